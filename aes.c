@@ -728,8 +728,8 @@ static const u32 rcon[] = {
 /**
  * Expand the cipher key into the encryption key schedule.
  */
-int AES_set_encrypt_key(const unsigned char *userKey, const int bits,
-			AES_KEY *key) {
+static int aes_expand_key(const unsigned char *userKey, const int bits,
+			  AES_KEY *key) {
 
 	u32 *rk;
    	int i = 0;
@@ -826,6 +826,26 @@ int AES_set_encrypt_key(const unsigned char *userKey, const int bits,
 	return 0;
 }
 
+/* the AES-NI instructions take the round keys in memory order */
+static void aes_key_to_bytes(AES_KEY *key)
+{
+    int i;
+
+    for (i = 0; i < 4 * (key->rounds + 1); i++) {
+        PUTU32(key->ni_rd_key + 4 * i, key->rd_key[i]);
+    }
+}
+
+int AES_set_encrypt_key(const unsigned char *userKey, const int bits,
+			AES_KEY *key) {
+	int status;
+
+	status = aes_expand_key(userKey, bits, key);
+	if (status == 0)
+		aes_key_to_bytes(key);
+	return status;
+}
+
 /**
  * Expand the cipher key into the decryption key schedule.
  */
@@ -874,9 +894,200 @@ int AES_set_decrypt_key(const unsigned char *userKey, const int bits,
 			Td2[Te4[(rk[3] >>  8) & 0xff] & 0xff] ^
 			Td3[Te4[(rk[3]      ) & 0xff] & 0xff];
 	}
+	aes_key_to_bytes(key);
 	return 0;
 }
 
+#ifdef CONFIG_AESNI_OPT
+#pragma GCC push_options
+#pragma GCC target("aes,sse2")
+#include <cpuid.h>
+#include <wmmintrin.h>
+
+static bool aes_ni;
+
+static void __attribute__((constructor)) init_aes_ni(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        aes_ni = (ecx & bit_AES) != 0;
+    }
+}
+
+static inline __m128i aes_ni_round_key(const AES_KEY *key, int i)
+{
+    return _mm_loadu_si128((const __m128i *)key->ni_rd_key + i);
+}
+
+static void aes_ni_encrypt(const unsigned char *in, unsigned char *out,
+                           const AES_KEY *key)
+{
+    __m128i b = _mm_loadu_si128((const __m128i *)in);
+    int r;
+
+    b = _mm_xor_si128(b, aes_ni_round_key(key, 0));
+    for (r = 1; r < key->rounds; r++) {
+        b = _mm_aesenc_si128(b, aes_ni_round_key(key, r));
+    }
+    b = _mm_aesenclast_si128(b, aes_ni_round_key(key, key->rounds));
+    _mm_storeu_si128((__m128i *)out, b);
+}
+
+static void aes_ni_decrypt(const unsigned char *in, unsigned char *out,
+                           const AES_KEY *key)
+{
+    __m128i b = _mm_loadu_si128((const __m128i *)in);
+    int r;
+
+    b = _mm_xor_si128(b, aes_ni_round_key(key, 0));
+    for (r = 1; r < key->rounds; r++) {
+        b = _mm_aesdec_si128(b, aes_ni_round_key(key, r));
+    }
+    b = _mm_aesdeclast_si128(b, aes_ni_round_key(key, key->rounds));
+    _mm_storeu_si128((__m128i *)out, b);
+}
+
+/*
+ * Run four blocks through the cipher at once.  The instructions are
+ * pipelined, so this costs little more than a single block.
+ */
+static inline void aes_ni_crypt4(__m128i *b, const AES_KEY *key, int enc)
+{
+    __m128i k = aes_ni_round_key(key, 0);
+    int r;
+
+    b[0] = _mm_xor_si128(b[0], k);
+    b[1] = _mm_xor_si128(b[1], k);
+    b[2] = _mm_xor_si128(b[2], k);
+    b[3] = _mm_xor_si128(b[3], k);
+    for (r = 1; r < key->rounds; r++) {
+        k = aes_ni_round_key(key, r);
+        if (enc) {
+            b[0] = _mm_aesenc_si128(b[0], k);
+            b[1] = _mm_aesenc_si128(b[1], k);
+            b[2] = _mm_aesenc_si128(b[2], k);
+            b[3] = _mm_aesenc_si128(b[3], k);
+        } else {
+            b[0] = _mm_aesdec_si128(b[0], k);
+            b[1] = _mm_aesdec_si128(b[1], k);
+            b[2] = _mm_aesdec_si128(b[2], k);
+            b[3] = _mm_aesdec_si128(b[3], k);
+        }
+    }
+    k = aes_ni_round_key(key, key->rounds);
+    if (enc) {
+        b[0] = _mm_aesenclast_si128(b[0], k);
+        b[1] = _mm_aesenclast_si128(b[1], k);
+        b[2] = _mm_aesenclast_si128(b[2], k);
+        b[3] = _mm_aesenclast_si128(b[3], k);
+    } else {
+        b[0] = _mm_aesdeclast_si128(b[0], k);
+        b[1] = _mm_aesdeclast_si128(b[1], k);
+        b[2] = _mm_aesdeclast_si128(b[2], k);
+        b[3] = _mm_aesdeclast_si128(b[3], k);
+    }
+}
+
+/* @length is a multiple of AES_BLOCK_SIZE; @in and @out may be the same */
+static void aes_ni_cbc_encrypt(const unsigned char *in, unsigned char *out,
+                               unsigned long length, const AES_KEY *key,
+                               unsigned char *ivec, int enc)
+{
+    const __m128i *src = (const __m128i *)in;
+    __m128i *dst = (__m128i *)out;
+    __m128i iv = _mm_loadu_si128((__m128i *)ivec);
+    __m128i b[4], c[4];
+    unsigned long n = length / AES_BLOCK_SIZE;
+    int i, r;
+
+    if (enc) {
+        /* each block depends on the previous one */
+        for (; n; n--, src++, dst++) {
+            iv = _mm_xor_si128(_mm_loadu_si128(src), iv);
+            iv = _mm_xor_si128(iv, aes_ni_round_key(key, 0));
+            for (r = 1; r < key->rounds; r++) {
+                iv = _mm_aesenc_si128(iv, aes_ni_round_key(key, r));
+            }
+            iv = _mm_aesenclast_si128(iv, aes_ni_round_key(key, key->rounds));
+            _mm_storeu_si128(dst, iv);
+        }
+    } else {
+        for (; n >= 4; n -= 4, src += 4, dst += 4) {
+            for (i = 0; i < 4; i++) {
+                b[i] = c[i] = _mm_loadu_si128(src + i);
+            }
+            aes_ni_crypt4(b, key, 0);
+            _mm_storeu_si128(dst, _mm_xor_si128(b[0], iv));
+            for (i = 1; i < 4; i++) {
+                _mm_storeu_si128(dst + i, _mm_xor_si128(b[i], c[i - 1]));
+            }
+            iv = c[3];
+        }
+        for (; n; n--, src++, dst++) {
+            c[0] = _mm_loadu_si128(src);
+            aes_ni_decrypt((const unsigned char *)src, (unsigned char *)dst,
+                           key);
+            _mm_storeu_si128(dst, _mm_xor_si128(_mm_loadu_si128(dst), iv));
+            iv = c[0];
+        }
+    }
+    _mm_storeu_si128((__m128i *)ivec, iv);
+}
+
+/* multiply the tweak by alpha in GF(2^128), see xts_mul_alpha */
+static inline __m128i aes_ni_xts_mul_alpha(__m128i t)
+{
+    /* the top bits of both halves, swapped, as all-ones masks */
+    __m128i carry = _mm_srai_epi32(_mm_shuffle_epi32(t, 0x5f), 31);
+
+    carry = _mm_and_si128(carry, _mm_set_epi32(0, 1, 0, 0x87));
+    return _mm_xor_si128(_mm_slli_epi64(t, 1), carry);
+}
+
+static void aes_ni_xts_encrypt(const unsigned char *in, unsigned char *out,
+                               unsigned long length, const AES_KEY *key,
+                               const AES_KEY *tweak_key,
+                               const unsigned char *iv, int enc)
+{
+    const __m128i *src = (const __m128i *)in;
+    __m128i *dst = (__m128i *)out;
+    unsigned char tweak[AES_BLOCK_SIZE];
+    __m128i t[4], b[4];
+    unsigned long n = length / AES_BLOCK_SIZE;
+    int i;
+
+    aes_ni_encrypt(iv, tweak, tweak_key);
+    t[0] = _mm_loadu_si128((__m128i *)tweak);
+
+    for (; n >= 4; n -= 4, src += 4, dst += 4) {
+        for (i = 0; i < 4; i++) {
+            if (i) {
+                t[i] = aes_ni_xts_mul_alpha(t[i - 1]);
+            }
+            b[i] = _mm_xor_si128(_mm_loadu_si128(src + i), t[i]);
+        }
+        aes_ni_crypt4(b, key, enc);
+        for (i = 0; i < 4; i++) {
+            _mm_storeu_si128(dst + i, _mm_xor_si128(b[i], t[i]));
+        }
+        t[0] = aes_ni_xts_mul_alpha(t[3]);
+    }
+    for (; n; n--, src++, dst++) {
+        b[0] = _mm_xor_si128(_mm_loadu_si128(src), t[0]);
+        _mm_storeu_si128(dst, b[0]);
+        if (enc) {
+            aes_ni_encrypt((unsigned char *)dst, (unsigned char *)dst, key);
+        } else {
+            aes_ni_decrypt((unsigned char *)dst, (unsigned char *)dst, key);
+        }
+        _mm_storeu_si128(dst, _mm_xor_si128(_mm_loadu_si128(dst), t[0]));
+        t[0] = aes_ni_xts_mul_alpha(t[0]);
+    }
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AESNI_OPT */
+
 #ifndef AES_ASM
 /*
  * Encrypt a single block
@@ -892,6 +1103,12 @@ void AES_encrypt(const unsigned char *in, unsigned char *out,
 #endif /* ?FULL_UNROLL */
 
 	assert(in && out && key);
+#ifdef CONFIG_AESNI_OPT
+	if (aes_ni) {
+		aes_ni_encrypt(in, out, key);
+		return;
+	}
+#endif
 	rk = key->rd_key;
 
 	/*
@@ -1083,6 +1300,12 @@ void AES_decrypt(const unsigned char *in, unsigned char *out,
 #endif /* ?FULL_UNROLL */
 
 	assert(in && out && key);
+#ifdef CONFIG_AESNI_OPT
+	if (aes_ni) {
+		aes_ni_decrypt(in, out, key);
+		return;
+	}
+#endif
 	rk = key->rd_key;
 
 	/*
@@ -1273,6 +1496,13 @@ void AES_cbc_encrypt(const unsigned char *in, unsigned char *out,
 
 	assert(in && out && key && ivec);
 
+#ifdef CONFIG_AESNI_OPT
+	if (aes_ni && length % AES_BLOCK_SIZE == 0) {
+		aes_ni_cbc_encrypt(in, out, length, key, ivec, enc);
+		return;
+	}
+#endif
+
 	if (enc) {
 		while (len >= AES_BLOCK_SIZE) {
 			for(n=0; n < AES_BLOCK_SIZE; ++n)
@@ -1312,3 +1542,69 @@ void AES_cbc_encrypt(const unsigned char *in, unsigned char *out,
 		}
 	}
 }
+
+/*
+ * Multiply the tweak by alpha, the primitive element of GF(2^128) with
+ * the byte order of IEEE P1619: a shift left by one bit of the little
+ * endian 128-bit number, folding the carry back in as x^7 + x^2 + x + 1.
+ */
+static void xts_mul_alpha(unsigned char *t)
+{
+    unsigned char carry = 0, c;
+    int n;
+
+    for (n = 0; n < AES_BLOCK_SIZE; n++) {
+        c = t[n] >> 7;
+        t[n] = (t[n] << 1) | carry;
+        carry = c;
+    }
+    if (carry) {
+        t[0] ^= 0x87;
+    }
+}
+
+/*
+ * XTS-AES (IEEE P1619) over one data unit of @length bytes, a multiple of
+ * AES_BLOCK_SIZE.  @key is the encryption or the decryption schedule of
+ * the data key, according to @enc; @tweak_key is always an encryption
+ * schedule, and @iv the data unit number as the tweak wants it.
+ * @in and @out may be the same buffer.
+ */
+void AES_xts_encrypt(const unsigned char *in, unsigned char *out,
+                     const unsigned long length, const AES_KEY *key,
+                     const AES_KEY *tweak_key, const unsigned char *iv,
+                     const int enc)
+{
+    unsigned long len = length;
+    unsigned char t[AES_BLOCK_SIZE], tmp[AES_BLOCK_SIZE];
+    int n;
+
+    assert(in && out && key && tweak_key && iv);
+    assert(length % AES_BLOCK_SIZE == 0);
+
+#ifdef CONFIG_AESNI_OPT
+    if (aes_ni) {
+        aes_ni_xts_encrypt(in, out, length, key, tweak_key, iv, enc);
+        return;
+    }
+#endif
+
+    AES_encrypt(iv, t, tweak_key);
+    while (len >= AES_BLOCK_SIZE) {
+        for (n = 0; n < AES_BLOCK_SIZE; n++) {
+            tmp[n] = in[n] ^ t[n];
+        }
+        if (enc) {
+            AES_encrypt(tmp, tmp, key);
+        } else {
+            AES_decrypt(tmp, tmp, key);
+        }
+        for (n = 0; n < AES_BLOCK_SIZE; n++) {
+            out[n] = tmp[n] ^ t[n];
+        }
+        xts_mul_alpha(t);
+        len -= AES_BLOCK_SIZE;
+        in += AES_BLOCK_SIZE;
+        out += AES_BLOCK_SIZE;
+    }
+}
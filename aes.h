@@ -6,6 +6,7 @@
 
 struct aes_key_st {
     uint32_t rd_key[4 *(AES_MAXNR + 1)];
+    uint8_t ni_rd_key[16 * (AES_MAXNR + 1)];    /* rd_key in memory order */
     int rounds;
 };
 typedef struct aes_key_st AES_KEY;
@@ -22,5 +23,9 @@ void AES_decrypt(const unsigned char *in, unsigned char *out,
 void AES_cbc_encrypt(const unsigned char *in, unsigned char *out,
 		     const unsigned long length, const AES_KEY *key,
 		     unsigned char *ivec, const int enc);
+void AES_xts_encrypt(const unsigned char *in, unsigned char *out,
+                     const unsigned long length, const AES_KEY *key,
+                     const AES_KEY *tweak_key, const unsigned char *iv,
+                     const int enc);
 
 #endif
@@ -18,17 +18,6 @@
 #include "qemu-queue.h"
 #include "qemu_socket.h"
 
-typedef struct AioHandler AioHandler;
-
-/* The list of registered AIO handlers */
-static QLIST_HEAD(, AioHandler) aio_handlers;
-
-/* This is a simple lock used to protect the aio_handlers list.  Specifically,
- * it's used to ensure that no callbacks are removed while we're walking and
- * dispatching callbacks.
- */
-static int walking_handlers;
-
 struct AioHandler
 {
     int fd;
@@ -40,11 +29,11 @@ struct AioHandler
     QLIST_ENTRY(AioHandler) node;
 };
 
-static AioHandler *find_aio_handler(int fd)
+static AioHandler *find_aio_handler(AioContext *ctx, int fd)
 {
     AioHandler *node;
 
-    QLIST_FOREACH(node, &aio_handlers, node) {
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
         if (node->fd == fd)
             if (!node->deleted)
                 return node;
@@ -53,21 +42,21 @@ static AioHandler *find_aio_handler(int fd)
     return NULL;
 }
 
-int qemu_aio_set_fd_handler(int fd,
-                            IOHandler *io_read,
-                            IOHandler *io_write,
-                            AioFlushHandler *io_flush,
-                            void *opaque)
+void aio_set_fd_handler(AioContext *ctx, int fd,
+                        IOHandler *io_read,
+                        IOHandler *io_write,
+                        AioFlushHandler *io_flush,
+                        void *opaque)
 {
     AioHandler *node;
 
-    node = find_aio_handler(fd);
+    node = find_aio_handler(ctx, fd);
 
     /* Are we deleting the fd handler? */
     if (!io_read && !io_write) {
         if (node) {
             /* If the lock is held, just mark the node as deleted */
-            if (walking_handlers)
+            if (ctx->walking_handlers)
                 node->deleted = 1;
             else {
                 /* Otherwise, delete it for real.  We can't just mark it as
@@ -83,7 +72,7 @@ int qemu_aio_set_fd_handler(int fd,
             /* Alloc and insert if it's not already there */
             node = g_malloc0(sizeof(AioHandler));
             node->fd = fd;
-            QLIST_INSERT_HEAD(&aio_handlers, node, node);
+            QLIST_INSERT_HEAD(&ctx->aio_handlers, node, node);
         }
         /* Update handler with latest information */
         node->io_read = io_read;
@@ -92,41 +81,97 @@ int qemu_aio_set_fd_handler(int fd,
         node->opaque = opaque;
     }
 
-    qemu_set_fd_handler2(fd, NULL, io_read, io_write, opaque);
+    if (ctx == qemu_get_aio_context()) {
+        /* The main loop dispatches the handlers of its context too */
+        qemu_set_fd_handler2(fd, NULL, io_read, io_write, opaque);
+    } else {
+        aio_notify(ctx);
+    }
+}
 
+int qemu_aio_set_fd_handler(int fd,
+                            IOHandler *io_read,
+                            IOHandler *io_write,
+                            AioFlushHandler *io_flush,
+                            void *opaque)
+{
+    aio_set_fd_handler(qemu_get_aio_context(), fd, io_read, io_write,
+                       io_flush, opaque);
     return 0;
 }
 
+bool aio_pending(AioContext *ctx)
+{
+    AioHandler *node;
+    bool busy = false;
+
+    if (aio_bh_pending(ctx)) {
+        return true;
+    }
+
+    ctx->walking_handlers++;
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (!node->deleted && node->io_flush &&
+            node->io_flush(node->opaque)) {
+            busy = true;
+            break;
+        }
+    }
+    ctx->walking_handlers--;
+
+    return busy;
+}
+
+void aio_flush(AioContext *ctx)
+{
+    while (aio_pending(ctx)) {
+        aio_poll(ctx, true);
+    }
+}
+
 void qemu_aio_flush(void)
 {
-    while (qemu_aio_wait());
+    aio_flush(qemu_get_aio_context());
 }
 
 bool qemu_aio_wait(void)
+{
+    return aio_poll(qemu_get_aio_context(), true);
+}
+
+bool aio_poll(AioContext *ctx, bool blocking)
 {
     AioHandler *node;
     fd_set rdfds, wrfds;
+    struct timeval tv, *tvp;
+    int64_t deadline;
     int max_fd = -1;
     int ret;
-    bool busy;
+    bool busy, progress;
+
+    progress = false;
 
     /*
      * If there are callbacks left that have been queued, we need to call then.
      * Do not call select in this case, because it is possible that the caller
      * does not need a complete flush (as is the case for qemu_aio_wait loops).
      */
-    if (qemu_bh_poll()) {
+    if (aio_bh_poll(ctx)) {
         return true;
     }
+    if (aio_timers_run(ctx)) {
+        blocking = false;
+        progress = true;
+    }
 
-    walking_handlers = 1;
+    ctx->walking_handlers++;
 
     FD_ZERO(&rdfds);
     FD_ZERO(&wrfds);
 
     /* fill fd sets */
     busy = false;
-    QLIST_FOREACH(node, &aio_handlers, node) {
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
         /* If there aren't pending AIO operations, don't invoke callbacks.
          * Otherwise, if there are no AIO requests, qemu_aio_wait() would
          * wait indefinitely.
@@ -147,23 +192,36 @@ bool qemu_aio_wait(void)
         }
     }
 
-    walking_handlers = 0;
+    ctx->walking_handlers--;
 
-    /* No AIO operations?  Get us out of here */
-    if (!busy) {
-        return false;
+    /* Nothing to wait for?  Get us out of here */
+    deadline = aio_timers_deadline(ctx);
+    if (!busy && deadline < 0 && ctx->notify_fds[0] < 0) {
+        return progress;
     }
 
     /* wait until next event */
-    ret = select(max_fd, &rdfds, &wrfds, NULL, NULL);
+    if (!blocking) {
+        deadline = 0;
+    }
+    if (deadline >= 0) {
+        int64_t us = (deadline + 999) / 1000;
+
+        tv.tv_sec = us / 1000000;
+        tv.tv_usec = us % 1000000;
+        tvp = &tv;
+    } else {
+        tvp = NULL;
+    }
+    ret = select(max_fd, &rdfds, &wrfds, NULL, tvp);
 
     /* if we have any readable fds, dispatch event */
     if (ret > 0) {
-        walking_handlers = 1;
+        ctx->walking_handlers++;
 
         /* we have to walk very carefully in case
          * qemu_aio_set_fd_handler is called while we're walking */
-        node = QLIST_FIRST(&aio_handlers);
+        node = QLIST_FIRST(&ctx->aio_handlers);
         while (node) {
             AioHandler *tmp;
 
@@ -171,24 +229,37 @@ bool qemu_aio_wait(void)
                 FD_ISSET(node->fd, &rdfds) &&
                 node->io_read) {
                 node->io_read(node->opaque);
+                /* being woken up by aio_notify() is not progress */
+                if (node->fd != ctx->notify_fds[0]) {
+                    progress = true;
+                }
             }
             if (!node->deleted &&
                 FD_ISSET(node->fd, &wrfds) &&
                 node->io_write) {
                 node->io_write(node->opaque);
+                progress = true;
             }
 
             tmp = node;
             node = QLIST_NEXT(node, node);
 
-            if (tmp->deleted) {
+            ctx->walking_handlers--;
+
+            if (!ctx->walking_handlers && tmp->deleted) {
                 QLIST_REMOVE(tmp, node);
                 g_free(tmp);
             }
+
+            ctx->walking_handlers++;
         }
 
-        walking_handlers = 0;
+        ctx->walking_handlers--;
+    }
+
+    if (aio_timers_run(ctx)) {
+        progress = true;
     }
 
-    return true;
+    return progress || busy;
 }
@@ -27,6 +27,7 @@
 #ifndef _WIN32
 #include <sys/types.h>
 #include <sys/mman.h>
+#include <sys/file.h>
 #endif
 #include "config.h"
 #include "monitor.h"
@@ -44,7 +45,13 @@
 #include "exec-memory.h"
 #include "hw/pcspk.h"
 #include "qemu/page_cache.h"
+#include "qemu_socket.h"
 #include "qmp-commands.h"
+#include "qemu-thread.h"
+#include "cpus.h"
+#include "balloon.h"
+#include "bitmap.h"
+#include <zlib.h>
 
 #ifdef DEBUG_ARCH_INIT
 #define DPRINTF(fmt, ...) \
@@ -102,13 +109,22 @@ const uint32_t arch_type = QEMU_ARCH;
 /***********************************************************/
 /* ram save/restore */
 
-#define RAM_SAVE_FLAG_FULL     0x01 /* Obsolete, not used anymore */
+/* 0x01 was RAM_SAVE_FLAG_FULL, which nothing has sent for a long time */
+#define RAM_SAVE_FLAG_HASH     0x01
 #define RAM_SAVE_FLAG_COMPRESS 0x02
 #define RAM_SAVE_FLAG_MEM_SIZE 0x04
 #define RAM_SAVE_FLAG_PAGE     0x08
 #define RAM_SAVE_FLAG_EOS      0x10
 #define RAM_SAVE_FLAG_CONTINUE 0x20
 #define RAM_SAVE_FLAG_XBZRLE   0x40
+#define RAM_SAVE_FLAG_ZERO_RANGE 0x80
+#define RAM_SAVE_FLAG_COMPRESS_PAGE 0x100
+/* followed by a be32: a non-zero count announces that many parallel
+ * channels, 0 means that every channel has been drained */
+#define RAM_SAVE_FLAG_CHANNELS 0x200
+/* asks the destination to answer for every RAM_SAVE_FLAG_HASH so far;
+ * 1K page targets leave no room for a flag of its own */
+#define RAM_SAVE_FLAG_HASH_SYNC (RAM_SAVE_FLAG_HASH | RAM_SAVE_FLAG_COMPRESS_PAGE)
 
 #ifdef __ALTIVEC__
 #include <altivec.h>
@@ -167,6 +183,11 @@ static int is_dup_page(uint8_t *page)
     VECTYPE val = SPLAT(page);
     int i;
 
+    /* zero pages are by far the most common, check them the fast way */
+    if (*page == 0) {
+        return buffer_is_zero(page, TARGET_PAGE_SIZE);
+    }
+
     for (i = 0; i < TARGET_PAGE_SIZE / sizeof(VECTYPE); i++) {
         if (!ALL_EQ(val, p[i])) {
             return 0;
@@ -183,25 +204,27 @@ static struct {
     uint8_t *encoded_buf;
     /* buffer for storing page content */
     uint8_t *current_buf;
-    /* buffer used for XBZRLE decoding */
-    uint8_t *decoded_buf;
     /* Cache for XBZRLE */
     PageCache *cache;
 } XBZRLE = {
     .encoded_buf = NULL,
     .current_buf = NULL,
-    .decoded_buf = NULL,
     .cache = NULL,
 };
 
 
 int64_t xbzrle_cache_resize(int64_t new_size)
 {
+    int64_t ret = pow2floor(new_size);
+
+    /* the migration thread uses the cache with only the ramlist lock held */
+    qemu_mutex_lock_ramlist();
     if (XBZRLE.cache != NULL) {
-        return cache_resize(XBZRLE.cache, new_size / TARGET_PAGE_SIZE) *
+        ret = cache_resize(XBZRLE.cache, new_size / TARGET_PAGE_SIZE) *
             TARGET_PAGE_SIZE;
     }
-    return pow2floor(new_size);
+    qemu_mutex_unlock_ramlist();
+    return ret;
 }
 
 /* accounting for migration statistics */
@@ -211,8 +234,13 @@ typedef struct AccountingInfo {
     uint64_t iterations;
     uint64_t xbzrle_bytes;
     uint64_t xbzrle_pages;
+    uint64_t xbzrle_cache_hit;
     uint64_t xbzrle_cache_miss;
     uint64_t xbzrle_overflows;
+    uint64_t compress_pages;
+    uint64_t compress_bytes;
+    uint64_t dedup_pages;
+    uint64_t dedup_resent;
 } AccountingInfo;
 
 static AccountingInfo acct_info;
@@ -252,6 +280,11 @@ uint64_t xbzrle_mig_pages_transferred(void)
     return acct_info.xbzrle_pages;
 }
 
+uint64_t xbzrle_mig_pages_cache_hit(void)
+{
+    return acct_info.xbzrle_cache_hit;
+}
+
 uint64_t xbzrle_mig_pages_cache_miss(void)
 {
     return acct_info.xbzrle_cache_miss;
@@ -262,24 +295,328 @@ uint64_t xbzrle_mig_pages_overflow(void)
     return acct_info.xbzrle_overflows;
 }
 
-static void save_block_hdr(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
-        int cont, int flag)
+uint64_t compress_mig_pages_transferred(void)
+{
+    return acct_info.compress_pages;
+}
+
+uint64_t compress_mig_bytes_transferred(void)
+{
+    return acct_info.compress_bytes;
+}
+
+uint64_t dedup_mig_pages_transferred(void)
+{
+    return acct_info.dedup_pages;
+}
+
+uint64_t dedup_mig_pages_resent(void)
+{
+    return acct_info.dedup_resent;
+}
+
+/*
+ * Parallel channels.  RAM pages are spread over the channels in chunks of
+ * RAM_CHANNEL_CHUNK_BITS of ram_addr_t space: a page always goes through
+ * the same channel, so the updates to a page reach the destination in
+ * order even though the channels are not synchronized with each other.
+ * Channel 0 is the main migration stream; without extra channels it is
+ * the only one.
+ */
+#define RAM_CHANNEL_CHUNK_BITS 21
+
+typedef struct RAMChannel {
+    QEMUFile *f;
+    /* block of the last page header put on this stream; the destination
+     * resolves RAM_SAVE_FLAG_CONTINUE against it */
+    RAMBlock *last_sent_block;
+} RAMChannel;
+
+static RAMChannel ram_channels[MAX_MIGRATE_CHANNELS];
+static int ram_channel_count;
+
+static RAMChannel *ram_channel_for(RAMBlock *block, ram_addr_t offset)
+{
+    ram_addr_t chunk = (block->offset + offset) >> RAM_CHANNEL_CHUNK_BITS;
+
+    return &ram_channels[chunk % ram_channel_count];
+}
+
+/* Offset in @block past the last page of the chunk @offset is in */
+static ram_addr_t ram_channel_chunk_end(RAMBlock *block, ram_addr_t offset)
+{
+    ram_addr_t end;
+
+    if (ram_channel_count == 1) {
+        return block->length;
+    }
+    end = ((block->offset + offset) | ((1 << RAM_CHANNEL_CHUNK_BITS) - 1)) + 1;
+    return MIN(end - block->offset, block->length);
+}
+
+/* Pages written straight into the destination's memory by the transport
+ * (RDMA) overtake anything still sitting in the stream buffer.  Page
+ * records go out before the next such write, so that e.g. an old zero
+ * page record cannot land on top of newer data.
+ */
+static bool ram_writes;
+static bool ram_stream_pending;
+
+static int save_block_hdr(RAMChannel *c, RAMBlock *block, ram_addr_t offset,
+                          int flag)
+{
+    int cont = (block == c->last_sent_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
+    int len = 8;
+
+    ram_stream_pending = true;
+    qemu_put_be64(c->f, offset | cont | flag);
+    if (!cont) {
+        qemu_put_byte(c->f, strlen(block->idstr));
+        qemu_put_buffer(c->f, (uint8_t *)block->idstr,
+                        strlen(block->idstr));
+        len += 1 + strlen(block->idstr);
+        c->last_sent_block = block;
+    }
+    return len;
+}
+
+static int ram_write_page(RAMChannel *c, uint8_t *p)
+{
+    if (ram_stream_pending) {
+        qemu_fflush(c->f);
+        ram_stream_pending = false;
+    }
+    return migrate_write_ram(p, TARGET_PAGE_SIZE);
+}
+
+/* Multi-threaded page compression.
+ *
+ * The migration thread keeps scanning the dirty bitmap and detecting
+ * duplicate pages itself; every page that would otherwise go out in full
+ * is copied to an idle worker, which deflates it while the scan goes on.
+ * Finished pages are put on the stream by the migration thread the next
+ * time it looks for an idle worker, so the QEMUFile is never touched from
+ * the workers.  Compressed pages of different addresses may go out in any
+ * order, but a page still in flight is flushed before a newer record for
+ * it, and all of them are flushed when the scan wraps.
+ */
+typedef struct CompressParam {
+    QemuThread thread;
+    /* protected by comp_pool.lock */
+    bool busy;          /* a page was handed to this worker */
+    bool done;          /* the page is compressed and waiting to be sent */
+    RAMBlock *block;
+    ram_addr_t offset;
+    /* owned by the worker while busy && !done */
+    uint8_t *in;
+    uint8_t *out;
+    unsigned long out_len;
+    int ret;
+} CompressParam;
+
+static struct {
+    CompressParam *params;
+    int count;
+    int level;
+    bool quit;
+    QemuMutex lock;
+    QemuCond work_cond;
+    QemuCond done_cond;
+} comp_pool;
+
+static void *do_compress_thread(void *opaque)
+{
+    CompressParam *param = opaque;
+
+    qemu_mutex_lock(&comp_pool.lock);
+    while (!comp_pool.quit) {
+        if (param->busy && !param->done) {
+            qemu_mutex_unlock(&comp_pool.lock);
+            param->out_len = compressBound(TARGET_PAGE_SIZE);
+            param->ret = compress2(param->out, &param->out_len, param->in,
+                                   TARGET_PAGE_SIZE, comp_pool.level);
+            qemu_mutex_lock(&comp_pool.lock);
+            param->done = true;
+            qemu_cond_broadcast(&comp_pool.done_cond);
+        } else {
+            qemu_cond_wait(&comp_pool.work_cond, &comp_pool.lock);
+        }
+    }
+    qemu_mutex_unlock(&comp_pool.lock);
+
+    return NULL;
+}
+
+static void compress_threads_init(void)
+{
+    int i;
+
+    comp_pool.count = migrate_compress_threads();
+    comp_pool.level = migrate_compress_level();
+    comp_pool.quit = false;
+    comp_pool.params = g_new0(CompressParam, comp_pool.count);
+    qemu_mutex_init(&comp_pool.lock);
+    qemu_cond_init(&comp_pool.work_cond);
+    qemu_cond_init(&comp_pool.done_cond);
+
+    for (i = 0; i < comp_pool.count; i++) {
+        CompressParam *param = &comp_pool.params[i];
+
+        param->in = g_malloc(TARGET_PAGE_SIZE);
+        param->out = g_malloc(compressBound(TARGET_PAGE_SIZE));
+        qemu_thread_create(&param->thread, do_compress_thread, param,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void compress_threads_fini(void)
+{
+    int i;
+
+    if (!comp_pool.params) {
+        return;
+    }
+
+    qemu_mutex_lock(&comp_pool.lock);
+    comp_pool.quit = true;
+    qemu_cond_broadcast(&comp_pool.work_cond);
+    qemu_mutex_unlock(&comp_pool.lock);
+
+    for (i = 0; i < comp_pool.count; i++) {
+        qemu_thread_join(&comp_pool.params[i].thread);
+        g_free(comp_pool.params[i].in);
+        g_free(comp_pool.params[i].out);
+    }
+    qemu_cond_destroy(&comp_pool.done_cond);
+    qemu_cond_destroy(&comp_pool.work_cond);
+    qemu_mutex_destroy(&comp_pool.lock);
+    g_free(comp_pool.params);
+    comp_pool.params = NULL;
+}
+
+/* Called with comp_lock held; puts a finished page on the stream */
+static int flush_compressed_page(RAMChannel *c, CompressParam *param)
+{
+    QEMUFile *f = c->f;
+    int bytes_sent;
+
+    param->busy = false;
+    param->done = false;
+
+    if (param->ret != Z_OK) {
+        /* deflate can't fail on a bounded buffer, but play safe */
+        qemu_file_set_error(f, -EIO);
+        return 0;
+    }
+
+    bytes_sent = save_block_hdr(c, param->block, param->offset,
+                                RAM_SAVE_FLAG_COMPRESS_PAGE);
+    qemu_put_be32(f, param->out_len);
+    qemu_put_buffer(f, param->out, param->out_len);
+    bytes_sent += 4 + param->out_len;
+    acct_info.compress_pages++;
+    acct_info.compress_bytes += bytes_sent;
+
+    return bytes_sent;
+}
+
+/* Hand one page to an idle worker.  Returns the number of bytes that were
+ * put on the stream to make a worker available. */
+static int compress_page_with_threads(RAMChannel *c, RAMBlock *block,
+                                      ram_addr_t offset, uint8_t *p)
+{
+    CompressParam *param = NULL;
+    int bytes_sent = 0;
+    int i;
+
+    qemu_mutex_lock(&comp_pool.lock);
+    while (!param) {
+        for (i = 0; i < comp_pool.count; i++) {
+            CompressParam *cur = &comp_pool.params[i];
+
+            if (cur->done) {
+                bytes_sent += flush_compressed_page(c, cur);
+            }
+            if (!cur->busy) {
+                param = cur;
+                break;
+            }
+        }
+        if (!param) {
+            qemu_cond_wait(&comp_pool.done_cond, &comp_pool.lock);
+        }
+    }
+
+    /* copy the page so the guest can keep dirtying it while we deflate */
+    memcpy(param->in, p, TARGET_PAGE_SIZE);
+    param->block = block;
+    param->offset = offset;
+    param->busy = true;
+    qemu_cond_broadcast(&comp_pool.work_cond);
+    qemu_mutex_unlock(&comp_pool.lock);
+
+    return bytes_sent;
+}
+
+/* Wait for every in-flight page and put it on the stream */
+static int flush_compressed_data(RAMChannel *c)
 {
-        qemu_put_be64(f, offset | cont | flag);
-        if (!cont) {
-                qemu_put_byte(f, strlen(block->idstr));
-                qemu_put_buffer(f, (uint8_t *)block->idstr,
-                                strlen(block->idstr));
+    int bytes_sent = 0;
+    int i;
+
+    if (!comp_pool.params) {
+        return 0;
+    }
+
+    qemu_mutex_lock(&comp_pool.lock);
+    for (i = 0; i < comp_pool.count; i++) {
+        CompressParam *param = &comp_pool.params[i];
+
+        while (param->busy && !param->done) {
+            qemu_cond_wait(&comp_pool.done_cond, &comp_pool.lock);
+        }
+        if (param->done) {
+            bytes_sent += flush_compressed_page(c, param);
+        }
+    }
+    qemu_mutex_unlock(&comp_pool.lock);
+
+    return bytes_sent;
+}
+
+/* Put the in-flight pages of @block between @offset and @offset + @len on
+ * the stream, so that a newer record of those pages is not overtaken */
+static int flush_compressed_range(RAMChannel *c, RAMBlock *block,
+                                  ram_addr_t offset, ram_addr_t len)
+{
+    int bytes_sent = 0;
+    int i;
+
+    qemu_mutex_lock(&comp_pool.lock);
+    for (i = 0; i < comp_pool.count; i++) {
+        CompressParam *param = &comp_pool.params[i];
+
+        if (!param->busy || param->block != block ||
+            param->offset - offset >= len) {
+            continue;
         }
+        while (!param->done) {
+            qemu_cond_wait(&comp_pool.done_cond, &comp_pool.lock);
+        }
+        bytes_sent += flush_compressed_page(c, param);
+    }
+    qemu_mutex_unlock(&comp_pool.lock);
 
+    return bytes_sent;
 }
 
 #define ENCODING_FLAG_XBZRLE 0x1
 
-static int save_xbzrle_page(QEMUFile *f, uint8_t *current_data,
+static int save_xbzrle_page(RAMChannel *c, uint8_t *current_data,
                             ram_addr_t current_addr, RAMBlock *block,
-                            ram_addr_t offset, int cont, bool last_stage)
+                            ram_addr_t offset, bool last_stage)
 {
+    QEMUFile *f = c->f;
     int encoded_len = 0, bytes_sent = -1;
     uint8_t *prev_cached_page;
 
@@ -292,6 +629,7 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t *current_data,
         return -1;
     }
 
+    acct_info.xbzrle_cache_hit++;
     prev_cached_page = get_cached_data(XBZRLE.cache, current_addr);
 
     /* save current buffer into memory */
@@ -318,19 +656,222 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t *current_data,
     }
 
     /* Send XBZRLE based compressed page */
-    save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_XBZRLE);
+    bytes_sent = save_block_hdr(c, block, offset, RAM_SAVE_FLAG_XBZRLE);
     qemu_put_byte(f, ENCODING_FLAG_XBZRLE);
     qemu_put_be16(f, encoded_len);
     qemu_put_buffer(f, XBZRLE.encoded_buf, encoded_len);
-    bytes_sent = encoded_len + 1 + 2;
+    bytes_sent += encoded_len + 1 + 2;
     acct_info.xbzrle_pages++;
     acct_info.xbzrle_bytes += bytes_sent;
 
     return bytes_sent;
 }
 
+/*
+ * Content-addressed pages, for the dedup capability.
+ *
+ * Instead of a page, the source sends its SHA-256 digest.  The destination
+ * looks it up among the pages it already has, copies the page if it finds
+ * it and otherwise answers on the return path of the connection with the
+ * be64 ram_addr_t of the page.  The source marks such pages dirty again and
+ * sends them in full the next time around.  The final RAM_SAVE_FLAG_HASH_SYNC
+ * makes the destination answer for all digests so far, followed by
+ * DEDUP_SYNC_REPLY, so that every missing page is known before the device
+ * state goes out.  SHA-256 rather than a cheaper hash because any guest
+ * can choose what its pages contain, and a collision would hand another
+ * guest's page to the destination.
+ */
+#define DEDUP_DIGEST_SIZE       32
+#define DEDUP_SYNC_REPLY        (~(uint64_t)0)
+/* requests the destination sends at once */
+#define DEDUP_REPLY_BATCH       512
+
+static struct {
+    bool active;
+    GChecksum *checksum;
+    /* pages the destination asked for, by ram_addr_t page number */
+    unsigned long *resend;
+    long nr_pages;
+    /* replies read from the return path, the last one may be partial */
+    uint8_t reply[DEDUP_REPLY_BATCH * 8];
+    int reply_len;
+} dedup_save;
+
+static void dedup_digest(GChecksum *checksum, const uint8_t *p,
+                         uint8_t *digest)
+{
+    gsize len = DEDUP_DIGEST_SIZE;
+
+    g_checksum_reset(checksum);
+    g_checksum_update(checksum, p, TARGET_PAGE_SIZE);
+    g_checksum_get_digest(checksum, digest, &len);
+}
+
+/* Pages are numbered by ram_addr_t, which the block offsets cover */
+static long ram_nr_pages(void)
+{
+    RAMBlock *block;
+    ram_addr_t end = 0;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        end = MAX(end, block->offset + block->length);
+    }
+    return end >> TARGET_PAGE_BITS;
+}
+
+static RAMBlock *ram_block_from_addr(ram_addr_t addr)
+{
+    RAMBlock *block;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        if (addr - block->offset < block->length) {
+            return block;
+        }
+    }
+    return NULL;
+}
+
+/* Called with the ramlist lock held */
+static void dedup_save_init(void)
+{
+    dedup_save.active = false;
+    if (!migrate_use_dedup()) {
+        return;
+    }
+    if (!migrate_has_return_path() || ram_channel_count > 1) {
+        DPRINTF("dedup needs a return path and a single channel\n");
+        return;
+    }
+    dedup_save.checksum = g_checksum_new(G_CHECKSUM_SHA256);
+    dedup_save.nr_pages = ram_nr_pages();
+    dedup_save.resend = bitmap_new(dedup_save.nr_pages);
+    dedup_save.reply_len = 0;
+    dedup_save.active = true;
+    acct_clear();
+}
+
+static void dedup_save_fini(void)
+{
+    if (!dedup_save.active) {
+        return;
+    }
+    g_checksum_free(dedup_save.checksum);
+    g_free(dedup_save.resend);
+    dedup_save.resend = NULL;
+    dedup_save.active = false;
+}
+
+static int save_hash_page(RAMChannel *c, RAMBlock *block, ram_addr_t offset,
+                          uint8_t *p)
+{
+    uint8_t digest[DEDUP_DIGEST_SIZE];
+    int bytes_sent;
+
+    dedup_digest(dedup_save.checksum, p, digest);
+    bytes_sent = save_block_hdr(c, block, offset, RAM_SAVE_FLAG_HASH);
+    qemu_put_buffer(c->f, digest, DEDUP_DIGEST_SIZE);
+    bytes_sent += DEDUP_DIGEST_SIZE;
+    acct_info.dedup_pages++;
+
+    return bytes_sent;
+}
+
+/* The destination lacks the page at @addr: send it in full */
+static int dedup_resend(ram_addr_t addr)
+{
+    RAMBlock *block = ram_block_from_addr(addr);
+
+    if (!block || (addr & ~TARGET_PAGE_MASK) ||
+        (addr >> TARGET_PAGE_BITS) >= dedup_save.nr_pages) {
+        fprintf(stderr, "dedup: bad page request %" PRIx64 "\n",
+                (uint64_t)addr);
+        return -EINVAL;
+    }
+    set_bit(addr >> TARGET_PAGE_BITS, dedup_save.resend);
+    memory_region_set_dirty(block->mr, addr - block->offset,
+                            TARGET_PAGE_SIZE);
+    acct_info.dedup_resent++;
+    return 0;
+}
+
+/* Takes in what the destination sent back, waiting for the answer to the
+ * sync if @wait.  Returns 1 once that came, 0 when nothing more is
+ * pending, or -errno. */
+static int dedup_read_replies(bool wait)
+{
+    int i, ret;
+
+    while (true) {
+        ret = migrate_read_return_path(dedup_save.reply + dedup_save.reply_len,
+                                       sizeof(dedup_save.reply) -
+                                       dedup_save.reply_len, wait);
+        if (ret <= 0) {
+            return ret;
+        }
+        dedup_save.reply_len += ret;
+
+        for (i = 0; i + 8 <= dedup_save.reply_len; i += 8) {
+            uint64_t addr = ldq_be_p(dedup_save.reply + i);
+
+            if (addr == DEDUP_SYNC_REPLY) {
+                /* nothing follows the answer to the sync */
+                dedup_save.reply_len = 0;
+                return 1;
+            }
+            ret = dedup_resend(addr);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+        memmove(dedup_save.reply, dedup_save.reply + i,
+                dedup_save.reply_len - i);
+        dedup_save.reply_len -= i;
+    }
+}
+
 static RAMBlock *last_block;
 static ram_addr_t last_offset;
+static uint32_t last_version;
+
+/* Longest run of zero pages sent as a single RAM_SAVE_FLAG_ZERO_RANGE */
+#define ZERO_RANGE_MAX_PAGES 65536
+
+/*
+ * Extend a run of zero pages that starts at @offset, whose dirty bit was
+ * already cleared, over the dirty zero pages that follow it in @block,
+ * up to @end.  Their dirty bits are cleared too.  Returns the length of
+ * the run, in pages.  *@stray is set when the page past the run had its
+ * bit cleared but was written to in the meantime; the caller has to send
+ * it.
+ */
+static int ram_zero_run(RAMBlock *block, ram_addr_t offset, ram_addr_t end,
+                        bool *stray)
+{
+    MemoryRegion *mr = block->mr;
+    uint8_t *p = memory_region_get_ram_ptr(mr);
+    int n = 1;
+
+    *stray = false;
+    for (offset += TARGET_PAGE_SIZE;
+         offset < end && n < ZERO_RANGE_MAX_PAGES;
+         offset += TARGET_PAGE_SIZE) {
+        if (!memory_region_get_dirty(mr, offset, TARGET_PAGE_SIZE,
+                                     DIRTY_MEMORY_MIGRATION) ||
+            !buffer_is_zero(p + offset, TARGET_PAGE_SIZE)) {
+            break;
+        }
+        memory_region_reset_dirty(mr, offset, TARGET_PAGE_SIZE,
+                                  DIRTY_MEMORY_MIGRATION);
+        /* it may have been written before its dirty bit was cleared */
+        if (!buffer_is_zero(p + offset, TARGET_PAGE_SIZE)) {
+            *stray = true;
+            break;
+        }
+        n++;
+    }
+
+    return n;
+}
 
 /*
  * ram_save_block: Writes a page of memory to the stream f
@@ -344,61 +885,136 @@ static int ram_save_block(QEMUFile *f, bool last_stage)
 {
     RAMBlock *block = last_block;
     ram_addr_t offset = last_offset;
+    bool complete_round = false;
     int bytes_sent = -1;
+    int ret;
     MemoryRegion *mr;
+    RAMChannel *c;
+    uint8_t *p;
     ram_addr_t current_addr;
+    int zero_bytes = 0;
+    int flushed_bytes = 0;
+    bool send_async;
 
     if (!block)
         block = QLIST_FIRST(&ram_list.blocks);
+    last_block = block;
 
-    do {
+    while (true) {
         mr = block->mr;
-        if (memory_region_get_dirty(mr, offset, TARGET_PAGE_SIZE,
-                                    DIRTY_MEMORY_MIGRATION)) {
-            uint8_t *p;
-            int cont = (block == last_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
-
-            memory_region_reset_dirty(mr, offset, TARGET_PAGE_SIZE,
-                                      DIRTY_MEMORY_MIGRATION);
-
-            p = memory_region_get_ram_ptr(mr) + offset;
-
-            if (is_dup_page(p)) {
-                acct_info.dup_pages++;
-                save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_COMPRESS);
-                qemu_put_byte(f, *p);
-                bytes_sent = 1;
-            } else if (migrate_use_xbzrle()) {
-                current_addr = block->offset + offset;
-                bytes_sent = save_xbzrle_page(f, p, current_addr, block,
-                                              offset, cont, last_stage);
-                if (!last_stage) {
-                    p = get_cached_data(XBZRLE.cache, current_addr);
-                }
+        /* skip clean pages a bitmap word at a time */
+        offset = memory_region_find_next_dirty(mr, offset, block->length,
+                                               DIRTY_MEMORY_MIGRATION);
+        if (complete_round && block == last_block && offset >= last_offset) {
+            if (flushed_bytes) {
+                /* the caller looks for dirty pages again */
+                bytes_sent = flushed_bytes;
+            }
+            break;
+        }
+        if (offset >= block->length) {
+            offset = 0;
+            block = QLIST_NEXT(block, next);
+            if (!block) {
+                block = QLIST_FIRST(&ram_list.blocks);
+                complete_round = true;
+                /* the next round may send the same pages again */
+                flushed_bytes += flush_compressed_data(&ram_channels[0]);
             }
+            continue;
+        }
+
+        memory_region_reset_dirty(mr, offset, TARGET_PAGE_SIZE,
+                                  DIRTY_MEMORY_MIGRATION);
+again:
+        ret = -1;
+        send_async = true;
+
+        p = memory_region_get_ram_ptr(mr) + offset;
+        c = ram_channel_for(block, offset);
+
+        if (comp_pool.params) {
+            flushed_bytes += flush_compressed_range(c, block, offset,
+                                                    TARGET_PAGE_SIZE);
+        }
+
+        if (is_dup_page(p)) {
+            int n = 1;
+            bool stray = false;
 
-            /* either we didn't send yet (we may have had XBZRLE overflow) */
-            if (bytes_sent == -1) {
-                save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_PAGE);
-                qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
-                bytes_sent = TARGET_PAGE_SIZE;
-                acct_info.norm_pages++;
+            if (*p == 0 && migrate_use_zero_range()) {
+                n = ram_zero_run(block, offset,
+                                 ram_channel_chunk_end(block, offset), &stray);
             }
+            acct_info.dup_pages += n;
+            if (n > 1 && comp_pool.params) {
+                flushed_bytes += flush_compressed_range(c, block, offset,
+                                        (ram_addr_t)n * TARGET_PAGE_SIZE);
+            }
+            if (n > 1) {
+                ret = save_block_hdr(c, block, offset,
+                                     RAM_SAVE_FLAG_ZERO_RANGE);
+                qemu_put_be32(c->f, n);
+                ret += 4;
+            } else {
+                ret = save_block_hdr(c, block, offset,
+                                     RAM_SAVE_FLAG_COMPRESS);
+                qemu_put_byte(c->f, *p);
+                ret += 1;
+            }
+            offset += (n - 1) * TARGET_PAGE_SIZE;
+            if (stray) {
+                /* the page after the run is no longer marked dirty */
+                zero_bytes += ret;
+                offset += TARGET_PAGE_SIZE;
+                goto again;
+            }
+        } else if (dedup_save.active &&
+                   !test_and_clear_bit((block->offset + offset) >>
+                                       TARGET_PAGE_BITS, dedup_save.resend)) {
+            ret = save_hash_page(c, block, offset, p);
+        } else if (dedup_save.active) {
+            /* asked for by the destination, which keeps exactly this */
+            ret = save_block_hdr(c, block, offset, RAM_SAVE_FLAG_PAGE);
+            qemu_put_buffer_async(c->f, p, TARGET_PAGE_SIZE);
+            ret += TARGET_PAGE_SIZE;
+            acct_info.norm_pages++;
+        } else if (migrate_use_xbzrle()) {
+            current_addr = block->offset + offset;
+            ret = save_xbzrle_page(c, p, current_addr, block,
+                                   offset, last_stage);
+            if (!last_stage) {
+                /* the cache entry can be replaced before the next flush */
+                p = get_cached_data(XBZRLE.cache, current_addr);
+                send_async = false;
+            }
+        }
 
-            /* if page is unmodified, continue to the next */
-            if (bytes_sent != 0) {
-                break;
+        /* either we didn't send yet (we may have had XBZRLE overflow) */
+        if (ret == -1 && comp_pool.params) {
+            ret = compress_page_with_threads(c, block, offset, p);
+        } else if (ret == -1 && ram_writes && ram_write_page(c, p) == 0) {
+            ret = TARGET_PAGE_SIZE;
+            acct_info.norm_pages++;
+        } else if (ret == -1) {
+            ret = save_block_hdr(c, block, offset, RAM_SAVE_FLAG_PAGE);
+            if (send_async) {
+                qemu_put_buffer_async(c->f, p, TARGET_PAGE_SIZE);
+            } else {
+                qemu_put_buffer(c->f, p, TARGET_PAGE_SIZE);
             }
+            ret += TARGET_PAGE_SIZE;
+            acct_info.norm_pages++;
         }
 
-        offset += TARGET_PAGE_SIZE;
-        if (offset >= block->length) {
-            offset = 0;
-            block = QLIST_NEXT(block, next);
-            if (!block)
-                block = QLIST_FIRST(&ram_list.blocks);
+        /* if page is unmodified, continue to the next */
+        bytes_sent = ret + zero_bytes + flushed_bytes;
+        if (bytes_sent != 0) {
+            break;
         }
-    } while (block != last_block || offset != last_offset);
+
+        offset += TARGET_PAGE_SIZE;
+    }
 
     last_block = block;
     last_offset = offset;
@@ -407,6 +1023,7 @@ static int ram_save_block(QEMUFile *f, bool last_stage)
 }
 
 static uint64_t bytes_transferred;
+static uint64_t dirty_sync_count;
 
 static ram_addr_t ram_save_remaining(void)
 {
@@ -423,6 +1040,94 @@ uint64_t ram_bytes_transferred(void)
     return bytes_transferred;
 }
 
+uint64_t ram_dirty_sync_count(void)
+{
+    return dirty_sync_count;
+}
+
+/* auto-converge state, see migration_bitmap_sync() */
+static int64_t start_time;
+static uint64_t bytes_xfer_prev;
+static uint64_t num_dirty_pages_period;
+static int dirty_rate_high_cnt;
+
+#define THROTTLE_PCT_INITIAL   20
+#define THROTTLE_PCT_INCREMENT 10
+
+/* Reduce amount of guest cpu execution to hopefully slow down memory writes.
+ * If guest dirty memory rate is reduced below the rate at which we can
+ * transfer pages to the destination then we should be able to complete
+ * migration. Some workloads dirty memory way too fast and will not
+ * effectively converge, even with auto-converge.
+ */
+static void mig_throttle_guest_down(void)
+{
+    if (!cpu_throttle_active()) {
+        cpu_throttle_set(THROTTLE_PCT_INITIAL);
+    } else {
+        cpu_throttle_set(cpu_throttle_get_percentage() +
+                         THROTTLE_PCT_INCREMENT);
+    }
+    DPRINTF("throttling guest cpus down to %d%%\n",
+            cpu_throttle_get_percentage());
+}
+
+/* The guest reports its free pages while the first pass runs */
+static bool free_page_hinting;
+
+static void free_page_hint_stop(void)
+{
+    if (free_page_hinting) {
+        qemu_balloon_free_page_hint(false);
+        free_page_hinting = false;
+    }
+}
+
+/* Pull the dirty log into the migration bitmap; every call starts a new
+ * pre-copy pass.  Called with the iothread lock held.
+ */
+static void migration_bitmap_sync(void)
+{
+    int64_t end_time;
+    uint64_t bytes_xfer_now;
+
+    /* a hint applied after this sync could clear the bit of a page that
+     * was reported free, then written and logged before the sync */
+    free_page_hint_stop();
+    memory_global_sync_dirty_bitmap(get_system_memory());
+    dirty_sync_count++;
+
+    /* whatever is dirty now was written during the last pass */
+    num_dirty_pages_period += ram_list.dirty_pages;
+
+    end_time = qemu_get_clock_ms(rt_clock);
+    if (!start_time) {
+        start_time = end_time;
+        bytes_xfer_prev = bytes_transferred;
+    }
+
+    /* more than 1 second = 1000 milliseconds */
+    if (end_time > start_time + 1000) {
+        if (migrate_auto_converge()) {
+            /* The following detection logic can be refined later. For now:
+               Check to see if the dirtied bytes is 50% more than the approx.
+               amount of bytes that just got transferred since the last time
+               we were in this routine. If that happens twice, start or
+               increase throttling */
+            bytes_xfer_now = bytes_transferred;
+            if ((num_dirty_pages_period * TARGET_PAGE_SIZE >
+                 (bytes_xfer_now - bytes_xfer_prev) / 2) &&
+                (++dirty_rate_high_cnt >= 2)) {
+                dirty_rate_high_cnt = 0;
+                mig_throttle_guest_down();
+            }
+            bytes_xfer_prev = bytes_xfer_now;
+        }
+        num_dirty_pages_period = 0;
+        start_time = end_time;
+    }
+}
+
 uint64_t ram_bytes_total(void)
 {
     RAMBlock *block;
@@ -465,233 +1170,1148 @@ static void sort_ram_list(void)
 
 static void migration_end(void)
 {
+    free_page_hint_stop();
     memory_global_dirty_log_stop();
+    compress_threads_fini();
+    dedup_save_fini();
+    cpu_throttle_stop();
 
     if (migrate_use_xbzrle()) {
         cache_fini(XBZRLE.cache);
         g_free(XBZRLE.cache);
         g_free(XBZRLE.encoded_buf);
         g_free(XBZRLE.current_buf);
-        g_free(XBZRLE.decoded_buf);
         XBZRLE.cache = NULL;
     }
 }
 
-static void ram_migration_cancel(void *opaque)
+static void ram_migration_cancel(void *opaque)
+{
+    migration_end();
+}
+
+#define MAX_WAIT 50 /* ms, half buffered_file limit */
+
+static void reset_ram_globals(void)
+{
+    int i;
+
+    last_block = NULL;
+    for (i = 0; i < ram_channel_count; i++) {
+        ram_channels[i].last_sent_block = NULL;
+    }
+    last_offset = 0;
+    last_version = ram_list.version;
+}
+
+/* Any error on a parallel channel fails the migration */
+static int ram_channels_get_error(void)
+{
+    int i, ret;
+
+    for (i = 0; i < ram_channel_count; i++) {
+        ret = qemu_file_get_error(ram_channels[i].f);
+        if (ret) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+static int ram_save_setup(QEMUFile *f, void *opaque)
+{
+    ram_addr_t addr;
+    RAMBlock *block;
+    int i;
+
+    ram_channels[0].f = f;
+    ram_channel_count = 1 + migrate_channel_file_count();
+    ram_writes = migrate_use_ram_writes();
+    ram_stream_pending = false;
+    for (i = 1; i < ram_channel_count; i++) {
+        ram_channels[i].f = migrate_channel_file(i - 1);
+    }
+
+    qemu_mutex_lock_ramlist();
+    bytes_transferred = 0;
+    dirty_sync_count = 0;
+    start_time = 0;
+    num_dirty_pages_period = 0;
+    dirty_rate_high_cnt = 0;
+    sort_ram_list();
+    reset_ram_globals();
+
+    if (migrate_use_xbzrle()) {
+        XBZRLE.cache = cache_init(migrate_xbzrle_cache_size() /
+                                  TARGET_PAGE_SIZE,
+                                  TARGET_PAGE_SIZE);
+        if (!XBZRLE.cache) {
+            DPRINTF("Error creating cache\n");
+            qemu_mutex_unlock_ramlist();
+            return -1;
+        }
+        XBZRLE.encoded_buf = g_malloc0(TARGET_PAGE_SIZE);
+        XBZRLE.current_buf = g_malloc(TARGET_PAGE_SIZE);
+        acct_clear();
+    }
+
+    if (migrate_use_compression()) {
+        compress_threads_init();
+        acct_clear();
+    }
+
+    dedup_save_init();
+
+    /* Make sure all dirty bits are set */
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        for (addr = 0; addr < block->length; addr += TARGET_PAGE_SIZE) {
+            if (!memory_region_get_dirty(block->mr, addr, TARGET_PAGE_SIZE,
+                                         DIRTY_MEMORY_MIGRATION)) {
+                memory_region_set_dirty(block->mr, addr, TARGET_PAGE_SIZE);
+            }
+        }
+    }
+
+    memory_global_dirty_log_start();
+
+    /* free pages need not be sent at all unless they are dirtied */
+    qemu_balloon_free_page_hint(true);
+    free_page_hinting = true;
+
+    qemu_put_be64(f, ram_bytes_total() | RAM_SAVE_FLAG_MEM_SIZE);
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        qemu_put_byte(f, strlen(block->idstr));
+        qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
+        qemu_put_be64(f, block->length);
+    }
+
+    if (ram_channel_count > 1) {
+        qemu_put_be64(f, RAM_SAVE_FLAG_CHANNELS);
+        qemu_put_be32(f, ram_channel_count);
+    }
+
+    qemu_mutex_unlock_ramlist();
+    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+
+    return 0;
+}
+
+static int ram_save_iterate(QEMUFile *f, void *opaque)
+{
+    uint64_t bytes_transferred_last;
+    double bwidth = 0;
+    int ret;
+    int i;
+    uint64_t expected_time;
+
+    /* Called from the migration thread without the iothread lock; the
+     * ramlist lock keeps blocks from being added or removed under us.  */
+    qemu_mutex_lock_ramlist();
+
+    if (ram_list.version != last_version) {
+        reset_ram_globals();
+    }
+
+    bytes_transferred_last = bytes_transferred;
+    bwidth = qemu_get_clock_ns(rt_clock);
+
+    i = 0;
+    while ((ret = qemu_file_rate_limit(f)) == 0) {
+        int bytes_sent;
+
+        bytes_sent = ram_save_block(f, false);
+        /* no more blocks to sent */
+        if (bytes_sent < 0) {
+            break;
+        }
+        bytes_transferred += bytes_sent;
+        acct_info.iterations++;
+        /* we want to check in the 1st loop, just in case it was the 1st time
+           and we had to sync the dirty bitmap.
+           qemu_get_clock_ns() is a bit expensive, so we only check each some
+           iterations
+        */
+        if ((i & 63) == 0) {
+            uint64_t t1 = (qemu_get_clock_ns(rt_clock) - bwidth) / 1000000;
+
+            if (dedup_save.active) {
+                ret = dedup_read_replies(false);
+                if (ret < 0) {
+                    break;
+                }
+            }
+            if (t1 > MAX_WAIT) {
+                DPRINTF("big wait: " PRIu64 " milliseconds, %d iterations\n",
+                        t1, i);
+                break;
+            }
+        }
+        i++;
+    }
+
+    if (ret >= 0) {
+        bytes_transferred += flush_compressed_data(&ram_channels[0]);
+        ret = ram_channels_get_error();
+    }
+    qemu_mutex_unlock_ramlist();
+
+    if (ret < 0) {
+        return ret;
+    }
+
+    bwidth = qemu_get_clock_ns(rt_clock) - bwidth;
+    bwidth = (bytes_transferred - bytes_transferred_last) / bwidth;
+
+    /* if we haven't transferred anything this round, force expected_time to a
+     * a very high value, but without crashing */
+    if (bwidth == 0) {
+        bwidth = 0.000001;
+    }
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+
+    expected_time = ram_save_remaining() * TARGET_PAGE_SIZE / bwidth;
+
+    DPRINTF("ram_save_live: expected(" PRIu64 ") <= max(" PRIu64 ")?\n",
+            expected_time, migrate_max_downtime());
+
+    if (expected_time <= migrate_max_downtime()) {
+        qemu_mutex_lock_iothread();
+        migration_bitmap_sync();
+        qemu_mutex_unlock_iothread();
+        expected_time = ram_save_remaining() * TARGET_PAGE_SIZE / bwidth;
+
+        if (expected_time <= migrate_max_downtime()) {
+            return 1;
+        }
+    }
+
+    /* A guest that dirties memory faster than we can send it never gets
+     * under the downtime target; give up iterating after a bounded number
+     * of passes so the migration is guaranteed to finish. */
+    if (migrate_max_precopy_passes() &&
+        dirty_sync_count >= migrate_max_precopy_passes()) {
+        DPRINTF("pre-copy pass limit reached after %" PRIu64 " passes\n",
+                dirty_sync_count);
+        return 1;
+    }
+    return 0;
+}
+
+static int ram_save_complete(QEMUFile *f, void *opaque)
+{
+    migration_bitmap_sync();
+
+    qemu_mutex_lock_ramlist();
+
+    /* try transferring iterative blocks of memory */
+
+    /* flush all remaining blocks regardless of rate limiting */
+    while (true) {
+        int bytes_sent;
+
+        bytes_sent = ram_save_block(f, true);
+        /* no more blocks to sent */
+        if (bytes_sent < 0) {
+            break;
+        }
+        bytes_transferred += bytes_sent;
+    }
+    bytes_transferred += flush_compressed_data(&ram_channels[0]);
+
+    /* the pages the destination lacks go out before the device state */
+    if (dedup_save.active) {
+        int bytes_sent, ret;
+
+        qemu_put_be64(f, RAM_SAVE_FLAG_HASH_SYNC);
+        qemu_fflush(f);
+        ret = qemu_file_get_error(f);
+        if (ret == 0) {
+            ret = dedup_read_replies(true);
+        }
+        if (ret < 0) {
+            qemu_file_set_error(f, ret);
+        } else {
+            while ((bytes_sent = ram_save_block(f, true)) >= 0) {
+                bytes_transferred += bytes_sent;
+            }
+        }
+    }
+    memory_global_dirty_log_stop();
+    compress_threads_fini();
+    dedup_save_fini();
+    cpu_throttle_stop();
+
+    qemu_mutex_unlock_ramlist();
+
+    /* The channels end here; the destination waits for all of them before
+     * it moves on to the device state that follows on the main stream. */
+    if (ram_channel_count > 1) {
+        int i;
+
+        for (i = 1; i < ram_channel_count; i++) {
+            qemu_put_be64(ram_channels[i].f, RAM_SAVE_FLAG_EOS);
+            qemu_fflush(ram_channels[i].f);
+        }
+        qemu_put_be64(f, RAM_SAVE_FLAG_CHANNELS);
+        qemu_put_be32(f, 0);
+    }
+    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+
+    return ram_channels_get_error();
+}
+
+static int load_xbzrle(QEMUFile *f, void *host, uint8_t **decoded_buf)
+{
+    int ret, rc = 0;
+    unsigned int xh_len;
+    int xh_flags;
+
+    if (!*decoded_buf) {
+        *decoded_buf = g_malloc(TARGET_PAGE_SIZE);
+    }
+
+    /* extract RLE header */
+    xh_flags = qemu_get_byte(f);
+    xh_len = qemu_get_be16(f);
+
+    if (xh_flags != ENCODING_FLAG_XBZRLE) {
+        fprintf(stderr, "Failed to load XBZRLE page - wrong compression!\n");
+        return -1;
+    }
+
+    if (xh_len > TARGET_PAGE_SIZE) {
+        fprintf(stderr, "Failed to load XBZRLE page - len overflow!\n");
+        return -1;
+    }
+    /* load data and decode */
+    qemu_get_buffer(f, *decoded_buf, xh_len);
+
+    /* decode RLE */
+    ret = xbzrle_decode_buffer(*decoded_buf, xh_len, host,
+                               TARGET_PAGE_SIZE);
+    if (ret == -1) {
+        fprintf(stderr, "Failed to load XBZRLE page - decode error!\n");
+        rc = -1;
+    } else  if (ret > TARGET_PAGE_SIZE) {
+        fprintf(stderr, "Failed to load XBZRLE page - size %d exceeds %d!\n",
+                ret, TARGET_PAGE_SIZE);
+        abort();
+    }
+
+    return rc;
+}
+
+/* Parallel decompression of RAM_SAVE_FLAG_COMPRESS_PAGE records.  The
+ * pool is started by the first compressed page of an incoming migration
+ * and stopped by ram_load_cleanup() when the migration ends.  The stream
+ * is read by the loading thread only, the workers inflate straight into
+ * guest memory, and every page is in place before ram_load() returns.  A
+ * newer record of a page that is still being inflated waits for the
+ * worker, see decompress_wait_range(). */
+typedef struct DecompressParam {
+    QemuThread thread;
+    /* protected by decomp_pool.lock */
+    bool busy;
+    /* owned by the worker while busy */
+    void *host;
+    uint8_t *in;
+    unsigned long in_len;
+} DecompressParam;
+
+static struct {
+    DecompressParam *params;
+    int count;
+    bool quit;
+    bool error;
+    QemuMutex lock;
+    QemuCond work_cond;
+    QemuCond done_cond;
+} decomp_pool;
+
+static void *do_decompress_thread(void *opaque)
+{
+    DecompressParam *param = opaque;
+
+    qemu_mutex_lock(&decomp_pool.lock);
+    while (!decomp_pool.quit) {
+        if (param->busy) {
+            unsigned long out_len = TARGET_PAGE_SIZE;
+            int ret;
+
+            qemu_mutex_unlock(&decomp_pool.lock);
+            ret = uncompress(param->host, &out_len, param->in, param->in_len);
+            qemu_mutex_lock(&decomp_pool.lock);
+            if (ret != Z_OK || out_len != TARGET_PAGE_SIZE) {
+                decomp_pool.error = true;
+            }
+            param->busy = false;
+            qemu_cond_broadcast(&decomp_pool.done_cond);
+        } else {
+            qemu_cond_wait(&decomp_pool.work_cond, &decomp_pool.lock);
+        }
+    }
+    qemu_mutex_unlock(&decomp_pool.lock);
+
+    return NULL;
+}
+
+static void decompress_threads_init(void)
+{
+    int i;
+
+    decomp_pool.count = migrate_decompress_threads();
+    decomp_pool.quit = false;
+    decomp_pool.error = false;
+    decomp_pool.params = g_new0(DecompressParam, decomp_pool.count);
+    qemu_mutex_init(&decomp_pool.lock);
+    qemu_cond_init(&decomp_pool.work_cond);
+    qemu_cond_init(&decomp_pool.done_cond);
+
+    for (i = 0; i < decomp_pool.count; i++) {
+        DecompressParam *param = &decomp_pool.params[i];
+
+        param->in = g_malloc(compressBound(TARGET_PAGE_SIZE));
+        qemu_thread_create(&param->thread, do_decompress_thread, param,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+/* Waits for all pending pages; returns -EINVAL if any failed to inflate */
+static int decompress_threads_drain(void)
+{
+    bool error;
+    int i;
+
+    if (!decomp_pool.params) {
+        return 0;
+    }
+
+    qemu_mutex_lock(&decomp_pool.lock);
+    for (i = 0; i < decomp_pool.count; i++) {
+        while (decomp_pool.params[i].busy) {
+            qemu_cond_wait(&decomp_pool.done_cond, &decomp_pool.lock);
+        }
+    }
+    error = decomp_pool.error;
+    decomp_pool.error = false;
+    qemu_mutex_unlock(&decomp_pool.lock);
+
+    if (error) {
+        fprintf(stderr, "Failed to load compressed page - decode error!\n");
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static void decompress_threads_fini(void)
+{
+    int i;
+
+    if (!decomp_pool.params) {
+        return;
+    }
+
+    decompress_threads_drain();
+    qemu_mutex_lock(&decomp_pool.lock);
+    decomp_pool.quit = true;
+    qemu_cond_broadcast(&decomp_pool.work_cond);
+    qemu_mutex_unlock(&decomp_pool.lock);
+
+    for (i = 0; i < decomp_pool.count; i++) {
+        qemu_thread_join(&decomp_pool.params[i].thread);
+        g_free(decomp_pool.params[i].in);
+    }
+    qemu_cond_destroy(&decomp_pool.done_cond);
+    qemu_cond_destroy(&decomp_pool.work_cond);
+    qemu_mutex_destroy(&decomp_pool.lock);
+    g_free(decomp_pool.params);
+    decomp_pool.params = NULL;
+}
+
+/* Waits for the workers that inflate into @host .. @host + @len */
+static void decompress_wait_range(void *host, size_t len)
+{
+    int i;
+
+    if (!decomp_pool.params) {
+        return;
+    }
+
+    qemu_mutex_lock(&decomp_pool.lock);
+    for (i = 0; i < decomp_pool.count; i++) {
+        DecompressParam *param = &decomp_pool.params[i];
+
+        while (param->busy && (uint8_t *)param->host >= (uint8_t *)host &&
+               (uint8_t *)param->host < (uint8_t *)host + len) {
+            qemu_cond_wait(&decomp_pool.done_cond, &decomp_pool.lock);
+        }
+    }
+    qemu_mutex_unlock(&decomp_pool.lock);
+}
+
+static int load_compressed_page(QEMUFile *f, void *host)
+{
+    DecompressParam *param = NULL;
+    unsigned int len;
+    int i;
+
+    len = qemu_get_be32(f);
+    if (len > compressBound(TARGET_PAGE_SIZE)) {
+        fprintf(stderr, "Failed to load compressed page - len overflow!\n");
+        return -EINVAL;
+    }
+
+    if (!decomp_pool.params) {
+        decompress_threads_init();
+    }
+    decompress_wait_range(host, TARGET_PAGE_SIZE);
+
+    qemu_mutex_lock(&decomp_pool.lock);
+    while (!param) {
+        for (i = 0; i < decomp_pool.count; i++) {
+            if (!decomp_pool.params[i].busy) {
+                param = &decomp_pool.params[i];
+                break;
+            }
+        }
+        if (!param) {
+            qemu_cond_wait(&decomp_pool.done_cond, &decomp_pool.lock);
+        }
+    }
+    qemu_mutex_unlock(&decomp_pool.lock);
+
+    /* the worker is idle, so its buffer can be filled without the lock */
+    qemu_get_buffer(f, param->in, len);
+
+    qemu_mutex_lock(&decomp_pool.lock);
+    param->host = host;
+    param->in_len = len;
+    param->busy = true;
+    qemu_cond_broadcast(&decomp_pool.work_cond);
+    qemu_mutex_unlock(&decomp_pool.lock);
+
+    return 0;
+}
+
+/* An incoming stream of RAM pages: the main migration stream, or one of
+ * the parallel channels, each of which is read by a thread of its own. */
+typedef struct RAMLoadStream {
+    QEMUFile *f;
+    /* block of the last page received, RAM_SAVE_FLAG_CONTINUE refers to it */
+    RAMBlock *block;
+    uint8_t *xbzrle_buf;
+    /* channels only */
+    int fd;
+    QemuThread thread;
+    int ret;
+} RAMLoadStream;
+
+static RAMLoadStream load_main;
+
+static struct {
+    RAMLoadStream *streams;
+    int count;
+} load_channels;
+
+static inline void *host_from_stream_offset(RAMLoadStream *ls,
+                                            ram_addr_t offset,
+                                            int flags)
+{
+    QEMUFile *f = ls->f;
+    RAMBlock *block;
+    char id[256];
+    uint8_t len;
+
+    if (flags & RAM_SAVE_FLAG_CONTINUE) {
+        if (!ls->block) {
+            fprintf(stderr, "Ack, bad migration stream!\n");
+            return NULL;
+        }
+
+        return memory_region_get_ram_ptr(ls->block->mr) + offset;
+    }
+
+    len = qemu_get_byte(f);
+    qemu_get_buffer(f, (uint8_t *)id, len);
+    id[len] = 0;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        if (!strncmp(id, block->idstr, sizeof(id))) {
+            ls->block = block;
+            return memory_region_get_ram_ptr(block->mr) + offset;
+        }
+    }
+
+    ls->block = NULL;
+    fprintf(stderr, "Can't find block %s!\n", id);
+    return NULL;
+}
+
+/* Zero @npages pages at @host without touching the ones that already are:
+ * on a fresh destination they are not even backed by memory yet.
+ */
+static void ram_zero_pages(uint8_t *host, uint32_t npages)
+{
+    uint32_t i;
+
+    for (i = 0; i < npages; i++, host += TARGET_PAGE_SIZE) {
+        if (!buffer_is_zero(host, TARGET_PAGE_SIZE)) {
+            memset(host, 0, TARGET_PAGE_SIZE);
+#ifndef _WIN32
+            if (!qemu_balloon_is_inhibited() &&
+                (!kvm_enabled() || kvm_has_sync_mmu())) {
+                qemu_madvise(host, TARGET_PAGE_SIZE, QEMU_MADV_DONTNEED);
+            }
+#endif
+        }
+    }
+}
+
+/* A page the destination can copy from, found by its digest */
+typedef struct DedupPage {
+    uint8_t digest[DEDUP_DIGEST_SIZE];
+    /* a page received in this migration, or NULL for the page store */
+    RAMBlock *block;
+    /* offset in @block, or index in the page store */
+    uint64_t pos;
+} DedupPage;
+
+static struct {
+    bool active;
+    /* the sync was answered, the state goes at the end of the section */
+    bool synced;
+    int fd;
+    GChecksum *checksum;
+    GHashTable *pages;
+    /* pages asked for, by ram_addr_t page number; they are added to the
+     * index when they arrive */
+    unsigned long *requested;
+    long nr_pages;
+    uint8_t requests[DEDUP_REPLY_BATCH * 8];
+    int nr_requests;
+    /* the page store: pages in store_fd, their digests in index_fd */
+    int store_fd;
+    int index_fd;
+} dedup_load;
+
+static guint dedup_hash(gconstpointer key)
+{
+    guint hash;
+
+    /* the digest is as good a hash as any */
+    memcpy(&hash, key, sizeof(hash));
+    return hash;
+}
+
+static gboolean dedup_equal(gconstpointer a, gconstpointer b)
+{
+    return !memcmp(a, b, DEDUP_DIGEST_SIZE);
+}
+
+static void dedup_index(const uint8_t *digest, RAMBlock *block, uint64_t pos)
+{
+    DedupPage *page = g_malloc(sizeof(*page));
+
+    memcpy(page->digest, digest, DEDUP_DIGEST_SIZE);
+    page->block = block;
+    page->pos = pos;
+    g_hash_table_replace(dedup_load.pages, page->digest, page);
+}
+
+/*
+ * The page store is made of two files, appended to by every incoming
+ * migration on the host: the pages, one after the other, and the index,
+ * a be32 magic and page size followed by the digest of each page.  A
+ * digest is only written once its page is complete, and appending is
+ * serialized by an exclusive lock on the index.  The index is read when
+ * the migration starts; pages other migrations add later are not seen.
+ */
+#define DEDUP_STORE_MAGIC       0x51504753      /* "QPGS" */
+#define DEDUP_STORE_HEADER      8
+
+#ifndef _WIN32
+static uint64_t dedup_store_nr_pages(void)
+{
+    off_t size = lseek(dedup_load.index_fd, 0, SEEK_END);
+
+    if (size < DEDUP_STORE_HEADER) {
+        return 0;
+    }
+    return (size - DEDUP_STORE_HEADER) / DEDUP_DIGEST_SIZE;
+}
+
+/* Called with the index locked */
+static int dedup_store_read_index(void)
+{
+    uint8_t header[DEDUP_STORE_HEADER];
+    uint8_t *buf;
+    uint64_t nr, i, n, done;
+    off_t size;
+    int ret = 0;
+
+    size = lseek(dedup_load.index_fd, 0, SEEK_END);
+    if (size == 0) {
+        stl_be_p(header, DEDUP_STORE_MAGIC);
+        stl_be_p(header + 4, TARGET_PAGE_SIZE);
+        if (pwrite(dedup_load.index_fd, header, sizeof(header), 0) !=
+            sizeof(header)) {
+            return -errno;
+        }
+        return 0;
+    }
+    if (pread(dedup_load.index_fd, header, sizeof(header), 0) !=
+        sizeof(header) ||
+        ldl_be_p(header) != DEDUP_STORE_MAGIC ||
+        ldl_be_p(header + 4) != TARGET_PAGE_SIZE) {
+        return -EINVAL;
+    }
+
+    /* a digest without its page can only be the last one */
+    nr = MIN(dedup_store_nr_pages(),
+             lseek(dedup_load.store_fd, 0, SEEK_END) / TARGET_PAGE_SIZE);
+    buf = g_malloc(DEDUP_REPLY_BATCH * DEDUP_DIGEST_SIZE);
+    for (done = 0; done < nr; done += n) {
+        n = MIN(nr - done, DEDUP_REPLY_BATCH);
+        if (pread(dedup_load.index_fd, buf, n * DEDUP_DIGEST_SIZE,
+                  DEDUP_STORE_HEADER + done * DEDUP_DIGEST_SIZE) !=
+            n * DEDUP_DIGEST_SIZE) {
+            ret = -EIO;
+            break;
+        }
+        for (i = 0; i < n; i++) {
+            dedup_index(buf + i * DEDUP_DIGEST_SIZE, NULL, done + i);
+        }
+    }
+    g_free(buf);
+
+    return ret;
+}
+
+static int dedup_store_open(const char *path)
+{
+    char *index_path = g_strdup_printf("%s.idx", path);
+    int ret;
+
+    dedup_load.store_fd = qemu_open(path, O_RDWR | O_CREAT | O_BINARY, 0600);
+    dedup_load.index_fd = qemu_open(index_path, O_RDWR | O_CREAT | O_BINARY,
+                                    0600);
+    g_free(index_path);
+    if (dedup_load.store_fd < 0 || dedup_load.index_fd < 0) {
+        ret = -errno;
+        goto fail;
+    }
+
+    flock(dedup_load.index_fd, LOCK_EX);
+    ret = dedup_store_read_index();
+    flock(dedup_load.index_fd, LOCK_UN);
+    if (ret < 0) {
+        goto fail;
+    }
+    return 0;
+
+fail:
+    if (dedup_load.store_fd >= 0) {
+        close(dedup_load.store_fd);
+    }
+    if (dedup_load.index_fd >= 0) {
+        close(dedup_load.index_fd);
+    }
+    dedup_load.store_fd = dedup_load.index_fd = -1;
+    return ret;
+}
+
+/* Returns the index of the page in the store, or -errno */
+static int64_t dedup_store_append(const uint8_t *host, const uint8_t *digest)
+{
+    uint64_t nr;
+    int64_t ret;
+
+    flock(dedup_load.index_fd, LOCK_EX);
+    nr = dedup_store_nr_pages();
+    if (pwrite(dedup_load.store_fd, host, TARGET_PAGE_SIZE,
+               nr * TARGET_PAGE_SIZE) != TARGET_PAGE_SIZE ||
+        pwrite(dedup_load.index_fd, digest, DEDUP_DIGEST_SIZE,
+               DEDUP_STORE_HEADER + nr * DEDUP_DIGEST_SIZE) !=
+        DEDUP_DIGEST_SIZE) {
+        /* drop a partial digest, the next page overwrites the rest */
+        ret = -errno;
+        if (ftruncate(dedup_load.index_fd,
+                      DEDUP_STORE_HEADER + nr * DEDUP_DIGEST_SIZE) < 0) {
+            /* the index is unusable whatever we do */
+        }
+    } else {
+        ret = nr;
+    }
+    flock(dedup_load.index_fd, LOCK_UN);
+
+    return ret;
+}
+#else
+static int dedup_store_open(const char *path)
+{
+    return -ENOTSUP;
+}
+
+static int64_t dedup_store_append(const uint8_t *host, const uint8_t *digest)
+{
+    return -ENOTSUP;
+}
+#endif
+
+static int dedup_load_init(void)
+{
+    int ret;
+
+    dedup_load.fd = migrate_incoming_return_path();
+    if (dedup_load.fd < 0) {
+        fprintf(stderr, "dedup: the migration transport has no return "
+                "path\n");
+        return -EINVAL;
+    }
+    dedup_load.checksum = g_checksum_new(G_CHECKSUM_SHA256);
+    dedup_load.pages = g_hash_table_new_full(dedup_hash, dedup_equal,
+                                             NULL, g_free);
+    dedup_load.nr_pages = ram_nr_pages();
+    dedup_load.requested = bitmap_new(dedup_load.nr_pages);
+    dedup_load.nr_requests = 0;
+    dedup_load.synced = false;
+    dedup_load.store_fd = dedup_load.index_fd = -1;
+    if (migration_page_store) {
+        ret = dedup_store_open(migration_page_store);
+        if (ret < 0) {
+            /* the pages of this migration can still be shared */
+            fprintf(stderr, "dedup: cannot use page store %s: %s\n",
+                    migration_page_store, strerror(-ret));
+        }
+    }
+    dedup_load.active = true;
+
+    return 0;
+}
+
+static void dedup_load_fini(void)
+{
+    if (!dedup_load.active) {
+        return;
+    }
+    if (dedup_load.store_fd >= 0) {
+        close(dedup_load.store_fd);
+        close(dedup_load.index_fd);
+    }
+    g_hash_table_destroy(dedup_load.pages);
+    g_checksum_free(dedup_load.checksum);
+    g_free(dedup_load.requested);
+    dedup_load.requested = NULL;
+    dedup_load.active = false;
+}
+
+static int dedup_send(const uint8_t *buf, int size)
+{
+    int offset = 0;
+
+    while (offset < size) {
+        ssize_t ret = send(dedup_load.fd, buf + offset, size - offset, 0);
+
+        if (ret > 0) {
+            offset += ret;
+        } else if (ret == 0) {
+            return -EIO;
+        } else if (socket_error() != EINTR) {
+            return -socket_error();
+        }
+    }
+    return 0;
+}
+
+/*
+ * The source reads the requests between pages, which keeps the return
+ * path from filling up while the destination blocks sending on it.
+ */
+static int dedup_flush_requests(void)
+{
+    int ret = dedup_send(dedup_load.requests, dedup_load.nr_requests * 8);
+
+    dedup_load.nr_requests = 0;
+    return ret;
+}
+
+static int dedup_request(uint64_t addr)
 {
-    migration_end();
+    stq_be_p(dedup_load.requests + dedup_load.nr_requests * 8, addr);
+    if (++dedup_load.nr_requests == DEDUP_REPLY_BATCH) {
+        return dedup_flush_requests();
+    }
+    return 0;
 }
 
-#define MAX_WAIT 50 /* ms, half buffered_file limit */
+static int dedup_sync(void)
+{
+    int ret;
 
-static int ram_save_setup(QEMUFile *f, void *opaque)
+    if (!dedup_load.active) {
+        return -EINVAL;
+    }
+    ret = dedup_request(DEDUP_SYNC_REPLY);
+    if (ret == 0) {
+        ret = dedup_flush_requests();
+    }
+    dedup_load.synced = true;
+    return ret;
+}
+
+/* Fills @host with the page that has @digest; false if there is none */
+static bool dedup_copy(DedupPage *page, uint8_t *host, const uint8_t *digest)
 {
-    ram_addr_t addr;
-    RAMBlock *block;
+    uint8_t check[DEDUP_DIGEST_SIZE];
 
-    bytes_transferred = 0;
-    last_block = NULL;
-    last_offset = 0;
-    sort_ram_list();
+    if (!page->block) {
+        if (pread(dedup_load.store_fd, host, TARGET_PAGE_SIZE,
+                  page->pos * TARGET_PAGE_SIZE) != TARGET_PAGE_SIZE) {
+            return false;
+        }
+    } else {
+        uint8_t *src = memory_region_get_ram_ptr(page->block->mr) + page->pos;
 
-    if (migrate_use_xbzrle()) {
-        XBZRLE.cache = cache_init(migrate_xbzrle_cache_size() /
-                                  TARGET_PAGE_SIZE,
-                                  TARGET_PAGE_SIZE);
-        if (!XBZRLE.cache) {
-            DPRINTF("Error creating cache\n");
-            return -1;
+        /* the guest may have got a newer version of the page since */
+        dedup_digest(dedup_load.checksum, src, check);
+        if (memcmp(check, digest, DEDUP_DIGEST_SIZE)) {
+            return false;
         }
-        XBZRLE.encoded_buf = g_malloc0(TARGET_PAGE_SIZE);
-        XBZRLE.current_buf = g_malloc(TARGET_PAGE_SIZE);
-        acct_clear();
+        if (src != host) {
+            memcpy(host, src, TARGET_PAGE_SIZE);
+        }
+        return true;
     }
+    dedup_digest(dedup_load.checksum, host, check);
+    return !memcmp(check, digest, DEDUP_DIGEST_SIZE);
+}
 
-    /* Make sure all dirty bits are set */
-    QLIST_FOREACH(block, &ram_list.blocks, next) {
-        for (addr = 0; addr < block->length; addr += TARGET_PAGE_SIZE) {
-            if (!memory_region_get_dirty(block->mr, addr, TARGET_PAGE_SIZE,
-                                         DIRTY_MEMORY_MIGRATION)) {
-                memory_region_set_dirty(block->mr, addr, TARGET_PAGE_SIZE);
-            }
+static int load_hash_page(RAMBlock *block, ram_addr_t offset, uint8_t *host,
+                          const uint8_t *digest)
+{
+    ram_addr_t addr = block->offset + offset;
+    DedupPage *page;
+
+    if (!dedup_load.active && dedup_load_init() < 0) {
+        return -EINVAL;
+    }
+    if ((addr >> TARGET_PAGE_BITS) >= dedup_load.nr_pages) {
+        return -EINVAL;
+    }
+
+    page = g_hash_table_lookup(dedup_load.pages, digest);
+    if (page) {
+        if (dedup_copy(page, host, digest)) {
+            return 0;
         }
+        g_hash_table_remove(dedup_load.pages, digest);
     }
 
-    memory_global_dirty_log_start();
+    set_bit(addr >> TARGET_PAGE_BITS, dedup_load.requested);
+    return dedup_request(addr);
+}
 
-    qemu_put_be64(f, ram_bytes_total() | RAM_SAVE_FLAG_MEM_SIZE);
+/* A page asked for came in: it can serve the next guests */
+static void dedup_page_received(RAMBlock *block, ram_addr_t offset,
+                                uint8_t *host)
+{
+    ram_addr_t addr = block->offset + offset;
+    uint8_t digest[DEDUP_DIGEST_SIZE];
+    int64_t pos = -1;
 
-    QLIST_FOREACH(block, &ram_list.blocks, next) {
-        qemu_put_byte(f, strlen(block->idstr));
-        qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
-        qemu_put_be64(f, block->length);
+    if ((addr >> TARGET_PAGE_BITS) >= dedup_load.nr_pages ||
+        !test_and_clear_bit(addr >> TARGET_PAGE_BITS, dedup_load.requested)) {
+        return;
     }
+    dedup_digest(dedup_load.checksum, host, digest);
+    if (g_hash_table_lookup(dedup_load.pages, digest)) {
+        return;
+    }
+    if (dedup_load.store_fd >= 0) {
+        pos = dedup_store_append(host, digest);
+    }
+    if (pos >= 0) {
+        dedup_index(digest, NULL, pos);
+    } else {
+        dedup_index(digest, block, offset);
+    }
+}
 
-    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
-
-    return 0;
+/* Loads the page record that starts with @addr | @flags, if it is one.
+ * Used by the main stream and the channels alike. */
+/* Only the main stream carries compressed pages */
+static void ram_load_wait(RAMLoadStream *ls, void *host, size_t len)
+{
+    if (ls == &load_main) {
+        decompress_wait_range(host, len);
+    }
 }
 
-static int ram_save_iterate(QEMUFile *f, void *opaque)
+static int ram_load_page(RAMLoadStream *ls, ram_addr_t addr, int flags)
 {
-    uint64_t bytes_transferred_last;
-    double bwidth = 0;
-    int ret;
-    int i;
-    uint64_t expected_time;
+    QEMUFile *f = ls->f;
 
-    bytes_transferred_last = bytes_transferred;
-    bwidth = qemu_get_clock_ns(rt_clock);
+    if (flags & RAM_SAVE_FLAG_COMPRESS) {
+        void *host;
+        uint8_t ch;
 
-    i = 0;
-    while ((ret = qemu_file_rate_limit(f)) == 0) {
-        int bytes_sent;
+        host = host_from_stream_offset(ls, addr, flags);
+        if (!host) {
+            return -EINVAL;
+        }
 
-        bytes_sent = ram_save_block(f, false);
-        /* no more blocks to sent */
-        if (bytes_sent < 0) {
-            break;
+        ch = qemu_get_byte(f);
+        ram_load_wait(ls, host, TARGET_PAGE_SIZE);
+        memset(host, ch, TARGET_PAGE_SIZE);
+#ifndef _WIN32
+        if (ch == 0 && !qemu_balloon_is_inhibited() &&
+            (!kvm_enabled() || kvm_has_sync_mmu())) {
+            qemu_madvise(host, TARGET_PAGE_SIZE, QEMU_MADV_DONTNEED);
         }
-        bytes_transferred += bytes_sent;
-        acct_info.iterations++;
-        /* we want to check in the 1st loop, just in case it was the 1st time
-           and we had to sync the dirty bitmap.
-           qemu_get_clock_ns() is a bit expensive, so we only check each some
-           iterations
-        */
-        if ((i & 63) == 0) {
-            uint64_t t1 = (qemu_get_clock_ns(rt_clock) - bwidth) / 1000000;
-            if (t1 > MAX_WAIT) {
-                DPRINTF("big wait: " PRIu64 " milliseconds, %d iterations\n",
-                        t1, i);
-                break;
-            }
+#endif
+    } else if (flags & RAM_SAVE_FLAG_ZERO_RANGE) {
+        uint8_t *host;
+        uint32_t npages;
+
+        host = host_from_stream_offset(ls, addr, flags);
+        npages = qemu_get_be32(f);
+        if (!host || npages == 0 || npages > ZERO_RANGE_MAX_PAGES ||
+            addr + (ram_addr_t)npages * TARGET_PAGE_SIZE >
+            ls->block->length) {
+            return -EINVAL;
         }
-        i++;
-    }
-
-    if (ret < 0) {
-        return ret;
-    }
-
-    bwidth = qemu_get_clock_ns(rt_clock) - bwidth;
-    bwidth = (bytes_transferred - bytes_transferred_last) / bwidth;
 
-    /* if we haven't transferred anything this round, force expected_time to a
-     * a very high value, but without crashing */
-    if (bwidth == 0) {
-        bwidth = 0.000001;
-    }
+        ram_load_wait(ls, host, (size_t)npages * TARGET_PAGE_SIZE);
+        ram_zero_pages(host, npages);
+    } else if (flags & RAM_SAVE_FLAG_PAGE) {
+        void *host;
 
-    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+        host = host_from_stream_offset(ls, addr, flags);
+        if (!host) {
+            return -EINVAL;
+        }
 
-    expected_time = ram_save_remaining() * TARGET_PAGE_SIZE / bwidth;
+        ram_load_wait(ls, host, TARGET_PAGE_SIZE);
+        qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+        if (dedup_load.active) {
+            dedup_page_received(ls->block, addr, host);
+        }
+    } else if (flags & RAM_SAVE_FLAG_XBZRLE) {
+        if (!migrate_use_xbzrle()) {
+            return -EINVAL;
+        }
+        void *host = host_from_stream_offset(ls, addr, flags);
+        if (!host) {
+            return -EINVAL;
+        }
 
-    DPRINTF("ram_save_live: expected(" PRIu64 ") <= max(" PRIu64 ")?\n",
-            expected_time, migrate_max_downtime());
+        ram_load_wait(ls, host, TARGET_PAGE_SIZE);
+        if (load_xbzrle(f, host, &ls->xbzrle_buf) < 0) {
+            return -EINVAL;
+        }
+    } else if (flags & RAM_SAVE_FLAG_HASH) {
+        uint8_t digest[DEDUP_DIGEST_SIZE];
+        void *host;
 
-    if (expected_time <= migrate_max_downtime()) {
-        memory_global_sync_dirty_bitmap(get_system_memory());
-        expected_time = ram_save_remaining() * TARGET_PAGE_SIZE / bwidth;
+        /* the answers go back on the main connection only */
+        if (ls != &load_main) {
+            return -EINVAL;
+        }
+        host = host_from_stream_offset(ls, addr, flags);
+        if (!host) {
+            return -EINVAL;
+        }
 
-        return expected_time <= migrate_max_downtime();
+        qemu_get_buffer(f, digest, DEDUP_DIGEST_SIZE);
+        ram_load_wait(ls, host, TARGET_PAGE_SIZE);
+        return load_hash_page(ls->block, addr, host, digest);
     }
+
     return 0;
 }
 
-static int ram_save_complete(QEMUFile *f, void *opaque)
+/* Runs until the channel is drained, marked by RAM_SAVE_FLAG_EOS */
+static void *ram_load_channel_thread(void *opaque)
 {
-    memory_global_sync_dirty_bitmap(get_system_memory());
+    RAMLoadStream *ls = opaque;
+    ram_addr_t addr;
+    int flags;
 
-    /* try transferring iterative blocks of memory */
+    do {
+        addr = qemu_get_be64(ls->f);
 
-    /* flush all remaining blocks regardless of rate limiting */
-    while (true) {
-        int bytes_sent;
+        flags = addr & ~TARGET_PAGE_MASK;
+        addr &= TARGET_PAGE_MASK;
 
-        bytes_sent = ram_save_block(f, true);
-        /* no more blocks to sent */
-        if (bytes_sent < 0) {
+        if (flags & (RAM_SAVE_FLAG_MEM_SIZE | RAM_SAVE_FLAG_COMPRESS_PAGE |
+                     RAM_SAVE_FLAG_CHANNELS)) {
+            fprintf(stderr, "Unexpected record %#x on migration channel\n",
+                    flags);
+            ls->ret = -EINVAL;
             break;
         }
-        bytes_transferred += bytes_sent;
-    }
-    memory_global_dirty_log_stop();
-
-    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+        ls->ret = ram_load_page(ls, addr, flags);
+        if (!ls->ret) {
+            ls->ret = qemu_file_get_error(ls->f);
+        }
+    } while (!ls->ret && !(flags & RAM_SAVE_FLAG_EOS));
 
-    return 0;
+    return NULL;
 }
 
-static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
+/* Waits for every channel to be drained and closes them */
+static int ram_load_channels_fini(void)
 {
-    int ret, rc = 0;
-    unsigned int xh_len;
-    int xh_flags;
-
-    if (!XBZRLE.decoded_buf) {
-        XBZRLE.decoded_buf = g_malloc(TARGET_PAGE_SIZE);
-    }
-
-    /* extract RLE header */
-    xh_flags = qemu_get_byte(f);
-    xh_len = qemu_get_be16(f);
-
-    if (xh_flags != ENCODING_FLAG_XBZRLE) {
-        fprintf(stderr, "Failed to load XBZRLE page - wrong compression!\n");
-        return -1;
-    }
+    int i, ret = 0;
 
-    if (xh_len > TARGET_PAGE_SIZE) {
-        fprintf(stderr, "Failed to load XBZRLE page - len overflow!\n");
-        return -1;
-    }
-    /* load data and decode */
-    qemu_get_buffer(f, XBZRLE.decoded_buf, xh_len);
+    for (i = 0; i < load_channels.count; i++) {
+        RAMLoadStream *ls = &load_channels.streams[i];
 
-    /* decode RLE */
-    ret = xbzrle_decode_buffer(XBZRLE.decoded_buf, xh_len, host,
-                               TARGET_PAGE_SIZE);
-    if (ret == -1) {
-        fprintf(stderr, "Failed to load XBZRLE page - decode error!\n");
-        rc = -1;
-    } else  if (ret > TARGET_PAGE_SIZE) {
-        fprintf(stderr, "Failed to load XBZRLE page - size %d exceeds %d!\n",
-                ret, TARGET_PAGE_SIZE);
-        abort();
+        qemu_thread_join(&ls->thread);
+        if (ls->ret < 0) {
+            ret = ls->ret;
+        }
+        qemu_fclose(ls->f);
+        closesocket(ls->fd);
+        g_free(ls->xbzrle_buf);
     }
+    g_free(load_channels.streams);
+    load_channels.streams = NULL;
+    load_channels.count = 0;
 
-    return rc;
+    return ret;
 }
 
-static inline void *host_from_stream_offset(QEMUFile *f,
-                                            ram_addr_t offset,
-                                            int flags)
+/* The source announced @count streams; accept the ones past the main one */
+static int ram_load_channels_init(int count)
 {
-    static RAMBlock *block = NULL;
-    char id[256];
-    uint8_t len;
-
-    if (flags & RAM_SAVE_FLAG_CONTINUE) {
-        if (!block) {
-            fprintf(stderr, "Ack, bad migration stream!\n");
-            return NULL;
-        }
+    int i;
 
-        return memory_region_get_ram_ptr(block->mr) + offset;
+    if (load_channels.streams || count < 2 || count > MAX_MIGRATE_CHANNELS) {
+        return -EINVAL;
     }
 
-    len = qemu_get_byte(f);
-    qemu_get_buffer(f, (uint8_t *)id, len);
-    id[len] = 0;
-
-    QLIST_FOREACH(block, &ram_list.blocks, next) {
-        if (!strncmp(id, block->idstr, sizeof(id)))
-            return memory_region_get_ram_ptr(block->mr) + offset;
+    load_channels.streams = g_new0(RAMLoadStream, count - 1);
+    for (i = 0; i < count - 1; i++) {
+        RAMLoadStream *ls = &load_channels.streams[i];
+
+        ls->fd = migrate_incoming_accept_channel();
+        if (ls->fd < 0) {
+            /* the channels already up are left alone: the incoming
+             * migration fails as a whole */
+            fprintf(stderr, "Failed to accept migration channel: %s\n",
+                    strerror(-ls->fd));
+            return ls->fd;
+        }
+        ls->f = qemu_fopen_socket(ls->fd);
+        qemu_thread_create(&ls->thread, ram_load_channel_thread, ls,
+                           QEMU_THREAD_JOINABLE);
+        load_channels.count++;
     }
 
-    fprintf(stderr, "Can't find block %s!\n", id);
-    return NULL;
+    return 0;
 }
 
 static int ram_load(QEMUFile *f, void *opaque, int version_id)
@@ -707,6 +2327,8 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
         return -EINVAL;
     }
 
+    load_main.f = f;
+
     do {
         addr = qemu_get_be64(f);
 
@@ -751,45 +2373,38 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
             }
         }
 
-        if (flags & RAM_SAVE_FLAG_COMPRESS) {
-            void *host;
-            uint8_t ch;
-
-            host = host_from_stream_offset(f, addr, flags);
-            if (!host) {
-                return -EINVAL;
-            }
-
-            ch = qemu_get_byte(f);
-            memset(host, ch, TARGET_PAGE_SIZE);
-#ifndef _WIN32
-            if (ch == 0 &&
-                (!kvm_enabled() || kvm_has_sync_mmu())) {
-                qemu_madvise(host, TARGET_PAGE_SIZE, QEMU_MADV_DONTNEED);
+        if ((flags & RAM_SAVE_FLAG_HASH_SYNC) == RAM_SAVE_FLAG_HASH_SYNC) {
+            ret = dedup_sync();
+            if (ret < 0) {
+                goto done;
             }
-#endif
-        } else if (flags & RAM_SAVE_FLAG_PAGE) {
-            void *host;
+        } else if (flags & RAM_SAVE_FLAG_CHANNELS) {
+            uint32_t count = qemu_get_be32(f);
 
-            host = host_from_stream_offset(f, addr, flags);
-            if (!host) {
-                return -EINVAL;
+            if (count) {
+                ret = ram_load_channels_init(count);
+            } else {
+                ret = ram_load_channels_fini();
             }
-
-            qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
-        } else if (flags & RAM_SAVE_FLAG_XBZRLE) {
-            if (!migrate_use_xbzrle()) {
-                return -EINVAL;
+            if (ret < 0) {
+                goto done;
             }
-            void *host = host_from_stream_offset(f, addr, flags);
+        } else if (flags & RAM_SAVE_FLAG_COMPRESS_PAGE) {
+            void *host = host_from_stream_offset(&load_main, addr, flags);
             if (!host) {
-                return -EINVAL;
+                ret = -EINVAL;
+                goto done;
             }
 
-            if (load_xbzrle(f, addr, host) < 0) {
+            if (load_compressed_page(f, host) < 0) {
                 ret = -EINVAL;
                 goto done;
             }
+        } else {
+            ret = ram_load_page(&load_main, addr, flags);
+            if (ret < 0) {
+                goto done;
+            }
         }
         error = qemu_file_get_error(f);
         if (error) {
@@ -799,16 +2414,33 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
     } while (!(flags & RAM_SAVE_FLAG_EOS));
 
 done:
+    if (decompress_threads_drain() < 0 && ret == 0) {
+        ret = -EINVAL;
+    }
+    /* the source reads the answers while it goes on iterating */
+    if (dedup_load.active && dedup_load.nr_requests && ret == 0) {
+        ret = dedup_flush_requests();
+    }
+    if (dedup_load.active && (dedup_load.synced || ret < 0)) {
+        dedup_load_fini();
+    }
     DPRINTF("Completed load of VM with exit code %d seq iteration " PRIu64 "\n",
             ret, seq_iter);
     return ret;
 }
 
+/* Called once the whole incoming stream has been loaded, or has failed */
+static void ram_load_cleanup(void *opaque)
+{
+    decompress_threads_fini();
+}
+
 SaveVMHandlers savevm_ram_handlers = {
     .save_live_setup = ram_save_setup,
     .save_live_iterate = ram_save_iterate,
     .save_live_complete = ram_save_complete,
     .load_state = ram_load,
+    .load_cleanup = ram_load_cleanup,
     .cancel = ram_migration_cancel,
 };
 
@@ -1064,6 +2696,19 @@ int tcg_available(void)
     return 1;
 }
 
+/* Multi-threaded TCG relies on the guest memory ordering being no weaker
+   than the host's, and on the targets' atomic instructions taking the
+   atomic lock.  */
+int mttcg_available(void)
+{
+#if defined(CONFIG_LINUX) && (defined(__i386__) || defined(__x86_64__)) && \
+    (defined(TARGET_I386) || defined(TARGET_ARM))
+    return 1;
+#else
+    return 0;
+#endif
+}
+
 int kvm_available(void)
 {
 #ifdef CONFIG_KVM
@@ -1091,3 +2736,70 @@ TargetInfo *qmp_query_target(Error **errp)
 
     return info;
 }
+
+#ifdef __linux__
+static bool ram_range_is_guest(unsigned long start, unsigned long end)
+{
+    RAMBlock *block;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        unsigned long host = (unsigned long)block->host;
+
+        if (start < host + block->length && host < end) {
+            return true;
+        }
+    }
+    return false;
+}
+
+MemorySharingInfo *qmp_query_memory_sharing(Error **errp)
+{
+    MemorySharingInfo *info;
+    unsigned long start, end;
+    bool guest = false;
+    char line[256];
+    int64_t kb;
+    FILE *f;
+
+    f = fopen("/proc/self/smaps", "r");
+    if (!f) {
+        error_set(errp, QERR_OPEN_FILE_FAILED, "/proc/self/smaps");
+        return NULL;
+    }
+
+    info = g_malloc0(sizeof(*info));
+    info->merge = qemu_ram_mem_merge();
+    while (fgets(line, sizeof(line), f)) {
+        /* a mapping header starts with its address range */
+        if (sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+            guest = ram_range_is_guest(start, end);
+            continue;
+        }
+        if (!guest) {
+            continue;
+        }
+        if (sscanf(line, "Rss: %" SCNd64, &kb) == 1) {
+            info->rss += kb << 10;
+        } else if (sscanf(line, "Shared_Clean: %" SCNd64, &kb) == 1 ||
+                   sscanf(line, "Shared_Dirty: %" SCNd64, &kb) == 1) {
+            info->shared += kb << 10;
+        } else if (sscanf(line, "AnonHugePages: %" SCNd64, &kb) == 1) {
+            info->anon_huge += kb << 10;
+        } else if (sscanf(line, "Swap: %" SCNd64, &kb) == 1) {
+            info->swap += kb << 10;
+        } else if (sscanf(line, "KSM: %" SCNd64, &kb) == 1) {
+            info->has_ksm = true;
+            info->ksm += kb << 10;
+        }
+    }
+    fclose(f);
+
+    return info;
+}
+#else
+MemorySharingInfo *qmp_query_memory_sharing(Error **errp)
+{
+    error_set(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+#endif
@@ -31,6 +31,7 @@ void cpudef_init(void);
 int audio_available(void);
 void audio_init(ISABus *isa_bus, PCIBus *pci_bus);
 int tcg_available(void);
+int mttcg_available(void);
 int kvm_available(void);
 int xen_available(void);
 
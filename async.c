@@ -25,44 +25,107 @@
 #include "qemu-common.h"
 #include "qemu-aio.h"
 #include "main-loop.h"
-
-/* Anchor of the list of Bottom Halves belonging to the context */
-static struct QEMUBH *first_bh;
+#include "qemu-timer.h"
+#include "qemu-barrier.h"
 
 /***********************************************************/
 /* bottom halves (can be seen as timers which expire ASAP) */
 
 struct QEMUBH {
+    AioContext *ctx;
     QEMUBHFunc *cb;
     void *opaque;
     QEMUBH *next;
+    QEMUBH *pending_next;
+    int queued;
     bool scheduled;
     bool idle;
     bool deleted;
 };
 
-QEMUBH *qemu_bh_new(QEMUBHFunc *cb, void *opaque)
+QEMUBH *aio_bh_new(AioContext *ctx, QEMUBHFunc *cb, void *opaque)
 {
     QEMUBH *bh;
     bh = g_malloc0(sizeof(QEMUBH));
+    bh->ctx = ctx;
     bh->cb = cb;
     bh->opaque = opaque;
-    bh->next = first_bh;
-    first_bh = bh;
+    bh->next = ctx->first_bh;
+    ctx->first_bh = bh;
     return bh;
 }
 
-int qemu_bh_poll(void)
+QEMUBH *qemu_bh_new(QEMUBHFunc *cb, void *opaque)
 {
-    QEMUBH *bh, **bhp, *next;
+    return aio_bh_new(qemu_get_aio_context(), cb, opaque);
+}
+
+/* Push @bh on the pending stack of its context unless it is already
+ * there.  This can be called from any thread.
+ */
+static void aio_bh_enqueue(QEMUBH *bh)
+{
+    AioContext *ctx = bh->ctx;
+    QEMUBH *head;
+
+    /* make the scheduled flag visible before the BH can be dequeued */
+    smp_wmb();
+    if (!__sync_bool_compare_and_swap(&bh->queued, 0, 1)) {
+        return;
+    }
+    do {
+        head = ctx->pending_bh;
+        bh->pending_next = head;
+    } while (!__sync_bool_compare_and_swap(&ctx->pending_bh, head, bh));
+}
+
+static void aio_bh_free_deleted(AioContext *ctx)
+{
+    QEMUBH *bh, **bhp;
+
+    bhp = &ctx->first_bh;
+    while (*bhp) {
+        bh = *bhp;
+        /* a deleted BH may still be on the pending stack */
+        if (bh->deleted && !bh->queued) {
+            *bhp = bh->next;
+            g_free(bh);
+            ctx->deleted_bh--;
+        } else {
+            bhp = &bh->next;
+        }
+    }
+}
+
+int aio_bh_poll(AioContext *ctx)
+{
+    QEMUBH *bh, *next, *list, **tail;
     int ret;
-    static int nesting = 0;
 
-    nesting++;
+    ctx->walking_bh++;
+
+    /* Take the whole stack at once, and reverse it so that BHs run
+     * in the order they were scheduled.  The BHs are moved to the
+     * ready list rather than a local one, so that a nested call from
+     * a callback also runs those that were taken here.
+     */
+    bh = __sync_lock_test_and_set(&ctx->pending_bh, NULL);
+    for (list = NULL; bh; bh = next) {
+        next = bh->pending_next;
+        bh->pending_next = list;
+        list = bh;
+    }
+    for (tail = &ctx->ready_bh; *tail; tail = &(*tail)->pending_next) {
+        /* nothing */
+    }
+    *tail = list;
 
     ret = 0;
-    for (bh = first_bh; bh; bh = next) {
-        next = bh->next;
+    while ((bh = ctx->ready_bh)) {
+        ctx->ready_bh = bh->pending_next;
+        /* after this, a new qemu_bh_schedule() queues the BH again */
+        bh->queued = 0;
+        smp_mb();
         if (!bh->deleted && bh->scheduled) {
             bh->scheduled = 0;
             if (!bh->idle)
@@ -72,31 +135,47 @@ int qemu_bh_poll(void)
         }
     }
 
-    nesting--;
+    ctx->walking_bh--;
 
     /* remove deleted bhs */
-    if (!nesting) {
-        bhp = &first_bh;
-        while (*bhp) {
-            bh = *bhp;
-            if (bh->deleted) {
-                *bhp = bh->next;
-                g_free(bh);
-            } else {
-                bhp = &bh->next;
-            }
-        }
+    if (!ctx->walking_bh && ctx->deleted_bh) {
+        aio_bh_free_deleted(ctx);
     }
 
     return ret;
 }
 
+int qemu_bh_poll(void)
+{
+    return aio_bh_poll(qemu_get_aio_context());
+}
+
+/* Other threads only ever push on the pending stack, so the thread
+ * running the context can walk it without taking it.
+ */
+static bool aio_bh_list_pending(QEMUBH *bh)
+{
+    for (; bh; bh = bh->pending_next) {
+        if (!bh->deleted && bh->scheduled) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool aio_bh_pending(AioContext *ctx)
+{
+    return aio_bh_list_pending(ctx->ready_bh) ||
+           aio_bh_list_pending(ctx->pending_bh);
+}
+
 void qemu_bh_schedule_idle(QEMUBH *bh)
 {
     if (bh->scheduled)
         return;
     bh->scheduled = 1;
     bh->idle = 1;
+    aio_bh_enqueue(bh);
 }
 
 void qemu_bh_schedule(QEMUBH *bh)
@@ -105,10 +184,15 @@ void qemu_bh_schedule(QEMUBH *bh)
         return;
     bh->scheduled = 1;
     bh->idle = 0;
-    /* stop the currently executing CPU to execute the BH ASAP */
-    qemu_notify_event();
+    aio_bh_enqueue(bh);
+    /* wake up the context's thread; for the main loop, this stops the
+     * currently executing CPU to execute the BH ASAP */
+    aio_notify(bh->ctx);
 }
 
+/* A cancelled or deleted BH stays on the pending stack, and is
+ * skipped when the stack is processed.
+ */
 void qemu_bh_cancel(QEMUBH *bh)
 {
     bh->scheduled = 0;
@@ -117,14 +201,16 @@ void qemu_bh_cancel(QEMUBH *bh)
 void qemu_bh_delete(QEMUBH *bh)
 {
     bh->scheduled = 0;
-    bh->deleted = 1;
+    if (!bh->deleted) {
+        bh->deleted = 1;
+        bh->ctx->deleted_bh++;
+    }
 }
 
-void qemu_bh_update_timeout(uint32_t *timeout)
+/* Returns true if a BH on the list must run immediately */
+static bool aio_bh_list_timeout(QEMUBH *bh, uint32_t *timeout)
 {
-    QEMUBH *bh;
-
-    for (bh = first_bh; bh; bh = bh->next) {
+    for (; bh; bh = bh->pending_next) {
         if (!bh->deleted && bh->scheduled) {
             if (bh->idle) {
                 /* idle bottom halves will be polled at least
@@ -134,9 +220,296 @@ void qemu_bh_update_timeout(uint32_t *timeout)
                 /* non-idle bottom halves will be executed
                  * immediately */
                 *timeout = 0;
-                break;
+                return true;
             }
         }
     }
+    return false;
 }
 
+void aio_bh_update_timeout(AioContext *ctx, uint32_t *timeout)
+{
+    int64_t deadline;
+
+    if (aio_bh_list_timeout(ctx->ready_bh, timeout) ||
+        aio_bh_list_timeout(ctx->pending_bh, timeout)) {
+        return;
+    }
+
+    deadline = aio_timers_deadline(ctx);
+    if (deadline >= 0) {
+        *timeout = MIN((deadline + SCALE_MS - 1) / SCALE_MS, *timeout);
+    }
+}
+
+void qemu_bh_update_timeout(uint32_t *timeout)
+{
+    aio_bh_update_timeout(qemu_get_aio_context(), timeout);
+}
+
+/***********************************************************/
+/* timers */
+
+/*
+ * The active timers of a context on one clock, sorted by expiry time.
+ * Times on different clocks cannot be compared, so each clock that
+ * the context's timers use gets a list of its own.
+ */
+struct AioTimerList {
+    AioContext *ctx;
+    QEMUClock *clock;               /* NULL for get_clock() */
+    AioTimer *active_timers;
+    Notifier enable_notifier;
+    QLIST_ENTRY(AioTimerList) next;
+};
+
+struct AioTimer {
+    AioTimerList *list;
+    AioTimerFunc *cb;
+    void *opaque;
+    int64_t expire_time;            /* nanoseconds of the list's clock */
+    bool pending;
+    AioTimer *next;
+};
+
+static int64_t aio_timer_list_now(AioTimerList *tl)
+{
+    return tl->clock ? qemu_get_clock_ns(tl->clock) : get_clock();
+}
+
+static bool aio_timer_list_enabled(AioTimerList *tl)
+{
+    return !tl->clock || qemu_clock_enabled(tl->clock);
+}
+
+/* A stopped clock was restarted, its timers may be due */
+static void aio_timer_list_enabled_cb(Notifier *notifier, void *data)
+{
+    AioTimerList *tl = container_of(notifier, AioTimerList, enable_notifier);
+
+    if (tl->active_timers) {
+        aio_notify(tl->ctx);
+    }
+}
+
+static AioTimerList *aio_timer_list_get(AioContext *ctx, QEMUClock *clock)
+{
+    AioTimerList *tl;
+
+    QLIST_FOREACH(tl, &ctx->timer_lists, next) {
+        if (tl->clock == clock) {
+            return tl;
+        }
+    }
+
+    tl = g_malloc0(sizeof(*tl));
+    tl->ctx = ctx;
+    tl->clock = clock;
+    if (clock) {
+        tl->enable_notifier.notify = aio_timer_list_enabled_cb;
+        qemu_register_clock_enable_notifier(clock, &tl->enable_notifier);
+    }
+    QLIST_INSERT_HEAD(&ctx->timer_lists, tl, next);
+    return tl;
+}
+
+AioTimer *aio_timer_new_clock(AioContext *ctx, QEMUClock *clock,
+                              AioTimerFunc *cb, void *opaque)
+{
+    AioTimer *ts = g_malloc0(sizeof(*ts));
+
+    ts->list = aio_timer_list_get(ctx, clock);
+    ts->cb = cb;
+    ts->opaque = opaque;
+    return ts;
+}
+
+AioTimer *aio_timer_new(AioContext *ctx, AioTimerFunc *cb, void *opaque)
+{
+    return aio_timer_new_clock(ctx, NULL, cb, opaque);
+}
+
+void aio_timer_free(AioTimer *ts)
+{
+    aio_timer_del(ts);
+    g_free(ts);
+}
+
+void aio_timer_del(AioTimer *ts)
+{
+    AioTimer **pt;
+
+    if (!ts->pending) {
+        return;
+    }
+    for (pt = &ts->list->active_timers; *pt != ts; pt = &(*pt)->next) {
+        assert(*pt);
+    }
+    *pt = ts->next;
+    ts->pending = false;
+}
+
+/* Arm @ts to fire at @expire_time, replacing an earlier expiry */
+void aio_timer_mod(AioTimer *ts, int64_t expire_time)
+{
+    AioTimerList *tl = ts->list;
+    AioTimer **pt;
+
+    aio_timer_del(ts);
+
+    /* keep the list sorted, first timer to expire at the head */
+    for (pt = &tl->active_timers; *pt; pt = &(*pt)->next) {
+        if ((*pt)->expire_time > expire_time) {
+            break;
+        }
+    }
+    ts->expire_time = expire_time;
+    ts->next = *pt;
+    ts->pending = true;
+    *pt = ts;
+
+    /* the thread may be sleeping past the new expiry */
+    if (pt == &tl->active_timers && aio_timer_list_enabled(tl)) {
+        aio_notify(tl->ctx);
+    }
+}
+
+bool aio_timer_pending(AioTimer *ts)
+{
+    return ts->pending;
+}
+
+int64_t aio_timers_deadline(AioContext *ctx)
+{
+    AioTimerList *tl;
+    int64_t deadline = -1, delta;
+
+    QLIST_FOREACH(tl, &ctx->timer_lists, next) {
+        if (!tl->active_timers || !aio_timer_list_enabled(tl)) {
+            continue;
+        }
+        delta = MAX(tl->active_timers->expire_time - aio_timer_list_now(tl), 0);
+        if (deadline < 0 || delta < deadline) {
+            deadline = delta;
+        }
+    }
+    return deadline;
+}
+
+bool aio_timers_run(AioContext *ctx)
+{
+    AioTimerList *tl;
+    AioTimer *ts;
+    int64_t now;
+    bool ran = false;
+
+    QLIST_FOREACH(tl, &ctx->timer_lists, next) {
+        if (!tl->active_timers || !aio_timer_list_enabled(tl)) {
+            continue;
+        }
+
+        now = aio_timer_list_now(tl);
+        while ((ts = tl->active_timers) && ts->expire_time <= now) {
+            /* remove the timer before calling the callback, which may
+             * rearm it */
+            tl->active_timers = ts->next;
+            ts->pending = false;
+            ts->cb(ts->opaque);
+            ran = true;
+        }
+    }
+    return ran;
+}
+
+/***********************************************************/
+/* contexts */
+
+static void aio_notify_read(void *opaque)
+{
+    AioContext *ctx = opaque;
+    char buf[16];
+    ssize_t len;
+
+    do {
+        len = read(ctx->notify_fds[0], buf, sizeof(buf));
+    } while (len == sizeof(buf) || (len < 0 && errno == EINTR));
+}
+
+static void aio_context_init(AioContext *ctx)
+{
+    QLIST_INIT(&ctx->aio_handlers);
+    QLIST_INIT(&ctx->timer_lists);
+    ctx->notify_fds[0] = ctx->notify_fds[1] = -1;
+}
+
+AioContext *aio_context_new(void)
+{
+    AioContext *ctx = g_malloc0(sizeof(*ctx));
+
+    aio_context_init(ctx);
+#ifndef _WIN32
+    if (qemu_eventfd(ctx->notify_fds) < 0) {
+        ctx->notify_fds[0] = ctx->notify_fds[1] = -1;
+    } else {
+        fcntl(ctx->notify_fds[0], F_SETFL, O_NONBLOCK);
+        fcntl(ctx->notify_fds[1], F_SETFL, O_NONBLOCK);
+        aio_set_fd_handler(ctx, ctx->notify_fds[0], aio_notify_read, NULL,
+                           NULL, ctx);
+    }
+#endif
+    return ctx;
+}
+
+void aio_context_free(AioContext *ctx)
+{
+    QEMUBH *bh, *next;
+    AioTimerList *tl, *next_tl;
+
+    if (ctx->notify_fds[0] >= 0) {
+        aio_set_fd_handler(ctx, ctx->notify_fds[0], NULL, NULL, NULL, NULL);
+        close(ctx->notify_fds[0]);
+        close(ctx->notify_fds[1]);
+    }
+
+    assert(QLIST_EMPTY(&ctx->aio_handlers));
+    QLIST_FOREACH_SAFE(tl, &ctx->timer_lists, next, next_tl) {
+        assert(!tl->active_timers);
+        if (tl->clock) {
+            qemu_unregister_clock_enable_notifier(tl->clock,
+                                                  &tl->enable_notifier);
+        }
+        g_free(tl);
+    }
+    for (bh = ctx->first_bh; bh; bh = next) {
+        next = bh->next;
+        assert(bh->deleted);
+        g_free(bh);
+    }
+    g_free(ctx);
+}
+
+AioContext *qemu_get_aio_context(void)
+{
+    static AioContext *qemu_aio_context;
+
+    if (!qemu_aio_context) {
+        qemu_aio_context = g_malloc0(sizeof(*qemu_aio_context));
+        aio_context_init(qemu_aio_context);
+    }
+    return qemu_aio_context;
+}
+
+void aio_notify(AioContext *ctx)
+{
+    /* eventfd needs 8 bytes; a pipe does not care */
+    static const uint64_t val = 1;
+
+    if (ctx->notify_fds[1] < 0) {
+        qemu_notify_event();
+        return;
+    }
+    /* a full pipe or eventfd counter already has a wakeup pending */
+    if (write(ctx->notify_fds[1], &val, sizeof(val)) < 0) {
+        /* nothing to do */
+    }
+}
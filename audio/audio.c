@@ -1123,7 +1123,11 @@ static int audio_is_timer_needed (void)
 static void audio_reset_timer (AudioState *s)
 {
     if (audio_is_timer_needed ()) {
-        qemu_mod_timer (s->ts, qemu_get_clock_ns (vm_clock) + 1);
+        /* voices being enabled must not push a pending run further out */
+        if (!qemu_timer_pending (s->ts)) {
+            qemu_mod_timer (s->ts,
+                            qemu_get_clock_ns (vm_clock) + conf.period.ticks);
+        }
     }
     else {
         qemu_del_timer (s->ts);
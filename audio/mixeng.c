@@ -155,6 +155,84 @@
 #undef ITYPE
 #undef SHIFT
 
+/*
+ * Signed 16 bit native stereo is what nearly every guest device and
+ * backend use, so its conversions get SSE2 versions.  The samples are
+ * 64 bit fixed point, for which SSE2 has no multiply, so volume and
+ * rate conversion stay scalar.
+ */
+#if defined(__SSE2__) && !defined(FLOAT_MIXENG)
+#include <emmintrin.h>
+
+static void conv_s16_stereo_sse2 (struct st_sample *dst, const void *src,
+                                  int samples)
+{
+    const int16_t *in = src;
+    __m128i zero = _mm_setzero_si128 ();
+    int i;
+
+    for (i = 0; i + 4 <= samples; i += 4) {
+        __m128i x = _mm_loadu_si128 ((const __m128i *) (in + i * 2));
+        /* v << 16 as 32 bit, then sign extended to 64 bit */
+        __m128i lo = _mm_unpacklo_epi16 (zero, x);
+        __m128i hi = _mm_unpackhi_epi16 (zero, x);
+        __m128i lo_sign = _mm_srai_epi32 (lo, 31);
+        __m128i hi_sign = _mm_srai_epi32 (hi, 31);
+        __m128i *out = (__m128i *) (dst + i);
+
+        _mm_storeu_si128 (out, _mm_unpacklo_epi32 (lo, lo_sign));
+        _mm_storeu_si128 (out + 1, _mm_unpackhi_epi32 (lo, lo_sign));
+        _mm_storeu_si128 (out + 2, _mm_unpacklo_epi32 (hi, hi_sign));
+        _mm_storeu_si128 (out + 3, _mm_unpackhi_epi32 (hi, hi_sign));
+    }
+    conv_natural_int16_t_to_stereo (dst + i, in + i * 2, samples - i);
+}
+
+/* The thresholds of clip_natural_int16_t, on four channel values */
+static inline __m128i clip_s16_sse2 (__m128i a, __m128i b)
+{
+    __m128i a_split = _mm_shuffle_epi32 (a, _MM_SHUFFLE (3, 1, 2, 0));
+    __m128i b_split = _mm_shuffle_epi32 (b, _MM_SHUFFLE (3, 1, 2, 0));
+    __m128i low = _mm_unpacklo_epi64 (a_split, b_split);
+    __m128i high = _mm_unpackhi_epi64 (a_split, b_split);
+    /* does the 64 bit value fit in 32 bits? */
+    __m128i fits = _mm_cmpeq_epi32 (high, _mm_srai_epi32 (low, 31));
+    __m128i max = _mm_set1_epi32 (SHRT_MAX);
+    __m128i top = _mm_cmpgt_epi32 (low, _mm_set1_epi32 (0x7f000000 - 1));
+    __m128i val = _mm_or_si128 (_mm_andnot_si128 (top, _mm_srai_epi32 (low, 16)),
+                                _mm_and_si128 (top, max));
+    /* SHRT_MAX or, for negative values, SHRT_MIN */
+    __m128i sat = _mm_xor_si128 (max, _mm_srai_epi32 (high, 31));
+
+    return _mm_or_si128 (_mm_and_si128 (fits, val),
+                         _mm_andnot_si128 (fits, sat));
+}
+
+static void clip_s16_stereo_sse2 (void *dst, const struct st_sample *src,
+                                  int samples)
+{
+    int16_t *out = dst;
+    int i;
+
+    for (i = 0; i + 4 <= samples; i += 4) {
+        const __m128i *in = (const __m128i *) (src + i);
+        __m128i lo = clip_s16_sse2 (_mm_loadu_si128 (in),
+                                    _mm_loadu_si128 (in + 1));
+        __m128i hi = clip_s16_sse2 (_mm_loadu_si128 (in + 2),
+                                    _mm_loadu_si128 (in + 3));
+
+        _mm_storeu_si128 ((__m128i *) (out + i * 2), _mm_packs_epi32 (lo, hi));
+    }
+    clip_natural_int16_t_from_stereo (out + i * 2, src + i, samples - i);
+}
+
+#define CONV_S16_STEREO conv_s16_stereo_sse2
+#define CLIP_S16_STEREO clip_s16_stereo_sse2
+#else
+#define CONV_S16_STEREO conv_natural_int16_t_to_stereo
+#define CLIP_S16_STEREO clip_natural_int16_t_from_stereo
+#endif
+
 t_sample *mixeng_conv[2][2][2][3] = {
     {
         {
@@ -198,7 +276,7 @@ t_sample *mixeng_conv[2][2][2][3] = {
         {
             {
                 conv_natural_int8_t_to_stereo,
-                conv_natural_int16_t_to_stereo,
+                CONV_S16_STEREO,
                 conv_natural_int32_t_to_stereo
             },
             {
@@ -253,7 +331,7 @@ f_sample *mixeng_clip[2][2][2][3] = {
         {
             {
                 clip_natural_int8_t_from_stereo,
-                clip_natural_int16_t_from_stereo,
+                CLIP_S16_STEREO,
                 clip_natural_int32_t_from_stereo
             },
             {
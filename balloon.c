@@ -34,7 +34,9 @@
 
 static QEMUBalloonEvent *balloon_event_fn;
 static QEMUBalloonStatus *balloon_stat_fn;
+static QEMUBalloonFreePageHint *balloon_free_page_fn;
 static void *balloon_opaque;
+static bool balloon_inhibited;
 
 int qemu_add_balloon_handler(QEMUBalloonEvent *event_func,
                              QEMUBalloonStatus *stat_func, void *opaque)
@@ -59,9 +61,39 @@ void qemu_remove_balloon_handler(void *opaque)
     }
     balloon_event_fn = NULL;
     balloon_stat_fn = NULL;
+    balloon_free_page_fn = NULL;
     balloon_opaque = NULL;
 }
 
+void qemu_set_balloon_free_page_handler(QEMUBalloonFreePageHint *hint_func,
+                                        void *opaque)
+{
+    if (balloon_opaque != opaque) {
+        return;
+    }
+    balloon_free_page_fn = hint_func;
+}
+
+void qemu_balloon_free_page_hint(bool start)
+{
+    if (balloon_free_page_fn) {
+        balloon_free_page_fn(balloon_opaque, start);
+    }
+}
+
+/* While set, guest pages must stay where they are: they are registered
+ * with an RDMA device, which keeps using the old ones if they are
+ * discarded and faulted back in. */
+void qemu_balloon_inhibit(bool state)
+{
+    balloon_inhibited = state;
+}
+
+bool qemu_balloon_is_inhibited(void)
+{
+    return balloon_inhibited;
+}
+
 static int qemu_balloon(ram_addr_t target)
 {
     if (!balloon_event_fn) {
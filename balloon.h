@@ -19,11 +19,21 @@
 
 typedef void (QEMUBalloonEvent)(void *opaque, ram_addr_t target);
 typedef void (QEMUBalloonStatus)(void *opaque, BalloonInfo *info);
+typedef void (QEMUBalloonFreePageHint)(void *opaque, bool start);
 
 int qemu_add_balloon_handler(QEMUBalloonEvent *event_func,
 			     QEMUBalloonStatus *stat_func, void *opaque);
 void qemu_remove_balloon_handler(void *opaque);
+void qemu_set_balloon_free_page_handler(QEMUBalloonFreePageHint *hint_func,
+                                        void *opaque);
+
+/* Ask the guest to report its free pages, which are then cleared from the
+ * migration dirty bitmap, or stop it.  Called with the iothread lock held,
+ * and hints are only applied between the two calls. */
+void qemu_balloon_free_page_hint(bool start);
 
 void qemu_balloon_changed(int64_t actual);
+void qemu_balloon_inhibit(bool state);
+bool qemu_balloon_is_inhibited(void);
 
 #endif
@@ -193,6 +193,47 @@ static inline int test_and_change_bit(int nr, unsigned long *addr)
 	return (old & mask) != 0;
 }
 
+/**
+ * set_bit_atomic - Atomically set a bit in memory
+ * @nr: the bit to set
+ * @addr: the address to start counting from
+ *
+ * Safe against concurrent updates of other bits in the same word.
+ */
+static inline void set_bit_atomic(int nr, unsigned long *addr)
+{
+    unsigned long mask = BIT_MASK(nr);
+    unsigned long *p = addr + BIT_WORD(nr);
+
+    __sync_fetch_and_or(p, mask);
+}
+
+/**
+ * test_and_set_bit_atomic - Atomically set a bit and return its old value
+ * @nr: Bit to set
+ * @addr: Address to count from
+ */
+static inline int test_and_set_bit_atomic(int nr, unsigned long *addr)
+{
+    unsigned long mask = BIT_MASK(nr);
+    unsigned long *p = addr + BIT_WORD(nr);
+
+    return (__sync_fetch_and_or(p, mask) & mask) != 0;
+}
+
+/**
+ * test_and_clear_bit_atomic - Atomically clear a bit and return its old value
+ * @nr: Bit to clear
+ * @addr: Address to count from
+ */
+static inline int test_and_clear_bit_atomic(int nr, unsigned long *addr)
+{
+    unsigned long mask = BIT_MASK(nr);
+    unsigned long *p = addr + BIT_WORD(nr);
+
+    return (__sync_fetch_and_and(p, ~mask) & mask) != 0;
+}
+
 /**
  * test_bit - Determine whether a bit is set
  * @nr: bit number to test
@@ -21,6 +21,8 @@
 #include "block-migration.h"
 #include "migration.h"
 #include "blockdev.h"
+#include "main-loop.h"
+#include "bitmap.h"
 #include <assert.h>
 
 #define BLOCK_SIZE (BDRV_SECTORS_PER_DIRTY_CHUNK << BDRV_SECTOR_BITS)
@@ -28,6 +30,7 @@
 #define BLK_MIG_FLAG_DEVICE_BLOCK       0x01
 #define BLK_MIG_FLAG_EOS                0x02
 #define BLK_MIG_FLAG_PROGRESS           0x04
+#define BLK_MIG_FLAG_ZERO_BLOCK         0x08
 
 #define MAX_IS_ALLOCATED_SEARCH 65536
 
@@ -51,6 +54,7 @@ typedef struct BlkMigDevState {
     int64_t total_sectors;
     int64_t dirty;
     QSIMPLEQ_ENTRY(BlkMigDevState) entry;
+    /* one bit per chunk with a read in flight */
     unsigned long *aio_bitmap;
 } BlkMigDevState;
 
@@ -80,6 +84,7 @@ typedef struct BlkMigState {
     long double total_time;
     long double prev_time_offset;
     int reads;
+    int inflight_limit;
 } BlkMigState;
 
 static BlkMigState block_mig_state;
@@ -100,6 +105,21 @@ static void blk_send(QEMUFile *f, BlkMigBlock * blk)
     qemu_put_buffer(f, blk->buf, BLOCK_SIZE);
 }
 
+/* Tells the destination to zero a range instead of sending it */
+static void blk_send_zero(QEMUFile *f, BlkMigDevState *bmds, int64_t sector,
+                          int nr_sectors)
+{
+    int len;
+
+    qemu_put_be64(f, (sector << BDRV_SECTOR_BITS) | BLK_MIG_FLAG_ZERO_BLOCK);
+
+    len = strlen(bmds->bs->device_name);
+    qemu_put_byte(f, len);
+    qemu_put_buffer(f, (uint8_t *)bmds->bs->device_name, len);
+
+    qemu_put_be32(f, nr_sectors);
+}
+
 int blk_mig_active(void)
 {
     return !QSIMPLEQ_EMPTY(&block_mig_state.bmds_list);
@@ -142,9 +162,8 @@ static int bmds_aio_inflight(BlkMigDevState *bmds, int64_t sector)
 {
     int64_t chunk = sector / (int64_t)BDRV_SECTORS_PER_DIRTY_CHUNK;
 
-    if ((sector << BDRV_SECTOR_BITS) < bdrv_getlength(bmds->bs)) {
-        return !!(bmds->aio_bitmap[chunk / (sizeof(unsigned long) * 8)] &
-            (1UL << (chunk % (sizeof(unsigned long) * 8))));
+    if (sector < bmds->total_sectors) {
+        return test_bit(chunk, bmds->aio_bitmap);
     } else {
         return 0;
     }
@@ -154,34 +173,21 @@ static void bmds_set_aio_inflight(BlkMigDevState *bmds, int64_t sector_num,
                              int nb_sectors, int set)
 {
     int64_t start, end;
-    unsigned long val, idx, bit;
 
     start = sector_num / BDRV_SECTORS_PER_DIRTY_CHUNK;
     end = (sector_num + nb_sectors - 1) / BDRV_SECTORS_PER_DIRTY_CHUNK;
 
-    for (; start <= end; start++) {
-        idx = start / (sizeof(unsigned long) * 8);
-        bit = start % (sizeof(unsigned long) * 8);
-        val = bmds->aio_bitmap[idx];
-        if (set) {
-            val |= 1UL << bit;
-        } else {
-            val &= ~(1UL << bit);
-        }
-        bmds->aio_bitmap[idx] = val;
+    if (set) {
+        bitmap_set(bmds->aio_bitmap, start, end - start + 1);
+    } else {
+        bitmap_clear(bmds->aio_bitmap, start, end - start + 1);
     }
 }
 
 static void alloc_aio_bitmap(BlkMigDevState *bmds)
 {
-    BlockDriverState *bs = bmds->bs;
-    int64_t bitmap_size;
-
-    bitmap_size = (bdrv_getlength(bs) >> BDRV_SECTOR_BITS) +
-            BDRV_SECTORS_PER_DIRTY_CHUNK * 8 - 1;
-    bitmap_size /= BDRV_SECTORS_PER_DIRTY_CHUNK * 8;
-
-    bmds->aio_bitmap = g_malloc0(bitmap_size);
+    bmds->aio_bitmap = bitmap_new(DIV_ROUND_UP(bmds->total_sectors,
+                                               BDRV_SECTORS_PER_DIRTY_CHUNK));
 }
 
 static void blk_mig_read_cb(void *opaque, int ret)
@@ -211,10 +217,18 @@ static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds)
     BlkMigBlock *blk;
     int nr_sectors;
 
-    if (bmds->shared_base) {
+    /* Unallocated ranges come from the shared base on the destination,
+     * or read as zeroes if there is no backing file; in the latter case,
+     * with the zero-range capability, the destination zeroes them without
+     * the data going over the wire.
+     */
+    if (bmds->shared_base || (!bs->backing_hd && migrate_use_zero_range())) {
         while (cur_sector < total_sectors &&
                !bdrv_is_allocated(bs, cur_sector, MAX_IS_ALLOCATED_SEARCH,
                                   &nr_sectors)) {
+            if (!bmds->shared_base) {
+                blk_send_zero(f, bmds, cur_sector, nr_sectors);
+            }
             cur_sector += nr_sectors;
         }
     }
@@ -312,6 +326,7 @@ static void init_blk_migration(QEMUFile *f)
     block_mig_state.bulk_completed = 0;
     block_mig_state.total_time = 0;
     block_mig_state.reads = 0;
+    block_mig_state.inflight_limit = migrate_block_inflight();
 
     bdrv_iterate(init_blk_migration_it, NULL);
 }
@@ -371,55 +386,54 @@ static int mig_save_device_dirty(QEMUFile *f, BlkMigDevState *bmds,
     int nr_sectors;
     int ret = -EIO;
 
-    for (sector = bmds->cur_dirty; sector < bmds->total_sectors;) {
-        if (bmds_aio_inflight(bmds, sector)) {
-            bdrv_drain_all();
-        }
-        if (bdrv_get_dirty(bmds->bs, sector)) {
+    sector = bdrv_get_next_dirty(bmds->bs, bmds->cur_dirty);
+    if (sector < 0) {
+        bmds->cur_dirty = total_sectors;
+        return 1;
+    }
+    bmds->cur_dirty = sector;
 
-            if (total_sectors - sector < BDRV_SECTORS_PER_DIRTY_CHUNK) {
-                nr_sectors = total_sectors - sector;
-            } else {
-                nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
-            }
-            blk = g_malloc(sizeof(BlkMigBlock));
-            blk->buf = g_malloc(BLOCK_SIZE);
-            blk->bmds = bmds;
-            blk->sector = sector;
-            blk->nr_sectors = nr_sectors;
-
-            if (is_async) {
-                blk->iov.iov_base = blk->buf;
-                blk->iov.iov_len = nr_sectors * BDRV_SECTOR_SIZE;
-                qemu_iovec_init_external(&blk->qiov, &blk->iov, 1);
-
-                if (block_mig_state.submitted == 0) {
-                    block_mig_state.prev_time_offset = qemu_get_clock_ns(rt_clock);
-                }
+    if (bmds_aio_inflight(bmds, sector)) {
+        bdrv_drain_all();
+    }
 
-                blk->aiocb = bdrv_aio_readv(bmds->bs, sector, &blk->qiov,
-                                            nr_sectors, blk_mig_read_cb, blk);
-                block_mig_state.submitted++;
-                bmds_set_aio_inflight(bmds, sector, nr_sectors, 1);
-            } else {
-                ret = bdrv_read(bmds->bs, sector, blk->buf, nr_sectors);
-                if (ret < 0) {
-                    goto error;
-                }
-                blk_send(f, blk);
+    if (total_sectors - sector < BDRV_SECTORS_PER_DIRTY_CHUNK) {
+        nr_sectors = total_sectors - sector;
+    } else {
+        nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
+    }
+    blk = g_malloc(sizeof(BlkMigBlock));
+    blk->buf = g_malloc(BLOCK_SIZE);
+    blk->bmds = bmds;
+    blk->sector = sector;
+    blk->nr_sectors = nr_sectors;
 
-                g_free(blk->buf);
-                g_free(blk);
-            }
+    if (is_async) {
+        blk->iov.iov_base = blk->buf;
+        blk->iov.iov_len = nr_sectors * BDRV_SECTOR_SIZE;
+        qemu_iovec_init_external(&blk->qiov, &blk->iov, 1);
 
-            bdrv_reset_dirty(bmds->bs, sector, nr_sectors);
-            break;
+        if (block_mig_state.submitted == 0) {
+            block_mig_state.prev_time_offset = qemu_get_clock_ns(rt_clock);
         }
-        sector += BDRV_SECTORS_PER_DIRTY_CHUNK;
-        bmds->cur_dirty = sector;
+
+        blk->aiocb = bdrv_aio_readv(bmds->bs, sector, &blk->qiov,
+                                    nr_sectors, blk_mig_read_cb, blk);
+        block_mig_state.submitted++;
+        bmds_set_aio_inflight(bmds, sector, nr_sectors, 1);
+    } else {
+        ret = bdrv_read(bmds->bs, sector, blk->buf, nr_sectors);
+        if (ret < 0) {
+            goto error;
+        }
+        blk_send(f, blk);
+
+        g_free(blk->buf);
+        g_free(blk);
     }
 
-    return (bmds->cur_dirty >= bmds->total_sectors);
+    bdrv_reset_dirty(bmds->bs, sector, nr_sectors);
+    return 0;
 
 error:
     DPRINTF("Error reading sector %" PRId64 "\n", sector);
@@ -476,6 +490,26 @@ static void flush_blks(QEMUFile* f)
             block_mig_state.transferred);
 }
 
+/*
+ * During the bulk phase reads run ahead of the stream, up to the configured
+ * number in flight, so that the disks see a deep queue even when the rate
+ * limit of one slice is only a few blocks.  Dirty blocks are read as the
+ * bandwidth allows.
+ */
+static int blk_mig_can_submit(QEMUFile *f)
+{
+    int64_t queued = (int64_t)(block_mig_state.submitted +
+                               block_mig_state.read_done) * BLOCK_SIZE;
+    int64_t limit = qemu_file_get_rate_limit(f);
+
+    if (block_mig_state.bulk_completed == 0) {
+        return block_mig_state.submitted < block_mig_state.inflight_limit &&
+               queued < MAX(limit, (int64_t)block_mig_state.inflight_limit *
+                                   BLOCK_SIZE);
+    }
+    return queued < limit;
+}
+
 static int64_t get_remaining_dirty(void)
 {
     BlkMigDevState *bmds;
@@ -575,20 +609,22 @@ static int block_save_iterate(QEMUFile *f, void *opaque)
     DPRINTF("Enter save live iterate submitted %d transferred %d\n",
             block_mig_state.submitted, block_mig_state.transferred);
 
+    /* The migration thread calls us without the iothread lock, but the
+     * block layer is not thread-safe.  */
+    qemu_mutex_lock_iothread();
+
     flush_blks(f);
 
     ret = qemu_file_get_error(f);
     if (ret) {
         blk_mig_cleanup();
-        return ret;
+        goto out;
     }
 
     blk_mig_reset_dirty_cursor();
 
     /* control the rate of transfer */
-    while ((block_mig_state.submitted +
-            block_mig_state.read_done) * BLOCK_SIZE <
-           qemu_file_get_rate_limit(f)) {
+    while (blk_mig_can_submit(f)) {
         if (block_mig_state.bulk_completed == 0) {
             /* first finish the bulk phase */
             if (blk_mig_save_bulked_block(f) == 0) {
@@ -608,12 +644,16 @@ static int block_save_iterate(QEMUFile *f, void *opaque)
     ret = qemu_file_get_error(f);
     if (ret) {
         blk_mig_cleanup();
-        return ret;
+        goto out;
     }
 
     qemu_put_be64(f, BLK_MIG_FLAG_EOS);
 
-    return is_stage2_completed();
+    ret = is_stage2_completed();
+
+out:
+    qemu_mutex_unlock_iothread();
+    return ret;
 }
 
 static int block_save_complete(QEMUFile *f, void *opaque)
@@ -713,6 +753,23 @@ static int block_load(QEMUFile *f, void *opaque, int version_id)
             if (ret < 0) {
                 return ret;
             }
+        } else if (flags & BLK_MIG_FLAG_ZERO_BLOCK) {
+            len = qemu_get_byte(f);
+            qemu_get_buffer(f, (uint8_t *)device_name, len);
+            device_name[len] = '\0';
+
+            bs = bdrv_find(device_name);
+            if (!bs) {
+                fprintf(stderr, "Error unknown block device %s\n",
+                        device_name);
+                return -EINVAL;
+            }
+
+            nr_sectors = qemu_get_be32(f);
+            ret = bdrv_write_zeroes(bs, addr, nr_sectors);
+            if (ret < 0) {
+                return ret;
+            }
         } else if (flags & BLK_MIG_FLAG_PROGRESS) {
             if (!banner_printed) {
                 printf("Receiving block device images\n");
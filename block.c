@@ -31,6 +31,9 @@
 #include "qemu-coroutine.h"
 #include "qmp-commands.h"
 #include "qemu-timer.h"
+#include "bitops.h"
+#include "bitmap.h"
+#include "qemu-throttle.h"
 
 #ifdef CONFIG_BSD
 #include <sys/types.h>
@@ -51,6 +54,7 @@
 typedef enum {
     BDRV_REQ_COPY_ON_READ = 0x1,
     BDRV_REQ_ZERO_WRITE   = 0x2,
+    BDRV_REQ_BACKGROUND   = 0x4,    /* block job copy-on-read */
 } BdrvRequestFlags;
 
 static void bdrv_dev_change_media_cb(BlockDriverState *bs, bool load);
@@ -82,13 +86,16 @@ static BlockDriverAIOCB *bdrv_co_aio_rw_vector(BlockDriverState *bs,
 static void coroutine_fn bdrv_co_do_rw(void *opaque);
 static int coroutine_fn bdrv_co_do_write_zeroes(BlockDriverState *bs,
     int64_t sector_num, int nb_sectors);
-
-static bool bdrv_exceed_bps_limits(BlockDriverState *bs, int nb_sectors,
-        bool is_write, double elapsed_time, uint64_t *wait);
-static bool bdrv_exceed_iops_limits(BlockDriverState *bs, bool is_write,
-        double elapsed_time, uint64_t *wait);
-static bool bdrv_exceed_io_limits(BlockDriverState *bs, int nb_sectors,
-        bool is_write, int64_t *wait);
+static void bdrv_layer_acct_start(BlockDriverState *bs,
+                                  BlockAcctCookie *cookie, int64_t bytes,
+                                  enum BlockAcctType type);
+static void bdrv_layer_acct_done(BlockDriverState *bs, BlockAcctCookie *cookie);
+static void bdrv_set_dirty_bitmaps(BlockDriverState *bs, int64_t sector_num,
+                                   int nb_sectors);
+static void bdrv_dirty_bitmaps_set_all(BlockDriverState *bs);
+static void bdrv_release_all_dirty_bitmaps(BlockDriverState *bs);
+static int bdrv_dirty_bitmaps_resize(BlockDriverState *bs, int64_t size,
+                                     bool check_only);
 
 static QTAILQ_HEAD(, BlockDriverState) bdrv_states =
     QTAILQ_HEAD_INITIALIZER(bdrv_states);
@@ -96,6 +103,39 @@ static QTAILQ_HEAD(, BlockDriverState) bdrv_states =
 static QLIST_HEAD(, BlockDriver) bdrv_drivers =
     QLIST_HEAD_INITIALIZER(bdrv_drivers);
 
+/*
+ * A named dirty bitmap has one bit per @granularity bytes of the device,
+ * set when a write touches them.  Unlike the dirty tracking of block
+ * migration, any number of them can be active at once, and the image
+ * format may keep them across restarts.
+ */
+struct BdrvDirtyBitmap {
+    char *name;
+    int64_t granularity;        /* bytes per bit, a power of two */
+    int64_t size;               /* bytes covered */
+    int nb_bits;
+    int64_t count;              /* number of bits set */
+    unsigned long *bitmap;
+    bool persistent;
+    QLIST_ENTRY(BdrvDirtyBitmap) list;
+};
+
+/*
+ * A throttle group holds the leaky buckets shared by its members.  Devices
+ * without a group name get a private group of their own.
+ */
+struct BlockThrottleGroup {
+    char *name;
+    ThrottleState ts;
+    CoQueue throttled_reqs;
+    QEMUTimer *timer;
+    QLIST_HEAD(, BlockDriverState) members;
+    QLIST_ENTRY(BlockThrottleGroup) list;
+};
+
+static QLIST_HEAD(, BlockThrottleGroup) throttle_groups =
+    QLIST_HEAD_INITIALIZER(throttle_groups);
+
 /* The device to use for VM snapshots */
 static BlockDriverState *bs_snapshots;
 
@@ -123,40 +163,122 @@ int is_windows_drive(const char *filename)
 #endif
 
 /* throttling disk I/O limits */
-void bdrv_io_limits_disable(BlockDriverState *bs)
+static void bdrv_throttle_group_timer(void *opaque)
 {
-    bs->io_limits_enabled = false;
+    BlockThrottleGroup *tg = opaque;
+
+    qemu_co_queue_next(&tg->throttled_reqs);
+}
+
+/* Load the limits of bs into the buckets of its group */
+static void bdrv_throttle_group_config(BlockThrottleGroup *tg,
+                                       BlockIOLimit *io_limits)
+{
+    int i;
+
+    for (i = 0; i < THROTTLE_MAX; i++) {
+        throttle_config_bucket(&tg->ts.bps[i], io_limits->bps[i],
+                               io_limits->bps_max[i]);
+        throttle_config_bucket(&tg->ts.ops[i], io_limits->iops[i],
+                               io_limits->iops_max[i]);
+    }
+    tg->ts.op_size = io_limits->iops_size;
+}
+
+static BlockThrottleGroup *bdrv_throttle_group_get(const char *name)
+{
+    BlockThrottleGroup *tg;
+
+    if (name) {
+        QLIST_FOREACH(tg, &throttle_groups, list) {
+            if (!strcmp(tg->name, name)) {
+                return tg;
+            }
+        }
+    }
 
-    while (qemu_co_queue_next(&bs->throttled_reqs));
+    tg = g_malloc0(sizeof(*tg));
+    tg->name = g_strdup(name);
+    throttle_init(&tg->ts, qemu_get_clock_ns(vm_clock));
+    qemu_co_queue_init(&tg->throttled_reqs);
+    tg->timer = qemu_new_timer_ns(vm_clock, bdrv_throttle_group_timer, tg);
+    QLIST_INIT(&tg->members);
+    if (name) {
+        QLIST_INSERT_HEAD(&throttle_groups, tg, list);
+    }
+    return tg;
+}
 
-    if (bs->block_timer) {
-        qemu_del_timer(bs->block_timer);
-        qemu_free_timer(bs->block_timer);
-        bs->block_timer = NULL;
+static void bdrv_throttle_group_put(BlockThrottleGroup *tg)
+{
+    if (!QLIST_EMPTY(&tg->members)) {
+        return;
     }
 
-    bs->slice_start = 0;
-    bs->slice_end   = 0;
-    bs->slice_time  = 0;
-    memset(&bs->io_base, 0, sizeof(bs->io_base));
+    assert(qemu_co_queue_empty(&tg->throttled_reqs));
+    if (tg->name) {
+        QLIST_REMOVE(tg, list);
+    }
+    qemu_del_timer(tg->timer);
+    qemu_free_timer(tg->timer);
+    g_free(tg->name);
+    g_free(tg);
 }
 
-static void bdrv_block_timer(void *opaque)
+void bdrv_io_limits_disable(BlockDriverState *bs)
 {
-    BlockDriverState *bs = opaque;
+    BlockThrottleGroup *tg = bs->throttle_group;
 
-    qemu_co_queue_next(&bs->throttled_reqs);
+    bs->io_limits_enabled = false;
+    if (!tg) {
+        return;
+    }
+
+    /* Requests of the other members go back to sleep when they find that
+     * they are still throttled.
+     */
+    qemu_co_queue_restart_all(&tg->throttled_reqs);
+
+    QLIST_REMOVE(bs, throttle_list);
+    bs->throttle_group = NULL;
+    bdrv_throttle_group_put(tg);
 }
 
+/* Join the throttle group of bs, or just apply the limits if it is a member */
 void bdrv_io_limits_enable(BlockDriverState *bs)
 {
-    qemu_co_queue_init(&bs->throttled_reqs);
-    bs->block_timer = qemu_new_timer_ns(vm_clock, bdrv_block_timer, bs);
-    bs->slice_time  = 5 * BLOCK_IO_SLICE_TIME;
-    bs->slice_start = qemu_get_clock_ns(vm_clock);
-    bs->slice_end   = bs->slice_start + bs->slice_time;
-    memset(&bs->io_base, 0, sizeof(bs->io_base));
+    BlockThrottleGroup *tg;
+
+    if (bs->throttle_group) {
+        bs->io_limits_enabled = true;
+        bdrv_io_limits_update(bs);
+        return;
+    }
+    tg = bdrv_throttle_group_get(bs->throttle_group_name);
+    QLIST_INSERT_HEAD(&tg->members, bs, throttle_list);
+    bs->throttle_group = tg;
     bs->io_limits_enabled = true;
+    bdrv_io_limits_update(bs);
+}
+
+/*
+ * Make the limits of bs those of its whole throttle group, and let waiting
+ * requests check them again.
+ */
+void bdrv_io_limits_update(BlockDriverState *bs)
+{
+    BlockThrottleGroup *tg = bs->throttle_group;
+    BlockDriverState *member;
+
+    if (!tg) {
+        return;
+    }
+
+    bdrv_throttle_group_config(tg, &bs->io_limits);
+    QLIST_FOREACH(member, &tg->members, throttle_list) {
+        member->io_limits = bs->io_limits;
+    }
+    qemu_mod_timer(tg->timer, qemu_get_clock_ns(vm_clock));
 }
 
 bool bdrv_io_limits_enabled(BlockDriverState *bs)
@@ -173,10 +295,8 @@ bool bdrv_io_limits_enabled(BlockDriverState *bs)
 static void bdrv_io_limits_intercept(BlockDriverState *bs,
                                      bool is_write, int nb_sectors)
 {
-    int64_t wait_time = -1;
-
-    if (!qemu_co_queue_empty(&bs->throttled_reqs)) {
-        qemu_co_queue_wait(&bs->throttled_reqs);
+    if (!qemu_co_queue_empty(&bs->throttle_group->throttled_reqs)) {
+        qemu_co_queue_wait(&bs->throttle_group->throttled_reqs);
     }
 
     /* In fact, we hope to keep each request's timing, in FIFO mode. The next
@@ -184,15 +304,24 @@ static void bdrv_io_limits_intercept(BlockDriverState *bs,
      * allowed to be serviced. So if the current request still exceeds the
      * limits, it will be inserted to the head. All requests followed it will
      * be still in throttled_reqs queue.
+     *
+     * The group can change or go away while we sleep, so look it up again
+     * every time.
      */
-
-    while (bdrv_exceed_io_limits(bs, nb_sectors, is_write, &wait_time)) {
-        qemu_mod_timer(bs->block_timer,
-                       wait_time + qemu_get_clock_ns(vm_clock));
-        qemu_co_queue_wait_insert_head(&bs->throttled_reqs);
+    while (bs->io_limits_enabled) {
+        BlockThrottleGroup *tg = bs->throttle_group;
+        int64_t now = qemu_get_clock_ns(vm_clock);
+        int64_t wait_time = throttle_compute_wait(&tg->ts, is_write, now);
+
+        if (!wait_time) {
+            throttle_account(&tg->ts, is_write,
+                             (int64_t)nb_sectors * BDRV_SECTOR_SIZE);
+            qemu_co_queue_next(&tg->throttled_reqs);
+            break;
+        }
+        qemu_mod_timer(tg->timer, now + wait_time);
+        qemu_co_queue_wait_insert_head(&tg->throttled_reqs);
     }
-
-    qemu_co_queue_next(&bs->throttled_reqs);
 }
 
 /* check if the path starts with "<protocol>:" */
@@ -305,6 +434,7 @@ BlockDriverState *bdrv_new(const char *device_name)
     BlockDriverState *bs;
 
     bs = g_malloc0(sizeof(BlockDriverState));
+    bs->aio_context = qemu_get_aio_context();
     pstrcpy(bs->device_name, sizeof(bs->device_name), device_name);
     if (device_name[0] != '\0') {
         QTAILQ_INSERT_TAIL(&bdrv_states, bs, list);
@@ -728,6 +858,74 @@ int bdrv_file_open(BlockDriverState **pbs, const char *filename, int flags)
     return 0;
 }
 
+/*
+ * The cache sits on the image file of the backing file, below the format
+ * driver, so that it covers metadata too.  Backing files are read-only, so
+ * nothing this process does makes the cache stale.
+ */
+static void bdrv_attach_backing_cache(BlockDriverState *bs)
+{
+    BlockDriverState *file;
+
+    if (!bs->backing_cache_size || !bs->backing_hd) {
+        return;
+    }
+    file = bs->backing_hd->file ? bs->backing_hd->file : bs->backing_hd;
+    if (!file->shared_cache) {
+        file->shared_cache = bdrv_shared_cache_open(file,
+                                                    bs->backing_cache_size);
+    }
+}
+
+/*
+ * Opens the backing file of bs if it has one and it is not open yet.  This
+ * is done by bdrv_open() unless BDRV_O_NO_BACKING is given, e.g. for a
+ * mirror target whose backing chain must not be opened before the switch.
+ */
+int bdrv_open_backing_file(BlockDriverState *bs)
+{
+    char backing_filename[PATH_MAX];
+    int back_flags, ret;
+    BlockDriver *back_drv = NULL;
+
+    if (bs->backing_hd != NULL) {
+        return 0;
+    }
+
+    bs->open_flags &= ~BDRV_O_NO_BACKING;
+    if (bs->backing_file[0] == '\0') {
+        return 0;
+    }
+
+    bs->backing_hd = bdrv_new("");
+    bs->backing_hd->backing_cache_size = bs->backing_cache_size;
+    bdrv_get_full_backing_filename(bs, backing_filename,
+                                   sizeof(backing_filename));
+
+    if (bs->backing_format[0] != '\0') {
+        back_drv = bdrv_find_format(bs->backing_format);
+    }
+
+    /* backing files always opened read-only */
+    back_flags = bs->open_flags & ~(BDRV_O_RDWR | BDRV_O_SNAPSHOT);
+
+    ret = bdrv_open(bs->backing_hd, backing_filename, back_flags, back_drv);
+    if (ret < 0) {
+        bdrv_delete(bs->backing_hd);
+        bs->backing_hd = NULL;
+        bs->open_flags |= BDRV_O_NO_BACKING;
+        return ret;
+    }
+    if (bs->is_temporary) {
+        bs->backing_hd->keep_read_only = !(bs->open_flags & BDRV_O_RDWR);
+    } else {
+        /* base image inherits from "parent" */
+        bs->backing_hd->keep_read_only = bs->keep_read_only;
+    }
+    bdrv_attach_backing_cache(bs);
+    return 0;
+}
+
 /*
  * Opens a disk image (raw, qcow2, vmdk, ...)
  */
@@ -811,34 +1009,12 @@ int bdrv_open(BlockDriverState *bs, const char *filename, int flags,
     }
 
     /* If there is a backing file, use it */
-    if ((flags & BDRV_O_NO_BACKING) == 0 && bs->backing_file[0] != '\0') {
-        char backing_filename[PATH_MAX];
-        int back_flags;
-        BlockDriver *back_drv = NULL;
-
-        bs->backing_hd = bdrv_new("");
-        bdrv_get_full_backing_filename(bs, backing_filename,
-                                       sizeof(backing_filename));
-
-        if (bs->backing_format[0] != '\0') {
-            back_drv = bdrv_find_format(bs->backing_format);
-        }
-
-        /* backing files always opened read-only */
-        back_flags =
-            flags & ~(BDRV_O_RDWR | BDRV_O_SNAPSHOT | BDRV_O_NO_BACKING);
-
-        ret = bdrv_open(bs->backing_hd, backing_filename, back_flags, back_drv);
+    if ((flags & BDRV_O_NO_BACKING) == 0) {
+        ret = bdrv_open_backing_file(bs);
         if (ret < 0) {
             bdrv_close(bs);
             return ret;
         }
-        if (bs->is_temporary) {
-            bs->backing_hd->keep_read_only = !(flags & BDRV_O_RDWR);
-        } else {
-            /* base image inherits from "parent" */
-            bs->backing_hd->keep_read_only = bs->keep_read_only;
-        }
     }
 
     if (!bdrv_key_required(bs)) {
@@ -861,6 +1037,8 @@ unlink_and_fail:
 
 void bdrv_close(BlockDriverState *bs)
 {
+    /* The main loop takes over, drivers are only closed from there */
+    bdrv_set_aio_context(bs, qemu_get_aio_context());
     bdrv_flush(bs);
     if (bs->drv) {
         if (bs->job) {
@@ -876,6 +1054,7 @@ void bdrv_close(BlockDriverState *bs)
             bs->backing_hd = NULL;
         }
         bs->drv->bdrv_close(bs);
+        bdrv_release_all_dirty_bitmaps(bs);
         g_free(bs->opaque);
 #ifdef _WIN32
         if (bs->is_temporary) {
@@ -897,6 +1076,10 @@ void bdrv_close(BlockDriverState *bs)
             bdrv_delete(bs->file);
             bs->file = NULL;
         }
+        if (bs->shared_cache) {
+            bdrv_shared_cache_close(bs->shared_cache);
+            bs->shared_cache = NULL;
+        }
 
         bdrv_dev_change_media_cb(bs, false);
     }
@@ -940,17 +1123,23 @@ void bdrv_drain_all(void)
          * a busy wait.
          */
         QTAILQ_FOREACH(bs, &bdrv_states, list) {
-            if (!qemu_co_queue_empty(&bs->throttled_reqs)) {
-                qemu_co_queue_restart_all(&bs->throttled_reqs);
+            if (bs->throttle_group &&
+                !qemu_co_queue_empty(&bs->throttle_group->throttled_reqs)) {
+                qemu_co_queue_restart_all(&bs->throttle_group->throttled_reqs);
                 busy = true;
             }
         }
     } while (busy);
 
-    /* If requests are still pending there is a bug somewhere */
+    /* If requests are still pending there is a bug somewhere.  Devices in
+     * other contexts are drained by the threads that run them. */
     QTAILQ_FOREACH(bs, &bdrv_states, list) {
+        if (bdrv_get_aio_context(bs) != qemu_get_aio_context()) {
+            continue;
+        }
         assert(QLIST_EMPTY(&bs->tracked_requests));
-        assert(qemu_co_queue_empty(&bs->throttled_reqs));
+        assert(!bs->throttle_group ||
+               qemu_co_queue_empty(&bs->throttle_group->throttled_reqs));
     }
 }
 
@@ -986,14 +1175,11 @@ static void bdrv_move_feature_fields(BlockDriverState *bs_dest,
 
     bs_dest->enable_write_cache = bs_src->enable_write_cache;
 
-    /* i/o timing parameters */
-    bs_dest->slice_time         = bs_src->slice_time;
-    bs_dest->slice_start        = bs_src->slice_start;
-    bs_dest->slice_end          = bs_src->slice_end;
+    /* i/o throttling */
     bs_dest->io_limits          = bs_src->io_limits;
-    bs_dest->io_base            = bs_src->io_base;
-    bs_dest->throttled_reqs     = bs_src->throttled_reqs;
-    bs_dest->block_timer        = bs_src->block_timer;
+    bs_dest->throttle_group_name = bs_src->throttle_group_name;
+    bs_dest->throttle_group     = bs_src->throttle_group;
+    bs_dest->throttle_list      = bs_src->throttle_list;
     bs_dest->io_limits_enabled  = bs_src->io_limits_enabled;
 
     /* r/w error */
@@ -1004,9 +1190,14 @@ static void bdrv_move_feature_fields(BlockDriverState *bs_dest,
     bs_dest->iostatus_enabled   = bs_src->iostatus_enabled;
     bs_dest->iostatus           = bs_src->iostatus;
 
+    /* latency histograms, so that they keep measuring the guest's requests */
+    memcpy(bs_dest->latency_histogram, bs_src->latency_histogram,
+           sizeof(bs_dest->latency_histogram));
+
     /* dirty bitmap */
     bs_dest->dirty_count        = bs_src->dirty_count;
     bs_dest->dirty_bitmap       = bs_src->dirty_bitmap;
+    bs_dest->dirty_bitmaps      = bs_src->dirty_bitmaps;
 
     /* job */
     bs_dest->in_use             = bs_src->in_use;
@@ -1037,11 +1228,12 @@ void bdrv_swap(BlockDriverState *bs_new, BlockDriverState *bs_old)
     /* bs_new must be anonymous and shouldn't have anything fancy enabled */
     assert(bs_new->device_name[0] == '\0');
     assert(bs_new->dirty_bitmap == NULL);
+    assert(QLIST_EMPTY(&bs_new->dirty_bitmaps));
     assert(bs_new->job == NULL);
     assert(bs_new->dev == NULL);
     assert(bs_new->in_use == 0);
     assert(bs_new->io_limits_enabled == false);
-    assert(bs_new->block_timer == NULL);
+    assert(bs_new->throttle_group == NULL);
 
     tmp = *bs_new;
     *bs_new = *bs_old;
@@ -1060,7 +1252,7 @@ void bdrv_swap(BlockDriverState *bs_new, BlockDriverState *bs_old)
     assert(bs_new->job == NULL);
     assert(bs_new->in_use == 0);
     assert(bs_new->io_limits_enabled == false);
-    assert(bs_new->block_timer == NULL);
+    assert(bs_new->throttle_group == NULL);
 
     bdrv_rebind(bs_new);
     bdrv_rebind(bs_old);
@@ -1093,6 +1285,8 @@ void bdrv_append(BlockDriverState *bs_new, BlockDriverState *bs_top)
 
 void bdrv_delete(BlockDriverState *bs)
 {
+    int i;
+
     assert(!bs->dev);
     assert(!bs->job);
     assert(!bs->in_use);
@@ -1102,6 +1296,11 @@ void bdrv_delete(BlockDriverState *bs)
 
     bdrv_close(bs);
 
+    for (i = 0; i < BDRV_MAX_IOTYPE; i++) {
+        bdrv_set_latency_histogram(bs, i, NULL, 0);
+    }
+    g_free(bs->throttle_group_name);
+
     assert(bs != bs_snapshots);
     g_free(bs);
 }
@@ -1356,6 +1555,7 @@ ro_cleanup:
         bdrv_delete(bs->backing_hd);
         bs->backing_hd = NULL;
         bs_ro = bdrv_new("");
+        bs_ro->backing_cache_size = bs->backing_cache_size;
         ret = bdrv_open(bs_ro, filename, open_flags & ~BDRV_O_RDWR,
             backing_drv);
         if (ret < 0) {
@@ -1366,6 +1566,7 @@ ro_cleanup:
         }
         bs->backing_hd = bs_ro;
         bs->backing_hd->keep_read_only = 0;
+        bdrv_attach_backing_cache(bs);
     }
 
     return ret;
@@ -1389,6 +1590,7 @@ struct BdrvTrackedRequest {
     int64_t sector_num;
     int nb_sectors;
     bool is_write;
+    bool is_background; /* block job copy-on-read, guest reads skip it */
     QLIST_ENTRY(BdrvTrackedRequest) list;
     Coroutine *co; /* owner, used for deadlock detection */
     CoQueue wait_queue; /* coroutines blocked on this request */
@@ -1411,13 +1613,15 @@ static void tracked_request_end(BdrvTrackedRequest *req)
 static void tracked_request_begin(BdrvTrackedRequest *req,
                                   BlockDriverState *bs,
                                   int64_t sector_num,
-                                  int nb_sectors, bool is_write)
+                                  int nb_sectors, bool is_write,
+                                  bool is_background)
 {
     *req = (BdrvTrackedRequest){
         .bs = bs,
         .sector_num = sector_num,
         .nb_sectors = nb_sectors,
         .is_write = is_write,
+        .is_background = is_background,
         .co = qemu_coroutine_self(),
     };
 
@@ -1460,8 +1664,31 @@ static bool tracked_request_overlaps(BdrvTrackedRequest *req,
     return true;
 }
 
+/**
+ * Check whether a block job copy-on-read touches the clusters of a region
+ */
+static bool overlaps_background_request(BlockDriverState *bs,
+                                        int64_t sector_num, int nb_sectors)
+{
+    BdrvTrackedRequest *req;
+    int64_t cluster_sector_num;
+    int cluster_nb_sectors;
+
+    round_to_clusters(bs, sector_num, nb_sectors,
+                      &cluster_sector_num, &cluster_nb_sectors);
+
+    QLIST_FOREACH(req, &bs->tracked_requests, list) {
+        if (req->is_background &&
+            tracked_request_overlaps(req, cluster_sector_num,
+                                     cluster_nb_sectors)) {
+            return true;
+        }
+    }
+    return false;
+}
+
 static void coroutine_fn wait_for_overlapping_requests(BlockDriverState *bs,
-        int64_t sector_num, int nb_sectors)
+        int64_t sector_num, int nb_sectors, bool skip_background)
 {
     BdrvTrackedRequest *req;
     int64_t cluster_sector_num;
@@ -1480,6 +1707,9 @@ static void coroutine_fn wait_for_overlapping_requests(BlockDriverState *bs,
     do {
         retry = false;
         QLIST_FOREACH(req, &bs->tracked_requests, list) {
+            if (skip_background && req->is_background) {
+                continue;
+            }
             if (tracked_request_overlaps(req, cluster_sector_num,
                                          cluster_nb_sectors)) {
                 /* Hitting this means there was a reentrant request, for
@@ -1620,7 +1850,7 @@ static int bdrv_rw_co(BlockDriverState *bs, int64_t sector_num, uint8_t *buf,
         co = qemu_coroutine_create(bdrv_rw_co_entry);
         qemu_coroutine_enter(co, &rwco);
         while (rwco.ret == NOT_DONE) {
-            qemu_aio_wait();
+            aio_poll(bdrv_get_aio_context(bs), true);
         }
     }
     return rwco.ret;
@@ -1647,7 +1877,6 @@ int bdrv_read_unthrottled(BlockDriverState *bs, int64_t sector_num,
     return ret;
 }
 
-#define BITS_PER_LONG  (sizeof(unsigned long) * 8)
 
 static void set_dirty_bitmap(BlockDriverState *bs, int64_t sector_num,
                              int nb_sectors, int dirty)
@@ -1882,6 +2111,7 @@ static int coroutine_fn bdrv_co_do_readv(BlockDriverState *bs,
 {
     BlockDriver *drv = bs->drv;
     BdrvTrackedRequest req;
+    BlockAcctCookie acct;
     int ret;
 
     if (!drv) {
@@ -1891,6 +2121,9 @@ static int coroutine_fn bdrv_co_do_readv(BlockDriverState *bs,
         return -EIO;
     }
 
+    bdrv_layer_acct_start(bs, &acct, nb_sectors * BDRV_SECTOR_SIZE,
+                          BDRV_ACCT_READ);
+
     /* throttling disk read I/O */
     if (bs->io_limits_enabled) {
         bdrv_io_limits_intercept(bs, false, nb_sectors);
@@ -1904,10 +2137,23 @@ static int coroutine_fn bdrv_co_do_readv(BlockDriverState *bs,
     }
 
     if (bs->copy_on_read_in_flight) {
-        wait_for_overlapping_requests(bs, sector_num, nb_sectors);
+        bool background = flags & BDRV_REQ_BACKGROUND;
+
+        /* Guest reads never wait for a block job's copy-on-read.  If the job
+         * is copying the same clusters, leave the copying to it and just
+         * read through to the backing file.
+         */
+        if (!background && (flags & BDRV_REQ_COPY_ON_READ) &&
+            overlaps_background_request(bs, sector_num, nb_sectors)) {
+            flags &= ~BDRV_REQ_COPY_ON_READ;
+            bs->copy_on_read_in_flight--;
+        }
+        wait_for_overlapping_requests(bs, sector_num, nb_sectors,
+                                      !background);
     }
 
-    tracked_request_begin(&req, bs, sector_num, nb_sectors, false);
+    tracked_request_begin(&req, bs, sector_num, nb_sectors, false,
+                          flags & BDRV_REQ_BACKGROUND);
 
     if (flags & BDRV_REQ_COPY_ON_READ) {
         int pnum;
@@ -1919,11 +2165,22 @@ static int coroutine_fn bdrv_co_do_readv(BlockDriverState *bs,
 
         if (!ret || pnum != nb_sectors) {
             ret = bdrv_co_do_copy_on_readv(bs, sector_num, nb_sectors, qiov);
+
+            /* Let a job prefetch around what the guest is reading */
+            if (ret >= 0 && !(flags & BDRV_REQ_BACKGROUND) && bs->job &&
+                bs->job->job_type->copy_on_read) {
+                bs->job->job_type->copy_on_read(bs->job, sector_num,
+                                                nb_sectors);
+            }
             goto out;
         }
     }
 
-    ret = drv->bdrv_co_readv(bs, sector_num, nb_sectors, qiov);
+    if (bs->shared_cache) {
+        ret = bdrv_shared_cache_co_readv(bs, sector_num, nb_sectors, qiov);
+    } else {
+        ret = drv->bdrv_co_readv(bs, sector_num, nb_sectors, qiov);
+    }
 
 out:
     tracked_request_end(&req);
@@ -1932,6 +2189,7 @@ out:
         bs->copy_on_read_in_flight--;
     }
 
+    bdrv_layer_acct_done(bs, &acct);
     return ret;
 }
 
@@ -1952,6 +2210,19 @@ int coroutine_fn bdrv_co_copy_on_readv(BlockDriverState *bs,
                             BDRV_REQ_COPY_ON_READ);
 }
 
+/*
+ * Copy-on-read on behalf of a block job.  Guest reads of the same clusters do
+ * not wait for it, guest writes still do.
+ */
+int coroutine_fn bdrv_co_background_copy_on_readv(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors, QEMUIOVector *qiov)
+{
+    trace_bdrv_co_copy_on_readv(bs, sector_num, nb_sectors);
+
+    return bdrv_co_do_readv(bs, sector_num, nb_sectors, qiov,
+                            BDRV_REQ_COPY_ON_READ | BDRV_REQ_BACKGROUND);
+}
+
 static int coroutine_fn bdrv_co_do_write_zeroes(BlockDriverState *bs,
     int64_t sector_num, int nb_sectors)
 {
@@ -1992,6 +2263,7 @@ static int coroutine_fn bdrv_co_do_writev(BlockDriverState *bs,
 {
     BlockDriver *drv = bs->drv;
     BdrvTrackedRequest req;
+    BlockAcctCookie acct;
     int ret;
 
     if (!bs->drv) {
@@ -2004,16 +2276,19 @@ static int coroutine_fn bdrv_co_do_writev(BlockDriverState *bs,
         return -EIO;
     }
 
+    bdrv_layer_acct_start(bs, &acct, nb_sectors * BDRV_SECTOR_SIZE,
+                          BDRV_ACCT_WRITE);
+
     /* throttling disk write I/O */
     if (bs->io_limits_enabled) {
         bdrv_io_limits_intercept(bs, true, nb_sectors);
     }
 
     if (bs->copy_on_read_in_flight) {
-        wait_for_overlapping_requests(bs, sector_num, nb_sectors);
+        wait_for_overlapping_requests(bs, sector_num, nb_sectors, false);
     }
 
-    tracked_request_begin(&req, bs, sector_num, nb_sectors, true);
+    tracked_request_begin(&req, bs, sector_num, nb_sectors, true, false);
 
     if (flags & BDRV_REQ_ZERO_WRITE) {
         ret = bdrv_co_do_write_zeroes(bs, sector_num, nb_sectors);
@@ -2028,6 +2303,7 @@ static int coroutine_fn bdrv_co_do_writev(BlockDriverState *bs,
     if (bs->dirty_bitmap) {
         set_dirty_bitmap(bs, sector_num, nb_sectors, 1);
     }
+    bdrv_set_dirty_bitmaps(bs, sector_num, nb_sectors);
 
     if (bs->wr_highest_sector < sector_num + nb_sectors - 1) {
         bs->wr_highest_sector = sector_num + nb_sectors - 1;
@@ -2035,6 +2311,7 @@ static int coroutine_fn bdrv_co_do_writev(BlockDriverState *bs,
 
     tracked_request_end(&req);
 
+    bdrv_layer_acct_done(bs, &acct);
     return ret;
 }
 
@@ -2055,6 +2332,39 @@ int coroutine_fn bdrv_co_write_zeroes(BlockDriverState *bs,
                              BDRV_REQ_ZERO_WRITE);
 }
 
+static void coroutine_fn bdrv_write_zeroes_co_entry(void *opaque)
+{
+    RwCo *rwco = opaque;
+
+    rwco->ret = bdrv_co_write_zeroes(rwco->bs, rwco->sector_num,
+                                     rwco->nb_sectors);
+}
+
+/* Synchronous version of bdrv_co_write_zeroes() */
+int bdrv_write_zeroes(BlockDriverState *bs, int64_t sector_num, int nb_sectors)
+{
+    Coroutine *co;
+    RwCo rwco = {
+        .bs = bs,
+        .sector_num = sector_num,
+        .nb_sectors = nb_sectors,
+        .is_write = true,
+        .ret = NOT_DONE,
+    };
+
+    if (qemu_in_coroutine()) {
+        /* Fast-path if already in coroutine context */
+        bdrv_write_zeroes_co_entry(&rwco);
+    } else {
+        co = qemu_coroutine_create(bdrv_write_zeroes_co_entry);
+        qemu_coroutine_enter(co, &rwco);
+        while (rwco.ret == NOT_DONE) {
+            aio_poll(bdrv_get_aio_context(bs), true);
+        }
+    }
+    return rwco.ret;
+}
+
 /**
  * Truncate file to 'offset' bytes (needed only for file protocols)
  */
@@ -2070,9 +2380,14 @@ int bdrv_truncate(BlockDriverState *bs, int64_t offset)
         return -EACCES;
     if (bdrv_in_use(bs))
         return -EBUSY;
+    ret = bdrv_dirty_bitmaps_resize(bs, offset, true);
+    if (ret < 0) {
+        return ret;
+    }
     ret = drv->bdrv_truncate(bs, offset);
     if (ret == 0) {
         ret = refresh_total_sectors(bs, offset >> BDRV_SECTOR_BITS);
+        bdrv_dirty_bitmaps_resize(bs, offset, false);
         bdrv_dev_resize_cb(bs);
     }
     return ret;
@@ -2134,6 +2449,44 @@ void bdrv_set_io_limits(BlockDriverState *bs,
     bs->io_limits_enabled = bdrv_io_limits_enabled(bs);
 }
 
+/*
+ * Put bs in the named throttle group, or in a group of its own if @group
+ * is NULL.  All devices of a group share the same limits; the last ones
+ * that were set on any member apply.
+ *
+ * Before bdrv_open() this only records the name; the group is joined when
+ * the image is opened with limits set.
+ */
+void bdrv_set_throttle_group(BlockDriverState *bs, const char *group)
+{
+    bool joined = bs->throttle_group != NULL;
+
+    if (joined) {
+        bdrv_io_limits_disable(bs);
+    }
+    g_free(bs->throttle_group_name);
+    bs->throttle_group_name = g_strdup(group);
+    if (joined) {
+        bdrv_io_limits_enable(bs);
+    }
+}
+
+/* metadata cache sizes, take effect when the image is opened */
+void bdrv_set_metadata_cache_sizes(BlockDriverState *bs,
+                                   uint64_t l2_cache_size,
+                                   uint64_t refcount_cache_size)
+{
+    bs->l2_cache_size = l2_cache_size;
+    bs->refcount_cache_size = refcount_cache_size;
+}
+
+/* size of the shared cache of the backing files, takes effect when the
+ * backing files are opened */
+void bdrv_set_backing_cache_size(BlockDriverState *bs, uint64_t size)
+{
+    bs->backing_cache_size = size;
+}
+
 void bdrv_set_on_error(BlockDriverState *bs, BlockErrorAction on_read_error,
                        BlockErrorAction on_write_error)
 {
@@ -2360,7 +2713,7 @@ int bdrv_is_allocated(BlockDriverState *bs, int64_t sector_num, int nb_sectors,
     co = qemu_coroutine_create(bdrv_is_allocated_co_entry);
     qemu_coroutine_enter(co, &data);
     while (!data.done) {
-        qemu_aio_wait();
+        aio_poll(bdrv_get_aio_context(bs), true);
     }
     return data.ret;
 }
@@ -2401,9 +2754,13 @@ int coroutine_fn bdrv_co_is_allocated_above(BlockDriverState *top,
          * [sector_num, nb_sectors] is unallocated on top but intermediate
          * might have
          *
-         * [sector_num+x, nr_sectors] allocated.
+         * [sector_num+x, nr_sectors] allocated.  A backing file that
+         * ends before sector_num reports nothing, don't let that shrink
+         * the range.
          */
-        if (n > pnum_inter) {
+        if (n > pnum_inter &&
+            (intermediate == top ||
+             sector_num + pnum_inter < intermediate->total_sectors)) {
             n = pnum_inter;
         }
 
@@ -2438,6 +2795,24 @@ BlockInfoList *qmp_query_block(Error **errp)
             info->value->io_status = bs->iostatus;
         }
 
+        if (!QLIST_EMPTY(&bs->dirty_bitmaps)) {
+            BlockDirtyInfoList **tail = &info->value->dirty_bitmaps;
+            BdrvDirtyBitmap *bitmap;
+
+            info->value->has_dirty_bitmaps = true;
+            QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
+                BlockDirtyInfoList *entry = g_malloc0(sizeof(*entry));
+
+                entry->value = g_malloc0(sizeof(*entry->value));
+                entry->value->name = g_strdup(bitmap->name);
+                entry->value->granularity = bitmap->granularity;
+                entry->value->count = bitmap->count;
+                entry->value->persistent = bitmap->persistent;
+                *tail = entry;
+                tail = &entry->next;
+            }
+        }
+
         if (bs->drv) {
             info->value->has_inserted = true;
             info->value->inserted = g_malloc0(sizeof(*info->value->inserted));
@@ -2467,6 +2842,31 @@ BlockInfoList *qmp_query_block(Error **errp)
                                bs->io_limits.iops[BLOCK_IO_LIMIT_READ];
                 info->value->inserted->iops_wr =
                                bs->io_limits.iops[BLOCK_IO_LIMIT_WRITE];
+                info->value->inserted->has_bps_max = true;
+                info->value->inserted->bps_max =
+                               bs->io_limits.bps_max[BLOCK_IO_LIMIT_TOTAL];
+                info->value->inserted->has_bps_rd_max = true;
+                info->value->inserted->bps_rd_max =
+                               bs->io_limits.bps_max[BLOCK_IO_LIMIT_READ];
+                info->value->inserted->has_bps_wr_max = true;
+                info->value->inserted->bps_wr_max =
+                               bs->io_limits.bps_max[BLOCK_IO_LIMIT_WRITE];
+                info->value->inserted->has_iops_max = true;
+                info->value->inserted->iops_max =
+                               bs->io_limits.iops_max[BLOCK_IO_LIMIT_TOTAL];
+                info->value->inserted->has_iops_rd_max = true;
+                info->value->inserted->iops_rd_max =
+                               bs->io_limits.iops_max[BLOCK_IO_LIMIT_READ];
+                info->value->inserted->has_iops_wr_max = true;
+                info->value->inserted->iops_wr_max =
+                               bs->io_limits.iops_max[BLOCK_IO_LIMIT_WRITE];
+                info->value->inserted->has_iops_size = true;
+                info->value->inserted->iops_size = bs->io_limits.iops_size;
+                if (bs->throttle_group_name) {
+                    info->value->inserted->has_group = true;
+                    info->value->inserted->group =
+                               g_strdup(bs->throttle_group_name);
+                }
             }
         }
 
@@ -2482,9 +2882,34 @@ BlockInfoList *qmp_query_block(Error **errp)
     return head;
 }
 
+static BlockLatencyBinList *bdrv_latency_histogram_info(
+    BlockLatencyHistogram *hist)
+{
+    BlockLatencyBinList *head = NULL, **prev = &head;
+    int i;
+
+    for (i = 0; i < hist->nbins; i++) {
+        BlockLatencyBinList *entry = g_malloc0(sizeof(*entry));
+
+        entry->value = g_malloc0(sizeof(*entry->value));
+        entry->value->low = i ? hist->boundaries[i - 1] : 0;
+        if (i < hist->nbins - 1) {
+            entry->value->has_high = true;
+            entry->value->high = hist->boundaries[i];
+        }
+        entry->value->count = hist->bins[i];
+
+        *prev = entry;
+        prev = &entry->next;
+    }
+
+    return head;
+}
+
 /* Consider exposing this as a full fledged QMP command */
-static BlockStats *qmp_query_blockstat(const BlockDriverState *bs, Error **errp)
+static BlockStats *qmp_query_blockstat(BlockDriverState *bs, Error **errp)
 {
+    BlockLatencyHistogram *hist = bs->latency_histogram;
     BlockStats *s;
 
     s = g_malloc0(sizeof(*s));
@@ -2504,12 +2929,32 @@ static BlockStats *qmp_query_blockstat(const BlockDriverState *bs, Error **errp)
     s->stats->wr_total_time_ns = bs->total_time_ns[BDRV_ACCT_WRITE];
     s->stats->rd_total_time_ns = bs->total_time_ns[BDRV_ACCT_READ];
     s->stats->flush_total_time_ns = bs->total_time_ns[BDRV_ACCT_FLUSH];
+    s->stats->in_flight = bs->in_flight;
+
+    s->stats->has_rd_latency_histogram = hist[BDRV_ACCT_READ].nbins > 0;
+    s->stats->rd_latency_histogram =
+        bdrv_latency_histogram_info(&hist[BDRV_ACCT_READ]);
+    s->stats->has_wr_latency_histogram = hist[BDRV_ACCT_WRITE].nbins > 0;
+    s->stats->wr_latency_histogram =
+        bdrv_latency_histogram_info(&hist[BDRV_ACCT_WRITE]);
+    s->stats->has_flush_latency_histogram = hist[BDRV_ACCT_FLUSH].nbins > 0;
+    s->stats->flush_latency_histogram =
+        bdrv_latency_histogram_info(&hist[BDRV_ACCT_FLUSH]);
+
+    if (bs->drv && bs->drv->bdrv_get_stats) {
+        bs->drv->bdrv_get_stats(bs, s->stats);
+    }
 
     if (bs->file) {
         s->has_parent = true;
         s->parent = qmp_query_blockstat(bs->file, NULL);
     }
 
+    if (bs->backing_hd) {
+        s->has_backing = true;
+        s->backing = qmp_query_blockstat(bs->backing_hd, NULL);
+    }
+
     return s;
 }
 
@@ -2564,6 +3009,7 @@ int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
     if (bs->dirty_bitmap) {
         set_dirty_bitmap(bs, sector_num, nb_sectors, 1);
     }
+    bdrv_set_dirty_bitmaps(bs, sector_num, nb_sectors);
 
     return drv->bdrv_write_compressed(bs, sector_num, buf, nb_sectors);
 }
@@ -2681,10 +3127,14 @@ int bdrv_snapshot_goto(BlockDriverState *bs,
 
     if (!drv)
         return -ENOMEDIUM;
-    if (drv->bdrv_snapshot_goto)
+    if (drv->bdrv_snapshot_goto) {
+        /* whatever the bitmaps tracked is gone, the whole disk changed */
+        bdrv_dirty_bitmaps_set_all(bs);
         return drv->bdrv_snapshot_goto(bs, snapshot_id);
+    }
 
     if (bs->file) {
+        bdrv_dirty_bitmaps_set_all(bs);
         drv->bdrv_close(bs);
         ret = bdrv_snapshot_goto(bs->file, snapshot_id);
         open_ret = drv->bdrv_open(bs, bs->open_flags);
@@ -3047,209 +3497,44 @@ void bdrv_aio_cancel(BlockDriverAIOCB *acb)
     acb->pool->cancel(acb);
 }
 
-/* block I/O throttling */
-static bool bdrv_exceed_bps_limits(BlockDriverState *bs, int nb_sectors,
-                 bool is_write, double elapsed_time, uint64_t *wait)
-{
-    uint64_t bps_limit = 0;
-    double   bytes_limit, bytes_base, bytes_res;
-    double   slice_time, wait_time;
-
-    if (bs->io_limits.bps[BLOCK_IO_LIMIT_TOTAL]) {
-        bps_limit = bs->io_limits.bps[BLOCK_IO_LIMIT_TOTAL];
-    } else if (bs->io_limits.bps[is_write]) {
-        bps_limit = bs->io_limits.bps[is_write];
-    } else {
-        if (wait) {
-            *wait = 0;
-        }
-
-        return false;
-    }
-
-    slice_time = bs->slice_end - bs->slice_start;
-    slice_time /= (NANOSECONDS_PER_SECOND);
-    bytes_limit = bps_limit * slice_time;
-    bytes_base  = bs->nr_bytes[is_write] - bs->io_base.bytes[is_write];
-    if (bs->io_limits.bps[BLOCK_IO_LIMIT_TOTAL]) {
-        bytes_base += bs->nr_bytes[!is_write] - bs->io_base.bytes[!is_write];
-    }
-
-    /* bytes_base: the bytes of data which have been read/written; and
-     *             it is obtained from the history statistic info.
-     * bytes_res: the remaining bytes of data which need to be read/written.
-     * (bytes_base + bytes_res) / bps_limit: used to calcuate
-     *             the total time for completing reading/writting all data.
-     */
-    bytes_res   = (unsigned) nb_sectors * BDRV_SECTOR_SIZE;
+/**************************************************************/
+/* async block device emulation */
 
-    if (bytes_base + bytes_res <= bytes_limit) {
-        if (wait) {
-            *wait = 0;
-        }
+typedef struct BlockDriverAIOCBSync {
+    BlockDriverAIOCB common;
+    QEMUBH *bh;
+    int ret;
+    /* vector translation state */
+    QEMUIOVector *qiov;
+    uint8_t *bounce;
+    int is_write;
+} BlockDriverAIOCBSync;
 
-        return false;
-    }
+static void bdrv_aio_cancel_em(BlockDriverAIOCB *blockacb)
+{
+    BlockDriverAIOCBSync *acb =
+        container_of(blockacb, BlockDriverAIOCBSync, common);
+    qemu_bh_delete(acb->bh);
+    acb->bh = NULL;
+    qemu_aio_release(acb);
+}
 
-    /* Calc approx time to dispatch */
-    wait_time = (bytes_base + bytes_res) / bps_limit - elapsed_time;
+static AIOPool bdrv_em_aio_pool = {
+    .aiocb_size         = sizeof(BlockDriverAIOCBSync),
+    .cancel             = bdrv_aio_cancel_em,
+};
 
-    /* When the I/O rate at runtime exceeds the limits,
-     * bs->slice_end need to be extended in order that the current statistic
-     * info can be kept until the timer fire, so it is increased and tuned
-     * based on the result of experiment.
-     */
-    bs->slice_time = wait_time * BLOCK_IO_SLICE_TIME * 10;
-    bs->slice_end += bs->slice_time - 3 * BLOCK_IO_SLICE_TIME;
-    if (wait) {
-        *wait = wait_time * BLOCK_IO_SLICE_TIME * 10;
-    }
+static void bdrv_aio_bh_cb(void *opaque)
+{
+    BlockDriverAIOCBSync *acb = opaque;
 
-    return true;
-}
-
-static bool bdrv_exceed_iops_limits(BlockDriverState *bs, bool is_write,
-                             double elapsed_time, uint64_t *wait)
-{
-    uint64_t iops_limit = 0;
-    double   ios_limit, ios_base;
-    double   slice_time, wait_time;
-
-    if (bs->io_limits.iops[BLOCK_IO_LIMIT_TOTAL]) {
-        iops_limit = bs->io_limits.iops[BLOCK_IO_LIMIT_TOTAL];
-    } else if (bs->io_limits.iops[is_write]) {
-        iops_limit = bs->io_limits.iops[is_write];
-    } else {
-        if (wait) {
-            *wait = 0;
-        }
-
-        return false;
-    }
-
-    slice_time = bs->slice_end - bs->slice_start;
-    slice_time /= (NANOSECONDS_PER_SECOND);
-    ios_limit  = iops_limit * slice_time;
-    ios_base   = bs->nr_ops[is_write] - bs->io_base.ios[is_write];
-    if (bs->io_limits.iops[BLOCK_IO_LIMIT_TOTAL]) {
-        ios_base += bs->nr_ops[!is_write] - bs->io_base.ios[!is_write];
-    }
-
-    if (ios_base + 1 <= ios_limit) {
-        if (wait) {
-            *wait = 0;
-        }
-
-        return false;
-    }
-
-    /* Calc approx time to dispatch */
-    wait_time = (ios_base + 1) / iops_limit;
-    if (wait_time > elapsed_time) {
-        wait_time = wait_time - elapsed_time;
-    } else {
-        wait_time = 0;
-    }
-
-    bs->slice_time = wait_time * BLOCK_IO_SLICE_TIME * 10;
-    bs->slice_end += bs->slice_time - 3 * BLOCK_IO_SLICE_TIME;
-    if (wait) {
-        *wait = wait_time * BLOCK_IO_SLICE_TIME * 10;
-    }
-
-    return true;
-}
-
-static bool bdrv_exceed_io_limits(BlockDriverState *bs, int nb_sectors,
-                           bool is_write, int64_t *wait)
-{
-    int64_t  now, max_wait;
-    uint64_t bps_wait = 0, iops_wait = 0;
-    double   elapsed_time;
-    int      bps_ret, iops_ret;
-
-    now = qemu_get_clock_ns(vm_clock);
-    if ((bs->slice_start < now)
-        && (bs->slice_end > now)) {
-        bs->slice_end = now + bs->slice_time;
-    } else {
-        bs->slice_time  =  5 * BLOCK_IO_SLICE_TIME;
-        bs->slice_start = now;
-        bs->slice_end   = now + bs->slice_time;
-
-        bs->io_base.bytes[is_write]  = bs->nr_bytes[is_write];
-        bs->io_base.bytes[!is_write] = bs->nr_bytes[!is_write];
-
-        bs->io_base.ios[is_write]    = bs->nr_ops[is_write];
-        bs->io_base.ios[!is_write]   = bs->nr_ops[!is_write];
-    }
-
-    elapsed_time  = now - bs->slice_start;
-    elapsed_time  /= (NANOSECONDS_PER_SECOND);
-
-    bps_ret  = bdrv_exceed_bps_limits(bs, nb_sectors,
-                                      is_write, elapsed_time, &bps_wait);
-    iops_ret = bdrv_exceed_iops_limits(bs, is_write,
-                                      elapsed_time, &iops_wait);
-    if (bps_ret || iops_ret) {
-        max_wait = bps_wait > iops_wait ? bps_wait : iops_wait;
-        if (wait) {
-            *wait = max_wait;
-        }
-
-        now = qemu_get_clock_ns(vm_clock);
-        if (bs->slice_end < now + max_wait) {
-            bs->slice_end = now + max_wait;
-        }
-
-        return true;
-    }
-
-    if (wait) {
-        *wait = 0;
-    }
-
-    return false;
-}
-
-/**************************************************************/
-/* async block device emulation */
-
-typedef struct BlockDriverAIOCBSync {
-    BlockDriverAIOCB common;
-    QEMUBH *bh;
-    int ret;
-    /* vector translation state */
-    QEMUIOVector *qiov;
-    uint8_t *bounce;
-    int is_write;
-} BlockDriverAIOCBSync;
-
-static void bdrv_aio_cancel_em(BlockDriverAIOCB *blockacb)
-{
-    BlockDriverAIOCBSync *acb =
-        container_of(blockacb, BlockDriverAIOCBSync, common);
-    qemu_bh_delete(acb->bh);
-    acb->bh = NULL;
-    qemu_aio_release(acb);
-}
-
-static AIOPool bdrv_em_aio_pool = {
-    .aiocb_size         = sizeof(BlockDriverAIOCBSync),
-    .cancel             = bdrv_aio_cancel_em,
-};
-
-static void bdrv_aio_bh_cb(void *opaque)
-{
-    BlockDriverAIOCBSync *acb = opaque;
-
-    if (!acb->is_write)
-        qemu_iovec_from_buf(acb->qiov, 0, acb->bounce, acb->qiov->size);
-    qemu_vfree(acb->bounce);
-    acb->common.cb(acb->common.opaque, acb->ret);
-    qemu_bh_delete(acb->bh);
-    acb->bh = NULL;
-    qemu_aio_release(acb);
+    if (!acb->is_write)
+        qemu_iovec_from_buf(acb->qiov, 0, acb->bounce, acb->qiov->size);
+    qemu_vfree(acb->bounce);
+    acb->common.cb(acb->common.opaque, acb->ret);
+    qemu_bh_delete(acb->bh);
+    acb->bh = NULL;
+    qemu_aio_release(acb);
 }
 
 static BlockDriverAIOCB *bdrv_aio_rw_vector(BlockDriverState *bs,
@@ -3267,7 +3552,7 @@ static BlockDriverAIOCB *bdrv_aio_rw_vector(BlockDriverState *bs,
     acb->is_write = is_write;
     acb->qiov = qiov;
     acb->bounce = qemu_blockalign(bs, qiov->size);
-    acb->bh = qemu_bh_new(bdrv_aio_bh_cb, acb);
+    acb->bh = aio_bh_new(bdrv_get_aio_context(bs), bdrv_aio_bh_cb, acb);
 
     if (is_write) {
         qemu_iovec_to_buf(acb->qiov, 0, acb->bounce, qiov->size);
@@ -3336,7 +3621,8 @@ static void coroutine_fn bdrv_co_do_rw(void *opaque)
             acb->req.nb_sectors, acb->req.qiov, 0);
     }
 
-    acb->bh = qemu_bh_new(bdrv_co_em_bh, acb);
+    acb->bh = aio_bh_new(bdrv_get_aio_context(acb->common.bs),
+                         bdrv_co_em_bh, acb);
     qemu_bh_schedule(acb->bh);
 }
 
@@ -3369,7 +3655,8 @@ static void coroutine_fn bdrv_aio_flush_co_entry(void *opaque)
     BlockDriverState *bs = acb->common.bs;
 
     acb->req.error = bdrv_co_flush(bs);
-    acb->bh = qemu_bh_new(bdrv_co_em_bh, acb);
+    acb->bh = aio_bh_new(bdrv_get_aio_context(acb->common.bs),
+                         bdrv_co_em_bh, acb);
     qemu_bh_schedule(acb->bh);
 }
 
@@ -3394,7 +3681,8 @@ static void coroutine_fn bdrv_aio_discard_co_entry(void *opaque)
     BlockDriverState *bs = acb->common.bs;
 
     acb->req.error = bdrv_co_discard(bs, acb->req.sector, acb->req.nb_sectors);
-    acb->bh = qemu_bh_new(bdrv_co_em_bh, acb);
+    acb->bh = aio_bh_new(bdrv_get_aio_context(acb->common.bs),
+                         bdrv_co_em_bh, acb);
     qemu_bh_schedule(acb->bh);
 }
 
@@ -3432,13 +3720,9 @@ void *qemu_aio_get(AIOPool *pool, BlockDriverState *bs,
 {
     BlockDriverAIOCB *acb;
 
-    if (pool->free_aiocb) {
-        acb = pool->free_aiocb;
-        pool->free_aiocb = acb->next;
-    } else {
-        acb = g_malloc0(pool->aiocb_size);
-        acb->pool = pool;
-    }
+    /* g_slice keeps per-thread magazines, so this works from any context */
+    acb = g_slice_alloc0(pool->aiocb_size);
+    acb->pool = pool;
     acb->bs = bs;
     acb->cb = cb;
     acb->opaque = opaque;
@@ -3447,10 +3731,8 @@ void *qemu_aio_get(AIOPool *pool, BlockDriverState *bs,
 
 void qemu_aio_release(void *p)
 {
-    BlockDriverAIOCB *acb = (BlockDriverAIOCB *)p;
-    AIOPool *pool = acb->pool;
-    acb->next = pool->free_aiocb;
-    pool->free_aiocb = acb;
+    BlockDriverAIOCB *acb = p;
+    g_slice_free1(acb->pool->aiocb_size, acb);
 }
 
 /**************************************************************/
@@ -3516,14 +3798,10 @@ static void coroutine_fn bdrv_flush_co_entry(void *opaque)
     rwco->ret = bdrv_co_flush(rwco->bs);
 }
 
-int coroutine_fn bdrv_co_flush(BlockDriverState *bs)
+static int coroutine_fn bdrv_co_do_flush(BlockDriverState *bs)
 {
     int ret;
 
-    if (!bs || !bdrv_is_inserted(bs) || bdrv_is_read_only(bs)) {
-        return 0;
-    }
-
     /* Write back cached data to the OS even with cache=unsafe */
     if (bs->drv->bdrv_co_flush_to_os) {
         ret = bs->drv->bdrv_co_flush_to_os(bs);
@@ -3577,6 +3855,22 @@ flush_parent:
     return bdrv_co_flush(bs->file);
 }
 
+int coroutine_fn bdrv_co_flush(BlockDriverState *bs)
+{
+    BlockAcctCookie acct;
+    int ret;
+
+    if (!bs || !bdrv_is_inserted(bs) || bdrv_is_read_only(bs)) {
+        return 0;
+    }
+
+    bdrv_layer_acct_start(bs, &acct, 0, BDRV_ACCT_FLUSH);
+    ret = bdrv_co_do_flush(bs);
+    bdrv_layer_acct_done(bs, &acct);
+
+    return ret;
+}
+
 void bdrv_invalidate_cache(BlockDriverState *bs)
 {
     if (bs->drv && bs->drv->bdrv_invalidate_cache) {
@@ -3593,6 +3887,26 @@ void bdrv_invalidate_cache_all(void)
     }
 }
 
+/*
+ * Called on the source of a migration with the VM stopped.  Until
+ * bdrv_invalidate_cache() the images must not be written again.
+ */
+int bdrv_inactivate_all(void)
+{
+    BlockDriverState *bs;
+    int ret;
+
+    QTAILQ_FOREACH(bs, &bdrv_states, list) {
+        if (bs->drv && bs->drv->bdrv_inactivate) {
+            ret = bs->drv->bdrv_inactivate(bs);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+    }
+    return 0;
+}
+
 void bdrv_clear_incoming_migration_all(void)
 {
     BlockDriverState *bs;
@@ -3617,7 +3931,7 @@ int bdrv_flush(BlockDriverState *bs)
         co = qemu_coroutine_create(bdrv_flush_co_entry);
         qemu_coroutine_enter(co, &rwco);
         while (rwco.ret == NOT_DONE) {
-            qemu_aio_wait();
+            aio_poll(bdrv_get_aio_context(bs), true);
         }
     }
 
@@ -3640,7 +3954,12 @@ int coroutine_fn bdrv_co_discard(BlockDriverState *bs, int64_t sector_num,
         return -EIO;
     } else if (bs->read_only) {
         return -EROFS;
-    } else if (bs->drv->bdrv_co_discard) {
+    }
+
+    /* discarded sectors may read back differently from now on */
+    bdrv_set_dirty_bitmaps(bs, sector_num, nb_sectors);
+
+    if (bs->drv->bdrv_co_discard) {
         return bs->drv->bdrv_co_discard(bs, sector_num, nb_sectors);
     } else if (bs->drv->bdrv_aio_discard) {
         BlockDriverAIOCB *acb;
@@ -3678,7 +3997,7 @@ int bdrv_discard(BlockDriverState *bs, int64_t sector_num, int nb_sectors)
         co = qemu_coroutine_create(bdrv_discard_co_entry);
         qemu_coroutine_enter(co, &rwco);
         while (rwco.ret == NOT_DONE) {
-            qemu_aio_wait();
+            aio_poll(bdrv_get_aio_context(bs), true);
         }
     }
 
@@ -3813,17 +4132,312 @@ int bdrv_get_dirty(BlockDriverState *bs, int64_t sector)
     }
 }
 
+void bdrv_set_dirty(BlockDriverState *bs, int64_t cur_sector,
+                    int nr_sectors)
+{
+    set_dirty_bitmap(bs, cur_sector, nr_sectors, 1);
+}
+
 void bdrv_reset_dirty(BlockDriverState *bs, int64_t cur_sector,
                       int nr_sectors)
 {
     set_dirty_bitmap(bs, cur_sector, nr_sectors, 0);
 }
 
+/*
+ * Returns the first sector of the first dirty chunk at or after @sector,
+ * or -1 if there is none.
+ */
+int64_t bdrv_get_next_dirty(BlockDriverState *bs, int64_t sector)
+{
+    int64_t nb_chunks, chunk;
+
+    if (!bs->dirty_bitmap || !bs->dirty_count) {
+        return -1;
+    }
+
+    nb_chunks = ((bdrv_getlength(bs) >> BDRV_SECTOR_BITS) +
+                 BDRV_SECTORS_PER_DIRTY_CHUNK - 1) /
+                BDRV_SECTORS_PER_DIRTY_CHUNK;
+    chunk = sector / BDRV_SECTORS_PER_DIRTY_CHUNK;
+    if (chunk >= nb_chunks) {
+        return -1;
+    }
+
+    chunk = find_next_bit(bs->dirty_bitmap, nb_chunks, chunk);
+    if (chunk >= nb_chunks) {
+        return -1;
+    }
+    return chunk * BDRV_SECTORS_PER_DIRTY_CHUNK;
+}
+
 int64_t bdrv_get_dirty_count(BlockDriverState *bs)
 {
     return bs->dirty_count;
 }
 
+static int64_t bdrv_dirty_bitmap_nb_bits(int64_t size, int64_t granularity)
+{
+    return (size + granularity - 1) / granularity;
+}
+
+BdrvDirtyBitmap *bdrv_create_dirty_bitmap(BlockDriverState *bs,
+                                          const char *name,
+                                          int64_t granularity, Error **errp)
+{
+    BdrvDirtyBitmap *bitmap;
+    int64_t size, nb_bits;
+
+    if (granularity < BDRV_SECTOR_SIZE || (granularity & (granularity - 1))) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "granularity",
+                  "a power of two of at least 512");
+        return NULL;
+    }
+    if (bdrv_find_dirty_bitmap(bs, name)) {
+        error_set(errp, QERR_DUPLICATE_ID, name, "dirty bitmap");
+        return NULL;
+    }
+    size = bdrv_getlength(bs);
+    if (size < 0) {
+        error_set(errp, QERR_DEVICE_HAS_NO_MEDIUM, bdrv_get_device_name(bs));
+        return NULL;
+    }
+    nb_bits = bdrv_dirty_bitmap_nb_bits(size, granularity);
+    if (nb_bits > INT_MAX) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "granularity",
+                  "a larger granularity for a device of this size");
+        return NULL;
+    }
+
+    bitmap = g_malloc0(sizeof(*bitmap));
+    bitmap->name = g_strdup(name);
+    bitmap->granularity = granularity;
+    bitmap->size = size;
+    bitmap->nb_bits = nb_bits;
+    bitmap->bitmap = bitmap_new(nb_bits);
+    QLIST_INSERT_HEAD(&bs->dirty_bitmaps, bitmap, list);
+    return bitmap;
+}
+
+BdrvDirtyBitmap *bdrv_find_dirty_bitmap(BlockDriverState *bs,
+                                        const char *name)
+{
+    BdrvDirtyBitmap *bitmap;
+
+    QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
+        if (!strcmp(bitmap->name, name)) {
+            return bitmap;
+        }
+    }
+    return NULL;
+}
+
+BdrvDirtyBitmap *bdrv_next_dirty_bitmap(BlockDriverState *bs,
+                                        BdrvDirtyBitmap *bitmap)
+{
+    if (!bitmap) {
+        return QLIST_FIRST(&bs->dirty_bitmaps);
+    }
+    return QLIST_NEXT(bitmap, list);
+}
+
+void bdrv_release_dirty_bitmap(BlockDriverState *bs, BdrvDirtyBitmap *bitmap)
+{
+    QLIST_REMOVE(bitmap, list);
+    g_free(bitmap->bitmap);
+    g_free(bitmap->name);
+    g_free(bitmap);
+}
+
+static void bdrv_release_all_dirty_bitmaps(BlockDriverState *bs)
+{
+    while (!QLIST_EMPTY(&bs->dirty_bitmaps)) {
+        bdrv_release_dirty_bitmap(bs, QLIST_FIRST(&bs->dirty_bitmaps));
+    }
+}
+
+const char *bdrv_dirty_bitmap_name(BdrvDirtyBitmap *bitmap)
+{
+    return bitmap->name;
+}
+
+int64_t bdrv_dirty_bitmap_granularity(BdrvDirtyBitmap *bitmap)
+{
+    return bitmap->granularity;
+}
+
+int64_t bdrv_dirty_bitmap_count(BdrvDirtyBitmap *bitmap)
+{
+    return bitmap->count;
+}
+
+bool bdrv_dirty_bitmap_persistent(BdrvDirtyBitmap *bitmap)
+{
+    return bitmap->persistent;
+}
+
+void bdrv_dirty_bitmap_set_persistent(BdrvDirtyBitmap *bitmap,
+                                      bool persistent)
+{
+    bitmap->persistent = persistent;
+}
+
+bool bdrv_can_store_dirty_bitmap(BlockDriverState *bs, const char *name)
+{
+    BlockDriver *drv = bs->drv;
+
+    return drv && drv->bdrv_can_store_dirty_bitmap &&
+           drv->bdrv_can_store_dirty_bitmap(bs, name);
+}
+
+void bdrv_clear_dirty_bitmap(BdrvDirtyBitmap *bitmap)
+{
+    bitmap_zero(bitmap->bitmap, bitmap->nb_bits);
+    bitmap->count = 0;
+}
+
+void bdrv_dirty_bitmap_set_all(BdrvDirtyBitmap *bitmap)
+{
+    bitmap_zero(bitmap->bitmap, bitmap->nb_bits);
+    bitmap_set(bitmap->bitmap, 0, bitmap->nb_bits);
+    bitmap->count = bitmap->nb_bits;
+}
+
+static void bdrv_dirty_bitmaps_set_all(BlockDriverState *bs)
+{
+    BdrvDirtyBitmap *bitmap;
+
+    QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
+        bdrv_dirty_bitmap_set_all(bitmap);
+    }
+}
+
+static void bdrv_set_dirty_bitmaps(BlockDriverState *bs, int64_t sector_num,
+                                   int nb_sectors)
+{
+    int64_t start = sector_num * BDRV_SECTOR_SIZE;
+    int64_t end = (sector_num + nb_sectors) * BDRV_SECTOR_SIZE;
+    BdrvDirtyBitmap *bitmap;
+    int64_t bit, last;
+
+    QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
+        last = MIN((end - 1) / bitmap->granularity, bitmap->nb_bits - 1);
+        for (bit = start / bitmap->granularity; bit <= last; bit++) {
+            if (!test_and_set_bit(bit, bitmap->bitmap)) {
+                bitmap->count++;
+            }
+        }
+    }
+}
+
+/*
+ * Resizing keeps the bits of the part of the device that stays, and marks
+ * the part that is added dirty, as whatever it reads is new to a backup.
+ * With @check_only, only tell whether all the bitmaps can grow to @size.
+ */
+static int bdrv_dirty_bitmaps_resize(BlockDriverState *bs, int64_t size,
+                                     bool check_only)
+{
+    BdrvDirtyBitmap *bitmap;
+    unsigned long *old;
+    int64_t nb_bits;
+    int old_bits, bit;
+
+    QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
+        nb_bits = bdrv_dirty_bitmap_nb_bits(size, bitmap->granularity);
+        if (nb_bits > INT_MAX) {
+            return -EFBIG;
+        }
+        if (check_only) {
+            continue;
+        }
+
+        old = bitmap->bitmap;
+        old_bits = bitmap->nb_bits;
+        bitmap->bitmap = bitmap_new(nb_bits);
+        bitmap->nb_bits = nb_bits;
+        bitmap->size = size;
+        bitmap->count = 0;
+        for (bit = find_first_bit(old, old_bits); bit < MIN(old_bits, nb_bits);
+             bit = find_next_bit(old, old_bits, bit + 1)) {
+            set_bit(bit, bitmap->bitmap);
+            bitmap->count++;
+        }
+        if (nb_bits > old_bits) {
+            bitmap_set(bitmap->bitmap, old_bits, nb_bits - old_bits);
+            bitmap->count += nb_bits - old_bits;
+        }
+        g_free(old);
+    }
+    return 0;
+}
+
+/*
+ * Finds the dirty range that contains @offset, or the first one after it.
+ * Returns its start in bytes and stores its length in @len, or returns -1
+ * if no other part of the device is dirty.
+ */
+int64_t bdrv_dirty_bitmap_next_range(BdrvDirtyBitmap *bitmap, int64_t offset,
+                                     int64_t *len)
+{
+    int64_t bit = offset / bitmap->granularity;
+    int64_t start, end;
+
+    if (offset < 0 || bit >= bitmap->nb_bits) {
+        return -1;
+    }
+    bit = find_next_bit(bitmap->bitmap, bitmap->nb_bits, bit);
+    if (bit >= bitmap->nb_bits) {
+        return -1;
+    }
+    end = find_next_zero_bit(bitmap->bitmap, bitmap->nb_bits, bit);
+
+    start = bit * bitmap->granularity;
+    *len = MIN(end * bitmap->granularity, bitmap->size) - start;
+    return start;
+}
+
+/*
+ * The serialized form is the same on every host: bit n of the bitmap is
+ * bit n % 8 of byte n / 8.
+ */
+uint64_t bdrv_dirty_bitmap_serialized_size(BdrvDirtyBitmap *bitmap)
+{
+    return ((uint64_t)bitmap->nb_bits + 7) / 8;
+}
+
+void bdrv_dirty_bitmap_serialize(BdrvDirtyBitmap *bitmap, uint8_t *buf)
+{
+    int bit;
+
+    memset(buf, 0, bdrv_dirty_bitmap_serialized_size(bitmap));
+    for (bit = find_first_bit(bitmap->bitmap, bitmap->nb_bits);
+         bit < bitmap->nb_bits;
+         bit = find_next_bit(bitmap->bitmap, bitmap->nb_bits, bit + 1)) {
+        buf[bit / 8] |= 1 << (bit % 8);
+    }
+}
+
+void bdrv_dirty_bitmap_deserialize(BdrvDirtyBitmap *bitmap,
+                                   const uint8_t *buf)
+{
+    uint64_t i, size = bdrv_dirty_bitmap_serialized_size(bitmap);
+    int bit;
+
+    bdrv_clear_dirty_bitmap(bitmap);
+    for (i = 0; i < size; i++) {
+        if (!buf[i]) {
+            continue;
+        }
+        for (bit = i * 8; bit < MIN(i * 8 + 8, bitmap->nb_bits); bit++) {
+            if (buf[i] & (1 << (bit % 8))) {
+                set_bit(bit, bitmap->bitmap);
+                bitmap->count++;
+            }
+        }
+    }
+}
+
 void bdrv_set_in_use(BlockDriverState *bs, int in_use)
 {
     assert(bs->in_use != in_use);
@@ -3835,6 +4449,130 @@ int bdrv_in_use(BlockDriverState *bs)
     return bs->in_use;
 }
 
+AioContext *bdrv_get_aio_context(BlockDriverState *bs)
+{
+    return bs->aio_context;
+}
+
+static void bdrv_detach_aio_context(BlockDriverState *bs)
+{
+    if (!bs->drv) {
+        return;
+    }
+
+    if (bs->drv->bdrv_detach_aio_context) {
+        bs->drv->bdrv_detach_aio_context(bs);
+    }
+    if (bs->file) {
+        bdrv_detach_aio_context(bs->file);
+    }
+    if (bs->backing_hd) {
+        bdrv_detach_aio_context(bs->backing_hd);
+    }
+}
+
+/* On failure the whole tree is left detached */
+static int bdrv_attach_aio_context(BlockDriverState *bs,
+                                   AioContext *new_context)
+{
+    BlockDriver *drv = bs->drv;
+    int ret = 0;
+
+    if (!drv) {
+        bs->aio_context = new_context;
+        return 0;
+    }
+
+    if (bs->backing_hd) {
+        ret = bdrv_attach_aio_context(bs->backing_hd, new_context);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    if (bs->file) {
+        ret = bdrv_attach_aio_context(bs->file, new_context);
+        if (ret < 0) {
+            goto fail_file;
+        }
+    }
+
+    if (drv->bdrv_attach_aio_context) {
+        ret = drv->bdrv_attach_aio_context(bs, new_context);
+    } else if (new_context != qemu_get_aio_context()) {
+        ret = -ENOTSUP;
+    }
+    if (ret < 0) {
+        goto fail_drv;
+    }
+
+    bs->aio_context = new_context;
+    return 0;
+
+fail_drv:
+    if (bs->file) {
+        bdrv_detach_aio_context(bs->file);
+    }
+fail_file:
+    if (bs->backing_hd) {
+        bdrv_detach_aio_context(bs->backing_hd);
+    }
+    return ret;
+}
+
+/*
+ * Move @bs and the BDSes below it to @new_context, so that their callbacks
+ * are dispatched by the thread that runs it.  The caller must make sure
+ * that no request is in flight.  Returns -ENOTSUP, leaving @bs where it
+ * was, if a driver on the chain or I/O throttling only work in the main
+ * loop.
+ */
+int bdrv_set_aio_context(BlockDriverState *bs, AioContext *new_context)
+{
+    AioContext *old_context = bdrv_get_aio_context(bs);
+    int ret;
+
+    if (new_context == old_context) {
+        return 0;
+    }
+    if (bs->io_limits_enabled || bs->job) {
+        return -ENOTSUP;
+    }
+    assert(QLIST_EMPTY(&bs->tracked_requests));
+
+    bdrv_detach_aio_context(bs);
+    ret = bdrv_attach_aio_context(bs, new_context);
+    if (ret < 0) {
+        bdrv_attach_aio_context(bs, old_context);
+    }
+    return ret;
+}
+
+/*
+ * Requests issued between bdrv_io_plug() and bdrv_io_unplug() may be
+ * submitted to the host together when unplugging.  Calls nest.
+ */
+void bdrv_io_plug(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (drv && drv->bdrv_io_plug) {
+        drv->bdrv_io_plug(bs);
+    } else if (bs->file) {
+        bdrv_io_plug(bs->file);
+    }
+}
+
+void bdrv_io_unplug(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (drv && drv->bdrv_io_unplug) {
+        drv->bdrv_io_unplug(bs);
+    } else if (bs->file) {
+        bdrv_io_unplug(bs->file);
+    }
+}
+
 void bdrv_iostatus_enable(BlockDriverState *bs)
 {
     bs->iostatus_enabled = true;
@@ -3890,11 +4628,82 @@ bdrv_acct_start(BlockDriverState *bs, BlockAcctCookie *cookie, int64_t bytes,
 void
 bdrv_acct_done(BlockDriverState *bs, BlockAcctCookie *cookie)
 {
+    int64_t latency_ns = get_clock() - cookie->start_time_ns;
+    BlockLatencyHistogram *hist = &bs->latency_histogram[cookie->type];
+
     assert(cookie->type < BDRV_MAX_IOTYPE);
 
     bs->nr_bytes[cookie->type] += cookie->bytes;
     bs->nr_ops[cookie->type]++;
-    bs->total_time_ns[cookie->type] += get_clock() - cookie->start_time_ns;
+    bs->total_time_ns[cookie->type] += latency_ns;
+
+    if (hist->nbins) {
+        int lo = 0, hi = hist->nbins - 1;
+
+        /* find the first boundary above latency_ns */
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (latency_ns < hist->boundaries[mid]) {
+                hi = mid;
+            } else {
+                lo = mid + 1;
+            }
+        }
+        hist->bins[lo]++;
+    }
+}
+
+/*
+ * Requests that reach a BlockDriverState are accounted by the device the
+ * guest sees, if there is one attached, and by the block layer otherwise;
+ * so the statistics of the layers below a device (image format, protocol,
+ * backing files) describe the requests that the layer above issued.
+ */
+static void bdrv_layer_acct_start(BlockDriverState *bs,
+                                  BlockAcctCookie *cookie, int64_t bytes,
+                                  enum BlockAcctType type)
+{
+    bs->in_flight++;
+    bdrv_acct_start(bs, cookie, bytes, type);
+}
+
+static void bdrv_layer_acct_done(BlockDriverState *bs, BlockAcctCookie *cookie)
+{
+    bs->in_flight--;
+    if (!bs->dev) {
+        bdrv_acct_done(bs, cookie);
+    }
+}
+
+/*
+ * Collect a histogram of the latencies of the requests of the given type,
+ * for bs and the layers below it.  The nboundaries latencies, in
+ * nanoseconds, must be strictly increasing; nboundaries == 0 disables the
+ * histogram.  Any previous histogram is discarded.
+ */
+void bdrv_set_latency_histogram(BlockDriverState *bs, enum BlockAcctType type,
+                                const int64_t *boundaries, int nboundaries)
+{
+    BlockLatencyHistogram *hist;
+
+    if (!bs) {
+        return;
+    }
+
+    hist = &bs->latency_histogram[type];
+    g_free(hist->boundaries);
+    g_free(hist->bins);
+    memset(hist, 0, sizeof(*hist));
+
+    if (nboundaries) {
+        hist->nbins = nboundaries + 1;
+        hist->boundaries = g_memdup(boundaries,
+                                    nboundaries * sizeof(*boundaries));
+        hist->bins = g_new0(uint64_t, hist->nbins);
+    }
+
+    bdrv_set_latency_histogram(bs->file, type, boundaries, nboundaries);
+    bdrv_set_latency_histogram(bs->backing_hd, type, boundaries, nboundaries);
 }
 
 int bdrv_img_create(const char *filename, const char *fmt,
@@ -4081,7 +4890,21 @@ void *block_job_create(const BlockJobType *job_type, BlockDriverState *bs,
     return job;
 }
 
-void block_job_complete(BlockJob *job, int ret)
+QObject *qobject_from_block_job(BlockJob *job)
+{
+    return qobject_from_jsonf("{ 'type': %s,"
+                              "'device': %s,"
+                              "'len': %" PRId64 ","
+                              "'offset': %" PRId64 ","
+                              "'speed': %" PRId64 " }",
+                              job->job_type->job_type,
+                              bdrv_get_device_name(job->bs),
+                              job->len,
+                              job->offset,
+                              job->speed);
+}
+
+void block_job_completed(BlockJob *job, int ret)
 {
     BlockDriverState *bs = job->bs;
 
@@ -4122,6 +4945,25 @@ bool block_job_is_cancelled(BlockJob *job)
     return job->cancelled;
 }
 
+void block_job_complete(BlockJob *job, Error **errp)
+{
+    if (job->cancelled || !job->job_type->complete) {
+        error_set(errp, QERR_BLOCK_JOB_NOT_READY, bdrv_get_device_name(job->bs));
+        return;
+    }
+
+    job->job_type->complete(job, errp);
+}
+
+void block_job_ready(BlockJob *job)
+{
+    QObject *obj;
+
+    obj = qobject_from_block_job(job);
+    monitor_protocol_event(QEVENT_BLOCK_JOB_READY, obj);
+    qobject_decref(obj);
+}
+
 struct BlockCancelData {
     BlockJob *job;
     BlockDriverCompletionFunc *cb;
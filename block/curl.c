@@ -23,6 +23,7 @@
  */
 #include "qemu-common.h"
 #include "block_int.h"
+#include "trace.h"
 #include <curl/curl.h>
 
 // #define DEBUG
@@ -38,6 +39,12 @@
 #define CURL_NUM_ACB    8
 #define SECTOR_SIZE     512
 #define READ_AHEAD_SIZE (256 * 1024)
+/* Sequential readers get up to this much readahead */
+#define READ_AHEAD_MAX  (4 * 1024 * 1024)
+
+/* Completed transfers are kept in an LRU cache of blocks of this size */
+#define CURL_BLOCK_SIZE (64 * 1024)
+#define CURL_CACHE_SIZE (32 * 1024 * 1024)
 
 #define FIND_RET_NONE   0
 #define FIND_RET_OK     1
@@ -71,12 +78,31 @@ typedef struct CURLState
     char in_use;
 } CURLState;
 
+typedef struct CURLCacheBlock {
+    int64_t index;
+    char *buf;
+    QTAILQ_ENTRY(CURLCacheBlock) lru;
+} CURLCacheBlock;
+
 typedef struct BDRVCURLState {
     CURLM *multi;
     size_t len;
     CURLState states[CURL_NUM_STATES];
     char *url;
     size_t readahead_size;
+
+    /* readahead of the next miss, grows while the guest reads sequentially */
+    size_t cur_readahead;
+    size_t next_offset;
+
+    size_t cache_size;
+    GHashTable *cache;
+    QTAILQ_HEAD(CURLCacheLRU, CURLCacheBlock) cache_lru;
+    int cache_blocks;
+
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    uint64_t bytes_fetched;
 } BDRVCURLState;
 
 static void curl_clean_state(CURLState *s);
@@ -123,6 +149,7 @@ static size_t curl_read_cb(void *ptr, size_t size, size_t nmemb, void *opaque)
 {
     CURLState *s = ((CURLState*)opaque);
     size_t realsize = size * nmemb;
+    size_t n;
     int i;
 
     DPRINTF("CURL: Just reading %zd bytes\n", realsize);
@@ -130,8 +157,10 @@ static size_t curl_read_cb(void *ptr, size_t size, size_t nmemb, void *opaque)
     if (!s || !s->orig_buf)
         goto read_end;
 
-    memcpy(s->orig_buf + s->buf_off, ptr, realsize);
-    s->buf_off += realsize;
+    n = MIN(realsize, s->buf_len - s->buf_off);
+    memcpy(s->orig_buf + s->buf_off, ptr, n);
+    s->buf_off += n;
+    s->s->bytes_fetched += n;
 
     for(i=0; i<CURL_NUM_ACB; i++) {
         CURLAIOCB *acb = s->acb[i];
@@ -205,6 +234,117 @@ static int curl_find_buf(BDRVCURLState *s, size_t start, size_t len,
     return FIND_RET_NONE;
 }
 
+static void curl_cache_block_free(gpointer data)
+{
+    CURLCacheBlock *block = data;
+
+    g_free(block->buf);
+    g_free(block);
+}
+
+static void curl_cache_init(BDRVCURLState *s)
+{
+    QTAILQ_INIT(&s->cache_lru);
+    if (s->cache_size < CURL_BLOCK_SIZE) {
+        return;
+    }
+    /* the key lives inside the block and goes away with it */
+    s->cache = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+                                     NULL, curl_cache_block_free);
+}
+
+static void curl_cache_destroy(BDRVCURLState *s)
+{
+    if (s->cache) {
+        g_hash_table_destroy(s->cache);
+        s->cache = NULL;
+    }
+}
+
+static CURLCacheBlock *curl_cache_lookup(BDRVCURLState *s, int64_t index)
+{
+    CURLCacheBlock *block;
+
+    block = g_hash_table_lookup(s->cache, &index);
+    if (block) {
+        QTAILQ_REMOVE(&s->cache_lru, block, lru);
+        QTAILQ_INSERT_HEAD(&s->cache_lru, block, lru);
+    }
+    return block;
+}
+
+static void curl_cache_insert(BDRVCURLState *s, int64_t index,
+                              const char *data, size_t len)
+{
+    CURLCacheBlock *block;
+
+    block = g_hash_table_lookup(s->cache, &index);
+    if (block) {
+        return;
+    }
+
+    if ((size_t)(s->cache_blocks + 1) * CURL_BLOCK_SIZE > s->cache_size) {
+        block = QTAILQ_LAST(&s->cache_lru, CURLCacheLRU);
+        QTAILQ_REMOVE(&s->cache_lru, block, lru);
+        g_hash_table_remove(s->cache, &block->index);
+        s->cache_blocks--;
+    }
+
+    block = g_malloc(sizeof(*block));
+    block->index = index;
+    block->buf = g_malloc(CURL_BLOCK_SIZE);
+    memcpy(block->buf, data, len);
+    QTAILQ_INSERT_HEAD(&s->cache_lru, block, lru);
+    g_hash_table_insert(s->cache, &block->index, block);
+    s->cache_blocks++;
+}
+
+/* Satisfy a read from the cache if all the blocks it covers are there */
+static bool curl_cache_read(BDRVCURLState *s, size_t start, size_t len,
+                            QEMUIOVector *qiov)
+{
+    size_t end = start + len, pos, n;
+    int64_t i, first = start / CURL_BLOCK_SIZE;
+    int64_t last = (end - 1) / CURL_BLOCK_SIZE;
+    CURLCacheBlock *block;
+
+    if (!s->cache) {
+        return false;
+    }
+    for (i = first; i <= last; i++) {
+        if (!g_hash_table_lookup(s->cache, &i)) {
+            return false;
+        }
+    }
+    for (pos = start; pos < end; pos += n) {
+        block = curl_cache_lookup(s, pos / CURL_BLOCK_SIZE);
+        n = MIN(end - pos, CURL_BLOCK_SIZE - pos % CURL_BLOCK_SIZE);
+        qemu_iovec_from_buf(qiov, pos - start,
+                            block->buf + pos % CURL_BLOCK_SIZE, n);
+    }
+    return true;
+}
+
+/* Remember the whole blocks of a finished transfer; buffers start on a
+ * block boundary, and the last block of the image may be short.  */
+static void curl_cache_fill(BDRVCURLState *s, CURLState *state)
+{
+    size_t pos, n;
+
+    if (!s->cache || !state->orig_buf) {
+        return;
+    }
+    assert(state->buf_start % CURL_BLOCK_SIZE == 0);
+    for (pos = 0; pos < state->buf_off; pos += CURL_BLOCK_SIZE) {
+        n = MIN(state->buf_off - pos, CURL_BLOCK_SIZE);
+        if (n < CURL_BLOCK_SIZE && state->buf_start + pos + n < s->len) {
+            break;
+        }
+        curl_cache_insert(s, (state->buf_start + pos) / CURL_BLOCK_SIZE,
+                          state->orig_buf + pos, n);
+    }
+}
+
 static void curl_multi_do(void *arg)
 {
     BDRVCURLState *s = (BDRVCURLState *)arg;
@@ -237,7 +377,9 @@ static void curl_multi_do(void *arg)
                 curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**)&state);
 
                 /* ACBs for successful messages get completed in curl_read_cb */
-                if (msg->data.result != CURLE_OK) {
+                if (msg->data.result == CURLE_OK) {
+                    curl_cache_fill(s, state);
+                } else {
                     int i;
                     for (i = 0; i < CURL_NUM_ACB; i++) {
                         CURLAIOCB *acb = state->acb[i];
@@ -320,47 +462,46 @@ static void curl_clean_state(CURLState *s)
     s->in_use = 0;
 }
 
+/* Strip a trailing "<optstr>#:" from @file, storing the number in @val */
+static bool curl_parse_trailing_opt(char *file, const char *optstr,
+                                    size_t *val)
+{
+    size_t len = strlen(file), optlen = strlen(optstr);
+    char *p;
+
+    if (len == 0 || file[len - 1] != ':') {
+        return false;
+    }
+    p = file + len - 1;
+    while (p > file && p[-1] >= '0' && p[-1] <= '9') {
+        p--;
+    }
+    if (p == file + len - 1 || p - file <= optlen ||
+        strncmp(p - optlen, optstr, optlen) != 0) {
+        return false;
+    }
+    *val = strtoull(p, NULL, 10);
+    p[-optlen] = '\0';
+    return true;
+}
+
 static int curl_open(BlockDriverState *bs, const char *filename, int flags)
 {
     BDRVCURLState *s = bs->opaque;
     CURLState *state = NULL;
     double d;
-
-    #define RA_OPTSTR ":readahead="
     char *file;
-    char *ra;
-    const char *ra_val;
-    int parse_state = 0;
 
     static int inited = 0;
 
     file = g_strdup(filename);
     s->readahead_size = READ_AHEAD_SIZE;
+    s->cache_size = CURL_CACHE_SIZE;
 
-    /* Parse a trailing ":readahead=#:" param, if present. */
-    ra = file + strlen(file) - 1;
-    while (ra >= file) {
-        if (parse_state == 0) {
-            if (*ra == ':')
-                parse_state++;
-            else
-                break;
-        } else if (parse_state == 1) {
-            if (*ra > '9' || *ra < '0') {
-                char *opt_start = ra - strlen(RA_OPTSTR) + 1;
-                if (opt_start > file &&
-                    strncmp(opt_start, RA_OPTSTR, strlen(RA_OPTSTR)) == 0) {
-                    ra_val = ra + 1;
-                    ra -= strlen(RA_OPTSTR) - 1;
-                    *ra = '\0';
-                    s->readahead_size = atoi(ra_val);
-                    break;
-                } else {
-                    break;
-                }
-            }
-        }
-        ra--;
+    /* Parse trailing ":readahead=#:" and ":cache_size=#:" params */
+    while (curl_parse_trailing_opt(file, ":readahead=", &s->readahead_size) ||
+           curl_parse_trailing_opt(file, ":cache_size=", &s->cache_size)) {
+        /* nothing */
     }
 
     if ((s->readahead_size & 0x1ff) != 0) {
@@ -368,6 +509,7 @@ static int curl_open(BlockDriverState *bs, const char *filename, int flags)
                 s->readahead_size);
         goto out_noclean;
     }
+    s->cur_readahead = s->readahead_size;
 
     if (!inited) {
         curl_global_init(CURL_GLOBAL_ALL);
@@ -405,6 +547,7 @@ static int curl_open(BlockDriverState *bs, const char *filename, int flags)
     s->multi = curl_multi_init();
     curl_multi_setopt( s->multi, CURLMOPT_SOCKETDATA, s); 
     curl_multi_setopt( s->multi, CURLMOPT_SOCKETFUNCTION, curl_sock_cb ); 
+    curl_cache_init(s);
     curl_multi_do(s);
 
     return 0;
@@ -455,12 +598,30 @@ static void curl_readv_bh_cb(void *p)
     acb->bh = NULL;
 
     size_t start = acb->sector_num * SECTOR_SIZE;
+    size_t len = acb->nb_sectors * SECTOR_SIZE;
     size_t end;
 
+    /* Grow the readahead while the guest reads sequentially */
+    if (start == s->next_offset) {
+        s->cur_readahead = MIN(MAX(s->cur_readahead * 2, CURL_BLOCK_SIZE),
+                               MAX(s->readahead_size, READ_AHEAD_MAX));
+    } else {
+        s->cur_readahead = s->readahead_size;
+    }
+    s->next_offset = start + len;
+
+    if (curl_cache_read(s, start, len, acb->qiov)) {
+        s->cache_hits++;
+        acb->common.cb(acb->common.opaque, 0);
+        qemu_aio_release(acb);
+        return;
+    }
+
     // In case we have the requested data already (e.g. read-ahead),
     // we can just call the callback and be done.
-    switch (curl_find_buf(s, start, acb->nb_sectors * SECTOR_SIZE, acb)) {
+    switch (curl_find_buf(s, start, len, acb)) {
         case FIND_RET_OK:
+            s->cache_hits++;
             qemu_aio_release(acb);
             // fall through
         case FIND_RET_WAIT:
@@ -468,6 +629,7 @@ static void curl_readv_bh_cb(void *p)
         default:
             break;
     }
+    s->cache_misses++;
 
     // No cache found, so let's start a new request
     state = curl_init_state(s);
@@ -477,21 +639,23 @@ static void curl_readv_bh_cb(void *p)
         return;
     }
 
-    acb->start = 0;
-    acb->end = (acb->nb_sectors * SECTOR_SIZE);
-
+    /* Fetch whole blocks, so that the result can be cached */
     state->buf_off = 0;
     if (state->orig_buf)
         g_free(state->orig_buf);
-    state->buf_start = start;
-    state->buf_len = acb->end + s->readahead_size;
-    end = MIN(start + state->buf_len, s->len) - 1;
+    state->buf_start = start - start % CURL_BLOCK_SIZE;
+    acb->start = start - state->buf_start;
+    acb->end = acb->start + len;
+    state->buf_len = DIV_ROUND_UP(acb->end + s->cur_readahead,
+                                  CURL_BLOCK_SIZE) * CURL_BLOCK_SIZE;
+    state->buf_len = MIN(state->buf_len, s->len - state->buf_start);
+    end = state->buf_start + state->buf_len - 1;
     state->orig_buf = g_malloc(state->buf_len);
     state->acb[0] = acb;
 
-    snprintf(state->range, 127, "%zd-%zd", start, end);
-    DPRINTF("CURL (AIO): Reading %d at %zd (%s)\n",
-            (acb->nb_sectors * SECTOR_SIZE), start, state->range);
+    snprintf(state->range, 127, "%zd-%zd", state->buf_start, end);
+    DPRINTF("CURL (AIO): Reading %zd at %zd (%s)\n",
+            len, start, state->range);
     curl_easy_setopt(state->curl, CURLOPT_RANGE, state->range);
 
     curl_multi_add_handle(s->multi, state->curl);
@@ -528,6 +692,8 @@ static void curl_close(BlockDriverState *bs)
     int i;
 
     DPRINTF("CURL: Close\n");
+    trace_curl_cache_stats(s, s->cache_hits, s->cache_misses,
+                           s->bytes_fetched);
     for (i=0; i<CURL_NUM_STATES; i++) {
         if (s->states[i].in_use)
             curl_clean_state(&s->states[i]);
@@ -542,6 +708,7 @@ static void curl_close(BlockDriverState *bs)
     }
     if (s->multi)
         curl_multi_cleanup(s->multi);
+    curl_cache_destroy(s);
     if (s->url)
         free(s->url);
 }
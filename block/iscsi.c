@@ -40,6 +40,15 @@
 #include <hw/scsi-defs.h>
 #endif
 
+/* Commands in flight per LUN, unless the target reports a full task set */
+#define ISCSI_MAX_QUEUE_DEPTH   128
+/* Commands completed before a reduced queue depth grows by one again */
+#define ISCSI_QUEUE_RAMP_UP     256
+/* READ(10) has a 16 bit transfer length */
+#define ISCSI_MAX_XFER_LEN10    0xffff
+
+typedef struct IscsiAIOCB IscsiAIOCB;
+
 typedef struct IscsiLun {
     struct iscsi_context *iscsi;
     int lun;
@@ -47,9 +56,16 @@ typedef struct IscsiLun {
     int block_size;
     uint64_t num_blocks;
     int events;
+    /* from the Block Limits VPD page, in blocks; 0 if there is no limit */
+    uint32_t max_xfer_len;
+    int queue_depth;
+    int in_flight;
+    int ramp_up;
+    /* reads and writes waiting for a free slot in the queue */
+    QTAILQ_HEAD(, IscsiAIOCB) pending;
 } IscsiLun;
 
-typedef struct IscsiAIOCB {
+struct IscsiAIOCB {
     BlockDriverAIOCB common;
     QEMUIOVector *qiov;
     QEMUBH *bh;
@@ -58,12 +74,20 @@ typedef struct IscsiAIOCB {
     uint8_t *buf;
     int status;
     int canceled;
-    size_t read_size;
     size_t read_offset;
+    /* reads and writes: what is left, and the part in the current task */
+    int write;
+    int queued;
+    int64_t sector_num;
+    int nb_sectors;
+    int chunk_sectors;
+    size_t qiov_offset;
+    QEMUIOVector chunk_qiov;
+    QTAILQ_ENTRY(IscsiAIOCB) entry;
 #ifdef __linux__
     sg_io_hdr_t *ioh;
 #endif
-} IscsiAIOCB;
+};
 
 struct IscsiTask {
     IscsiLun *iscsilun;
@@ -87,6 +111,9 @@ iscsi_bh_cb(void *p)
         scsi_free_scsi_task(acb->task);
         acb->task = NULL;
     }
+    if (acb->qiov) {
+        qemu_iovec_destroy(&acb->chunk_qiov);
+    }
 
     qemu_aio_release(acb);
 }
@@ -124,6 +151,15 @@ iscsi_aio_cancel(BlockDriverAIOCB *blockacb)
 
     acb->canceled = 1;
 
+    if (acb->queued) {
+        /* not sent to the target yet */
+        QTAILQ_REMOVE(&iscsilun->pending, acb, entry);
+        acb->queued = 0;
+        acb->status = -ECANCELED;
+        iscsi_schedule_bh(acb);
+        return;
+    }
+
     /* send a task mgmt call to the target to cancel the task on the target */
     iscsi_task_mgmt_abort_task_async(iscsilun->iscsi, acb->task,
                                      iscsi_abort_task_cb, acb);
@@ -197,220 +233,303 @@ iscsi_process_write(void *arg)
 }
 
 
+static int64_t sector_qemu2lun(int64_t sector, IscsiLun *iscsilun)
+{
+    return sector * BDRV_SECTOR_SIZE / iscsilun->block_size;
+}
+
+static void iscsi_rw_send(IscsiAIOCB *acb);
+
+/* Send a read or write, or queue it if the LUN has enough commands */
 static void
-iscsi_aio_write16_cb(struct iscsi_context *iscsi, int status,
-                     void *command_data, void *opaque)
+iscsi_rw_submit(IscsiAIOCB *acb)
+{
+    IscsiLun *iscsilun = acb->iscsilun;
+
+    if (iscsilun->in_flight >= iscsilun->queue_depth ||
+        !QTAILQ_EMPTY(&iscsilun->pending)) {
+        acb->queued = 1;
+        QTAILQ_INSERT_TAIL(&iscsilun->pending, acb, entry);
+        return;
+    }
+    iscsi_rw_send(acb);
+}
+
+static void
+iscsi_kick_pending(IscsiLun *iscsilun)
+{
+    IscsiAIOCB *acb;
+
+    while (iscsilun->in_flight < iscsilun->queue_depth &&
+           (acb = QTAILQ_FIRST(&iscsilun->pending)) != NULL) {
+        QTAILQ_REMOVE(&iscsilun->pending, acb, entry);
+        acb->queued = 0;
+        iscsi_rw_send(acb);
+    }
+}
+
+static void
+iscsi_aio_rw_cb(struct iscsi_context *iscsi, int status,
+                void *command_data, void *opaque)
 {
     IscsiAIOCB *acb = opaque;
+    IscsiLun *iscsilun = acb->iscsilun;
 
-    trace_iscsi_aio_write16_cb(iscsi, status, acb, acb->canceled);
+    if (acb->write) {
+        trace_iscsi_aio_write16_cb(iscsi, status, acb, acb->canceled);
+    } else {
+        trace_iscsi_aio_read16_cb(iscsi, status, acb, acb->canceled);
+    }
 
     g_free(acb->buf);
+    acb->buf = NULL;
+    iscsilun->in_flight--;
 
     if (acb->canceled != 0) {
+        iscsi_kick_pending(iscsilun);
         return;
     }
 
-    acb->status = 0;
-    if (status < 0) {
-        error_report("Failed to write16 data to iSCSI lun. %s",
-                     iscsi_get_error(iscsi));
-        acb->status = -EIO;
+    if (status == BUSY || status == TASK_SET_FULL) {
+        /* The target has no room for more commands from us: send this one
+         * again once another completes, and no more than the target took.
+         */
+        iscsilun->queue_depth = MAX(iscsilun->in_flight, 1);
+        iscsilun->ramp_up = 0;
+        scsi_free_scsi_task(acb->task);
+        acb->task = NULL;
+        acb->queued = 1;
+        QTAILQ_INSERT_HEAD(&iscsilun->pending, acb, entry);
+        iscsi_kick_pending(iscsilun);
+        return;
     }
 
-    iscsi_schedule_bh(acb);
-}
+    if (status != 0) {
+        error_report("Failed to %s16 data %s iSCSI lun. %s",
+                     acb->write ? "write" : "read",
+                     acb->write ? "to" : "from", iscsi_get_error(iscsi));
+        acb->status = -EIO;
+        iscsi_schedule_bh(acb);
+    } else if (acb->nb_sectors > acb->chunk_sectors) {
+        /* The request was larger than the target transfers at once */
+        acb->sector_num  += acb->chunk_sectors;
+        acb->nb_sectors  -= acb->chunk_sectors;
+        acb->qiov_offset += acb->chunk_sectors * BDRV_SECTOR_SIZE;
+        scsi_free_scsi_task(acb->task);
+        acb->task = NULL;
+        iscsi_rw_submit(acb);
+    } else {
+        acb->status = 0;
+        iscsi_schedule_bh(acb);
+    }
 
-static int64_t sector_qemu2lun(int64_t sector, IscsiLun *iscsilun)
-{
-    return sector * BDRV_SECTOR_SIZE / iscsilun->block_size;
+    /* Grow a queue depth that a full task set reduced again, slowly */
+    if (status == 0 && iscsilun->queue_depth < ISCSI_MAX_QUEUE_DEPTH &&
+        ++iscsilun->ramp_up >= ISCSI_QUEUE_RAMP_UP) {
+        iscsilun->queue_depth++;
+        iscsilun->ramp_up = 0;
+    }
+    iscsi_kick_pending(iscsilun);
 }
 
-static BlockDriverAIOCB *
-iscsi_aio_writev(BlockDriverState *bs, int64_t sector_num,
-                 QEMUIOVector *qiov, int nb_sectors,
-                 BlockDriverCompletionFunc *cb,
-                 void *opaque)
+/* Send the next command of a read or write, at most max_xfer_len blocks */
+static void
+iscsi_rw_send(IscsiAIOCB *acb)
 {
-    IscsiLun *iscsilun = bs->opaque;
+    IscsiLun *iscsilun = acb->iscsilun;
     struct iscsi_context *iscsi = iscsilun->iscsi;
-    IscsiAIOCB *acb;
-    size_t size;
-    uint32_t num_sectors;
+    struct iscsi_data *datap = NULL;
+    uint32_t max_xfer_len = iscsilun->max_xfer_len;
+    uint32_t num_blocks;
     uint64_t lba;
+    size_t size;
+    int nb_sectors = acb->nb_sectors;
+#if !defined(LIBISCSI_FEATURE_IOVECTOR)
     struct iscsi_data data;
+    int i;
+#endif
 
-    acb = qemu_aio_get(&iscsi_aio_pool, bs, cb, opaque);
-    trace_iscsi_aio_writev(iscsi, sector_num, nb_sectors, opaque, acb);
-
-    acb->iscsilun = iscsilun;
-    acb->qiov     = qiov;
-
-    acb->canceled   = 0;
-    acb->bh         = NULL;
-    acb->status     = -EINPROGRESS;
+    if (!acb->write && iscsilun->type != TYPE_DISK &&
+        (max_xfer_len == 0 || max_xfer_len > ISCSI_MAX_XFER_LEN10)) {
+        max_xfer_len = ISCSI_MAX_XFER_LEN10;
+    }
+    if (max_xfer_len != 0) {
+        int64_t max_sectors = (int64_t)max_xfer_len *
+                              iscsilun->block_size / BDRV_SECTOR_SIZE;
 
-    /* XXX we should pass the iovec to write16 to avoid the extra copy */
-    /* this will allow us to get rid of 'buf' completely */
+        /* leave room for the extra block of a misaligned read */
+        if (iscsilun->block_size > BDRV_SECTOR_SIZE) {
+            max_sectors -= iscsilun->block_size / BDRV_SECTOR_SIZE;
+        }
+        if (max_sectors > 0 && nb_sectors > max_sectors) {
+            nb_sectors = max_sectors;
+        }
+    }
+    acb->chunk_sectors = nb_sectors;
     size = nb_sectors * BDRV_SECTOR_SIZE;
-    acb->buf = g_malloc(size);
-    qemu_iovec_to_buf(acb->qiov, 0, acb->buf, size);
 
     acb->task = malloc(sizeof(struct scsi_task));
     if (acb->task == NULL) {
-        error_report("iSCSI: Failed to allocate task for scsi WRITE16 "
-                     "command. %s", iscsi_get_error(iscsi));
-        qemu_aio_release(acb);
-        return NULL;
+        error_report("iSCSI: Failed to allocate task for scsi %s command. %s",
+                     acb->write ? "WRITE16" : "READ16",
+                     iscsi_get_error(iscsi));
+        goto fail;
     }
     memset(acb->task, 0, sizeof(struct scsi_task));
 
-    acb->task->xfer_dir = SCSI_XFER_WRITE;
-    acb->task->cdb_size = 16;
-    acb->task->cdb[0] = 0x8a;
-    if (!(bs->open_flags & BDRV_O_CACHE_WB)) {
-        /* set FUA on writes when cache mode is write through */
-        acb->task->cdb[1] |= 0x04;
-    }
-    lba = sector_qemu2lun(sector_num, iscsilun);
-    *(uint32_t *)&acb->task->cdb[2]  = htonl(lba >> 32);
-    *(uint32_t *)&acb->task->cdb[6]  = htonl(lba & 0xffffffff);
-    num_sectors = size / iscsilun->block_size;
-    *(uint32_t *)&acb->task->cdb[10] = htonl(num_sectors);
+    /* If LUN blocksize is bigger than BDRV_BLOCK_SIZE a read from QEMU
+     * may be misaligned to the LUN, so we may need to read some extra
+     * data.
+     */
+    acb->read_offset = 0;
+    if (!acb->write && iscsilun->block_size > BDRV_SECTOR_SIZE) {
+        uint64_t bdrv_offset = BDRV_SECTOR_SIZE * acb->sector_num;
+
+        acb->read_offset  = bdrv_offset % iscsilun->block_size;
+    }
+    num_blocks = (size + iscsilun->block_size + acb->read_offset - 1)
+                 / iscsilun->block_size;
+    lba = sector_qemu2lun(acb->sector_num, iscsilun);
     acb->task->expxferlen = size;
 
-    data.data = acb->buf;
-    data.size = size;
+    if (acb->write) {
+        acb->task->xfer_dir = SCSI_XFER_WRITE;
+        acb->task->cdb_size = 16;
+        acb->task->cdb[0] = 0x8a;
+        if (!(acb->common.bs->open_flags & BDRV_O_CACHE_WB)) {
+            /* set FUA on writes when cache mode is write through */
+            acb->task->cdb[1] |= 0x04;
+        }
+        *(uint32_t *)&acb->task->cdb[2]  = htonl(lba >> 32);
+        *(uint32_t *)&acb->task->cdb[6]  = htonl(lba & 0xffffffff);
+        *(uint32_t *)&acb->task->cdb[10] = htonl(num_blocks);
+    } else {
+        acb->task->xfer_dir = SCSI_XFER_READ;
+        switch (iscsilun->type) {
+        case TYPE_DISK:
+            acb->task->cdb_size = 16;
+            acb->task->cdb[0]  = 0x88;
+            *(uint32_t *)&acb->task->cdb[2]  = htonl(lba >> 32);
+            *(uint32_t *)&acb->task->cdb[6]  = htonl(lba & 0xffffffff);
+            *(uint32_t *)&acb->task->cdb[10] = htonl(num_blocks);
+            break;
+        default:
+            acb->task->cdb_size = 10;
+            acb->task->cdb[0]  = 0x28;
+            *(uint32_t *)&acb->task->cdb[2] = htonl(lba);
+            *(uint16_t *)&acb->task->cdb[7] = htons(num_blocks);
+            break;
+        }
+    }
+
+    qemu_iovec_reset(&acb->chunk_qiov);
+    qemu_iovec_concat(&acb->chunk_qiov, acb->qiov, acb->qiov_offset, size);
+
+#if !defined(LIBISCSI_FEATURE_IOVECTOR)
+    /* without iovector support libiscsi wants writes in one buffer */
+    if (acb->write) {
+        acb->buf = g_malloc(size);
+        qemu_iovec_to_buf(&acb->chunk_qiov, 0, acb->buf, size);
+        data.data = acb->buf;
+        data.size = size;
+        datap = &data;
+    }
+#endif
 
     if (iscsi_scsi_command_async(iscsi, iscsilun->lun, acb->task,
-                                 iscsi_aio_write16_cb,
-                                 &data,
-                                 acb) != 0) {
+                                 iscsi_aio_rw_cb, datap, acb) != 0) {
         scsi_free_scsi_task(acb->task);
+        acb->task = NULL;
         g_free(acb->buf);
-        qemu_aio_release(acb);
-        return NULL;
+        acb->buf = NULL;
+        goto fail;
     }
 
-    iscsi_set_events(iscsilun);
-
-    return &acb->common;
-}
-
-static void
-iscsi_aio_read16_cb(struct iscsi_context *iscsi, int status,
-                    void *command_data, void *opaque)
-{
-    IscsiAIOCB *acb = opaque;
-
-    trace_iscsi_aio_read16_cb(iscsi, status, acb, acb->canceled);
-
-    if (acb->canceled != 0) {
-        return;
+    /* the data goes straight from and to the guest's buffers */
+#if defined(LIBISCSI_FEATURE_IOVECTOR)
+    if (acb->write) {
+        scsi_task_set_iov_out(acb->task,
+                              (struct scsi_iovec *) acb->chunk_qiov.iov,
+                              acb->chunk_qiov.niov);
+    } else {
+        scsi_task_set_iov_in(acb->task,
+                             (struct scsi_iovec *) acb->chunk_qiov.iov,
+                             acb->chunk_qiov.niov);
+    }
+#else
+    if (!acb->write) {
+        for (i = 0; i < acb->chunk_qiov.niov; i++) {
+            scsi_task_add_data_in_buffer(acb->task,
+                    acb->chunk_qiov.iov[i].iov_len,
+                    acb->chunk_qiov.iov[i].iov_base);
+        }
     }
+#endif
 
-    acb->status = 0;
-    if (status != 0) {
-        error_report("Failed to read16 data from iSCSI lun. %s",
-                     iscsi_get_error(iscsi));
-        acb->status = -EIO;
-    }
+    iscsilun->in_flight++;
+    return;
 
+fail:
+    acb->status = -EIO;
     iscsi_schedule_bh(acb);
 }
 
 static BlockDriverAIOCB *
-iscsi_aio_readv(BlockDriverState *bs, int64_t sector_num,
-                QEMUIOVector *qiov, int nb_sectors,
-                BlockDriverCompletionFunc *cb,
-                void *opaque)
+iscsi_aio_rw(BlockDriverState *bs, int64_t sector_num,
+             QEMUIOVector *qiov, int nb_sectors,
+             BlockDriverCompletionFunc *cb, void *opaque, int write)
 {
     IscsiLun *iscsilun = bs->opaque;
-    struct iscsi_context *iscsi = iscsilun->iscsi;
     IscsiAIOCB *acb;
-    size_t qemu_read_size;
-    int i;
-    uint64_t lba;
-    uint32_t num_sectors;
-
-    qemu_read_size = BDRV_SECTOR_SIZE * (size_t)nb_sectors;
 
     acb = qemu_aio_get(&iscsi_aio_pool, bs, cb, opaque);
-    trace_iscsi_aio_readv(iscsi, sector_num, nb_sectors, opaque, acb);
+    if (write) {
+        trace_iscsi_aio_writev(iscsilun->iscsi, sector_num, nb_sectors,
+                               opaque, acb);
+    } else {
+        trace_iscsi_aio_readv(iscsilun->iscsi, sector_num, nb_sectors,
+                              opaque, acb);
+    }
 
     acb->iscsilun = iscsilun;
     acb->qiov     = qiov;
+    acb->task     = NULL;
+    acb->buf      = NULL;
 
     acb->canceled    = 0;
+    acb->queued      = 0;
     acb->bh          = NULL;
     acb->status      = -EINPROGRESS;
-    acb->read_size   = qemu_read_size;
-    acb->buf         = NULL;
-
-    /* If LUN blocksize is bigger than BDRV_BLOCK_SIZE a read from QEMU
-     * may be misaligned to the LUN, so we may need to read some extra
-     * data.
-     */
-    acb->read_offset = 0;
-    if (iscsilun->block_size > BDRV_SECTOR_SIZE) {
-        uint64_t bdrv_offset = BDRV_SECTOR_SIZE * sector_num;
-
-        acb->read_offset  = bdrv_offset % iscsilun->block_size;
-    }
-
-    num_sectors  = (qemu_read_size + iscsilun->block_size
-                    + acb->read_offset - 1)
-                    / iscsilun->block_size;
-
-    acb->task = malloc(sizeof(struct scsi_task));
-    if (acb->task == NULL) {
-        error_report("iSCSI: Failed to allocate task for scsi READ16 "
-                     "command. %s", iscsi_get_error(iscsi));
-        qemu_aio_release(acb);
-        return NULL;
-    }
-    memset(acb->task, 0, sizeof(struct scsi_task));
-
-    acb->task->xfer_dir = SCSI_XFER_READ;
-    lba = sector_qemu2lun(sector_num, iscsilun);
-    acb->task->expxferlen = qemu_read_size;
-
-    switch (iscsilun->type) {
-    case TYPE_DISK:
-        acb->task->cdb_size = 16;
-        acb->task->cdb[0]  = 0x88;
-        *(uint32_t *)&acb->task->cdb[2]  = htonl(lba >> 32);
-        *(uint32_t *)&acb->task->cdb[6]  = htonl(lba & 0xffffffff);
-        *(uint32_t *)&acb->task->cdb[10] = htonl(num_sectors);
-        break;
-    default:
-        acb->task->cdb_size = 10;
-        acb->task->cdb[0]  = 0x28;
-        *(uint32_t *)&acb->task->cdb[2] = htonl(lba);
-        *(uint16_t *)&acb->task->cdb[7] = htons(num_sectors);
-        break;
-    }
-    
-    if (iscsi_scsi_command_async(iscsi, iscsilun->lun, acb->task,
-                                 iscsi_aio_read16_cb,
-                                 NULL,
-                                 acb) != 0) {
-        scsi_free_scsi_task(acb->task);
-        qemu_aio_release(acb);
-        return NULL;
-    }
-
-    for (i = 0; i < acb->qiov->niov; i++) {
-        scsi_task_add_data_in_buffer(acb->task,
-                acb->qiov->iov[i].iov_len,
-                acb->qiov->iov[i].iov_base);
-    }
+    acb->write       = write;
+    acb->sector_num  = sector_num;
+    acb->nb_sectors  = nb_sectors;
+    acb->qiov_offset = 0;
+    qemu_iovec_init(&acb->chunk_qiov, qiov->niov);
 
+    iscsi_rw_submit(acb);
     iscsi_set_events(iscsilun);
 
     return &acb->common;
 }
 
+static BlockDriverAIOCB *
+iscsi_aio_writev(BlockDriverState *bs, int64_t sector_num,
+                 QEMUIOVector *qiov, int nb_sectors,
+                 BlockDriverCompletionFunc *cb,
+                 void *opaque)
+{
+    return iscsi_aio_rw(bs, sector_num, qiov, nb_sectors, cb, opaque, 1);
+}
+
+static BlockDriverAIOCB *
+iscsi_aio_readv(BlockDriverState *bs, int64_t sector_num,
+                QEMUIOVector *qiov, int nb_sectors,
+                BlockDriverCompletionFunc *cb,
+                void *opaque)
+{
+    return iscsi_aio_rw(bs, sector_num, qiov, nb_sectors, cb, opaque, 0);
+}
+
 
 static void
 iscsi_synccache10_cb(struct iscsi_context *iscsi, int status,
@@ -443,6 +562,7 @@ iscsi_aio_flush(BlockDriverState *bs,
     acb = qemu_aio_get(&iscsi_aio_pool, bs, cb, opaque);
 
     acb->iscsilun = iscsilun;
+    acb->qiov       = NULL;
     acb->canceled   = 0;
     acb->bh         = NULL;
     acb->status     = -EINPROGRESS;
@@ -496,6 +616,7 @@ iscsi_aio_discard(BlockDriverState *bs,
     acb = qemu_aio_get(&iscsi_aio_pool, bs, cb, opaque);
 
     acb->iscsilun = iscsilun;
+    acb->qiov       = NULL;
     acb->canceled   = 0;
     acb->bh         = NULL;
     acb->status     = -EINPROGRESS;
@@ -571,6 +692,7 @@ static BlockDriverAIOCB *iscsi_aio_ioctl(BlockDriverState *bs,
     acb = qemu_aio_get(&iscsi_aio_pool, bs, cb, opaque);
 
     acb->iscsilun = iscsilun;
+    acb->qiov        = NULL;
     acb->canceled    = 0;
     acb->bh          = NULL;
     acb->status      = -EINPROGRESS;
@@ -658,6 +780,29 @@ iscsi_getlength(BlockDriverState *bs)
     return len;
 }
 
+#if defined(LIBISCSI_FEATURE_IOVECTOR)
+static void
+iscsi_block_limits_cb(struct iscsi_context *iscsi, int status,
+                      void *command_data, void *opaque)
+{
+    struct IscsiTask *itask = opaque;
+    struct scsi_task *task = command_data;
+    struct scsi_inquiry_block_limits *inq_bl;
+
+    /* The page is optional, without it there is no limit */
+    if (status == 0) {
+        inq_bl = scsi_datain_unmarshall(task);
+        if (inq_bl != NULL) {
+            itask->iscsilun->max_xfer_len = inq_bl->max_xfer_len;
+        }
+    }
+
+    itask->status   = 0;
+    itask->complete = 1;
+    scsi_free_scsi_task(task);
+}
+#endif
+
 static void
 iscsi_readcapacity16_cb(struct iscsi_context *iscsi, int status,
                         void *command_data, void *opaque)
@@ -689,9 +834,20 @@ iscsi_readcapacity16_cb(struct iscsi_context *iscsi, int status,
     itask->bs->total_sectors    = itask->iscsilun->num_blocks *
                                itask->iscsilun->block_size / BDRV_SECTOR_SIZE ;
 
+    scsi_free_scsi_task(task);
+
+#if defined(LIBISCSI_FEATURE_IOVECTOR)
+    /* libiscsi versions this recent can also parse the Block Limits page */
+    task = iscsi_inquiry_task(iscsi, itask->iscsilun->lun,
+                              1, SCSI_INQUIRY_PAGECODE_BLOCK_LIMITS, 64,
+                              iscsi_block_limits_cb, opaque);
+    if (task != NULL) {
+        return;
+    }
+#endif
+
     itask->status   = 0;
     itask->complete = 1;
-    scsi_free_scsi_task(task);
 }
 
 static void
@@ -942,6 +1098,8 @@ static int iscsi_open(BlockDriverState *bs, const char *filename, int flags)
     }
 
     memset(iscsilun, 0, sizeof(IscsiLun));
+    iscsilun->queue_depth = ISCSI_MAX_QUEUE_DEPTH;
+    QTAILQ_INIT(&iscsilun->pending);
 
     initiator_name = parse_initiator_name(iscsi_url->target);
 
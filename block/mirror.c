@@ -0,0 +1,354 @@
+/*
+ * Image mirroring
+ *
+ * Copyright Red Hat, Inc. 2012
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#include "trace.h"
+#include "block_int.h"
+#include "qemu/ratelimit.h"
+#include "bitops.h"
+
+enum {
+    /*
+     * Number of chunks that can be copied at the same time.  Each copy
+     * operation covers one chunk of the dirty bitmap, i.e.
+     * BDRV_SECTORS_PER_DIRTY_CHUNK sectors.
+     */
+    MIRROR_MAX_IN_FLIGHT = 16,
+};
+
+#define SLICE_TIME 100000000ULL /* ns */
+
+typedef struct MirrorBlockJob {
+    BlockJob common;
+    RateLimit limit;
+    BlockDriverState *target;
+    MirrorSyncMode mode;
+    bool synced;
+    bool should_complete;
+    bool waiting;
+    int64_t sector_num;
+    unsigned long *in_flight_bitmap;
+    int in_flight;
+    int ret;
+} MirrorBlockJob;
+
+typedef struct MirrorOp {
+    MirrorBlockJob *s;
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int64_t sector_num;
+    int nb_sectors;
+} MirrorOp;
+
+static void mirror_iteration_done(MirrorOp *op, int ret)
+{
+    MirrorBlockJob *s = op->s;
+    int64_t chunk_num = op->sector_num / BDRV_SECTORS_PER_DIRTY_CHUNK;
+
+    trace_mirror_iteration_done(s, op->sector_num, op->nb_sectors, ret);
+    clear_bit(chunk_num, s->in_flight_bitmap);
+    s->in_flight--;
+    if (ret < 0 && s->ret == 0) {
+        s->ret = ret;
+    }
+
+    qemu_vfree(op->iov.iov_base);
+    g_slice_free(MirrorOp, op);
+
+    if (s->waiting) {
+        qemu_coroutine_enter(s->common.co, NULL);
+    }
+}
+
+static void mirror_write_complete(void *opaque, int ret)
+{
+    mirror_iteration_done(opaque, ret);
+}
+
+static void mirror_read_complete(void *opaque, int ret)
+{
+    MirrorOp *op = opaque;
+    MirrorBlockJob *s = op->s;
+
+    if (ret < 0) {
+        mirror_iteration_done(op, ret);
+        return;
+    }
+    bdrv_aio_writev(s->target, op->sector_num, &op->qiov, op->nb_sectors,
+                    mirror_write_complete, op);
+}
+
+/* Wait for one of the in-flight copy operations to complete */
+static void coroutine_fn mirror_wait_for_io(MirrorBlockJob *s)
+{
+    assert(s->in_flight > 0);
+    trace_mirror_yield(s, bdrv_get_dirty_count(s->common.bs), s->in_flight);
+    s->waiting = true;
+    qemu_coroutine_yield();
+    s->waiting = false;
+}
+
+static void coroutine_fn mirror_iteration(MirrorBlockJob *s)
+{
+    BlockDriverState *source = s->common.bs;
+    int64_t end, sector_num, chunk_num;
+    int nb_sectors;
+    MirrorOp *op;
+
+    sector_num = bdrv_get_next_dirty(source, s->sector_num);
+    if (sector_num < 0) {
+        sector_num = bdrv_get_next_dirty(source, 0);
+        trace_mirror_restart_iter(s, bdrv_get_dirty_count(source));
+        assert(sector_num >= 0);
+    }
+
+    /* A copy of an older version of this chunk is still in flight.  Do not
+     * let the two writes to the target race; try again when it is done.
+     */
+    chunk_num = sector_num / BDRV_SECTORS_PER_DIRTY_CHUNK;
+    if (test_bit(chunk_num, s->in_flight_bitmap)) {
+        mirror_wait_for_io(s);
+        return;
+    }
+
+    end = s->common.len >> BDRV_SECTOR_BITS;
+    nb_sectors = MIN(BDRV_SECTORS_PER_DIRTY_CHUNK, end - sector_num);
+    s->sector_num = sector_num + nb_sectors;
+
+    /* Guest writes that land after this point mark the chunk dirty again */
+    bdrv_reset_dirty(source, sector_num, nb_sectors);
+
+    op = g_slice_new(MirrorOp);
+    op->s = s;
+    op->sector_num = sector_num;
+    op->nb_sectors = nb_sectors;
+    op->iov.iov_base = qemu_blockalign(source, nb_sectors * BDRV_SECTOR_SIZE);
+    op->iov.iov_len = nb_sectors * BDRV_SECTOR_SIZE;
+    qemu_iovec_init_external(&op->qiov, &op->iov, 1);
+
+    set_bit(chunk_num, s->in_flight_bitmap);
+    s->in_flight++;
+
+    trace_mirror_one_iteration(s, sector_num, nb_sectors);
+    bdrv_aio_readv(source, sector_num, &op->qiov, nb_sectors,
+                   mirror_read_complete, op);
+}
+
+static void coroutine_fn mirror_run(void *opaque)
+{
+    MirrorBlockJob *s = opaque;
+    BlockDriverState *bs = s->common.bs;
+    int64_t sector_num, end, nb_chunks;
+    int ret = 0;
+    int n;
+
+    if (block_job_is_cancelled(&s->common)) {
+        goto immediate_exit;
+    }
+
+    s->common.len = bdrv_getlength(bs);
+    if (s->common.len < 0) {
+        ret = s->common.len;
+        goto immediate_exit;
+    }
+
+    end = s->common.len >> BDRV_SECTOR_BITS;
+    nb_chunks = DIV_ROUND_UP(end, BDRV_SECTORS_PER_DIRTY_CHUNK);
+    s->in_flight_bitmap = g_new0(unsigned long, BITS_TO_LONGS(nb_chunks));
+
+    if (s->mode != MIRROR_SYNC_MODE_NONE) {
+        /* First part, loop on the sectors and initialize the dirty bitmap.  */
+        BlockDriverState *base;
+        base = s->mode == MIRROR_SYNC_MODE_FULL ? NULL : bs->backing_hd;
+        for (sector_num = 0; sector_num < end; ) {
+            int64_t next = (sector_num / BDRV_SECTORS_PER_DIRTY_CHUNK + 1) *
+                           BDRV_SECTORS_PER_DIRTY_CHUNK;
+
+            next = MIN(next, end);
+            ret = bdrv_co_is_allocated_above(bs, base, sector_num,
+                                             next - sector_num, &n);
+            if (ret < 0) {
+                goto immediate_exit;
+            }
+
+            assert(n > 0);
+            if (ret == 1) {
+                bdrv_set_dirty(bs, sector_num, n);
+                sector_num = next;
+            } else {
+                sector_num += n;
+            }
+        }
+    }
+
+    s->sector_num = 0;
+    for (;;) {
+        uint64_t delay_ns = 0;
+        int64_t cnt;
+        bool should_complete;
+
+        if (s->ret < 0) {
+            ret = s->ret;
+            goto immediate_exit;
+        }
+        if (!s->synced && block_job_is_cancelled(&s->common)) {
+            ret = 0;
+            goto immediate_exit;
+        }
+
+        /* Publish progress */
+        cnt = bdrv_get_dirty_count(bs);
+        s->common.offset = (end - MIN(end, cnt * BDRV_SECTORS_PER_DIRTY_CHUNK))
+                           * BDRV_SECTOR_SIZE;
+
+        if (cnt != 0 && s->in_flight < MIRROR_MAX_IN_FLIGHT) {
+            if (s->common.speed) {
+                delay_ns = ratelimit_calculate_delay(&s->limit,
+                                                BDRV_SECTORS_PER_DIRTY_CHUNK);
+            }
+            if (delay_ns == 0) {
+                mirror_iteration(s);
+                continue;
+            }
+        } else if (s->in_flight > 0) {
+            mirror_wait_for_io(s);
+            continue;
+        }
+
+        should_complete = false;
+        if (s->in_flight == 0 && cnt == 0) {
+            trace_mirror_before_flush(s);
+            ret = bdrv_flush(s->target);
+            if (ret < 0) {
+                goto immediate_exit;
+            }
+
+            /* We're out of the streaming phase.  From now on, if the job
+             * is cancelled we will actually complete all pending I/O and
+             * report completion.  This way, block-job-cancel will leave
+             * the target in a consistent state.
+             */
+            if (!s->synced) {
+                block_job_ready(&s->common);
+                s->synced = true;
+            }
+
+            should_complete = s->should_complete ||
+                block_job_is_cancelled(&s->common);
+            cnt = bdrv_get_dirty_count(bs);
+        }
+
+        if (cnt == 0 && should_complete) {
+            /* Guest writes only mark the dirty bitmap when they complete.
+             * If we're about to exit, wait for pending requests before
+             * looking at the dirty count again, or we may exit while the
+             * source still has data to copy.  Nothing can be submitted
+             * between here and the switch to the target.
+             */
+            trace_mirror_before_drain(s, cnt);
+            bdrv_drain_all();
+            cnt = bdrv_get_dirty_count(bs);
+        }
+
+        ret = 0;
+        trace_mirror_before_sleep(s, cnt, s->synced);
+        if (!s->synced) {
+            block_job_sleep_ns(&s->common, rt_clock, delay_ns);
+        } else if (!should_complete) {
+            delay_ns = (cnt == 0 ? SLICE_TIME : delay_ns);
+            block_job_sleep_ns(&s->common, rt_clock, delay_ns);
+        } else if (cnt == 0) {
+            /* The two disks are in sync.  Exit and report successful
+             * completion.
+             */
+            s->common.cancelled = false;
+            break;
+        }
+    }
+
+immediate_exit:
+    while (s->in_flight > 0) {
+        mirror_wait_for_io(s);
+    }
+    g_free(s->in_flight_bitmap);
+    bdrv_set_dirty_tracking(bs, 0);
+    if (s->should_complete && ret == 0) {
+        bdrv_swap(s->target, s->common.bs);
+    }
+    bdrv_delete(s->target);
+    block_job_completed(&s->common, ret);
+}
+
+static void mirror_set_speed(BlockJob *job, int64_t speed, Error **errp)
+{
+    MirrorBlockJob *s = container_of(job, MirrorBlockJob, common);
+
+    if (speed < 0) {
+        error_set(errp, QERR_INVALID_PARAMETER, "speed");
+        return;
+    }
+    ratelimit_set_speed(&s->limit, speed / BDRV_SECTOR_SIZE, SLICE_TIME);
+}
+
+static void mirror_complete(BlockJob *job, Error **errp)
+{
+    MirrorBlockJob *s = container_of(job, MirrorBlockJob, common);
+    int ret;
+
+    if (!s->synced) {
+        error_set(errp, QERR_BLOCK_JOB_NOT_READY, job->bs->device_name);
+        return;
+    }
+
+    /* Open the backing file now, so that errors can be reported to the
+     * caller and the job does not have to do it between the final check
+     * of the dirty bitmap and the switch.
+     */
+    ret = bdrv_open_backing_file(s->target);
+    if (ret < 0) {
+        char backing_filename[PATH_MAX];
+        bdrv_get_full_backing_filename(s->target, backing_filename,
+                                       sizeof(backing_filename));
+        error_set(errp, QERR_OPEN_FILE_FAILED, backing_filename);
+        return;
+    }
+
+    s->should_complete = true;
+}
+
+static BlockJobType mirror_job_type = {
+    .instance_size = sizeof(MirrorBlockJob),
+    .job_type      = "mirror",
+    .set_speed     = mirror_set_speed,
+    .complete      = mirror_complete,
+};
+
+void mirror_start(BlockDriverState *bs, BlockDriverState *target,
+                  int64_t speed, MirrorSyncMode mode,
+                  BlockDriverCompletionFunc *cb,
+                  void *opaque, Error **errp)
+{
+    MirrorBlockJob *s;
+
+    s = block_job_create(&mirror_job_type, bs, speed, cb, opaque, errp);
+    if (!s) {
+        return;
+    }
+
+    s->target = target;
+    s->mode = mode;
+
+    /* Start tracking writes right away, the first pass of the job may
+     * run after the guest submitted new ones.
+     */
+    bdrv_set_dirty_tracking(bs, 1);
+    s->common.co = qemu_coroutine_create(mirror_run);
+    trace_mirror_start(bs, s, s->common.co, opaque);
+    qemu_coroutine_enter(s->common.co, s);
+}
@@ -204,14 +204,21 @@ static int nbd_co_send_request(BDRVNBDState *s, struct nbd_request *request,
     s->send_coroutine = qemu_coroutine_self();
     qemu_aio_set_fd_handler(s->sock, nbd_reply_ready, nbd_restart_write,
                             nbd_have_request, s);
+    if (qiov) {
+        /* header and payload in as few segments as possible */
+        socket_set_cork(s->sock, 1);
+    }
     rc = nbd_send_request(s->sock, request);
     if (rc >= 0 && qiov) {
         ret = qemu_co_sendv(s->sock, qiov->iov, qiov->niov,
                             offset, request->len);
         if (ret != request->len) {
-            return -EIO;
+            rc = -EIO;
         }
     }
+    if (qiov) {
+        socket_set_cork(s->sock, 0);
+    }
     qemu_aio_set_fd_handler(s->sock, nbd_reply_ready, NULL,
                             nbd_have_request, s);
     s->send_coroutine = NULL;
@@ -284,8 +291,12 @@ static int nbd_establish_connection(BlockDriverState *bs)
     }
 
     /* Now that we're connected, set the socket to be non-blocking and
-     * kick the reply mechanism.  */
+     * kick the reply mechanism.  Requests are small and latency bound,
+     * so don't let Nagle hold them back; writes cork explicitly.  */
     socket_set_nonblock(sock);
+    if (s->host_spec[0] != '/') {
+        socket_set_nodelay(sock);
+    }
     qemu_aio_set_fd_handler(sock, nbd_reply_ready, NULL,
                             nbd_have_request, s);
 
@@ -390,38 +401,99 @@ static int nbd_co_writev_1(BlockDriverState *bs, int64_t sector_num,
  * remain aligned to 4K. */
 #define NBD_MAX_SECTORS 2040
 
-static int nbd_co_readv(BlockDriverState *bs, int64_t sector_num,
-                        int nb_sectors, QEMUIOVector *qiov)
+/* Larger requests are split, and all the pieces are put on the wire
+ * at once instead of waiting for each reply in turn.
+ */
+typedef struct NBDSplitRequest {
+    BlockDriverState *bs;
+    QEMUIOVector *qiov;
+    bool is_write;
+    Coroutine *co;
+    int pending;
+    int ret;
+} NBDSplitRequest;
+
+typedef struct NBDSplitChunk {
+    NBDSplitRequest *req;
+    int64_t sector_num;
+    int nb_sectors;
+    int offset;
+} NBDSplitChunk;
+
+static void coroutine_fn nbd_co_split_entry(void *opaque)
 {
-    int offset = 0;
+    NBDSplitChunk *chunk = opaque;
+    NBDSplitRequest *req = chunk->req;
     int ret;
-    while (nb_sectors > NBD_MAX_SECTORS) {
-        ret = nbd_co_readv_1(bs, sector_num, NBD_MAX_SECTORS, qiov, offset);
-        if (ret < 0) {
-            return ret;
-        }
-        offset += NBD_MAX_SECTORS * 512;
-        sector_num += NBD_MAX_SECTORS;
-        nb_sectors -= NBD_MAX_SECTORS;
+
+    if (req->is_write) {
+        ret = nbd_co_writev_1(req->bs, chunk->sector_num, chunk->nb_sectors,
+                              req->qiov, chunk->offset);
+    } else {
+        ret = nbd_co_readv_1(req->bs, chunk->sector_num, chunk->nb_sectors,
+                             req->qiov, chunk->offset);
+    }
+    if (ret < 0 && req->ret == 0) {
+        req->ret = ret;
+    }
+    g_free(chunk);
+    if (--req->pending == 0 && req->co) {
+        qemu_coroutine_enter(req->co, NULL);
     }
-    return nbd_co_readv_1(bs, sector_num, nb_sectors, qiov, offset);
 }
 
-static int nbd_co_writev(BlockDriverState *bs, int64_t sector_num,
-                         int nb_sectors, QEMUIOVector *qiov)
+static int nbd_co_rw(BlockDriverState *bs, int64_t sector_num,
+                     int nb_sectors, QEMUIOVector *qiov, bool is_write)
 {
+    NBDSplitRequest req = {
+        .bs       = bs,
+        .qiov     = qiov,
+        .is_write = is_write,
+    };
+    NBDSplitChunk *chunk;
+    Coroutine *co;
     int offset = 0;
-    int ret;
-    while (nb_sectors > NBD_MAX_SECTORS) {
-        ret = nbd_co_writev_1(bs, sector_num, NBD_MAX_SECTORS, qiov, offset);
-        if (ret < 0) {
-            return ret;
-        }
+
+    if (nb_sectors <= NBD_MAX_SECTORS) {
+        return is_write ? nbd_co_writev_1(bs, sector_num, nb_sectors, qiov, 0)
+                        : nbd_co_readv_1(bs, sector_num, nb_sectors, qiov, 0);
+    }
+
+    /* hold a reference so that chunks that complete right away do not
+     * try to wake us up before everything is submitted */
+    req.pending = 1;
+    while (nb_sectors > 0) {
+        chunk = g_malloc(sizeof(*chunk));
+        chunk->req = &req;
+        chunk->sector_num = sector_num;
+        chunk->nb_sectors = MIN(nb_sectors, NBD_MAX_SECTORS);
+        chunk->offset = offset;
+
+        req.pending++;
+        co = qemu_coroutine_create(nbd_co_split_entry);
+        qemu_coroutine_enter(co, chunk);
+
         offset += NBD_MAX_SECTORS * 512;
         sector_num += NBD_MAX_SECTORS;
         nb_sectors -= NBD_MAX_SECTORS;
     }
-    return nbd_co_writev_1(bs, sector_num, nb_sectors, qiov, offset);
+    if (--req.pending > 0) {
+        req.co = qemu_coroutine_self();
+        qemu_coroutine_yield();
+    }
+    return req.ret;
+}
+
+static int nbd_co_readv(BlockDriverState *bs, int64_t sector_num,
+                        int nb_sectors, QEMUIOVector *qiov)
+{
+    return nbd_co_rw(bs, sector_num, nb_sectors, qiov, false);
+}
+
+static int nbd_co_writev(BlockDriverState *bs, int64_t sector_num,
+                         int nb_sectors, QEMUIOVector *qiov)
+{
+    return nbd_co_rw(bs, sector_num, nb_sectors, qiov, true);
 }
 
 static int nbd_co_flush(BlockDriverState *bs)
@@ -0,0 +1,252 @@
+/*
+ * Null block driver
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * Requests complete without touching any storage, which makes it possible
+ * to measure the block layer and the format drivers on their own; see
+ * tests/bench-block.c.  Two protocols are provided:
+ *
+ *   null-co://[size=<bytes>][,latency-ns=<ns>][,zeroes=on]
+ *       implements bdrv_co_readv/bdrv_co_writev
+ *   null-aio://[size=<bytes>][,latency-ns=<ns>][,zeroes=on]
+ *       implements bdrv_aio_readv/bdrv_aio_writev, completing from a BH
+ *
+ * Writes are discarded.  Reads leave the buffer alone unless zeroes=on.
+ */
+
+#include "qemu-common.h"
+#include "block_int.h"
+#include "module.h"
+#include "qemu-timer.h"
+
+#define NULL_DEFAULT_SIZE   (1ULL << 30)
+
+typedef struct BDRVNullState {
+    int64_t length;
+    int64_t latency_ns;
+    bool zeroes;
+} BDRVNullState;
+
+/* completed from @bh, or from @timer with latency-ns */
+typedef struct NullAIOCB {
+    BlockDriverAIOCB common;
+    QEMUBH *bh;
+    AioTimer *timer;
+} NullAIOCB;
+
+static int null_open(BlockDriverState *bs, const char *filename, int flags)
+{
+    BDRVNullState *s = bs->opaque;
+    char prefix[32], buf[64];
+    const char *p;
+    char *end;
+
+    snprintf(prefix, sizeof(prefix), "%s://", bs->drv->protocol_name);
+    if (!strstart(filename, prefix, &p)) {
+        return -EINVAL;
+    }
+
+    s->length = NULL_DEFAULT_SIZE;
+    if (get_param_value(buf, sizeof(buf), "size", p)) {
+        s->length = strtosz_suffix(buf, &end, STRTOSZ_DEFSUFFIX_B);
+        if (s->length < 0 || *end) {
+            return -EINVAL;
+        }
+    }
+    if (get_param_value(buf, sizeof(buf), "latency-ns", p)) {
+        s->latency_ns = strtoll(buf, &end, 10);
+        if (s->latency_ns < 0 || *end) {
+            return -EINVAL;
+        }
+    }
+    if (get_param_value(buf, sizeof(buf), "zeroes", p)) {
+        s->zeroes = !strcmp(buf, "on");
+    }
+    return 0;
+}
+
+static void null_close(BlockDriverState *bs)
+{
+}
+
+static int64_t null_getlength(BlockDriverState *bs)
+{
+    BDRVNullState *s = bs->opaque;
+
+    return s->length;
+}
+
+static void null_co_wake(void *opaque)
+{
+    qemu_coroutine_enter(opaque, NULL);
+}
+
+static int coroutine_fn null_co_delay(BlockDriverState *bs)
+{
+    BDRVNullState *s = bs->opaque;
+    AioTimer *timer;
+
+    if (s->latency_ns) {
+        timer = aio_timer_new(bdrv_get_aio_context(bs), null_co_wake,
+                              qemu_coroutine_self());
+        aio_timer_mod(timer, get_clock() + s->latency_ns);
+        qemu_coroutine_yield();
+        aio_timer_free(timer);
+    }
+    return 0;
+}
+
+static int coroutine_fn null_co_readv(BlockDriverState *bs,
+                                      int64_t sector_num, int nb_sectors,
+                                      QEMUIOVector *qiov)
+{
+    BDRVNullState *s = bs->opaque;
+
+    if (s->zeroes) {
+        qemu_iovec_memset(qiov, 0, 0, qiov->size);
+    }
+    return null_co_delay(bs);
+}
+
+static int coroutine_fn null_co_writev(BlockDriverState *bs,
+                                       int64_t sector_num, int nb_sectors,
+                                       QEMUIOVector *qiov)
+{
+    return null_co_delay(bs);
+}
+
+static int coroutine_fn null_co_flush(BlockDriverState *bs)
+{
+    return null_co_delay(bs);
+}
+
+static void null_aio_cancel(BlockDriverAIOCB *blockacb)
+{
+    NullAIOCB *acb = container_of(blockacb, NullAIOCB, common);
+
+    if (acb->timer) {
+        aio_timer_free(acb->timer);
+    } else {
+        qemu_bh_delete(acb->bh);
+    }
+    qemu_aio_release(acb);
+}
+
+static AIOPool null_aio_pool = {
+    .aiocb_size = sizeof(NullAIOCB),
+    .cancel     = null_aio_cancel,
+};
+
+static void null_aio_complete(void *opaque)
+{
+    NullAIOCB *acb = opaque;
+
+    if (acb->timer) {
+        aio_timer_free(acb->timer);
+    } else {
+        qemu_bh_delete(acb->bh);
+    }
+    acb->common.cb(acb->common.opaque, 0);
+    qemu_aio_release(acb);
+}
+
+static BlockDriverAIOCB *null_aio_common(BlockDriverState *bs,
+                                         BlockDriverCompletionFunc *cb,
+                                         void *opaque)
+{
+    BDRVNullState *s = bs->opaque;
+    AioContext *ctx = bdrv_get_aio_context(bs);
+    NullAIOCB *acb;
+
+    acb = qemu_aio_get(&null_aio_pool, bs, cb, opaque);
+    acb->bh = NULL;
+    acb->timer = NULL;
+    if (s->latency_ns) {
+        acb->timer = aio_timer_new(ctx, null_aio_complete, acb);
+        aio_timer_mod(acb->timer, get_clock() + s->latency_ns);
+    } else {
+        acb->bh = aio_bh_new(ctx, null_aio_complete, acb);
+        qemu_bh_schedule(acb->bh);
+    }
+    return &acb->common;
+}
+
+static BlockDriverAIOCB *null_aio_readv(BlockDriverState *bs,
+    int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+    BlockDriverCompletionFunc *cb, void *opaque)
+{
+    BDRVNullState *s = bs->opaque;
+
+    if (s->zeroes) {
+        qemu_iovec_memset(qiov, 0, 0, qiov->size);
+    }
+    return null_aio_common(bs, cb, opaque);
+}
+
+static BlockDriverAIOCB *null_aio_writev(BlockDriverState *bs,
+    int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+    BlockDriverCompletionFunc *cb, void *opaque)
+{
+    return null_aio_common(bs, cb, opaque);
+}
+
+static BlockDriverAIOCB *null_aio_flush(BlockDriverState *bs,
+    BlockDriverCompletionFunc *cb, void *opaque)
+{
+    return null_aio_common(bs, cb, opaque);
+}
+
+/* Nothing outlives a request, so there is nothing to move */
+static void null_detach_aio_context(BlockDriverState *bs)
+{
+}
+
+static int null_attach_aio_context(BlockDriverState *bs,
+                                   AioContext *new_context)
+{
+    return 0;
+}
+
+static BlockDriver bdrv_null_co = {
+    .format_name            = "null-co",
+    .protocol_name          = "null-co",
+    .instance_size          = sizeof(BDRVNullState),
+
+    .bdrv_file_open         = null_open,
+    .bdrv_close             = null_close,
+    .bdrv_getlength         = null_getlength,
+
+    .bdrv_co_readv          = null_co_readv,
+    .bdrv_co_writev         = null_co_writev,
+    .bdrv_co_flush_to_disk  = null_co_flush,
+
+    .bdrv_detach_aio_context = null_detach_aio_context,
+    .bdrv_attach_aio_context = null_attach_aio_context,
+};
+
+static BlockDriver bdrv_null_aio = {
+    .format_name            = "null-aio",
+    .protocol_name          = "null-aio",
+    .instance_size          = sizeof(BDRVNullState),
+
+    .bdrv_file_open         = null_open,
+    .bdrv_close             = null_close,
+    .bdrv_getlength         = null_getlength,
+
+    .bdrv_aio_readv         = null_aio_readv,
+    .bdrv_aio_writev        = null_aio_writev,
+    .bdrv_aio_flush         = null_aio_flush,
+
+    .bdrv_detach_aio_context = null_detach_aio_context,
+    .bdrv_attach_aio_context = null_attach_aio_context,
+};
+
+static void bdrv_null_init(void)
+{
+    bdrv_register(&bdrv_null_co);
+    bdrv_register(&bdrv_null_aio);
+}
+
+block_init(bdrv_null_init);
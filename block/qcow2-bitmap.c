@@ -0,0 +1,346 @@
+/*
+ * Persistent dirty bitmaps for the QCOW2 format
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * The dirty bitmaps header extension is a list of entries, each padded to
+ * 8 bytes.  The data of a bitmap is its serialized form, in clusters of
+ * its own.
+ *
+ * While QEMU has the image open read-write, the bitmaps live in memory
+ * and the entries are marked in use, without data; closing the image
+ * writes the data and clears the flag.  A bitmap that is still in use
+ * when the image is opened was not saved, e.g. because QEMU crashed, and
+ * comes back all dirty.  The same happens to all of them when the image
+ * had been written by a program that does not know about dirty bitmaps,
+ * which clears the autoclear bit.
+ */
+
+#include "qemu-common.h"
+#include "block_int.h"
+#include "block/qcow2.h"
+#include "host-utils.h"
+
+typedef struct QEMU_PACKED Qcow2BitmapHeader {
+    uint64_t data_offset;
+    uint32_t data_size;
+    uint8_t granularity_bits;
+    uint8_t flags;
+    uint16_t name_size;
+    /* followed by the name, not null terminated */
+} Qcow2BitmapHeader;
+
+void qcow2_free_bitmaps(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int i;
+
+    for (i = 0; i < s->nb_bitmaps; i++) {
+        g_free(s->bitmaps[i].name);
+    }
+    g_free(s->bitmaps);
+    s->bitmaps = NULL;
+    s->nb_bitmaps = 0;
+}
+
+int qcow2_read_bitmap_ext(BlockDriverState *bs, uint64_t offset,
+                          uint32_t len)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2BitmapHeader h;
+    Qcow2Bitmap *bm;
+    uint8_t *buf;
+    uint32_t pos;
+    int ret;
+
+    qcow2_free_bitmaps(bs);
+
+    buf = g_malloc(len);
+    ret = bdrv_pread(bs->file, offset, buf, len);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    for (pos = 0; pos < len; pos = align_offset(pos + sizeof(h) +
+                                                h.name_size, 8)) {
+        if (len - pos < sizeof(h)) {
+            goto invalid;
+        }
+        memcpy(&h, buf + pos, sizeof(h));
+        be64_to_cpus(&h.data_offset);
+        be32_to_cpus(&h.data_size);
+        be16_to_cpus(&h.name_size);
+
+        if (h.name_size == 0 || h.name_size > QCOW2_MAX_BITMAP_NAME ||
+            h.name_size > len - pos - sizeof(h) ||
+            h.granularity_bits < BDRV_SECTOR_BITS ||
+            h.granularity_bits > 62 ||
+            (h.data_offset & (s->cluster_size - 1))) {
+            goto invalid;
+        }
+
+        s->bitmaps = g_realloc(s->bitmaps,
+                               (s->nb_bitmaps + 1) * sizeof(*s->bitmaps));
+        bm = &s->bitmaps[s->nb_bitmaps++];
+        bm->name = g_strndup((char *)buf + pos + sizeof(h), h.name_size);
+        bm->data_offset = h.data_offset;
+        bm->data_size = h.data_offset ? h.data_size : 0;
+        bm->granularity_bits = h.granularity_bits;
+        bm->flags = h.flags;
+    }
+
+    g_free(buf);
+    return 0;
+
+invalid:
+    error_report("Invalid dirty bitmaps header extension");
+    ret = -EINVAL;
+fail:
+    qcow2_free_bitmaps(bs);
+    g_free(buf);
+    return ret;
+}
+
+/* Returns the contents of the header extension, or NULL if there is none */
+void *qcow2_bitmap_ext(BlockDriverState *bs, size_t *len)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2BitmapHeader h;
+    uint8_t *buf;
+    size_t pos;
+    int i;
+
+    if (!s->nb_bitmaps) {
+        return NULL;
+    }
+
+    *len = 0;
+    for (i = 0; i < s->nb_bitmaps; i++) {
+        *len += align_offset(sizeof(h) + strlen(s->bitmaps[i].name), 8);
+    }
+
+    buf = g_malloc0(*len);
+    for (i = 0, pos = 0; i < s->nb_bitmaps; i++) {
+        Qcow2Bitmap *bm = &s->bitmaps[i];
+        size_t name_size = strlen(bm->name);
+
+        h = (Qcow2BitmapHeader) {
+            .data_offset        = cpu_to_be64(bm->data_offset),
+            .data_size          = cpu_to_be32(bm->data_size),
+            .granularity_bits   = bm->granularity_bits,
+            .flags              = bm->flags,
+            .name_size          = cpu_to_be16(name_size),
+        };
+        memcpy(buf + pos, &h, sizeof(h));
+        memcpy(buf + pos + sizeof(h), bm->name, name_size);
+        pos += align_offset(sizeof(h) + name_size, 8);
+    }
+    return buf;
+}
+
+bool qcow2_can_store_dirty_bitmap(BlockDriverState *bs, const char *name)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    /* without the autoclear bit, writes by older programs go unnoticed */
+    return s->bitmaps_loaded && s->qcow_version >= 3 &&
+           strlen(name) <= QCOW2_MAX_BITMAP_NAME;
+}
+
+static void qcow2_load_bitmap(BlockDriverState *bs, Qcow2Bitmap *bm,
+                              BdrvDirtyBitmap *bitmap, bool valid)
+{
+    uint8_t *buf;
+    int ret;
+
+    if (!valid || (bm->flags & QCOW2_BITMAP_IN_USE) || !bm->data_offset ||
+        bm->data_size != bdrv_dirty_bitmap_serialized_size(bitmap)) {
+        bdrv_dirty_bitmap_set_all(bitmap);
+        return;
+    }
+
+    buf = g_malloc(bm->data_size);
+    ret = bdrv_pread(bs->file, bm->data_offset, buf, bm->data_size);
+    if (ret < 0) {
+        bdrv_dirty_bitmap_set_all(bitmap);
+    } else {
+        bdrv_dirty_bitmap_deserialize(bitmap, buf);
+    }
+    g_free(buf);
+}
+
+/*
+ * Called when the image is opened read-write.  A bitmap that already
+ * exists in the BlockDriverState, because the image is being reopened,
+ * gets the saved data.
+ */
+int qcow2_load_dirty_bitmaps(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    bool valid = s->autoclear_features & QCOW2_AUTOCLEAR_DIRTY_BITMAPS;
+    Qcow2Bitmap *old;
+    int i, nb_old, ret;
+
+    if (s->qcow_version < 3) {
+        return 0;
+    }
+    s->bitmaps_loaded = true;
+    if (!s->nb_bitmaps) {
+        return 0;
+    }
+
+    for (i = 0; i < s->nb_bitmaps; i++) {
+        Qcow2Bitmap *bm = &s->bitmaps[i];
+        BdrvDirtyBitmap *bitmap;
+        Error *local_err = NULL;
+
+        bitmap = bdrv_find_dirty_bitmap(bs, bm->name);
+        if (!bitmap) {
+            bitmap = bdrv_create_dirty_bitmap(bs, bm->name,
+                                              1LL << bm->granularity_bits,
+                                              &local_err);
+        }
+        if (!bitmap) {
+            error_report("Cannot load dirty bitmap '%s': %s", bm->name,
+                         error_get_pretty(local_err));
+            error_free(local_err);
+            continue;
+        }
+        bdrv_dirty_bitmap_set_persistent(bitmap, true);
+        qcow2_load_bitmap(bs, bm, bitmap, valid);
+    }
+
+    /*
+     * Mark the bitmaps in use before their data clusters go, so that the
+     * header never points to freed clusters.  The data is written anew on
+     * close.
+     */
+    old = g_memdup(s->bitmaps, s->nb_bitmaps * sizeof(*s->bitmaps));
+    nb_old = s->nb_bitmaps;
+    for (i = 0; i < s->nb_bitmaps; i++) {
+        s->bitmaps[i].data_offset = 0;
+        s->bitmaps[i].data_size = 0;
+        s->bitmaps[i].flags |= QCOW2_BITMAP_IN_USE;
+    }
+    s->autoclear_features &= ~QCOW2_AUTOCLEAR_DIRTY_BITMAPS;
+
+    ret = qcow2_update_header(bs);
+    if (ret == 0) {
+        for (i = 0; i < nb_old; i++) {
+            if (old[i].data_offset) {
+                qcow2_free_clusters(bs, old[i].data_offset, old[i].data_size);
+            }
+        }
+    }
+    g_free(old);
+    return ret;
+}
+
+static int qcow2_store_bitmap(BlockDriverState *bs, Qcow2Bitmap *bm,
+                              BdrvDirtyBitmap *bitmap)
+{
+    uint64_t size = bdrv_dirty_bitmap_serialized_size(bitmap);
+    int64_t offset;
+    uint8_t *buf;
+    int ret;
+
+    if (size == 0) {
+        return 0;
+    }
+
+    offset = qcow2_alloc_clusters(bs, size);
+    if (offset < 0) {
+        return offset;
+    }
+
+    buf = g_malloc(size);
+    bdrv_dirty_bitmap_serialize(bitmap, buf);
+    ret = bdrv_pwrite(bs->file, offset, buf, size);
+    g_free(buf);
+    if (ret < 0) {
+        qcow2_free_clusters(bs, offset, size);
+        return ret;
+    }
+
+    bm->data_offset = offset;
+    bm->data_size = size;
+    bm->flags &= ~QCOW2_BITMAP_IN_USE;
+    return 0;
+}
+
+/*
+ * Called on close.  Bitmaps that were removed since the image was opened
+ * are dropped from it, bitmaps that cannot be written stay in use and
+ * come back all dirty.
+ */
+int qcow2_store_dirty_bitmaps(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    BdrvDirtyBitmap *bitmap = NULL;
+    int had_bitmaps = s->nb_bitmaps;
+    int ret;
+
+    if (!s->bitmaps_loaded) {
+        return 0;
+    }
+
+    qcow2_free_bitmaps(bs);
+    while ((bitmap = bdrv_next_dirty_bitmap(bs, bitmap))) {
+        Qcow2Bitmap *bm;
+
+        if (!bdrv_dirty_bitmap_persistent(bitmap)) {
+            continue;
+        }
+
+        s->bitmaps = g_realloc(s->bitmaps,
+                               (s->nb_bitmaps + 1) * sizeof(*s->bitmaps));
+        bm = &s->bitmaps[s->nb_bitmaps++];
+        bm->name = g_strdup(bdrv_dirty_bitmap_name(bitmap));
+        bm->data_offset = 0;
+        bm->data_size = 0;
+        bm->granularity_bits = ctz64(bdrv_dirty_bitmap_granularity(bitmap));
+        bm->flags = QCOW2_BITMAP_IN_USE;
+
+        ret = qcow2_store_bitmap(bs, bm, bitmap);
+        if (ret < 0) {
+            error_report("Cannot store dirty bitmap '%s': %s", bm->name,
+                         strerror(-ret));
+        }
+    }
+
+    if (!had_bitmaps && !s->nb_bitmaps) {
+        return 0;
+    }
+
+    /* both the data and its refcounts must be stable before the header */
+    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+    if (ret == 0) {
+        ret = bdrv_flush(bs->file);
+    }
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (s->nb_bitmaps) {
+        s->autoclear_features |= QCOW2_AUTOCLEAR_DIRTY_BITMAPS;
+    }
+    return qcow2_update_header(bs);
+}
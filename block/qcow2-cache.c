@@ -28,32 +28,86 @@
 #include "trace.h"
 
 typedef struct Qcow2CachedTable {
-    void*   table;
     int64_t offset;
     bool    dirty;
-    int     cache_hits;
     int     ref;
+    QLIST_ENTRY(Qcow2CachedTable) hash_next;
+    QTAILQ_ENTRY(Qcow2CachedTable) lru_next;
 } Qcow2CachedTable;
 
+/*
+ * The tables live in one array, so that the entry of a table handed out by
+ * qcow2_cache_get() is found from its address.  Entries that hold a table
+ * are indexed by offset in a hash table, and all entries are kept in least
+ * recently used order for replacement.
+ */
 struct Qcow2Cache {
     Qcow2CachedTable*       entries;
+    uint8_t*                table_array;
     struct Qcow2Cache*      depends;
     int                     size;
+    int                     table_bits;
     bool                    depends_on_flush;
+    QLIST_HEAD(, Qcow2CachedTable) *buckets;
+    unsigned int            hash_mask;
+    QTAILQ_HEAD(, Qcow2CachedTable) lru; /* least recently used first */
+    uint64_t                hits;
+    uint64_t                misses;
+    MemAccount*             mem_account;
+    size_t                  mem_size;
 };
 
+static inline void *qcow2_cache_table(Qcow2Cache *c, int i)
+{
+    return c->table_array + ((size_t)i << c->table_bits);
+}
+
+/* Returns the index of the entry for @table, or -1 if it is not ours */
+static inline int qcow2_cache_table_index(Qcow2Cache *c, void *table)
+{
+    ptrdiff_t diff = (uint8_t *)table - c->table_array;
+
+    if (diff < 0 || diff >= ((ptrdiff_t)c->size << c->table_bits)) {
+        return -1;
+    }
+    assert((diff & ((1 << c->table_bits) - 1)) == 0);
+    return diff >> c->table_bits;
+}
+
+static inline unsigned int qcow2_cache_hash(Qcow2Cache *c, uint64_t offset)
+{
+    return (offset >> c->table_bits) & c->hash_mask;
+}
+
 Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables)
 {
     BDRVQcowState *s = bs->opaque;
     Qcow2Cache *c;
+    unsigned int buckets;
     int i;
 
     c = g_malloc0(sizeof(*c));
     c->size = num_tables;
+    c->table_bits = s->cluster_bits;
     c->entries = g_malloc0(sizeof(*c->entries) * num_tables);
+    c->table_array = qemu_blockalign(bs, (size_t)num_tables << c->table_bits);
 
+    buckets = 1;
+    while (buckets < num_tables) {
+        buckets <<= 1;
+    }
+    c->hash_mask = buckets - 1;
+    c->buckets = g_malloc0(sizeof(*c->buckets) * buckets);
+
+    c->mem_account = &s->mem_account;
+    c->mem_size = sizeof(*c) + sizeof(*c->entries) * num_tables +
+                  ((size_t)num_tables << c->table_bits) +
+                  sizeof(*c->buckets) * buckets;
+    mem_account_alloc(c->mem_account, c->mem_size);
+
+    QTAILQ_INIT(&c->lru);
     for (i = 0; i < c->size; i++) {
-        c->entries[i].table = qemu_blockalign(bs, s->cluster_size);
+        QTAILQ_INSERT_TAIL(&c->lru, &c->entries[i], lru_next);
     }
 
     return c;
@@ -65,15 +119,24 @@ int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c)
 
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
-        qemu_vfree(c->entries[i].table);
     }
 
+    mem_account_free(c->mem_account, c->mem_size);
+    qemu_vfree(c->table_array);
+    g_free(c->buckets);
     g_free(c->entries);
     g_free(c);
 
     return 0;
 }
 
+void qcow2_cache_get_stats(Qcow2Cache *c, BlockCacheStats *stats)
+{
+    stats->size = (int64_t)c->size << c->table_bits;
+    stats->hits = c->hits;
+    stats->misses = c->misses;
+}
+
 static int qcow2_cache_flush_dependency(BlockDriverState *bs, Qcow2Cache *c)
 {
     int ret;
@@ -120,7 +183,7 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
         BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE);
     }
 
-    ret = bdrv_pwrite(bs->file, c->entries[i].offset, c->entries[i].table,
+    ret = bdrv_pwrite(bs->file, c->entries[i].offset, qcow2_cache_table(c, i),
         s->cluster_size);
     if (ret < 0) {
         return ret;
@@ -131,21 +194,40 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
     return 0;
 }
 
+static int qcow2_cache_entry_cmp(const void *a, const void *b)
+{
+    const Qcow2CachedTable *ta = *(Qcow2CachedTable * const *)a;
+    const Qcow2CachedTable *tb = *(Qcow2CachedTable * const *)b;
+
+    return ta->offset < tb->offset ? -1 : ta->offset > tb->offset;
+}
+
 int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c)
 {
     BDRVQcowState *s = bs->opaque;
+    Qcow2CachedTable **dirty;
     int result = 0;
     int ret;
-    int i;
+    int i, n;
 
     trace_qcow2_cache_flush(qemu_coroutine_self(), c == s->l2_table_cache);
 
-    for (i = 0; i < c->size; i++) {
-        ret = qcow2_cache_entry_flush(bs, c, i);
+    /* write the dirty tables back in the order they are in the image */
+    dirty = g_malloc(sizeof(*dirty) * c->size);
+    for (i = 0, n = 0; i < c->size; i++) {
+        if (c->entries[i].dirty && c->entries[i].offset) {
+            dirty[n++] = &c->entries[i];
+        }
+    }
+    qsort(dirty, n, sizeof(*dirty), qcow2_cache_entry_cmp);
+
+    for (i = 0; i < n; i++) {
+        ret = qcow2_cache_entry_flush(bs, c, dirty[i] - c->entries);
         if (ret < 0 && result != -ENOSPC) {
             result = ret;
         }
     }
+    g_free(dirty);
 
     if (result == 0) {
         ret = bdrv_flush(bs->file);
@@ -187,38 +269,24 @@ void qcow2_cache_depends_on_flush(Qcow2Cache *c)
 
 static int qcow2_cache_find_entry_to_replace(Qcow2Cache *c)
 {
-    int i;
-    int min_count = INT_MAX;
-    int min_index = -1;
+    Qcow2CachedTable *t;
 
-
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].ref) {
-            continue;
+    QTAILQ_FOREACH(t, &c->lru, lru_next) {
+        if (!t->ref) {
+            return t - c->entries;
         }
-
-        if (c->entries[i].cache_hits < min_count) {
-            min_index = i;
-            min_count = c->entries[i].cache_hits;
-        }
-
-        /* Give newer hits priority */
-        /* TODO Check how to optimize the replacement strategy */
-        c->entries[i].cache_hits /= 2;
     }
 
-    if (min_index == -1) {
-        /* This can't happen in current synchronous code, but leave the check
-         * here as a reminder for whoever starts using AIO with the cache */
-        abort();
-    }
-    return min_index;
+    /* This can't happen in current synchronous code, but leave the check
+     * here as a reminder for whoever starts using AIO with the cache */
+    abort();
 }
 
 static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     uint64_t offset, void **table, bool read_from_disk)
 {
     BDRVQcowState *s = bs->opaque;
+    Qcow2CachedTable *t;
     int i;
     int ret;
 
@@ -226,11 +294,14 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
                           offset, read_from_disk);
 
     /* Check if the table is already cached */
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].offset == offset) {
+    QLIST_FOREACH(t, &c->buckets[qcow2_cache_hash(c, offset)], hash_next) {
+        if (t->offset == offset) {
+            i = t - c->entries;
+            c->hits++;
             goto found;
         }
     }
+    c->misses++;
 
     /* If not, write a table back and replace it */
     i = qcow2_cache_find_entry_to_replace(c);
@@ -239,6 +310,7 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     if (i < 0) {
         return i;
     }
+    t = &c->entries[i];
 
     ret = qcow2_cache_entry_flush(bs, c, i);
     if (ret < 0) {
@@ -247,28 +319,31 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
 
     trace_qcow2_cache_get_read(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
-    c->entries[i].offset = 0;
+    if (t->offset) {
+        QLIST_REMOVE(t, hash_next);
+        t->offset = 0;
+    }
     if (read_from_disk) {
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
         }
 
-        ret = bdrv_pread(bs->file, offset, c->entries[i].table, s->cluster_size);
+        ret = bdrv_pread(bs->file, offset, qcow2_cache_table(c, i),
+                         s->cluster_size);
         if (ret < 0) {
             return ret;
         }
     }
 
-    /* Give the table some hits for the start so that it won't be replaced
-     * immediately. The number 32 is completely arbitrary. */
-    c->entries[i].cache_hits = 32;
-    c->entries[i].offset = offset;
+    t->offset = offset;
+    QLIST_INSERT_HEAD(&c->buckets[qcow2_cache_hash(c, offset)], t, hash_next);
 
     /* And return the right table */
 found:
-    c->entries[i].cache_hits++;
-    c->entries[i].ref++;
-    *table = c->entries[i].table;
+    t->ref++;
+    QTAILQ_REMOVE(&c->lru, t, lru_next);
+    QTAILQ_INSERT_TAIL(&c->lru, t, lru_next);
+    *table = qcow2_cache_table(c, i);
 
     trace_qcow2_cache_get_done(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
@@ -290,16 +365,12 @@ int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
 
 int qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table)
 {
-    int i;
+    int i = qcow2_cache_table_index(c, *table);
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].table == *table) {
-            goto found;
-        }
+    if (i < 0) {
+        return -ENOENT;
     }
-    return -ENOENT;
 
-found:
     c->entries[i].ref--;
     *table = NULL;
 
@@ -309,15 +380,11 @@ found:
 
 void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table)
 {
-    int i;
+    int i = qcow2_cache_table_index(c, table);
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].table == table) {
-            goto found;
-        }
+    if (i < 0) {
+        abort();
     }
-    abort();
 
-found:
     c->entries[i].dirty = true;
 }
@@ -289,14 +289,14 @@ static int count_contiguous_free_clusters(uint64_t nb_clusters, uint64_t *l2_tab
     return i;
 }
 
-/* The crypt function is compatible with the linux cryptoloop
-   algorithm for < 4 GB images. NOTE: out_buf == in_buf is
-   supported */
+/* The CBC mode is compatible with the linux cryptoloop algorithm
+   for < 4 GB images; XTS takes the sector number as the data unit
+   number of IEEE P1619. NOTE: out_buf == in_buf is supported */
 void qcow2_encrypt_sectors(BDRVQcowState *s, int64_t sector_num,
                            uint8_t *out_buf, const uint8_t *in_buf,
-                           int nb_sectors, int enc,
-                           const AES_KEY *key)
+                           int nb_sectors, int enc)
 {
+    const AES_KEY *key = enc ? &s->aes_encrypt_key : &s->aes_decrypt_key;
     union {
         uint64_t ll[2];
         uint8_t b[16];
@@ -306,8 +306,12 @@ void qcow2_encrypt_sectors(BDRVQcowState *s, int64_t sector_num,
     for(i = 0; i < nb_sectors; i++) {
         ivec.ll[0] = cpu_to_le64(sector_num);
         ivec.ll[1] = 0;
-        AES_cbc_encrypt(in_buf, out_buf, 512, key,
-                        ivec.b, enc);
+        if (s->crypt_method == QCOW_CRYPT_AES_XTS) {
+            AES_xts_encrypt(in_buf, out_buf, 512, key, &s->aes_tweak_key,
+                            ivec.b, enc);
+        } else {
+            AES_cbc_encrypt(in_buf, out_buf, 512, key, ivec.b, enc);
+        }
         sector_num++;
         in_buf += 512;
         out_buf += 512;
@@ -355,9 +359,7 @@ static int coroutine_fn copy_sectors(BlockDriverState *bs,
     }
 
     if (s->crypt_method) {
-        qcow2_encrypt_sectors(s, start_sect + n_start,
-                        iov.iov_base, iov.iov_base, n, 1,
-                        &s->aes_encrypt_key);
+        qcow2_co_encrypt_sectors(bs, start_sect + n_start, iov.iov_base, n, 1);
     }
 
     BLKDBG_EVENT(bs->file, BLKDBG_COW_WRITE);
@@ -618,10 +620,10 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
 int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
 {
     BDRVQcowState *s = bs->opaque;
-    int i, j = 0, l2_index, ret;
+    int i, j = 0, n, l2_index, ret = 0;
     uint64_t *old_cluster, start_sect, *l2_table;
     uint64_t cluster_offset = m->alloc_offset;
-    bool cow = false;
+    bool cow_start, cow_end;
 
     trace_qcow2_cluster_link_l2(qemu_coroutine_self(), m->nb_clusters);
 
@@ -630,25 +632,26 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
 
     old_cluster = g_malloc(m->nb_clusters * sizeof(uint64_t));
 
-    /* copy content of unmodified sectors */
+    /* copy content of unmodified sectors; the clusters are only ours until
+     * the L2 table points to them, so other requests can go on meanwhile */
     start_sect = (m->offset & ~(s->cluster_size - 1)) >> 9;
-    if (m->n_start) {
-        cow = true;
-        qemu_co_mutex_unlock(&s->lock);
-        ret = copy_sectors(bs, start_sect, cluster_offset, 0, m->n_start);
-        qemu_co_mutex_lock(&s->lock);
-        if (ret < 0)
-            goto err;
-    }
-
-    if (m->nb_available & (s->cluster_sectors - 1)) {
-        cow = true;
+    cow_start = m->n_start != 0;
+    cow_end = (m->nb_available & (s->cluster_sectors - 1)) != 0;
+    if (cow_start || cow_end) {
         qemu_co_mutex_unlock(&s->lock);
-        ret = copy_sectors(bs, start_sect, cluster_offset, m->nb_available,
-                           align_offset(m->nb_available, s->cluster_sectors));
+        if (cow_start) {
+            ret = copy_sectors(bs, start_sect, cluster_offset, 0, m->n_start);
+        }
+        if (ret >= 0 && cow_end) {
+            ret = copy_sectors(bs, start_sect, cluster_offset,
+                               m->nb_available,
+                               align_offset(m->nb_available,
+                                            s->cluster_sectors));
+        }
         qemu_co_mutex_lock(&s->lock);
-        if (ret < 0)
+        if (ret < 0) {
             goto err;
+        }
     }
 
     /*
@@ -658,7 +661,7 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
      * need to be sure that the refcounts have been increased and COW was
      * handled.
      */
-    if (cow) {
+    if (cow_start || cow_end) {
         qcow2_cache_depends_on_flush(s->l2_table_cache);
     }
 
@@ -695,11 +698,25 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
     /*
      * If this was a COW, we need to decrease the refcount of the old cluster.
      * Also flush bs->file to get the right order for L2 and refcount update.
+     * Runs of contiguous old clusters are freed with a single refcount update.
      */
-    if (j != 0) {
-        for (i = 0; i < j; i++) {
-            qcow2_free_any_clusters(bs, be64_to_cpu(old_cluster[i]), 1);
+    for (i = 0; i < j; i += n) {
+        uint64_t entry = be64_to_cpu(old_cluster[i]);
+
+        n = 1;
+        if (qcow2_get_cluster_type(entry) == QCOW2_CLUSTER_NORMAL) {
+            while (i + n < j) {
+                uint64_t next = be64_to_cpu(old_cluster[i + n]);
+
+                if (qcow2_get_cluster_type(next) != QCOW2_CLUSTER_NORMAL ||
+                    (next & L2E_OFFSET_MASK) != (entry & L2E_OFFSET_MASK) +
+                    ((uint64_t)n << s->cluster_bits)) {
+                    break;
+                }
+                n++;
+            }
         }
+        qcow2_free_any_clusters(bs, entry, n);
     }
 
     ret = 0;
@@ -782,7 +799,10 @@ static int do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
         uint64_t old_start = old_alloc->offset >> s->cluster_bits;
         uint64_t old_end = old_start + old_alloc->nb_clusters;
 
-        if (end < old_start || start > old_end) {
+        /* [start, end) and [old_start, old_end) are cluster ranges, so a
+         * request touching the cluster right after a running allocation
+         * does not have to wait for it */
+        if (end <= old_start || start >= old_end) {
             /* No intersection */
         } else {
             if (start < old_start) {
@@ -1197,3 +1217,38 @@ int qcow2_zero_clusters(BlockDriverState *bs, uint64_t offset, int nb_sectors)
 
     return 0;
 }
+
+/*
+ * Points the L2 entry of the cluster at @guest_offset to @l2_entry and drops
+ * the reference of the cluster it pointed to before.  The caller holds the
+ * reference of the new cluster.
+ */
+int qcow2_map_cluster(BlockDriverState *bs, uint64_t guest_offset,
+    uint64_t l2_entry)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t *l2_table, old_entry;
+    int l2_index;
+    int ret;
+
+    if (qcow2_need_accurate_refcounts(s)) {
+        qcow2_cache_set_dependency(bs, s->l2_table_cache,
+                                   s->refcount_block_cache);
+    }
+    ret = get_cluster_table(bs, guest_offset, &l2_table, &l2_index);
+    if (ret < 0) {
+        return ret;
+    }
+
+    old_entry = be64_to_cpu(l2_table[l2_index]);
+    qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
+    l2_table[l2_index] = cpu_to_be64(l2_entry);
+
+    ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
+    if (ret < 0) {
+        return ret;
+    }
+
+    qcow2_free_any_clusters(bs, old_entry, 1);
+    return 0;
+}
@@ -0,0 +1,179 @@
+/*
+ * Encryption worker threads for the QCOW2 format
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * The data of a large request is encrypted or decrypted by a few worker
+ * threads, each taking a piece of at least QCOW2_CRYPT_MIN_SECTORS, while
+ * the coroutine that issued it yields: other guest requests go on in the
+ * meantime, and the work is spread over several host CPUs.  The worker
+ * that finishes the last piece queues the request on crypt_done, and a
+ * bottom half in the image's AioContext enters the coroutine again.
+ *
+ * The threads are started by the first request large enough to use them
+ * and stopped when the image is closed.  Callers must not hold s->lock,
+ * since they yield.
+ */
+
+#include "qemu-common.h"
+#include "block_int.h"
+#include "block/qcow2.h"
+
+struct Qcow2CryptRequest {
+    Coroutine *co;
+    int pending;                /* pieces not done yet, under crypt_lock */
+    QTAILQ_ENTRY(Qcow2CryptRequest) next;
+};
+
+struct Qcow2CryptJob {
+    Qcow2CryptRequest *req;
+    int64_t sector_num;
+    uint8_t *buf;
+    int nb_sectors;
+    int enc;
+    QTAILQ_ENTRY(Qcow2CryptJob) next;
+};
+
+static void *qcow2_crypt_thread(void *opaque)
+{
+    BDRVQcowState *s = opaque;
+    Qcow2CryptJob *job;
+    Qcow2CryptRequest *req;
+
+    qemu_mutex_lock(&s->crypt_lock);
+    for (;;) {
+        job = QTAILQ_FIRST(&s->crypt_jobs);
+        if (!job) {
+            if (s->crypt_exit) {
+                break;
+            }
+            qemu_cond_wait(&s->crypt_cond, &s->crypt_lock);
+            continue;
+        }
+        QTAILQ_REMOVE(&s->crypt_jobs, job, next);
+        qemu_mutex_unlock(&s->crypt_lock);
+
+        qcow2_encrypt_sectors(s, job->sector_num, job->buf, job->buf,
+                              job->nb_sectors, job->enc);
+
+        qemu_mutex_lock(&s->crypt_lock);
+        req = job->req;
+        if (--req->pending == 0) {
+            QTAILQ_INSERT_TAIL(&s->crypt_done, req, next);
+            qemu_bh_schedule(s->crypt_bh);
+        }
+    }
+    qemu_mutex_unlock(&s->crypt_lock);
+    return NULL;
+}
+
+static void qcow2_crypt_bh(void *opaque)
+{
+    BDRVQcowState *s = opaque;
+    Qcow2CryptRequest *req;
+
+    qemu_mutex_lock(&s->crypt_lock);
+    while ((req = QTAILQ_FIRST(&s->crypt_done)) != NULL) {
+        QTAILQ_REMOVE(&s->crypt_done, req, next);
+        qemu_mutex_unlock(&s->crypt_lock);
+        qemu_coroutine_enter(req->co, NULL);
+        qemu_mutex_lock(&s->crypt_lock);
+    }
+    qemu_mutex_unlock(&s->crypt_lock);
+}
+
+static void qcow2_crypt_start(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int i, n = 1;
+
+#ifdef _SC_NPROCESSORS_ONLN
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    n = MAX(1, MIN(n, QCOW2_CRYPT_MAX_THREADS));
+
+    qemu_mutex_init(&s->crypt_lock);
+    qemu_cond_init(&s->crypt_cond);
+    QTAILQ_INIT(&s->crypt_jobs);
+    QTAILQ_INIT(&s->crypt_done);
+    s->crypt_bh = aio_bh_new(bdrv_get_aio_context(bs), qcow2_crypt_bh, s);
+    s->crypt_exit = false;
+    for (i = 0; i < n; i++) {
+        qemu_thread_create(&s->crypt_threads[i], qcow2_crypt_thread, s,
+                           QEMU_THREAD_JOINABLE);
+    }
+    s->crypt_nthreads = n;
+}
+
+/* All requests have completed by the time the image is closed */
+void qcow2_crypt_stop(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int i;
+
+    if (!s->crypt_nthreads) {
+        return;
+    }
+
+    qemu_mutex_lock(&s->crypt_lock);
+    s->crypt_exit = true;
+    qemu_cond_broadcast(&s->crypt_cond);
+    qemu_mutex_unlock(&s->crypt_lock);
+    for (i = 0; i < s->crypt_nthreads; i++) {
+        qemu_thread_join(&s->crypt_threads[i]);
+    }
+    s->crypt_nthreads = 0;
+
+    assert(QTAILQ_EMPTY(&s->crypt_done));
+    qemu_bh_delete(s->crypt_bh);
+    qemu_cond_destroy(&s->crypt_cond);
+    qemu_mutex_destroy(&s->crypt_lock);
+}
+
+/*
+ * Encrypt (@enc != 0) or decrypt @nb_sectors of @buf in place, the data
+ * of the guest sectors from @sector_num on.
+ */
+void coroutine_fn qcow2_co_encrypt_sectors(BlockDriverState *bs,
+                                           int64_t sector_num, uint8_t *buf,
+                                           int nb_sectors, int enc)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2CryptJob jobs[QCOW2_CRYPT_MAX_THREADS];
+    Qcow2CryptRequest req;
+    int i, n, piece;
+
+    if (nb_sectors < 2 * QCOW2_CRYPT_MIN_SECTORS) {
+        qcow2_encrypt_sectors(s, sector_num, buf, buf, nb_sectors, enc);
+        return;
+    }
+
+    if (!s->crypt_nthreads) {
+        qcow2_crypt_start(bs);
+    }
+
+    n = MIN(s->crypt_nthreads, nb_sectors / QCOW2_CRYPT_MIN_SECTORS);
+    piece = DIV_ROUND_UP(nb_sectors, n);
+
+    req.co = qemu_coroutine_self();
+    req.pending = n;
+
+    qemu_mutex_lock(&s->crypt_lock);
+    for (i = 0; i < n; i++) {
+        jobs[i] = (Qcow2CryptJob) {
+            .req        = &req,
+            .sector_num = sector_num + i * piece,
+            .buf        = buf + i * piece * BDRV_SECTOR_SIZE,
+            .nb_sectors = MIN(piece, nb_sectors - i * piece),
+            .enc        = enc,
+        };
+        QTAILQ_INSERT_TAIL(&s->crypt_jobs, &jobs[i], next);
+    }
+    qemu_cond_broadcast(&s->crypt_cond);
+    qemu_mutex_unlock(&s->crypt_lock);
+
+    qemu_coroutine_yield();
+}
@@ -0,0 +1,545 @@
+/*
+ * Cluster deduplication for the QCOW2 format
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Writes of whole clusters look up the SHA-256 of the data in an index of
+ * the clusters written so far, and map the guest cluster to the existing
+ * host cluster when there is one.  SHA-256 rather than a cheaper hash plus
+ * a comparison of the data, because any guest can choose what it writes
+ * and a collision would hand it another cluster's contents.
+ *
+ * The index holds a reference to each of its clusters.  Their refcount is
+ * therefore never 1 while they are indexed, the L2 entries pointing to
+ * them never have QCOW_OFLAG_COPIED, and every write to them goes through
+ * COW: an indexed cluster never changes.  When the last L2 entry goes,
+ * the entry is dropped and the cluster freed.
+ *
+ * While QEMU has the image open read-write, the index lives in memory;
+ * the table in the image is freed on open and written anew on close.  If
+ * QEMU crashes, the references of the index leak until "qemu-img check
+ * -r leaks", and the index starts empty.  The same happens when the image
+ * has been written by a program that does not know about dedup, which
+ * clears the autoclear bit.
+ */
+
+#include "qemu-common.h"
+#include "block_int.h"
+#include "block/qcow2.h"
+
+#define QCOW2_DEDUP_SHA256      0
+
+/* entries read or written at once */
+#define QCOW2_DEDUP_BATCH       1024
+
+typedef struct QEMU_PACKED Qcow2DedupExt {
+    uint64_t table_offset;
+    uint64_t nb_entries;
+    uint8_t hash_type;
+    uint8_t reserved[7];
+} Qcow2DedupExt;
+
+typedef struct Qcow2DedupEntry {
+    uint8_t hash[QCOW2_DEDUP_HASH_SIZE];
+    uint64_t offset;
+} Qcow2DedupEntry;
+
+static guint dedup_hash(gconstpointer key)
+{
+    guint hash;
+
+    /* the digest is as good a hash as any */
+    memcpy(&hash, key, sizeof(hash));
+    return hash;
+}
+
+static gboolean dedup_equal(gconstpointer a, gconstpointer b)
+{
+    return !memcmp(a, b, QCOW2_DEDUP_HASH_SIZE);
+}
+
+static void dedup_digest(BDRVQcowState *s, const uint8_t *buf,
+                         uint8_t *digest)
+{
+    GChecksum *checksum = g_checksum_new(G_CHECKSUM_SHA256);
+    gsize len = QCOW2_DEDUP_HASH_SIZE;
+
+    g_checksum_update(checksum, buf, s->cluster_size);
+    g_checksum_get_digest(checksum, digest, &len);
+    g_checksum_free(checksum);
+}
+
+static void dedup_insert(BDRVQcowState *s, const uint8_t *digest,
+                         uint64_t offset)
+{
+    Qcow2DedupEntry *entry = g_malloc(sizeof(*entry));
+
+    memcpy(entry->hash, digest, QCOW2_DEDUP_HASH_SIZE);
+    entry->offset = offset;
+    g_hash_table_insert(s->dedup_hash, entry->hash, entry);
+    g_hash_table_insert(s->dedup_offsets, &entry->offset, entry);
+}
+
+/* Frees the entry */
+static void dedup_remove(BDRVQcowState *s, Qcow2DedupEntry *entry)
+{
+    g_hash_table_remove(s->dedup_hash, entry->hash);
+    g_hash_table_remove(s->dedup_offsets, &entry->offset);
+}
+
+int qcow2_read_dedup_ext(BlockDriverState *bs, uint64_t offset,
+                         uint32_t len)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2DedupExt ext;
+    int ret;
+
+    if (len < sizeof(ext)) {
+        error_report("Invalid dedup header extension");
+        return -EINVAL;
+    }
+    ret = bdrv_pread(bs->file, offset, &ext, sizeof(ext));
+    if (ret < 0) {
+        return ret;
+    }
+    be64_to_cpus(&ext.table_offset);
+    be64_to_cpus(&ext.nb_entries);
+
+    if (ext.hash_type != QCOW2_DEDUP_SHA256) {
+        error_report("Unsupported dedup hash type %d", ext.hash_type);
+        return -ENOTSUP;
+    }
+    if ((ext.table_offset & (s->cluster_size - 1)) ||
+        ext.nb_entries > INT64_MAX / QCOW2_DEDUP_ENTRY_SIZE) {
+        error_report("Invalid dedup header extension");
+        return -EINVAL;
+    }
+
+    s->dedup = true;
+    s->dedup_table_offset = ext.table_offset;
+    s->dedup_table_entries = ext.table_offset ? ext.nb_entries : 0;
+    return 0;
+}
+
+/* Returns the contents of the header extension, or NULL if there is none */
+void *qcow2_dedup_ext(BlockDriverState *bs, size_t *len)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2DedupExt *ext;
+
+    if (!s->dedup) {
+        return NULL;
+    }
+
+    ext = g_malloc0(sizeof(*ext));
+    ext->table_offset = cpu_to_be64(s->dedup_table_offset);
+    ext->nb_entries = cpu_to_be64(s->dedup_table_entries);
+    ext->hash_type = QCOW2_DEDUP_SHA256;
+    *len = sizeof(*ext);
+    return ext;
+}
+
+static int dedup_read_table(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint8_t *buf;
+    uint64_t i, n;
+    int ret = 0;
+
+    buf = g_malloc(QCOW2_DEDUP_BATCH * QCOW2_DEDUP_ENTRY_SIZE);
+    for (i = 0; i < s->dedup_table_entries; i += n) {
+        uint8_t *p = buf;
+        uint64_t j;
+
+        n = MIN(s->dedup_table_entries - i, QCOW2_DEDUP_BATCH);
+        ret = bdrv_pread(bs->file,
+                         s->dedup_table_offset + i * QCOW2_DEDUP_ENTRY_SIZE,
+                         buf, n * QCOW2_DEDUP_ENTRY_SIZE);
+        if (ret < 0) {
+            break;
+        }
+        ret = 0;
+
+        for (j = 0; j < n; j++, p += QCOW2_DEDUP_ENTRY_SIZE) {
+            uint64_t offset = ldq_be_p(p + QCOW2_DEDUP_HASH_SIZE);
+
+            if (!offset || (offset & (s->cluster_size - 1)) ||
+                g_hash_table_lookup(s->dedup_hash, p) ||
+                g_hash_table_lookup(s->dedup_offsets, &offset)) {
+                error_report("Invalid dedup table entry");
+                ret = -EINVAL;
+                goto out;
+            }
+            dedup_insert(s, p, offset);
+        }
+    }
+
+out:
+    g_free(buf);
+    return ret;
+}
+
+/*
+ * Called on open.  The table is read even when the image is opened
+ * read-only, so that qemu-img check can count its references.
+ */
+int qcow2_dedup_open(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int ret;
+
+    s->dedup_hash = g_hash_table_new(dedup_hash, dedup_equal);
+    s->dedup_offsets = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+                                             NULL, g_free);
+
+    if (s->dedup && s->qcow_version < 3) {
+        s->dedup = false;
+    }
+    if (!s->dedup || !s->dedup_table_offset) {
+        return 0;
+    }
+
+    /* the references of a stale table are leaks, see above */
+    if (!(s->autoclear_features & QCOW2_AUTOCLEAR_DEDUP)) {
+        s->dedup_table_offset = 0;
+        s->dedup_table_entries = 0;
+        return 0;
+    }
+
+    ret = dedup_read_table(bs);
+    if (ret < 0) {
+        g_hash_table_remove_all(s->dedup_hash);
+        g_hash_table_remove_all(s->dedup_offsets);
+    }
+    return ret;
+}
+
+/* Called after creating an image */
+int qcow2_dedup_enable(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    s->dedup = true;
+    s->dedup_table_offset = 0;
+    s->dedup_table_entries = 0;
+    return qcow2_update_header(bs);
+}
+
+/*
+ * Called when the image is opened read-write: the index is in memory, so
+ * the table goes, first from the header and then from the refcounts.
+ */
+int qcow2_dedup_load(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t old_offset = s->dedup_table_offset;
+    uint64_t old_size = s->dedup_table_entries * QCOW2_DEDUP_ENTRY_SIZE;
+    int ret;
+
+    if (!s->dedup) {
+        return 0;
+    }
+
+    s->dedup_table_offset = 0;
+    s->dedup_table_entries = 0;
+    s->autoclear_features &= ~QCOW2_AUTOCLEAR_DEDUP;
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (old_offset) {
+        qcow2_free_clusters(bs, old_offset, old_size);
+    }
+    s->dedup_loaded = true;
+    return 0;
+}
+
+/*
+ * Drops the entries whose clusters are only referenced by the index any
+ * more, e.g. because a snapshot that used them was deleted.
+ */
+static void dedup_sweep(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    GHashTableIter iter;
+    Qcow2DedupEntry *entry;
+
+    g_hash_table_iter_init(&iter, s->dedup_offsets);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&entry)) {
+        uint64_t offset = entry->offset;
+        int refcount = qcow2_get_refcount(bs, offset >> s->cluster_bits);
+
+        if (refcount < 0 || refcount > 1) {
+            continue;
+        }
+        g_hash_table_remove(s->dedup_hash, entry->hash);
+        g_hash_table_iter_remove(&iter);
+        if (refcount == 1) {
+            qcow2_update_refcount(bs, offset, s->cluster_size, -1);
+        }
+    }
+}
+
+/* Called on close */
+int qcow2_dedup_store(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    GHashTableIter iter;
+    Qcow2DedupEntry *entry;
+    uint64_t nb_entries, i = 0;
+    int64_t offset = 0;
+    uint8_t *buf;
+    int ret;
+
+    if (!s->dedup_loaded) {
+        return 0;
+    }
+
+    dedup_sweep(bs);
+    nb_entries = g_hash_table_size(s->dedup_offsets);
+
+    if (nb_entries) {
+        uint64_t size = nb_entries * QCOW2_DEDUP_ENTRY_SIZE;
+
+        offset = qcow2_alloc_clusters(bs, size);
+        if (offset < 0) {
+            return offset;
+        }
+
+        buf = g_malloc(size);
+        g_hash_table_iter_init(&iter, s->dedup_offsets);
+        while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&entry)) {
+            uint8_t *p = buf + i++ * QCOW2_DEDUP_ENTRY_SIZE;
+
+            memcpy(p, entry->hash, QCOW2_DEDUP_HASH_SIZE);
+            stq_be_p(p + QCOW2_DEDUP_HASH_SIZE, entry->offset);
+        }
+        ret = bdrv_pwrite(bs->file, offset, buf, size);
+        g_free(buf);
+        if (ret < 0) {
+            qcow2_free_clusters(bs, offset, size);
+            return ret;
+        }
+    }
+
+    /* both the table and its refcounts must be stable before the header */
+    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+    if (ret == 0) {
+        ret = bdrv_flush(bs->file);
+    }
+    if (ret < 0) {
+        return ret;
+    }
+
+    s->dedup_table_offset = offset;
+    s->dedup_table_entries = nb_entries;
+    s->autoclear_features |= QCOW2_AUTOCLEAR_DEDUP;
+    return qcow2_update_header(bs);
+}
+
+void qcow2_dedup_close(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    if (s->dedup_hash) {
+        g_hash_table_destroy(s->dedup_hash);
+        g_hash_table_destroy(s->dedup_offsets);
+        s->dedup_hash = NULL;
+        s->dedup_offsets = NULL;
+    }
+    s->dedup_loaded = false;
+}
+
+/*
+ * Called when the refcounts of [offset, offset + size) have been
+ * decreased: the clusters of the index whose last L2 entry went are
+ * freed.
+ */
+void qcow2_dedup_release(BlockDriverState *bs, int64_t offset, int64_t size)
+{
+    BDRVQcowState *s = bs->opaque;
+    int64_t start = offset & ~(s->cluster_size - 1);
+    int64_t end = offset + size;
+
+    if (!g_hash_table_size(s->dedup_offsets)) {
+        return;
+    }
+
+    for (offset = start; offset < end; offset += s->cluster_size) {
+        uint64_t key = offset;
+        Qcow2DedupEntry *entry;
+
+        entry = g_hash_table_lookup(s->dedup_offsets, &key);
+        if (!entry ||
+            qcow2_get_refcount(bs, offset >> s->cluster_bits) != 1) {
+            continue;
+        }
+        dedup_remove(s, entry);
+        qcow2_update_refcount(bs, offset, s->cluster_size, -1);
+    }
+}
+
+/* Returns the clusters in the index, for qemu-img check */
+uint64_t *qcow2_dedup_offsets(BlockDriverState *bs, size_t *nb_offsets)
+{
+    BDRVQcowState *s = bs->opaque;
+    GHashTableIter iter;
+    Qcow2DedupEntry *entry;
+    uint64_t *offsets;
+    size_t i = 0;
+
+    *nb_offsets = g_hash_table_size(s->dedup_offsets);
+    offsets = g_malloc(*nb_offsets * sizeof(*offsets));
+
+    g_hash_table_iter_init(&iter, s->dedup_offsets);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&entry)) {
+        offsets[i++] = entry->offset;
+    }
+    return offsets;
+}
+
+/*
+ * Writes the cluster at @sector_num, which must be cluster aligned, from
+ * @qiov at @qiov_offset.  Called with s->lock held.
+ */
+int coroutine_fn qcow2_dedup_write(BlockDriverState *bs, int64_t sector_num,
+                                   QEMUIOVector *qiov, uint64_t qiov_offset)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t guest_offset = sector_num << BDRV_SECTOR_BITS;
+    uint64_t guest_cluster = guest_offset >> s->cluster_bits;
+    uint8_t digest[QCOW2_DEDUP_HASH_SIZE];
+    QCowL2Meta *old_alloc;
+    QCowL2Meta m = {
+        .offset         = guest_offset,
+        .nb_clusters    = 1,
+    };
+    Qcow2DedupEntry *entry;
+    uint64_t cluster_offset;
+    int64_t new_offset;
+    QEMUIOVector hd_qiov;
+    struct iovec iov;
+    bool indexed;
+    uint8_t *buf;
+    int num, ret;
+
+    /* wait for the allocating writes to this cluster, then keep others off */
+again:
+    QLIST_FOREACH(old_alloc, &s->cluster_allocs, next_in_flight) {
+        uint64_t old_start = old_alloc->offset >> s->cluster_bits;
+
+        if (guest_cluster >= old_start &&
+            guest_cluster < old_start + old_alloc->nb_clusters) {
+            qemu_co_mutex_unlock(&s->lock);
+            qemu_co_queue_wait(&old_alloc->dependent_requests);
+            qemu_co_mutex_lock(&s->lock);
+            goto again;
+        }
+    }
+    qemu_co_queue_init(&m.dependent_requests);
+    QLIST_INSERT_HEAD(&s->cluster_allocs, &m, next_in_flight);
+
+    buf = qemu_blockalign(bs, s->cluster_size);
+    qemu_iovec_to_buf(qiov, qiov_offset, buf, s->cluster_size);
+    dedup_digest(s, buf, digest);
+
+    if (s->use_lazy_refcounts) {
+        qcow2_mark_dirty(bs);
+    }
+
+    entry = g_hash_table_lookup(s->dedup_hash, digest);
+    if (entry) {
+        num = s->cluster_sectors;
+        ret = qcow2_get_cluster_offset(bs, guest_offset, &num,
+                                       &cluster_offset);
+        if (ret < 0) {
+            goto out;
+        }
+        if (ret == QCOW2_CLUSTER_NORMAL && cluster_offset == entry->offset) {
+            ret = 0;
+            goto out;
+        }
+
+        new_offset = entry->offset;
+        ret = qcow2_update_refcount(bs, new_offset, s->cluster_size, 1);
+        if (ret < 0) {
+            goto out;
+        }
+        ret = qcow2_map_cluster(bs, guest_offset, new_offset);
+        if (ret < 0) {
+            qcow2_free_clusters(bs, new_offset, s->cluster_size);
+        }
+        goto out;
+    }
+
+    new_offset = qcow2_alloc_clusters(bs, s->cluster_size);
+    if (new_offset < 0) {
+        ret = new_offset;
+        goto out;
+    }
+
+    iov.iov_base = buf;
+    iov.iov_len = s->cluster_size;
+    qemu_iovec_init_external(&hd_qiov, &iov, 1);
+
+    BLKDBG_EVENT(bs->file, BLKDBG_WRITE_AIO);
+    qemu_co_mutex_unlock(&s->lock);
+    ret = bdrv_co_writev(bs->file, new_offset >> BDRV_SECTOR_BITS,
+                         s->cluster_sectors, &hd_qiov);
+    qemu_co_mutex_lock(&s->lock);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    /* another write may have stored the same data meanwhile */
+    indexed = !g_hash_table_lookup(s->dedup_hash, digest);
+    if (indexed) {
+        ret = qcow2_update_refcount(bs, new_offset, s->cluster_size, 1);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+    ret = qcow2_map_cluster(bs, guest_offset,
+                            new_offset | (indexed ? 0 : QCOW_OFLAG_COPIED));
+    if (ret < 0) {
+        if (indexed) {
+            qcow2_update_refcount(bs, new_offset, s->cluster_size, -1);
+        }
+        goto fail;
+    }
+    if (indexed) {
+        dedup_insert(s, digest, new_offset);
+    }
+    goto out;
+
+fail:
+    qcow2_free_clusters(bs, new_offset, s->cluster_size);
+out:
+    QLIST_REMOVE(&m, next_in_flight);
+    if (!qemu_co_queue_empty(&m.dependent_requests)) {
+        qemu_co_mutex_unlock(&s->lock);
+        qemu_co_queue_restart_all(&m.dependent_requests);
+        qemu_co_mutex_lock(&s->lock);
+    }
+    qemu_vfree(buf);
+    return ret;
+}
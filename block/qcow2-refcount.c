@@ -506,6 +506,17 @@ fail:
     return ret;
 }
 
+int qcow2_get_refcount(BlockDriverState *bs, int64_t cluster_index)
+{
+    return get_refcount(bs, cluster_index);
+}
+
+int qcow2_update_refcount(BlockDriverState *bs, int64_t offset,
+                          int64_t length, int addend)
+{
+    return update_refcount(bs, offset, length, addend);
+}
+
 /*
  * Increases or decreases the refcount of a given cluster by one.
  * addend must be 1 or -1.
@@ -669,6 +680,7 @@ int64_t qcow2_alloc_bytes(BlockDriverState *bs, int size)
 void qcow2_free_clusters(BlockDriverState *bs,
                           int64_t offset, int64_t size)
 {
+    BDRVQcowState *s = bs->opaque;
     int ret;
 
     BLKDBG_EVENT(bs->file, BLKDBG_CLUSTER_FREE);
@@ -676,6 +688,8 @@ void qcow2_free_clusters(BlockDriverState *bs,
     if (ret < 0) {
         fprintf(stderr, "qcow2_free_clusters failed: %s\n", strerror(-ret));
         /* TODO Remember the clusters to free them later and avoid leaking */
+    } else if (s->dedup_loaded) {
+        qcow2_dedup_release(bs, offset, size);
     }
 }
 
@@ -725,7 +739,9 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     BDRVQcowState *s = bs->opaque;
     uint64_t *l1_table, *l2_table, l2_offset, offset, l1_size2, l1_allocated;
     int64_t old_offset, old_l2_offset;
+    uint64_t run_start, run_len;
     int i, j, l1_modified = 0, nb_csectors, refcount;
+    bool compressed_updated = false;
     int ret;
 
     l2_table = NULL;
@@ -769,37 +785,63 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
                 goto fail;
             }
 
+            /*
+             * Update the refcounts first, a run of contiguous clusters at a
+             * time: a snapshot of a freshly written image has few runs, and
+             * update_refcount() looks up each refcount block once per run
+             * rather than once per cluster.
+             */
+            run_start = run_len = 0;
+            for(j = 0; addend != 0 && j <= s->l2_size; j++) {
+                offset = j < s->l2_size ? be64_to_cpu(l2_table[j]) : 0;
+                offset &= ~QCOW_OFLAG_COPIED;
+                if (offset && !(offset & QCOW_OFLAG_COMPRESSED) &&
+                    run_len && (offset & L2E_OFFSET_MASK) ==
+                    run_start + (run_len << s->cluster_bits)) {
+                    run_len++;
+                    continue;
+                }
+                if (run_len) {
+                    ret = update_refcount(bs, run_start,
+                                          run_len << s->cluster_bits, addend);
+                    if (ret < 0) {
+                        goto fail;
+                    }
+                    run_len = 0;
+                }
+                if (!offset) {
+                    continue;
+                }
+                if (offset & QCOW_OFLAG_COMPRESSED) {
+                    nb_csectors = ((offset >> s->csize_shift) &
+                                   s->csize_mask) + 1;
+                    ret = update_refcount(bs,
+                        (offset & s->cluster_offset_mask) & ~511,
+                        nb_csectors * 512, addend);
+                    if (ret < 0) {
+                        goto fail;
+                    }
+                    compressed_updated = true;
+                } else {
+                    run_start = offset & L2E_OFFSET_MASK;
+                    run_len = 1;
+                }
+            }
+
             for(j = 0; j < s->l2_size; j++) {
                 offset = be64_to_cpu(l2_table[j]);
                 if (offset != 0) {
                     old_offset = offset;
                     offset &= ~QCOW_OFLAG_COPIED;
                     if (offset & QCOW_OFLAG_COMPRESSED) {
-                        nb_csectors = ((offset >> s->csize_shift) &
-                                       s->csize_mask) + 1;
-                        if (addend != 0) {
-                            int ret;
-                            ret = update_refcount(bs,
-                                (offset & s->cluster_offset_mask) & ~511,
-                                nb_csectors * 512, addend);
-                            if (ret < 0) {
-                                goto fail;
-                            }
-
-                            /* TODO Flushing once for the whole function should
-                             * be enough */
-                            bdrv_flush(bs->file);
-                        }
                         /* compressed clusters are never modified */
                         refcount = 2;
+                    } else if (addend > 0) {
+                        /* the snapshot shares every cluster it counted */
+                        refcount = 2;
                     } else {
                         uint64_t cluster_index = (offset & L2E_OFFSET_MASK) >> s->cluster_bits;
-                        if (addend != 0) {
-                            refcount = update_cluster_refcount(bs, cluster_index, addend);
-                        } else {
-                            refcount = get_refcount(bs, cluster_index);
-                        }
-
+                        refcount = get_refcount(bs, cluster_index);
                         if (refcount < 0) {
                             ret = -EIO;
                             goto fail;
@@ -849,6 +891,9 @@ fail:
     if (l2_table) {
         qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
     }
+    if (compressed_updated) {
+        bdrv_flush(bs->file);
+    }
 
     /* Update L1 only if it isn't deleted anyway (addend = -1) */
     if (addend >= 0 && l1_modified) {
@@ -1148,6 +1193,33 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
     inc_refcounts(bs, res, refcount_table, nb_clusters,
         s->snapshots_offset, s->snapshots_size);
 
+    /* dedup index */
+    if (s->dedup_table_offset) {
+        inc_refcounts(bs, res, refcount_table, nb_clusters,
+            s->dedup_table_offset,
+            s->dedup_table_entries * QCOW2_DEDUP_ENTRY_SIZE);
+    }
+    if (s->dedup_offsets) {
+        uint64_t *dedup_offsets;
+        size_t nb_dedup, j;
+
+        /* each entry holds a reference to its cluster */
+        dedup_offsets = qcow2_dedup_offsets(bs, &nb_dedup);
+        for (j = 0; j < nb_dedup; j++) {
+            inc_refcounts(bs, res, refcount_table, nb_clusters,
+                dedup_offsets[j], s->cluster_size);
+        }
+        g_free(dedup_offsets);
+    }
+
+    /* dirty bitmaps */
+    for (i = 0; i < s->nb_bitmaps; i++) {
+        if (s->bitmaps[i].data_offset) {
+            inc_refcounts(bs, res, refcount_table, nb_clusters,
+                s->bitmaps[i].data_offset, s->bitmaps[i].data_size);
+        }
+    }
+
     /* refcount data */
     inc_refcounts(bs, res, refcount_table, nb_clusters,
         s->refcount_table_offset,
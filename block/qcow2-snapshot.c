@@ -51,6 +51,44 @@ typedef struct QEMU_PACKED QCowSnapshotExtraData {
     uint64_t disk_size;
 } QCowSnapshotExtraData;
 
+/* An extra data area larger than this is taken for a corrupted table */
+#define QCOW_MAX_SNAPSHOT_EXTRA_DATA    1024
+
+/* The table is read this much at a time at least */
+#define SNAPSHOT_TABLE_READ_SIZE        (64 * 1024)
+
+static void snapshot_index_add(BDRVQcowState *s, int i)
+{
+    QCowSnapshot *sn = &s->snapshots[i];
+    unsigned long id = strtoul(sn->id_str, NULL, 10);
+
+    g_hash_table_insert(s->snapshot_ids, sn->id_str, GINT_TO_POINTER(i + 1));
+    if (!g_hash_table_lookup(s->snapshot_names, sn->name)) {
+        g_hash_table_insert(s->snapshot_names, sn->name,
+                            GINT_TO_POINTER(i + 1));
+    }
+    if (id > s->snapshot_id_max) {
+        s->snapshot_id_max = id;
+    }
+}
+
+/* The keys are the strings of the table, so this follows every change */
+static void snapshot_index_rebuild(BDRVQcowState *s)
+{
+    int i;
+
+    if (!s->snapshot_ids) {
+        s->snapshot_ids = g_hash_table_new(g_str_hash, g_str_equal);
+        s->snapshot_names = g_hash_table_new(g_str_hash, g_str_equal);
+    }
+    g_hash_table_remove_all(s->snapshot_ids);
+    g_hash_table_remove_all(s->snapshot_names);
+    s->snapshot_id_max = 0;
+    for (i = 0; i < s->nb_snapshots; i++) {
+        snapshot_index_add(s, i);
+    }
+}
+
 void qcow2_free_snapshots(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
@@ -63,6 +101,34 @@ void qcow2_free_snapshots(BlockDriverState *bs)
     g_free(s->snapshots);
     s->snapshots = NULL;
     s->nb_snapshots = 0;
+    if (s->snapshot_ids) {
+        g_hash_table_destroy(s->snapshot_ids);
+        g_hash_table_destroy(s->snapshot_names);
+        s->snapshot_ids = NULL;
+        s->snapshot_names = NULL;
+    }
+}
+
+/* Make sure @len bytes of the table at @offset are in the buffer */
+static int snapshot_table_fill(BlockDriverState *bs, uint8_t **buf,
+                               size_t *buf_len, size_t offset, size_t len)
+{
+    BDRVQcowState *s = bs->opaque;
+    size_t new_len;
+    int ret;
+
+    if (offset + len <= *buf_len) {
+        return 0;
+    }
+    new_len = MAX(offset + len, MAX(*buf_len * 2, SNAPSHOT_TABLE_READ_SIZE));
+    *buf = g_realloc(*buf, new_len);
+    ret = bdrv_pread(bs->file, s->snapshots_offset + *buf_len,
+                     *buf + *buf_len, new_len - *buf_len);
+    if (ret < 0) {
+        return ret;
+    }
+    *buf_len = new_len;
+    return 0;
 }
 
 int qcow2_read_snapshots(BlockDriverState *bs)
@@ -72,26 +138,31 @@ int qcow2_read_snapshots(BlockDriverState *bs)
     QCowSnapshotExtraData extra;
     QCowSnapshot *sn;
     int i, id_str_size, name_size;
-    int64_t offset;
+    size_t offset, buf_len = 0;
+    uint8_t *buf = NULL;
     uint32_t extra_data_size;
     int ret;
 
     if (!s->nb_snapshots) {
         s->snapshots = NULL;
         s->snapshots_size = 0;
+        snapshot_index_rebuild(s);
         return 0;
     }
 
-    offset = s->snapshots_offset;
+    /* The entries are read from a buffer that grows with large reads,
+     * 4 small reads per snapshot made opening slow with many of them. */
+    offset = 0;
     s->snapshots = g_malloc0(s->nb_snapshots * sizeof(QCowSnapshot));
 
     for(i = 0; i < s->nb_snapshots; i++) {
         /* Read statically sized part of the snapshot header */
         offset = align_offset(offset, 8);
-        ret = bdrv_pread(bs->file, offset, &h, sizeof(h));
+        ret = snapshot_table_fill(bs, &buf, &buf_len, offset, sizeof(h));
         if (ret < 0) {
             goto fail;
         }
+        memcpy(&h, buf + offset, sizeof(h));
 
         offset += sizeof(h);
         sn = s->snapshots + i;
@@ -106,12 +177,19 @@ int qcow2_read_snapshots(BlockDriverState *bs)
         id_str_size = be16_to_cpu(h.id_str_size);
         name_size = be16_to_cpu(h.name_size);
 
-        /* Read extra data */
-        ret = bdrv_pread(bs->file, offset, &extra,
-                         MIN(sizeof(extra), extra_data_size));
+        if (extra_data_size > QCOW_MAX_SNAPSHOT_EXTRA_DATA) {
+            ret = -EFBIG;
+            goto fail;
+        }
+
+        /* Read extra data, the id and the name */
+        ret = snapshot_table_fill(bs, &buf, &buf_len, offset,
+                                  extra_data_size + id_str_size + name_size);
         if (ret < 0) {
             goto fail;
         }
+        memset(&extra, 0, sizeof(extra));
+        memcpy(&extra, buf + offset, MIN(sizeof(extra), extra_data_size));
         offset += extra_data_size;
 
         if (extra_data_size >= 8) {
@@ -125,45 +203,97 @@ int qcow2_read_snapshots(BlockDriverState *bs)
         }
 
         /* Read snapshot ID */
-        sn->id_str = g_malloc(id_str_size + 1);
-        ret = bdrv_pread(bs->file, offset, sn->id_str, id_str_size);
-        if (ret < 0) {
-            goto fail;
-        }
+        sn->id_str = g_strndup((char *)buf + offset, id_str_size);
         offset += id_str_size;
-        sn->id_str[id_str_size] = '\0';
 
         /* Read snapshot name */
-        sn->name = g_malloc(name_size + 1);
-        ret = bdrv_pread(bs->file, offset, sn->name, name_size);
-        if (ret < 0) {
-            goto fail;
-        }
+        sn->name = g_strndup((char *)buf + offset, name_size);
         offset += name_size;
-        sn->name[name_size] = '\0';
     }
 
-    s->snapshots_size = offset - s->snapshots_offset;
+    s->snapshots_size = offset;
+    g_free(buf);
+    snapshot_index_rebuild(s);
     return 0;
 
 fail:
+    g_free(buf);
+    /* the strings read so far, the rest of the table is zeroed */
+    s->nb_snapshots = i + 1;
     qcow2_free_snapshots(bs);
     return ret;
 }
 
-/* add at the end of the file a new list of snapshots */
-static int qcow2_write_snapshots(BlockDriverState *bs)
+/* Size of the entry of @sn in the table, without the alignment */
+static size_t snapshot_entry_size(QCowSnapshot *sn)
+{
+    return sizeof(QCowSnapshotHeader) + sizeof(QCowSnapshotExtraData) +
+           strlen(sn->id_str) + strlen(sn->name);
+}
+
+static void snapshot_entry_write(QCowSnapshot *sn, uint8_t *buf)
 {
-    BDRVQcowState *s = bs->opaque;
-    QCowSnapshot *sn;
     QCowSnapshotHeader h;
     QCowSnapshotExtraData extra;
-    int i, name_size, id_str_size, snapshots_size;
+    int id_str_size = strlen(sn->id_str);
+    int name_size = strlen(sn->name);
+
+    memset(&h, 0, sizeof(h));
+    h.l1_table_offset = cpu_to_be64(sn->l1_table_offset);
+    h.l1_size = cpu_to_be32(sn->l1_size);
+    /* If it doesn't fit in 32 bit, older implementations should treat it
+     * as a disk-only snapshot rather than truncate the VM state */
+    if (sn->vm_state_size <= 0xffffffff) {
+        h.vm_state_size = cpu_to_be32(sn->vm_state_size);
+    }
+    h.date_sec = cpu_to_be32(sn->date_sec);
+    h.date_nsec = cpu_to_be32(sn->date_nsec);
+    h.vm_clock_nsec = cpu_to_be64(sn->vm_clock_nsec);
+    h.extra_data_size = cpu_to_be32(sizeof(extra));
+    h.id_str_size = cpu_to_be16(id_str_size);
+    h.name_size = cpu_to_be16(name_size);
+
+    memset(&extra, 0, sizeof(extra));
+    extra.vm_state_size_large = cpu_to_be64(sn->vm_state_size);
+    extra.disk_size = cpu_to_be64(sn->disk_size);
+
+    memcpy(buf, &h, sizeof(h));
+    buf += sizeof(h);
+    memcpy(buf, &extra, sizeof(extra));
+    buf += sizeof(extra);
+    memcpy(buf, sn->id_str, id_str_size);
+    buf += id_str_size;
+    memcpy(buf, sn->name, name_size);
+}
+
+/* Point the header to @nb_snapshots entries at @snapshots_offset */
+static int qcow2_write_snapshot_header(BlockDriverState *bs,
+                                       int64_t snapshots_offset,
+                                       int nb_snapshots)
+{
     struct {
         uint32_t nb_snapshots;
         uint64_t snapshots_offset;
     } QEMU_PACKED header_data;
+
+    QEMU_BUILD_BUG_ON(offsetof(QCowHeader, snapshots_offset) !=
+        offsetof(QCowHeader, nb_snapshots) + sizeof(header_data.nb_snapshots));
+
+    header_data.nb_snapshots        = cpu_to_be32(nb_snapshots);
+    header_data.snapshots_offset    = cpu_to_be64(snapshots_offset);
+
+    return bdrv_pwrite_sync(bs->file, offsetof(QCowHeader, nb_snapshots),
+                            &header_data, sizeof(header_data));
+}
+
+/* add at the end of the file a new list of snapshots */
+static int qcow2_write_snapshots(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    QCowSnapshot *sn;
+    int i, snapshots_size;
     int64_t offset, snapshots_offset;
+    uint8_t *buf;
     int ret;
 
     /* compute the size of the snapshots */
@@ -171,10 +301,7 @@ static int qcow2_write_snapshots(BlockDriverState *bs)
     for(i = 0; i < s->nb_snapshots; i++) {
         sn = s->snapshots + i;
         offset = align_offset(offset, 8);
-        offset += sizeof(h);
-        offset += sizeof(extra);
-        offset += strlen(sn->id_str);
-        offset += strlen(sn->name);
+        offset += snapshot_entry_size(sn);
     }
     snapshots_size = offset;
 
@@ -186,55 +313,19 @@ static int qcow2_write_snapshots(BlockDriverState *bs)
         return offset;
     }
 
-    /* Write all snapshots to the new list */
+    /* Write all snapshots to the new list at once */
+    buf = g_malloc0(MAX(snapshots_size, 1));
+    offset = 0;
     for(i = 0; i < s->nb_snapshots; i++) {
         sn = s->snapshots + i;
-        memset(&h, 0, sizeof(h));
-        h.l1_table_offset = cpu_to_be64(sn->l1_table_offset);
-        h.l1_size = cpu_to_be32(sn->l1_size);
-        /* If it doesn't fit in 32 bit, older implementations should treat it
-         * as a disk-only snapshot rather than truncate the VM state */
-        if (sn->vm_state_size <= 0xffffffff) {
-            h.vm_state_size = cpu_to_be32(sn->vm_state_size);
-        }
-        h.date_sec = cpu_to_be32(sn->date_sec);
-        h.date_nsec = cpu_to_be32(sn->date_nsec);
-        h.vm_clock_nsec = cpu_to_be64(sn->vm_clock_nsec);
-        h.extra_data_size = cpu_to_be32(sizeof(extra));
-
-        memset(&extra, 0, sizeof(extra));
-        extra.vm_state_size_large = cpu_to_be64(sn->vm_state_size);
-        extra.disk_size = cpu_to_be64(sn->disk_size);
-
-        id_str_size = strlen(sn->id_str);
-        name_size = strlen(sn->name);
-        h.id_str_size = cpu_to_be16(id_str_size);
-        h.name_size = cpu_to_be16(name_size);
         offset = align_offset(offset, 8);
-
-        ret = bdrv_pwrite(bs->file, offset, &h, sizeof(h));
-        if (ret < 0) {
-            goto fail;
-        }
-        offset += sizeof(h);
-
-        ret = bdrv_pwrite(bs->file, offset, &extra, sizeof(extra));
-        if (ret < 0) {
-            goto fail;
-        }
-        offset += sizeof(extra);
-
-        ret = bdrv_pwrite(bs->file, offset, sn->id_str, id_str_size);
-        if (ret < 0) {
-            goto fail;
-        }
-        offset += id_str_size;
-
-        ret = bdrv_pwrite(bs->file, offset, sn->name, name_size);
-        if (ret < 0) {
-            goto fail;
-        }
-        offset += name_size;
+        snapshot_entry_write(sn, buf + offset);
+        offset += snapshot_entry_size(sn);
+    }
+    ret = bdrv_pwrite(bs->file, snapshots_offset, buf, snapshots_size);
+    g_free(buf);
+    if (ret < 0) {
+        goto fail;
     }
 
     /*
@@ -246,14 +337,7 @@ static int qcow2_write_snapshots(BlockDriverState *bs)
         goto fail;
     }
 
-    QEMU_BUILD_BUG_ON(offsetof(QCowHeader, snapshots_offset) !=
-        offsetof(QCowHeader, nb_snapshots) + sizeof(header_data.nb_snapshots));
-
-    header_data.nb_snapshots        = cpu_to_be32(s->nb_snapshots);
-    header_data.snapshots_offset    = cpu_to_be64(snapshots_offset);
-
-    ret = bdrv_pwrite_sync(bs->file, offsetof(QCowHeader, nb_snapshots),
-                           &header_data, sizeof(header_data));
+    ret = qcow2_write_snapshot_header(bs, snapshots_offset, s->nb_snapshots);
     if (ret < 0) {
         goto fail;
     }
@@ -268,55 +352,78 @@ fail:
     return ret;
 }
 
+/*
+ * Append the last snapshot of the list in the unused end of the last
+ * cluster of the table, if it fits.  Readers only see it once the header
+ * counts it, so the old table stays valid until then.  Returns -ENOSPC if
+ * the table has to be moved instead.
+ */
+static int qcow2_append_snapshot(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    QCowSnapshot *sn = &s->snapshots[s->nb_snapshots - 1];
+    int64_t offset = align_offset(s->snapshots_size, 8);
+    size_t size = snapshot_entry_size(sn);
+    uint8_t *buf;
+    int ret;
+
+    if (s->nb_snapshots == 1 ||
+        offset + size > align_offset(s->snapshots_size, s->cluster_size)) {
+        return -ENOSPC;
+    }
+
+    buf = g_malloc0(size);
+    snapshot_entry_write(sn, buf);
+    ret = bdrv_pwrite(bs->file, s->snapshots_offset + offset, buf, size);
+    g_free(buf);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = bdrv_flush(bs);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = qcow2_write_snapshot_header(bs, s->snapshots_offset,
+                                      s->nb_snapshots);
+    if (ret < 0) {
+        return ret;
+    }
+
+    s->snapshots_size = offset + size;
+    return 0;
+}
+
 static void find_new_snapshot_id(BlockDriverState *bs,
                                  char *id_str, int id_str_size)
 {
     BDRVQcowState *s = bs->opaque;
-    QCowSnapshot *sn;
-    int i, id, id_max = 0;
 
-    for(i = 0; i < s->nb_snapshots; i++) {
-        sn = s->snapshots + i;
-        id = strtoul(sn->id_str, NULL, 10);
-        if (id > id_max)
-            id_max = id;
-    }
-    snprintf(id_str, id_str_size, "%d", id_max + 1);
+    snprintf(id_str, id_str_size, "%lu", s->snapshot_id_max + 1);
 }
 
 static int find_snapshot_by_id(BlockDriverState *bs, const char *id_str)
 {
     BDRVQcowState *s = bs->opaque;
-    int i;
 
-    for(i = 0; i < s->nb_snapshots; i++) {
-        if (!strcmp(s->snapshots[i].id_str, id_str))
-            return i;
-    }
-    return -1;
+    return GPOINTER_TO_INT(g_hash_table_lookup(s->snapshot_ids, id_str)) - 1;
 }
 
 static int find_snapshot_by_id_or_name(BlockDriverState *bs, const char *name)
 {
     BDRVQcowState *s = bs->opaque;
-    int i, ret;
+    int ret;
 
     ret = find_snapshot_by_id(bs, name);
     if (ret >= 0)
         return ret;
-    for(i = 0; i < s->nb_snapshots; i++) {
-        if (!strcmp(s->snapshots[i].name, name))
-            return i;
-    }
-    return -1;
+    return GPOINTER_TO_INT(g_hash_table_lookup(s->snapshot_names, name)) - 1;
 }
 
 /* if no id is provided, a new one is constructed */
 int qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info)
 {
     BDRVQcowState *s = bs->opaque;
-    QCowSnapshot *new_snapshot_list = NULL;
-    QCowSnapshot *old_snapshot_list = NULL;
     QCowSnapshot sn1, *sn = &sn1;
     int i, ret;
     uint64_t *l1_table = NULL;
@@ -383,24 +490,19 @@ int qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info)
         goto fail;
     }
 
-    /* Append the new snapshot to the snapshot list */
-    new_snapshot_list = g_malloc((s->nb_snapshots + 1) * sizeof(QCowSnapshot));
-    if (s->snapshots) {
-        memcpy(new_snapshot_list, s->snapshots,
-               s->nb_snapshots * sizeof(QCowSnapshot));
-        old_snapshot_list = s->snapshots;
-    }
-    s->snapshots = new_snapshot_list;
+    /* Append the new snapshot to the snapshot list, in place if possible */
+    s->snapshots = g_renew(QCowSnapshot, s->snapshots, s->nb_snapshots + 1);
     s->snapshots[s->nb_snapshots++] = *sn;
 
-    ret = qcow2_write_snapshots(bs);
+    ret = qcow2_append_snapshot(bs);
+    if (ret == -ENOSPC) {
+        ret = qcow2_write_snapshots(bs);
+    }
     if (ret < 0) {
-        g_free(s->snapshots);
-        s->snapshots = old_snapshot_list;
+        s->nb_snapshots--;
         goto fail;
     }
-
-    g_free(old_snapshot_list);
+    snapshot_index_add(s, s->nb_snapshots - 1);
 
 #ifdef DEBUG_ALLOC
     {
@@ -550,6 +652,7 @@ int qcow2_snapshot_delete(BlockDriverState *bs, const char *snapshot_id)
             s->snapshots + snapshot_index + 1,
             (s->nb_snapshots - snapshot_index - 1) * sizeof(sn));
     s->nb_snapshots--;
+    snapshot_index_rebuild(s);
     ret = qcow2_write_snapshots(bs);
     if (ret < 0) {
         return ret;
@@ -55,6 +55,15 @@ typedef struct {
 #define  QCOW2_EXT_MAGIC_END 0
 #define  QCOW2_EXT_MAGIC_BACKING_FORMAT 0xE2792ACA
 #define  QCOW2_EXT_MAGIC_FEATURE_TABLE 0x6803f857
+#define  QCOW2_EXT_MAGIC_COMPRESSION 0xC03183A3
+#define  QCOW2_EXT_MAGIC_DIRTY_BITMAPS 0x23852875
+#define  QCOW2_EXT_MAGIC_DEDUP 0xDEDE0C1C
+
+typedef struct {
+    uint8_t type;
+    uint8_t level;
+    uint8_t reserved[6];
+} QEMU_PACKED Qcow2CompressionExt;
 
 static int qcow2_probe(const uint8_t *buf, int buf_size, const char *filename)
 {
@@ -147,6 +156,45 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
             }
             break;
 
+        case QCOW2_EXT_MAGIC_COMPRESSION:
+            {
+                Qcow2CompressionExt cext;
+
+                if (ext.len < sizeof(cext)) {
+                    error_report("Compression header extension too short");
+                    return -EINVAL;
+                }
+                ret = bdrv_pread(bs->file, offset, &cext, sizeof(cext));
+                if (ret < 0) {
+                    return ret;
+                }
+                if (cext.type != QCOW2_COMPRESSION_DEFLATE) {
+                    error_report("Unsupported compression type %d",
+                                 cext.type);
+                    return -ENOTSUP;
+                }
+                if (cext.level > 9) {
+                    error_report("Invalid compression level %d", cext.level);
+                    return -EINVAL;
+                }
+                s->compression_level = cext.level;
+            }
+            break;
+
+        case QCOW2_EXT_MAGIC_DIRTY_BITMAPS:
+            ret = qcow2_read_bitmap_ext(bs, offset, ext.len);
+            if (ret < 0) {
+                return ret;
+            }
+            break;
+
+        case QCOW2_EXT_MAGIC_DEDUP:
+            ret = qcow2_read_dedup_ext(bs, offset, ext.len);
+            if (ret < 0) {
+                return ret;
+            }
+            break;
+
         default:
             /* unknown magic - save it in case we need to rewrite the header */
             {
@@ -221,7 +269,7 @@ static void report_unsupported_feature(BlockDriverState *bs,
  * updated successfully.  Therefore it is not required to check the return
  * value of this function.
  */
-static int qcow2_mark_dirty(BlockDriverState *bs)
+int qcow2_mark_dirty(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
     uint64_t val;
@@ -253,11 +301,18 @@ static int qcow2_mark_dirty(BlockDriverState *bs)
  * Clears the dirty bit and flushes before if necessary.  Only call this
  * function when there are no pending requests, it does not guard against
  * concurrent requests dirtying the image.
+ *
+ * During an incoming migration the header in memory is the one read while
+ * the source was still running, so it is never written back; the image is
+ * checked when it is opened again if the bit stays set.
  */
 static int qcow2_mark_clean(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
 
+    if (s->flags & BDRV_O_INCOMING) {
+        return 0;
+    }
     if (s->incompatible_features & QCOW2_INCOMPAT_DIRTY) {
         int ret = bdrv_flush(bs);
         if (ret < 0) {
@@ -284,12 +339,42 @@ static int qcow2_check(BlockDriverState *bs, BdrvCheckResult *result,
     return ret;
 }
 
+/* Converts a cache size in bytes requested by the user to a number of
+ * tables, 0 meaning the default */
+static int qcow2_cache_num_tables(BlockDriverState *bs, const char *name,
+                                  uint64_t size, int default_tables,
+                                  int min_tables)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t num_tables;
+
+    if (!size) {
+        return default_tables;
+    }
+
+    num_tables = size >> s->cluster_bits;
+    if (num_tables < min_tables) {
+        error_report("%s %" PRIu64 " is too small, the minimum for this "
+                     "image is %" PRIu64, name, size,
+                     (uint64_t)min_tables << s->cluster_bits);
+        return -EINVAL;
+    }
+    if (num_tables > INT_MAX) {
+        error_report("%s %" PRIu64 " is too large", name, size);
+        return -EINVAL;
+    }
+
+    return num_tables;
+}
+
 static int qcow2_open(BlockDriverState *bs, int flags)
 {
     BDRVQcowState *s = bs->opaque;
     int len, i, ret = 0;
     QCowHeader header;
     uint64_t ext_end;
+    int l2_cache_tables, refcount_cache_tables;
+    char *lock_name;
 
     ret = bdrv_pread(bs->file, 0, &header, sizeof(header));
     if (ret < 0) {
@@ -368,6 +453,11 @@ static int qcow2_open(BlockDriverState *bs, int flags)
         goto fail;
     }
 
+    /* version 2 images have no dirty bit, so refcounts must be eager */
+    s->use_lazy_refcounts = s->qcow_version >= 3 &&
+        ((s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS) ||
+         (flags & BDRV_O_LAZY_REFCOUNTS));
+
     /* Check support for various header values */
     if (header.refcount_order != 4) {
         report_unsupported(bs, "%d bit reference counts",
@@ -381,7 +471,7 @@ static int qcow2_open(BlockDriverState *bs, int flags)
         ret = -EINVAL;
         goto fail;
     }
-    if (header.crypt_method > QCOW_CRYPT_AES) {
+    if (header.crypt_method > QCOW_CRYPT_AES_XTS) {
         ret = -EINVAL;
         goto fail;
     }
@@ -429,8 +519,26 @@ static int qcow2_open(BlockDriverState *bs, int flags)
     }
 
     /* alloc L2 table/refcount block cache */
-    s->l2_table_cache = qcow2_cache_create(bs, L2_CACHE_SIZE);
-    s->refcount_block_cache = qcow2_cache_create(bs, REFCOUNT_CACHE_SIZE);
+    l2_cache_tables = qcow2_cache_num_tables(bs, "l2-cache-size",
+                                             bs->l2_cache_size,
+                                             L2_CACHE_SIZE,
+                                             MIN_L2_CACHE_SIZE);
+    if (l2_cache_tables < 0) {
+        ret = l2_cache_tables;
+        goto fail;
+    }
+    refcount_cache_tables = qcow2_cache_num_tables(bs, "refcount-cache-size",
+                                                   bs->refcount_cache_size,
+                                                   REFCOUNT_CACHE_SIZE,
+                                                   MIN_REFCOUNT_CACHE_SIZE);
+    if (refcount_cache_tables < 0) {
+        ret = refcount_cache_tables;
+        goto fail;
+    }
+
+    mem_account_register(&s->mem_account, "qcow2", bs->filename);
+    s->l2_table_cache = qcow2_cache_create(bs, l2_cache_tables);
+    s->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_tables);
 
     s->cluster_cache = g_malloc(s->cluster_size);
     /* one more sector for decompressed data alignment */
@@ -471,9 +579,15 @@ static int qcow2_open(BlockDriverState *bs, int flags)
         goto fail;
     }
 
+    ret = qcow2_dedup_open(bs);
+    if (ret < 0) {
+        goto fail;
+    }
+
     /* Clear unknown autoclear feature bits */
-    if (!bs->read_only && s->autoclear_features != 0) {
-        s->autoclear_features = 0;
+    if (!bs->read_only && !(flags & BDRV_O_INCOMING) &&
+        (s->autoclear_features & ~QCOW2_AUTOCLEAR_MASK)) {
+        s->autoclear_features &= QCOW2_AUTOCLEAR_MASK;
         ret = qcow2_update_header(bs);
         if (ret < 0) {
             goto fail;
@@ -482,9 +596,12 @@ static int qcow2_open(BlockDriverState *bs, int flags)
 
     /* Initialise locks */
     qemu_co_mutex_init(&s->lock);
+    lock_name = g_strdup_printf("qcow2:%s", bs->filename);
+    qemu_co_mutex_set_name(&s->lock, lock_name);
+    g_free(lock_name);
 
-    /* Repair image if dirty */
-    if (!(flags & BDRV_O_CHECK) && !bs->read_only &&
+    /* Repair image if dirty, but not while the source may still write it */
+    if (!(flags & (BDRV_O_CHECK | BDRV_O_INCOMING)) && !bs->read_only &&
         (s->incompatible_features & QCOW2_INCOMPAT_DIRTY)) {
         BdrvCheckResult result = {0};
 
@@ -494,6 +611,22 @@ static int qcow2_open(BlockDriverState *bs, int flags)
         }
     }
 
+    /*
+     * qemu-img check looks at the bitmaps as they are stored.  An incoming
+     * migration loads them in qcow2_invalidate_cache(), once the source
+     * has written them back and stopped using the image.
+     */
+    if (!(flags & (BDRV_O_CHECK | BDRV_O_INCOMING)) && !bs->read_only) {
+        ret = qcow2_load_dirty_bitmaps(bs);
+        if (ret < 0) {
+            goto fail;
+        }
+        ret = qcow2_dedup_load(bs);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
 #ifdef DEBUG_ALLOC
     {
         BdrvCheckResult result = {0};
@@ -503,25 +636,64 @@ static int qcow2_open(BlockDriverState *bs, int flags)
     return ret;
 
  fail:
+    qemu_co_mutex_destroy(&s->lock);
+    mem_account_unregister(&s->mem_account);
     g_free(s->unknown_header_fields);
     cleanup_unknown_header_ext(bs);
+    qcow2_free_bitmaps(bs);
+    qcow2_dedup_close(bs);
     qcow2_free_snapshots(bs);
     qcow2_refcount_close(bs);
     g_free(s->l1_table);
     if (s->l2_table_cache) {
         qcow2_cache_destroy(bs, s->l2_table_cache);
+        s->l2_table_cache = NULL;
+    }
+    if (s->refcount_block_cache) {
+        qcow2_cache_destroy(bs, s->refcount_block_cache);
+        s->refcount_block_cache = NULL;
     }
     g_free(s->cluster_cache);
     qemu_vfree(s->cluster_data);
     return ret;
 }
 
+/*
+ * XTS wants two keys; both come from the SHA-256 of the whole password,
+ * rather than from its first 16 characters as for CBC.
+ */
+static int qcow2_set_xts_key(BDRVQcowState *s, const char *key)
+{
+    GChecksum *checksum;
+    uint8_t digest[32];
+    gsize len = sizeof(digest);
+    int ret = 0;
+
+    checksum = g_checksum_new(G_CHECKSUM_SHA256);
+    g_checksum_update(checksum, (const guchar *)key, strlen(key));
+    g_checksum_get_digest(checksum, digest, &len);
+    g_checksum_free(checksum);
+
+    s->crypt_method = s->crypt_method_header;
+    if (AES_set_encrypt_key(digest, 128, &s->aes_encrypt_key) != 0 ||
+        AES_set_decrypt_key(digest, 128, &s->aes_decrypt_key) != 0 ||
+        AES_set_encrypt_key(digest + 16, 128, &s->aes_tweak_key) != 0) {
+        ret = -1;
+    }
+    memset(digest, 0, sizeof(digest));
+    return ret;
+}
+
 static int qcow2_set_key(BlockDriverState *bs, const char *key)
 {
     BDRVQcowState *s = bs->opaque;
     uint8_t keybuf[16];
     int len, i;
 
+    if (s->crypt_method_header == QCOW_CRYPT_AES_XTS) {
+        return qcow2_set_xts_key(s, key);
+    }
+
     memset(keybuf, 0, 16);
     len = strlen(key);
     if (len > 16)
@@ -575,7 +747,8 @@ static int coroutine_fn qcow2_co_is_allocated(BlockDriverState *bs,
         *pnum = 0;
     }
 
-    return (cluster_offset != 0);
+    /* zero clusters hide the backing file just like data clusters */
+    return (cluster_offset != 0) || (ret == QCOW2_CLUSTER_ZERO);
 }
 
 /* handle reading after the end of the backing file */
@@ -703,16 +876,16 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
             ret = bdrv_co_readv(bs->file,
                                 (cluster_offset >> 9) + index_in_cluster,
                                 cur_nr_sectors, &hd_qiov);
+            if (ret >= 0 && s->crypt_method) {
+                qcow2_co_encrypt_sectors(bs, sector_num, cluster_data,
+                                         cur_nr_sectors, 0);
+                qemu_iovec_from_buf(qiov, bytes_done,
+                    cluster_data, 512 * cur_nr_sectors);
+            }
             qemu_co_mutex_lock(&s->lock);
             if (ret < 0) {
                 goto fail;
             }
-            if (s->crypt_method) {
-                qcow2_encrypt_sectors(s, sector_num,  cluster_data,
-                    cluster_data, cur_nr_sectors, 0, &s->aes_decrypt_key);
-                qemu_iovec_from_buf(qiov, bytes_done,
-                    cluster_data, 512 * cur_nr_sectors);
-            }
             break;
 
         default:
@@ -784,6 +957,20 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
 
         trace_qcow2_writev_start_part(qemu_coroutine_self());
         index_in_cluster = sector_num & (s->cluster_sectors - 1);
+
+        /* whole clusters go through the dedup index */
+        if (s->dedup_loaded && !s->crypt_method && index_in_cluster == 0 &&
+            remaining_sectors >= s->cluster_sectors) {
+            ret = qcow2_dedup_write(bs, sector_num, qiov, bytes_done);
+            if (ret < 0) {
+                goto fail;
+            }
+            remaining_sectors -= s->cluster_sectors;
+            sector_num += s->cluster_sectors;
+            bytes_done += s->cluster_size;
+            continue;
+        }
+
         n_end = index_in_cluster + remaining_sectors;
         if (s->crypt_method &&
             n_end > QCOW_MAX_CRYPT_CLUSTERS * s->cluster_sectors) {
@@ -796,8 +983,7 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
             goto fail;
         }
 
-        if (l2meta.nb_clusters > 0 &&
-            (s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS)) {
+        if (l2meta.nb_clusters > 0 && s->use_lazy_refcounts) {
             qcow2_mark_dirty(bs);
         }
 
@@ -817,17 +1003,19 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
             assert(hd_qiov.size <=
                    QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size);
             qemu_iovec_to_buf(&hd_qiov, 0, cluster_data, hd_qiov.size);
-
-            qcow2_encrypt_sectors(s, sector_num, cluster_data,
-                cluster_data, cur_nr_sectors, 1, &s->aes_encrypt_key);
-
             qemu_iovec_reset(&hd_qiov);
             qemu_iovec_add(&hd_qiov, cluster_data,
                 cur_nr_sectors * 512);
         }
 
-        BLKDBG_EVENT(bs->file, BLKDBG_WRITE_AIO);
+        /* the new clusters are ours until the L2 update, in l2meta */
         qemu_co_mutex_unlock(&s->lock);
+        if (s->crypt_method) {
+            qcow2_co_encrypt_sectors(bs, sector_num, cluster_data,
+                                     cur_nr_sectors, 1);
+        }
+
+        BLKDBG_EVENT(bs->file, BLKDBG_WRITE_AIO);
         trace_qcow2_writev_data(qemu_coroutine_self(),
                                 (cluster_offset >> 9) + index_in_cluster);
         ret = bdrv_co_writev(bs->file,
@@ -864,9 +1052,53 @@ fail:
     return ret;
 }
 
+static void qcow2_compress_stop(BlockDriverState *bs);
+
+/*
+ * Store the dirty bitmaps and the dedup index, which are not written again
+ * until the image is reopened, and leave the image clean.
+ */
+static int qcow2_inactivate(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int ret, result = 0;
+
+    if (bs->read_only) {
+        return 0;
+    }
+
+    ret = qcow2_store_dirty_bitmaps(bs);
+    if (ret < 0) {
+        error_report("Failed to store the dirty bitmaps of %s: %s",
+                     bs->filename, strerror(-ret));
+        result = ret;
+    }
+    s->bitmaps_loaded = false;
+    ret = qcow2_dedup_store(bs);
+    if (ret < 0) {
+        error_report("Failed to store the dedup index of %s: %s",
+                     bs->filename, strerror(-ret));
+        result = ret;
+    }
+    s->dedup_loaded = false;
+
+    ret = qcow2_cache_flush(bs, s->l2_table_cache);
+    if (ret == 0) {
+        ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+    }
+    if (ret == 0) {
+        ret = qcow2_mark_clean(bs);
+    }
+    return ret < 0 ? ret : result;
+}
+
 static void qcow2_close(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
+
+    qcow2_compress_stop(bs);
+    qcow2_crypt_stop(bs);
+    qcow2_inactivate(bs);
     g_free(s->l1_table);
 
     qcow2_cache_flush(bs, s->l2_table_cache);
@@ -879,19 +1111,24 @@ static void qcow2_close(BlockDriverState *bs)
 
     g_free(s->unknown_header_fields);
     cleanup_unknown_header_ext(bs);
+    qcow2_free_bitmaps(bs);
+    qcow2_dedup_close(bs);
 
     g_free(s->cluster_cache);
     qemu_vfree(s->cluster_data);
     qcow2_refcount_close(bs);
     qcow2_free_snapshots(bs);
+    qemu_co_mutex_destroy(&s->lock);
+    mem_account_unregister(&s->mem_account);
 }
 
 static void qcow2_invalidate_cache(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
-    int flags = s->flags;
+    int flags = s->flags & ~BDRV_O_INCOMING;
     AES_KEY aes_encrypt_key;
     AES_KEY aes_decrypt_key;
+    AES_KEY aes_tweak_key;
     uint32_t crypt_method = 0;
 
     /*
@@ -903,6 +1140,7 @@ static void qcow2_invalidate_cache(BlockDriverState *bs)
         crypt_method = s->crypt_method;
         memcpy(&aes_encrypt_key, &s->aes_encrypt_key, sizeof(aes_encrypt_key));
         memcpy(&aes_decrypt_key, &s->aes_decrypt_key, sizeof(aes_decrypt_key));
+        memcpy(&aes_tweak_key, &s->aes_tweak_key, sizeof(aes_tweak_key));
     }
 
     qcow2_close(bs);
@@ -914,6 +1152,7 @@ static void qcow2_invalidate_cache(BlockDriverState *bs)
         s->crypt_method = crypt_method;
         memcpy(&s->aes_encrypt_key, &aes_encrypt_key, sizeof(aes_encrypt_key));
         memcpy(&s->aes_decrypt_key, &aes_decrypt_key, sizeof(aes_decrypt_key));
+        memcpy(&s->aes_tweak_key, &aes_tweak_key, sizeof(aes_tweak_key));
     }
 }
 
@@ -1036,6 +1275,54 @@ int qcow2_update_header(BlockDriverState *bs)
         buflen -= ret;
     }
 
+    /* Compression header extension */
+    if (s->compression_level) {
+        Qcow2CompressionExt cext = {
+            .type  = QCOW2_COMPRESSION_DEFLATE,
+            .level = s->compression_level,
+        };
+
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_COMPRESSION,
+                             &cext, sizeof(cext), buflen);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        buf += ret;
+        buflen -= ret;
+    }
+
+    /* Dirty bitmaps header extension */
+    if (s->nb_bitmaps) {
+        size_t len;
+        void *ext = qcow2_bitmap_ext(bs, &len);
+
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_DIRTY_BITMAPS, ext, len,
+                             buflen);
+        g_free(ext);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        buf += ret;
+        buflen -= ret;
+    }
+
+    /* Dedup header extension */
+    if (s->dedup) {
+        size_t len;
+        void *ext = qcow2_dedup_ext(bs, &len);
+
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_DEDUP, ext, len, buflen);
+        g_free(ext);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        buf += ret;
+        buflen -= ret;
+    }
+
     /* Feature table */
     Qcow2Feature features[] = {
         {
@@ -1048,6 +1335,16 @@ int qcow2_update_header(BlockDriverState *bs)
             .bit  = QCOW2_COMPAT_LAZY_REFCOUNTS_BITNR,
             .name = "lazy refcounts",
         },
+        {
+            .type = QCOW2_FEAT_TYPE_AUTOCLEAR,
+            .bit  = QCOW2_AUTOCLEAR_DIRTY_BITMAPS_BITNR,
+            .name = "dirty bitmaps",
+        },
+        {
+            .type = QCOW2_FEAT_TYPE_AUTOCLEAR,
+            .bit  = QCOW2_AUTOCLEAR_DEDUP_BITNR,
+            .name = "dedup",
+        },
     };
 
     ret = header_ext_add(buf, QCOW2_EXT_MAGIC_FEATURE_TABLE,
@@ -1170,7 +1467,8 @@ static int preallocate(BlockDriverState *bs)
 static int qcow2_create2(const char *filename, int64_t total_size,
                          const char *backing_file, const char *backing_format,
                          int flags, size_t cluster_size, int prealloc,
-                         QEMUOptionParameter *options, int version)
+                         QEMUOptionParameter *options, int version,
+                         int compression_level)
 {
     /* Calculate cluster_bits */
     int cluster_bits;
@@ -1224,7 +1522,9 @@ static int qcow2_create2(const char *filename, int64_t total_size,
     header.refcount_order = cpu_to_be32(3 + REFCOUNT_SHIFT);
     header.header_length = cpu_to_be32(sizeof(header));
 
-    if (flags & BLOCK_FLAG_ENCRYPT) {
+    if (flags & BLOCK_FLAG_ENCRYPT_XTS) {
+        header.crypt_method = cpu_to_be32(QCOW_CRYPT_AES_XTS);
+    } else if (flags & BLOCK_FLAG_ENCRYPT) {
         header.crypt_method = cpu_to_be32(QCOW_CRYPT_AES);
     } else {
         header.crypt_method = cpu_to_be32(QCOW_CRYPT_NONE);
@@ -1279,6 +1579,22 @@ static int qcow2_create2(const char *filename, int64_t total_size,
         goto out;
     }
 
+    if (compression_level) {
+        BDRVQcowState *s = bs->opaque;
+        s->compression_level = compression_level;
+        ret = qcow2_update_header(bs);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+
+    if (flags & BLOCK_FLAG_DEDUP) {
+        ret = qcow2_dedup_enable(bs);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+
     /* Want a backing file? There you go.*/
     if (backing_file) {
         ret = bdrv_change_backing_file(bs, backing_file, backing_format);
@@ -1313,6 +1629,7 @@ static int qcow2_create(const char *filename, QEMUOptionParameter *options)
     size_t cluster_size = DEFAULT_CLUSTER_SIZE;
     int prealloc = 0;
     int version = 2;
+    int compression_level = 0;
 
     /* Read out options */
     while (options && options->name) {
@@ -1350,6 +1667,25 @@ static int qcow2_create(const char *filename, QEMUOptionParameter *options)
             }
         } else if (!strcmp(options->name, BLOCK_OPT_LAZY_REFCOUNTS)) {
             flags |= options->value.n ? BLOCK_FLAG_LAZY_REFCOUNTS : 0;
+        } else if (!strcmp(options->name, BLOCK_OPT_DEDUP)) {
+            flags |= options->value.n ? BLOCK_FLAG_DEDUP : 0;
+        } else if (!strcmp(options->name, BLOCK_OPT_ENCRYPT_MODE)) {
+            if (!options->value.s || !strcmp(options->value.s, "cbc")) {
+                flags &= ~BLOCK_FLAG_ENCRYPT_XTS;
+            } else if (!strcmp(options->value.s, "xts")) {
+                flags |= BLOCK_FLAG_ENCRYPT_XTS;
+            } else {
+                fprintf(stderr, "Invalid encryption mode: '%s'\n",
+                    options->value.s);
+                return -EINVAL;
+            }
+        } else if (!strcmp(options->name, BLOCK_OPT_COMPRESSION_LEVEL)) {
+            compression_level = options->value.n;
+            if (compression_level < 0 || compression_level > 9) {
+                fprintf(stderr, "Compression level must be between 1 and 9 "
+                        "(0 for the default)\n");
+                return -EINVAL;
+            }
         }
         options++;
     }
@@ -1366,8 +1702,27 @@ static int qcow2_create(const char *filename, QEMUOptionParameter *options)
         return -EINVAL;
     }
 
+    if (version < 3 && (flags & BLOCK_FLAG_DEDUP)) {
+        fprintf(stderr, "Dedup only supported with compatibility "
+                "level 1.1 and above (use compat=1.1 or greater)\n");
+        return -EINVAL;
+    }
+
+    if ((flags & BLOCK_FLAG_ENCRYPT_XTS) && !(flags & BLOCK_FLAG_ENCRYPT)) {
+        fprintf(stderr, "Encryption mode given for an image that is not "
+                "encrypted (use encryption=on)\n");
+        return -EINVAL;
+    }
+
+    if ((flags & BLOCK_FLAG_ENCRYPT) && (flags & BLOCK_FLAG_DEDUP)) {
+        fprintf(stderr, "Encryption and dedup cannot be used at the "
+                "same time\n");
+        return -EINVAL;
+    }
+
     return qcow2_create2(filename, sectors, backing_file, backing_fmt, flags,
-                         cluster_size, prealloc, options, version);
+                         cluster_size, prealloc, options, version,
+                         compression_level);
 }
 
 static int qcow2_make_empty(BlockDriverState *bs)
@@ -1465,37 +1820,25 @@ static int qcow2_truncate(BlockDriverState *bs, int64_t offset)
 
 /* XXX: put compressed sectors first, then all the cluster aligned
    tables to avoid losing bytes in alignment */
-static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
-                                  const uint8_t *buf, int nb_sectors)
+/*
+ * Deflate one cluster of @buf into @out_buf.  Returns the compressed
+ * length, or -1 if the cluster does not get any smaller.
+ */
+static int qcow2_compress(BDRVQcowState *s, uint8_t *out_buf,
+                          const uint8_t *buf)
 {
-    BDRVQcowState *s = bs->opaque;
     z_stream strm;
     int ret, out_len;
-    uint8_t *out_buf;
-    uint64_t cluster_offset;
-
-    if (nb_sectors == 0) {
-        /* align end of file to a sector boundary to ease reading with
-           sector based I/Os */
-        cluster_offset = bdrv_getlength(bs->file);
-        cluster_offset = (cluster_offset + 511) & ~511;
-        bdrv_truncate(bs->file, cluster_offset);
-        return 0;
-    }
-
-    if (nb_sectors != s->cluster_sectors)
-        return -EINVAL;
-
-    out_buf = g_malloc(s->cluster_size + (s->cluster_size / 1000) + 128);
+    int level = s->compression_level ? s->compression_level
+                                     : Z_DEFAULT_COMPRESSION;
 
-    /* best compression, small window, no zlib header */
+    /* small window, no zlib header */
     memset(&strm, 0, sizeof(strm));
-    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
+    ret = deflateInit2(&strm, level,
                        Z_DEFLATED, -12,
                        9, Z_DEFAULT_STRATEGY);
     if (ret != 0) {
-        ret = -EINVAL;
-        goto fail;
+        return -1;
     }
 
     strm.avail_in = s->cluster_size;
@@ -1504,39 +1847,219 @@ static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
     strm.next_out = out_buf;
 
     ret = deflate(&strm, Z_FINISH);
-    if (ret != Z_STREAM_END && ret != Z_OK) {
-        deflateEnd(&strm);
-        ret = -EINVAL;
-        goto fail;
-    }
     out_len = strm.next_out - out_buf;
-
     deflateEnd(&strm);
 
     if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
+        return -1;
+    }
+    return out_len;
+}
+
+static void *qcow2_compress_thread(void *opaque)
+{
+    BDRVQcowState *s = opaque;
+    Qcow2CompressJob *job;
+
+    qemu_mutex_lock(&s->compress_lock);
+    for (;;) {
+        QTAILQ_FOREACH(job, &s->compress_jobs, next) {
+            if (!job->started) {
+                break;
+            }
+        }
+        if (!job) {
+            if (s->compress_exit) {
+                break;
+            }
+            qemu_cond_wait(&s->compress_work_cond, &s->compress_lock);
+            continue;
+        }
+        job->started = true;
+        qemu_mutex_unlock(&s->compress_lock);
+
+        job->out_len = qcow2_compress(s, job->out_buf, job->buf);
+
+        qemu_mutex_lock(&s->compress_lock);
+        job->done = true;
+        qemu_cond_broadcast(&s->compress_done_cond);
+    }
+    qemu_mutex_unlock(&s->compress_lock);
+    return NULL;
+}
+
+static void qcow2_compress_start(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int i, n = 1;
+
+#ifdef _SC_NPROCESSORS_ONLN
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    n = MAX(1, MIN(n, QCOW2_COMPRESS_MAX_THREADS));
+
+    qemu_mutex_init(&s->compress_lock);
+    qemu_cond_init(&s->compress_work_cond);
+    qemu_cond_init(&s->compress_done_cond);
+    QTAILQ_INIT(&s->compress_jobs);
+    s->compress_exit = false;
+    s->compress_queued = 0;
+    s->compress_ret = 0;
+    for (i = 0; i < n; i++) {
+        qemu_thread_create(&s->compress_threads[i], qcow2_compress_thread, s,
+                           QEMU_THREAD_JOINABLE);
+    }
+    s->compress_nthreads = n;
+}
+
+static int qcow2_compress_write_job(BlockDriverState *bs,
+                                    Qcow2CompressJob *job)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t cluster_offset;
+    int ret;
+
+    if (job->out_len < 0) {
         /* could not compress: write normal cluster */
-        ret = bdrv_write(bs, sector_num, buf, s->cluster_sectors);
+        ret = bdrv_write(bs, job->sector_num, job->buf, s->cluster_sectors);
         if (ret < 0) {
-            goto fail;
+            return ret;
         }
     } else {
         cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
-            sector_num << 9, out_len);
+            job->sector_num << 9, job->out_len);
         if (!cluster_offset) {
-            ret = -EIO;
-            goto fail;
+            return -EIO;
         }
         cluster_offset &= s->cluster_offset_mask;
         BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
-        ret = bdrv_pwrite(bs->file, cluster_offset, out_buf, out_len);
+        ret = bdrv_pwrite(bs->file, cluster_offset, job->out_buf,
+                          job->out_len);
         if (ret < 0) {
-            goto fail;
+            return ret;
         }
     }
+    return 0;
+}
+
+/*
+ * Write out the finished jobs at the head of the queue, waiting for the
+ * workers until no more than @max_queued jobs are left.  Returns the
+ * first error any write ran into since the last call.
+ */
+static int qcow2_compress_complete(BlockDriverState *bs, int max_queued)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2CompressJob *job;
+    int ret;
+
+    if (!s->compress_nthreads) {
+        return 0;
+    }
+
+    qemu_mutex_lock(&s->compress_lock);
+    while ((job = QTAILQ_FIRST(&s->compress_jobs)) != NULL) {
+        if (!job->done) {
+            if (s->compress_queued <= max_queued) {
+                break;
+            }
+            qemu_cond_wait(&s->compress_done_cond, &s->compress_lock);
+            continue;
+        }
+        QTAILQ_REMOVE(&s->compress_jobs, job, next);
+        s->compress_queued--;
+        qemu_mutex_unlock(&s->compress_lock);
+
+        ret = qcow2_compress_write_job(bs, job);
+        if (ret < 0 && !s->compress_ret) {
+            s->compress_ret = ret;
+        }
+        qemu_vfree(job->buf);
+        g_free(job->out_buf);
+        g_free(job);
+
+        qemu_mutex_lock(&s->compress_lock);
+    }
+    qemu_mutex_unlock(&s->compress_lock);
+
+    ret = s->compress_ret;
+    s->compress_ret = 0;
+    return ret;
+}
+
+static void qcow2_compress_stop(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int i;
+
+    if (!s->compress_nthreads) {
+        return;
+    }
+    qcow2_compress_complete(bs, 0);
+
+    qemu_mutex_lock(&s->compress_lock);
+    s->compress_exit = true;
+    qemu_cond_broadcast(&s->compress_work_cond);
+    qemu_mutex_unlock(&s->compress_lock);
+    for (i = 0; i < s->compress_nthreads; i++) {
+        qemu_thread_join(&s->compress_threads[i]);
+    }
+    s->compress_nthreads = 0;
+
+    qemu_cond_destroy(&s->compress_done_cond);
+    qemu_cond_destroy(&s->compress_work_cond);
+    qemu_mutex_destroy(&s->compress_lock);
+}
+
+/*
+ * The cluster is queued for the worker threads and written out by a
+ * later call, in the order of submission; errors are reported by the
+ * call that finds them.  The final call with nb_sectors == 0 waits for
+ * all of them.
+ */
+static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
+                                  const uint8_t *buf, int nb_sectors)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2CompressJob *job;
+    uint64_t cluster_offset;
+    int ret;
+
+    if (nb_sectors == 0) {
+        ret = qcow2_compress_complete(bs, 0);
+        if (ret < 0) {
+            return ret;
+        }
+        /* align end of file to a sector boundary to ease reading with
+           sector based I/Os */
+        cluster_offset = bdrv_getlength(bs->file);
+        cluster_offset = (cluster_offset + 511) & ~511;
+        bdrv_truncate(bs->file, cluster_offset);
+        return 0;
+    }
+
+    if (nb_sectors != s->cluster_sectors)
+        return -EINVAL;
+
+    if (!s->compress_nthreads) {
+        qcow2_compress_start(bs);
+    }
+
+    /* keep every worker busy, with one more job waiting for each */
+    ret = qcow2_compress_complete(bs, 2 * s->compress_nthreads - 1);
+
+    job = g_malloc0(sizeof(*job));
+    job->sector_num = sector_num;
+    job->buf = qemu_blockalign(bs, s->cluster_size);
+    memcpy(job->buf, buf, s->cluster_size);
+    job->out_buf = g_malloc(s->cluster_size + (s->cluster_size / 1000) + 128);
+
+    qemu_mutex_lock(&s->compress_lock);
+    QTAILQ_INSERT_TAIL(&s->compress_jobs, job, next);
+    s->compress_queued++;
+    qemu_cond_signal(&s->compress_work_cond);
+    qemu_mutex_unlock(&s->compress_lock);
 
-    ret = 0;
-fail:
-    g_free(out_buf);
     return ret;
 }
 
@@ -1569,6 +2092,19 @@ static int64_t qcow2_vm_state_offset(BDRVQcowState *s)
 	return (int64_t)s->l1_vm_state_index << (s->cluster_bits + s->l2_bits);
 }
 
+static void qcow2_get_stats(BlockDriverState *bs, BlockDeviceStats *stats)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    stats->has_l2_cache = true;
+    stats->l2_cache = g_malloc0(sizeof(*stats->l2_cache));
+    qcow2_cache_get_stats(s->l2_table_cache, stats->l2_cache);
+
+    stats->has_refcount_cache = true;
+    stats->refcount_cache = g_malloc0(sizeof(*stats->refcount_cache));
+    qcow2_cache_get_stats(s->refcount_block_cache, stats->refcount_cache);
+}
+
 static int qcow2_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
 {
     BDRVQcowState *s = bs->opaque;
@@ -1654,6 +2190,11 @@ static QEMUOptionParameter qcow2_create_options[] = {
         .type = OPT_FLAG,
         .help = "Encrypt the image"
     },
+    {
+        .name = BLOCK_OPT_ENCRYPT_MODE,
+        .type = OPT_STRING,
+        .help = "Cipher mode of the encryption (allowed values: cbc, xts)"
+    },
     {
         .name = BLOCK_OPT_CLUSTER_SIZE,
         .type = OPT_SIZE,
@@ -1670,6 +2211,16 @@ static QEMUOptionParameter qcow2_create_options[] = {
         .type = OPT_FLAG,
         .help = "Postpone refcount updates",
     },
+    {
+        .name = BLOCK_OPT_COMPRESSION_LEVEL,
+        .type = OPT_NUMBER,
+        .help = "Deflate level (1-9) for compressed clusters"
+    },
+    {
+        .name = BLOCK_OPT_DEDUP,
+        .type = OPT_FLAG,
+        .help = "Store identical clusters only once",
+    },
     { NULL }
 };
 
@@ -1699,6 +2250,8 @@ static BlockDriver bdrv_qcow2 = {
     .bdrv_snapshot_list     = qcow2_snapshot_list,
     .bdrv_snapshot_load_tmp     = qcow2_snapshot_load_tmp,
     .bdrv_get_info      = qcow2_get_info,
+    .bdrv_can_store_dirty_bitmap = qcow2_can_store_dirty_bitmap,
+    .bdrv_get_stats     = qcow2_get_stats,
 
     .bdrv_save_vmstate    = qcow2_save_vmstate,
     .bdrv_load_vmstate    = qcow2_load_vmstate,
@@ -1706,6 +2259,7 @@ static BlockDriver bdrv_qcow2 = {
     .bdrv_change_backing_file   = qcow2_change_backing_file,
 
     .bdrv_invalidate_cache      = qcow2_invalidate_cache,
+    .bdrv_inactivate            = qcow2_inactivate,
 
     .create_options = qcow2_create_options,
     .bdrv_check = qcow2_check,
@@ -27,6 +27,8 @@
 
 #include "aes.h"
 #include "qemu-coroutine.h"
+#include "qemu-thread.h"
+#include "qemu-memacct.h"
 
 //#define DEBUG_ALLOC
 //#define DEBUG_ALLOC2
@@ -36,9 +38,20 @@
 
 #define QCOW_CRYPT_NONE 0
 #define QCOW_CRYPT_AES  1
+#define QCOW_CRYPT_AES_XTS 2
 
 #define QCOW_MAX_CRYPT_CLUSTERS 32
 
+/* threads deflating clusters for qcow2_write_compressed */
+#define QCOW2_COMPRESS_MAX_THREADS 8
+
+/* threads encrypting the data of large requests, see qcow2-crypt.c */
+#define QCOW2_CRYPT_MAX_THREADS 8
+#define QCOW2_CRYPT_MIN_SECTORS 128
+
+/* compression types of the compression header extension */
+#define QCOW2_COMPRESSION_DEFLATE 0
+
 /* indicate that the refcount of the referenced cluster is exactly one. */
 #define QCOW_OFLAG_COPIED     (1LL << 63)
 /* indicate that the cluster is compressed (they never have the copied flag) */
@@ -51,10 +64,14 @@
 #define MIN_CLUSTER_BITS 9
 #define MAX_CLUSTER_BITS 21
 
+/* Default and minimum number of tables in the caches; the l2-cache-size and
+ * refcount-cache-size drive options override the default */
 #define L2_CACHE_SIZE 16
+#define MIN_L2_CACHE_SIZE 2
 
 /* Must be at least 4 to cover all cases of refcount table growth */
 #define REFCOUNT_CACHE_SIZE 4
+#define MIN_REFCOUNT_CACHE_SIZE 4
 
 #define DEFAULT_CLUSTER_SIZE 65536
 
@@ -97,6 +114,19 @@ typedef struct QCowSnapshot {
 struct Qcow2Cache;
 typedef struct Qcow2Cache Qcow2Cache;
 
+typedef struct Qcow2CompressJob {
+    int64_t sector_num;
+    uint8_t *buf;
+    uint8_t *out_buf;
+    int out_len;            /* -1 if the cluster does not compress */
+    bool started;
+    bool done;
+    QTAILQ_ENTRY(Qcow2CompressJob) next;
+} Qcow2CompressJob;
+
+typedef struct Qcow2CryptJob Qcow2CryptJob;
+typedef struct Qcow2CryptRequest Qcow2CryptRequest;
+
 typedef struct Qcow2UnknownHeaderExtension {
     uint32_t magic;
     uint32_t len;
@@ -126,6 +156,36 @@ enum {
     QCOW2_COMPAT_FEAT_MASK            = QCOW2_COMPAT_LAZY_REFCOUNTS,
 };
 
+/* Autoclear feature bits */
+enum {
+    QCOW2_AUTOCLEAR_DIRTY_BITMAPS_BITNR = 0,
+    QCOW2_AUTOCLEAR_DIRTY_BITMAPS       =
+        1 << QCOW2_AUTOCLEAR_DIRTY_BITMAPS_BITNR,
+    QCOW2_AUTOCLEAR_DEDUP_BITNR         = 1,
+    QCOW2_AUTOCLEAR_DEDUP               = 1 << QCOW2_AUTOCLEAR_DEDUP_BITNR,
+
+    QCOW2_AUTOCLEAR_MASK                = QCOW2_AUTOCLEAR_DIRTY_BITMAPS |
+                                          QCOW2_AUTOCLEAR_DEDUP,
+};
+
+/* an entry of the dedup table: SHA-256 of the cluster, then its offset */
+#define QCOW2_DEDUP_HASH_SIZE   32
+#define QCOW2_DEDUP_ENTRY_SIZE  (QCOW2_DEDUP_HASH_SIZE + 8)
+
+/* longest name of a persistent dirty bitmap */
+#define QCOW2_MAX_BITMAP_NAME 255
+
+/* the bitmap is loaded by a running QEMU, so its data in the image is stale */
+#define QCOW2_BITMAP_IN_USE 1
+
+typedef struct Qcow2Bitmap {
+    char *name;
+    uint64_t data_offset;       /* 0 if no data is stored */
+    uint32_t data_size;
+    uint8_t granularity_bits;
+    uint8_t flags;
+} Qcow2Bitmap;
+
 typedef struct Qcow2Feature {
     uint8_t type;
     uint8_t bit;
@@ -161,15 +221,21 @@ typedef struct BDRVQcowState {
     int64_t free_byte_offset;
 
     CoMutex lock;
+    MemAccount mem_account;     /* the metadata caches */
 
     uint32_t crypt_method; /* current crypt method, 0 if no key yet */
     uint32_t crypt_method_header;
     AES_KEY aes_encrypt_key;
     AES_KEY aes_decrypt_key;
+    AES_KEY aes_tweak_key;      /* QCOW_CRYPT_AES_XTS only */
     uint64_t snapshots_offset;
     int snapshots_size;
     int nb_snapshots;
     QCowSnapshot *snapshots;
+    /* id_str and name to index + 1 in snapshots, the first one for names */
+    GHashTable *snapshot_ids;
+    GHashTable *snapshot_names;
+    unsigned long snapshot_id_max;
 
     int flags;
     int qcow_version;
@@ -178,9 +244,63 @@ typedef struct BDRVQcowState {
     uint64_t compatible_features;
     uint64_t autoclear_features;
 
+    /* refcount updates are postponed and the image is marked dirty instead,
+     * because of the lazy refcounts bit or the lazy-refcounts drive option */
+    bool use_lazy_refcounts;
+
     size_t unknown_header_fields_size;
     void* unknown_header_fields;
     QLIST_HEAD(, Qcow2UnknownHeaderExtension) unknown_header_ext;
+
+    /* deflate level from the compression header extension, 0 if unset */
+    int compression_level;
+
+    /*
+     * Directory of the dirty bitmaps header extension.  Once the bitmaps
+     * are loaded into the BlockDriverState, the entries are only rewritten
+     * on close.
+     */
+    Qcow2Bitmap *bitmaps;
+    int nb_bitmaps;
+    bool bitmaps_loaded;
+
+    /*
+     * Index of the clusters written with dedup, by their hash and by their
+     * offset.  It holds a reference to each of them, so that they are
+     * never written in place.  The table in the image is only valid until
+     * the index is loaded for writing; it is written anew on close.
+     */
+    bool dedup;
+    bool dedup_loaded;
+    uint64_t dedup_table_offset;
+    uint64_t dedup_table_entries;
+    GHashTable *dedup_hash;
+    GHashTable *dedup_offsets;
+
+    /*
+     * Compressed writes are deflated by worker threads and written out
+     * by the caller of qcow2_write_compressed, oldest first.  Everything
+     * below except the job list is only touched by that caller.
+     */
+    QemuMutex compress_lock;
+    QemuCond compress_work_cond;
+    QemuCond compress_done_cond;
+    QTAILQ_HEAD(, Qcow2CompressJob) compress_jobs;
+    bool compress_exit;
+    int compress_queued;
+    int compress_ret;
+    int compress_nthreads;
+    QemuThread compress_threads[QCOW2_COMPRESS_MAX_THREADS];
+
+    /* encryption workers, started by the first request that needs them */
+    QemuMutex crypt_lock;
+    QemuCond crypt_cond;
+    QTAILQ_HEAD(, Qcow2CryptJob) crypt_jobs;
+    QTAILQ_HEAD(, Qcow2CryptRequest) crypt_done;
+    QEMUBH *crypt_bh;
+    bool crypt_exit;
+    int crypt_nthreads;
+    QemuThread crypt_threads[QCOW2_CRYPT_MAX_THREADS];
 } BDRVQcowState;
 
 /* XXX: use std qcow open function ? */
@@ -265,6 +385,7 @@ static inline bool qcow2_need_accurate_refcounts(BDRVQcowState *s)
 int qcow2_backing_read1(BlockDriverState *bs, QEMUIOVector *qiov,
                   int64_t sector_num, int nb_sectors);
 int qcow2_update_header(BlockDriverState *bs);
+int qcow2_mark_dirty(BlockDriverState *bs);
 
 /* qcow2-refcount.c functions */
 int qcow2_refcount_init(BlockDriverState *bs);
@@ -278,6 +399,9 @@ void qcow2_free_clusters(BlockDriverState *bs,
     int64_t offset, int64_t size);
 void qcow2_free_any_clusters(BlockDriverState *bs,
     uint64_t cluster_offset, int nb_clusters);
+int qcow2_get_refcount(BlockDriverState *bs, int64_t cluster_index);
+int qcow2_update_refcount(BlockDriverState *bs, int64_t offset,
+    int64_t length, int addend);
 
 int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     int64_t l1_table_offset, int l1_size, int addend);
@@ -291,8 +415,7 @@ void qcow2_l2_cache_reset(BlockDriverState *bs);
 int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset);
 void qcow2_encrypt_sectors(BDRVQcowState *s, int64_t sector_num,
                      uint8_t *out_buf, const uint8_t *in_buf,
-                     int nb_sectors, int enc,
-                     const AES_KEY *key);
+                     int nb_sectors, int enc);
 
 int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
     int *num, uint64_t *cluster_offset);
@@ -306,6 +429,37 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m);
 int qcow2_discard_clusters(BlockDriverState *bs, uint64_t offset,
     int nb_sectors);
 int qcow2_zero_clusters(BlockDriverState *bs, uint64_t offset, int nb_sectors);
+int qcow2_map_cluster(BlockDriverState *bs, uint64_t guest_offset,
+    uint64_t l2_entry);
+
+/* qcow2-bitmap.c functions */
+int qcow2_read_bitmap_ext(BlockDriverState *bs, uint64_t offset,
+                          uint32_t len);
+void *qcow2_bitmap_ext(BlockDriverState *bs, size_t *len);
+int qcow2_load_dirty_bitmaps(BlockDriverState *bs);
+int qcow2_store_dirty_bitmaps(BlockDriverState *bs);
+void qcow2_free_bitmaps(BlockDriverState *bs);
+bool qcow2_can_store_dirty_bitmap(BlockDriverState *bs, const char *name);
+
+/* qcow2-dedup.c functions */
+int qcow2_read_dedup_ext(BlockDriverState *bs, uint64_t offset,
+                         uint32_t len);
+void *qcow2_dedup_ext(BlockDriverState *bs, size_t *len);
+int qcow2_dedup_open(BlockDriverState *bs);
+int qcow2_dedup_enable(BlockDriverState *bs);
+int qcow2_dedup_load(BlockDriverState *bs);
+int qcow2_dedup_store(BlockDriverState *bs);
+void qcow2_dedup_close(BlockDriverState *bs);
+void qcow2_dedup_release(BlockDriverState *bs, int64_t offset, int64_t size);
+uint64_t *qcow2_dedup_offsets(BlockDriverState *bs, size_t *nb_offsets);
+int coroutine_fn qcow2_dedup_write(BlockDriverState *bs, int64_t sector_num,
+                                   QEMUIOVector *qiov, uint64_t qiov_offset);
+
+/* qcow2-crypt.c functions */
+void qcow2_crypt_stop(BlockDriverState *bs);
+void coroutine_fn qcow2_co_encrypt_sectors(BlockDriverState *bs,
+                                           int64_t sector_num, uint8_t *buf,
+                                           int nb_sectors, int enc);
 
 /* qcow2-snapshot.c functions */
 int qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info);
@@ -320,6 +474,7 @@ int qcow2_read_snapshots(BlockDriverState *bs);
 /* qcow2-cache.c functions */
 Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables);
 int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c);
+void qcow2_cache_get_stats(Qcow2Cache *c, BlockCacheStats *stats);
 
 void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table);
 int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c);
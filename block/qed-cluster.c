@@ -111,6 +111,41 @@ out:
     g_free(find_cluster_cb);
 }
 
+/**
+ * Prefetch the next L2 table for sequential accesses
+ *
+ * Once a sequential stream gets into the last quarter of the range mapped by
+ * an L2 table, the following table is read into the cache so that the stream
+ * does not stall on it when crossing over.
+ */
+static void qed_find_cluster_prefetch(BDRVQEDState *s, uint64_t pos,
+                                      size_t len)
+{
+    uint64_t l2_range = 1ULL << s->l1_shift;
+    uint64_t end = pos + len;
+    unsigned int next_index;
+    uint64_t l2_offset;
+    bool sequential;
+
+    sequential = pos == s->l2_prefetch_seq_pos;
+    s->l2_prefetch_seq_pos = end;
+    if (!sequential ||
+        ((end - 1) & (l2_range - 1)) < l2_range - l2_range / 4) {
+        return;
+    }
+
+    next_index = qed_l1_index(s, pos) + 1;
+    if (next_index >= s->table_nelems) {
+        return;
+    }
+    l2_offset = s->l1_table->offsets[next_index];
+    if (qed_offset_is_unalloc_cluster(l2_offset) ||
+        !qed_check_table_offset(s, l2_offset)) {
+        return;
+    }
+    qed_prefetch_l2_table(s, l2_offset);
+}
+
 /**
  * Find the offset of a data cluster
  *
@@ -160,6 +195,8 @@ void qed_find_cluster(BDRVQEDState *s, QEDRequest *request, uint64_t pos,
     find_cluster_cb->opaque = opaque;
     find_cluster_cb->request = request;
 
+    qed_find_cluster_prefetch(s, pos, len);
+
     qed_read_l2_table(s, request, l2_offset,
                       qed_find_cluster_cb, find_cluster_cb);
 }
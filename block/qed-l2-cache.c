@@ -44,25 +44,31 @@
  *
  * An interesting case occurs when two requests need to access an L2 table that
  * is not in the cache.  Since the operation to read the table from the image
- * file takes some time to complete, both requests may see a cache miss and
- * start reading the L2 table from the image file.  The first to finish will
- * commit its L2 table into the cache.  When the second tries to commit its
- * table will be deleted in favor of the existing cache entry.
+ * file takes some time to complete, both requests may see a cache miss.  The
+ * table read code in qed-table.c makes the second request wait for the read
+ * started by the first one.  Should two reads of the same table still race,
+ * the first to finish will commit its L2 table into the cache.  When the
+ * second tries to commit its table will be deleted in favor of the existing
+ * cache entry.
+ *
+ * Entries are looked up through a hash table on their offset and evicted in
+ * least recently used order.
  */
 
 #include "trace.h"
 #include "qed.h"
 
-/* Each L2 holds 2GB so this let's us fully cache a 100GB disk */
-#define MAX_L2_CACHE_SIZE 50
-
 /**
  * Initialize the L2 cache
+ *
+ * @max_entries:    Number of tables to keep before evicting unused ones
  */
-void qed_init_l2_cache(L2TableCache *l2_cache)
+void qed_init_l2_cache(L2TableCache *l2_cache, unsigned int max_entries)
 {
     QTAILQ_INIT(&l2_cache->entries);
     l2_cache->n_entries = 0;
+    l2_cache->max_entries = max_entries;
+    l2_cache->hash = g_hash_table_new(g_int64_hash, g_int64_equal);
 }
 
 /**
@@ -76,6 +82,7 @@ void qed_free_l2_cache(L2TableCache *l2_cache)
         qemu_vfree(entry->table);
         g_free(entry);
     }
+    g_hash_table_destroy(l2_cache->hash);
 }
 
 /**
@@ -126,14 +133,18 @@ CachedL2Table *qed_find_l2_cache_entry(L2TableCache *l2_cache, uint64_t offset)
 {
     CachedL2Table *entry;
 
-    QTAILQ_FOREACH(entry, &l2_cache->entries, node) {
-        if (entry->offset == offset) {
-            trace_qed_find_l2_cache_entry(l2_cache, entry, offset, entry->ref);
-            entry->ref++;
-            return entry;
-        }
+    entry = g_hash_table_lookup(l2_cache->hash, &offset);
+    if (!entry) {
+        return NULL;
     }
-    return NULL;
+
+    trace_qed_find_l2_cache_entry(l2_cache, entry, offset, entry->ref);
+    entry->ref++;
+
+    /* Most recently used entries live at the tail */
+    QTAILQ_REMOVE(&l2_cache->entries, entry, node);
+    QTAILQ_INSERT_TAIL(&l2_cache->entries, entry, node);
+    return entry;
 }
 
 /**
@@ -164,7 +175,7 @@ void qed_commit_l2_cache_entry(L2TableCache *l2_cache, CachedL2Table *l2_table)
     /* Evict an unused cache entry so we have space.  If all entries are in use
      * we can grow the cache temporarily and we try to shrink back down later.
      */
-    if (l2_cache->n_entries >= MAX_L2_CACHE_SIZE) {
+    if (l2_cache->n_entries >= l2_cache->max_entries) {
         CachedL2Table *next;
         QTAILQ_FOREACH_SAFE(entry, &l2_cache->entries, node, next) {
             if (entry->ref > 1) {
@@ -172,11 +183,12 @@ void qed_commit_l2_cache_entry(L2TableCache *l2_cache, CachedL2Table *l2_table)
             }
 
             QTAILQ_REMOVE(&l2_cache->entries, entry, node);
+            g_hash_table_remove(l2_cache->hash, &entry->offset);
             l2_cache->n_entries--;
             qed_unref_l2_cache_entry(entry);
 
             /* Stop evicting when we've shrunk back to max size */
-            if (l2_cache->n_entries < MAX_L2_CACHE_SIZE) {
+            if (l2_cache->n_entries < l2_cache->max_entries) {
                 break;
             }
         }
@@ -184,4 +196,5 @@ void qed_commit_l2_cache_entry(L2TableCache *l2_cache, CachedL2Table *l2_table)
 
     l2_cache->n_entries++;
     QTAILQ_INSERT_TAIL(&l2_cache->entries, l2_table, node);
+    g_hash_table_insert(l2_cache->hash, &l2_table->offset, l2_table);
 }
@@ -201,21 +201,34 @@ int qed_write_l1_table_sync(BDRVQEDState *s, unsigned int index,
     return ret;
 }
 
-typedef struct {
+/* A request waiting for an L2 table read started by another request */
+typedef struct QEDReadL2TableWaiter {
+    BlockDriverCompletionFunc *cb;
+    void *opaque;
+    QEDRequest *request;
+    QSIMPLEQ_ENTRY(QEDReadL2TableWaiter) next;
+} QEDReadL2TableWaiter;
+
+typedef struct QEDReadL2TableCB {
     GenericCB gencb;
     BDRVQEDState *s;
     uint64_t l2_offset;
     QEDRequest *request;
+    QLIST_ENTRY(QEDReadL2TableCB) next;     /* in s->l2_reads */
+    QSIMPLEQ_HEAD(, QEDReadL2TableWaiter) waiters;
 } QEDReadL2TableCB;
 
 static void qed_read_l2_table_cb(void *opaque, int ret)
 {
     QEDReadL2TableCB *read_l2_table_cb = opaque;
+    QEDReadL2TableWaiter *waiter;
     QEDRequest *request = read_l2_table_cb->request;
     BDRVQEDState *s = read_l2_table_cb->s;
     CachedL2Table *l2_table = request->l2_table;
     uint64_t l2_offset = read_l2_table_cb->l2_offset;
 
+    QLIST_REMOVE(read_l2_table_cb, next);
+
     if (ret) {
         /* can't trust loaded L2 table anymore */
         qed_unref_l2_cache_entry(l2_table);
@@ -232,6 +245,17 @@ static void qed_read_l2_table_cb(void *opaque, int ret)
         assert(request->l2_table != NULL);
     }
 
+    /* Our reference keeps the entry in the cache for the waiters */
+    while ((waiter = QSIMPLEQ_FIRST(&read_l2_table_cb->waiters))) {
+        QSIMPLEQ_REMOVE_HEAD(&read_l2_table_cb->waiters, next);
+        if (ret == 0) {
+            waiter->request->l2_table =
+                qed_find_l2_cache_entry(&s->l2_cache, l2_offset);
+        }
+        waiter->cb(waiter->opaque, ret);
+        g_free(waiter);
+    }
+
     gencb_complete(&read_l2_table_cb->gencb, ret);
 }
 
@@ -249,6 +273,19 @@ void qed_read_l2_table(BDRVQEDState *s, QEDRequest *request, uint64_t offset,
         return;
     }
 
+    /* Piggyback on a read of the same table that is already in flight */
+    QLIST_FOREACH(read_l2_table_cb, &s->l2_reads, next) {
+        if (read_l2_table_cb->l2_offset == offset) {
+            QEDReadL2TableWaiter *waiter = g_malloc(sizeof(*waiter));
+
+            waiter->cb = cb;
+            waiter->opaque = opaque;
+            waiter->request = request;
+            QSIMPLEQ_INSERT_TAIL(&read_l2_table_cb->waiters, waiter, next);
+            return;
+        }
+    }
+
     request->l2_table = qed_alloc_l2_cache_entry(&s->l2_cache);
     request->l2_table->table = qed_alloc_table(s);
 
@@ -256,6 +293,8 @@ void qed_read_l2_table(BDRVQEDState *s, QEDRequest *request, uint64_t offset,
     read_l2_table_cb->s = s;
     read_l2_table_cb->l2_offset = offset;
     read_l2_table_cb->request = request;
+    QSIMPLEQ_INIT(&read_l2_table_cb->waiters);
+    QLIST_INSERT_HEAD(&s->l2_reads, read_l2_table_cb, next);
 
     BLKDBG_EVENT(s->bs->file, BLKDBG_L2_LOAD);
     qed_read_table(s, offset, request->l2_table->table,
@@ -274,6 +313,40 @@ int qed_read_l2_table_sync(BDRVQEDState *s, QEDRequest *request, uint64_t offset
     return ret;
 }
 
+static void qed_prefetch_l2_table_cb(void *opaque, int ret)
+{
+    QEDRequest *request = opaque;
+
+    /* The table stays in the cache once our reference is dropped */
+    qed_unref_l2_cache_entry(request->l2_table);
+    g_free(request);
+}
+
+/**
+ * Start reading an L2 table into the cache without waiting for it
+ *
+ * Nothing is done if the table is already cached or being read.
+ */
+void qed_prefetch_l2_table(BDRVQEDState *s, uint64_t offset)
+{
+    QEDReadL2TableCB *read_l2_table_cb;
+    QEDRequest *request;
+
+    if (g_hash_table_lookup(s->l2_cache.hash, &offset)) {
+        return;
+    }
+    QLIST_FOREACH(read_l2_table_cb, &s->l2_reads, next) {
+        if (read_l2_table_cb->l2_offset == offset) {
+            return;
+        }
+    }
+
+    trace_qed_prefetch_l2_table(s, offset);
+
+    request = g_malloc0(sizeof(*request));
+    qed_read_l2_table(s, request, offset, qed_prefetch_l2_table_cb, request);
+}
+
 void qed_write_l2_table(BDRVQEDState *s, QEDRequest *request,
                         unsigned int index, unsigned int n, bool flush,
                         BlockDriverCompletionFunc *cb, void *opaque)
@@ -373,6 +373,19 @@ static void bdrv_qed_rebind(BlockDriverState *bs)
     s->bs = bs;
 }
 
+/**
+ * Number of L2 tables to cache: enough to map the whole image, bounded by
+ * QED_MAX_L2_CACHE_BYTES
+ */
+static unsigned int qed_l2_cache_size(BDRVQEDState *s)
+{
+    uint64_t needed = DIV_ROUND_UP(s->header.image_size, 1ULL << s->l1_shift);
+    uint64_t budget = QED_MAX_L2_CACHE_BYTES /
+                      (s->header.cluster_size * s->header.table_size);
+
+    return MAX(MIN(needed, budget), QED_MIN_L2_CACHE_SIZE);
+}
+
 static int bdrv_qed_open(BlockDriverState *bs, int flags)
 {
     BDRVQEDState *s = bs->opaque;
@@ -382,6 +395,7 @@ static int bdrv_qed_open(BlockDriverState *bs, int flags)
 
     s->bs = bs;
     QSIMPLEQ_INIT(&s->allocating_write_reqs);
+    QLIST_INIT(&s->l2_reads);
 
     ret = bdrv_pread(bs->file, 0, &le_header, sizeof(le_header));
     if (ret < 0) {
@@ -469,7 +483,7 @@ static int bdrv_qed_open(BlockDriverState *bs, int flags)
     }
 
     s->l1_table = qed_alloc_table(s);
-    qed_init_l2_cache(&s->l2_cache);
+    qed_init_l2_cache(&s->l2_cache, qed_l2_cache_size(s));
 
     ret = qed_read_l1_table_sync(s);
     if (ret) {
@@ -81,6 +81,13 @@ enum {
 
     /* Delay to flush and clean image after last allocating write completes */
     QED_NEED_CHECK_TIMEOUT = 5,    /* in seconds */
+
+    /* The L2 cache holds enough tables to map the whole image, within a
+     * memory budget.  Each default-sized L2 maps 2 GB, so the minimum is
+     * enough to fully cache a 100 GB disk.
+     */
+    QED_MIN_L2_CACHE_SIZE = 50,             /* in tables */
+    QED_MAX_L2_CACHE_BYTES = 64 * 1024 * 1024,
 };
 
 typedef struct {
@@ -115,8 +122,10 @@ typedef struct CachedL2Table {
 } CachedL2Table;
 
 typedef struct {
-    QTAILQ_HEAD(, CachedL2Table) entries;
+    QTAILQ_HEAD(, CachedL2Table) entries;   /* least recently used first */
+    GHashTable *hash;                       /* offset -> CachedL2Table */
     unsigned int n_entries;
+    unsigned int max_entries;
 } L2TableCache;
 
 typedef struct QEDRequest {
@@ -167,6 +176,12 @@ typedef struct {
     QSIMPLEQ_HEAD(, QEDAIOCB) allocating_write_reqs;
     bool allocating_write_reqs_plugged;
 
+    /* L2 table reads in flight, shared by requests for the same table */
+    QLIST_HEAD(, QEDReadL2TableCB) l2_reads;
+
+    /* Sequential access detection for L2 table prefetch */
+    uint64_t l2_prefetch_seq_pos;
+
     /* Periodic flush and clear need check flag */
     QEMUTimer *need_check_timer;
 } BDRVQEDState;
@@ -218,7 +233,7 @@ int qed_write_header_sync(BDRVQEDState *s);
 /**
  * L2 cache functions
  */
-void qed_init_l2_cache(L2TableCache *l2_cache);
+void qed_init_l2_cache(L2TableCache *l2_cache, unsigned int max_entries);
 void qed_free_l2_cache(L2TableCache *l2_cache);
 CachedL2Table *qed_alloc_l2_cache_entry(L2TableCache *l2_cache);
 void qed_unref_l2_cache_entry(CachedL2Table *entry);
@@ -237,6 +252,7 @@ int qed_read_l2_table_sync(BDRVQEDState *s, QEDRequest *request,
                            uint64_t offset);
 void qed_read_l2_table(BDRVQEDState *s, QEDRequest *request, uint64_t offset,
                        BlockDriverCompletionFunc *cb, void *opaque);
+void qed_prefetch_l2_table(BDRVQEDState *s, uint64_t offset);
 void qed_write_l2_table(BDRVQEDState *s, QEDRequest *request,
                         unsigned int index, unsigned int n, bool flush,
                         BlockDriverCompletionFunc *cb, void *opaque);
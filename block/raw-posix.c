@@ -118,6 +118,10 @@
 
 #define MAX_BLOCKSIZE	4096
 
+/* Discard and write zeroes requests are split in chunks of this size, so
+   that their length fits in the size_t of a thread pool request */
+#define RAW_RANGE_MAX_SECTORS   (1 << 21)
+
 typedef struct BDRVRawState {
     int fd;
     int type;
@@ -138,6 +142,10 @@ typedef struct BDRVRawState {
 #ifdef CONFIG_XFS
     bool is_xfs : 1;
 #endif
+    bool is_blkdev : 1;
+    /* cleared the first time the host says it cannot do it */
+    bool has_discard : 1;
+    bool has_write_zeroes : 1;
 } BDRVRawState;
 
 static int fd_open(BlockDriverState *bs);
@@ -185,6 +193,80 @@ static int raw_normalize_devicepath(const char **filename)
 }
 #endif
 
+/*
+ * Find the alignment that O_DIRECT needs for offsets, lengths and buffers.
+ * Ask the kernel where it can tell, otherwise try reads until one is not
+ * refused with EINVAL.  bs->buffer_alignment becomes the larger of the
+ * request and memory alignments, and requests that do not meet it go
+ * through a bounce buffer.
+ */
+static void raw_probe_alignment(BlockDriverState *bs)
+{
+    BDRVRawState *s = bs->opaque;
+    unsigned int align = 0, mem_align = 0, i;
+    uint8_t *buf;
+
+#ifdef BLKSSZGET
+    {
+        int sector_size;
+
+        if (ioctl(s->fd, BLKSSZGET, &sector_size) == 0 && sector_size > 0) {
+            align = sector_size;
+        }
+    }
+#endif
+#ifdef DKIOCGETBLOCKSIZE
+    {
+        uint32_t block_size;
+
+        if (ioctl(s->fd, DKIOCGETBLOCKSIZE, &block_size) == 0) {
+            align = block_size;
+        }
+    }
+#endif
+#ifdef DIOCGSECTORSIZE
+    {
+        unsigned int sector_size;
+
+        if (ioctl(s->fd, DIOCGSECTORSIZE, &sector_size) == 0) {
+            align = sector_size;
+        }
+    }
+#endif
+#ifdef CONFIG_XFS
+    if (s->is_xfs) {
+        struct dioattr da;
+
+        if (xfsctl(NULL, s->fd, XFS_IOC_DIOINFO, &da) >= 0) {
+            align = da.d_miniosz;
+            mem_align = da.d_mem;
+        }
+    }
+#endif
+
+    buf = qemu_memalign(MAX_BLOCKSIZE, 2 * MAX_BLOCKSIZE);
+    for (i = BDRV_SECTOR_SIZE; !align && i <= MAX_BLOCKSIZE; i <<= 1) {
+        if (pread(s->fd, buf, i, 0) >= 0 || errno != EINVAL) {
+            align = i;
+        }
+    }
+    if (!align) {
+        align = BDRV_SECTOR_SIZE;
+    }
+    for (i = BDRV_SECTOR_SIZE; !mem_align && i <= MAX_BLOCKSIZE; i <<= 1) {
+        if (pread(s->fd, buf + i, MIN(align, MAX_BLOCKSIZE), 0) >= 0 ||
+            errno != EINVAL) {
+            mem_align = i;
+        }
+    }
+    qemu_vfree(buf);
+
+    DEBUG_BLOCK_PRINT("O_DIRECT alignment: requests %u, memory %u\n",
+                      align, mem_align);
+    bdrv_set_buffer_alignment(bs, MAX(MAX(align, mem_align),
+                                      BDRV_SECTOR_SIZE));
+}
+
 static int raw_open_common(BlockDriverState *bs, const char *filename,
                            int bdrv_flags, int open_flags)
 {
@@ -239,30 +321,44 @@ static int raw_open_common(BlockDriverState *bs, const char *filename,
         goto out_free_buf;
     }
 
+#ifdef CONFIG_XFS
+    if (platform_test_xfs_fd(s->fd)) {
+        s->is_xfs = 1;
+    }
+#endif
+
+    {
+        struct stat st;
+
+        if (fstat(s->fd, &st) == 0) {
+            s->is_blkdev = S_ISBLK(st.st_mode);
+            s->has_discard = S_ISREG(st.st_mode) || s->is_blkdev;
+            s->has_write_zeroes = s->has_discard;
+        }
+    }
+
+    if (s->aligned_buf) {
+        raw_probe_alignment(bs);
+    }
+
 #ifdef CONFIG_LINUX_AIO
     /*
      * Currently Linux do AIO only for files opened with O_DIRECT
-     * specified so check NOCACHE flag too
+     * specified so check NOCACHE flag too.  Block devices use it unless
+     * aio=threads was given: it does not block on them, while on files
+     * it can block on allocating the file's metadata.
      */
-    if ((bdrv_flags & (BDRV_O_NOCACHE|BDRV_O_NATIVE_AIO)) ==
-                      (BDRV_O_NOCACHE|BDRV_O_NATIVE_AIO)) {
+    s->use_aio = 0;
+    if ((bdrv_flags & BDRV_O_NOCACHE) &&
+        ((bdrv_flags & BDRV_O_NATIVE_AIO) ||
+         (s->is_blkdev && !(bdrv_flags & BDRV_O_THREAD_AIO)))) {
 
         s->aio_ctx = laio_init();
-        if (!s->aio_ctx) {
+        if (s->aio_ctx) {
+            s->use_aio = 1;
+        } else if (bdrv_flags & BDRV_O_NATIVE_AIO) {
             goto out_free_buf;
         }
-        s->use_aio = 1;
-    } else
-#endif
-    {
-#ifdef CONFIG_LINUX_AIO
-        s->use_aio = 0;
-#endif
-    }
-
-#ifdef CONFIG_XFS
-    if (platform_test_xfs_fd(s->fd)) {
-        s->is_xfs = 1;
     }
 #endif
 
@@ -283,32 +379,23 @@ static int raw_open(BlockDriverState *bs, const char *filename, int flags)
     return raw_open_common(bs, filename, flags, 0);
 }
 
-/* XXX: use host sector size if necessary with:
-#ifdef DIOCGSECTORSIZE
-        {
-            unsigned int sectorsize = 512;
-            if (!ioctl(fd, DIOCGSECTORSIZE, &sectorsize) &&
-                sectorsize > bufsize)
-                bufsize = sectorsize;
-        }
-#endif
-#ifdef CONFIG_COCOA
-        uint32_t blockSize = 512;
-        if ( !ioctl( fd, DKIOCGETBLOCKSIZE, &blockSize ) && blockSize > bufsize) {
-            bufsize = blockSize;
-        }
-#endif
-*/
-
 /*
- * Check if all memory in this vector is sector aligned.
+ * Check if the request and all memory in this vector meet the O_DIRECT
+ * alignment of the file.
  */
-static int qiov_is_aligned(BlockDriverState *bs, QEMUIOVector *qiov)
+static int qiov_is_aligned(BlockDriverState *bs, int64_t sector_num,
+                           int nb_sectors, QEMUIOVector *qiov)
 {
+    int align = bs->buffer_alignment;
     int i;
 
+    if ((sector_num * BDRV_SECTOR_SIZE) % align ||
+        (nb_sectors * BDRV_SECTOR_SIZE) % align) {
+        return 0;
+    }
     for (i = 0; i < qiov->niov; i++) {
-        if ((uintptr_t) qiov->iov[i].iov_base % bs->buffer_alignment) {
+        if ((uintptr_t) qiov->iov[i].iov_base % align ||
+            qiov->iov[i].iov_len % align) {
             return 0;
         }
     }
@@ -331,7 +418,7 @@ static BlockDriverAIOCB *raw_aio_submit(BlockDriverState *bs,
      * driver that it needs to copy the buffer.
      */
     if (s->aligned_buf) {
-        if (!qiov_is_aligned(bs, qiov)) {
+        if (!qiov_is_aligned(bs, sector_num, nb_sectors, qiov)) {
             type |= QEMU_AIO_MISALIGNED;
 #ifdef CONFIG_LINUX_AIO
         } else if (s->use_aio) {
@@ -372,6 +459,89 @@ static BlockDriverAIOCB *raw_aio_flush(BlockDriverState *bs,
     return paio_submit(bs, s->fd, 0, NULL, 0, cb, opaque, QEMU_AIO_FLUSH);
 }
 
+static void raw_detach_aio_context(BlockDriverState *bs)
+{
+#ifdef CONFIG_LINUX_AIO
+    BDRVRawState *s = bs->opaque;
+
+    if (s->use_aio) {
+        laio_detach_aio_context(s->aio_ctx, bdrv_get_aio_context(bs));
+    }
+#endif
+}
+
+static void raw_io_plug(BlockDriverState *bs)
+{
+#ifdef CONFIG_LINUX_AIO
+    BDRVRawState *s = bs->opaque;
+
+    if (s->use_aio) {
+        laio_io_plug(s->aio_ctx);
+    }
+#endif
+}
+
+static void raw_io_unplug(BlockDriverState *bs)
+{
+#ifdef CONFIG_LINUX_AIO
+    BDRVRawState *s = bs->opaque;
+
+    if (s->use_aio) {
+        laio_io_unplug(s->aio_ctx);
+    }
+#endif
+}
+
+/* Only Linux AIO completes requests in the context of the BDS; the thread
+ * pool always calls back from the main loop */
+static int raw_attach_aio_context(BlockDriverState *bs,
+                                  AioContext *new_context)
+{
+#ifdef CONFIG_LINUX_AIO
+    BDRVRawState *s = bs->opaque;
+
+    if (s->use_aio) {
+        laio_attach_aio_context(s->aio_ctx, new_context);
+        return 0;
+    }
+#endif
+    return new_context == qemu_get_aio_context() ? 0 : -ENOTSUP;
+}
+
+#ifdef CONFIG_LINUX_AIO
+/*
+ * Return the file descriptor for Linux AIO
+ *
+ * This function is a layering violation and should be removed when it becomes
+ * possible to call the block layer outside the global mutex.  It allows the
+ * caller to hijack the file descriptor so I/O can be performed outside the
+ * block layer.
+ */
+int raw_get_aio_fd(BlockDriverState *bs)
+{
+    BDRVRawState *s;
+
+    if (!bs->drv) {
+        return -ENOMEDIUM;
+    }
+
+    if (bs->drv == bdrv_find_format("raw")) {
+        bs = bs->file;
+    }
+
+    /* raw-posix has several protocols so just check for raw_aio_readv */
+    if (bs->drv->bdrv_aio_readv != raw_aio_readv) {
+        return -ENOTSUP;
+    }
+
+    s = bs->opaque;
+    if (!s->use_aio) {
+        return -ENOTSUP;
+    }
+    return s->fd;
+}
+#endif /* CONFIG_LINUX_AIO */
+
 static void raw_close(BlockDriverState *bs)
 {
     BDRVRawState *s = bs->opaque;
@@ -587,38 +757,42 @@ static int raw_create(const char *filename, QEMUOptionParameter *options)
     return result;
 }
 
+#if defined SEEK_HOLE && defined SEEK_DATA
 /*
- * Returns true iff the specified sector is present in the disk image. Drivers
- * not implementing the functionality are assumed to not support backing files,
- * hence all their sectors are reported as allocated.
- *
- * If 'sector_num' is beyond the end of the disk image the return value is 0
- * and 'pnum' is set to 0.
- *
- * 'pnum' is set to the number of sectors (including and immediately following
- * the specified sector) that are known to be in the same
- * allocated/unallocated state.
- *
- * 'nb_sectors' is the max value 'pnum' should be set to.  If nb_sectors goes
- * beyond the end of the disk image it will be clamped.
+ * Find the data extent or the hole at @start, and where it ends.  The
+ * kernel takes data that is still in the page cache into account.
  */
-static int coroutine_fn raw_co_is_allocated(BlockDriverState *bs,
-                                            int64_t sector_num,
-                                            int nb_sectors, int *pnum)
+static int try_seek_hole(BDRVRawState *s, off_t start, off_t *data,
+                         off_t *hole)
 {
-    off_t start, data, hole;
-    int ret;
-
-    ret = fd_open(bs);
-    if (ret < 0) {
-        return ret;
+    *hole = lseek(s->fd, start, SEEK_HOLE);
+    if (*hole == -1) {
+        /* ENXIO past the end of the file, most likely EINVAL otherwise */
+        return -errno;
     }
 
-    start = sector_num * BDRV_SECTOR_SIZE;
+    if (*hole > start) {
+        *data = start;
+    } else {
+        /* On a hole.  We need another syscall to find its end.  */
+        *data = lseek(s->fd, start, SEEK_DATA);
+        if (*data == -1) {
+            *data = lseek(s->fd, 0, SEEK_END);
+        }
+    }
+    return 0;
+}
+#endif
 
 #ifdef CONFIG_FIEMAP
-
-    BDRVRawState *s = bs->opaque;
+/*
+ * FIEMAP only knows about the blocks that are allocated on disk:
+ * FIEMAP_FLAG_SYNC writes back dirty and delayed-allocation data first, or
+ * it would be reported as a hole.
+ */
+static int try_fiemap(BDRVRawState *s, off_t start, int nb_sectors,
+                      off_t *data, off_t *hole)
+{
     struct {
         struct fiemap fm;
         struct fiemap_extent fe;
@@ -626,13 +800,11 @@ static int coroutine_fn raw_co_is_allocated(BlockDriverState *bs,
 
     f.fm.fm_start = start;
     f.fm.fm_length = (int64_t)nb_sectors * BDRV_SECTOR_SIZE;
-    f.fm.fm_flags = 0;
+    f.fm.fm_flags = FIEMAP_FLAG_SYNC;
     f.fm.fm_extent_count = 1;
     f.fm.fm_reserved = 0;
     if (ioctl(s->fd, FS_IOC_FIEMAP, &f) == -1) {
-        /* Assume everything is allocated.  */
-        *pnum = nb_sectors;
-        return 1;
+        return -errno;
     }
 
     if (f.fm.fm_mapped_extents == 0) {
@@ -640,41 +812,63 @@ static int coroutine_fn raw_co_is_allocated(BlockDriverState *bs,
          * f.fm.fm_start + f.fm.fm_length must be clamped to the file size!
          */
         off_t length = lseek(s->fd, 0, SEEK_END);
-        hole = f.fm.fm_start;
-        data = MIN(f.fm.fm_start + f.fm.fm_length, length);
+        *hole = f.fm.fm_start;
+        *data = MIN(f.fm.fm_start + f.fm.fm_length, length);
     } else {
-        data = f.fe.fe_logical;
-        hole = f.fe.fe_logical + f.fe.fe_length;
+        *data = f.fe.fe_logical;
+        *hole = f.fe.fe_logical + f.fe.fe_length;
     }
+    return 0;
+}
+#endif
 
-#elif defined SEEK_HOLE && defined SEEK_DATA
-
+/*
+ * Returns true iff the specified sector is present in the disk image. Drivers
+ * not implementing the functionality are assumed to not support backing files,
+ * hence all their sectors are reported as allocated.
+ *
+ * If 'sector_num' is beyond the end of the disk image the return value is 0
+ * and 'pnum' is set to 0.
+ *
+ * 'pnum' is set to the number of sectors (including and immediately following
+ * the specified sector) that are known to be in the same
+ * allocated/unallocated state.
+ *
+ * 'nb_sectors' is the max value 'pnum' should be set to.  If nb_sectors goes
+ * beyond the end of the disk image it will be clamped.
+ *
+ * Callers skip or zero what is reported as a hole, so anything that cannot
+ * be answered reliably is reported as allocated.
+ */
+static int coroutine_fn raw_co_is_allocated(BlockDriverState *bs,
+                                            int64_t sector_num,
+                                            int nb_sectors, int *pnum)
+{
     BDRVRawState *s = bs->opaque;
+    off_t start, data = 0, hole = 0;
+    int ret;
 
-    hole = lseek(s->fd, start, SEEK_HOLE);
-    if (hole == -1) {
-        /* -ENXIO indicates that sector_num was past the end of the file.
-         * There is a virtual hole there.  */
-        assert(errno != -ENXIO);
-
-        /* Most likely EINVAL.  Assume everything is allocated.  */
-        *pnum = nb_sectors;
-        return 1;
+    ret = fd_open(bs);
+    if (ret < 0) {
+        return ret;
     }
 
-    if (hole > start) {
-        data = start;
-    } else {
-        /* On a hole.  We need another syscall to find its end.  */
-        data = lseek(s->fd, start, SEEK_DATA);
-        if (data == -1) {
-            data = lseek(s->fd, 0, SEEK_END);
-        }
+    start = sector_num * BDRV_SECTOR_SIZE;
+    ret = -ENOTSUP;
+
+#if defined SEEK_HOLE && defined SEEK_DATA
+    ret = try_seek_hole(s, start, &data, &hole);
+#endif
+#ifdef CONFIG_FIEMAP
+    if (ret < 0) {
+        ret = try_fiemap(s, start, nb_sectors, &data, &hole);
     }
-#else
-    *pnum = nb_sectors;
-    return 1;
 #endif
+    if (ret < 0) {
+        /* Assume everything is allocated.  */
+        *pnum = nb_sectors;
+        return 1;
+    }
 
     if (data <= start) {
         /* On a data extent, compute sectors to the end of the extent.  */
@@ -706,18 +900,88 @@ static int xfs_discard(BDRVRawState *s, int64_t sector_num, int nb_sectors)
 }
 #endif
 
+typedef struct RawCoRequest {
+    Coroutine *co;
+    int ret;
+} RawCoRequest;
+
+static void raw_co_request_complete(void *opaque, int ret)
+{
+    RawCoRequest *req = opaque;
+
+    req->ret = ret;
+    qemu_coroutine_enter(req->co, NULL);
+}
+
+/* Run a discard or write zeroes request in the thread pool */
+static coroutine_fn int raw_co_range_request(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors, int type)
+{
+    BDRVRawState *s = bs->opaque;
+    RawCoRequest req = { .co = qemu_coroutine_self() };
+    int ret;
+
+    ret = fd_open(bs);
+    if (ret < 0) {
+        return ret;
+    }
+    if (s->is_blkdev) {
+        type |= QEMU_AIO_BLKDEV;
+    }
+
+    while (nb_sectors > 0) {
+        int n = MIN(nb_sectors, RAW_RANGE_MAX_SECTORS);
+
+        paio_submit(bs, s->fd, sector_num, NULL, n,
+                    raw_co_request_complete, &req, type);
+        qemu_coroutine_yield();
+        if (req.ret < 0) {
+            return req.ret;
+        }
+        sector_num += n;
+        nb_sectors -= n;
+    }
+    return 0;
+}
+
 static coroutine_fn int raw_co_discard(BlockDriverState *bs,
     int64_t sector_num, int nb_sectors)
 {
-#ifdef CONFIG_XFS
     BDRVRawState *s = bs->opaque;
+    int ret;
 
+#ifdef CONFIG_XFS
     if (s->is_xfs) {
         return xfs_discard(s, sector_num, nb_sectors);
     }
 #endif
 
-    return 0;
+    if (!s->has_discard) {
+        return 0;
+    }
+    ret = raw_co_range_request(bs, sector_num, nb_sectors, QEMU_AIO_DISCARD);
+    if (ret == -ENOTSUP) {
+        s->has_discard = false;
+        return 0;
+    }
+    return ret;
+}
+
+static coroutine_fn int raw_co_write_zeroes(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors)
+{
+    BDRVRawState *s = bs->opaque;
+    int ret;
+
+    if (!s->has_write_zeroes) {
+        return -ENOTSUP;
+    }
+    ret = raw_co_range_request(bs, sector_num, nb_sectors,
+                               QEMU_AIO_WRITE_ZEROES);
+    if (ret == -ENOTSUP) {
+        s->has_write_zeroes = false;
+    }
+    return ret;
 }
 
 static QEMUOptionParameter raw_create_options[] = {
@@ -738,12 +1002,18 @@ static BlockDriver bdrv_file = {
     .bdrv_close = raw_close,
     .bdrv_create = raw_create,
     .bdrv_co_discard = raw_co_discard,
+    .bdrv_co_write_zeroes = raw_co_write_zeroes,
     .bdrv_co_is_allocated = raw_co_is_allocated,
 
     .bdrv_aio_readv = raw_aio_readv,
     .bdrv_aio_writev = raw_aio_writev,
     .bdrv_aio_flush = raw_aio_flush,
 
+    .bdrv_detach_aio_context = raw_detach_aio_context,
+    .bdrv_attach_aio_context = raw_attach_aio_context,
+    .bdrv_io_plug = raw_io_plug,
+    .bdrv_io_unplug = raw_io_unplug,
+
     .bdrv_truncate = raw_truncate,
     .bdrv_getlength = raw_getlength,
     .bdrv_get_allocated_file_size
@@ -1007,11 +1277,18 @@ static BlockDriver bdrv_host_device = {
     .bdrv_create        = hdev_create,
     .create_options     = raw_create_options,
     .bdrv_has_zero_init = hdev_has_zero_init,
+    .bdrv_co_discard    = raw_co_discard,
+    .bdrv_co_write_zeroes = raw_co_write_zeroes,
 
     .bdrv_aio_readv	= raw_aio_readv,
     .bdrv_aio_writev	= raw_aio_writev,
     .bdrv_aio_flush	= raw_aio_flush,
 
+    .bdrv_detach_aio_context = raw_detach_aio_context,
+    .bdrv_attach_aio_context = raw_attach_aio_context,
+    .bdrv_io_plug = raw_io_plug,
+    .bdrv_io_unplug = raw_io_unplug,
+
     .bdrv_truncate      = raw_truncate,
     .bdrv_getlength	= raw_getlength,
     .bdrv_get_allocated_file_size
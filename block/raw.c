@@ -106,6 +106,13 @@ static int raw_has_zero_init(BlockDriverState *bs)
     return bdrv_has_zero_init(bs->file);
 }
 
+/* Everything goes through bs->file, which block.c moves for us */
+static int raw_attach_aio_context(BlockDriverState *bs,
+                                  AioContext *new_context)
+{
+    return 0;
+}
+
 static BlockDriver bdrv_raw = {
     .format_name        = "raw",
 
@@ -135,6 +142,8 @@ static BlockDriver bdrv_raw = {
     .bdrv_create        = raw_create,
     .create_options     = raw_create_options,
     .bdrv_has_zero_init = raw_has_zero_init,
+
+    .bdrv_attach_aio_context = raw_attach_aio_context,
 };
 
 static void bdrv_raw_init(void)
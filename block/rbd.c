@@ -681,7 +681,11 @@ static BlockDriverAIOCB *rbd_start_aio(BlockDriverState *bs,
     acb = qemu_aio_get(&rbd_aio_pool, bs, cb, opaque);
     acb->cmd = cmd;
     acb->qiov = qiov;
-    if (cmd == RBD_AIO_DISCARD) {
+    if (cmd == RBD_AIO_DISCARD ||
+        (cmd == RBD_AIO_WRITE && qiov->niov == 1)) {
+        /* librbd takes a flat buffer, so only writes with several iovecs
+         * need a copy.  Reads always bounce: cancel does not wait for
+         * librbd, which must not write to guest memory afterwards.  */
         acb->bounce = NULL;
     } else {
         acb->bounce = qemu_blockalign(bs, qiov->size);
@@ -692,12 +696,17 @@ static BlockDriverAIOCB *rbd_start_aio(BlockDriverState *bs,
     acb->cancelled = 0;
     acb->bh = NULL;
 
-    if (cmd == RBD_AIO_WRITE) {
-        qemu_iovec_to_buf(acb->qiov, 0, acb->bounce, qiov->size);
+    if (acb->bounce) {
+        if (cmd == RBD_AIO_WRITE) {
+            qemu_iovec_to_buf(acb->qiov, 0, acb->bounce, qiov->size);
+        }
+        buf = acb->bounce;
+    } else if (qiov) {
+        buf = qiov->iov[0].iov_base;
+    } else {
+        buf = NULL;
     }
 
-    buf = acb->bounce;
-
     off = sector_num * BDRV_SECTOR_SIZE;
     size = nb_sectors * BDRV_SECTOR_SIZE;
 
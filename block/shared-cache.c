@@ -0,0 +1,376 @@
+/*
+ * Read cache for backing files, shared between QEMU processes
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * All the clones of a base image read the same blocks of it while they
+ * boot.  With cache=none every one of them goes to the storage for them;
+ * this cache keeps them in a file in SHARED_CACHE_DIR that every QEMU
+ * process reading the image maps, so that only the first reader of each
+ * chunk goes to the storage.
+ *
+ * The file is named after the device and inode of the image, and its
+ * header holds the size and modification time the image had when the file
+ * was made.  A process that finds them changed marks the file stale, which
+ * makes all its users read through from then on, and replaces it with a
+ * new one.  The name can be guessed, so a file that is not private to the
+ * user running QEMU is never used: another user could feed it crafted data.
+ *
+ * The cache is direct mapped: chunk n of the image can only live in slot
+ * n % nb_slots.  The tag of a slot holds a generation number, the chunk
+ * and a state.  A process fills a slot after moving its tag to BUSY with
+ * a compare and swap; readers copy the data of a VALID slot and check
+ * that the tag did not change meanwhile, so no process ever waits for
+ * another.  A slot whose filler dies while it is BUSY is lost.
+ */
+
+#include "qemu-common.h"
+#include "block_int.h"
+#include "qemu-barrier.h"
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+#define SHARED_CACHE_DIR        "/dev/shm"
+#define SHARED_CACHE_MAGIC      0x51424353      /* "QBCS" */
+#define SHARED_CACHE_VERSION    2
+
+#define SHARED_CACHE_CHUNK          (64 * 1024)
+#define SHARED_CACHE_CHUNK_SECTORS  (SHARED_CACHE_CHUNK >> BDRV_SECTOR_BITS)
+#define SHARED_CACHE_ALIGN          4096
+
+enum {
+    SHARED_CACHE_EMPTY  = 0,
+    SHARED_CACHE_BUSY   = 1,
+    SHARED_CACHE_VALID  = 2,
+};
+
+#define TAG_STATE(tag)          ((tag) & 3)
+#define TAG_GEN(tag)            ((tag) >> 48)
+#define TAG_CHUNK(tag)          (((tag) >> 2) & ((1ULL << 46) - 1))
+#define MAKE_TAG(gen, chunk, state) \
+    (((uint64_t)(gen) << 48) | ((uint64_t)(chunk) << 2) | (state))
+
+typedef struct SharedCacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    /* identity of the image */
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime;              /* in ns */
+    uint32_t chunk_size;
+    uint32_t nb_slots;
+    volatile uint32_t stale;
+} SharedCacheHeader;
+
+struct BdrvSharedCache {
+    int fd;
+    size_t map_size;
+    SharedCacheHeader *header;
+    volatile uint64_t *tags;
+    uint8_t *data;
+    uint32_t nb_slots;
+};
+
+#ifndef _WIN32
+/* A rewrite within the same second must not go unnoticed */
+static int64_t shared_cache_mtime(struct stat *st)
+{
+#ifdef __APPLE__
+    return st->st_mtimespec.tv_sec * 1000000000LL + st->st_mtimespec.tv_nsec;
+#else
+    return st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+#endif
+}
+
+static size_t shared_cache_data_offset(uint32_t nb_slots)
+{
+    return DIV_ROUND_UP(SHARED_CACHE_ALIGN + nb_slots * sizeof(uint64_t),
+                        SHARED_CACHE_ALIGN) * SHARED_CACHE_ALIGN;
+}
+
+static size_t shared_cache_map_size(uint32_t nb_slots)
+{
+    return shared_cache_data_offset(nb_slots) +
+           (size_t)nb_slots * SHARED_CACHE_CHUNK;
+}
+
+static bool shared_cache_matches(SharedCacheHeader *h, struct stat *st,
+                                 size_t file_size)
+{
+    return h->version == SHARED_CACHE_VERSION &&
+           h->dev == st->st_dev && h->ino == st->st_ino &&
+           h->size == st->st_size && h->mtime == shared_cache_mtime(st) &&
+           h->chunk_size == SHARED_CACHE_CHUNK && h->nb_slots &&
+           file_size >= shared_cache_map_size(h->nb_slots);
+}
+
+/* Creates the cache file, or returns -EEXIST if another process did */
+static int shared_cache_create(BdrvSharedCache *c, const char *path,
+                               struct stat *st, uint32_t nb_slots)
+{
+    SharedCacheHeader *h;
+    int fd;
+
+    fd = qemu_open(path, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
+    if (fd < 0) {
+        return -errno;
+    }
+    c->map_size = shared_cache_map_size(nb_slots);
+    /* whatever the umask, for shared_cache_attach() to accept it */
+    if (fchmod(fd, 0600) < 0 || ftruncate(fd, c->map_size) < 0) {
+        goto fail;
+    }
+    h = mmap(NULL, c->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (h == MAP_FAILED) {
+        goto fail;
+    }
+
+    /* the file is all zeroes, so every slot is empty */
+    h->version = SHARED_CACHE_VERSION;
+    h->dev = st->st_dev;
+    h->ino = st->st_ino;
+    h->size = st->st_size;
+    h->mtime = shared_cache_mtime(st);
+    h->chunk_size = SHARED_CACHE_CHUNK;
+    h->nb_slots = nb_slots;
+    smp_wmb();
+    h->magic = SHARED_CACHE_MAGIC;
+
+    c->fd = fd;
+    c->header = h;
+    return 0;
+
+fail:
+    close(fd);
+    unlink(path);
+    return -EIO;
+}
+
+/*
+ * Maps the cache file another process of the same user made.  Returns
+ * -ESTALE after marking it stale if it belongs to an older version of the
+ * image, -EPERM if it is not the user's own private file.
+ */
+static int shared_cache_attach(BdrvSharedCache *c, const char *path,
+                               struct stat *st)
+{
+    struct stat cst;
+    SharedCacheHeader *h;
+    int fd, ret = -EINVAL;
+
+    fd = qemu_open(path, O_RDWR | O_NOFOLLOW);
+    if (fd < 0) {
+        return -errno;
+    }
+    if (fstat(fd, &cst) < 0) {
+        goto fail;
+    }
+    if (!S_ISREG(cst.st_mode) || cst.st_uid != geteuid() ||
+        (cst.st_mode & 0777) != 0600) {
+        ret = -EPERM;
+        goto fail;
+    }
+    if (cst.st_size < sizeof(*h)) {
+        /* still being created */
+        goto fail;
+    }
+    h = mmap(NULL, cst.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (h == MAP_FAILED) {
+        goto fail;
+    }
+    if (h->magic != SHARED_CACHE_MAGIC) {
+        munmap(h, cst.st_size);
+        goto fail;
+    }
+    smp_rmb();
+    if (h->stale || !shared_cache_matches(h, st, cst.st_size)) {
+        h->stale = 1;
+        munmap(h, cst.st_size);
+        ret = -ESTALE;
+        goto fail;
+    }
+
+    c->fd = fd;
+    c->map_size = cst.st_size;
+    c->header = h;
+    return 0;
+
+fail:
+    close(fd);
+    return ret;
+}
+
+/*
+ * Returns the cache of the image file of @bs, @size bytes large unless
+ * the cache exists already, or NULL if it cannot have one.  Failing to
+ * set up the cache is not an error: the image is read directly.
+ */
+BdrvSharedCache *bdrv_shared_cache_open(BlockDriverState *bs, uint64_t size)
+{
+    BdrvSharedCache *c;
+    struct stat st;
+    uint64_t nb_slots = size / SHARED_CACHE_CHUNK;
+    char *path;
+    int i, ret = -EEXIST;
+
+    if (!nb_slots || strcmp(bs->drv->format_name, "file") ||
+        stat(bs->filename, &st) < 0 || !S_ISREG(st.st_mode)) {
+        return NULL;
+    }
+    nb_slots = MIN(nb_slots, UINT32_MAX);
+
+    c = g_malloc0(sizeof(*c));
+    path = g_strdup_printf("%s/qemu-backing-%" PRIx64 "-%" PRIx64,
+                           SHARED_CACHE_DIR, (uint64_t)st.st_dev,
+                           (uint64_t)st.st_ino);
+
+    /* one retry after replacing a stale file */
+    for (i = 0; i < 2; i++) {
+        ret = shared_cache_create(c, path, &st, nb_slots);
+        if (ret != -EEXIST) {
+            break;
+        }
+        ret = shared_cache_attach(c, path, &st);
+        if (ret != -ESTALE) {
+            break;
+        }
+        unlink(path);
+    }
+    g_free(path);
+
+    if (ret < 0) {
+        g_free(c);
+        return NULL;
+    }
+
+    c->nb_slots = c->header->nb_slots;
+    c->tags = (uint64_t *)((uint8_t *)c->header + SHARED_CACHE_ALIGN);
+    c->data = (uint8_t *)c->header + shared_cache_data_offset(c->nb_slots);
+    return c;
+}
+
+void bdrv_shared_cache_close(BdrvSharedCache *c)
+{
+    munmap(c->header, c->map_size);
+    close(c->fd);
+    g_free(c);
+}
+
+/* Reads from the image file, bypassing the cache */
+static int coroutine_fn shared_cache_read_through(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors, QEMUIOVector *qiov,
+    size_t qiov_offset)
+{
+    QEMUIOVector local_qiov;
+    int ret;
+
+    qemu_iovec_init(&local_qiov, qiov->niov);
+    qemu_iovec_concat(&local_qiov, qiov, qiov_offset,
+                      nb_sectors * BDRV_SECTOR_SIZE);
+    ret = bs->drv->bdrv_co_readv(bs, sector_num, nb_sectors, &local_qiov);
+    qemu_iovec_destroy(&local_qiov);
+    return ret;
+}
+
+/* Reads sectors that are all in the same chunk */
+static int coroutine_fn shared_cache_read_chunk(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors, QEMUIOVector *qiov,
+    size_t qiov_offset)
+{
+    BdrvSharedCache *c = bs->shared_cache;
+    uint64_t chunk = sector_num / SHARED_CACHE_CHUNK_SECTORS;
+    uint32_t slot = chunk % c->nb_slots;
+    volatile uint64_t *tag = &c->tags[slot];
+    uint8_t *data = c->data + (size_t)slot * SHARED_CACHE_CHUNK;
+    size_t offset = (sector_num % SHARED_CACHE_CHUNK_SECTORS) *
+                    BDRV_SECTOR_SIZE;
+    size_t bytes = nb_sectors * BDRV_SECTOR_SIZE;
+    uint64_t old, busy;
+    QEMUIOVector chunk_qiov;
+    struct iovec iov;
+    int n, ret;
+
+    old = *tag;
+    if (TAG_STATE(old) == SHARED_CACHE_VALID && TAG_CHUNK(old) == chunk) {
+        smp_rmb();
+        qemu_iovec_from_buf(qiov, qiov_offset, data + offset, bytes);
+        smp_rmb();
+        if (*tag == old) {
+            return 0;
+        }
+        /* refilled under our feet; the copy may be torn */
+        old = *tag;
+    }
+
+    busy = MAKE_TAG(TAG_GEN(old) + 1, chunk, SHARED_CACHE_BUSY);
+    if (TAG_STATE(old) == SHARED_CACHE_BUSY ||
+        !__sync_bool_compare_and_swap(tag, old, busy)) {
+        return shared_cache_read_through(bs, sector_num, nb_sectors, qiov,
+                                         qiov_offset);
+    }
+
+    /* the slot is ours; a chunk past the end of the image is partial */
+    n = MIN(SHARED_CACHE_CHUNK_SECTORS,
+            bs->total_sectors - chunk * SHARED_CACHE_CHUNK_SECTORS);
+    iov.iov_base = data;
+    iov.iov_len = n * BDRV_SECTOR_SIZE;
+    qemu_iovec_init_external(&chunk_qiov, &iov, 1);
+    ret = bs->drv->bdrv_co_readv(bs, chunk * SHARED_CACHE_CHUNK_SECTORS, n,
+                                 &chunk_qiov);
+    if (ret < 0) {
+        *tag = MAKE_TAG(TAG_GEN(busy), 0, SHARED_CACHE_EMPTY);
+        return ret;
+    }
+    qemu_iovec_from_buf(qiov, qiov_offset, data + offset, bytes);
+
+    smp_wmb();
+    *tag = MAKE_TAG(TAG_GEN(busy), chunk, SHARED_CACHE_VALID);
+    return 0;
+}
+
+int coroutine_fn bdrv_shared_cache_co_readv(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors, QEMUIOVector *qiov)
+{
+    BdrvSharedCache *c = bs->shared_cache;
+    int64_t end = sector_num + nb_sectors;
+    size_t qiov_offset = 0;
+    int ret;
+
+    if (c->header->stale) {
+        return bs->drv->bdrv_co_readv(bs, sector_num, nb_sectors, qiov);
+    }
+
+    while (sector_num < end) {
+        int64_t chunk_end = (sector_num / SHARED_CACHE_CHUNK_SECTORS + 1) *
+                            SHARED_CACHE_CHUNK_SECTORS;
+        int n = MIN(end, chunk_end) - sector_num;
+
+        ret = shared_cache_read_chunk(bs, sector_num, n, qiov, qiov_offset);
+        if (ret < 0) {
+            return ret;
+        }
+        sector_num += n;
+        qiov_offset += n * BDRV_SECTOR_SIZE;
+    }
+    return 0;
+}
+#else
+BdrvSharedCache *bdrv_shared_cache_open(BlockDriverState *bs, uint64_t size)
+{
+    return NULL;
+}
+
+void bdrv_shared_cache_close(BdrvSharedCache *c)
+{
+}
+
+int coroutine_fn bdrv_shared_cache_co_readv(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors, QEMUIOVector *qiov)
+{
+    return bs->drv->bdrv_co_readv(bs, sector_num, nb_sectors, qiov);
+}
+#endif
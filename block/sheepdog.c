@@ -1731,6 +1731,57 @@ static int coroutine_fn sd_co_flush_to_disk(BlockDriverState *bs)
     return 0;
 }
 
+/*
+ * Data objects that were never written have no vdi id in the inode, and
+ * read as zeroes without a trip to the sheep.  Report them as
+ * unallocated so that callers such as qemu-img convert can skip them.
+ */
+static int coroutine_fn sd_co_is_allocated(BlockDriverState *bs,
+                                           int64_t sector_num,
+                                           int nb_sectors, int *pnum)
+{
+    BDRVSheepdogState *s = bs->opaque;
+    SheepdogInode *inode = &s->inode;
+    uint64_t offset = sector_num * SECTOR_SIZE;
+    uint64_t end = MIN(offset + (uint64_t)nb_sectors * SECTOR_SIZE,
+                       inode->vdi_size);
+    unsigned long idx = offset / SD_DATA_OBJ_SIZE;
+    unsigned long last = DIV_ROUND_UP(end, SD_DATA_OBJ_SIZE);
+    bool allocated;
+
+    if (offset >= end) {
+        *pnum = 0;
+        return 0;
+    }
+
+    allocated = inode->data_vdi_id[idx] != 0;
+    while (++idx < last &&
+           (inode->data_vdi_id[idx] != 0) == allocated) {
+        /* nothing */
+    }
+    *pnum = (MIN(end, (uint64_t)idx * SD_DATA_OBJ_SIZE) - offset) /
+            SECTOR_SIZE;
+    return allocated;
+}
+
+/* Zeroing objects that were never written costs nothing; anything else
+ * falls back to writing a zeroed buffer.  */
+static int coroutine_fn sd_co_write_zeroes(BlockDriverState *bs,
+                                           int64_t sector_num,
+                                           int nb_sectors)
+{
+    int n;
+
+    while (nb_sectors > 0) {
+        if (sd_co_is_allocated(bs, sector_num, nb_sectors, &n) || n == 0) {
+            return -ENOTSUP;
+        }
+        sector_num += n;
+        nb_sectors -= n;
+    }
+    return 0;
+}
+
 static int sd_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info)
 {
     BDRVSheepdogState *s = bs->opaque;
@@ -2064,6 +2115,8 @@ BlockDriver bdrv_sheepdog = {
     .bdrv_co_readv  = sd_co_readv,
     .bdrv_co_writev = sd_co_writev,
     .bdrv_co_flush_to_disk  = sd_co_flush_to_disk,
+    .bdrv_co_is_allocated   = sd_co_is_allocated,
+    .bdrv_co_write_zeroes   = sd_co_write_zeroes,
 
     .bdrv_snapshot_create   = sd_snapshot_create,
     .bdrv_snapshot_goto     = sd_snapshot_goto,
@@ -22,15 +22,36 @@ enum {
      * contiguous regions of the image is efficient.
      */
     STREAM_BUFFER_SIZE = 512 * 1024, /* in bytes */
+
+    /*
+     * Amount of data populated after a guest copy-on-read, so that a guest
+     * reading sequentially from a slow backing file finds the following
+     * clusters already in the image.
+     */
+    STREAM_PREFETCH_SIZE = 1024 * 1024, /* in bytes */
+
+    /* Prefetch regions queued, the oldest is dropped when full */
+    STREAM_MAX_PREFETCH = 16,
 };
 
 #define SLICE_TIME 100000000ULL /* ns */
 
+typedef struct StreamPrefetch {
+    int64_t sector_num;
+    int nb_sectors;
+} StreamPrefetch;
+
 typedef struct StreamBlockJob {
     BlockJob common;
     RateLimit limit;
     BlockDriverState *base;
     char backing_file_id[1024];
+
+    /* Ring of regions next to guest reads, populated ahead of the linear
+     * pass and outside of the rate limit */
+    StreamPrefetch prefetch[STREAM_MAX_PREFETCH];
+    unsigned int prefetch_head;
+    unsigned int prefetch_count;
 } StreamBlockJob;
 
 static int coroutine_fn stream_populate(BlockDriverState *bs,
@@ -46,7 +67,87 @@ static int coroutine_fn stream_populate(BlockDriverState *bs,
     qemu_iovec_init_external(&qiov, &iov, 1);
 
     /* Copy-on-read the unallocated clusters */
-    return bdrv_co_copy_on_readv(bs, sector_num, nb_sectors, &qiov);
+    return bdrv_co_background_copy_on_readv(bs, sector_num, nb_sectors, &qiov);
+}
+
+/*
+ * Find out how much of [sector_num, sector_num + *n) can be handled in one
+ * go, starting with at most STREAM_BUFFER_SIZE, and whether it needs copying.
+ * Returns 1 if it does, 0 if not, or -errno.
+ */
+static int coroutine_fn stream_needs_copy(StreamBlockJob *s,
+                                          int64_t sector_num, int *n)
+{
+    BlockDriverState *bs = s->common.bs;
+    int ret;
+
+    ret = bdrv_co_is_allocated(bs, sector_num, *n, n);
+    if (ret == 1) {
+        /* Allocated in the top, no need to copy.  */
+        return 0;
+    }
+
+    /* Copy if allocated in the intermediate images.  Limit to the
+     * known-unallocated area [sector_num, sector_num+n).  */
+    return bdrv_co_is_allocated_above(bs->backing_hd, s->base,
+                                      sector_num, *n, n);
+}
+
+/*
+ * Populate the queued prefetch regions.  Errors are not fatal, the linear pass
+ * will get to the region again.
+ */
+static void coroutine_fn stream_run_prefetch(StreamBlockJob *s, void *buf)
+{
+    BlockDriverState *bs = s->common.bs;
+
+    while (s->prefetch_count && !block_job_is_cancelled(&s->common)) {
+        StreamPrefetch *p = &s->prefetch[s->prefetch_head];
+        int64_t sector_num = p->sector_num;
+        int64_t end = sector_num + p->nb_sectors;
+        int n;
+
+        s->prefetch_head = (s->prefetch_head + 1) % STREAM_MAX_PREFETCH;
+        s->prefetch_count--;
+
+        for (; sector_num < end; sector_num += n) {
+            int ret;
+
+            n = MIN(end - sector_num, STREAM_BUFFER_SIZE / BDRV_SECTOR_SIZE);
+            ret = stream_needs_copy(s, sector_num, &n);
+            trace_stream_prefetch(s, sector_num, n, ret);
+            if (ret == 1) {
+                ret = stream_populate(bs, sector_num, n, buf);
+            }
+            if (ret < 0) {
+                break;
+            }
+        }
+    }
+}
+
+static void stream_copy_on_read(BlockJob *job, int64_t sector_num,
+                                int nb_sectors)
+{
+    StreamBlockJob *s = container_of(job, StreamBlockJob, common);
+    int64_t end = s->common.len >> BDRV_SECTOR_BITS;
+    StreamPrefetch *p;
+
+    sector_num += nb_sectors;
+    if (sector_num >= end) {
+        return;
+    }
+
+    if (s->prefetch_count == STREAM_MAX_PREFETCH) {
+        s->prefetch_head = (s->prefetch_head + 1) % STREAM_MAX_PREFETCH;
+        s->prefetch_count--;
+    }
+    p = &s->prefetch[(s->prefetch_head + s->prefetch_count) %
+                     STREAM_MAX_PREFETCH];
+    p->sector_num = sector_num;
+    p->nb_sectors = MIN(end - sector_num,
+                        STREAM_PREFETCH_SIZE / BDRV_SECTOR_SIZE);
+    s->prefetch_count++;
 }
 
 static void close_unused_images(BlockDriverState *top, BlockDriverState *base,
@@ -83,7 +184,7 @@ static void coroutine_fn stream_run(void *opaque)
 
     s->common.len = bdrv_getlength(bs);
     if (s->common.len < 0) {
-        block_job_complete(&s->common, s->common.len);
+        block_job_completed(&s->common, s->common.len);
         return;
     }
 
@@ -112,18 +213,15 @@ wait:
             break;
         }
 
-        ret = bdrv_co_is_allocated(bs, sector_num,
-                                   STREAM_BUFFER_SIZE / BDRV_SECTOR_SIZE, &n);
-        if (ret == 1) {
-            /* Allocated in the top, no need to copy.  */
-            copy = false;
-        } else {
-            /* Copy if allocated in the intermediate images.  Limit to the
-             * known-unallocated area [sector_num, sector_num+n).  */
-            ret = bdrv_co_is_allocated_above(bs->backing_hd, base,
-                                             sector_num, n, &n);
-            copy = (ret == 1);
+        /* Regions the guest is reading go first */
+        stream_run_prefetch(s, buf);
+        if (block_job_is_cancelled(&s->common)) {
+            break;
         }
+
+        n = STREAM_BUFFER_SIZE / BDRV_SECTOR_SIZE;
+        ret = stream_needs_copy(s, sector_num, &n);
+        copy = (ret == 1);
         trace_stream_one_iteration(s, sector_num, n, ret);
         if (ret >= 0 && copy) {
             if (s->common.speed) {
@@ -160,7 +258,7 @@ wait:
     }
 
     qemu_vfree(buf);
-    block_job_complete(&s->common, ret);
+    block_job_completed(&s->common, ret);
 }
 
 static void stream_set_speed(BlockJob *job, int64_t speed, Error **errp)
@@ -178,6 +276,7 @@ static BlockJobType stream_job_type = {
     .instance_size = sizeof(StreamBlockJob),
     .job_type      = "stream",
     .set_speed     = stream_set_speed,
+    .copy_on_read  = stream_copy_on_read,
 };
 
 void stream_start(BlockDriverState *bs, BlockDriverState *base,
@@ -31,11 +31,11 @@
  * Allocation of blocks could be optimized (less writes to block map and
  * header).
  *
- * Read and write of adjacents blocks could be done in one operation
- * (current code uses one operation per block (1 MiB).
+ * Writes of adjacent blocks could be done in one operation (current code
+ * uses one operation per block (1 MiB); reads of adjacent blocks are merged.
  *
- * The code is not thread safe (missing locks for changes in header and
- * block table, no problem with current QEMU).
+ * Requests run in parallel.  Only block allocation, which changes the header
+ * and the block map, is serialized by a lock.
  *
  * Hints:
  *
@@ -181,6 +181,8 @@ typedef struct {
     uint32_t bmap_sector;
     /* VDI header (converted to host endianness). */
     VdiHeader header;
+    /* Serializes block allocation, i.e. changes to header and block map. */
+    CoMutex write_lock;
 
     Error *migration_blocker;
 } BDRVVdiState;
@@ -445,6 +447,8 @@ static int vdi_open(BlockDriverState *bs, int flags)
               "vdi", bs->device_name, "live migration");
     migrate_add_blocker(s->migration_blocker);
 
+    qemu_co_mutex_init(&s->write_lock);
+
     return 0;
 
  fail_free_bmap:
@@ -471,22 +475,39 @@ static int coroutine_fn vdi_co_is_allocated(BlockDriverState *bs,
     return VDI_IS_ALLOCATED(bmap_entry);
 }
 
-static int vdi_co_read(BlockDriverState *bs,
-        int64_t sector_num, uint8_t *buf, int nb_sectors)
+static int coroutine_fn vdi_co_readv(BlockDriverState *bs,
+        int64_t sector_num, int nb_sectors, QEMUIOVector *qiov)
 {
     BDRVVdiState *s = bs->opaque;
+    QEMUIOVector hd_qiov;
     uint32_t bmap_entry;
     uint32_t block_index;
     uint32_t sector_in_block;
     uint32_t n_sectors;
+    uint64_t bytes_done = 0;
     int ret = 0;
 
     logout("\n");
 
+    qemu_iovec_init(&hd_qiov, qiov->niov);
     while (ret >= 0 && nb_sectors > 0) {
         block_index = sector_num / s->block_sectors;
         sector_in_block = sector_num % s->block_sectors;
         n_sectors = s->block_sectors - sector_in_block;
+        bmap_entry = le32_to_cpu(s->bmap[block_index]);
+
+        /* Merge the following blocks if they are unallocated as well, or
+         * allocated right behind this one in the image file. */
+        while (n_sectors < nb_sectors) {
+            uint32_t next = le32_to_cpu(s->bmap[++block_index]);
+            if (VDI_IS_ALLOCATED(bmap_entry)
+                ? next != bmap_entry + (n_sectors + sector_in_block) /
+                          s->block_sectors
+                : VDI_IS_ALLOCATED(next)) {
+                break;
+            }
+            n_sectors += s->block_sectors;
+        }
         if (n_sectors > nb_sectors) {
             n_sectors = nb_sectors;
         }
@@ -494,43 +515,48 @@ static int vdi_co_read(BlockDriverState *bs,
         logout("will read %u sectors starting at sector %" PRIu64 "\n",
                n_sectors, sector_num);
 
-        /* prepare next AIO request */
-        bmap_entry = le32_to_cpu(s->bmap[block_index]);
         if (!VDI_IS_ALLOCATED(bmap_entry)) {
             /* Block not allocated, return zeros, no need to wait. */
-            memset(buf, 0, n_sectors * SECTOR_SIZE);
+            qemu_iovec_memset(qiov, bytes_done, 0, n_sectors * SECTOR_SIZE);
             ret = 0;
         } else {
             uint64_t offset = s->header.offset_data / SECTOR_SIZE +
                               (uint64_t)bmap_entry * s->block_sectors +
                               sector_in_block;
-            ret = bdrv_read(bs->file, offset, buf, n_sectors);
+            qemu_iovec_reset(&hd_qiov);
+            qemu_iovec_concat(&hd_qiov, qiov, bytes_done,
+                              n_sectors * SECTOR_SIZE);
+            ret = bdrv_co_readv(bs->file, offset, n_sectors, &hd_qiov);
         }
         logout("%u sectors read\n", n_sectors);
 
         nb_sectors -= n_sectors;
         sector_num += n_sectors;
-        buf += n_sectors * SECTOR_SIZE;
+        bytes_done += n_sectors * SECTOR_SIZE;
     }
+    qemu_iovec_destroy(&hd_qiov);
 
     return ret;
 }
 
-static int vdi_co_write(BlockDriverState *bs,
-        int64_t sector_num, const uint8_t *buf, int nb_sectors)
+static int coroutine_fn vdi_co_writev(BlockDriverState *bs,
+        int64_t sector_num, int nb_sectors, QEMUIOVector *qiov)
 {
     BDRVVdiState *s = bs->opaque;
+    QEMUIOVector hd_qiov;
     uint32_t bmap_entry;
     uint32_t block_index;
     uint32_t sector_in_block;
     uint32_t n_sectors;
     uint32_t bmap_first = VDI_UNALLOCATED;
     uint32_t bmap_last = VDI_UNALLOCATED;
+    uint64_t bytes_done = 0;
     uint8_t *block = NULL;
     int ret = 0;
 
     logout("\n");
 
+    qemu_iovec_init(&hd_qiov, qiov->niov);
     while (ret >= 0 && nb_sectors > 0) {
         block_index = sector_num / s->block_sectors;
         sector_in_block = sector_num % s->block_sectors;
@@ -542,76 +568,86 @@ static int vdi_co_write(BlockDriverState *bs,
         logout("will write %u sectors starting at sector %" PRIu64 "\n",
                n_sectors, sector_num);
 
-        /* prepare next AIO request */
         bmap_entry = le32_to_cpu(s->bmap[block_index]);
+        if (!VDI_IS_ALLOCATED(bmap_entry) && block == NULL) {
+            /* The first allocation of this request takes the lock and keeps
+             * it until header and block map are on disk.  Another request
+             * may have allocated the block while we waited. */
+            qemu_co_mutex_lock(&s->write_lock);
+            block = g_malloc(s->block_size);
+            bmap_entry = le32_to_cpu(s->bmap[block_index]);
+        }
         if (!VDI_IS_ALLOCATED(bmap_entry)) {
             /* Allocate new block and write to it. */
             uint64_t offset;
             bmap_entry = s->header.blocks_allocated;
-            s->bmap[block_index] = cpu_to_le32(bmap_entry);
             s->header.blocks_allocated++;
             offset = s->header.offset_data / SECTOR_SIZE +
                      (uint64_t)bmap_entry * s->block_sectors;
-            if (block == NULL) {
-                block = g_malloc(s->block_size);
+            if (!VDI_IS_ALLOCATED(bmap_first)) {
                 bmap_first = block_index;
             }
             bmap_last = block_index;
             /* Copy data to be written to new block and zero unused parts. */
             memset(block, 0, sector_in_block * SECTOR_SIZE);
-            memcpy(block + sector_in_block * SECTOR_SIZE,
-                   buf, n_sectors * SECTOR_SIZE);
+            qemu_iovec_to_buf(qiov, bytes_done,
+                              block + sector_in_block * SECTOR_SIZE,
+                              n_sectors * SECTOR_SIZE);
             memset(block + (sector_in_block + n_sectors) * SECTOR_SIZE, 0,
                    (s->block_sectors - n_sectors - sector_in_block) * SECTOR_SIZE);
             ret = bdrv_write(bs->file, offset, block, s->block_sectors);
+            if (ret >= 0) {
+                /* Unlocked readers and writers may use the block only now. */
+                s->bmap[block_index] = cpu_to_le32(bmap_entry);
+            }
         } else {
             uint64_t offset = s->header.offset_data / SECTOR_SIZE +
                               (uint64_t)bmap_entry * s->block_sectors +
                               sector_in_block;
-            ret = bdrv_write(bs->file, offset, buf, n_sectors);
+            qemu_iovec_reset(&hd_qiov);
+            qemu_iovec_concat(&hd_qiov, qiov, bytes_done,
+                              n_sectors * SECTOR_SIZE);
+            ret = bdrv_co_writev(bs->file, offset, n_sectors, &hd_qiov);
         }
 
         nb_sectors -= n_sectors;
         sector_num += n_sectors;
-        buf += n_sectors * SECTOR_SIZE;
+        bytes_done += n_sectors * SECTOR_SIZE;
 
         logout("%u sectors written\n", n_sectors);
     }
+    qemu_iovec_destroy(&hd_qiov);
 
     logout("finished data write\n");
-    if (ret < 0) {
-        return ret;
-    }
-
-    if (block) {
+    if (ret >= 0 && VDI_IS_ALLOCATED(bmap_first)) {
         /* One or more new blocks were allocated. */
         VdiHeader *header = (VdiHeader *) block;
         uint8_t *base;
         uint64_t offset;
 
         logout("now writing modified header\n");
-        assert(VDI_IS_ALLOCATED(bmap_first));
         *header = s->header;
         vdi_header_to_le(header);
         ret = bdrv_write(bs->file, 0, block, 1);
-        g_free(block);
-        block = NULL;
 
-        if (ret < 0) {
-            return ret;
+        if (ret >= 0) {
+            logout("now writing modified block map entry %u...%u\n",
+                   bmap_first, bmap_last);
+            /* Write modified sectors from block map. */
+            bmap_first /= (SECTOR_SIZE / sizeof(uint32_t));
+            bmap_last /= (SECTOR_SIZE / sizeof(uint32_t));
+            n_sectors = bmap_last - bmap_first + 1;
+            offset = s->bmap_sector + bmap_first;
+            base = ((uint8_t *)&s->bmap[0]) + bmap_first * SECTOR_SIZE;
+            logout("will write %u block map sectors starting from entry %u\n",
+                   n_sectors, bmap_first);
+            ret = bdrv_write(bs->file, offset, base, n_sectors);
         }
+    }
 
-        logout("now writing modified block map entry %u...%u\n",
-               bmap_first, bmap_last);
-        /* Write modified sectors from block map. */
-        bmap_first /= (SECTOR_SIZE / sizeof(uint32_t));
-        bmap_last /= (SECTOR_SIZE / sizeof(uint32_t));
-        n_sectors = bmap_last - bmap_first + 1;
-        offset = s->bmap_sector + bmap_first;
-        base = ((uint8_t *)&s->bmap[0]) + bmap_first * SECTOR_SIZE;
-        logout("will write %u block map sectors starting from entry %u\n",
-               n_sectors, bmap_first);
-        ret = bdrv_write(bs->file, offset, base, n_sectors);
+    if (block) {
+        g_free(block);
+        qemu_co_mutex_unlock(&s->write_lock);
     }
 
     return ret;
@@ -766,9 +802,9 @@ static BlockDriver bdrv_vdi = {
     .bdrv_co_is_allocated = vdi_co_is_allocated,
     .bdrv_make_empty = vdi_make_empty,
 
-    .bdrv_read = vdi_co_read,
+    .bdrv_co_readv = vdi_co_readv,
 #if defined(CONFIG_VDI_WRITE)
-    .bdrv_write = vdi_co_write,
+    .bdrv_co_writev = vdi_co_writev,
 #endif
 
     .bdrv_get_info = vdi_get_info,
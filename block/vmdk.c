@@ -66,6 +66,7 @@ typedef struct {
     uint16_t compressAlgorithm;
 } QEMU_PACKED VMDK4Header;
 
+/* Grain tables cached per extent, unless l2-cache-size says otherwise */
 #define L2_CACHE_SIZE 16
 
 typedef struct VmdkExtent {
@@ -84,15 +85,24 @@ typedef struct VmdkExtent {
     uint32_t l1_entry_sectors;
 
     unsigned int l2_size;
+    /* l2_cache_entries grain tables, found through l2_cache_index by their
+       offset and replaced in least recently used order */
     uint32_t *l2_cache;
-    uint32_t l2_cache_offsets[L2_CACHE_SIZE];
-    uint32_t l2_cache_counts[L2_CACHE_SIZE];
+    uint32_t *l2_cache_offsets;
+    uint64_t *l2_cache_last_use;
+    GHashTable *l2_cache_index;
+    unsigned int l2_cache_entries;
+    uint64_t l2_cache_clock;
 
     unsigned int cluster_sectors;
+
+    /* protects the grain tables and allocations; requests to different
+       extents run in parallel */
+    CoMutex lock;
 } VmdkExtent;
 
 typedef struct BDRVVmdkState {
-    CoMutex lock;
+    CoMutex lock;               /* protects the CID update */
     int desc_offset;
     bool cid_updated;
     uint32_t parent_cid;
@@ -196,6 +206,11 @@ static void vmdk_free_extents(BlockDriverState *bs)
         e = &s->extents[i];
         g_free(e->l1_table);
         g_free(e->l2_cache);
+        g_free(e->l2_cache_offsets);
+        g_free(e->l2_cache_last_use);
+        if (e->l2_cache_index) {
+            g_hash_table_destroy(e->l2_cache_index);
+        }
         g_free(e->l1_backup_table);
         if (e->file != bs->file) {
             bdrv_delete(e->file);
@@ -368,6 +383,18 @@ static VmdkExtent *vmdk_add_extent(BlockDriverState *bs,
     return extent;
 }
 
+/* Enough grain tables for l2-cache-size, but no more than the extent has */
+static unsigned int vmdk_l2_cache_entries(BlockDriverState *bs,
+                                          VmdkExtent *extent)
+{
+    uint64_t entries = L2_CACHE_SIZE;
+
+    if (bs->l2_cache_size) {
+        entries = bs->l2_cache_size / (extent->l2_size * sizeof(uint32_t));
+    }
+    return MAX(MIN(entries, extent->l1_size), 1);
+}
+
 static int vmdk_init_tables(BlockDriverState *bs, VmdkExtent *extent)
 {
     int ret;
@@ -401,8 +428,14 @@ static int vmdk_init_tables(BlockDriverState *bs, VmdkExtent *extent)
         }
     }
 
-    extent->l2_cache =
-        g_malloc(extent->l2_size * L2_CACHE_SIZE * sizeof(uint32_t));
+    extent->l2_cache_entries = vmdk_l2_cache_entries(bs, extent);
+    extent->l2_cache = g_malloc((size_t)extent->l2_size *
+                                extent->l2_cache_entries * sizeof(uint32_t));
+    extent->l2_cache_offsets =
+        g_malloc0(extent->l2_cache_entries * sizeof(uint32_t));
+    extent->l2_cache_last_use =
+        g_malloc0(extent->l2_cache_entries * sizeof(uint64_t));
+    extent->l2_cache_index = g_hash_table_new(g_direct_hash, g_direct_equal);
     return 0;
  fail_l1b:
     g_free(extent->l1_backup_table);
@@ -699,7 +732,7 @@ static int vmdk_open_desc_file(BlockDriverState *bs, int flags,
 
 static int vmdk_open(BlockDriverState *bs, int flags)
 {
-    int ret;
+    int ret, i;
     BDRVVmdkState *s = bs->opaque;
 
     if (vmdk_open_sparse(bs, bs->file, flags) == 0) {
@@ -717,6 +750,10 @@ static int vmdk_open(BlockDriverState *bs, int flags)
     }
     s->parent_cid = vmdk_read_cid(bs, 1);
     qemu_co_mutex_init(&s->lock);
+    /* only now, as adding extents moves them around */
+    for (i = 0; i < s->num_extents; i++) {
+        qemu_co_mutex_init(&s->extents[i].lock);
+    }
 
     /* Disable migration when VMDK images are used */
     error_set(&s->migration_blocker,
@@ -802,9 +839,8 @@ static int get_cluster_offset(BlockDriverState *bs,
                                     int allocate,
                                     uint64_t *cluster_offset)
 {
-    unsigned int l1_index, l2_offset, l2_index;
-    int min_index, i, j;
-    uint32_t min_count, *l2_table, tmp = 0;
+    unsigned int l1_index, l2_offset, l2_index, i, slot;
+    uint32_t *l2_table, tmp = 0;
 
     if (m_data) {
         m_data->valid = 0;
@@ -823,28 +859,27 @@ static int get_cluster_offset(BlockDriverState *bs,
     if (!l2_offset) {
         return -1;
     }
-    for (i = 0; i < L2_CACHE_SIZE; i++) {
-        if (l2_offset == extent->l2_cache_offsets[i]) {
-            /* increment the hit count */
-            if (++extent->l2_cache_counts[i] == 0xffffffff) {
-                for (j = 0; j < L2_CACHE_SIZE; j++) {
-                    extent->l2_cache_counts[j] >>= 1;
-                }
-            }
-            l2_table = extent->l2_cache + (i * extent->l2_size);
-            goto found;
+    slot = GPOINTER_TO_UINT(g_hash_table_lookup(extent->l2_cache_index,
+                                                GUINT_TO_POINTER(l2_offset)));
+    if (slot) {
+        slot--;
+        l2_table = extent->l2_cache + ((size_t)slot * extent->l2_size);
+        goto found;
+    }
+    /* not found: load it in the least recently used entry */
+    slot = 0;
+    for (i = 1; i < extent->l2_cache_entries; i++) {
+        if (extent->l2_cache_last_use[i] <
+            extent->l2_cache_last_use[slot]) {
+            slot = i;
         }
     }
-    /* not found: load a new entry in the least used one */
-    min_index = 0;
-    min_count = 0xffffffff;
-    for (i = 0; i < L2_CACHE_SIZE; i++) {
-        if (extent->l2_cache_counts[i] < min_count) {
-            min_count = extent->l2_cache_counts[i];
-            min_index = i;
-        }
+    if (extent->l2_cache_offsets[slot]) {
+        g_hash_table_remove(extent->l2_cache_index,
+                            GUINT_TO_POINTER(extent->l2_cache_offsets[slot]));
+        extent->l2_cache_offsets[slot] = 0;
     }
-    l2_table = extent->l2_cache + (min_index * extent->l2_size);
+    l2_table = extent->l2_cache + ((size_t)slot * extent->l2_size);
     if (bdrv_pread(
                 extent->file,
                 (int64_t)l2_offset * 512,
@@ -854,9 +889,11 @@ static int get_cluster_offset(BlockDriverState *bs,
         return -1;
     }
 
-    extent->l2_cache_offsets[min_index] = l2_offset;
-    extent->l2_cache_counts[min_index] = 1;
+    extent->l2_cache_offsets[slot] = l2_offset;
+    g_hash_table_insert(extent->l2_cache_index, GUINT_TO_POINTER(l2_offset),
+                        GUINT_TO_POINTER(slot + 1));
  found:
+    extent->l2_cache_last_use[slot] = ++extent->l2_cache_clock;
     l2_index = ((offset >> 9) / extent->cluster_sectors) % extent->l2_size;
     *cluster_offset = le32_to_cpu(l2_table[l2_index]);
 
@@ -929,10 +966,10 @@ static int coroutine_fn vmdk_co_is_allocated(BlockDriverState *bs,
     if (!extent) {
         return 0;
     }
-    qemu_co_mutex_lock(&s->lock);
+    qemu_co_mutex_lock(&extent->lock);
     ret = get_cluster_offset(bs, extent, NULL,
                             sector_num * 512, 0, &offset);
-    qemu_co_mutex_unlock(&s->lock);
+    qemu_co_mutex_unlock(&extent->lock);
     /* get_cluster_offset returning 0 means success */
     ret = !ret;
 
@@ -1052,8 +1089,52 @@ static int vmdk_read_extent(VmdkExtent *extent, int64_t cluster_offset,
     return ret;
 }
 
-static int vmdk_read(BlockDriverState *bs, int64_t sector_num,
-                    uint8_t *buf, int nb_sectors)
+/*
+ * Look up the cluster at @sector_num and the clusters after it in the
+ * extent that continue it: contiguous in the file if it is allocated,
+ * unallocated as well if it is not.  Returns the result of
+ * get_cluster_offset() for the cluster and stores the number of sectors
+ * of the run, which may go beyond @nb_sectors, in *@pnum.
+ */
+static int coroutine_fn vmdk_get_cluster_run(BlockDriverState *bs,
+                                             VmdkExtent *extent,
+                                             int64_t sector_num,
+                                             int nb_sectors,
+                                             uint64_t *cluster_offset,
+                                             uint64_t *pnum)
+{
+    uint64_t index_in_cluster = sector_num % extent->cluster_sectors;
+    uint64_t n = extent->cluster_sectors - index_in_cluster;
+    uint64_t next_offset;
+    int ret, next_ret;
+
+    qemu_co_mutex_lock(&extent->lock);
+    ret = get_cluster_offset(bs, extent, NULL, sector_num << 9, 0,
+                             cluster_offset);
+    /* compressed grains must be inflated one at a time */
+    while (!extent->flat && !extent->compressed && n < nb_sectors &&
+           sector_num + n < extent->end_sector) {
+        next_ret = get_cluster_offset(bs, extent, NULL,
+                                      (sector_num + n) << 9, 0, &next_offset);
+        if (next_ret != ret ||
+            (!ret && next_offset !=
+                     *cluster_offset + (index_in_cluster + n) * 512)) {
+            break;
+        }
+        n += extent->cluster_sectors;
+    }
+    qemu_co_mutex_unlock(&extent->lock);
+
+    *pnum = n;
+    return ret;
+}
+
+/*
+ * Allocated clusters never move, so the data is transferred without the
+ * extent lock once their offset is known.
+ */
+static int coroutine_fn vmdk_read(BlockDriverState *bs, int64_t sector_num,
+                                  uint8_t *buf, int nb_sectors)
 {
     BDRVVmdkState *s = bs->opaque;
     int ret;
@@ -1066,11 +1147,9 @@ static int vmdk_read(BlockDriverState *bs, int64_t sector_num,
         if (!extent) {
             return -EIO;
         }
-        ret = get_cluster_offset(
-                            bs, extent, NULL,
-                            sector_num << 9, 0, &cluster_offset);
+        ret = vmdk_get_cluster_run(bs, extent, sector_num, nb_sectors,
+                                   &cluster_offset, &n);
         index_in_cluster = sector_num % extent->cluster_sectors;
-        n = extent->cluster_sectors - index_in_cluster;
         if (n > nb_sectors) {
             n = nb_sectors;
         }
@@ -1104,24 +1183,71 @@ static int vmdk_read(BlockDriverState *bs, int64_t sector_num,
 
 static coroutine_fn int vmdk_co_read(BlockDriverState *bs, int64_t sector_num,
                                      uint8_t *buf, int nb_sectors)
+{
+    return vmdk_read(bs, sector_num, buf, nb_sectors);
+}
+
+/* Write to one cluster, called with the extent lock held */
+static int coroutine_fn vmdk_write_cluster(BlockDriverState *bs,
+                                           VmdkExtent *extent,
+                                           int64_t sector_num,
+                                           const uint8_t *buf, int n)
 {
     int ret;
-    BDRVVmdkState *s = bs->opaque;
-    qemu_co_mutex_lock(&s->lock);
-    ret = vmdk_read(bs, sector_num, buf, nb_sectors);
-    qemu_co_mutex_unlock(&s->lock);
-    return ret;
+    int64_t index_in_cluster;
+    uint64_t cluster_offset;
+    VmdkMetaData m_data;
+
+    ret = get_cluster_offset(
+                            bs,
+                            extent,
+                            &m_data,
+                            sector_num << 9, !extent->compressed,
+                            &cluster_offset);
+    if (extent->compressed) {
+        if (ret == 0) {
+            /* Refuse write to allocated cluster for streamOptimized */
+            fprintf(stderr,
+                    "VMDK: can't write to allocated cluster"
+                    " for streamOptimized\n");
+            return -EIO;
+        } else {
+            /* allocate */
+            ret = get_cluster_offset(
+                                    bs,
+                                    extent,
+                                    &m_data,
+                                    sector_num << 9, 1,
+                                    &cluster_offset);
+        }
+    }
+    if (ret) {
+        return -EINVAL;
+    }
+    index_in_cluster = sector_num % extent->cluster_sectors;
+
+    ret = vmdk_write_extent(extent,
+                    cluster_offset, index_in_cluster * 512,
+                    buf, n, sector_num);
+    if (ret) {
+        return ret;
+    }
+    if (m_data.valid) {
+        /* update L2 tables */
+        if (vmdk_L2update(extent, &m_data) == -1) {
+            return -EIO;
+        }
+    }
+    return 0;
 }
 
-static int vmdk_write(BlockDriverState *bs, int64_t sector_num,
-                     const uint8_t *buf, int nb_sectors)
+static int coroutine_fn vmdk_write(BlockDriverState *bs, int64_t sector_num,
+                                   const uint8_t *buf, int nb_sectors)
 {
     BDRVVmdkState *s = bs->opaque;
     VmdkExtent *extent = NULL;
-    int n, ret;
     int64_t index_in_cluster;
-    uint64_t cluster_offset;
-    VmdkMetaData m_data;
+    int n, ret;
 
     if (sector_num > bs->total_sectors) {
         fprintf(stderr,
@@ -1136,50 +1262,18 @@ static int vmdk_write(BlockDriverState *bs, int64_t sector_num,
         if (!extent) {
             return -EIO;
         }
-        ret = get_cluster_offset(
-                                bs,
-                                extent,
-                                &m_data,
-                                sector_num << 9, !extent->compressed,
-                                &cluster_offset);
-        if (extent->compressed) {
-            if (ret == 0) {
-                /* Refuse write to allocated cluster for streamOptimized */
-                fprintf(stderr,
-                        "VMDK: can't write to allocated cluster"
-                        " for streamOptimized\n");
-                return -EIO;
-            } else {
-                /* allocate */
-                ret = get_cluster_offset(
-                                        bs,
-                                        extent,
-                                        &m_data,
-                                        sector_num << 9, 1,
-                                        &cluster_offset);
-            }
-        }
-        if (ret) {
-            return -EINVAL;
-        }
         index_in_cluster = sector_num % extent->cluster_sectors;
         n = extent->cluster_sectors - index_in_cluster;
         if (n > nb_sectors) {
             n = nb_sectors;
         }
 
-        ret = vmdk_write_extent(extent,
-                        cluster_offset, index_in_cluster * 512,
-                        buf, n, sector_num);
+        qemu_co_mutex_lock(&extent->lock);
+        ret = vmdk_write_cluster(bs, extent, sector_num, buf, n);
+        qemu_co_mutex_unlock(&extent->lock);
         if (ret) {
             return ret;
         }
-        if (m_data.valid) {
-            /* update L2 tables */
-            if (vmdk_L2update(extent, &m_data) == -1) {
-                return -EIO;
-            }
-        }
         nb_sectors -= n;
         sector_num += n;
         buf += n * 512;
@@ -1187,11 +1281,16 @@ static int vmdk_write(BlockDriverState *bs, int64_t sector_num,
         /* update CID on the first write every time the virtual disk is
          * opened */
         if (!s->cid_updated) {
-            ret = vmdk_write_cid(bs, time(NULL));
-            if (ret < 0) {
-                return ret;
+            qemu_co_mutex_lock(&s->lock);
+            if (!s->cid_updated) {
+                ret = vmdk_write_cid(bs, time(NULL));
+                if (ret < 0) {
+                    qemu_co_mutex_unlock(&s->lock);
+                    return ret;
+                }
+                s->cid_updated = true;
             }
-            s->cid_updated = true;
+            qemu_co_mutex_unlock(&s->lock);
         }
     }
     return 0;
@@ -1200,12 +1299,7 @@ static int vmdk_write(BlockDriverState *bs, int64_t sector_num,
 static coroutine_fn int vmdk_co_write(BlockDriverState *bs, int64_t sector_num,
                                       const uint8_t *buf, int nb_sectors)
 {
-    int ret;
-    BDRVVmdkState *s = bs->opaque;
-    qemu_co_mutex_lock(&s->lock);
-    ret = vmdk_write(bs, sector_num, buf, nb_sectors);
-    qemu_co_mutex_unlock(&s->lock);
-    return ret;
+    return vmdk_write(bs, sector_num, buf, nb_sectors);
 }
 
 
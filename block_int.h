@@ -35,14 +35,13 @@
 #define BLOCK_FLAG_ENCRYPT          1
 #define BLOCK_FLAG_COMPAT6          4
 #define BLOCK_FLAG_LAZY_REFCOUNTS   8
+#define BLOCK_FLAG_DEDUP            16
+#define BLOCK_FLAG_ENCRYPT_XTS      32
 
 #define BLOCK_IO_LIMIT_READ     0
 #define BLOCK_IO_LIMIT_WRITE    1
 #define BLOCK_IO_LIMIT_TOTAL    2
 
-#define BLOCK_IO_SLICE_TIME     100000000
-#define NANOSECONDS_PER_SECOND  1000000000.0
-
 #define BLOCK_OPT_SIZE              "size"
 #define BLOCK_OPT_ENCRYPT           "encryption"
 #define BLOCK_OPT_COMPAT6           "compat6"
@@ -54,18 +53,33 @@
 #define BLOCK_OPT_SUBFMT            "subformat"
 #define BLOCK_OPT_COMPAT_LEVEL      "compat"
 #define BLOCK_OPT_LAZY_REFCOUNTS    "lazy_refcounts"
+#define BLOCK_OPT_COMPRESSION_LEVEL "compression_level"
+#define BLOCK_OPT_DEDUP             "dedup"
+#define BLOCK_OPT_ENCRYPT_MODE      "encryption_mode"
 
 typedef struct BdrvTrackedRequest BdrvTrackedRequest;
 
 typedef struct BlockIOLimit {
     int64_t bps[3];
     int64_t iops[3];
+    /* burst sizes in bytes and operations, 0 for the default */
+    int64_t bps_max[3];
+    int64_t iops_max[3];
+    /* size of one operation for IOPS accounting, 0 to count requests */
+    int64_t iops_size;
 } BlockIOLimit;
 
-typedef struct BlockIOBaseValue {
-    uint64_t bytes[2];
-    uint64_t ios[2];
-} BlockIOBaseValue;
+typedef struct BlockThrottleGroup BlockThrottleGroup;
+typedef struct BdrvSharedCache BdrvSharedCache;
+
+typedef struct BlockLatencyHistogram {
+    /* bins[i] counts the requests that took boundaries[i - 1] nanoseconds or
+     * more and less than boundaries[i]; the first bin starts at zero and the
+     * last one is unbounded.  nbins is 0 if the histogram is disabled. */
+    int nbins;
+    int64_t *boundaries;
+    uint64_t *bins;
+} BlockLatencyHistogram;
 
 typedef struct BlockJob BlockJob;
 
@@ -83,6 +97,18 @@ typedef struct BlockJobType {
 
     /** Optional callback for job types that support setting a speed limit */
     void (*set_speed)(BlockJob *job, int64_t speed, Error **errp);
+
+    /**
+     * Optional callback for job types whose completion must be triggered
+     * manually, like mirroring once source and target are in sync.
+     */
+    void (*complete)(BlockJob *job, Error **errp);
+
+    /**
+     * Optional callback invoked after a guest read copied sectors from the
+     * backing file into the image, so that the job can prefetch around them.
+     */
+    void (*copy_on_read)(BlockJob *job, int64_t sector_num, int nb_sectors);
 } BlockJobType;
 
 /**
@@ -185,6 +211,12 @@ struct BlockDriver {
      */
     void (*bdrv_invalidate_cache)(BlockDriverState *bs);
 
+    /*
+     * Write back the metadata kept in memory on the source of a migration,
+     * before the destination takes the image over.
+     */
+    int (*bdrv_inactivate)(BlockDriverState *bs);
+
     /*
      * Flushes all data that was already written to the OS all the way down to
      * the disk (for example raw-posix calls fsync()).
@@ -215,6 +247,11 @@ struct BlockDriver {
     int (*bdrv_snapshot_load_tmp)(BlockDriverState *bs,
                                   const char *snapshot_name);
     int (*bdrv_get_info)(BlockDriverState *bs, BlockDriverInfo *bdi);
+    /* whether the persistent dirty bitmap @name can be kept in the image */
+    bool (*bdrv_can_store_dirty_bitmap)(BlockDriverState *bs,
+                                        const char *name);
+    /* fills in the driver specific optional fields of @stats */
+    void (*bdrv_get_stats)(BlockDriverState *bs, BlockDeviceStats *stats);
 
     int (*bdrv_save_vmstate)(BlockDriverState *bs, const uint8_t *buf,
                              int64_t pos, int size);
@@ -255,6 +292,25 @@ struct BlockDriver {
      */
     int (*bdrv_has_zero_init)(BlockDriverState *bs);
 
+    /*
+     * Move the driver's file descriptor handlers, bottom halves and timers
+     * out of bdrv_get_aio_context(bs), and into @new_context.  Attaching
+     * returns -errno, with no side effect, if the driver can not run in
+     * @new_context; it can not fail for the main loop's context.  Drivers
+     * without these callbacks only run in the main loop's context.
+     */
+    void (*bdrv_detach_aio_context)(BlockDriverState *bs);
+    int (*bdrv_attach_aio_context)(BlockDriverState *bs,
+                                   AioContext *new_context);
+
+    /*
+     * Between plug and unplug, the driver may hold back the requests it
+     * is given to submit them together.  Drivers without these callbacks
+     * pass them on to bs->file.
+     */
+    void (*bdrv_io_plug)(BlockDriverState *bs);
+    void (*bdrv_io_unplug)(BlockDriverState *bs);
+
     QLIST_ENTRY(BlockDriver) list;
 };
 
@@ -296,21 +352,33 @@ struct BlockDriverState {
     /* number of in-flight copy-on-read requests */
     unsigned int copy_on_read_in_flight;
 
-    /* the time for latest disk I/O */
-    int64_t slice_time;
-    int64_t slice_start;
-    int64_t slice_end;
+    /* I/O throttling; devices in the same group share one budget */
     BlockIOLimit io_limits;
-    BlockIOBaseValue  io_base;
-    CoQueue      throttled_reqs;
-    QEMUTimer    *block_timer;
+    char         *throttle_group_name;
+    BlockThrottleGroup *throttle_group;
+    QLIST_ENTRY(BlockDriverState) throttle_list;
     bool         io_limits_enabled;
 
+    /* sizes in bytes of the L2 table and refcount block caches of image
+     * formats that have them, 0 for the driver default; used on open */
+    uint64_t l2_cache_size;
+    uint64_t refcount_cache_size;
+
+    /* size in bytes of the cache shared with other processes for the
+     * backing files, 0 for none; inherited along the backing chain.  The
+     * cache itself belongs to the image file of each backing file. */
+    uint64_t backing_cache_size;
+    BdrvSharedCache *shared_cache;
+
     /* I/O stats (display with "info blockstats"). */
     uint64_t nr_bytes[BDRV_MAX_IOTYPE];
     uint64_t nr_ops[BDRV_MAX_IOTYPE];
     uint64_t total_time_ns[BDRV_MAX_IOTYPE];
     uint64_t wr_highest_sector;
+    BlockLatencyHistogram latency_histogram[BDRV_MAX_IOTYPE];
+
+    /* number of requests being processed by this layer */
+    unsigned int in_flight;
 
     /* Whether the disk can expand beyond total_sectors */
     int growable;
@@ -329,9 +397,13 @@ struct BlockDriverState {
     char device_name[32];
     unsigned long *dirty_bitmap;
     int64_t dirty_count;
+    QLIST_HEAD(, BdrvDirtyBitmap) dirty_bitmaps;
     int in_use; /* users other than guest access, eg. block migration */
     QTAILQ_ENTRY(BlockDriverState) list;
 
+    /* event loop that dispatches the callbacks of this BDS */
+    AioContext *aio_context;
+
     QLIST_HEAD(, BdrvTrackedRequest) tracked_requests;
 
     /* long-running background operation */
@@ -342,6 +414,17 @@ int get_tmp_filename(char *filename, int size);
 
 void bdrv_set_io_limits(BlockDriverState *bs,
                         BlockIOLimit *io_limits);
+void bdrv_set_throttle_group(BlockDriverState *bs, const char *group);
+void bdrv_set_metadata_cache_sizes(BlockDriverState *bs,
+                                   uint64_t l2_cache_size,
+                                   uint64_t refcount_cache_size);
+void bdrv_set_backing_cache_size(BlockDriverState *bs, uint64_t size);
+
+/* block/shared-cache.c */
+BdrvSharedCache *bdrv_shared_cache_open(BlockDriverState *bs, uint64_t size);
+void bdrv_shared_cache_close(BdrvSharedCache *c);
+int coroutine_fn bdrv_shared_cache_co_readv(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors, QEMUIOVector *qiov);
 
 #ifdef _WIN32
 int is_windows_drive(const char *filename);
@@ -381,14 +464,42 @@ void *block_job_create(const BlockJobType *job_type, BlockDriverState *bs,
 void block_job_sleep_ns(BlockJob *job, QEMUClock *clock, int64_t ns);
 
 /**
- * block_job_complete:
+ * block_job_completed:
  * @job: The job being completed.
  * @ret: The status code.
  *
  * Call the completion function that was registered at creation time, and
  * free @job.
  */
-void block_job_complete(BlockJob *job, int ret);
+void block_job_completed(BlockJob *job, int ret);
+
+/**
+ * block_job_complete:
+ * @job: The job to be completed.
+ * @errp: Error object.
+ *
+ * Asynchronously complete the specified job.  Only jobs that have a
+ * #BlockJobType.complete callback and are not being cancelled can be
+ * completed this way.
+ */
+void block_job_complete(BlockJob *job, Error **errp);
+
+/**
+ * block_job_ready:
+ * @job: The job which is now ready to be completed.
+ *
+ * Send a BLOCK_JOB_READY event for the specified job.
+ */
+void block_job_ready(BlockJob *job);
+
+/**
+ * qobject_from_block_job:
+ * @job: The job whose information is requested.
+ *
+ * Return a QDict corresponding to the information that is sent with
+ * block job events.
+ */
+QObject *qobject_from_block_job(BlockJob *job);
 
 /**
  * block_job_set_speed:
@@ -456,4 +567,24 @@ void stream_start(BlockDriverState *bs, BlockDriverState *base,
                   BlockDriverCompletionFunc *cb,
                   void *opaque, Error **errp);
 
+/**
+ * mirror_start:
+ * @bs: Block device to operate on.
+ * @target: Block device to write to.
+ * @speed: The maximum speed, in bytes per second, or 0 for unlimited.
+ * @mode: Whether to collapse all images in the chain to the target.
+ * @cb: Completion function for the job.
+ * @opaque: Opaque pointer value passed to @cb.
+ * @errp: Error object.
+ *
+ * Start a mirroring operation on @bs.  Clusters that are allocated
+ * in @bs will be written to @target until the job is cancelled or
+ * manually completed.  At the end of a successful mirroring job,
+ * @bs will be switched to read from @target.
+ */
+void mirror_start(BlockDriverState *bs, BlockDriverState *target,
+                  int64_t speed, MirrorSyncMode mode,
+                  BlockDriverCompletionFunc *cb,
+                  void *opaque, Error **errp);
+
 #endif /* BLOCK_INT_H */
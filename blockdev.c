@@ -15,6 +15,7 @@
 #include "qemu-config.h"
 #include "qemu-objects.h"
 #include "sysemu.h"
+#include "qemu-timer.h"
 #include "block_int.h"
 #include "qmp-commands.h"
 #include "trace.h"
@@ -258,6 +259,7 @@ static bool do_check_io_limits(BlockIOLimit *io_limits)
 {
     bool bps_flag;
     bool iops_flag;
+    int i;
 
     assert(io_limits);
 
@@ -271,9 +273,30 @@ static bool do_check_io_limits(BlockIOLimit *io_limits)
         return false;
     }
 
+    /* a burst size only makes sense together with its limit */
+    for (i = 0; i < 3; i++) {
+        if ((io_limits->bps_max[i] && !io_limits->bps[i]) ||
+            (io_limits->iops_max[i] && !io_limits->iops[i])) {
+            return false;
+        }
+    }
+
     return true;
 }
 
+static bool do_check_io_limits_range(BlockIOLimit *io_limits)
+{
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        if (io_limits->bps[i] < 0 || io_limits->iops[i] < 0 ||
+            io_limits->bps_max[i] < 0 || io_limits->iops_max[i] < 0) {
+            return false;
+        }
+    }
+    return io_limits->iops_size >= 0;
+}
+
 DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
 {
     const char *buf;
@@ -313,6 +336,10 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
     ro = qemu_opt_get_bool(opts, "readonly", 0);
     copy_on_read = qemu_opt_get_bool(opts, "copy-on-read", false);
 
+    if (qemu_opt_get_bool(opts, "lazy-refcounts", false)) {
+        bdrv_flags |= BDRV_O_LAZY_REFCOUNTS;
+    }
+
     file = qemu_opt_get(opts, "file");
     serial = qemu_opt_get(opts, "serial");
 
@@ -390,7 +417,7 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
         if (!strcmp(buf, "native")) {
             bdrv_flags |= BDRV_O_NATIVE_AIO;
         } else if (!strcmp(buf, "threads")) {
-            /* this is the default */
+            bdrv_flags |= BDRV_O_THREAD_AIO;
         } else {
            error_report("invalid aio option");
            return NULL;
@@ -425,10 +452,24 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
                            qemu_opt_get_number(opts, "iops_rd", 0);
     io_limits.iops[BLOCK_IO_LIMIT_WRITE] =
                            qemu_opt_get_number(opts, "iops_wr", 0);
+    io_limits.bps_max[BLOCK_IO_LIMIT_TOTAL]  =
+                           qemu_opt_get_number(opts, "bps_max", 0);
+    io_limits.bps_max[BLOCK_IO_LIMIT_READ]   =
+                           qemu_opt_get_number(opts, "bps_rd_max", 0);
+    io_limits.bps_max[BLOCK_IO_LIMIT_WRITE]  =
+                           qemu_opt_get_number(opts, "bps_wr_max", 0);
+    io_limits.iops_max[BLOCK_IO_LIMIT_TOTAL] =
+                           qemu_opt_get_number(opts, "iops_max", 0);
+    io_limits.iops_max[BLOCK_IO_LIMIT_READ]  =
+                           qemu_opt_get_number(opts, "iops_rd_max", 0);
+    io_limits.iops_max[BLOCK_IO_LIMIT_WRITE] =
+                           qemu_opt_get_number(opts, "iops_wr_max", 0);
+    io_limits.iops_size = qemu_opt_get_number(opts, "iops_size", 0);
 
     if (!do_check_io_limits(&io_limits)) {
         error_report("bps(iops) and bps_rd/bps_wr(iops_rd/iops_wr) "
-                     "cannot be used at the same time");
+                     "cannot be used at the same time, and burst sizes "
+                     "need the matching limit");
         return NULL;
     }
 
@@ -544,6 +585,14 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
 
     /* disk I/O throttling */
     bdrv_set_io_limits(dinfo->bdrv, &io_limits);
+    bdrv_set_throttle_group(dinfo->bdrv, qemu_opt_get(opts, "group"));
+
+    bdrv_set_metadata_cache_sizes(dinfo->bdrv,
+                                  qemu_opt_get_size(opts, "l2-cache-size", 0),
+                                  qemu_opt_get_size(opts,
+                                                    "refcount-cache-size", 0));
+    bdrv_set_backing_cache_size(dinfo->bdrv,
+                                qemu_opt_get_size(opts, "backing-cache", 0));
 
     switch(type) {
     case IF_IDE:
@@ -825,6 +874,256 @@ exit:
     return;
 }
 
+/*
+ * Frozen transactions: freeze the guest filesystems through the guest
+ * agent, run a transaction and thaw again, all from QEMU so that the guest
+ * stays frozen for the agent round trips and the snapshots only.  The agent
+ * answers asynchronously; FROZEN_TRANSACTION_COMPLETED reports the outcome.
+ */
+
+#define FROZEN_TIMEOUT_DEFAULT 10000    /* ms */
+
+static const GuestAgentOps *guest_agent_ops;
+
+void guest_agent_register(const GuestAgentOps *ops)
+{
+    guest_agent_ops = ops;
+}
+
+typedef enum {
+    FROZEN_FREEZING,
+    FROZEN_THAWING,
+} FrozenState;
+
+typedef struct FrozenTransaction {
+    char *agent;
+    BlockdevActionList *actions;
+    FrozenState state;
+    QEMUTimer *timer;
+    int64_t timeout;
+    int64_t start;
+    int64_t snapshot_time;
+    int64_t frozen;
+    char *error;
+} FrozenTransaction;
+
+static FrozenTransaction *frozen_transaction;
+
+/* the marshaller frees the actions when the command returns */
+static BlockdevActionList *blockdev_action_list_copy(BlockdevActionList *list)
+{
+    BlockdevActionList *copy = NULL, **next = &copy;
+    BlockdevSnapshot *src, *snap;
+    BlockdevAction *action;
+
+    for (; list; list = list->next) {
+        action = g_malloc0(sizeof(*action));
+        action->kind = list->value->kind;
+        switch (action->kind) {
+        case BLOCKDEV_ACTION_KIND_BLOCKDEV_SNAPSHOT_SYNC:
+            src = list->value->blockdev_snapshot_sync;
+            snap = g_malloc0(sizeof(*snap));
+            snap->device = g_strdup(src->device);
+            snap->snapshot_file = g_strdup(src->snapshot_file);
+            snap->has_format = src->has_format;
+            snap->format = g_strdup(src->format);
+            snap->has_mode = src->has_mode;
+            snap->mode = src->mode;
+            action->blockdev_snapshot_sync = snap;
+            break;
+        default:
+            abort();
+        }
+        *next = g_malloc0(sizeof(**next));
+        (*next)->value = action;
+        next = &(*next)->next;
+    }
+    return copy;
+}
+
+static void frozen_transaction_finish(FrozenTransaction *s)
+{
+    int64_t now = qemu_get_clock_ns(rt_clock);
+    QObject *data;
+
+    data = qobject_from_jsonf("{ 'frozen': %" PRId64 ", "
+                              "'freeze-time': %" PRId64 ", "
+                              "'snapshot-time': %" PRId64 " }",
+                              s->frozen, (now - s->start) / 1000,
+                              s->snapshot_time / 1000);
+    if (s->error) {
+        qdict_put(qobject_to_qdict(data), "error", qstring_from_str(s->error));
+    }
+    monitor_protocol_event(QEVENT_FROZEN_TRANSACTION_COMPLETED, data);
+    qobject_decref(data);
+
+    qemu_del_timer(s->timer);
+    qemu_free_timer(s->timer);
+    qapi_free_BlockdevActionList(s->actions);
+    g_free(s->agent);
+    g_free(s->error);
+    g_free(s);
+    frozen_transaction = NULL;
+}
+
+static void frozen_transaction_fail(FrozenTransaction *s, const char *fmt, ...)
+    GCC_FMT_ATTR(2, 3);
+
+static void frozen_transaction_fail(FrozenTransaction *s, const char *fmt, ...)
+{
+    va_list ap;
+
+    /* keep the first error */
+    if (!s->error) {
+        va_start(ap, fmt);
+        s->error = g_strdup_vprintf(fmt, ap);
+        va_end(ap);
+    }
+}
+
+static void frozen_transaction_reply(void *opaque, QObject *reply);
+
+static void frozen_transaction_thaw(FrozenTransaction *s)
+{
+    int ret;
+
+    s->state = FROZEN_THAWING;
+    ret = guest_agent_ops->command(s->agent, "guest-fsfreeze-thaw",
+                                   frozen_transaction_reply, s);
+    if (ret < 0) {
+        frozen_transaction_fail(s, "guest-fsfreeze-thaw could not be sent: %s",
+                                strerror(-ret));
+        frozen_transaction_finish(s);
+        return;
+    }
+    qemu_mod_timer(s->timer, qemu_get_clock_ms(rt_clock) + s->timeout);
+}
+
+static void frozen_transaction_reply(void *opaque, QObject *reply)
+{
+    FrozenTransaction *s = opaque;
+    const char *cmd = s->state == FROZEN_FREEZING ? "guest-fsfreeze-freeze"
+                                                  : "guest-fsfreeze-thaw";
+    Error *err = NULL;
+    QDict *qdict;
+    int64_t start;
+
+    if (!reply) {
+        frozen_transaction_fail(s, "guest agent closed during %s", cmd);
+        frozen_transaction_finish(s);
+        return;
+    }
+
+    qdict = qobject_to_qdict(reply);
+    if (!qdict_haskey(qdict, "return")) {
+        /* a failed freeze thaws what it had frozen */
+        frozen_transaction_fail(s, "%s failed", cmd);
+        frozen_transaction_finish(s);
+        return;
+    }
+
+    if (s->state == FROZEN_THAWING) {
+        frozen_transaction_finish(s);
+        return;
+    }
+
+    s->frozen = qdict_get_try_int(qdict, "return", 0);
+    start = qemu_get_clock_ns(rt_clock);
+    qmp_transaction(s->actions, &err);
+    s->snapshot_time = qemu_get_clock_ns(rt_clock) - start;
+    if (err) {
+        frozen_transaction_fail(s, "%s", error_get_pretty(err));
+        error_free(err);
+    }
+    frozen_transaction_thaw(s);
+}
+
+static void frozen_transaction_timeout(void *opaque)
+{
+    FrozenTransaction *s = opaque;
+
+    guest_agent_ops->cancel(s->agent);
+    if (s->state == FROZEN_FREEZING) {
+        /* the freeze may still complete, so thaw anyway */
+        frozen_transaction_fail(s, "guest-fsfreeze-freeze timed out");
+        frozen_transaction_thaw(s);
+    } else {
+        frozen_transaction_fail(s, "guest-fsfreeze-thaw timed out");
+        frozen_transaction_finish(s);
+    }
+}
+
+void qmp_frozen_transaction(const char *agent, BlockdevActionList *actions,
+                            bool has_timeout, int64_t timeout, Error **errp)
+{
+    FrozenTransaction *s;
+    BlockdevActionList *entry;
+    const char *device;
+    int ret;
+
+    if (frozen_transaction) {
+        error_set(errp, QERR_DEVICE_IN_USE, frozen_transaction->agent);
+        return;
+    }
+    if (!has_timeout) {
+        timeout = FROZEN_TIMEOUT_DEFAULT;
+    } else if (timeout <= 0) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "timeout",
+                  "a positive number of milliseconds");
+        return;
+    }
+
+    /* catch the obvious mistakes before the guest is frozen */
+    for (entry = actions; entry; entry = entry->next) {
+        switch (entry->value->kind) {
+        case BLOCKDEV_ACTION_KIND_BLOCKDEV_SNAPSHOT_SYNC:
+            device = entry->value->blockdev_snapshot_sync->device;
+            if (!bdrv_find(device)) {
+                error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+                return;
+            }
+            break;
+        default:
+            abort();
+        }
+    }
+
+    s = g_malloc0(sizeof(*s));
+    s->agent = g_strdup(agent);
+    s->timeout = timeout;
+    s->state = FROZEN_FREEZING;
+    s->start = qemu_get_clock_ns(rt_clock);
+
+    ret = guest_agent_ops ? guest_agent_ops->command(agent,
+                                                     "guest-fsfreeze-freeze",
+                                                     frozen_transaction_reply,
+                                                     s)
+                          : -ENODEV;
+    switch (ret) {
+    case 0:
+        break;
+    case -ENODEV:
+        error_set(errp, QERR_DEVICE_NOT_FOUND, agent);
+        goto fail;
+    case -ENOTCONN:
+        error_set(errp, QERR_DEVICE_NOT_ACTIVE, agent);
+        goto fail;
+    default:
+        error_set(errp, QERR_DEVICE_IN_USE, agent);
+        goto fail;
+    }
+
+    s->actions = blockdev_action_list_copy(actions);
+    s->timer = qemu_new_timer_ms(rt_clock, frozen_transaction_timeout, s);
+    qemu_mod_timer(s->timer, qemu_get_clock_ms(rt_clock) + timeout);
+    frozen_transaction = s;
+    return;
+
+fail:
+    g_free(s->agent);
+    g_free(s);
+}
+
 
 static void eject_device(BlockDriverState *bs, int force, Error **errp)
 {
@@ -942,7 +1241,16 @@ void qmp_change_blockdev(const char *device, const char *filename,
 /* throttling disk I/O limits */
 void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
                                int64_t bps_wr, int64_t iops, int64_t iops_rd,
-                               int64_t iops_wr, Error **errp)
+                               int64_t iops_wr,
+                               bool has_bps_max, int64_t bps_max,
+                               bool has_bps_rd_max, int64_t bps_rd_max,
+                               bool has_bps_wr_max, int64_t bps_wr_max,
+                               bool has_iops_max, int64_t iops_max,
+                               bool has_iops_rd_max, int64_t iops_rd_max,
+                               bool has_iops_wr_max, int64_t iops_wr_max,
+                               bool has_iops_size, int64_t iops_size,
+                               bool has_group, const char *group,
+                               Error **errp)
 {
     BlockIOLimit io_limits;
     BlockDriverState *bs;
@@ -959,22 +1267,130 @@ void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
     io_limits.iops[BLOCK_IO_LIMIT_TOTAL]= iops;
     io_limits.iops[BLOCK_IO_LIMIT_READ] = iops_rd;
     io_limits.iops[BLOCK_IO_LIMIT_WRITE]= iops_wr;
+    io_limits.bps_max[BLOCK_IO_LIMIT_TOTAL] = has_bps_max ? bps_max : 0;
+    io_limits.bps_max[BLOCK_IO_LIMIT_READ]  = has_bps_rd_max ? bps_rd_max : 0;
+    io_limits.bps_max[BLOCK_IO_LIMIT_WRITE] = has_bps_wr_max ? bps_wr_max : 0;
+    io_limits.iops_max[BLOCK_IO_LIMIT_TOTAL] = has_iops_max ? iops_max : 0;
+    io_limits.iops_max[BLOCK_IO_LIMIT_READ] = has_iops_rd_max ? iops_rd_max : 0;
+    io_limits.iops_max[BLOCK_IO_LIMIT_WRITE] = has_iops_wr_max ? iops_wr_max : 0;
+    io_limits.iops_size = has_iops_size ? iops_size : 0;
 
     if (!do_check_io_limits(&io_limits)) {
         error_set(errp, QERR_INVALID_PARAMETER_COMBINATION);
         return;
     }
+    if (!do_check_io_limits_range(&io_limits)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "limits",
+                  "a non-negative number");
+        return;
+    }
 
     bs->io_limits = io_limits;
-    bs->slice_time = BLOCK_IO_SLICE_TIME;
+    if (has_group) {
+        bdrv_set_throttle_group(bs, group[0] ? group : NULL);
+    }
 
     if (!bs->io_limits_enabled && bdrv_io_limits_enabled(bs)) {
         bdrv_io_limits_enable(bs);
     } else if (bs->io_limits_enabled && !bdrv_io_limits_enabled(bs)) {
         bdrv_io_limits_disable(bs);
     } else {
-        if (bs->block_timer) {
-            qemu_mod_timer(bs->block_timer, qemu_get_clock_ns(vm_clock));
+        bdrv_io_limits_update(bs);
+    }
+}
+
+/* Latency histograms have at most this many bins */
+#define MAX_LATENCY_BINS 64
+
+/*
+ * Parse a comma-separated list of strictly increasing latencies.  Returns
+ * the number of boundaries, or -1 if the list is malformed.
+ */
+static int parse_latency_boundaries(const char *str, int64_t *boundaries)
+{
+    int n = 0;
+
+    while (*str) {
+        char *end;
+        int64_t val;
+
+        if (n == MAX_LATENCY_BINS - 1) {
+            return -1;
+        }
+        errno = 0;
+        val = strtoll(str, &end, 10);
+        if (errno || end == str || val <= (n ? boundaries[n - 1] : 0)) {
+            return -1;
+        }
+        boundaries[n++] = val;
+
+        if (*end == ',') {
+            end++;
+            if (!*end) {
+                return -1;
+            }
+        } else if (*end) {
+            return -1;
+        }
+        str = end;
+    }
+
+    return n;
+}
+
+void qmp_block_latency_histogram_set(const char *device, bool has_boundaries,
+                                     const char *boundaries,
+                                     bool has_boundaries_read,
+                                     const char *boundaries_read,
+                                     bool has_boundaries_write,
+                                     const char *boundaries_write,
+                                     bool has_boundaries_flush,
+                                     const char *boundaries_flush,
+                                     Error **errp)
+{
+    static const char *names[BDRV_MAX_IOTYPE] = {
+        [BDRV_ACCT_READ]    = "boundaries-read",
+        [BDRV_ACCT_WRITE]   = "boundaries-write",
+        [BDRV_ACCT_FLUSH]   = "boundaries-flush",
+    };
+    const char *str[BDRV_MAX_IOTYPE] = {
+        [BDRV_ACCT_READ]    = has_boundaries_read ? boundaries_read : NULL,
+        [BDRV_ACCT_WRITE]   = has_boundaries_write ? boundaries_write : NULL,
+        [BDRV_ACCT_FLUSH]   = has_boundaries_flush ? boundaries_flush : NULL,
+    };
+    int64_t values[BDRV_MAX_IOTYPE][MAX_LATENCY_BINS - 1];
+    int n[BDRV_MAX_IOTYPE];
+    BlockDriverState *bs;
+    int i;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+        return;
+    }
+
+    /* check everything before changing anything */
+    for (i = 0; i < BDRV_MAX_IOTYPE; i++) {
+        const char *name = names[i];
+
+        if (!str[i] && has_boundaries) {
+            str[i] = boundaries;
+            name = "boundaries";
+        }
+        if (!str[i]) {
+            continue;
+        }
+        n[i] = parse_latency_boundaries(str[i], values[i]);
+        if (n[i] < 0) {
+            error_set(errp, QERR_INVALID_PARAMETER_VALUE, name,
+                      "a list of increasing latencies in nanoseconds");
+            return;
+        }
+    }
+
+    for (i = 0; i < BDRV_MAX_IOTYPE; i++) {
+        if (str[i]) {
+            bdrv_set_latency_histogram(bs, i, values[i], n[i]);
         }
     }
 }
@@ -1049,26 +1465,126 @@ void qmp_block_resize(const char *device, int64_t size, Error **errp)
     }
 }
 
-static QObject *qobject_from_block_job(BlockJob *job)
+#define DEFAULT_DIRTY_BITMAP_GRANULARITY 65536
+
+void qmp_block_dirty_bitmap_add(const char *device, const char *name,
+                                bool has_granularity, int64_t granularity,
+                                bool has_persistent, bool persistent,
+                                Error **errp)
+{
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+        return;
+    }
+    if (!bdrv_is_inserted(bs)) {
+        error_set(errp, QERR_DEVICE_HAS_NO_MEDIUM, device);
+        return;
+    }
+    if (has_persistent && persistent &&
+        (bdrv_is_read_only(bs) || !bdrv_can_store_dirty_bitmap(bs, name))) {
+        error_set(errp, QERR_BLOCK_FORMAT_FEATURE_NOT_SUPPORTED,
+                  bdrv_get_format_name(bs), device, "persistent dirty bitmaps");
+        return;
+    }
+
+    bitmap = bdrv_create_dirty_bitmap(bs, name,
+                                      has_granularity ? granularity :
+                                      DEFAULT_DIRTY_BITMAP_GRANULARITY, errp);
+    if (bitmap && has_persistent) {
+        bdrv_dirty_bitmap_set_persistent(bitmap, persistent);
+    }
+}
+
+static BdrvDirtyBitmap *find_dirty_bitmap(const char *device,
+                                          const char *name,
+                                          BlockDriverState **pbs,
+                                          Error **errp)
+{
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+        return NULL;
+    }
+    bitmap = bdrv_find_dirty_bitmap(bs, name);
+    if (!bitmap) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "name",
+                  "the name of a dirty bitmap of the device");
+        return NULL;
+    }
+    if (pbs) {
+        *pbs = bs;
+    }
+    return bitmap;
+}
+
+void qmp_block_dirty_bitmap_remove(const char *device, const char *name,
+                                   Error **errp)
 {
-    return qobject_from_jsonf("{ 'type': %s,"
-                              "'device': %s,"
-                              "'len': %" PRId64 ","
-                              "'offset': %" PRId64 ","
-                              "'speed': %" PRId64 " }",
-                              job->job_type->job_type,
-                              bdrv_get_device_name(job->bs),
-                              job->len,
-                              job->offset,
-                              job->speed);
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+
+    bitmap = find_dirty_bitmap(device, name, &bs, errp);
+    if (bitmap) {
+        bdrv_release_dirty_bitmap(bs, bitmap);
+    }
 }
 
-static void block_stream_cb(void *opaque, int ret)
+void qmp_block_dirty_bitmap_clear(const char *device, const char *name,
+                                  Error **errp)
+{
+    BdrvDirtyBitmap *bitmap;
+
+    bitmap = find_dirty_bitmap(device, name, NULL, errp);
+    if (bitmap) {
+        bdrv_clear_dirty_bitmap(bitmap);
+    }
+}
+
+BlockDirtyRangeList *qmp_query_block_dirty_bitmap(const char *device,
+                                                  const char *name,
+                                                  bool has_clear, bool clear,
+                                                  Error **errp)
+{
+    BlockDirtyRangeList *head = NULL, **tail = &head;
+    BdrvDirtyBitmap *bitmap;
+    int64_t offset = 0, len;
+
+    bitmap = find_dirty_bitmap(device, name, NULL, errp);
+    if (!bitmap) {
+        return NULL;
+    }
+
+    while ((offset = bdrv_dirty_bitmap_next_range(bitmap, offset,
+                                                  &len)) >= 0) {
+        BlockDirtyRangeList *entry = g_malloc0(sizeof(*entry));
+
+        entry->value = g_malloc0(sizeof(*entry->value));
+        entry->value->offset = offset;
+        entry->value->length = len;
+        *tail = entry;
+        tail = &entry->next;
+        offset += len;
+    }
+
+    if (has_clear && clear) {
+        bdrv_clear_dirty_bitmap(bitmap);
+    }
+    return head;
+}
+
+static void block_job_cb(void *opaque, int ret)
 {
     BlockDriverState *bs = opaque;
     QObject *obj;
 
-    trace_block_stream_cb(bs, bs->job, ret);
+    trace_block_job_cb(bs, bs->job, ret);
 
     assert(bs->job);
     obj = qobject_from_block_job(bs->job);
@@ -1110,7 +1626,7 @@ void qmp_block_stream(const char *device, bool has_base,
     }
 
     stream_start(bs, base_bs, base, has_speed ? speed : 0,
-                 block_stream_cb, bs, &local_err);
+                 block_job_cb, bs, &local_err);
     if (error_is_set(&local_err)) {
         error_propagate(errp, local_err);
         return;
@@ -1124,6 +1640,125 @@ void qmp_block_stream(const char *device, bool has_base,
     trace_qmp_block_stream(bs, bs->job);
 }
 
+void qmp_drive_mirror(const char *device, const char *target,
+                      bool has_format, const char *format,
+                      enum MirrorSyncMode sync,
+                      bool has_mode, enum NewImageMode mode,
+                      bool has_speed, int64_t speed, Error **errp)
+{
+    BlockDriverState *bs;
+    BlockDriverState *source, *target_bs;
+    BlockDriver *proto_drv;
+    BlockDriver *drv = NULL;
+    Error *local_err = NULL;
+    int flags;
+    uint64_t size;
+    int ret;
+
+    if (!has_speed) {
+        speed = 0;
+    }
+    if (!has_mode) {
+        mode = NEW_IMAGE_MODE_ABSOLUTE_PATHS;
+    }
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+        return;
+    }
+
+    if (!bdrv_is_inserted(bs)) {
+        error_set(errp, QERR_DEVICE_HAS_NO_MEDIUM, device);
+        return;
+    }
+
+    if (!has_format) {
+        format = mode == NEW_IMAGE_MODE_EXISTING ? NULL : bs->drv->format_name;
+    }
+    if (format) {
+        drv = bdrv_find_format(format);
+        if (!drv) {
+            error_set(errp, QERR_INVALID_BLOCK_FORMAT, format);
+            return;
+        }
+    }
+
+    if (bdrv_in_use(bs)) {
+        error_set(errp, QERR_DEVICE_IN_USE, device);
+        return;
+    }
+
+    flags = bs->open_flags | BDRV_O_RDWR;
+    source = bs->backing_hd;
+    if (!source && sync == MIRROR_SYNC_MODE_TOP) {
+        sync = MIRROR_SYNC_MODE_FULL;
+    }
+
+    proto_drv = bdrv_find_protocol(target);
+    if (!proto_drv) {
+        error_set(errp, QERR_INVALID_BLOCK_FORMAT, format);
+        return;
+    }
+
+    bdrv_get_geometry(bs, &size);
+    size *= 512;
+    if (sync == MIRROR_SYNC_MODE_FULL && mode != NEW_IMAGE_MODE_EXISTING) {
+        /* create new image w/o backing file */
+        assert(format && drv);
+        ret = bdrv_img_create(target, format,
+                              NULL, NULL, NULL, size, flags);
+    } else {
+        switch (mode) {
+        case NEW_IMAGE_MODE_EXISTING:
+            ret = 0;
+            break;
+        case NEW_IMAGE_MODE_ABSOLUTE_PATHS:
+            /* create new image with backing file */
+            if (sync == MIRROR_SYNC_MODE_NONE) {
+                source = bs;
+            }
+            ret = bdrv_img_create(target, format,
+                                  source->filename,
+                                  source->drv->format_name,
+                                  NULL, size, flags);
+            break;
+        default:
+            abort();
+        }
+    }
+
+    if (ret) {
+        error_set(errp, QERR_OPEN_FILE_FAILED, target);
+        return;
+    }
+
+    /* Mirroring takes care of copy-on-write using the source's backing
+     * file.  The target's backing file is only opened when the job
+     * completes.
+     */
+    target_bs = bdrv_new("");
+    ret = bdrv_open(target_bs, target, flags | BDRV_O_NO_BACKING, drv);
+
+    if (ret < 0) {
+        bdrv_delete(target_bs);
+        error_set(errp, QERR_OPEN_FILE_FAILED, target);
+        return;
+    }
+
+    mirror_start(bs, target_bs, speed, sync, block_job_cb, bs, &local_err);
+    if (local_err != NULL) {
+        bdrv_delete(target_bs);
+        error_propagate(errp, local_err);
+        return;
+    }
+
+    /* Grab a reference so hotplug does not delete the BlockDriverState from
+     * underneath us.
+     */
+    drive_get_ref(drive_get_by_blockdev(bs));
+}
+
 static BlockJob *find_block_job(const char *device)
 {
     BlockDriverState *bs;
@@ -1160,6 +1795,19 @@ void qmp_block_job_cancel(const char *device, Error **errp)
     block_job_cancel(job);
 }
 
+void qmp_block_job_complete(const char *device, Error **errp)
+{
+    BlockJob *job = find_block_job(device);
+
+    if (!job) {
+        error_set(errp, QERR_DEVICE_NOT_ACTIVE, device);
+        return;
+    }
+
+    trace_qmp_block_job_complete(job);
+    block_job_complete(job, errp);
+}
+
 static void do_qmp_query_block_jobs_one(void *opaque, BlockDriverState *bs)
 {
     BlockJobInfoList **prev = opaque;
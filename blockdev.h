@@ -57,6 +57,23 @@ DriveInfo *drive_init(QemuOpts *arg, int default_to_scsi);
 
 DriveInfo *add_init_drive(const char *opts);
 
+/*
+ * The guest agent channel used by frozen-transaction.  @command sends an
+ * agent command without arguments to the agent behind device @id and
+ * returns a negative errno if it cannot; @cb then gets the reply, valid
+ * only during the call, or NULL if the agent went away.  @cancel forgets
+ * about the pending command.
+ */
+typedef void GuestAgentReplyFunc(void *opaque, QObject *reply);
+
+typedef struct GuestAgentOps {
+    int (*command)(const char *id, const char *cmd, GuestAgentReplyFunc *cb,
+                   void *opaque);
+    void (*cancel)(const char *id);
+} GuestAgentOps;
+
+void guest_agent_register(const GuestAgentOps *ops);
+
 void qmp_change_blockdev(const char *device, const char *filename,
                          bool has_format, const char *format, Error **errp);
 void do_commit(Monitor *mon, const QDict *qdict);
@@ -18,26 +18,29 @@
 #include "qemu-timer.h"
 #include "qemu-char.h"
 #include "buffered_file.h"
+#include "qemu-thread.h"
+#include "iov.h"
 
 //#define DEBUG_BUFFERED_FILE
 
 typedef struct QEMUFileBuffered
 {
     BufferedPutFunc *put_buffer;
+    BufferedWritevFunc *writev_buffer;
+    BufferedSetupFunc *setup;
     BufferedPutReadyFunc *put_ready;
     BufferedWaitForUnfreezeFunc *wait_for_unfreeze;
     BufferedCloseFunc *close;
     void *opaque;
     QEMUFile *file;
-    int freeze_output;
     size_t bytes_xfer;
     size_t xfer_limit;
-    uint8_t *buffer;
-    size_t buffer_size;
-    size_t buffer_capacity;
-    QEMUTimer *timer;
+    QemuThread thread;
 } QEMUFileBuffered;
 
+/* length of a rate limiting slice, in milliseconds */
+#define BUFFER_DELAY 100
+
 #ifdef DEBUG_BUFFERED_FILE
 #define DPRINTF(fmt, ...) \
     do { printf("buffered-file: " fmt, ## __VA_ARGS__); } while (0)
@@ -46,76 +49,59 @@ typedef struct QEMUFileBuffered
     do { } while (0)
 #endif
 
-static void buffered_append(QEMUFileBuffered *s,
-                            const uint8_t *buf, size_t size)
+/* Writes are done synchronously from the migration thread, so there is
+ * nothing to buffer: when the backend is not ready we simply wait for it.
+ */
+static int buffered_put_buffer(void *opaque, const uint8_t *buf, int64_t pos, int size)
 {
-    if (size > (s->buffer_capacity - s->buffer_size)) {
-        void *tmp;
-
-        DPRINTF("increasing buffer capacity from %zu by %zu\n",
-                s->buffer_capacity, size + 1024);
-
-        s->buffer_capacity += size + 1024;
-
-        tmp = g_realloc(s->buffer, s->buffer_capacity);
-        if (tmp == NULL) {
-            fprintf(stderr, "qemu file buffer expansion failed\n");
-            exit(1);
-        }
-
-        s->buffer = tmp;
-    }
-
-    memcpy(s->buffer + s->buffer_size, buf, size);
-    s->buffer_size += size;
-}
+    QEMUFileBuffered *s = opaque;
+    int offset = 0, error;
+    ssize_t ret;
 
-static void buffered_flush(QEMUFileBuffered *s)
-{
-    size_t offset = 0;
-    int error;
+    DPRINTF("putting %d bytes at %" PRId64 "\n", size, pos);
 
     error = qemu_file_get_error(s->file);
-    if (error != 0) {
+    if (error) {
         DPRINTF("flush when error, bailing: %s\n", strerror(-error));
-        return;
+        return error;
     }
 
-    DPRINTF("flushing %zu byte(s) of data\n", s->buffer_size);
-
-    while (offset < s->buffer_size) {
-        ssize_t ret;
-
-        ret = s->put_buffer(s->opaque, s->buffer + offset,
-                            s->buffer_size - offset);
+    while (offset < size) {
+        ret = s->put_buffer(s->opaque, buf + offset, size - offset);
         if (ret == -EAGAIN) {
-            DPRINTF("backend not ready, freezing\n");
-            s->freeze_output = 1;
-            break;
+            DPRINTF("backend not ready, waiting\n");
+            s->wait_for_unfreeze(s->opaque);
+            error = qemu_file_get_error(s->file);
+            if (error) {
+                return error;
+            }
+            continue;
         }
 
         if (ret <= 0) {
-            DPRINTF("error flushing data, %zd\n", ret);
+            DPRINTF("error putting\n");
             qemu_file_set_error(s->file, ret);
-            break;
-        } else {
-            DPRINTF("flushed %zd byte(s)\n", ret);
-            offset += ret;
+            return -EINVAL;
         }
+
+        DPRINTF("put %zd byte(s)\n", ret);
+        offset += ret;
     }
 
-    DPRINTF("flushed %zu of %zu byte(s)\n", offset, s->buffer_size);
-    memmove(s->buffer, s->buffer + offset, s->buffer_size - offset);
-    s->buffer_size -= offset;
+    s->bytes_xfer += size;
+    return size;
 }
 
-static int buffered_put_buffer(void *opaque, const uint8_t *buf, int64_t pos, int size)
+static int buffered_writev_buffer(void *opaque, struct iovec *iov, int iovcnt,
+                                  int64_t pos)
 {
     QEMUFileBuffered *s = opaque;
-    int offset = 0, error;
+    size_t offset = 0, size = iov_size(iov, iovcnt);
+    int error;
     ssize_t ret;
 
-    DPRINTF("putting %d bytes at %" PRId64 "\n", size, pos);
+    DPRINTF("putting %zd bytes in %d pieces at %" PRId64 "\n",
+            size, iovcnt, pos);
 
     error = qemu_file_get_error(s->file);
     if (error) {
@@ -123,51 +109,30 @@ static int buffered_put_buffer(void *opaque, const uint8_t *buf, int64_t pos, in
         return error;
     }
 
-    DPRINTF("unfreezing output\n");
-    s->freeze_output = 0;
-
-    buffered_flush(s);
-
-    while (!s->freeze_output && offset < size) {
-        if (s->bytes_xfer > s->xfer_limit) {
-            DPRINTF("transfer limit exceeded when putting\n");
-            break;
-        }
-
-        ret = s->put_buffer(s->opaque, buf + offset, size - offset);
+    while (offset < size) {
+        ret = s->writev_buffer(s->opaque, iov, iovcnt, offset, size - offset);
         if (ret == -EAGAIN) {
-            DPRINTF("backend not ready, freezing\n");
-            s->freeze_output = 1;
-            break;
+            DPRINTF("backend not ready, waiting\n");
+            s->wait_for_unfreeze(s->opaque);
+            error = qemu_file_get_error(s->file);
+            if (error) {
+                return error;
+            }
+            continue;
         }
 
         if (ret <= 0) {
             DPRINTF("error putting\n");
             qemu_file_set_error(s->file, ret);
-            offset = -EINVAL;
-            break;
+            return -EINVAL;
         }
 
         DPRINTF("put %zd byte(s)\n", ret);
         offset += ret;
-        s->bytes_xfer += ret;
-    }
-
-    if (offset >= 0) {
-        DPRINTF("buffering %d bytes\n", size - offset);
-        buffered_append(s, buf + offset, size - offset);
-        offset = size;
-    }
-
-    if (pos == 0 && size == 0) {
-        DPRINTF("file is ready\n");
-        if (s->bytes_xfer <= s->xfer_limit) {
-            DPRINTF("notifying client\n");
-            s->put_ready(s->opaque);
-        }
     }
 
-    return offset;
+    s->bytes_xfer += size;
+    return size;
 }
 
 static int buffered_close(void *opaque)
@@ -177,17 +142,11 @@ static int buffered_close(void *opaque)
 
     DPRINTF("closing\n");
 
-    while (!qemu_file_get_error(s->file) && s->buffer_size) {
-        buffered_flush(s);
-        if (s->freeze_output)
-            s->wait_for_unfreeze(s->opaque);
-    }
+    /* The thread is done by the time its client closes the file */
+    qemu_thread_join(&s->thread);
 
     ret = s->close(s->opaque);
 
-    qemu_del_timer(s->timer);
-    qemu_free_timer(s->timer);
-    g_free(s->buffer);
     g_free(s);
 
     return ret;
@@ -208,10 +167,8 @@ static int buffered_rate_limit(void *opaque)
     if (ret) {
         return ret;
     }
-    if (s->freeze_output)
-        return 1;
 
-    if (s->bytes_xfer > s->xfer_limit)
+    if (s->bytes_xfer >= s->xfer_limit)
         return 1;
 
     return 0;
@@ -227,8 +184,8 @@ static int64_t buffered_set_rate_limit(void *opaque, int64_t new_rate)
         new_rate = SIZE_MAX;
     }
 
-    s->xfer_limit = new_rate / 10;
-    
+    s->xfer_limit = new_rate / (1000 / BUFFER_DELAY);
+
 out:
     return s->xfer_limit;
 }
@@ -240,31 +197,43 @@ static int64_t buffered_get_rate_limit(void *opaque)
     return s->xfer_limit;
 }
 
-static void buffered_rate_tick(void *opaque)
+static void *buffered_file_thread(void *opaque)
 {
     QEMUFileBuffered *s = opaque;
+    int64_t slice_start;
 
-    if (qemu_file_get_error(s->file)) {
-        buffered_close(s);
-        return;
+    if (s->setup(s->opaque) < 0) {
+        return NULL;
     }
 
-    qemu_mod_timer(s->timer, qemu_get_clock_ms(rt_clock) + 100);
-
-    if (s->freeze_output)
-        return;
+    slice_start = qemu_get_clock_ms(rt_clock);
+    while (true) {
+        int64_t now = qemu_get_clock_ms(rt_clock);
 
-    s->bytes_xfer = 0;
+        if (now >= slice_start + BUFFER_DELAY) {
+            s->bytes_xfer = 0;
+            slice_start = now;
+        }
+        if (s->bytes_xfer >= s->xfer_limit) {
+            /* out of budget for this slice, sleep until the next one */
+            g_usleep((slice_start + BUFFER_DELAY - now) * 1000);
+            continue;
+        }
 
-    buffered_flush(s);
+        DPRINTF("notifying client\n");
+        if (!s->put_ready(s->opaque)) {
+            break;
+        }
+    }
 
-    /* Add some checks around this */
-    s->put_ready(s->opaque);
+    return NULL;
 }
 
 QEMUFile *qemu_fopen_ops_buffered(void *opaque,
                                   size_t bytes_per_sec,
                                   BufferedPutFunc *put_buffer,
+                                  BufferedWritevFunc *writev_buffer,
+                                  BufferedSetupFunc *setup,
                                   BufferedPutReadyFunc *put_ready,
                                   BufferedWaitForUnfreezeFunc *wait_for_unfreeze,
                                   BufferedCloseFunc *close)
@@ -274,8 +243,10 @@ QEMUFile *qemu_fopen_ops_buffered(void *opaque,
     s = g_malloc0(sizeof(*s));
 
     s->opaque = opaque;
-    s->xfer_limit = bytes_per_sec / 10;
+    s->xfer_limit = bytes_per_sec / (1000 / BUFFER_DELAY);
     s->put_buffer = put_buffer;
+    s->writev_buffer = writev_buffer;
+    s->setup = setup;
     s->put_ready = put_ready;
     s->wait_for_unfreeze = wait_for_unfreeze;
     s->close = close;
@@ -284,10 +255,12 @@ QEMUFile *qemu_fopen_ops_buffered(void *opaque,
                              buffered_close, buffered_rate_limit,
                              buffered_set_rate_limit,
 			     buffered_get_rate_limit);
+    if (writev_buffer) {
+        qemu_file_set_writev_buffer(s->file, buffered_writev_buffer);
+    }
 
-    s->timer = qemu_new_timer_ms(rt_clock, buffered_rate_tick, s);
-
-    qemu_mod_timer(s->timer, qemu_get_clock_ms(rt_clock) + 100);
+    qemu_thread_create(&s->thread, buffered_file_thread, s,
+                       QEMU_THREAD_JOINABLE);
 
     return s->file;
 }
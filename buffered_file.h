@@ -17,12 +17,25 @@
 #include "hw/hw.h"
 
 typedef ssize_t (BufferedPutFunc)(void *opaque, const void *data, size_t size);
-typedef void (BufferedPutReadyFunc)(void *opaque);
+/* Writes up to @bytes of the data of @iov from byte @offset on */
+typedef ssize_t (BufferedWritevFunc)(void *opaque, struct iovec *iov,
+                                     int iovcnt, size_t offset, size_t bytes);
+typedef int (BufferedSetupFunc)(void *opaque);
+typedef bool (BufferedPutReadyFunc)(void *opaque);
 typedef void (BufferedWaitForUnfreezeFunc)(void *opaque);
 typedef int (BufferedCloseFunc)(void *opaque);
 
+/* The returned file is driven by a thread of its own: it calls @setup
+ * once, then @put_ready whenever the rate limit allows more data to be
+ * sent, until @put_ready returns false.  Neither is called with the
+ * iothread lock held.  The file must only be closed once the thread
+ * has stopped calling back.  @writev_buffer may be NULL; with it, data
+ * queued by qemu_put_buffer_async() goes to the backend without copying.
+ */
 QEMUFile *qemu_fopen_ops_buffered(void *opaque, size_t xfer_limit,
                                   BufferedPutFunc *put_buffer,
+                                  BufferedWritevFunc *writev_buffer,
+                                  BufferedSetupFunc *setup,
                                   BufferedPutReadyFunc *put_ready,
                                   BufferedWaitForUnfreezeFunc *wait_for_unfreeze,
                                   BufferedCloseFunc *close);
@@ -22,6 +22,7 @@
 #include "qemu-common.h"
 #include "qemu-tls.h"
 #include "cpu-common.h"
+#include "qemu-thread.h"
 
 /* some important defines:
  *
@@ -359,6 +360,9 @@ typedef int (*walk_memory_regions_fn)(void *, abi_ulong,
 int walk_memory_regions(void *, walk_memory_regions_fn);
 
 int page_get_flags(target_ulong address);
+int page_get_flags_range(target_ulong start, target_ulong end);
+target_ulong page_find_gap(target_ulong limit, target_ulong size,
+                           target_ulong mask);
 void page_set_flags(target_ulong start, target_ulong end, int flags);
 int page_check_range(target_ulong start, target_ulong len, int flags);
 #endif
@@ -418,7 +422,10 @@ DECLARE_TLS(CPUArchState *,cpu_single_env);
 #define CPU_INTERRUPT_TGT_INT_2   0x0800
 #define CPU_INTERRUPT_TGT_INT_3   0x2000
 
-/* First unused bit: 0x4000.  */
+/* Record the guest PC for the TCG sampler, see tcg_sample_start().  */
+#define CPU_INTERRUPT_SAMPLE      0x4000
+
+/* First unused bit: 0x8000.  */
 
 /* The set of all bits that should be masked when single-stepping.  */
 #define CPU_INTERRUPT_SSTEP_MASK \
@@ -476,6 +483,11 @@ void cpu_watchpoint_remove_all(CPUArchState *env, int mask);
 void cpu_single_step(CPUArchState *env, int enabled);
 int cpu_is_stopped(CPUArchState *env);
 void run_on_cpu(CPUArchState *env, void (*func)(void *data), void *data);
+void async_run_on_cpu(CPUArchState *env, void (*func)(void *data),
+                      void *data);
+bool qemu_vcpu_parked_at_start(CPUArchState *env);
+void qemu_park_vcpu(CPUArchState *env);
+void qemu_unpark_vcpu(CPUArchState *env);
 
 #if !defined(CONFIG_USER_ONLY)
 
@@ -491,6 +503,10 @@ extern ram_addr_t ram_size;
 
 /* RAM is pre-allocated and passed into qemu_ram_alloc_from_ptr */
 #define RAM_PREALLOC_MASK   (1 << 0)
+/* guest RAM proper, backed by transparent huge pages where possible */
+#define RAM_HUGEPAGE_MASK   (1 << 1)
+/* mapped MAP_SHARED from block->fd, other processes can map it too */
+#define RAM_SHARED_MASK     (1 << 1)
 
 typedef struct RAMBlock {
     struct MemoryRegion *mr;
@@ -498,6 +514,7 @@ typedef struct RAMBlock {
     ram_addr_t offset;
     ram_addr_t length;
     uint32_t flags;
+    size_t page_size;       /* of the host mapping, larger with hugetlbfs */
     char idstr[256];
     QLIST_ENTRY(RAMBlock) next;
 #if defined(__linux__) && !defined(TARGET_S390X)
@@ -506,12 +523,23 @@ typedef struct RAMBlock {
 } RAMBlock;
 
 typedef struct RAMList {
-    uint8_t *phys_dirty;
+    /* Protects the list of blocks and the dirty bitmaps' size; taken by
+     * the migration thread instead of the iothread lock. */
+    QemuMutex mutex;
+    /* one bitmap per DIRTY_MEMORY_* client, one bit per target page */
+    unsigned long *dirty_memory[DIRTY_MEMORY_NUM];
+    RAMBlock *mru_block;
     QLIST_HEAD(, RAMBlock) blocks;
+    /* bumped whenever a block is added or removed */
+    uint32_t version;
+    /* pages dirty for DIRTY_MEMORY_MIGRATION, updated atomically */
     uint64_t dirty_pages;
 } RAMList;
 extern RAMList ram_list;
 
+void qemu_mutex_lock_ramlist(void);
+void qemu_mutex_unlock_ramlist(void);
+
 extern const char *mem_path;
 extern int mem_prealloc;
 
@@ -526,6 +554,7 @@ extern int mem_prealloc;
 #define TLB_MMIO        (1 << 5)
 
 void dump_exec_info(FILE *f, fprintf_function cpu_fprintf);
+void dma_bounce_info(FILE *f, fprintf_function cpu_fprintf);
 #endif /* !CONFIG_USER_ONLY */
 
 int cpu_memory_rw_debug(CPUArchState *env, target_ulong addr,
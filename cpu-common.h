@@ -33,10 +33,20 @@ typedef uintptr_t ram_addr_t;
 
 /* memory API */
 
+/* Dirty memory clients.  Each one has its own bitmap in ram_list, see
+ * cpu-all.h.  To be replaced with dynamic registration.
+ */
+#define DIRTY_MEMORY_VGA       0
+#define DIRTY_MEMORY_CODE      1
+#define DIRTY_MEMORY_MIGRATION 2
+#define DIRTY_MEMORY_NUM       3        /* num of dirty bits */
+
 typedef void CPUWriteMemoryFunc(void *opaque, target_phys_addr_t addr, uint32_t value);
 typedef uint32_t CPUReadMemoryFunc(void *opaque, target_phys_addr_t addr);
 
 void qemu_ram_remap(ram_addr_t addr, ram_addr_t length);
+int qemu_ram_map_file(ram_addr_t addr, ram_addr_t length, int fd,
+                      off_t offset);
 /* This should only be used for ram local to a device.  */
 void *qemu_get_ram_ptr(ram_addr_t addr);
 void *qemu_ram_ptr_length(ram_addr_t addr, ram_addr_t *size);
@@ -47,7 +57,22 @@ void qemu_put_ram_ptr(void *addr);
 /* This should not be used by devices.  */
 int qemu_ram_addr_from_host(void *ptr, ram_addr_t *ram_addr);
 ram_addr_t qemu_ram_addr_from_host_nofail(void *ptr);
+int qemu_ram_get_fd(void *ptr, ram_addr_t *offset);
+/* Host page size backing the RAM at @ptr */
+size_t qemu_ram_pagesize(void *ptr);
+bool qemu_ram_mem_merge(void);
+void qemu_ram_set_discarded(void *ptr, size_t len, bool discarded);
 void qemu_ram_set_idstr(ram_addr_t addr, const char *name, DeviceState *dev);
+/* -mem-prealloc faults in RAM from worker threads; vm_start() waits for
+ * them to finish. */
+bool qemu_ram_prealloc_defer_start(void);
+void qemu_ram_prealloc_cancel_start(void);
+void qemu_ram_prealloc_status(bool *active, uint64_t *total, uint64_t *done);
+
+typedef void (RAMBlockIterFunc)(const char *idstr, void *host_addr,
+                                ram_addr_t length, void *opaque);
+
+void qemu_ram_foreach_block(RAMBlockIterFunc func, void *opaque);
 
 void cpu_physical_memory_rw(target_phys_addr_t addr, uint8_t *buf,
                             int len, int is_write);
@@ -66,6 +91,35 @@ void *cpu_physical_memory_map(target_phys_addr_t addr,
                               int is_write);
 void cpu_physical_memory_unmap(void *buffer, target_phys_addr_t len,
                                int is_write, target_phys_addr_t access_len);
+
+/* A range of guest memory looked up once, for structures such as
+ * descriptor rings that a device accesses over and over.  While the range
+ * is all in RAM (and writable RAM, for is_write), the accessors below copy
+ * straight from or to host memory.  Otherwise they go through
+ * cpu_physical_memory_rw().  A change to the memory map is noticed on the
+ * next access, which looks the range up again, so a device can keep the
+ * cache for as long as the guest keeps the structure where it is.
+ */
+typedef struct PhysMemoryCache {
+    uint8_t *host;
+    ram_addr_t ram_addr;
+    target_phys_addr_t addr;
+    target_phys_addr_t len;
+    bool is_write;
+    unsigned version;
+} PhysMemoryCache;
+
+void cpu_physical_memory_map_cached(PhysMemoryCache *cache,
+                                    target_phys_addr_t addr,
+                                    target_phys_addr_t len, bool is_write);
+void cpu_physical_memory_unmap_cached(PhysMemoryCache *cache);
+void cpu_physical_memory_read_cached(PhysMemoryCache *cache,
+                                     target_phys_addr_t offset,
+                                     void *buf, int len);
+void cpu_physical_memory_write_cached(PhysMemoryCache *cache,
+                                      target_phys_addr_t offset,
+                                      const void *buf, int len);
+
 void *cpu_register_map_client(void *opaque, void (*callback)(void *opaque));
 void cpu_unregister_map_client(void *cookie);
 
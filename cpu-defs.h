@@ -77,8 +77,21 @@ typedef uint64_t target_ulong __attribute__((aligned(TARGET_LONG_ALIGNMENT)));
 #define TB_JMP_PAGE_MASK (TB_JMP_CACHE_SIZE - TB_JMP_PAGE_SIZE)
 
 #if !defined(CONFIG_USER_ONLY)
+#if defined(CONFIG_TCG_INTERPRETER) || defined(__i386__) || \
+    defined(__x86_64__)
+/* The TCG backend loads the TLB index mask from env->tlb_mask, so the
+   TLB can be resized between CPU_TLB_MIN_BITS and CPU_TLB_BITS.  The
+   other backends have it built into the generated code.  */
+#define CPU_TLB_DYNAMIC
+#define CPU_TLB_BITS 12
+#define CPU_TLB_MIN_BITS 8
+#else
 #define CPU_TLB_BITS 8
+#define CPU_TLB_MIN_BITS CPU_TLB_BITS
+#endif
 #define CPU_TLB_SIZE (1 << CPU_TLB_BITS)
+/* recently evicted entries, looked up before refilling the TLB */
+#define CPU_VTLB_SIZE 8
 
 #if HOST_LONG_BITS == 32 && TARGET_LONG_BITS == 32
 #define CPU_TLB_ENTRY_BITS 4
@@ -112,12 +125,32 @@ extern int CPUTLBEntry_wrong_size[sizeof(CPUTLBEntry) == (1 << CPU_TLB_ENTRY_BIT
     /* The meaning of the MMU modes is defined in the target code. */   \
     CPUTLBEntry tlb_table[NB_MMU_MODES][CPU_TLB_SIZE];                  \
     target_phys_addr_t iotlb[NB_MMU_MODES][CPU_TLB_SIZE];               \
+    CPUTLBEntry tlb_v_table[NB_MMU_MODES][CPU_VTLB_SIZE];               \
+    target_phys_addr_t iotlb_v[NB_MMU_MODES][CPU_VTLB_SIZE];            \
+    unsigned int vtlb_index;                                            \
     target_ulong tlb_flush_addr;                                        \
     target_ulong tlb_flush_mask;
 
+/* The size of the TLB is kept across CPU reset, which clears the entries
+   up to breakpoints; the following tlb_flush() clears those in use. */
+#define CPU_COMMON_TLB_SIZE \
+    /* (number of entries in use - 1) << CPU_TLB_ENTRY_BITS */          \
+    uintptr_t tlb_mask;                                                 \
+    /* for resizing: entries filled since the last flush, and the       \
+       most filled in the current window */                             \
+    unsigned int tlb_used;                                              \
+    unsigned int tlb_window_used;                                       \
+    int64_t tlb_window_start;
+
+/* Number of entries in use per MMU mode, and index of addr */
+#define tlb_n_entries(env) (((env)->tlb_mask >> CPU_TLB_ENTRY_BITS) + 1)
+#define tlb_index(env, addr)                                            \
+    (((addr) >> TARGET_PAGE_BITS) & ((env)->tlb_mask >> CPU_TLB_ENTRY_BITS))
+
 #else
 
 #define CPU_COMMON_TLB
+#define CPU_COMMON_TLB_SIZE
 
 #endif
 
@@ -136,6 +169,8 @@ typedef struct icount_decr_u16 {
 
 struct kvm_run;
 struct KVMState;
+struct KVMExitStats;
+struct TCGSampleStats;
 struct qemu_work_item;
 
 typedef struct CPUBreakpoint {
@@ -151,6 +186,26 @@ typedef struct CPUWatchpoint {
     QTAILQ_ENTRY(CPUWatchpoint) entry;
 } CPUWatchpoint;
 
+/* TCG execution counters, only updated with -tcg-stats */
+typedef struct TCGExecStats {
+    uint64_t tb_execs;          /* TBs entered, counted by the TBs */
+    uint64_t tb_lookups;        /* TBs looked up by cpu_exec() */
+    uint64_t jmp_cache_misses;  /* ... that were not in tb_jmp_cache */
+    uint64_t hash_misses;       /* ... and had to be translated */
+    uint64_t indirect_lookups;  /* helper_lookup_tb_ptr() hits */
+    uint64_t chained;           /* direct jumps patched */
+    uint64_t tlb_slow_path;     /* softmmu helper calls */
+    uint64_t tlb_misses;        /* ... for a page not in the TLB */
+    uint64_t tlb_io;            /* MMIO accesses */
+} TCGExecStats;
+
+/* Where the vCPU thread spent its time, in ns, see query-cpus */
+typedef struct VCPUTimeStats {
+    int64_t lock_wait_ns;       /* waiting for the global mutex */
+    int64_t kvm_run_ns;         /* in KVM_RUN */
+    int64_t kvm_exit_ns;        /* handling KVM exits, with lock waits */
+} VCPUTimeStats;
+
 #define CPU_TEMP_BUF_NLONGS 128
 #define CPU_COMMON                                                      \
     struct TranslationBlock *current_tb; /* currently executing TB  */  \
@@ -190,6 +245,8 @@ typedef struct CPUWatchpoint {
                                                                         \
     struct GDBRegisterState *gdb_regs;                                  \
                                                                         \
+    CPU_COMMON_TLB_SIZE                                                 \
+                                                                        \
     /* Core interrupt code */                                           \
     jmp_buf jmp_env;                                                    \
     int exception_index;                                                \
@@ -208,12 +265,19 @@ typedef struct CPUWatchpoint {
     uint32_t created;                                                   \
     uint32_t stop;   /* Stop request */                                 \
     uint32_t stopped; /* Artificially stopped */                        \
+    uint32_t parked; /* Hot-pluggable and not plugged */                \
+    uint32_t unplug_pending; /* Guest asked to give the CPU up */       \
     struct QemuCond *halt_cond;                                         \
     struct qemu_work_item *queued_work_first, *queued_work_last;        \
+    int throttle_thread_scheduled;                                      \
     const char *cpu_model_str;                                          \
     struct KVMState *kvm_state;                                         \
     struct kvm_run *kvm_run;                                            \
     int kvm_fd;                                                         \
-    int kvm_vcpu_dirty;
+    int kvm_vcpu_dirty;                                                 \
+    struct KVMExitStats *kvm_exit_stats;                                \
+    struct TCGSampleStats *tcg_samples;                                 \
+    TCGExecStats tcg_stats;                                             \
+    VCPUTimeStats time_stats;
 
 #endif
@@ -22,6 +22,10 @@
 #include "tcg.h"
 #include "qemu-barrier.h"
 #include "qtest.h"
+#if !defined(CONFIG_USER_ONLY)
+#include "qemu-timer.h"
+#include "qmp-commands.h"
+#endif
 
 int tb_invalidated_flag;
 
@@ -85,57 +89,45 @@ static TranslationBlock *tb_find_slow(CPUArchState *env,
                                       target_ulong cs_base,
                                       uint64_t flags)
 {
-    TranslationBlock *tb, **ptb1;
-    unsigned int h;
-    tb_page_addr_t phys_pc, phys_page1;
-    target_ulong virt_page2;
+    TranslationBlock *tb;
+    tb_page_addr_t phys_pc;
 
     tb_invalidated_flag = 0;
 
     /* find translated block using physical mappings */
     phys_pc = get_page_addr_code(env, pc);
-    phys_page1 = phys_pc & TARGET_PAGE_MASK;
-    h = tb_phys_hash_func(phys_pc);
-    ptb1 = &tb_phys_hash[h];
-    for(;;) {
-        tb = *ptb1;
-        if (!tb)
-            goto not_found;
-        if (tb->pc == pc &&
-            tb->page_addr[0] == phys_page1 &&
-            tb->cs_base == cs_base &&
-            tb->flags == flags) {
-            /* check next page if needed */
-            if (tb->page_addr[1] != -1) {
-                tb_page_addr_t phys_page2;
-
-                virt_page2 = (pc & TARGET_PAGE_MASK) +
-                    TARGET_PAGE_SIZE;
-                phys_page2 = get_page_addr_code(env, virt_page2);
-                if (tb->page_addr[1] == phys_page2)
-                    goto found;
-            } else {
-                goto found;
-            }
+    tb = tb_hash_lookup(env, phys_pc, pc, cs_base, flags);
+    if (!tb) {
+        /* if no translated code available, then translate it now */
+        if (unlikely(tcg_stats_enabled)) {
+            env->tcg_stats.hash_misses++;
         }
-        ptb1 = &tb->phys_hash_next;
-    }
- not_found:
-   /* if no translated code available, then translate it now */
-    tb = tb_gen_code(env, pc, cs_base, flags, 0);
-
- found:
-    /* Move the last found TB to the head of the list */
-    if (likely(*ptb1)) {
-        *ptb1 = tb->phys_hash_next;
-        tb->phys_hash_next = tb_phys_hash[h];
-        tb_phys_hash[h] = tb;
+        tb = tb_gen_code(env, pc, cs_base, flags, 0);
     }
     /* we add the TB in the virtual pc hash table */
     env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)] = tb;
     return tb;
 }
 
+/* Whether a direct jump to TB may be patched into another TB.  Writes
+   to either page of TB invalidate it through tb_invalidate_phys_page_range,
+   and tb_phys_invalidate() resets every jump into it, so the jump never
+   outlives the code.  With softmmu, however, the guest can also remap the
+   virtual page holding the second half of a TB while the first stays;
+   tb_find_slow() checks that mapping on each lookup but a direct jump
+   would not, so such TBs are only reached through the main loop.  In
+   user mode the virtual address is the page address and cannot change
+   under the TB, but TBs of pages that are not write protected check
+   their code in the main loop.  */
+static inline bool tb_can_chain(TranslationBlock *tb)
+{
+#if defined(CONFIG_USER_ONLY)
+    return !(tb->cflags & CF_CHECK_CODE);
+#else
+    return tb->page_addr[1] == -1;
+#endif
+}
+
 static inline TranslationBlock *tb_find_fast(CPUArchState *env)
 {
     TranslationBlock *tb;
@@ -147,13 +139,145 @@ static inline TranslationBlock *tb_find_fast(CPUArchState *env)
        is executed. */
     cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
     tb = env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)];
+    if (unlikely(tcg_stats_enabled)) {
+        env->tcg_stats.tb_lookups++;
+    }
     if (unlikely(!tb || tb->pc != pc || tb->cs_base != cs_base ||
                  tb->flags != flags)) {
+        if (unlikely(tcg_stats_enabled)) {
+            env->tcg_stats.jmp_cache_misses++;
+        }
         tb = tb_find_slow(env, pc, cs_base, flags);
     }
     return tb;
 }
 
+/* Called by the code of gen_lookup_and_goto_ptr() at the end of a TB
+   whose successor is only known at run time.  Returns the host code of
+   the next TB if tb_jmp_cache has it, otherwise the epilogue, which
+   returns to cpu_exec() with nothing to chain.
+
+   tb_jmp_cache is cleared by tb_phys_invalidate() and by TLB flushes,
+   so a hit is as valid as one in tb_find_fast().  Pending interrupts and
+   exit requests must be noticed here, since chained execution no longer
+   passes through the main loop; env->current_tb tracks the TB being
+   entered so that cpu_unlink_tb() still breaks its direct jumps.
+   cpu_interrupt() sets interrupt_request before it reads current_tb, so
+   current_tb is set before interrupt_request is read: either the
+   interrupt is seen here or the new TB gets unlinked.  */
+void *helper_lookup_tb_ptr(CPUArchState *env)
+{
+    TranslationBlock *tb;
+    target_ulong cs_base, pc;
+    int flags;
+
+    tb = env->current_tb;
+    if (!tb || (tb->cflags & CF_COUNT_MASK)) {
+        return tcg_ctx.code_gen_epilogue;
+    }
+    cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
+    tb = env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)];
+    if (unlikely(!tb || tb->pc != pc || tb->cs_base != cs_base ||
+                 tb->flags != flags || (tb->cflags & CF_CHECK_CODE))) {
+        return tcg_ctx.code_gen_epilogue;
+    }
+#ifdef TARGET_HAS_SUPERBLOCK
+    /* let cpu_exec() retranslate it */
+    if (unlikely(++tb->exec_count >= TB_HOT_THRESHOLD && !tb->cflags)) {
+        return tcg_ctx.code_gen_epilogue;
+    }
+#endif
+    if (unlikely(tcg_stats_enabled)) {
+        env->tcg_stats.indirect_lookups++;
+    }
+    env->current_tb = tb;
+    smp_mb();
+    if (env->exit_request || env->interrupt_request) {
+        return tcg_ctx.code_gen_epilogue;
+    }
+    return tb->tc_ptr;
+}
+
+#ifdef TARGET_HAS_SUPERBLOCK
+/* Replace a hot TB with a superblock, which continues translation at
+   the target of direct jumps so that the optimizer and the register
+   allocator see the former successors too.  Only plain TBs are
+   promoted: icount TBs must keep their instruction budget.  */
+static TranslationBlock *tb_promote_hot(CPUArchState *env,
+                                        TranslationBlock *tb)
+{
+    target_ulong pc = tb->pc;
+    target_ulong cs_base = tb->cs_base;
+    uint64_t flags = tb->flags;
+
+    if (tb->cflags) {
+        return tb;
+    }
+    /* drops the jumps into the old TB; they are chained again to the
+       new one as it is entered from here */
+    tb_phys_invalidate(tb, -1);
+    tb = tb_gen_code(env, pc, cs_base, flags, CF_SUPERBLOCK);
+    env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)] = tb;
+    return tb;
+}
+#endif
+
+#if defined(CONFIG_USER_ONLY)
+/* The guest rewrote the code of a TB of a page that is not write
+   protected: translate it again */
+static TranslationBlock *tb_retranslate(CPUArchState *env,
+                                        TranslationBlock *tb)
+{
+    target_ulong pc = tb->pc;
+    target_ulong cs_base = tb->cs_base;
+    uint64_t flags = tb->flags;
+    int cflags = tb->cflags & ~CF_CHECK_CODE;
+
+    tb_phys_invalidate(tb, -1);
+    tb = tb_gen_code(env, pc, cs_base, flags, cflags);
+    env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)] = tb;
+    return tb;
+}
+#endif
+
+/* Look the next TB up in tb_jmp_cache without taking tb_lock, when there
+   is no jump to patch.  Guest threads then only serialize to translate,
+   not on every return to the main loop.  Like helper_lookup_tb_ptr() this
+   relies on tb_jmp_cache being cleared before a TB goes away.  Returns
+   NULL for the locked path: misses, TBs whose code must be checked and
+   TBs due for promotion.  System emulation always takes the lock.  */
+static inline TranslationBlock *tb_find_unlocked(CPUArchState *env,
+                                                 tcg_target_ulong next_tb)
+{
+#if defined(CONFIG_USER_ONLY)
+    TranslationBlock *tb;
+    target_ulong cs_base, pc;
+    int flags;
+
+    if (next_tb != 0 || tb_invalidated_flag) {
+        return NULL;
+    }
+    cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
+    tb = env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)];
+    if (unlikely(!tb || tb->pc != pc || tb->cs_base != cs_base ||
+                 tb->flags != flags || (tb->cflags & CF_CHECK_CODE))) {
+        return NULL;
+    }
+#ifdef TARGET_HAS_SUPERBLOCK
+    if (unlikely(tb->exec_count + 1 >= TB_HOT_THRESHOLD && !tb->cflags)) {
+        return NULL;
+    }
+    tb->exec_count++;
+#endif
+    if (unlikely(tcg_stats_enabled)) {
+        env->tcg_stats.tb_lookups++;
+    }
+    return tb;
+#else
+    return NULL;
+#endif
+}
+
 static CPUDebugExcpHandler *debug_excp_handler;
 
 void cpu_set_debug_excp_handler(CPUDebugExcpHandler *handler)
@@ -175,6 +299,79 @@ static void cpu_handle_debug_exception(CPUArchState *env)
     }
 }
 
+#if !defined(CONFIG_USER_ONLY)
+/* guest PCs kept per vCPU by the sampler */
+#define TCG_SAMPLE_SLOTS        1024
+
+typedef struct TCGSample {
+    target_ulong pc;
+    uint64_t samples;
+} TCGSample;
+
+typedef struct TCGSampleStats {
+    uint64_t total;
+    uint64_t dropped;
+    TCGSample slots[TCG_SAMPLE_SLOTS];
+} TCGSampleStats;
+
+static QEMUTimer *tcg_sample_timer;
+static int tcg_sample_rate;
+
+/* Called by the vCPU between two TBs, so nothing else writes @stats */
+static void tcg_sample_record(CPUArchState *env)
+{
+    TCGSampleStats *stats = env->tcg_samples;
+    target_ulong pc, cs_base;
+    int flags;
+    unsigned i, h;
+    TCGSample *e;
+
+    if (!stats) {
+        return;
+    }
+    cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
+    stats->total++;
+    h = ((uint64_t)pc >> 1) * 2654435761u;
+    for (i = 0; i < TCG_SAMPLE_SLOTS; i++) {
+        e = &stats->slots[(h + i) % TCG_SAMPLE_SLOTS];
+        if (!e->samples) {
+            e->pc = pc;
+        }
+        if (e->pc == pc) {
+            e->samples++;
+            return;
+        }
+    }
+    stats->dropped++;
+}
+
+static void tcg_sample_tick(void *opaque)
+{
+    CPUArchState *env;
+
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        if (!env->tcg_samples) {
+            env->tcg_samples = g_malloc0(sizeof(TCGSampleStats));
+        }
+        /* halted vCPUs pick this up when they wake, so idle time is
+           not sampled */
+        cpu_interrupt(env, CPU_INTERRUPT_SAMPLE);
+    }
+    qemu_mod_timer(tcg_sample_timer, qemu_get_clock_ns(rt_clock) +
+                   get_ticks_per_sec() / tcg_sample_rate);
+}
+
+/* Sample the guest PC of every vCPU @rate times per second.  The vCPU
+   records its own PC at the next TB boundary, which is where
+   cpu_interrupt() breaks the chain of translated code.  */
+void tcg_sample_start(int rate)
+{
+    tcg_sample_rate = rate;
+    tcg_sample_timer = qemu_new_timer_ns(rt_clock, tcg_sample_tick, NULL);
+    tcg_sample_tick(NULL);
+}
+#endif
+
 /* main execution loop */
 
 volatile sig_atomic_t exit_request;
@@ -266,10 +463,20 @@ int cpu_exec(CPUArchState *env)
             for(;;) {
                 interrupt_request = env->interrupt_request;
                 if (unlikely(interrupt_request)) {
+#if !defined(CONFIG_USER_ONLY)
+                    /* interrupt delivery talks to the devices */
+                    bool io_locked = qemu_tcg_io_lock();
+#endif
                     if (unlikely(env->singlestep_enabled & SSTEP_NOIRQ)) {
                         /* Mask out external interrupts for this step. */
                         interrupt_request &= ~CPU_INTERRUPT_SSTEP_MASK;
                     }
+#if !defined(CONFIG_USER_ONLY)
+                    if (interrupt_request & CPU_INTERRUPT_SAMPLE) {
+                        env->interrupt_request &= ~CPU_INTERRUPT_SAMPLE;
+                        tcg_sample_record(env);
+                    }
+#endif
                     if (interrupt_request & CPU_INTERRUPT_DEBUG) {
                         env->interrupt_request &= ~CPU_INTERRUPT_DEBUG;
                         env->exception_index = EXCP_DEBUG;
@@ -540,6 +747,9 @@ int cpu_exec(CPUArchState *env)
                            the program flow was changed */
                         next_tb = 0;
                     }
+#if !defined(CONFIG_USER_ONLY)
+                    qemu_tcg_io_unlock(io_locked);
+#endif
                 }
                 if (unlikely(env->exit_request)) {
                     env->exit_request = 0;
@@ -565,29 +775,49 @@ int cpu_exec(CPUArchState *env)
 #endif
                 }
 #endif /* DEBUG_DISAS || CONFIG_DEBUG_EXEC */
-                spin_lock(&tb_lock);
-                tb = tb_find_fast(env);
-                /* Note: we do it here to avoid a gcc bug on Mac OS X when
-                   doing it in tb_find_slow */
-                if (tb_invalidated_flag) {
-                    /* as some TB could have been invalidated because
-                       of memory exceptions while generating the code, we
-                       must recompute the hash index here */
-                    next_tb = 0;
-                    tb_invalidated_flag = 0;
+                tb = tb_find_unlocked(env, next_tb);
+                if (!tb) {
+                    spin_lock(&tb_lock);
+                    tb_mutex_lock();
+                    tb = tb_find_fast(env);
+#if defined(CONFIG_USER_ONLY)
+                    if (unlikely(tb->cflags & CF_CHECK_CODE) &&
+                        tb_code_changed(tb)) {
+                        tb = tb_retranslate(env, tb);
+                    }
+#endif
+#ifdef TARGET_HAS_SUPERBLOCK
+                    if (unlikely(++tb->exec_count >= TB_HOT_THRESHOLD)) {
+                        tb = tb_promote_hot(env, tb);
+                    }
+#endif
+                    /* Note: we do it here to avoid a gcc bug on Mac OS X when
+                       doing it in tb_find_slow */
+                    if (tb_invalidated_flag) {
+                        /* as some TB could have been invalidated because
+                           of memory exceptions while generating the code, we
+                           must recompute the hash index here */
+                        next_tb = 0;
+                        tb_invalidated_flag = 0;
+                    }
+                    /* see if we can patch the calling TB.  Multi-threaded
+                       TCG does not chain TBs: another vCPU may be executing
+                       the jump being patched. */
+                    if (next_tb != 0 && tb_can_chain(tb) && !mttcg_enabled) {
+                        tb_add_jump((TranslationBlock *)(next_tb & ~3),
+                                    next_tb & 3, tb);
+                        if (unlikely(tcg_stats_enabled)) {
+                            env->tcg_stats.chained++;
+                        }
+                    }
+                    tb_mutex_unlock();
+                    spin_unlock(&tb_lock);
                 }
 #ifdef CONFIG_DEBUG_EXEC
                 qemu_log_mask(CPU_LOG_EXEC, "Trace %p [" TARGET_FMT_lx "] %s\n",
                              tb->tc_ptr, tb->pc,
                              lookup_symbol(tb->pc));
 #endif
-                /* see if we can patch the calling TB. When the TB
-                   spans two pages, we cannot safely do a direct
-                   jump. */
-                if (next_tb != 0 && tb->page_addr[1] == -1) {
-                    tb_add_jump((TranslationBlock *)(next_tb & ~3), next_tb & 3, tb);
-                }
-                spin_unlock(&tb_lock);
 
                 /* cpu_interrupt might be called while translating the
                    TB, but before it is linked into a potentially
@@ -635,6 +865,9 @@ int cpu_exec(CPUArchState *env)
             /* Reload env after longjmp - the compiler may have smashed all
              * local variables as longjmp is marked 'noreturn'. */
             env = cpu_single_env;
+#if !defined(CONFIG_USER_ONLY)
+            cpu_exec_reset_locks();
+#endif
         }
     } /* for(;;) */
 
@@ -671,3 +904,65 @@ int cpu_exec(CPUArchState *env)
     cpu_single_env = NULL;
     return ret;
 }
+
+#if !defined(CONFIG_USER_ONLY)
+static int tcg_sample_compare(const void *a, const void *b)
+{
+    const TCGSample *ea = a, *eb = b;
+
+    if (ea->samples != eb->samples) {
+        return ea->samples > eb->samples ? -1 : 1;
+    }
+    return 0;
+}
+
+GuestSampleInfo *qmp_query_guest_samples(bool has_limit, int64_t limit,
+                                         Error **errp)
+{
+    GuestSampleInfo *info = g_malloc0(sizeof(*info));
+    VcpuGuestSamplesList *cpu_head = NULL, **cpu_tail = &cpu_head;
+    TCGSample *slots;
+    CPUArchState *env;
+    int i, n;
+
+    info->rate = tcg_sample_rate;
+    n = has_limit ? MIN(MAX(limit, 0), TCG_SAMPLE_SLOTS) : 10;
+    slots = g_new(TCGSample, TCG_SAMPLE_SLOTS);
+
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        TCGSampleStats *stats = env->tcg_samples;
+        VcpuGuestSamplesList *entry;
+        GuestPcSampleList **hot_tail;
+
+        if (!stats) {
+            continue;
+        }
+        entry = g_malloc0(sizeof(*entry));
+        entry->value = g_malloc0(sizeof(*entry->value));
+        entry->value->cpu = env->cpu_index;
+        entry->value->total = stats->total;
+        entry->value->dropped = stats->dropped;
+        hot_tail = &entry->value->hot;
+
+        /* the vCPU keeps counting; a slightly stale copy is fine */
+        memcpy(slots, stats->slots, sizeof(stats->slots));
+        qsort(slots, TCG_SAMPLE_SLOTS, sizeof(*slots), tcg_sample_compare);
+        for (i = 0; i < n && slots[i].samples; i++) {
+            GuestPcSampleList *hot = g_malloc0(sizeof(*hot));
+
+            hot->value = g_malloc0(sizeof(*hot->value));
+            hot->value->pc = slots[i].pc;
+            hot->value->symbol = g_strdup(lookup_symbol(slots[i].pc));
+            hot->value->samples = slots[i].samples;
+            *hot_tail = hot;
+            hot_tail = &hot->next;
+        }
+        *cpu_tail = entry;
+        cpu_tail = &entry->next;
+    }
+    g_free(slots);
+    info->vcpus = cpu_head;
+
+    return info;
+}
+#endif
@@ -31,12 +31,16 @@
 #include "dma.h"
 #include "kvm.h"
 #include "qmp-commands.h"
+#include "qemu-objects.h"
 
 #include "qemu-thread.h"
+#include "qemu-rcu.h"
+#include "qemu-lockstat.h"
 #include "cpus.h"
 #include "qtest.h"
 #include "main-loop.h"
 #include "bitmap.h"
+#include "event_notifier.h"
 
 #ifndef _WIN32
 #include "compatfd.h"
@@ -45,6 +49,7 @@
 #ifdef CONFIG_LINUX
 
 #include <sys/prctl.h>
+#include <poll.h>
 
 #ifndef PR_MCE_KILL
 #define PR_MCE_KILL 33
@@ -62,6 +67,9 @@
 
 static CPUArchState *next_cpu;
 
+/* CPUs numbered from smp_cpus up are created parked, see qemu_park_vcpu() */
+static bool vcpu_parking;
+
 static bool cpu_thread_is_idle(CPUArchState *env)
 {
     if (env->stop || env->queued_work_first) {
@@ -616,12 +624,44 @@ static void qemu_tcg_init_cpu_signals(void)
 QemuMutex qemu_global_mutex;
 static QemuCond qemu_io_proceeded_cond;
 static bool iothread_requesting_mutex;
+/* Only qemu_mutex_lock_iothread() and qemu_mutex_unlock_iothread() are
+   counted, not the vCPU threads taking qemu_global_mutex directly */
+static QemuLockStats iothread_lock_stats;
+static DEFINE_TLS(int64_t, iothread_locked_at);
 
 static QemuThread io_thread;
 
 static QemuThread *tcg_cpu_thread;
 static QemuCond *tcg_halt_cond;
 
+/* Multi-threaded TCG.  The vCPU threads release the iothread lock while
+ * they run guest code and take it back for device accesses.  Those that
+ * run without it are counted in tcg_exec_count; an exclusive section
+ * waits for the count to drop to zero, and keeps the others from
+ * starting again until it ends.
+ *
+ * Flushing the translated code must also wait for the vCPU threads that
+ * are doing device accesses in the middle of a TB, and those may be
+ * waiting for the iothread lock.  So it is deferred until none is inside
+ * cpu_exec(), counted in tcg_cpu_exec_count, and done by the next one to
+ * enter it.
+ */
+static QemuMutex tcg_exclusive_lock;
+static QemuCond tcg_exclusive_cond;
+static QemuCond tcg_exclusive_resume;
+static int tcg_exec_count;
+static bool tcg_exclusive_pending;
+static int tcg_cpu_exec_count;
+static bool tcg_flush_pending;
+static bool tcg_flushing;
+static DEFINE_TLS(int, tcg_exclusive_depth);
+/* this thread runs guest code without the iothread lock */
+static DEFINE_TLS(bool, tcg_vcpu_running);
+/* this thread took the iothread lock in qemu_tcg_io_lock() */
+static DEFINE_TLS(bool, tcg_io_locked);
+/* this thread stopped running guest code in qemu_tcg_exec_pause() */
+static DEFINE_TLS(bool, tcg_exec_paused);
+
 /* cpu creation */
 static QemuCond qemu_cpu_cond;
 /* system init */
@@ -636,6 +676,10 @@ void qemu_init_cpu_loop(void)
     qemu_cond_init(&qemu_work_cond);
     qemu_cond_init(&qemu_io_proceeded_cond);
     qemu_mutex_init(&qemu_global_mutex);
+    lock_stats_register(&iothread_lock_stats, "qemu_global_mutex");
+    qemu_mutex_init(&tcg_exclusive_lock);
+    qemu_cond_init(&tcg_exclusive_cond);
+    qemu_cond_init(&tcg_exclusive_resume);
 
     qemu_thread_get_self(&io_thread);
 }
@@ -651,6 +695,7 @@ void run_on_cpu(CPUArchState *env, void (*func)(void *data), void *data)
 
     wi.func = func;
     wi.data = data;
+    wi.free = false;
     if (!env->queued_work_first) {
         env->queued_work_first = &wi;
     } else {
@@ -669,6 +714,32 @@ void run_on_cpu(CPUArchState *env, void (*func)(void *data), void *data)
     }
 }
 
+void async_run_on_cpu(CPUArchState *env, void (*func)(void *data),
+                      void *data)
+{
+    struct qemu_work_item *wi;
+
+    if (qemu_cpu_is_self(env)) {
+        func(data);
+        return;
+    }
+
+    wi = g_malloc0(sizeof(struct qemu_work_item));
+    wi->func = func;
+    wi->data = data;
+    wi->free = true;
+    if (!env->queued_work_first) {
+        env->queued_work_first = wi;
+    } else {
+        env->queued_work_last->next = wi;
+    }
+    env->queued_work_last = wi;
+    wi->next = NULL;
+    wi->done = false;
+
+    qemu_cpu_kick(env);
+}
+
 static void flush_queued_work(CPUArchState *env)
 {
     struct qemu_work_item *wi;
@@ -681,11 +752,99 @@ static void flush_queued_work(CPUArchState *env)
         env->queued_work_first = wi->next;
         wi->func(wi->data);
         wi->done = true;
+        if (wi->free) {
+            g_free(wi);
+        }
     }
     env->queued_work_last = NULL;
     qemu_cond_broadcast(&qemu_work_cond);
 }
 
+/* vCPU throttling.  While active, every vCPU is made to sleep for
+ * throttle_percentage of each time slice, with the global mutex dropped.
+ */
+#define CPU_THROTTLE_PCT_MIN 1
+#define CPU_THROTTLE_PCT_MAX 99
+#define CPU_THROTTLE_TIMESLICE_NS 10000000
+
+static QEMUTimer *throttle_timer;
+static int throttle_percentage;
+
+static void cpu_throttle_thread(void *opaque)
+{
+    CPUArchState *env = opaque;
+    CPUArchState *self_env = cpu_single_env;
+    double pct;
+    long sleeptime_us;
+
+    /* Stop the timer if needed */
+    if (!throttle_percentage) {
+        env->throttle_thread_scheduled = 0;
+        return;
+    }
+
+    pct = (double)throttle_percentage / 100;
+    sleeptime_us = (long)(pct / (1 - pct) * CPU_THROTTLE_TIMESLICE_NS / 1000);
+
+    qemu_mutex_unlock(&qemu_global_mutex);
+    g_usleep(sleeptime_us);
+    qemu_mutex_lock(&qemu_global_mutex);
+    cpu_single_env = self_env;
+
+    env->throttle_thread_scheduled = 0;
+}
+
+static void cpu_throttle_timer_tick(void *opaque)
+{
+    CPUArchState *env;
+    double pct;
+
+    /* Stop the timer if needed */
+    if (!throttle_percentage) {
+        return;
+    }
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        if (!env->throttle_thread_scheduled) {
+            env->throttle_thread_scheduled = 1;
+            async_run_on_cpu(env, cpu_throttle_thread, env);
+        }
+    }
+
+    pct = (double)throttle_percentage / 100;
+    qemu_mod_timer(throttle_timer, qemu_get_clock_ns(rt_clock) +
+                   CPU_THROTTLE_TIMESLICE_NS / (1 - pct));
+}
+
+void cpu_throttle_set(int new_throttle_pct)
+{
+    /* Ensure throttle percentage is within valid range */
+    new_throttle_pct = MIN(new_throttle_pct, CPU_THROTTLE_PCT_MAX);
+    new_throttle_pct = MAX(new_throttle_pct, CPU_THROTTLE_PCT_MIN);
+
+    if (!throttle_timer) {
+        throttle_timer = qemu_new_timer_ns(rt_clock,
+                                           cpu_throttle_timer_tick, NULL);
+    }
+    throttle_percentage = new_throttle_pct;
+    qemu_mod_timer(throttle_timer, qemu_get_clock_ns(rt_clock) +
+                   CPU_THROTTLE_TIMESLICE_NS);
+}
+
+void cpu_throttle_stop(void)
+{
+    throttle_percentage = 0;
+}
+
+bool cpu_throttle_active(void)
+{
+    return (cpu_throttle_get_percentage() != 0);
+}
+
+int cpu_throttle_get_percentage(void)
+{
+    return throttle_percentage;
+}
+
 static void qemu_wait_io_event_common(CPUArchState *env)
 {
     CPUState *cpu = ENV_GET_CPU(env);
@@ -719,16 +878,106 @@ static void qemu_tcg_wait_io_event(void)
     }
 }
 
-static void qemu_kvm_wait_io_event(CPUArchState *env)
+static void qemu_tcg_mttcg_wait_io_event(CPUArchState *env)
 {
     while (cpu_thread_is_idle(env)) {
         qemu_cond_wait(env->halt_cond, &qemu_global_mutex);
     }
 
+    qemu_wait_io_event_common(env);
+}
+
+/* Userspace halt polling, adapted like the kernel's halt_poll_ns */
+#define KVM_HALT_POLL_NS_START  10000
+#define KVM_HALT_POLL_NS_MAX    200000
+
+#ifdef CONFIG_LINUX
+/* Wait for qemu_cpu_kick() with the global mutex released.  The vCPU first
+ * spins for halt_poll_ns: a wakeup that comes within that window costs
+ * neither a context switch nor a signal.  The window grows while wakeups
+ * come soon after it expires, and shrinks when the vCPU sleeps longer
+ * than the maximum.
+ */
+static void qemu_kvm_halt_wait(CPUArchState *env)
+{
+    CPUState *cpu = ENV_GET_CPU(env);
+    struct pollfd pfd;
+    int64_t start, block_ns;
+
+    cpu->halt_waiting = true;
+    smp_mb();
+    if (cpu->kick_pending) {
+        goto out;
+    }
+    qemu_mutex_unlock_iothread();
+
+    start = get_clock();
+    while (!cpu->kick_pending && get_clock() - start < cpu->halt_poll_ns) {
+        barrier();
+    }
+
+    pfd.fd = event_notifier_get_fd(cpu->halt_notifier);
+    pfd.events = POLLIN;
+    while (!cpu->kick_pending) {
+        poll(&pfd, 1, -1);
+        event_notifier_test_and_clear(cpu->halt_notifier);
+    }
+
+    block_ns = get_clock() - start;
+    if (block_ns <= cpu->halt_poll_ns) {
+        /* caught while polling */
+    } else if (block_ns > KVM_HALT_POLL_NS_MAX) {
+        cpu->halt_poll_ns /= 2;
+    } else if (cpu->halt_poll_ns < KVM_HALT_POLL_NS_MAX) {
+        cpu->halt_poll_ns = cpu->halt_poll_ns ? cpu->halt_poll_ns * 2
+                                              : KVM_HALT_POLL_NS_START;
+        cpu->halt_poll_ns = MIN(cpu->halt_poll_ns, KVM_HALT_POLL_NS_MAX);
+    }
+
+    qemu_mutex_lock_iothread();
+out:
+    cpu->halt_waiting = false;
+    /* the caller checks again for whatever caused the kick */
+    cpu->kick_pending = false;
+}
+#else
+static void qemu_kvm_halt_wait(CPUArchState *env)
+{
+    qemu_cond_wait(env->halt_cond, &qemu_global_mutex);
+}
+#endif
+
+static void qemu_kvm_wait_io_event(CPUArchState *env)
+{
+    CPUState *cpu = ENV_GET_CPU(env);
+
+    while (cpu_thread_is_idle(env)) {
+        if (cpu->halt_notifier) {
+            qemu_kvm_halt_wait(env);
+        } else {
+            qemu_cond_wait(env->halt_cond, &qemu_global_mutex);
+        }
+    }
+
     qemu_kvm_eat_signals(env);
     qemu_wait_io_event_common(env);
 }
 
+/* Runs on the vCPU thread, at startup or when a parked CPU is plugged */
+static void qemu_kvm_create_vcpu(void *arg)
+{
+    CPUArchState *env = arg;
+    int r;
+
+    r = kvm_init_vcpu(env);
+    if (r < 0) {
+        fprintf(stderr, "kvm_init_vcpu failed: %s\n", strerror(-r));
+        exit(1);
+    }
+
+    qemu_kvm_init_cpu_signals(env);
+}
+
 static void *qemu_kvm_cpu_thread_fn(void *arg)
 {
     CPUArchState *env = arg;
@@ -737,17 +986,14 @@ static void *qemu_kvm_cpu_thread_fn(void *arg)
 
     qemu_mutex_lock(&qemu_global_mutex);
     qemu_thread_get_self(cpu->thread);
+    rcu_register_thread();
     env->thread_id = qemu_get_thread_id();
     cpu_single_env = env;
 
-    r = kvm_init_vcpu(env);
-    if (r < 0) {
-        fprintf(stderr, "kvm_init_vcpu failed: %s\n", strerror(-r));
-        exit(1);
+    if (!env->parked) {
+        qemu_kvm_create_vcpu(env);
     }
 
-    qemu_kvm_init_cpu_signals(env);
-
     /* signal CPU creation */
     env->created = 1;
     qemu_cond_signal(&qemu_cpu_cond);
@@ -778,6 +1024,7 @@ static void *qemu_dummy_cpu_thread_fn(void *arg)
 
     qemu_mutex_lock_iothread();
     qemu_thread_get_self(cpu->thread);
+    rcu_register_thread();
     env->thread_id = qemu_get_thread_id();
 
     sigemptyset(&waitset);
@@ -809,6 +1056,7 @@ static void *qemu_dummy_cpu_thread_fn(void *arg)
 }
 
 static void tcg_exec_all(void);
+static int tcg_cpu_exec(CPUArchState *env);
 
 static void *qemu_tcg_cpu_thread_fn(void *arg)
 {
@@ -817,6 +1065,7 @@ static void *qemu_tcg_cpu_thread_fn(void *arg)
 
     qemu_tcg_init_cpu_signals();
     qemu_thread_get_self(cpu->thread);
+    rcu_register_thread();
 
     /* signal CPU creation */
     qemu_mutex_lock(&qemu_global_mutex);
@@ -847,6 +1096,182 @@ static void *qemu_tcg_cpu_thread_fn(void *arg)
     return NULL;
 }
 
+static void tcg_exec_start(void)
+{
+    qemu_mutex_lock(&tcg_exclusive_lock);
+    while (tcg_exclusive_pending) {
+        qemu_cond_wait(&tcg_exclusive_resume, &tcg_exclusive_lock);
+    }
+    tcg_exec_count++;
+    tls_var(tcg_vcpu_running) = true;
+    qemu_mutex_unlock(&tcg_exclusive_lock);
+}
+
+static void tcg_exec_end(void)
+{
+    qemu_mutex_lock(&tcg_exclusive_lock);
+    tls_var(tcg_vcpu_running) = false;
+    if (--tcg_exec_count == 0 && tcg_exclusive_pending) {
+        qemu_cond_signal(&tcg_exclusive_cond);
+    }
+    qemu_mutex_unlock(&tcg_exclusive_lock);
+}
+
+static void tcg_cpu_exec_enter(void)
+{
+    qemu_mutex_lock(&tcg_exclusive_lock);
+    while (tcg_flush_pending || tcg_flushing) {
+        if (tcg_flushing || tcg_cpu_exec_count > 0) {
+            qemu_cond_wait(&tcg_exclusive_resume, &tcg_exclusive_lock);
+            continue;
+        }
+        tcg_flush_pending = false;
+        tcg_flushing = true;
+        qemu_mutex_unlock(&tcg_exclusive_lock);
+        tb_flush_idle();
+        qemu_mutex_lock(&tcg_exclusive_lock);
+        tcg_flushing = false;
+        qemu_cond_broadcast(&tcg_exclusive_resume);
+    }
+    tcg_cpu_exec_count++;
+    qemu_mutex_unlock(&tcg_exclusive_lock);
+}
+
+static void tcg_cpu_exec_leave(void)
+{
+    qemu_mutex_lock(&tcg_exclusive_lock);
+    if (--tcg_cpu_exec_count == 0 && tcg_flush_pending) {
+        qemu_cond_broadcast(&tcg_exclusive_resume);
+    }
+    qemu_mutex_unlock(&tcg_exclusive_lock);
+}
+
+void qemu_tcg_flush_request(void)
+{
+    CPUArchState *env;
+
+    qemu_mutex_lock(&tcg_exclusive_lock);
+    tcg_flush_pending = true;
+    qemu_mutex_unlock(&tcg_exclusive_lock);
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        env->exit_request = 1;
+    }
+}
+
+static void *qemu_tcg_mttcg_cpu_thread_fn(void *arg)
+{
+    CPUArchState *env = arg;
+    CPUState *cpu = ENV_GET_CPU(env);
+    int r;
+
+    qemu_mutex_lock(&qemu_global_mutex);
+    qemu_thread_get_self(cpu->thread);
+    rcu_register_thread();
+    env->thread_id = qemu_get_thread_id();
+
+    /* signal CPU creation */
+    env->created = 1;
+    qemu_cond_signal(&qemu_cpu_cond);
+
+    while (1) {
+        if (cpu_can_run(env)) {
+            qemu_mutex_unlock(&qemu_global_mutex);
+            tcg_cpu_exec_enter();
+            tcg_exec_start();
+            r = tcg_cpu_exec(env);
+            tcg_exec_end();
+            tcg_cpu_exec_leave();
+            qemu_mutex_lock(&qemu_global_mutex);
+            if (r == EXCP_DEBUG) {
+                cpu_handle_guest_debug(env);
+            }
+        }
+        qemu_tcg_mttcg_wait_io_event(env);
+    }
+
+    return NULL;
+}
+
+bool qemu_tcg_io_lock(void)
+{
+    if (!tls_var(tcg_vcpu_running)) {
+        return false;
+    }
+    tcg_exec_end();
+    qemu_mutex_lock(&qemu_global_mutex);
+    tls_var(tcg_io_locked) = true;
+    return true;
+}
+
+void qemu_tcg_io_unlock(bool locked)
+{
+    if (locked) {
+        tls_var(tcg_io_locked) = false;
+        qemu_mutex_unlock(&qemu_global_mutex);
+        tcg_exec_start();
+    }
+}
+
+/* cpu_exec() calls this after a longjmp, which may have skipped the
+   qemu_tcg_io_unlock() */
+void qemu_tcg_io_lock_reset(void)
+{
+    qemu_tcg_io_unlock(tls_var(tcg_io_locked));
+}
+
+void qemu_tcg_exec_pause(void)
+{
+    if (tls_var(tcg_vcpu_running)) {
+        tcg_exec_end();
+        tls_var(tcg_exec_paused) = true;
+    }
+}
+
+void qemu_tcg_exec_resume(void)
+{
+    if (tls_var(tcg_exec_paused)) {
+        tls_var(tcg_exec_paused) = false;
+        tcg_exec_start();
+    }
+}
+
+void qemu_tcg_start_exclusive(void)
+{
+    CPUArchState *env;
+
+    if (!mttcg_enabled || tls_var(tcg_exclusive_depth)++ > 0) {
+        return;
+    }
+    qemu_tcg_exec_pause();
+
+    qemu_mutex_lock(&tcg_exclusive_lock);
+    while (tcg_exclusive_pending) {
+        qemu_cond_wait(&tcg_exclusive_resume, &tcg_exclusive_lock);
+    }
+    tcg_exclusive_pending = true;
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        env->exit_request = 1;
+    }
+    while (tcg_exec_count > 0) {
+        qemu_cond_wait(&tcg_exclusive_cond, &tcg_exclusive_lock);
+    }
+    qemu_mutex_unlock(&tcg_exclusive_lock);
+}
+
+void qemu_tcg_end_exclusive(void)
+{
+    if (!mttcg_enabled || --tls_var(tcg_exclusive_depth) > 0) {
+        return;
+    }
+
+    qemu_mutex_lock(&tcg_exclusive_lock);
+    tcg_exclusive_pending = false;
+    qemu_cond_broadcast(&tcg_exclusive_resume);
+    qemu_mutex_unlock(&tcg_exclusive_lock);
+
+    qemu_tcg_exec_resume();
+}
+
 static void qemu_cpu_kick_thread(CPUArchState *env)
 {
     CPUState *cpu = ENV_GET_CPU(env);
@@ -873,7 +1298,19 @@ void qemu_cpu_kick(void *_env)
     CPUState *cpu = ENV_GET_CPU(env);
 
     qemu_cond_broadcast(env->halt_cond);
-    if (!tcg_enabled() && !cpu->thread_kicked) {
+    if (cpu->halt_notifier) {
+        /* a vCPU waiting in qemu_kvm_halt_wait() needs no signal */
+        cpu->kick_pending = true;
+        smp_mb();
+        if (cpu->halt_waiting) {
+            event_notifier_set(cpu->halt_notifier);
+            return;
+        }
+    }
+    if (mttcg_enabled) {
+        /* checked by cpu_exec() between translation blocks */
+        env->exit_request = 1;
+    } else if (!tcg_enabled() && !cpu->thread_kicked) {
         qemu_cpu_kick_thread(env);
         cpu->thread_kicked = true;
     }
@@ -904,21 +1341,48 @@ int qemu_cpu_is_self(void *_env)
 
 void qemu_mutex_lock_iothread(void)
 {
-    if (!tcg_enabled()) {
-        qemu_mutex_lock(&qemu_global_mutex);
+    CPUArchState *env = cpu_single_env;
+    int64_t start = lock_stats_start();
+    int64_t vcpu_start = 0;
+    bool contended = false;
+
+    if (env) {
+        vcpu_start = start ? start : get_clock();
+    }
+
+    if (!tcg_enabled() || mttcg_enabled) {
+        if (!start) {
+            qemu_mutex_lock(&qemu_global_mutex);
+        } else if (qemu_mutex_trylock(&qemu_global_mutex)) {
+            contended = true;
+            qemu_mutex_lock(&qemu_global_mutex);
+        }
     } else {
         iothread_requesting_mutex = true;
         if (qemu_mutex_trylock(&qemu_global_mutex)) {
+            contended = true;
             qemu_cpu_kick_thread(first_cpu);
             qemu_mutex_lock(&qemu_global_mutex);
         }
         iothread_requesting_mutex = false;
         qemu_cond_broadcast(&qemu_io_proceeded_cond);
     }
+    if (unlikely(start)) {
+        tls_var(iothread_locked_at) =
+            lock_stats_acquired(&iothread_lock_stats, start, contended,
+                                __builtin_return_address(0));
+    }
+    if (env) {
+        env->time_stats.lock_wait_ns += get_clock() - vcpu_start;
+    }
 }
 
 void qemu_mutex_unlock_iothread(void)
 {
+    if (unlikely(tls_var(iothread_locked_at))) {
+        lock_stats_released(&iothread_lock_stats, tls_var(iothread_locked_at));
+        tls_var(iothread_locked_at) = 0;
+    }
     qemu_mutex_unlock(&qemu_global_mutex);
 }
 
@@ -936,6 +1400,19 @@ static int all_vcpus_paused(void)
     return 1;
 }
 
+/* True on the thread of a vCPU, which cannot wait for itself to stop */
+static bool qemu_in_vcpu_thread(void)
+{
+    CPUArchState *env;
+
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        if (ENV_GET_CPU(env)->thread && qemu_cpu_is_self(env)) {
+            return true;
+        }
+    }
+    return false;
+}
+
 void pause_all_vcpus(void)
 {
     CPUArchState *penv = first_cpu;
@@ -947,9 +1424,9 @@ void pause_all_vcpus(void)
         penv = penv->next_cpu;
     }
 
-    if (!qemu_thread_is_self(&io_thread)) {
+    if (qemu_in_vcpu_thread()) {
         cpu_stop_current();
-        if (!kvm_enabled()) {
+        if (!kvm_enabled() && !mttcg_enabled) {
             while (penv) {
                 penv->stop = 0;
                 penv->stopped = 1;
@@ -976,7 +1453,9 @@ void resume_all_vcpus(void)
     qemu_clock_enable(vm_clock, true);
     while (penv) {
         penv->stop = 0;
-        penv->stopped = 0;
+        if (!penv->parked) {
+            penv->stopped = 0;
+        }
         qemu_cpu_kick(penv);
         penv = penv->next_cpu;
     }
@@ -987,6 +1466,19 @@ static void qemu_tcg_init_vcpu(void *_env)
     CPUArchState *env = _env;
     CPUState *cpu = ENV_GET_CPU(env);
 
+    /* one thread per cpu with multi-threaded TCG */
+    if (mttcg_enabled) {
+        cpu->thread = g_malloc0(sizeof(QemuThread));
+        env->halt_cond = g_malloc0(sizeof(QemuCond));
+        qemu_cond_init(env->halt_cond);
+        qemu_thread_create(cpu->thread, qemu_tcg_mttcg_cpu_thread_fn, env,
+                           QEMU_THREAD_JOINABLE);
+        while (env->created == 0) {
+            qemu_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
+        }
+        return;
+    }
+
     /* share a single thread for all cpus with TCG */
     if (!tcg_cpu_thread) {
         cpu->thread = g_malloc0(sizeof(QemuThread));
@@ -1015,6 +1507,16 @@ static void qemu_kvm_start_vcpu(CPUArchState *env)
     cpu->thread = g_malloc0(sizeof(QemuThread));
     env->halt_cond = g_malloc0(sizeof(QemuCond));
     qemu_cond_init(env->halt_cond);
+    cpu->halt_notifier = g_new0(EventNotifier, 1);
+    if (event_notifier_init(cpu->halt_notifier, 0) < 0) {
+        g_free(cpu->halt_notifier);
+        cpu->halt_notifier = NULL;
+    }
+    if (env->parked) {
+        /* no KVM vCPU yet, the state in env is the only one */
+        env->kvm_fd = -1;
+        env->kvm_vcpu_dirty = 1;
+    }
     qemu_thread_create(cpu->thread, qemu_kvm_cpu_thread_fn, env,
                        QEMU_THREAD_JOINABLE);
     while (env->created == 0) {
@@ -1043,6 +1545,7 @@ void qemu_init_vcpu(void *_env)
     env->nr_cores = smp_cores;
     env->nr_threads = smp_threads;
     env->stopped = 1;
+    env->parked = qemu_vcpu_parked_at_start(env);
     if (kvm_enabled()) {
         qemu_kvm_start_vcpu(env);
     } else if (tcg_enabled()) {
@@ -1052,6 +1555,47 @@ void qemu_init_vcpu(void *_env)
     }
 }
 
+void qemu_enable_vcpu_parking(void)
+{
+    vcpu_parking = true;
+}
+
+bool qemu_vcpu_parked_at_start(CPUArchState *env)
+{
+    return vcpu_parking && env->cpu_index >= smp_cpus;
+}
+
+/*
+ * A parked CPU exists but is not plugged into the machine: it never runs
+ * and its thread sleeps.  With KVM, a CPU that starts parked gets its
+ * kernel vCPU only when it is first plugged, and keeps it when it is
+ * parked again, so plugging it back only loads its state.
+ */
+void qemu_park_vcpu(CPUArchState *env)
+{
+    env->parked = 1;
+    env->stopped = 1;
+    qemu_cpu_kick(env);
+}
+
+void qemu_unpark_vcpu(CPUArchState *env)
+{
+    if (!env->parked) {
+        return;
+    }
+
+    if (kvm_enabled() && !env->kvm_state) {
+        run_on_cpu(env, qemu_kvm_create_vcpu, env);
+    }
+    cpu_synchronize_post_init(env);
+
+    env->parked = 0;
+    if (runstate_is_running()) {
+        env->stopped = 0;
+        qemu_cpu_kick(env);
+    }
+}
+
 void cpu_stop_current(void)
 {
     if (cpu_single_env) {
@@ -1062,9 +1606,12 @@ void cpu_stop_current(void)
     }
 }
 
+/* Other threads than the vCPUs, such as the migration thread, must hold
+   the iothread lock; the VM is stopped when this returns.  A vCPU only
+   requests the stop, which the main loop carries out.  */
 void vm_stop(RunState state)
 {
-    if (!qemu_thread_is_self(&io_thread)) {
+    if (qemu_in_vcpu_thread()) {
         qemu_system_vmstop_request(state);
         /*
          * FIXME: should not return to device code in case
@@ -1073,6 +1620,7 @@ void vm_stop(RunState state)
         cpu_stop_current();
         return;
     }
+    qemu_ram_prealloc_cancel_start();
     do_vm_stop(state);
 }
 
@@ -1199,6 +1747,30 @@ void list_cpus(FILE *f, fprintf_function cpu_fprintf, const char *optarg)
 #endif
 }
 
+/* Time the vCPU thread was runnable but waited for a host CPU, in ns,
+   or -1 if the host does not tell */
+static int64_t vcpu_run_delay(CPUArchState *env)
+{
+#ifdef CONFIG_LINUX
+    char path[64];
+    unsigned long long exec_ns, delay_ns;
+    FILE *f;
+    int n;
+
+    snprintf(path, sizeof(path), "/proc/self/task/%d/schedstat",
+             env->thread_id);
+    f = fopen(path, "r");
+    if (!f) {
+        return -1;
+    }
+    n = fscanf(f, "%llu %llu", &exec_ns, &delay_ns);
+    fclose(f);
+    return n == 2 ? delay_ns : -1;
+#else
+    return -1;
+#endif
+}
+
 CpuInfoList *qmp_query_cpus(Error **errp)
 {
     CpuInfoList *head = NULL, *cur_item = NULL;
@@ -1207,6 +1779,10 @@ CpuInfoList *qmp_query_cpus(Error **errp)
     for(env = first_cpu; env != NULL; env = env->next_cpu) {
         CpuInfoList *info;
 
+        if (env->parked) {
+            continue;
+        }
+
         cpu_synchronize_state(env);
 
         info = g_malloc0(sizeof(*info));
@@ -1230,6 +1806,15 @@ CpuInfoList *qmp_query_cpus(Error **errp)
         info->value->has_PC = true;
         info->value->PC = env->active_tc.PC;
 #endif
+        info->value->run_delay_ns = vcpu_run_delay(env);
+        info->value->has_run_delay_ns = info->value->run_delay_ns >= 0;
+        info->value->lock_wait_ns = env->time_stats.lock_wait_ns;
+        if (kvm_enabled()) {
+            info->value->has_kvm_run_ns = true;
+            info->value->kvm_run_ns = env->time_stats.kvm_run_ns;
+            info->value->has_kvm_exit_ns = true;
+            info->value->kvm_exit_ns = env->time_stats.kvm_exit_ns;
+        }
 
         /* XXX: waiting for the qapi to support GSList */
         if (!cur_item) {
@@ -1243,6 +1828,60 @@ CpuInfoList *qmp_query_cpus(Error **errp)
     return head;
 }
 
+static QEMUTimer *vcpu_times_timer;
+static int64_t vcpu_times_interval;
+
+static void vcpu_times_event(void *opaque)
+{
+    QList *cpus = qlist_new();
+    QObject *data;
+    CPUArchState *env;
+
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        int64_t run_delay = vcpu_run_delay(env);
+        QDict *cpu;
+
+        cpu = qobject_to_qdict(qobject_from_jsonf(
+            "{ 'CPU': %d, 'lock-wait-ns': %" PRId64 " }",
+            env->cpu_index, env->time_stats.lock_wait_ns));
+        if (run_delay >= 0) {
+            qdict_put(cpu, "run-delay-ns", qint_from_int(run_delay));
+        }
+        if (kvm_enabled()) {
+            qdict_put(cpu, "kvm-run-ns",
+                      qint_from_int(env->time_stats.kvm_run_ns));
+            qdict_put(cpu, "kvm-exit-ns",
+                      qint_from_int(env->time_stats.kvm_exit_ns));
+        }
+        qlist_append(cpus, cpu);
+    }
+    data = qobject_from_jsonf("{ 'cpus': %p }", cpus);
+    monitor_protocol_event(QEVENT_VCPU_TIMES, data);
+    qobject_decref(data);
+
+    qemu_mod_timer(vcpu_times_timer,
+                   qemu_get_clock_ms(rt_clock) + vcpu_times_interval);
+}
+
+void qmp_vcpu_times_event_set(int64_t interval, Error **errp)
+{
+    if (interval < 0) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "interval",
+                  "a positive number of milliseconds or 0");
+        return;
+    }
+    if (!vcpu_times_timer) {
+        vcpu_times_timer = qemu_new_timer_ms(rt_clock, vcpu_times_event, NULL);
+    }
+    vcpu_times_interval = interval;
+    if (interval) {
+        qemu_mod_timer(vcpu_times_timer,
+                       qemu_get_clock_ms(rt_clock) + interval);
+    } else {
+        qemu_del_timer(vcpu_times_timer);
+    }
+}
+
 void qmp_memsave(int64_t addr, int64_t size, const char *filename,
                  bool has_cpu, int64_t cpu_index, Error **errp)
 {
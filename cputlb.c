@@ -21,6 +21,8 @@
 #include "cpu.h"
 #include "exec-all.h"
 #include "memory.h"
+#include "qemu-timer.h"
+#include "qemu-rcu.h"
 
 #include "cputlb.h"
 
@@ -32,6 +34,7 @@
 
 /* statistics */
 int tlb_flush_count;
+int tlb_victim_hit_count;
 
 static const CPUTLBEntry s_cputlb_empty_entry = {
     .addr_read  = -1,
@@ -52,9 +55,40 @@ static const CPUTLBEntry s_cputlb_empty_entry = {
  * entries from the TLB at any time, so flushing more entries than
  * required is only an efficiency issue, not a correctness issue.
  */
+#ifdef CPU_TLB_DYNAMIC
+/* window over which the TLB use is observed before shrinking */
+#define TLB_RESIZE_WINDOW (get_ticks_per_sec() / 10)
+
+/* Pick the TLB size for after a flush.  Grow at once if most of the
+   entries were filled since the previous flush.  Shrink if few of them
+   were during a whole window, so that frequent flushes stay cheap.  The
+   fills of all the MMU modes are counted together.  */
+static void tlb_resize(CPUArchState *env)
+{
+    size_t n = tlb_n_entries(env);
+    int64_t now = get_clock();
+
+    env->tlb_window_used = MAX(env->tlb_window_used, env->tlb_used);
+    if (env->tlb_used > n * 7 / 10 && n < CPU_TLB_SIZE) {
+        n *= 2;
+        env->tlb_window_used = 0;
+        env->tlb_window_start = now;
+    } else if (now - env->tlb_window_start > TLB_RESIZE_WINDOW) {
+        if (env->tlb_window_used < n * 3 / 10 &&
+            n > (1 << CPU_TLB_MIN_BITS)) {
+            n /= 2;
+        }
+        env->tlb_window_used = 0;
+        env->tlb_window_start = now;
+    }
+    env->tlb_used = 0;
+    env->tlb_mask = (uintptr_t)(n - 1) << CPU_TLB_ENTRY_BITS;
+}
+#endif
+
 void tlb_flush(CPUArchState *env, int flush_global)
 {
-    int i;
+    int mmu_idx;
 
 #if defined(DEBUG_TLB)
     printf("tlb_flush:\n");
@@ -63,12 +97,16 @@ void tlb_flush(CPUArchState *env, int flush_global)
        links while we are modifying them */
     env->current_tb = NULL;
 
-    for (i = 0; i < CPU_TLB_SIZE; i++) {
-        int mmu_idx;
-
-        for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-            env->tlb_table[mmu_idx][i] = s_cputlb_empty_entry;
-        }
+#ifdef CPU_TLB_DYNAMIC
+    tlb_resize(env);
+#endif
+    /* only the entries in use need clearing; the others are cleared when
+       the TLB grows again */
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        memset(env->tlb_table[mmu_idx], -1,
+               tlb_n_entries(env) * sizeof(CPUTLBEntry));
+        memset(env->tlb_v_table[mmu_idx], -1,
+               sizeof(env->tlb_v_table[0]));
     }
 
     memset(env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof (void *));
@@ -78,14 +116,27 @@ void tlb_flush(CPUArchState *env, int flush_global)
     tlb_flush_count++;
 }
 
+static inline bool tlb_hit_page(target_ulong tlb_addr, target_ulong page)
+{
+    return page == (tlb_addr & (TARGET_PAGE_MASK | TLB_INVALID_MASK));
+}
+
+static inline bool tlb_entry_is_page(CPUTLBEntry *tlb_entry, target_ulong page)
+{
+    return tlb_hit_page(tlb_entry->addr_read, page) ||
+           tlb_hit_page(tlb_entry->addr_write, page) ||
+           tlb_hit_page(tlb_entry->addr_code, page);
+}
+
+static inline bool tlb_entry_is_empty(CPUTLBEntry *tlb_entry)
+{
+    return tlb_entry->addr_read == -1 && tlb_entry->addr_write == -1 &&
+           tlb_entry->addr_code == -1;
+}
+
 static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
 {
-    if (addr == (tlb_entry->addr_read &
-                 (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
-        addr == (tlb_entry->addr_write &
-                 (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
-        addr == (tlb_entry->addr_code &
-                 (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
+    if (tlb_entry_is_page(tlb_entry, addr)) {
         *tlb_entry = s_cputlb_empty_entry;
     }
 }
@@ -113,9 +164,14 @@ void tlb_flush_page(CPUArchState *env, target_ulong addr)
     env->current_tb = NULL;
 
     addr &= TARGET_PAGE_MASK;
-    i = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    i = tlb_index(env, addr);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        int k;
+
         tlb_flush_entry(&env->tlb_table[mmu_idx][i], addr);
+        for (k = 0; k < CPU_VTLB_SIZE; k++) {
+            tlb_flush_entry(&env->tlb_v_table[mmu_idx][k], addr);
+        }
     }
 
     tb_flush_jmp_cache(env, addr);
@@ -127,7 +183,7 @@ void tlb_protect_code(ram_addr_t ram_addr)
 {
     cpu_physical_memory_reset_dirty(ram_addr,
                                     ram_addr + TARGET_PAGE_SIZE,
-                                    CODE_DIRTY_FLAG);
+                                    DIRTY_MEMORY_CODE);
 }
 
 /* update the TLB so that writes in physical page 'phys_addr' are no longer
@@ -135,7 +191,7 @@ void tlb_protect_code(ram_addr_t ram_addr)
 void tlb_unprotect_code_phys(CPUArchState *env, ram_addr_t ram_addr,
                              target_ulong vaddr)
 {
-    cpu_physical_memory_set_dirty_flags(ram_addr, CODE_DIRTY_FLAG);
+    cpu_physical_memory_set_dirty_flag(ram_addr, DIRTY_MEMORY_CODE);
 }
 
 static bool tlb_is_dirty_ram(CPUTLBEntry *tlbe)
@@ -181,10 +237,14 @@ void cpu_tlb_reset_dirty_all(ram_addr_t start1, ram_addr_t length)
         for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
             unsigned int i;
 
-            for (i = 0; i < CPU_TLB_SIZE; i++) {
+            for (i = 0; i < tlb_n_entries(env); i++) {
                 tlb_reset_dirty_range(&env->tlb_table[mmu_idx][i],
                                       start1, length);
             }
+            for (i = 0; i < CPU_VTLB_SIZE; i++) {
+                tlb_reset_dirty_range(&env->tlb_v_table[mmu_idx][i],
+                                      start1, length);
+            }
         }
     }
 }
@@ -204,10 +264,83 @@ void tlb_set_dirty(CPUArchState *env, target_ulong vaddr)
     int mmu_idx;
 
     vaddr &= TARGET_PAGE_MASK;
-    i = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    i = tlb_index(env, vaddr);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        int k;
+
         tlb_set_dirty1(&env->tlb_table[mmu_idx][i], vaddr);
+        for (k = 0; k < CPU_VTLB_SIZE; k++) {
+            tlb_set_dirty1(&env->tlb_v_table[mmu_idx][k], vaddr);
+        }
+    }
+}
+
+/* Look for the page of addr in the victim TLB, and swap the entry found
+   with the TLB entry at index.  elt_ofs is the offset of the addr_read,
+   addr_write or addr_code field to match.  */
+bool tlb_victim_hit(CPUArchState *env, int mmu_idx, int index,
+                    size_t elt_ofs, target_ulong page)
+{
+    int k;
+
+    for (k = 0; k < CPU_VTLB_SIZE; k++) {
+        CPUTLBEntry *vte = &env->tlb_v_table[mmu_idx][k];
+        target_ulong cmp = *(target_ulong *)((uintptr_t)vte + elt_ofs);
+
+        if (tlb_hit_page(cmp, page)) {
+            CPUTLBEntry *te = &env->tlb_table[mmu_idx][index];
+            CPUTLBEntry tmp = *te;
+            target_phys_addr_t iotlb = env->iotlb[mmu_idx][index];
+
+            *te = *vte;
+            *vte = tmp;
+            env->iotlb[mmu_idx][index] = env->iotlb_v[mmu_idx][k];
+            env->iotlb_v[mmu_idx][k] = iotlb;
+            tlb_victim_hit_count++;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Fill the TLB entry for a store to the page of addr; returns its index */
+static int tlb_fill_write(CPUArchState *env, target_ulong addr, int mmu_idx,
+                          uintptr_t retaddr)
+{
+    target_ulong page = addr & TARGET_PAGE_MASK;
+    int index = tlb_index(env, addr);
+
+    if (!tlb_hit_page(env->tlb_table[mmu_idx][index].addr_write, page) &&
+        !tlb_victim_hit(env, mmu_idx, index,
+                        offsetof(CPUTLBEntry, addr_write), page)) {
+        tlb_fill(env, addr, 1, mmu_idx, retaddr);
+        /* the fill may have resized the TLB */
+        index = tlb_index(env, addr);
+    }
+    return index;
+}
+
+/* Fill the TLB for a store of size bytes to addr, raising the faults the
+   store would raise, and return the host address that it writes.  NULL
+   means that the store must go through the softmmu: MMIO, pages that are
+   watched for code or dirty logging, and accesses that cross a page.  */
+void *tlb_vaddr_to_host_write(CPUArchState *env, target_ulong addr, int size,
+                              int mmu_idx, uintptr_t retaddr)
+{
+    target_ulong last = addr + size - 1;
+    int index;
+
+    if ((last & TARGET_PAGE_MASK) != (addr & TARGET_PAGE_MASK)) {
+        tlb_fill_write(env, addr, mmu_idx, retaddr);
+        tlb_fill_write(env, last, mmu_idx, retaddr);
+        return NULL;
+    }
+
+    index = tlb_fill_write(env, addr, mmu_idx, retaddr);
+    if (env->tlb_table[mmu_idx][index].addr_write & ~TARGET_PAGE_MASK) {
+        return NULL;
     }
+    return (void *)((uintptr_t)addr + env->tlb_table[mmu_idx][index].addend);
 }
 
 /* Our TLB does not support large pages, so remember the area covered by
@@ -252,6 +385,7 @@ void tlb_set_page(CPUArchState *env, target_ulong vaddr,
     if (size != TARGET_PAGE_SIZE) {
         tlb_add_large_page(env, vaddr, size);
     }
+    rcu_read_lock();
     section = phys_page_find(paddr >> TARGET_PAGE_BITS);
 #if defined(DEBUG_TLB)
     printf("tlb_set_page: vaddr=" TARGET_FMT_lx " paddr=0x" TARGET_FMT_plx
@@ -277,9 +411,18 @@ void tlb_set_page(CPUArchState *env, target_ulong vaddr,
     iotlb = memory_region_section_get_iotlb(env, section, vaddr, paddr, prot,
                                             &address);
 
-    index = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-    env->iotlb[mmu_idx][index] = iotlb - vaddr;
+    index = tlb_index(env, vaddr);
     te = &env->tlb_table[mmu_idx][index];
+    if (tlb_entry_is_empty(te)) {
+        env->tlb_used++;
+    } else if (!tlb_entry_is_page(te, vaddr & TARGET_PAGE_MASK)) {
+        /* keep the entry being replaced in the victim TLB */
+        unsigned int vidx = env->vtlb_index++ % CPU_VTLB_SIZE;
+
+        env->tlb_v_table[mmu_idx][vidx] = *te;
+        env->iotlb_v[mmu_idx][vidx] = env->iotlb[mmu_idx][index];
+    }
+    env->iotlb[mmu_idx][index] = iotlb - vaddr;
     te->addend = addend - vaddr;
     if (prot & PAGE_READ) {
         te->addr_read = address;
@@ -308,6 +451,7 @@ void tlb_set_page(CPUArchState *env, target_ulong vaddr,
     } else {
         te->addr_write = -1;
     }
+    rcu_read_unlock();
 }
 
 /* NOTE: this function can trigger an exception */
@@ -321,7 +465,7 @@ tb_page_addr_t get_page_addr_code(CPUArchState *env1, target_ulong addr)
     void *p;
     MemoryRegion *mr;
 
-    page_index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    page_index = tlb_index(env1, addr);
     mmu_idx = cpu_mmu_index(env1);
     if (unlikely(env1->tlb_table[mmu_idx][page_index].addr_code !=
                  (addr & TARGET_PAGE_MASK))) {
@@ -330,6 +474,8 @@ tb_page_addr_t get_page_addr_code(CPUArchState *env1, target_ulong addr)
 #else
         ldub_code(addr);
 #endif
+        /* the fill may have resized the TLB */
+        page_index = tlb_index(env1, addr);
     }
     pd = env1->iotlb[mmu_idx][page_index] & ~TARGET_PAGE_MASK;
     mr = iotlb_to_region(pd);
@@ -28,6 +28,10 @@
 #include "qemu_socket.h"
 #include "iov.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 void strpadcpy(char *buf, int buf_size, const char *str, char pad)
 {
     int len = qemu_strnlen(str, buf_size);
@@ -246,12 +250,10 @@ size_t qemu_iovec_memset(QEMUIOVector *qiov, size_t offset,
 }
 
 /*
- * Checks if a buffer is all zeroes
- *
- * Attention! The len must be a multiple of 4 * sizeof(long) due to
- * restriction of optimizations in this function.
+ * Checks if a buffer is all zeroes, one long at a time.  The len must be
+ * a multiple of 4 * sizeof(long).
  */
-bool buffer_is_zero(const void *buf, size_t len)
+static bool buffer_is_zero_long(const void *buf, size_t len)
 {
     /*
      * Use long as the biggest available internal data type that fits into the
@@ -263,7 +265,6 @@ bool buffer_is_zero(const void *buf, size_t len)
     long d0, d1, d2, d3;
     const long * const data = buf;
 
-    assert(len % (4 * sizeof(long)) == 0);
     len /= sizeof(long);
 
     for (i = 0; i < len; i += 4) {
@@ -280,6 +281,120 @@ bool buffer_is_zero(const void *buf, size_t len)
     return true;
 }
 
+/*
+ * Vector versions.  They need buf aligned to the size of the vector, and
+ * len a multiple of four vectors.
+ */
+#ifdef __SSE2__
+static bool buffer_is_zero_sse2(const void *buf, size_t len)
+{
+    const __m128i *p = buf;
+    const __m128i zero = _mm_setzero_si128();
+    size_t i;
+
+    len /= sizeof(__m128i);
+
+    for (i = 0; i < len; i += 4) {
+        __m128i t = _mm_or_si128(_mm_or_si128(p[i + 0], p[i + 1]),
+                                 _mm_or_si128(p[i + 2], p[i + 3]));
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(t, zero)) != 0xFFFF) {
+            return false;
+        }
+    }
+
+    return true;
+}
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <cpuid.h>
+#include <immintrin.h>
+
+static bool buffer_is_zero_avx2(const void *buf, size_t len)
+{
+    const __m256i *p = buf;
+    size_t i;
+
+    len /= sizeof(__m256i);
+
+    for (i = 0; i < len; i += 4) {
+        __m256i t = _mm256_or_si256(_mm256_or_si256(p[i + 0], p[i + 1]),
+                                    _mm256_or_si256(p[i + 2], p[i + 3]));
+
+        if (!_mm256_testz_si256(t, t)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+#pragma GCC pop_options
+
+static bool cpu_has_avx2(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    if (__get_cpuid_max(0, NULL) < 7) {
+        return false;
+    }
+
+    /* the OS must also save the YMM registers on context switch */
+    __cpuid(1, eax, ebx, ecx, edx);
+    if ((ecx & (bit_OSXSAVE | bit_AVX)) != (bit_OSXSAVE | bit_AVX)) {
+        return false;
+    }
+    asm("xgetbv" : "=a" (eax), "=d" (edx) : "c" (0));
+    if ((eax & 6) != 6) {
+        return false;
+    }
+
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    return (ebx & bit_AVX2) != 0;
+}
+#endif
+
+static bool (*buffer_is_zero_vector)(const void *buf, size_t len);
+static size_t buffer_is_zero_vector_size;
+
+static void __attribute__((constructor)) init_buffer_is_zero(void)
+{
+#ifdef __SSE2__
+    buffer_is_zero_vector = buffer_is_zero_sse2;
+    buffer_is_zero_vector_size = sizeof(__m128i);
+#endif
+#ifdef CONFIG_AVX2_OPT
+    if (cpu_has_avx2()) {
+        buffer_is_zero_vector = buffer_is_zero_avx2;
+        buffer_is_zero_vector_size = sizeof(__m256i);
+    }
+#endif
+}
+
+/*
+ * Checks if a buffer is all zeroes
+ *
+ * Attention! The len must be a multiple of 4 * sizeof(long) due to
+ * restriction of optimizations in this function.  Suitably aligned
+ * buffers are checked with the widest vector unit the host supports.
+ */
+bool buffer_is_zero(const void *buf, size_t len)
+{
+    size_t vsize = buffer_is_zero_vector_size;
+
+    assert(len % (4 * sizeof(long)) == 0);
+
+    if (buffer_is_zero_vector &&
+        ((uintptr_t)buf & (vsize - 1)) == 0 &&
+        (len & (4 * vsize - 1)) == 0) {
+        return buffer_is_zero_vector(buf, len);
+    }
+
+    return buffer_is_zero_long(buf, len);
+}
+
 #ifndef _WIN32
 /* Sets a specific flag */
 int fcntl_setfl(int fd, int flag)
@@ -13,17 +13,31 @@
 
 #include "qemu-common.h"
 #include "dump.h"
+#include "sysemu.h"
 #include "qerror.h"
 #include "qmp-commands.h"
 
 /* we need this function in hmp.c */
 void qmp_dump_guest_memory(bool paging, const char *file, bool has_begin,
                            int64_t begin, bool has_length, int64_t length,
+                           bool has_detach, bool detach,
+                           bool has_format, DumpGuestMemoryFormat format,
                            Error **errp)
 {
     error_set(errp, QERR_UNSUPPORTED);
 }
 
+DumpQueryResult *qmp_query_dump(Error **errp)
+{
+    error_set(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
+bool dump_in_progress(void)
+{
+    return false;
+}
+
 int cpu_write_elf64_note(write_core_dump_function f,
                                        CPUArchState *env, int cpuid,
                                        void *opaque)
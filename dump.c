@@ -24,6 +24,124 @@
 #include "error.h"
 #include "qmp-commands.h"
 #include "gdbstub.h"
+#include "qemu-thread.h"
+#include "main-loop.h"
+#include "migration.h"
+#include "qemu-objects.h"
+#include <zlib.h>
+
+/* guest memory is written this much at a time, and zero chunks of this
+   size are left as holes in the ELF output when the file allows it */
+#define DUMP_CHUNK_SIZE             (16 * TARGET_PAGE_SIZE)
+
+/*
+ * kdump-compressed format, as written by makedumpfile and read by crash:
+ *
+ *   block 0: disk dump header
+ *   next sub_hdr_size blocks: kdump sub header and the ELF notes
+ *   next bitmap_blocks blocks: two bitmaps of the page frames; the first
+ *       one has the frames that exist, the second the ones that are dumped
+ *   one page descriptor for each dumped frame, in the order of the frames
+ *   the page data, compressed or not
+ *
+ * Frames are numbered like the ELF output without paging numbers its
+ * PT_LOADs, by the offset of the RAM block.  All zero frames share one
+ * page of data.
+ */
+#define KDUMP_SIGNATURE             "KDUMP   "
+#define SIG_LEN                     (sizeof(KDUMP_SIGNATURE) - 1)
+#define KDUMP_HEADER_VERSION        6
+#define DISKDUMP_HEADER_BLOCKS      1
+#define DUMP_LEVEL                  1   /* zero pages may be excluded */
+#define DUMP_DH_COMPRESSED_ZLIB     0x1
+
+/* pages handed to a compression thread at a time */
+#define DUMP_BATCH_PAGES            256
+#define DUMP_MAX_COMPRESS_THREADS   8
+
+typedef struct QEMU_PACKED NewUtsname {
+    char sysname[65];
+    char nodename[65];
+    char release[65];
+    char version[65];
+    char machine[65];
+    char domainname[65];
+} NewUtsname;
+
+typedef struct QEMU_PACKED DiskDumpHeader32 {
+    char signature[SIG_LEN];
+    uint32_t header_version;
+    NewUtsname utsname;
+    char timestamp[10];             /* struct timeval, with padding */
+    uint32_t status;
+    uint32_t block_size;
+    uint32_t sub_hdr_size;          /* in blocks */
+    uint32_t bitmap_blocks;
+    uint32_t max_mapnr;
+    uint32_t total_ram_blocks;
+    uint32_t device_blocks;
+    uint32_t written_blocks;
+    uint32_t current_cpu;
+    uint32_t nr_cpus;
+} DiskDumpHeader32;
+
+typedef struct QEMU_PACKED DiskDumpHeader64 {
+    char signature[SIG_LEN];
+    uint32_t header_version;
+    NewUtsname utsname;
+    char timestamp[22];             /* struct timeval, with padding */
+    uint32_t status;
+    uint32_t block_size;
+    uint32_t sub_hdr_size;
+    uint32_t bitmap_blocks;
+    uint32_t max_mapnr;
+    uint32_t total_ram_blocks;
+    uint32_t device_blocks;
+    uint32_t written_blocks;
+    uint32_t current_cpu;
+    uint32_t nr_cpus;
+} DiskDumpHeader64;
+
+typedef struct QEMU_PACKED KdumpSubHeader32 {
+    uint32_t phys_base;
+    uint32_t dump_level;
+    uint32_t split;
+    uint32_t start_pfn;
+    uint32_t end_pfn;
+    uint64_t offset_vmcoreinfo;
+    uint32_t size_vmcoreinfo;
+    uint64_t offset_note;
+    uint32_t note_size;
+    uint64_t offset_eraseinfo;
+    uint32_t size_eraseinfo;
+    uint64_t start_pfn_64;
+    uint64_t end_pfn_64;
+    uint64_t max_mapnr_64;
+} KdumpSubHeader32;
+
+typedef struct QEMU_PACKED KdumpSubHeader64 {
+    uint64_t phys_base;
+    uint32_t dump_level;
+    uint32_t split;
+    uint64_t start_pfn;
+    uint64_t end_pfn;
+    uint64_t offset_vmcoreinfo;
+    uint64_t size_vmcoreinfo;
+    uint64_t offset_note;
+    uint64_t note_size;
+    uint64_t offset_eraseinfo;
+    uint64_t size_eraseinfo;
+    uint64_t start_pfn_64;
+    uint64_t end_pfn_64;
+    uint64_t max_mapnr_64;
+} KdumpSubHeader64;
+
+typedef struct QEMU_PACKED PageDescriptor {
+    uint64_t offset;                /* of the page data in the file */
+    uint32_t size;
+    uint32_t flags;                 /* DUMP_DH_COMPRESSED_* */
+    uint64_t page_flags;
+} PageDescriptor;
 
 static uint16_t cpu_convert_to_target16(uint16_t val, int endian)
 {
@@ -58,6 +176,26 @@ static uint64_t cpu_convert_to_target64(uint64_t val, int endian)
     return val;
 }
 
+struct DumpState;
+
+/*
+ * Compression threads of a kdump-compressed dump.  Batches are handed
+ * out round robin, so waiting for the workers in the same order gives
+ * back the pages in the order of the frames.
+ */
+typedef struct DumpCompressJob {
+    QemuThread thread;
+    struct DumpState *s;
+    /* protected by DumpState.compress_lock */
+    bool busy;                  /* a batch was handed to this worker */
+    bool done;                  /* it is compressed and waiting */
+    /* owned by the worker while busy && !done */
+    uint8_t *in;                /* guest pages, the guest is stopped */
+    int nr_pages;
+    uint8_t *out;               /* one compressBound() slot per page */
+    size_t out_len[DUMP_BATCH_PAGES];   /* 0 for zero pages */
+} DumpCompressJob;
+
 typedef struct DumpState {
     ArchDumpInfo dump_info;
     MemoryMappingList list;
@@ -75,13 +213,58 @@ typedef struct DumpState {
     int64_t begin;
     int64_t length;
     Error **errp;
+
+    DumpGuestMemoryFormat format;
+    bool sparse;                /* zero chunks can be left as holes */
+    int64_t hole;               /* to skip before the next write */
+
+    /* detached dumps */
+    bool detached;
+    QemuThread thread;
+    QEMUBH *cleanup_bh;
+    int ret;
+    const char *error;
+    Error *blocker;
+
+    /* kdump-compressed output */
+    uint8_t *note_buf;
+    size_t note_buf_offset;
+    RAMBlock **blocks;          /* sorted by offset */
+    int nr_blocks;
+    uint64_t max_mapnr;
+    size_t len_dump_bitmap;     /* of each bitmap, rounded to blocks */
+    uint32_t sub_hdr_size;
+    off_t offset_bitmap;
+    off_t offset_page;
+    off_t offset_data;
+    DumpCompressJob *jobs;
+    int nr_jobs;
+    bool compress_quit;
+    QemuMutex compress_lock;
+    QemuCond work_cond;
+    QemuCond done_cond;
 } DumpState;
 
+/* The dump in progress if any or else the last one, see query-dump.
+   The counters are updated by the dump thread without a lock. */
+static struct {
+    DumpStatus status;
+    int64_t completed;
+    int64_t total;
+} dump_progress;
+
+bool dump_in_progress(void)
+{
+    return dump_progress.status == DUMP_STATUS_ACTIVE;
+}
+
 static int dump_cleanup(DumpState *s)
 {
     int ret = 0;
 
     memory_mapping_list_free(&s->list);
+    g_free(s->note_buf);
+    g_free(s->blocks);
     if (s->fd != -1) {
         close(s->fd);
     }
@@ -92,9 +275,13 @@ static int dump_cleanup(DumpState *s)
     return ret;
 }
 
+/* The caller cleans up once the dump is over; detached dumps report the
+   first reason in their DUMP_COMPLETED event */
 static void dump_error(DumpState *s, const char *reason)
 {
-    dump_cleanup(s);
+    if (!s->error) {
+        s->error = reason;
+    }
 }
 
 static int fd_write_vmcore(void *buf, size_t size, void *opaque)
@@ -275,7 +462,7 @@ static int write_elf64_note(DumpState *s)
     return 0;
 }
 
-static int write_elf64_notes(DumpState *s)
+static int write_elf64_notes(write_core_dump_function f, DumpState *s)
 {
     CPUArchState *env;
     int ret;
@@ -283,7 +470,7 @@ static int write_elf64_notes(DumpState *s)
 
     for (env = first_cpu; env != NULL; env = env->next_cpu) {
         id = cpu_index(env);
-        ret = cpu_write_elf64_note(fd_write_vmcore, env, id, s);
+        ret = cpu_write_elf64_note(f, env, id, s);
         if (ret < 0) {
             dump_error(s, "dump: failed to write elf notes.\n");
             return -1;
@@ -291,7 +478,7 @@ static int write_elf64_notes(DumpState *s)
     }
 
     for (env = first_cpu; env != NULL; env = env->next_cpu) {
-        ret = cpu_write_elf64_qemunote(fd_write_vmcore, env, s);
+        ret = cpu_write_elf64_qemunote(f, env, s);
         if (ret < 0) {
             dump_error(s, "dump: failed to write CPU status.\n");
             return -1;
@@ -325,7 +512,7 @@ static int write_elf32_note(DumpState *s)
     return 0;
 }
 
-static int write_elf32_notes(DumpState *s)
+static int write_elf32_notes(write_core_dump_function f, DumpState *s)
 {
     CPUArchState *env;
     int ret;
@@ -333,7 +520,7 @@ static int write_elf32_notes(DumpState *s)
 
     for (env = first_cpu; env != NULL; env = env->next_cpu) {
         id = cpu_index(env);
-        ret = cpu_write_elf32_note(fd_write_vmcore, env, id, s);
+        ret = cpu_write_elf32_note(f, env, id, s);
         if (ret < 0) {
             dump_error(s, "dump: failed to write elf notes.\n");
             return -1;
@@ -341,7 +528,7 @@ static int write_elf32_notes(DumpState *s)
     }
 
     for (env = first_cpu; env != NULL; env = env->next_cpu) {
-        ret = cpu_write_elf32_qemunote(fd_write_vmcore, env, s);
+        ret = cpu_write_elf32_qemunote(f, env, s);
         if (ret < 0) {
             dump_error(s, "dump: failed to write CPU status.\n");
             return -1;
@@ -385,6 +572,14 @@ static int write_data(DumpState *s, void *buf, int length)
 {
     int ret;
 
+    if (s->hole) {
+        if (lseek(s->fd, s->hole, SEEK_CUR) < 0) {
+            dump_error(s, "dump: failed to seek.\n");
+            return -1;
+        }
+        s->hole = 0;
+    }
+
     ret = fd_write_vmcore(buf, length, s);
     if (ret < 0) {
         dump_error(s, "dump: failed to save memory.\n");
@@ -394,27 +589,25 @@ static int write_data(DumpState *s, void *buf, int length)
     return 0;
 }
 
-/* write the memroy to vmcore. 1 page per I/O. */
+/* write the memory to vmcore, DUMP_CHUNK_SIZE per I/O */
 static int write_memory(DumpState *s, RAMBlock *block, ram_addr_t start,
                         int64_t size)
 {
-    int64_t i;
+    uint8_t *p = block->host + start;
+    int64_t done, len;
     int ret;
 
-    for (i = 0; i < size / TARGET_PAGE_SIZE; i++) {
-        ret = write_data(s, block->host + start + i * TARGET_PAGE_SIZE,
-                         TARGET_PAGE_SIZE);
-        if (ret < 0) {
-            return ret;
-        }
-    }
-
-    if ((size % TARGET_PAGE_SIZE) != 0) {
-        ret = write_data(s, block->host + start + i * TARGET_PAGE_SIZE,
-                         size % TARGET_PAGE_SIZE);
-        if (ret < 0) {
-            return ret;
+    for (done = 0; done < size; done += len) {
+        len = MIN(size - done, DUMP_CHUNK_SIZE);
+        if (s->sparse && buffer_is_zero(p + done, len)) {
+            s->hole += len;
+        } else {
+            ret = write_data(s, p + done, len);
+            if (ret < 0) {
+                return ret;
+            }
         }
+        dump_progress.completed += len;
     }
 
     return 0;
@@ -560,7 +753,7 @@ static int dump_begin(DumpState *s)
         }
 
         /* write notes to vmcore */
-        if (write_elf64_notes(s) < 0) {
+        if (write_elf64_notes(fd_write_vmcore, s) < 0) {
             return -1;
         }
 
@@ -583,7 +776,7 @@ static int dump_begin(DumpState *s)
         }
 
         /* write notes to vmcore */
-        if (write_elf32_notes(s) < 0) {
+        if (write_elf32_notes(fd_write_vmcore, s) < 0) {
             return -1;
         }
     }
@@ -591,10 +784,19 @@ static int dump_begin(DumpState *s)
     return 0;
 }
 
-/* write PT_LOAD to vmcore */
+/* the memory ended with a hole: give the file its full size */
 static int dump_completed(DumpState *s)
 {
-    dump_cleanup(s);
+    off_t end;
+
+    if (s->hole) {
+        end = lseek(s->fd, s->hole, SEEK_CUR);
+        if (end < 0 || ftruncate(s->fd, end) < 0) {
+            dump_error(s, "dump: failed to extend the file.\n");
+            return -1;
+        }
+        s->hole = 0;
+    }
     return 0;
 }
 
@@ -649,8 +851,7 @@ static int dump_iterate(DumpState *s)
 
         ret = get_next_block(s, block);
         if (ret == 1) {
-            dump_completed(s);
-            return 0;
+            return dump_completed(s);
         }
     }
 }
@@ -672,6 +873,499 @@ static int create_vmcore(DumpState *s)
     return 0;
 }
 
+/* kdump-compressed output */
+
+static int buf_write_note(void *buf, size_t size, void *opaque)
+{
+    DumpState *s = opaque;
+
+    if (s->note_buf_offset + size > s->note_size) {
+        return -1;
+    }
+    memcpy(s->note_buf + s->note_buf_offset, buf, size);
+    s->note_buf_offset += size;
+    return 0;
+}
+
+/* the kdump output is not written in order, so it must be seekable */
+static int dump_write_at(DumpState *s, const void *buf, size_t size,
+                         off_t offset)
+{
+    if (lseek(s->fd, offset, SEEK_SET) < 0 ||
+        fd_write_vmcore((void *)buf, size, s) < 0) {
+        dump_error(s, "dump: failed to write kdump data.\n");
+        return -1;
+    }
+    return 0;
+}
+
+static const char *kdump_machine_name(DumpState *s)
+{
+    switch (s->dump_info.d_machine) {
+    case EM_X86_64:
+        return "x86_64";
+    case EM_386:
+        return "i686";
+    default:
+        return "";
+    }
+}
+
+static int write_kdump_header32(DumpState *s)
+{
+    int endian = s->dump_info.d_endian;
+    DiskDumpHeader32 dh;
+    KdumpSubHeader32 kh;
+    int ret;
+
+    memset(&dh, 0, sizeof(dh));
+    memcpy(dh.signature, KDUMP_SIGNATURE, SIG_LEN);
+    dh.header_version = cpu_convert_to_target32(KDUMP_HEADER_VERSION, endian);
+    pstrcpy(dh.utsname.machine, sizeof(dh.utsname.machine),
+            kdump_machine_name(s));
+    dh.status = cpu_convert_to_target32(DUMP_DH_COMPRESSED_ZLIB, endian);
+    dh.block_size = cpu_convert_to_target32(TARGET_PAGE_SIZE, endian);
+    dh.sub_hdr_size = cpu_convert_to_target32(s->sub_hdr_size, endian);
+    dh.bitmap_blocks = cpu_convert_to_target32(
+        2 * s->len_dump_bitmap / TARGET_PAGE_SIZE, endian);
+    dh.max_mapnr = cpu_convert_to_target32(MIN(s->max_mapnr, UINT32_MAX),
+                                           endian);
+    dh.nr_cpus = cpu_convert_to_target32(smp_cpus, endian);
+
+    memset(&kh, 0, sizeof(kh));
+    kh.dump_level = cpu_convert_to_target32(DUMP_LEVEL, endian);
+    kh.max_mapnr_64 = cpu_convert_to_target64(s->max_mapnr, endian);
+    kh.offset_note = cpu_convert_to_target64(
+        TARGET_PAGE_SIZE * DISKDUMP_HEADER_BLOCKS + sizeof(kh), endian);
+    kh.note_size = cpu_convert_to_target32(s->note_size, endian);
+
+    ret = dump_write_at(s, &dh, sizeof(dh), 0);
+    if (ret == 0) {
+        ret = dump_write_at(s, &kh, sizeof(kh),
+                            TARGET_PAGE_SIZE * DISKDUMP_HEADER_BLOCKS);
+    }
+    return ret;
+}
+
+static int write_kdump_header64(DumpState *s)
+{
+    int endian = s->dump_info.d_endian;
+    DiskDumpHeader64 dh;
+    KdumpSubHeader64 kh;
+    int ret;
+
+    memset(&dh, 0, sizeof(dh));
+    memcpy(dh.signature, KDUMP_SIGNATURE, SIG_LEN);
+    dh.header_version = cpu_convert_to_target32(KDUMP_HEADER_VERSION, endian);
+    pstrcpy(dh.utsname.machine, sizeof(dh.utsname.machine),
+            kdump_machine_name(s));
+    dh.status = cpu_convert_to_target32(DUMP_DH_COMPRESSED_ZLIB, endian);
+    dh.block_size = cpu_convert_to_target32(TARGET_PAGE_SIZE, endian);
+    dh.sub_hdr_size = cpu_convert_to_target32(s->sub_hdr_size, endian);
+    dh.bitmap_blocks = cpu_convert_to_target32(
+        2 * s->len_dump_bitmap / TARGET_PAGE_SIZE, endian);
+    dh.max_mapnr = cpu_convert_to_target32(MIN(s->max_mapnr, UINT32_MAX),
+                                           endian);
+    dh.nr_cpus = cpu_convert_to_target32(smp_cpus, endian);
+
+    memset(&kh, 0, sizeof(kh));
+    kh.dump_level = cpu_convert_to_target32(DUMP_LEVEL, endian);
+    kh.max_mapnr_64 = cpu_convert_to_target64(s->max_mapnr, endian);
+    kh.offset_note = cpu_convert_to_target64(
+        TARGET_PAGE_SIZE * DISKDUMP_HEADER_BLOCKS + sizeof(kh), endian);
+    kh.note_size = cpu_convert_to_target64(s->note_size, endian);
+
+    ret = dump_write_at(s, &dh, sizeof(dh), 0);
+    if (ret == 0) {
+        ret = dump_write_at(s, &kh, sizeof(kh),
+                            TARGET_PAGE_SIZE * DISKDUMP_HEADER_BLOCKS);
+    }
+    return ret;
+}
+
+static int write_kdump_notes(DumpState *s)
+{
+    off_t offset = TARGET_PAGE_SIZE * DISKDUMP_HEADER_BLOCKS;
+    int ret;
+
+    s->note_buf = g_malloc0(s->note_size);
+    s->note_buf_offset = 0;
+    if (s->dump_info.d_class == ELFCLASS64) {
+        ret = write_elf64_notes(buf_write_note, s);
+        offset += sizeof(KdumpSubHeader64);
+    } else {
+        ret = write_elf32_notes(buf_write_note, s);
+        offset += sizeof(KdumpSubHeader32);
+    }
+    if (ret < 0) {
+        return -1;
+    }
+    return dump_write_at(s, s->note_buf, s->note_size, offset);
+}
+
+/* Every frame of every block exists and is dumped */
+static int write_kdump_bitmaps(DumpState *s)
+{
+    uint8_t *bitmap = g_malloc0(s->len_dump_bitmap);
+    int i, ret;
+
+    for (i = 0; i < s->nr_blocks; i++) {
+        RAMBlock *block = s->blocks[i];
+        uint64_t pfn = block->offset >> TARGET_PAGE_BITS;
+        uint64_t end = pfn + (block->length >> TARGET_PAGE_BITS);
+
+        for (; pfn < end; pfn++) {
+            bitmap[pfn / 8] |= 1 << (pfn % 8);
+        }
+    }
+
+    ret = dump_write_at(s, bitmap, s->len_dump_bitmap, s->offset_bitmap);
+    if (ret == 0) {
+        ret = dump_write_at(s, bitmap, s->len_dump_bitmap,
+                            s->offset_bitmap + s->len_dump_bitmap);
+    }
+    g_free(bitmap);
+    return ret;
+}
+
+static void *dump_compress_thread(void *opaque)
+{
+    DumpCompressJob *job = opaque;
+    DumpState *s = job->s;
+    uLong bound = compressBound(TARGET_PAGE_SIZE);
+    int i;
+
+    qemu_mutex_lock(&s->compress_lock);
+    while (!s->compress_quit) {
+        if (!job->busy || job->done) {
+            qemu_cond_wait(&s->work_cond, &s->compress_lock);
+            continue;
+        }
+        qemu_mutex_unlock(&s->compress_lock);
+
+        for (i = 0; i < job->nr_pages; i++) {
+            uint8_t *in = job->in + i * TARGET_PAGE_SIZE;
+            uint8_t *out = job->out + i * bound;
+            uLongf len = bound;
+
+            if (buffer_is_zero(in, TARGET_PAGE_SIZE)) {
+                len = 0;
+            } else if (compress2(out, &len, in, TARGET_PAGE_SIZE,
+                                 Z_BEST_SPEED) != Z_OK ||
+                       len >= TARGET_PAGE_SIZE) {
+                /* not worth it, store the page as is */
+                memcpy(out, in, TARGET_PAGE_SIZE);
+                len = TARGET_PAGE_SIZE;
+            }
+            job->out_len[i] = len;
+        }
+
+        qemu_mutex_lock(&s->compress_lock);
+        job->done = true;
+        qemu_cond_broadcast(&s->done_cond);
+    }
+    qemu_mutex_unlock(&s->compress_lock);
+
+    return NULL;
+}
+
+static void dump_compress_threads_init(DumpState *s)
+{
+    int i;
+
+    s->nr_jobs = 1;
+#ifdef _SC_NPROCESSORS_ONLN
+    s->nr_jobs = MAX(1, MIN(sysconf(_SC_NPROCESSORS_ONLN),
+                            DUMP_MAX_COMPRESS_THREADS));
+#endif
+    s->jobs = g_new0(DumpCompressJob, s->nr_jobs);
+    s->compress_quit = false;
+    qemu_mutex_init(&s->compress_lock);
+    qemu_cond_init(&s->work_cond);
+    qemu_cond_init(&s->done_cond);
+
+    for (i = 0; i < s->nr_jobs; i++) {
+        DumpCompressJob *job = &s->jobs[i];
+
+        job->s = s;
+        job->out = g_malloc(DUMP_BATCH_PAGES * compressBound(TARGET_PAGE_SIZE));
+        qemu_thread_create(&job->thread, dump_compress_thread, job,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void dump_compress_threads_fini(DumpState *s)
+{
+    int i;
+
+    qemu_mutex_lock(&s->compress_lock);
+    s->compress_quit = true;
+    qemu_cond_broadcast(&s->work_cond);
+    qemu_mutex_unlock(&s->compress_lock);
+
+    for (i = 0; i < s->nr_jobs; i++) {
+        qemu_thread_join(&s->jobs[i].thread);
+        g_free(s->jobs[i].out);
+    }
+    qemu_cond_destroy(&s->done_cond);
+    qemu_cond_destroy(&s->work_cond);
+    qemu_mutex_destroy(&s->compress_lock);
+    g_free(s->jobs);
+    s->jobs = NULL;
+}
+
+static void dump_compress_wait(DumpState *s, DumpCompressJob *job)
+{
+    qemu_mutex_lock(&s->compress_lock);
+    while (!job->done) {
+        qemu_cond_wait(&s->done_cond, &s->compress_lock);
+    }
+    job->busy = false;
+    job->done = false;
+    qemu_mutex_unlock(&s->compress_lock);
+}
+
+/* Write the descriptors and data of a finished batch; zero pages all
+   refer to the page at @zero_offset */
+static int write_kdump_batch(DumpState *s, DumpCompressJob *job,
+                             off_t *desc_offset, off_t *data_offset,
+                             off_t zero_offset, uint8_t *data)
+{
+    int endian = s->dump_info.d_endian;
+    uLong bound = compressBound(TARGET_PAGE_SIZE);
+    PageDescriptor desc[DUMP_BATCH_PAGES];
+    size_t data_len = 0;
+    int i;
+
+    memset(desc, 0, sizeof(desc));
+    for (i = 0; i < job->nr_pages; i++) {
+        size_t len = job->out_len[i];
+
+        if (len == 0) {
+            desc[i].offset = cpu_convert_to_target64(zero_offset, endian);
+            desc[i].size = cpu_convert_to_target32(TARGET_PAGE_SIZE, endian);
+            continue;
+        }
+        desc[i].offset = cpu_convert_to_target64(*data_offset + data_len,
+                                                 endian);
+        desc[i].size = cpu_convert_to_target32(len, endian);
+        if (len < TARGET_PAGE_SIZE) {
+            desc[i].flags = cpu_convert_to_target32(DUMP_DH_COMPRESSED_ZLIB,
+                                                    endian);
+        }
+        memcpy(data + data_len, job->out + i * bound, len);
+        data_len += len;
+    }
+
+    if (dump_write_at(s, desc, job->nr_pages * sizeof(PageDescriptor),
+                      *desc_offset) < 0) {
+        return -1;
+    }
+    if (data_len && dump_write_at(s, data, data_len, *data_offset) < 0) {
+        return -1;
+    }
+    *desc_offset += job->nr_pages * sizeof(PageDescriptor);
+    *data_offset += data_len;
+    dump_progress.completed += job->nr_pages * TARGET_PAGE_SIZE;
+    return 0;
+}
+
+static int write_kdump_pages(DumpState *s)
+{
+    off_t desc_offset = s->offset_page;
+    off_t data_offset = s->offset_data;
+    off_t zero_offset = data_offset;
+    uint64_t submitted = 0, written = 0;
+    uint8_t *data;
+    int i, ret;
+
+    data = g_malloc0(DUMP_BATCH_PAGES * TARGET_PAGE_SIZE);
+    ret = dump_write_at(s, data, TARGET_PAGE_SIZE, zero_offset);
+    if (ret < 0) {
+        g_free(data);
+        return ret;
+    }
+    data_offset += TARGET_PAGE_SIZE;
+
+    dump_compress_threads_init(s);
+    for (i = 0; i < s->nr_blocks && ret == 0; i++) {
+        RAMBlock *block = s->blocks[i];
+        ram_addr_t offset;
+
+        for (offset = 0; offset < block->length;
+             offset += DUMP_BATCH_PAGES * TARGET_PAGE_SIZE) {
+            DumpCompressJob *job = &s->jobs[submitted % s->nr_jobs];
+
+            /* the worker still has the batch of nr_jobs ago */
+            if (job->busy) {
+                dump_compress_wait(s, job);
+                written++;
+                ret = write_kdump_batch(s, job, &desc_offset, &data_offset,
+                                        zero_offset, data);
+                if (ret < 0) {
+                    break;
+                }
+            }
+
+            qemu_mutex_lock(&s->compress_lock);
+            job->in = block->host + offset;
+            job->nr_pages = MIN(DUMP_BATCH_PAGES,
+                                (block->length - offset) >> TARGET_PAGE_BITS);
+            job->busy = true;
+            qemu_cond_broadcast(&s->work_cond);
+            qemu_mutex_unlock(&s->compress_lock);
+            submitted++;
+        }
+    }
+
+    /* after an error, still wait for the workers but stop writing */
+    for (; written < submitted; written++) {
+        DumpCompressJob *job = &s->jobs[written % s->nr_jobs];
+
+        dump_compress_wait(s, job);
+        if (ret == 0) {
+            ret = write_kdump_batch(s, job, &desc_offset, &data_offset,
+                                    zero_offset, data);
+        }
+    }
+    dump_compress_threads_fini(s);
+    g_free(data);
+
+    return ret;
+}
+
+static int block_offset_compare(const void *a, const void *b)
+{
+    const RAMBlock *block_a = *(RAMBlock * const *)a;
+    const RAMBlock *block_b = *(RAMBlock * const *)b;
+
+    if (block_a->offset == block_b->offset) {
+        return 0;
+    }
+    return block_a->offset < block_b->offset ? -1 : 1;
+}
+
+/* Lay out the file; the page descriptors follow the order of the frames */
+static void kdump_init(DumpState *s)
+{
+    RAMBlock *block;
+    uint64_t nr_pages = 0;
+    size_t sub_hdr;
+    int i = 0;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        s->nr_blocks++;
+    }
+    s->blocks = g_new(RAMBlock *, s->nr_blocks);
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        s->blocks[i++] = block;
+        s->max_mapnr = MAX(s->max_mapnr,
+                           (block->offset + block->length) >> TARGET_PAGE_BITS);
+        nr_pages += block->length >> TARGET_PAGE_BITS;
+    }
+    qsort(s->blocks, s->nr_blocks, sizeof(s->blocks[0]), block_offset_compare);
+
+    if (s->dump_info.d_class == ELFCLASS64) {
+        sub_hdr = sizeof(KdumpSubHeader64);
+    } else {
+        sub_hdr = sizeof(KdumpSubHeader32);
+    }
+    s->sub_hdr_size = DIV_ROUND_UP(sub_hdr + s->note_size, TARGET_PAGE_SIZE);
+    s->len_dump_bitmap = DIV_ROUND_UP(s->max_mapnr, TARGET_PAGE_SIZE * 8) *
+                         TARGET_PAGE_SIZE;
+    s->offset_bitmap = (DISKDUMP_HEADER_BLOCKS + s->sub_hdr_size) *
+                       TARGET_PAGE_SIZE;
+    s->offset_page = s->offset_bitmap + 2 * s->len_dump_bitmap;
+    s->offset_data = s->offset_page + nr_pages * sizeof(PageDescriptor);
+}
+
+static int create_kdump_vmcore(DumpState *s)
+{
+    int ret;
+
+    if (s->dump_info.d_class == ELFCLASS64) {
+        ret = write_kdump_header64(s);
+    } else {
+        ret = write_kdump_header32(s);
+    }
+    if (ret < 0 || write_kdump_notes(s) < 0 || write_kdump_bitmaps(s) < 0) {
+        return -1;
+    }
+
+    return write_kdump_pages(s);
+}
+
+/* Runs in the dump thread when detached; the ramlist lock keeps the
+   blocks from going away */
+static int dump_process(DumpState *s)
+{
+    int ret;
+
+    qemu_mutex_lock_ramlist();
+    if (s->format == DUMP_GUEST_MEMORY_FORMAT_KDUMP_ZLIB) {
+        ret = create_kdump_vmcore(s);
+    } else {
+        ret = create_vmcore(s);
+    }
+    qemu_mutex_unlock_ramlist();
+
+    return ret;
+}
+
+static void dump_finish(DumpState *s, int ret)
+{
+    dump_progress.status = ret < 0 ? DUMP_STATUS_FAILED : DUMP_STATUS_COMPLETED;
+    dump_cleanup(s);
+}
+
+static void dump_cleanup_bh(void *opaque)
+{
+    DumpState *s = opaque;
+    QObject *data;
+
+    qemu_bh_delete(s->cleanup_bh);
+    qemu_thread_join(&s->thread);
+    migrate_del_blocker(s->blocker);
+    error_free(s->blocker);
+    dump_finish(s, s->ret);
+
+    if (s->ret < 0) {
+        char *error = g_strchomp(g_strdup(s->error ? s->error : "I/O error"));
+
+        data = qobject_from_jsonf("{ 'result': { 'status': %s, "
+                                  "'completed': %" PRId64 ", "
+                                  "'total': %" PRId64 " }, 'error': %s }",
+                                  DumpStatus_lookup[dump_progress.status],
+                                  dump_progress.completed,
+                                  dump_progress.total, error);
+        g_free(error);
+    } else {
+        data = qobject_from_jsonf("{ 'result': { 'status': %s, "
+                                  "'completed': %" PRId64 ", "
+                                  "'total': %" PRId64 " } }",
+                                  DumpStatus_lookup[dump_progress.status],
+                                  dump_progress.completed,
+                                  dump_progress.total);
+    }
+    monitor_protocol_event(QEVENT_DUMP_COMPLETED, data);
+    qobject_decref(data);
+
+    g_free(s);
+}
+
+static void *dump_thread(void *opaque)
+{
+    DumpState *s = opaque;
+
+    s->ret = dump_process(s);
+
+    qemu_mutex_lock_iothread();
+    qemu_bh_schedule(s->cleanup_bh);
+    qemu_mutex_unlock_iothread();
+
+    return NULL;
+}
+
 static ram_addr_t get_start_block(DumpState *s)
 {
     RAMBlock *block;
@@ -700,10 +1394,13 @@ static ram_addr_t get_start_block(DumpState *s)
     return -1;
 }
 
-static int dump_init(DumpState *s, int fd, bool paging, bool has_filter,
-                     int64_t begin, int64_t length, Error **errp)
+static int dump_init(DumpState *s, int fd, DumpGuestMemoryFormat format,
+                     bool paging, bool has_filter, int64_t begin,
+                     int64_t length, Error **errp)
 {
     CPUArchState *env;
+    RAMBlock *block;
+    struct stat st;
     int nr_cpus;
     int ret;
 
@@ -716,6 +1413,11 @@ static int dump_init(DumpState *s, int fd, bool paging, bool has_filter,
 
     s->errp = errp;
     s->fd = fd;
+    s->format = format;
+    /* holes only make sense in a regular file that we truncated */
+    s->sparse = format == DUMP_GUEST_MEMORY_FORMAT_ELF &&
+                fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+                lseek(fd, 0, SEEK_CUR) == 0;
     s->has_filter = has_filter;
     s->begin = begin;
     s->length = length;
@@ -764,6 +1466,26 @@ static int dump_init(DumpState *s, int fd, bool paging, bool has_filter,
         memory_mapping_filter(&s->list, s->begin, s->length);
     }
 
+    /* the bytes of guest memory that will be written */
+    dump_progress.completed = 0;
+    dump_progress.total = 0;
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        int64_t start = block->offset, end = block->offset + block->length;
+
+        if (s->has_filter) {
+            start = MAX(start, s->begin);
+            end = MIN(end, s->begin + s->length);
+        }
+        if (start < end) {
+            dump_progress.total += end - start;
+        }
+    }
+
+    if (format == DUMP_GUEST_MEMORY_FORMAT_KDUMP_ZLIB) {
+        kdump_init(s);
+        return 0;
+    }
+
     /*
      * calculate phdr_num
      *
@@ -818,6 +1540,8 @@ cleanup:
 
 void qmp_dump_guest_memory(bool paging, const char *file, bool has_begin,
                            int64_t begin, bool has_length, int64_t length,
+                           bool has_detach, bool detach,
+                           bool has_format, DumpGuestMemoryFormat format,
                            Error **errp)
 {
     const char *p;
@@ -825,6 +1549,14 @@ void qmp_dump_guest_memory(bool paging, const char *file, bool has_begin,
     DumpState *s;
     int ret;
 
+    if (!has_format) {
+        format = DUMP_GUEST_MEMORY_FORMAT_ELF;
+    }
+    if (dump_in_progress()) {
+        error_set(errp, ERROR_CLASS_GENERIC_ERROR,
+                  "A dump is already in progress");
+        return;
+    }
     if (has_begin && !has_length) {
         error_set(errp, QERR_MISSING_PARAMETER, "length");
         return;
@@ -833,6 +1565,11 @@ void qmp_dump_guest_memory(bool paging, const char *file, bool has_begin,
         error_set(errp, QERR_MISSING_PARAMETER, "begin");
         return;
     }
+    /* kdump-compressed files describe physical frames, all of them */
+    if (format != DUMP_GUEST_MEMORY_FORMAT_ELF && (paging || has_begin)) {
+        error_set(errp, QERR_INVALID_PARAMETER_COMBINATION);
+        return;
+    }
 
 #if !defined(WIN32)
     if (strstart(file, "fd:", &p)) {
@@ -857,17 +1594,49 @@ void qmp_dump_guest_memory(bool paging, const char *file, bool has_begin,
         return;
     }
 
-    s = g_malloc(sizeof(DumpState));
+    if (format != DUMP_GUEST_MEMORY_FORMAT_ELF && lseek(fd, 0, SEEK_CUR) < 0) {
+        close(fd);
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "file",
+                  "a seekable file for the kdump-compressed format");
+        return;
+    }
+
+    s = g_malloc0(sizeof(DumpState));
 
-    ret = dump_init(s, fd, paging, has_begin, begin, length, errp);
+    ret = dump_init(s, fd, format, paging, has_begin, begin, length, errp);
     if (ret < 0) {
         g_free(s);
         return;
     }
+    dump_progress.status = DUMP_STATUS_ACTIVE;
+
+    if (has_detach && detach) {
+        /* the guest stays stopped until DUMP_COMPLETED */
+        s->detached = true;
+        s->errp = NULL;
+        s->cleanup_bh = qemu_bh_new(dump_cleanup_bh, s);
+        error_set(&s->blocker, ERROR_CLASS_GENERIC_ERROR,
+                  "Guest memory is being dumped");
+        migrate_add_blocker(s->blocker);
+        qemu_thread_create(&s->thread, dump_thread, s, QEMU_THREAD_JOINABLE);
+        return;
+    }
 
-    if (create_vmcore(s) < 0 && !error_is_set(s->errp)) {
+    ret = dump_process(s);
+    if (ret < 0 && !error_is_set(s->errp)) {
         error_set(errp, QERR_IO_ERROR);
     }
+    dump_finish(s, ret);
 
     g_free(s);
 }
+
+DumpQueryResult *qmp_query_dump(Error **errp)
+{
+    DumpQueryResult *result = g_malloc0(sizeof(*result));
+
+    result->status = dump_progress.status;
+    result->completed = dump_progress.completed;
+    result->total = dump_progress.total;
+    return result;
+}
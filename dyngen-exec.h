@@ -32,6 +32,8 @@
 #define AREG0 "r27"
 #elif defined(__arm__)
 #define AREG0 "r6"
+#elif defined(__aarch64__)
+#define AREG0 "x19"
 #elif defined(__hppa__)
 #define AREG0 "r17"
 #elif defined(__mips__)
@@ -110,6 +110,8 @@ typedef int64_t  Elf64_Sxword;
 
 #define EM_UNICORE32    110     /* UniCore32 */
 
+#define EM_AARCH64      183     /* ARM 64-bit */
+
 /*
  * This is an interim value that we will use until the committee comes
  * up with a final number.
@@ -616,6 +618,13 @@ typedef struct {
 /* Keep this the last entry.  */
 #define R_ARM_NUM		256
 
+/* AArch64 relocs.  */
+#define R_AARCH64_NONE		0	/* No reloc */
+#define R_AARCH64_ABS64		257	/* Direct 64 bit */
+#define R_AARCH64_CONDBR19	280	/* PC relative 19 bit conditional branch */
+#define R_AARCH64_JUMP26	282	/* PC relative 26 bit branch */
+#define R_AARCH64_CALL26	283	/* PC relative 26 bit call */
+
 /* s390 relocations defined by the ABIs */
 #define R_390_NONE		0	/* No reloc.  */
 #define R_390_8			1	/* Direct 8 bit.  */
@@ -86,14 +86,35 @@ int cpu_gen_code(CPUArchState *env, struct TranslationBlock *tb,
                  int *gen_code_size_ptr);
 int cpu_restore_state(struct TranslationBlock *tb,
                       CPUArchState *env, uintptr_t searched_pc);
+void tb_perf_map_add(struct TranslationBlock *tb, int code_size);
+
+/* Counted by cpu_gen_code() with -tcg-stats */
+typedef struct TCGTranslationStats {
+    uint64_t tbs;
+    uint64_t guest_insns;
+    uint64_t guest_bytes;
+    uint64_t host_bytes;
+    int64_t time_ns;
+} TCGTranslationStats;
+
+extern bool tcg_stats_enabled;
+extern TCGTranslationStats tcg_translation_stats;
 void QEMU_NORETURN cpu_resume_from_signal(CPUArchState *env1, void *puc);
 void QEMU_NORETURN cpu_io_recompile(CPUArchState *env, uintptr_t retaddr);
 TranslationBlock *tb_gen_code(CPUArchState *env, 
                               target_ulong pc, target_ulong cs_base, int flags,
                               int cflags);
+#if defined(CONFIG_LINUX_USER)
+/* linux-user/tbcache.c */
+bool tb_cache_load(CPUArchState *env, TranslationBlock *tb, int *code_size);
+void tb_cache_save(CPUArchState *env, TranslationBlock *tb, int code_size);
+#endif
 void cpu_exec_init(CPUArchState *env);
 void QEMU_NORETURN cpu_loop_exit(CPUArchState *env1);
 int page_unprotect(target_ulong address, uintptr_t pc, void *puc);
+#if defined(CONFIG_USER_ONLY)
+bool tb_code_changed(TranslationBlock *tb);
+#endif
 void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
                                    int is_cpu_write_access);
 void tb_invalidate_phys_range(tb_page_addr_t start, tb_page_addr_t end,
@@ -118,9 +139,6 @@ static inline void tlb_flush(CPUArchState *env, int flush_global)
 
 #define CODE_GEN_ALIGN           16 /* must be >= of the size of a icache line */
 
-#define CODE_GEN_PHYS_HASH_BITS     15
-#define CODE_GEN_PHYS_HASH_SIZE     (1 << CODE_GEN_PHYS_HASH_BITS)
-
 #define MIN_CODE_GEN_BUFFER_SIZE     (1024 * 1024)
 
 /* estimated block size for TB allocation */
@@ -132,7 +150,8 @@ static inline void tlb_flush(CPUArchState *env, int flush_global)
 #define CODE_GEN_AVG_BLOCK_SIZE 64
 #endif
 
-#if defined(_ARCH_PPC) || defined(__x86_64__) || defined(__arm__) || defined(__i386__)
+#if defined(_ARCH_PPC) || defined(__x86_64__) || defined(__arm__) || \
+    defined(__i386__) || defined(__aarch64__)
 #define USE_DIRECT_JUMP
 #elif defined(CONFIG_TCG_INTERPRETER)
 #define USE_DIRECT_JUMP
@@ -144,13 +163,13 @@ struct TranslationBlock {
     uint64_t flags; /* flags defining in which context the code was generated */
     uint16_t size;      /* size of target code for this block (1 <=
                            size <= TARGET_PAGE_SIZE) */
-    uint16_t cflags;    /* compile flags */
+    uint32_t cflags;    /* compile flags */
 #define CF_COUNT_MASK  0x7fff
 #define CF_LAST_IO     0x8000 /* Last insn may be an IO access.  */
+#define CF_SUPERBLOCK  0x10000 /* hot code: follow direct jumps */
+#define CF_CHECK_CODE  0x20000 /* user mode: code checked at each entry */
 
     uint8_t *tc_ptr;    /* pointer to the translated code */
-    /* next matching tb for physical address. */
-    struct TranslationBlock *phys_hash_next;
     /* first and second physical page containing code. The lower bit
        of the pointer tells the index in page_next[] */
     struct TranslationBlock *page_next[2];
@@ -171,8 +190,21 @@ struct TranslationBlock {
     struct TranslationBlock *jmp_next[2];
     struct TranslationBlock *jmp_first;
     uint32_t icount;
+    /* number of times the TB was entered without chaining */
+    uint32_t exec_count;
+#if defined(CONFIG_USER_ONLY)
+    /* hash of the guest code, for CF_CHECK_CODE */
+    uint64_t code_hash;
+#endif
 };
 
+/* Targets defining TARGET_HAS_SUPERBLOCK retranslate a TB with
+   CF_SUPERBLOCK once it has been entered TB_HOT_THRESHOLD times from
+   cpu_exec() or helper_lookup_tb_ptr().  Chained execution is not
+   counted, but a hot loop still goes through the main loop on every
+   interrupt, so these entries are a cheap sample of where time goes.  */
+#define TB_HOT_THRESHOLD 256
+
 static inline unsigned int tb_jmp_cache_hash_page(target_ulong pc)
 {
     target_ulong tmp;
@@ -188,18 +220,15 @@ static inline unsigned int tb_jmp_cache_hash_func(target_ulong pc)
 	    | (tmp & TB_JMP_ADDR_MASK));
 }
 
-static inline unsigned int tb_phys_hash_func(tb_page_addr_t pc)
-{
-    return (pc >> 2) & (CODE_GEN_PHYS_HASH_SIZE - 1);
-}
-
+void *helper_lookup_tb_ptr(CPUArchState *env);
 void tb_free(TranslationBlock *tb);
 void tb_flush(CPUArchState *env);
 void tb_link_page(TranslationBlock *tb,
                   tb_page_addr_t phys_pc, tb_page_addr_t phys_page2);
 void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr);
-
-extern TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
+TranslationBlock *tb_hash_lookup(CPUArchState *env, tb_page_addr_t phys_pc,
+                                 target_ulong pc, target_ulong cs_base,
+                                 uint64_t flags);
 
 #if defined(USE_DIRECT_JUMP)
 
@@ -244,6 +273,13 @@ static inline void tb_set_jmp_target1(uintptr_t jmp_addr, uintptr_t addr)
     __asm __volatile__ ("swi 0x9f0002" : : "r" (_beg), "r" (_end), "r" (_flg));
 #endif
 }
+#elif defined(__aarch64__)
+static inline void tb_set_jmp_target1(uintptr_t jmp_addr, uintptr_t addr)
+{
+    /* a single 4-byte aligned store, so other threads see either branch */
+    *(uint32_t *)jmp_addr = 0x14000000 | (((addr - jmp_addr) >> 2) & 0x3ffffff);
+    __builtin___clear_cache((char *) jmp_addr, (char *) jmp_addr + 4);
+}
 #else
 #error tb_set_jmp_target1 is missing
 #endif
@@ -286,6 +322,23 @@ TranslationBlock *tb_find_pc(uintptr_t pc_ptr);
 
 extern spinlock_t tb_lock;
 
+#if !defined(CONFIG_USER_ONLY)
+void tb_mutex_lock(void);
+void tb_mutex_unlock(void);
+void cpu_atomic_lock(void);
+void cpu_atomic_unlock(void);
+void cpu_exec_reset_locks(void);
+void tb_flush_idle(void);
+#else
+static inline void tb_mutex_lock(void)
+{
+}
+
+static inline void tb_mutex_unlock(void)
+{
+}
+#endif
+
 extern int tb_invalidated_flag;
 
 /* The return address may point to the start of the next instruction.
@@ -308,6 +361,32 @@ extern uintptr_t tci_tb_ptr;
 # define GETPC() ((uintptr_t)__builtin_return_address(0) - 1)
 #endif
 
+#if defined(CONFIG_QEMU_LDST_OPTIMIZATION) && defined(CONFIG_SOFTMMU)
+/* The TLB miss cases of qemu_ld/st are generated after the code of the
+   TB, so the return address of an MMU helper called from there is not in
+   the code of the guest instruction.  The fast path address is found in
+   the code that follows the call instead, without an extra argument:
+
+     call MMU helper
+     jmp POST_PROC (2 bytes)    <- return address
+     jmp FAST_PATH (5 bytes), never executed
+   POST_PROC:
+     ...
+     jmp FAST_PATH
+ */
+# if defined(__i386__) || defined(__x86_64__)
+#  define GETRA() ((uintptr_t)__builtin_return_address(0))
+#  define GETPC_LDST() ((uintptr_t)(GETRA() + 7 + \
+                                    *(int32_t *)(GETRA() + 3) - 1))
+# else
+#  error "CONFIG_QEMU_LDST_OPTIMIZATION needs GETPC_LDST() implementation!"
+# endif
+bool is_tcg_gen_code(uintptr_t pc_ptr);
+# define GETPC_EXT() (is_tcg_gen_code(GETRA()) ? GETPC_LDST() : GETPC())
+#else
+# define GETPC_EXT() GETPC()
+#endif
+
 #if !defined(CONFIG_USER_ONLY)
 
 struct MemoryRegion *iotlb_to_region(target_phys_addr_t index);
@@ -316,8 +395,12 @@ uint64_t io_mem_read(struct MemoryRegion *mr, target_phys_addr_t addr,
 void io_mem_write(struct MemoryRegion *mr, target_phys_addr_t addr,
                   uint64_t value, unsigned size);
 
+bool tlb_victim_hit(CPUArchState *env, int mmu_idx, int index,
+                    size_t elt_ofs, target_ulong page);
 void tlb_fill(CPUArchState *env1, target_ulong addr, int is_write, int mmu_idx,
               uintptr_t retaddr);
+void *tlb_vaddr_to_host_write(CPUArchState *env, target_ulong addr, int size,
+                              int mmu_idx, uintptr_t retaddr);
 
 #include "softmmu_defs.h"
 
@@ -23,11 +23,16 @@
 #error Do not include exec-obsolete.h
 #endif
 
+#include "bitops.h"
+#include "bswap.h"
+#include "host-utils.h"
+
 #ifndef CONFIG_USER_ONLY
 
 ram_addr_t qemu_ram_alloc_from_ptr(ram_addr_t size, void *host,
                                    MemoryRegion *mr);
 ram_addr_t qemu_ram_alloc(ram_addr_t size, MemoryRegion *mr);
+ram_addr_t qemu_ram_alloc_system(ram_addr_t size, MemoryRegion *mr);
 void qemu_ram_free(ram_addr_t addr);
 void qemu_ram_free_from_ptr(ram_addr_t addr);
 
@@ -38,96 +43,178 @@ void cpu_register_physical_memory_log(struct MemoryRegionSection *section,
 
 void qemu_register_coalesced_mmio(target_phys_addr_t addr, ram_addr_t size);
 void qemu_unregister_coalesced_mmio(target_phys_addr_t addr, ram_addr_t size);
+void qemu_register_coalesced_pio(pio_addr_t addr, pio_addr_t size);
+void qemu_unregister_coalesced_pio(pio_addr_t addr, pio_addr_t size);
 
 int cpu_physical_memory_set_dirty_tracking(int enable);
 
-#define VGA_DIRTY_FLAG       0x01
-#define CODE_DIRTY_FLAG      0x02
-#define MIGRATION_DIRTY_FLAG 0x08
+static inline bool cpu_physical_memory_get_dirty_flag(ram_addr_t addr,
+                                                      unsigned client)
+{
+    assert(client < DIRTY_MEMORY_NUM);
+    return test_bit(addr >> TARGET_PAGE_BITS, ram_list.dirty_memory[client]);
+}
 
-static inline int cpu_physical_memory_get_dirty_flags(ram_addr_t addr)
+/* read dirty bit (return true only if the page is dirty for all clients) */
+static inline bool cpu_physical_memory_is_dirty(ram_addr_t addr)
 {
-    return ram_list.phys_dirty[addr >> TARGET_PAGE_BITS];
+    return cpu_physical_memory_get_dirty_flag(addr, DIRTY_MEMORY_VGA) &&
+        cpu_physical_memory_get_dirty_flag(addr, DIRTY_MEMORY_CODE) &&
+        cpu_physical_memory_get_dirty_flag(addr, DIRTY_MEMORY_MIGRATION);
 }
 
-/* read dirty bit (return 0 or 1) */
-static inline int cpu_physical_memory_is_dirty(ram_addr_t addr)
+/* Returns the first page at or after @start that is dirty for @client,
+ * or @end if there is none.  Scans a word of the bitmap at a time. */
+static inline ram_addr_t cpu_physical_memory_find_next_dirty(ram_addr_t start,
+                                                             ram_addr_t end,
+                                                             unsigned client)
 {
-    return cpu_physical_memory_get_dirty_flags(addr) == 0xff;
+    unsigned long page;
+
+    assert(client < DIRTY_MEMORY_NUM);
+    page = find_next_bit(ram_list.dirty_memory[client],
+                         end >> TARGET_PAGE_BITS, start >> TARGET_PAGE_BITS);
+    return MIN((ram_addr_t)page << TARGET_PAGE_BITS, end);
 }
 
-static inline int cpu_physical_memory_get_dirty(ram_addr_t start,
-                                                ram_addr_t length,
-                                                int dirty_flags)
+static inline bool cpu_physical_memory_get_dirty(ram_addr_t start,
+                                                 ram_addr_t length,
+                                                 unsigned client)
 {
-    int ret = 0;
-    ram_addr_t addr, end;
+    ram_addr_t end;
 
     end = TARGET_PAGE_ALIGN(start + length);
     start &= TARGET_PAGE_MASK;
-    for (addr = start; addr < end; addr += TARGET_PAGE_SIZE) {
-        ret |= cpu_physical_memory_get_dirty_flags(addr) & dirty_flags;
+    return cpu_physical_memory_find_next_dirty(start, end, client) < end;
+}
+
+static inline void cpu_physical_memory_set_dirty_flag(ram_addr_t addr,
+                                                      unsigned client)
+{
+    assert(client < DIRTY_MEMORY_NUM);
+    if (!test_and_set_bit_atomic(addr >> TARGET_PAGE_BITS,
+                                 ram_list.dirty_memory[client]) &&
+        client == DIRTY_MEMORY_MIGRATION) {
+        __sync_fetch_and_add(&ram_list.dirty_pages, 1);
     }
-    return ret;
 }
 
-static inline int cpu_physical_memory_set_dirty_flags(ram_addr_t addr,
-                                                      int dirty_flags)
+static inline void cpu_physical_memory_clear_dirty_flag(ram_addr_t addr,
+                                                        unsigned client)
 {
-    if ((dirty_flags & MIGRATION_DIRTY_FLAG) &&
-        !cpu_physical_memory_get_dirty(addr, TARGET_PAGE_SIZE,
-                                       MIGRATION_DIRTY_FLAG)) {
-        ram_list.dirty_pages++;
+    assert(client < DIRTY_MEMORY_NUM);
+    if (test_and_clear_bit_atomic(addr >> TARGET_PAGE_BITS,
+                                  ram_list.dirty_memory[client]) &&
+        client == DIRTY_MEMORY_MIGRATION) {
+        __sync_fetch_and_sub(&ram_list.dirty_pages, 1);
     }
-    return ram_list.phys_dirty[addr >> TARGET_PAGE_BITS] |= dirty_flags;
 }
 
 static inline void cpu_physical_memory_set_dirty(ram_addr_t addr)
 {
-    cpu_physical_memory_set_dirty_flags(addr, 0xff);
+    cpu_physical_memory_set_dirty_flag(addr, DIRTY_MEMORY_VGA);
+    cpu_physical_memory_set_dirty_flag(addr, DIRTY_MEMORY_CODE);
+    cpu_physical_memory_set_dirty_flag(addr, DIRTY_MEMORY_MIGRATION);
 }
 
-static inline int cpu_physical_memory_clear_dirty_flags(ram_addr_t addr,
-                                                        int dirty_flags)
+static inline void cpu_physical_memory_set_dirty_range(ram_addr_t start,
+                                                       ram_addr_t length)
 {
-    int mask = ~dirty_flags;
+    ram_addr_t addr, end;
 
-    if ((dirty_flags & MIGRATION_DIRTY_FLAG) &&
-        cpu_physical_memory_get_dirty(addr, TARGET_PAGE_SIZE,
-                                      MIGRATION_DIRTY_FLAG)) {
-        ram_list.dirty_pages--;
+    end = TARGET_PAGE_ALIGN(start + length);
+    start &= TARGET_PAGE_MASK;
+    for (addr = start; addr < end; addr += TARGET_PAGE_SIZE) {
+        cpu_physical_memory_set_dirty(addr);
     }
-    return ram_list.phys_dirty[addr >> TARGET_PAGE_BITS] &= mask;
 }
 
-static inline void cpu_physical_memory_set_dirty_range(ram_addr_t start,
-                                                       ram_addr_t length,
-                                                       int dirty_flags)
+/* Mark a range dirty for everybody but the TB code tracking; used after
+ * guest memory was written outside of translated code. */
+static inline void cpu_physical_memory_set_dirty_range_nocode(ram_addr_t start,
+                                                              ram_addr_t length)
 {
     ram_addr_t addr, end;
 
     end = TARGET_PAGE_ALIGN(start + length);
     start &= TARGET_PAGE_MASK;
     for (addr = start; addr < end; addr += TARGET_PAGE_SIZE) {
-        cpu_physical_memory_set_dirty_flags(addr, dirty_flags);
+        cpu_physical_memory_set_dirty_flag(addr, DIRTY_MEMORY_VGA);
+        cpu_physical_memory_set_dirty_flag(addr, DIRTY_MEMORY_MIGRATION);
     }
 }
 
-static inline void cpu_physical_memory_mask_dirty_range(ram_addr_t start,
-                                                        ram_addr_t length,
-                                                        int dirty_flags)
+/* Mark dirty the pages whose bits are set in @bitmap, a little-endian
+ * bitmap of @pages pages in the format KVM_GET_DIRTY_LOG returns, starting
+ * at @start.  When @start is aligned to a bitmap word, whole words are
+ * merged into the client bitmaps at once. */
+static inline void cpu_physical_memory_set_dirty_lebitmap(unsigned long *bitmap,
+                                                          ram_addr_t start,
+                                                          ram_addr_t pages)
+{
+    unsigned long page = start >> TARGET_PAGE_BITS;
+    unsigned long len = BIT_WORD(pages + BITS_PER_LONG - 1);
+    unsigned long i, j, k, c, old;
+    uint64_t added = 0;
+
+    if (page % BITS_PER_LONG == 0) {
+        k = BIT_WORD(page);
+        for (i = 0; i < len; i++) {
+            if (!bitmap[i]) {
+                continue;
+            }
+            c = leul_to_cpu(bitmap[i]);
+            __sync_fetch_and_or(&ram_list.dirty_memory[DIRTY_MEMORY_VGA][k + i],
+                                c);
+            __sync_fetch_and_or(&ram_list.dirty_memory[DIRTY_MEMORY_CODE][k + i],
+                                c);
+            old = __sync_fetch_and_or(
+                &ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION][k + i], c);
+#if HOST_LONG_BITS == 64
+            added += ctpop64(c & ~old);
+#else
+            added += ctpop32(c & ~old);
+#endif
+        }
+        if (added) {
+            __sync_fetch_and_add(&ram_list.dirty_pages, added);
+        }
+        return;
+    }
+
+    for (i = 0; i < len; i++) {
+        if (!bitmap[i]) {
+            continue;
+        }
+        c = leul_to_cpu(bitmap[i]);
+        do {
+            j = ffsl(c) - 1;
+            c &= ~(1ul << j);
+            cpu_physical_memory_set_dirty(start + ((ram_addr_t)
+                                          (i * BITS_PER_LONG + j) <<
+                                          TARGET_PAGE_BITS));
+        } while (c != 0);
+    }
+}
+
+static inline void cpu_physical_memory_clear_dirty_range(ram_addr_t start,
+                                                         ram_addr_t length,
+                                                         unsigned client)
 {
     ram_addr_t addr, end;
 
     end = TARGET_PAGE_ALIGN(start + length);
     start &= TARGET_PAGE_MASK;
-    for (addr = start; addr < end; addr += TARGET_PAGE_SIZE) {
-        cpu_physical_memory_clear_dirty_flags(addr, dirty_flags);
+    for (addr = cpu_physical_memory_find_next_dirty(start, end, client);
+         addr < end;
+         addr = cpu_physical_memory_find_next_dirty(addr + TARGET_PAGE_SIZE,
+                                                    end, client)) {
+        cpu_physical_memory_clear_dirty_flag(addr, client);
     }
 }
 
 void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
-                                     int dirty_flags);
+                                     unsigned client);
 
 extern const IORangeOps memory_region_iorange_ops;
 
@@ -35,6 +35,7 @@
 #include "qemu-timer.h"
 #include "memory.h"
 #include "exec-memory.h"
+#include "qemu-rcu.h"
 #if defined(CONFIG_USER_ONLY)
 #include <qemu.h>
 #if defined(__FreeBSD__) || defined(__FreeBSD_kernel__)
@@ -55,6 +56,9 @@
 #else /* !CONFIG_USER_ONLY */
 #include "xen-mapcache.h"
 #include "trace.h"
+#include "sysemu.h"
+#include "qmp-commands.h"
+#include "qemu-memacct.h"
 #endif
 
 #include "cputlb.h"
@@ -79,12 +83,50 @@
 
 #define SMC_BITMAP_USE_THRESHOLD 10
 
-static TranslationBlock *tbs;
-static int code_gen_max_blocks;
-TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
-static int nb_tbs;
+/* The TBs are found by physical PC in an open addressing hash table.
+   A bucket holds the hashes and pointers of as many TBs as fit in a
+   cache line, so that a lookup usually reads a single line and only
+   dereferences the TBs whose hash matches.  Buckets are probed
+   linearly; removed entries are left as TB_HASH_DELETED until the table
+   is rebuilt.  */
+#define TB_HASH_BUCKET_SIZE 64
+#define TB_HASH_BUCKET_ENTRIES \
+    (TB_HASH_BUCKET_SIZE / (sizeof(uint32_t) + sizeof(void *)))
+#define TB_HASH_MIN_BITS 12
+#define TB_HASH_DELETED ((TranslationBlock *)1)
+
+typedef struct TBHashBucket {
+    uint32_t hashes[TB_HASH_BUCKET_ENTRIES];
+    TranslationBlock *tbs[TB_HASH_BUCKET_ENTRIES];
+} __attribute__((aligned(TB_HASH_BUCKET_SIZE))) TBHashBucket;
+
+static TBHashBucket *tb_hash_buckets;
+static unsigned int tb_hash_bits;
+static size_t tb_hash_used;
+static size_t tb_hash_deleted;
+
+/* statistics */
+static uint64_t tb_hash_lookup_count;
+static uint64_t tb_hash_hit_count;
+static uint64_t tb_hash_probe_count;
+static unsigned int tb_hash_max_probes;
+static int tb_hash_resize_count;
+
+static void tb_hash_init(void);
+
 /* any access to the tbs or the page table must use this lock */
 spinlock_t tb_lock = SPIN_LOCK_UNLOCKED;
+#if !defined(CONFIG_USER_ONLY)
+/* With multi-threaded TCG, the tbs, the page table and the TCG context are
+   protected by tb_mutex.  A thread may take it recursively, but must not
+   wait for the iothread lock or an exclusive section while holding it.  */
+static QemuMutex tb_mutex;
+static DEFINE_TLS(int, tb_lock_depth);
+
+/* serializes the guest atomic operations of the vCPU threads */
+static QemuMutex atomic_mutex;
+static DEFINE_TLS(bool, atomic_locked);
+#endif
 
 #if defined(__arm__) || defined(__sparc_v9__)
 /* The prologue must be reachable with a direct jump. ARM and Sparc64
@@ -104,9 +146,38 @@ spinlock_t tb_lock = SPIN_LOCK_UNLOCKED;
 uint8_t code_gen_prologue[1024] code_gen_section;
 static uint8_t *code_gen_buffer;
 static unsigned long code_gen_buffer_size;
-/* threshold to flush the translated code buffer */
-static unsigned long code_gen_buffer_max_size;
-static uint8_t *code_gen_ptr;
+
+/* The translated code buffer is split in regions that are filled one at
+   a time.  Only some of them are in use at first; more are added if the
+   code in use turns over quickly.  Once that stops, the region with the
+   oldest code is flushed and reused, rather than the whole buffer.  */
+typedef struct CodeGenRegion {
+    uint8_t *start;
+    uint8_t *ptr;               /* next free byte */
+    TranslationBlock *tbs;      /* sorted by tc_ptr */
+    int nb_tbs;
+    unsigned int generation;    /* when the region was last started */
+    int64_t start_time;
+} CodeGenRegion;
+
+#define CODE_GEN_MAX_REGIONS        64
+#define CODE_GEN_MIN_REGION_SIZE    (2 * 1024 * 1024)
+/* add a region if all of them were filled in less than this */
+#define CODE_GEN_GROW_TIME          (get_ticks_per_sec())
+
+static CodeGenRegion code_gen_regions[CODE_GEN_MAX_REGIONS];
+static CodeGenRegion *code_gen_region;
+static int code_gen_nb_regions;
+static int code_gen_active_regions;
+static unsigned long code_gen_region_size;
+/* threshold to move on to the next region */
+static unsigned long code_gen_region_max_size;
+static int code_gen_region_max_blocks;
+static unsigned int code_gen_generation;
+#if !defined(CONFIG_USER_ONLY)
+/* the regions in use; the rest of the buffer is never touched */
+static MemAccount code_gen_mem_account;
+#endif
 
 #if !defined(CONFIG_USER_ONLY)
 int phys_ram_fd;
@@ -130,6 +201,8 @@ DEFINE_TLS(CPUArchState *,cpu_single_env);
    1 = Precise instruction counting.
    2 = Adaptive rate instruction counting.  */
 int use_icount = 0;
+/* Run each vCPU in its own thread, without the iothread lock.  */
+int mttcg_enabled = 0;
 
 typedef struct PageDesc {
     /* list of TBs intersecting this ram page */
@@ -139,7 +212,9 @@ typedef struct PageDesc {
     unsigned int code_write_count;
     uint8_t *code_bitmap;
 #if defined(CONFIG_USER_ONLY)
-    unsigned long flags;
+    /* write faults taken because the page holds code; past
+       SMC_BITMAP_USE_THRESHOLD the page is no longer write protected */
+    unsigned int write_faults;
 #endif
 } PageDesc;
 
@@ -187,8 +262,6 @@ static void *l1_map[V_L1_SIZE];
 #if !defined(CONFIG_USER_ONLY)
 typedef struct PhysPageEntry PhysPageEntry;
 
-static MemoryRegionSection *phys_sections;
-static unsigned phys_sections_nb, phys_sections_nb_alloc;
 static uint16_t phys_section_unassigned;
 static uint16_t phys_section_notdirty;
 static uint16_t phys_section_rom;
@@ -196,19 +269,48 @@ static uint16_t phys_section_watch;
 
 struct PhysPageEntry {
     uint16_t is_leaf : 1;
-     /* index into phys_sections (is_leaf) or phys_map_nodes (!is_leaf) */
+     /* index into sections (is_leaf) or nodes (!is_leaf) */
     uint16_t ptr : 15;
 };
 
-/* Simple allocator for PhysPageEntry nodes */
-static PhysPageEntry (*phys_map_nodes)[L2_SIZE];
-static unsigned phys_map_nodes_nb, phys_map_nodes_nb_alloc;
-
 #define PHYS_MAP_NODE_NIL (((uint16_t)~0) >> 1)
 
-/* This is a multi-level map on the physical address space.
-   The bottom level has pointers to MemoryRegionSections.  */
-static PhysPageEntry phys_map = { .ptr = PHYS_MAP_NODE_NIL, .is_leaf = 0 };
+/* This is a multi-level map on the physical address space, with a simple
+   allocator for its nodes.  The bottom level has indices into sections.
+   A new map is built by the core memory listener on every topology change
+   and published with RCU, so lookups only need rcu_read_lock().  */
+typedef struct PhysDispatch {
+    PhysPageEntry phys_map;
+    PhysPageEntry (*nodes)[L2_SIZE];
+    unsigned nodes_nb, nodes_nb_alloc;
+    MemoryRegionSection *sections;
+    unsigned sections_nb, sections_nb_alloc;
+    /* never reused, unlike the address of a reclaimed map */
+    unsigned version;
+    struct rcu_head rcu;
+} PhysDispatch;
+
+static PhysDispatch *cur_dispatch;
+static PhysDispatch *next_dispatch;
+static unsigned phys_dispatch_version;
+
+/* qemu-tls.h only has real per-thread variables on Linux.  Elsewhere the
+ * lookup caches would be shared by all threads and could be read torn, so
+ * they are left out.
+ */
+#ifdef __linux__
+#define CONFIG_LOOKUP_CACHE 1
+#endif
+
+#ifdef CONFIG_LOOKUP_CACHE
+/* The section of each thread's last phys_page_find() */
+typedef struct PhysSectionCache {
+    unsigned version;
+    MemoryRegionSection *section;
+} PhysSectionCache;
+
+static DEFINE_TLS(PhysSectionCache, phys_section_cache);
+#endif
 
 static void io_mem_init(void);
 static void memory_map_init(void);
@@ -218,6 +320,7 @@ static MemoryRegion io_mem_watch;
 
 /* statistics */
 static int tb_flush_count;
+static int tb_region_flush_count;
 static int tb_phys_invalidate_count;
 
 #ifdef _WIN32
@@ -387,42 +490,223 @@ static inline PageDesc *page_find(tb_page_addr_t index)
     return page_find_alloc(index, 0);
 }
 
+#if defined(CONFIG_USER_ONLY)
+/*
+ * The flags of the guest pages are kept in a treap of disjoint intervals,
+ * each a run of pages with the same flags; pages outside of the intervals
+ * have no flags.  Adjacent intervals with the same flags are merged, so
+ * that the cost of looking up or changing a range depends on the number
+ * of mappings of the guest, not on the number of pages.  The intervals
+ * are protected by mmap_lock.
+ */
+typedef struct PageVMA PageVMA;
+struct PageVMA {
+    target_ulong start;
+    target_ulong last;          /* inclusive, so that the top page fits */
+    int flags;
+    uint32_t prio;
+    PageVMA *left, *right;
+};
+
+static PageVMA *page_vmas;
+static uint32_t page_vma_seed = 1;
+
+static PageVMA *page_vma_new(target_ulong start, target_ulong last, int flags)
+{
+    PageVMA *v = g_new0(PageVMA, 1);
+
+    /* xorshift, the priorities only need to look random */
+    page_vma_seed ^= page_vma_seed << 13;
+    page_vma_seed ^= page_vma_seed >> 17;
+    page_vma_seed ^= page_vma_seed << 5;
+
+    v->start = start;
+    v->last = last;
+    v->flags = flags;
+    v->prio = page_vma_seed;
+    return v;
+}
+
+static void page_vma_free(PageVMA *v)
+{
+    if (v) {
+        page_vma_free(v->left);
+        page_vma_free(v->right);
+        g_free(v);
+    }
+}
+
+/* Split v into the intervals starting below key and the others */
+static void page_vma_split(PageVMA *v, target_ulong key,
+                           PageVMA **left, PageVMA **right)
+{
+    if (!v) {
+        *left = *right = NULL;
+    } else if (v->start < key) {
+        page_vma_split(v->right, key, &v->right, right);
+        *left = v;
+    } else {
+        page_vma_split(v->left, key, left, &v->left);
+        *right = v;
+    }
+}
+
+/* All the intervals of left must start below those of right */
+static PageVMA *page_vma_merge(PageVMA *left, PageVMA *right)
+{
+    if (!left) {
+        return right;
+    }
+    if (!right) {
+        return left;
+    }
+    if (left->prio > right->prio) {
+        left->right = page_vma_merge(left->right, right);
+        return left;
+    }
+    right->left = page_vma_merge(left, right->left);
+    return right;
+}
+
+static PageVMA *page_vma_first(PageVMA *v)
+{
+    while (v && v->left) {
+        v = v->left;
+    }
+    return v;
+}
+
+static PageVMA *page_vma_last(PageVMA *v)
+{
+    while (v && v->right) {
+        v = v->right;
+    }
+    return v;
+}
+
+/* The last interval that starts below key */
+static PageVMA *page_vma_before(target_ulong key)
+{
+    PageVMA *v = page_vmas, *found = NULL;
+
+    while (v) {
+        if (v->start < key) {
+            found = v;
+            v = v->right;
+        } else {
+            v = v->left;
+        }
+    }
+    return found;
+}
+
+/* The first interval that ends at or above addr */
+static PageVMA *page_vma_lookup(target_ulong addr)
+{
+    PageVMA *v = page_vmas, *found = NULL;
+
+    while (v) {
+        if (v->last >= addr) {
+            found = v;
+            v = v->left;
+        } else {
+            v = v->right;
+        }
+    }
+    return found;
+}
+
+static PageVMA *page_vma_next(PageVMA *v)
+{
+    return v->last == (target_ulong)-1 ? NULL : page_vma_lookup(v->last + 1);
+}
+
+static int page_vma_flags(target_ulong addr)
+{
+    PageVMA *v = page_vma_lookup(addr);
+
+    return v && v->start <= addr ? v->flags : 0;
+}
+
+/* Give the pages from start to last the flags, without looking at
+   PAGE_WRITE_ORG or the translated code */
+static void page_vma_set(target_ulong start, target_ulong last, int flags)
+{
+    PageVMA *left, *mid, *right, *v, *next;
+
+    page_vma_split(page_vmas, start, &left, &right);
+    if (last == (target_ulong)-1) {
+        mid = right;
+        right = NULL;
+    } else {
+        page_vma_split(right, last + 1, &mid, &right);
+    }
+
+    /* cut the intervals that stick out of the range */
+    v = page_vma_last(left);
+    if (v && v->last >= start) {
+        if (v->last > last) {
+            right = page_vma_merge(page_vma_new(last + 1, v->last, v->flags),
+                                   right);
+        }
+        v->last = start - 1;
+    }
+    v = page_vma_last(mid);
+    if (v && v->last > last) {
+        right = page_vma_merge(page_vma_new(last + 1, v->last, v->flags),
+                               right);
+    }
+    page_vma_free(mid);
+    mid = NULL;
+
+    if (flags) {
+        v = page_vma_last(left);
+        if (v && v->last + 1 == start && v->flags == flags) {
+            v->last = last;
+        } else {
+            mid = v = page_vma_new(start, last, flags);
+        }
+        next = page_vma_first(right);
+        if (next && last != (target_ulong)-1 && next->start == last + 1 &&
+            next->flags == flags) {
+            page_vma_split(right, next->start + 1, &next, &right);
+            v->last = next->last;
+            page_vma_free(next);
+        }
+    }
+    page_vmas = page_vma_merge(page_vma_merge(left, mid), right);
+}
+#endif
+
 #if !defined(CONFIG_USER_ONLY)
 
-static void phys_map_node_reserve(unsigned nodes)
+static void phys_map_node_reserve(PhysDispatch *d, unsigned nodes)
 {
-    if (phys_map_nodes_nb + nodes > phys_map_nodes_nb_alloc) {
+    if (d->nodes_nb + nodes > d->nodes_nb_alloc) {
         typedef PhysPageEntry Node[L2_SIZE];
-        phys_map_nodes_nb_alloc = MAX(phys_map_nodes_nb_alloc * 2, 16);
-        phys_map_nodes_nb_alloc = MAX(phys_map_nodes_nb_alloc,
-                                      phys_map_nodes_nb + nodes);
-        phys_map_nodes = g_renew(Node, phys_map_nodes,
-                                 phys_map_nodes_nb_alloc);
+        d->nodes_nb_alloc = MAX(d->nodes_nb_alloc * 2, 16);
+        d->nodes_nb_alloc = MAX(d->nodes_nb_alloc, d->nodes_nb + nodes);
+        d->nodes = g_renew(Node, d->nodes, d->nodes_nb_alloc);
     }
 }
 
-static uint16_t phys_map_node_alloc(void)
+static uint16_t phys_map_node_alloc(PhysDispatch *d)
 {
     unsigned i;
     uint16_t ret;
 
-    ret = phys_map_nodes_nb++;
+    ret = d->nodes_nb++;
     assert(ret != PHYS_MAP_NODE_NIL);
-    assert(ret != phys_map_nodes_nb_alloc);
+    assert(ret != d->nodes_nb_alloc);
     for (i = 0; i < L2_SIZE; ++i) {
-        phys_map_nodes[ret][i].is_leaf = 0;
-        phys_map_nodes[ret][i].ptr = PHYS_MAP_NODE_NIL;
+        d->nodes[ret][i].is_leaf = 0;
+        d->nodes[ret][i].ptr = PHYS_MAP_NODE_NIL;
     }
     return ret;
 }
 
-static void phys_map_nodes_reset(void)
-{
-    phys_map_nodes_nb = 0;
-}
-
-
-static void phys_page_set_level(PhysPageEntry *lp, target_phys_addr_t *index,
+static void phys_page_set_level(PhysDispatch *d, PhysPageEntry *lp,
+                                target_phys_addr_t *index,
                                 target_phys_addr_t *nb, uint16_t leaf,
                                 int level)
 {
@@ -431,8 +715,8 @@ static void phys_page_set_level(PhysPageEntry *lp, target_phys_addr_t *index,
     target_phys_addr_t step = (target_phys_addr_t)1 << (level * L2_BITS);
 
     if (!lp->is_leaf && lp->ptr == PHYS_MAP_NODE_NIL) {
-        lp->ptr = phys_map_node_alloc();
-        p = phys_map_nodes[lp->ptr];
+        lp->ptr = phys_map_node_alloc(d);
+        p = d->nodes[lp->ptr];
         if (level == 0) {
             for (i = 0; i < L2_SIZE; i++) {
                 p[i].is_leaf = 1;
@@ -440,7 +724,7 @@ static void phys_page_set_level(PhysPageEntry *lp, target_phys_addr_t *index,
             }
         }
     } else {
-        p = phys_map_nodes[lp->ptr];
+        p = d->nodes[lp->ptr];
     }
     lp = &p[(*index >> (level * L2_BITS)) & (L2_SIZE - 1)];
 
@@ -451,24 +735,25 @@ static void phys_page_set_level(PhysPageEntry *lp, target_phys_addr_t *index,
             *index += step;
             *nb -= step;
         } else {
-            phys_page_set_level(lp, index, nb, leaf, level - 1);
+            phys_page_set_level(d, lp, index, nb, leaf, level - 1);
         }
         ++lp;
     }
 }
 
-static void phys_page_set(target_phys_addr_t index, target_phys_addr_t nb,
-                          uint16_t leaf)
+static void phys_page_set(PhysDispatch *d, target_phys_addr_t index,
+                          target_phys_addr_t nb, uint16_t leaf)
 {
     /* Wildly overreserve - it doesn't matter much. */
-    phys_map_node_reserve(3 * P_L2_LEVELS);
+    phys_map_node_reserve(d, 3 * P_L2_LEVELS);
 
-    phys_page_set_level(&phys_map, &index, &nb, leaf, P_L2_LEVELS - 1);
+    phys_page_set_level(d, &d->phys_map, &index, &nb, leaf, P_L2_LEVELS - 1);
 }
 
-MemoryRegionSection *phys_page_find(target_phys_addr_t index)
+static MemoryRegionSection *phys_page_find_dispatch(PhysDispatch *d,
+                                                    target_phys_addr_t index)
 {
-    PhysPageEntry lp = phys_map;
+    PhysPageEntry lp = d->phys_map;
     PhysPageEntry *p;
     int i;
     uint16_t s_index = phys_section_unassigned;
@@ -477,13 +762,49 @@ MemoryRegionSection *phys_page_find(target_phys_addr_t index)
         if (lp.ptr == PHYS_MAP_NODE_NIL) {
             goto not_found;
         }
-        p = phys_map_nodes[lp.ptr];
+        p = d->nodes[lp.ptr];
         lp = p[(index >> (i * L2_BITS)) & (L2_SIZE - 1)];
     }
 
     s_index = lp.ptr;
 not_found:
-    return &phys_sections[s_index];
+    return &d->sections[s_index];
+}
+
+/* The result is only valid until the caller's rcu_read_unlock().  */
+MemoryRegionSection *phys_page_find(target_phys_addr_t index)
+{
+    PhysDispatch *d = atomic_rcu_read(&cur_dispatch);
+#ifdef CONFIG_LOOKUP_CACHE
+    PhysSectionCache *c = &tls_var(phys_section_cache);
+    target_phys_addr_t addr = index << TARGET_PAGE_BITS;
+    MemoryRegionSection *section;
+
+    /* Device models tend to hit the same RAM region many times in a row.
+     * Only sections made of whole pages are remembered: every page inside
+     * them maps to them, which is not true of a section that starts or
+     * ends in a subpage, nor of the catch-all dummy sections.
+     */
+    section = c->section;
+    if (c->version == d->version &&
+        addr - section->offset_within_address_space < section->size) {
+        return section;
+    }
+    section = phys_page_find_dispatch(d, index);
+    if (!((section->offset_within_address_space | section->size) &
+          ~TARGET_PAGE_MASK) && section->size) {
+        c->version = d->version;
+        c->section = section;
+    }
+    return section;
+#else
+    return phys_page_find_dispatch(d, index);
+#endif
+}
+
+static MemoryRegionSection *phys_section_find(uint16_t index)
+{
+    return &atomic_rcu_read(&cur_dispatch)->sections[index];
 }
 
 bool memory_region_is_unassigned(MemoryRegion *mr)
@@ -510,21 +831,88 @@ static uint8_t static_code_gen_buffer[DEFAULT_CODE_GEN_BUFFER_SIZE]
                __attribute__((aligned (CODE_GEN_ALIGN)));
 #endif
 
+#if !defined(CONFIG_USER_ONLY) && !defined(USE_STATIC_CODE_GEN_BUFFER)
+/* Return the amount of host RAM, or 0 if it is not known */
+static uint64_t host_ram_size(void)
+{
+#if defined(_SC_PHYS_PAGES)
+    long pages = sysconf(_SC_PHYS_PAGES);
+
+    if (pages > 0) {
+        return (uint64_t)pages * getpagesize();
+    }
+#endif
+    return 0;
+}
+#endif
+
+static void tb_region_start(CodeGenRegion *r)
+{
+    if (!r->tbs) {
+        r->tbs = g_malloc(code_gen_region_max_blocks *
+                          sizeof(TranslationBlock));
+    }
+    r->generation = ++code_gen_generation;
+    r->start_time = get_clock();
+    code_gen_region = r;
+}
+
+/* Split the buffer in regions, using those that cover initial_size */
+static void code_gen_regions_init(unsigned long initial_size)
+{
+    unsigned long size;
+    int i;
+
+    if (initial_size > code_gen_buffer_size) {
+        initial_size = code_gen_buffer_size;
+    }
+    size = MAX(initial_size / 8, CODE_GEN_MIN_REGION_SIZE);
+    size = MAX(size, code_gen_buffer_size / CODE_GEN_MAX_REGIONS);
+    size = MIN(size, code_gen_buffer_size) & ~(CODE_GEN_ALIGN - 1);
+
+    code_gen_region_size = size;
+    code_gen_region_max_size = size - (TCG_MAX_OP_SIZE * OPC_BUF_SIZE);
+    code_gen_region_max_blocks = size / CODE_GEN_AVG_BLOCK_SIZE;
+    code_gen_nb_regions = code_gen_buffer_size / size;
+    code_gen_active_regions = MAX(initial_size / size, 1);
+    for (i = 0; i < code_gen_nb_regions; i++) {
+        code_gen_regions[i].start = code_gen_buffer + i * size;
+        code_gen_regions[i].ptr = code_gen_regions[i].start;
+    }
+    tb_region_start(&code_gen_regions[0]);
+#if !defined(CONFIG_USER_ONLY)
+    mem_account_register(&code_gen_mem_account, "tcg", NULL);
+    mem_account_alloc(&code_gen_mem_account,
+                      (int64_t)code_gen_active_regions * size);
+#endif
+}
+
 static void code_gen_alloc(unsigned long tb_size)
 {
+    unsigned long initial_size;
+
 #ifdef USE_STATIC_CODE_GEN_BUFFER
     code_gen_buffer = static_code_gen_buffer;
     code_gen_buffer_size = DEFAULT_CODE_GEN_BUFFER_SIZE;
+    initial_size = code_gen_buffer_size;
     map_exec(code_gen_buffer, code_gen_buffer_size);
 #else
     code_gen_buffer_size = tb_size;
+    initial_size = tb_size;
     if (code_gen_buffer_size == 0) {
 #if defined(CONFIG_USER_ONLY)
         code_gen_buffer_size = DEFAULT_CODE_GEN_BUFFER_SIZE;
 #else
-        /* XXX: needs adjustments */
+        /* Let the buffer grow up to a quarter of the guest RAM, but to no
+           more than an eighth of the host RAM.  */
+        uint64_t host_size = host_ram_size() / 8;
+
         code_gen_buffer_size = (unsigned long)(ram_size / 4);
+        if (host_size && code_gen_buffer_size > host_size) {
+            code_gen_buffer_size = host_size;
+        }
 #endif
+        initial_size = DEFAULT_CODE_GEN_BUFFER_SIZE;
     }
     if (code_gen_buffer_size < MIN_CODE_GEN_BUFFER_SIZE)
         code_gen_buffer_size = MIN_CODE_GEN_BUFFER_SIZE;
@@ -551,6 +939,10 @@ static void code_gen_alloc(unsigned long tb_size)
         /* Keep the buffer no bigger than 16MB to branch between blocks */
         if (code_gen_buffer_size > 16 * 1024 * 1024)
             code_gen_buffer_size = 16 * 1024 * 1024;
+#elif defined(__aarch64__)
+        /* B and BL reach +-128MB */
+        if (code_gen_buffer_size > 128 * 1024 * 1024)
+            code_gen_buffer_size = 128 * 1024 * 1024;
 #elif defined(__s390x__)
         /* Map the buffer so that we can use direct calls and branches.  */
         /* We have a +- 4GB range on the branches; leave some slop.  */
@@ -604,10 +996,7 @@ static void code_gen_alloc(unsigned long tb_size)
 #endif
 #endif /* !USE_STATIC_CODE_GEN_BUFFER */
     map_exec(code_gen_prologue, sizeof(code_gen_prologue));
-    code_gen_buffer_max_size = code_gen_buffer_size -
-        (TCG_MAX_OP_SIZE * OPC_BUF_SIZE);
-    code_gen_max_blocks = code_gen_buffer_size / CODE_GEN_AVG_BLOCK_SIZE;
-    tbs = g_malloc(code_gen_max_blocks * sizeof(TranslationBlock));
+    code_gen_regions_init(initial_size);
 }
 
 /* Must be called before using the QEMU cpus. 'tb_size' is the size
@@ -615,9 +1004,14 @@ static void code_gen_alloc(unsigned long tb_size)
    size. */
 void tcg_exec_init(unsigned long tb_size)
 {
+#if !defined(CONFIG_USER_ONLY)
+    qemu_mutex_init(&tb_mutex);
+    qemu_mutex_init(&atomic_mutex);
+#endif
     cpu_gen_init();
     code_gen_alloc(tb_size);
-    code_gen_ptr = code_gen_buffer;
+    tb_hash_init();
+    tcg_register_helper(helper_lookup_tb_ptr, "lookup_tb_ptr");
     tcg_register_jit(code_gen_buffer, code_gen_buffer_size);
     page_init();
 #if !defined(CONFIG_USER_ONLY) || !defined(CONFIG_USE_GUEST_BASE)
@@ -632,9 +1026,76 @@ bool tcg_enabled(void)
     return code_gen_buffer != NULL;
 }
 
+#if !defined(CONFIG_USER_ONLY)
+void tb_mutex_lock(void)
+{
+    if (mttcg_enabled && tls_var(tb_lock_depth)++ == 0 &&
+        qemu_mutex_trylock(&tb_mutex)) {
+        /* the owner may be waiting for an exclusive section */
+        qemu_tcg_exec_pause();
+        qemu_mutex_lock(&tb_mutex);
+        qemu_tcg_exec_resume();
+    }
+}
+
+void tb_mutex_unlock(void)
+{
+    if (mttcg_enabled && --tls_var(tb_lock_depth) == 0) {
+        qemu_mutex_unlock(&tb_mutex);
+    }
+}
+
+/* Drop tb_mutex however many times it was taken */
+static void tb_lock_release(void)
+{
+    if (tls_var(tb_lock_depth)) {
+        tls_var(tb_lock_depth) = 0;
+        qemu_mutex_unlock(&tb_mutex);
+    }
+}
+
+/* With multi-threaded TCG, guest atomic operations (x86 lock prefix, ARM
+   store exclusive and SWP) are host atomics on the RAM that the TLB maps
+   them to.  Those that cannot be, MMIO, page-crossing accesses and
+   cmpxchg16b, run between cpu_atomic_lock() and cpu_atomic_unlock()
+   instead, which only makes them atomic with respect to each other: a
+   plain store by another vCPU can still be lost in between.  */
+void cpu_atomic_lock(void)
+{
+    if (!mttcg_enabled) {
+        return;
+    }
+    if (qemu_mutex_trylock(&atomic_mutex)) {
+        /* the owner may be waiting for an exclusive section */
+        qemu_tcg_exec_pause();
+        qemu_mutex_lock(&atomic_mutex);
+        qemu_tcg_exec_resume();
+    }
+    tls_var(atomic_locked) = true;
+}
+
+void cpu_atomic_unlock(void)
+{
+    if (tls_var(atomic_locked)) {
+        tls_var(atomic_locked) = false;
+        qemu_mutex_unlock(&atomic_mutex);
+    }
+}
+
+/* A longjmp back to cpu_exec() skips the unlocks of whatever it
+   interrupted.  */
+void cpu_exec_reset_locks(void)
+{
+    tb_lock_release();
+    cpu_atomic_unlock();
+    qemu_tcg_io_lock_reset();
+}
+#endif
+
 void cpu_exec_init_all(void)
 {
 #if !defined(CONFIG_USER_ONLY)
+    qemu_mutex_init(&ram_list.mutex);
     memory_map_init();
     io_mem_init();
 #endif
@@ -654,6 +1115,60 @@ static int cpu_common_post_load(void *opaque, int version_id)
     return 0;
 }
 
+/* Sent for hot-plugged CPUs and for unplugged boot CPUs */
+static bool cpu_common_parked_needed(void *opaque)
+{
+    CPUArchState *env = opaque;
+
+    return env->parked != qemu_vcpu_parked_at_start(env);
+}
+
+static int cpu_common_parked_post_load(void *opaque, int version_id)
+{
+    CPUArchState *env = opaque;
+    bool parked = env->parked;
+
+    /* Apply the loaded value the way hot-plug and unplug do */
+    env->parked = qemu_vcpu_parked_at_start(env);
+    if (parked) {
+        qemu_park_vcpu(env);
+    } else {
+        qemu_unpark_vcpu(env);
+    }
+    return 0;
+}
+
+static const VMStateDescription vmstate_cpu_common_parked = {
+    .name = "cpu_common/parked",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .post_load = cpu_common_parked_post_load,
+    .fields      = (VMStateField []) {
+        VMSTATE_UINT32(parked, CPUArchState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+/* Sent while the guest is asked to give the CPU up */
+static bool cpu_common_unplug_pending_needed(void *opaque)
+{
+    CPUArchState *env = opaque;
+
+    return env->unplug_pending;
+}
+
+static const VMStateDescription vmstate_cpu_common_unplug_pending = {
+    .name = "cpu_common/unplug_pending",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .fields      = (VMStateField []) {
+        VMSTATE_UINT32(unplug_pending, CPUArchState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static const VMStateDescription vmstate_cpu_common = {
     .name = "cpu_common",
     .version_id = 1,
@@ -664,6 +1179,17 @@ static const VMStateDescription vmstate_cpu_common = {
         VMSTATE_UINT32(halted, CPUArchState),
         VMSTATE_UINT32(interrupt_request, CPUArchState),
         VMSTATE_END_OF_LIST()
+    },
+    .subsections = (VMStateSubsection []) {
+        {
+            .vmsd = &vmstate_cpu_common_parked,
+            .needed = cpu_common_parked_needed,
+        }, {
+            .vmsd = &vmstate_cpu_common_unplug_pending,
+            .needed = cpu_common_unplug_pending_needed,
+        }, {
+            /* empty */
+        }
     }
 };
 #endif
@@ -702,6 +1228,8 @@ void cpu_exec_init(CPUArchState *env)
     QTAILQ_INIT(&env->watchpoints);
 #ifndef CONFIG_USER_ONLY
     env->thread_id = qemu_get_thread_id();
+    env->tlb_mask = (uintptr_t)((1 << CPU_TLB_MIN_BITS) - 1)
+                    << CPU_TLB_ENTRY_BITS;
 #endif
     *penv = env;
 #if defined(CONFIG_USER_ONLY)
@@ -714,29 +1242,100 @@ void cpu_exec_init(CPUArchState *env)
 #endif
 }
 
-/* Allocate a new translation block. Flush the translation buffer if
-   too many translation blocks or too much generated code. */
+static void tb_region_flush(CodeGenRegion *r)
+{
+    int i;
+
+    for (i = 0; i < r->nb_tbs; i++) {
+        if (r->tbs[i].page_addr[0] != -1) {
+            tb_phys_invalidate(&r->tbs[i], -1);
+        }
+    }
+    r->nb_tbs = 0;
+    r->ptr = r->start;
+    tb_invalidated_flag = 1;
+    tb_region_flush_count++;
+}
+
+/* Switch to a free region, or add one if the translated code turns over
+   quickly, or else flush the oldest one.  Return false if the whole
+   buffer must be flushed instead.  */
+static bool tb_region_next(void)
+{
+    CodeGenRegion *r, *oldest = NULL;
+    int i;
+
+    for (i = 0; i < code_gen_active_regions; i++) {
+        r = &code_gen_regions[i];
+        if (r->nb_tbs == 0 && r != code_gen_region) {
+            tb_region_start(r);
+            return true;
+        }
+        if (!oldest || r->generation < oldest->generation) {
+            oldest = r;
+        }
+    }
+    if (code_gen_active_regions < code_gen_nb_regions &&
+        get_clock() - oldest->start_time < CODE_GEN_GROW_TIME) {
+        tb_region_start(&code_gen_regions[code_gen_active_regions++]);
+#if !defined(CONFIG_USER_ONLY)
+        mem_account_resize(&code_gen_mem_account, code_gen_region_size);
+#endif
+        return true;
+    }
+    /* other vCPUs may be running the code of any region */
+    if (code_gen_active_regions == 1 || mttcg_enabled) {
+        return false;
+    }
+    tb_region_flush(oldest);
+    tb_region_start(oldest);
+    return true;
+}
+
+/* Allocate a new translation block. Move on to another region if too
+   many translation blocks or too much generated code.  */
 static TranslationBlock *tb_alloc(target_ulong pc)
 {
+    CodeGenRegion *r = code_gen_region;
     TranslationBlock *tb;
 
-    if (nb_tbs >= code_gen_max_blocks ||
-        (code_gen_ptr - code_gen_buffer) >= code_gen_buffer_max_size)
-        return NULL;
-    tb = &tbs[nb_tbs++];
+    if (r->nb_tbs >= code_gen_region_max_blocks ||
+        (r->ptr - r->start) >= code_gen_region_max_size) {
+        if (!tb_region_next()) {
+            return NULL;
+        }
+        r = code_gen_region;
+    }
+    tb = &r->tbs[r->nb_tbs++];
     tb->pc = pc;
     tb->cflags = 0;
+    tb->exec_count = 0;
     return tb;
 }
 
 void tb_free(TranslationBlock *tb)
 {
+    CodeGenRegion *r = code_gen_region;
+
     /* In practice this is mostly used for single use temporary TB
        Ignore the hard cases and just back up if this TB happens to
        be the last one generated.  */
-    if (nb_tbs > 0 && tb == &tbs[nb_tbs - 1]) {
-        code_gen_ptr = tb->tc_ptr;
-        nb_tbs--;
+    if (r->nb_tbs > 0 && tb == &r->tbs[r->nb_tbs - 1]) {
+        r->ptr = tb->tc_ptr;
+        r->nb_tbs--;
+    }
+}
+
+/* Sum the generated code and TB count of the regions in use */
+static void tb_region_usage(size_t *code_size, int *nb_tbs)
+{
+    int i;
+
+    *code_size = 0;
+    *nb_tbs = 0;
+    for (i = 0; i < code_gen_active_regions; i++) {
+        *code_size += code_gen_regions[i].ptr - code_gen_regions[i].start;
+        *nb_tbs += code_gen_regions[i].nb_tbs;
     }
 }
 
@@ -763,6 +1362,9 @@ static void page_flush_tb_1 (int level, void **lp)
         for (i = 0; i < L2_SIZE; ++i) {
             pd[i].first_tb = NULL;
             invalidate_page_bitmap(pd + i);
+#if defined(CONFIG_USER_ONLY)
+            pd[i].write_faults = 0;
+#endif
         }
     } else {
         void **pp = *lp;
@@ -780,89 +1382,297 @@ static void page_flush_tb(void)
     }
 }
 
-/* flush all the translation blocks */
-/* XXX: tb_flush is currently not thread safe */
-void tb_flush(CPUArchState *env1)
+static inline uint32_t tb_hash_func(tb_page_addr_t phys_pc, target_ulong pc,
+                                    uint64_t flags, target_ulong cs_base)
 {
-    CPUArchState *env;
-#if defined(DEBUG_FLUSH)
-    printf("qemu: flush code_size=%ld nb_tbs=%d avg_tb_size=%ld\n",
-           (unsigned long)(code_gen_ptr - code_gen_buffer),
-           nb_tbs, nb_tbs > 0 ?
-           ((unsigned long)(code_gen_ptr - code_gen_buffer)) / nb_tbs : 0);
-#endif
-    if ((unsigned long)(code_gen_ptr - code_gen_buffer) > code_gen_buffer_size)
-        cpu_abort(env1, "Internal error: code buffer overflow\n");
-
-    nb_tbs = 0;
+    uint64_t h;
 
-    for(env = first_cpu; env != NULL; env = env->next_cpu) {
-        memset (env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof (void *));
-    }
+    h = (uint64_t)phys_pc * 0x9e3779b97f4a7c15ULL;
+    h = (h ^ pc) * 0x9e3779b97f4a7c15ULL;
+    h = (h ^ flags) * 0x9e3779b97f4a7c15ULL;
+    h = (h ^ cs_base) * 0x9e3779b97f4a7c15ULL;
+    return h ^ (h >> 32);
+}
 
-    memset (tb_phys_hash, 0, CODE_GEN_PHYS_HASH_SIZE * sizeof (void *));
-    page_flush_tb();
+static inline uint32_t tb_hash_func_tb(TranslationBlock *tb)
+{
+    tb_page_addr_t phys_pc = tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK);
 
-    code_gen_ptr = code_gen_buffer;
-    /* XXX: flush processor icache at this point if cache flush is
-       expensive */
-    tb_flush_count++;
+    return tb_hash_func(phys_pc, tb->pc, tb->flags, tb->cs_base);
 }
 
-#ifdef DEBUG_TB_CHECK
+static inline size_t tb_hash_capacity(void)
+{
+    return (size_t)TB_HASH_BUCKET_ENTRIES << tb_hash_bits;
+}
 
-static void tb_invalidate_check(target_ulong address)
+static TBHashBucket *tb_hash_alloc(unsigned int bits)
 {
-    TranslationBlock *tb;
-    int i;
-    address &= TARGET_PAGE_MASK;
-    for(i = 0;i < CODE_GEN_PHYS_HASH_SIZE; i++) {
-        for(tb = tb_phys_hash[i]; tb != NULL; tb = tb->phys_hash_next) {
-            if (!(address + TARGET_PAGE_SIZE <= tb->pc ||
-                  address >= tb->pc + tb->size)) {
-                printf("ERROR invalidate: address=" TARGET_FMT_lx
-                       " PC=%08lx size=%04x\n",
-                       address, (long)tb->pc, tb->size);
-            }
-        }
-    }
+    size_t size = sizeof(TBHashBucket) << bits;
+    TBHashBucket *buckets = qemu_memalign(TB_HASH_BUCKET_SIZE, size);
+
+    memset(buckets, 0, size);
+    return buckets;
 }
 
-/* verify that all the pages have correct rights for code */
-static void tb_page_check(void)
+static void tb_hash_init(void)
 {
-    TranslationBlock *tb;
-    int i, flags1, flags2;
-
-    for(i = 0;i < CODE_GEN_PHYS_HASH_SIZE; i++) {
-        for(tb = tb_phys_hash[i]; tb != NULL; tb = tb->phys_hash_next) {
-            flags1 = page_get_flags(tb->pc);
-            flags2 = page_get_flags(tb->pc + tb->size - 1);
-            if ((flags1 & PAGE_WRITE) || (flags2 & PAGE_WRITE)) {
-                printf("ERROR page flags: PC=%08lx size=%04x f1=%x f2=%x\n",
-                       (long)tb->pc, tb->size, flags1, flags2);
+    tb_hash_bits = TB_HASH_MIN_BITS;
+    tb_hash_buckets = tb_hash_alloc(tb_hash_bits);
+}
+
+/* store tb in the first free entry on its probe sequence */
+static void tb_hash_insert1(TranslationBlock *tb, uint32_t hash)
+{
+    unsigned int mask = (1 << tb_hash_bits) - 1;
+    unsigned int idx = hash & mask;
+    int i;
+
+    for (;;) {
+        TBHashBucket *b = &tb_hash_buckets[idx];
+
+        for (i = 0; i < TB_HASH_BUCKET_ENTRIES; i++) {
+            if (b->tbs[i] == NULL || b->tbs[i] == TB_HASH_DELETED) {
+                if (b->tbs[i] == TB_HASH_DELETED) {
+                    tb_hash_deleted--;
+                }
+                b->hashes[i] = hash;
+                b->tbs[i] = tb;
+                tb_hash_used++;
+                return;
+            }
+        }
+        idx = (idx + 1) & mask;
+    }
+}
+
+/* Rebuild the table without the deleted entries, twice as large if it
+   is more than half full of TBs.  */
+static void tb_hash_resize(void)
+{
+    TBHashBucket *old = tb_hash_buckets;
+    unsigned int old_bits = tb_hash_bits;
+    size_t i;
+    int j;
+
+    if (tb_hash_used * 2 > tb_hash_capacity()) {
+        tb_hash_bits++;
+    }
+    tb_hash_buckets = tb_hash_alloc(tb_hash_bits);
+    tb_hash_used = 0;
+    tb_hash_deleted = 0;
+    for (i = 0; i < ((size_t)1 << old_bits); i++) {
+        for (j = 0; j < TB_HASH_BUCKET_ENTRIES; j++) {
+            TranslationBlock *tb = old[i].tbs[j];
+
+            if (tb != NULL && tb != TB_HASH_DELETED) {
+                tb_hash_insert1(tb, old[i].hashes[j]);
             }
         }
     }
+    qemu_vfree(old);
+    tb_hash_resize_count++;
+}
+
+static void tb_hash_insert(TranslationBlock *tb)
+{
+    /* keep free entries on every probe sequence */
+    if ((tb_hash_used + tb_hash_deleted + 1) * 4 > tb_hash_capacity() * 3) {
+        tb_hash_resize();
+    }
+    tb_hash_insert1(tb, tb_hash_func_tb(tb));
 }
 
+static void tb_hash_remove(TranslationBlock *tb)
+{
+    uint32_t hash = tb_hash_func_tb(tb);
+    unsigned int mask = (1 << tb_hash_bits) - 1;
+    unsigned int idx = hash & mask;
+    int i;
+
+    for (;;) {
+        TBHashBucket *b = &tb_hash_buckets[idx];
+
+        for (i = 0; i < TB_HASH_BUCKET_ENTRIES; i++) {
+            if (b->tbs[i] == tb) {
+                b->tbs[i] = TB_HASH_DELETED;
+                tb_hash_used--;
+                tb_hash_deleted++;
+                return;
+            }
+            if (b->tbs[i] == NULL) {
+                return;
+            }
+        }
+        idx = (idx + 1) & mask;
+    }
+}
+
+static void tb_hash_flush(void)
+{
+    memset(tb_hash_buckets, 0, sizeof(TBHashBucket) << tb_hash_bits);
+    tb_hash_used = 0;
+    tb_hash_deleted = 0;
+}
+
+/* Find the TB for pc, cs_base and flags whose code starts at phys_pc.
+   A TB that spans two pages must also match the current physical address
+   of its second page.  */
+TranslationBlock *tb_hash_lookup(CPUArchState *env, tb_page_addr_t phys_pc,
+                                 target_ulong pc, target_ulong cs_base,
+                                 uint64_t flags)
+{
+    uint32_t hash = tb_hash_func(phys_pc, pc, flags, cs_base);
+    unsigned int mask = (1 << tb_hash_bits) - 1;
+    unsigned int idx = hash & mask;
+    tb_page_addr_t phys_page1 = phys_pc & TARGET_PAGE_MASK;
+    TranslationBlock *tb, *found = NULL;
+    unsigned int probes;
+    int i;
+
+    for (probes = 1; ; probes++) {
+        TBHashBucket *b = &tb_hash_buckets[idx];
+
+        for (i = 0; i < TB_HASH_BUCKET_ENTRIES; i++) {
+            tb = b->tbs[i];
+            if (tb == NULL) {
+                goto done;
+            }
+            if (b->hashes[i] != hash || tb == TB_HASH_DELETED ||
+                tb->pc != pc || tb->page_addr[0] != phys_page1 ||
+                tb->cs_base != cs_base || tb->flags != flags) {
+                continue;
+            }
+            if (tb->page_addr[1] != -1) {
+                target_ulong virt_page2 = (pc & TARGET_PAGE_MASK) +
+                                          TARGET_PAGE_SIZE;
+
+                if (tb->page_addr[1] != get_page_addr_code(env, virt_page2)) {
+                    continue;
+                }
+            }
+            found = tb;
+            goto done;
+        }
+        idx = (idx + 1) & mask;
+    }
+ done:
+    tb_hash_lookup_count++;
+    tb_hash_probe_count += probes;
+    if (probes > tb_hash_max_probes) {
+        tb_hash_max_probes = probes;
+    }
+    if (found) {
+        tb_hash_hit_count++;
+    }
+    return found;
+}
+
+/* flush all the translation blocks */
+static void do_tb_flush(CPUArchState *env1)
+{
+    CPUArchState *env;
+    CodeGenRegion *r;
+    int i;
+#if defined(DEBUG_FLUSH)
+    size_t code_size;
+    int nb_tbs;
+
+    tb_region_usage(&code_size, &nb_tbs);
+    printf("qemu: flush code_size=%zd nb_tbs=%d avg_tb_size=%zd\n",
+           code_size, nb_tbs, nb_tbs > 0 ? code_size / nb_tbs : 0);
 #endif
+    for (i = 0; i < code_gen_active_regions; i++) {
+        r = &code_gen_regions[i];
+        if ((unsigned long)(r->ptr - r->start) > code_gen_region_size) {
+            cpu_abort(env1, "Internal error: code buffer overflow\n");
+        }
+        r->nb_tbs = 0;
+        r->ptr = r->start;
+    }
 
-/* invalidate one TB */
-static inline void tb_remove(TranslationBlock **ptb, TranslationBlock *tb,
-                             int next_offset)
+    for(env = first_cpu; env != NULL; env = env->next_cpu) {
+        memset (env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof (void *));
+    }
+
+    tb_hash_flush();
+    page_flush_tb();
+
+    tb_region_start(&code_gen_regions[0]);
+    /* XXX: flush processor icache at this point if cache flush is
+       expensive */
+    tb_flush_count++;
+}
+
+void tb_flush(CPUArchState *env1)
 {
-    TranslationBlock *tb1;
-    for(;;) {
-        tb1 = *ptb;
-        if (tb1 == tb) {
-            *ptb = *(TranslationBlock **)((char *)tb1 + next_offset);
-            break;
+#if !defined(CONFIG_USER_ONLY)
+    if (mttcg_enabled) {
+        /* Other vCPUs may be running translated code.  The flush is
+           done by tb_flush_idle() once they have all left cpu_exec().  */
+        qemu_tcg_flush_request();
+        return;
+    }
+#endif
+    do_tb_flush(env1);
+}
+
+#if !defined(CONFIG_USER_ONLY)
+void tb_flush_idle(void)
+{
+    tb_mutex_lock();
+    do_tb_flush(first_cpu);
+    tb_mutex_unlock();
+}
+#endif
+
+#ifdef DEBUG_TB_CHECK
+
+#define TB_HASH_FOREACH(tb, i, j)                                       \
+    for (i = 0; i < ((size_t)1 << tb_hash_bits); i++)                   \
+        for (j = 0; j < TB_HASH_BUCKET_ENTRIES; j++)                    \
+            if ((tb = tb_hash_buckets[i].tbs[j]) != NULL &&             \
+                tb != TB_HASH_DELETED)
+
+static void tb_invalidate_check(target_ulong address)
+{
+    TranslationBlock *tb;
+    size_t i;
+    int j;
+    address &= TARGET_PAGE_MASK;
+    TB_HASH_FOREACH(tb, i, j) {
+        if (!(address + TARGET_PAGE_SIZE <= tb->pc ||
+              address >= tb->pc + tb->size)) {
+            printf("ERROR invalidate: address=" TARGET_FMT_lx
+                   " PC=%08lx size=%04x\n",
+                   address, (long)tb->pc, tb->size);
         }
-        ptb = (TranslationBlock **)((char *)tb1 + next_offset);
     }
 }
 
+/* verify that all the pages have correct rights for code */
+static void tb_page_check(void)
+{
+    TranslationBlock *tb;
+    size_t i;
+    int j, flags1, flags2;
+
+    TB_HASH_FOREACH(tb, i, j) {
+        if (tb->cflags & CF_CHECK_CODE) {
+            continue;
+        }
+        flags1 = page_get_flags(tb->pc);
+        flags2 = page_get_flags(tb->pc + tb->size - 1);
+        if ((flags1 & PAGE_WRITE) || (flags2 & PAGE_WRITE)) {
+            printf("ERROR page flags: PC=%08lx size=%04x f1=%x f2=%x\n",
+                   (long)tb->pc, tb->size, flags1, flags2);
+        }
+    }
+}
+
+#endif
+
+/* invalidate one TB */
 static inline void tb_page_remove(TranslationBlock **ptb, TranslationBlock *tb)
 {
     TranslationBlock *tb1;
@@ -915,19 +1725,34 @@ static inline void tb_reset_jump(TranslationBlock *tb, int n)
     tb_set_jmp_target(tb, n, (uintptr_t)(tb->tc_ptr + tb->tb_next_offset[n]));
 }
 
+/* reset the jumps of other TBs to this one */
+static void tb_jmp_unchain(TranslationBlock *tb)
+{
+    TranslationBlock *tb1, *tb2;
+    unsigned int n1;
+
+    tb1 = tb->jmp_first;
+    for(;;) {
+        n1 = (uintptr_t)tb1 & 3;
+        if (n1 == 2)
+            break;
+        tb1 = (TranslationBlock *)((uintptr_t)tb1 & ~3);
+        tb2 = tb1->jmp_next[n1];
+        tb_reset_jump(tb1, n1);
+        tb1->jmp_next[n1] = NULL;
+        tb1 = tb2;
+    }
+    tb->jmp_first = (TranslationBlock *)((uintptr_t)tb | 2);
+}
+
 void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
 {
     CPUArchState *env;
     PageDesc *p;
-    unsigned int h, n1;
-    tb_page_addr_t phys_pc;
-    TranslationBlock *tb1, *tb2;
+    unsigned int h;
 
-    /* remove the TB from the hash list */
-    phys_pc = tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK);
-    h = tb_phys_hash_func(phys_pc);
-    tb_remove(&tb_phys_hash[h], tb,
-              offsetof(TranslationBlock, phys_hash_next));
+    /* remove the TB from the hash table */
+    tb_hash_remove(tb);
 
     /* remove the TB from the page list */
     if (tb->page_addr[0] != page_addr) {
@@ -955,18 +1780,9 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     tb_jmp_remove(tb, 1);
 
     /* suppress any remaining jumps to this TB */
-    tb1 = tb->jmp_first;
-    for(;;) {
-        n1 = (uintptr_t)tb1 & 3;
-        if (n1 == 2)
-            break;
-        tb1 = (TranslationBlock *)((uintptr_t)tb1 & ~3);
-        tb2 = tb1->jmp_next[n1];
-        tb_reset_jump(tb1, n1);
-        tb1->jmp_next[n1] = NULL;
-        tb1 = tb2;
-    }
-    tb->jmp_first = (TranslationBlock *)((uintptr_t)tb | 2); /* fail safe */
+    tb_jmp_unchain(tb);
+    /* so that tb_region_flush() skips it */
+    tb->page_addr[0] = -1;
 
     tb_phys_invalidate_count++;
 }
@@ -1036,24 +1852,39 @@ TranslationBlock *tb_gen_code(CPUArchState *env,
     target_ulong virt_page2;
     int code_gen_size;
 
+    tb_mutex_lock();
     phys_pc = get_page_addr_code(env, pc);
     tb = tb_alloc(pc);
     if (!tb) {
         /* flush must be done */
         tb_flush(env);
+        if (mttcg_enabled) {
+            /* ... but not until the other vCPUs stop, so retry later */
+            env->exception_index = EXCP_INTERRUPT;
+            cpu_loop_exit(env);
+        }
         /* cannot fail at this point */
         tb = tb_alloc(pc);
         /* Don't forget to invalidate previous TB info.  */
         tb_invalidated_flag = 1;
     }
-    tc_ptr = code_gen_ptr;
+    tc_ptr = code_gen_region->ptr;
     tb->tc_ptr = tc_ptr;
     tb->cs_base = cs_base;
     tb->flags = flags;
     tb->cflags = cflags;
+#if defined(CONFIG_LINUX_USER)
+    if (!tb_cache_load(env, tb, &code_gen_size)) {
+        cpu_gen_code(env, tb, &code_gen_size);
+        tb_cache_save(env, tb, code_gen_size);
+    }
+#else
     cpu_gen_code(env, tb, &code_gen_size);
-    code_gen_ptr = (void *)(((uintptr_t)code_gen_ptr + code_gen_size +
-                             CODE_GEN_ALIGN - 1) & ~(CODE_GEN_ALIGN - 1));
+#endif
+    tb_perf_map_add(tb, code_gen_size);
+    code_gen_region->ptr = (void *)(((uintptr_t)tc_ptr + code_gen_size +
+                                     CODE_GEN_ALIGN - 1) &
+                                    ~(CODE_GEN_ALIGN - 1));
 
     /* check next page if needed */
     virt_page2 = (pc + tb->size - 1) & TARGET_PAGE_MASK;
@@ -1062,6 +1893,7 @@ TranslationBlock *tb_gen_code(CPUArchState *env,
         phys_page2 = get_page_addr_code(env, virt_page2);
     }
     tb_link_page(tb, phys_pc, phys_page2);
+    tb_mutex_unlock();
     return tb;
 }
 
@@ -1106,9 +1938,12 @@ void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
     int current_flags = 0;
 #endif /* TARGET_HAS_PRECISE_SMC */
 
+    tb_mutex_lock();
     p = page_find(start >> TARGET_PAGE_BITS);
-    if (!p)
+    if (!p) {
+        tb_mutex_unlock();
         return;
+    }
     if (!p->code_bitmap &&
         ++p->code_write_count >= SMC_BITMAP_USE_THRESHOLD &&
         is_cpu_write_access) {
@@ -1189,9 +2024,11 @@ void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
            itself */
         env->current_tb = NULL;
         tb_gen_code(env, current_pc, current_cs_base, current_flags, 1);
+        /* cpu_exec() drops tb_mutex after the longjmp */
         cpu_resume_from_signal(env, NULL);
     }
 #endif
+    tb_mutex_unlock();
 }
 
 /* len must be <= 8 and start must be a multiple of len */
@@ -1208,9 +2045,12 @@ static inline void tb_invalidate_phys_page_fast(tb_page_addr_t start, int len)
                   (intptr_t)cpu_single_env->segs[R_CS].base);
     }
 #endif
+    tb_mutex_lock();
     p = page_find(start >> TARGET_PAGE_BITS);
-    if (!p)
+    if (!p) {
+        tb_mutex_unlock();
         return;
+    }
     if (p->code_bitmap) {
         offset = start & ~TARGET_PAGE_MASK;
         b = p->code_bitmap[offset >> 3] >> (offset & 7);
@@ -1220,6 +2060,7 @@ static inline void tb_invalidate_phys_page_fast(tb_page_addr_t start, int len)
     do_invalidate:
         tb_invalidate_phys_page_range(start, start + len, 1);
     }
+    tb_mutex_unlock();
 }
 
 #if !defined(CONFIG_SOFTMMU)
@@ -1283,6 +2124,81 @@ static void tb_invalidate_phys_page(tb_page_addr_t addr,
 }
 #endif
 
+#if defined(CONFIG_USER_ONLY)
+/* The guest code of TB; TBs of pages that are not write protected
+   compare it with the hash taken when they were linked */
+static uint64_t tb_code_hash(TranslationBlock *tb)
+{
+    const uint8_t *code = g2h(tb->pc);
+    uint64_t h = 0xcbf29ce484222325ULL, w;
+    int i;
+
+    for (i = 0; i + 8 <= tb->size; i += 8) {
+        memcpy(&w, code + i, 8);
+        h = (h ^ w) * 0x100000001b3ULL;
+        h ^= h >> 29;
+    }
+    for (; i < tb->size; i++) {
+        h = (h ^ code[i]) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static void tb_set_check_code(TranslationBlock *tb)
+{
+    tb->code_hash = tb_code_hash(tb);
+    tb->cflags |= CF_CHECK_CODE;
+}
+
+bool tb_code_changed(TranslationBlock *tb)
+{
+    return tb_code_hash(tb) != tb->code_hash;
+}
+
+/* Stop relying on the write protection of the page: its TBs check
+   their code when they are entered from now on.  Direct jumps into
+   them would skip that, so they are reset.  */
+static void tb_page_check_code(PageDesc *p)
+{
+    TranslationBlock *tb = p->first_tb;
+    int n;
+
+    while (tb != NULL) {
+        n = (uintptr_t)tb & 3;
+        tb = (TranslationBlock *)((uintptr_t)tb & ~3);
+        if (!(tb->cflags & CF_CHECK_CODE)) {
+            tb_set_check_code(tb);
+            tb_jmp_unchain(tb);
+        }
+        tb = tb->page_next[n];
+    }
+}
+
+/* Whether the write at addr, which faulted on the page at page_addr, may
+   hit translated code.  The access size is not known, so this assumes
+   the largest one.  */
+static bool tb_page_write_hits_code(PageDesc *p, target_ulong page_addr,
+                                    target_ulong addr)
+{
+    int offset, end;
+
+    if ((addr & TARGET_PAGE_MASK) != page_addr) {
+        return false;
+    }
+    if (!p->code_bitmap) {
+        build_page_bitmap(p);
+    }
+    offset = addr - page_addr;
+    end = MIN(offset + 16, TARGET_PAGE_SIZE);
+    for (; offset < end; offset++) {
+        if (p->code_bitmap[offset >> 3] & (1 << (offset & 7))) {
+            return true;
+        }
+    }
+    return false;
+}
+#endif
+
 /* add the tb in the target page and protect it if necessary */
 static inline void tb_alloc_page(TranslationBlock *tb,
                                  unsigned int n, tb_page_addr_t page_addr)
@@ -1304,10 +2220,14 @@ static inline void tb_alloc_page(TranslationBlock *tb,
 #if defined(TARGET_HAS_SMC) || 1
 
 #if defined(CONFIG_USER_ONLY)
-    if (p->flags & PAGE_WRITE) {
+    if (p->write_faults >= SMC_BITMAP_USE_THRESHOLD) {
+        /* written too often to be worth protecting */
+        if (!(tb->cflags & CF_CHECK_CODE)) {
+            tb_set_check_code(tb);
+        }
+    } else if (page_vma_flags(page_addr) & PAGE_WRITE) {
         target_ulong addr;
-        PageDesc *p2;
-        int prot;
+        int prot, flags;
 
         /* force the host page as non writable (writes will have a
            page fault + mprotect overhead) */
@@ -1316,12 +2236,13 @@ static inline void tb_alloc_page(TranslationBlock *tb,
         for(addr = page_addr; addr < page_addr + qemu_host_page_size;
             addr += TARGET_PAGE_SIZE) {
 
-            p2 = page_find (addr >> TARGET_PAGE_BITS);
-            if (!p2)
-                continue;
-            prot |= p2->flags;
-            p2->flags &= ~PAGE_WRITE;
-          }
+            flags = page_vma_flags(addr);
+            prot |= flags;
+            if (flags & PAGE_WRITE) {
+                page_vma_set(addr, addr + TARGET_PAGE_SIZE - 1,
+                             flags & ~PAGE_WRITE);
+            }
+        }
         mprotect(g2h(page_addr), qemu_host_page_size,
                  (prot & PAGE_BITS) & ~PAGE_WRITE);
 #ifdef DEBUG_TB_INVALIDATE
@@ -1346,18 +2267,9 @@ static inline void tb_alloc_page(TranslationBlock *tb,
 void tb_link_page(TranslationBlock *tb,
                   tb_page_addr_t phys_pc, tb_page_addr_t phys_page2)
 {
-    unsigned int h;
-    TranslationBlock **ptb;
-
     /* Grab the mmap lock to stop another thread invalidating this TB
        before we are done.  */
     mmap_lock();
-    /* add in the physical hash table */
-    h = tb_phys_hash_func(phys_pc);
-    ptb = &tb_phys_hash[h];
-    tb->phys_hash_next = *ptb;
-    *ptb = tb;
-
     /* add in the page list */
     tb_alloc_page(tb, 0, phys_pc & TARGET_PAGE_MASK);
     if (phys_page2 != -1)
@@ -1365,6 +2277,9 @@ void tb_link_page(TranslationBlock *tb,
     else
         tb->page_addr[1] = -1;
 
+    /* add in the physical hash table, which hashes page_addr[0] */
+    tb_hash_insert(tb);
+
     tb->jmp_first = (TranslationBlock *)((uintptr_t)tb | 2);
     tb->jmp_next[0] = NULL;
     tb->jmp_next[1] = NULL;
@@ -1381,6 +2296,15 @@ void tb_link_page(TranslationBlock *tb,
     mmap_unlock();
 }
 
+#if defined(CONFIG_QEMU_LDST_OPTIMIZATION) && defined(CONFIG_SOFTMMU)
+/* check whether the given address is in the translated code */
+bool is_tcg_gen_code(uintptr_t tc_ptr)
+{
+    return tc_ptr >= (uintptr_t)code_gen_buffer &&
+           tc_ptr < (uintptr_t)code_gen_buffer + code_gen_buffer_size;
+}
+#endif
+
 /* find the TB 'tb' such that tb[0].tc_ptr <= tc_ptr <
    tb[1].tc_ptr. Return NULL if not found */
 TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
@@ -1388,29 +2312,40 @@ TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
     int m_min, m_max, m;
     uintptr_t v;
     TranslationBlock *tb;
+    CodeGenRegion *r;
 
-    if (nb_tbs <= 0)
-        return NULL;
+    tb_mutex_lock();
     if (tc_ptr < (uintptr_t)code_gen_buffer ||
-        tc_ptr >= (uintptr_t)code_gen_ptr) {
+        tc_ptr >= (uintptr_t)code_gen_buffer +
+                  code_gen_active_regions * code_gen_region_size) {
+        tb_mutex_unlock();
+        return NULL;
+    }
+    r = &code_gen_regions[(tc_ptr - (uintptr_t)code_gen_buffer) /
+                          code_gen_region_size];
+    if (r->nb_tbs <= 0 || tc_ptr >= (uintptr_t)r->ptr) {
+        tb_mutex_unlock();
         return NULL;
     }
     /* binary search (cf Knuth) */
     m_min = 0;
-    m_max = nb_tbs - 1;
+    m_max = r->nb_tbs - 1;
     while (m_min <= m_max) {
         m = (m_min + m_max) >> 1;
-        tb = &tbs[m];
+        tb = &r->tbs[m];
         v = (uintptr_t)tb->tc_ptr;
-        if (v == tc_ptr)
-            return tb;
-        else if (tc_ptr < v) {
+        if (v == tc_ptr) {
+            m_max = m;
+            break;
+        } else if (tc_ptr < v) {
             m_max = m - 1;
         } else {
             m_min = m + 1;
         }
     }
-    return &tbs[m_max];
+    tb = &r->tbs[m_max];
+    tb_mutex_unlock();
+    return tb;
 }
 
 static void tb_reset_jump_recursive(TranslationBlock *tb);
@@ -1472,13 +2407,16 @@ void tb_invalidate_phys_addr(target_phys_addr_t addr)
     ram_addr_t ram_addr;
     MemoryRegionSection *section;
 
+    rcu_read_lock();
     section = phys_page_find(addr >> TARGET_PAGE_BITS);
     if (!(memory_region_is_ram(section->mr)
           || (section->mr->rom_device && section->mr->readable))) {
+        rcu_read_unlock();
         return;
     }
     ram_addr = (memory_region_get_ram_addr(section->mr) & TARGET_PAGE_MASK)
         + memory_region_section_addr(section, addr);
+    rcu_read_unlock();
     tb_invalidate_phys_page_range(ram_addr, ram_addr + 1, 0);
 }
 
@@ -1844,7 +2782,7 @@ static void tlb_reset_dirty_range_all(ram_addr_t start, ram_addr_t end,
 
 /* Note: start and end must be within the same ram block.  */
 void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
-                                     int dirty_flags)
+                                     unsigned client)
 {
     uintptr_t length;
 
@@ -1854,7 +2792,7 @@ void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
     length = end - start;
     if (length == 0)
         return;
-    cpu_physical_memory_mask_dirty_range(start, length, dirty_flags);
+    cpu_physical_memory_clear_dirty_range(start, length, client);
 
     if (tcg_enabled()) {
         tlb_reset_dirty_range_all(start, end, length);
@@ -1894,7 +2832,7 @@ target_phys_addr_t memory_region_section_get_iotlb(CPUArchState *env,
            and avoid full address decoding in every device.
            We can't use the high bits of pd for this because
            IO_MEM_ROMD uses these as a ram address.  */
-        iotlb = section - phys_sections;
+        iotlb = section - atomic_rcu_read(&cur_dispatch)->sections;
         iotlb += memory_region_section_addr(section, paddr);
     }
 
@@ -1926,6 +2864,7 @@ struct walk_memory_regions_data
     void *priv;
     uintptr_t start;
     int prot;
+    abi_ulong next;
 };
 
 static int walk_memory_regions_end(struct walk_memory_regions_data *data,
@@ -1945,62 +2884,54 @@ static int walk_memory_regions_end(struct walk_memory_regions_data *data,
 }
 
 static int walk_memory_regions_1(struct walk_memory_regions_data *data,
-                                 abi_ulong base, int level, void **lp)
+                                 PageVMA *v)
 {
-    abi_ulong pa;
-    int i, rc;
+    int rc;
 
-    if (*lp == NULL) {
-        return walk_memory_regions_end(data, base, 0);
+    if (!v) {
+        return 0;
+    }
+    rc = walk_memory_regions_1(data, v->left);
+    if (rc != 0) {
+        return rc;
     }
 
-    if (level == 0) {
-        PageDesc *pd = *lp;
-        for (i = 0; i < L2_SIZE; ++i) {
-            int prot = pd[i].flags;
-
-            pa = base | (i << TARGET_PAGE_BITS);
-            if (prot != data->prot) {
-                rc = walk_memory_regions_end(data, pa, prot);
-                if (rc != 0) {
-                    return rc;
-                }
-            }
+    if (v->start != data->next) {
+        rc = walk_memory_regions_end(data, data->next, 0);
+        if (rc != 0) {
+            return rc;
         }
-    } else {
-        void **pp = *lp;
-        for (i = 0; i < L2_SIZE; ++i) {
-            pa = base | ((abi_ulong)i <<
-                (TARGET_PAGE_BITS + L2_BITS * level));
-            rc = walk_memory_regions_1(data, pa, level - 1, pp + i);
-            if (rc != 0) {
-                return rc;
-            }
+    }
+    if (v->flags != data->prot) {
+        rc = walk_memory_regions_end(data, v->start, v->flags);
+        if (rc != 0) {
+            return rc;
         }
     }
+    data->next = v->last + 1;
 
-    return 0;
+    return walk_memory_regions_1(data, v->right);
 }
 
 int walk_memory_regions(void *priv, walk_memory_regions_fn fn)
 {
     struct walk_memory_regions_data data;
-    uintptr_t i;
+    int rc;
 
     data.fn = fn;
     data.priv = priv;
     data.start = -1ul;
     data.prot = 0;
+    data.next = 0;
 
-    for (i = 0; i < V_L1_SIZE; i++) {
-        int rc = walk_memory_regions_1(&data, (abi_ulong)i << V_L1_SHIFT,
-                                       V_L1_SHIFT / L2_BITS - 1, l1_map + i);
-        if (rc != 0) {
-            return rc;
-        }
+    mmap_lock();
+    rc = walk_memory_regions_1(&data, page_vmas);
+    if (rc == 0) {
+        rc = walk_memory_regions_end(&data, data.next, 0);
     }
+    mmap_unlock();
 
-    return walk_memory_regions_end(&data, 0, 0);
+    return rc;
 }
 
 static int dump_region(void *priv, abi_ulong start,
@@ -2028,12 +2959,79 @@ void page_dump(FILE *f)
 
 int page_get_flags(target_ulong address)
 {
-    PageDesc *p;
+    int flags;
 
-    p = page_find(address >> TARGET_PAGE_BITS);
-    if (!p)
+    mmap_lock();
+    flags = page_vma_flags(address & TARGET_PAGE_MASK);
+    mmap_unlock();
+    return flags;
+}
+
+/* Return the flags of the pages from start to end - 1 or'ed together */
+int page_get_flags_range(target_ulong start, target_ulong end)
+{
+    PageVMA *v;
+    target_ulong last;
+    int flags = 0;
+
+    if (start == end) {
         return 0;
-    return p->flags;
+    }
+    start &= TARGET_PAGE_MASK;
+    last = end - 1;
+
+    mmap_lock();
+    for (v = page_vma_lookup(start); v && v->start <= last;
+         v = page_vma_next(v)) {
+        flags |= v->flags;
+    }
+    mmap_unlock();
+    return flags;
+}
+
+/* Return the highest address aligned on ~mask such that the size bytes
+   from there are below limit and have no flags, or -1 if there is none.
+   This only knows about the guest mappings, so it is only useful when
+   the guest address space has been reserved.  */
+target_ulong page_find_gap(target_ulong limit, target_ulong size,
+                           target_ulong mask)
+{
+    PageVMA *v;
+    target_ulong addr, found = -1;
+
+    mmap_lock();
+    while (limit >= size) {
+        addr = (limit - size) & mask;
+        v = page_vma_before(addr + size);
+        if (!v || v->last < addr) {
+            found = addr;
+            break;
+        }
+        limit = v->start;
+    }
+    mmap_unlock();
+    return found;
+}
+
+/* Invalidate the code in the pages from start to last */
+static void page_invalidate_code(target_ulong start, target_ulong last)
+{
+    target_ulong addr = start;
+
+    do {
+        PageDesc *p = page_find(addr >> TARGET_PAGE_BITS);
+
+        if (p) {
+            if (p->first_tb) {
+                tb_invalidate_phys_page(addr, 0, NULL);
+            }
+            addr += TARGET_PAGE_SIZE;
+        } else {
+            /* none of the pages of this leaf table has translated code */
+            addr |= ((target_ulong)L2_SIZE << TARGET_PAGE_BITS) - 1;
+            addr++;
+        }
+    } while (addr != 0 && addr <= last);
 }
 
 /* Modify the flags of a page and invalidate the code if necessary.
@@ -2041,7 +3039,8 @@ int page_get_flags(target_ulong address)
    on PAGE_WRITE.  The mmap_lock should already be held.  */
 void page_set_flags(target_ulong start, target_ulong end, int flags)
 {
-    target_ulong addr, len;
+    PageVMA *v;
+    target_ulong last;
 
     /* This function should never be called with addresses outside the
        guest address space.  If this assert fires, it probably indicates
@@ -2052,33 +3051,29 @@ void page_set_flags(target_ulong start, target_ulong end, int flags)
     assert(start < end);
 
     start = start & TARGET_PAGE_MASK;
-    end = TARGET_PAGE_ALIGN(end);
+    last = TARGET_PAGE_ALIGN(end) - 1;
 
     if (flags & PAGE_WRITE) {
         flags |= PAGE_WRITE_ORG;
-    }
-
-    for (addr = start, len = end - start;
-         len != 0;
-         len -= TARGET_PAGE_SIZE, addr += TARGET_PAGE_SIZE) {
-        PageDesc *p = page_find_alloc(addr >> TARGET_PAGE_BITS, 1);
 
         /* If the write protection bit is set, then we invalidate
            the code inside.  */
-        if (!(p->flags & PAGE_WRITE) &&
-            (flags & PAGE_WRITE) &&
-            p->first_tb) {
-            tb_invalidate_phys_page(addr, 0, NULL);
+        for (v = page_vma_lookup(start); v && v->start <= last;
+             v = page_vma_next(v)) {
+            if (!(v->flags & PAGE_WRITE)) {
+                page_invalidate_code(MAX(v->start, start), MIN(v->last, last));
+            }
         }
-        p->flags = flags;
     }
+
+    page_vma_set(start, last, flags);
 }
 
 int page_check_range(target_ulong start, target_ulong len, int flags)
 {
-    PageDesc *p;
-    target_ulong end;
-    target_ulong addr;
+    PageVMA *v;
+    target_ulong addr, last, vma_last;
+    int ret = 0;
 
     /* This function should never be called with addresses outside the
        guest address space.  If this assert fires, it probably indicates
@@ -2095,33 +3090,77 @@ int page_check_range(target_ulong start, target_ulong len, int flags)
         return -1;
     }
 
-    end = TARGET_PAGE_ALIGN(start+len); /* must do before we loose bits in the next step */
+    last = TARGET_PAGE_ALIGN(start + len) - 1; /* must do before we loose bits in the next step */
     start = start & TARGET_PAGE_MASK;
 
-    for (addr = start, len = end - start;
-         len != 0;
-         len -= TARGET_PAGE_SIZE, addr += TARGET_PAGE_SIZE) {
-        p = page_find(addr >> TARGET_PAGE_BITS);
-        if( !p )
-            return -1;
-        if( !(p->flags & PAGE_VALID) )
-            return -1;
-
-        if ((flags & PAGE_READ) && !(p->flags & PAGE_READ))
-            return -1;
+    mmap_lock();
+    for (addr = start; ; addr = vma_last + 1) {
+        v = page_vma_lookup(addr);
+        if (!v || v->start > addr || !(v->flags & PAGE_VALID)) {
+            ret = -1;
+            break;
+        }
+        if ((flags & PAGE_READ) && !(v->flags & PAGE_READ)) {
+            ret = -1;
+            break;
+        }
+        vma_last = MIN(v->last, last);
         if (flags & PAGE_WRITE) {
-            if (!(p->flags & PAGE_WRITE_ORG))
-                return -1;
-            /* unprotect the page if it was put read-only because it
-               contains translated code */
-            if (!(p->flags & PAGE_WRITE)) {
-                if (!page_unprotect(addr, 0, NULL))
-                    return -1;
+            if (!(v->flags & PAGE_WRITE_ORG)) {
+                ret = -1;
+                break;
+            }
+            /* unprotect the pages that were put read-only because they
+               contain translated code */
+            if (!(v->flags & PAGE_WRITE)) {
+                target_ulong page;
+
+                for (page = addr; ; page += TARGET_PAGE_SIZE) {
+                    if (!(page_vma_flags(page) & PAGE_WRITE) &&
+                        !page_unprotect(page, 0, NULL)) {
+                        ret = -1;
+                        goto out;
+                    }
+                    if (page == (vma_last & TARGET_PAGE_MASK)) {
+                        break;
+                    }
+                }
             }
-            return 0;
+        }
+        if (vma_last == last) {
+            break;
         }
     }
-    return 0;
+out:
+    mmap_unlock();
+    return ret;
+}
+
+/* Deal with the code of the page at addr, which was made writable
+   because of a write at address */
+static void page_unprotect_code(target_ulong addr, target_ulong address,
+                                uintptr_t pc, void *puc)
+{
+    PageDesc *p = page_find(addr >> TARGET_PAGE_BITS);
+
+    if (!p || !p->first_tb) {
+        return;
+    }
+    /* a page that keeps being written, like the code buffer of a JIT,
+       loses its TBs only when the write hits them; the TBs check their
+       code instead of the page being protected */
+    if (++p->write_faults >= SMC_BITMAP_USE_THRESHOLD &&
+        !tb_page_write_hits_code(p, addr, address)) {
+        tb_page_check_code(p);
+        return;
+    }
+
+    /* and since the content will be modified, we must invalidate
+       the corresponding translated code. */
+    tb_invalidate_phys_page(addr, pc, puc);
+#ifdef DEBUG_TB_CHECK
+    tb_invalidate_check(addr);
+#endif
 }
 
 /* called from signal handler: invalidate the code and unprotect the
@@ -2129,7 +3168,7 @@ int page_check_range(target_ulong start, target_ulong len, int flags)
 int page_unprotect(target_ulong address, uintptr_t pc, void *puc)
 {
     unsigned int prot;
-    PageDesc *p;
+    int flags;
     target_ulong host_start, host_end, addr;
 
     /* Technically this isn't safe inside a signal handler.  However we
@@ -2137,33 +3176,33 @@ int page_unprotect(target_ulong address, uintptr_t pc, void *puc)
        practice it seems to be ok.  */
     mmap_lock();
 
-    p = page_find(address >> TARGET_PAGE_BITS);
-    if (!p) {
-        mmap_unlock();
-        return 0;
-    }
+    flags = page_vma_flags(address & TARGET_PAGE_MASK);
 
     /* if the page was really writable, then we change its
        protection back to writable */
-    if ((p->flags & PAGE_WRITE_ORG) && !(p->flags & PAGE_WRITE)) {
+    if ((flags & PAGE_WRITE_ORG) && !(flags & PAGE_WRITE)) {
         host_start = address & qemu_host_page_mask;
         host_end = host_start + qemu_host_page_size;
 
         prot = 0;
         for (addr = host_start ; addr < host_end ; addr += TARGET_PAGE_SIZE) {
-            p = page_find(addr >> TARGET_PAGE_BITS);
-            p->flags |= PAGE_WRITE;
-            prot |= p->flags;
-
-            /* and since the content will be modified, we must invalidate
-               the corresponding translated code. */
-            tb_invalidate_phys_page(addr, pc, puc);
-#ifdef DEBUG_TB_CHECK
-            tb_invalidate_check(addr);
-#endif
+            flags = page_vma_flags(addr);
+            if ((flags & PAGE_WRITE_ORG) && !(flags & PAGE_WRITE)) {
+                flags |= PAGE_WRITE;
+                page_vma_set(addr, addr + TARGET_PAGE_SIZE - 1, flags);
+            }
+            prot |= flags;
         }
+        /* invalidating the code of the current TB does not return, so
+           protect first and leave the page of the write for last */
         mprotect((void *)g2h(host_start), qemu_host_page_size,
                  prot & PAGE_BITS);
+        for (addr = host_start ; addr < host_end ; addr += TARGET_PAGE_SIZE) {
+            if (addr != (address & TARGET_PAGE_MASK)) {
+                page_unprotect_code(addr, address, pc, puc);
+            }
+        }
+        page_unprotect_code(address & TARGET_PAGE_MASK, address, pc, puc);
 
         mmap_unlock();
         return 1;
@@ -2178,26 +3217,57 @@ int page_unprotect(target_ulong address, uintptr_t pc, void *puc)
 #define SUBPAGE_IDX(addr) ((addr) & ~TARGET_PAGE_MASK)
 typedef struct subpage_t {
     MemoryRegion iomem;
+    PhysDispatch *d;
     target_phys_addr_t base;
     uint16_t sub_section[TARGET_PAGE_SIZE];
+    /* next on subpage_reclaim_list */
+    struct subpage_t *reclaim_next;
 } subpage_t;
 
+/* Destroying a subpage's region walks the flat views and the memory
+ * listeners, so the RCU callback leaves it to a bottom half that runs
+ * under the iothread lock.
+ */
+static QemuMutex subpage_reclaim_lock;
+static subpage_t *subpage_reclaim_list;
+static QEMUBH *subpage_reclaim_bh;
+
 static int subpage_register (subpage_t *mmio, uint32_t start, uint32_t end,
                              uint16_t section);
-static subpage_t *subpage_init(target_phys_addr_t base);
-static void destroy_page_desc(uint16_t section_index)
+static subpage_t *subpage_init(PhysDispatch *d, target_phys_addr_t base);
+static void destroy_page_desc(PhysDispatch *d, uint16_t section_index)
 {
-    MemoryRegionSection *section = &phys_sections[section_index];
+    MemoryRegionSection *section = &d->sections[section_index];
     MemoryRegion *mr = section->mr;
 
     if (mr->subpage) {
         subpage_t *subpage = container_of(mr, subpage_t, iomem);
+
+        qemu_mutex_lock(&subpage_reclaim_lock);
+        subpage->reclaim_next = subpage_reclaim_list;
+        subpage_reclaim_list = subpage;
+        qemu_mutex_unlock(&subpage_reclaim_lock);
+    }
+}
+
+static void subpage_reclaim_bh_cb(void *opaque)
+{
+    subpage_t *subpage, *next;
+
+    qemu_mutex_lock(&subpage_reclaim_lock);
+    subpage = subpage_reclaim_list;
+    subpage_reclaim_list = NULL;
+    qemu_mutex_unlock(&subpage_reclaim_lock);
+
+    for (; subpage; subpage = next) {
+        next = subpage->reclaim_next;
         memory_region_destroy(&subpage->iomem);
         g_free(subpage);
     }
 }
 
-static void destroy_l2_mapping(PhysPageEntry *lp, unsigned level)
+static void destroy_l2_mapping(PhysDispatch *d, PhysPageEntry *lp,
+                               unsigned level)
 {
     unsigned i;
     PhysPageEntry *p;
@@ -2206,46 +3276,49 @@ static void destroy_l2_mapping(PhysPageEntry *lp, unsigned level)
         return;
     }
 
-    p = phys_map_nodes[lp->ptr];
+    p = d->nodes[lp->ptr];
     for (i = 0; i < L2_SIZE; ++i) {
         if (!p[i].is_leaf) {
-            destroy_l2_mapping(&p[i], level - 1);
+            destroy_l2_mapping(d, &p[i], level - 1);
         } else {
-            destroy_page_desc(p[i].ptr);
+            destroy_page_desc(d, p[i].ptr);
         }
     }
     lp->is_leaf = 0;
     lp->ptr = PHYS_MAP_NODE_NIL;
 }
 
-static void destroy_all_mappings(void)
+/* Called after a grace period, once no reader can see d any more.  */
+static void phys_dispatch_reclaim(struct rcu_head *rcu)
 {
-    destroy_l2_mapping(&phys_map, P_L2_LEVELS - 1);
-    phys_map_nodes_reset();
-}
+    PhysDispatch *d = container_of(rcu, PhysDispatch, rcu);
 
-static uint16_t phys_section_add(MemoryRegionSection *section)
-{
-    if (phys_sections_nb == phys_sections_nb_alloc) {
-        phys_sections_nb_alloc = MAX(phys_sections_nb_alloc * 2, 16);
-        phys_sections = g_renew(MemoryRegionSection, phys_sections,
-                                phys_sections_nb_alloc);
-    }
-    phys_sections[phys_sections_nb] = *section;
-    return phys_sections_nb++;
+    destroy_l2_mapping(d, &d->phys_map, P_L2_LEVELS - 1);
+    g_free(d->nodes);
+    g_free(d->sections);
+    g_free(d);
+    qemu_bh_schedule(subpage_reclaim_bh);
 }
 
-static void phys_sections_clear(void)
+static uint16_t phys_section_add(PhysDispatch *d,
+                                 MemoryRegionSection *section)
 {
-    phys_sections_nb = 0;
+    if (d->sections_nb == d->sections_nb_alloc) {
+        d->sections_nb_alloc = MAX(d->sections_nb_alloc * 2, 16);
+        d->sections = g_renew(MemoryRegionSection, d->sections,
+                              d->sections_nb_alloc);
+    }
+    d->sections[d->sections_nb] = *section;
+    return d->sections_nb++;
 }
 
-static void register_subpage(MemoryRegionSection *section)
+static void register_subpage(PhysDispatch *d, MemoryRegionSection *section)
 {
     subpage_t *subpage;
     target_phys_addr_t base = section->offset_within_address_space
         & TARGET_PAGE_MASK;
-    MemoryRegionSection *existing = phys_page_find(base >> TARGET_PAGE_BITS);
+    MemoryRegionSection *existing = phys_page_find_dispatch(d,
+                                        base >> TARGET_PAGE_BITS);
     MemoryRegionSection subsection = {
         .offset_within_address_space = base,
         .size = TARGET_PAGE_SIZE,
@@ -2255,36 +3328,37 @@ static void register_subpage(MemoryRegionSection *section)
     assert(existing->mr->subpage || existing->mr == &io_mem_unassigned);
 
     if (!(existing->mr->subpage)) {
-        subpage = subpage_init(base);
+        subpage = subpage_init(d, base);
         subsection.mr = &subpage->iomem;
-        phys_page_set(base >> TARGET_PAGE_BITS, 1,
-                      phys_section_add(&subsection));
+        phys_page_set(d, base >> TARGET_PAGE_BITS, 1,
+                      phys_section_add(d, &subsection));
     } else {
         subpage = container_of(existing->mr, subpage_t, iomem);
     }
     start = section->offset_within_address_space & ~TARGET_PAGE_MASK;
     end = start + section->size - 1;
-    subpage_register(subpage, start, end, phys_section_add(section));
+    subpage_register(subpage, start, end, phys_section_add(d, section));
 }
 
 
-static void register_multipage(MemoryRegionSection *section)
+static void register_multipage(PhysDispatch *d, MemoryRegionSection *section)
 {
     target_phys_addr_t start_addr = section->offset_within_address_space;
     ram_addr_t size = section->size;
     target_phys_addr_t addr;
-    uint16_t section_index = phys_section_add(section);
+    uint16_t section_index = phys_section_add(d, section);
 
     assert(size);
 
     addr = start_addr;
-    phys_page_set(addr >> TARGET_PAGE_BITS, size >> TARGET_PAGE_BITS,
+    phys_page_set(d, addr >> TARGET_PAGE_BITS, size >> TARGET_PAGE_BITS,
                   section_index);
 }
 
 void cpu_register_physical_memory_log(MemoryRegionSection *section,
                                       bool readonly)
 {
+    PhysDispatch *d = next_dispatch;
     MemoryRegionSection now = *section, remain = *section;
 
     if ((now.offset_within_address_space & ~TARGET_PAGE_MASK)
@@ -2292,7 +3366,7 @@ void cpu_register_physical_memory_log(MemoryRegionSection *section,
         now.size = MIN(TARGET_PAGE_ALIGN(now.offset_within_address_space)
                        - now.offset_within_address_space,
                        now.size);
-        register_subpage(&now);
+        register_subpage(d, &now);
         remain.size -= now.size;
         remain.offset_within_address_space += now.size;
         remain.offset_within_region += now.size;
@@ -2301,10 +3375,10 @@ void cpu_register_physical_memory_log(MemoryRegionSection *section,
         now = remain;
         if (remain.offset_within_region & ~TARGET_PAGE_MASK) {
             now.size = TARGET_PAGE_SIZE;
-            register_subpage(&now);
+            register_subpage(d, &now);
         } else {
             now.size &= TARGET_PAGE_MASK;
-            register_multipage(&now);
+            register_multipage(d, &now);
         }
         remain.size -= now.size;
         remain.offset_within_address_space += now.size;
@@ -2312,7 +3386,7 @@ void cpu_register_physical_memory_log(MemoryRegionSection *section,
     }
     now = remain;
     if (now.size) {
-        register_subpage(&now);
+        register_subpage(d, &now);
     }
 }
 
@@ -2329,6 +3403,20 @@ void qemu_unregister_coalesced_mmio(target_phys_addr_t addr, ram_addr_t size)
         kvm_uncoalesce_mmio_region(addr, size);
 }
 
+void qemu_register_coalesced_pio(pio_addr_t addr, pio_addr_t size)
+{
+    if (kvm_enabled()) {
+        kvm_coalesce_pio_region(addr, size);
+    }
+}
+
+void qemu_unregister_coalesced_pio(pio_addr_t addr, pio_addr_t size)
+{
+    if (kvm_enabled()) {
+        kvm_uncoalesce_pio_region(addr, size);
+    }
+}
+
 void qemu_flush_coalesced_mmio_buffer(void)
 {
     if (kvm_enabled())
@@ -2363,7 +3451,8 @@ static long gethugepagesize(const char *path)
 
 static void *file_ram_alloc(RAMBlock *block,
                             ram_addr_t memory,
-                            const char *path)
+                            const char *path,
+                            size_t *pagesize)
 {
     char *filename;
     void *area;
@@ -2412,12 +3501,15 @@ static void *file_ram_alloc(RAMBlock *block,
         perror("ftruncate");
 
 #ifdef MAP_POPULATE
-    /* NB: MAP_POPULATE won't exhaustively alloc all phys pages in the case
-     * MAP_PRIVATE is requested.  For mem_prealloc we mmap as MAP_SHARED
-     * to sidestep this quirk.
+    /* Preallocation is done by the caller once the memory policy is set,
+     * which MAP_POPULATE would precede.  Keep mapping preallocated memory
+     * MAP_SHARED so that the pages are really reserved in the file.
      */
-    flags = mem_prealloc ? MAP_POPULATE | MAP_SHARED : MAP_PRIVATE;
+    flags = mem_prealloc ? MAP_SHARED : MAP_PRIVATE;
     area = mmap(0, memory, PROT_READ | PROT_WRITE, flags, fd, 0);
+    if (flags & MAP_SHARED) {
+        block->flags |= RAM_SHARED_MASK;
+    }
 #else
     area = mmap(0, memory, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
 #endif
@@ -2427,10 +3519,285 @@ static void *file_ram_alloc(RAMBlock *block,
         return (NULL);
     }
     block->fd = fd;
+    *pagesize = hpagesize;
     return area;
 }
 #endif
 
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sched.h>
+#endif
+
+/* mbind() modes, from <numaif.h> which needs libnuma */
+#define QEMU_MPOL_PREFERRED     1
+#define QEMU_MPOL_BIND          2
+#define QEMU_MPOL_INTERLEAVE    3
+
+/* Apply the -numa host policies to the guest's main RAM.  The guest nodes
+ * cover the block in order, like the tables the firmware builds from
+ * node_mem[].  Boundaries are rounded to @pagesize, which may be the huge
+ * page size of a -mem-path file.
+ */
+static void ram_bind_host_nodes(void *host, ram_addr_t size, size_t pagesize)
+{
+#if defined(__linux__) && defined(__NR_mbind)
+    ram_addr_t mask = ~(ram_addr_t)(pagesize - 1);
+    ram_addr_t start, end = 0;
+    int i, mode;
+
+    for (i = 0; i < nb_numa_nodes && end < size; i++) {
+        start = end & mask;
+        end = (i == nb_numa_nodes - 1) ? size : MIN(end + node_mem[i], size);
+
+        switch (node_host_policy[i]) {
+        case NUMA_POLICY_PREFERRED:
+            mode = QEMU_MPOL_PREFERRED;
+            break;
+        case NUMA_POLICY_BIND:
+            mode = QEMU_MPOL_BIND;
+            break;
+        case NUMA_POLICY_INTERLEAVE:
+            mode = QEMU_MPOL_INTERLEAVE;
+            break;
+        default:
+            continue;
+        }
+
+        /* the last node also gets the tail of a rounded-up huge page */
+        if (syscall(__NR_mbind, (uint8_t *)host + start,
+                    ((end == size ? end + pagesize - 1 : end) & mask) - start,
+                    mode, node_host_mask[i], MAX_HOST_NODES + 1, 0)) {
+            fprintf(stderr, "cannot bind the memory of numa node %d: %s\n",
+                    i, strerror(errno));
+            exit(1);
+        }
+    }
+#else
+    int i;
+
+    for (i = 0; i < nb_numa_nodes; i++) {
+        if (node_host_policy[i] != NUMA_POLICY_DEFAULT) {
+            fprintf(stderr, "numa hostnodes option unsupported\n");
+            exit(1);
+        }
+    }
+#endif
+}
+
+/* Preallocation runs in the background so that the monitor stays
+ * responsive; vm_start() is deferred until every page has been touched.
+ * Jobs are only created and reaped by the main thread.
+ */
+#define RAM_PREALLOC_MAX_THREADS    16
+#define RAM_PREALLOC_STEP           (1 << 20)
+
+typedef struct RAMPreallocJob {
+    QemuThread thread;
+    uint8_t *start;
+    size_t size;
+    size_t pagesize;
+    unsigned long *host_mask;   /* where to run, or NULL */
+    QLIST_ENTRY(RAMPreallocJob) next;
+} RAMPreallocJob;
+
+static QLIST_HEAD(, RAMPreallocJob) ram_prealloc_jobs =
+    QLIST_HEAD_INITIALIZER(ram_prealloc_jobs);
+static QEMUBH *ram_prealloc_bh;
+static int ram_prealloc_running;
+static uint64_t ram_prealloc_total;
+static uint64_t ram_prealloc_done;
+static bool ram_prealloc_start_pending;
+
+/* Run the calling thread on the CPUs of the host nodes in @host_mask, so
+ * that zeroing the pages happens locally. */
+static void ram_prealloc_pin(unsigned long *host_mask)
+{
+#ifdef __linux__
+    cpu_set_t cpus;
+    char path[64], buf[1024], *p;
+    unsigned long first, last;
+    int node, fd, len;
+    bool any = false;
+
+    CPU_ZERO(&cpus);
+    for (node = find_first_bit(host_mask, MAX_HOST_NODES);
+         node < MAX_HOST_NODES;
+         node = find_next_bit(host_mask, MAX_HOST_NODES, node + 1)) {
+        snprintf(path, sizeof(path),
+                 "/sys/devices/system/node/node%d/cpulist", node);
+        fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            continue;
+        }
+        len = read(fd, buf, sizeof(buf) - 1);
+        close(fd);
+        if (len <= 0) {
+            continue;
+        }
+        buf[len] = 0;
+
+        /* "0-7,16-23" */
+        for (p = buf; *p >= '0' && *p <= '9'; p++) {
+            first = last = strtoul(p, &p, 10);
+            if (*p == '-') {
+                last = strtoul(p + 1, &p, 10);
+            }
+            for (; first <= last && first < CPU_SETSIZE; first++) {
+                CPU_SET(first, &cpus);
+                any = true;
+            }
+            if (*p != ',') {
+                break;
+            }
+        }
+    }
+    if (any) {
+        sched_setaffinity(0, sizeof(cpus), &cpus);
+    }
+#endif
+}
+
+static void *ram_prealloc_thread(void *opaque)
+{
+    RAMPreallocJob *job = opaque;
+    size_t off, len, i;
+
+    if (job->host_mask) {
+        ram_prealloc_pin(job->host_mask);
+    }
+
+    for (off = 0; off < job->size; off += len) {
+        len = MIN(MAX(RAM_PREALLOC_STEP, job->pagesize), job->size - off);
+        for (i = 0; i < len; i += job->pagesize) {
+            /* the guest image may be loaded concurrently; do not lose
+               its writes */
+            __sync_fetch_and_add(job->start + off + i, 0);
+        }
+        __sync_fetch_and_add(&ram_prealloc_done, len);
+    }
+
+    if (__sync_sub_and_fetch(&ram_prealloc_running, 1) == 0) {
+        qemu_bh_schedule(ram_prealloc_bh);
+    }
+    return NULL;
+}
+
+static void ram_prealloc_finish(void *opaque)
+{
+    RAMPreallocJob *job;
+
+    if (ram_prealloc_running) {
+        return;
+    }
+    while ((job = QLIST_FIRST(&ram_prealloc_jobs)) != NULL) {
+        QLIST_REMOVE(job, next);
+        qemu_thread_join(&job->thread);
+        g_free(job);
+    }
+    if (ram_prealloc_start_pending) {
+        ram_prealloc_start_pending = false;
+        vm_start();
+    }
+}
+
+static int ram_prealloc_threads(void)
+{
+    QemuOpts *machine_opts;
+    long n;
+
+    machine_opts = qemu_opts_find(qemu_find_opts("machine"), 0);
+    n = machine_opts ? qemu_opt_get_number(machine_opts, "prealloc-threads",
+                                           0) : 0;
+    if (n <= 0) {
+        n = MIN(MAX(sysconf(_SC_NPROCESSORS_ONLN), 1),
+                RAM_PREALLOC_MAX_THREADS);
+    }
+    return n;
+}
+
+/* Start @n threads touching [@start, @start + @size) */
+static void ram_prealloc_range(uint8_t *start, size_t size, size_t pagesize,
+                               int n, unsigned long *host_mask)
+{
+    RAMPreallocJob *job;
+    size_t chunk, off;
+
+    chunk = DIV_ROUND_UP(DIV_ROUND_UP(size, n), pagesize) * pagesize;
+    for (off = 0; off < size; off += chunk) {
+        job = g_malloc0(sizeof(*job));
+        job->start = start + off;
+        job->size = MIN(chunk, size - off);
+        job->pagesize = pagesize;
+        job->host_mask = host_mask;
+        QLIST_INSERT_HEAD(&ram_prealloc_jobs, job, next);
+        __sync_fetch_and_add(&ram_prealloc_running, 1);
+        qemu_thread_create(&job->thread, ram_prealloc_thread, job,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+/* Fault in every page of a RAM block.  For the main RAM each guest node
+ * gets its share of the threads, running on the host nodes it is bound to.
+ */
+static void ram_prealloc(void *host, ram_addr_t size, size_t pagesize,
+                         bool system)
+{
+    ram_addr_t mask = ~(ram_addr_t)(pagesize - 1);
+    ram_addr_t start, end = 0;
+    int i, n = ram_prealloc_threads();
+    unsigned long *host_mask;
+
+    if (!ram_prealloc_bh) {
+        ram_prealloc_bh = qemu_bh_new(ram_prealloc_finish, NULL);
+    }
+    if (!ram_prealloc_running) {
+        ram_prealloc_total = ram_prealloc_done = 0;
+    }
+    ram_prealloc_total += size;
+
+    if (!system || nb_numa_nodes == 0) {
+        ram_prealloc_range(host, size, pagesize, n, NULL);
+        return;
+    }
+
+    for (i = 0; i < nb_numa_nodes && end < size; i++) {
+        start = end;
+        end = (i == nb_numa_nodes - 1) ? size : MIN(end + node_mem[i], size);
+        end = end == size ? size : end & mask;
+        if (end <= start) {
+            end = start;
+            continue;
+        }
+        host_mask = node_host_policy[i] == NUMA_POLICY_BIND ||
+                    node_host_policy[i] == NUMA_POLICY_PREFERRED ?
+                    node_host_mask[i] : NULL;
+        ram_prealloc_range((uint8_t *)host + start, end - start, pagesize,
+                           MAX(n * (end - start) / size, 1), host_mask);
+    }
+}
+
+bool qemu_ram_prealloc_defer_start(void)
+{
+    if (!ram_prealloc_running && QLIST_EMPTY(&ram_prealloc_jobs)) {
+        return false;
+    }
+    ram_prealloc_start_pending = true;
+    return true;
+}
+
+void qemu_ram_prealloc_cancel_start(void)
+{
+    ram_prealloc_start_pending = false;
+}
+
+void qemu_ram_prealloc_status(bool *active, uint64_t *total, uint64_t *done)
+{
+    *active = ram_prealloc_running || !QLIST_EMPTY(&ram_prealloc_jobs);
+    *total = ram_prealloc_total;
+    *done = ram_prealloc_done;
+}
+
 static ram_addr_t find_ram_offset(ram_addr_t size)
 {
     RAMBlock *block, *next_block;
@@ -2493,6 +3860,31 @@ static void qemu_ram_setup_dump(void *addr, ram_addr_t size)
     }
 }
 
+/* Whether guest RAM is offered to KSM, "-machine mem-merge" */
+bool qemu_ram_mem_merge(void)
+{
+    QemuOpts *machine_opts = qemu_opts_find(qemu_find_opts("machine"), 0);
+
+    return !machine_opts ||
+           qemu_opt_get_bool(machine_opts, "mem-merge", true);
+}
+
+/* KSM and transparent huge page advice for a RAM block.  Only the RAM the
+ * guest runs from is worth huge pages; khugepaged would merely rescan the
+ * small blocks of ROMs and device memory.
+ */
+static void qemu_ram_setup_advice(void *addr, ram_addr_t size, uint32_t flags)
+{
+    if (qemu_ram_mem_merge()) {
+        qemu_madvise(addr, size, QEMU_MADV_MERGEABLE);
+    }
+    if (flags & RAM_HUGEPAGE_MASK) {
+        qemu_madvise(addr, size, QEMU_MADV_HUGEPAGE);
+    } else {
+        qemu_madvise(addr, size, QEMU_MADV_NOHUGEPAGE);
+    }
+}
+
 void qemu_ram_set_idstr(ram_addr_t addr, const char *name, DeviceState *dev)
 {
     RAMBlock *new_block, *block;
@@ -2514,38 +3906,88 @@ void qemu_ram_set_idstr(ram_addr_t addr, const char *name, DeviceState *dev)
             g_free(id);
         }
     }
-    pstrcat(new_block->idstr, sizeof(new_block->idstr), name);
+    pstrcat(new_block->idstr, sizeof(new_block->idstr), name);
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        if (block != new_block && !strcmp(block->idstr, new_block->idstr)) {
+            fprintf(stderr, "RAMBlock \"%s\" already registered, abort!\n",
+                    new_block->idstr);
+            abort();
+        }
+    }
+}
+
+void qemu_mutex_lock_ramlist(void)
+{
+    qemu_mutex_lock(&ram_list.mutex);
+}
+
+void qemu_mutex_unlock_ramlist(void)
+{
+    qemu_mutex_unlock(&ram_list.mutex);
+}
+
+void qemu_ram_foreach_block(RAMBlockIterFunc func, void *opaque)
+{
+    RAMBlock *block;
+
+    qemu_mutex_lock_ramlist();
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        func(block->idstr, block->host, block->length, opaque);
+    }
+    qemu_mutex_unlock_ramlist();
+}
+
+/* Grow the per-client dirty bitmaps; pages are counted in target pages */
+static void dirty_memory_extend(ram_addr_t old_ram_size,
+                                ram_addr_t new_ram_size)
+{
+    ram_addr_t old_longs = BITS_TO_LONGS(old_ram_size);
+    ram_addr_t new_longs = BITS_TO_LONGS(new_ram_size);
+    int i;
+
+    if (new_longs <= old_longs) {
+        return;
+    }
 
-    QLIST_FOREACH(block, &ram_list.blocks, next) {
-        if (block != new_block && !strcmp(block->idstr, new_block->idstr)) {
-            fprintf(stderr, "RAMBlock \"%s\" already registered, abort!\n",
-                    new_block->idstr);
-            abort();
-        }
+    for (i = 0; i < DIRTY_MEMORY_NUM; i++) {
+        ram_list.dirty_memory[i] =
+            g_realloc(ram_list.dirty_memory[i],
+                      new_longs * sizeof(unsigned long));
+        memset(ram_list.dirty_memory[i] + old_longs, 0,
+               (new_longs - old_longs) * sizeof(unsigned long));
     }
 }
 
-ram_addr_t qemu_ram_alloc_from_ptr(ram_addr_t size, void *host,
-                                   MemoryRegion *mr)
+static ram_addr_t ram_block_alloc(ram_addr_t size, void *host,
+                                  MemoryRegion *mr, bool system)
 {
     RAMBlock *new_block;
+    ram_addr_t old_ram_size;
+    size_t pagesize = getpagesize();
+    bool prealloc = false;
 
     size = TARGET_PAGE_ALIGN(size);
     new_block = g_malloc0(sizeof(*new_block));
 
     new_block->mr = mr;
     new_block->offset = find_ram_offset(size);
+    if (system) {
+        new_block->flags |= RAM_HUGEPAGE_MASK;
+    }
     if (host) {
         new_block->host = host;
         new_block->flags |= RAM_PREALLOC_MASK;
     } else {
         if (mem_path) {
 #if defined (__linux__) && !defined(TARGET_S390X)
-            new_block->host = file_ram_alloc(new_block, size, mem_path);
+            new_block->host = file_ram_alloc(new_block, size, mem_path,
+                                             &pagesize);
             if (!new_block->host) {
                 new_block->host = qemu_vmalloc(size);
-                qemu_madvise(new_block->host, size, QEMU_MADV_MERGEABLE);
+                qemu_ram_setup_advice(new_block->host, size, new_block->flags);
             }
+            prealloc = mem_prealloc;
 #else
             fprintf(stderr, "-mem-path option unsupported\n");
             exit(1);
@@ -2559,18 +4001,28 @@ ram_addr_t qemu_ram_alloc_from_ptr(ram_addr_t size, void *host,
             } else {
                 new_block->host = qemu_vmalloc(size);
             }
-            qemu_madvise(new_block->host, size, QEMU_MADV_MERGEABLE);
+            qemu_ram_setup_advice(new_block->host, size, new_block->flags);
+            prealloc = mem_prealloc && system;
+        }
+        if (new_block->host && system) {
+            ram_bind_host_nodes(new_block->host, size, pagesize);
+        }
+        if (new_block->host && prealloc) {
+            ram_prealloc(new_block->host, size, pagesize, system);
         }
     }
     new_block->length = size;
+    new_block->page_size = pagesize;
 
+    qemu_mutex_lock_ramlist();
+    old_ram_size = last_ram_offset() >> TARGET_PAGE_BITS;
     QLIST_INSERT_HEAD(&ram_list.blocks, new_block, next);
+    ram_list.mru_block = NULL;
+    ram_list.version++;
+    dirty_memory_extend(old_ram_size, last_ram_offset() >> TARGET_PAGE_BITS);
 
-    ram_list.phys_dirty = g_realloc(ram_list.phys_dirty,
-                                       last_ram_offset() >> TARGET_PAGE_BITS);
-    memset(ram_list.phys_dirty + (new_block->offset >> TARGET_PAGE_BITS),
-           0, size >> TARGET_PAGE_BITS);
-    cpu_physical_memory_set_dirty_range(new_block->offset, size, 0xff);
+    cpu_physical_memory_set_dirty_range(new_block->offset, size);
+    qemu_mutex_unlock_ramlist();
 
     qemu_ram_setup_dump(new_block->host, size);
 
@@ -2580,31 +4032,49 @@ ram_addr_t qemu_ram_alloc_from_ptr(ram_addr_t size, void *host,
     return new_block->offset;
 }
 
+ram_addr_t qemu_ram_alloc_from_ptr(ram_addr_t size, void *host,
+                                   MemoryRegion *mr)
+{
+    return ram_block_alloc(size, host, mr, false);
+}
+
 ram_addr_t qemu_ram_alloc(ram_addr_t size, MemoryRegion *mr)
 {
-    return qemu_ram_alloc_from_ptr(size, NULL, mr);
+    return ram_block_alloc(size, NULL, mr, false);
+}
+
+ram_addr_t qemu_ram_alloc_system(ram_addr_t size, MemoryRegion *mr)
+{
+    return ram_block_alloc(size, NULL, mr, true);
 }
 
 void qemu_ram_free_from_ptr(ram_addr_t addr)
 {
     RAMBlock *block;
 
+    qemu_mutex_lock_ramlist();
     QLIST_FOREACH(block, &ram_list.blocks, next) {
         if (addr == block->offset) {
             QLIST_REMOVE(block, next);
+            ram_list.mru_block = NULL;
+            ram_list.version++;
             g_free(block);
-            return;
+            break;
         }
     }
+    qemu_mutex_unlock_ramlist();
 }
 
 void qemu_ram_free(ram_addr_t addr)
 {
     RAMBlock *block;
 
+    qemu_mutex_lock_ramlist();
     QLIST_FOREACH(block, &ram_list.blocks, next) {
         if (addr == block->offset) {
             QLIST_REMOVE(block, next);
+            ram_list.mru_block = NULL;
+            ram_list.version++;
             if (block->flags & RAM_PREALLOC_MASK) {
                 ;
             } else if (mem_path) {
@@ -2630,10 +4100,10 @@ void qemu_ram_free(ram_addr_t addr)
 #endif
             }
             g_free(block);
-            return;
+            break;
         }
     }
-
+    qemu_mutex_unlock_ramlist();
 }
 
 #ifndef _WIN32
@@ -2689,54 +4159,148 @@ void qemu_ram_remap(ram_addr_t addr, ram_addr_t length)
                             length, addr);
                     exit(1);
                 }
-                qemu_madvise(vaddr, length, QEMU_MADV_MERGEABLE);
+                qemu_ram_setup_advice(vaddr, length, block->flags);
                 qemu_ram_setup_dump(vaddr, length);
             }
             return;
         }
     }
 }
-#endif /* !_WIN32 */
-
-/* Return a host pointer to ram allocated with qemu_ram_alloc.
-   With the exception of the softmmu code in this file, this should
-   only be used for local memory (e.g. video ram) that the device owns,
-   and knows it isn't going to access beyond the end of the block.
 
-   It should not be used for general purpose DMA.
-   Use cpu_physical_memory_map/cpu_physical_memory_rw instead.
+/* Replace the guest RAM at @addr with a private mapping of @length bytes
+ * of @fd from @offset, so that the pages come from the page cache and are
+ * only copied when the guest writes them.  Returns -1, leaving the RAM
+ * alone, if it cannot be mapped: @addr and @offset must be host page
+ * aligned and the RAM anonymous memory of a single block.
  */
-void *qemu_get_ram_ptr(ram_addr_t addr)
+int qemu_ram_map_file(ram_addr_t addr, ram_addr_t length, int fd,
+                      off_t offset)
 {
+    uintptr_t page_mask = qemu_real_host_page_size - 1;
+    ram_addr_t block_offset, map_length;
     RAMBlock *block;
+    void *area, *vaddr;
+
+    if (mem_path || xen_enabled()) {
+        return -1;
+    }
+#if defined(TARGET_S390X) && defined(CONFIG_KVM)
+    return -1;
+#endif
+    if (offset & page_mask) {
+        return -1;
+    }
+    map_length = (length + page_mask) & ~page_mask;
 
     QLIST_FOREACH(block, &ram_list.blocks, next) {
-        if (addr - block->offset < block->length) {
-            /* Move this entry to to start of the list.  */
-            if (block != QLIST_FIRST(&ram_list.blocks)) {
-                QLIST_REMOVE(block, next);
-                QLIST_INSERT_HEAD(&ram_list.blocks, block, next);
+        block_offset = addr - block->offset;
+        if (block_offset < block->length) {
+            if ((block->flags & RAM_PREALLOC_MASK) ||
+                map_length > block->length - block_offset) {
+                return -1;
             }
-            if (xen_enabled()) {
-                /* We need to check if the requested address is in the RAM
-                 * because we don't want to map the entire memory in QEMU.
-                 * In that case just map until the end of the page.
-                 */
-                if (block->offset == 0) {
-                    return xen_map_cache(addr, 0, 0);
-                } else if (block->host == NULL) {
-                    block->host =
-                        xen_map_cache(block->offset, block->length, 1);
+            vaddr = block->host + block_offset;
+            if ((uintptr_t)vaddr & page_mask) {
+                return -1;
+            }
+            area = mmap(vaddr, map_length, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_FIXED, fd, offset);
+            if (area != vaddr) {
+                /* a failed MAP_FIXED may have dropped the old pages */
+                area = mmap(vaddr, map_length, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_FIXED | MAP_ANONYMOUS, -1, 0);
+                if (area != vaddr) {
+                    fprintf(stderr, "Could not remap addr: "
+                            RAM_ADDR_FMT "@" RAM_ADDR_FMT "\n",
+                            map_length, addr);
+                    exit(1);
                 }
+                qemu_ram_setup_advice(vaddr, map_length, block->flags);
+                qemu_ram_setup_dump(vaddr, map_length);
+                return -1;
             }
-            return block->host + (addr - block->offset);
+            qemu_ram_setup_dump(vaddr, map_length);
+            /* the rest of the last page is not part of the image */
+            memset((uint8_t *)vaddr + length, 0, map_length - length);
+            return 0;
+        }
+    }
+    return -1;
+}
+#endif /* !_WIN32 */
+
+#ifdef CONFIG_LOOKUP_CACHE
+/* The block of each thread's last qemu_get_ram_ptr() */
+typedef struct RAMBlockCache {
+    uint32_t version;
+    RAMBlock *block;
+} RAMBlockCache;
+
+static DEFINE_TLS(RAMBlockCache, ram_block_cache);
+#endif
+
+static RAMBlock *qemu_get_ram_block(ram_addr_t addr)
+{
+    RAMBlock *block;
+#ifdef CONFIG_LOOKUP_CACHE
+    RAMBlockCache *c = &tls_var(ram_block_cache);
+    uint32_t version = ram_list.version;
+
+    /* ram_list.version is bumped when a block goes away, so a cached
+     * block is still there if the version matches */
+    block = c->block;
+    if (block && c->version == version &&
+        addr - block->offset < block->length) {
+        return block;
+    }
+#else
+    block = ram_list.mru_block;
+    if (block && addr - block->offset < block->length) {
+        return block;
+    }
+#endif
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        if (addr - block->offset < block->length) {
+#ifdef CONFIG_LOOKUP_CACHE
+            c->version = version;
+            c->block = block;
+#else
+            ram_list.mru_block = block;
+#endif
+            return block;
         }
     }
 
     fprintf(stderr, "Bad ram offset %" PRIx64 "\n", (uint64_t)addr);
     abort();
+}
 
-    return NULL;
+/* Return a host pointer to ram allocated with qemu_ram_alloc.
+   With the exception of the softmmu code in this file, this should
+   only be used for local memory (e.g. video ram) that the device owns,
+   and knows it isn't going to access beyond the end of the block.
+
+   It should not be used for general purpose DMA.
+   Use cpu_physical_memory_map/cpu_physical_memory_rw instead.
+ */
+void *qemu_get_ram_ptr(ram_addr_t addr)
+{
+    RAMBlock *block = qemu_get_ram_block(addr);
+
+    if (xen_enabled()) {
+        /* We need to check if the requested address is in the RAM
+         * because we don't want to map the entire memory in QEMU.
+         * In that case just map until the end of the page.
+         */
+        if (block->offset == 0) {
+            return xen_map_cache(addr, 0, 0);
+        } else if (block->host == NULL) {
+            block->host =
+                xen_map_cache(block->offset, block->length, 1);
+        }
+    }
+    return block->host + (addr - block->offset);
 }
 
 /* Return a host pointer to ram allocated with qemu_ram_alloc.
@@ -2824,6 +4388,80 @@ int qemu_ram_addr_from_host(void *ptr, ram_addr_t *ram_addr)
     return -1;
 }
 
+/* Return the file that backs the RAM at host address ptr, so that another
+ * process can map the same memory, and the offset of ptr in that file.
+ * Returns -1 if the RAM is not a shared mapping of a file.
+ */
+int qemu_ram_get_fd(void *ptr, ram_addr_t *offset)
+{
+#if defined(__linux__) && !defined(TARGET_S390X)
+    RAMBlock *block;
+    uint8_t *host = ptr;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        if (block->host == NULL) {
+            continue;
+        }
+        if (host - block->host < block->length) {
+            if (!(block->flags & RAM_SHARED_MASK)) {
+                return -1;
+            }
+            *offset = host - block->host;
+            return block->fd;
+        }
+    }
+#endif
+    return -1;
+}
+
+size_t qemu_ram_pagesize(void *ptr)
+{
+    RAMBlock *block;
+    uint8_t *host = ptr;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        if (block->host && host - block->host < block->length) {
+            return block->page_size;
+        }
+    }
+    return getpagesize();
+}
+
+/* Transparent huge page size on the hosts that have them; on others
+   qemu_madvise() fails harmlessly.  */
+#define RAM_THP_SIZE (2 * 1024 * 1024)
+
+/* The guest gave the RAM at [@ptr, @ptr + @len) back to the host with the
+ * balloon (@discarded), or took it back.  While it is in the balloon,
+ * keep khugepaged from filling the huge pages that the range covers
+ * whole, which would give the memory back to the guest's RSS.  Only
+ * whole huge pages are marked, so the VMAs stay few and merge again when
+ * the guest deflates.
+ */
+void qemu_ram_set_discarded(void *ptr, size_t len, bool discarded)
+{
+    RAMBlock *block;
+    uint8_t *host = ptr;
+    uintptr_t start, end;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        if (block->host && host - block->host < block->length) {
+            break;
+        }
+    }
+    if (!block || !(block->flags & RAM_HUGEPAGE_MASK) ||
+        block->page_size > getpagesize()) {
+        return;
+    }
+
+    start = ((uintptr_t)host + RAM_THP_SIZE - 1) & ~(uintptr_t)(RAM_THP_SIZE - 1);
+    end = ((uintptr_t)host + len) & ~(uintptr_t)(RAM_THP_SIZE - 1);
+    if (start < end) {
+        qemu_madvise((void *)start, end - start,
+                     discarded ? QEMU_MADV_NOHUGEPAGE : QEMU_MADV_HUGEPAGE);
+    }
+}
+
 /* Some of the softmmu routines need to translate from a host pointer
    (typically a TLB entry) back to a ram offset.  */
 ram_addr_t qemu_ram_addr_from_host_nofail(void *ptr)
@@ -2893,12 +4531,9 @@ static const MemoryRegionOps rom_mem_ops = {
 static void notdirty_mem_write(void *opaque, target_phys_addr_t ram_addr,
                                uint64_t val, unsigned size)
 {
-    int dirty_flags;
-    dirty_flags = cpu_physical_memory_get_dirty_flags(ram_addr);
-    if (!(dirty_flags & CODE_DIRTY_FLAG)) {
+    if (!cpu_physical_memory_get_dirty_flag(ram_addr, DIRTY_MEMORY_CODE)) {
 #if !defined(CONFIG_USER_ONLY)
         tb_invalidate_phys_page_fast(ram_addr, size);
-        dirty_flags = cpu_physical_memory_get_dirty_flags(ram_addr);
 #endif
     }
     switch (size) {
@@ -2914,11 +4549,11 @@ static void notdirty_mem_write(void *opaque, target_phys_addr_t ram_addr,
     default:
         abort();
     }
-    dirty_flags |= (0xff & ~CODE_DIRTY_FLAG);
-    cpu_physical_memory_set_dirty_flags(ram_addr, dirty_flags);
+    cpu_physical_memory_set_dirty_flag(ram_addr, DIRTY_MEMORY_MIGRATION);
+    cpu_physical_memory_set_dirty_flag(ram_addr, DIRTY_MEMORY_VGA);
     /* we remove the notdirty callback only if the code has been
        flushed */
-    if (dirty_flags == 0xff)
+    if (cpu_physical_memory_is_dirty(ram_addr))
         tlb_set_dirty(cpu_single_env, cpu_single_env->mem_io_vaddr);
 }
 
@@ -2958,6 +4593,8 @@ static void check_watchpoint(int offset, int len_mask, int flags)
                               "pc=%p", (void *)env->mem_io_pc);
                 }
                 cpu_restore_state(tb, env, env->mem_io_pc);
+                /* released by cpu_exec() after the longjmp */
+                tb_mutex_lock();
                 tb_phys_invalidate(tb, -1);
                 if (wp->flags & BP_STOP_BEFORE_ACCESS) {
                     env->exception_index = EXCP_DEBUG;
@@ -3024,7 +4661,7 @@ static uint64_t subpage_read(void *opaque, target_phys_addr_t addr,
            mmio, len, addr, idx);
 #endif
 
-    section = &phys_sections[mmio->sub_section[idx]];
+    section = &mmio->d->sections[mmio->sub_section[idx]];
     addr += mmio->base;
     addr -= section->offset_within_address_space;
     addr += section->offset_within_region;
@@ -3043,7 +4680,7 @@ static void subpage_write(void *opaque, target_phys_addr_t addr,
            __func__, mmio, len, addr, idx, value);
 #endif
 
-    section = &phys_sections[mmio->sub_section[idx]];
+    section = &mmio->d->sections[mmio->sub_section[idx]];
     addr += mmio->base;
     addr -= section->offset_within_address_space;
     addr += section->offset_within_region;
@@ -3101,10 +4738,10 @@ static int subpage_register (subpage_t *mmio, uint32_t start, uint32_t end,
     printf("%s: %p start %08x end %08x idx %08x eidx %08x mem %ld\n", __func__,
            mmio, start, end, idx, eidx, memory);
 #endif
-    if (memory_region_is_ram(phys_sections[section].mr)) {
-        MemoryRegionSection new_section = phys_sections[section];
+    if (memory_region_is_ram(mmio->d->sections[section].mr)) {
+        MemoryRegionSection new_section = mmio->d->sections[section];
         new_section.mr = &io_mem_subpage_ram;
-        section = phys_section_add(&new_section);
+        section = phys_section_add(mmio->d, &new_section);
     }
     for (; idx <= eidx; idx++) {
         mmio->sub_section[idx] = section;
@@ -3113,12 +4750,13 @@ static int subpage_register (subpage_t *mmio, uint32_t start, uint32_t end,
     return 0;
 }
 
-static subpage_t *subpage_init(target_phys_addr_t base)
+static subpage_t *subpage_init(PhysDispatch *d, target_phys_addr_t base)
 {
     subpage_t *mmio;
 
     mmio = g_malloc0(sizeof(subpage_t));
 
+    mmio->d = d;
     mmio->base = base;
     memory_region_init_io(&mmio->iomem, &subpage_ops, mmio,
                           "subpage", TARGET_PAGE_SIZE);
@@ -3132,7 +4770,7 @@ static subpage_t *subpage_init(target_phys_addr_t base)
     return mmio;
 }
 
-static uint16_t dummy_section(MemoryRegion *mr)
+static uint16_t dummy_section(PhysDispatch *d, MemoryRegion *mr)
 {
     MemoryRegionSection section = {
         .mr = mr,
@@ -3141,12 +4779,14 @@ static uint16_t dummy_section(MemoryRegion *mr)
         .size = UINT64_MAX,
     };
 
-    return phys_section_add(&section);
+    return phys_section_add(d, &section);
 }
 
+/* TLB entries are flushed with the vCPUs stopped before a new map is
+   published, so the index always refers to the current one.  */
 MemoryRegion *iotlb_to_region(target_phys_addr_t index)
 {
-    return phys_sections[index & ~TARGET_PAGE_MASK].mr;
+    return phys_section_find(index & ~TARGET_PAGE_MASK)->mr;
 }
 
 static void io_mem_init(void)
@@ -3165,25 +4805,40 @@ static void io_mem_init(void)
 
 static void core_begin(MemoryListener *listener)
 {
-    destroy_all_mappings();
-    phys_sections_clear();
-    phys_map.ptr = PHYS_MAP_NODE_NIL;
-    phys_section_unassigned = dummy_section(&io_mem_unassigned);
-    phys_section_notdirty = dummy_section(&io_mem_notdirty);
-    phys_section_rom = dummy_section(&io_mem_rom);
-    phys_section_watch = dummy_section(&io_mem_watch);
+    PhysDispatch *d = g_new0(PhysDispatch, 1);
+
+    /* readers keep using cur_dispatch until core_commit() */
+    d->phys_map.ptr = PHYS_MAP_NODE_NIL;
+    d->phys_map.is_leaf = 0;
+    phys_section_unassigned = dummy_section(d, &io_mem_unassigned);
+    phys_section_notdirty = dummy_section(d, &io_mem_notdirty);
+    phys_section_rom = dummy_section(d, &io_mem_rom);
+    phys_section_watch = dummy_section(d, &io_mem_watch);
+    d->version = ++phys_dispatch_version;
+    next_dispatch = d;
 }
 
 static void core_commit(MemoryListener *listener)
 {
+    PhysDispatch *old = cur_dispatch;
     CPUArchState *env;
 
+    /* vCPU threads fill their TLBs without the iothread lock */
+    qemu_tcg_start_exclusive();
+    atomic_rcu_set(&cur_dispatch, next_dispatch);
+    next_dispatch = NULL;
+
     /* since each CPU stores ram addresses in its TLB cache, we must
        reset the modified entries */
     /* XXX: slow ! */
     for(env = first_cpu; env != NULL; env = env->next_cpu) {
         tlb_flush(env, 1);
     }
+    qemu_tcg_end_exclusive();
+
+    if (old) {
+        call_rcu(&old->rcu, phys_dispatch_reclaim);
+    }
 }
 
 static void core_region_add(MemoryListener *listener,
@@ -3340,6 +4995,9 @@ static MemoryListener io_memory_listener = {
 
 static void memory_map_init(void)
 {
+    qemu_mutex_init(&subpage_reclaim_lock);
+    subpage_reclaim_bh = qemu_bh_new(subpage_reclaim_bh_cb, NULL);
+
     system_memory = g_malloc(sizeof(*system_memory));
     memory_region_init(system_memory, "system", INT64_MAX);
     set_system_memory_map(system_memory);
@@ -3415,6 +5073,7 @@ void cpu_physical_memory_rw(target_phys_addr_t addr, uint8_t *buf,
     target_phys_addr_t page;
     MemoryRegionSection *section;
 
+    rcu_read_lock();
     while (len > 0) {
         page = addr & TARGET_PAGE_MASK;
         l = (page + TARGET_PAGE_SIZE) - addr;
@@ -3455,8 +5114,7 @@ void cpu_physical_memory_rw(target_phys_addr_t addr, uint8_t *buf,
                     /* invalidate code */
                     tb_invalidate_phys_page_range(addr1, addr1 + l, 0);
                     /* set dirty bit */
-                    cpu_physical_memory_set_dirty_flags(
-                        addr1, (0xff & ~CODE_DIRTY_FLAG));
+                    cpu_physical_memory_set_dirty_range_nocode(addr1, l);
                 }
                 qemu_put_ram_ptr(ptr);
             }
@@ -3495,6 +5153,7 @@ void cpu_physical_memory_rw(target_phys_addr_t addr, uint8_t *buf,
         buf += l;
         addr += l;
     }
+    rcu_read_unlock();
 }
 
 /* used for ROM loading : can write in RAM and ROM */
@@ -3506,6 +5165,7 @@ void cpu_physical_memory_write_rom(target_phys_addr_t addr,
     target_phys_addr_t page;
     MemoryRegionSection *section;
 
+    rcu_read_lock();
     while (len > 0) {
         page = addr & TARGET_PAGE_MASK;
         l = (page + TARGET_PAGE_SIZE) - addr;
@@ -3529,15 +5189,73 @@ void cpu_physical_memory_write_rom(target_phys_addr_t addr,
         buf += l;
         addr += l;
     }
+    rcu_read_unlock();
 }
 
+/* Mappings of MMIO or ROM go through a bounce buffer.  Each mapping takes
+ * its own buffer from a small pool, so that requests from different devices
+ * do not have to wait for each other; the buffers are kept for reuse.
+ */
+#define BOUNCE_BUFFERS 16
+
 typedef struct {
     void *buffer;
     target_phys_addr_t addr;
     target_phys_addr_t len;
+    bool in_use;
 } BounceBuffer;
 
-static BounceBuffer bounce;
+static BounceBuffer bounce[BOUNCE_BUFFERS];
+static int bounce_in_use;
+
+static struct {
+    uint64_t direct;
+    uint64_t bounced;
+    uint64_t exhausted;
+    int max_in_use;
+} bounce_stats;
+
+static BounceBuffer *bounce_get(void)
+{
+    int i;
+
+    for (i = 0; i < BOUNCE_BUFFERS; i++) {
+        if (!bounce[i].in_use) {
+            if (!bounce[i].buffer) {
+                bounce[i].buffer = qemu_memalign(TARGET_PAGE_SIZE,
+                                                 TARGET_PAGE_SIZE);
+            }
+            bounce[i].in_use = true;
+            if (++bounce_in_use > bounce_stats.max_in_use) {
+                bounce_stats.max_in_use = bounce_in_use;
+            }
+            return &bounce[i];
+        }
+    }
+    return NULL;
+}
+
+static BounceBuffer *bounce_find(void *buffer)
+{
+    int i;
+
+    for (i = 0; i < BOUNCE_BUFFERS; i++) {
+        if (bounce[i].in_use && bounce[i].buffer == buffer) {
+            return &bounce[i];
+        }
+    }
+    return NULL;
+}
+
+void dma_bounce_info(FILE *f, fprintf_function cpu_fprintf)
+{
+    cpu_fprintf(f, "direct mappings     %" PRIu64 "\n", bounce_stats.direct);
+    cpu_fprintf(f, "bounced mappings    %" PRIu64 "\n", bounce_stats.bounced);
+    cpu_fprintf(f, "no buffer available %" PRIu64 "\n",
+                bounce_stats.exhausted);
+    cpu_fprintf(f, "buffers in use      %d/%d (max %d)\n",
+                bounce_in_use, BOUNCE_BUFFERS, bounce_stats.max_in_use);
+}
 
 typedef struct MapClient {
     void *opaque;
@@ -3597,6 +5315,7 @@ void *cpu_physical_memory_map(target_phys_addr_t addr,
     ram_addr_t rlen;
     void *ret;
 
+    rcu_read_lock();
     while (len > 0) {
         page = addr & TARGET_PAGE_MASK;
         l = (page + TARGET_PAGE_SIZE) - addr;
@@ -3605,18 +5324,26 @@ void *cpu_physical_memory_map(target_phys_addr_t addr,
         section = phys_page_find(page >> TARGET_PAGE_BITS);
 
         if (!(memory_region_is_ram(section->mr) && !section->readonly)) {
-            if (todo || bounce.buffer) {
+            BounceBuffer *b;
+
+            if (todo) {
                 break;
             }
-            bounce.buffer = qemu_memalign(TARGET_PAGE_SIZE, TARGET_PAGE_SIZE);
-            bounce.addr = addr;
-            bounce.len = l;
+            rcu_read_unlock();
+            b = bounce_get();
+            if (!b) {
+                bounce_stats.exhausted++;
+                return NULL;
+            }
+            bounce_stats.bounced++;
+            b->addr = addr;
+            b->len = l;
             if (!is_write) {
-                cpu_physical_memory_read(addr, bounce.buffer, l);
+                cpu_physical_memory_read(addr, b->buffer, l);
             }
 
             *plen = l;
-            return bounce.buffer;
+            return b->buffer;
         }
         if (!todo) {
             raddr = memory_region_get_ram_addr(section->mr)
@@ -3627,6 +5354,8 @@ void *cpu_physical_memory_map(target_phys_addr_t addr,
         addr += l;
         todo += l;
     }
+    rcu_read_unlock();
+    bounce_stats.direct++;
     rlen = todo;
     ret = qemu_ram_ptr_length(raddr, &rlen);
     *plen = rlen;
@@ -3640,7 +5369,9 @@ void *cpu_physical_memory_map(target_phys_addr_t addr,
 void cpu_physical_memory_unmap(void *buffer, target_phys_addr_t len,
                                int is_write, target_phys_addr_t access_len)
 {
-    if (buffer != bounce.buffer) {
+    BounceBuffer *b = bounce_find(buffer);
+
+    if (!b) {
         if (is_write) {
             ram_addr_t addr1 = qemu_ram_addr_from_host_nofail(buffer);
             while (access_len) {
@@ -3652,8 +5383,7 @@ void cpu_physical_memory_unmap(void *buffer, target_phys_addr_t len,
                     /* invalidate code */
                     tb_invalidate_phys_page_range(addr1, addr1 + l, 0);
                     /* set dirty bit */
-                    cpu_physical_memory_set_dirty_flags(
-                        addr1, (0xff & ~CODE_DIRTY_FLAG));
+                    cpu_physical_memory_set_dirty_range_nocode(addr1, l);
                 }
                 addr1 += l;
                 access_len -= l;
@@ -3665,13 +5395,133 @@ void cpu_physical_memory_unmap(void *buffer, target_phys_addr_t len,
         return;
     }
     if (is_write) {
-        cpu_physical_memory_write(bounce.addr, bounce.buffer, access_len);
+        cpu_physical_memory_write(b->addr, b->buffer, access_len);
     }
-    qemu_vfree(bounce.buffer);
-    bounce.buffer = NULL;
+    b->in_use = false;
+    bounce_in_use--;
     cpu_notify_map_clients();
 }
 
+/* Called with rcu_read_lock() held */
+static void phys_memory_cache_lookup(PhysMemoryCache *cache)
+{
+    target_phys_addr_t addr = cache->addr, len = cache->len;
+    MemoryRegionSection *section;
+    ram_addr_t raddr, rlen;
+    target_phys_addr_t l;
+
+    cache->host = NULL;
+    cache->version = atomic_rcu_read(&cur_dispatch)->version;
+    if (!len || xen_enabled()) {
+        return;
+    }
+
+    /* all of the range must be in RAM, with contiguous ram addresses */
+    cache->ram_addr = RAM_ADDR_MAX;
+    while (len > 0) {
+        l = MIN(len, TARGET_PAGE_ALIGN(addr + 1) - addr);
+        section = phys_page_find(addr >> TARGET_PAGE_BITS);
+        if (!memory_region_is_ram(section->mr) ||
+            (cache->is_write && section->readonly)) {
+            return;
+        }
+        raddr = memory_region_get_ram_addr(section->mr)
+            + memory_region_section_addr(section, addr);
+        if (cache->ram_addr == RAM_ADDR_MAX) {
+            cache->ram_addr = raddr;
+        } else if (raddr != cache->ram_addr + (addr - cache->addr)) {
+            return;
+        }
+        addr += l;
+        len -= l;
+    }
+
+    rlen = cache->len;
+    cache->host = qemu_ram_ptr_length(cache->ram_addr, &rlen);
+    if (rlen < cache->len) {
+        cache->host = NULL;
+    }
+}
+
+void cpu_physical_memory_map_cached(PhysMemoryCache *cache,
+                                    target_phys_addr_t addr,
+                                    target_phys_addr_t len, bool is_write)
+{
+    cache->addr = addr;
+    cache->len = len;
+    cache->is_write = is_write;
+    rcu_read_lock();
+    phys_memory_cache_lookup(cache);
+    rcu_read_unlock();
+}
+
+void cpu_physical_memory_unmap_cached(PhysMemoryCache *cache)
+{
+    cache->host = NULL;
+    cache->len = 0;
+}
+
+/* Returns the host address of @offset, or NULL for the slow path */
+static uint8_t *phys_memory_cache_ptr(PhysMemoryCache *cache,
+                                      target_phys_addr_t offset, int len)
+{
+    if (unlikely(cache->version != atomic_rcu_read(&cur_dispatch)->version)) {
+        phys_memory_cache_lookup(cache);
+    }
+    if (!cache->host || offset > cache->len || len > cache->len - offset) {
+        return NULL;
+    }
+    return cache->host + offset;
+}
+
+void cpu_physical_memory_read_cached(PhysMemoryCache *cache,
+                                     target_phys_addr_t offset,
+                                     void *buf, int len)
+{
+    uint8_t *ptr;
+
+    rcu_read_lock();
+    ptr = phys_memory_cache_ptr(cache, offset, len);
+    if (ptr) {
+        memcpy(buf, ptr, len);
+    }
+    rcu_read_unlock();
+    if (!ptr) {
+        cpu_physical_memory_read(cache->addr + offset, buf, len);
+    }
+}
+
+void cpu_physical_memory_write_cached(PhysMemoryCache *cache,
+                                      target_phys_addr_t offset,
+                                      const void *buf, int len)
+{
+    ram_addr_t addr1, end;
+    uint8_t *ptr;
+
+    rcu_read_lock();
+    ptr = cache->is_write ? phys_memory_cache_ptr(cache, offset, len) : NULL;
+    if (ptr) {
+        memcpy(ptr, buf, len);
+        addr1 = cache->ram_addr + offset;
+        end = addr1 + len;
+        while (addr1 < end) {
+            ram_addr_t l = MIN(end, TARGET_PAGE_ALIGN(addr1 + 1)) - addr1;
+
+            if (!cpu_physical_memory_is_dirty(addr1)) {
+                /* invalidate code */
+                tb_invalidate_phys_page_range(addr1, addr1 + l, 0);
+                /* set dirty bit */
+                cpu_physical_memory_set_dirty_range_nocode(addr1, l);
+            }
+            addr1 += l;
+        }
+    }
+    rcu_read_unlock();
+    if (!ptr) {
+        cpu_physical_memory_write(cache->addr + offset, buf, len);
+    }
+}
+
 /* warning: addr must be aligned */
 static inline uint32_t ldl_phys_internal(target_phys_addr_t addr,
                                          enum device_endian endian)
@@ -3680,6 +5530,7 @@ static inline uint32_t ldl_phys_internal(target_phys_addr_t addr,
     uint32_t val;
     MemoryRegionSection *section;
 
+    rcu_read_lock();
     section = phys_page_find(addr >> TARGET_PAGE_BITS);
 
     if (!(memory_region_is_ram(section->mr) ||
@@ -3713,6 +5564,7 @@ static inline uint32_t ldl_phys_internal(target_phys_addr_t addr,
             break;
         }
     }
+    rcu_read_unlock();
     return val;
 }
 
@@ -3739,6 +5591,7 @@ static inline uint64_t ldq_phys_internal(target_phys_addr_t addr,
     uint64_t val;
     MemoryRegionSection *section;
 
+    rcu_read_lock();
     section = phys_page_find(addr >> TARGET_PAGE_BITS);
 
     if (!(memory_region_is_ram(section->mr) ||
@@ -3772,6 +5625,7 @@ static inline uint64_t ldq_phys_internal(target_phys_addr_t addr,
             break;
         }
     }
+    rcu_read_unlock();
     return val;
 }
 
@@ -3806,6 +5660,7 @@ static inline uint32_t lduw_phys_internal(target_phys_addr_t addr,
     uint64_t val;
     MemoryRegionSection *section;
 
+    rcu_read_lock();
     section = phys_page_find(addr >> TARGET_PAGE_BITS);
 
     if (!(memory_region_is_ram(section->mr) ||
@@ -3839,6 +5694,7 @@ static inline uint32_t lduw_phys_internal(target_phys_addr_t addr,
             break;
         }
     }
+    rcu_read_unlock();
     return val;
 }
 
@@ -3865,12 +5721,13 @@ void stl_phys_notdirty(target_phys_addr_t addr, uint32_t val)
     uint8_t *ptr;
     MemoryRegionSection *section;
 
+    rcu_read_lock();
     section = phys_page_find(addr >> TARGET_PAGE_BITS);
 
     if (!memory_region_is_ram(section->mr) || section->readonly) {
         addr = memory_region_section_addr(section, addr);
         if (memory_region_is_ram(section->mr)) {
-            section = &phys_sections[phys_section_rom];
+            section = phys_section_find(phys_section_rom);
         }
         io_mem_write(section->mr, addr, val, 4);
     } else {
@@ -3885,11 +5742,11 @@ void stl_phys_notdirty(target_phys_addr_t addr, uint32_t val)
                 /* invalidate code */
                 tb_invalidate_phys_page_range(addr1, addr1 + 4, 0);
                 /* set dirty bit */
-                cpu_physical_memory_set_dirty_flags(
-                    addr1, (0xff & ~CODE_DIRTY_FLAG));
+                cpu_physical_memory_set_dirty_range_nocode(addr1, 4);
             }
         }
     }
+    rcu_read_unlock();
 }
 
 void stq_phys_notdirty(target_phys_addr_t addr, uint64_t val)
@@ -3897,12 +5754,13 @@ void stq_phys_notdirty(target_phys_addr_t addr, uint64_t val)
     uint8_t *ptr;
     MemoryRegionSection *section;
 
+    rcu_read_lock();
     section = phys_page_find(addr >> TARGET_PAGE_BITS);
 
     if (!memory_region_is_ram(section->mr) || section->readonly) {
         addr = memory_region_section_addr(section, addr);
         if (memory_region_is_ram(section->mr)) {
-            section = &phys_sections[phys_section_rom];
+            section = phys_section_find(phys_section_rom);
         }
 #ifdef TARGET_WORDS_BIGENDIAN
         io_mem_write(section->mr, addr, val >> 32, 4);
@@ -3917,6 +5775,7 @@ void stq_phys_notdirty(target_phys_addr_t addr, uint64_t val)
                                + memory_region_section_addr(section, addr));
         stq_p(ptr, val);
     }
+    rcu_read_unlock();
 }
 
 /* warning: addr must be aligned */
@@ -3926,12 +5785,13 @@ static inline void stl_phys_internal(target_phys_addr_t addr, uint32_t val,
     uint8_t *ptr;
     MemoryRegionSection *section;
 
+    rcu_read_lock();
     section = phys_page_find(addr >> TARGET_PAGE_BITS);
 
     if (!memory_region_is_ram(section->mr) || section->readonly) {
         addr = memory_region_section_addr(section, addr);
         if (memory_region_is_ram(section->mr)) {
-            section = &phys_sections[phys_section_rom];
+            section = phys_section_find(phys_section_rom);
         }
 #if defined(TARGET_WORDS_BIGENDIAN)
         if (endian == DEVICE_LITTLE_ENDIAN) {
@@ -3964,10 +5824,10 @@ static inline void stl_phys_internal(target_phys_addr_t addr, uint32_t val,
             /* invalidate code */
             tb_invalidate_phys_page_range(addr1, addr1 + 4, 0);
             /* set dirty bit */
-            cpu_physical_memory_set_dirty_flags(addr1,
-                (0xff & ~CODE_DIRTY_FLAG));
+            cpu_physical_memory_set_dirty_range_nocode(addr1, 4);
         }
     }
+    rcu_read_unlock();
 }
 
 void stl_phys(target_phys_addr_t addr, uint32_t val)
@@ -3999,12 +5859,13 @@ static inline void stw_phys_internal(target_phys_addr_t addr, uint32_t val,
     uint8_t *ptr;
     MemoryRegionSection *section;
 
+    rcu_read_lock();
     section = phys_page_find(addr >> TARGET_PAGE_BITS);
 
     if (!memory_region_is_ram(section->mr) || section->readonly) {
         addr = memory_region_section_addr(section, addr);
         if (memory_region_is_ram(section->mr)) {
-            section = &phys_sections[phys_section_rom];
+            section = phys_section_find(phys_section_rom);
         }
 #if defined(TARGET_WORDS_BIGENDIAN)
         if (endian == DEVICE_LITTLE_ENDIAN) {
@@ -4037,10 +5898,10 @@ static inline void stw_phys_internal(target_phys_addr_t addr, uint32_t val,
             /* invalidate code */
             tb_invalidate_phys_page_range(addr1, addr1 + 2, 0);
             /* set dirty bit */
-            cpu_physical_memory_set_dirty_flags(addr1,
-                (0xff & ~CODE_DIRTY_FLAG));
+            cpu_physical_memory_set_dirty_range_nocode(addr1, 2);
         }
     }
+    rcu_read_unlock();
 }
 
 void stw_phys(target_phys_addr_t addr, uint32_t val)
@@ -4170,41 +6031,59 @@ void cpu_io_recompile(CPUArchState *env, uintptr_t retaddr)
 
 void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
 {
-    int i, target_code_size, max_target_code_size;
+    int i, j, target_code_size, max_target_code_size;
     int direct_jmp_count, direct_jmp2_count, cross_page;
+    int nb_tbs, full_regions;
+    size_t code_size;
     TranslationBlock *tb;
+    CodeGenRegion *r;
+    CPUArchState *env;
 
     target_code_size = 0;
     max_target_code_size = 0;
     cross_page = 0;
     direct_jmp_count = 0;
     direct_jmp2_count = 0;
-    for(i = 0; i < nb_tbs; i++) {
-        tb = &tbs[i];
-        target_code_size += tb->size;
-        if (tb->size > max_target_code_size)
-            max_target_code_size = tb->size;
-        if (tb->page_addr[1] != -1)
-            cross_page++;
-        if (tb->tb_next_offset[0] != 0xffff) {
-            direct_jmp_count++;
-            if (tb->tb_next_offset[1] != 0xffff) {
-                direct_jmp2_count++;
+    full_regions = 0;
+    tb_region_usage(&code_size, &nb_tbs);
+    for (j = 0; j < code_gen_active_regions; j++) {
+        r = &code_gen_regions[j];
+        if (r != code_gen_region && r->nb_tbs) {
+            full_regions++;
+        }
+        for (i = 0; i < r->nb_tbs; i++) {
+            tb = &r->tbs[i];
+            target_code_size += tb->size;
+            if (tb->size > max_target_code_size) {
+                max_target_code_size = tb->size;
+            }
+            if (tb->page_addr[1] != -1) {
+                cross_page++;
+            }
+            if (tb->tb_next_offset[0] != 0xffff) {
+                direct_jmp_count++;
+                if (tb->tb_next_offset[1] != 0xffff) {
+                    direct_jmp2_count++;
+                }
             }
         }
     }
     /* XXX: avoid using doubles ? */
     cpu_fprintf(f, "Translation buffer state:\n");
-    cpu_fprintf(f, "gen code size       %td/%ld\n",
-                code_gen_ptr - code_gen_buffer, code_gen_buffer_max_size);
-    cpu_fprintf(f, "TB count            %d/%d\n", 
-                nb_tbs, code_gen_max_blocks);
+    cpu_fprintf(f, "gen code size       %zd/%ld (max %ld)\n",
+                code_size, code_gen_active_regions * code_gen_region_max_size,
+                code_gen_nb_regions * code_gen_region_max_size);
+    cpu_fprintf(f, "code regions        %d/%d of %ld KB (%d full)\n",
+                code_gen_active_regions, code_gen_nb_regions,
+                code_gen_region_size / 1024, full_regions);
+    cpu_fprintf(f, "TB count            %d/%d\n",
+                nb_tbs, code_gen_active_regions * code_gen_region_max_blocks);
     cpu_fprintf(f, "TB avg target size  %d max=%d bytes\n",
                 nb_tbs ? target_code_size / nb_tbs : 0,
                 max_target_code_size);
     cpu_fprintf(f, "TB avg host size    %td bytes (expansion ratio: %0.1f)\n",
-                nb_tbs ? (code_gen_ptr - code_gen_buffer) / nb_tbs : 0,
-                target_code_size ? (double) (code_gen_ptr - code_gen_buffer) / target_code_size : 0);
+                nb_tbs ? (ptrdiff_t)code_size / nb_tbs : 0,
+                target_code_size ? (double) code_size / target_code_size : 0);
     cpu_fprintf(f, "cross page TB count %d (%d%%)\n",
             cross_page,
             nb_tbs ? (cross_page * 100) / nb_tbs : 0);
@@ -4215,11 +6094,100 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
                 nb_tbs ? (direct_jmp2_count * 100) / nb_tbs : 0);
     cpu_fprintf(f, "\nStatistics:\n");
     cpu_fprintf(f, "TB flush count      %d\n", tb_flush_count);
+    cpu_fprintf(f, "region flush count  %d\n", tb_region_flush_count);
     cpu_fprintf(f, "TB invalidate count %d\n", tb_phys_invalidate_count);
+    cpu_fprintf(f, "TB hash table       %zd/%zd entries (%zd deleted), "
+                "%d resizes\n", tb_hash_used, tb_hash_capacity(),
+                tb_hash_deleted, tb_hash_resize_count);
+    cpu_fprintf(f, "TB hash lookups     %" PRIu64 " (%" PRIu64 "%% hits)\n",
+                tb_hash_lookup_count, tb_hash_lookup_count ?
+                tb_hash_hit_count * 100 / tb_hash_lookup_count : 0);
+    cpu_fprintf(f, "TB hash probes      %" PRIu64 ".%02" PRIu64
+                " buckets/lookup, max %u\n",
+                tb_hash_lookup_count ?
+                tb_hash_probe_count / tb_hash_lookup_count : 0,
+                tb_hash_lookup_count ?
+                tb_hash_probe_count * 100 / tb_hash_lookup_count % 100 : 0,
+                tb_hash_max_probes);
     cpu_fprintf(f, "TLB flush count     %d\n", tlb_flush_count);
+    cpu_fprintf(f, "TLB victim hits     %d\n", tlb_victim_hit_count);
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        cpu_fprintf(f, "TLB size (CPU %d)    %zd\n", env->cpu_index,
+                    (size_t)tlb_n_entries(env));
+    }
     tcg_dump_info(f, cpu_fprintf);
 }
 
+static int tcg_helper_calls_compare(const void *a, const void *b)
+{
+    const TCGHelperInfo *ha = *(const TCGHelperInfo **)a;
+    const TCGHelperInfo *hb = *(const TCGHelperInfo **)b;
+
+    if (*ha->exec_count != *hb->exec_count) {
+        return *ha->exec_count > *hb->exec_count ? -1 : 1;
+    }
+    return 0;
+}
+
+TcgStats *qmp_query_tcg_stats(bool has_limit, int64_t limit, Error **errp)
+{
+    TcgStats *info = g_malloc0(sizeof(*info));
+    TcgHelperCallsList **tail = &info->helpers;
+    TCGHelperInfo **helpers;
+    CPUArchState *env;
+    size_t code_size;
+    int i, n, nb_tbs, nb_helpers;
+
+    tb_region_usage(&code_size, &nb_tbs);
+    info->enabled = tcg_stats_enabled;
+    info->code_size = code_size;
+    info->code_capacity = code_gen_active_regions * code_gen_region_max_size;
+    info->tb_count = nb_tbs;
+    info->flushes = tb_flush_count;
+
+    info->translated_tbs = tcg_translation_stats.tbs;
+    info->translation_ns = tcg_translation_stats.time_ns;
+    info->guest_insns = tcg_translation_stats.guest_insns;
+    info->guest_bytes = tcg_translation_stats.guest_bytes;
+    info->host_bytes = tcg_translation_stats.host_bytes;
+
+    /* the vCPUs keep counting; slightly stale sums are fine */
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        info->tb_execs += env->tcg_stats.tb_execs;
+        info->tb_lookups += env->tcg_stats.tb_lookups;
+        info->jmp_cache_misses += env->tcg_stats.jmp_cache_misses;
+        info->hash_misses += env->tcg_stats.hash_misses;
+        info->indirect_lookups += env->tcg_stats.indirect_lookups;
+        info->chained_jumps += env->tcg_stats.chained;
+        info->tlb_slow_path += env->tcg_stats.tlb_slow_path;
+        info->tlb_misses += env->tcg_stats.tlb_misses;
+        info->tlb_io += env->tcg_stats.tlb_io;
+    }
+    info->tlb_victim_hits = tlb_victim_hit_count;
+
+    helpers = g_new(TCGHelperInfo *, tcg_ctx.nb_helpers);
+    nb_helpers = 0;
+    for (i = 0; i < tcg_ctx.nb_helpers; i++) {
+        if (tcg_ctx.helpers[i].exec_count && *tcg_ctx.helpers[i].exec_count) {
+            helpers[nb_helpers++] = &tcg_ctx.helpers[i];
+        }
+    }
+    qsort(helpers, nb_helpers, sizeof(*helpers), tcg_helper_calls_compare);
+    n = has_limit ? MIN(MAX(limit, 0), nb_helpers) : MIN(10, nb_helpers);
+    for (i = 0; i < n; i++) {
+        TcgHelperCallsList *entry = g_malloc0(sizeof(*entry));
+
+        entry->value = g_malloc0(sizeof(*entry->value));
+        entry->value->name = g_strdup(helpers[i]->name);
+        entry->value->calls = *helpers[i]->exec_count;
+        *tail = entry;
+        tail = &entry->next;
+    }
+    g_free(helpers);
+
+    return info;
+}
+
 /*
  * A helper function for the _utterly broken_ virtio device model to find out if
  * it's running on a big endian machine. Don't do this at home kids!
@@ -4240,10 +6208,13 @@ bool virtio_is_big_endian(void)
 bool cpu_physical_memory_is_io(target_phys_addr_t phys_addr)
 {
     MemoryRegionSection *section;
+    bool ret;
 
+    rcu_read_lock();
     section = phys_page_find(phys_addr >> TARGET_PAGE_BITS);
-
-    return !(memory_region_is_ram(section->mr) ||
-             memory_region_is_romd(section->mr));
+    ret = !(memory_region_is_ram(section->mr) ||
+            memory_region_is_romd(section->mr));
+    rcu_read_unlock();
+    return ret;
 }
 #endif
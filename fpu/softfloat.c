@@ -40,6 +40,9 @@ these four paragraphs for those parts of this code that are retained.
  */
 #include "config.h"
 
+#include <float.h>
+#include <math.h>
+
 #include "softfloat.h"
 
 /*----------------------------------------------------------------------------
@@ -1843,6 +1846,126 @@ static float32 subFloat32Sigs( float32 a, float32 b, flag zSign STATUS_PARAM)
 
 }
 
+/*----------------------------------------------------------------------------
+| Host FPU fast path for the basic operations.  When both operands are zero
+| or normal and the rounding mode is round-to-nearest-even, the host FPU
+| gives the same result as the code below and overflows the same way.  What
+| it does not tell cheaply is whether the result is exact: that is worked
+| out from the rounding error (TwoSum for sums, the host double for float32
+| products, quotients and roots), or else the fast path is only taken when
+| the inexact flag is raised already.  Tiny results, where the target's
+| tininess detection and flushing come in, are left to softfloat.  Each
+| helper returns 0 when softfloat has to do the operation.
+*----------------------------------------------------------------------------*/
+#if defined(FLT_EVAL_METHOD) && FLT_EVAL_METHOD == 0 && \
+    !defined(__FAST_MATH__)
+#define USE_HOST_FPU
+#endif
+
+#ifdef USE_HOST_FPU
+typedef union {
+    float32 s;
+    float h;
+} float32_host;
+
+INLINE flag float32_is_zero_or_normal(float32 a)
+{
+    return float32_is_zero(a) || ((extractFloat32Exp(a) + 1) & 0xff) > 1;
+}
+
+INLINE flag float32_host_ok(float32 a, float32 b STATUS_PARAM)
+{
+    return STATUS(float_rounding_mode) == float_round_nearest_even &&
+           float32_is_zero_or_normal(a) && float32_is_zero_or_normal(b);
+}
+
+static flag float32_host_add(float32 a, float32 b, float32 *z STATUS_PARAM)
+{
+    float32_host ua = { a }, ub = { b }, uz;
+    float bv, err;
+
+    if (!float32_host_ok(a, b STATUS_VAR)) {
+        return 0;
+    }
+    uz.h = ua.h + ub.h;
+    if (isinf(uz.h)) {
+        float_raise(float_flag_overflow | float_flag_inexact STATUS_VAR);
+    } else if (fabsf(uz.h) <= FLT_MIN && uz.h != 0) {
+        return 0;
+    } else {
+        /* TwoSum: the exact rounding error of the addition */
+        bv = uz.h - ua.h;
+        err = (ua.h - (uz.h - bv)) + (ub.h - bv);
+        if (err != 0) {
+            float_raise(float_flag_inexact STATUS_VAR);
+        }
+    }
+    *z = uz.s;
+    return 1;
+}
+
+static flag float32_host_mul(float32 a, float32 b, float32 *z STATUS_PARAM)
+{
+    float32_host ua = { a }, ub = { b }, uz;
+    double p;
+
+    if (!float32_host_ok(a, b STATUS_VAR)) {
+        return 0;
+    }
+    /* exact, 24 + 24 bits fit the double */
+    p = (double)ua.h * ub.h;
+    uz.h = p;
+    if (isinf(uz.h)) {
+        float_raise(float_flag_overflow | float_flag_inexact STATUS_VAR);
+    } else if (fabsf(uz.h) <= FLT_MIN && p != 0) {
+        return 0;
+    } else if (uz.h != p) {
+        float_raise(float_flag_inexact STATUS_VAR);
+    }
+    *z = uz.s;
+    return 1;
+}
+
+/*
+ * The double quotient and root rounded again to float are correctly
+ * rounded, as 53 >= 2 * 24 + 2; the check multiplies back exactly.
+ */
+static flag float32_host_div(float32 a, float32 b, float32 *z STATUS_PARAM)
+{
+    float32_host ua = { a }, ub = { b }, uz;
+
+    if (!float32_host_ok(a, b STATUS_VAR) || float32_is_zero(b)) {
+        return 0;
+    }
+    uz.h = (double)ua.h / ub.h;
+    if (isinf(uz.h)) {
+        float_raise(float_flag_overflow | float_flag_inexact STATUS_VAR);
+    } else if (fabsf(uz.h) <= FLT_MIN && !float32_is_zero(a)) {
+        return 0;
+    } else if ((double)uz.h * ub.h != ua.h) {
+        float_raise(float_flag_inexact STATUS_VAR);
+    }
+    *z = uz.s;
+    return 1;
+}
+
+static flag float32_host_sqrt(float32 a, float32 *z STATUS_PARAM)
+{
+    float32_host ua = { a }, uz;
+
+    if (!float32_host_ok(a, a STATUS_VAR) ||
+        (extractFloat32Sign(a) && !float32_is_zero(a))) {
+        return 0;
+    }
+    uz.h = sqrt(ua.h);
+    if ((double)uz.h * uz.h != ua.h) {
+        float_raise(float_flag_inexact STATUS_VAR);
+    }
+    *z = uz.s;
+    return 1;
+}
+#endif
+
 /*----------------------------------------------------------------------------
 | Returns the result of adding the single-precision floating-point values `a'
 | and `b'.  The operation is performed according to the IEC/IEEE Standard for
@@ -1852,6 +1975,13 @@ static float32 subFloat32Sigs( float32 a, float32 b, flag zSign STATUS_PARAM)
 float32 float32_add( float32 a, float32 b STATUS_PARAM )
 {
     flag aSign, bSign;
+#ifdef USE_HOST_FPU
+    float32 z;
+
+    if (float32_host_add(a, b, &z STATUS_VAR)) {
+        return z;
+    }
+#endif
     a = float32_squash_input_denormal(a STATUS_VAR);
     b = float32_squash_input_denormal(b STATUS_VAR);
 
@@ -1875,6 +2005,13 @@ float32 float32_add( float32 a, float32 b STATUS_PARAM )
 float32 float32_sub( float32 a, float32 b STATUS_PARAM )
 {
     flag aSign, bSign;
+#ifdef USE_HOST_FPU
+    float32 z;
+
+    if (float32_host_add(a, float32_chs(b), &z STATUS_VAR)) {
+        return z;
+    }
+#endif
     a = float32_squash_input_denormal(a STATUS_VAR);
     b = float32_squash_input_denormal(b STATUS_VAR);
 
@@ -1903,6 +2040,13 @@ float32 float32_mul( float32 a, float32 b STATUS_PARAM )
     uint64_t zSig64;
     uint32_t zSig;
 
+#ifdef USE_HOST_FPU
+    float32 z;
+
+    if (float32_host_mul(a, b, &z STATUS_VAR)) {
+        return z;
+    }
+#endif
     a = float32_squash_input_denormal(a STATUS_VAR);
     b = float32_squash_input_denormal(b STATUS_VAR);
 
@@ -1963,6 +2107,13 @@ float32 float32_div( float32 a, float32 b STATUS_PARAM )
     flag aSign, bSign, zSign;
     int_fast16_t aExp, bExp, zExp;
     uint32_t aSig, bSig, zSig;
+#ifdef USE_HOST_FPU
+    float32 z;
+
+    if (float32_host_div(a, b, &z STATUS_VAR)) {
+        return z;
+    }
+#endif
     a = float32_squash_input_denormal(a STATUS_VAR);
     b = float32_squash_input_denormal(b STATUS_VAR);
 
@@ -2336,6 +2487,13 @@ float32 float32_sqrt( float32 a STATUS_PARAM )
     int_fast16_t aExp, zExp;
     uint32_t aSig, zSig;
     uint64_t rem, term;
+#ifdef USE_HOST_FPU
+    float32 z;
+
+    if (float32_host_sqrt(a, &z STATUS_VAR)) {
+        return z;
+    }
+#endif
     a = float32_squash_input_denormal(a STATUS_VAR);
 
     aSig = extractFloat32Frac( a );
@@ -3406,6 +3564,107 @@ static float64 subFloat64Sigs( float64 a, float64 b, flag zSign STATUS_PARAM )
 
 }
 
+#ifdef USE_HOST_FPU
+/*----------------------------------------------------------------------------
+| Host FPU fast path, see float32_host_add.  There is no wider host type to
+| check products, quotients and roots against, so those only go to the host
+| once the inexact flag is raised.
+*----------------------------------------------------------------------------*/
+typedef union {
+    float64 s;
+    double h;
+} float64_host;
+
+INLINE flag float64_is_zero_or_normal(float64 a)
+{
+    return float64_is_zero(a) || ((extractFloat64Exp(a) + 1) & 0x7ff) > 1;
+}
+
+INLINE flag float64_host_ok(float64 a, float64 b STATUS_PARAM)
+{
+    return STATUS(float_rounding_mode) == float_round_nearest_even &&
+           float64_is_zero_or_normal(a) && float64_is_zero_or_normal(b);
+}
+
+INLINE flag float64_host_inexact_ok(float64 a, float64 b STATUS_PARAM)
+{
+    return (STATUS(float_exception_flags) & float_flag_inexact) &&
+           float64_host_ok(a, b STATUS_VAR);
+}
+
+static flag float64_host_add(float64 a, float64 b, float64 *z STATUS_PARAM)
+{
+    float64_host ua = { a }, ub = { b }, uz;
+    double bv, err;
+
+    if (!float64_host_ok(a, b STATUS_VAR)) {
+        return 0;
+    }
+    uz.h = ua.h + ub.h;
+    if (isinf(uz.h)) {
+        float_raise(float_flag_overflow | float_flag_inexact STATUS_VAR);
+    } else if (fabs(uz.h) <= DBL_MIN && uz.h != 0) {
+        return 0;
+    } else {
+        bv = uz.h - ua.h;
+        err = (ua.h - (uz.h - bv)) + (ub.h - bv);
+        if (err != 0) {
+            float_raise(float_flag_inexact STATUS_VAR);
+        }
+    }
+    *z = uz.s;
+    return 1;
+}
+
+static flag float64_host_mul(float64 a, float64 b, float64 *z STATUS_PARAM)
+{
+    float64_host ua = { a }, ub = { b }, uz;
+
+    if (!float64_host_inexact_ok(a, b STATUS_VAR)) {
+        return 0;
+    }
+    uz.h = ua.h * ub.h;
+    if (isinf(uz.h)) {
+        float_raise(float_flag_overflow STATUS_VAR);
+    } else if (fabs(uz.h) <= DBL_MIN &&
+               !float64_is_zero(a) && !float64_is_zero(b)) {
+        return 0;
+    }
+    *z = uz.s;
+    return 1;
+}
+
+static flag float64_host_div(float64 a, float64 b, float64 *z STATUS_PARAM)
+{
+    float64_host ua = { a }, ub = { b }, uz;
+
+    if (!float64_host_inexact_ok(a, b STATUS_VAR) || float64_is_zero(b)) {
+        return 0;
+    }
+    uz.h = ua.h / ub.h;
+    if (isinf(uz.h)) {
+        float_raise(float_flag_overflow STATUS_VAR);
+    } else if (fabs(uz.h) <= DBL_MIN && !float64_is_zero(a)) {
+        return 0;
+    }
+    *z = uz.s;
+    return 1;
+}
+
+static flag float64_host_sqrt(float64 a, float64 *z STATUS_PARAM)
+{
+    float64_host ua = { a }, uz;
+
+    if (!float64_host_inexact_ok(a, a STATUS_VAR) ||
+        (extractFloat64Sign(a) && !float64_is_zero(a))) {
+        return 0;
+    }
+    uz.h = sqrt(ua.h);
+    *z = uz.s;
+    return 1;
+}
+#endif
+
 /*----------------------------------------------------------------------------
 | Returns the result of adding the double-precision floating-point values `a'
 | and `b'.  The operation is performed according to the IEC/IEEE Standard for
@@ -3415,6 +3674,13 @@ static float64 subFloat64Sigs( float64 a, float64 b, flag zSign STATUS_PARAM )
 float64 float64_add( float64 a, float64 b STATUS_PARAM )
 {
     flag aSign, bSign;
+#ifdef USE_HOST_FPU
+    float64 z;
+
+    if (float64_host_add(a, b, &z STATUS_VAR)) {
+        return z;
+    }
+#endif
     a = float64_squash_input_denormal(a STATUS_VAR);
     b = float64_squash_input_denormal(b STATUS_VAR);
 
@@ -3438,6 +3704,13 @@ float64 float64_add( float64 a, float64 b STATUS_PARAM )
 float64 float64_sub( float64 a, float64 b STATUS_PARAM )
 {
     flag aSign, bSign;
+#ifdef USE_HOST_FPU
+    float64 z;
+
+    if (float64_host_add(a, float64_chs(b), &z STATUS_VAR)) {
+        return z;
+    }
+#endif
     a = float64_squash_input_denormal(a STATUS_VAR);
     b = float64_squash_input_denormal(b STATUS_VAR);
 
@@ -3464,6 +3737,13 @@ float64 float64_mul( float64 a, float64 b STATUS_PARAM )
     int_fast16_t aExp, bExp, zExp;
     uint64_t aSig, bSig, zSig0, zSig1;
 
+#ifdef USE_HOST_FPU
+    float64 z;
+
+    if (float64_host_mul(a, b, &z STATUS_VAR)) {
+        return z;
+    }
+#endif
     a = float64_squash_input_denormal(a STATUS_VAR);
     b = float64_squash_input_denormal(b STATUS_VAR);
 
@@ -3526,6 +3806,13 @@ float64 float64_div( float64 a, float64 b STATUS_PARAM )
     uint64_t aSig, bSig, zSig;
     uint64_t rem0, rem1;
     uint64_t term0, term1;
+#ifdef USE_HOST_FPU
+    float64 z;
+
+    if (float64_host_div(a, b, &z STATUS_VAR)) {
+        return z;
+    }
+#endif
     a = float64_squash_input_denormal(a STATUS_VAR);
     b = float64_squash_input_denormal(b STATUS_VAR);
 
@@ -3903,6 +4190,13 @@ float64 float64_sqrt( float64 a STATUS_PARAM )
     int_fast16_t aExp, zExp;
     uint64_t aSig, zSig, doubleZSig;
     uint64_t rem0, rem1, term0, term1;
+#ifdef USE_HOST_FPU
+    float64 z;
+
+    if (float64_host_sqrt(a, &z STATUS_VAR)) {
+        return z;
+    }
+#endif
     a = float64_squash_input_denormal(a STATUS_VAR);
 
     aSig = extractFloat64Frac( a );
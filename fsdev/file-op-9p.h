@@ -63,6 +63,14 @@ typedef struct extended_ops {
 #define V9FS_RDONLY                 0x00000040
 #define V9FS_PROXY_SOCK_FD          0x00000080
 #define V9FS_PROXY_SOCK_NAME        0x00000100
+/*
+ * Cache file attributes and lookups: "loose" revalidates them after
+ * a short timeout, "fscache" assumes nobody but the guest changes
+ * the export and keeps them until the guest modifies the file.
+ */
+#define V9FS_CACHE_LOOSE            0x00000200
+#define V9FS_CACHE_FSCACHE          0x00000400
+#define V9FS_CACHE_MASK             0x00000600
 
 #define V9FS_SEC_MASK               0x0000003C
 
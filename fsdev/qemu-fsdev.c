@@ -37,6 +37,8 @@ int qemu_fsdev_add(QemuOpts *opts)
     const char *fsdev_id = qemu_opts_id(opts);
     const char *fsdriver = qemu_opt_get(opts, "fsdriver");
     const char *writeout = qemu_opt_get(opts, "writeout");
+    const char *cache = qemu_opt_get(opts, "cache");
+    int cache_flags = 0;
     bool ro = qemu_opt_get_bool(opts, "readonly", 0);
 
     if (!fsdev_id) {
@@ -60,6 +62,17 @@ int qemu_fsdev_add(QemuOpts *opts)
         return -1;
     }
 
+    if (cache) {
+        if (!strcmp(cache, "loose")) {
+            cache_flags = V9FS_CACHE_LOOSE;
+        } else if (!strcmp(cache, "fscache")) {
+            cache_flags = V9FS_CACHE_FSCACHE;
+        } else if (strcmp(cache, "none")) {
+            fprintf(stderr, "fsdev: invalid cache mode %s\n", cache);
+            return -1;
+        }
+    }
+
     fsle = g_malloc0(sizeof(*fsle));
     fsle->fse.fsdev_id = g_strdup(fsdev_id);
     fsle->fse.ops = FsDrivers[i].ops;
@@ -68,6 +81,7 @@ int qemu_fsdev_add(QemuOpts *opts)
             fsle->fse.export_flags |= V9FS_IMMEDIATE_WRITEOUT;
         }
     }
+    fsle->fse.export_flags |= cache_flags;
     if (ro) {
         fsle->fse.export_flags |= V9FS_RDONLY;
     } else {
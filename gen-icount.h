@@ -5,10 +5,25 @@
 static TCGArg *icount_arg;
 static int icount_label;
 
+/* Count the execution of the TB in env->tcg_stats */
+static inline void gen_tb_exec_count(void)
+{
+    TCGv_i64 n = tcg_temp_new_i64();
+
+    tcg_gen_ld_i64(n, cpu_env, offsetof(CPUArchState, tcg_stats.tb_execs));
+    tcg_gen_addi_i64(n, n, 1);
+    tcg_gen_st_i64(n, cpu_env, offsetof(CPUArchState, tcg_stats.tb_execs));
+    tcg_temp_free_i64(n);
+}
+
 static inline void gen_icount_start(void)
 {
     TCGv_i32 count;
 
+    /* every target calls this at the start of a TB */
+    if (unlikely(tcg_stats_enabled)) {
+        gen_tb_exec_count();
+    }
     if (!use_icount)
         return;
 
@@ -33,6 +48,31 @@ static void gen_icount_end(TranslationBlock *tb, int num_insns)
     }
 }
 
+/* End the TB for an indirect branch: jump straight to the TB for the
+   new CPU state if tb_jmp_cache has it, else return to cpu_exec().  The
+   PC must already be stored in env.  */
+static inline void gen_lookup_and_goto_ptr(void)
+{
+    TCGv_ptr ptr, fn;
+    TCGArg args[1];
+    int sizemask = 0;
+
+    if (!TCG_TARGET_HAS_goto_ptr) {
+        tcg_gen_exit_tb(0);
+        return;
+    }
+    sizemask |= tcg_gen_sizemask(0, TCG_TARGET_REG_BITS == 64, 0);
+    sizemask |= tcg_gen_sizemask(1, TCG_TARGET_REG_BITS == 64, 0);
+    ptr = tcg_temp_new_ptr();
+    fn = tcg_const_ptr(helper_lookup_tb_ptr);
+    args[0] = GET_TCGV_PTR(cpu_env);
+    tcg_gen_callN(&tcg_ctx, fn, TCG_CALL_PURE, sizemask,
+                  GET_TCGV_PTR(ptr), 1, args);
+    tcg_temp_free_ptr(fn);
+    tcg_gen_goto_ptr(ptr);
+    tcg_temp_free_ptr(ptr);
+}
+
 static inline void gen_io_start(void)
 {
     TCGv_i32 tmp = tcg_const_i32(1);
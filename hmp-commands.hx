@@ -109,6 +109,21 @@ STEXI
 @item block_job_cancel
 @findex block_job_cancel
 Stop an active block streaming operation.
+ETEXI
+
+    {
+        .name       = "block_job_complete",
+        .args_type  = "device:B",
+        .params     = "device",
+        .help       = "complete an active background block operation",
+        .mhandler.cmd = hmp_block_job_complete,
+    },
+
+STEXI
+@item block_job_complete
+@findex block_job_complete
+Manually trigger completion of an active background block operation.
+For mirroring, this will switch the device to the destination path.
 ETEXI
 
     {
@@ -264,19 +279,42 @@ ETEXI
 
     {
         .name       = "savevm",
-        .args_type  = "name:s?",
-        .params     = "[tag|id]",
-        .help       = "save a VM snapshot. If no tag or id are provided, a new snapshot is created",
+        .args_type  = "live:-l,name:s?",
+        .params     = "[-l] [tag|id]",
+        .help       = "save a VM snapshot. If no tag or id are provided, a new snapshot is created"
+                      "\n\t\t\t -l to save the VM state while the guest runs",
         .mhandler.cmd = do_savevm,
     },
 
 STEXI
-@item savevm [@var{tag}|@var{id}]
+@item savevm [-l] [@var{tag}|@var{id}]
 @findex savevm
 Create a snapshot of the whole virtual machine. If @var{tag} is
 provided, it is used as human readable identifier. If there is already
 a snapshot with the same tag or ID, it is replaced. More info at
 @ref{vm_snapshots}.
+
+With @option{-l}, the command returns at once and the VM state is saved
+in the background while the guest keeps running, the way it is sent
+during live migration.  The guest is only stopped to save what changed
+during the copy and to create the disk snapshots, so the snapshot shows
+the guest at the time the copy finishes.  Other snapshot commands and
+migration are refused until then.
+ETEXI
+
+    {
+        .name       = "savevm_cancel",
+        .args_type  = "",
+        .params     = "",
+        .help       = "cancel the live snapshot being saved",
+        .mhandler.cmd = do_savevm_cancel,
+    },
+
+STEXI
+@item savevm_cancel
+@findex savevm_cancel
+Cancel the live snapshot started by @code{savevm -l}.  No snapshot is
+created.
 ETEXI
 
     {
@@ -630,6 +668,36 @@ STEXI
 @findex device_del
 
 Remove device @var{id}.
+ETEXI
+
+    {
+        .name       = "cpu_add",
+        .args_type  = "id:i",
+        .params     = "id",
+        .help       = "plug a CPU reserved with -smp maxcpus",
+        .mhandler.cmd = hmp_cpu_add,
+    },
+
+STEXI
+@item cpu_add @var{id}
+@findex cpu_add
+
+Plug CPU @var{id}, which must be below the -smp maxcpus count.
+ETEXI
+
+    {
+        .name       = "cpu_del",
+        .args_type  = "id:i",
+        .params     = "id",
+        .help       = "ask the guest to give up a CPU",
+        .mhandler.cmd = hmp_cpu_del,
+    },
+
+STEXI
+@item cpu_del @var{id}
+@findex cpu_del
+
+Ask the guest to take CPU @var{id} offline; the CPU is unplugged once it has.
 ETEXI
 
     {
@@ -892,6 +960,20 @@ STEXI
 @item migrate_set_capability @var{capability} @var{state}
 @findex migrate_set_capability
 Enable/Disable the usage of a capability @var{capability} for migration.
+ETEXI
+
+    {
+        .name       = "migrate_set_parameter",
+        .args_type  = "parameter:s,value:i",
+        .params     = "parameter value",
+        .help       = "Set the parameter for migration",
+        .mhandler.cmd = hmp_migrate_set_parameter,
+    },
+
+STEXI
+@item migrate_set_parameter @var{parameter} @var{value}
+@findex migrate_set_parameter
+Set the parameter @var{parameter} for migration.
 ETEXI
 
     {
@@ -915,9 +997,12 @@ ETEXI
 #if defined(CONFIG_HAVE_CORE_DUMP)
     {
         .name       = "dump-guest-memory",
-        .args_type  = "paging:-p,protocol:s,begin:i?,length:i?",
-        .params     = "[-p] protocol [begin] [length]",
+        .args_type  = "paging:-p,detach:-d,zlib:-z,protocol:s,begin:i?,"
+                      "length:i?",
+        .params     = "[-p] [-d] [-z] protocol [begin] [length]",
         .help       = "dump guest memory to file"
+                      "\n\t\t\t -d: return at once, see info dump"
+                      "\n\t\t\t -z: kdump-compressed format, with zlib"
                       "\n\t\t\t begin(optional): the starting physical address"
                       "\n\t\t\t length(optional): the memory size, in bytes",
         .user_print = monitor_user_noop,
@@ -926,13 +1011,18 @@ ETEXI
 
 
 STEXI
-@item dump-guest-memory [-p] @var{protocol} @var{begin} @var{length}
+@item dump-guest-memory [-p] [-d] [-z] @var{protocol} @var{begin} @var{length}
 @findex dump-guest-memory
 Dump guest memory to @var{protocol}. The file can be processed with crash or
 gdb.
   protocol: destination file(started with "file:") or destination file
             descriptor (started with "fd:")
     paging: do paging to get guest's memory mapping
+        -d: write the dump in the background; the guest stays stopped
+            until it is done, see @code{info dump}
+        -z: write a kdump-compressed file instead of an ELF core; it needs
+            a seekable file and cannot be combined with paging, begin or
+            length
      begin: the starting physical address. It's optional, and should be
             specified with length together.
     length: the memory size, in bytes. It's optional, and should be specified
@@ -960,6 +1050,28 @@ STEXI
 @item snapshot_blkdev
 @findex snapshot_blkdev
 Snapshot device, using snapshot file as target if provided
+ETEXI
+
+    {
+        .name       = "drive_mirror",
+        .args_type  = "reuse:-n,full:-f,device:B,target:s,format:s?",
+        .params     = "[-n] [-f] device target [format]",
+        .help       = "initiates live storage\n\t\t\t"
+                      "migration for a device. The device's contents are\n\t\t\t"
+                      "copied to the new image file, including data that\n\t\t\t"
+                      "is written after the command is started.\n\t\t\t"
+                      "The -n flag requests QEMU to reuse the image found\n\t\t\t"
+                      "in new-image-file, instead of recreating it from scratch.\n\t\t\t"
+                      "The -f flag requests QEMU to copy the whole disk,\n\t\t\t"
+                      "so that the result does not need a backing file.",
+        .mhandler.cmd = hmp_drive_mirror,
+    },
+
+STEXI
+@item drive_mirror
+@findex drive_mirror
+Start mirroring a block device's writes to a new destination,
+using the specified target.
 ETEXI
 
     {
@@ -1319,6 +1431,39 @@ ETEXI
         .mhandler.cmd = hmp_block_set_io_throttle,
     },
 
+STEXI
+@item block_latency_histogram_set @var{device} [@var{boundaries}]
+@findex block_latency_histogram_set
+Collect latency histograms of the requests of block device @var{device} and of
+the layers below it.  @var{boundaries} is a comma-separated list of increasing
+latencies in nanoseconds; without it the histograms are disabled.  The
+histograms are shown by @code{info blockstats}.
+ETEXI
+
+    {
+        .name       = "block_latency_histogram_set",
+        .args_type  = "device:B,boundaries:s?",
+        .params     = "device [boundaries]",
+        .help       = "set the latency histogram boundaries of a block device",
+        .mhandler.cmd = hmp_block_latency_histogram_set,
+    },
+
+STEXI
+@item lock_stats on|off
+@findex lock_stats
+Start or stop collecting contention statistics of the global mutex and of the
+coroutine locks of image formats.  Starting resets the statistics; they are
+shown by @code{info lock-stats}.
+ETEXI
+
+    {
+        .name       = "lock_stats",
+        .args_type  = "enable:b",
+        .params     = "on|off",
+        .help       = "start or stop collecting lock contention statistics",
+        .mhandler.cmd = hmp_lock_stats,
+    },
+
 STEXI
 @item block_passwd @var{device} @var{password}
 @findex block_passwd
@@ -1417,12 +1562,36 @@ show emulated PCI device info
 show virtual to physical memory mappings (i386, SH4, SPARC, PPC, and Xtensa only)
 @item info mem
 show the active virtual memory mappings (i386 only)
+@item info io-exits
+show how many accesses each mapped I/O region received, and how many of
+them were coalesced
 @item info jit
-show dynamic compiler info
+show dynamic compiler info, including translated code buffer occupancy
+and flush counts
+@item info dma-bounce
+show how many DMA mappings went directly to guest RAM, how many needed a
+bounce buffer, and how often no bounce buffer was free
 @item info numa
 show NUMA information
 @item info kvm
 show KVM information
+@item info kvm-exits
+show per-vCPU KVM exit counters and the most frequently sampled I/O addresses
+@item info guest-samples
+show the guest PCs and symbols most often seen by the TCG sampler, per vCPU
+@item info tcg-stats
+show TCG translation and execution statistics and the most called helpers;
+most of them need -tcg-stats
+@item info lock-stats
+show contention statistics of the global mutex and of the coroutine locks
+of image formats, collected after @code{lock_stats on}
+@item info xen-mapcache
+show the hit rate and the size of the Xen map cache
+@item info memory-usage
+show the memory allocated by virtio devices, qcow2 caches, VNC, the XBZRLE
+cache and TCG outside of guest RAM, per subsystem and per device
+@item info dump
+show the progress of the running or last guest memory dump
 @item info usb
 show USB devices plugged on the virtual USB hub
 @item info usbhost
@@ -1455,8 +1624,14 @@ show migration status
 show current migration capabilities
 @item info migrate_cache_size
 show current migration XBZRLE cache size
+@item info migrate_parameters
+show current migration parameters
 @item info balloon
 show balloon information
+@item info mem-prealloc
+show guest RAM preallocation progress
+@item info memory_sharing
+show how guest RAM is shared and backed on the host
 @item info qtree
 show device tree
 @item info qdm
@@ -67,6 +67,257 @@ void hmp_info_kvm(Monitor *mon)
     qapi_free_KvmInfo(info);
 }
 
+void hmp_info_mem_prealloc(Monitor *mon)
+{
+    MemPreallocInfo *info;
+
+    info = qmp_query_mem_prealloc(NULL);
+    monitor_printf(mon, "preallocation: %s\n",
+                   info->active ? "active" : "inactive");
+    monitor_printf(mon, "allocated: %" PRId64 " of %" PRId64 " MB\n",
+                   info->done >> 20, info->total >> 20);
+
+    qapi_free_MemPreallocInfo(info);
+}
+
+void hmp_info_memory_sharing(Monitor *mon)
+{
+    MemorySharingInfo *info;
+    Error *err = NULL;
+
+    info = qmp_query_memory_sharing(&err);
+    if (err) {
+        monitor_printf(mon, "%s\n", error_get_pretty(err));
+        error_free(err);
+        return;
+    }
+
+    monitor_printf(mon, "memory merge: %s\n", info->merge ? "on" : "off");
+    monitor_printf(mon, "resident: %" PRId64 " kB\n", info->rss >> 10);
+    monitor_printf(mon, "shared: %" PRId64 " kB\n", info->shared >> 10);
+    if (info->has_ksm) {
+        monitor_printf(mon, "ksm: %" PRId64 " kB\n", info->ksm >> 10);
+    }
+    monitor_printf(mon, "huge pages: %" PRId64 " kB\n",
+                   info->anon_huge >> 10);
+    monitor_printf(mon, "swap: %" PRId64 " kB\n", info->swap >> 10);
+
+    qapi_free_MemorySharingInfo(info);
+}
+
+void hmp_info_kvm_exits(Monitor *mon)
+{
+    KvmExitInfo *info;
+    KvmVcpuExitsList *cpu;
+    KvmExitCountList *count;
+    KvmHotAddressList *hot;
+
+    info = qmp_query_kvm_exits(false, 0, NULL);
+    for (cpu = info->vcpus; cpu; cpu = cpu->next) {
+        monitor_printf(mon, "CPU #%" PRId64 ": %" PRId64 " exits, %" PRId64
+                       " signals\n", cpu->value->cpu, cpu->value->total,
+                       cpu->value->signals);
+        for (count = cpu->value->exits; count; count = count->next) {
+            monitor_printf(mon, "    %-16s %" PRId64 "\n",
+                           count->value->reason, count->value->count);
+        }
+    }
+    if (info->hot) {
+        monitor_printf(mon, "hot addresses (1 in %" PRId64 " I/O exits):\n",
+                       info->sample_interval);
+    }
+    for (hot = info->hot; hot; hot = hot->next) {
+        monitor_printf(mon, "    %s 0x%" PRIx64 " %-20s %" PRId64 "\n",
+                       KvmIoSpace_lookup[hot->value->space], hot->value->addr,
+                       hot->value->region, hot->value->samples);
+    }
+
+    qapi_free_KvmExitInfo(info);
+}
+
+void hmp_info_guest_samples(Monitor *mon)
+{
+    GuestSampleInfo *info;
+    VcpuGuestSamplesList *cpu;
+    GuestPcSampleList *hot;
+
+    info = qmp_query_guest_samples(false, 0, NULL);
+    if (!info->rate) {
+        monitor_printf(mon, "TCG sampler not running\n");
+    }
+    for (cpu = info->vcpus; cpu; cpu = cpu->next) {
+        monitor_printf(mon, "CPU #%" PRId64 ": %" PRId64 " samples, %" PRId64
+                       " dropped\n", cpu->value->cpu, cpu->value->total,
+                       cpu->value->dropped);
+        for (hot = cpu->value->hot; hot; hot = hot->next) {
+            monitor_printf(mon, "    0x%016" PRIx64 " %-24s %" PRId64 "\n",
+                           hot->value->pc, hot->value->symbol,
+                           hot->value->samples);
+        }
+    }
+
+    qapi_free_GuestSampleInfo(info);
+}
+
+static double hmp_percent(int64_t part, int64_t total)
+{
+    return total ? part * 100.0 / total : 0;
+}
+
+void hmp_info_tcg_stats(Monitor *mon)
+{
+    TcgStats *info;
+    TcgHelperCallsList *h;
+
+    info = qmp_query_tcg_stats(false, 0, NULL);
+    monitor_printf(mon, "code buffer: %" PRId64 "/%" PRId64 " bytes, %"
+                   PRId64 " TBs, %" PRId64 " flushes\n", info->code_size,
+                   info->code_capacity, info->tb_count, info->flushes);
+    if (!info->enabled) {
+        monitor_printf(mon, "start QEMU with -tcg-stats for more\n");
+        qapi_free_TcgStats(info);
+        return;
+    }
+
+    monitor_printf(mon, "translated: %" PRId64 " TBs, %.0f ns/TB, "
+                   "%.1f guest insns/TB, %.1f host bytes/guest byte\n",
+                   info->translated_tbs,
+                   info->translated_tbs ?
+                   (double)info->translation_ns / info->translated_tbs : 0,
+                   info->translated_tbs ?
+                   (double)info->guest_insns / info->translated_tbs : 0,
+                   info->guest_bytes ?
+                   (double)info->host_bytes / info->guest_bytes : 0);
+    monitor_printf(mon, "executed: %" PRId64 " TBs, %.1f%% from the loop, "
+                   "%.1f%% through indirect lookups, %.1f%% chained\n",
+                   info->tb_execs,
+                   hmp_percent(info->tb_lookups, info->tb_execs),
+                   hmp_percent(info->indirect_lookups, info->tb_execs),
+                   info->tb_execs ? 100 - hmp_percent(info->tb_lookups +
+                                                      info->indirect_lookups,
+                                                      info->tb_execs) : 0);
+    monitor_printf(mon, "lookups: %" PRId64 ", %.1f%% missed the jump cache, "
+                   "%.1f%% translated\n", info->tb_lookups,
+                   hmp_percent(info->jmp_cache_misses, info->tb_lookups),
+                   hmp_percent(info->hash_misses, info->tb_lookups));
+    monitor_printf(mon, "chained jumps: %" PRId64 "\n", info->chained_jumps);
+    monitor_printf(mon, "TLB: %" PRId64 " slow path accesses, %" PRId64
+                   " misses (%" PRId64 " victim hits), %" PRId64 " MMIO\n",
+                   info->tlb_slow_path, info->tlb_misses,
+                   info->tlb_victim_hits, info->tlb_io);
+    for (h = info->helpers; h; h = h->next) {
+        monitor_printf(mon, "    %-24s %" PRId64 "\n",
+                       h->value->name, h->value->calls);
+    }
+
+    qapi_free_TcgStats(info);
+}
+
+static void print_lock_histogram(Monitor *mon, const char *name,
+                                 LockStatsBinList *bins)
+{
+    monitor_printf(mon, "    %s_ns:", name);
+    for (; bins; bins = bins->next) {
+        if (bins->value->has_high) {
+            monitor_printf(mon, " [%" PRId64 ",%" PRId64 ")=%" PRId64,
+                           bins->value->low, bins->value->high,
+                           bins->value->count);
+        } else {
+            monitor_printf(mon, " [%" PRId64 ",inf)=%" PRId64,
+                           bins->value->low, bins->value->count);
+        }
+    }
+    monitor_printf(mon, "\n");
+}
+
+void hmp_info_xen_mapcache(Monitor *mon)
+{
+    XenMapCacheInfo *info;
+    Error *err = NULL;
+
+    info = qmp_query_xen_mapcache(&err);
+    if (err) {
+        monitor_printf(mon, "%s\n", error_get_pretty(err));
+        error_free(err);
+        return;
+    }
+
+    monitor_printf(mon, "hits: %" PRId64 " (%.1f%%)\n", info->hits,
+                   hmp_percent(info->hits, info->hits + info->misses));
+    monitor_printf(mon, "misses: %" PRId64 "\n", info->misses);
+    monitor_printf(mon, "evictions: %" PRId64 "\n", info->evictions);
+    monitor_printf(mon, "size: %" PRId64 " MB of %" PRId64 " MB\n",
+                   info->size >> 20, info->max_size >> 20);
+    monitor_printf(mon, "locked: %" PRId64 "\n", info->locked);
+
+    qapi_free_XenMapCacheInfo(info);
+}
+
+void hmp_info_lock_stats(Monitor *mon)
+{
+    LockStatsInfo *info;
+    LockStatsList *l;
+    LockCallerInfoList *c;
+
+    info = qmp_query_lock_stats(NULL);
+    if (!info->enabled) {
+        monitor_printf(mon, "lock statistics are off, "
+                       "enable them with lock_stats on\n");
+    }
+    for (l = info->locks; l; l = l->next) {
+        LockStats *ls = l->value;
+
+        monitor_printf(mon, "%s: %" PRId64 " acquisitions, %.1f%% contended, "
+                       "%.0f ns average wait, %.0f ns average hold\n",
+                       ls->name, ls->acquisitions,
+                       hmp_percent(ls->contended, ls->acquisitions),
+                       ls->acquisitions ?
+                       (double)ls->wait_ns / ls->acquisitions : 0,
+                       ls->acquisitions ?
+                       (double)ls->hold_ns / ls->acquisitions : 0);
+        if (!ls->acquisitions) {
+            continue;
+        }
+        print_lock_histogram(mon, "wait", ls->wait_histogram);
+        print_lock_histogram(mon, "hold", ls->hold_histogram);
+        for (c = ls->callers; c; c = c->next) {
+            monitor_printf(mon, "    caller %#" PRIx64 ": %" PRId64
+                           " acquisitions, %" PRId64 " contended, %" PRId64
+                           " ns waited\n", c->value->caller,
+                           c->value->acquisitions, c->value->contended,
+                           c->value->wait_ns);
+        }
+    }
+
+    qapi_free_LockStatsInfo(info);
+}
+
+void hmp_info_memory_usage(Monitor *mon)
+{
+    MemoryUsageInfo *info;
+    MemorySubsystemUsageList *sub;
+    MemoryAccountUsageList *acct;
+
+    info = qmp_query_memory_usage(NULL);
+    monitor_printf(mon, "total: %" PRId64 " kB\n", info->total >> 10);
+    for (sub = info->subsystems; sub; sub = sub->next) {
+        monitor_printf(mon, "%s: %" PRId64 " kB\n",
+                       sub->value->subsystem, sub->value->bytes >> 10);
+        for (acct = info->accounts; acct; acct = acct->next) {
+            MemoryAccountUsage *a = acct->value;
+
+            if (!a->has_owner || strcmp(a->subsystem, sub->value->subsystem)) {
+                continue;
+            }
+            monitor_printf(mon, "    %s: %" PRId64 " kB, peak %" PRId64
+                           " kB, %" PRId64 " allocations\n", a->owner,
+                           a->bytes >> 10, a->peak >> 10, a->allocations);
+        }
+    }
+
+    qapi_free_MemoryUsageInfo(info);
+}
+
 void hmp_info_status(Monitor *mon)
 {
     StatusInfo *info;
@@ -128,6 +379,50 @@ void hmp_info_mice(Monitor *mon)
     qapi_free_MouseInfoList(mice_list);
 }
 
+#define HMP_MIGRATE_SLOWEST_DEVICES 5
+
+static int64_t device_stats_time(MigrationDeviceStats *dev)
+{
+    return MAX(dev->has_save_time ? dev->save_time : 0,
+               dev->has_load_time ? dev->load_time : 0);
+}
+
+/* Only the slowest few; query-migrate has them all */
+static void hmp_info_migrate_devices(Monitor *mon,
+                                     MigrationDeviceStatsList *devices)
+{
+    MigrationDeviceStats *slowest[HMP_MIGRATE_SLOWEST_DEVICES];
+    MigrationDeviceStatsList *dev;
+    int i, n = 0;
+
+    for (dev = devices; dev; dev = dev->next) {
+        int64_t t = device_stats_time(dev->value);
+
+        for (i = n; i > 0 && device_stats_time(slowest[i - 1]) < t; i--) {
+            if (i < HMP_MIGRATE_SLOWEST_DEVICES) {
+                slowest[i] = slowest[i - 1];
+            }
+        }
+        if (i < HMP_MIGRATE_SLOWEST_DEVICES) {
+            slowest[i] = dev->value;
+            n = MIN(n + 1, HMP_MIGRATE_SLOWEST_DEVICES);
+        }
+    }
+
+    monitor_printf(mon, "slowest device states:\n");
+    for (i = 0; i < n; i++) {
+        monitor_printf(mon, "  %s.%" PRId64 ":", slowest[i]->id,
+                       slowest[i]->instance_id);
+        if (slowest[i]->has_save_time) {
+            monitor_printf(mon, " save %" PRId64 " us", slowest[i]->save_time);
+        }
+        if (slowest[i]->has_load_time) {
+            monitor_printf(mon, " load %" PRId64 " us", slowest[i]->load_time);
+        }
+        monitor_printf(mon, "\n");
+    }
+}
+
 void hmp_info_migrate(Monitor *mon)
 {
     MigrationInfo *info;
@@ -151,6 +446,10 @@ void hmp_info_migrate(Monitor *mon)
         monitor_printf(mon, "Migration status: %s\n", info->status);
         monitor_printf(mon, "total time: %" PRIu64 " milliseconds\n",
                        info->total_time);
+        if (info->has_downtime) {
+            monitor_printf(mon, "downtime: %" PRIu64 " milliseconds\n",
+                           info->downtime);
+        }
     }
 
     if (info->has_ram) {
@@ -166,6 +465,8 @@ void hmp_info_migrate(Monitor *mon)
                        info->ram->normal);
         monitor_printf(mon, "normal bytes: %" PRIu64 " kbytes\n",
                        info->ram->normal_bytes >> 10);
+        monitor_printf(mon, "dirty sync count: %" PRIu64 "\n",
+                       info->ram->dirty_sync_count);
     }
 
     if (info->has_disk) {
@@ -184,12 +485,37 @@ void hmp_info_migrate(Monitor *mon)
                        info->xbzrle_cache->bytes >> 10);
         monitor_printf(mon, "xbzrle pages: %" PRIu64 " pages\n",
                        info->xbzrle_cache->pages);
+        monitor_printf(mon, "xbzrle cache hit: %" PRIu64 "\n",
+                       info->xbzrle_cache->cache_hit);
         monitor_printf(mon, "xbzrle cache miss: %" PRIu64 "\n",
                        info->xbzrle_cache->cache_miss);
         monitor_printf(mon, "xbzrle overflow : %" PRIu64 "\n",
                        info->xbzrle_cache->overflow);
     }
 
+    if (info->has_compression) {
+        monitor_printf(mon, "compression pages: %" PRIu64 " pages\n",
+                       info->compression->pages);
+        monitor_printf(mon, "compressed size: %" PRIu64 " kbytes\n",
+                       info->compression->compressed_size >> 10);
+    }
+
+    if (info->has_dedup) {
+        monitor_printf(mon, "dedup pages: %" PRIu64 " pages\n",
+                       info->dedup->pages);
+        monitor_printf(mon, "dedup resent: %" PRIu64 " pages\n",
+                       info->dedup->resent);
+    }
+
+    if (info->has_cpu_throttle_percentage) {
+        monitor_printf(mon, "cpu throttle percentage: %" PRIu64 "\n",
+                       info->cpu_throttle_percentage);
+    }
+
+    if (info->has_devices) {
+        hmp_info_migrate_devices(mon, info->devices);
+    }
+
     qapi_free_MigrationInfo(info);
     qapi_free_MigrationCapabilityStatusList(caps);
 }
@@ -219,6 +545,25 @@ void hmp_info_migrate_cache_size(Monitor *mon)
                    qmp_query_migrate_cache_size(NULL) >> 10);
 }
 
+void hmp_info_migrate_parameters(Monitor *mon)
+{
+    MigrationParameters *params;
+
+    params = qmp_query_migrate_parameters(NULL);
+
+    monitor_printf(mon, "parameters: compress-level: %" PRId64
+                   " compress-threads: %" PRId64
+                   " decompress-threads: %" PRId64
+                   " max-precopy-passes: %" PRId64
+                   " channels: %" PRId64
+                   " block-inflight: %" PRId64 "\n",
+                   params->compress_level, params->compress_threads,
+                   params->decompress_threads, params->max_precopy_passes,
+                   params->channels, params->block_inflight);
+
+    qapi_free_MigrationParameters(params);
+}
+
 void hmp_info_cpus(Monitor *mon)
 {
     CpuInfoList *cpu_list, *cpu;
@@ -302,6 +647,14 @@ void hmp_info_block(Monitor *mon)
                             info->value->inserted->iops,
                             info->value->inserted->iops_rd,
                             info->value->inserted->iops_wr);
+            if (info->value->inserted->has_iops_size) {
+                monitor_printf(mon, " iops_size=%" PRId64,
+                               info->value->inserted->iops_size);
+            }
+            if (info->value->inserted->has_group) {
+                monitor_printf(mon, " group=%s",
+                               info->value->inserted->group);
+            }
         } else {
             monitor_printf(mon, " [not inserted]");
         }
@@ -312,9 +665,27 @@ void hmp_info_block(Monitor *mon)
     qapi_free_BlockInfoList(block_list);
 }
 
+static void print_latency_histogram(Monitor *mon, const char *name,
+                                    BlockLatencyBinList *bins)
+{
+    monitor_printf(mon, "    %s_latency_ns:", name);
+    for (; bins; bins = bins->next) {
+        if (bins->value->has_high) {
+            monitor_printf(mon, " [%" PRId64 ",%" PRId64 ")=%" PRId64,
+                           bins->value->low, bins->value->high,
+                           bins->value->count);
+        } else {
+            monitor_printf(mon, " [%" PRId64 ",inf)=%" PRId64,
+                           bins->value->low, bins->value->count);
+        }
+    }
+    monitor_printf(mon, "\n");
+}
+
 void hmp_info_blockstats(Monitor *mon)
 {
     BlockStatsList *stats_list, *stats;
+    BlockDeviceStats *s;
 
     stats_list = qmp_query_blockstats(NULL);
 
@@ -341,6 +712,29 @@ void hmp_info_blockstats(Monitor *mon)
                        stats->value->stats->wr_total_time_ns,
                        stats->value->stats->rd_total_time_ns,
                        stats->value->stats->flush_total_time_ns);
+
+        if (stats->value->stats->has_l2_cache) {
+            BlockCacheStats *c = stats->value->stats->l2_cache;
+            monitor_printf(mon, "    l2_cache: size=%" PRId64
+                           " hits=%" PRId64 " misses=%" PRId64 "\n",
+                           c->size, c->hits, c->misses);
+        }
+        if (stats->value->stats->has_refcount_cache) {
+            BlockCacheStats *c = stats->value->stats->refcount_cache;
+            monitor_printf(mon, "    refcount_cache: size=%" PRId64
+                           " hits=%" PRId64 " misses=%" PRId64 "\n",
+                           c->size, c->hits, c->misses);
+        }
+        s = stats->value->stats;
+        if (s->has_rd_latency_histogram) {
+            print_latency_histogram(mon, "rd", s->rd_latency_histogram);
+        }
+        if (s->has_wr_latency_histogram) {
+            print_latency_histogram(mon, "wr", s->wr_latency_histogram);
+        }
+        if (s->has_flush_latency_histogram) {
+            print_latency_histogram(mon, "flush", s->flush_latency_histogram);
+        }
     }
 
     qapi_free_BlockStatsList(stats_list);
@@ -646,6 +1040,22 @@ void hmp_cpu(Monitor *mon, const QDict *qdict)
     }
 }
 
+void hmp_cpu_add(Monitor *mon, const QDict *qdict)
+{
+    Error *err = NULL;
+
+    qmp_cpu_add(qdict_get_int(qdict, "id"), &err);
+    hmp_handle_error(mon, &err);
+}
+
+void hmp_cpu_del(Monitor *mon, const QDict *qdict)
+{
+    Error *err = NULL;
+
+    qmp_cpu_del(qdict_get_int(qdict, "id"), &err);
+    hmp_handle_error(mon, &err);
+}
+
 void hmp_memsave(Monitor *mon, const QDict *qdict)
 {
     uint32_t size = qdict_get_int(qdict, "size");
@@ -779,6 +1189,28 @@ void hmp_snapshot_blkdev(Monitor *mon, const QDict *qdict)
     hmp_handle_error(mon, &errp);
 }
 
+void hmp_drive_mirror(Monitor *mon, const QDict *qdict)
+{
+    const char *device = qdict_get_str(qdict, "device");
+    const char *filename = qdict_get_str(qdict, "target");
+    const char *format = qdict_get_try_str(qdict, "format");
+    int reuse = qdict_get_try_bool(qdict, "reuse", 0);
+    int full = qdict_get_try_bool(qdict, "full", 0);
+    enum NewImageMode mode;
+    Error *errp = NULL;
+
+    if (reuse) {
+        mode = NEW_IMAGE_MODE_EXISTING;
+    } else {
+        mode = NEW_IMAGE_MODE_ABSOLUTE_PATHS;
+    }
+
+    qmp_drive_mirror(device, filename, !!format, format,
+                     full ? MIRROR_SYNC_MODE_FULL : MIRROR_SYNC_MODE_TOP,
+                     true, mode, false, 0, &errp);
+    hmp_handle_error(mon, &errp);
+}
+
 void hmp_migrate_cancel(Monitor *mon, const QDict *qdict)
 {
     qmp_migrate_cancel(NULL);
@@ -841,6 +1273,41 @@ void hmp_migrate_set_capability(Monitor *mon, const QDict *qdict)
     }
 }
 
+void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
+{
+    const char *param = qdict_get_str(qdict, "parameter");
+    int64_t value = qdict_get_int(qdict, "value");
+    Error *err = NULL;
+
+    if (strcmp(param, "compress-level") == 0) {
+        qmp_migrate_set_parameters(true, value, false, 0, false, 0,
+                                   false, 0, false, 0, false, 0, &err);
+    } else if (strcmp(param, "compress-threads") == 0) {
+        qmp_migrate_set_parameters(false, 0, true, value, false, 0,
+                                   false, 0, false, 0, false, 0, &err);
+    } else if (strcmp(param, "decompress-threads") == 0) {
+        qmp_migrate_set_parameters(false, 0, false, 0, true, value,
+                                   false, 0, false, 0, false, 0, &err);
+    } else if (strcmp(param, "max-precopy-passes") == 0) {
+        qmp_migrate_set_parameters(false, 0, false, 0, false, 0,
+                                   true, value, false, 0, false, 0, &err);
+    } else if (strcmp(param, "channels") == 0) {
+        qmp_migrate_set_parameters(false, 0, false, 0, false, 0,
+                                   false, 0, true, value, false, 0, &err);
+    } else if (strcmp(param, "block-inflight") == 0) {
+        qmp_migrate_set_parameters(false, 0, false, 0, false, 0,
+                                   false, 0, false, 0, true, value, &err);
+    } else {
+        error_set(&err, QERR_INVALID_PARAMETER, param);
+    }
+
+    if (err) {
+        monitor_printf(mon, "migrate_set_parameter: %s\n",
+                       error_get_pretty(err));
+        error_free(err);
+    }
+}
+
 void hmp_set_password(Monitor *mon, const QDict *qdict)
 {
     const char *protocol  = qdict_get_str(qdict, "protocol");
@@ -915,10 +1382,30 @@ void hmp_block_set_io_throttle(Monitor *mon, const QDict *qdict)
                               qdict_get_int(qdict, "bps_wr"),
                               qdict_get_int(qdict, "iops"),
                               qdict_get_int(qdict, "iops_rd"),
-                              qdict_get_int(qdict, "iops_wr"), &err);
+                              qdict_get_int(qdict, "iops_wr"),
+                              false, 0, false, 0, false, 0,
+                              false, 0, false, 0, false, 0,
+                              false, 0, false, NULL, &err);
     hmp_handle_error(mon, &err);
 }
 
+void hmp_block_latency_histogram_set(Monitor *mon, const QDict *qdict)
+{
+    Error *err = NULL;
+    const char *boundaries = qdict_get_try_str(qdict, "boundaries");
+
+    qmp_block_latency_histogram_set(qdict_get_str(qdict, "device"),
+                                    true, boundaries ? boundaries : "",
+                                    false, NULL, false, NULL, false, NULL,
+                                    &err);
+    hmp_handle_error(mon, &err);
+}
+
+void hmp_lock_stats(Monitor *mon, const QDict *qdict)
+{
+    qmp_lock_stats_set(qdict_get_bool(qdict, "enable"), NULL);
+}
+
 void hmp_block_stream(Monitor *mon, const QDict *qdict)
 {
     Error *error = NULL;
@@ -953,6 +1440,16 @@ void hmp_block_job_cancel(Monitor *mon, const QDict *qdict)
     hmp_handle_error(mon, &error);
 }
 
+void hmp_block_job_complete(Monitor *mon, const QDict *qdict)
+{
+    Error *error = NULL;
+    const char *device = qdict_get_str(qdict, "device");
+
+    qmp_block_job_complete(device, &error);
+
+    hmp_handle_error(mon, &error);
+}
+
 typedef struct MigrationStatus
 {
     QEMUTimer *timer;
@@ -1039,6 +1536,8 @@ void hmp_dump_guest_memory(Monitor *mon, const QDict *qdict)
 {
     Error *errp = NULL;
     int paging = qdict_get_try_bool(qdict, "paging", 0);
+    bool detach = qdict_get_try_bool(qdict, "detach", 0);
+    bool zlib = qdict_get_try_bool(qdict, "zlib", 0);
     const char *file = qdict_get_str(qdict, "protocol");
     bool has_begin = qdict_haskey(qdict, "begin");
     bool has_length = qdict_haskey(qdict, "length");
@@ -1053,10 +1552,29 @@ void hmp_dump_guest_memory(Monitor *mon, const QDict *qdict)
     }
 
     qmp_dump_guest_memory(paging, file, has_begin, begin, has_length, length,
+                          true, detach, true,
+                          zlib ? DUMP_GUEST_MEMORY_FORMAT_KDUMP_ZLIB
+                               : DUMP_GUEST_MEMORY_FORMAT_ELF,
                           &errp);
     hmp_handle_error(mon, &errp);
 }
 
+void hmp_info_dump(Monitor *mon)
+{
+    DumpQueryResult *result;
+
+    result = qmp_query_dump(NULL);
+    if (!result) {
+        return;
+    }
+    monitor_printf(mon, "Status: %s\n", DumpStatus_lookup[result->status]);
+    if (result->status != DUMP_STATUS_NONE) {
+        monitor_printf(mon, "Completed: %" PRId64 " of %" PRId64 " kbytes\n",
+                       result->completed >> 10, result->total >> 10);
+    }
+    qapi_free_DumpQueryResult(result);
+}
+
 void hmp_netdev_add(Monitor *mon, const QDict *qdict)
 {
     Error *err = NULL;
@@ -39,6 +39,39 @@ int v9fs_co_readdir_r(V9fsPDU *pdu, V9fsFidState *fidp, struct dirent *dent,
     return err;
 }
 
+/*
+ * Read up to @count entries into @dents in a single trip to the worker
+ * threads.  Returns the number of entries read, 0 at the end of the
+ * directory, or a negative errno if nothing could be read.
+ */
+int v9fs_co_readdir_batch(V9fsPDU *pdu, V9fsFidState *fidp,
+                          struct dirent *dents, int count)
+{
+    int err, i;
+    struct dirent *result;
+    V9fsState *s = pdu->s;
+
+    if (v9fs_request_cancelled(pdu)) {
+        return -EINTR;
+    }
+    v9fs_co_run_in_worker(
+        {
+            for (i = 0; i < count; i++) {
+                errno = 0;
+                s->ops->readdir_r(&s->ctx, &fidp->fs, &dents[i], &result);
+                if (!result) {
+                    break;
+                }
+            }
+            if (!i && errno) {
+                err = -errno;
+            } else {
+                err = i;
+            }
+        });
+    return err;
+}
+
 off_t v9fs_co_telldir(V9fsPDU *pdu, V9fsFidState *fidp)
 {
     off_t err;
@@ -96,6 +129,7 @@ int v9fs_co_mkdir(V9fsPDU *pdu, V9fsFidState *fidp, V9fsString *name,
     cred.fc_mode = mode;
     cred.fc_uid = uid;
     cred.fc_gid = gid;
+    v9fs_path_init(&path);
     v9fs_path_read_lock(s);
     v9fs_co_run_in_worker(
         {
@@ -103,7 +137,6 @@ int v9fs_co_mkdir(V9fsPDU *pdu, V9fsFidState *fidp, V9fsString *name,
             if (err < 0) {
                 err = -errno;
             } else {
-                v9fs_path_init(&path);
                 err = v9fs_name_to_path(s, &fidp->path, name->data, &path);
                 if (!err) {
                     err = s->ops->lstat(&s->ctx, &path, stbuf);
@@ -111,10 +144,12 @@ int v9fs_co_mkdir(V9fsPDU *pdu, V9fsFidState *fidp, V9fsString *name,
                         err = -errno;
                     }
                 }
-                v9fs_path_free(&path);
             }
         });
     v9fs_path_unlock(s);
+    v9fs_attr_cache_invalidate(s, &fidp->path);
+    v9fs_attr_cache_invalidate(s, &path);
+    v9fs_path_free(&path);
     return err;
 }
 
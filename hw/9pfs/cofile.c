@@ -44,11 +44,16 @@ int v9fs_co_st_gen(V9fsPDU *pdu, V9fsPath *path, mode_t st_mode,
 int v9fs_co_lstat(V9fsPDU *pdu, V9fsPath *path, struct stat *stbuf)
 {
     int err;
+    unsigned gen;
     V9fsState *s = pdu->s;
 
     if (v9fs_request_cancelled(pdu)) {
         return -EINTR;
     }
+    if (v9fs_attr_cache_lookup(s, path, stbuf, &err)) {
+        return err;
+    }
+    gen = s->attr_cache_gen;
     v9fs_path_read_lock(s);
     v9fs_co_run_in_worker(
         {
@@ -58,6 +63,7 @@ int v9fs_co_lstat(V9fsPDU *pdu, V9fsPath *path, struct stat *stbuf)
             }
         });
     v9fs_path_unlock(s);
+    v9fs_attr_cache_insert(s, path, gen, err, stbuf);
     return err;
 }
 
@@ -112,6 +118,9 @@ int v9fs_co_open(V9fsPDU *pdu, V9fsFidState *fidp, int flags)
             }
         });
     v9fs_path_unlock(s);
+    if (flags & O_TRUNC) {
+        v9fs_attr_cache_invalidate(s, &fidp->path);
+    }
     if (!err) {
         total_open_fd++;
         if (total_open_fd > open_fd_hw) {
@@ -126,7 +135,7 @@ int v9fs_co_open2(V9fsPDU *pdu, V9fsFidState *fidp, V9fsString *name, gid_t gid,
 {
     int err;
     FsCred cred;
-    V9fsPath path;
+    V9fsPath path, dirpath;
     V9fsState *s = pdu->s;
 
     if (v9fs_request_cancelled(pdu)) {
@@ -141,6 +150,9 @@ int v9fs_co_open2(V9fsPDU *pdu, V9fsFidState *fidp, V9fsString *name, gid_t gid,
      * don't change. Read lock is fine because this fid cannot
      * be used by any other operation.
      */
+    v9fs_path_init(&dirpath);
+    v9fs_path_copy(&dirpath, &fidp->path);
+    v9fs_path_init(&path);
     v9fs_path_read_lock(s);
     v9fs_co_run_in_worker(
         {
@@ -149,7 +161,6 @@ int v9fs_co_open2(V9fsPDU *pdu, V9fsFidState *fidp, V9fsString *name, gid_t gid,
             if (err < 0) {
                 err = -errno;
             } else {
-                v9fs_path_init(&path);
                 err = v9fs_name_to_path(s, &fidp->path, name->data, &path);
                 if (!err) {
                     err = s->ops->lstat(&s->ctx, &path, stbuf);
@@ -162,10 +173,13 @@ int v9fs_co_open2(V9fsPDU *pdu, V9fsFidState *fidp, V9fsString *name, gid_t gid,
                 } else {
                     s->ops->close(&s->ctx, &fidp->fs);
                 }
-                v9fs_path_free(&path);
             }
         });
     v9fs_path_unlock(s);
+    v9fs_attr_cache_invalidate(s, &dirpath);
+    v9fs_attr_cache_invalidate(s, &path);
+    v9fs_path_free(&dirpath);
+    v9fs_path_free(&path);
     if (!err) {
         total_open_fd++;
         if (total_open_fd > open_fd_hw) {
@@ -233,6 +247,7 @@ int v9fs_co_link(V9fsPDU *pdu, V9fsFidState *oldfid,
             }
         });
     v9fs_path_unlock(s);
+    v9fs_attr_cache_flush(s);
     return err;
 }
 
@@ -252,6 +267,7 @@ int v9fs_co_pwritev(V9fsPDU *pdu, V9fsFidState *fidp,
                 err = -errno;
             }
         });
+    v9fs_attr_cache_invalidate(s, &fidp->path);
     return err;
 }
 
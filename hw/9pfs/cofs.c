@@ -89,6 +89,7 @@ int v9fs_co_chmod(V9fsPDU *pdu, V9fsPath *path, mode_t mode)
             }
         });
     v9fs_path_unlock(s);
+    v9fs_attr_cache_invalidate(s, path);
     return err;
 }
 
@@ -110,6 +111,7 @@ int v9fs_co_utimensat(V9fsPDU *pdu, V9fsPath *path,
             }
         });
     v9fs_path_unlock(s);
+    v9fs_attr_cache_invalidate(s, path);
     return err;
 }
 
@@ -134,6 +136,7 @@ int v9fs_co_chown(V9fsPDU *pdu, V9fsPath *path, uid_t uid, gid_t gid)
             }
         });
     v9fs_path_unlock(s);
+    v9fs_attr_cache_invalidate(s, path);
     return err;
 }
 
@@ -154,6 +157,7 @@ int v9fs_co_truncate(V9fsPDU *pdu, V9fsPath *path, off_t size)
             }
         });
     v9fs_path_unlock(s);
+    v9fs_attr_cache_invalidate(s, path);
     return err;
 }
 
@@ -173,6 +177,7 @@ int v9fs_co_mknod(V9fsPDU *pdu, V9fsFidState *fidp, V9fsString *name, uid_t uid,
     cred.fc_gid  = gid;
     cred.fc_mode = mode;
     cred.fc_rdev = dev;
+    v9fs_path_init(&path);
     v9fs_path_read_lock(s);
     v9fs_co_run_in_worker(
         {
@@ -180,7 +185,6 @@ int v9fs_co_mknod(V9fsPDU *pdu, V9fsFidState *fidp, V9fsString *name, uid_t uid,
             if (err < 0) {
                 err = -errno;
             } else {
-                v9fs_path_init(&path);
                 err = v9fs_name_to_path(s, &fidp->path, name->data, &path);
                 if (!err) {
                     err = s->ops->lstat(&s->ctx, &path, stbuf);
@@ -188,10 +192,12 @@ int v9fs_co_mknod(V9fsPDU *pdu, V9fsFidState *fidp, V9fsString *name, uid_t uid,
                         err = -errno;
                     }
                 }
-                v9fs_path_free(&path);
             }
         });
     v9fs_path_unlock(s);
+    v9fs_attr_cache_invalidate(s, &fidp->path);
+    v9fs_attr_cache_invalidate(s, &path);
+    v9fs_path_free(&path);
     return err;
 }
 
@@ -213,6 +219,7 @@ int v9fs_co_remove(V9fsPDU *pdu, V9fsPath *path)
             }
         });
     v9fs_path_unlock(s);
+    v9fs_attr_cache_flush(s);
     return err;
 }
 
@@ -233,6 +240,7 @@ int v9fs_co_unlinkat(V9fsPDU *pdu, V9fsPath *path, V9fsString *name, int flags)
             }
         });
     v9fs_path_unlock(s);
+    v9fs_attr_cache_flush(s);
     return err;
 }
 
@@ -252,6 +260,7 @@ int v9fs_co_rename(V9fsPDU *pdu, V9fsPath *oldpath, V9fsPath *newpath)
                 err = -errno;
             }
         });
+    v9fs_attr_cache_flush(s);
     return err;
 }
 
@@ -272,6 +281,7 @@ int v9fs_co_renameat(V9fsPDU *pdu, V9fsPath *olddirpath, V9fsString *oldname,
                 err = -errno;
             }
         });
+    v9fs_attr_cache_flush(s);
     return err;
 }
 
@@ -290,6 +300,7 @@ int v9fs_co_symlink(V9fsPDU *pdu, V9fsFidState *dfidp, V9fsString *name,
     cred.fc_uid = dfidp->uid;
     cred.fc_gid = gid;
     cred.fc_mode = 0777;
+    v9fs_path_init(&path);
     v9fs_path_read_lock(s);
     v9fs_co_run_in_worker(
         {
@@ -298,7 +309,6 @@ int v9fs_co_symlink(V9fsPDU *pdu, V9fsFidState *dfidp, V9fsString *name,
             if (err < 0) {
                 err = -errno;
             } else {
-                v9fs_path_init(&path);
                 err = v9fs_name_to_path(s, &dfidp->path, name->data, &path);
                 if (!err) {
                     err = s->ops->lstat(&s->ctx, &path, stbuf);
@@ -306,10 +316,12 @@ int v9fs_co_symlink(V9fsPDU *pdu, V9fsFidState *dfidp, V9fsString *name,
                         err = -errno;
                     }
                 }
-                v9fs_path_free(&path);
             }
         });
     v9fs_path_unlock(s);
+    v9fs_attr_cache_invalidate(s, &dfidp->path);
+    v9fs_attr_cache_invalidate(s, &path);
+    v9fs_path_free(&path);
     return err;
 }
 
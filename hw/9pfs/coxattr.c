@@ -82,6 +82,7 @@ int v9fs_co_lsetxattr(V9fsPDU *pdu, V9fsPath *path,
             }
         });
     v9fs_path_unlock(s);
+    v9fs_attr_cache_invalidate(s, path);
     return err;
 }
 
@@ -103,5 +104,6 @@ int v9fs_co_lremovexattr(V9fsPDU *pdu, V9fsPath *path,
             }
         });
     v9fs_path_unlock(s);
+    v9fs_attr_cache_invalidate(s, path);
     return err;
 }
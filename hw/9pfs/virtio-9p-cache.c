@@ -0,0 +1,149 @@
+/*
+ * Virtio 9p attribute cache
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include "virtio-9p.h"
+#include "qemu-timer.h"
+
+/*
+ * With cache=loose or cache=fscache the results of lstat, including
+ * ENOENT for names that do not exist, are remembered per path so that
+ * repeated walks and getattrs of the same file are answered without a
+ * trip to the worker threads.  The table is only touched from the QEMU
+ * thread.  Every change the guest makes through the server invalidates
+ * the affected entries and bumps attr_cache_gen, so that a lookup that
+ * was in flight across the change does not store a stale result.
+ */
+
+/* Bound on the number of cached paths; the table is emptied when full */
+#define V9FS_ATTR_CACHE_MAX     4096
+/* How long cache=loose trusts an entry */
+#define V9FS_ATTR_CACHE_TTL     (1000LL * 1000 * 1000)
+
+typedef struct V9fsAttrEntry {
+    V9fsPath path;
+    int err;
+    struct stat stbuf;
+    int64_t expire;
+} V9fsAttrEntry;
+
+static guint v9fs_path_hash(gconstpointer key)
+{
+    const V9fsPath *path = key;
+    guint hash = 5381;
+    int i;
+
+    for (i = 0; i < path->size; i++) {
+        hash = hash * 33 + (unsigned char)path->data[i];
+    }
+    return hash;
+}
+
+static gboolean v9fs_path_equal(gconstpointer a, gconstpointer b)
+{
+    const V9fsPath *p1 = a, *p2 = b;
+
+    return p1->size == p2->size && !memcmp(p1->data, p2->data, p1->size);
+}
+
+static void v9fs_attr_entry_free(gpointer data)
+{
+    V9fsAttrEntry *entry = data;
+
+    v9fs_path_free(&entry->path);
+    g_free(entry);
+}
+
+void v9fs_attr_cache_init(V9fsState *s)
+{
+    if (!(s->ctx.export_flags & V9FS_CACHE_MASK)) {
+        return;
+    }
+    /* the key lives inside the entry and goes away with it */
+    s->attr_cache = g_hash_table_new_full(v9fs_path_hash, v9fs_path_equal,
+                                          NULL, v9fs_attr_entry_free);
+}
+
+/*
+ * Return true and fill in @stbuf and @err if @path has a valid entry.
+ */
+bool v9fs_attr_cache_lookup(V9fsState *s, V9fsPath *path,
+                            struct stat *stbuf, int *err)
+{
+    V9fsAttrEntry *entry;
+
+    if (!s->attr_cache) {
+        return false;
+    }
+    entry = g_hash_table_lookup(s->attr_cache, path);
+    if (!entry) {
+        return false;
+    }
+    if (qemu_get_clock_ns(rt_clock) >= entry->expire) {
+        g_hash_table_remove(s->attr_cache, path);
+        return false;
+    }
+    *err = entry->err;
+    if (!entry->err) {
+        *stbuf = entry->stbuf;
+    }
+    return true;
+}
+
+/*
+ * Remember the result of an lstat of @path.  @gen is the value of
+ * attr_cache_gen sampled before the lstat was started.
+ */
+void v9fs_attr_cache_insert(V9fsState *s, V9fsPath *path, unsigned gen,
+                            int err, struct stat *stbuf)
+{
+    V9fsAttrEntry *entry;
+
+    if (!s->attr_cache || gen != s->attr_cache_gen) {
+        return;
+    }
+    if (err && err != -ENOENT) {
+        return;
+    }
+    if (g_hash_table_size(s->attr_cache) >= V9FS_ATTR_CACHE_MAX) {
+        g_hash_table_remove_all(s->attr_cache);
+    }
+    entry = g_malloc0(sizeof(*entry));
+    v9fs_path_init(&entry->path);
+    v9fs_path_copy(&entry->path, path);
+    entry->err = err;
+    if (!err) {
+        entry->stbuf = *stbuf;
+    }
+    if (s->ctx.export_flags & V9FS_CACHE_FSCACHE) {
+        entry->expire = INT64_MAX;
+    } else {
+        entry->expire = qemu_get_clock_ns(rt_clock) + V9FS_ATTR_CACHE_TTL;
+    }
+    /* replace, not insert: the old key is freed with the old entry */
+    g_hash_table_replace(s->attr_cache, &entry->path, entry);
+}
+
+/* Drop the entry of a path whose attributes were changed */
+void v9fs_attr_cache_invalidate(V9fsState *s, V9fsPath *path)
+{
+    if (!s->attr_cache) {
+        return;
+    }
+    s->attr_cache_gen++;
+    g_hash_table_remove(s->attr_cache, path);
+}
+
+/* Drop everything, for changes to the namespace */
+void v9fs_attr_cache_flush(V9fsState *s)
+{
+    if (!s->attr_cache) {
+        return;
+    }
+    s->attr_cache_gen++;
+    g_hash_table_remove_all(s->attr_cache);
+}
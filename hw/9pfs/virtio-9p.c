@@ -261,6 +261,7 @@ static V9fsFidState *alloc_fid(V9fsState *s, int32_t fid)
     f->fid = fid;
     f->fid_type = P9_FID_NONE;
     f->ref = 1;
+    qemu_co_mutex_init(&f->dir_lock);
     /*
      * Mark the fid as referenced so that the LRU
      * reclaim won't close the file descriptor
@@ -629,7 +630,9 @@ static void complete_pdu(V9fsState *s, V9fsPDU *pdu, ssize_t len)
     pdu->id = id;
 
     /* push onto queue and notify */
-    virtqueue_push(s->vq, &pdu->elem, len);
+    virtqueue_push(s->vq, pdu->elem, len);
+    g_free(pdu->elem);
+    pdu->elem = NULL;
 
     /* FIXME: we should batch these completions */
     virtio_notify(&s->vdev, s->vq);
@@ -916,6 +919,15 @@ static void v9fs_version(void *opaque)
 
     virtfs_reset(pdu);
 
+    /* the server may only lower the client's msize */
+    if (s->msize < P9_MIN_MSIZE) {
+        offset = -EMSGSIZE;
+        goto out;
+    }
+    if (s->msize > P9_MAX_MSIZE) {
+        s->msize = P9_MAX_MSIZE;
+    }
+
     if (!strcmp(version.data, "9P2000.u")) {
         s->proto_version = V9FS_PROTO_2000U;
     } else if (!strcmp(version.data, "9P2000.L")) {
@@ -1570,7 +1582,7 @@ static int v9fs_xattr_read(V9fsState *s, V9fsPDU *pdu, V9fsFidState *fidp,
         return err;
     }
     offset += err;
-    err = v9fs_pack(pdu->elem.in_sg, pdu->elem.in_num, offset,
+    err = v9fs_pack(pdu->elem->in_sg, pdu->elem->in_num, offset,
                     ((char *)fidp->fs.xattr.value) + off,
                     read_count);
     if (err < 0) {
@@ -1589,7 +1601,8 @@ static int v9fs_do_readdir_with_stat(V9fsPDU *pdu,
     int32_t count = 0;
     struct stat stbuf;
     off_t saved_dir_pos;
-    struct dirent *dent, *result;
+    struct dirent *dents, *dent;
+    int i, n;
 
     /* save the directory position */
     saved_dir_pos = v9fs_co_telldir(pdu, fidp);
@@ -1597,48 +1610,51 @@ static int v9fs_do_readdir_with_stat(V9fsPDU *pdu,
         return saved_dir_pos;
     }
 
-    dent = g_malloc(sizeof(struct dirent));
+    dents = g_malloc(sizeof(struct dirent) * V9FS_READDIR_BATCH);
 
-    while (1) {
-        v9fs_path_init(&path);
-        err = v9fs_co_readdir_r(pdu, fidp, dent, &result);
-        if (err || !result) {
-            break;
-        }
-        err = v9fs_co_name_to_path(pdu, &fidp->path, dent->d_name, &path);
-        if (err < 0) {
-            goto out;
-        }
-        err = v9fs_co_lstat(pdu, &path, &stbuf);
-        if (err < 0) {
-            goto out;
-        }
-        err = stat_to_v9stat(pdu, &path, &stbuf, &v9stat);
-        if (err < 0) {
-            goto out;
-        }
-        /* 11 = 7 + 4 (7 = start offset, 4 = space for storing count) */
-        len = pdu_marshal(pdu, 11 + count, "S", &v9stat);
-        if ((len != (v9stat.size + 2)) || ((count + len) > max_count)) {
-            /* Ran out of buffer. Set dir back to old position and return */
-            v9fs_co_seekdir(pdu, fidp, saved_dir_pos);
+    do {
+        n = err = v9fs_co_readdir_batch(pdu, fidp, dents, V9FS_READDIR_BATCH);
+        for (i = 0; i < n; i++) {
+            dent = &dents[i];
+            v9fs_path_init(&path);
+            err = v9fs_co_name_to_path(pdu, &fidp->path, dent->d_name, &path);
+            if (err < 0) {
+                goto out;
+            }
+            err = v9fs_co_lstat(pdu, &path, &stbuf);
+            if (err < 0) {
+                goto out;
+            }
+            err = stat_to_v9stat(pdu, &path, &stbuf, &v9stat);
+            if (err < 0) {
+                goto out;
+            }
+            /* 11 = 7 + 4 (7 = start offset, 4 = space for storing count) */
+            len = pdu_marshal(pdu, 11 + count, "S", &v9stat);
+            if ((len != (v9stat.size + 2)) || ((count + len) > max_count)) {
+                /* Ran out of buffer. Set dir back to old position and return */
+                v9fs_co_seekdir(pdu, fidp, saved_dir_pos);
+                v9fs_stat_free(&v9stat);
+                v9fs_path_free(&path);
+                g_free(dents);
+                return count;
+            }
+            count += len;
             v9fs_stat_free(&v9stat);
             v9fs_path_free(&path);
-            g_free(dent);
-            return count;
+            saved_dir_pos = dent->d_off;
         }
-        count += len;
-        v9fs_stat_free(&v9stat);
-        v9fs_path_free(&path);
-        saved_dir_pos = dent->d_off;
-    }
-out:
-    g_free(dent);
-    v9fs_path_free(&path);
+        /* a short batch means the end of the directory was reached */
+    } while (n == V9FS_READDIR_BATCH);
+    g_free(dents);
     if (err < 0) {
         return err;
     }
     return count;
+out:
+    g_free(dents);
+    v9fs_path_free(&path);
+    return err;
 }
 
 /*
@@ -1661,11 +1677,11 @@ static void v9fs_init_qiov_from_pdu(QEMUIOVector *qiov, V9fsPDU *pdu,
     unsigned int niov;
 
     if (is_write) {
-        iov = pdu->elem.out_sg;
-        niov = pdu->elem.out_num;
+        iov = pdu->elem->out_sg;
+        niov = pdu->elem->out_num;
     } else {
-        iov = pdu->elem.in_sg;
-        niov = pdu->elem.in_num;
+        iov = pdu->elem->in_sg;
+        niov = pdu->elem->in_num;
     }
 
     qemu_iovec_init_external(&elem, iov, niov);
@@ -1698,10 +1714,12 @@ static void v9fs_read(void *opaque)
     }
     if (fidp->fid_type == P9_FID_DIR) {
 
+        qemu_co_mutex_lock(&fidp->dir_lock);
         if (off == 0) {
             v9fs_co_rewinddir(pdu, fidp);
         }
         count = v9fs_do_readdir_with_stat(pdu, fidp, max_count);
+        qemu_co_mutex_unlock(&fidp->dir_lock);
         if (count < 0) {
             err = count;
             goto out;
@@ -1775,7 +1793,8 @@ static int v9fs_do_readdir(V9fsPDU *pdu,
     int len, err = 0;
     int32_t count = 0;
     off_t saved_dir_pos;
-    struct dirent *dent, *result;
+    struct dirent *dents, *dent;
+    int i, n;
 
     /* save the directory position */
     saved_dir_pos = v9fs_co_telldir(pdu, fidp);
@@ -1783,48 +1802,49 @@ static int v9fs_do_readdir(V9fsPDU *pdu,
         return saved_dir_pos;
     }
 
-    dent = g_malloc(sizeof(struct dirent));
+    dents = g_malloc(sizeof(struct dirent) * V9FS_READDIR_BATCH);
 
-    while (1) {
-        err = v9fs_co_readdir_r(pdu, fidp, dent, &result);
-        if (err || !result) {
-            break;
-        }
-        v9fs_string_init(&name);
-        v9fs_string_sprintf(&name, "%s", dent->d_name);
-        if ((count + v9fs_readdir_data_size(&name)) > max_count) {
-            /* Ran out of buffer. Set dir back to old position and return */
-            v9fs_co_seekdir(pdu, fidp, saved_dir_pos);
-            v9fs_string_free(&name);
-            g_free(dent);
-            return count;
-        }
-        /*
-         * Fill up just the path field of qid because the client uses
-         * only that. To fill the entire qid structure we will have
-         * to stat each dirent found, which is expensive
-         */
-        size = MIN(sizeof(dent->d_ino), sizeof(qid.path));
-        memcpy(&qid.path, &dent->d_ino, size);
-        /* Fill the other fields with dummy values */
-        qid.type = 0;
-        qid.version = 0;
-
-        /* 11 = 7 + 4 (7 = start offset, 4 = space for storing count) */
-        len = pdu_marshal(pdu, 11 + count, "Qqbs",
-                          &qid, dent->d_off,
-                          dent->d_type, &name);
-        if (len < 0) {
-            v9fs_co_seekdir(pdu, fidp, saved_dir_pos);
+    do {
+        n = err = v9fs_co_readdir_batch(pdu, fidp, dents, V9FS_READDIR_BATCH);
+        for (i = 0; i < n; i++) {
+            dent = &dents[i];
+            v9fs_string_init(&name);
+            v9fs_string_sprintf(&name, "%s", dent->d_name);
+            if ((count + v9fs_readdir_data_size(&name)) > max_count) {
+                /* Ran out of buffer. Set dir back to old position and return */
+                v9fs_co_seekdir(pdu, fidp, saved_dir_pos);
+                v9fs_string_free(&name);
+                g_free(dents);
+                return count;
+            }
+            /*
+             * Fill up just the path field of qid because the client uses
+             * only that. To fill the entire qid structure we will have
+             * to stat each dirent found, which is expensive
+             */
+            size = MIN(sizeof(dent->d_ino), sizeof(qid.path));
+            memcpy(&qid.path, &dent->d_ino, size);
+            /* Fill the other fields with dummy values */
+            qid.type = 0;
+            qid.version = 0;
+
+            /* 11 = 7 + 4 (7 = start offset, 4 = space for storing count) */
+            len = pdu_marshal(pdu, 11 + count, "Qqbs",
+                              &qid, dent->d_off,
+                              dent->d_type, &name);
+            if (len < 0) {
+                v9fs_co_seekdir(pdu, fidp, saved_dir_pos);
+                v9fs_string_free(&name);
+                g_free(dents);
+                return len;
+            }
+            count += len;
             v9fs_string_free(&name);
-            g_free(dent);
-            return len;
+            saved_dir_pos = dent->d_off;
         }
-        count += len;
-        v9fs_string_free(&name);
-        saved_dir_pos = dent->d_off;
-    }
-    g_free(dent);
+        /* a short batch means the end of the directory was reached */
+    } while (n == V9FS_READDIR_BATCH);
+    g_free(dents);
     if (err < 0) {
         return err;
     }
@@ -1859,12 +1879,14 @@ static void v9fs_readdir(void *opaque)
         retval = -EINVAL;
         goto out;
     }
+    qemu_co_mutex_lock(&fidp->dir_lock);
     if (initial_offset == 0) {
         v9fs_co_rewinddir(pdu, fidp);
     } else {
         v9fs_co_seekdir(pdu, fidp, initial_offset);
     }
     count = v9fs_do_readdir(pdu, fidp, max_count);
+    qemu_co_mutex_unlock(&fidp->dir_lock);
     if (count < 0) {
         retval = count;
         goto out;
@@ -3256,16 +3278,15 @@ void handle_9p_output(VirtIODevice *vdev, VirtQueue *vq)
 {
     V9fsState *s = (V9fsState *)vdev;
     V9fsPDU *pdu;
-    ssize_t len;
 
     while ((pdu = alloc_pdu(s)) &&
-            (len = virtqueue_pop(vq, &pdu->elem)) != 0) {
+            (pdu->elem = virtqueue_pop(vq, sizeof(VirtQueueElement)))) {
         uint8_t *ptr;
         pdu->s = s;
-        BUG_ON(pdu->elem.out_num == 0 || pdu->elem.in_num == 0);
-        BUG_ON(pdu->elem.out_sg[0].iov_len < 7);
+        BUG_ON(pdu->elem->out_num == 0 || pdu->elem->in_num == 0);
+        BUG_ON(pdu->elem->out_sg[0].iov_len < 7);
 
-        ptr = pdu->elem.out_sg[0].iov_base;
+        ptr = pdu->elem->out_sg[0].iov_base;
 
         pdu->size = le32_to_cpu(*(uint32_t *)ptr);
         pdu->id = ptr[4];
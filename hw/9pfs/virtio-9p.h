@@ -125,6 +125,15 @@ static inline const char *rpath(FsContext *ctx, const char *path, char *buffer)
  */
 #define P9_IOHDRSZ 24
 
+/*
+ * Bounds for the negotiated msize.  Reads and writes go straight between
+ * the guest buffers of a single virtqueue element and the host file, so
+ * the largest useful msize is what one element can map: a full chain of
+ * descriptors covering 4k pages each.
+ */
+#define P9_MIN_MSIZE    4096
+#define P9_MAX_MSIZE    (VIRTQUEUE_MAX_SIZE * 4096)
+
 typedef struct V9fsPDU V9fsPDU;
 struct V9fsState;
 
@@ -135,7 +144,7 @@ struct V9fsPDU
     uint8_t id;
     uint8_t cancelled;
     CoQueue complete;
-    VirtQueueElement elem;
+    VirtQueueElement *elem;
     struct V9fsState *s;
     QLIST_ENTRY(V9fsPDU) next;
 };
@@ -151,6 +160,8 @@ struct V9fsPDU
 #define VIRTIO_ID_9P    9
 #define MAX_REQ         128
 #define MAX_TAG_LEN     32
+/* directory entries fetched per trip to the worker threads */
+#define V9FS_READDIR_BATCH  32
 
 #define BUG_ON(cond) assert(!(cond))
 
@@ -200,6 +211,11 @@ struct V9fsFidState
     uid_t uid;
     int ref;
     int clunked;
+    /*
+     * Serializes the requests that move the directory stream, other
+     * requests on the fid run in parallel.
+     */
+    CoMutex dir_lock;
     V9fsFidState *next;
     V9fsFidState *rclm_lst;
 };
@@ -225,6 +241,9 @@ typedef struct V9fsState
     CoRwlock rename_lock;
     int32_t root_fid;
     Error *migration_blocker;
+    /* lstat cache for cache=loose|fscache, see virtio-9p-cache.c */
+    GHashTable *attr_cache;
+    unsigned attr_cache_gen;
 } V9fsState;
 
 typedef struct V9fsStatState {
@@ -396,10 +415,17 @@ extern void v9fs_path_free(V9fsPath *path);
 extern void v9fs_path_copy(V9fsPath *lhs, V9fsPath *rhs);
 extern int v9fs_name_to_path(V9fsState *s, V9fsPath *dirpath,
                              const char *name, V9fsPath *path);
+extern void v9fs_attr_cache_init(V9fsState *s);
+extern bool v9fs_attr_cache_lookup(V9fsState *s, V9fsPath *path,
+                                   struct stat *stbuf, int *err);
+extern void v9fs_attr_cache_insert(V9fsState *s, V9fsPath *path, unsigned gen,
+                                   int err, struct stat *stbuf);
+extern void v9fs_attr_cache_invalidate(V9fsState *s, V9fsPath *path);
+extern void v9fs_attr_cache_flush(V9fsState *s);
 
 #define pdu_marshal(pdu, offset, fmt, args...)  \
-    v9fs_marshal(pdu->elem.in_sg, pdu->elem.in_num, offset, 1, fmt, ##args)
+    v9fs_marshal(pdu->elem->in_sg, pdu->elem->in_num, offset, 1, fmt, ##args)
 #define pdu_unmarshal(pdu, offset, fmt, args...)  \
-    v9fs_unmarshal(pdu->elem.out_sg, pdu->elem.out_num, offset, 1, fmt, ##args)
+    v9fs_unmarshal(pdu->elem->out_sg, pdu->elem->out_num, offset, 1, fmt, ##args)
 
 #endif
@@ -352,10 +352,38 @@ static void acpi_pm_tmr_timer(void *opaque)
     ar->tmr.update_sci(ar);
 }
 
-void acpi_pm_tmr_init(ACPIREGS *ar, acpi_update_sci_fn update_sci)
+static uint64_t acpi_pm_tmr_read(void *opaque, target_phys_addr_t addr,
+                                 unsigned width)
+{
+    return addr ? 0 : acpi_pm_tmr_get(opaque);
+}
+
+static void acpi_pm_tmr_write(void *opaque, target_phys_addr_t addr,
+                              uint64_t val, unsigned width)
+{
+    /* nothing */
+}
+
+static const MemoryRegionOps acpi_pm_tmr_ops = {
+    .read = acpi_pm_tmr_read,
+    .write = acpi_pm_tmr_write,
+    .endianness = DEVICE_LITTLE_ENDIAN,
+};
+
+/* If PARENT is not NULL, the timer register is mapped at offset 8 of that
+   PM I/O block.  Reading it only looks at the clock, so it does not need
+   the global mutex.  */
+void acpi_pm_tmr_init(ACPIREGS *ar, acpi_update_sci_fn update_sci,
+                      MemoryRegion *parent)
 {
     ar->tmr.update_sci = update_sci;
     ar->tmr.timer = qemu_new_timer_ns(vm_clock, acpi_pm_tmr_timer, ar);
+    if (parent) {
+        memory_region_init_io(&ar->tmr.io, &acpi_pm_tmr_ops, ar,
+                              "acpi-tmr", 4);
+        memory_region_set_lockless(&ar->tmr.io, true, false);
+        memory_region_add_subregion(parent, 8, &ar->tmr.io);
+    }
 }
 
 void acpi_pm_tmr_reset(ACPIREGS *ar)
@@ -19,6 +19,8 @@
  * <http://www.gnu.org/licenses/>.
  */
 
+#include "memory.h"
+
 /* from linux include/acpi/actype.h */
 /* Default ACPI register widths */
 
@@ -85,6 +87,7 @@ typedef void (*acpi_update_sci_fn)(ACPIREGS *ar);
 struct ACPIPMTimer {
     QEMUTimer *timer;
     int64_t overflow_time;
+    MemoryRegion io;
 
     acpi_update_sci_fn update_sci;
 };
@@ -120,7 +123,8 @@ struct ACPIREGS {
 void acpi_pm_tmr_update(ACPIREGS *ar, bool enable);
 void acpi_pm_tmr_calc_overflow_time(ACPIREGS *ar);
 uint32_t acpi_pm_tmr_get(ACPIREGS *ar);
-void acpi_pm_tmr_init(ACPIREGS *ar, acpi_update_sci_fn update_sci);
+void acpi_pm_tmr_init(ACPIREGS *ar, acpi_update_sci_fn update_sci,
+                      MemoryRegion *parent);
 void acpi_pm_tmr_reset(ACPIREGS *ar);
 
 #include "qemu-timer.h"
@@ -87,6 +87,53 @@ static int get_highest_priority_int(uint32_t *tab)
     return -1;
 }
 
+/* The highest vectors of IRR and ISR decide each interrupt acceptance,
+   EOI and PPR read, so they are kept across calls: setting a bit can
+   only raise them, clearing one marks them stale for the next lookup. */
+static int apic_irr_max(APICCommonState *s)
+{
+    if (s->irr_max == APIC_VECTOR_STALE) {
+        s->irr_max = get_highest_priority_int(s->irr);
+    }
+    return s->irr_max;
+}
+
+static int apic_isr_max(APICCommonState *s)
+{
+    if (s->isr_max == APIC_VECTOR_STALE) {
+        s->isr_max = get_highest_priority_int(s->isr);
+    }
+    return s->isr_max;
+}
+
+static inline void apic_set_irr(APICCommonState *s, int vector)
+{
+    set_bit(s->irr, vector);
+    if (s->irr_max != APIC_VECTOR_STALE) {
+        s->irr_max = MAX(s->irr_max, vector);
+    }
+}
+
+static inline void apic_reset_irr(APICCommonState *s, int vector)
+{
+    reset_bit(s->irr, vector);
+    s->irr_max = APIC_VECTOR_STALE;
+}
+
+static inline void apic_set_isr(APICCommonState *s, int vector)
+{
+    set_bit(s->isr, vector);
+    if (s->isr_max != APIC_VECTOR_STALE) {
+        s->isr_max = MAX(s->isr_max, vector);
+    }
+}
+
+static inline void apic_reset_isr(APICCommonState *s, int vector)
+{
+    reset_bit(s->isr, vector);
+    s->isr_max = APIC_VECTOR_STALE;
+}
+
 static void apic_sync_vapic(APICCommonState *s, int sync_type)
 {
     VAPICState vapic_state;
@@ -115,7 +162,7 @@ static void apic_sync_vapic(APICCommonState *s, int sync_type)
             length = sizeof(VAPICState);
         }
 
-        vector = get_highest_priority_int(s->isr);
+        vector = apic_isr_max(s);
         if (vector < 0) {
             vector = 0;
         }
@@ -123,7 +170,7 @@ static void apic_sync_vapic(APICCommonState *s, int sync_type)
 
         vapic_state.zero = 0;
 
-        vector = get_highest_priority_int(s->irr);
+        vector = apic_irr_max(s);
         if (vector < 0) {
             vector = 0;
         }
@@ -184,7 +231,7 @@ void apic_deliver_pic_intr(DeviceState *d, int level)
         case APIC_DM_FIXED:
             if (!(lvt & APIC_LVT_LEVEL_TRIGGER))
                 break;
-            reset_bit(s->irr, lvt & 0xff);
+            apic_reset_irr(s, lvt & 0xff);
             /* fall through */
         case APIC_DM_EXTINT:
             cpu_reset_interrupt(s->cpu_env, CPU_INTERRUPT_HARD);
@@ -318,7 +365,7 @@ static int apic_get_ppr(APICCommonState *s)
     int tpr, isrv, ppr;
 
     tpr = (s->tpr >> 4);
-    isrv = get_highest_priority_int(s->isr);
+    isrv = apic_isr_max(s);
     if (isrv < 0)
         isrv = 0;
     isrv >>= 4;
@@ -344,7 +391,7 @@ static int apic_get_arb_pri(APICCommonState *s)
 static int apic_irq_pending(APICCommonState *s)
 {
     int irrv, ppr;
-    irrv = get_highest_priority_int(s->irr);
+    irrv = apic_irr_max(s);
     if (irrv < 0) {
         return 0;
     }
@@ -381,7 +428,7 @@ static void apic_set_irq(APICCommonState *s, int vector_num, int trigger_mode)
 {
     apic_report_irq_delivered(!get_bit(s->irr, vector_num));
 
-    set_bit(s->irr, vector_num);
+    apic_set_irr(s, vector_num);
     if (trigger_mode)
         set_bit(s->tmr, vector_num);
     else
@@ -402,10 +449,10 @@ static void apic_set_irq(APICCommonState *s, int vector_num, int trigger_mode)
 static void apic_eoi(APICCommonState *s)
 {
     int isrv;
-    isrv = get_highest_priority_int(s->isr);
+    isrv = apic_isr_max(s);
     if (isrv < 0)
         return;
-    reset_bit(s->isr, isrv);
+    apic_reset_isr(s, isrv);
     if (!(s->spurious_vec & APIC_SV_DIRECTED_IO) && get_bit(s->tmr, isrv)) {
         ioapic_eoi_broadcast(isrv);
     }
@@ -566,8 +613,8 @@ int apic_get_interrupt(DeviceState *d)
         apic_sync_vapic(s, SYNC_TO_VAPIC);
         return s->spurious_vec & 0xff;
     }
-    reset_bit(s->irr, intno);
-    set_bit(s->isr, intno);
+    apic_reset_irr(s, intno);
+    apic_set_isr(s, intno);
     apic_sync_vapic(s, SYNC_TO_VAPIC);
 
     /* re-inject if there is still a pending PIC interrupt */
@@ -849,6 +896,8 @@ static void apic_pre_save(APICCommonState *s)
 
 static void apic_post_load(APICCommonState *s)
 {
+    s->irr_max = APIC_VECTOR_STALE;
+    s->isr_max = APIC_VECTOR_STALE;
     if (s->timer_expiry != -1) {
         qemu_mod_timer(s->timer, s->timer_expiry);
     } else {
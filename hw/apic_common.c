@@ -183,6 +183,8 @@ void apic_init_reset(DeviceState *d)
     memset(s->isr, 0, sizeof(s->isr));
     memset(s->tmr, 0, sizeof(s->tmr));
     memset(s->irr, 0, sizeof(s->irr));
+    s->irr_max = -1;
+    s->isr_max = -1;
     for (i = 0; i < APIC_LVT_NB; i++) {
         s->lvt[i] = APIC_LVT_MASKED;
     }
@@ -66,6 +66,8 @@
 
 #define MAX_APICS 255
 
+#define APIC_VECTOR_STALE               (-2)
+
 #define MSI_SPACE_SIZE                  0x100000
 
 typedef struct APICCommonState APICCommonState;
@@ -107,6 +109,10 @@ struct APICCommonState {
     uint32_t isr[8];  /* in service register */
     uint32_t tmr[8];  /* trigger mode register */
     uint32_t irr[8]; /* interrupt request register */
+    /* highest vectors set in irr and isr, -1 if none, as kept up to date
+       by apic.c; APIC_VECTOR_STALE makes it scan the register again */
+    int irr_max;
+    int isr_max;
     uint32_t lvt[APIC_LVT_NB];
     uint32_t esr; /* error register */
     uint32_t icr[2];
@@ -44,46 +44,60 @@ static inline int gic_get_current_cpu(gic_state *s)
     return 0;
 }
 
-/* TODO: Many places that call this routine could be optimized.  */
-/* Update interrupt status after enabled or pending bits have been changed.  */
-void gic_update(gic_state *s)
+/* Update the interrupt status of one CPU.  Only the interrupts that are
+   both enabled and pending for it are looked at.  */
+static void gic_update_cpu(gic_state *s, int cpu)
 {
     int best_irq;
     int best_prio;
     int irq;
     int level;
-    int cpu;
-    int cm;
 
-    for (cpu = 0; cpu < NUM_CPU(s); cpu++) {
-        cm = 1 << cpu;
-        s->current_pending[cpu] = 1023;
-        if (!s->enabled || !s->cpu_enabled[cpu]) {
-            qemu_irq_lower(s->parent_irq[cpu]);
-            return;
+    s->current_pending[cpu] = 1023;
+    if (!s->enabled || !s->cpu_enabled[cpu]) {
+        qemu_irq_lower(s->parent_irq[cpu]);
+        return;
+    }
+    best_prio = 0x100;
+    best_irq = 1023;
+    for (irq = find_first_bit(s->pending_enabled[cpu], s->num_irq);
+         irq < s->num_irq;
+         irq = find_next_bit(s->pending_enabled[cpu], s->num_irq, irq + 1)) {
+        if (GIC_GET_PRIORITY(irq, cpu) < best_prio) {
+            best_prio = GIC_GET_PRIORITY(irq, cpu);
+            best_irq = irq;
         }
-        best_prio = 0x100;
-        best_irq = 1023;
-        for (irq = 0; irq < s->num_irq; irq++) {
-            if (GIC_TEST_ENABLED(irq, cm) && GIC_TEST_PENDING(irq, cm)) {
-                if (GIC_GET_PRIORITY(irq, cpu) < best_prio) {
-                    best_prio = GIC_GET_PRIORITY(irq, cpu);
-                    best_irq = irq;
-                }
-            }
+    }
+    level = 0;
+    if (best_prio <= s->priority_mask[cpu]) {
+        s->current_pending[cpu] = best_irq;
+        if (best_prio < s->running_priority[cpu]) {
+            DPRINTF("Raised pending IRQ %d\n", best_irq);
+            level = 1;
         }
-        level = 0;
-        if (best_prio <= s->priority_mask[cpu]) {
-            s->current_pending[cpu] = best_irq;
-            if (best_prio < s->running_priority[cpu]) {
-                DPRINTF("Raised pending IRQ %d\n", best_irq);
-                level = 1;
-            }
+    }
+    qemu_set_irq(s->parent_irq[cpu], level);
+}
+
+/* Update the CPUs in @cm after their enabled or pending bits, priority
+   mask or running priority have been changed.  */
+static void gic_update_mask(gic_state *s, int cm)
+{
+    int cpu;
+
+    for (cpu = 0; cpu < NUM_CPU(s); cpu++) {
+        if (cm & (1 << cpu)) {
+            gic_update_cpu(s, cpu);
         }
-        qemu_set_irq(s->parent_irq[cpu], level);
     }
 }
 
+/* Update interrupt status after enabled or pending bits have been changed.  */
+void gic_update(gic_state *s)
+{
+    gic_update_mask(s, ALL_CPU_MASK);
+}
+
 void gic_set_pending_private(gic_state *s, int cpu, int irq)
 {
     int cm = 1 << cpu;
@@ -93,7 +107,7 @@ void gic_set_pending_private(gic_state *s, int cpu, int irq)
 
     DPRINTF("Set %d pending cpu %d\n", irq, cpu);
     GIC_SET_PENDING(irq, cm);
-    gic_update(s);
+    gic_update_cpu(s, cpu);
 }
 
 /* Process a change in an external IRQ input.  */
@@ -130,11 +144,13 @@ static void gic_set_irq(void *opaque, int irq, int level)
         if (GIC_TEST_TRIGGER(irq) || GIC_TEST_ENABLED(irq, cm)) {
             DPRINTF("Set %d pending mask %x\n", irq, target);
             GIC_SET_PENDING(irq, target);
+            gic_update_mask(s, target);
         }
     } else {
+        /* The pending bit stays set until the interrupt is acknowledged,
+           so nothing that gic_update() looks at has changed.  */
         GIC_CLEAR_LEVEL(irq, cm);
     }
-    gic_update(s);
 }
 
 static void gic_set_running_irq(gic_state *s, int cpu, int irq)
@@ -145,7 +161,7 @@ static void gic_set_running_irq(gic_state *s, int cpu, int irq)
     } else {
         s->running_priority[cpu] = GIC_GET_PRIORITY(irq, cpu);
     }
-    gic_update(s);
+    gic_update_cpu(s, cpu);
 }
 
 uint32_t gic_acknowledge_irq(gic_state *s, int cpu)
@@ -161,7 +177,14 @@ uint32_t gic_acknowledge_irq(gic_state *s, int cpu)
     s->last_active[new_irq][cpu] = s->running_irq[cpu];
     /* Clear pending flags for both level and edge triggered interrupts.
        Level triggered IRQs will be reasserted once they become inactive.  */
-    GIC_CLEAR_PENDING(new_irq, GIC_TEST_MODEL(new_irq) ? ALL_CPU_MASK : cm);
+    if (GIC_TEST_MODEL(new_irq)) {
+        /* 1-N model: the other CPUs may have this one as their highest
+           pending interrupt too.  */
+        GIC_CLEAR_PENDING(new_irq, ALL_CPU_MASK);
+        gic_update_mask(s, ALL_CPU_MASK & ~cm);
+    } else {
+        GIC_CLEAR_PENDING(new_irq, cm);
+    }
     gic_set_running_irq(s, cpu, new_irq);
     DPRINTF("ACK %d\n", new_irq);
     return new_irq;
@@ -204,7 +227,7 @@ void gic_complete_irq(gic_state *s, int cpu, int irq)
             tmp = s->last_active[tmp][cpu];
         }
         if (update) {
-            gic_update(s);
+            gic_update_cpu(s, cpu);
         }
     } else {
         /* Complete the current running IRQ.  */
@@ -524,7 +547,7 @@ static void gic_dist_writel(void *opaque, target_phys_addr_t offset,
             break;
         }
         GIC_SET_PENDING(irq, mask);
-        gic_update(s);
+        gic_update_mask(s, mask);
         return;
     }
     gic_dist_writew(opaque, offset, value & 0xffff);
@@ -580,7 +603,7 @@ static void gic_cpu_write(gic_state *s, int cpu, int offset, uint32_t value)
         hw_error("gic_cpu_write: Bad offset %x\n", (int)offset);
         return;
     }
-    gic_update(s);
+    gic_update_cpu(s, cpu);
 }
 
 /* Wrappers to read/write the GIC CPU interface for the current CPU */
@@ -22,6 +22,7 @@
 #define QEMU_ARM_GIC_INTERNAL_H
 
 #include "sysbus.h"
+#include "bitops.h"
 
 /* Maximum number of possible interrupts, determined by the GIC architecture */
 #define GIC_MAXIRQ 1020
@@ -36,11 +37,11 @@
    through the normal GIC interface.  */
 #define GIC_BASE_IRQ ((s->revision == REV_NVIC) ? 32 : 0)
 
-#define GIC_SET_ENABLED(irq, cm) s->irq_state[irq].enabled |= (cm)
-#define GIC_CLEAR_ENABLED(irq, cm) s->irq_state[irq].enabled &= ~(cm)
+#define GIC_SET_ENABLED(irq, cm) gic_set_enabled(s, irq, cm, true)
+#define GIC_CLEAR_ENABLED(irq, cm) gic_set_enabled(s, irq, cm, false)
 #define GIC_TEST_ENABLED(irq, cm) ((s->irq_state[irq].enabled & (cm)) != 0)
-#define GIC_SET_PENDING(irq, cm) s->irq_state[irq].pending |= (cm)
-#define GIC_CLEAR_PENDING(irq, cm) s->irq_state[irq].pending &= ~(cm)
+#define GIC_SET_PENDING(irq, cm) gic_set_pending(s, irq, cm, true)
+#define GIC_CLEAR_PENDING(irq, cm) gic_set_pending(s, irq, cm, false)
 #define GIC_TEST_PENDING(irq, cm) ((s->irq_state[irq].pending & (cm)) != 0)
 #define GIC_SET_ACTIVE(irq, cm) s->irq_state[irq].active |= (cm)
 #define GIC_CLEAR_ACTIVE(irq, cm) s->irq_state[irq].active &= ~(cm)
@@ -88,6 +89,13 @@ typedef struct gic_state {
 
     uint32_t num_cpu;
 
+    /* For each CPU, the interrupts that are both enabled and pending for
+     * it, so that gic_update() only looks at those.  Kept in step with
+     * irq_state by the GIC_*_ENABLED and GIC_*_PENDING macros; code that
+     * writes irq_state directly calls gic_sync_irq() afterwards.
+     */
+    unsigned long pending_enabled[NCPU][BITS_TO_LONGS(GIC_MAXIRQ)];
+
     MemoryRegion iomem; /* Distributor */
     /* This is just so we can have an opaque pointer which identifies
      * both this GIC and which CPU interface we should be accessing.
@@ -102,6 +110,50 @@ typedef struct gic_state {
 #define REV_11MPCORE 0
 #define REV_NVIC 0xffffffff
 
+static inline void gic_sync_irq_mask(gic_state *s, int irq, unsigned cm)
+{
+    unsigned both = s->irq_state[irq].enabled & s->irq_state[irq].pending;
+    int cpu;
+
+    for (cpu = 0; cm; cpu++, cm >>= 1) {
+        if (!(cm & 1)) {
+            continue;
+        }
+        if (both & (1 << cpu)) {
+            set_bit(irq, s->pending_enabled[cpu]);
+        } else {
+            clear_bit(irq, s->pending_enabled[cpu]);
+        }
+    }
+}
+
+static inline void gic_sync_irq(gic_state *s, int irq)
+{
+    gic_sync_irq_mask(s, irq, ALL_CPU_MASK);
+}
+
+static inline void gic_set_enabled(gic_state *s, int irq, unsigned cm,
+                                   bool enabled)
+{
+    if (enabled) {
+        s->irq_state[irq].enabled |= cm;
+    } else {
+        s->irq_state[irq].enabled &= ~cm;
+    }
+    gic_sync_irq_mask(s, irq, cm & ALL_CPU_MASK);
+}
+
+static inline void gic_set_pending(gic_state *s, int irq, unsigned cm,
+                                   bool pending)
+{
+    if (pending) {
+        s->irq_state[irq].pending |= cm;
+    } else {
+        s->irq_state[irq].pending &= ~cm;
+    }
+    gic_sync_irq_mask(s, irq, cm & ALL_CPU_MASK);
+}
+
 void gic_set_pending_private(gic_state *s, int cpu, int irq);
 uint32_t gic_acknowledge_irq(gic_state *s, int cpu);
 void gic_complete_irq(gic_state *s, int cpu, int irq);
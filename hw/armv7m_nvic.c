@@ -330,12 +330,14 @@ static void nvic_writel(void *opaque, uint32_t offset, uint32_t value)
             armv7m_nvic_set_pending(s, ARMV7M_EXCP_PENDSV);
         } else if (value & (1 << 27)) {
             s->gic.irq_state[ARMV7M_EXCP_PENDSV].pending = 0;
+            gic_sync_irq(&s->gic, ARMV7M_EXCP_PENDSV);
             gic_update(&s->gic);
         }
         if (value & (1 << 26)) {
             armv7m_nvic_set_pending(s, ARMV7M_EXCP_SYSTICK);
         } else if (value & (1 << 25)) {
             s->gic.irq_state[ARMV7M_EXCP_SYSTICK].pending = 0;
+            gic_sync_irq(&s->gic, ARMV7M_EXCP_SYSTICK);
             gic_update(&s->gic);
         }
         break;
@@ -373,6 +375,9 @@ static void nvic_writel(void *opaque, uint32_t offset, uint32_t value)
         s->gic.irq_state[ARMV7M_EXCP_MEM].enabled = (value & (1 << 16)) != 0;
         s->gic.irq_state[ARMV7M_EXCP_BUS].enabled = (value & (1 << 17)) != 0;
         s->gic.irq_state[ARMV7M_EXCP_USAGE].enabled = (value & (1 << 18)) != 0;
+        gic_sync_irq(&s->gic, ARMV7M_EXCP_MEM);
+        gic_sync_irq(&s->gic, ARMV7M_EXCP_BUS);
+        gic_sync_irq(&s->gic, ARMV7M_EXCP_USAGE);
         break;
     case 0xd28: /* Configurable Fault Status.  */
     case 0xd2c: /* Hard Fault Status.  */
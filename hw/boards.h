@@ -14,12 +14,16 @@ typedef void QEMUMachineInitFunc(ram_addr_t ram_size,
 
 typedef void QEMUMachineResetFunc(void);
 
+typedef void QEMUMachineHotAddCPUFunc(const int64_t id, Error **errp);
+
 typedef struct QEMUMachine {
     const char *name;
     const char *alias;
     const char *desc;
     QEMUMachineInitFunc *init;
     QEMUMachineResetFunc *reset;
+    QEMUMachineHotAddCPUFunc *hot_add_cpu;
+    QEMUMachineHotAddCPUFunc *hot_remove_cpu;
     int use_scsi;
     int max_cpus;
     unsigned int no_serial:1,
@@ -0,0 +1,142 @@
+/*
+ * Linux AIO request queue
+ *
+ * The queue is not tied to the main loop: its owner waits on the eventfd
+ * returned by ioq_get_notifier() and calls ioq_run_completion() itself.
+ *
+ * Copyright 2012 Red Hat, Inc. and/or its affiliates
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "ioq.h"
+
+/* Returns 0 or a negative errno.  The caller adds the iocbs to the free list
+ * with ioq_put_iocb().
+ */
+int ioq_init(IOQueue *ioq, int fd, unsigned int max_reqs)
+{
+    int rc;
+
+    ioq->fd = fd;
+    ioq->max_reqs = max_reqs;
+
+    memset(&ioq->io_ctx, 0, sizeof ioq->io_ctx);
+    rc = io_setup(max_reqs, &ioq->io_ctx);
+    if (rc != 0) {
+        return rc;
+    }
+
+    rc = event_notifier_init(&ioq->io_notifier, 0);
+    if (rc != 0) {
+        io_destroy(ioq->io_ctx);
+        return rc;
+    }
+
+    ioq->freelist = g_malloc0(sizeof ioq->freelist[0] * max_reqs);
+    ioq->freelist_idx = 0;
+
+    ioq->queue = g_malloc0(sizeof ioq->queue[0] * max_reqs);
+    ioq->queue_idx = 0;
+    return 0;
+}
+
+void ioq_cleanup(IOQueue *ioq)
+{
+    g_free(ioq->freelist);
+    g_free(ioq->queue);
+
+    event_notifier_cleanup(&ioq->io_notifier);
+    io_destroy(ioq->io_ctx);
+}
+
+EventNotifier *ioq_get_notifier(IOQueue *ioq)
+{
+    return &ioq->io_notifier;
+}
+
+/* Returns NULL if all iocbs are in use */
+struct iocb *ioq_get_iocb(IOQueue *ioq)
+{
+    if (unlikely(ioq->freelist_idx == 0)) {
+        return NULL;
+    }
+    return ioq->freelist[--ioq->freelist_idx];
+}
+
+void ioq_put_iocb(IOQueue *ioq, struct iocb *iocb)
+{
+    assert(ioq->freelist_idx < ioq->max_reqs);
+    ioq->freelist[ioq->freelist_idx++] = iocb;
+}
+
+/* Queue a read or write on an iocb from ioq_get_iocb().  The kernel takes
+ * its own copy of @iov on submission, so it only needs to stay around until
+ * ioq_submit().
+ */
+void ioq_rdwr(IOQueue *ioq, struct iocb *iocb, bool read,
+              struct iovec *iov, unsigned int count, long long offset)
+{
+    assert(ioq->queue_idx < ioq->max_reqs);
+    ioq->queue[ioq->queue_idx++] = iocb;
+
+    if (read) {
+        io_prep_preadv(iocb, ioq->fd, iov, count, offset);
+    } else {
+        io_prep_pwritev(iocb, ioq->fd, iov, count, offset);
+    }
+    io_set_eventfd(iocb, event_notifier_get_fd(&ioq->io_notifier));
+}
+
+/* Submit all queued requests.  Requests that the kernel refuses are
+ * completed right away with an error.  Returns the number of requests
+ * submitted.
+ */
+int ioq_submit(IOQueue *ioq, IOQueueCompletion *completion, void *opaque)
+{
+    int rc, i;
+
+    rc = io_submit(ioq->io_ctx, ioq->queue_idx, ioq->queue);
+    for (i = MAX(rc, 0); i < ioq->queue_idx; i++) {
+        completion(ioq->queue[i], rc < 0 ? rc : -EIO, opaque);
+        ioq_put_iocb(ioq, ioq->queue[i]);
+    }
+    ioq->queue_idx = 0; /* reset */
+    return MAX(rc, 0);
+}
+
+static inline ssize_t io_event_ret(struct io_event *ev)
+{
+    return (ssize_t)(((uint64_t)ev->res2 << 32) | ev->res);
+}
+
+/* Call @completion for each finished request and put its iocb back on the
+ * free list.  Returns the number of requests completed or a negative errno.
+ */
+int ioq_run_completion(IOQueue *ioq, IOQueueCompletion *completion,
+                       void *opaque)
+{
+    struct io_event events[ioq->max_reqs];
+    int nevents, i, total = 0;
+
+    do {
+        do {
+            nevents = io_getevents(ioq->io_ctx, 0, ioq->max_reqs,
+                                   events, NULL);
+        } while (nevents == -EINTR);
+        if (nevents < 0) {
+            return nevents;
+        }
+
+        for (i = 0; i < nevents; i++) {
+            completion(events[i].obj, io_event_ret(&events[i]), opaque);
+            ioq_put_iocb(ioq, events[i].obj);
+        }
+        total += nevents;
+    } while (nevents == ioq->max_reqs);
+
+    return total;
+}
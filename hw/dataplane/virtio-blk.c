@@ -0,0 +1,542 @@
+/*
+ * Dedicated thread for virtio-blk I/O processing
+ *
+ * The thread services the virtqueue without taking the global mutex: it is
+ * kicked through the ioeventfd, submits requests straight to the image file
+ * with Linux AIO and raises the interrupt through the irqfd.  This only
+ * handles raw images opened with cache=none,aio=native; block layer features
+ * (I/O throttling, rerror/werror policies, accounting, image formats) are
+ * bypassed.
+ *
+ * Copyright 2012 Red Hat, Inc. and/or its affiliates
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include <sys/epoll.h>
+#include "qemu-common.h"
+#include "qemu-thread.h"
+#include "qemu-rcu.h"
+#include "qemu-error.h"
+#include "qerror.h"
+#include "iov.h"
+#include "block.h"
+#include "migration.h"
+#include "hw/virtio-blk.h"
+#include "hw/dataplane/vring.h"
+#include "hw/dataplane/ioq.h"
+#include "hw/dataplane/virtio-blk.h"
+
+enum {
+    SEG_MAX = 126,                  /* maximum number of I/O segments */
+    VRING_MAX = SEG_MAX + 2,        /* maximum number of vring descriptors */
+    REQ_MAX = VRING_MAX,            /* maximum number of requests in the vring,
+                                     * is VRING_MAX / 2 with traditional and
+                                     * VRING_MAX with indirect descriptors */
+};
+
+typedef struct {
+    struct iocb iocb;               /* Linux AIO control block */
+    unsigned int head;              /* vring descriptor index */
+    struct iovec iov[VRING_MAX];    /* guest buffers, headers included */
+    struct iovec *data_iov;         /* data part of iov[] */
+    unsigned int data_iov_cnt;
+    size_t len;                     /* length of the data */
+    bool read;
+    unsigned char *status;          /* virtio_blk_inhdr status byte */
+    struct iovec bounce_iov;        /* used if guest buffers are unaligned */
+} VirtIOBlockRequest;
+
+typedef struct {
+    EventNotifier *notifier;
+    void (*handler)(VirtIOBlockDataPlane *s);
+} DataPlaneEvent;
+
+struct VirtIOBlockDataPlane {
+    bool started;
+    bool stopping;
+    bool disabled;                  /* could not be started, use main loop */
+    QemuThread thread;
+
+    VirtIOBlkConf *blk;
+    int fd;                         /* image file descriptor */
+    bool read_only;
+
+    VirtIODevice *vdev;
+    Vring vring;                    /* virtqueue vring */
+    EventNotifier *guest_notifier;  /* irq */
+
+    int epoll_fd;                   /* the thread waits on these: */
+    DataPlaneEvent notify_event;    /* virtqueue ioeventfd */
+    DataPlaneEvent io_event;        /* Linux AIO completions */
+    DataPlaneEvent stop_event;      /* wake up, we are stopping */
+    EventNotifier stop_notifier;
+
+    IOQueue ioqueue;                /* Linux AIO queue */
+    VirtIOBlockRequest requests[REQ_MAX]; /* pool of requests, managed by the
+                                             queue */
+    unsigned int num_reqs;          /* requests in flight */
+
+    Error *migration_blocker;
+};
+
+/* Raise an interrupt to signal guest, if necessary */
+static void notify_guest(VirtIOBlockDataPlane *s)
+{
+    if (!vring_should_notify(s->vdev, &s->vring)) {
+        return;
+    }
+
+    event_notifier_set(s->guest_notifier);
+}
+
+/* Fill in the status and put the request on the used ring */
+static void finish_request(VirtIOBlockDataPlane *s, VirtIOBlockRequest *req,
+                           unsigned char status, size_t in_len)
+{
+    *req->status = status;
+    vring_push(&s->vring, req->head, in_len + sizeof(struct virtio_blk_inhdr));
+}
+
+static void complete_request(struct iocb *iocb, ssize_t ret, void *opaque)
+{
+    VirtIOBlockDataPlane *s = opaque;
+    VirtIOBlockRequest *req = container_of(iocb, VirtIOBlockRequest, iocb);
+    unsigned char status = VIRTIO_BLK_S_OK;
+
+    if (ret < 0 || ret != req->len) {
+        status = VIRTIO_BLK_S_IOERR;
+    }
+
+    if (req->bounce_iov.iov_base) {
+        /* Copy data back to the guest */
+        if (req->read && status == VIRTIO_BLK_S_OK) {
+            iov_from_buf(req->data_iov, req->data_iov_cnt, 0,
+                         req->bounce_iov.iov_base, req->len);
+        }
+        qemu_vfree(req->bounce_iov.iov_base);
+        req->bounce_iov.iov_base = NULL;
+    }
+
+    finish_request(s, req, status,
+                   req->read && status == VIRTIO_BLK_S_OK ? req->len : 0);
+    s->num_reqs--;
+}
+
+/* Requests that are completed without going through the ioqueue */
+static void complete_request_early(VirtIOBlockDataPlane *s,
+                                   VirtIOBlockRequest *req,
+                                   unsigned char status, size_t in_len)
+{
+    finish_request(s, req, status, in_len);
+    ioq_put_iocb(&s->ioqueue, &req->iocb);
+    s->num_reqs--;
+}
+
+static bool iov_is_aligned(struct iovec *iov, unsigned int iov_cnt,
+                           size_t align)
+{
+    unsigned int i;
+
+    for (i = 0; i < iov_cnt; i++) {
+        if (((uintptr_t)iov[i].iov_base | iov[i].iov_len) & (align - 1)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void do_rdwr_cmd(VirtIOBlockDataPlane *s, VirtIOBlockRequest *req,
+                        uint64_t sector)
+{
+    struct iovec *iov = req->data_iov;
+    unsigned int iov_cnt = req->data_iov_cnt;
+    uint32_t block_size = s->blk->conf.logical_block_size;
+
+    req->len = iov_size(iov, iov_cnt);
+    if ((sector * BDRV_SECTOR_SIZE) % block_size ||
+        req->len % block_size || (!req->read && s->read_only)) {
+        complete_request_early(s, req, VIRTIO_BLK_S_IOERR, 0);
+        return;
+    }
+
+    /* O_DIRECT needs aligned buffers, go through a bounce buffer if the
+     * guest's are not */
+    if (!iov_is_aligned(iov, iov_cnt, BDRV_SECTOR_SIZE)) {
+        req->bounce_iov.iov_base = qemu_memalign(BDRV_SECTOR_SIZE,
+                                                 MAX(req->len, 1));
+        req->bounce_iov.iov_len = req->len;
+        if (!req->read) {
+            iov_to_buf(iov, iov_cnt, 0, req->bounce_iov.iov_base, req->len);
+        }
+        iov = &req->bounce_iov;
+        iov_cnt = 1;
+    }
+
+    ioq_rdwr(&s->ioqueue, &req->iocb, req->read, iov, iov_cnt,
+             sector * BDRV_SECTOR_SIZE);
+}
+
+static void do_get_id_cmd(VirtIOBlockDataPlane *s, VirtIOBlockRequest *req)
+{
+    char id[VIRTIO_BLK_ID_BYTES];
+
+    /* Serial number not NUL-terminated when shorter than buffer */
+    strncpy(id, s->blk->serial ? s->blk->serial : "", sizeof(id));
+    iov_from_buf(req->data_iov, req->data_iov_cnt, 0, id, sizeof(id));
+    complete_request_early(s, req, VIRTIO_BLK_S_OK,
+                           MIN(iov_size(req->data_iov, req->data_iov_cnt),
+                               sizeof(id)));
+}
+
+static void do_flush_cmd(VirtIOBlockDataPlane *s, VirtIOBlockRequest *req)
+{
+    unsigned char status = VIRTIO_BLK_S_OK;
+
+    /* Completed writes are on the file already, only the disk cache is
+     * left to flush */
+    if (qemu_fdatasync(s->fd) < 0) {
+        status = VIRTIO_BLK_S_IOERR;
+    }
+    complete_request_early(s, req, status, 0);
+}
+
+/* Returns false if the request is malformed */
+static bool process_request(VirtIOBlockDataPlane *s, VirtIOBlockRequest *req,
+                            unsigned int out_num, unsigned int in_num)
+{
+    struct iovec *iov = req->iov;
+    struct iovec *in_iov = &req->iov[out_num];
+    struct virtio_blk_outhdr *outhdr;
+    uint32_t type;
+
+    if (out_num < 1 || in_num < 1) {
+        error_report("virtio-blk missing headers");
+        return false;
+    }
+
+    if (iov[0].iov_len < sizeof(*outhdr) ||
+        in_iov[in_num - 1].iov_len < sizeof(struct virtio_blk_inhdr)) {
+        error_report("virtio-blk header not in correct element");
+        return false;
+    }
+
+    outhdr = iov[0].iov_base;
+    req->status = in_iov[in_num - 1].iov_base;
+    req->bounce_iov.iov_base = NULL;
+
+    type = ldl_p(&outhdr->type);
+
+    if (type & VIRTIO_BLK_T_FLUSH) {
+        do_flush_cmd(s, req);
+    } else if (type & VIRTIO_BLK_T_SCSI_CMD) {
+        complete_request_early(s, req, VIRTIO_BLK_S_UNSUPP, 0);
+    } else if (type & VIRTIO_BLK_T_GET_ID) {
+        req->data_iov = in_iov;
+        req->data_iov_cnt = in_num - 1;
+        do_get_id_cmd(s, req);
+    } else if (type & VIRTIO_BLK_T_OUT) {
+        req->read = false;
+        req->data_iov = &iov[1];
+        req->data_iov_cnt = out_num - 1;
+        do_rdwr_cmd(s, req, ldq_p(&outhdr->sector));
+    } else {
+        req->read = true;
+        req->data_iov = in_iov;
+        req->data_iov_cnt = in_num - 1;
+        do_rdwr_cmd(s, req, ldq_p(&outhdr->sector));
+    }
+    return true;
+}
+
+static void handle_notify(VirtIOBlockDataPlane *s)
+{
+    VirtIOBlockRequest *req;
+    struct iocb *iocb;
+    unsigned int out_num, in_num;
+    int head = -EAGAIN;
+
+    event_notifier_test_and_clear(s->notify_event.notifier);
+    if (s->stopping) {
+        return;
+    }
+
+    for (;;) {
+        /* Disable guest->host notifies to avoid unnecessary vmexits */
+        vring_disable_notification(s->vdev, &s->vring);
+
+        /* There are as many requests as vring entries, so an iocb is
+         * always available for a new descriptor chain */
+        while ((iocb = ioq_get_iocb(&s->ioqueue))) {
+            req = container_of(iocb, VirtIOBlockRequest, iocb);
+            head = vring_pop(s->vdev, &s->vring, req->iov,
+                             req->iov + VRING_MAX, &out_num, &in_num);
+            if (head < 0) {
+                ioq_put_iocb(&s->ioqueue, iocb);
+                break;
+            }
+
+            req->head = head;
+            s->num_reqs++;
+            if (!process_request(s, req, out_num, in_num)) {
+                ioq_put_iocb(&s->ioqueue, iocb);
+                s->num_reqs--;
+                s->vring.broken = true;
+                head = -EFAULT;
+                break;
+            }
+        }
+
+        if (head != -EAGAIN) {
+            /* fatal error, the guest gets no more service */
+            break;
+        }
+
+        /* Re-enable guest->host notifies and stop processing the vring.
+         * But if the guest has snuck in more descriptors, keep processing.
+         */
+        if (vring_enable_notification(s->vdev, &s->vring)) {
+            break;
+        }
+    }
+
+    if (ioq_num_queued(&s->ioqueue)) {
+        ioq_submit(&s->ioqueue, complete_request, s);
+    }
+
+    /* Requests may complete right away (flush, errors) */
+    notify_guest(s);
+}
+
+static void handle_io(VirtIOBlockDataPlane *s)
+{
+    event_notifier_test_and_clear(s->io_event.notifier);
+    if (ioq_run_completion(&s->ioqueue, complete_request, s) > 0) {
+        notify_guest(s);
+    }
+}
+
+static void handle_stop(VirtIOBlockDataPlane *s)
+{
+    event_notifier_test_and_clear(s->stop_event.notifier);
+}
+
+static void *data_plane_thread(void *opaque)
+{
+    VirtIOBlockDataPlane *s = opaque;
+
+    rcu_register_thread();
+
+    /* Keep going until requests in flight are done after a stop request */
+    do {
+        struct epoll_event events[3];
+        int i, nevents;
+
+        nevents = epoll_wait(s->epoll_fd, events, ARRAY_SIZE(events), -1);
+        for (i = 0; i < nevents; i++) {
+            DataPlaneEvent *event = events[i].data.ptr;
+
+            event->handler(s);
+        }
+    } while (!s->stopping || s->num_reqs > 0);
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static int add_event(VirtIOBlockDataPlane *s, DataPlaneEvent *event,
+                     EventNotifier *notifier,
+                     void (*handler)(VirtIOBlockDataPlane *s))
+{
+    struct epoll_event epoll_event = {
+        .events = EPOLLIN,
+        .data.ptr = event,
+    };
+
+    event->notifier = notifier;
+    event->handler = handler;
+    return epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD,
+                     event_notifier_get_fd(notifier), &epoll_event);
+}
+
+/* Returns false, and reports why, if @blk can not be used with a data
+ * plane.  *dataplane is left NULL when the data plane is not requested.
+ */
+bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *blk,
+                                  VirtIOBlockDataPlane **dataplane)
+{
+    VirtIOBlockDataPlane *s;
+    int fd;
+
+    *dataplane = NULL;
+
+    if (!blk->data_plane) {
+        return true;
+    }
+
+    if (blk->scsi) {
+        error_report("device is incompatible with x-data-plane, "
+                     "use scsi=off");
+        return false;
+    }
+
+    if (blk->config_wce) {
+        error_report("device is incompatible with x-data-plane, "
+                     "use config-wce=off");
+        return false;
+    }
+
+    fd = raw_get_aio_fd(blk->conf.bs);
+    if (fd < 0) {
+        error_report("drive is incompatible with x-data-plane, "
+                     "use format=raw,cache=none,aio=native");
+        return false;
+    }
+
+    s = g_new0(VirtIOBlockDataPlane, 1);
+    s->vdev = vdev;
+    s->fd = fd;
+    s->blk = blk;
+    s->read_only = bdrv_is_read_only(blk->conf.bs);
+
+    /* Prevent block operations that conflict with data plane thread */
+    bdrv_set_in_use(blk->conf.bs, 1);
+
+    error_set(&s->migration_blocker, QERR_DEVICE_FEATURE_BLOCKS_MIGRATION,
+              "x-data-plane", "virtio-blk");
+    migrate_add_blocker(s->migration_blocker);
+
+    *dataplane = s;
+    return true;
+}
+
+void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
+{
+    if (!s) {
+        return;
+    }
+
+    virtio_blk_data_plane_stop(s);
+    migrate_del_blocker(s->migration_blocker);
+    error_free(s->migration_blocker);
+    bdrv_set_in_use(s->blk->conf.bs, 0);
+    g_free(s);
+}
+
+/* Returns true if the thread services the virtqueue, false if the main loop
+ * has to.
+ */
+bool virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
+{
+    VirtQueue *vq;
+    int i;
+
+    if (s->started) {
+        return true;
+    }
+    if (s->disabled) {
+        return false;
+    }
+
+    vq = virtio_get_queue(s->vdev, 0);
+    if (!vring_setup(&s->vring, s->vdev, 0)) {
+        s->disabled = true;
+        return false;
+    }
+    if (vring_get_num(&s->vring) > REQ_MAX) {
+        error_report("virtio-blk vring size %u is too large for x-data-plane",
+                     vring_get_num(&s->vring));
+        goto fail_vring;
+    }
+
+    /* Set up guest notifier (irq) */
+    if (s->vdev->binding->set_guest_notifiers(s->vdev->binding_opaque,
+                                              true) != 0) {
+        error_report("virtio-blk failed to set guest notifier, "
+                     "ensure -enable-kvm is set");
+        goto fail_vring;
+    }
+    s->guest_notifier = virtio_queue_get_guest_notifier(vq);
+
+    /* Set up virtqueue notify */
+    if (s->vdev->binding->set_host_notifier(s->vdev->binding_opaque,
+                                            0, true) != 0) {
+        error_report("virtio-blk failed to set host notifier");
+        goto fail_guest_notifiers;
+    }
+
+    if (ioq_init(&s->ioqueue, s->fd, REQ_MAX) < 0) {
+        error_report("virtio-blk failed to set up Linux AIO");
+        goto fail_host_notifier;
+    }
+    for (i = 0; i < ARRAY_SIZE(s->requests); i++) {
+        ioq_put_iocb(&s->ioqueue, &s->requests[i].iocb);
+    }
+
+    event_notifier_init(&s->stop_notifier, 0);
+    s->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (s->epoll_fd < 0 ||
+        add_event(s, &s->notify_event, virtio_queue_get_host_notifier(vq),
+                  handle_notify) < 0 ||
+        add_event(s, &s->io_event, ioq_get_notifier(&s->ioqueue),
+                  handle_io) < 0 ||
+        add_event(s, &s->stop_event, &s->stop_notifier, handle_stop) < 0) {
+        error_report("virtio-blk failed to set up x-data-plane thread: %s",
+                     strerror(errno));
+        goto fail_epoll;
+    }
+
+    s->num_reqs = 0;
+    s->stopping = false;
+    s->started = true;
+    qemu_thread_create(&s->thread, data_plane_thread, s, QEMU_THREAD_JOINABLE);
+
+    /* Kick right away to begin processing requests already in vring */
+    event_notifier_set(virtio_queue_get_host_notifier(vq));
+    return true;
+
+fail_epoll:
+    if (s->epoll_fd >= 0) {
+        close(s->epoll_fd);
+    }
+    event_notifier_cleanup(&s->stop_notifier);
+    ioq_cleanup(&s->ioqueue);
+fail_host_notifier:
+    s->vdev->binding->set_host_notifier(s->vdev->binding_opaque, 0, false);
+fail_guest_notifiers:
+    s->vdev->binding->set_guest_notifiers(s->vdev->binding_opaque, false);
+fail_vring:
+    vring_teardown(&s->vring, s->vdev, 0);
+    s->disabled = true;
+    error_report("virtio-blk falling back to processing requests in the "
+                 "main loop");
+    return false;
+}
+
+void virtio_blk_data_plane_stop(VirtIOBlockDataPlane *s)
+{
+    if (!s->started || s->stopping) {
+        return;
+    }
+    s->stopping = true;
+
+    /* Tell the thread to stop and wait for requests in flight */
+    event_notifier_set(&s->stop_notifier);
+    qemu_thread_join(&s->thread);
+
+    close(s->epoll_fd);
+    event_notifier_cleanup(&s->stop_notifier);
+    ioq_cleanup(&s->ioqueue);
+
+    /* Sync vring state back to virtqueue so that non-dataplane request
+     * processing can continue when we disable the host notifier below.
+     */
+    vring_teardown(&s->vring, s->vdev, 0);
+
+    s->vdev->binding->set_host_notifier(s->vdev->binding_opaque, 0, false);
+    s->vdev->binding->set_guest_notifiers(s->vdev->binding_opaque, false);
+
+    s->started = false;
+    s->stopping = false;
+}
@@ -116,6 +116,9 @@ typedef struct E1000State_st {
         int8_t ip;
         int8_t tcp;
         char cptse;     // current packet tse bit
+        /* TSO: sum of the segment payload, accumulated as it is fetched */
+        uint32_t payload_sum;
+        bool payload_sum_valid;
     } tx;
 
     struct {
@@ -127,8 +130,26 @@ typedef struct E1000State_st {
     } eecd_state;
 
     QEMUTimer *autoneg_timer;
+
+    /* descriptor rings, see e1000_ring_rw() */
+    PhysMemoryCache tx_ring;
+    PhysMemoryCache rx_ring;
+
+    /* Interrupt mitigation */
+    QEMUTimer *mit_timer;       /* delays the next rising edge of the irq */
+    bool mit_timer_on;          /* mitigation window is open */
+    bool mit_irq_level;         /* last level driven on the irq line */
+    uint32_t mit_ide;           /* a tx descriptor asked for a delay */
+
+/* Compatibility flags for migration to/from older versions */
+#define E1000_FLAG_MIT_BIT 0
+#define E1000_FLAG_MIT (1 << E1000_FLAG_MIT_BIT)
+    uint32_t compat_flags;
 } E1000State;
 
+/* Descriptors fetched from and written back to guest memory at once */
+#define E1000_DESC_BATCH 16
+
 #define	defreg(x)	x = (E1000_##x>>2)
 enum {
     defreg(CTRL),	defreg(EECD),	defreg(EERD),	defreg(GPRC),
@@ -141,7 +162,8 @@ enum {
     defreg(TORH),	defreg(TORL),	defreg(TOTH),	defreg(TOTL),
     defreg(TPR),	defreg(TPT),	defreg(TXDCTL),	defreg(WUFC),
     defreg(RA),		defreg(MTA),	defreg(CRCERRS),defreg(VFTA),
-    defreg(VET),
+    defreg(VET),	defreg(RDTR),	defreg(RADV),	defreg(TADV),
+    defreg(ITR),
 };
 
 static void
@@ -220,16 +242,73 @@ static const uint32_t mac_reg_init[] = {
                 E1000_MANC_RMCP_EN,
 };
 
+/* Keep the shortest non-zero delay */
+static void
+mit_update_delay(uint32_t *curr, uint32_t value)
+{
+    if (value && (*curr == 0 || value < *curr)) {
+        *curr = value;
+    }
+}
+
 static void
 set_interrupt_cause(E1000State *s, int index, uint32_t val)
 {
+    uint32_t pending_ints;
+    uint32_t mit_delay;
+
     if (val && (E1000_DEVID >= E1000_DEV_ID_82547EI_MOBILE)) {
         /* Only for 8257x */
         val |= E1000_ICR_INT_ASSERTED;
     }
     s->mac_reg[ICR] = val;
     s->mac_reg[ICS] = val;
-    qemu_set_irq(s->dev.irq[0], (s->mac_reg[IMS] & s->mac_reg[ICR]) != 0);
+
+    pending_ints = s->mac_reg[IMS] & s->mac_reg[ICR];
+    if (!s->mit_irq_level && pending_ints) {
+        /*
+         * This is a rising edge.  Inside the mitigation window, postpone
+         * it until the timer expires; the causes accumulate in ICR.
+         * Like the hardware, RADV and TADV count in units of 1024 ns and
+         * ITR in units of 256 ns.  RDTR only enables RADV: the relative
+         * timers, RDTR and TIDV, that restart at every packet are not
+         * emulated.
+         */
+        if (s->mit_timer_on) {
+            return;
+        }
+        if (s->compat_flags & E1000_FLAG_MIT) {
+            mit_delay = 0;
+            if (s->mit_ide &&
+                (pending_ints & (E1000_ICR_TXQE | E1000_ICR_TXDW))) {
+                mit_update_delay(&mit_delay, s->mac_reg[TADV] * 4);
+            }
+            if (s->mac_reg[RDTR] && (pending_ints & E1000_ICS_RXT0)) {
+                mit_update_delay(&mit_delay, s->mac_reg[RADV] * 4);
+            }
+            mit_update_delay(&mit_delay, s->mac_reg[ITR]);
+
+            if (mit_delay) {
+                s->mit_timer_on = true;
+                qemu_mod_timer(s->mit_timer,
+                               qemu_get_clock_ns(vm_clock) + mit_delay * 256);
+            }
+            s->mit_ide = 0;
+        }
+    }
+
+    s->mit_irq_level = (pending_ints != 0);
+    qemu_set_irq(s->dev.irq[0], s->mit_irq_level);
+}
+
+static void
+e1000_mit_timer(void *opaque)
+{
+    E1000State *s = opaque;
+
+    s->mit_timer_on = false;
+    /* raise the irq now if causes were held back */
+    set_interrupt_cause(s, 0, s->mac_reg[ICR]);
 }
 
 static void
@@ -268,12 +347,17 @@ static void e1000_reset(void *opaque)
     E1000State *d = opaque;
 
     qemu_del_timer(d->autoneg_timer);
+    qemu_del_timer(d->mit_timer);
+    d->mit_timer_on = false;
+    d->mit_irq_level = false;
+    d->mit_ide = 0;
     memset(d->phy_reg, 0, sizeof d->phy_reg);
     memmove(d->phy_reg, phy_reg_init, sizeof phy_reg_init);
     memset(d->mac_reg, 0, sizeof d->mac_reg);
     memmove(d->mac_reg, mac_reg_init, sizeof mac_reg_init);
     d->rxbuf_min_shift = 1;
     memset(&d->tx, 0, sizeof d->tx);
+    d->tx.payload_sum_valid = true;
 
     if (d->nic->nc.link_down) {
         e1000_link_down(d);
@@ -452,6 +536,27 @@ e1000_send_packet(E1000State *s, const uint8_t *buf, int size)
     }
 }
 
+/* For TSO segments the payload sum was accumulated while fetching the
+ * data, only the header, whose fields change for every segment, has to be
+ * summed here.
+ */
+static bool
+putsum_tso(struct e1000_tx *tp)
+{
+    unsigned int hdr = tp->hdr_len;
+    uint32_t sum;
+
+    if (!tp->payload_sum_valid || tp->tucse ||
+        hdr < tp->tucss + (tp->tcp ? 20 : 8) || tp->tucso + 2 > hdr) {
+        return false;
+    }
+    sum = net_checksum_add(hdr - tp->tucss, tp->data + tp->tucss) +
+          tp->payload_sum;
+    cpu_to_be16wu((uint16_t *)(tp->data + tp->tucso),
+                  net_checksum_finish(sum));
+    return true;
+}
+
 static void
 xmit_seg(E1000State *s)
 {
@@ -493,8 +598,11 @@ xmit_seg(E1000State *s)
         tp->tso_frames++;
     }
 
-    if (tp->sum_needed & E1000_TXD_POPTS_TXSM)
-        putsum(tp->data, tp->size, tp->tucso, tp->tucss, tp->tucse);
+    if (tp->sum_needed & E1000_TXD_POPTS_TXSM) {
+        if (!(tp->tse && tp->cptse && putsum_tso(tp))) {
+            putsum(tp->data, tp->size, tp->tucso, tp->tucss, tp->tucse);
+        }
+    }
     if (tp->sum_needed & E1000_TXD_POPTS_IXSM)
         putsum(tp->data, tp->size, tp->ipcso, tp->ipcss, tp->ipcse);
     if (tp->vlan_needed) {
@@ -522,6 +630,7 @@ process_tx_desc(E1000State *s, struct e1000_tx_desc *dp)
     struct e1000_context_desc *xp = (struct e1000_context_desc *)dp;
     struct e1000_tx *tp = &s->tx;
 
+    s->mit_ide |= (txd_lower & E1000_TXD_CMD_IDE);
     if (dtype == E1000_TXD_CMD_DEXT) {	// context descriptor
         op = le32_to_cpu(xp->cmd_and_length);
         tp->ipcss = xp->lower_setup.ip_fields.ipcss;
@@ -537,6 +646,9 @@ process_tx_desc(E1000State *s, struct e1000_tx_desc *dp)
         tp->tcp = (op & E1000_TXD_CMD_TCP) ? 1 : 0;
         tp->tse = (op & E1000_TXD_CMD_TSE) ? 1 : 0;
         tp->tso_frames = 0;
+        if (tp->size) {
+            tp->payload_sum_valid = false;
+        }
         if (tp->tucso == 0) {	// this is probably wrong
             DBGOUT(TXSUM, "TCP/UDP: cso 0!\n");
             tp->tucso = tp->tucss + (tp->tcp ? 16 : 6);
@@ -575,12 +687,21 @@ process_tx_desc(E1000State *s, struct e1000_tx_desc *dp)
             pci_dma_read(&s->dev, addr, tp->data + tp->size, bytes);
             if ((sz = tp->size + bytes) >= hdr && tp->size < hdr)
                 memmove(tp->header, tp->data, hdr);
+            if (sz > hdr && hdr > tp->tucss) {
+                /* sum the payload while it is still in the cache */
+                unsigned int start = MAX(tp->size, hdr);
+                tp->payload_sum += net_checksum_add_cont(sz - start,
+                                                         tp->data + start,
+                                                         start - tp->tucss);
+            }
             tp->size = sz;
             addr += bytes;
             if (sz == msh) {
                 xmit_seg(s);
                 memmove(tp->data, tp->header, hdr);
                 tp->size = hdr;
+                tp->payload_sum = 0;
+                tp->payload_sum_valid = true;
             }
         } while (split_size -= bytes);
     } else if (!tp->tse && tp->cptse) {
@@ -590,6 +711,7 @@ process_tx_desc(E1000State *s, struct e1000_tx_desc *dp)
         split_size = MIN(sizeof(tp->data) - tp->size, split_size);
         pci_dma_read(&s->dev, addr, tp->data + tp->size, split_size);
         tp->size += split_size;
+        tp->payload_sum_valid = false;
     }
 
     if (!(txd_lower & E1000_TXD_CMD_EOP))
@@ -601,6 +723,41 @@ process_tx_desc(E1000State *s, struct e1000_tx_desc *dp)
     tp->vlan_needed = 0;
     tp->size = 0;
     tp->cptse = 0;
+    tp->payload_sum = 0;
+    tp->payload_sum_valid = true;
+}
+
+/* Descriptor accesses go through a mapping of the whole ring, made again
+ * when the guest moves or resizes it.  Without an IOMMU that saves the
+ * memory map lookup of every descriptor fetch and write back.
+ */
+static void
+e1000_ring_rw(E1000State *s, PhysMemoryCache *ring, dma_addr_t ring_base,
+              dma_addr_t ring_len, dma_addr_t addr, void *buf, dma_addr_t len,
+              DMADirection dir)
+{
+    if (dma_has_iommu(pci_dma_context(&s->dev))) {
+        pci_dma_rw(&s->dev, addr, buf, len, dir);
+        return;
+    }
+
+    if (ring->addr != ring_base || ring->len != ring_len) {
+        cpu_physical_memory_map_cached(ring, ring_base, ring_len, true);
+    }
+    dma_barrier(NULL, dir);
+    if (dir == DMA_DIRECTION_FROM_DEVICE) {
+        cpu_physical_memory_write_cached(ring, addr - ring_base, buf, len);
+    } else {
+        cpu_physical_memory_read_cached(ring, addr - ring_base, buf, len);
+    }
+}
+
+static uint64_t tx_desc_base(E1000State *s)
+{
+    uint64_t bah = s->mac_reg[TDBAH];
+    uint64_t bal = s->mac_reg[TDBAL] & ~0xf;
+
+    return (bah << 32) + bal;
 }
 
 static uint32_t
@@ -613,25 +770,42 @@ txdesc_writeback(E1000State *s, dma_addr_t base, struct e1000_tx_desc *dp)
     txd_upper = (le32_to_cpu(dp->upper.data) | E1000_TXD_STAT_DD) &
                 ~(E1000_TXD_STAT_EC | E1000_TXD_STAT_LC | E1000_TXD_STAT_TU);
     dp->upper.data = cpu_to_le32(txd_upper);
-    pci_dma_write(&s->dev, base + ((char *)&dp->upper - (char *)dp),
-                  &dp->upper, sizeof(dp->upper));
+    e1000_ring_rw(s, &s->tx_ring, tx_desc_base(s), s->mac_reg[TDLEN],
+                  base + ((char *)&dp->upper - (char *)dp),
+                  &dp->upper, sizeof(dp->upper), DMA_DIRECTION_FROM_DEVICE);
     return E1000_ICR_TXDW;
 }
 
-static uint64_t tx_desc_base(E1000State *s)
+/* Fetch the descriptors from index head up to tail, but not past the end
+ * of the ring or more than max, with a single DMA.  Returns the number
+ * of descriptors read.
+ */
+static unsigned int
+e1000_fetch_descs(E1000State *s, PhysMemoryCache *cache, dma_addr_t ring,
+                  uint32_t head, uint32_t tail, uint32_t ring_size,
+                  void *descs, size_t desc_size, unsigned int max)
 {
-    uint64_t bah = s->mac_reg[TDBAH];
-    uint64_t bal = s->mac_reg[TDBAL] & ~0xf;
+    unsigned int n;
 
-    return (bah << 32) + bal;
+    n = (tail > head ? tail : ring_size) - head;
+    n = MIN(n, max);
+    if (n == 0) {
+        /* bogus ring size, let the caller see one descriptor */
+        n = 1;
+    }
+    e1000_ring_rw(s, cache, ring, ring_size * desc_size,
+                  ring + head * desc_size, descs, n * desc_size,
+                  DMA_DIRECTION_TO_DEVICE);
+    return n;
 }
 
 static void
 start_xmit(E1000State *s)
 {
     dma_addr_t base;
-    struct e1000_tx_desc desc;
+    struct e1000_tx_desc descs[E1000_DESC_BATCH], *dp;
     uint32_t tdh_start = s->mac_reg[TDH], cause = E1000_ICS_TXQE;
+    unsigned int i = 0, n = 0;
 
     if (!(s->mac_reg[TCTL] & E1000_TCTL_EN)) {
         DBGOUT(TX, "tx disabled\n");
@@ -639,19 +813,30 @@ start_xmit(E1000State *s)
     }
 
     while (s->mac_reg[TDH] != s->mac_reg[TDT]) {
+        if (i == n) {
+            n = e1000_fetch_descs(s, &s->tx_ring, tx_desc_base(s),
+                                  s->mac_reg[TDH],
+                                  s->mac_reg[TDT],
+                                  s->mac_reg[TDLEN] / sizeof(*dp),
+                                  descs, sizeof(*dp), E1000_DESC_BATCH);
+            i = 0;
+        }
+        dp = &descs[i++];
         base = tx_desc_base(s) +
                sizeof(struct e1000_tx_desc) * s->mac_reg[TDH];
-        pci_dma_read(&s->dev, base, &desc, sizeof(desc));
 
         DBGOUT(TX, "index %d: %p : %x %x\n", s->mac_reg[TDH],
-               (void *)(intptr_t)desc.buffer_addr, desc.lower.data,
-               desc.upper.data);
+               (void *)(intptr_t)dp->buffer_addr, dp->lower.data,
+               dp->upper.data);
 
-        process_tx_desc(s, &desc);
-        cause |= txdesc_writeback(s, base, &desc);
+        process_tx_desc(s, dp);
+        cause |= txdesc_writeback(s, base, dp);
 
-        if (++s->mac_reg[TDH] * sizeof(desc) >= s->mac_reg[TDLEN])
+        if (++s->mac_reg[TDH] * sizeof(*dp) >= s->mac_reg[TDLEN]) {
             s->mac_reg[TDH] = 0;
+            /* continue from the start of the ring */
+            n = i;
+        }
         /*
          * the following could happen only if guest sw assigns
          * bogus values to TDT/TDLEN.
@@ -773,9 +958,9 @@ static ssize_t
 e1000_receive(NetClientState *nc, const uint8_t *buf, size_t size)
 {
     E1000State *s = DO_UPCAST(NICState, nc, nc)->opaque;
-    struct e1000_rx_desc desc;
-    dma_addr_t base;
-    unsigned int n, rdt;
+    struct e1000_rx_desc descs[E1000_DESC_BATCH], *dp;
+    dma_addr_t base = 0;
+    unsigned int n, rdt, i = 0, nfetched = 0;
     uint32_t rdh_start;
     uint16_t vlan_special = 0;
     uint8_t vlan_status = 0, vlan_offset = 0;
@@ -818,40 +1003,70 @@ e1000_receive(NetClientState *nc, const uint8_t *buf, size_t size)
         if (desc_size > s->rxbuf_size) {
             desc_size = s->rxbuf_size;
         }
-        base = rx_desc_base(s) + sizeof(desc) * s->mac_reg[RDH];
-        pci_dma_read(&s->dev, base, &desc, sizeof(desc));
-        desc.special = vlan_special;
-        desc.status |= (vlan_status | E1000_RXD_STAT_DD);
-        if (desc.buffer_addr) {
+        if (i == nfetched) {
+            /* fetch no more descriptors than the rest of the packet needs,
+             * they may not belong to the device yet.  The write back of
+             * the previous batch ends before this point.
+             */
+            unsigned int needed = DIV_ROUND_UP(total_size - desc_offset,
+                                               s->rxbuf_size);
+            base = rx_desc_base(s) + sizeof(*dp) * s->mac_reg[RDH];
+            nfetched = e1000_fetch_descs(s, &s->rx_ring, rx_desc_base(s),
+                                         s->mac_reg[RDH],
+                                         s->mac_reg[RDT],
+                                         s->mac_reg[RDLEN] / sizeof(*dp),
+                                         descs, sizeof(*dp),
+                                         MIN(needed, E1000_DESC_BATCH));
+            i = 0;
+        }
+        dp = &descs[i++];
+        dp->special = vlan_special;
+        dp->status |= (vlan_status | E1000_RXD_STAT_DD);
+        if (dp->buffer_addr) {
             if (desc_offset < size) {
                 size_t copy_size = size - desc_offset;
                 if (copy_size > s->rxbuf_size) {
                     copy_size = s->rxbuf_size;
                 }
-                pci_dma_write(&s->dev, le64_to_cpu(desc.buffer_addr),
+                pci_dma_write(&s->dev, le64_to_cpu(dp->buffer_addr),
                               buf + desc_offset + vlan_offset, copy_size);
             }
             desc_offset += desc_size;
-            desc.length = cpu_to_le16(desc_size);
+            dp->length = cpu_to_le16(desc_size);
             if (desc_offset >= total_size) {
-                desc.status |= E1000_RXD_STAT_EOP | E1000_RXD_STAT_IXSM;
+                dp->status |= E1000_RXD_STAT_EOP | E1000_RXD_STAT_IXSM;
             } else {
                 /* Guest zeroing out status is not a hardware requirement.
                    Clear EOP in case guest didn't do it. */
-                desc.status &= ~E1000_RXD_STAT_EOP;
+                dp->status &= ~E1000_RXD_STAT_EOP;
             }
         } else { // as per intel docs; skip descriptors with null buf addr
             DBGOUT(RX, "Null RX descriptor!!\n");
         }
-        pci_dma_write(&s->dev, base, &desc, sizeof(desc));
 
-        if (++s->mac_reg[RDH] * sizeof(desc) >= s->mac_reg[RDLEN])
+        if (++s->mac_reg[RDH] * sizeof(*dp) >= s->mac_reg[RDLEN]) {
             s->mac_reg[RDH] = 0;
+            nfetched = i;
+        }
+        if (i == nfetched || desc_offset >= total_size) {
+            /* all buffers of the batch are written, now hand back the
+             * descriptors with a single DMA
+             */
+            e1000_ring_rw(s, &s->rx_ring, rx_desc_base(s), s->mac_reg[RDLEN],
+                          base, descs, i * sizeof(*dp),
+                          DMA_DIRECTION_FROM_DEVICE);
+            nfetched = i;
+        }
         s->check_rxov = 1;
         /* see comment in start_xmit; same here */
         if (s->mac_reg[RDH] == rdh_start) {
             DBGOUT(RXERR, "RDH wraparound @%x, RDT %x, RDLEN %x\n",
                    rdh_start, s->mac_reg[RDT], s->mac_reg[RDLEN]);
+            if (i != nfetched) {
+                e1000_ring_rw(s, &s->rx_ring, rx_desc_base(s),
+                              s->mac_reg[RDLEN], base, descs, i * sizeof(*dp),
+                              DMA_DIRECTION_FROM_DEVICE);
+            }
             set_ics(s, 0, E1000_ICS_RXO);
             return -1;
         }
@@ -870,8 +1085,8 @@ e1000_receive(NetClientState *nc, const uint8_t *buf, size_t size)
 
     n = E1000_ICS_RXT0;
     if ((rdt = s->mac_reg[RDT]) < s->mac_reg[RDH])
-        rdt += s->mac_reg[RDLEN] / sizeof(desc);
-    if (((rdt - s->mac_reg[RDH]) * sizeof(desc)) <= s->mac_reg[RDLEN] >>
+        rdt += s->mac_reg[RDLEN] / sizeof(*dp);
+    if (((rdt - s->mac_reg[RDH]) * sizeof(*dp)) <= s->mac_reg[RDLEN] >>
         s->rxbuf_min_shift)
         n |= E1000_ICS_RXDMT0;
 
@@ -977,7 +1192,8 @@ static uint32_t (*macreg_readops[])(E1000State *, int) = {
     getreg(TORL),	getreg(TOTL),	getreg(IMS),	getreg(TCTL),
     getreg(RDH),	getreg(RDT),	getreg(VET),	getreg(ICS),
     getreg(TDBAL),	getreg(TDBAH),	getreg(RDBAH),	getreg(RDBAL),
-    getreg(TDLEN),	getreg(RDLEN),
+    getreg(TDLEN),	getreg(RDLEN),	getreg(RDTR),	getreg(RADV),
+    getreg(TADV),	getreg(ITR),
 
     [TOTH] = mac_read_clr8,	[TORH] = mac_read_clr8,	[GPRC] = mac_read_clr4,
     [GPTC] = mac_read_clr4,	[TPR] = mac_read_clr4,	[TPT] = mac_read_clr4,
@@ -999,6 +1215,8 @@ static void (*macreg_writeops[])(E1000State *, int, uint32_t) = {
     [TDH] = set_16bit,	[RDH] = set_16bit,	[RDT] = set_rdt,
     [IMC] = set_imc,	[IMS] = set_ims,	[ICR] = set_icr,
     [EECD] = set_eecd,	[RCTL] = set_rx_control, [CTRL] = set_ctrl,
+    [RDTR] = set_16bit,	[RADV] = set_16bit,	[TADV] = set_16bit,
+    [ITR] = set_16bit,
     [RA ... RA+31] = &mac_writereg,
     [MTA ... MTA+127] = &mac_writereg,
     [VFTA ... VFTA+127] = &mac_writereg,
@@ -1075,11 +1293,52 @@ static bool is_version_1(void *opaque, int version_id)
     return version_id == 1;
 }
 
+static int e1000_post_load(void *opaque, int version_id)
+{
+    E1000State *s = opaque;
+
+    /* the payload sum is not migrated, recompute a partial segment */
+    s->tx.payload_sum = 0;
+    s->tx.payload_sum_valid = (s->tx.size == 0);
+
+    if (!(s->compat_flags & E1000_FLAG_MIT)) {
+        s->mac_reg[ITR] = s->mac_reg[RDTR] = s->mac_reg[RADV] =
+            s->mac_reg[TADV] = 0;
+        s->mit_irq_level = false;
+    }
+    s->mit_ide = 0;
+    s->mit_timer_on = false;
+    return 0;
+}
+
+static bool e1000_mit_state_needed(void *opaque)
+{
+    E1000State *s = opaque;
+
+    return s->compat_flags & E1000_FLAG_MIT;
+}
+
+static const VMStateDescription vmstate_e1000_mit_state = {
+    .name = "e1000/mit_state",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .fields    = (VMStateField[]) {
+        VMSTATE_UINT32(mac_reg[RDTR], E1000State),
+        VMSTATE_UINT32(mac_reg[RADV], E1000State),
+        VMSTATE_UINT32(mac_reg[TADV], E1000State),
+        VMSTATE_UINT32(mac_reg[ITR], E1000State),
+        VMSTATE_BOOL(mit_irq_level, E1000State),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static const VMStateDescription vmstate_e1000 = {
     .name = "e1000",
     .version_id = 2,
     .minimum_version_id = 1,
     .minimum_version_id_old = 1,
+    .post_load = e1000_post_load,
     .fields      = (VMStateField []) {
         VMSTATE_PCI_DEVICE(dev, E1000State),
         VMSTATE_UNUSED_TEST(is_version_1, 4), /* was instance id */
@@ -1150,6 +1409,14 @@ static const VMStateDescription vmstate_e1000 = {
         VMSTATE_UINT32_SUB_ARRAY(mac_reg, E1000State, MTA, 128),
         VMSTATE_UINT32_SUB_ARRAY(mac_reg, E1000State, VFTA, 128),
         VMSTATE_END_OF_LIST()
+    },
+    .subsections = (VMStateSubsection[]) {
+        {
+            .vmsd = &vmstate_e1000_mit_state,
+            .needed = e1000_mit_state_needed,
+        }, {
+            /* empty */
+        }
     }
 };
 
@@ -1199,6 +1466,8 @@ pci_e1000_uninit(PCIDevice *dev)
 
     qemu_del_timer(d->autoneg_timer);
     qemu_free_timer(d->autoneg_timer);
+    qemu_del_timer(d->mit_timer);
+    qemu_free_timer(d->mit_timer);
     memory_region_destroy(&d->mmio);
     memory_region_destroy(&d->io);
     qemu_del_net_client(&d->nic->nc);
@@ -1253,6 +1522,7 @@ static int pci_e1000_init(PCIDevice *pci_dev)
     add_boot_device_path(d->conf.bootindex, &pci_dev->qdev, "/ethernet-phy@0");
 
     d->autoneg_timer = qemu_new_timer_ms(vm_clock, e1000_autoneg_timer, d);
+    d->mit_timer = qemu_new_timer_ns(vm_clock, e1000_mit_timer, d);
 
     return 0;
 }
@@ -1265,6 +1535,8 @@ static void qdev_e1000_reset(DeviceState *dev)
 
 static Property e1000_properties[] = {
     DEFINE_NIC_PROPERTIES(E1000State, conf),
+    DEFINE_PROP_BIT("mitigation", E1000State,
+                    compat_flags, E1000_FLAG_MIT_BIT, true),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -253,14 +253,6 @@ static int glue(load_elf, SZ)(const char *name, int fd,
         ph = &phdr[i];
         if (ph->p_type == PT_LOAD) {
             mem_size = ph->p_memsz;
-            /* XXX: avoid allocating */
-            data = g_malloc0(mem_size);
-            if (ph->p_filesz > 0) {
-                if (lseek(fd, ph->p_offset, SEEK_SET) < 0)
-                    goto fail;
-                if (read(fd, data, ph->p_filesz) != ph->p_filesz)
-                    goto fail;
-            }
             /* address_offset is hack for kernel images that are
                linked at the wrong physical address.  */
             if (translate_fn) {
@@ -270,7 +262,27 @@ static int glue(load_elf, SZ)(const char *name, int fd,
             }
 
             snprintf(label, sizeof(label), "phdr #%d: %s", i, name);
-            rom_add_blob_fixed(label, data, mem_size, addr);
+            if (ph->p_filesz > 0 && ph->p_filesz <= mem_size &&
+                rom_add_file_range(label, fd, ph->p_offset, ph->p_filesz,
+                                   addr) == 0) {
+                /* only the part that is not in the file needs memory */
+                if (mem_size > ph->p_filesz) {
+                    data = g_malloc0(mem_size - ph->p_filesz);
+                    snprintf(label, sizeof(label), "phdr #%d bss: %s",
+                             i, name);
+                    rom_add_blob_fixed(label, data, mem_size - ph->p_filesz,
+                                       addr + ph->p_filesz);
+                }
+            } else {
+                data = g_malloc0(mem_size);
+                if (ph->p_filesz > 0) {
+                    if (lseek(fd, ph->p_offset, SEEK_SET) < 0)
+                        goto fail;
+                    if (read(fd, data, ph->p_filesz) != ph->p_filesz)
+                        goto fail;
+                }
+                rom_add_blob_fixed(label, data, mem_size, addr);
+            }
 
             total_size += mem_size;
             if (addr < low)
@@ -522,6 +522,10 @@ static void ahci_reset_port(AHCIState *s, int port)
         ncq_tfs->used = 0;
     }
 
+    /* completions of cancelled requests are not reported to the guest */
+    qemu_bh_cancel(d->ncq_bh);
+    d->ncq_done = 0;
+
     s->dev[port].port_state = STATE_RUN;
     if (!ide_state->bs) {
         s->dev[port].port_regs.sig = 0;
@@ -563,6 +567,9 @@ static void ahci_write_fis_sdb(AHCIState *s, int port, uint32_t finished)
     IDEState *ide_state;
     uint8_t *sdb_fis;
 
+    /* the FIS clears the SActive bits of the tags it completes */
+    pr->scr_act &= ~finished;
+
     if (!s->dev[port].res_fis ||
         !(pr->cmd & PORT_CMD_FIS_RX)) {
         return;
@@ -571,12 +578,11 @@ static void ahci_write_fis_sdb(AHCIState *s, int port, uint32_t finished)
     sdb_fis = &s->dev[port].res_fis[RES_FIS_SDBFIS];
     ide_state = &s->dev[port].port.ifs[0];
 
-    /* clear memory */
-    *(uint32_t*)sdb_fis = 0;
-
     /* write values */
-    sdb_fis[0] = ide_state->error;
+    sdb_fis[0] = SATA_FIS_TYPE_SDB;
+    sdb_fis[1] = SATA_FIS_SDB_INTERRUPT;
     sdb_fis[2] = ide_state->status & 0x77;
+    sdb_fis[3] = ide_state->error;
     s->dev[port].finished |= finished;
     *(uint32_t*)(sdb_fis + 4) = cpu_to_le32(s->dev[port].finished);
 
@@ -709,32 +715,47 @@ out:
     return r;
 }
 
-static void ncq_cb(void *opaque, int ret)
+/* Report all NCQ tags that completed since the last run with a single
+ * Set Device Bits FIS and interrupt. */
+static void ahci_ncq_bh(void *opaque)
 {
-    NCQTransferState *ncq_tfs = (NCQTransferState *)opaque;
-    IDEState *ide_state = &ncq_tfs->drive->port.ifs[0];
+    AHCIDevice *ad = opaque;
+    uint32_t done = ad->ncq_done;
 
-    /* Clear bit for this tag in SActive */
-    ncq_tfs->drive->port_regs.scr_act &= ~(1 << ncq_tfs->tag);
+    ad->ncq_done = 0;
+    ahci_write_fis_sdb(ad->hba, ad->port_no, done);
+}
+
+static void ncq_finish(NCQTransferState *ncq_tfs, int ret)
+{
+    AHCIDevice *ad = ncq_tfs->drive;
+    IDEState *ide_state = &ad->port.ifs[0];
 
     if (ret < 0) {
         /* error */
         ide_state->error = ABRT_ERR;
         ide_state->status = READY_STAT | ERR_STAT;
-        ncq_tfs->drive->port_regs.scr_err |= (1 << ncq_tfs->tag);
-    } else {
+        ad->port_regs.scr_err |= (1 << ncq_tfs->tag);
+    } else if (!ad->ncq_done) {
+        /* don't hide an error reported by another tag of the same FIS */
         ide_state->status = READY_STAT | SEEK_STAT;
     }
 
-    ahci_write_fis_sdb(ncq_tfs->drive->hba, ncq_tfs->drive->port_no,
-                       (1 << ncq_tfs->tag));
+    DPRINTF(ad->port_no, "NCQ transfer tag %d finished\n", ncq_tfs->tag);
 
-    DPRINTF(ncq_tfs->drive->port_no, "NCQ transfer tag %d finished\n",
-            ncq_tfs->tag);
+    ncq_tfs->used = 0;
+    ad->ncq_done |= (1 << ncq_tfs->tag);
+    qemu_bh_schedule(ad->ncq_bh);
+}
 
+static void ncq_cb(void *opaque, int ret)
+{
+    NCQTransferState *ncq_tfs = (NCQTransferState *)opaque;
+
+    ncq_tfs->aiocb = NULL;
     bdrv_acct_done(ncq_tfs->drive->port.ifs[0].bs, &ncq_tfs->acct);
     qemu_sglist_destroy(&ncq_tfs->sglist);
-    ncq_tfs->used = 0;
+    ncq_finish(ncq_tfs, ret);
 }
 
 static void process_ncq_command(AHCIState *s, int port, uint8_t *cmd_fis,
@@ -770,8 +791,11 @@ static void process_ncq_command(AHCIState *s, int port, uint8_t *cmd_fis,
             ncq_tfs->lba, ncq_tfs->lba + ncq_tfs->sector_count - 2,
             s->dev[port].port.ifs[0].nb_sectors - 1);
 
-    ahci_populate_sglist(&s->dev[port], &ncq_tfs->sglist, 0);
     ncq_tfs->tag = tag;
+    if (ahci_populate_sglist(&s->dev[port], &ncq_tfs->sglist, 0) < 0) {
+        ncq_finish(ncq_tfs, -EINVAL);
+        return;
+    }
 
     switch(ncq_fis->command) {
         case READ_FPDMA_QUEUED:
@@ -804,6 +828,7 @@ static void process_ncq_command(AHCIState *s, int port, uint8_t *cmd_fis,
         default:
             DPRINTF(port, "error: tried to process non-NCQ command as NCQ\n");
             qemu_sglist_destroy(&ncq_tfs->sglist);
+            ncq_finish(ncq_tfs, -EINVAL);
             break;
     }
 }
@@ -1176,11 +1201,18 @@ void ahci_init(AHCIState *s, DeviceState *qdev, DMAContext *dma, int ports)
         ad->port.dma = &ad->dma;
         ad->port.dma->ops = &ahci_dma_ops;
         ad->port_regs.cmd = PORT_CMD_SPIN_UP | PORT_CMD_POWER_ON;
+        ad->ncq_bh = qemu_bh_new(ahci_ncq_bh, ad);
     }
 }
 
 void ahci_uninit(AHCIState *s)
 {
+    int i;
+
+    for (i = 0; i < s->ports; i++) {
+        qemu_bh_delete(s->dev[i].ncq_bh);
+    }
+
     memory_region_destroy(&s->mem);
     memory_region_destroy(&s->idp);
     g_free(s->dev);
@@ -177,6 +177,8 @@
 #define AHCI_SCR_SCTL_DET                 0xf
 
 #define SATA_FIS_TYPE_REGISTER_H2D        0x27
+#define SATA_FIS_TYPE_SDB                 0xa1
+#define SATA_FIS_SDB_INTERRUPT            0x40
 #define SATA_FIS_REG_H2D_UPDATE_COMMAND_REGISTER 0x80
 
 #define AHCI_CMD_HDR_CMD_FIS_LEN           0x1f
@@ -288,6 +290,9 @@ struct AHCIDevice {
     BlockDriverCompletionFunc *dma_cb;
     AHCICmdHdr *cur_cmd;
     NCQTransferState ncq_tfs[AHCI_MAX_CMDS];
+    /* NCQ tags completed since the last Set Device Bits FIS */
+    uint32_t ncq_done;
+    QEMUBH *ncq_bh;
 };
 
 typedef struct AHCIState {
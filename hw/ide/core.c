@@ -2124,9 +2124,16 @@ static const MemoryRegionPortio ide_portio2_list[] = {
 
 void ide_init_ioport(IDEBus *bus, ISADevice *dev, int iobase, int iobase2)
 {
+    PortioList *piolist;
+
     /* ??? Assume only ISA and PCI configurations, and that the PCI-ISA
        bridge has been setup properly to always register with ISA.  */
-    isa_register_portio_list(dev, iobase, ide_portio_list, bus, "ide");
+    piolist = isa_register_portio_list(dev, iobase, ide_portio_list, bus,
+                                       "ide");
+    /* The taskfile registers only latch their value until the command
+       register is written or the status is read, both of which exit
+       and replay the queued writes first.  */
+    portio_list_add_coalescing(piolist, 1, 6);
 
     if (iobase2) {
         isa_register_portio_list(dev, iobase2, ide_portio2_list, bus, "ide");
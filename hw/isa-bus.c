@@ -103,9 +103,9 @@ void isa_register_ioport(ISADevice *dev, MemoryRegion *io, uint16_t start)
     isa_init_ioport(dev, start);
 }
 
-void isa_register_portio_list(ISADevice *dev, uint16_t start,
-                              const MemoryRegionPortio *pio_start,
-                              void *opaque, const char *name)
+PortioList *isa_register_portio_list(ISADevice *dev, uint16_t start,
+                                     const MemoryRegionPortio *pio_start,
+                                     void *opaque, const char *name)
 {
     PortioList *piolist = g_new(PortioList, 1);
 
@@ -116,6 +116,7 @@ void isa_register_portio_list(ISADevice *dev, uint16_t start,
 
     portio_list_init(piolist, pio_start, opaque, name);
     portio_list_add(piolist, isabus->address_space_io, start);
+    return piolist;
 }
 
 static int isa_qdev_init(DeviceState *qdev)
@@ -72,10 +72,12 @@ void isa_register_ioport(ISADevice *dev, MemoryRegion *io, uint16_t start);
  * @portio: the ports, sorted by offset.
  * @opaque: passed into the old_portio callbacks.
  * @name: passed into memory_region_init_io.
+ *
+ * Returns the #PortioList, e.g. for portio_list_add_coalescing().
  */
-void isa_register_portio_list(ISADevice *dev, uint16_t start,
-                              const MemoryRegionPortio *portio,
-                              void *opaque, const char *name);
+PortioList *isa_register_portio_list(ISADevice *dev, uint16_t start,
+                                     const MemoryRegionPortio *portio,
+                                     void *opaque, const char *name);
 
 static inline ISABus *isa_bus_from_device(ISADevice *d)
 {
@@ -27,6 +27,9 @@
 
 #include <sys/mman.h>
 #include <sys/types.h>
+#include <sys/vfs.h>
+
+#define HUGETLBFS_MAGIC       0x958458f6
 
 #define IVSHMEM_IOEVENTFD   0
 #define IVSHMEM_MSI     1
@@ -52,6 +55,8 @@ typedef struct Peer {
 typedef struct EventfdEntry {
     PCIDevice *pdev;
     int vector;
+    int virq;       /* MSI route while the vector is unmasked, or -1 */
+    bool irqfd;     /* the eventfd of the vector injects it in the kernel */
 } EventfdEntry;
 
 typedef struct IVShmemState {
@@ -85,6 +90,7 @@ typedef struct IVShmemState {
     Error *migration_blocker;
 
     char * shmobj;
+    char * shmpath;
     char * sizearg;
     char * role;
     int role_val;   /* scalar to avoid multiple string comparisons */
@@ -273,6 +279,75 @@ static void fake_irqfd(void *opaque, const uint8_t *buf, int size) {
     msix_notify(pdev, entry->vector);
 }
 
+/*
+ * With KVM, the eventfds the peers ring for our vectors are bound to the
+ * MSI routes of the vectors while those are unmasked, and interrupts are
+ * injected without going through the main loop.  A masked vector falls
+ * back to the chardev, which sets its pending bit.
+ */
+static void ivshmem_add_irqfd(IVShmemState *s, int vector)
+{
+    EventfdEntry *entry = &s->eventfd_table[vector];
+
+    if (entry->virq < 0 || entry->irqfd || s->vm_id < 0 ||
+        vector >= s->peers[s->vm_id].nb_eventfds) {
+        return;
+    }
+    if (kvm_irqchip_add_irq_notifier(kvm_state,
+                                     &s->peers[s->vm_id].eventfds[vector],
+                                     entry->virq) < 0) {
+        return;
+    }
+    /* stop reading the eventfd, but keep the chardev connected */
+    qemu_chr_add_handlers(s->eventfd_chr[vector], NULL, NULL, NULL, entry);
+    entry->irqfd = true;
+}
+
+static void ivshmem_remove_irqfd(IVShmemState *s, int vector)
+{
+    EventfdEntry *entry = &s->eventfd_table[vector];
+    int ret;
+
+    if (!entry->irqfd) {
+        return;
+    }
+    ret = kvm_irqchip_remove_irq_notifier(kvm_state,
+                                          &s->peers[s->vm_id].eventfds[vector],
+                                          entry->virq);
+    assert(ret == 0);
+    qemu_chr_add_handlers(s->eventfd_chr[vector], ivshmem_can_receive,
+                          fake_irqfd, ivshmem_event, entry);
+    entry->irqfd = false;
+}
+
+static int ivshmem_vector_use(PCIDevice *dev, unsigned vector, MSIMessage msg)
+{
+    IVShmemState *s = DO_UPCAST(IVShmemState, dev, dev);
+    EventfdEntry *entry = &s->eventfd_table[vector];
+    int ret;
+
+    ret = kvm_irqchip_add_msi_route(kvm_state, msg);
+    if (ret < 0) {
+        return ret;
+    }
+    entry->virq = ret;
+    ivshmem_add_irqfd(s, vector);
+    return 0;
+}
+
+static void ivshmem_vector_release(PCIDevice *dev, unsigned vector)
+{
+    IVShmemState *s = DO_UPCAST(IVShmemState, dev, dev);
+    EventfdEntry *entry = &s->eventfd_table[vector];
+
+    if (entry->virq < 0) {
+        return;
+    }
+    ivshmem_remove_irqfd(s, vector);
+    kvm_irqchip_release_virq(kvm_state, entry->virq);
+    entry->virq = -1;
+}
+
 static CharDriverState* create_eventfd_chr_device(void * opaque, EventNotifier *n,
                                                   int vector)
 {
@@ -309,6 +384,7 @@ static int check_shm_size(IVShmemState *s, int fd) {
      * the object has allocated return -1 to indicate error */
 
     struct stat buf;
+    struct statfs fs;
 
     fstat(fd, &buf);
 
@@ -318,9 +394,17 @@ static int check_shm_size(IVShmemState *s, int fd) {
                 " than shared object size (%" PRIu64 " > %" PRIu64")\n",
                 s->ivshmem_size, (uint64_t)buf.st_size);
         return -1;
-    } else {
-        return 0;
     }
+
+    /* hugetlbfs only maps whole huge pages */
+    if (fstatfs(fd, &fs) == 0 && fs.f_type == HUGETLBFS_MAGIC &&
+        (s->ivshmem_size & (fs.f_bsize - 1))) {
+        fprintf(stderr, "IVSHMEM ERROR: size %" PRIu64 " is not a multiple"
+                " of the huge page size %ld\n", s->ivshmem_size,
+                (long)fs.f_bsize);
+        return -1;
+    }
+    return 0;
 }
 
 /* create the shared memory BAR when we are not using the server, so we can
@@ -332,6 +416,11 @@ static void create_shared_memory_BAR(IVShmemState *s, int fd) {
     s->shm_fd = fd;
 
     ptr = mmap(0, s->ivshmem_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ptr == MAP_FAILED) {
+        fprintf(stderr, "ivshmem: could not map shared memory: %s\n",
+                strerror(errno));
+        exit(-1);
+    }
 
     memory_region_init_ram_ptr(&s->ivshmem, "ivshmem.bar2",
                                s->ivshmem_size, ptr);
@@ -366,12 +455,18 @@ static void close_guest_eventfds(IVShmemState *s, int posn)
 {
     int i, guest_curr_max;
 
+    guest_curr_max = s->peers[posn].nb_eventfds;
+
+    if (posn == s->vm_id && ivshmem_has_feature(s, IVSHMEM_MSI)) {
+        for (i = 0; i < guest_curr_max; i++) {
+            ivshmem_remove_irqfd(s, i);
+        }
+    }
+
     if (!ivshmem_has_feature(s, IVSHMEM_IOEVENTFD)) {
         return;
     }
 
-    guest_curr_max = s->peers[posn].nb_eventfds;
-
     memory_region_transaction_begin();
     for (i = 0; i < guest_curr_max; i++) {
         ivshmem_del_eventfd(s, posn, i);
@@ -472,6 +567,11 @@ static void ivshmem_read(void *opaque, const uint8_t * buf, int flags)
         /* mmap the region and map into the BAR2 */
         map_ptr = mmap(0, s->ivshmem_size, PROT_READ|PROT_WRITE, MAP_SHARED,
                                                             incoming_fd, 0);
+        if (map_ptr == MAP_FAILED) {
+            fprintf(stderr, "ivshmem: could not map shared memory: %s\n",
+                    strerror(errno));
+            exit(-1);
+        }
         memory_region_init_ram_ptr(&s->ivshmem,
                                    "ivshmem.bar2", s->ivshmem_size, map_ptr);
         vmstate_register_ram(&s->ivshmem, &s->dev.qdev);
@@ -514,6 +614,9 @@ static void ivshmem_read(void *opaque, const uint8_t * buf, int flags)
         s->eventfd_chr[guest_max_eventfd] = create_eventfd_chr_device(s,
                    &s->peers[s->vm_id].eventfds[guest_max_eventfd],
                    guest_max_eventfd);
+        if (ivshmem_has_feature(s, IVSHMEM_MSI)) {
+            ivshmem_add_irqfd(s, guest_max_eventfd);
+        }
     }
 
     if (ivshmem_has_feature(s, IVSHMEM_IOEVENTFD)) {
@@ -577,6 +680,8 @@ static uint64_t ivshmem_get_size(IVShmemState * s) {
 
 static void ivshmem_setup_msi(IVShmemState * s)
 {
+    int i;
+
     if (msix_init_exclusive_bar(&s->dev, s->vectors, 1)) {
         IVSHMEM_DPRINTF("msix initialization failed\n");
         exit(1);
@@ -586,8 +691,17 @@ static void ivshmem_setup_msi(IVShmemState * s)
 
     /* allocate QEMU char devices for receiving interrupts */
     s->eventfd_table = g_malloc0(s->vectors * sizeof(EventfdEntry));
+    for (i = 0; i < s->vectors; i++) {
+        s->eventfd_table[i].virq = -1;
+    }
 
     ivshmem_use_msix(s);
+
+    if (kvm_msi_via_irqfd_enabled() &&
+        msix_set_vector_notifiers(&s->dev, ivshmem_vector_use,
+                                  ivshmem_vector_release) < 0) {
+        IVSHMEM_DPRINTF("could not set up irqfds, using the chardevs\n");
+    }
 }
 
 static void ivshmem_save(QEMUFile* f, void *opaque)
@@ -741,16 +855,34 @@ static int pci_ivshmem_init(PCIDevice *dev)
         /* just map the file immediately, we're not using a server */
         int fd;
 
-        if (s->shmobj == NULL) {
-            fprintf(stderr, "Must specify 'chardev' or 'shm' to ivshmem\n");
+        if (s->shmobj == NULL && s->shmpath == NULL) {
+            fprintf(stderr, "Must specify 'chardev', 'shm' or 'shm-path'"
+                            " to ivshmem\n");
+            exit(-1);
         }
 
-        IVSHMEM_DPRINTF("using shm_open (shm object = %s)\n", s->shmobj);
-
-        /* try opening with O_EXCL and if it succeeds zero the memory
-         * by truncating to 0 */
-        if ((fd = shm_open(s->shmobj, O_CREAT|O_RDWR|O_EXCL,
+        IVSHMEM_DPRINTF("using %s (shm object = %s)\n",
+                        s->shmpath ? "open" : "shm_open",
+                        s->shmpath ? s->shmpath : s->shmobj);
+
+        if (s->shmpath) {
+            /* a file of its own, e.g. on hugetlbfs */
+            fd = qemu_open(s->shmpath, O_CREAT|O_RDWR|O_EXCL,
+                           S_IRWXU|S_IRWXG|S_IRWXO);
+            if (fd < 0) {
+                fd = qemu_open(s->shmpath, O_RDWR);
+                if (fd < 0) {
+                    fprintf(stderr, "ivshmem: could not open %s: %s\n",
+                            s->shmpath, strerror(errno));
+                    exit(-1);
+                }
+            } else if (ftruncate(fd, s->ivshmem_size) != 0) {
+                fprintf(stderr, "ivshmem: could not truncate shared file\n");
+            }
+        } else if ((fd = shm_open(s->shmobj, O_CREAT|O_RDWR|O_EXCL,
                         S_IRWXU|S_IRWXG|S_IRWXO)) > 0) {
+            /* try opening with O_EXCL and if it succeeds zero the memory
+             * by truncating to 0 */
            /* truncate file to length PCI device's memory */
             if (ftruncate(fd, s->ivshmem_size) != 0) {
                 fprintf(stderr, "ivshmem: could not truncate shared file\n");
@@ -785,6 +917,10 @@ static void pci_ivshmem_uninit(PCIDevice *dev)
         error_free(s->migration_blocker);
     }
 
+    if (s->dev.msix_vector_use_notifier) {
+        msix_unset_vector_notifiers(&s->dev);
+    }
+
     memory_region_destroy(&s->ivshmem_mmio);
     memory_region_del_subregion(&s->bar, &s->ivshmem);
     vmstate_unregister_ram(&s->ivshmem, &s->dev.qdev);
@@ -800,6 +936,7 @@ static Property ivshmem_properties[] = {
     DEFINE_PROP_BIT("ioeventfd", IVShmemState, features, IVSHMEM_IOEVENTFD, false),
     DEFINE_PROP_BIT("msi", IVShmemState, features, IVSHMEM_MSI, true),
     DEFINE_PROP_STRING("shm", IVShmemState, shmobj),
+    DEFINE_PROP_STRING("shm-path", IVShmemState, shmpath),
     DEFINE_PROP_STRING("role", IVShmemState, role),
     DEFINE_PROP_END_OF_LIST(),
 };
@@ -112,9 +112,15 @@ static void kvm_apic_vapic_base_update(APICCommonState *s)
     struct kvm_vapic_addr vapid_addr = {
         .vapic_addr = s->vapic_paddr,
     };
+    CPUX86State *env = s->cpu_env;
     int ret;
 
-    ret = kvm_vcpu_ioctl(s->cpu_env, KVM_SET_VAPIC_ADDR, &vapid_addr);
+    if (!env->kvm_state) {
+        /* parked CPU, the kernel vCPU starts with no VAPIC */
+        return;
+    }
+
+    ret = kvm_vcpu_ioctl(env, KVM_SET_VAPIC_ADDR, &vapid_addr);
     if (ret < 0) {
         fprintf(stderr, "KVM: setting VAPIC address failed (%s)\n",
                 strerror(-ret));
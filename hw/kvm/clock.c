@@ -76,6 +76,9 @@ static void kvmclock_vm_state_change(void *opaque, int running,
             return;
         }
         for (penv = first_cpu; penv != NULL; penv = penv->next_cpu) {
+            if (!penv->kvm_state) {
+                continue;
+            }
             ret = kvm_vcpu_ioctl(penv, KVM_KVMCLOCK_CTRL, 0);
             if (ret) {
                 if (ret != -EINVAL) {
@@ -51,8 +51,12 @@
 #include "fw_cfg.h"
 #include "memory.h"
 #include "exec-memory.h"
+#include "qemu-config.h"
 
 #include <zlib.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
 
 static int roms_loaded;
 
@@ -535,6 +539,10 @@ struct Rom {
     char *path;
     size_t romsize;
     uint8_t *data;
+    uint8_t *map;       /* private mapping of the file that data points into */
+    size_t map_size;
+    int fd;             /* kept to map the file into guest RAM, or -1 */
+    off_t offset;       /* of data in the file */
     int isrom;
     char *fw_dir;
     char *fw_file;
@@ -564,6 +572,95 @@ static void rom_insert(Rom *rom)
     QTAILQ_INSERT_TAIL(&roms, rom, next);
 }
 
+static void rom_free_data(Rom *rom)
+{
+    if (rom->fd != -1) {
+        close(rom->fd);
+        rom->fd = -1;
+    }
+#ifndef _WIN32
+    if (rom->map) {
+        munmap(rom->map, rom->map_size);
+        rom->map = NULL;
+        rom->data = NULL;
+        return;
+    }
+#endif
+    g_free(rom->data);
+    rom->data = NULL;
+}
+
+#ifndef _WIN32
+/* -machine map-images=on: map file images into guest RAM at reset */
+static bool rom_map_images(void)
+{
+    QemuOpts *opts = qemu_opts_find(qemu_find_opts("machine"), 0);
+
+    return opts && qemu_opt_get_bool(opts, "map-images", false);
+}
+
+/* Point rom->data at a private mapping of @fd from @offset.  Pages are only
+ * read in when the ROM is copied to the guest or fetched through fw_cfg,
+ * and only copied if a loader patches them */
+static void rom_map_file(Rom *rom, int fd, off_t offset)
+{
+    size_t delta = offset & (getpagesize() - 1);
+    void *map;
+
+    map = mmap(NULL, rom->romsize + delta, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE, fd, offset - delta);
+    if (map == MAP_FAILED) {
+        return;
+    }
+    rom->map = map;
+    rom->map_size = rom->romsize + delta;
+    rom->data = rom->map + delta;
+    rom->offset = offset;
+    if (!rom->fw_file && rom_map_images()) {
+        rom->fd = dup(fd);
+    }
+}
+
+/* Map the image into guest RAM instead of copying it there */
+static int rom_map_ram(Rom *rom)
+{
+    MemoryRegionSection section;
+
+    section = memory_region_find(get_system_memory(), rom->addr, rom->romsize);
+    if (section.size != rom->romsize || !memory_region_is_ram(section.mr)) {
+        return -1;
+    }
+    return qemu_ram_map_file(memory_region_get_ram_addr(section.mr) +
+                             section.offset_within_region,
+                             rom->romsize, rom->fd, rom->offset);
+}
+#endif
+
+/* Add @len bytes of @fd from @offset without reading them; -1 if the file
+ * cannot be mapped, for the caller to read it instead */
+int rom_add_file_range(const char *name, int fd, off_t offset, size_t len,
+                       target_phys_addr_t addr)
+{
+#ifndef _WIN32
+    Rom *rom;
+
+    rom = g_malloc0(sizeof(*rom));
+    rom->fd      = -1;
+    rom->addr    = addr;
+    rom->romsize = len;
+    rom_map_file(rom, fd, offset);
+    if (!rom->data) {
+        g_free(rom);
+        return -1;
+    }
+    rom->name    = g_strdup(name);
+    rom_insert(rom);
+    return 0;
+#else
+    return -1;
+#endif
+}
+
 int rom_add_file(const char *file, const char *fw_dir,
                  target_phys_addr_t addr, int32_t bootindex)
 {
@@ -572,6 +669,7 @@ int rom_add_file(const char *file, const char *fw_dir,
     char devpath[100];
 
     rom = g_malloc0(sizeof(*rom));
+    rom->fd = -1;
     rom->name = g_strdup(file);
     rom->path = qemu_find_file(QEMU_FILE_TYPE_BIOS, rom->name);
     if (rom->path == NULL) {
@@ -591,13 +689,21 @@ int rom_add_file(const char *file, const char *fw_dir,
     }
     rom->addr    = addr;
     rom->romsize = lseek(fd, 0, SEEK_END);
-    rom->data    = g_malloc0(rom->romsize);
-    lseek(fd, 0, SEEK_SET);
-    rc = read(fd, rom->data, rom->romsize);
-    if (rc != rom->romsize) {
-        fprintf(stderr, "rom: file %-20s: read error: rc=%d (expected %zd)\n",
-                rom->name, rc, rom->romsize);
-        goto err;
+#ifndef _WIN32
+    if (rom->romsize) {
+        rom_map_file(rom, fd, 0);
+    }
+#endif
+    if (!rom->data) {
+        rom->data = g_malloc0(rom->romsize);
+        lseek(fd, 0, SEEK_SET);
+        rc = read(fd, rom->data, rom->romsize);
+        if (rc != rom->romsize) {
+            fprintf(stderr,
+                    "rom: file %-20s: read error: rc=%d (expected %zd)\n",
+                    rom->name, rc, rom->romsize);
+            goto err;
+        }
     }
     close(fd);
     rom_insert(rom);
@@ -625,7 +731,7 @@ int rom_add_file(const char *file, const char *fw_dir,
 err:
     if (fd != -1)
         close(fd);
-    g_free(rom->data);
+    rom_free_data(rom);
     g_free(rom->path);
     g_free(rom->name);
     g_free(rom);
@@ -638,6 +744,7 @@ int rom_add_blob(const char *name, const void *blob, size_t len,
     Rom *rom;
 
     rom = g_malloc0(sizeof(*rom));
+    rom->fd      = -1;
     rom->name    = g_strdup(name);
     rom->addr    = addr;
     rom->romsize = len;
@@ -668,11 +775,15 @@ static void rom_reset(void *unused)
         if (rom->data == NULL) {
             continue;
         }
+#ifndef _WIN32
+        if (rom->fd != -1 && !rom->isrom && rom_map_ram(rom) == 0) {
+            continue;
+        }
+#endif
         cpu_physical_memory_write_rom(rom->addr, rom->data, rom->romsize);
         if (rom->isrom) {
             /* rom needs to be written only once */
-            g_free(rom->data);
-            rom->data = NULL;
+            rom_free_data(rom);
         }
     }
 }
@@ -768,6 +879,8 @@ int rom_copy(uint8_t *dest, target_phys_addr_t addr, size_t size)
     return (d + l) - dest;
 }
 
+/* The caller may patch the data, which must then be copied to the guest
+   rather than mapped from the file */
 void *rom_ptr(target_phys_addr_t addr)
 {
     Rom *rom;
@@ -775,6 +888,10 @@ void *rom_ptr(target_phys_addr_t addr)
     rom = find_rom(addr);
     if (!rom || !rom->data)
         return NULL;
+    if (rom->fd != -1) {
+        close(rom->fd);
+        rom->fd = -1;
+    }
     return rom->data + (addr - rom->addr);
 }
 
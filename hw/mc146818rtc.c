@@ -655,6 +655,8 @@ static int rtc_initfn(ISADevice *dev)
     qemu_mod_timer(s->second_timer2, s->next_second_time);
 
     memory_region_init_io(&s->io, &cmos_ops, s, "rtc", 2);
+    /* the index register only selects what the data port accesses */
+    memory_region_add_coalescing(&s->io, 0, 1);
     isa_register_ioport(dev, &s->io, base);
 
     qdev_set_legacy_instance_id(&dev->qdev, base, 2);
@@ -19,6 +19,7 @@
 #include "msix.h"
 #include "pci.h"
 #include "range.h"
+#include "kvm.h"
 
 #define MSIX_CAP_LENGTH 12
 
@@ -428,6 +429,12 @@ void msix_notify(PCIDevice *dev, unsigned vector)
 
     msg = msix_get_message(dev, vector);
 
+    /* The in-kernel irqchip takes the message directly, so skip the
+       dispatch of a write into the APIC MSI window */
+    if (kvm_msi_via_irqfd_enabled() &&
+        kvm_irqchip_send_msi(kvm_state, msg) >= 0) {
+        return;
+    }
     stl_le_phys(msg.address, msg.data);
 }
 
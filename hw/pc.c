@@ -52,6 +52,8 @@
 #include "arch_init.h"
 #include "bitmap.h"
 #include "vga-pci.h"
+#include "cpus.h"
+#include "qerror.h"
 
 /* output Bochs bios info messages */
 //#define DEBUG_BIOS
@@ -923,14 +925,144 @@ static X86CPU *pc_new_cpu(const char *cpu_model)
         exit(1);
     }
     env = &cpu->env;
-    if ((env->cpuid_features & CPUID_APIC) || smp_cpus > 1) {
+    if ((env->cpuid_features & CPUID_APIC) || max_cpus > 1) {
         env->apic_state = apic_init(env, env->cpuid_apic_id);
     }
     cpu_reset(CPU(cpu));
     return cpu;
 }
 
-void pc_cpus_init(const char *cpu_model)
+/*
+ * CPU hotplug.  The CPUs between -smp and maxcpus are created at startup
+ * and parked, so plugging one only resets it and tells the guest through
+ * ACPI.  Unplugging asks the guest to give the CPU up; it is parked once
+ * the guest has taken it offline, which shows as a halt with interrupts
+ * disabled.
+ */
+#define PC_CPU_UNPLUG_POLL_MS 100
+
+static QEMUTimer *pc_cpu_unplug_timer;
+
+/* Runs on the thread of the CPU being unplugged */
+static void pc_cpu_try_park(void *opaque)
+{
+    CPUX86State *env = opaque;
+
+    cpu_synchronize_state(env);
+    if (env->halted && !(env->eflags & IF_MASK)) {
+        qemu_park_vcpu(env);
+    }
+}
+
+static void pc_cpu_unplug_poll(void *opaque)
+{
+    CPUX86State *env;
+    bool pending = false;
+
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        if (!env->unplug_pending) {
+            continue;
+        }
+        run_on_cpu(env, pc_cpu_try_park, env);
+        if (env->parked) {
+            env->unplug_pending = 0;
+        } else {
+            pending = true;
+        }
+    }
+
+    if (pending) {
+        qemu_mod_timer(pc_cpu_unplug_timer,
+                       qemu_get_clock_ms(rt_clock) + PC_CPU_UNPLUG_POLL_MS);
+    }
+}
+
+/* The firmware must not find CPUs that the guest was asked to give up */
+static void pc_cpu_unplug_reset(void *opaque)
+{
+    CPUX86State *env;
+
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        if (env->unplug_pending) {
+            env->unplug_pending = 0;
+            qemu_park_vcpu(env);
+        }
+    }
+    qemu_del_timer(pc_cpu_unplug_timer);
+}
+
+/* Pending removals migrate with the CPUs; poll for them once we run */
+static void pc_cpu_unplug_vmstate_change(void *opaque, int running,
+                                         RunState state)
+{
+    CPUX86State *env;
+
+    if (!running) {
+        return;
+    }
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        if (env->unplug_pending) {
+            qemu_mod_timer(pc_cpu_unplug_timer,
+                           qemu_get_clock_ms(rt_clock) + PC_CPU_UNPLUG_POLL_MS);
+            return;
+        }
+    }
+}
+
+void pc_hot_add_cpu(const int64_t id, Error **errp)
+{
+    CPUX86State *env;
+
+    if (id < 0 || id >= max_cpus) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "id",
+                  "a CPU number below maxcpus");
+        return;
+    }
+    env = qemu_get_cpu(id);
+
+    if (env->unplug_pending) {
+        /* the guest may still be using it, just cancel the request */
+        env->unplug_pending = 0;
+        qemu_system_cpu_hotplug(env->cpuid_apic_id, true);
+        return;
+    }
+    if (!env->parked) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "id",
+                  "a CPU that is not plugged");
+        return;
+    }
+
+    qdev_reset_all(env->apic_state);
+    cpu_reset(ENV_GET_CPU(env));
+    if (kvm_enabled()) {
+        kvm_arch_reset_vcpu(env);
+    }
+    qemu_unpark_vcpu(env);
+    qemu_system_cpu_hotplug(env->cpuid_apic_id, true);
+}
+
+void pc_hot_remove_cpu(const int64_t id, Error **errp)
+{
+    CPUX86State *env;
+
+    if (id <= 0 || id >= max_cpus) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "id",
+                  "a CPU number below maxcpus, other than 0");
+        return;
+    }
+    env = qemu_get_cpu(id);
+
+    if (env->parked || env->unplug_pending) {
+        return;
+    }
+
+    env->unplug_pending = 1;
+    qemu_system_cpu_hotplug(env->cpuid_apic_id, false);
+    qemu_mod_timer(pc_cpu_unplug_timer,
+                   qemu_get_clock_ms(rt_clock) + PC_CPU_UNPLUG_POLL_MS);
+}
+
+void pc_cpus_init(const char *cpu_model, bool cpu_hotplug)
 {
     int i;
 
@@ -943,7 +1075,15 @@ void pc_cpus_init(const char *cpu_model)
 #endif
     }
 
-    for(i = 0; i < smp_cpus; i++) {
+    if (cpu_hotplug) {
+        pc_cpu_unplug_timer = qemu_new_timer_ms(rt_clock, pc_cpu_unplug_poll,
+                                                NULL);
+        qemu_register_reset(pc_cpu_unplug_reset, NULL);
+        qemu_add_vm_change_state_handler(pc_cpu_unplug_vmstate_change, NULL);
+        qemu_enable_vcpu_parking();
+    }
+
+    for (i = 0; i < (cpu_hotplug ? max_cpus : smp_cpus); i++) {
         pc_new_cpu(cpu_model);
     }
 }
@@ -969,8 +1109,8 @@ void *pc_memory_init(MemoryRegion *system_memory,
      * with older qemus that used qemu_ram_alloc().
      */
     ram = g_malloc(sizeof(*ram));
-    memory_region_init_ram(ram, "pc.ram",
-                           below_4g_mem_size + above_4g_mem_size);
+    memory_region_init_system_ram(ram, "pc.ram",
+                                  below_4g_mem_size + above_4g_mem_size);
     vmstate_register_ram_global(ram);
     *ram_memory = ram;
     ram_below_4g = g_malloc(sizeof(*ram_below_4g));
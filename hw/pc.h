@@ -105,7 +105,9 @@ extern int fd_bootchk;
 void pc_register_ferr_irq(qemu_irq irq);
 void pc_acpi_smi_interrupt(void *opaque, int irq, int level);
 
-void pc_cpus_init(const char *cpu_model);
+void pc_cpus_init(const char *cpu_model, bool cpu_hotplug);
+void pc_hot_add_cpu(const int64_t id, Error **errp);
+void pc_hot_remove_cpu(const int64_t id, Error **errp);
 void *pc_memory_init(MemoryRegion *system_memory,
                     const char *kernel_filename,
                     const char *kernel_cmdline,
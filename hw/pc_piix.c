@@ -117,6 +117,9 @@ static void ioapic_init(GSIState *gsi_state)
     }
 }
 
+/* Set by machine types from pc-1.3 on, which create maxcpus CPUs */
+static bool has_cpu_hotplug;
+
 /* PC hardware initialisation */
 static void pc_init1(MemoryRegion *system_memory,
                      MemoryRegion *system_io,
@@ -149,7 +152,7 @@ static void pc_init1(MemoryRegion *system_memory,
     MemoryRegion *rom_memory;
     void *fw_cfg = NULL;
 
-    pc_cpus_init(cpu_model);
+    pc_cpus_init(cpu_model, has_cpu_hotplug);
 
     if (kvmclock_enabled) {
         kvmclock_create();
@@ -301,6 +304,18 @@ static void pc_init_pci(ram_addr_t ram_size,
              initrd_filename, cpu_model, 1, 1);
 }
 
+static void pc_init_pci_1_3(ram_addr_t ram_size,
+                            const char *boot_device,
+                            const char *kernel_filename,
+                            const char *kernel_cmdline,
+                            const char *initrd_filename,
+                            const char *cpu_model)
+{
+    has_cpu_hotplug = true;
+    pc_init_pci(ram_size, boot_device, kernel_filename, kernel_cmdline,
+                initrd_filename, cpu_model);
+}
+
 static void pc_init_pci_no_kvmclock(ram_addr_t ram_size,
                                     const char *boot_device,
                                     const char *kernel_filename,
@@ -349,16 +364,37 @@ static void pc_xen_hvm_init(ram_addr_t ram_size,
 }
 #endif
 
+static QEMUMachine pc_machine_v1_3 = {
+    .name = "pc-1.3",
+    .alias = "pc",
+    .desc = "Standard PC",
+    .init = pc_init_pci_1_3,
+    .hot_add_cpu = pc_hot_add_cpu,
+    .hot_remove_cpu = pc_hot_remove_cpu,
+    .max_cpus = 255,
+    .is_default = 1,
+};
+
+#define PC_COMPAT_1_2 \
+        {\
+            .driver   = "e1000",\
+            .property = "mitigation",\
+            .value    = "off",\
+        }
+
 static QEMUMachine pc_machine_v1_2 = {
     .name = "pc-1.2",
-    .alias = "pc",
     .desc = "Standard PC",
     .init = pc_init_pci,
     .max_cpus = 255,
-    .is_default = 1,
+    .compat_props = (GlobalProperty[]) {
+        PC_COMPAT_1_2,
+        { /* end of list */ }
+    },
 };
 
 #define PC_COMPAT_1_1 \
+        PC_COMPAT_1_2,\
         {\
             .driver   = "virtio-scsi-pci",\
             .property = "hotplug",\
@@ -655,6 +691,7 @@ static QEMUMachine xenfv_machine = {
 
 static void pc_machine_init(void)
 {
+    qemu_register_machine(&pc_machine_v1_3);
     qemu_register_machine(&pc_machine_v1_2);
     qemu_register_machine(&pc_machine_v1_1);
     qemu_register_machine(&pc_machine_v1_0);
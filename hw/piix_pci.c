@@ -26,6 +26,7 @@
 #include "pc.h"
 #include "pci.h"
 #include "pci_host.h"
+#include "pcie_host.h"
 #include "isa.h"
 #include "sysbus.h"
 #include "range.h"
@@ -37,9 +38,13 @@
  */
 
 typedef struct I440FXState {
-    PCIHostState parent_obj;
+    PCIExpressHost parent_obj;
+    uint64_t mmcfg_base;
 } I440FXState;
 
+/* Size of the optional MMCONFIG window: all 256 buses */
+#define I440FX_MMCFG_SIZE       (1ULL << 28)
+
 #define PIIX_NUM_PIC_IRQS       16      /* i8259 * 2 */
 #define PIIX_NUM_PIRQS          4ULL    /* PIRQ[A-D] */
 #define XEN_PIIX_NUM_PIRQS      128ULL
@@ -228,6 +233,7 @@ static const VMStateDescription vmstate_i440fx = {
 static int i440fx_pcihost_initfn(SysBusDevice *dev)
 {
     PCIHostState *s = PCI_HOST_BRIDGE(dev);
+    I440FXState *f = DO_UPCAST(I440FXState, parent_obj.pci, s);
 
     memory_region_init_io(&s->conf_mem, &pci_host_conf_le_ops, s,
                           "pci-conf-idx", 4);
@@ -239,6 +245,16 @@ static int i440fx_pcihost_initfn(SysBusDevice *dev)
     sysbus_add_io(dev, 0xcfc, &s->data_mem);
     sysbus_init_ioports(&s->busdev, 0xcfc, 4);
 
+    /*
+     * The real chipset has no MMCONFIG, but a window lets a guest reach
+     * config space with one MMIO access instead of two port accesses.
+     * Guests find it through an MCFG table, e.g. from -acpitable.
+     */
+    if (f->mmcfg_base) {
+        pcie_host_init(&f->parent_obj, I440FX_MMCFG_SIZE);
+        pcie_host_mmcfg_map(&f->parent_obj, f->mmcfg_base);
+    }
+
     return 0;
 }
 
@@ -593,6 +609,11 @@ static const TypeInfo i440fx_info = {
     .class_init    = i440fx_class_init,
 };
 
+static Property i440fx_pcihost_properties[] = {
+    DEFINE_PROP_HEX64("mmconfig-base", I440FXState, mmcfg_base, 0),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
 static void i440fx_pcihost_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
@@ -601,6 +622,7 @@ static void i440fx_pcihost_class_init(ObjectClass *klass, void *data)
     k->init = i440fx_pcihost_initfn;
     dc->fw_name = "pci";
     dc->no_user = 1;
+    dc->props = i440fx_pcihost_properties;
 }
 
 static const TypeInfo i440fx_pcihost_info = {
@@ -28,6 +28,7 @@
 #include "net.h"
 #include "qdev.h"
 #include "sysemu.h"
+#include "qemu-timer.h"
 #include "error.h"
 
 int qdev_hotplug = 0;
@@ -153,6 +154,7 @@ DeviceState *qdev_try_create(BusState *bus, const char *type)
 int qdev_init(DeviceState *dev)
 {
     DeviceClass *dc = DEVICE_GET_CLASS(dev);
+    int64_t start = get_clock();
     int rc;
 
     assert(dev->state == DEV_STATE_CREATED);
@@ -163,6 +165,16 @@ int qdev_init(DeviceState *dev)
         return rc;
     }
 
+    if (startup_profile && !qdev_hotplug) {
+        gchar *what = g_strdup_printf("%s%s%s%s",
+                                      object_get_typename(OBJECT(dev)),
+                                      dev->id ? " (" : "",
+                                      dev->id ? dev->id : "",
+                                      dev->id ? ")" : "");
+        startup_profile_step(what, start);
+        g_free(what);
+    }
+
     if (!OBJECT(dev)->parent) {
         static int unattached_count = 0;
         gchar *name = g_strdup_printf("device[%d]", unattached_count++);
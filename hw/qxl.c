@@ -375,7 +375,7 @@ static void qxl_rom_set_dirty(PCIQXLDevice *qxl)
     qxl_set_dirty(&qxl->rom_bar, 0, qxl->rom_size);
 }
 
-/* called from spice server thread context only */
+/* can be called from spice server thread context */
 static void qxl_ram_set_dirty(PCIQXLDevice *qxl, void *ptr)
 {
     void *base = qxl->vga.vram_ptr;
@@ -387,7 +387,11 @@ static void qxl_ram_set_dirty(PCIQXLDevice *qxl, void *ptr)
     qxl_set_dirty(&qxl->vga.vram, offset, offset + TARGET_PAGE_SIZE);
 }
 
-/* can be called from spice server thread context */
+/*
+ * Dirties the whole ram header.  The per-command paths only dirty the
+ * page of the ring fields they touched, see qxl_ram_set_dirty.
+ * can be called from spice server thread context
+ */
 static void qxl_ring_set_dirty(PCIQXLDevice *qxl)
 {
     ram_addr_t addr = qxl->shadow_rom.ram_header_offset;
@@ -584,7 +588,7 @@ static int interface_get_command(QXLInstance *sin, struct QXLCommandExt *ext)
         ext->group_id = MEMSLOT_GROUP_GUEST;
         ext->flags    = qxl->cmdflags;
         SPICE_RING_POP(ring, notify);
-        qxl_ring_set_dirty(qxl);
+        qxl_ram_set_dirty(qxl, &ring->cons);
         if (notify) {
             qxl_send_events(qxl, QXL_INTERRUPT_DISPLAY);
         }
@@ -610,7 +614,7 @@ static int interface_req_cmd_notification(QXLInstance *sin)
     case QXL_MODE_NATIVE:
     case QXL_MODE_UNDEFINED:
         SPICE_RING_CONS_WAIT(&qxl->ram->cmd_ring, wait);
-        qxl_ring_set_dirty(qxl);
+        qxl_ram_set_dirty(qxl, &qxl->ram->cmd_ring.notify_on_prod);
         break;
     default:
         /* nothing */
@@ -642,6 +646,7 @@ static inline void qxl_push_free_res(PCIQXLDevice *d, int flush)
     }
 
     SPICE_RING_PUSH(ring, notify);
+    qxl_ram_set_dirty(d, &ring->prod);
     trace_qxl_ring_res_push(d->id, qxl_mode_to_string(d->mode),
            d->guest_surfaces.count, d->num_free_res,
            d->last_release, notify ? "yes" : "no");
@@ -655,9 +660,9 @@ static inline void qxl_push_free_res(PCIQXLDevice *d, int flush)
         return;
     }
     *item = 0;
+    qxl_ram_set_dirty(d, item);
     d->num_free_res = 0;
     d->last_release = NULL;
-    qxl_ring_set_dirty(d);
 }
 
 /* called from spice server thread context only */
@@ -689,7 +694,7 @@ static void interface_release_resource(QXLInstance *sin,
         ext.info->next = 0;
         qxl_ram_set_dirty(qxl, &ext.info->next);
         *item = id;
-        qxl_ring_set_dirty(qxl);
+        qxl_ram_set_dirty(qxl, item);
     } else {
         /* append item to the list */
         qxl->last_release->next = ext.info->id;
@@ -729,7 +734,7 @@ static int interface_get_cursor_command(QXLInstance *sin, struct QXLCommandExt *
         ext->group_id = MEMSLOT_GROUP_GUEST;
         ext->flags    = qxl->cmdflags;
         SPICE_RING_POP(ring, notify);
-        qxl_ring_set_dirty(qxl);
+        qxl_ram_set_dirty(qxl, &ring->cons);
         if (notify) {
             qxl_send_events(qxl, QXL_INTERRUPT_CURSOR);
         }
@@ -758,7 +763,7 @@ static int interface_req_cursor_notification(QXLInstance *sin)
     case QXL_MODE_NATIVE:
     case QXL_MODE_UNDEFINED:
         SPICE_RING_CONS_WAIT(&qxl->ram->cursor_ring, wait);
-        qxl_ring_set_dirty(qxl);
+        qxl_ram_set_dirty(qxl, &qxl->ram->cursor_ring.notify_on_prod);
         break;
     default:
         /* nothing */
@@ -952,7 +957,6 @@ static void qxl_update_irq(PCIQXLDevice *d)
     uint32_t mask    = le32_to_cpu(d->ram->int_mask);
     int level = !!(pending & mask);
     qemu_set_irq(d->pci.irq[0], level);
-    qxl_ring_set_dirty(d);
 }
 
 static void qxl_check_state(PCIQXLDevice *d)
@@ -1527,6 +1531,8 @@ static void pipe_read(void *opaque)
     char dummy;
     int len;
 
+    /* cleared first: events raised from here on kick the pipe again */
+    __sync_fetch_and_and(&d->irq_kick_pending, 0);
     do {
         len = read(d->pipe[0], &dummy, sizeof(dummy));
     } while (len == sizeof(dummy));
@@ -1543,9 +1549,14 @@ static void qxl_send_events(PCIQXLDevice *d, uint32_t events)
     if ((old_pending & le_events) == le_events) {
         return;
     }
+    qxl_ram_set_dirty(d, &d->ram->int_pending);
     if (qemu_thread_is_self(&d->main)) {
         qxl_update_irq(d);
-    } else {
+    } else if (!__sync_fetch_and_or(&d->irq_kick_pending, 1)) {
+        /*
+         * One wakeup of the main loop covers all events raised until
+         * pipe_read runs, whatever their bits.
+         */
         if (write(d->pipe[1], d, 1) != 1) {
             dprint(d, 1, "%s: write to pipe failed\n", __func__);
         }
@@ -76,6 +76,7 @@ typedef struct PCIQXLDevice {
     /* thread signaling */
     QemuThread         main;
     int                pipe[2];
+    uint32_t           irq_kick_pending;
 
     /* ram pci bar */
     QXLRam             *ram;
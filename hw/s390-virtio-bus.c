@@ -30,6 +30,7 @@
 #include "hw/virtio-net.h"
 #include "hw/sysbus.h"
 #include "kvm.h"
+#include "qemu-error.h"
 
 #include "hw/s390-virtio-bus.h"
 
@@ -54,6 +55,8 @@ static const TypeInfo s390_virtio_bus_info = {
 static const VirtIOBindings virtio_s390_bindings;
 
 static ram_addr_t s390_virtio_device_num_vq(VirtIOS390Device *dev);
+static void s390_virtio_start_ioeventfd(VirtIOS390Device *dev);
+static void s390_virtio_stop_ioeventfd(VirtIOS390Device *dev);
 
 /* length of VirtIO device pages */
 const target_phys_addr_t virtio_size = S390_DEVICE_PAGES * TARGET_PAGE_SIZE;
@@ -246,6 +249,7 @@ void s390_virtio_device_sync(VirtIOS390Device *dev)
     uint8_t num_vq;
     int i;
 
+    s390_virtio_stop_ioeventfd(dev);
     virtio_reset(dev->vdev);
 
     /* Sync dev space */
@@ -296,13 +300,30 @@ void s390_virtio_device_update_status(VirtIOS390Device *dev)
 {
     VirtIODevice *vdev = dev->vdev;
     uint32_t features;
+    uint8_t status = ldub_phys(dev->dev_offs + VIRTIO_DEV_OFFS_STATUS);
 
-    virtio_set_status(vdev, ldub_phys(dev->dev_offs + VIRTIO_DEV_OFFS_STATUS));
+    if (!(status & VIRTIO_CONFIG_S_DRIVER_OK)) {
+        s390_virtio_stop_ioeventfd(dev);
+    }
+    virtio_set_status(vdev, status);
 
     /* Update guest supported feature bitmap */
 
     features = bswap32(ldl_be_phys(dev->feat_offs));
     virtio_set_features(vdev, features);
+
+    if (status & VIRTIO_CONFIG_S_DRIVER_OK) {
+        s390_virtio_start_ioeventfd(dev);
+    }
+}
+
+void s390_virtio_device_reset(VirtIOS390Device *dev)
+{
+    s390_virtio_stop_ioeventfd(dev);
+    virtio_reset(dev->vdev);
+    stb_phys(dev->dev_offs + VIRTIO_DEV_OFFS_STATUS, 0);
+    s390_virtio_device_sync(dev);
+    s390_virtio_reset_idx(dev);
 }
 
 VirtIOS390Device *s390_virtio_bus_console(VirtIOS390Bus *bus)
@@ -367,11 +388,190 @@ static unsigned virtio_s390_get_features(void *opaque)
     return dev->host_features;
 }
 
+/* The kernel has no ioeventfd for the diagnose 500 notify hypercall, so
+ * the hypercall itself signals the host notifier of the queue.  That is
+ * cheap enough to leave the device model to the iothread, and lets vhost
+ * take the kicks of the queues it runs.
+ */
+void s390_virtio_device_notify(VirtIOS390Device *dev, int n)
+{
+    VirtQueue *vq;
+
+    if (dev->host_notifiers & (1ULL << n)) {
+        vq = virtio_get_queue(dev->vdev, n);
+        event_notifier_set(virtio_queue_get_host_notifier(vq));
+    } else if (!dev->ioeventfd_started) {
+        virtio_queue_notify(dev->vdev, n);
+    }
+}
+
+static int s390_virtio_set_host_notifier_internal(VirtIOS390Device *dev,
+                                                  int n, bool assign,
+                                                  bool set_handler)
+{
+    VirtQueue *vq = virtio_get_queue(dev->vdev, n);
+    EventNotifier *notifier = virtio_queue_get_host_notifier(vq);
+    int r = 0;
+
+    if (assign) {
+        r = event_notifier_init(notifier, 1);
+        if (r < 0) {
+            error_report("%s: unable to init event notifier: %d",
+                         __func__, r);
+            return r;
+        }
+        virtio_queue_set_host_notifier_fd_handler(vq, true, set_handler);
+        dev->host_notifiers |= 1ULL << n;
+    } else {
+        dev->host_notifiers &= ~(1ULL << n);
+        virtio_queue_set_host_notifier_fd_handler(vq, false, false);
+        event_notifier_cleanup(notifier);
+    }
+    return r;
+}
+
+static void s390_virtio_start_ioeventfd(VirtIOS390Device *dev)
+{
+    int n, r;
+
+    if (!(dev->flags & VIRTIO_S390_FLAG_USE_IOEVENTFD) ||
+        dev->ioeventfd_disabled ||
+        dev->ioeventfd_started) {
+        return;
+    }
+
+    for (n = 0; n < VIRTIO_PCI_QUEUE_MAX; n++) {
+        if (!virtio_queue_get_num(dev->vdev, n)) {
+            continue;
+        }
+
+        r = s390_virtio_set_host_notifier_internal(dev, n, true, true);
+        if (r < 0) {
+            goto assign_error;
+        }
+    }
+    dev->ioeventfd_started = true;
+    return;
+
+assign_error:
+    while (--n >= 0) {
+        if (!virtio_queue_get_num(dev->vdev, n)) {
+            continue;
+        }
+
+        r = s390_virtio_set_host_notifier_internal(dev, n, false, false);
+        assert(r >= 0);
+    }
+    dev->ioeventfd_started = false;
+    error_report("%s: failed. Fallback to a userspace (slower).", __func__);
+}
+
+static void s390_virtio_stop_ioeventfd(VirtIOS390Device *dev)
+{
+    int n, r;
+
+    if (!dev->ioeventfd_started) {
+        return;
+    }
+
+    for (n = 0; n < VIRTIO_PCI_QUEUE_MAX; n++) {
+        if (!virtio_queue_get_num(dev->vdev, n)) {
+            continue;
+        }
+
+        r = s390_virtio_set_host_notifier_internal(dev, n, false, false);
+        assert(r >= 0);
+    }
+    dev->ioeventfd_started = false;
+}
+
+static int virtio_s390_set_host_notifier(void *opaque, int n, bool assign)
+{
+    VirtIOS390Device *dev = opaque;
+
+    /* vhost takes over the host notifiers of its queues */
+    dev->ioeventfd_disabled = assign;
+    if (assign) {
+        s390_virtio_stop_ioeventfd(dev);
+    }
+    return s390_virtio_set_host_notifier_internal(dev, n, assign, false);
+}
+
+/* There is no irqfd for the virtio external interrupt either: the guest
+ * notifiers are read by the iothread, which injects one interrupt for
+ * however many times vhost signalled the queue since the last read.
+ */
+static int virtio_s390_set_guest_notifier(VirtIOS390Device *dev, int n,
+                                          bool assign)
+{
+    VirtQueue *vq = virtio_get_queue(dev->vdev, n);
+    EventNotifier *notifier = virtio_queue_get_guest_notifier(vq);
+
+    if (assign) {
+        int r = event_notifier_init(notifier, 0);
+        if (r < 0) {
+            return r;
+        }
+        virtio_queue_set_guest_notifier_fd_handler(vq, true, false);
+    } else {
+        virtio_queue_set_guest_notifier_fd_handler(vq, false, false);
+        event_notifier_cleanup(notifier);
+    }
+
+    return 0;
+}
+
+static bool virtio_s390_query_guest_notifiers(void *opaque)
+{
+    return true;
+}
+
+static int virtio_s390_set_guest_notifiers(void *opaque, bool assign)
+{
+    VirtIOS390Device *dev = opaque;
+    int r, n;
+
+    for (n = 0; n < VIRTIO_PCI_QUEUE_MAX; n++) {
+        if (!virtio_queue_get_num(dev->vdev, n)) {
+            break;
+        }
+
+        r = virtio_s390_set_guest_notifier(dev, n, assign);
+        if (r < 0) {
+            goto assign_error;
+        }
+    }
+    return 0;
+
+assign_error:
+    /* We get here on assignment failure. Recover by undoing for VQs 0 .. n. */
+    assert(assign);
+    while (--n >= 0) {
+        virtio_s390_set_guest_notifier(dev, n, !assign);
+    }
+    return r;
+}
+
+static void virtio_s390_vmstate_change(void *opaque, bool running)
+{
+    VirtIOS390Device *dev = opaque;
+
+    if (running && (dev->vdev->status & VIRTIO_CONFIG_S_DRIVER_OK)) {
+        s390_virtio_start_ioeventfd(dev);
+    } else if (!running) {
+        s390_virtio_stop_ioeventfd(dev);
+    }
+}
+
 /**************** S390 Virtio Bus Device Descriptions *******************/
 
 static const VirtIOBindings virtio_s390_bindings = {
     .notify = virtio_s390_notify,
     .get_features = virtio_s390_get_features,
+    .query_guest_notifiers = virtio_s390_query_guest_notifiers,
+    .set_host_notifier = virtio_s390_set_host_notifier,
+    .set_guest_notifiers = virtio_s390_set_guest_notifiers,
+    .vmstate_change = virtio_s390_vmstate_change,
 };
 
 static Property s390_virtio_net_properties[] = {
@@ -380,7 +580,13 @@ static Property s390_virtio_net_properties[] = {
                        net.txtimer, TX_TIMER_INTERVAL),
     DEFINE_PROP_INT32("x-txburst", VirtIOS390Device,
                       net.txburst, TX_BURST),
+    DEFINE_PROP_UINT32("x-txrate", VirtIOS390Device,
+                       net.txrate, TX_ADAPTIVE_RATE),
+    DEFINE_PROP_BIT("x-txzerocopy", VirtIOS390Device, net.flags,
+                    VIRTIO_NET_CONF_TX_ZEROCOPY, false),
     DEFINE_PROP_STRING("tx", VirtIOS390Device, net.tx),
+    DEFINE_PROP_BIT("ioeventfd", VirtIOS390Device, flags,
+                    VIRTIO_S390_FLAG_USE_IOEVENTFD_BIT, false),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -407,6 +613,8 @@ static Property s390_virtio_blk_properties[] = {
 #ifdef __linux__
     DEFINE_PROP_BIT("scsi", VirtIOS390Device, blk.scsi, 0, true),
 #endif
+    DEFINE_PROP_BIT("ioeventfd", VirtIOS390Device, flags,
+                    VIRTIO_S390_FLAG_USE_IOEVENTFD_BIT, true),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -429,6 +637,8 @@ static TypeInfo s390_virtio_blk = {
 static Property s390_virtio_serial_properties[] = {
     DEFINE_PROP_UINT32("max_ports", VirtIOS390Device,
                        serial.max_virtserial_ports, 31),
+    DEFINE_PROP_BIT("ioeventfd", VirtIOS390Device, flags,
+                    VIRTIO_S390_FLAG_USE_IOEVENTFD_BIT, true),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -476,6 +686,8 @@ static TypeInfo virtio_s390_device_info = {
 
 static Property s390_virtio_scsi_properties[] = {
     DEFINE_VIRTIO_SCSI_PROPERTIES(VirtIOS390Device, host_features, scsi),
+    DEFINE_PROP_BIT("ioeventfd", VirtIOS390Device, flags,
+                    VIRTIO_S390_FLAG_USE_IOEVENTFD_BIT, true),
     DEFINE_PROP_END_OF_LIST(),
 };
 
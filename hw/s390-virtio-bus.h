@@ -44,6 +44,10 @@
 #define VIRTIO_PARAM_CONFIG_CHANGED     0x1
 #define VIRTIO_PARAM_DEV_ADD            0x2
 
+/* Use host notifiers for the queue kicks, see s390_virtio_device_notify() */
+#define VIRTIO_S390_FLAG_USE_IOEVENTFD_BIT  0
+#define VIRTIO_S390_FLAG_USE_IOEVENTFD      (1 << VIRTIO_S390_FLAG_USE_IOEVENTFD_BIT)
+
 #define TYPE_VIRTIO_S390_DEVICE "virtio-s390-device"
 #define VIRTIO_S390_DEVICE(obj) \
      OBJECT_CHECK(VirtIOS390Device, (obj), TYPE_VIRTIO_S390_DEVICE)
@@ -75,6 +79,11 @@ struct VirtIOS390Device {
     virtio_serial_conf serial;
     virtio_net_conf net;
     VirtIOSCSIConf scsi;
+    uint32_t flags;
+    /* queues whose kicks go to their host notifier */
+    uint64_t host_notifiers;
+    bool ioeventfd_disabled;
+    bool ioeventfd_started;
 };
 
 typedef struct VirtIOS390Bus {
@@ -96,5 +105,7 @@ VirtIOS390Device *s390_virtio_bus_find_vring(VirtIOS390Bus *bus,
                                              ram_addr_t mem, int *vq_num);
 VirtIOS390Device *s390_virtio_bus_find_mem(VirtIOS390Bus *bus, ram_addr_t mem);
 void s390_virtio_device_sync(VirtIOS390Device *dev);
+void s390_virtio_device_reset(VirtIOS390Device *dev);
+void s390_virtio_device_notify(VirtIOS390Device *dev, int n);
 void s390_virtio_reset_idx(VirtIOS390Device *dev);
 
@@ -83,7 +83,7 @@ int s390_virtio_hypercall(CPUS390XState *env, uint64_t mem, uint64_t hypercall)
             VirtIOS390Device *dev = s390_virtio_bus_find_vring(s390_bus,
                                                                mem, &i);
             if (dev) {
-                virtio_queue_notify(dev->vdev, i);
+                s390_virtio_device_notify(dev, i);
             } else {
                 r = -EINVAL;
             }
@@ -96,10 +96,7 @@ int s390_virtio_hypercall(CPUS390XState *env, uint64_t mem, uint64_t hypercall)
         VirtIOS390Device *dev;
 
         dev = s390_virtio_bus_find_mem(s390_bus, mem);
-        virtio_reset(dev->vdev);
-        stb_phys(dev->dev_offs + VIRTIO_DEV_OFFS_STATUS, 0);
-        s390_virtio_device_sync(dev);
-        s390_virtio_reset_idx(dev);
+        s390_virtio_device_reset(dev);
         break;
     }
     case KVM_S390_VIRTIO_SET_STATUS:
@@ -697,6 +697,30 @@ int32_t scsi_req_enqueue(SCSIRequest *req)
     return rc;
 }
 
+/* Enqueue the request and start its data transfer at once.  This is the
+ * same as scsi_req_enqueue() followed by scsi_req_continue() if it
+ * returned nonzero, for HBAs that do not have to look at the length
+ * first; devices can then go straight to the block layer.
+ */
+int32_t scsi_req_submit(SCSIRequest *req)
+{
+    int32_t rc;
+
+    assert(!req->retry);
+    scsi_req_enqueue_internal(req);
+    scsi_req_ref(req);
+    if (req->sg && req->ops->submit) {
+        rc = req->ops->submit(req, req->cmd.buf);
+    } else {
+        rc = req->ops->send_command(req, req->cmd.buf);
+        if (rc) {
+            scsi_req_continue(req);
+        }
+    }
+    scsi_req_unref(req);
+    return rc;
+}
+
 static void scsi_req_dequeue(SCSIRequest *req)
 {
     trace_scsi_req_dequeue(req->dev->id, req->lun, req->tag);
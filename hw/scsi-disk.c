@@ -1934,6 +1934,45 @@ static int32_t scsi_disk_dma_command(SCSIRequest *req, uint8_t *buf)
     }
 }
 
+/* READ and WRITE with a scatter/gather list: submit the whole transfer
+ * to the block layer from here rather than through scsi_read_data() or
+ * scsi_write_data(); it completes in scsi_dma_complete().
+ */
+static int32_t scsi_disk_dma_submit(SCSIRequest *req, uint8_t *buf)
+{
+    SCSIDiskReq *r = DO_UPCAST(SCSIDiskReq, req, req);
+    SCSIDiskState *s = DO_UPCAST(SCSIDiskState, qdev, req->dev);
+    bool is_write = r->req.cmd.mode == SCSI_XFER_TO_DEV;
+    int32_t len;
+
+    len = scsi_disk_dma_command(req, buf);
+    if (!len || r->sector_count == 0) {
+        return len;
+    }
+
+    /* FUA reads flush first, VERIFY does no I/O at all */
+    if ((!is_write && scsi_is_cmd_fua(&r->req.cmd)) ||
+        buf[0] == VERIFY_10 || buf[0] == VERIFY_12 || buf[0] == VERIFY_16) {
+        scsi_req_continue(req);
+        return len;
+    }
+
+    r->started = true;
+    /* The request is used as the AIO opaque value, so add a ref.  */
+    scsi_req_ref(&r->req);
+    r->req.resid -= r->req.sg->size;
+    if (is_write) {
+        dma_acct_start(s->qdev.conf.bs, &r->acct, r->req.sg, BDRV_ACCT_WRITE);
+        r->req.aiocb = dma_bdrv_write(s->qdev.conf.bs, r->req.sg, r->sector,
+                                      scsi_dma_complete, r);
+    } else {
+        dma_acct_start(s->qdev.conf.bs, &r->acct, r->req.sg, BDRV_ACCT_READ);
+        r->req.aiocb = dma_bdrv_read(s->qdev.conf.bs, r->req.sg, r->sector,
+                                     scsi_dma_complete, r);
+    }
+    return len;
+}
+
 static void scsi_disk_reset(DeviceState *dev)
 {
     SCSIDiskState *s = DO_UPCAST(SCSIDiskState, qdev.qdev, dev);
@@ -2130,6 +2169,7 @@ static const SCSIReqOps scsi_disk_dma_reqops = {
     .size         = sizeof(SCSIDiskReq),
     .free_req     = scsi_free_request,
     .send_command = scsi_disk_dma_command,
+    .submit       = scsi_disk_dma_submit,
     .read_data    = scsi_read_data,
     .write_data   = scsi_write_data,
     .cancel_io    = scsi_cancel_io,
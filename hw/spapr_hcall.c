@@ -92,6 +92,38 @@ static target_ulong compute_tlbie_rb(target_ulong v, target_ulong r,
     return rb;
 }
 
+/* TLB invalidations for the HPTEs an hcall changes are collected here and
+ * done once, just before the hcall returns: on the 64-bit hash MMU each
+ * tlbie flushes the whole QEMU TLB, so H_BULK_REMOVE would otherwise flush
+ * it once per entry.
+ */
+typedef struct HPTEInvalidate {
+    int count;
+    target_ulong rb;
+} HPTEInvalidate;
+
+static void hpte_invalidate(HPTEInvalidate *inv, target_ulong v,
+                            target_ulong r, target_ulong ptex)
+{
+    /* The MMU emulation sets R in every HPTE it translates through, so an
+     * entry with R still clear cannot be in the TLB. */
+    if (!(r & HPTE_R_R)) {
+        return;
+    }
+    inv->rb = compute_tlbie_rb(v, r, ptex);
+    inv->count++;
+}
+
+static void hpte_invalidate_flush(CPUPPCState *env, HPTEInvalidate *inv)
+{
+    if (inv->count == 1) {
+        ppc_tlb_invalidate_one(env, inv->rb);
+    } else if (inv->count > 1) {
+        ppc_tlb_invalidate_all(env);
+    }
+    inv->count = 0;
+}
+
 static target_ulong h_enter(CPUPPCState *env, sPAPREnvironment *spapr,
                             target_ulong opcode, target_ulong *args)
 {
@@ -184,10 +216,11 @@ enum {
 static target_ulong remove_hpte(CPUPPCState *env, target_ulong ptex,
                                 target_ulong avpn,
                                 target_ulong flags,
-                                target_ulong *vp, target_ulong *rp)
+                                target_ulong *vp, target_ulong *rp,
+                                HPTEInvalidate *inv)
 {
     uint8_t *hpte;
-    target_ulong v, r, rb;
+    target_ulong v, r;
 
     if ((ptex * HASH_PTE_SIZE_64) & ~env->htab_mask) {
         return REMOVE_PARM;
@@ -213,8 +246,7 @@ static target_ulong remove_hpte(CPUPPCState *env, target_ulong ptex,
     *vp = v & ~HPTE_V_HVLOCK;
     *rp = r;
     stq_p(hpte, 0);
-    rb = compute_tlbie_rb(v, r, ptex);
-    ppc_tlb_invalidate_one(env, rb);
+    hpte_invalidate(inv, v, r, ptex);
     assert(!(ldq_p(hpte) & HPTE_V_HVLOCK));
     return REMOVE_SUCCESS;
 }
@@ -225,10 +257,12 @@ static target_ulong h_remove(CPUPPCState *env, sPAPREnvironment *spapr,
     target_ulong flags = args[0];
     target_ulong pte_index = args[1];
     target_ulong avpn = args[2];
+    HPTEInvalidate inv = { 0 };
     int ret;
 
     ret = remove_hpte(env, pte_index, avpn, flags,
-                      &args[0], &args[1]);
+                      &args[0], &args[1], &inv);
+    hpte_invalidate_flush(env, &inv);
 
     switch (ret) {
     case REMOVE_SUCCESS:
@@ -268,6 +302,8 @@ static target_ulong h_remove(CPUPPCState *env, sPAPREnvironment *spapr,
 static target_ulong h_bulk_remove(CPUPPCState *env, sPAPREnvironment *spapr,
                                   target_ulong opcode, target_ulong *args)
 {
+    HPTEInvalidate inv = { 0 };
+    target_ulong rc = H_SUCCESS;
     int i;
 
     for (i = 0; i < H_BULK_REMOVE_MAX_BATCH; i++) {
@@ -278,7 +314,8 @@ static target_ulong h_bulk_remove(CPUPPCState *env, sPAPREnvironment *spapr,
         if ((*tsh & H_BULK_REMOVE_TYPE) == H_BULK_REMOVE_END) {
             break;
         } else if ((*tsh & H_BULK_REMOVE_TYPE) != H_BULK_REMOVE_REQUEST) {
-            return H_PARAMETER;
+            rc = H_PARAMETER;
+            break;
         }
 
         *tsh &= H_BULK_REMOVE_PTEX | H_BULK_REMOVE_FLAGS;
@@ -286,29 +323,30 @@ static target_ulong h_bulk_remove(CPUPPCState *env, sPAPREnvironment *spapr,
 
         if ((*tsh & H_BULK_REMOVE_ANDCOND) && (*tsh & H_BULK_REMOVE_AVPN)) {
             *tsh |= H_BULK_REMOVE_PARM;
-            return H_PARAMETER;
+            rc = H_PARAMETER;
+            break;
         }
 
         ret = remove_hpte(env, *tsh & H_BULK_REMOVE_PTEX, tsl,
                           (*tsh & H_BULK_REMOVE_FLAGS) >> 26,
-                          &v, &r);
+                          &v, &r, &inv);
 
         *tsh |= ret << 60;
 
-        switch (ret) {
-        case REMOVE_SUCCESS:
+        if (ret == REMOVE_SUCCESS) {
             *tsh |= (r & (HPTE_R_C | HPTE_R_R)) << 43;
+        } else if (ret == REMOVE_PARM) {
+            rc = H_PARAMETER;
+            break;
+        } else if (ret == REMOVE_HW) {
+            rc = H_HARDWARE;
             break;
-
-        case REMOVE_PARM:
-            return H_PARAMETER;
-
-        case REMOVE_HW:
-            return H_HARDWARE;
         }
     }
 
-    return H_SUCCESS;
+    /* Entries removed before an error must still be invalidated */
+    hpte_invalidate_flush(env, &inv);
+    return rc;
 }
 
 static target_ulong h_protect(CPUPPCState *env, sPAPREnvironment *spapr,
@@ -318,7 +356,8 @@ static target_ulong h_protect(CPUPPCState *env, sPAPREnvironment *spapr,
     target_ulong pte_index = args[1];
     target_ulong avpn = args[2];
     uint8_t *hpte;
-    target_ulong v, r, rb;
+    target_ulong v, r;
+    HPTEInvalidate inv = { 0 };
 
     if ((pte_index * HASH_PTE_SIZE_64) & ~env->htab_mask) {
         return H_PARAMETER;
@@ -346,9 +385,9 @@ static target_ulong h_protect(CPUPPCState *env, sPAPREnvironment *spapr,
     r |= (flags << 55) & HPTE_R_PP0;
     r |= (flags << 48) & HPTE_R_KEY_HI;
     r |= flags & (HPTE_R_PP | HPTE_R_N | HPTE_R_KEY_LO);
-    rb = compute_tlbie_rb(v, r, pte_index);
+    hpte_invalidate(&inv, v, r, pte_index);
     stq_p(hpte, v & ~HPTE_V_VALID);
-    ppc_tlb_invalidate_one(env, rb);
+    hpte_invalidate_flush(env, &inv);
     stq_p(hpte + (HASH_PTE_SIZE_64/2), r);
     /* Don't need a memory barrier, due to qemu's global lock */
     stq_p(hpte, v & ~HPTE_V_HVLOCK);
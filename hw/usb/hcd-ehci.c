@@ -1204,6 +1204,15 @@ static void ehci_mem_writel(void *ptr, target_phys_addr_t addr, uint32_t val)
             s->async_stepdown = 0;
             qemu_mod_timer(s->frame_timer, qemu_get_clock_ns(vm_clock));
         }
+
+        /* Answer the doorbell now rather than at the next frame, which
+         * can be many milliseconds away on an idle controller; the guest
+         * waits for it before it frees the queue heads it unlinked.
+         */
+        if (val & USBCMD_IAAD) {
+            s->async_stepdown = 0;
+            qemu_bh_schedule(s->async_bh);
+        }
         break;
 
     case USBSTS:
@@ -1211,6 +1220,10 @@ static void ehci_mem_writel(void *ptr, target_phys_addr_t addr, uint32_t val)
         ehci_clear_usbsts(s, val);          // bits 0 through 5 are R/WC
         val = s->usbsts;
         ehci_update_irq(s);
+        /* the async schedule waits for the guest to acknowledge IAA */
+        if (old & ~val & USBSTS_IAA) {
+            qemu_bh_schedule(s->async_bh);
+        }
         break;
 
     case USBINTR:
@@ -46,6 +46,10 @@
 typedef struct AsyncURB AsyncURB;
 typedef struct USBRedirDevice USBRedirDevice;
 
+enum USBRedirDeviceOptions {
+    USBREDIR_OPT_PIPELINE,
+};
+
 /* Struct to hold buffered packets (iso or int input packets) */
 struct buf_packet {
     uint8_t *data;
@@ -76,6 +80,7 @@ struct USBRedirDevice {
     uint8_t debug;
     char *filter_str;
     int32_t bootindex;
+    uint32_t options;
     /* Data passed from chardev the fd_read cb to the usbredirparser read cb */
     const uint8_t *read_buf;
     int read_buf_size;
@@ -1199,6 +1204,11 @@ static void usbredir_ep_info(void *priv,
                             i & 0x0f);
         usb_ep->type = dev->endpoint[i].type;
         usb_ep->ifnum = dev->endpoint[i].interface;
+        /* Keep the bulk queue of the guest in flight on the channel, so
+           that each packet does not wait for the round trip of the one
+           before it; the other end completes them in order. */
+        usb_ep->pipeline = (dev->options & (1 << USBREDIR_OPT_PIPELINE)) &&
+            dev->endpoint[i].type == usb_redir_type_bulk;
     }
 }
 
@@ -1468,6 +1478,8 @@ static Property usbredir_properties[] = {
     DEFINE_PROP_UINT8("debug", USBRedirDevice, debug, 0),
     DEFINE_PROP_STRING("filter", USBRedirDevice, filter_str),
     DEFINE_PROP_INT32("bootindex", USBRedirDevice, bootindex, -1),
+    DEFINE_PROP_BIT("pipeline", USBRedirDevice, options,
+                    USBREDIR_OPT_PIPELINE, true),
     DEFINE_PROP_END_OF_LIST(),
 };
 
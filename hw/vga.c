@@ -28,6 +28,7 @@
 #include "pci.h"
 #include "vga_int.h"
 #include "pixel_ops.h"
+#include "ui/pixel-conv.h"
 #include "qemu-timer.h"
 #include "xen.h"
 #include "trace.h"
@@ -622,6 +623,60 @@ static uint32_t vbe_ioport_read_data(void *opaque, uint32_t addr)
     return val;
 }
 
+/* Leave damage reporting mode, e.g. on a mode switch */
+static void vbe_damage_stop(VGACommonState *s)
+{
+    if (s->vbe_damage) {
+        s->vbe_damage = false;
+        s->vbe_damage_count = 0;
+        vga_dirty_log_start(s);
+        s->graphic_mode = -1; /* force full update */
+    }
+}
+
+static void vbe_damage_report(VGACommonState *s, int x, int y, int w, int h)
+{
+    int xres = s->vbe_regs[VBE_DISPI_INDEX_XRES];
+    int yres = s->vbe_regs[VBE_DISPI_INDEX_YRES];
+    VGADamageRect *r;
+
+    if (!(s->vbe_regs[VBE_DISPI_INDEX_ENABLE] & VBE_DISPI_ENABLED)) {
+        return;
+    }
+
+    if (!s->vbe_damage) {
+        /* What was written before the first report is not known */
+        s->vbe_damage = true;
+        vga_dirty_log_stop(s);
+        s->vbe_damage_rects[0] = (VGADamageRect) { 0, 0, xres, yres };
+        s->vbe_damage_count = 1;
+    }
+
+    if (x >= xres || y >= yres) {
+        return;
+    }
+    w = MIN(w, xres - x);
+    h = MIN(h, yres - y);
+    if (w == 0 || h == 0) {
+        return;
+    }
+
+    if (s->vbe_damage_count < VBE_MAX_DAMAGE) {
+        s->vbe_damage_rects[s->vbe_damage_count++] =
+            (VGADamageRect) { x, y, w, h };
+        return;
+    }
+
+    /* Out of slots, grow the last rectangle to cover the new one */
+    r = &s->vbe_damage_rects[VBE_MAX_DAMAGE - 1];
+    w = MAX(r->x + r->w, x + w);
+    h = MAX(r->y + r->h, y + h);
+    r->x = MIN(r->x, x);
+    r->y = MIN(r->y, y);
+    r->w = w - r->x;
+    r->h = h - r->y;
+}
+
 static void vbe_ioport_write_index(void *opaque, uint32_t addr, uint32_t val)
 {
     VGACommonState *s = opaque;
@@ -632,7 +687,7 @@ static void vbe_ioport_write_data(void *opaque, uint32_t addr, uint32_t val)
 {
     VGACommonState *s = opaque;
 
-    if (s->vbe_index <= VBE_DISPI_INDEX_NB) {
+    if (s->vbe_index <= VBE_DISPI_INDEX_DAMAGE_H) {
 #ifdef DEBUG_BOCHS_VBE
         printf("VBE: write index=0x%x val=0x%x\n", s->vbe_index, val);
 #endif
@@ -642,10 +697,20 @@ static void vbe_ioport_write_data(void *opaque, uint32_t addr, uint32_t val)
                 val == VBE_DISPI_ID1 ||
                 val == VBE_DISPI_ID2 ||
                 val == VBE_DISPI_ID3 ||
-                val == VBE_DISPI_ID4) {
+                val == VBE_DISPI_ID4 ||
+                val == VBE_DISPI_ID_DAMAGE) {
                 s->vbe_regs[s->vbe_index] = val;
             }
             break;
+        case VBE_DISPI_INDEX_DAMAGE_X:
+        case VBE_DISPI_INDEX_DAMAGE_Y:
+        case VBE_DISPI_INDEX_DAMAGE_W:
+            s->vbe_damage_regs[s->vbe_index - VBE_DISPI_INDEX_DAMAGE_X] = val;
+            break;
+        case VBE_DISPI_INDEX_DAMAGE_H:
+            vbe_damage_report(s, s->vbe_damage_regs[0], s->vbe_damage_regs[1],
+                              s->vbe_damage_regs[2], val);
+            break;
         case VBE_DISPI_INDEX_XRES:
             if ((val <= VBE_DISPI_MAX_XRES) && ((val & 7) == 0)) {
                 s->vbe_regs[s->vbe_index] = val;
@@ -675,6 +740,7 @@ static void vbe_ioport_write_data(void *opaque, uint32_t addr, uint32_t val)
             vga_update_memory_access(s);
             break;
         case VBE_DISPI_INDEX_ENABLE:
+            vbe_damage_stop(s);
             if ((val & VBE_DISPI_ENABLED) &&
                 !(s->vbe_regs[VBE_DISPI_INDEX_ENABLE] & VBE_DISPI_ENABLED)) {
                 int h, shift_control;
@@ -1626,6 +1692,51 @@ void vga_dirty_log_stop(VGACommonState *s)
     memory_region_set_log(&s->vram, false, DIRTY_MEMORY_VGA);
 }
 
+static bool vga_damage_active(VGACommonState *s)
+{
+#ifdef CONFIG_BOCHS_VBE
+    return s->vbe_damage;
+#else
+    return false;
+#endif
+}
+
+#ifdef CONFIG_BOCHS_VBE
+/*
+ * Redraw only the rectangles reported by the guest.  Used for linear modes
+ * without line doubling or split screen, where line y starts at
+ * addr1 + y * line_offset.
+ */
+static void vga_draw_damage(VGACommonState *s, vga_draw_line_func *draw_line,
+                            uint32_t addr1, int width, int height)
+{
+    uint8_t *d = ds_get_data(s->ds);
+    int linesize = ds_get_linesize(s->ds);
+    int i, y;
+
+    for (i = 0; i < s->vbe_damage_count; i++) {
+        VGADamageRect *r = &s->vbe_damage_rects[i];
+        int x0 = MIN(r->x, width);
+        int y0 = MIN(r->y, height);
+        int x1 = MIN(r->x + r->w, width);
+        int y1 = MIN(r->y + r->h, height);
+
+        if (x0 >= x1 || y0 >= y1) {
+            continue;
+        }
+        if (!is_buffer_shared(s->ds->surface)) {
+            for (y = y0; y < y1; y++) {
+                draw_line(s, d + y * linesize,
+                          s->vram_ptr + addr1 + y * s->line_offset, width);
+            }
+        }
+        dpy_update(s->ds, x0, y0, x1 - x0, y1 - y0);
+    }
+    s->vbe_damage_count = 0;
+    memset(s->invalidated_y_table, 0, ((height + 31) >> 5) * 4);
+}
+#endif
+
 /*
  * graphic modes
  */
@@ -1641,7 +1752,7 @@ static void vga_draw_graphic(VGACommonState *s, int full_update)
 
     full_update |= update_basic_params(s);
 
-    if (!full_update)
+    if (!full_update && !vga_damage_active(s))
         vga_sync_dirty_bitmap(s);
 
     s->get_resolution(s, &width, &height);
@@ -1771,6 +1882,16 @@ static void vga_draw_graphic(VGACommonState *s, int full_update)
            s->line_compare, s->sr[VGA_SEQ_CLOCK_MODE]);
 #endif
     addr1 = (s->start_addr * 4);
+#ifdef CONFIG_BOCHS_VBE
+    if (vga_damage_active(s)) {
+        if (!full_update && multi_scan == 0 && s->line_compare >= height) {
+            vga_draw_damage(s, vga_draw_line, addr1, width, height);
+            return;
+        }
+        /* everything is redrawn anyway */
+        s->vbe_damage_count = 0;
+    }
+#endif
     bwidth = (width * bits + 7) / 8;
     y_start = -1;
     page_min = -1;
@@ -1950,6 +2071,7 @@ void vga_common_reset(VGACommonState *s)
     s->vbe_start_addr = 0;
     s->vbe_line_offset = 0;
     s->vbe_bank_mask = (s->vram_size >> 16) - 1;
+    vbe_damage_stop(s);
 #endif
     memset(s->font_offsets, '\0', sizeof(s->font_offsets));
     s->graphic_mode = -1; /* force full update */
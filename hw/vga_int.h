@@ -48,12 +48,23 @@
 #define VBE_DISPI_INDEX_NB              0xa /* size of vbe_regs[] */
 #define VBE_DISPI_INDEX_VIDEO_MEMORY_64K 0xa /* read-only, not in vbe_regs */
 
+/* QEMU extension: the guest reports the rectangles it changed, so that the
+ * display does not need dirty logging of the video memory.  Write-only,
+ * writing the height reports the rectangle.  Probed by writing
+ * VBE_DISPI_ID_DAMAGE to the id register and reading it back.
+ */
+#define VBE_DISPI_INDEX_DAMAGE_X        0xb
+#define VBE_DISPI_INDEX_DAMAGE_Y        0xc
+#define VBE_DISPI_INDEX_DAMAGE_W        0xd
+#define VBE_DISPI_INDEX_DAMAGE_H        0xe
+
 #define VBE_DISPI_ID0                   0xB0C0
 #define VBE_DISPI_ID1                   0xB0C1
 #define VBE_DISPI_ID2                   0xB0C2
 #define VBE_DISPI_ID3                   0xB0C3
 #define VBE_DISPI_ID4                   0xB0C4
 #define VBE_DISPI_ID5                   0xB0C5
+#define VBE_DISPI_ID_DAMAGE             0xB0D0 /* not a Bochs version */
 
 #define VBE_DISPI_DISABLED              0x00
 #define VBE_DISPI_ENABLED               0x01
@@ -66,13 +77,24 @@
 
 #ifdef CONFIG_BOCHS_VBE
 
+/* Damage rectangles queued between two refreshes, merged when full */
+#define VBE_MAX_DAMAGE                  16
+
+typedef struct VGADamageRect {
+    uint16_t x, y, w, h;
+} VGADamageRect;
+
 #define VGA_STATE_COMMON_BOCHS_VBE              \
     uint16_t vbe_index;                         \
     uint16_t vbe_regs[VBE_DISPI_INDEX_NB];      \
     uint32_t vbe_start_addr;                    \
     uint32_t vbe_line_offset;                   \
     uint32_t vbe_bank_mask;			\
-    int vbe_mapped;
+    int vbe_mapped;                             \
+    uint16_t vbe_damage_regs[3];                \
+    bool vbe_damage;                            \
+    int vbe_damage_count;                       \
+    VGADamageRect vbe_damage_rects[VBE_MAX_DAMAGE];
 #else
 
 #define VGA_STATE_COMMON_BOCHS_VBE
@@ -41,6 +41,16 @@
 #define PIXEL_NAME DEPTH
 #endif /* BGR_FORMAT */
 
+/* the shared converters handle little endian guests on little endian hosts */
+#if DEPTH == 32 && !defined(HOST_WORDS_BIGENDIAN) && \
+    !defined(TARGET_WORDS_BIGENDIAN)
+#ifdef BGR_FORMAT
+#define PIXEL_CONV_DST PIXEL_CONV_XBGR8888
+#else
+#define PIXEL_CONV_DST PIXEL_CONV_XRGB8888
+#endif
+#endif
+
 #if DEPTH != 15 && !defined(BGR_FORMAT)
 
 static inline void glue(vga_draw_glyph_line_, DEPTH)(uint8_t *d,
@@ -322,6 +332,10 @@ static void glue(vga_draw_line8_, DEPTH)(VGACommonState *s1, uint8_t *d,
                                          const uint8_t *s, int width)
 {
     uint32_t *palette;
+#if BPP == 4
+    palette = s1->last_palette;
+    pixel_conv_palette8(d, s, palette, width);
+#else
     int x;
 
     palette = s1->last_palette;
@@ -338,6 +352,7 @@ static void glue(vga_draw_line8_, DEPTH)(VGACommonState *s1, uint8_t *d,
         d += BPP * 8;
         s += 8;
     }
+#endif
 }
 
 #endif /* DEPTH != 15 */
@@ -353,6 +368,8 @@ static void glue(vga_draw_line15_, PIXEL_NAME)(VGACommonState *s1, uint8_t *d,
 {
 #if DEPTH == 15 && defined(HOST_WORDS_BIGENDIAN) == defined(TARGET_WORDS_BIGENDIAN)
     memcpy(d, s, width * 2);
+#elif defined(PIXEL_CONV_DST)
+    pixel_conv(PIXEL_CONV_RGB555, PIXEL_CONV_DST, d, s, width);
 #else
     int w;
     uint32_t v, r, g, b;
@@ -378,6 +395,8 @@ static void glue(vga_draw_line16_, PIXEL_NAME)(VGACommonState *s1, uint8_t *d,
 {
 #if DEPTH == 16 && defined(HOST_WORDS_BIGENDIAN) == defined(TARGET_WORDS_BIGENDIAN)
     memcpy(d, s, width * 2);
+#elif defined(PIXEL_CONV_DST)
+    pixel_conv(PIXEL_CONV_RGB565, PIXEL_CONV_DST, d, s, width);
 #else
     int w;
     uint32_t v, r, g, b;
@@ -401,6 +420,9 @@ static void glue(vga_draw_line16_, PIXEL_NAME)(VGACommonState *s1, uint8_t *d,
 static void glue(vga_draw_line24_, PIXEL_NAME)(VGACommonState *s1, uint8_t *d,
                                           const uint8_t *s, int width)
 {
+#if defined(PIXEL_CONV_DST)
+    pixel_conv(PIXEL_CONV_RGB888, PIXEL_CONV_DST, d, s, width);
+#else
     int w;
     uint32_t r, g, b;
 
@@ -419,6 +441,7 @@ static void glue(vga_draw_line24_, PIXEL_NAME)(VGACommonState *s1, uint8_t *d,
         s += 3;
         d += BPP;
     } while (--w != 0);
+#endif
 }
 
 /*
@@ -429,6 +452,8 @@ static void glue(vga_draw_line32_, PIXEL_NAME)(VGACommonState *s1, uint8_t *d,
 {
 #if DEPTH == 32 && defined(HOST_WORDS_BIGENDIAN) == defined(TARGET_WORDS_BIGENDIAN) && !defined(BGR_FORMAT)
     memcpy(d, s, width * 4);
+#elif defined(PIXEL_CONV_DST)
+    pixel_conv(PIXEL_CONV_XRGB8888, PIXEL_CONV_DST, d, s, width);
 #else
     int w;
     uint32_t r, g, b;
@@ -452,6 +477,7 @@ static void glue(vga_draw_line32_, PIXEL_NAME)(VGACommonState *s1, uint8_t *d,
 }
 
 #undef PUT_PIXEL2
+#undef PIXEL_CONV_DST
 #undef DEPTH
 #undef BPP
 #undef PIXEL_TYPE
@@ -0,0 +1,363 @@
+/*
+ * vhost-scsi host device
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+/*
+ * The virtio-scsi queues are handed to a LIO target in the host kernel
+ * through /dev/vhost-scsi, which then processes the requests without
+ * exiting to QEMU.  QEMU only provides the configuration space, sets up
+ * the memory table and the vrings and binds the endpoint when the guest
+ * driver is ready.  There is no userspace fallback: the LUNs are those of
+ * the kernel target, not SCSI devices on a QEMU bus.
+ */
+
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <linux/vhost.h>
+#include "config.h"
+#include "qemu-common.h"
+#include "qemu-error.h"
+#include "qerror.h"
+#include "migration.h"
+#include "monitor.h"
+#include "vhost.h"
+#include "virtio-pci.h"
+#include "virtio-scsi.h"
+
+typedef struct VHostSCSI {
+    VirtIODevice vdev;
+    DeviceState *qdev;
+    VirtIOSCSIConf *conf;
+    struct vhost_dev dev;
+    Error *migration_blocker;
+} VHostSCSI;
+
+static int vhost_scsi_set_endpoint(VHostSCSI *s, unsigned long request)
+{
+    struct vhost_scsi_target backend;
+
+    memset(&backend, 0, sizeof(backend));
+    backend.abi_version = VHOST_SCSI_ABI_VERSION;
+    pstrcpy(backend.vhost_wwpn, sizeof(backend.vhost_wwpn), s->conf->wwpn);
+    if (ioctl(s->dev.control, request, &backend) < 0) {
+        return -errno;
+    }
+    return 0;
+}
+
+static int vhost_scsi_start(VHostSCSI *s)
+{
+    VirtIODevice *vdev = &s->vdev;
+    int ret;
+
+    if (!vdev->binding->set_guest_notifiers) {
+        error_report("binding does not support guest notifiers");
+        return -ENOSYS;
+    }
+
+    ret = vhost_dev_enable_notifiers(&s->dev, vdev);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = vdev->binding->set_guest_notifiers(vdev->binding_opaque, true);
+    if (ret < 0) {
+        error_report("Error binding guest notifier: %d", -ret);
+        goto err_host_notifiers;
+    }
+
+    s->dev.acked_features = vdev->guest_features;
+    ret = vhost_dev_start(&s->dev, vdev);
+    if (ret < 0) {
+        error_report("Error starting vhost: %d", -ret);
+        goto err_guest_notifiers;
+    }
+
+    ret = vhost_scsi_set_endpoint(s, VHOST_SCSI_SET_ENDPOINT);
+    if (ret < 0) {
+        error_report("Error setting vhost-scsi endpoint %s: %s",
+                     s->conf->wwpn, strerror(-ret));
+        goto err_vhost_stop;
+    }
+    return 0;
+
+err_vhost_stop:
+    vhost_dev_stop(&s->dev, vdev);
+err_guest_notifiers:
+    vdev->binding->set_guest_notifiers(vdev->binding_opaque, false);
+err_host_notifiers:
+    vhost_dev_disable_notifiers(&s->dev, vdev);
+    return ret;
+}
+
+static void vhost_scsi_stop(VHostSCSI *s)
+{
+    VirtIODevice *vdev = &s->vdev;
+    int ret;
+
+    ret = vhost_scsi_set_endpoint(s, VHOST_SCSI_CLEAR_ENDPOINT);
+    if (ret < 0) {
+        error_report("Error clearing vhost-scsi endpoint %s: %s",
+                     s->conf->wwpn, strerror(-ret));
+    }
+    vhost_dev_stop(&s->dev, vdev);
+
+    ret = vdev->binding->set_guest_notifiers(vdev->binding_opaque, false);
+    if (ret < 0) {
+        error_report("vhost guest notifier cleanup failed: %d", ret);
+    }
+    assert(ret >= 0);
+    vhost_dev_disable_notifiers(&s->dev, vdev);
+}
+
+static void vhost_scsi_set_status(VirtIODevice *vdev, uint8_t val)
+{
+    VHostSCSI *s = (VHostSCSI *)vdev;
+    bool start = (val & VIRTIO_CONFIG_S_DRIVER_OK) && vdev->vm_running;
+    int ret;
+
+    if (s->dev.started == start) {
+        return;
+    }
+
+    if (start) {
+        ret = vhost_scsi_start(s);
+        if (ret < 0) {
+            error_report("virtio-scsi: unable to start vhost: %s",
+                         strerror(-ret));
+            /* there is no userspace virtio-scsi fallback */
+            exit(1);
+        }
+    } else {
+        vhost_scsi_stop(s);
+    }
+}
+
+static void vhost_scsi_get_config(VirtIODevice *vdev, uint8_t *config)
+{
+    VirtIOSCSIConfig *scsiconf = (VirtIOSCSIConfig *)config;
+    VHostSCSI *s = (VHostSCSI *)vdev;
+
+    stl_raw(&scsiconf->num_queues, s->conf->num_queues);
+    stl_raw(&scsiconf->seg_max, VIRTIO_SCSI_VQ_SIZE - 2);
+    stl_raw(&scsiconf->max_sectors, s->conf->max_sectors);
+    stl_raw(&scsiconf->cmd_per_lun, s->conf->cmd_per_lun);
+    stl_raw(&scsiconf->event_info_size, sizeof(VirtIOSCSIEvent));
+    stl_raw(&scsiconf->sense_size, VIRTIO_SCSI_SENSE_SIZE);
+    stl_raw(&scsiconf->cdb_size, VIRTIO_SCSI_CDB_SIZE);
+    stl_raw(&scsiconf->max_channel, VIRTIO_SCSI_MAX_CHANNEL);
+    stl_raw(&scsiconf->max_target, VIRTIO_SCSI_MAX_TARGET);
+    stl_raw(&scsiconf->max_lun, VIRTIO_SCSI_MAX_LUN);
+}
+
+static void vhost_scsi_set_config(VirtIODevice *vdev, const uint8_t *config)
+{
+    VirtIOSCSIConfig *scsiconf = (VirtIOSCSIConfig *)config;
+
+    if ((uint32_t) ldl_raw(&scsiconf->sense_size) != VIRTIO_SCSI_SENSE_SIZE ||
+        (uint32_t) ldl_raw(&scsiconf->cdb_size) != VIRTIO_SCSI_CDB_SIZE) {
+        error_report("vhost-scsi does not support changing the sense data "
+                     "and CDB sizes");
+        exit(1);
+    }
+}
+
+static uint32_t vhost_scsi_get_features(VirtIODevice *vdev,
+                                        uint32_t features)
+{
+    VHostSCSI *s = (VHostSCSI *)vdev;
+
+    /* Clear features not supported by host kernel. */
+    if (!(s->dev.features & (1 << VIRTIO_F_NOTIFY_ON_EMPTY))) {
+        features &= ~(1 << VIRTIO_F_NOTIFY_ON_EMPTY);
+    }
+    if (!(s->dev.features & (1 << VIRTIO_RING_F_INDIRECT_DESC))) {
+        features &= ~(1 << VIRTIO_RING_F_INDIRECT_DESC);
+    }
+    if (!(s->dev.features & (1 << VIRTIO_RING_F_EVENT_IDX))) {
+        features &= ~(1 << VIRTIO_RING_F_EVENT_IDX);
+    }
+    return features;
+}
+
+/* Kicks go to the kernel once the device is started */
+static void vhost_scsi_handle_output(VirtIODevice *vdev, VirtQueue *vq)
+{
+}
+
+VirtIODevice *vhost_scsi_init(DeviceState *dev, VirtIOSCSIConf *proxyconf)
+{
+    VHostSCSI *s;
+    int vhostfd = -1;
+    int abi_version;
+    int i, ret;
+
+    if (!proxyconf->wwpn) {
+        error_report("vhost-scsi: missing wwpn");
+        return NULL;
+    }
+    if (proxyconf->num_queues == 0 ||
+        proxyconf->num_queues > VIRTIO_PCI_QUEUE_MAX -
+                                VIRTIO_SCSI_VQ_NUM_FIXED) {
+        error_report("vhost-scsi: invalid number of queues %u",
+                     proxyconf->num_queues);
+        return NULL;
+    }
+
+    if (proxyconf->vhostfd) {
+        vhostfd = net_handle_fd_param(cur_mon, proxyconf->vhostfd);
+        if (vhostfd == -1) {
+            error_report("vhost-scsi: unable to parse vhostfd");
+            return NULL;
+        }
+    } else {
+        vhostfd = open("/dev/vhost-scsi", O_RDWR);
+        if (vhostfd < 0) {
+            error_report("vhost-scsi: open vhost char device failed: %s",
+                         strerror(errno));
+            return NULL;
+        }
+    }
+
+    s = (VHostSCSI *)virtio_common_init("vhost-scsi", VIRTIO_ID_SCSI,
+                                        sizeof(VirtIOSCSIConfig),
+                                        sizeof(VHostSCSI));
+    s->qdev = dev;
+    s->conf = proxyconf;
+
+    s->vdev.get_config = vhost_scsi_get_config;
+    s->vdev.set_config = vhost_scsi_set_config;
+    s->vdev.get_features = vhost_scsi_get_features;
+    s->vdev.set_status = vhost_scsi_set_status;
+
+    /* every queue, including control and event, belongs to the kernel */
+    for (i = 0; i < VIRTIO_SCSI_VQ_NUM_FIXED + proxyconf->num_queues; i++) {
+        virtio_add_queue(&s->vdev, VIRTIO_SCSI_VQ_SIZE,
+                         vhost_scsi_handle_output);
+    }
+
+    s->dev.nvqs = VIRTIO_SCSI_VQ_NUM_FIXED + proxyconf->num_queues;
+    s->dev.vqs = g_new0(struct vhost_virtqueue, s->dev.nvqs);
+    s->dev.vq_index = 0;
+
+    ret = vhost_dev_init(&s->dev, vhostfd, VHOST_BACKEND_TYPE_KERNEL, true);
+    if (ret < 0) {
+        error_report("vhost-scsi: vhost initialization failed: %s",
+                     strerror(-ret));
+        goto fail;
+    }
+
+    if (ioctl(s->dev.control, VHOST_SCSI_GET_ABI_VERSION, &abi_version) < 0) {
+        error_report("vhost-scsi: unable to get ABI version: %s",
+                     strerror(errno));
+        goto fail_cleanup;
+    }
+    if (abi_version > VHOST_SCSI_ABI_VERSION) {
+        error_report("vhost-scsi: the running tcm_vhost module has ABI "
+                     "version %d, greater than the supported version %d",
+                     abi_version, VHOST_SCSI_ABI_VERSION);
+        goto fail_cleanup;
+    }
+
+    /* the requests in flight live in the kernel */
+    error_set(&s->migration_blocker, QERR_DEVICE_FEATURE_BLOCKS_MIGRATION,
+              "vhost-scsi", "vhost-scsi");
+    migrate_add_blocker(s->migration_blocker);
+
+    return &s->vdev;
+
+fail_cleanup:
+    vhost_dev_cleanup(&s->dev);
+fail:
+    g_free(s->dev.vqs);
+    virtio_cleanup(&s->vdev);
+    return NULL;
+}
+
+void vhost_scsi_exit(VirtIODevice *vdev)
+{
+    VHostSCSI *s = (VHostSCSI *)vdev;
+
+    /* This will stop the vhost backend. */
+    vhost_scsi_set_status(vdev, 0);
+
+    migrate_del_blocker(s->migration_blocker);
+    error_free(s->migration_blocker);
+
+    vhost_dev_cleanup(&s->dev);
+    g_free(s->dev.vqs);
+    virtio_cleanup(vdev);
+}
+
+static int vhost_scsi_init_pci(PCIDevice *pci_dev)
+{
+    VirtIOPCIProxy *proxy = DO_UPCAST(VirtIOPCIProxy, pci_dev, pci_dev);
+    VirtIODevice *vdev;
+
+    vdev = vhost_scsi_init(&pci_dev->qdev, &proxy->scsi);
+    if (!vdev) {
+        return -EINVAL;
+    }
+
+    vdev->nvectors = proxy->nvectors == DEV_NVECTORS_UNSPECIFIED
+                                        ? proxy->scsi.num_queues + 3
+                                        : proxy->nvectors;
+    virtio_init_pci(proxy, vdev);
+
+    /* make the actual value visible */
+    proxy->nvectors = vdev->nvectors;
+    return 0;
+}
+
+static void vhost_scsi_exit_pci(PCIDevice *pci_dev)
+{
+    VirtIOPCIProxy *proxy = DO_UPCAST(VirtIOPCIProxy, pci_dev, pci_dev);
+
+    vhost_scsi_exit(proxy->vdev);
+    virtio_exit_pci(pci_dev);
+}
+
+static Property vhost_scsi_properties[] = {
+    DEFINE_PROP_BIT("ioeventfd", VirtIOPCIProxy, flags, VIRTIO_PCI_FLAG_USE_IOEVENTFD_BIT, true),
+    DEFINE_PROP_UINT32("vectors", VirtIOPCIProxy, nvectors, DEV_NVECTORS_UNSPECIFIED),
+    DEFINE_VIRTIO_COMMON_FEATURES(VirtIOPCIProxy, host_features),
+    DEFINE_PROP_UINT32("num_queues", VirtIOPCIProxy, scsi.num_queues, 1),
+    DEFINE_PROP_UINT32("max_sectors", VirtIOPCIProxy, scsi.max_sectors, 0xFFFF),
+    DEFINE_PROP_UINT32("cmd_per_lun", VirtIOPCIProxy, scsi.cmd_per_lun, 128),
+    DEFINE_PROP_STRING("wwpn", VirtIOPCIProxy, scsi.wwpn),
+    DEFINE_PROP_STRING("vhostfd", VirtIOPCIProxy, scsi.vhostfd),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void vhost_scsi_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    PCIDeviceClass *k = PCI_DEVICE_CLASS(klass);
+
+    k->init = vhost_scsi_init_pci;
+    k->exit = vhost_scsi_exit_pci;
+    k->vendor_id = PCI_VENDOR_ID_REDHAT_QUMRANET;
+    k->device_id = PCI_DEVICE_ID_VIRTIO_SCSI;
+    k->revision = 0x00;
+    k->class_id = PCI_CLASS_STORAGE_SCSI;
+    dc->reset = virtio_pci_reset;
+    dc->props = vhost_scsi_properties;
+}
+
+static TypeInfo vhost_scsi_info = {
+    .name          = "vhost-scsi-pci",
+    .parent        = TYPE_PCI_DEVICE,
+    .instance_size = sizeof(VirtIOPCIProxy),
+    .class_init    = vhost_scsi_class_init,
+};
+
+static void vhost_scsi_register_types(void)
+{
+    type_register_static(&vhost_scsi_info);
+}
+
+type_init(vhost_scsi_register_types)
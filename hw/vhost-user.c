@@ -0,0 +1,402 @@
+/*
+ * vhost-user
+ *
+ * Copyright Red Hat, Inc. 2012
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "vhost.h"
+#include "vhost-backend.h"
+#include "qemu-common.h"
+#include "qemu-error.h"
+#include "qemu_socket.h"
+#include "cpu-common.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/vhost.h>
+
+/* The messages are the vhost ioctls, sent over a UNIX socket to the
+ * process that runs the device.  File descriptors (guest RAM, kick and
+ * call eventfds) travel as SCM_RIGHTS ancillary data.  See
+ * docs/specs/vhost-user.txt.
+ */
+
+#define VHOST_MEMORY_MAX_NREGIONS    8
+
+typedef enum VhostUserRequest {
+    VHOST_USER_NONE = 0,
+    VHOST_USER_GET_FEATURES = 1,
+    VHOST_USER_SET_FEATURES = 2,
+    VHOST_USER_SET_OWNER = 3,
+    VHOST_USER_RESET_OWNER = 4,
+    VHOST_USER_SET_MEM_TABLE = 5,
+    VHOST_USER_SET_LOG_BASE = 6,
+    VHOST_USER_SET_LOG_FD = 7,
+    VHOST_USER_SET_VRING_NUM = 8,
+    VHOST_USER_SET_VRING_ADDR = 9,
+    VHOST_USER_SET_VRING_BASE = 10,
+    VHOST_USER_GET_VRING_BASE = 11,
+    VHOST_USER_SET_VRING_KICK = 12,
+    VHOST_USER_SET_VRING_CALL = 13,
+    VHOST_USER_SET_VRING_ERR = 14,
+    VHOST_USER_MAX
+} VhostUserRequest;
+
+typedef struct VhostUserMemoryRegion {
+    uint64_t guest_phys_addr;
+    uint64_t memory_size;
+    uint64_t userspace_addr;
+    /* where the region starts in the file descriptor sent with it */
+    uint64_t mmap_offset;
+} VhostUserMemoryRegion;
+
+typedef struct VhostUserMemory {
+    uint32_t nregions;
+    uint32_t padding;
+    VhostUserMemoryRegion regions[VHOST_MEMORY_MAX_NREGIONS];
+} VhostUserMemory;
+
+typedef struct VhostUserMsg {
+    uint32_t request;
+
+#define VHOST_USER_VERSION_MASK     (0x3)
+#define VHOST_USER_REPLY_MASK       (0x1 << 2)
+    uint32_t flags;
+    uint32_t size; /* the following payload size */
+    union {
+#define VHOST_USER_VRING_IDX_MASK   (0xff)
+#define VHOST_USER_VRING_NOFD_MASK  (0x1 << 8)
+        uint64_t u64;
+        struct vhost_vring_state state;
+        struct vhost_vring_addr addr;
+        VhostUserMemory memory;
+    } payload;
+} QEMU_PACKED VhostUserMsg;
+
+#define VHOST_USER_HDR_SIZE     offsetof(VhostUserMsg, payload)
+
+/* The version of the protocol we support */
+#define VHOST_USER_VERSION      (0x1)
+
+static VhostUserRequest vhost_user_request_translate(unsigned long request)
+{
+    switch (request) {
+    case VHOST_GET_FEATURES:
+        return VHOST_USER_GET_FEATURES;
+    case VHOST_SET_FEATURES:
+        return VHOST_USER_SET_FEATURES;
+    case VHOST_SET_OWNER:
+        return VHOST_USER_SET_OWNER;
+    case VHOST_RESET_OWNER:
+        return VHOST_USER_RESET_OWNER;
+    case VHOST_SET_MEM_TABLE:
+        return VHOST_USER_SET_MEM_TABLE;
+    case VHOST_SET_LOG_BASE:
+        return VHOST_USER_SET_LOG_BASE;
+    case VHOST_SET_LOG_FD:
+        return VHOST_USER_SET_LOG_FD;
+    case VHOST_SET_VRING_NUM:
+        return VHOST_USER_SET_VRING_NUM;
+    case VHOST_SET_VRING_ADDR:
+        return VHOST_USER_SET_VRING_ADDR;
+    case VHOST_SET_VRING_BASE:
+        return VHOST_USER_SET_VRING_BASE;
+    case VHOST_GET_VRING_BASE:
+        return VHOST_USER_GET_VRING_BASE;
+    case VHOST_SET_VRING_KICK:
+        return VHOST_USER_SET_VRING_KICK;
+    case VHOST_SET_VRING_CALL:
+        return VHOST_USER_SET_VRING_CALL;
+    case VHOST_SET_VRING_ERR:
+        return VHOST_USER_SET_VRING_ERR;
+    default:
+        return VHOST_USER_MAX;
+    }
+}
+
+static int vhost_user_read_all(int fd, void *buf, size_t len)
+{
+    uint8_t *p = buf;
+
+    while (len > 0) {
+        ssize_t r = read(fd, p, len);
+
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            if (r == 0) {
+                errno = ECONNRESET;
+            }
+            return -1;
+        }
+        p += r;
+        len -= r;
+    }
+    return 0;
+}
+
+static int vhost_user_read(struct vhost_dev *dev, VhostUserMsg *msg)
+{
+    if (vhost_user_read_all(dev->control, msg, VHOST_USER_HDR_SIZE) < 0) {
+        error_report("vhost-user: failed to read reply header: %s",
+                     strerror(errno));
+        return -1;
+    }
+
+    if (msg->flags != (VHOST_USER_REPLY_MASK | VHOST_USER_VERSION)) {
+        error_report("vhost-user: unexpected reply flags 0x%x", msg->flags);
+        errno = EPROTO;
+        return -1;
+    }
+
+    if (msg->size > sizeof(msg->payload)) {
+        error_report("vhost-user: reply payload of %u bytes is too large",
+                     msg->size);
+        errno = EPROTO;
+        return -1;
+    }
+
+    if (msg->size &&
+        vhost_user_read_all(dev->control, &msg->payload, msg->size) < 0) {
+        error_report("vhost-user: failed to read reply payload: %s",
+                     strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+static int vhost_user_write(struct vhost_dev *dev, VhostUserMsg *msg,
+                            int *fds, int fd_num)
+{
+    struct msghdr msgh;
+    struct iovec iov;
+    size_t fd_size = fd_num * sizeof(int);
+    char control[CMSG_SPACE(VHOST_MEMORY_MAX_NREGIONS * sizeof(int))];
+    ssize_t r;
+
+    assert(fd_num <= VHOST_MEMORY_MAX_NREGIONS);
+
+    memset(&msgh, 0, sizeof(msgh));
+    iov.iov_base = msg;
+    iov.iov_len = VHOST_USER_HDR_SIZE + msg->size;
+    msgh.msg_iov = &iov;
+    msgh.msg_iovlen = 1;
+
+    if (fd_num) {
+        struct cmsghdr *cmsg;
+
+        memset(control, 0, sizeof(control));
+        msgh.msg_control = control;
+        msgh.msg_controllen = CMSG_SPACE(fd_size);
+        cmsg = CMSG_FIRSTHDR(&msgh);
+        cmsg->cmsg_len = CMSG_LEN(fd_size);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        memcpy(CMSG_DATA(cmsg), fds, fd_size);
+    }
+
+    do {
+        r = sendmsg(dev->control, &msgh, 0);
+    } while (r < 0 && errno == EINTR);
+
+    if (r < 0) {
+        error_report("vhost-user: failed to send request %u: %s",
+                     msg->request, strerror(errno));
+        return -1;
+    }
+    if (r != iov.iov_len) {
+        error_report("vhost-user: short write sending request %u",
+                     msg->request);
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+static int vhost_user_set_mem_table(VhostUserMsg *msg, struct vhost_memory *mem,
+                                    int *fds, int *fd_num)
+{
+    int i;
+
+    for (i = 0; i < mem->nregions; i++) {
+        struct vhost_memory_region *reg = &mem->regions[i];
+        VhostUserMemoryRegion *dst;
+        ram_addr_t offset;
+        int fd;
+
+        fd = qemu_ram_get_fd((void *)(uintptr_t)reg->userspace_addr, &offset);
+        if (fd < 0) {
+            error_report("vhost-user: guest RAM must be a shared file "
+                         "mapping (use -mem-path with -mem-prealloc)");
+            errno = EINVAL;
+            return -1;
+        }
+        if (*fd_num == VHOST_MEMORY_MAX_NREGIONS) {
+            error_report("vhost-user: guest memory has more than %d regions",
+                         VHOST_MEMORY_MAX_NREGIONS);
+            errno = E2BIG;
+            return -1;
+        }
+
+        dst = &msg->payload.memory.regions[*fd_num];
+        dst->guest_phys_addr = reg->guest_phys_addr;
+        dst->memory_size = reg->memory_size;
+        dst->userspace_addr = reg->userspace_addr;
+        dst->mmap_offset = offset;
+        fds[(*fd_num)++] = fd;
+    }
+
+    msg->payload.memory.nregions = *fd_num;
+    msg->payload.memory.padding = 0;
+    msg->size = offsetof(VhostUserMemory, regions) +
+                *fd_num * sizeof(VhostUserMemoryRegion);
+    return 0;
+}
+
+static int vhost_user_call(struct vhost_dev *dev, unsigned long int request,
+                           void *arg)
+{
+    VhostUserMsg msg;
+    VhostUserRequest msg_request;
+    struct vhost_vring_file *file;
+    int fds[VHOST_MEMORY_MAX_NREGIONS];
+    int fd_num = 0;
+    bool need_reply = false;
+
+    assert(dev->vhost_ops->backend_type == VHOST_BACKEND_TYPE_USER);
+
+    msg_request = vhost_user_request_translate(request);
+    msg.request = msg_request;
+    msg.flags = VHOST_USER_VERSION;
+    msg.size = 0;
+
+    switch (msg_request) {
+    case VHOST_USER_GET_FEATURES:
+        need_reply = true;
+        break;
+
+    case VHOST_USER_SET_FEATURES:
+        msg.payload.u64 = *(uint64_t *)arg;
+        msg.size = sizeof(msg.payload.u64);
+        break;
+
+    case VHOST_USER_SET_OWNER:
+    case VHOST_USER_RESET_OWNER:
+        break;
+
+    case VHOST_USER_SET_MEM_TABLE:
+        if (vhost_user_set_mem_table(&msg, arg, fds, &fd_num) < 0) {
+            return -1;
+        }
+        break;
+
+    case VHOST_USER_SET_VRING_NUM:
+    case VHOST_USER_SET_VRING_BASE:
+        memcpy(&msg.payload.state, arg, sizeof(struct vhost_vring_state));
+        msg.size = sizeof(struct vhost_vring_state);
+        break;
+
+    case VHOST_USER_GET_VRING_BASE:
+        memcpy(&msg.payload.state, arg, sizeof(struct vhost_vring_state));
+        msg.size = sizeof(struct vhost_vring_state);
+        need_reply = true;
+        break;
+
+    case VHOST_USER_SET_VRING_ADDR:
+        memcpy(&msg.payload.addr, arg, sizeof(struct vhost_vring_addr));
+        msg.size = sizeof(struct vhost_vring_addr);
+        break;
+
+    case VHOST_USER_SET_VRING_KICK:
+    case VHOST_USER_SET_VRING_CALL:
+    case VHOST_USER_SET_VRING_ERR:
+        file = arg;
+        msg.payload.u64 = file->index & VHOST_USER_VRING_IDX_MASK;
+        msg.size = sizeof(msg.payload.u64);
+        if (file->fd >= 0) {
+            fds[fd_num++] = file->fd;
+        } else {
+            msg.payload.u64 |= VHOST_USER_VRING_NOFD_MASK;
+        }
+        break;
+
+    default:
+        /* The dirty log lives in QEMU's private memory, the other process
+         * can not write to it.  Migration is blocked instead.
+         */
+        error_report("vhost-user: request 0x%lx is not supported", request);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    if (vhost_user_write(dev, &msg, fds, fd_num) < 0) {
+        return -1;
+    }
+
+    if (need_reply) {
+        if (vhost_user_read(dev, &msg) < 0) {
+            return -1;
+        }
+
+        if (msg.request != msg_request) {
+            error_report("vhost-user: received reply %u to request %u",
+                         msg.request, msg_request);
+            errno = EPROTO;
+            return -1;
+        }
+
+        switch (msg_request) {
+        case VHOST_USER_GET_FEATURES:
+            if (msg.size != sizeof(msg.payload.u64)) {
+                error_report("vhost-user: bad GET_FEATURES reply size");
+                errno = EPROTO;
+                return -1;
+            }
+            *(uint64_t *)arg = msg.payload.u64;
+            break;
+        case VHOST_USER_GET_VRING_BASE:
+            if (msg.size != sizeof(struct vhost_vring_state)) {
+                error_report("vhost-user: bad GET_VRING_BASE reply size");
+                errno = EPROTO;
+                return -1;
+            }
+            memcpy(arg, &msg.payload.state, sizeof(struct vhost_vring_state));
+            break;
+        default:
+            abort();
+        }
+    }
+
+    return 0;
+}
+
+static int vhost_user_init(struct vhost_dev *dev, int devfd)
+{
+    assert(dev->vhost_ops->backend_type == VHOST_BACKEND_TYPE_USER);
+
+    if (devfd < 0) {
+        return -EBADF;
+    }
+    dev->control = devfd;
+    return 0;
+}
+
+static int vhost_user_cleanup(struct vhost_dev *dev)
+{
+    assert(dev->vhost_ops->backend_type == VHOST_BACKEND_TYPE_USER);
+
+    return closesocket(dev->control);
+}
+
+const VhostOps user_ops = {
+    .backend_type = VHOST_BACKEND_TYPE_USER,
+    .vhost_call = vhost_user_call,
+    .vhost_backend_init = vhost_user_init,
+    .vhost_backend_cleanup = vhost_user_cleanup,
+};
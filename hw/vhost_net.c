@@ -15,6 +15,7 @@
 
 #include "net.h"
 #include "net/tap.h"
+#include "net/vhost-user.h"
 
 #include "virtio-net.h"
 #include "vhost_net.h"
@@ -80,40 +81,48 @@ void vhost_net_ack_features(struct vhost_net *net, unsigned features)
     }
 }
 
-static int vhost_net_get_fd(NetClientState *backend)
+static bool vhost_net_is_tap(struct vhost_net *net)
 {
-    switch (backend->info->type) {
-    case NET_CLIENT_OPTIONS_KIND_TAP:
-        return tap_get_fd(backend);
-    default:
-        fprintf(stderr, "vhost-net requires tap backend\n");
-        return -EBADFD;
-    }
+    return net->nc->info->type == NET_CLIENT_OPTIONS_KIND_TAP;
 }
 
+/* For a vhost-user backend, devfd is the socket to the other process */
 struct vhost_net *vhost_net_init(NetClientState *backend, int devfd,
                                  bool force)
 {
     int r;
+    VhostBackendType backend_type;
     struct vhost_net *net = g_malloc(sizeof *net);
     if (!backend) {
         fprintf(stderr, "vhost-net requires backend to be setup\n");
         goto fail;
     }
-    r = vhost_net_get_fd(backend);
-    if (r < 0) {
+    net->nc = backend;
+
+    switch (backend->info->type) {
+    case NET_CLIENT_OPTIONS_KIND_TAP:
+        backend_type = VHOST_BACKEND_TYPE_KERNEL;
+        net->backend = tap_get_fd(backend);
+        net->dev.backend_features = tap_has_vnet_hdr(backend) ? 0 :
+            (1 << VHOST_NET_F_VIRTIO_NET_HDR);
+        break;
+    case NET_CLIENT_OPTIONS_KIND_VHOST_USER:
+        /* the other process owns the datapath and the virtio-net header */
+        backend_type = VHOST_BACKEND_TYPE_USER;
+        net->backend = -1;
+        net->dev.backend_features = 0;
+        break;
+    default:
+        fprintf(stderr, "vhost-net requires tap or vhost-user backend\n");
         goto fail;
     }
-    net->nc = backend;
-    net->dev.backend_features = tap_has_vnet_hdr(backend) ? 0 :
-        (1 << VHOST_NET_F_VIRTIO_NET_HDR);
-    net->backend = r;
 
-    r = vhost_dev_init(&net->dev, devfd, force);
+    r = vhost_dev_init(&net->dev, devfd, backend_type, force);
     if (r < 0) {
         goto fail;
     }
-    if (!tap_has_vnet_hdr_len(backend,
+    if (vhost_net_is_tap(net) &&
+        !tap_has_vnet_hdr_len(backend,
                               sizeof(struct virtio_net_hdr_mrg_rxbuf))) {
         net->dev.features &= ~(1 << VIRTIO_NET_F_MRG_RXBUF);
     }
@@ -137,20 +146,23 @@ bool vhost_net_query(VHostNetState *net, VirtIODevice *dev)
     return vhost_dev_query(&net->dev, dev);
 }
 
-int vhost_net_start(struct vhost_net *net,
-                    VirtIODevice *dev)
+static int vhost_net_start_one(struct vhost_net *net,
+                               VirtIODevice *dev,
+                               int vq_index)
 {
     struct vhost_vring_file file = { };
     int r;
 
     net->dev.nvqs = 2;
     net->dev.vqs = net->vqs;
+    net->dev.vq_index = vq_index;
 
     r = vhost_dev_enable_notifiers(&net->dev, dev);
     if (r < 0) {
         goto fail_notifiers;
     }
-    if (net->dev.acked_features & (1 << VIRTIO_NET_F_MRG_RXBUF)) {
+    if (vhost_net_is_tap(net) &&
+        (net->dev.acked_features & (1 << VIRTIO_NET_F_MRG_RXBUF))) {
         tap_set_vnet_hdr_len(net->nc,
                              sizeof(struct virtio_net_hdr_mrg_rxbuf));
     }
@@ -160,6 +172,10 @@ int vhost_net_start(struct vhost_net *net,
         goto fail_start;
     }
 
+    if (!vhost_net_is_tap(net)) {
+        return 0;
+    }
+
     net->nc->info->poll(net->nc, false);
     qemu_set_fd_handler(net->backend, NULL, NULL, NULL);
     file.fd = net->backend;
@@ -179,20 +195,27 @@ fail:
     }
     net->nc->info->poll(net->nc, true);
     vhost_dev_stop(&net->dev, dev);
-    if (net->dev.acked_features & (1 << VIRTIO_NET_F_MRG_RXBUF)) {
+fail_start:
+    if (vhost_net_is_tap(net) &&
+        (net->dev.acked_features & (1 << VIRTIO_NET_F_MRG_RXBUF))) {
         tap_set_vnet_hdr_len(net->nc, sizeof(struct virtio_net_hdr));
     }
-fail_start:
     vhost_dev_disable_notifiers(&net->dev, dev);
 fail_notifiers:
     return r;
 }
 
-void vhost_net_stop(struct vhost_net *net,
-                    VirtIODevice *dev)
+static void vhost_net_stop_one(struct vhost_net *net,
+                               VirtIODevice *dev)
 {
     struct vhost_vring_file file = { .fd = -1 };
 
+    if (!vhost_net_is_tap(net)) {
+        vhost_dev_stop(&net->dev, dev);
+        vhost_dev_disable_notifiers(&net->dev, dev);
+        return;
+    }
+
     for (file.index = 0; file.index < net->dev.nvqs; ++file.index) {
         int r = ioctl(net->dev.control, VHOST_NET_SET_BACKEND, &file);
         assert(r >= 0);
@@ -205,14 +228,84 @@ void vhost_net_stop(struct vhost_net *net,
     vhost_dev_disable_notifiers(&net->dev, dev);
 }
 
+/*
+ * Start one vhost device per queue pair of the virtio-net device; the
+ * device for pair i handles virtqueues 2 * i and 2 * i + 1.
+ */
+int vhost_net_start(VirtIODevice *dev, VHostNetState **nets,
+                    int total_queues)
+{
+    int r, i;
+
+    if (!dev->binding->set_guest_notifiers) {
+        error_report("binding does not support guest notifiers");
+        return -ENOSYS;
+    }
+
+    r = dev->binding->set_guest_notifiers(dev->binding_opaque, true);
+    if (r < 0) {
+        error_report("Error binding guest notifier: %d", -r);
+        return r;
+    }
+
+    for (i = 0; i < total_queues; i++) {
+        r = vhost_net_start_one(nets[i], dev, i * 2);
+        if (r < 0) {
+            goto err;
+        }
+    }
+    return 0;
+
+err:
+    while (--i >= 0) {
+        vhost_net_stop_one(nets[i], dev);
+    }
+    dev->binding->set_guest_notifiers(dev->binding_opaque, false);
+    return r;
+}
+
+void vhost_net_stop(VirtIODevice *dev, VHostNetState **nets,
+                    int total_queues)
+{
+    int i, r;
+
+    for (i = 0; i < total_queues; i++) {
+        vhost_net_stop_one(nets[i], dev);
+    }
+
+    r = dev->binding->set_guest_notifiers(dev->binding_opaque, false);
+    if (r < 0) {
+        fprintf(stderr, "vhost guest notifier cleanup failed: %d\n", r);
+        fflush(stderr);
+    }
+    assert(r >= 0);
+}
+
 void vhost_net_cleanup(struct vhost_net *net)
 {
     vhost_dev_cleanup(&net->dev);
-    if (net->dev.acked_features & (1 << VIRTIO_NET_F_MRG_RXBUF)) {
+    if (vhost_net_is_tap(net) &&
+        (net->dev.acked_features & (1 << VIRTIO_NET_F_MRG_RXBUF))) {
         tap_set_vnet_hdr_len(net->nc, sizeof(struct virtio_net_hdr));
     }
     g_free(net);
 }
+
+VHostNetState *get_vhost_net(NetClientState *nc)
+{
+    if (!nc) {
+        return NULL;
+    }
+
+    switch (nc->info->type) {
+    case NET_CLIENT_OPTIONS_KIND_TAP:
+        return tap_get_vhost_net(nc);
+    case NET_CLIENT_OPTIONS_KIND_VHOST_USER:
+        return vhost_user_get_vhost_net(nc);
+    default:
+        return NULL;
+    }
+}
 #else
 struct vhost_net *vhost_net_init(NetClientState *backend, int devfd,
                                  bool force)
@@ -226,13 +319,13 @@ bool vhost_net_query(VHostNetState *net, VirtIODevice *dev)
     return false;
 }
 
-int vhost_net_start(struct vhost_net *net,
-		    VirtIODevice *dev)
+int vhost_net_start(VirtIODevice *dev, VHostNetState **nets,
+                    int total_queues)
 {
     return -ENOSYS;
 }
-void vhost_net_stop(struct vhost_net *net,
-		    VirtIODevice *dev)
+void vhost_net_stop(VirtIODevice *dev, VHostNetState **nets,
+                    int total_queues)
 {
 }
 
@@ -247,4 +340,9 @@ unsigned vhost_net_get_features(struct vhost_net *net, unsigned features)
 void vhost_net_ack_features(struct vhost_net *net, unsigned features)
 {
 }
+
+VHostNetState *get_vhost_net(NetClientState *nc)
+{
+    return NULL;
+}
 #endif
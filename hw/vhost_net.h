@@ -9,12 +9,17 @@ typedef struct vhost_net VHostNetState;
 VHostNetState *vhost_net_init(NetClientState *backend, int devfd, bool force);
 
 bool vhost_net_query(VHostNetState *net, VirtIODevice *dev);
-int vhost_net_start(VHostNetState *net, VirtIODevice *dev);
-void vhost_net_stop(VHostNetState *net, VirtIODevice *dev);
+int vhost_net_start(VirtIODevice *dev, VHostNetState **nets,
+                    int total_queues);
+void vhost_net_stop(VirtIODevice *dev, VHostNetState **nets,
+                    int total_queues);
 
 void vhost_net_cleanup(VHostNetState *net);
 
 unsigned vhost_net_get_features(VHostNetState *net, unsigned features);
 void vhost_net_ack_features(VHostNetState *net, unsigned features);
 
+/* The vhost device of a tap or vhost-user backend, or NULL */
+VHostNetState *get_vhost_net(NetClientState *nc);
+
 #endif
@@ -22,21 +22,88 @@
 #include "virtio-balloon.h"
 #include "kvm.h"
 #include "exec-memory.h"
+#include "qemu-thread.h"
+#include "qemu-queue.h"
+#include "bitmap.h"
+#include "qemu-timer.h"
+#include "event_notifier.h"
 
 #if defined(__linux__)
 #include <sys/mman.h>
 #endif
 
+/*
+ * Automatic ballooning moves the target by 1/16 of the guest RAM at a time,
+ * and considers the guest short of memory below 1/8 of its total free.
+ */
+#define BALLOON_AUTO_STEP_SHIFT 4
+#define BALLOON_AUTO_LOW_SHIFT  3
+
+/* Report ids start here so that they never match the CMD_ID_* values */
+#define FREE_PAGE_HINT_CMD_ID_MIN 0x80000000
+
+/* Guest pages that are contiguous in host memory, discarded at once */
+typedef struct BalloonRange {
+    uint8_t *addr;
+    size_t len;
+    size_t page_size;           /* of the host mapping */
+} BalloonRange;
+
+/*
+ * An element of the inflate or deflate queue.  The madvise calls are made
+ * by the worker thread in the order the elements were popped, and the
+ * element is only pushed back once they are done: the guest may reuse a
+ * page as soon as its deflate completes, so an earlier discard of the
+ * same page must not still be pending.
+ */
+typedef struct BalloonRequest {
+    VirtQueue *vq;
+    VirtQueueElement *elem;
+    size_t len;
+    bool deflate;
+    BalloonRange *ranges;
+    int nr_ranges;
+    QSIMPLEQ_ENTRY(BalloonRequest) next;
+} BalloonRequest;
+
 typedef struct VirtIOBalloon
 {
     VirtIODevice vdev;
-    VirtQueue *ivq, *dvq, *svq;
+    VirtQueue *ivq, *dvq, *svq, *fpvq;
     uint32_t num_pages;
     uint32_t actual;
     uint64_t stats[VIRTIO_BALLOON_S_NR];
-    VirtQueueElement stats_vq_elem;
+    VirtQueueElement *stats_vq_elem;
     size_t stats_vq_offset;
     DeviceState *qdev;
+    VirtIOBalloonConf conf;
+    QEMUTimer *stats_timer;
+
+    /* host memory pressure, for the automatic policy */
+    EventNotifier pressure;
+    int pressure_level_fd;      /* -1 if not watched */
+    unsigned int pressure_events;   /* since the last stats report */
+
+    /* free page hinting, under the iothread lock */
+    uint32_t free_page_cmd_id;
+    bool free_page_hinting;     /* requested by migration */
+    bool free_page_reporting;   /* the guest acknowledged free_page_cmd_id */
+
+    QemuThread thread;
+    QemuMutex lock;
+    QemuCond cond;              /* signalled with a new or finished request */
+    /* protected by lock */
+    QSIMPLEQ_HEAD(, BalloonRequest) pending;
+    QSIMPLEQ_HEAD(, BalloonRequest) done;
+    bool busy;                  /* the worker is processing a request */
+    bool quit;
+    QEMUBH *done_bh;
+    VMChangeStateEntry *vmstate;
+
+    /* owned by the worker: the huge page being filled with guest pages,
+       which can only be discarded once all of them are ballooned */
+    uint8_t *pbp_base;
+    unsigned long *pbp_bitmap;
 } VirtIOBalloon;
 
 static VirtIOBalloon *to_virtio_balloon(VirtIODevice *vdev)
@@ -44,15 +111,165 @@ static VirtIOBalloon *to_virtio_balloon(VirtIODevice *vdev)
     return (VirtIOBalloon *)vdev;
 }
 
-static void balloon_page(void *addr, int deflate)
+static bool balloon_can_discard(void)
 {
 #if defined(__linux__)
-    if (!kvm_enabled() || kvm_has_sync_mmu())
-        qemu_madvise(addr, TARGET_PAGE_SIZE,
-                deflate ? QEMU_MADV_WILLNEED : QEMU_MADV_DONTNEED);
+    return !qemu_balloon_is_inhibited() &&
+           (!kvm_enabled() || kvm_has_sync_mmu());
+#else
+    return false;
 #endif
 }
 
+/* Huge pages cannot be discarded in part; remember which parts of the
+   current one the guest gave back and discard it when it is complete */
+static void balloon_partial_huge_page(VirtIOBalloon *s, uint8_t *addr,
+                                      size_t len, size_t page_size)
+{
+    uint8_t *base = (uint8_t *)((uintptr_t)addr & ~(uintptr_t)(page_size - 1));
+    long nr = page_size / TARGET_PAGE_SIZE;
+
+    if (base != s->pbp_base) {
+        g_free(s->pbp_bitmap);
+        s->pbp_bitmap = bitmap_new(nr);
+        s->pbp_base = base;
+    }
+    bitmap_set(s->pbp_bitmap, (addr - base) / TARGET_PAGE_SIZE,
+               len / TARGET_PAGE_SIZE);
+    if (find_first_zero_bit(s->pbp_bitmap, nr) == nr) {
+        qemu_madvise(base, page_size, QEMU_MADV_DONTNEED);
+        g_free(s->pbp_bitmap);
+        s->pbp_bitmap = NULL;
+        s->pbp_base = NULL;
+    }
+}
+
+static void balloon_inflate_range(VirtIOBalloon *s, BalloonRange *r)
+{
+    size_t mask = r->page_size - 1;
+    uint8_t *start, *end;
+
+    if (r->page_size <= TARGET_PAGE_SIZE) {
+        /* one call lets the kernel free transparent huge pages that the
+           range covers whole, without splitting them */
+        qemu_madvise(r->addr, r->len, QEMU_MADV_DONTNEED);
+        qemu_ram_set_discarded(r->addr, r->len, true);
+        return;
+    }
+
+    start = (uint8_t *)(((uintptr_t)r->addr + mask) & ~(uintptr_t)mask);
+    end = (uint8_t *)((uintptr_t)(r->addr + r->len) & ~(uintptr_t)mask);
+    if (start >= end) {
+        /* within a single huge page */
+        balloon_partial_huge_page(s, r->addr, r->len, r->page_size);
+        return;
+    }
+    if (r->addr < start) {
+        balloon_partial_huge_page(s, r->addr, start - r->addr, r->page_size);
+    }
+    qemu_madvise(start, end - start, QEMU_MADV_DONTNEED);
+    if (end < r->addr + r->len) {
+        balloon_partial_huge_page(s, end, r->addr + r->len - end,
+                                  r->page_size);
+    }
+}
+
+static void balloon_deflate_range(VirtIOBalloon *s, BalloonRange *r)
+{
+    if (s->pbp_base && r->addr < s->pbp_base + r->page_size &&
+        r->addr + r->len > s->pbp_base) {
+        /* the guest took back part of the huge page it was giving us */
+        g_free(s->pbp_bitmap);
+        s->pbp_bitmap = NULL;
+        s->pbp_base = NULL;
+    }
+    qemu_madvise(r->addr, r->len, QEMU_MADV_WILLNEED);
+    qemu_ram_set_discarded(r->addr, r->len, false);
+}
+
+static void balloon_process_request(VirtIOBalloon *s, BalloonRequest *req)
+{
+    int i;
+
+    if (!balloon_can_discard()) {
+        return;
+    }
+    for (i = 0; i < req->nr_ranges; i++) {
+        if (req->deflate) {
+            balloon_deflate_range(s, &req->ranges[i]);
+        } else {
+            balloon_inflate_range(s, &req->ranges[i]);
+        }
+    }
+}
+
+static void *balloon_thread(void *opaque)
+{
+    VirtIOBalloon *s = opaque;
+    BalloonRequest *req;
+
+    qemu_mutex_lock(&s->lock);
+    while (!s->quit) {
+        req = QSIMPLEQ_FIRST(&s->pending);
+        if (!req) {
+            qemu_cond_wait(&s->cond, &s->lock);
+            continue;
+        }
+        QSIMPLEQ_REMOVE_HEAD(&s->pending, next);
+        s->busy = true;
+        qemu_mutex_unlock(&s->lock);
+
+        balloon_process_request(s, req);
+
+        qemu_mutex_lock(&s->lock);
+        s->busy = false;
+        QSIMPLEQ_INSERT_TAIL(&s->done, req, next);
+        qemu_cond_broadcast(&s->cond);
+        qemu_bh_schedule(s->done_bh);
+    }
+    qemu_mutex_unlock(&s->lock);
+
+    return NULL;
+}
+
+/* Give the finished requests back to the guest, in order */
+static void balloon_complete_requests(VirtIOBalloon *s)
+{
+    QSIMPLEQ_HEAD(, BalloonRequest) done;
+    BalloonRequest *req;
+
+    qemu_mutex_lock(&s->lock);
+    QSIMPLEQ_INIT(&done);
+    QSIMPLEQ_CONCAT(&done, &s->done);
+    qemu_mutex_unlock(&s->lock);
+
+    while ((req = QSIMPLEQ_FIRST(&done))) {
+        QSIMPLEQ_REMOVE_HEAD(&done, next);
+        virtqueue_push(req->vq, req->elem, req->len);
+        virtio_notify(&s->vdev, req->vq);
+        g_free(req->elem);
+        g_free(req->ranges);
+        g_free(req);
+    }
+}
+
+static void balloon_done_bh(void *opaque)
+{
+    balloon_complete_requests(opaque);
+}
+
+/* Wait for the worker, for reset and for a VM stop, after which migration
+   must not see elements that were popped but not pushed */
+static void balloon_drain(VirtIOBalloon *s)
+{
+    qemu_mutex_lock(&s->lock);
+    while (!QSIMPLEQ_EMPTY(&s->pending) || s->busy) {
+        qemu_cond_wait(&s->cond, &s->lock);
+    }
+    qemu_mutex_unlock(&s->lock);
+    balloon_complete_requests(s);
+}
+
 /*
  * reset_stats - Mark all items in the stats array as unset
  *
@@ -70,16 +287,27 @@ static inline void reset_stats(VirtIOBalloon *dev)
 static void virtio_balloon_handle_output(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIOBalloon *s = to_virtio_balloon(vdev);
-    VirtQueueElement elem;
+    VirtQueueElement *elem;
     MemoryRegionSection section;
 
-    while (virtqueue_pop(vq, &elem)) {
+    while ((elem = virtqueue_pop(vq, sizeof(VirtQueueElement)))) {
+        BalloonRequest *req = g_new0(BalloonRequest, 1);
         size_t offset = 0;
+        IOVCursor cur;
         uint32_t pfn;
 
-        while (iov_to_buf(elem.out_sg, elem.out_num, offset, &pfn, 4) == 4) {
+        req->vq = vq;
+        req->elem = elem;
+        req->deflate = vq == s->dvq;
+        req->ranges = g_new(BalloonRange,
+                            iov_size(elem->out_sg, elem->out_num) / 4 + 1);
+
+        iov_cursor_init(&cur, elem->out_sg, elem->out_num, 0);
+        while (iov_cursor_to_buf(&cur, &pfn, 4) == 4) {
+            BalloonRange *r = &req->ranges[req->nr_ranges];
             ram_addr_t pa;
-            ram_addr_t addr;
+            uint8_t *addr;
+            size_t page_size;
 
             pa = (ram_addr_t)ldl_p(&pfn) << VIRTIO_BALLOON_PFN_SHIFT;
             offset += 4;
@@ -91,26 +319,263 @@ static void virtio_balloon_handle_output(VirtIODevice *vdev, VirtQueue *vq)
 
             /* Using memory_region_get_ram_ptr is bending the rules a bit, but
                should be OK because we only want a single page.  */
-            addr = section.offset_within_region;
-            balloon_page(memory_region_get_ram_ptr(section.mr) + addr,
-                         !!(vq == s->dvq));
+            addr = (uint8_t *)memory_region_get_ram_ptr(section.mr) +
+                   section.offset_within_region;
+
+            page_size = qemu_ram_pagesize(addr);
+
+            /* the guest usually hands out runs of consecutive frames */
+            if (req->nr_ranges && r[-1].addr + r[-1].len == addr &&
+                r[-1].page_size == page_size) {
+                r[-1].len += TARGET_PAGE_SIZE;
+                continue;
+            }
+            r->addr = addr;
+            r->len = TARGET_PAGE_SIZE;
+            r->page_size = page_size;
+            req->nr_ranges++;
         }
+        req->len = offset;
+
+        qemu_mutex_lock(&s->lock);
+        QSIMPLEQ_INSERT_TAIL(&s->pending, req, next);
+        qemu_cond_broadcast(&s->cond);
+        qemu_mutex_unlock(&s->lock);
+    }
+}
+
+/* The guest gave @len bytes at @addr out of its free memory for the
+   current report; migration does not need to send them unless they are
+   dirtied again.  Partial pages keep their dirty bit. */
+static void balloon_free_page_range(target_phys_addr_t addr,
+                                    target_phys_addr_t len)
+{
+    MemoryRegionSection section;
+    target_phys_addr_t end = addr + len;
+
+    while (addr < end) {
+        ram_addr_t start, stop;
 
-        virtqueue_push(vq, &elem, offset);
+        section = memory_region_find(get_system_memory(), addr, end - addr);
+        if (!section.size) {
+            break;
+        }
+        if (memory_region_is_ram(section.mr)) {
+            start = TARGET_PAGE_ALIGN(section.offset_within_region);
+            stop = (section.offset_within_region + section.size) &
+                   TARGET_PAGE_MASK;
+            if (start < stop) {
+                memory_region_reset_dirty(section.mr, start, stop - start,
+                                          DIRTY_MEMORY_MIGRATION);
+            }
+        }
+        addr = section.offset_within_address_space + section.size;
+    }
+}
+
+/*
+ * The guest answers a new free_page_hint_cmd_id with that id in an out
+ * buffer, then hands free blocks as in buffers, which it keeps allocated
+ * until the host writes VIRTIO_BALLOON_CMD_ID_DONE.  Hints for any other
+ * id are stale and ignored.
+ */
+static void virtio_balloon_handle_free_page(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtIOBalloon *s = to_virtio_balloon(vdev);
+    VirtQueueElement *elem;
+    bool notify = false;
+    uint32_t id;
+    int i;
+
+    while ((elem = virtqueue_pop(vq, sizeof(VirtQueueElement)))) {
+        if (elem->out_num &&
+            iov_to_buf(elem->out_sg, elem->out_num, 0, &id, 4) == 4) {
+            s->free_page_reporting = s->free_page_hinting &&
+                                     ldl_p(&id) == s->free_page_cmd_id;
+        }
+        if (s->free_page_reporting) {
+            for (i = 0; i < elem->in_num; i++) {
+                balloon_free_page_range(elem->in_addr[i],
+                                        elem->in_sg[i].iov_len);
+            }
+        }
+
+        /* nothing was written to the hinted pages */
+        virtqueue_push(vq, elem, 0);
+        g_free(elem);
+        notify = true;
+    }
+    if (notify) {
         virtio_notify(vdev, vq);
     }
 }
 
+static void virtio_balloon_free_page_hint(void *opaque, bool start)
+{
+    VirtIOBalloon *s = opaque;
+
+    if (!(s->vdev.guest_features & (1 << VIRTIO_BALLOON_F_FREE_PAGE_HINT))) {
+        return;
+    }
+    if (start) {
+        if (++s->free_page_cmd_id < FREE_PAGE_HINT_CMD_ID_MIN) {
+            s->free_page_cmd_id = FREE_PAGE_HINT_CMD_ID_MIN;
+        }
+    } else if (!s->free_page_hinting) {
+        return;
+    }
+    s->free_page_hinting = start;
+    s->free_page_reporting = false;
+    virtio_notify_config(&s->vdev);
+}
+
+/* Give the stats buffer back to the guest, which refills it */
+static void balloon_stats_request(VirtIOBalloon *s)
+{
+    if (!s->stats_vq_elem) {
+        return;
+    }
+    virtqueue_push(s->svq, s->stats_vq_elem, s->stats_vq_offset);
+    virtio_notify(&s->vdev, s->svq);
+    g_free(s->stats_vq_elem);
+    s->stats_vq_elem = NULL;
+}
+
+static void balloon_stats_poll(void *opaque)
+{
+    VirtIOBalloon *s = opaque;
+
+    balloon_stats_request(s);
+    qemu_mod_timer(s->stats_timer, qemu_get_clock_ms(vm_clock) +
+                   s->conf.stats_interval * 1000LL);
+}
+
+/*
+ * Run on each stats report.  If the host cgroup was under pressure since
+ * the previous one, take memory back from the guest as long as it keeps
+ * enough free; if the guest itself is short of free memory, give some
+ * back.  The target moves from the last requested one, so a target set
+ * with the balloon command is kept until the policy has a reason to move
+ * it, and never beyond auto-min and auto-max.
+ */
+static void balloon_auto_adjust(VirtIOBalloon *s)
+{
+    uint64_t free_mem = s->stats[VIRTIO_BALLOON_S_MEMFREE];
+    uint64_t total = s->stats[VIRTIO_BALLOON_S_MEMTOT];
+    uint64_t step = ram_size >> BALLOON_AUTO_STEP_SHIFT;
+    uint64_t max = s->conf.auto_max ? MIN(s->conf.auto_max, ram_size)
+                                    : ram_size;
+    uint64_t min = MIN(s->conf.auto_min, max);
+    uint64_t cur, target, low;
+    bool pressure = s->pressure_events != 0;
+
+    s->pressure_events = 0;
+    if (free_mem == (uint64_t)-1 || total == (uint64_t)-1) {
+        return;
+    }
+    low = total >> BALLOON_AUTO_LOW_SHIFT;
+    cur = ram_size - ((uint64_t)s->num_pages << VIRTIO_BALLOON_PFN_SHIFT);
+
+    if (pressure && free_mem > low) {
+        step = MIN(step, free_mem - low);
+        target = cur > min + step ? cur - step : min;
+    } else if (free_mem < low) {
+        target = MIN(cur + step, max);
+    } else {
+        return;
+    }
+    target = MAX(target, 1);
+    if (target != cur) {
+        s->num_pages = (ram_size - target) >> VIRTIO_BALLOON_PFN_SHIFT;
+        virtio_notify_config(&s->vdev);
+    }
+}
+
+#if defined(__linux__)
+static void balloon_pressure_read(void *opaque)
+{
+    VirtIOBalloon *s = opaque;
+
+    if (event_notifier_test_and_clear(&s->pressure)) {
+        s->pressure_events++;
+    }
+}
+
+/* Register for "medium" memory.pressure_level events of a cgroup v1 memory
+   controller, see Documentation/cgroups/memory.txt in the kernel */
+static int balloon_pressure_init(VirtIOBalloon *s, const char *cgroup)
+{
+    char *path, *line;
+    int fd, ret;
+
+    path = g_strdup_printf("%s/memory.pressure_level", cgroup);
+    s->pressure_level_fd = qemu_open(path, O_RDONLY);
+    g_free(path);
+    if (s->pressure_level_fd < 0) {
+        return -errno;
+    }
+
+    ret = event_notifier_init(&s->pressure, 0);
+    if (ret < 0) {
+        goto fail_level;
+    }
+
+    path = g_strdup_printf("%s/cgroup.event_control", cgroup);
+    fd = qemu_open(path, O_WRONLY);
+    g_free(path);
+    if (fd < 0) {
+        ret = -errno;
+        goto fail_notifier;
+    }
+    line = g_strdup_printf("%d %d medium",
+                           event_notifier_get_fd(&s->pressure),
+                           s->pressure_level_fd);
+    ret = write(fd, line, strlen(line)) < 0 ? -errno : 0;
+    g_free(line);
+    close(fd);
+    if (ret < 0) {
+        goto fail_notifier;
+    }
+
+    qemu_set_fd_handler(event_notifier_get_fd(&s->pressure),
+                        balloon_pressure_read, NULL, s);
+    return 0;
+
+fail_notifier:
+    event_notifier_cleanup(&s->pressure);
+fail_level:
+    close(s->pressure_level_fd);
+    s->pressure_level_fd = -1;
+    return ret;
+}
+#endif
+
+static void balloon_pressure_cleanup(VirtIOBalloon *s)
+{
+    if (s->pressure_level_fd < 0) {
+        return;
+    }
+    /* closing the eventfd drops the registration in the kernel */
+    qemu_set_fd_handler(event_notifier_get_fd(&s->pressure), NULL, NULL, NULL);
+    event_notifier_cleanup(&s->pressure);
+    close(s->pressure_level_fd);
+    s->pressure_level_fd = -1;
+}
+
 static void virtio_balloon_receive_stats(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIOBalloon *s = DO_UPCAST(VirtIOBalloon, vdev, vdev);
-    VirtQueueElement *elem = &s->stats_vq_elem;
+    VirtQueueElement *elem;
     VirtIOBalloonStat stat;
     size_t offset = 0;
+    IOVCursor cur;
 
-    if (!virtqueue_pop(vq, elem)) {
+    elem = virtqueue_pop(vq, sizeof(VirtQueueElement));
+    if (!elem) {
         return;
     }
+    g_free(s->stats_vq_elem);
+    s->stats_vq_elem = elem;
 
     /* Initialize the stats to get rid of any stale values.  This is only
      * needed to handle the case where a guest supports fewer stats than it
@@ -118,8 +583,8 @@ static void virtio_balloon_receive_stats(VirtIODevice *vdev, VirtQueue *vq)
      */
     reset_stats(s);
 
-    while (iov_to_buf(elem->out_sg, elem->out_num, offset, &stat, sizeof(stat))
-           == sizeof(stat)) {
+    iov_cursor_init(&cur, elem->out_sg, elem->out_num, 0);
+    while (iov_cursor_to_buf(&cur, &stat, sizeof(stat)) == sizeof(stat)) {
         uint16_t tag = tswap16(stat.tag);
         uint64_t val = tswap64(stat.val);
 
@@ -128,6 +593,10 @@ static void virtio_balloon_receive_stats(VirtIODevice *vdev, VirtQueue *vq)
             s->stats[tag] = val;
     }
     s->stats_vq_offset = offset;
+
+    if (s->conf.pressure_cgroup) {
+        balloon_auto_adjust(s);
+    }
 }
 
 static void virtio_balloon_get_config(VirtIODevice *vdev, uint8_t *config_data)
@@ -137,8 +606,12 @@ static void virtio_balloon_get_config(VirtIODevice *vdev, uint8_t *config_data)
 
     config.num_pages = cpu_to_le32(dev->num_pages);
     config.actual = cpu_to_le32(dev->actual);
+    /* when idle, let the guest release whatever it still holds */
+    config.free_page_hint_cmd_id = cpu_to_le32(dev->free_page_hinting ?
+                                               dev->free_page_cmd_id :
+                                               VIRTIO_BALLOON_CMD_ID_DONE);
 
-    memcpy(config_data, &config, 8);
+    memcpy(config_data, &config, sizeof(config));
 }
 
 static void virtio_balloon_set_config(VirtIODevice *vdev,
@@ -161,30 +634,36 @@ static uint32_t virtio_balloon_get_features(VirtIODevice *vdev, uint32_t f)
     return f;
 }
 
+static bool balloon_stat_get(VirtIOBalloon *dev, int tag, int64_t *val)
+{
+    if (dev->stats[tag] == (uint64_t)-1) {
+        return false;
+    }
+    *val = dev->stats[tag];
+    return true;
+}
+
+/*
+ * Asking the guest for stats and waiting for them would block the monitor
+ * on the guest (https://bugzilla.redhat.com/show_bug.cgi?id=623903), so
+ * report the last values the guest sent, as refreshed every stats-interval.
+ */
 static void virtio_balloon_stat(void *opaque, BalloonInfo *info)
 {
     VirtIOBalloon *dev = opaque;
 
-#if 0
-    /* Disable guest-provided stats for now. For more details please check:
-     * https://bugzilla.redhat.com/show_bug.cgi?id=623903
-     *
-     * If you do enable it (which is probably not going to happen as we
-     * need a new command for it), remember that you also need to fill the
-     * appropriate members of the BalloonInfo structure so that the stats
-     * are returned to the client.
-     */
-    if (dev->vdev.guest_features & (1 << VIRTIO_BALLOON_F_STATS_VQ)) {
-        virtqueue_push(dev->svq, &dev->stats_vq_elem, dev->stats_vq_offset);
-        virtio_notify(&dev->vdev, dev->svq);
-        return;
-    }
-#endif
-
-    /* Stats are not supported.  Clear out any stale values that might
-     * have been set by a more featureful guest kernel.
-     */
-    reset_stats(dev);
+    info->has_mem_swapped_in = balloon_stat_get(dev, VIRTIO_BALLOON_S_SWAP_IN,
+                                                &info->mem_swapped_in);
+    info->has_mem_swapped_out = balloon_stat_get(dev, VIRTIO_BALLOON_S_SWAP_OUT,
+                                                 &info->mem_swapped_out);
+    info->has_major_page_faults = balloon_stat_get(dev, VIRTIO_BALLOON_S_MAJFLT,
+                                                   &info->major_page_faults);
+    info->has_minor_page_faults = balloon_stat_get(dev, VIRTIO_BALLOON_S_MINFLT,
+                                                   &info->minor_page_faults);
+    info->has_free_mem = balloon_stat_get(dev, VIRTIO_BALLOON_S_MEMFREE,
+                                          &info->free_mem);
+    info->has_total_mem = balloon_stat_get(dev, VIRTIO_BALLOON_S_MEMTOT,
+                                           &info->total_mem);
 
     info->actual = ram_size - ((uint64_t) dev->actual <<
                                VIRTIO_BALLOON_PFN_SHIFT);
@@ -203,6 +682,34 @@ static void virtio_balloon_to_target(void *opaque, ram_addr_t target)
     }
 }
 
+static void virtio_balloon_reset(VirtIODevice *vdev)
+{
+    VirtIOBalloon *s = to_virtio_balloon(vdev);
+
+    balloon_drain(s);
+    s->free_page_hinting = false;
+    s->free_page_reporting = false;
+    g_free(s->stats_vq_elem);
+    s->stats_vq_elem = NULL;
+    reset_stats(s);
+}
+
+/*
+ * Complete the requests in flight while the RAM is still to be sent.  The
+ * held stats buffer is not migrated either: hand it back too, so that the
+ * guest sends it again, to the destination of a migration.
+ */
+static void virtio_balloon_vmstate_change(void *opaque, int running,
+                                          RunState state)
+{
+    VirtIOBalloon *s = opaque;
+
+    if (!running) {
+        balloon_drain(s);
+        balloon_stats_request(s);
+    }
+}
+
 static void virtio_balloon_save(QEMUFile *f, void *opaque)
 {
     VirtIOBalloon *s = opaque;
@@ -231,22 +738,45 @@ static int virtio_balloon_load(QEMUFile *f, void *opaque, int version_id)
     return 0;
 }
 
-VirtIODevice *virtio_balloon_init(DeviceState *dev)
+VirtIODevice *virtio_balloon_init(DeviceState *dev, VirtIOBalloonConf *conf)
 {
     VirtIOBalloon *s;
     int ret;
 
+    if (conf->pressure_cgroup && !conf->stats_interval) {
+        error_report("virtio-balloon: pressure-cgroup needs stats-interval");
+        return NULL;
+    }
+
     s = (VirtIOBalloon *)virtio_common_init("virtio-balloon",
                                             VIRTIO_ID_BALLOON,
-                                            8, sizeof(VirtIOBalloon));
+                                            sizeof(struct virtio_balloon_config),
+                                            sizeof(VirtIOBalloon));
+    s->conf = *conf;
+    s->pressure_level_fd = -1;
+    if (conf->pressure_cgroup) {
+#if defined(__linux__)
+        ret = balloon_pressure_init(s, conf->pressure_cgroup);
+#else
+        ret = -ENOSYS;
+#endif
+        if (ret < 0) {
+            error_report("virtio-balloon: cannot watch memory pressure of %s: %s",
+                         conf->pressure_cgroup, strerror(-ret));
+            virtio_cleanup(&s->vdev);
+            return NULL;
+        }
+    }
 
     s->vdev.get_config = virtio_balloon_get_config;
     s->vdev.set_config = virtio_balloon_set_config;
     s->vdev.get_features = virtio_balloon_get_features;
+    s->vdev.reset = virtio_balloon_reset;
 
     ret = qemu_add_balloon_handler(virtio_balloon_to_target,
                                    virtio_balloon_stat, s);
     if (ret < 0) {
+        balloon_pressure_cleanup(s);
         virtio_cleanup(&s->vdev);
         return NULL;
     }
@@ -254,9 +784,27 @@ VirtIODevice *virtio_balloon_init(DeviceState *dev)
     s->ivq = virtio_add_queue(&s->vdev, 128, virtio_balloon_handle_output);
     s->dvq = virtio_add_queue(&s->vdev, 128, virtio_balloon_handle_output);
     s->svq = virtio_add_queue(&s->vdev, 128, virtio_balloon_receive_stats);
+    s->fpvq = virtio_add_queue(&s->vdev, VIRTQUEUE_MAX_SIZE,
+                               virtio_balloon_handle_free_page);
+    qemu_set_balloon_free_page_handler(virtio_balloon_free_page_hint, s);
 
     reset_stats(s);
 
+    qemu_mutex_init(&s->lock);
+    qemu_cond_init(&s->cond);
+    QSIMPLEQ_INIT(&s->pending);
+    QSIMPLEQ_INIT(&s->done);
+    s->done_bh = qemu_bh_new(balloon_done_bh, s);
+    qemu_thread_create(&s->thread, balloon_thread, s, QEMU_THREAD_JOINABLE);
+    s->vmstate = qemu_add_vm_change_state_handler(virtio_balloon_vmstate_change,
+                                                  s);
+
+    if (conf->stats_interval) {
+        s->stats_timer = qemu_new_timer_ms(vm_clock, balloon_stats_poll, s);
+        qemu_mod_timer(s->stats_timer, qemu_get_clock_ms(vm_clock) +
+                       conf->stats_interval * 1000LL);
+    }
+
     s->qdev = dev;
     register_savevm(dev, "virtio-balloon", -1, 1,
                     virtio_balloon_save, virtio_balloon_load, s);
@@ -270,5 +818,24 @@ void virtio_balloon_exit(VirtIODevice *vdev)
 
     qemu_remove_balloon_handler(s);
     unregister_savevm(s->qdev, "virtio-balloon", s);
+    qemu_del_vm_change_state_handler(s->vmstate);
+    if (s->stats_timer) {
+        qemu_del_timer(s->stats_timer);
+        qemu_free_timer(s->stats_timer);
+    }
+    balloon_pressure_cleanup(s);
+    g_free(s->stats_vq_elem);
+
+    balloon_drain(s);
+    qemu_mutex_lock(&s->lock);
+    s->quit = true;
+    qemu_cond_broadcast(&s->cond);
+    qemu_mutex_unlock(&s->lock);
+    qemu_thread_join(&s->thread);
+    qemu_bh_delete(s->done_bh);
+    qemu_cond_destroy(&s->cond);
+    qemu_mutex_destroy(&s->lock);
+    g_free(s->pbp_bitmap);
+
     virtio_cleanup(vdev);
 }
@@ -26,6 +26,11 @@
 /* The feature bitmap for virtio balloon */
 #define VIRTIO_BALLOON_F_MUST_TELL_HOST 0 /* Tell before reclaiming pages */
 #define VIRTIO_BALLOON_F_STATS_VQ 1       /* Memory stats virtqueue */
+#define VIRTIO_BALLOON_F_FREE_PAGE_HINT 3 /* Report free pages on request */
+
+/* Values of free_page_hint_cmd_id that do not start a report */
+#define VIRTIO_BALLOON_CMD_ID_STOP 0      /* stop reporting */
+#define VIRTIO_BALLOON_CMD_ID_DONE 1      /* and release the reported pages */
 
 /* Size of a PFN in the balloon interface. */
 #define VIRTIO_BALLOON_PFN_SHIFT 12
@@ -36,6 +41,8 @@ struct virtio_balloon_config
     uint32_t num_pages;
     /* Number of pages we've actually got in balloon. */
     uint32_t actual;
+    /* Free page report requested by the host, or one of the CMD_ID_* */
+    uint32_t free_page_hint_cmd_id;
 };
 
 /* Memory Statistics */
@@ -52,4 +59,20 @@ typedef struct VirtIOBalloonStat {
     uint64_t val;
 } QEMU_PACKED VirtIOBalloonStat;
 
+struct VirtIOBalloonConf {
+    uint32_t stats_interval;    /* seconds between stats requests, 0 = off */
+    /* automatic ballooning, enabled by pressure_cgroup: the host memory
+       cgroup whose pressure makes the guest give memory back, and the
+       bounds of the guest size (0 = ram_size) */
+    char *pressure_cgroup;
+    uint64_t auto_min;
+    uint64_t auto_max;
+};
+
+#define DEFINE_VIRTIO_BALLOON_PROPERTIES(_state, _conf_field) \
+    DEFINE_PROP_UINT32("stats-interval", _state, _conf_field.stats_interval, 0), \
+    DEFINE_PROP_STRING("pressure-cgroup", _state, _conf_field.pressure_cgroup), \
+    DEFINE_PROP_UINT64("auto-min", _state, _conf_field.auto_min, 0), \
+    DEFINE_PROP_UINT64("auto-max", _state, _conf_field.auto_max, 0)
+
 #endif
@@ -105,6 +105,9 @@ struct VirtIOBlkConf
     char *serial;
     uint32_t scsi;
     uint32_t config_wce;
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    uint32_t data_plane;
+#endif
 };
 
 #define DEFINE_VIRTIO_BLK_FEATURES(_state, _field) \
@@ -10,16 +10,143 @@
  * the COPYING file in the top-level directory.
  */
 
+#include "iov.h"
 #include "qemu-char.h"
 #include "qemu-error.h"
+#include "qemu-objects.h"
+#include "json-streamer.h"
+#include "json-parser.h"
+#include "blockdev.h"
 #include "trace.h"
 #include "virtio-serial.h"
 
 typedef struct VirtConsole {
     VirtIOSerialPort port;
     CharDriverState *chr;
+
+    /*
+     * A command QEMU itself sent to the guest agent on this port.  Until
+     * it is answered the guest output goes to agent_parser instead of the
+     * chardev.
+     */
+    JSONMessageParser agent_parser;
+    GuestAgentReplyFunc *agent_cb;
+    void *agent_opaque;
+    int64_t agent_sync_id;
+    bool agent_synced;
 } VirtConsole;
 
+static void agent_reply(VirtConsole *vcon, QObject *reply)
+{
+    GuestAgentReplyFunc *cb = vcon->agent_cb;
+
+    /* the callback may send the next command */
+    vcon->agent_cb = NULL;
+    cb(vcon->agent_opaque, reply);
+}
+
+static void agent_parse(JSONMessageParser *parser, GPtrArray *tokens)
+{
+    VirtConsole *vcon = container_of(parser, VirtConsole, agent_parser);
+    QObject *obj;
+    QDict *qdict;
+
+    if (!vcon->agent_cb || !tokens) {
+        return;
+    }
+    obj = json_parser_parse(tokens, NULL);
+    if (!obj || qobject_type(obj) != QTYPE_QDICT) {
+        qobject_decref(obj);
+        return;
+    }
+
+    qdict = qobject_to_qdict(obj);
+    if (!vcon->agent_synced) {
+        /* skip whatever was still queued before our guest-sync */
+        if (qdict_haskey(qdict, "return") &&
+            qobject_type(qdict_get(qdict, "return")) == QTYPE_QINT &&
+            qdict_get_int(qdict, "return") == vcon->agent_sync_id) {
+            vcon->agent_synced = true;
+        }
+    } else {
+        agent_reply(vcon, obj);
+    }
+    qobject_decref(obj);
+}
+
+static VirtConsole *agent_find(const char *id)
+{
+    DeviceState *dev = qdev_find_recursive(sysbus_get_default(), id);
+
+    if (!dev || (!object_dynamic_cast(OBJECT(dev), "virtconsole") &&
+                 !object_dynamic_cast(OBJECT(dev), "virtserialport"))) {
+        return NULL;
+    }
+    return DO_UPCAST(VirtConsole, port, VIRTIO_SERIAL_PORT(dev));
+}
+
+static int agent_command(const char *id, const char *cmd,
+                         GuestAgentReplyFunc *cb, void *opaque)
+{
+    VirtConsole *vcon = agent_find(id);
+    char *buf;
+    size_t len;
+
+    if (!vcon) {
+        return -ENODEV;
+    }
+    if (vcon->agent_cb) {
+        return -EBUSY;
+    }
+    if (!vcon->port.guest_connected) {
+        return -ENOTCONN;
+    }
+
+    /*
+     * 0xff makes the agent drop any partial input, and guest-sync tells
+     * the answer to our command apart from older output.
+     */
+    vcon->agent_sync_id = g_random_int() & INT32_MAX;
+    buf = g_strdup_printf("\xff{ \"execute\": \"guest-sync\", "
+                          "\"arguments\": { \"id\": %" PRId64 " } }\n"
+                          "{ \"execute\": \"%s\" }\n",
+                          vcon->agent_sync_id, cmd);
+    len = strlen(buf);
+    if (virtio_serial_guest_ready(&vcon->port) < len) {
+        g_free(buf);
+        return -EAGAIN;
+    }
+    virtio_serial_write(&vcon->port, (uint8_t *)buf, len);
+    g_free(buf);
+
+    vcon->agent_cb = cb;
+    vcon->agent_opaque = opaque;
+    vcon->agent_synced = false;
+    return 0;
+}
+
+static void agent_cancel(const char *id)
+{
+    VirtConsole *vcon = agent_find(id);
+
+    if (vcon) {
+        vcon->agent_cb = NULL;
+    }
+}
+
+static const GuestAgentOps virtconsole_agent_ops = {
+    .command = agent_command,
+    .cancel = agent_cancel,
+};
+
+
+/* The backend took everything we sent it, send the rest */
+static void chr_write_ready(void *opaque)
+{
+    VirtConsole *vcon = opaque;
+
+    virtio_serial_throttle_port(&vcon->port, false);
+}
 
 /* Callback function that's called when the guest sends us data */
 static ssize_t flush_buf(VirtIOSerialPort *port, const uint8_t *buf, size_t len)
@@ -27,12 +154,17 @@ static ssize_t flush_buf(VirtIOSerialPort *port, const uint8_t *buf, size_t len)
     VirtConsole *vcon = DO_UPCAST(VirtConsole, port, port);
     ssize_t ret;
 
+    if (vcon->agent_cb) {
+        json_message_parser_feed(&vcon->agent_parser, (const char *)buf, len);
+        return len;
+    }
+
     if (!vcon->chr) {
         /* If there's no backend, we can just say we consumed all data. */
         return len;
     }
 
-    ret = qemu_chr_fe_write(vcon->chr, buf, len);
+    ret = qemu_chr_fe_write_nonblock(vcon->chr, buf, len);
     trace_virtio_console_flush_buf(port->id, len, ret);
 
     if (ret < 0) {
@@ -49,6 +181,46 @@ static ssize_t flush_buf(VirtIOSerialPort *port, const uint8_t *buf, size_t len)
          */
         ret = 0;
     }
+    if (ret < len &&
+        qemu_chr_fe_notify_writable(vcon->chr, chr_write_ready, vcon) == 0) {
+        /* leave the rest in the virtqueue until the backend drains */
+        virtio_serial_throttle_port(port, true);
+    }
+    return ret;
+}
+
+/* The same as flush_buf, for the data of several guest buffers */
+static ssize_t flush_iov(VirtIOSerialPort *port, const struct iovec *iov,
+                         int iovcnt)
+{
+    VirtConsole *vcon = DO_UPCAST(VirtConsole, port, port);
+    size_t len = iov_size(iov, iovcnt);
+    ssize_t ret;
+    int i;
+
+    if (vcon->agent_cb) {
+        for (i = 0; i < iovcnt && vcon->agent_cb; i++) {
+            json_message_parser_feed(&vcon->agent_parser, iov[i].iov_base,
+                                     iov[i].iov_len);
+        }
+        return len;
+    }
+
+    if (!vcon->chr) {
+        return len;
+    }
+
+    ret = qemu_chr_fe_writev_nonblock(vcon->chr, iov, iovcnt);
+    trace_virtio_console_flush_buf(port->id, len, ret);
+
+    if (ret < 0) {
+        /* see flush_buf */
+        ret = 0;
+    }
+    if (ret < len &&
+        qemu_chr_fe_notify_writable(vcon->chr, chr_write_ready, vcon) == 0) {
+        virtio_serial_throttle_port(port, true);
+    }
     return ret;
 }
 
@@ -68,6 +240,9 @@ static void guest_close(VirtIOSerialPort *port)
 {
     VirtConsole *vcon = DO_UPCAST(VirtConsole, port, port);
 
+    if (vcon->agent_cb) {
+        agent_reply(vcon, NULL);
+    }
     if (!vcon->chr) {
         return;
     }
@@ -120,6 +295,23 @@ static int virtconsole_initfn(VirtIOSerialPort *port)
         qemu_chr_add_handlers(vcon->chr, chr_can_read, chr_read, chr_event,
                               vcon);
     }
+    json_message_parser_init(&vcon->agent_parser, agent_parse);
+
+    return 0;
+}
+
+static int virtconsole_exitfn(VirtIOSerialPort *port)
+{
+    VirtConsole *vcon = DO_UPCAST(VirtConsole, port, port);
+
+    if (vcon->agent_cb) {
+        agent_reply(vcon, NULL);
+    }
+    json_message_parser_destroy(&vcon->agent_parser);
+    if (vcon->chr) {
+        qemu_chr_fe_notify_writable(vcon->chr, NULL, NULL);
+        qemu_chr_add_handlers(vcon->chr, NULL, NULL, NULL, NULL);
+    }
 
     return 0;
 }
@@ -136,7 +328,9 @@ static void virtconsole_class_init(ObjectClass *klass, void *data)
 
     k->is_console = true;
     k->init = virtconsole_initfn;
+    k->exit = virtconsole_exitfn;
     k->have_data = flush_buf;
+    k->have_data_iov = flush_iov;
     k->guest_open = guest_open;
     k->guest_close = guest_close;
     dc->props = virtconsole_properties;
@@ -160,7 +354,9 @@ static void virtserialport_class_init(ObjectClass *klass, void *data)
     VirtIOSerialPortClass *k = VIRTIO_SERIAL_PORT_CLASS(klass);
 
     k->init = virtconsole_initfn;
+    k->exit = virtconsole_exitfn;
     k->have_data = flush_buf;
+    k->have_data_iov = flush_iov;
     k->guest_open = guest_open;
     k->guest_close = guest_close;
     dc->props = virtserialport_properties;
@@ -177,6 +373,7 @@ static void virtconsole_register_types(void)
 {
     type_register_static(&virtconsole_info);
     type_register_static(&virtserialport_info);
+    guest_agent_register(&virtconsole_agent_ops);
 }
 
 type_init(virtconsole_register_types)
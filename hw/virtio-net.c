@@ -26,26 +26,60 @@
 #define MAC_TABLE_ENTRIES    64
 #define MAX_VLAN    (1 << 12)   /* Per 802.1Q definition */
 
+/* Number of packets handed to the net layer in one call */
+#define TX_BATCH    16
+
+/* Number of rx buffers popped ahead of the packets that will fill them */
+#define RX_BATCH    16
+
+/* Period over which tx=adaptive measures the packet rate of a queue */
+#define TX_RATE_INTERVAL    10000000 /* 10 ms */
+
+/* One rx/tx virtqueue pair, served by one queue of the NIC */
+typedef struct VirtIONetQueue {
+    VirtQueue *rx_vq;
+    VirtQueue *tx_vq;
+    /* tx=timer has only the timer, tx=bh only the bottom half and
+     * tx=adaptive both, using the timer while tx_deferred is set.
+     */
+    QEMUTimer *tx_timer;
+    QEMUBH *tx_bh;
+    int tx_waiting;
+    /* the net layer queued part of the last batch */
+    int tx_async;
+    VirtQueueElement *tx_batch[TX_BATCH];
+    unsigned int tx_batch_len[TX_BATCH];
+    /* with zero copy, tx_batch[tx_pending_start..] are still queued */
+    int tx_pending_start;
+    int tx_pending_count;
+    int tx_deferred;
+    int64_t tx_rate_start;
+    uint32_t tx_rate_packets;
+    /* ring of rx buffers already popped from rx_vq, oldest at rx_cache_head */
+    VirtQueueElement *rx_cache[RX_BATCH];
+    int rx_cache_head;
+    int rx_cache_count;
+    size_t rx_cache_bytes;
+    /* the guest is notified of used rx buffers once per main loop iteration */
+    QEMUBH *rx_bh;
+    int rx_notify_pending;
+    struct VirtIONet *n;
+} VirtIONetQueue;
+
 typedef struct VirtIONet
 {
     VirtIODevice vdev;
     uint8_t mac[ETH_ALEN];
     uint16_t status;
-    VirtQueue *rx_vq;
-    VirtQueue *tx_vq;
+    VirtIONetQueue *vqs;
     VirtQueue *ctrl_vq;
     NICState *nic;
-    QEMUTimer *tx_timer;
-    QEMUBH *tx_bh;
     uint32_t tx_timeout;
     int32_t tx_burst;
-    int tx_waiting;
+    uint32_t tx_rate;
+    int tx_zerocopy;
     uint32_t has_vnet_hdr;
     uint8_t has_ufo;
-    struct {
-        VirtQueueElement elem;
-        ssize_t len;
-    } async_tx;
     int mergeable_rx_bufs;
     uint8_t promisc;
     uint8_t allmulti;
@@ -63,6 +97,9 @@ typedef struct VirtIONet
     } mac_table;
     uint32_t *vlans;
     DeviceState *qdev;
+    int multiqueue;
+    uint16_t max_queues;
+    uint16_t curr_queues;
 } VirtIONet;
 
 /* TODO
@@ -74,22 +111,49 @@ static VirtIONet *to_virtio_net(VirtIODevice *vdev)
     return (VirtIONet *)vdev;
 }
 
+static VirtIONetQueue *virtio_net_get_subqueue(NetClientState *nc)
+{
+    VirtIONet *n = DO_UPCAST(NICState, nc, nc)->opaque;
+
+    return &n->vqs[nc->queue_index];
+}
+
+/* Virtqueues 2 * i and 2 * i + 1 are the rx and tx queues of pair i */
+static int vq2q(int queue_index)
+{
+    return queue_index / 2;
+}
+
+static NetClientState *virtio_net_get_peer(VirtIONet *n, int queue_index)
+{
+    return qemu_get_subqueue(n->nic, queue_index)->peer;
+}
+
+static int peer_is_tap(VirtIONet *n)
+{
+    NetClientState *peer = virtio_net_get_peer(n, 0);
+
+    return peer && peer->info->type == NET_CLIENT_OPTIONS_KIND_TAP;
+}
+
 static void virtio_net_get_config(VirtIODevice *vdev, uint8_t *config)
 {
     VirtIONet *n = to_virtio_net(vdev);
     struct virtio_net_config netcfg;
 
     stw_p(&netcfg.status, n->status);
+    stw_p(&netcfg.max_virtqueue_pairs, n->max_queues);
     memcpy(netcfg.mac, n->mac, ETH_ALEN);
-    memcpy(config, &netcfg, sizeof(netcfg));
+    /* without multiqueue the config space ends before max_virtqueue_pairs */
+    memcpy(config, &netcfg, n->vdev.config_len);
 }
 
 static void virtio_net_set_config(VirtIODevice *vdev, const uint8_t *config)
 {
     VirtIONet *n = to_virtio_net(vdev);
-    struct virtio_net_config netcfg;
+    struct virtio_net_config netcfg = {};
 
-    memcpy(&netcfg, config, sizeof(netcfg));
+    memcpy(&netcfg, config, n->vdev.config_len);
 
     if (memcmp(netcfg.mac, n->mac, ETH_ALEN)) {
         memcpy(n->mac, netcfg.mac, ETH_ALEN);
@@ -105,26 +169,38 @@ static bool virtio_net_started(VirtIONet *n, uint8_t status)
 
 static void virtio_net_vhost_status(VirtIONet *n, uint8_t status)
 {
-    if (!n->nic->nc.peer) {
-        return;
-    }
-    if (n->nic->nc.peer->info->type != NET_CLIENT_OPTIONS_KIND_TAP) {
-        return;
-    }
+    NetClientState *peer = virtio_net_get_peer(n, 0);
+    VHostNetState *nets[MAX_QUEUE_NUM];
+    int queues = n->multiqueue ? n->max_queues : 1;
+    int i;
 
-    if (!tap_get_vhost_net(n->nic->nc.peer)) {
+    if (!get_vhost_net(peer)) {
         return;
     }
     if (!!n->vhost_started == virtio_net_started(n, status) &&
-                              !n->nic->nc.peer->link_down) {
+                              !peer->link_down) {
         return;
     }
+
+    /* All the queue pairs get a vhost device, including the ones the
+     * guest did not enable: their tap queues are detached instead.
+     */
+    for (i = 0; i < queues; i++) {
+        nets[i] = get_vhost_net(virtio_net_get_peer(n, i));
+    }
+
     if (!n->vhost_started) {
         int r;
-        if (!vhost_net_query(tap_get_vhost_net(n->nic->nc.peer), &n->vdev)) {
+        if (!vhost_net_query(nets[0], &n->vdev)) {
             return;
         }
-        r = vhost_net_start(tap_get_vhost_net(n->nic->nc.peer), &n->vdev);
+        /* vhost takes over the rings, the tap queues must not keep
+         * zero copy buffers
+         */
+        for (i = 0; i < queues; i++) {
+            qemu_purge_queued_packets(qemu_get_subqueue(n->nic, i));
+        }
+        r = vhost_net_start(&n->vdev, nets, queues);
         if (r < 0) {
             error_report("unable to start vhost net: %d: "
                          "falling back on userspace virtio", -r);
@@ -132,33 +208,98 @@ static void virtio_net_vhost_status(VirtIONet *n, uint8_t status)
             n->vhost_started = 1;
         }
     } else {
-        vhost_net_stop(tap_get_vhost_net(n->nic->nc.peer), &n->vdev);
+        vhost_net_stop(&n->vdev, nets, queues);
         n->vhost_started = 0;
     }
 }
 
+static void virtio_net_rx_notify(VirtIONetQueue *q)
+{
+    if (q->rx_notify_pending) {
+        q->rx_notify_pending = 0;
+        qemu_bh_cancel(q->rx_bh);
+        virtio_notify(&q->n->vdev, q->rx_vq);
+    }
+}
+
+static void virtio_net_rx_bh(void *opaque)
+{
+    virtio_net_rx_notify(opaque);
+}
+
+/* Give the rx buffers that were popped ahead back to the guest's ring, so
+ * that vhost, the migration stream or a reset find last_avail_idx where the
+ * guest expects it.
+ */
+static void virtio_net_rx_discard(VirtIONetQueue *q)
+{
+    while (q->rx_cache_count > 0) {
+        VirtQueueElement *elem;
+
+        q->rx_cache_count--;
+        elem = q->rx_cache[(q->rx_cache_head + q->rx_cache_count) % RX_BATCH];
+        virtqueue_discard(q->rx_vq, elem);
+        g_free(elem);
+    }
+    q->rx_cache_head = 0;
+    q->rx_cache_bytes = 0;
+}
+
 static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
 {
     VirtIONet *n = to_virtio_net(vdev);
+    VirtIONetQueue *q;
+    int i;
+    uint8_t queue_status;
 
-    virtio_net_vhost_status(n, status);
+    for (i = 0; i < n->max_queues; i++) {
+        virtio_net_rx_notify(&n->vqs[i]);
+        virtio_net_rx_discard(&n->vqs[i]);
+    }
 
-    if (!n->tx_waiting) {
-        return;
+    if (!n->vdev.vm_running) {
+        /* Zero copy packets still in the backend's queue point into guest
+         * memory: drop them and give the buffers back while the VM stops,
+         * so that the used ring is part of the state a migration sends.
+         */
+        for (i = 0; i < n->max_queues; i++) {
+            q = &n->vqs[i];
+            if (q->tx_pending_count) {
+                qemu_purge_queued_packets(qemu_get_subqueue(n->nic, i));
+                virtio_notify(&n->vdev, q->tx_vq);
+            }
+        }
     }
 
-    if (virtio_net_started(n, status) && !n->vhost_started) {
-        if (n->tx_timer) {
-            qemu_mod_timer(n->tx_timer,
-                           qemu_get_clock_ns(vm_clock) + n->tx_timeout);
+    virtio_net_vhost_status(n, status);
+
+    for (i = 0; i < n->max_queues; i++) {
+        q = &n->vqs[i];
+
+        if ((!n->multiqueue && i != 0) || i >= n->curr_queues) {
+            queue_status = 0;
         } else {
-            qemu_bh_schedule(n->tx_bh);
+            queue_status = status;
         }
-    } else {
-        if (n->tx_timer) {
-            qemu_del_timer(n->tx_timer);
+
+        if (!q->tx_waiting) {
+            continue;
+        }
+
+        if (virtio_net_started(n, queue_status) && !n->vhost_started) {
+            if (q->tx_timer && (!q->tx_bh || q->tx_deferred)) {
+                qemu_mod_timer(q->tx_timer,
+                               qemu_get_clock_ns(vm_clock) + n->tx_timeout);
+            } else {
+                qemu_bh_schedule(q->tx_bh);
+            }
         } else {
-            qemu_bh_cancel(n->tx_bh);
+            if (q->tx_timer) {
+                qemu_del_timer(q->tx_timer);
+            }
+            if (q->tx_bh) {
+                qemu_bh_cancel(q->tx_bh);
+            }
         }
     }
 }
@@ -182,6 +323,7 @@ static void virtio_net_set_link_status(NetClientState *nc)
 static void virtio_net_reset(VirtIODevice *vdev)
 {
     VirtIONet *n = to_virtio_net(vdev);
+    int i;
 
     /* Reset back to compatibility mode */
     n->promisc = 1;
@@ -198,17 +340,23 @@ static void virtio_net_reset(VirtIODevice *vdev)
     n->mac_table.uni_overflow = 0;
     memset(n->mac_table.macs, 0, MAC_TABLE_ENTRIES * ETH_ALEN);
     memset(n->vlans, 0, MAX_VLAN >> 3);
+
+    /* Only the first queue pair is used until the guest asks for more */
+    n->curr_queues = 1;
+
+    for (i = 0; i < n->max_queues; i++) {
+        /* hands back the buffers of zero copy packets */
+        qemu_purge_queued_packets(qemu_get_subqueue(n->nic, i));
+        n->vqs[i].tx_async = 0;
+    }
 }
 
 static int peer_has_vnet_hdr(VirtIONet *n)
 {
-    if (!n->nic->nc.peer)
-        return 0;
-
-    if (n->nic->nc.peer->info->type != NET_CLIENT_OPTIONS_KIND_TAP)
+    if (!peer_is_tap(n))
         return 0;
 
-    n->has_vnet_hdr = tap_has_vnet_hdr(n->nic->nc.peer);
+    n->has_vnet_hdr = tap_has_vnet_hdr(virtio_net_get_peer(n, 0));
 
     return n->has_vnet_hdr;
 }
@@ -218,19 +366,72 @@ static int peer_has_ufo(VirtIONet *n)
     if (!peer_has_vnet_hdr(n))
         return 0;
 
-    n->has_ufo = tap_has_ufo(n->nic->nc.peer);
+    n->has_ufo = tap_has_ufo(virtio_net_get_peer(n, 0));
 
     return n->has_ufo;
 }
 
+/* The queues of a multiqueue tap are configured one by one */
+static void virtio_net_set_offload(VirtIONet *n, uint32_t features)
+{
+    int i;
+
+    for (i = 0; i < n->max_queues; i++) {
+        tap_set_offload(virtio_net_get_peer(n, i),
+                        (features >> VIRTIO_NET_F_GUEST_CSUM) & 1,
+                        (features >> VIRTIO_NET_F_GUEST_TSO4) & 1,
+                        (features >> VIRTIO_NET_F_GUEST_TSO6) & 1,
+                        (features >> VIRTIO_NET_F_GUEST_ECN)  & 1,
+                        (features >> VIRTIO_NET_F_GUEST_UFO)  & 1);
+    }
+}
+
+static void virtio_net_using_vnet_hdr(VirtIONet *n)
+{
+    int i;
+
+    for (i = 0; i < n->max_queues; i++) {
+        tap_using_vnet_hdr(virtio_net_get_peer(n, i), 1);
+    }
+}
+
+/* Peers without queues of their own can only use a single queue pair */
+static void virtio_net_set_queues(VirtIONet *n)
+{
+    int i;
+
+    if (!peer_is_tap(n) || n->max_queues == 1) {
+        return;
+    }
+
+    /* failures are reported by the tap code, the queue keeps its state */
+    for (i = 0; i < n->max_queues; i++) {
+        if (i < n->curr_queues) {
+            tap_enable(virtio_net_get_peer(n, i));
+        } else {
+            tap_disable(virtio_net_get_peer(n, i));
+            /* the packets it had queued are gone with their callback */
+            qemu_purge_queued_packets(qemu_get_subqueue(n->nic, i));
+            n->vqs[i].tx_async = 0;
+        }
+    }
+}
+
+static void virtio_net_set_multiqueue(VirtIONet *n, int multiqueue);
+
 static uint32_t virtio_net_get_features(VirtIODevice *vdev, uint32_t features)
 {
     VirtIONet *n = to_virtio_net(vdev);
 
     features |= (1 << VIRTIO_NET_F_MAC);
 
+    /* the guest can only steer to queues the backend has */
+    if (n->max_queues == 1 || !(features & (1 << VIRTIO_NET_F_CTRL_VQ))) {
+        features &= ~(0x1 << VIRTIO_NET_F_MQ);
+    }
+
     if (peer_has_vnet_hdr(n)) {
-        tap_using_vnet_hdr(n->nic->nc.peer, 1);
+        virtio_net_using_vnet_hdr(n);
     } else {
         features &= ~(0x1 << VIRTIO_NET_F_CSUM);
         features &= ~(0x1 << VIRTIO_NET_F_HOST_TSO4);
@@ -248,14 +449,11 @@ static uint32_t virtio_net_get_features(VirtIODevice *vdev, uint32_t features)
         features &= ~(0x1 << VIRTIO_NET_F_HOST_UFO);
     }
 
-    if (!n->nic->nc.peer ||
-        n->nic->nc.peer->info->type != NET_CLIENT_OPTIONS_KIND_TAP) {
+    if (!get_vhost_net(virtio_net_get_peer(n, 0))) {
         return features;
     }
-    if (!tap_get_vhost_net(n->nic->nc.peer)) {
-        return features;
-    }
-    return vhost_net_get_features(tap_get_vhost_net(n->nic->nc.peer), features);
+    return vhost_net_get_features(get_vhost_net(virtio_net_get_peer(n, 0)),
+                                  features);
 }
 
 static uint32_t virtio_net_bad_features(VirtIODevice *vdev)
@@ -276,25 +474,23 @@ static uint32_t virtio_net_bad_features(VirtIODevice *vdev)
 static void virtio_net_set_features(VirtIODevice *vdev, uint32_t features)
 {
     VirtIONet *n = to_virtio_net(vdev);
+    int i;
+
+    virtio_net_set_multiqueue(n, !!(features & (1 << VIRTIO_NET_F_MQ)));
 
     n->mergeable_rx_bufs = !!(features & (1 << VIRTIO_NET_F_MRG_RXBUF));
 
     if (n->has_vnet_hdr) {
-        tap_set_offload(n->nic->nc.peer,
-                        (features >> VIRTIO_NET_F_GUEST_CSUM) & 1,
-                        (features >> VIRTIO_NET_F_GUEST_TSO4) & 1,
-                        (features >> VIRTIO_NET_F_GUEST_TSO6) & 1,
-                        (features >> VIRTIO_NET_F_GUEST_ECN)  & 1,
-                        (features >> VIRTIO_NET_F_GUEST_UFO)  & 1);
+        virtio_net_set_offload(n, features);
     }
-    if (!n->nic->nc.peer ||
-        n->nic->nc.peer->info->type != NET_CLIENT_OPTIONS_KIND_TAP) {
-        return;
-    }
-    if (!tap_get_vhost_net(n->nic->nc.peer)) {
-        return;
+    for (i = 0; i < n->max_queues; i++) {
+        NetClientState *peer = virtio_net_get_peer(n, i);
+
+        if (!get_vhost_net(peer)) {
+            continue;
+        }
+        vhost_net_ack_features(get_vhost_net(peer), features);
     }
-    vhost_net_ack_features(tap_get_vhost_net(n->nic->nc.peer), features);
 }
 
 static int virtio_net_handle_rx_mode(VirtIONet *n, uint8_t cmd,
@@ -404,39 +600,75 @@ static int virtio_net_handle_vlan_table(VirtIONet *n, uint8_t cmd,
     return VIRTIO_NET_OK;
 }
 
+static int virtio_net_handle_mq(VirtIONet *n, uint8_t cmd,
+                                VirtQueueElement *elem)
+{
+    struct virtio_net_ctrl_mq s;
+
+    if (elem->out_num != 2 ||
+        elem->out_sg[1].iov_len != sizeof(struct virtio_net_ctrl_mq)) {
+        error_report("virtio-net ctrl invalid steering command");
+        return VIRTIO_NET_ERR;
+    }
+
+    if (cmd != VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET) {
+        return VIRTIO_NET_ERR;
+    }
+
+    s.virtqueue_pairs = lduw_p(elem->out_sg[1].iov_base);
+
+    if (s.virtqueue_pairs < VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MIN ||
+        s.virtqueue_pairs > VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MAX ||
+        s.virtqueue_pairs > n->max_queues ||
+        !n->multiqueue) {
+        return VIRTIO_NET_ERR;
+    }
+
+    n->curr_queues = s.virtqueue_pairs;
+    /* Stop the tx timers and bottom halves of the pairs that are no
+     * longer used before their tap queues go away. */
+    virtio_net_set_status(&n->vdev, n->vdev.status);
+    virtio_net_set_queues(n);
+
+    return VIRTIO_NET_OK;
+}
+
 static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = to_virtio_net(vdev);
     struct virtio_net_ctrl_hdr ctrl;
     virtio_net_ctrl_ack status = VIRTIO_NET_ERR;
-    VirtQueueElement elem;
+    VirtQueueElement *elem;
 
-    while (virtqueue_pop(vq, &elem)) {
-        if ((elem.in_num < 1) || (elem.out_num < 1)) {
+    while ((elem = virtqueue_pop(vq, sizeof(VirtQueueElement)))) {
+        if ((elem->in_num < 1) || (elem->out_num < 1)) {
             error_report("virtio-net ctrl missing headers");
             exit(1);
         }
 
-        if (elem.out_sg[0].iov_len < sizeof(ctrl) ||
-            elem.in_sg[elem.in_num - 1].iov_len < sizeof(status)) {
+        if (elem->out_sg[0].iov_len < sizeof(ctrl) ||
+            elem->in_sg[elem->in_num - 1].iov_len < sizeof(status)) {
             error_report("virtio-net ctrl header not in correct element");
             exit(1);
         }
 
-        ctrl.class = ldub_p(elem.out_sg[0].iov_base);
-        ctrl.cmd = ldub_p(elem.out_sg[0].iov_base + sizeof(ctrl.class));
+        ctrl.class = ldub_p(elem->out_sg[0].iov_base);
+        ctrl.cmd = ldub_p(elem->out_sg[0].iov_base + sizeof(ctrl.class));
 
         if (ctrl.class == VIRTIO_NET_CTRL_RX_MODE)
-            status = virtio_net_handle_rx_mode(n, ctrl.cmd, &elem);
+            status = virtio_net_handle_rx_mode(n, ctrl.cmd, elem);
         else if (ctrl.class == VIRTIO_NET_CTRL_MAC)
-            status = virtio_net_handle_mac(n, ctrl.cmd, &elem);
+            status = virtio_net_handle_mac(n, ctrl.cmd, elem);
         else if (ctrl.class == VIRTIO_NET_CTRL_VLAN)
-            status = virtio_net_handle_vlan_table(n, ctrl.cmd, &elem);
+            status = virtio_net_handle_vlan_table(n, ctrl.cmd, elem);
+        else if (ctrl.class == VIRTIO_NET_CTRL_MQ)
+            status = virtio_net_handle_mq(n, ctrl.cmd, elem);
 
-        stb_p(elem.in_sg[elem.in_num - 1].iov_base, status);
+        stb_p(elem->in_sg[elem->in_num - 1].iov_base, status);
 
-        virtqueue_push(vq, &elem, sizeof(status));
+        virtqueue_push(vq, elem, sizeof(status));
         virtio_notify(vdev, vq);
+        g_free(elem);
     }
 }
 
@@ -445,8 +677,9 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
 static void virtio_net_handle_rx(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = to_virtio_net(vdev);
+    int queue_index = vq2q(virtio_get_queue_index(vq));
 
-    qemu_flush_queued_packets(&n->nic->nc);
+    qemu_flush_queued_packets(qemu_get_subqueue(n->nic, queue_index));
 
     /* We now have RX buffers, signal to the IO thread to break out of the
      * select to re-poll the tap file descriptor */
@@ -456,35 +689,95 @@ static void virtio_net_handle_rx(VirtIODevice *vdev, VirtQueue *vq)
 static int virtio_net_can_receive(NetClientState *nc)
 {
     VirtIONet *n = DO_UPCAST(NICState, nc, nc)->opaque;
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+
     if (!n->vdev.vm_running) {
         return 0;
     }
 
-    if (!virtio_queue_ready(n->rx_vq) ||
+    if (nc->queue_index >= n->curr_queues) {
+        return 0;
+    }
+
+    if (!virtio_queue_ready(q->rx_vq) ||
         !(n->vdev.status & VIRTIO_CONFIG_S_DRIVER_OK))
         return 0;
 
     return 1;
 }
 
-static int virtio_net_has_buffers(VirtIONet *n, int bufsize)
+static void virtio_net_rx_refill(VirtIONetQueue *q)
+{
+    while (q->rx_cache_count < RX_BATCH) {
+        VirtQueueElement *elem = virtqueue_pop(q->rx_vq,
+                                               sizeof(VirtQueueElement));
+
+        if (!elem) {
+            break;
+        }
+        if (elem->in_num < 1) {
+            error_report("virtio-net receive queue contains no in buffers");
+            exit(1);
+        }
+        q->rx_cache[(q->rx_cache_head + q->rx_cache_count) % RX_BATCH] = elem;
+        q->rx_cache_count++;
+        q->rx_cache_bytes += iov_size(elem->in_sg, elem->in_num);
+    }
+}
+
+/* Take the oldest cached rx buffer, or pop one from the ring if a large
+ * mergeable packet has used them all.
+ */
+static VirtQueueElement *virtio_net_rx_pop(VirtIONetQueue *q)
 {
-    if (virtio_queue_empty(n->rx_vq) ||
-        (n->mergeable_rx_bufs &&
-         !virtqueue_avail_bytes(n->rx_vq, bufsize, 0))) {
-        virtio_queue_set_notification(n->rx_vq, 1);
+    VirtQueueElement *elem;
+
+    if (q->rx_cache_count > 0) {
+        elem = q->rx_cache[q->rx_cache_head];
+        q->rx_cache_head = (q->rx_cache_head + 1) % RX_BATCH;
+        q->rx_cache_count--;
+        q->rx_cache_bytes -= iov_size(elem->in_sg, elem->in_num);
+        return elem;
+    }
+
+    elem = virtqueue_pop(q->rx_vq, sizeof(VirtQueueElement));
+    if (elem && elem->in_num < 1) {
+        error_report("virtio-net receive queue contains no in buffers");
+        exit(1);
+    }
+    return elem;
+}
+
+static int virtio_net_rx_cached(VirtIONetQueue *q, int bufsize)
+{
+    if (q->rx_cache_count == 0) {
+        return 0;
+    }
+    if (!q->n->mergeable_rx_bufs || q->rx_cache_bytes >= bufsize) {
+        return 1;
+    }
+    return virtqueue_avail_bytes(q->rx_vq, bufsize - q->rx_cache_bytes, 0);
+}
+
+static int virtio_net_has_buffers(VirtIONetQueue *q, int bufsize)
+{
+    if (!virtio_net_rx_cached(q, bufsize)) {
+        virtio_net_rx_refill(q);
+    }
+
+    if (!virtio_net_rx_cached(q, bufsize)) {
+        virtio_queue_set_notification(q->rx_vq, 1);
 
         /* To avoid a race condition where the guest has made some buffers
          * available after the above check but before notification was
          * enabled, check for available buffers again.
          */
-        if (virtio_queue_empty(n->rx_vq) ||
-            (n->mergeable_rx_bufs &&
-             !virtqueue_avail_bytes(n->rx_vq, bufsize, 0)))
+        virtio_net_rx_refill(q);
+        if (!virtio_net_rx_cached(q, bufsize))
             return 0;
     }
 
-    virtio_queue_set_notification(n->rx_vq, 0);
+    virtio_queue_set_notification(q->rx_vq, 0);
     return 1;
 }
 
@@ -516,10 +809,10 @@ static void work_around_broken_dhclient(struct virtio_net_hdr *hdr,
     }
 }
 
-static int receive_header(VirtIONet *n, struct iovec *iov, int iovcnt,
-                          const void *buf, size_t size, size_t hdr_len)
+static int receive_header(VirtIONet *n, void *guest_hdr,
+                          const void *buf, size_t size)
 {
-    struct virtio_net_hdr *hdr = (struct virtio_net_hdr *)iov[0].iov_base;
+    struct virtio_net_hdr *hdr = guest_hdr;
     int offset = 0;
 
     hdr->flags = 0;
@@ -531,12 +824,6 @@ static int receive_header(VirtIONet *n, struct iovec *iov, int iovcnt,
         work_around_broken_dhclient(hdr, buf + offset, size - offset);
     }
 
-    /* We only ever receive a struct virtio_net_hdr from the tapfd,
-     * but we may be passing along a larger header to the guest.
-     */
-    iov[0].iov_base += hdr_len;
-    iov[0].iov_len  -= hdr_len;
-
     return offset;
 }
 
@@ -596,10 +883,11 @@ static int receive_filter(VirtIONet *n, const uint8_t *buf, int size)
 static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t size)
 {
     VirtIONet *n = DO_UPCAST(NICState, nc, nc)->opaque;
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
     struct virtio_net_hdr_mrg_rxbuf *mhdr = NULL;
     size_t guest_hdr_len, offset, i, host_hdr_len;
 
-    if (!virtio_net_can_receive(&n->nic->nc))
+    if (!virtio_net_can_receive(nc))
         return -1;
 
     /* hdr_len refers to the header we supply to the guest */
@@ -608,7 +896,7 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
 
 
     host_hdr_len = n->has_vnet_hdr ? sizeof(struct virtio_net_hdr) : 0;
-    if (!virtio_net_has_buffers(n, size + guest_hdr_len - host_hdr_len))
+    if (!virtio_net_has_buffers(q, size + guest_hdr_len - host_hdr_len))
         return 0;
 
     if (!receive_filter(n, buf, size))
@@ -617,13 +905,13 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
     offset = i = 0;
 
     while (offset < size) {
-        VirtQueueElement elem;
+        VirtQueueElement *elem;
         int len, total;
-        struct iovec sg[VIRTQUEUE_MAX_SIZE];
 
         total = 0;
 
-        if (virtqueue_pop(n->rx_vq, &elem) == 0) {
+        elem = virtio_net_rx_pop(q);
+        if (!elem) {
             if (i == 0)
                 return -1;
             error_report("virtio-net unexpected empty queue: "
@@ -634,29 +922,25 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
             exit(1);
         }
 
-        if (elem.in_num < 1) {
-            error_report("virtio-net receive queue contains no in buffers");
-            exit(1);
-        }
-
-        if (!n->mergeable_rx_bufs && elem.in_sg[0].iov_len != guest_hdr_len) {
+        if (!n->mergeable_rx_bufs && elem->in_sg[0].iov_len != guest_hdr_len) {
             error_report("virtio-net header not in first element");
             exit(1);
         }
 
-        memcpy(&sg, &elem.in_sg[0], sizeof(sg[0]) * elem.in_num);
-
         if (i == 0) {
             if (n->mergeable_rx_bufs)
-                mhdr = (struct virtio_net_hdr_mrg_rxbuf *)sg[0].iov_base;
+                mhdr = (struct virtio_net_hdr_mrg_rxbuf *)elem->in_sg[0].iov_base;
 
-            offset += receive_header(n, sg, elem.in_num,
-                                     buf + offset, size - offset, guest_hdr_len);
+            /* We only ever receive a struct virtio_net_hdr from the tapfd,
+             * but we may be passing along a larger header to the guest.
+             */
+            offset += receive_header(n, elem->in_sg[0].iov_base,
+                                     buf + offset, size - offset);
             total += guest_hdr_len;
         }
 
-        /* copy in packet.  ugh */
-        len = iov_from_buf(sg, elem.in_num, 0,
+        /* copy in packet, after the header in the first buffer */
+        len = iov_from_buf(elem->in_sg, elem->in_num, total,
                            buf + offset, size - offset);
         total += len;
         offset += len;
@@ -671,122 +955,223 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
                          i, n->mergeable_rx_bufs,
                          offset, size, guest_hdr_len, host_hdr_len);
 #endif
+            g_free(elem);
             return size;
         }
 
         /* signal other side */
-        virtqueue_fill(n->rx_vq, &elem, total, i++);
+        virtqueue_fill(q->rx_vq, elem, total, i++);
+        g_free(elem);
     }
 
     if (mhdr) {
         stw_p(&mhdr->num_buffers, i);
     }
 
-    virtqueue_flush(n->rx_vq, i);
-    virtio_notify(&n->vdev, n->rx_vq);
+    virtqueue_flush(q->rx_vq, i);
+    q->rx_notify_pending = 1;
+    qemu_bh_schedule(q->rx_bh);
 
     return size;
 }
 
-static int32_t virtio_net_flush_tx(VirtIONet *n, VirtQueue *vq);
+static int32_t virtio_net_flush_tx(VirtIONetQueue *q);
+
+/* Give the guest the buffers of the packets that were queued without a
+ * copy, now that the net layer is done with them.
+ */
+static void virtio_net_tx_release(VirtIONetQueue *q, bool notify)
+{
+    int i;
+
+    if (!q->tx_pending_count) {
+        return;
+    }
+
+    for (i = 0; i < q->tx_pending_count; i++) {
+        int idx = q->tx_pending_start + i;
+
+        virtqueue_fill(q->tx_vq, q->tx_batch[idx], q->tx_batch_len[idx], i);
+        g_free(q->tx_batch[idx]);
+    }
+    virtqueue_flush(q->tx_vq, q->tx_pending_count);
+    q->tx_pending_count = 0;
+    if (notify) {
+        virtio_notify(&q->n->vdev, q->tx_vq);
+    }
+}
 
 static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
 {
-    VirtIONet *n = DO_UPCAST(NICState, nc, nc)->opaque;
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
 
-    virtqueue_push(n->tx_vq, &n->async_tx.elem, n->async_tx.len);
-    virtio_notify(&n->vdev, n->tx_vq);
+    /* A zero length means the packets were purged, because of a reset, a
+     * VM stop or because the backend or the device goes away.  Do not send
+     * more, but let the guest kick again.
+     */
+    virtio_net_tx_release(q, len != 0);
+    q->tx_async = 0;
+    virtio_queue_set_notification(q->tx_vq, 1);
+    if (len == 0) {
+        return;
+    }
 
-    n->async_tx.elem.out_num = n->async_tx.len = 0;
+    virtio_net_flush_tx(q);
+}
+
+/* With tx=adaptive, pick the timer for high packet rates, where batching
+ * saves exits, and the bottom half for low rates, where it saves latency.
+ */
+static void virtio_net_tx_update_rate(VirtIONetQueue *q, int32_t packets)
+{
+    VirtIONet *n = q->n;
+    int64_t now, elapsed;
+    uint64_t rate;
+
+    if (!q->tx_timer || !q->tx_bh) {
+        return;
+    }
 
-    virtio_queue_set_notification(n->tx_vq, 1);
-    virtio_net_flush_tx(n, n->tx_vq);
+    q->tx_rate_packets += packets;
+    now = qemu_get_clock_ns(vm_clock);
+    elapsed = now - q->tx_rate_start;
+    if (elapsed < TX_RATE_INTERVAL) {
+        return;
+    }
+
+    rate = (uint64_t)q->tx_rate_packets * get_ticks_per_sec() / elapsed;
+    if (!q->tx_deferred && rate > n->tx_rate) {
+        q->tx_deferred = 1;
+    } else if (q->tx_deferred && rate < n->tx_rate / 2) {
+        q->tx_deferred = 0;
+    }
+
+    q->tx_rate_start = now;
+    q->tx_rate_packets = 0;
 }
 
 /* TX */
-static int32_t virtio_net_flush_tx(VirtIONet *n, VirtQueue *vq)
+static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
 {
-    VirtQueueElement elem;
+    VirtIONet *n = q->n;
+    NetClientState *nc;
+    NetPacketIOV packets[TX_BATCH];
+    unsigned flags;
     int32_t num_packets = 0;
+
     if (!(n->vdev.status & VIRTIO_CONFIG_S_DRIVER_OK)) {
         return num_packets;
     }
 
     assert(n->vdev.vm_running);
 
-    if (n->async_tx.elem.out_num) {
-        virtio_queue_set_notification(n->tx_vq, 0);
+    if (q->tx_async) {
+        virtio_queue_set_notification(q->tx_vq, 0);
         return num_packets;
     }
 
-    while (virtqueue_pop(vq, &elem)) {
-        ssize_t ret, len = 0;
-        unsigned int out_num = elem.out_num;
-        struct iovec *out_sg = &elem.out_sg[0];
-        unsigned hdr_len;
-
-        /* hdr_len refers to the header received from the guest */
-        hdr_len = n->mergeable_rx_bufs ?
-            sizeof(struct virtio_net_hdr_mrg_rxbuf) :
-            sizeof(struct virtio_net_hdr);
+    nc = qemu_get_subqueue(n->nic, vq2q(virtio_get_queue_index(q->tx_vq)));
+    flags = n->tx_zerocopy ? QEMU_NET_PACKET_FLAG_ZEROCOPY :
+                             QEMU_NET_PACKET_FLAG_NONE;
+
+    while (num_packets < n->tx_burst) {
+        int count = 0, done, sent, i;
+
+        while (count < MIN(TX_BATCH, n->tx_burst - num_packets) &&
+               (q->tx_batch[count] = virtqueue_pop(q->tx_vq,
+                                                   sizeof(VirtQueueElement)))) {
+            VirtQueueElement *elem = q->tx_batch[count];
+            unsigned int out_num = elem->out_num;
+            struct iovec *out_sg = &elem->out_sg[0];
+            unsigned hdr_len;
+            ssize_t len = 0;
+
+            /* hdr_len refers to the header received from the guest */
+            hdr_len = n->mergeable_rx_bufs ?
+                sizeof(struct virtio_net_hdr_mrg_rxbuf) :
+                sizeof(struct virtio_net_hdr);
+
+            if (out_num < 1 || out_sg->iov_len != hdr_len) {
+                error_report("virtio-net header not in first element");
+                exit(1);
+            }
 
-        if (out_num < 1 || out_sg->iov_len != hdr_len) {
-            error_report("virtio-net header not in first element");
-            exit(1);
-        }
+            /* ignore the header if GSO is not supported */
+            if (!n->has_vnet_hdr) {
+                out_num--;
+                out_sg++;
+                len += hdr_len;
+            } else if (n->mergeable_rx_bufs) {
+                /* tapfd expects a struct virtio_net_hdr */
+                hdr_len -= sizeof(struct virtio_net_hdr);
+                out_sg->iov_len -= hdr_len;
+                len += hdr_len;
+            }
 
-        /* ignore the header if GSO is not supported */
-        if (!n->has_vnet_hdr) {
-            out_num--;
-            out_sg++;
-            len += hdr_len;
-        } else if (n->mergeable_rx_bufs) {
-            /* tapfd expects a struct virtio_net_hdr */
-            hdr_len -= sizeof(struct virtio_net_hdr);
-            out_sg->iov_len -= hdr_len;
-            len += hdr_len;
+            packets[count].iov = out_sg;
+            packets[count].iovcnt = out_num;
+            q->tx_batch_len[count] = len + iov_size(out_sg, out_num);
+            count++;
         }
 
-        ret = qemu_sendv_packet_async(&n->nic->nc, out_sg, out_num,
-                                      virtio_net_tx_complete);
-        if (ret == 0) {
-            virtio_queue_set_notification(n->tx_vq, 0);
-            n->async_tx.elem = elem;
-            n->async_tx.len  = len;
-            return -EBUSY;
+        if (count == 0) {
+            break;
         }
 
-        len += ret;
+        sent = qemu_sendv_packet_batch_async(nc, flags, packets, count,
+                                             virtio_net_tx_complete);
 
-        virtqueue_push(vq, &elem, len);
-        virtio_notify(&n->vdev, vq);
-
-        if (++num_packets >= n->tx_burst) {
-            break;
+        /* The packets that could not go out right away have been copied
+         * by the net layer, so the whole batch is done for the guest.
+         * With zero copy, they still point into guest memory and are
+         * only done in virtio_net_tx_complete().
+         */
+        done = n->tx_zerocopy ? sent : count;
+        for (i = 0; i < done; i++) {
+            virtqueue_fill(q->tx_vq, q->tx_batch[i], q->tx_batch_len[i], i);
+            g_free(q->tx_batch[i]);
+        }
+        if (done) {
+            virtqueue_flush(q->tx_vq, done);
+            virtio_notify(&n->vdev, q->tx_vq);
+        }
+        q->tx_pending_start = done;
+        q->tx_pending_count = count - done;
+        num_packets += count;
+
+        if (sent < count) {
+            /* Send no more until the backend took the queued packets */
+            virtio_queue_set_notification(q->tx_vq, 0);
+            q->tx_async = 1;
+            virtio_net_tx_update_rate(q, num_packets);
+            return -EBUSY;
         }
     }
+
+    virtio_net_tx_update_rate(q, num_packets);
     return num_packets;
 }
 
 static void virtio_net_handle_tx_timer(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = to_virtio_net(vdev);
+    VirtIONetQueue *q = &n->vqs[vq2q(virtio_get_queue_index(vq))];
 
     /* This happens when device was stopped but VCPU wasn't. */
     if (!n->vdev.vm_running) {
-        n->tx_waiting = 1;
+        q->tx_waiting = 1;
         return;
     }
 
-    if (n->tx_waiting) {
+    if (q->tx_waiting) {
         virtio_queue_set_notification(vq, 1);
-        qemu_del_timer(n->tx_timer);
-        n->tx_waiting = 0;
-        virtio_net_flush_tx(n, vq);
+        qemu_del_timer(q->tx_timer);
+        q->tx_waiting = 0;
+        virtio_net_flush_tx(q);
     } else {
-        qemu_mod_timer(n->tx_timer,
+        qemu_mod_timer(q->tx_timer,
                        qemu_get_clock_ns(vm_clock) + n->tx_timeout);
-        n->tx_waiting = 1;
+        q->tx_waiting = 1;
         virtio_queue_set_notification(vq, 0);
     }
 }
@@ -794,48 +1179,77 @@ static void virtio_net_handle_tx_timer(VirtIODevice *vdev, VirtQueue *vq)
 static void virtio_net_handle_tx_bh(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = to_virtio_net(vdev);
+    VirtIONetQueue *q = &n->vqs[vq2q(virtio_get_queue_index(vq))];
 
-    if (unlikely(n->tx_waiting)) {
+    if (unlikely(q->tx_waiting)) {
         return;
     }
-    n->tx_waiting = 1;
+    q->tx_waiting = 1;
     /* This happens when device was stopped but VCPU wasn't. */
     if (!n->vdev.vm_running) {
         return;
     }
     virtio_queue_set_notification(vq, 0);
-    qemu_bh_schedule(n->tx_bh);
+    qemu_bh_schedule(q->tx_bh);
+}
+
+static void virtio_net_handle_tx_adaptive(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtIONet *n = to_virtio_net(vdev);
+    VirtIONetQueue *q = &n->vqs[vq2q(virtio_get_queue_index(vq))];
+
+    /* A kick after a quiet period brings the rate, and the latency, down */
+    virtio_net_tx_update_rate(q, 0);
+
+    if (q->tx_deferred) {
+        virtio_net_handle_tx_timer(vdev, vq);
+    } else {
+        virtio_net_handle_tx_bh(vdev, vq);
+    }
+}
+
+static VirtQueue *virtio_net_add_tx_queue(VirtIONet *n, VirtIONetQueue *q)
+{
+    if (q->tx_timer && q->tx_bh) {
+        return virtio_add_queue(&n->vdev, 256, virtio_net_handle_tx_adaptive);
+    } else if (q->tx_timer) {
+        return virtio_add_queue(&n->vdev, 256, virtio_net_handle_tx_timer);
+    } else {
+        return virtio_add_queue(&n->vdev, 256, virtio_net_handle_tx_bh);
+    }
 }
 
 static void virtio_net_tx_timer(void *opaque)
 {
-    VirtIONet *n = opaque;
+    VirtIONetQueue *q = opaque;
+    VirtIONet *n = q->n;
     assert(n->vdev.vm_running);
 
-    n->tx_waiting = 0;
+    q->tx_waiting = 0;
 
     /* Just in case the driver is not ready on more */
     if (!(n->vdev.status & VIRTIO_CONFIG_S_DRIVER_OK))
         return;
 
-    virtio_queue_set_notification(n->tx_vq, 1);
-    virtio_net_flush_tx(n, n->tx_vq);
+    virtio_queue_set_notification(q->tx_vq, 1);
+    virtio_net_flush_tx(q);
 }
 
 static void virtio_net_tx_bh(void *opaque)
 {
-    VirtIONet *n = opaque;
+    VirtIONetQueue *q = opaque;
+    VirtIONet *n = q->n;
     int32_t ret;
 
     assert(n->vdev.vm_running);
 
-    n->tx_waiting = 0;
+    q->tx_waiting = 0;
 
     /* Just in case the driver is not ready on more */
     if (unlikely(!(n->vdev.status & VIRTIO_CONFIG_S_DRIVER_OK)))
         return;
 
-    ret = virtio_net_flush_tx(n, n->tx_vq);
+    ret = virtio_net_flush_tx(q);
     if (ret == -EBUSY) {
         return; /* Notification re-enable handled by tx_complete */
     }
@@ -843,33 +1257,72 @@ static void virtio_net_tx_bh(void *opaque)
     /* If we flush a full burst of packets, assume there are
      * more coming and immediately reschedule */
     if (ret >= n->tx_burst) {
-        qemu_bh_schedule(n->tx_bh);
-        n->tx_waiting = 1;
+        qemu_bh_schedule(q->tx_bh);
+        q->tx_waiting = 1;
         return;
     }
 
     /* If less than a full burst, re-enable notification and flush
      * anything that may have come in while we weren't looking.  If
      * we find something, assume the guest is still active and reschedule */
-    virtio_queue_set_notification(n->tx_vq, 1);
-    if (virtio_net_flush_tx(n, n->tx_vq) > 0) {
-        virtio_queue_set_notification(n->tx_vq, 0);
-        qemu_bh_schedule(n->tx_bh);
-        n->tx_waiting = 1;
+    virtio_queue_set_notification(q->tx_vq, 1);
+    if (virtio_net_flush_tx(q) > 0) {
+        virtio_queue_set_notification(q->tx_vq, 0);
+        qemu_bh_schedule(q->tx_bh);
+        q->tx_waiting = 1;
     }
 }
 
+/*
+ * Lay out the virtqueues for the negotiated features: the rx/tx pairs
+ * come first and the control queue follows them.  Without multiqueue only
+ * the first pair is there and the control queue is virtqueue 2, like on
+ * older devices.
+ */
+static void virtio_net_set_multiqueue(VirtIONet *n, int multiqueue)
+{
+    int i, max = multiqueue ? n->max_queues : 1;
+
+    if (n->multiqueue == multiqueue) {
+        return;
+    }
+    n->multiqueue = multiqueue;
+
+    for (i = 1; i < n->max_queues; i++) {
+        virtio_net_rx_notify(&n->vqs[i]);
+        virtio_net_rx_discard(&n->vqs[i]);
+    }
+
+    for (i = 2; i < n->max_queues * 2 + 1; i++) {
+        virtio_del_queue(&n->vdev, i);
+    }
+
+    for (i = 1; i < max; i++) {
+        n->vqs[i].rx_vq = virtio_add_queue(&n->vdev, 256, virtio_net_handle_rx);
+        n->vqs[i].tx_vq = virtio_net_add_tx_queue(n, &n->vqs[i]);
+    }
+
+    n->ctrl_vq = virtio_add_queue(&n->vdev, 64, virtio_net_handle_ctrl);
+
+    virtio_net_set_queues(n);
+}
+
 static void virtio_net_save(QEMUFile *f, void *opaque)
 {
     VirtIONet *n = opaque;
+    int i;
 
     /* At this point, backend must be stopped, otherwise
-     * it might keep writing to memory. */
+     * it might keep writing to memory.  Zero copy buffers were given
+     * back when the VM stopped. */
     assert(!n->vhost_started);
+    for (i = 0; i < n->max_queues; i++) {
+        assert(n->vqs[i].rx_cache_count == 0);
+    }
     virtio_save(&n->vdev, f);
 
     qemu_put_buffer(f, n->mac, ETH_ALEN);
-    qemu_put_be32(f, n->tx_waiting);
+    qemu_put_be32(f, n->vqs[0].tx_waiting);
     qemu_put_be32(f, n->mergeable_rx_bufs);
     qemu_put_be16(f, n->status);
     qemu_put_byte(f, n->promisc);
@@ -885,6 +1338,17 @@ static void virtio_net_save(QEMUFile *f, void *opaque)
     qemu_put_byte(f, n->nouni);
     qemu_put_byte(f, n->nobcast);
     qemu_put_byte(f, n->has_ufo);
+
+    /* Only multiqueue devices have more state, so that migration between
+     * single queue devices stays compatible with older versions.
+     */
+    if (n->max_queues > 1) {
+        qemu_put_be16(f, n->max_queues);
+        qemu_put_be16(f, n->curr_queues);
+        for (i = 1; i < n->curr_queues; i++) {
+            qemu_put_be32(f, n->vqs[i].tx_waiting);
+        }
+    }
 }
 
 static int virtio_net_load(QEMUFile *f, void *opaque, int version_id)
@@ -902,7 +1366,7 @@ static int virtio_net_load(QEMUFile *f, void *opaque, int version_id)
     }
 
     qemu_get_buffer(f, n->mac, ETH_ALEN);
-    n->tx_waiting = qemu_get_be32(f);
+    n->vqs[0].tx_waiting = qemu_get_be32(f);
     n->mergeable_rx_bufs = qemu_get_be32(f);
 
     if (version_id >= 3)
@@ -941,13 +1405,8 @@ static int virtio_net_load(QEMUFile *f, void *opaque, int version_id)
         }
 
         if (n->has_vnet_hdr) {
-            tap_using_vnet_hdr(n->nic->nc.peer, 1);
-            tap_set_offload(n->nic->nc.peer,
-                    (n->vdev.guest_features >> VIRTIO_NET_F_GUEST_CSUM) & 1,
-                    (n->vdev.guest_features >> VIRTIO_NET_F_GUEST_TSO4) & 1,
-                    (n->vdev.guest_features >> VIRTIO_NET_F_GUEST_TSO6) & 1,
-                    (n->vdev.guest_features >> VIRTIO_NET_F_GUEST_ECN)  & 1,
-                    (n->vdev.guest_features >> VIRTIO_NET_F_GUEST_UFO)  & 1);
+            virtio_net_using_vnet_hdr(n);
+            virtio_net_set_offload(n, n->vdev.guest_features);
         }
     }
 
@@ -970,6 +1429,25 @@ static int virtio_net_load(QEMUFile *f, void *opaque, int version_id)
         }
     }
 
+    if (n->max_queues > 1) {
+        if (n->max_queues != qemu_get_be16(f)) {
+            error_report("virtio-net: different max_queues");
+            return -1;
+        }
+
+        n->curr_queues = qemu_get_be16(f);
+        if (n->curr_queues < 1 || n->curr_queues > n->max_queues) {
+            error_report("virtio-net: invalid number of queues in use: %d",
+                         n->curr_queues);
+            return -1;
+        }
+        for (i = 1; i < n->curr_queues; i++) {
+            n->vqs[i].tx_waiting = qemu_get_be32(f);
+        }
+    }
+
+    virtio_net_set_queues(n);
+
     /* Find the first multicast entry in the saved MAC filter */
     for (i = 0; i < n->mac_table.in_use; i++) {
         if (n->mac_table.macs[i * ETH_ALEN] & 1) {
@@ -1000,6 +1478,7 @@ VirtIODevice *virtio_net_init(DeviceState *dev, NICConf *conf,
                               virtio_net_conf *net)
 {
     VirtIONet *n;
+    int i;
 
     n = (VirtIONet *)virtio_common_init("virtio-net", VIRTIO_ID_NET,
                                         sizeof(struct virtio_net_config),
@@ -1012,33 +1491,68 @@ VirtIODevice *virtio_net_init(DeviceState *dev, NICConf *conf,
     n->vdev.bad_features = virtio_net_bad_features;
     n->vdev.reset = virtio_net_reset;
     n->vdev.set_status = virtio_net_set_status;
-    n->rx_vq = virtio_add_queue(&n->vdev, 256, virtio_net_handle_rx);
 
-    if (net->tx && strcmp(net->tx, "timer") && strcmp(net->tx, "bh")) {
-        error_report("virtio-net: "
-                     "Unknown option tx=%s, valid options: \"timer\" \"bh\"",
+    if (net->tx && strcmp(net->tx, "timer") && strcmp(net->tx, "bh") &&
+        strcmp(net->tx, "adaptive")) {
+        error_report("virtio-net: Unknown option tx=%s, "
+                     "valid options: \"timer\" \"bh\" \"adaptive\"",
                      net->tx);
         error_report("Defaulting to \"bh\"");
     }
 
-    if (net->tx && !strcmp(net->tx, "timer")) {
-        n->tx_vq = virtio_add_queue(&n->vdev, 256, virtio_net_handle_tx_timer);
-        n->tx_timer = qemu_new_timer_ns(vm_clock, virtio_net_tx_timer, n);
-        n->tx_timeout = net->txtimer;
-    } else {
-        n->tx_vq = virtio_add_queue(&n->vdev, 256, virtio_net_handle_tx_bh);
-        n->tx_bh = qemu_bh_new(virtio_net_tx_bh, n);
-    }
-    n->ctrl_vq = virtio_add_queue(&n->vdev, 64, virtio_net_handle_ctrl);
     qemu_macaddr_default_if_unset(&conf->macaddr);
     memcpy(&n->mac[0], &conf->macaddr, sizeof(n->mac));
     n->status = VIRTIO_NET_S_LINK_UP;
 
+    /* The NIC gets one queue per queue of the netdev */
     n->nic = qemu_new_nic(&net_virtio_info, conf, object_get_typename(OBJECT(dev)), dev->id, n);
+    n->max_queues = MAX(n->nic->queues, 1);
+    if (n->max_queues * 2 + 1 > VIRTIO_PCI_QUEUE_MAX) {
+        error_report("virtio-net: netdev has %d queues, at most %d are "
+                     "supported", n->max_queues, (VIRTIO_PCI_QUEUE_MAX - 1) / 2);
+        qemu_del_net_client(&n->nic->nc);
+        virtio_cleanup(&n->vdev);
+        return NULL;
+    }
+
+    /* Keep the layout of config space of single queue devices */
+    if (n->max_queues == 1) {
+        n->vdev.config_len = offsetof(struct virtio_net_config,
+                                      max_virtqueue_pairs);
+    }
+
+    n->vqs = g_malloc0(sizeof(VirtIONetQueue) * n->max_queues);
+    n->curr_queues = 1;
+    n->tx_timeout = net->txtimer;
+    n->tx_rate = net->txrate;
+    n->tx_zerocopy = !!(net->flags & (1 << VIRTIO_NET_CONF_TX_ZEROCOPY));
+
+    /* Timers and bottom halves are set up for all the pairs, the
+     * virtqueues of the pairs after the first appear once the guest
+     * negotiates VIRTIO_NET_F_MQ.
+     */
+    for (i = 0; i < n->max_queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        q->n = n;
+        if (net->tx && (!strcmp(net->tx, "timer") ||
+                        !strcmp(net->tx, "adaptive"))) {
+            q->tx_timer = qemu_new_timer_ns(vm_clock, virtio_net_tx_timer, q);
+        }
+        if (!q->tx_timer || !strcmp(net->tx, "adaptive")) {
+            q->tx_bh = qemu_bh_new(virtio_net_tx_bh, q);
+        }
+        q->tx_waiting = 0;
+        q->rx_bh = qemu_bh_new(virtio_net_rx_bh, q);
+        q->tx_rate_start = qemu_get_clock_ns(vm_clock);
+    }
+
+    n->vqs[0].rx_vq = virtio_add_queue(&n->vdev, 256, virtio_net_handle_rx);
+    n->vqs[0].tx_vq = virtio_net_add_tx_queue(n, &n->vqs[0]);
+    n->ctrl_vq = virtio_add_queue(&n->vdev, 64, virtio_net_handle_ctrl);
 
     qemu_format_nic_info_str(&n->nic->nc, conf->macaddr.a);
 
-    n->tx_waiting = 0;
     n->tx_burst = net->txburst;
     n->mergeable_rx_bufs = 0;
     n->promisc = 1; /* for compatibility */
@@ -1059,24 +1573,32 @@ VirtIODevice *virtio_net_init(DeviceState *dev, NICConf *conf,
 void virtio_net_exit(VirtIODevice *vdev)
 {
     VirtIONet *n = DO_UPCAST(VirtIONet, vdev, vdev);
+    int i;
 
     /* This will stop vhost backend if appropriate. */
     virtio_net_set_status(vdev, 0);
 
-    qemu_purge_queued_packets(&n->nic->nc);
-
     unregister_savevm(n->qdev, "virtio-net", n);
 
     g_free(n->mac_table.macs);
     g_free(n->vlans);
 
-    if (n->tx_timer) {
-        qemu_del_timer(n->tx_timer);
-        qemu_free_timer(n->tx_timer);
-    } else {
-        qemu_bh_delete(n->tx_bh);
+    for (i = 0; i < n->max_queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        qemu_purge_queued_packets(qemu_get_subqueue(n->nic, i));
+
+        if (q->tx_timer) {
+            qemu_del_timer(q->tx_timer);
+            qemu_free_timer(q->tx_timer);
+        }
+        if (q->tx_bh) {
+            qemu_bh_delete(q->tx_bh);
+        }
+        qemu_bh_delete(q->rx_bh);
     }
 
+    g_free(n->vqs);
     qemu_del_net_client(&n->nic->nc);
     virtio_cleanup(&n->vdev);
 }
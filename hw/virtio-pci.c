@@ -22,6 +22,7 @@
 #include "virtio-net.h"
 #include "virtio-serial.h"
 #include "virtio-scsi.h"
+#include "virtio-balloon.h"
 #include "pci.h"
 #include "qemu-error.h"
 #include "msi.h"
@@ -174,11 +175,16 @@ static int virtio_pci_set_host_notifier_internal(VirtIOPCIProxy *proxy,
             return r;
         }
         virtio_queue_set_host_notifier_fd_handler(vq, true, set_handler);
-        memory_region_add_eventfd(&proxy->bar, VIRTIO_PCI_QUEUE_NOTIFY, 2,
-                                  true, n, notifier);
+        /* without KVM ioeventfds, virtio_pci_notify_write() signals it */
+        if (kvm_has_many_ioeventfds()) {
+            memory_region_add_eventfd(&proxy->notify, 0, 2, true, n, notifier);
+        }
+        proxy->host_notifiers |= 1ULL << n;
     } else {
-        memory_region_del_eventfd(&proxy->bar, VIRTIO_PCI_QUEUE_NOTIFY, 2,
-                                  true, n, notifier);
+        proxy->host_notifiers &= ~(1ULL << n);
+        if (kvm_has_many_ioeventfds()) {
+            memory_region_del_eventfd(&proxy->notify, 0, 2, true, n, notifier);
+        }
         virtio_queue_set_host_notifier_fd_handler(vq, false, false);
         event_notifier_cleanup(notifier);
     }
@@ -206,6 +212,9 @@ static void virtio_pci_start_ioeventfd(VirtIOPCIProxy *proxy)
         }
     }
     proxy->ioeventfd_started = true;
+    /* every queue now has a notifier, so kicks need not wait for the
+       global mutex */
+    memory_region_set_lockless(&proxy->notify, false, true);
     return;
 
 assign_error:
@@ -230,6 +239,8 @@ static void virtio_pci_stop_ioeventfd(VirtIOPCIProxy *proxy)
         return;
     }
 
+    /* wait for the kicks in progress before closing the notifiers */
+    memory_region_set_lockless(&proxy->notify, false, false);
     for (n = 0; n < VIRTIO_PCI_QUEUE_MAX; n++) {
         if (!virtio_queue_get_num(proxy->vdev, n)) {
             continue;
@@ -277,11 +288,6 @@ static void virtio_ioport_write(void *opaque, uint32_t addr, uint32_t val)
         if (val < VIRTIO_PCI_QUEUE_MAX)
             vdev->queue_sel = val;
         break;
-    case VIRTIO_PCI_QUEUE_NOTIFY:
-        if (val < VIRTIO_PCI_QUEUE_MAX) {
-            virtio_queue_notify(vdev, val);
-        }
-        break;
     case VIRTIO_PCI_STATUS:
         if (!(val & VIRTIO_CONFIG_S_DRIVER_OK)) {
             virtio_pci_stop_ioeventfd(proxy);
@@ -474,6 +480,38 @@ static const MemoryRegionOps virtio_pci_config_ops = {
     .endianness = DEVICE_LITTLE_ENDIAN,
 };
 
+/* The queue notify register.  While ioeventfd is started, writes are
+ * done without the global mutex and only signal the host notifiers.
+ */
+static uint64_t virtio_pci_notify_read(void *opaque, target_phys_addr_t addr,
+                                       unsigned size)
+{
+    return (1ULL << (size * 8)) - 1;
+}
+
+static void virtio_pci_notify_write(void *opaque, target_phys_addr_t addr,
+                                    uint64_t val, unsigned size)
+{
+    VirtIOPCIProxy *proxy = opaque;
+    VirtQueue *vq;
+
+    if (val >= VIRTIO_PCI_QUEUE_MAX) {
+        return;
+    }
+    if (proxy->host_notifiers & (1ULL << val)) {
+        vq = virtio_get_queue(proxy->vdev, val);
+        event_notifier_set(virtio_queue_get_host_notifier(vq));
+    } else if (!proxy->ioeventfd_started) {
+        virtio_queue_notify(proxy->vdev, val);
+    }
+}
+
+static const MemoryRegionOps virtio_pci_notify_ops = {
+    .read = virtio_pci_notify_read,
+    .write = virtio_pci_notify_write,
+    .endianness = DEVICE_LITTLE_ENDIAN,
+};
+
 static void virtio_write_config(PCIDevice *pci_dev, uint32_t address,
                                 uint32_t val, int len)
 {
@@ -746,10 +784,15 @@ void virtio_init_pci(VirtIOPCIProxy *proxy, VirtIODevice *vdev)
 
     memory_region_init_io(&proxy->bar, &virtio_pci_config_ops, proxy,
                           "virtio-pci", size);
+    memory_region_init_io(&proxy->notify, &virtio_pci_notify_ops, proxy,
+                          "virtio-pci-notify", 2);
+    memory_region_add_subregion(&proxy->bar, VIRTIO_PCI_QUEUE_NOTIFY,
+                                &proxy->notify);
     pci_register_bar(&proxy->pci_dev, 0, PCI_BASE_ADDRESS_SPACE_IO,
                      &proxy->bar);
 
-    if (!kvm_has_many_ioeventfds()) {
+    /* without ioeventfds, KVM vCPUs still kick the notifiers themselves */
+    if (!kvm_enabled()) {
         proxy->flags &= ~VIRTIO_PCI_FLAG_USE_IOEVENTFD;
     }
 
@@ -779,10 +822,12 @@ static int virtio_blk_init_pci(PCIDevice *pci_dev)
     return 0;
 }
 
-static void virtio_exit_pci(PCIDevice *pci_dev)
+void virtio_exit_pci(PCIDevice *pci_dev)
 {
     VirtIOPCIProxy *proxy = DO_UPCAST(VirtIOPCIProxy, pci_dev, pci_dev);
 
+    memory_region_del_subregion(&proxy->bar, &proxy->notify);
+    memory_region_destroy(&proxy->notify);
     memory_region_destroy(&proxy->bar);
     msix_uninit_exclusive_bar(pci_dev);
 }
@@ -833,6 +878,9 @@ static int virtio_net_init_pci(PCIDevice *pci_dev)
     VirtIODevice *vdev;
 
     vdev = virtio_net_init(&pci_dev->qdev, &proxy->nic, &proxy->net);
+    if (!vdev) {
+        return -1;
+    }
 
     vdev->nvectors = proxy->nvectors;
     virtio_init_pci(proxy, vdev);
@@ -861,7 +909,7 @@ static int virtio_balloon_init_pci(PCIDevice *pci_dev)
         proxy->class_code = PCI_CLASS_OTHERS;
     }
 
-    vdev = virtio_balloon_init(&pci_dev->qdev);
+    vdev = virtio_balloon_init(&pci_dev->qdev, &proxy->balloon);
     if (!vdev) {
         return -1;
     }
@@ -887,6 +935,9 @@ static Property virtio_blk_properties[] = {
     DEFINE_PROP_BIT("scsi", VirtIOPCIProxy, blk.scsi, 0, true),
 #endif
     DEFINE_PROP_BIT("config-wce", VirtIOPCIProxy, blk.config_wce, 0, true),
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    DEFINE_PROP_BIT("x-data-plane", VirtIOPCIProxy, blk.data_plane, 0, false),
+#endif
     DEFINE_PROP_BIT("ioeventfd", VirtIOPCIProxy, flags, VIRTIO_PCI_FLAG_USE_IOEVENTFD_BIT, true),
     DEFINE_PROP_UINT32("vectors", VirtIOPCIProxy, nvectors, 2),
     DEFINE_VIRTIO_BLK_FEATURES(VirtIOPCIProxy, host_features),
@@ -922,6 +973,9 @@ static Property virtio_net_properties[] = {
     DEFINE_NIC_PROPERTIES(VirtIOPCIProxy, nic),
     DEFINE_PROP_UINT32("x-txtimer", VirtIOPCIProxy, net.txtimer, TX_TIMER_INTERVAL),
     DEFINE_PROP_INT32("x-txburst", VirtIOPCIProxy, net.txburst, TX_BURST),
+    DEFINE_PROP_UINT32("x-txrate", VirtIOPCIProxy, net.txrate, TX_ADAPTIVE_RATE),
+    DEFINE_PROP_BIT("x-txzerocopy", VirtIOPCIProxy, net.flags,
+                    VIRTIO_NET_CONF_TX_ZEROCOPY, false),
     DEFINE_PROP_STRING("tx", VirtIOPCIProxy, net.tx),
     DEFINE_PROP_END_OF_LIST(),
 };
@@ -982,7 +1036,10 @@ static TypeInfo virtio_serial_info = {
 
 static Property virtio_balloon_properties[] = {
     DEFINE_VIRTIO_COMMON_FEATURES(VirtIOPCIProxy, host_features),
+    DEFINE_PROP_BIT("free-page-hint", VirtIOPCIProxy, host_features,
+                    VIRTIO_BALLOON_F_FREE_PAGE_HINT, false),
     DEFINE_PROP_HEX32("class", VirtIOPCIProxy, class_code, 0),
+    DEFINE_VIRTIO_BALLOON_PROPERTIES(VirtIOPCIProxy, balloon),
     DEFINE_PROP_END_OF_LIST(),
 };
 
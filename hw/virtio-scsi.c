@@ -17,12 +17,8 @@
 #include <hw/scsi.h>
 #include <hw/scsi-defs.h>
 
-#define VIRTIO_SCSI_VQ_SIZE     128
-#define VIRTIO_SCSI_CDB_SIZE    32
-#define VIRTIO_SCSI_SENSE_SIZE  96
-#define VIRTIO_SCSI_MAX_CHANNEL 0
-#define VIRTIO_SCSI_MAX_TARGET  255
-#define VIRTIO_SCSI_MAX_LUN     16383
+/* Requests taken from one command queue before the others get a turn */
+#define VIRTIO_SCSI_CMD_BATCH   32
 
 /* Response codes */
 #define VIRTIO_SCSI_S_OK                       0
@@ -110,24 +106,7 @@ typedef struct {
     uint8_t response;
 } QEMU_PACKED VirtIOSCSICtrlANResp;
 
-typedef struct {
-    uint32_t event;
-    uint8_t lun[8];
-    uint32_t reason;
-} QEMU_PACKED VirtIOSCSIEvent;
-
-typedef struct {
-    uint32_t num_queues;
-    uint32_t seg_max;
-    uint32_t max_sectors;
-    uint32_t cmd_per_lun;
-    uint32_t event_info_size;
-    uint32_t sense_size;
-    uint32_t cdb_size;
-    uint16_t max_channel;
-    uint16_t max_target;
-    uint32_t max_lun;
-} QEMU_PACKED VirtIOSCSIConfig;
+typedef struct VirtIOSCSIQueue VirtIOSCSIQueue;
 
 typedef struct {
     VirtIODevice vdev;
@@ -141,13 +120,31 @@ typedef struct {
     bool events_dropped;
     VirtQueue *ctrl_vq;
     VirtQueue *event_vq;
+    VMChangeStateEntry *vmstate;
+    VirtIOSCSIQueue *cmd_queues;
     VirtQueue *cmd_vqs[0];
 } VirtIOSCSI;
 
+/* Each request queue is processed and signalled on its own, so that a
+ * guest spreading I/O over several queues (and MSI-X vectors) does not
+ * have one busy queue hold up the others.
+ */
+struct VirtIOSCSIQueue {
+    VirtIOSCSI *s;
+    VirtQueue *vq;
+    /* continues the queue after a full batch, with notification off */
+    QEMUBH *bh;
+    bool bh_deferred;
+    /* raises the queue's interrupt once for the completions of a
+     * main loop iteration */
+    QEMUBH *notify_bh;
+    bool notify_pending;
+};
+
 typedef struct VirtIOSCSIReq {
+    VirtQueueElement elem;
     VirtIOSCSI *dev;
     VirtQueue *vq;
-    VirtQueueElement elem;
     QEMUSGList qsgl;
     SCSIRequest *sreq;
     union {
@@ -181,10 +178,33 @@ static inline SCSIDevice *virtio_scsi_device_find(VirtIOSCSI *s, uint8_t *lun)
     return scsi_device_find(&s->bus, 0, lun[1], virtio_scsi_get_lun(lun));
 }
 
+static VirtIOSCSIQueue *virtio_scsi_cmd_queue(VirtIOSCSI *s, VirtQueue *vq)
+{
+    int n = virtio_queue_get_id(vq) - 2;
+
+    return n >= 0 ? &s->cmd_queues[n] : NULL;
+}
+
+static void virtio_scsi_cmd_notify(VirtIOSCSIQueue *q)
+{
+    if (q->notify_pending) {
+        q->notify_pending = false;
+        qemu_bh_cancel(q->notify_bh);
+        virtio_notify(&q->s->vdev, q->vq);
+    }
+}
+
+static void virtio_scsi_notify_bh(void *opaque)
+{
+    virtio_scsi_cmd_notify(opaque);
+}
+
 static void virtio_scsi_complete_req(VirtIOSCSIReq *req)
 {
     VirtIOSCSI *s = req->dev;
     VirtQueue *vq = req->vq;
+    VirtIOSCSIQueue *q = virtio_scsi_cmd_queue(s, vq);
+
     virtqueue_push(vq, &req->elem, req->qsgl.size + req->elem.in_sg[0].iov_len);
     qemu_sglist_destroy(&req->qsgl);
     if (req->sreq) {
@@ -192,7 +212,12 @@ static void virtio_scsi_complete_req(VirtIOSCSIReq *req)
         scsi_req_unref(req->sreq);
     }
     g_free(req);
-    virtio_notify(&s->vdev, vq);
+    if (q && s->vdev.vm_running) {
+        q->notify_pending = true;
+        qemu_bh_schedule(q->notify_bh);
+    } else {
+        virtio_notify(&s->vdev, vq);
+    }
 }
 
 static void virtio_scsi_bad_req(void)
@@ -235,13 +260,11 @@ static void virtio_scsi_parse_req(VirtIOSCSI *s, VirtQueue *vq,
 
 static VirtIOSCSIReq *virtio_scsi_pop_req(VirtIOSCSI *s, VirtQueue *vq)
 {
-    VirtIOSCSIReq *req;
-    req = g_malloc(sizeof(*req));
-    if (!virtqueue_pop(vq, &req->elem)) {
-        g_free(req);
+    VirtIOSCSIReq *req = virtqueue_pop(vq, sizeof(VirtIOSCSIReq));
+
+    if (!req) {
         return NULL;
     }
-
     virtio_scsi_parse_req(s, vq, req);
     return req;
 }
@@ -253,7 +276,7 @@ static void virtio_scsi_save_request(QEMUFile *f, SCSIRequest *sreq)
 
     assert(n < req->dev->conf->num_queues);
     qemu_put_be32s(f, &n);
-    qemu_put_buffer(f, (unsigned char *)&req->elem, sizeof(req->elem));
+    qemu_put_virtqueue_element(f, &req->elem);
 }
 
 static void *virtio_scsi_load_request(QEMUFile *f, SCSIRequest *sreq)
@@ -263,10 +286,9 @@ static void *virtio_scsi_load_request(QEMUFile *f, SCSIRequest *sreq)
     VirtIOSCSIReq *req;
     uint32_t n;
 
-    req = g_malloc(sizeof(*req));
     qemu_get_be32s(f, &n);
     assert(n < s->conf->num_queues);
-    qemu_get_buffer(f, (unsigned char *)&req->elem, sizeof(req->elem));
+    req = qemu_get_virtqueue_element(f, sizeof(VirtIOSCSIReq));
     virtio_scsi_parse_req(s, s->cmd_vqs[n], req);
 
     scsi_req_ref(sreq);
@@ -465,56 +487,124 @@ static void virtio_scsi_fail_cmd_req(VirtIOSCSIReq *req)
     virtio_scsi_complete_req(req);
 }
 
-static void virtio_scsi_handle_cmd(VirtIODevice *vdev, VirtQueue *vq)
+static void virtio_scsi_submit_cmd(VirtIOSCSI *s, VirtIOSCSIReq *req)
 {
-    VirtIOSCSI *s = (VirtIOSCSI *)vdev;
-    VirtIOSCSIReq *req;
-    int n;
+    SCSIDevice *d;
+    int out_size, in_size;
 
-    while ((req = virtio_scsi_pop_req(s, vq))) {
-        SCSIDevice *d;
-        int out_size, in_size;
-        if (req->elem.out_num < 1 || req->elem.in_num < 1) {
-            virtio_scsi_bad_req();
-        }
+    if (req->elem.out_num < 1 || req->elem.in_num < 1) {
+        virtio_scsi_bad_req();
+    }
 
-        out_size = req->elem.out_sg[0].iov_len;
-        in_size = req->elem.in_sg[0].iov_len;
-        if (out_size < sizeof(VirtIOSCSICmdReq) + s->cdb_size ||
-            in_size < sizeof(VirtIOSCSICmdResp) + s->sense_size) {
-            virtio_scsi_bad_req();
-        }
+    out_size = req->elem.out_sg[0].iov_len;
+    in_size = req->elem.in_sg[0].iov_len;
+    if (out_size < sizeof(VirtIOSCSICmdReq) + s->cdb_size ||
+        in_size < sizeof(VirtIOSCSICmdResp) + s->sense_size) {
+        virtio_scsi_bad_req();
+    }
 
-        if (req->elem.out_num > 1 && req->elem.in_num > 1) {
-            virtio_scsi_fail_cmd_req(req);
-            continue;
-        }
+    if (req->elem.out_num > 1 && req->elem.in_num > 1) {
+        virtio_scsi_fail_cmd_req(req);
+        return;
+    }
 
-        d = virtio_scsi_device_find(s, req->req.cmd->lun);
-        if (!d) {
-            req->resp.cmd->response = VIRTIO_SCSI_S_BAD_TARGET;
+    d = virtio_scsi_device_find(s, req->req.cmd->lun);
+    if (!d) {
+        req->resp.cmd->response = VIRTIO_SCSI_S_BAD_TARGET;
+        virtio_scsi_complete_req(req);
+        return;
+    }
+    req->sreq = scsi_req_new(d, req->req.cmd->tag,
+                             virtio_scsi_get_lun(req->req.cmd->lun),
+                             req->req.cmd->cdb, req);
+
+    if (req->sreq->cmd.mode != SCSI_XFER_NONE) {
+        int req_mode =
+            (req->elem.in_num > 1 ? SCSI_XFER_FROM_DEV : SCSI_XFER_TO_DEV);
+
+        if (req->sreq->cmd.mode != req_mode ||
+            req->sreq->cmd.xfer > req->qsgl.size) {
+            req->resp.cmd->response = VIRTIO_SCSI_S_OVERRUN;
             virtio_scsi_complete_req(req);
-            continue;
+            return;
         }
-        req->sreq = scsi_req_new(d, req->req.cmd->tag,
-                                 virtio_scsi_get_lun(req->req.cmd->lun),
-                                 req->req.cmd->cdb, req);
-
-        if (req->sreq->cmd.mode != SCSI_XFER_NONE) {
-            int req_mode =
-                (req->elem.in_num > 1 ? SCSI_XFER_FROM_DEV : SCSI_XFER_TO_DEV);
-
-            if (req->sreq->cmd.mode != req_mode ||
-                req->sreq->cmd.xfer > req->qsgl.size) {
-                req->resp.cmd->response = VIRTIO_SCSI_S_OVERRUN;
-                virtio_scsi_complete_req(req);
-                continue;
-            }
+    }
+
+    scsi_req_submit(req->sreq);
+}
+
+static void virtio_scsi_run_cmd_queue(VirtIOSCSIQueue *q)
+{
+    VirtIOSCSI *s = q->s;
+    VirtIOSCSIReq *req;
+    int i;
+
+    for (i = 0; i < VIRTIO_SCSI_CMD_BATCH; i++) {
+        req = virtio_scsi_pop_req(s, q->vq);
+        if (!req) {
+            break;
         }
+        virtio_scsi_submit_cmd(s, req);
+    }
+
+    if (i == VIRTIO_SCSI_CMD_BATCH) {
+        /* Let the other queues and the main loop have a go first */
+        virtio_queue_set_notification(q->vq, 0);
+        qemu_bh_schedule(q->bh);
+        return;
+    }
+
+    virtio_queue_set_notification(q->vq, 1);
+    /* The guest may have added requests just before notification was
+     * reenabled, in which case it did not kick us.  */
+    if (!virtio_queue_empty(q->vq)) {
+        virtio_queue_set_notification(q->vq, 0);
+        qemu_bh_schedule(q->bh);
+    }
+}
+
+static void virtio_scsi_cmd_bh(void *opaque)
+{
+    VirtIOSCSIQueue *q = opaque;
 
-        n = scsi_req_enqueue(req->sreq);
-        if (n) {
-            scsi_req_continue(req->sreq);
+    if (!virtio_queue_ready(q->vq)) {
+        return;
+    }
+    if (!q->s->vdev.vm_running) {
+        /* picked up again by virtio_scsi_vmstate_change() */
+        q->bh_deferred = true;
+        return;
+    }
+    virtio_scsi_run_cmd_queue(q);
+}
+
+static void virtio_scsi_handle_cmd(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtIOSCSI *s = (VirtIOSCSI *)vdev;
+
+    virtio_scsi_run_cmd_queue(virtio_scsi_cmd_queue(s, vq));
+}
+
+static void virtio_scsi_vmstate_change(void *opaque, int running,
+                                       RunState state)
+{
+    VirtIOSCSI *s = opaque;
+    int i;
+
+    if (!running) {
+        /* Raise the notifications now, while they can still be part of
+         * the interrupt state that a migration saves.  Requests that
+         * complete while the VM is stopped notify at once.
+         */
+        for (i = 0; i < s->conf->num_queues; i++) {
+            virtio_scsi_cmd_notify(&s->cmd_queues[i]);
+        }
+        return;
+    }
+    for (i = 0; i < s->conf->num_queues; i++) {
+        if (s->cmd_queues[i].bh_deferred) {
+            s->cmd_queues[i].bh_deferred = false;
+            qemu_bh_schedule(s->cmd_queues[i].bh);
         }
     }
 }
@@ -562,7 +652,16 @@ static uint32_t virtio_scsi_get_features(VirtIODevice *vdev,
 static void virtio_scsi_reset(VirtIODevice *vdev)
 {
     VirtIOSCSI *s = (VirtIOSCSI *)vdev;
+    int i;
 
+    for (i = 0; i < s->conf->num_queues; i++) {
+        VirtIOSCSIQueue *q = &s->cmd_queues[i];
+
+        q->notify_pending = false;
+        qemu_bh_cancel(q->notify_bh);
+        qemu_bh_cancel(q->bh);
+        q->bh_deferred = false;
+    }
     s->sense_size = VIRTIO_SCSI_SENSE_SIZE;
     s->cdb_size = VIRTIO_SCSI_CDB_SIZE;
     s->events_dropped = false;
@@ -574,6 +673,7 @@ static void virtio_scsi_reset(VirtIODevice *vdev)
 static void virtio_scsi_save(QEMUFile *f, void *opaque)
 {
     VirtIOSCSI *s = opaque;
+
     virtio_save(&s->vdev, f);
 }
 
@@ -716,10 +816,19 @@ VirtIODevice *virtio_scsi_init(DeviceState *dev, VirtIOSCSIConf *proxyconf)
                                    virtio_scsi_handle_ctrl);
     s->event_vq = virtio_add_queue(&s->vdev, VIRTIO_SCSI_VQ_SIZE,
                                    virtio_scsi_handle_event);
+    s->cmd_queues = g_new0(VirtIOSCSIQueue, s->conf->num_queues);
     for (i = 0; i < s->conf->num_queues; i++) {
+        VirtIOSCSIQueue *q = &s->cmd_queues[i];
+
         s->cmd_vqs[i] = virtio_add_queue(&s->vdev, VIRTIO_SCSI_VQ_SIZE,
                                          virtio_scsi_handle_cmd);
+        q->s = s;
+        q->vq = s->cmd_vqs[i];
+        q->bh = qemu_bh_new(virtio_scsi_cmd_bh, q);
+        q->notify_bh = qemu_bh_new(virtio_scsi_notify_bh, q);
     }
+    s->vmstate = qemu_add_vm_change_state_handler(virtio_scsi_vmstate_change,
+                                                  s);
 
     scsi_bus_new(&s->bus, dev, &virtio_scsi_scsi_info);
     if (!dev->hotplugged) {
@@ -735,6 +844,14 @@ VirtIODevice *virtio_scsi_init(DeviceState *dev, VirtIOSCSIConf *proxyconf)
 void virtio_scsi_exit(VirtIODevice *vdev)
 {
     VirtIOSCSI *s = (VirtIOSCSI *)vdev;
+    int i;
+
     unregister_savevm(s->qdev, "virtio-scsi", s);
+    qemu_del_vm_change_state_handler(s->vmstate);
+    for (i = 0; i < s->conf->num_queues; i++) {
+        qemu_bh_delete(s->cmd_queues[i].bh);
+        qemu_bh_delete(s->cmd_queues[i].notify_bh);
+    }
+    g_free(s->cmd_queues);
     virtio_cleanup(vdev);
 }
@@ -25,6 +25,12 @@
 #include "trace.h"
 #include "virtio-serial.h"
 
+/* Guest buffers handed to have_data_iov in one call */
+#define VIRTIO_SERIAL_BATCH_IOV 64
+
+/* Most input the guest is reported to be ready for at once */
+#define VIRTIO_SERIAL_GUEST_READY_MAX 65536
+
 /* The virtio-serial bus on top of which the ports will ride as devices */
 struct VirtIOSerialBus {
     BusState qbus;
@@ -89,7 +95,7 @@ static bool use_multiport(VirtIOSerial *vser)
 static size_t write_to_port(VirtIOSerialPort *port,
                             const uint8_t *buf, size_t size)
 {
-    VirtQueueElement elem;
+    VirtQueueElement *elem;
     VirtQueue *vq;
     size_t offset;
 
@@ -102,32 +108,176 @@ static size_t write_to_port(VirtIOSerialPort *port,
     while (offset < size) {
         size_t len;
 
-        if (!virtqueue_pop(vq, &elem)) {
+        elem = virtqueue_pop(vq, sizeof(VirtQueueElement));
+        if (!elem) {
             break;
         }
 
-        len = iov_from_buf(elem.in_sg, elem.in_num, 0,
+        len = iov_from_buf(elem->in_sg, elem->in_num, 0,
                            buf + offset, size - offset);
         offset += len;
 
-        virtqueue_push(vq, &elem, len);
+        virtqueue_push(vq, elem, len);
+        g_free(elem);
     }
 
-    virtio_notify(&port->vser->vdev, vq);
+    if (offset) {
+        virtio_notify(&port->vser->vdev, vq);
+    }
     return offset;
 }
 
 static void discard_vq_data(VirtQueue *vq, VirtIODevice *vdev)
 {
-    VirtQueueElement elem;
+    VirtQueueElement *elem;
+    unsigned int count = 0;
 
     if (!virtio_queue_ready(vq)) {
         return;
     }
-    while (virtqueue_pop(vq, &elem)) {
-        virtqueue_push(vq, &elem, 0);
+    while ((elem = virtqueue_pop(vq, sizeof(VirtQueueElement)))) {
+        virtqueue_push(vq, elem, 0);
+        g_free(elem);
+        count++;
+    }
+    if (count) {
+        virtio_notify(vdev, vq);
+    }
+}
+
+/*
+ * Flush for ports with have_data_iov: the data of up to
+ * VIRTIO_SERIAL_BATCH_IOV guest buffers, from as many elements as fit, is
+ * handed to the port in one call.  The elements it consumed completely are
+ * returned to the guest together, with a single notification; the one it
+ * stopped in is kept in port->elem as usual, and the ones after that are
+ * put back in the ring.
+ */
+static void do_flush_queued_data_iov(VirtIOSerialPort *port, VirtQueue *vq,
+                                     VirtIODevice *vdev)
+{
+    VirtIOSerialPortClass *vsc = VIRTIO_SERIAL_PORT_GET_CLASS(port);
+    VirtQueueElement *elems[VIRTIO_SERIAL_BATCH_IOV];
+    struct iovec iov[VIRTIO_SERIAL_BATCH_IOV];
+    unsigned int nelems, niov, pushed, total = 0;
+    unsigned int first_idx, i, j;
+    uint64_t first_offset, offset;
+    size_t size, left;
+    ssize_t ret;
+
+    while (!port->throttled) {
+        nelems = niov = 0;
+        first_idx = 0;
+        first_offset = 0;
+
+        /* Resume a previous element left off mid-way first */
+        if (port->elem) {
+            first_idx = port->iov_idx;
+            first_offset = port->iov_offset;
+            elems[nelems++] = port->elem;
+            port->elem = NULL;
+        }
+        for (;;) {
+            VirtQueueElement *elem;
+
+            if (nelems) {
+                elem = elems[nelems - 1];
+                j = nelems == 1 ? first_idx : 0;
+                for (; j < elem->out_num && niov < VIRTIO_SERIAL_BATCH_IOV;
+                     j++) {
+                    iov[niov] = elem->out_sg[j];
+                    if (nelems == 1 && j == first_idx) {
+                        iov[niov].iov_base += first_offset;
+                        iov[niov].iov_len -= first_offset;
+                    }
+                    niov++;
+                }
+            }
+            if (niov == VIRTIO_SERIAL_BATCH_IOV ||
+                nelems == VIRTIO_SERIAL_BATCH_IOV) {
+                break;
+            }
+            elem = virtqueue_pop(vq, sizeof(VirtQueueElement));
+            if (!elem) {
+                break;
+            }
+            if (nelems && niov + elem->out_num > VIRTIO_SERIAL_BATCH_IOV) {
+                /* leave it for the next batch */
+                virtqueue_discard(vq, elem);
+                g_free(elem);
+                break;
+            }
+            elems[nelems++] = elem;
+        }
+        if (!nelems) {
+            break;
+        }
+
+        size = iov_size(iov, niov);
+        ret = size ? vsc->have_data_iov(port, iov, niov) : 0;
+        if (ret < 0 && ret != -EAGAIN) {
+            /* We don't handle any other type of errors here */
+            abort();
+        }
+        if (ret < 0) {
+            ret = 0;
+        }
+
+        /* Walk the elements over the data the port took */
+        left = ret;
+        pushed = 0;
+        for (i = 0; i < nelems; i++) {
+            VirtQueueElement *elem = elems[i];
+
+            j = i ? 0 : first_idx;
+            offset = i ? 0 : first_offset;
+            for (; j < elem->out_num; j++) {
+                if (left < elem->out_sg[j].iov_len - offset) {
+                    offset += left;
+                    left = 0;
+                    break;
+                }
+                left -= elem->out_sg[j].iov_len - offset;
+                offset = 0;
+            }
+            if (j < elem->out_num) {
+                break;
+            }
+            virtqueue_fill(vq, elem, 0, pushed++);
+            g_free(elem);
+        }
+
+        if (i < nelems) {
+            /*
+             * The port stopped in elems[i], or the batch ended in it.
+             * Put back the elements after it, last one first.
+             */
+            unsigned int k;
+
+            for (k = nelems - 1; k > i; k--) {
+                virtqueue_discard(vq, elems[k]);
+                g_free(elems[k]);
+            }
+            if (ret < size && !vsc->is_console) {
+                /* See do_flush_queued_data() */
+                virtio_serial_throttle_port(port, true);
+            }
+            if (ret < size && !port->throttled) {
+                /* a console that can't throttle drops the rest */
+                virtqueue_fill(vq, elems[i], 0, pushed++);
+                g_free(elems[i]);
+            } else {
+                port->elem = elems[i];
+                port->iov_idx = j;
+                port->iov_offset = offset;
+            }
+        }
+        virtqueue_flush(vq, pushed);
+        total += pushed;
+    }
+    if (total) {
+        virtio_notify(vdev, vq);
     }
-    virtio_notify(vdev, vq);
 }
 
 static void do_flush_queued_data(VirtIOSerialPort *port, VirtQueue *vq,
@@ -139,26 +289,31 @@ static void do_flush_queued_data(VirtIOSerialPort *port, VirtQueue *vq,
     assert(virtio_queue_ready(vq));
 
     vsc = VIRTIO_SERIAL_PORT_GET_CLASS(port);
+    if (vsc->have_data_iov) {
+        do_flush_queued_data_iov(port, vq, vdev);
+        return;
+    }
 
     while (!port->throttled) {
         unsigned int i;
 
         /* Pop an elem only if we haven't left off a previous one mid-way */
-        if (!port->elem.out_num) {
-            if (!virtqueue_pop(vq, &port->elem)) {
+        if (!port->elem) {
+            port->elem = virtqueue_pop(vq, sizeof(VirtQueueElement));
+            if (!port->elem) {
                 break;
             }
             port->iov_idx = 0;
             port->iov_offset = 0;
         }
 
-        for (i = port->iov_idx; i < port->elem.out_num; i++) {
+        for (i = port->iov_idx; i < port->elem->out_num; i++) {
             size_t buf_size;
             ssize_t ret;
 
-            buf_size = port->elem.out_sg[i].iov_len - port->iov_offset;
+            buf_size = port->elem->out_sg[i].iov_len - port->iov_offset;
             ret = vsc->have_data(port,
-                                  port->elem.out_sg[i].iov_base
+                                  port->elem->out_sg[i].iov_base
                                   + port->iov_offset,
                                   buf_size);
             if (ret < 0 && ret != -EAGAIN) {
@@ -167,13 +322,15 @@ static void do_flush_queued_data(VirtIOSerialPort *port, VirtQueue *vq,
             }
             if (ret == -EAGAIN || (ret >= 0 && ret < buf_size)) {
 		/*
-                 * this is a temporary check until chardevs can signal to
-                 * frontends that they are writable again. This prevents
+                 * this is a temporary check until all chardevs can signal
+                 * to frontends that they are writable again. This prevents
                  * the console from going into throttled mode (forever)
                  * if virtio-console is connected to a pty without a
-                 * listener. Otherwise the guest spins forever.
+                 * listener. Otherwise the guest spins forever.  Consoles
+                 * on backends that do signal throttle themselves in
+                 * have_data.
                  * We can revert this if
-                 * 1: chardevs can notify frondends
+                 * 1: all chardevs can notify frondends
                  * 2: the guest driver does not spin in these cases
                  */
                 if (!vsc->is_console) {
@@ -190,8 +347,9 @@ static void do_flush_queued_data(VirtIOSerialPort *port, VirtQueue *vq,
         if (port->throttled) {
             break;
         }
-        virtqueue_push(vq, &port->elem, 0);
-        port->elem.out_num = 0;
+        virtqueue_push(vq, port->elem, 0);
+        g_free(port->elem);
+        port->elem = NULL;
     }
     virtio_notify(vdev, vq);
 }
@@ -208,7 +366,7 @@ static void flush_queued_data(VirtIOSerialPort *port)
 
 static size_t send_control_msg(VirtIOSerialPort *port, void *buf, size_t len)
 {
-    VirtQueueElement elem;
+    VirtQueueElement *elem;
     VirtQueue *vq;
     struct virtio_console_control *cpkt;
 
@@ -216,15 +374,17 @@ static size_t send_control_msg(VirtIOSerialPort *port, void *buf, size_t len)
     if (!virtio_queue_ready(vq)) {
         return 0;
     }
-    if (!virtqueue_pop(vq, &elem)) {
+    elem = virtqueue_pop(vq, sizeof(VirtQueueElement));
+    if (!elem) {
         return 0;
     }
 
     cpkt = (struct virtio_console_control *)buf;
     stl_p(&cpkt->id, port->id);
-    memcpy(elem.in_sg[0].iov_base, buf, len);
+    memcpy(elem->in_sg[0].iov_base, buf, len);
 
-    virtqueue_push(vq, &elem, len);
+    virtqueue_push(vq, elem, len);
+    g_free(elem);
     virtio_notify(&port->vser->vdev, vq);
     return len;
 }
@@ -297,6 +457,9 @@ size_t virtio_serial_guest_ready(VirtIOSerialPort *port)
         return 0;
     }
 
+    if (virtqueue_avail_bytes(vq, VIRTIO_SERIAL_GUEST_READY_MAX, 0)) {
+        return VIRTIO_SERIAL_GUEST_READY_MAX;
+    }
     if (virtqueue_avail_bytes(vq, 4096, 0)) {
         return 4096;
     }
@@ -444,7 +607,7 @@ static void control_in(VirtIODevice *vdev, VirtQueue *vq)
 
 static void control_out(VirtIODevice *vdev, VirtQueue *vq)
 {
-    VirtQueueElement elem;
+    VirtQueueElement *elem;
     VirtIOSerial *vser;
     uint8_t *buf;
     size_t len;
@@ -453,10 +616,10 @@ static void control_out(VirtIODevice *vdev, VirtQueue *vq)
 
     len = 0;
     buf = NULL;
-    while (virtqueue_pop(vq, &elem)) {
+    while ((elem = virtqueue_pop(vq, sizeof(VirtQueueElement)))) {
         size_t cur_len;
 
-        cur_len = iov_size(elem.out_sg, elem.out_num);
+        cur_len = iov_size(elem->out_sg, elem->out_num);
         /*
          * Allocate a new buf only if we didn't have one previously or
          * if the size of the buf differs
@@ -467,10 +630,11 @@ static void control_out(VirtIODevice *vdev, VirtQueue *vq)
             buf = g_malloc(cur_len);
             len = cur_len;
         }
-        iov_to_buf(elem.out_sg, elem.out_num, 0, buf, cur_len);
+        iov_to_buf(elem->out_sg, elem->out_num, 0, buf, cur_len);
 
         handle_control_message(vser, buf, cur_len);
-        virtqueue_push(vq, &elem, 0);
+        virtqueue_push(vq, elem, 0);
+        g_free(elem);
     }
     g_free(buf);
     virtio_notify(vdev, vq);
@@ -617,7 +781,7 @@ static void virtio_serial_save(QEMUFile *f, void *opaque)
         qemu_put_byte(f, port->host_connected);
 
 	elem_popped = 0;
-        if (port->elem.out_num) {
+        if (port->elem) {
             elem_popped = 1;
         }
         qemu_put_be32s(f, &elem_popped);
@@ -625,8 +789,7 @@ static void virtio_serial_save(QEMUFile *f, void *opaque)
             qemu_put_be32s(f, &port->iov_idx);
             qemu_put_be64s(f, &port->iov_offset);
 
-            qemu_put_buffer(f, (unsigned char *)&port->elem,
-                            sizeof(port->elem));
+            qemu_put_virtqueue_element(f, port->elem);
         }
     }
 }
@@ -708,12 +871,8 @@ static int virtio_serial_load(QEMUFile *f, void *opaque, int version_id)
                 qemu_get_be32s(f, &port->iov_idx);
                 qemu_get_be64s(f, &port->iov_offset);
 
-                qemu_get_buffer(f, (unsigned char *)&port->elem,
-                                sizeof(port->elem));
-                virtqueue_map_sg(port->elem.in_sg, port->elem.in_addr,
-                                 port->elem.in_num, 1);
-                virtqueue_map_sg(port->elem.out_sg, port->elem.out_addr,
-                                 port->elem.out_num, 1);
+                port->elem = qemu_get_virtqueue_element(f,
+                                                  sizeof(VirtQueueElement));
 
                 /*
                  *  Port was throttled on source machine.  Let's
@@ -861,7 +1020,7 @@ static int virtser_port_qdev_init(DeviceState *qdev)
         return ret;
     }
 
-    port->elem.out_num = 0;
+    port->elem = NULL;
 
     QTAILQ_INSERT_TAIL(&port->vser->ports, port, next);
     port->ivq = port->vser->ivqs[port->id];
@@ -886,6 +1045,13 @@ static int virtser_port_qdev_exit(DeviceState *qdev)
 
     QTAILQ_REMOVE(&vser->ports, port, next);
 
+    if (port->elem) {
+        virtqueue_push(port->ovq, port->elem, 0);
+        virtio_notify(&vser->vdev, port->ovq);
+        g_free(port->elem);
+        port->elem = NULL;
+    }
+
     if (vsc->exit) {
         vsc->exit(port);
     }
@@ -107,6 +107,14 @@ typedef struct VirtIOSerialPortClass {
      */
     ssize_t (*have_data)(VirtIOSerialPort *port, const uint8_t *buf,
                          size_t len);
+
+    /*
+     * Optional: the same as have_data, for the data of several guest
+     * buffers at once.  When set it is used instead of have_data, so
+     * that a port can hand a whole batch to its backend in one call.
+     */
+    ssize_t (*have_data_iov)(VirtIOSerialPort *port, const struct iovec *iov,
+                             int iovcnt);
 } VirtIOSerialPortClass;
 
 /*
@@ -151,7 +159,7 @@ struct VirtIOSerialPort {
      * element popped and continue consuming it once the backend
      * becomes writable again.
      */
-    VirtQueueElement elem;
+    VirtQueueElement *elem;
 
     /*
      * The index and the offset into the iov buffer that was popped in
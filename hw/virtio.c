@@ -17,6 +17,7 @@
 #include "qemu-error.h"
 #include "virtio.h"
 #include "qemu-barrier.h"
+#include "exec-memory.h"
 
 /* The alignment to use between consumer and producer parts of vring.
  * x86 pagesize again. */
@@ -58,11 +59,29 @@ typedef struct VRing
     target_phys_addr_t used;
 } VRing;
 
+/* A part of the vring that is backed by guest RAM, accessed directly */
+typedef struct VRingMap
+{
+    void *host;
+    MemoryRegion *mr;
+    target_phys_addr_t offset;
+} VRingMap;
+
 struct VirtQueue
 {
     VRing vring;
+    VRingMap desc_map;
+    VRingMap avail_map;
+    VRingMap used_map;
+    /* the maps above are up to date, though parts may still be unmapped */
+    bool mapped;
     target_phys_addr_t pa;
     uint16_t last_avail_idx;
+    /* Last avail index read from the guest; entries up to it can be
+     * popped without looking at the avail ring's index again. */
+    uint16_t shadow_avail_idx;
+    /* Our copy of the used index, only the device writes it */
+    uint16_t used_idx;
     /* Last used index value we have signalled on */
     uint16_t signalled_used;
 
@@ -81,6 +100,8 @@ struct VirtQueue
     EventNotifier host_notifier;
 };
 
+static void virtqueue_sync_indices(VirtQueue *vq);
+
 /* virt queue functions */
 static void virtqueue_init(VirtQueue *vq)
 {
@@ -91,55 +112,154 @@ static void virtqueue_init(VirtQueue *vq)
     vq->vring.used = vring_align(vq->vring.avail +
                                  offsetof(VRingAvail, ring[vq->vring.num]),
                                  VIRTIO_PCI_VRING_ALIGN);
+    vq->mapped = false;
+    virtqueue_sync_indices(vq);
 }
 
-static inline uint64_t vring_desc_addr(target_phys_addr_t desc_pa, int i)
+static void vring_map_part(VRingMap *map, target_phys_addr_t pa,
+                           target_phys_addr_t len, bool is_write)
+{
+    MemoryRegionSection section;
+
+    map->host = NULL;
+    if (!pa) {
+        return;
+    }
+
+    section = memory_region_find(get_system_memory(), pa, len);
+    if (section.size < len || !memory_region_is_ram(section.mr)) {
+        return;
+    }
+    if (is_write && (section.readonly || memory_region_is_rom(section.mr))) {
+        return;
+    }
+    map->mr = section.mr;
+    map->offset = section.offset_within_region;
+    map->host = memory_region_get_ram_ptr(section.mr) +
+                section.offset_within_region;
+}
+
+/* Look the rings up once instead of on every access.  Each part is
+ * mapped separately since the guest may place them in different RAM
+ * regions; a part that is not entirely in RAM stays on the slow path.
+ */
+static void virtqueue_map_rings(VirtQueue *vq)
+{
+    unsigned int num = vq->vring.num;
+
+    vring_map_part(&vq->desc_map, vq->vring.desc,
+                   num * sizeof(VRingDesc), false);
+    /* avail ring plus used_event */
+    vring_map_part(&vq->avail_map, vq->vring.avail,
+                   offsetof(VRingAvail, ring[num + 1]), false);
+    /* used ring plus avail_event */
+    vring_map_part(&vq->used_map, vq->vring.used,
+                   offsetof(VRingUsed, ring[num]) + sizeof(uint16_t), true);
+    vq->mapped = true;
+}
+
+/* Return a host pointer to @offset in a ring the queue has mapped, or NULL
+ * if that part is not in RAM and has to go through the slow path.  The
+ * rings are mapped on first use after virtqueue_init() or a change to the
+ * memory map.
+ */
+static inline void *vring_map_ptr(VirtQueue *vq, VRingMap *map,
+                                  target_phys_addr_t offset)
+{
+    if (unlikely(!vq->mapped)) {
+        virtqueue_map_rings(vq);
+    }
+    return map->host ? map->host + offset : NULL;
+}
+
+/* Only the queue's own descriptor table is mapped; indirect tables are
+ * looked up every time.
+ */
+static inline void *vring_desc_ptr(VirtQueue *vq, target_phys_addr_t desc_pa,
+                                   unsigned int i, size_t field)
+{
+    if (desc_pa != vq->vring.desc || i >= vq->vring.num) {
+        return NULL;
+    }
+    return vring_map_ptr(vq, &vq->desc_map, sizeof(VRingDesc) * i + field);
+}
+
+static inline uint64_t vring_desc_addr(VirtQueue *vq,
+                                       target_phys_addr_t desc_pa, int i)
 {
     target_phys_addr_t pa;
+    void *p = vring_desc_ptr(vq, desc_pa, i, offsetof(VRingDesc, addr));
+
+    if (p) {
+        return ldq_p(p);
+    }
     pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, addr);
     return ldq_phys(pa);
 }
 
-static inline uint32_t vring_desc_len(target_phys_addr_t desc_pa, int i)
+static inline uint32_t vring_desc_len(VirtQueue *vq,
+                                      target_phys_addr_t desc_pa, int i)
 {
     target_phys_addr_t pa;
+    void *p = vring_desc_ptr(vq, desc_pa, i, offsetof(VRingDesc, len));
+
+    if (p) {
+        return ldl_p(p);
+    }
     pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, len);
     return ldl_phys(pa);
 }
 
-static inline uint16_t vring_desc_flags(target_phys_addr_t desc_pa, int i)
+static inline uint16_t vring_desc_flags(VirtQueue *vq,
+                                        target_phys_addr_t desc_pa, int i)
 {
     target_phys_addr_t pa;
+    void *p = vring_desc_ptr(vq, desc_pa, i, offsetof(VRingDesc, flags));
+
+    if (p) {
+        return lduw_p(p);
+    }
     pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, flags);
     return lduw_phys(pa);
 }
 
-static inline uint16_t vring_desc_next(target_phys_addr_t desc_pa, int i)
+static inline uint16_t vring_desc_next(VirtQueue *vq,
+                                       target_phys_addr_t desc_pa, int i)
 {
     target_phys_addr_t pa;
+    void *p = vring_desc_ptr(vq, desc_pa, i, offsetof(VRingDesc, next));
+
+    if (p) {
+        return lduw_p(p);
+    }
     pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, next);
     return lduw_phys(pa);
 }
 
+static inline uint16_t vring_avail_lduw(VirtQueue *vq,
+                                        target_phys_addr_t offset)
+{
+    void *p = vring_map_ptr(vq, &vq->avail_map, offset);
+
+    if (p) {
+        return lduw_p(p);
+    }
+    return lduw_phys(vq->vring.avail + offset);
+}
+
 static inline uint16_t vring_avail_flags(VirtQueue *vq)
 {
-    target_phys_addr_t pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, flags);
-    return lduw_phys(pa);
+    return vring_avail_lduw(vq, offsetof(VRingAvail, flags));
 }
 
 static inline uint16_t vring_avail_idx(VirtQueue *vq)
 {
-    target_phys_addr_t pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, idx);
-    return lduw_phys(pa);
+    return vring_avail_lduw(vq, offsetof(VRingAvail, idx));
 }
 
 static inline uint16_t vring_avail_ring(VirtQueue *vq, int i)
 {
-    target_phys_addr_t pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, ring[i]);
-    return lduw_phys(pa);
+    return vring_avail_lduw(vq, offsetof(VRingAvail, ring[i]));
 }
 
 static inline uint16_t vring_used_event(VirtQueue *vq)
@@ -147,56 +267,88 @@ static inline uint16_t vring_used_event(VirtQueue *vq)
     return vring_avail_ring(vq, vq->vring.num);
 }
 
+/* Stores to the used ring bypass the dirty tracking of stl_phys(), so
+ * mark the pages by hand for migration and the VGA-style clients.
+ */
+static inline void vring_used_stl(VirtQueue *vq, target_phys_addr_t offset,
+                                  uint32_t val)
+{
+    void *p = vring_map_ptr(vq, &vq->used_map, offset);
+
+    if (p) {
+        stl_p(p, val);
+        memory_region_set_dirty(vq->used_map.mr, vq->used_map.offset + offset,
+                                sizeof(val));
+    } else {
+        stl_phys(vq->vring.used + offset, val);
+    }
+}
+
+static inline void vring_used_stw(VirtQueue *vq, target_phys_addr_t offset,
+                                  uint16_t val)
+{
+    void *p = vring_map_ptr(vq, &vq->used_map, offset);
+
+    if (p) {
+        stw_p(p, val);
+        memory_region_set_dirty(vq->used_map.mr, vq->used_map.offset + offset,
+                                sizeof(val));
+    } else {
+        stw_phys(vq->vring.used + offset, val);
+    }
+}
+
+static inline uint16_t vring_used_lduw(VirtQueue *vq,
+                                       target_phys_addr_t offset)
+{
+    void *p = vring_map_ptr(vq, &vq->used_map, offset);
+
+    if (p) {
+        return lduw_p(p);
+    }
+    return lduw_phys(vq->vring.used + offset);
+}
+
 static inline void vring_used_ring_id(VirtQueue *vq, int i, uint32_t val)
 {
-    target_phys_addr_t pa;
-    pa = vq->vring.used + offsetof(VRingUsed, ring[i].id);
-    stl_phys(pa, val);
+    vring_used_stl(vq, offsetof(VRingUsed, ring[i].id), val);
 }
 
 static inline void vring_used_ring_len(VirtQueue *vq, int i, uint32_t val)
 {
-    target_phys_addr_t pa;
-    pa = vq->vring.used + offsetof(VRingUsed, ring[i].len);
-    stl_phys(pa, val);
+    vring_used_stl(vq, offsetof(VRingUsed, ring[i].len), val);
 }
 
 static uint16_t vring_used_idx(VirtQueue *vq)
 {
-    target_phys_addr_t pa;
-    pa = vq->vring.used + offsetof(VRingUsed, idx);
-    return lduw_phys(pa);
+    return vring_used_lduw(vq, offsetof(VRingUsed, idx));
 }
 
 static inline void vring_used_idx_set(VirtQueue *vq, uint16_t val)
 {
-    target_phys_addr_t pa;
-    pa = vq->vring.used + offsetof(VRingUsed, idx);
-    stw_phys(pa, val);
+    vring_used_stw(vq, offsetof(VRingUsed, idx), val);
 }
 
 static inline void vring_used_flags_set_bit(VirtQueue *vq, int mask)
 {
-    target_phys_addr_t pa;
-    pa = vq->vring.used + offsetof(VRingUsed, flags);
-    stw_phys(pa, lduw_phys(pa) | mask);
+    target_phys_addr_t offset = offsetof(VRingUsed, flags);
+
+    vring_used_stw(vq, offset, vring_used_lduw(vq, offset) | mask);
 }
 
 static inline void vring_used_flags_unset_bit(VirtQueue *vq, int mask)
 {
-    target_phys_addr_t pa;
-    pa = vq->vring.used + offsetof(VRingUsed, flags);
-    stw_phys(pa, lduw_phys(pa) & ~mask);
+    target_phys_addr_t offset = offsetof(VRingUsed, flags);
+
+    vring_used_stw(vq, offset, vring_used_lduw(vq, offset) & ~mask);
 }
 
 static inline void vring_avail_event(VirtQueue *vq, uint16_t val)
 {
-    target_phys_addr_t pa;
     if (!vq->notification) {
         return;
     }
-    pa = vq->vring.used + offsetof(VRingUsed, ring[vq->vring.num]);
-    stw_phys(pa, val);
+    vring_used_stw(vq, offsetof(VRingUsed, ring[vq->vring.num]), val);
 }
 
 void virtio_queue_set_notification(VirtQueue *vq, int enable)
@@ -222,7 +374,25 @@ int virtio_queue_ready(VirtQueue *vq)
 
 int virtio_queue_empty(VirtQueue *vq)
 {
-    return vring_avail_idx(vq) == vq->last_avail_idx;
+    if (vq->shadow_avail_idx != vq->last_avail_idx) {
+        return 0;
+    }
+    vq->shadow_avail_idx = vring_avail_idx(vq);
+    if (vq->shadow_avail_idx == vq->last_avail_idx) {
+        return 1;
+    }
+    /* virtqueue_pop() trusts the shadow index, see virtqueue_num_heads() */
+    smp_rmb();
+    return 0;
+}
+
+/* Re-read the indices from the guest, after the queue was set up or
+ * after someone else (vhost, the data plane thread) drove it.
+ */
+static void virtqueue_sync_indices(VirtQueue *vq)
+{
+    vq->shadow_avail_idx = vq->last_avail_idx;
+    vq->used_idx = vq->pa ? vring_used_idx(vq) : 0;
 }
 
 void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
@@ -249,11 +419,41 @@ void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
                                   elem->out_sg[i].iov_len,
                                   0, elem->out_sg[i].iov_len);
 
-    idx = (idx + vring_used_idx(vq)) % vq->vring.num;
+    idx = (idx + vq->used_idx) % vq->vring.num;
 
     /* Get a pointer to the next entry in the used ring. */
     vring_used_ring_id(vq, idx, elem->index);
     vring_used_ring_len(vq, idx, len);
+
+    /* elements loaded by qemu_get_virtqueue_element() were not counted */
+    if (elem->size) {
+        mem_account_free(&vq->vdev->mem_account, elem->size);
+    }
+}
+
+/* Give back an element that virtqueue_pop() returned but that was not
+ * used.  Elements must be given back in the reverse order of the pops.
+ */
+void virtqueue_discard(VirtQueue *vq, const VirtQueueElement *elem)
+{
+    int i;
+
+    trace_virtqueue_discard(vq, elem);
+
+    for (i = 0; i < elem->in_num; i++) {
+        cpu_physical_memory_unmap(elem->in_sg[i].iov_base,
+                                  elem->in_sg[i].iov_len, 1, 0);
+    }
+    for (i = 0; i < elem->out_num; i++) {
+        cpu_physical_memory_unmap(elem->out_sg[i].iov_base,
+                                  elem->out_sg[i].iov_len, 0, 0);
+    }
+    if (elem->size) {
+        mem_account_free(&vq->vdev->mem_account, elem->size);
+    }
+
+    vq->last_avail_idx--;
+    vq->inuse--;
 }
 
 void virtqueue_flush(VirtQueue *vq, unsigned int count)
@@ -262,9 +462,10 @@ void virtqueue_flush(VirtQueue *vq, unsigned int count)
     /* Make sure buffer is written before we update index. */
     smp_wmb();
     trace_virtqueue_flush(vq, count);
-    old = vring_used_idx(vq);
+    old = vq->used_idx;
     new = old + count;
     vring_used_idx_set(vq, new);
+    vq->used_idx = new;
     vq->inuse -= count;
     if (unlikely((int16_t)(new - vq->signalled_used) < (uint16_t)(new - old)))
         vq->signalled_used_valid = false;
@@ -279,12 +480,21 @@ void virtqueue_push(VirtQueue *vq, const VirtQueueElement *elem,
 
 static int virtqueue_num_heads(VirtQueue *vq, unsigned int idx)
 {
-    uint16_t num_heads = vring_avail_idx(vq) - idx;
+    uint16_t num_heads;
+
+    /* Entries before the shadow index were already ordered by the
+     * smp_rmb() below when it was read.  */
+    if (vq->shadow_avail_idx != (uint16_t)idx) {
+        return (uint16_t)(vq->shadow_avail_idx - idx);
+    }
+
+    vq->shadow_avail_idx = vring_avail_idx(vq);
+    num_heads = vq->shadow_avail_idx - idx;
 
     /* Check it isn't doing very strange things with descriptor numbers. */
     if (num_heads > vq->vring.num) {
         error_report("Guest moved used index from %u to %u",
-                     idx, vring_avail_idx(vq));
+                     idx, vq->shadow_avail_idx);
         exit(1);
     }
     /* On success, callers read a descriptor at vq->last_avail_idx.
@@ -313,17 +523,17 @@ static unsigned int virtqueue_get_head(VirtQueue *vq, unsigned int idx)
     return head;
 }
 
-static unsigned virtqueue_next_desc(target_phys_addr_t desc_pa,
+static unsigned virtqueue_next_desc(VirtQueue *vq, target_phys_addr_t desc_pa,
                                     unsigned int i, unsigned int max)
 {
     unsigned int next;
 
     /* If this descriptor says it doesn't chain, we're done. */
-    if (!(vring_desc_flags(desc_pa, i) & VRING_DESC_F_NEXT))
+    if (!(vring_desc_flags(vq, desc_pa, i) & VRING_DESC_F_NEXT))
         return max;
 
     /* Check they're not leading us off end of descriptors. */
-    next = vring_desc_next(desc_pa, i);
+    next = vring_desc_next(vq, desc_pa, i);
     /* Make sure compiler knows to grab that: we don't want it changing! */
     smp_wmb();
 
@@ -353,8 +563,8 @@ int virtqueue_avail_bytes(VirtQueue *vq, int in_bytes, int out_bytes)
         i = virtqueue_get_head(vq, idx++);
         desc_pa = vq->vring.desc;
 
-        if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_INDIRECT) {
-            if (vring_desc_len(desc_pa, i) % sizeof(VRingDesc)) {
+        if (vring_desc_flags(vq, desc_pa, i) & VRING_DESC_F_INDIRECT) {
+            if (vring_desc_len(vq, desc_pa, i) % sizeof(VRingDesc)) {
                 error_report("Invalid size for indirect buffer table");
                 exit(1);
             }
@@ -367,9 +577,9 @@ int virtqueue_avail_bytes(VirtQueue *vq, int in_bytes, int out_bytes)
 
             /* loop over the indirect descriptor table */
             indirect = 1;
-            max = vring_desc_len(desc_pa, i) / sizeof(VRingDesc);
+            max = vring_desc_len(vq, desc_pa, i) / sizeof(VRingDesc);
             num_bufs = i = 0;
-            desc_pa = vring_desc_addr(desc_pa, i);
+            desc_pa = vring_desc_addr(vq, desc_pa, i);
         }
 
         do {
@@ -379,16 +589,16 @@ int virtqueue_avail_bytes(VirtQueue *vq, int in_bytes, int out_bytes)
                 exit(1);
             }
 
-            if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_WRITE) {
+            if (vring_desc_flags(vq, desc_pa, i) & VRING_DESC_F_WRITE) {
                 if (in_bytes > 0 &&
-                    (in_total += vring_desc_len(desc_pa, i)) >= in_bytes)
+                    (in_total += vring_desc_len(vq, desc_pa, i)) >= in_bytes)
                     return 1;
             } else {
                 if (out_bytes > 0 &&
-                    (out_total += vring_desc_len(desc_pa, i)) >= out_bytes)
+                    (out_total += vring_desc_len(vq, desc_pa, i)) >= out_bytes)
                     return 1;
             }
-        } while ((i = virtqueue_next_desc(desc_pa, i, max)) != max);
+        } while ((i = virtqueue_next_desc(vq, desc_pa, i, max)) != max);
 
         if (!indirect)
             total_bufs = num_bufs;
@@ -415,16 +625,49 @@ void virtqueue_map_sg(struct iovec *sg, target_phys_addr_t *addr,
     }
 }
 
-int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
+/* Allocate an element of @sz bytes (the device's request structure,
+ * which starts with the VirtQueueElement) followed by its arrays.
+ */
+void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_num)
+{
+    VirtQueueElement *elem;
+    size_t in_addr_ofs = QEMU_ALIGN_UP(sz, __alignof__(elem->in_addr[0]));
+    size_t out_addr_ofs = in_addr_ofs + in_num * sizeof(elem->in_addr[0]);
+    size_t out_addr_end = out_addr_ofs + out_num * sizeof(elem->out_addr[0]);
+    size_t in_sg_ofs = QEMU_ALIGN_UP(out_addr_end, __alignof__(elem->in_sg[0]));
+    size_t out_sg_ofs = in_sg_ofs + in_num * sizeof(elem->in_sg[0]);
+    size_t out_sg_end = out_sg_ofs + out_num * sizeof(elem->out_sg[0]);
+
+    assert(sz >= sizeof(VirtQueueElement));
+    elem = g_malloc(out_sg_end);
+    elem->size = 0;
+    elem->out_num = out_num;
+    elem->in_num = in_num;
+    elem->in_addr = (void *)elem + in_addr_ofs;
+    elem->out_addr = (void *)elem + out_addr_ofs;
+    elem->in_sg = (void *)elem + in_sg_ofs;
+    elem->out_sg = (void *)elem + out_sg_ofs;
+    return elem;
+}
+
+/* Take the next available descriptor chain off the queue.  Returns NULL
+ * if there is none, otherwise a block of @sz bytes as described for
+ * virtqueue_alloc_element(); the rest of the request is uninitialized.
+ */
+void *virtqueue_pop(VirtQueue *vq, size_t sz)
 {
     unsigned int i, head, max;
     target_phys_addr_t desc_pa = vq->vring.desc;
+    unsigned int out_num, in_num;
+    target_phys_addr_t addr[VIRTQUEUE_MAX_SIZE];
+    struct iovec iov[VIRTQUEUE_MAX_SIZE];
+    VirtQueueElement *elem;
 
     if (!virtqueue_num_heads(vq, vq->last_avail_idx))
-        return 0;
+        return NULL;
 
     /* When we start there are none of either input nor output. */
-    elem->out_num = elem->in_num = 0;
+    out_num = in_num = 0;
 
     max = vq->vring.num;
 
@@ -433,57 +676,128 @@ int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
         vring_avail_event(vq, vring_avail_idx(vq));
     }
 
-    if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_INDIRECT) {
-        if (vring_desc_len(desc_pa, i) % sizeof(VRingDesc)) {
+    if (vring_desc_flags(vq, desc_pa, i) & VRING_DESC_F_INDIRECT) {
+        if (vring_desc_len(vq, desc_pa, i) % sizeof(VRingDesc)) {
             error_report("Invalid size for indirect buffer table");
             exit(1);
         }
 
         /* loop over the indirect descriptor table */
-        max = vring_desc_len(desc_pa, i) / sizeof(VRingDesc);
-        desc_pa = vring_desc_addr(desc_pa, i);
+        max = vring_desc_len(vq, desc_pa, i) / sizeof(VRingDesc);
+        desc_pa = vring_desc_addr(vq, desc_pa, i);
         i = 0;
     }
 
-    /* Collect all the descriptors */
+    /* Collect all the descriptors on the stack: readable ones from the
+       start of the arrays, writable ones from the end.  */
     do {
-        struct iovec *sg;
+        unsigned int n;
 
-        if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_WRITE) {
-            if (elem->in_num >= ARRAY_SIZE(elem->in_sg)) {
+        if (vring_desc_flags(vq, desc_pa, i) & VRING_DESC_F_WRITE) {
+            if (out_num + in_num >= VIRTQUEUE_MAX_SIZE) {
                 error_report("Too many write descriptors in indirect table");
                 exit(1);
             }
-            elem->in_addr[elem->in_num] = vring_desc_addr(desc_pa, i);
-            sg = &elem->in_sg[elem->in_num++];
+            n = VIRTQUEUE_MAX_SIZE - 1 - in_num++;
         } else {
-            if (elem->out_num >= ARRAY_SIZE(elem->out_sg)) {
+            if (out_num + in_num >= VIRTQUEUE_MAX_SIZE) {
                 error_report("Too many read descriptors in indirect table");
                 exit(1);
             }
-            elem->out_addr[elem->out_num] = vring_desc_addr(desc_pa, i);
-            sg = &elem->out_sg[elem->out_num++];
+            n = out_num++;
         }
-
-        sg->iov_len = vring_desc_len(desc_pa, i);
+        addr[n] = vring_desc_addr(vq, desc_pa, i);
+        iov[n].iov_len = vring_desc_len(vq, desc_pa, i);
 
         /* If we've got too many, that implies a descriptor loop. */
-        if ((elem->in_num + elem->out_num) > max) {
+        if ((in_num + out_num) > max) {
             error_report("Looped descriptor");
             exit(1);
         }
-    } while ((i = virtqueue_next_desc(desc_pa, i, max)) != max);
+    } while ((i = virtqueue_next_desc(vq, desc_pa, i, max)) != max);
+
+    /* Now copy what we have collected into an element of the right size */
+    elem = virtqueue_alloc_element(sz, out_num, in_num);
+    elem->index = head;
+    for (i = 0; i < out_num; i++) {
+        elem->out_addr[i] = addr[i];
+        elem->out_sg[i] = iov[i];
+    }
+    for (i = 0; i < in_num; i++) {
+        elem->in_addr[i] = addr[VIRTQUEUE_MAX_SIZE - 1 - i];
+        elem->in_sg[i] = iov[VIRTQUEUE_MAX_SIZE - 1 - i];
+    }
 
-    /* Now map what we have collected */
     virtqueue_map_sg(elem->in_sg, elem->in_addr, elem->in_num, 1);
     virtqueue_map_sg(elem->out_sg, elem->out_addr, elem->out_num, 0);
 
-    elem->index = head;
-
     vq->inuse++;
+    elem->size = (void *)&elem->out_sg[out_num] - (void *)elem;
+    mem_account_alloc(&vq->vdev->mem_account, elem->size);
 
     trace_virtqueue_pop(vq, elem, elem->in_num, elem->out_num);
-    return elem->in_num + elem->out_num;
+    return elem;
+}
+
+/* Devices migrate in-flight elements in the layout VirtQueueElement had
+ * when its arrays were of fixed size.
+ */
+typedef struct VirtQueueElementOld {
+    unsigned int index;
+    unsigned int out_num;
+    unsigned int in_num;
+    target_phys_addr_t in_addr[VIRTQUEUE_MAX_SIZE];
+    target_phys_addr_t out_addr[VIRTQUEUE_MAX_SIZE];
+    struct iovec in_sg[VIRTQUEUE_MAX_SIZE];
+    struct iovec out_sg[VIRTQUEUE_MAX_SIZE];
+} VirtQueueElementOld;
+
+/* Read back an element saved by qemu_put_virtqueue_element() into a
+ * newly allocated block of @sz bytes, and map its buffers again.
+ */
+void *qemu_get_virtqueue_element(QEMUFile *f, size_t sz)
+{
+    VirtQueueElementOld *data = g_new(VirtQueueElementOld, 1);
+    VirtQueueElement *elem;
+    unsigned int i;
+
+    qemu_get_buffer(f, (uint8_t *)data, sizeof(*data));
+    assert(data->in_num <= VIRTQUEUE_MAX_SIZE);
+    assert(data->out_num <= VIRTQUEUE_MAX_SIZE);
+
+    elem = virtqueue_alloc_element(sz, data->out_num, data->in_num);
+    elem->index = data->index;
+    for (i = 0; i < elem->in_num; i++) {
+        elem->in_addr[i] = data->in_addr[i];
+        elem->in_sg[i].iov_len = data->in_sg[i].iov_len;
+    }
+    for (i = 0; i < elem->out_num; i++) {
+        elem->out_addr[i] = data->out_addr[i];
+        elem->out_sg[i].iov_len = data->out_sg[i].iov_len;
+    }
+    g_free(data);
+
+    virtqueue_map_sg(elem->in_sg, elem->in_addr, elem->in_num, 1);
+    virtqueue_map_sg(elem->out_sg, elem->out_addr, elem->out_num, 0);
+    return elem;
+}
+
+void qemu_put_virtqueue_element(QEMUFile *f, VirtQueueElement *elem)
+{
+    VirtQueueElementOld *data = g_new0(VirtQueueElementOld, 1);
+
+    data->index = elem->index;
+    data->in_num = elem->in_num;
+    data->out_num = elem->out_num;
+    memcpy(data->in_addr, elem->in_addr,
+           elem->in_num * sizeof(elem->in_addr[0]));
+    memcpy(data->out_addr, elem->out_addr,
+           elem->out_num * sizeof(elem->out_addr[0]));
+    memcpy(data->in_sg, elem->in_sg, elem->in_num * sizeof(elem->in_sg[0]));
+    memcpy(data->out_sg, elem->out_sg,
+           elem->out_num * sizeof(elem->out_sg[0]));
+    qemu_put_buffer(f, (uint8_t *)data, sizeof(*data));
+    g_free(data);
 }
 
 /* virtio device */
@@ -530,7 +844,10 @@ void virtio_reset(void *opaque)
         vdev->vq[i].vring.desc = 0;
         vdev->vq[i].vring.avail = 0;
         vdev->vq[i].vring.used = 0;
+        vdev->vq[i].mapped = false;
         vdev->vq[i].last_avail_idx = 0;
+        vdev->vq[i].shadow_avail_idx = 0;
+        vdev->vq[i].used_idx = 0;
         vdev->vq[i].pa = 0;
         vdev->vq[i].vector = VIRTIO_NO_VECTOR;
         vdev->vq[i].signalled_used = 0;
@@ -685,6 +1002,21 @@ VirtQueue *virtio_add_queue(VirtIODevice *vdev, int queue_size,
     return &vdev->vq[i];
 }
 
+void virtio_del_queue(VirtIODevice *vdev, int n)
+{
+    if (n < 0 || n >= VIRTIO_PCI_QUEUE_MAX) {
+        abort();
+    }
+
+    vdev->vq[n].vring.num = 0;
+    vdev->vq[n].mapped = false;
+}
+
+int virtio_get_queue_index(VirtQueue *vq)
+{
+    return vq - &vq->vdev->vq[0];
+}
+
 void virtio_irq(VirtQueue *vq)
 {
     trace_virtio_irq(vq);
@@ -724,7 +1056,7 @@ static bool vring_notify(VirtIODevice *vdev, VirtQueue *vq)
     v = vq->signalled_used_valid;
     vq->signalled_used_valid = true;
     old = vq->signalled_used;
-    new = vq->signalled_used = vring_used_idx(vq);
+    new = vq->signalled_used = vq->used_idx;
     return !v || vring_need_event(vring_used_event(vq), new, old);
 }
 
@@ -862,7 +1194,9 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f)
 
 void virtio_cleanup(VirtIODevice *vdev)
 {
+    memory_listener_unregister(&vdev->memory_listener);
     qemu_del_vm_change_state_handler(vdev->vmstate);
+    mem_account_unregister(&vdev->mem_account);
     g_free(vdev->config);
     g_free(vdev->vq);
     g_free(vdev);
@@ -887,6 +1221,52 @@ static void virtio_vmstate_change(void *opaque, int running, RunState state)
     }
 }
 
+/* Any change may move or remove the RAM behind the rings, so remap them
+ * lazily on the next access.
+ */
+static void virtio_listener_begin(MemoryListener *listener)
+{
+    VirtIODevice *vdev = container_of(listener, VirtIODevice,
+                                      memory_listener);
+    int i;
+
+    for (i = 0; i < VIRTIO_PCI_QUEUE_MAX; i++) {
+        vdev->vq[i].mapped = false;
+    }
+}
+
+static void virtio_listener_dummy(MemoryListener *listener)
+{
+}
+
+static void virtio_listener_section_dummy(MemoryListener *listener,
+                                          MemoryRegionSection *section)
+{
+}
+
+static void virtio_listener_eventfd_dummy(MemoryListener *listener,
+                                          MemoryRegionSection *section,
+                                          bool match_data, uint64_t data,
+                                          EventNotifier *e)
+{
+}
+
+static const MemoryListener virtio_memory_listener = {
+    .begin = virtio_listener_begin,
+    .commit = virtio_listener_dummy,
+    .region_add = virtio_listener_section_dummy,
+    .region_del = virtio_listener_section_dummy,
+    .region_nop = virtio_listener_section_dummy,
+    .log_start = virtio_listener_section_dummy,
+    .log_stop = virtio_listener_section_dummy,
+    .log_sync = virtio_listener_section_dummy,
+    .log_global_start = virtio_listener_dummy,
+    .log_global_stop = virtio_listener_dummy,
+    .eventfd_add = virtio_listener_eventfd_dummy,
+    .eventfd_del = virtio_listener_eventfd_dummy,
+    .priority = 10,
+};
+
 VirtIODevice *virtio_common_init(const char *name, uint16_t device_id,
                                  size_t config_size, size_t struct_size)
 {
@@ -916,14 +1296,28 @@ VirtIODevice *virtio_common_init(const char *name, uint16_t device_id,
 
     vdev->vmstate = qemu_add_vm_change_state_handler(virtio_vmstate_change, vdev);
 
+    vdev->memory_listener = virtio_memory_listener;
+    memory_listener_register(&vdev->memory_listener, get_system_memory());
+
+    mem_account_alloc(&vdev->mem_account, struct_size);
+    mem_account_alloc(&vdev->mem_account,
+                      sizeof(VirtQueue) * VIRTIO_PCI_QUEUE_MAX);
+    if (config_size) {
+        mem_account_alloc(&vdev->mem_account, config_size);
+    }
     return vdev;
 }
 
 void virtio_bind_device(VirtIODevice *vdev, const VirtIOBindings *binding,
                         void *opaque)
 {
+    DeviceState *dev = DEVICE(opaque);
+
     vdev->binding = binding;
     vdev->binding_opaque = opaque;
+    /* the transport is the device users know, by id or else by type */
+    mem_account_register(&vdev->mem_account, "virtio",
+                         dev->id ? dev->id : object_get_typename(OBJECT(dev)));
 }
 
 target_phys_addr_t virtio_queue_get_desc_addr(VirtIODevice *vdev, int n)
@@ -977,6 +1371,7 @@ uint16_t virtio_queue_get_last_avail_idx(VirtIODevice *vdev, int n)
 void virtio_queue_set_last_avail_idx(VirtIODevice *vdev, int n, uint16_t idx)
 {
     vdev->vq[n].last_avail_idx = idx;
+    virtqueue_sync_indices(&vdev->vq[n]);
 }
 
 VirtQueue *virtio_get_queue(VirtIODevice *vdev, int n)
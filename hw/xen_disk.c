@@ -52,6 +52,17 @@ static int max_requests = 32;
 #define BLOCK_SIZE  512
 #define IOCB_COUNT  (BLKIF_MAX_SEGMENTS_PER_REQUEST + 2)
 
+/* enough persistent grants for all the segments of max_requests requests */
+#define MAX_PERSISTENT_GRANTS(max_req) \
+    ((max_req) * BLKIF_MAX_SEGMENTS_PER_REQUEST)
+
+struct PersistentGrant {
+    void                *page;
+    struct XenBlkDev    *blkdev;
+};
+
+typedef struct PersistentGrant PersistentGrant;
+
 struct ioreq {
     blkif_request_t     req;
     int16_t             status;
@@ -69,6 +80,7 @@ struct ioreq {
     int                 prot;
     void                *page[BLKIF_MAX_SEGMENTS_PER_REQUEST];
     void                *pages;
+    int                 num_unmap;  /* the first pages are not persistent */
 
     /* aio status */
     int                 aio_inflight;
@@ -97,6 +109,16 @@ struct XenBlkDev {
     int                 more_work;
     int                 cnt_map;
 
+    /* grants kept mapped across requests, by grant reference */
+    bool                feature_persistent;
+    GTree               *persistent_gnts;
+    unsigned int        persistent_gnt_count;
+    unsigned int        max_grants;
+
+    /* plain writes pulled from the ring, submitted together */
+    BlockRequest        *blkreq;
+    int                 num_writes;
+
     /* request lists */
     QLIST_HEAD(inflight_head, ioreq) inflight;
     QLIST_HEAD(finished_head, ioreq) finished;
@@ -237,26 +259,52 @@ err:
     return -1;
 }
 
+static gint int_cmp(gconstpointer a, gconstpointer b, gpointer user_data)
+{
+    guint ua = GPOINTER_TO_UINT(a);
+    guint ub = GPOINTER_TO_UINT(b);
+    return (ua > ub) - (ua < ub);
+}
+
+static void destroy_grant(gpointer pgnt)
+{
+    PersistentGrant *grant = pgnt;
+    XenGnttab gnt = grant->blkdev->xendev.gnttabdev;
+
+    if (xc_gnttab_munmap(gnt, grant->page, 1) != 0) {
+        xen_be_printf(&grant->blkdev->xendev, 0,
+                      "xc_gnttab_munmap failed: %s\n",
+                      strerror(errno));
+    }
+    grant->blkdev->persistent_gnt_count--;
+    grant->blkdev->cnt_map--;
+    xen_be_printf(&grant->blkdev->xendev, 3,
+                  "unmapped grant %p\n", grant->page);
+    g_free(grant);
+}
+
 static void ioreq_unmap(struct ioreq *ioreq)
 {
     XenGnttab gnt = ioreq->blkdev->xendev.gnttabdev;
     int i;
 
-    if (ioreq->v.niov == 0 || ioreq->mapped == 0) {
+    if (ioreq->mapped == 0) {
         return;
     }
-    if (batch_maps) {
+    if (ioreq->num_unmap == 0) {
+        /* all the grants are persistent */
+    } else if (batch_maps) {
         if (!ioreq->pages) {
             return;
         }
-        if (xc_gnttab_munmap(gnt, ioreq->pages, ioreq->v.niov) != 0) {
+        if (xc_gnttab_munmap(gnt, ioreq->pages, ioreq->num_unmap) != 0) {
             xen_be_printf(&ioreq->blkdev->xendev, 0, "xc_gnttab_munmap failed: %s\n",
                           strerror(errno));
         }
-        ioreq->blkdev->cnt_map -= ioreq->v.niov;
+        ioreq->blkdev->cnt_map -= ioreq->num_unmap;
         ioreq->pages = NULL;
     } else {
-        for (i = 0; i < ioreq->v.niov; i++) {
+        for (i = 0; i < ioreq->num_unmap; i++) {
             if (!ioreq->page[i]) {
                 continue;
             }
@@ -273,42 +321,113 @@ static void ioreq_unmap(struct ioreq *ioreq)
 
 static int ioreq_map(struct ioreq *ioreq)
 {
-    XenGnttab gnt = ioreq->blkdev->xendev.gnttabdev;
-    int i;
+    struct XenBlkDev *blkdev = ioreq->blkdev;
+    XenGnttab gnt = blkdev->xendev.gnttabdev;
+    uint32_t domids[BLKIF_MAX_SEGMENTS_PER_REQUEST];
+    uint32_t refs[BLKIF_MAX_SEGMENTS_PER_REQUEST];
+    void *page[BLKIF_MAX_SEGMENTS_PER_REQUEST];
+    int i, j, new_maps = 0;
+    PersistentGrant *grant;
 
     if (ioreq->v.niov == 0 || ioreq->mapped == 1) {
         return 0;
     }
-    if (batch_maps) {
+
+    /* domids and refs get the grants that are not mapped yet */
+    if (blkdev->feature_persistent) {
+        for (i = 0; i < ioreq->v.niov; i++) {
+            grant = g_tree_lookup(blkdev->persistent_gnts,
+                                  GUINT_TO_POINTER(ioreq->refs[i]));
+            if (grant != NULL) {
+                page[i] = grant->page;
+                xen_be_printf(&blkdev->xendev, 3,
+                              "using persistent-grant %" PRIu32 "\n",
+                              ioreq->refs[i]);
+            } else {
+                domids[new_maps] = ioreq->domids[i];
+                refs[new_maps] = ioreq->refs[i];
+                page[i] = NULL;
+                new_maps++;
+            }
+        }
+        /* a grant may be reused later with the other protection */
+        ioreq->prot = PROT_WRITE | PROT_READ;
+    } else {
+        memcpy(domids, ioreq->domids, sizeof(domids));
+        memcpy(refs, ioreq->refs, sizeof(refs));
+        memset(page, 0, sizeof(page));
+        new_maps = ioreq->v.niov;
+    }
+
+    if (batch_maps && new_maps) {
         ioreq->pages = xc_gnttab_map_grant_refs
-            (gnt, ioreq->v.niov, ioreq->domids, ioreq->refs, ioreq->prot);
+            (gnt, new_maps, domids, refs, ioreq->prot);
         if (ioreq->pages == NULL) {
-            xen_be_printf(&ioreq->blkdev->xendev, 0,
+            xen_be_printf(&blkdev->xendev, 0,
                           "can't map %d grant refs (%s, %d maps)\n",
-                          ioreq->v.niov, strerror(errno), ioreq->blkdev->cnt_map);
+                          new_maps, strerror(errno), blkdev->cnt_map);
             return -1;
         }
-        for (i = 0; i < ioreq->v.niov; i++) {
-            ioreq->v.iov[i].iov_base = ioreq->pages + i * XC_PAGE_SIZE +
-                (uintptr_t)ioreq->v.iov[i].iov_base;
+        for (i = 0, j = 0; i < ioreq->v.niov; i++) {
+            if (page[i] == NULL) {
+                page[i] = ioreq->pages + (j++) * XC_PAGE_SIZE;
+            }
         }
-        ioreq->blkdev->cnt_map += ioreq->v.niov;
-    } else  {
-        for (i = 0; i < ioreq->v.niov; i++) {
+        blkdev->cnt_map += new_maps;
+    } else if (new_maps) {
+        for (i = 0; i < new_maps; i++) {
             ioreq->page[i] = xc_gnttab_map_grant_ref
-                (gnt, ioreq->domids[i], ioreq->refs[i], ioreq->prot);
+                (gnt, domids[i], refs[i], ioreq->prot);
             if (ioreq->page[i] == NULL) {
-                xen_be_printf(&ioreq->blkdev->xendev, 0,
+                xen_be_printf(&blkdev->xendev, 0,
                               "can't map grant ref %d (%s, %d maps)\n",
-                              ioreq->refs[i], strerror(errno), ioreq->blkdev->cnt_map);
+                              refs[i], strerror(errno), blkdev->cnt_map);
+                ioreq->mapped = 1;
+                ioreq->num_unmap = i;
                 ioreq_unmap(ioreq);
                 return -1;
             }
-            ioreq->v.iov[i].iov_base = ioreq->page[i] + (uintptr_t)ioreq->v.iov[i].iov_base;
-            ioreq->blkdev->cnt_map++;
+            blkdev->cnt_map++;
+        }
+        for (i = 0, j = 0; i < ioreq->v.niov; i++) {
+            if (page[i] == NULL) {
+                page[i] = ioreq->page[j++];
+            }
         }
     }
+
+    /*
+     * Keep as many of the new mappings as the cache takes, from the end of
+     * ioreq->page(s), so that only the first num_unmap get unmapped when
+     * the request completes.  A grant used twice in the request is only
+     * kept once.
+     */
+    while (blkdev->feature_persistent && new_maps &&
+           blkdev->persistent_gnt_count < blkdev->max_grants) {
+        if (g_tree_lookup(blkdev->persistent_gnts,
+                          GUINT_TO_POINTER(refs[new_maps - 1]))) {
+            break;
+        }
+        grant = g_malloc0(sizeof(*grant));
+        new_maps--;
+        if (batch_maps) {
+            grant->page = ioreq->pages + new_maps * XC_PAGE_SIZE;
+        } else {
+            grant->page = ioreq->page[new_maps];
+        }
+        grant->blkdev = blkdev;
+        xen_be_printf(&blkdev->xendev, 3, "adding grant %" PRIu32 " page: %p\n",
+                      refs[new_maps], grant->page);
+        g_tree_insert(blkdev->persistent_gnts,
+                      GUINT_TO_POINTER(refs[new_maps]), grant);
+        blkdev->persistent_gnt_count++;
+    }
+
+    for (i = 0; i < ioreq->v.niov; i++) {
+        ioreq->v.iov[i].iov_base += (uintptr_t)page[i];
+    }
     ioreq->mapped = 1;
+    ioreq->num_unmap = new_maps;
     return 0;
 }
 
@@ -347,6 +466,44 @@ static void qemu_aio_complete(void *opaque, int ret)
     qemu_bh_schedule(ioreq->blkdev->bh);
 }
 
+static void blk_submit_writes(struct XenBlkDev *blkdev)
+{
+    int i, ret;
+
+    if (!blkdev->num_writes) {
+        return;
+    }
+
+    ret = bdrv_aio_multiwrite(blkdev->bs, blkdev->blkreq, blkdev->num_writes);
+    if (ret != 0) {
+        for (i = 0; i < blkdev->num_writes; i++) {
+            if (blkdev->blkreq[i].error) {
+                qemu_aio_complete(blkdev->blkreq[i].opaque, -EIO);
+            }
+        }
+    }
+
+    blkdev->num_writes = 0;
+}
+
+/* Plain writes are queued so that adjacent ones get merged */
+static void blk_queue_write(struct XenBlkDev *blkdev, struct ioreq *ioreq)
+{
+    BlockRequest *blkreq;
+
+    if (blkdev->num_writes == max_requests) {
+        blk_submit_writes(blkdev);
+    }
+
+    blkreq = &blkdev->blkreq[blkdev->num_writes++];
+    blkreq->sector = ioreq->start / BLOCK_SIZE;
+    blkreq->nb_sectors = ioreq->v.size / BLOCK_SIZE;
+    blkreq->qiov = &ioreq->v;
+    blkreq->cb = qemu_aio_complete;
+    blkreq->opaque = ioreq;
+    blkreq->error = 0;
+}
+
 static int ioreq_runio_qemu_aio(struct ioreq *ioreq)
 {
     struct XenBlkDev *blkdev = ioreq->blkdev;
@@ -355,6 +512,11 @@ static int ioreq_runio_qemu_aio(struct ioreq *ioreq)
         goto err_no_map;
     }
 
+    /* queued writes go before anything that may depend on them */
+    if (ioreq->req.operation != BLKIF_OP_WRITE) {
+        blk_submit_writes(blkdev);
+    }
+
     ioreq->aio_inflight++;
     if (ioreq->presync) {
         bdrv_aio_flush(ioreq->blkdev->bs, qemu_aio_complete, ioreq);
@@ -377,6 +539,10 @@ static int ioreq_runio_qemu_aio(struct ioreq *ioreq)
 
         bdrv_acct_start(blkdev->bs, &ioreq->acct, ioreq->v.size, BDRV_ACCT_WRITE);
         ioreq->aio_inflight++;
+        if (ioreq->req.operation == BLKIF_OP_WRITE) {
+            blk_queue_write(blkdev, ioreq);
+            break;
+        }
         bdrv_aio_writev(blkdev->bs, ioreq->start / BLOCK_SIZE,
                         &ioreq->v, ioreq->v.size / BLOCK_SIZE,
                         qemu_aio_complete, ioreq);
@@ -518,6 +684,7 @@ static void blk_handle_requests(struct XenBlkDev *blkdev)
 
         ioreq_runio_qemu_aio(ioreq);
     }
+    blk_submit_writes(blkdev);
 
     if (blkdev->more_work && blkdev->requests_inflight < max_requests) {
         qemu_bh_schedule(blkdev->bh);
@@ -552,8 +719,11 @@ static void blk_alloc(struct XenDevice *xendev)
     if (xen_mode != XEN_EMULATE) {
         batch_maps = 1;
     }
+    blkdev->blkreq = g_new0(BlockRequest, max_requests);
+    /* the persistent grants stay mapped on top of the in-flight ones */
     if (xc_gnttab_set_max_grants(xendev->gnttabdev,
-            MAX_GRANTS(max_requests, BLKIF_MAX_SEGMENTS_PER_REQUEST)) < 0) {
+            MAX_GRANTS(max_requests, BLKIF_MAX_SEGMENTS_PER_REQUEST) +
+            MAX_PERSISTENT_GRANTS(max_requests)) < 0) {
         xen_be_printf(xendev, 0, "xc_gnttab_set_max_grants failed: %s\n",
                       strerror(errno));
     }
@@ -656,6 +826,7 @@ static int blk_init(struct XenDevice *xendev)
 
     /* fill info */
     xenstore_write_be_int(&blkdev->xendev, "feature-barrier", 1);
+    xenstore_write_be_int(&blkdev->xendev, "feature-persistent", 1);
     xenstore_write_be_int(&blkdev->xendev, "info",            info);
     xenstore_write_be_int(&blkdev->xendev, "sector-size",     blkdev->file_blk);
     xenstore_write_be_int(&blkdev->xendev, "sectors",
@@ -679,6 +850,7 @@ out_error:
 static int blk_connect(struct XenDevice *xendev)
 {
     struct XenBlkDev *blkdev = container_of(xendev, struct XenBlkDev, xendev);
+    int pers, max_grants;
 
     if (xenstore_read_fe_int(&blkdev->xendev, "ring-ref", &blkdev->ring_ref) == -1) {
         return -1;
@@ -687,6 +859,18 @@ static int blk_connect(struct XenDevice *xendev)
                              &blkdev->xendev.remote_port) == -1) {
         return -1;
     }
+    if (xenstore_read_fe_int(&blkdev->xendev, "feature-persistent", &pers)) {
+        blkdev->feature_persistent = false;
+    } else {
+        blkdev->feature_persistent = !!pers;
+    }
+    /* the toolstack may lower the number of grants kept mapped */
+    blkdev->max_grants = MAX_PERSISTENT_GRANTS(max_requests);
+    if (xenstore_read_be_int(&blkdev->xendev, "max-persistent-grants",
+                             &max_grants) == 0 && max_grants >= 0 &&
+        max_grants < blkdev->max_grants) {
+        blkdev->max_grants = max_grants;
+    }
 
     blkdev->protocol = BLKIF_PROTOCOL_NATIVE;
     if (blkdev->xendev.protocol) {
@@ -730,6 +914,14 @@ static int blk_connect(struct XenDevice *xendev)
     }
     }
 
+    if (blkdev->feature_persistent) {
+        /* the destroy function unmaps the grants */
+        blkdev->persistent_gnts = g_tree_new_full((GCompareDataFunc)int_cmp,
+                                                  NULL, NULL,
+                                                  (GDestroyNotify)destroy_grant);
+        blkdev->persistent_gnt_count = 0;
+    }
+
     xen_be_bind_evtchn(&blkdev->xendev);
 
     xen_be_printf(&blkdev->xendev, 1, "ok: proto %s, ring-ref %d, "
@@ -759,6 +951,12 @@ static void blk_disconnect(struct XenDevice *xendev)
         blkdev->cnt_map--;
         blkdev->sring = NULL;
     }
+
+    if (blkdev->persistent_gnts) {
+        g_tree_destroy(blkdev->persistent_gnts);
+        assert(blkdev->persistent_gnt_count == 0);
+        blkdev->persistent_gnts = NULL;
+    }
 }
 
 static int blk_free(struct XenDevice *xendev)
@@ -782,6 +980,7 @@ static int blk_free(struct XenDevice *xendev)
     g_free(blkdev->type);
     g_free(blkdev->dev);
     g_free(blkdev->devtype);
+    g_free(blkdev->blkreq);
     qemu_bh_delete(blkdev->bh);
     return 0;
 }
@@ -68,6 +68,12 @@ struct CPUState {
 #endif
     bool thread_kicked;
 
+    /* KVM vCPUs wait for kicks on halt_notifier, without the global mutex */
+    struct EventNotifier *halt_notifier;
+    bool halt_waiting;
+    bool kick_pending;
+    int64_t halt_poll_ns;
+
     /* TODO Move common fields from CPUArchState here. */
 };
 
@@ -235,11 +235,16 @@ typedef struct ObjectProperty
  * The base for all classes.  The only thing that #ObjectClass contains is an
  * integer type handle.
  */
+#define OBJECT_CLASS_CAST_CACHE 4
+
 struct ObjectClass
 {
     /*< private >*/
     Type type;
     GSList *interfaces;
+
+    /* Type names recently cast to successfully, compared by address */
+    const char *cast_cache[OBJECT_CLASS_CAST_CACHE];
 };
 
 /**
@@ -262,6 +267,8 @@ struct Object
     /*< private >*/
     ObjectClass *class;
     QTAILQ_HEAD(, ObjectProperty) properties;
+    unsigned int num_properties;
+    GHashTable *property_table; /* name -> property, once there are many */
     uint32_t ref;
     Object *parent;
 };
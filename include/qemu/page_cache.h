@@ -1,6 +1,6 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is set associative, sets are selected by the page address
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -18,6 +18,9 @@
 /* Page cache for storing guest pages */
 typedef struct PageCache PageCache;
 
+/* Number of pages that can be cached in each set */
+#define PAGE_CACHE_WAYS 4
+
 /**
  * cache_init: Initialize the page cache
  *
@@ -47,17 +50,21 @@ void cache_fini(PageCache *cache);
 bool cache_is_cached(const PageCache *cache, uint64_t addr);
 
 /**
- * get_cached_data: Get the data cached for an addr
+ * get_cached_data: Get the data cached for an addr, and mark it as the most
+ * recently used page of its set
  *
  * Returns pointer to the data cached or NULL if not cached
  *
  * @cache pointer to the PageCache struct
  * @addr: page addr
  */
-uint8_t *get_cached_data(const PageCache *cache, uint64_t addr);
+uint8_t *get_cached_data(PageCache *cache, uint64_t addr);
 
 /**
- * cache_insert: insert the page into the cache. the previous value will be overwritten
+ * cache_insert: insert the page into the cache. If the page is already cached
+ * its previous data is replaced, otherwise the least recently used page of the
+ * set is evicted if the set is full.  The cache takes ownership of @pdata and
+ * frees the data it drops.
  *
  * @cache pointer to the PageCache struct
  * @addr: page address
@@ -31,6 +31,9 @@
 #ifndef _WIN32
 #include <sys/wait.h>
 #endif
+#ifdef CONFIG_EPOLL
+#include <sys/epoll.h>
+#endif
 
 typedef struct IOHandlerRecord {
     IOCanReadHandler *fd_read_poll;
@@ -39,12 +42,84 @@ typedef struct IOHandlerRecord {
     void *opaque;
     QLIST_ENTRY(IOHandlerRecord) next;
     int fd;
+    int pollfds_idx;            /* entry in the main loop's array, or -1 */
     bool deleted;
+#ifdef CONFIG_EPOLL
+    int epoll_events;           /* G_IO_* registered in the epoll set */
+    bool no_epoll;              /* epoll refused the fd, e.g. a file */
+#endif
 } IOHandlerRecord;
 
 static QLIST_HEAD(, IOHandlerRecord) io_handlers =
     QLIST_HEAD_INITIALIZER(io_handlers);
 
+/* some handler is marked deleted and still has to be freed */
+static bool io_handlers_deleted;
+/* handlers with an entry in the main loop's array */
+static int io_handlers_direct;
+
+/*
+ * Where possible, descriptors are kept in an epoll set that is only
+ * changed when the events a handler waits for change, and only the
+ * descriptor of the set goes to the main loop, like slirp does with its
+ * sockets.  A wakeup then costs as much as the number of descriptors
+ * that are ready, no matter how many handlers there are, and there is
+ * no FD_SETSIZE limit.  Descriptors epoll does not support are polled
+ * directly.
+ */
+#ifdef CONFIG_EPOLL
+static int epoll_fd = -2;       /* -1 if epoll_create failed */
+static int epoll_pollfds_idx = -1;
+static IOHandlerRecord **epoll_handlers;    /* indexed by descriptor */
+static int epoll_nhandlers;
+
+static void iohandler_epoll_update(IOHandlerRecord *ioh, int events)
+{
+    struct epoll_event ev;
+    int op;
+
+    if (events == ioh->epoll_events) {
+        return;
+    }
+    if (ioh->fd >= epoll_nhandlers) {
+        int n = MAX(ioh->fd + 1, epoll_nhandlers * 2);
+
+        epoll_handlers = g_renew(IOHandlerRecord *, epoll_handlers, n);
+        memset(epoll_handlers + epoll_nhandlers, 0,
+               (n - epoll_nhandlers) * sizeof(IOHandlerRecord *));
+        epoll_nhandlers = n;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = (events & G_IO_IN ? EPOLLIN : 0) |
+                (events & G_IO_OUT ? EPOLLOUT : 0);
+    ev.data.fd = ioh->fd;
+
+    /* no events: remove it, or epoll keeps reporting errors and hangups */
+    op = !events ? EPOLL_CTL_DEL :
+         ioh->epoll_events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    if (epoll_ctl(epoll_fd, op, ioh->fd, &ev) < 0) {
+        if (op == EPOLL_CTL_MOD && errno == ENOENT) {
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, ioh->fd, &ev);
+        } else if (op == EPOLL_CTL_ADD && errno == EEXIST) {
+            epoll_ctl(epoll_fd, EPOLL_CTL_MOD, ioh->fd, &ev);
+        } else if (op == EPOLL_CTL_ADD && errno == EPERM) {
+            ioh->no_epoll = true;
+            return;
+        }
+    }
+    ioh->epoll_events = events;
+    epoll_handlers[ioh->fd] = events ? ioh : NULL;
+}
+
+static void iohandler_epoll_forget(IOHandlerRecord *ioh)
+{
+    if (epoll_fd >= 0 && !ioh->no_epoll) {
+        iohandler_epoll_update(ioh, 0);
+    }
+    ioh->no_epoll = false;
+}
+#endif
 
 /* XXX: fd_read_poll should be suppressed, but an API change is
    necessary in the character devices to suppress fd_can_read(). */
@@ -59,7 +134,12 @@ int qemu_set_fd_handler2(int fd,
     if (!fd_read && !fd_write) {
         QLIST_FOREACH(ioh, &io_handlers, next) {
             if (ioh->fd == fd) {
+#ifdef CONFIG_EPOLL
+                /* now, callers tend to close the descriptor next */
+                iohandler_epoll_forget(ioh);
+#endif
                 ioh->deleted = 1;
+                io_handlers_deleted = true;
                 break;
             }
         }
@@ -69,6 +149,7 @@ int qemu_set_fd_handler2(int fd,
                 goto found;
         }
         ioh = g_malloc0(sizeof(IOHandlerRecord));
+        ioh->pollfds_idx = -1;
         QLIST_INSERT_HEAD(&io_handlers, ioh, next);
     found:
         ioh->fd = fd;
@@ -90,39 +171,129 @@ int qemu_set_fd_handler(int fd,
     return qemu_set_fd_handler2(fd, NULL, fd_read, fd_write, opaque);
 }
 
-void qemu_iohandler_fill(int *pnfds, fd_set *readfds, fd_set *writefds, fd_set *xfds)
+void qemu_iohandler_fill(GArray *pollfds)
 {
     IOHandlerRecord *ioh;
 
+#ifdef CONFIG_EPOLL
+    if (epoll_fd == -2) {
+        epoll_fd = epoll_create(64);
+        if (epoll_fd >= 0) {
+            qemu_set_cloexec(epoll_fd);
+        }
+    }
+#endif
+
+    io_handlers_direct = 0;
     QLIST_FOREACH(ioh, &io_handlers, next) {
+        int events = 0;
+
+        ioh->pollfds_idx = -1;
         if (ioh->deleted)
             continue;
         if (ioh->fd_read &&
             (!ioh->fd_read_poll ||
              ioh->fd_read_poll(ioh->opaque) != 0)) {
-            FD_SET(ioh->fd, readfds);
-            if (ioh->fd > *pnfds)
-                *pnfds = ioh->fd;
+            events |= G_IO_IN | G_IO_HUP | G_IO_ERR;
         }
         if (ioh->fd_write) {
-            FD_SET(ioh->fd, writefds);
-            if (ioh->fd > *pnfds)
-                *pnfds = ioh->fd;
+            events |= G_IO_OUT | G_IO_ERR;
         }
+#ifdef CONFIG_EPOLL
+        if (epoll_fd >= 0 && !ioh->no_epoll) {
+            iohandler_epoll_update(ioh, events);
+            if (!ioh->no_epoll) {
+                continue;
+            }
+        }
+#endif
+        if (events) {
+            GPollFD pfd = {
+                .fd = ioh->fd,
+                .events = events,
+            };
+            ioh->pollfds_idx = pollfds->len;
+            g_array_append_val(pollfds, pfd);
+            io_handlers_direct++;
+        }
+    }
+
+#ifdef CONFIG_EPOLL
+    epoll_pollfds_idx = -1;
+    if (epoll_fd >= 0) {
+        GPollFD pfd = {
+            .fd = epoll_fd,
+            .events = G_IO_IN,
+        };
+        epoll_pollfds_idx = pollfds->len;
+        g_array_append_val(pollfds, pfd);
+    }
+#endif
+}
+
+static void iohandler_dispatch(IOHandlerRecord *ioh, int revents)
+{
+    if (!ioh->deleted && ioh->fd_read &&
+        (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR))) {
+        ioh->fd_read(ioh->opaque);
+    }
+    if (!ioh->deleted && ioh->fd_write &&
+        (revents & (G_IO_OUT | G_IO_ERR))) {
+        ioh->fd_write(ioh->opaque);
     }
 }
 
-void qemu_iohandler_poll(fd_set *readfds, fd_set *writefds, fd_set *xfds, int ret)
+#ifdef CONFIG_EPOLL
+static void iohandler_epoll_poll(void)
+{
+    struct epoll_event events[256];
+    int i, n;
+
+    n = epoll_wait(epoll_fd, events, ARRAY_SIZE(events), 0);
+    for (i = 0; i < n; i++) {
+        int fd = events[i].data.fd;
+        uint32_t ev = events[i].events;
+        IOHandlerRecord *ioh;
+        int revents;
+
+        /* records are only freed below, but may be gone from the table */
+        ioh = fd < epoll_nhandlers ? epoll_handlers[fd] : NULL;
+        if (!ioh || ioh->fd != fd) {
+            continue;
+        }
+        revents = (ev & EPOLLIN ? G_IO_IN : 0) |
+                  (ev & EPOLLOUT ? G_IO_OUT : 0);
+        /* like poll(), errors and hangups wake up readers and writers */
+        if (ev & (EPOLLERR | EPOLLHUP)) {
+            revents |= G_IO_ERR;
+        }
+        iohandler_dispatch(ioh, revents & ioh->epoll_events);
+    }
+}
+#endif
+
+void qemu_iohandler_poll(GArray *pollfds, int ret)
 {
     if (ret > 0) {
         IOHandlerRecord *pioh, *ioh;
 
+#ifdef CONFIG_EPOLL
+        if (epoll_pollfds_idx >= 0 &&
+            g_array_index(pollfds, GPollFD, epoll_pollfds_idx).revents) {
+            iohandler_epoll_poll();
+        }
+#endif
+
+        /* nothing to do if every descriptor is in the epoll set */
+        if (!io_handlers_direct && !io_handlers_deleted) {
+            return;
+        }
         QLIST_FOREACH_SAFE(ioh, &io_handlers, next, pioh) {
-            if (!ioh->deleted && ioh->fd_read && FD_ISSET(ioh->fd, readfds)) {
-                ioh->fd_read(ioh->opaque);
-            }
-            if (!ioh->deleted && ioh->fd_write && FD_ISSET(ioh->fd, writefds)) {
-                ioh->fd_write(ioh->opaque);
+            if (ioh->pollfds_idx >= 0) {
+                GPollFD *pfd = &g_array_index(pollfds, GPollFD,
+                                              ioh->pollfds_idx);
+
+                iohandler_dispatch(ioh, pfd->revents);
             }
 
             /* Do this last in case read/write handlers marked it for deletion */
@@ -131,6 +302,7 @@ void qemu_iohandler_poll(fd_set *readfds, fd_set *writefds, fd_set *xfds, int re
                 g_free(ioh);
             }
         }
+        io_handlers_deleted = false;
     }
 }
 
@@ -284,29 +284,40 @@ bool isa_is_ioport_assigned(pio_addr_t start)
 
 void cpu_outb(pio_addr_t addr, uint8_t val)
 {
+    bool locked = qemu_tcg_io_lock();
+
     LOG_IOPORT("outb: %04"FMT_pioaddr" %02"PRIx8"\n", addr, val);
     trace_cpu_out(addr, val);
     ioport_write(0, addr, val);
+    qemu_tcg_io_unlock(locked);
 }
 
 void cpu_outw(pio_addr_t addr, uint16_t val)
 {
+    bool locked = qemu_tcg_io_lock();
+
     LOG_IOPORT("outw: %04"FMT_pioaddr" %04"PRIx16"\n", addr, val);
     trace_cpu_out(addr, val);
     ioport_write(1, addr, val);
+    qemu_tcg_io_unlock(locked);
 }
 
 void cpu_outl(pio_addr_t addr, uint32_t val)
 {
+    bool locked = qemu_tcg_io_lock();
+
     LOG_IOPORT("outl: %04"FMT_pioaddr" %08"PRIx32"\n", addr, val);
     trace_cpu_out(addr, val);
     ioport_write(2, addr, val);
+    qemu_tcg_io_unlock(locked);
 }
 
 uint8_t cpu_inb(pio_addr_t addr)
 {
+    bool locked = qemu_tcg_io_lock();
     uint8_t val;
     val = ioport_read(0, addr);
+    qemu_tcg_io_unlock(locked);
     trace_cpu_in(addr, val);
     LOG_IOPORT("inb : %04"FMT_pioaddr" %02"PRIx8"\n", addr, val);
     return val;
@@ -314,8 +325,10 @@ uint8_t cpu_inb(pio_addr_t addr)
 
 uint16_t cpu_inw(pio_addr_t addr)
 {
+    bool locked = qemu_tcg_io_lock();
     uint16_t val;
     val = ioport_read(1, addr);
+    qemu_tcg_io_unlock(locked);
     trace_cpu_in(addr, val);
     LOG_IOPORT("inw : %04"FMT_pioaddr" %04"PRIx16"\n", addr, val);
     return val;
@@ -323,8 +336,10 @@ uint16_t cpu_inw(pio_addr_t addr)
 
 uint32_t cpu_inl(pio_addr_t addr)
 {
+    bool locked = qemu_tcg_io_lock();
     uint32_t val;
     val = ioport_read(2, addr);
+    qemu_tcg_io_unlock(locked);
     trace_cpu_in(addr, val);
     LOG_IOPORT("inl : %04"FMT_pioaddr" %08"PRIx32"\n", addr, val);
     return val;
@@ -403,6 +418,7 @@ void portio_list_add(PortioList *piolist,
     unsigned int off_low, off_high, off_last, count;
 
     piolist->address_space = address_space;
+    piolist->addr = start;
 
     /* Handle the first entry specially.  */
     off_last = off_low = pio_start->offset;
@@ -432,6 +448,22 @@ void portio_list_add(PortioList *piolist,
     portio_list_add_1(piolist, pio_start, count, start, off_low, off_high);
 }
 
+/* Coalesce writes to the ports [offset, offset + len) of the list, see
+ * memory_region_add_coalescing().  Must follow portio_list_add().
+ */
+void portio_list_add_coalescing(PortioList *piolist, uint32_t offset,
+                                uint32_t len)
+{
+    unsigned i;
+
+    /* the regions take absolute port numbers; each is only visible
+       through the window of its alias */
+    for (i = 0; i < piolist->nr; ++i) {
+        memory_region_add_coalescing(piolist->regions[i],
+                                     piolist->addr + offset, len);
+    }
+}
+
 void portio_list_del(PortioList *piolist)
 {
     MemoryRegion *mr, *alias;
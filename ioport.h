@@ -59,6 +59,7 @@ struct MemoryRegionPortio;
 typedef struct PortioList {
     const struct MemoryRegionPortio *ports;
     struct MemoryRegion *address_space;
+    uint32_t addr;
     unsigned nr;
     struct MemoryRegion **regions;
     struct MemoryRegion **aliases;
@@ -74,5 +75,7 @@ void portio_list_add(PortioList *piolist,
                      struct MemoryRegion *address_space,
                      uint32_t addr);
 void portio_list_del(PortioList *piolist);
+void portio_list_add_coalescing(PortioList *piolist, uint32_t offset,
+                                uint32_t len);
 
 #endif /* IOPORT_H */
@@ -18,6 +18,10 @@
 
 #include "iov.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #ifdef _WIN32
 # include <windows.h>
 # include <winsock2.h>
@@ -26,44 +30,160 @@
 # include <sys/socket.h>
 #endif
 
-size_t iov_from_buf(struct iovec *iov, unsigned int iov_cnt,
-                    size_t offset, const void *buf, size_t bytes)
+/*
+ * Copies of at least this many bytes use non-temporal stores: the data is
+ * not going to be read back soon enough to be worth evicting what the
+ * caches hold.
+ */
+#define IOV_NT_COPY_MIN (256 * 1024)
+
+static void iov_memcpy(void *dst, const void *src, size_t len, bool nt)
 {
-    size_t done;
-    unsigned int i;
-    for (i = 0, done = 0; (offset || done < bytes) && i < iov_cnt; i++) {
-        if (offset < iov[i].iov_len) {
-            size_t len = MIN(iov[i].iov_len - offset, bytes - done);
-            memcpy(iov[i].iov_base + offset, buf + done, len);
-            done += len;
-            offset = 0;
-        } else {
-            offset -= iov[i].iov_len;
+#ifdef __SSE2__
+    if (nt && len >= 128) {
+        size_t head = -(uintptr_t)dst & 15;
+        __m128i *d;
+        const __m128i *s;
+        size_t i;
+
+        memcpy(dst, src, head);
+        d = dst + head;
+        s = src + head;
+        len -= head;
+        for (i = 0; i < len / 64; i++, d += 4, s += 4) {
+            __m128i x0 = _mm_loadu_si128(s + 0);
+            __m128i x1 = _mm_loadu_si128(s + 1);
+            __m128i x2 = _mm_loadu_si128(s + 2);
+            __m128i x3 = _mm_loadu_si128(s + 3);
+            _mm_stream_si128(d + 0, x0);
+            _mm_stream_si128(d + 1, x1);
+            _mm_stream_si128(d + 2, x2);
+            _mm_stream_si128(d + 3, x3);
         }
+        /* order the streaming stores before whatever the caller does next */
+        _mm_sfence();
+        memcpy(d, s, len & 63);
+        return;
+    }
+#endif
+    memcpy(dst, src, len);
+}
+
+/* The number of bytes after the position of a cursor */
+static size_t iov_cursor_size(const IOVCursor *cur)
+{
+    return iov_size(cur->iov, cur->cnt) - cur->offset;
+}
+
+static bool iov_cursor_use_nt(const IOVCursor *cur, size_t bytes)
+{
+    return bytes >= IOV_NT_COPY_MIN && iov_cursor_size(cur) >= IOV_NT_COPY_MIN;
+}
+
+static void iov_cursor_advance(IOVCursor *cur, size_t len)
+{
+    cur->offset += len;
+    while (cur->cnt && cur->offset >= cur->iov->iov_len) {
+        cur->offset -= cur->iov->iov_len;
+        cur->iov++;
+        cur->cnt--;
+    }
+}
+
+void iov_cursor_init(IOVCursor *cur, const struct iovec *iov,
+                     unsigned int iov_cnt, size_t offset)
+{
+    cur->iov = iov;
+    cur->cnt = iov_cnt;
+    cur->offset = 0;
+    iov_cursor_advance(cur, offset);
+    assert(cur->cnt || cur->offset == 0);
+}
+
+size_t iov_cursor_skip(IOVCursor *cur, size_t bytes)
+{
+    size_t done, len;
+
+    for (done = 0; done < bytes && cur->cnt; done += len) {
+        len = MIN(cur->iov->iov_len - cur->offset, bytes - done);
+        iov_cursor_advance(cur, len);
     }
-    assert(offset == 0);
     return done;
 }
 
-size_t iov_to_buf(const struct iovec *iov, const unsigned int iov_cnt,
-                  size_t offset, void *buf, size_t bytes)
+size_t iov_cursor_to_buf(IOVCursor *cur, void *buf, size_t bytes)
 {
-    size_t done;
-    unsigned int i;
-    for (i = 0, done = 0; (offset || done < bytes) && i < iov_cnt; i++) {
-        if (offset < iov[i].iov_len) {
-            size_t len = MIN(iov[i].iov_len - offset, bytes - done);
-            memcpy(buf + done, iov[i].iov_base + offset, len);
-            done += len;
-            offset = 0;
-        } else {
-            offset -= iov[i].iov_len;
-        }
+    bool nt = iov_cursor_use_nt(cur, bytes);
+    size_t done, len;
+
+    for (done = 0; done < bytes && cur->cnt; done += len) {
+        len = MIN(cur->iov->iov_len - cur->offset, bytes - done);
+        iov_memcpy(buf + done, cur->iov->iov_base + cur->offset, len, nt);
+        iov_cursor_advance(cur, len);
+    }
+    return done;
+}
+
+size_t iov_cursor_from_buf(IOVCursor *cur, const void *buf, size_t bytes)
+{
+    bool nt = iov_cursor_use_nt(cur, bytes);
+    size_t done, len;
+
+    for (done = 0; done < bytes && cur->cnt; done += len) {
+        len = MIN(cur->iov->iov_len - cur->offset, bytes - done);
+        iov_memcpy(cur->iov->iov_base + cur->offset, buf + done, len, nt);
+        iov_cursor_advance(cur, len);
     }
-    assert(offset == 0);
     return done;
 }
 
+size_t iov_cursor_copy(IOVCursor *dst, IOVCursor *src, size_t bytes)
+{
+    bool nt = iov_cursor_use_nt(dst, bytes) && iov_cursor_use_nt(src, bytes);
+    size_t done, len;
+
+    for (done = 0; done < bytes && dst->cnt && src->cnt; done += len) {
+        len = MIN(dst->iov->iov_len - dst->offset,
+                  src->iov->iov_len - src->offset);
+        len = MIN(len, bytes - done);
+        iov_memcpy(dst->iov->iov_base + dst->offset,
+                   src->iov->iov_base + src->offset, len, nt);
+        iov_cursor_advance(dst, len);
+        iov_cursor_advance(src, len);
+    }
+    return done;
+}
+
+size_t iov_from_buf(struct iovec *iov, unsigned int iov_cnt,
+                    size_t offset, const void *buf, size_t bytes)
+{
+    IOVCursor cur;
+
+    iov_cursor_init(&cur, iov, iov_cnt, offset);
+    return iov_cursor_from_buf(&cur, buf, bytes);
+}
+
+size_t iov_to_buf(const struct iovec *iov, const unsigned int iov_cnt,
+                  size_t offset, void *buf, size_t bytes)
+{
+    IOVCursor cur;
+
+    iov_cursor_init(&cur, iov, iov_cnt, offset);
+    return iov_cursor_to_buf(&cur, buf, bytes);
+}
+
+size_t iov_to_iov(const struct iovec *dst_iov, unsigned int dst_cnt,
+                  size_t dst_offset,
+                  const struct iovec *src_iov, unsigned int src_cnt,
+                  size_t src_offset, size_t bytes)
+{
+    IOVCursor dst, src;
+
+    iov_cursor_init(&dst, dst_iov, dst_cnt, dst_offset);
+    iov_cursor_init(&src, src_iov, src_cnt, src_offset);
+    return iov_cursor_copy(&dst, &src, bytes);
+}
+
 size_t iov_memset(const struct iovec *iov, const unsigned int iov_cnt,
                   size_t offset, int fillc, size_t bytes)
 {
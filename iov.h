@@ -54,6 +54,51 @@ size_t iov_to_buf(const struct iovec *iov, const unsigned int iov_cnt,
 size_t iov_memset(const struct iovec *iov, const unsigned int iov_cnt,
                   size_t offset, int fillc, size_t bytes);
 
+/**
+ * Copy data between two iovecs like memcpy() between two continuous memory
+ * regions: `bytes' bytes starting at byte position `src_offset' of `src_iov'
+ * are copied to byte position `dst_offset' of `dst_iov'.  The copy stops at
+ * the end of either iovec, and the number of bytes actually copied is
+ * returned.  Both offsets must point to the inside of their iovec, and
+ * `-1' can be used as `bytes' again.  The two iovecs must not overlap.
+ */
+size_t iov_to_iov(const struct iovec *dst_iov, unsigned int dst_cnt,
+                  size_t dst_offset,
+                  const struct iovec *src_iov, unsigned int src_cnt,
+                  size_t src_offset, size_t bytes);
+
+/**
+ * A position within an iovec, for consuming it piece by piece without
+ * skipping over the elements before the position again on each step.
+ * `iov' points to the current element, `cnt' counts the elements left
+ * including it, and `offset' is the position within it.  Once the data
+ * is used up, `cnt' is 0.
+ */
+typedef struct IOVCursor {
+    const struct iovec *iov;
+    unsigned int cnt;
+    size_t offset;
+} IOVCursor;
+
+/**
+ * Initialize `cur' to byte position `offset' of iovec `iov' with `iov_cnt'
+ * elements; `offset' must point to the inside of the iovec.
+ */
+void iov_cursor_init(IOVCursor *cur, const struct iovec *iov,
+                     unsigned int iov_cnt, size_t offset);
+
+/**
+ * The cursor versions of iov_to_buf(), iov_from_buf() and iov_to_iov()
+ * work from the current position and move it past the data processed.
+ * They return the number of bytes processed, which may be less than
+ * `bytes' only at the end of the iovec.  iov_cursor_skip() moves the
+ * position without touching the data.
+ */
+size_t iov_cursor_skip(IOVCursor *cur, size_t bytes);
+size_t iov_cursor_to_buf(IOVCursor *cur, void *buf, size_t bytes);
+size_t iov_cursor_from_buf(IOVCursor *cur, const void *buf, size_t bytes);
+size_t iov_cursor_copy(IOVCursor *dst, IOVCursor *src, size_t bytes);
+
 /*
  * Send/recv data from/to iovec buffers directly
  *
@@ -18,7 +18,8 @@
 #include "qlist.h"
 #include "error.h"
 
-QObject *json_parser_parse(QList *tokens, va_list *ap);
-QObject *json_parser_parse_err(QList *tokens, va_list *ap, Error **errp);
+/* @tokens holds the JSONToken pointers of one message */
+QObject *json_parser_parse(GPtrArray *tokens, va_list *ap);
+QObject *json_parser_parse_err(GPtrArray *tokens, va_list *ap, Error **errp);
 
 #endif
@@ -11,9 +11,6 @@
  *
  */
 
-#include "qlist.h"
-#include "qint.h"
-#include "qdict.h"
 #include "qemu-common.h"
 #include "json-lexer.h"
 #include "json-streamer.h"
@@ -21,13 +18,50 @@
 #define MAX_TOKEN_SIZE (64ULL << 20)
 #define MAX_NESTING (1ULL << 10)
 
-static void json_message_process_token(JSONLexer *lexer, QString *token, JSONTokenType type, int x, int y)
+/* Most messages fit in one chunk, which is kept from one to the next */
+#define ARENA_SIZE 4096
+
+static JSONToken *json_message_token_alloc(JSONMessageParser *parser,
+                                           size_t len)
+{
+    size_t size = QEMU_ALIGN_UP(sizeof(JSONToken) + len + 1, sizeof(void *));
+    char *p;
+
+    /* large strings get a chunk of their own */
+    if (size > ARENA_SIZE / 4) {
+        p = g_malloc(size);
+        parser->arena_full = g_slist_prepend(parser->arena_full, p);
+        return (JSONToken *)p;
+    }
+
+    if (parser->arena_used + size > ARENA_SIZE) {
+        parser->arena_full = g_slist_prepend(parser->arena_full, parser->arena);
+        parser->arena = g_malloc(ARENA_SIZE);
+        parser->arena_used = 0;
+    }
+    p = parser->arena + parser->arena_used;
+    parser->arena_used += size;
+    return (JSONToken *)p;
+}
+
+static void json_message_tokens_reset(JSONMessageParser *parser)
+{
+    g_slist_foreach(parser->arena_full, (GFunc)g_free, NULL);
+    g_slist_free(parser->arena_full);
+    parser->arena_full = NULL;
+    parser->arena_used = 0;
+    g_ptr_array_set_size(parser->tokens, 0);
+    parser->token_size = 0;
+}
+
+static void json_message_process_token(JSONLexer *lexer, GString *input,
+                                       JSONTokenType type, int x, int y)
 {
     JSONMessageParser *parser = container_of(lexer, JSONMessageParser, lexer);
-    QDict *dict;
+    JSONToken *token;
 
     if (type == JSON_OPERATOR) {
-        switch (qstring_get_str(token)[0]) {
+        switch (input->str[0]) {
         case '{':
             parser->brace_count++;
             break;
@@ -45,16 +79,15 @@ static void json_message_process_token(JSONLexer *lexer, QString *token, JSONTok
         }
     }
 
-    dict = qdict_new();
-    qdict_put(dict, "type", qint_from_int(type));
-    QINCREF(token);
-    qdict_put(dict, "token", token);
-    qdict_put(dict, "x", qint_from_int(x));
-    qdict_put(dict, "y", qint_from_int(y));
+    token = json_message_token_alloc(parser, input->len);
+    token->type = type;
+    token->x = x;
+    token->y = y;
+    memcpy(token->str, input->str, input->len + 1);
 
-    parser->token_size += token->length;
+    parser->token_size += input->len;
 
-    qlist_append(parser->tokens, dict);
+    g_ptr_array_add(parser->tokens, token);
 
     if (type == JSON_ERROR) {
         goto out_emit_bad;
@@ -78,28 +111,30 @@ out_emit_bad:
     /* clear out token list and tell the parser to emit and error
      * indication by passing it a NULL list
      */
-    QDECREF(parser->tokens);
-    parser->tokens = NULL;
+    parser->brace_count = 0;
+    parser->bracket_count = 0;
+    parser->emit(parser, NULL);
+    json_message_tokens_reset(parser);
+    return;
 out_emit:
     /* send current list of tokens to parser and reset tokenizer */
     parser->brace_count = 0;
     parser->bracket_count = 0;
     parser->emit(parser, parser->tokens);
-    if (parser->tokens) {
-        QDECREF(parser->tokens);
-    }
-    parser->tokens = qlist_new();
-    parser->token_size = 0;
+    json_message_tokens_reset(parser);
 }
 
 void json_message_parser_init(JSONMessageParser *parser,
-                              void (*func)(JSONMessageParser *, QList *))
+                              void (*func)(JSONMessageParser *, GPtrArray *))
 {
     parser->emit = func;
     parser->brace_count = 0;
     parser->bracket_count = 0;
-    parser->tokens = qlist_new();
+    parser->tokens = g_ptr_array_new();
     parser->token_size = 0;
+    parser->arena = g_malloc(ARENA_SIZE);
+    parser->arena_used = 0;
+    parser->arena_full = NULL;
 
     json_lexer_init(&parser->lexer, json_message_process_token);
 }
@@ -118,5 +153,7 @@ int json_message_parser_flush(JSONMessageParser *parser)
 void json_message_parser_destroy(JSONMessageParser *parser)
 {
     json_lexer_destroy(&parser->lexer);
-    QDECREF(parser->tokens);
+    json_message_tokens_reset(parser);
+    g_ptr_array_free(parser->tokens, true);
+    g_free(parser->arena);
 }
@@ -14,21 +14,37 @@
 #ifndef QEMU_JSON_STREAMER_H
 #define QEMU_JSON_STREAMER_H
 
-#include "qlist.h"
+#include "qemu-common.h"
 #include "json-lexer.h"
 
+typedef struct JSONToken {
+    int type;
+    int x;
+    int y;
+    char str[];
+} JSONToken;
+
 typedef struct JSONMessageParser
 {
-    void (*emit)(struct JSONMessageParser *parser, QList *tokens);
+    void (*emit)(struct JSONMessageParser *parser, GPtrArray *tokens);
     JSONLexer lexer;
     int brace_count;
     int bracket_count;
-    QList *tokens;
+    GPtrArray *tokens;
     uint64_t token_size;
+
+    /* Storage for the tokens of the current message, freed at once */
+    char *arena;
+    size_t arena_used;
+    GSList *arena_full;
 } JSONMessageParser;
 
+/*
+ * @func gets the tokens of each message, or NULL after a lexical error.
+ * They are freed when it returns.
+ */
 void json_message_parser_init(JSONMessageParser *parser,
-                              void (*func)(JSONMessageParser *, QList *));
+                              void (*func)(JSONMessageParser *, GPtrArray *));
 
 int json_message_parser_feed(JSONMessageParser *parser,
                              const char *buffer, size_t size);
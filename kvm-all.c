@@ -22,6 +22,7 @@
 
 #include "qemu-common.h"
 #include "qemu-barrier.h"
+#include "qemu-thread.h"
 #include "qemu-option.h"
 #include "qemu-config.h"
 #include "sysemu.h"
@@ -30,9 +31,12 @@
 #include "gdbstub.h"
 #include "kvm.h"
 #include "bswap.h"
+#include "bitops.h"
 #include "memory.h"
 #include "exec-memory.h"
 #include "event_notifier.h"
+#include "qmp-commands.h"
+#include "qemu-timer.h"
 
 /* This check must be after config-host.h is included */
 #ifdef CONFIG_EVENTFD
@@ -54,6 +58,12 @@
 
 #define KVM_MSI_HASHTAB_SIZE    256
 
+/* exit_reason values beyond this are counted as "other" */
+#define KVM_EXIT_STATS_NR       21
+/* one I/O exit in this many is recorded in the hot address table */
+#define KVM_EXIT_SAMPLE_INTERVAL 64
+#define KVM_HOT_ADDR_SLOTS      256
+
 typedef struct KVMSlot
 {
     target_phys_addr_t start_addr;
@@ -61,16 +71,34 @@ typedef struct KVMSlot
     void *ram;
     int slot;
     int flags;
+    /* reused across KVM_GET_DIRTY_LOG calls until the slot goes away */
+    unsigned long *dirty_bmap;
+    unsigned long dirty_bmap_size;
 } KVMSlot;
 
 typedef struct kvm_dirty_log KVMDirtyLog;
 
+/* Written only by the vCPU thread, read racily by the monitor */
+typedef struct KVMExitStats {
+    uint64_t reasons[KVM_EXIT_STATS_NR + 1];
+    uint64_t signals;       /* KVM_RUN interrupted by a signal */
+    unsigned sample_tick;
+} KVMExitStats;
+
+typedef struct KVMHotAddr {
+    bool pio;
+    bool used;
+    uint64_t addr;
+    uint64_t samples;
+} KVMHotAddr;
+
 struct KVMState
 {
     KVMSlot slots[32];
     int fd;
     int vmfd;
     int coalesced_mmio;
+    int coalesced_pio;
     struct kvm_coalesced_mmio_ring *coalesced_mmio_ring;
     bool coalesced_flush_in_progress;
     int broken_set_mem_region;
@@ -96,6 +124,10 @@ struct KVMState
     QTAILQ_HEAD(msi_hashtab, KVMMSIRoute) msi_hashtab[KVM_MSI_HASHTAB_SIZE];
     bool direct_msi;
 #endif
+    /* sampled I/O exit addresses, an open-addressed hash table */
+    QemuMutex hot_lock;
+    KVMHotAddr hot[KVM_HOT_ADDR_SLOTS];
+    uint64_t hot_dropped;
 };
 
 KVMState *kvm_state;
@@ -226,6 +258,7 @@ int kvm_init_vcpu(CPUArchState *env)
     env->kvm_fd = ret;
     env->kvm_state = s;
     env->kvm_vcpu_dirty = 1;
+    env->kvm_exit_stats = g_malloc0(sizeof(KVMExitStats));
 
     mmap_size = kvm_ioctl(s, KVM_GET_VCPU_MMAP_SIZE, 0);
     if (mmap_size < 0) {
@@ -352,15 +385,147 @@ static int kvm_set_migration_log(int enable)
     return 0;
 }
 
-/* get kvm's dirty pages bitmap and update qemu's */
+/* Large slots are harvested in chunks of this many pages, which a small
+ * pool of threads merges into the dirty bitmaps in parallel.  Chunks are
+ * a multiple of the bitmap word size so that each stays word-aligned.
+ */
+#define KVM_DIRTY_CHUNK_PAGES   (1ul << 18)
+#define KVM_DIRTY_MAX_THREADS   4
+
+typedef struct KVMDirtyJob {
+    MemoryRegion *mr;
+    target_phys_addr_t offset;
+    unsigned long *bitmap;
+    uint64_t pages;
+    unsigned long nr_chunks;
+    unsigned long next_chunk;
+    int users;
+} KVMDirtyJob;
+
+static QemuMutex kvm_dirty_lock;
+static QemuCond kvm_dirty_cond;
+static QemuCond kvm_dirty_done_cond;
+static KVMDirtyJob *kvm_dirty_job;
+static unsigned kvm_dirty_gen;
+static int kvm_dirty_threads = -1;
+
+static void kvm_dirty_harvest(KVMDirtyJob *job)
+{
+    unsigned long chunk;
+    uint64_t first;
+
+    while ((chunk = __sync_fetch_and_add(&job->next_chunk, 1)) <
+           job->nr_chunks) {
+        first = (uint64_t)chunk * KVM_DIRTY_CHUNK_PAGES;
+        memory_region_set_dirty_lebitmap(job->mr,
+                                         job->offset +
+                                         (first << TARGET_PAGE_BITS),
+                                         job->bitmap + BIT_WORD(first),
+                                         MIN(KVM_DIRTY_CHUNK_PAGES,
+                                             job->pages - first));
+    }
+}
+
+static void *kvm_dirty_thread_fn(void *opaque)
+{
+    unsigned gen = 0;
+    KVMDirtyJob *job;
+
+    qemu_mutex_lock(&kvm_dirty_lock);
+    for (;;) {
+        while (!kvm_dirty_job || kvm_dirty_gen == gen) {
+            qemu_cond_wait(&kvm_dirty_cond, &kvm_dirty_lock);
+        }
+        gen = kvm_dirty_gen;
+        job = kvm_dirty_job;
+        job->users++;
+        qemu_mutex_unlock(&kvm_dirty_lock);
+
+        kvm_dirty_harvest(job);
+
+        qemu_mutex_lock(&kvm_dirty_lock);
+        if (--job->users == 0) {
+            qemu_cond_signal(&kvm_dirty_done_cond);
+        }
+    }
+    return NULL;
+}
+
+/* The pool is started on first use so that it is not lost across
+ * -daemonize.  Returns the number of helper threads.
+ */
+static int kvm_dirty_threads_init(void)
+{
+    QemuThread thread;
+    long cpus;
+    int i;
+
+    if (kvm_dirty_threads >= 0) {
+        return kvm_dirty_threads;
+    }
+
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    kvm_dirty_threads = MIN(MAX(cpus - 1, 0), KVM_DIRTY_MAX_THREADS);
+    qemu_mutex_init(&kvm_dirty_lock);
+    qemu_cond_init(&kvm_dirty_cond);
+    qemu_cond_init(&kvm_dirty_done_cond);
+    for (i = 0; i < kvm_dirty_threads; i++) {
+        qemu_thread_create(&thread, kvm_dirty_thread_fn, NULL,
+                           QEMU_THREAD_DETACHED);
+    }
+    return kvm_dirty_threads;
+}
+
+static void kvm_dirty_harvest_parallel(KVMDirtyJob *job)
+{
+    if (job->nr_chunks <= 2 || kvm_dirty_threads_init() == 0) {
+        kvm_dirty_harvest(job);
+        return;
+    }
+
+    qemu_mutex_lock(&kvm_dirty_lock);
+    kvm_dirty_job = job;
+    kvm_dirty_gen++;
+    qemu_cond_broadcast(&kvm_dirty_cond);
+    qemu_mutex_unlock(&kvm_dirty_lock);
+
+    kvm_dirty_harvest(job);
+
+    /* every chunk is claimed; wait for the helpers still working on one */
+    qemu_mutex_lock(&kvm_dirty_lock);
+    kvm_dirty_job = NULL;
+    while (job->users) {
+        qemu_cond_wait(&kvm_dirty_done_cond, &kvm_dirty_lock);
+    }
+    qemu_mutex_unlock(&kvm_dirty_lock);
+}
+
+/* get kvm's dirty pages bitmap for @mem and update qemu's */
 static int kvm_get_dirty_pages_log_range(MemoryRegionSection *section,
-                                         unsigned long *bitmap)
+                                         KVMSlot *mem, unsigned long *bitmap)
 {
     unsigned int i, j;
     unsigned long page_number, c;
-    target_phys_addr_t addr, addr1;
-    unsigned int len = ((section->size / TARGET_PAGE_SIZE) + HOST_LONG_BITS - 1) / HOST_LONG_BITS;
+    target_phys_addr_t addr, addr1, offset;
+    uint64_t pages = mem->memory_size >> TARGET_PAGE_BITS;
+    unsigned int len = (pages + HOST_LONG_BITS - 1) / HOST_LONG_BITS;
     unsigned long hpratio = getpagesize() / TARGET_PAGE_SIZE;
+    KVMDirtyJob job;
+
+    offset = section->offset_within_region +
+             (mem->start_addr - section->offset_within_address_space);
+
+    if (hpratio == 1) {
+        job.mr = section->mr;
+        job.offset = offset;
+        job.bitmap = bitmap;
+        job.pages = pages;
+        job.nr_chunks = DIV_ROUND_UP(pages, KVM_DIRTY_CHUNK_PAGES);
+        job.next_chunk = 0;
+        job.users = 0;
+        kvm_dirty_harvest_parallel(&job);
+        return 0;
+    }
 
     /*
      * bitmap-traveling is faster than memory-traveling (for addr...)
@@ -374,7 +539,7 @@ static int kvm_get_dirty_pages_log_range(MemoryRegionSection *section,
                 c &= ~(1ul << j);
                 page_number = (i * HOST_LONG_BITS + j) * hpratio;
                 addr1 = page_number * TARGET_PAGE_SIZE;
-                addr = section->offset_within_region + addr1;
+                addr = offset + addr1;
                 memory_region_set_dirty(section->mr, addr,
                                         TARGET_PAGE_SIZE * hpratio);
             } while (c != 0);
@@ -397,14 +562,13 @@ static int kvm_get_dirty_pages_log_range(MemoryRegionSection *section,
 static int kvm_physical_sync_dirty_bitmap(MemoryRegionSection *section)
 {
     KVMState *s = kvm_state;
-    unsigned long size, allocated_size = 0;
+    unsigned long size;
     KVMDirtyLog d;
     KVMSlot *mem;
     int ret = 0;
     target_phys_addr_t start_addr = section->offset_within_address_space;
     target_phys_addr_t end_addr = start_addr + section->size;
 
-    d.dirty_bitmap = NULL;
     while (start_addr < end_addr) {
         mem = kvm_lookup_overlapping_slot(s, start_addr, end_addr);
         if (mem == NULL) {
@@ -425,14 +589,14 @@ static int kvm_physical_sync_dirty_bitmap(MemoryRegionSection *section)
          */
         size = ALIGN(((mem->memory_size) >> TARGET_PAGE_BITS),
                      /*HOST_LONG_BITS*/ 64) / 8;
-        if (!d.dirty_bitmap) {
-            d.dirty_bitmap = g_malloc(size);
-        } else if (size > allocated_size) {
-            d.dirty_bitmap = g_realloc(d.dirty_bitmap, size);
+        if (size > mem->dirty_bmap_size) {
+            g_free(mem->dirty_bmap);
+            mem->dirty_bmap = g_malloc0(size);
+            mem->dirty_bmap_size = size;
         }
-        allocated_size = size;
-        memset(d.dirty_bitmap, 0, allocated_size);
 
+        /* the kernel overwrites the whole bitmap, no need to clear it */
+        d.dirty_bitmap = mem->dirty_bmap;
         d.slot = mem->slot;
 
         if (kvm_vm_ioctl(s, KVM_GET_DIRTY_LOG, &d) == -1) {
@@ -441,10 +605,9 @@ static int kvm_physical_sync_dirty_bitmap(MemoryRegionSection *section)
             break;
         }
 
-        kvm_get_dirty_pages_log_range(section, d.dirty_bitmap);
+        kvm_get_dirty_pages_log_range(section, mem, mem->dirty_bmap);
         start_addr = mem->start_addr + mem->memory_size;
     }
-    g_free(d.dirty_bitmap);
 
     return ret;
 }
@@ -485,6 +648,42 @@ int kvm_uncoalesce_mmio_region(target_phys_addr_t start, ram_addr_t size)
     return ret;
 }
 
+int kvm_coalesce_pio_region(uint32_t start, uint32_t size)
+{
+    int ret = -ENOSYS;
+    KVMState *s = kvm_state;
+
+    if (s->coalesced_pio) {
+        struct kvm_coalesced_mmio_zone zone;
+
+        zone.addr = start;
+        zone.size = size;
+        zone.pio = 1;
+
+        ret = kvm_vm_ioctl(s, KVM_REGISTER_COALESCED_MMIO, &zone);
+    }
+
+    return ret;
+}
+
+int kvm_uncoalesce_pio_region(uint32_t start, uint32_t size)
+{
+    int ret = -ENOSYS;
+    KVMState *s = kvm_state;
+
+    if (s->coalesced_pio) {
+        struct kvm_coalesced_mmio_zone zone;
+
+        zone.addr = start;
+        zone.size = size;
+        zone.pio = 1;
+
+        ret = kvm_vm_ioctl(s, KVM_UNREGISTER_COALESCED_MMIO, &zone);
+    }
+
+    return ret;
+}
+
 int kvm_check_extension(KVMState *s, unsigned int extension)
 {
     int ret;
@@ -599,6 +798,9 @@ static void kvm_set_phys_mem(MemoryRegionSection *section, bool add)
         }
 
         /* unregister the overlapping slot */
+        g_free(mem->dirty_bmap);
+        mem->dirty_bmap = NULL;
+        mem->dirty_bmap_size = 0;
         mem->memory_size = 0;
         err = kvm_set_user_memory_region(s, mem);
         if (err) {
@@ -1247,6 +1449,7 @@ int kvm_init(void)
     int max_vcpus;
 
     s = g_malloc0(sizeof(KVMState));
+    qemu_mutex_init(&s->hot_lock);
 
     /*
      * On systems where the kernel can support different base page
@@ -1316,6 +1519,8 @@ int kvm_init(void)
     }
 
     s->coalesced_mmio = kvm_check_extension(s, KVM_CAP_COALESCED_MMIO);
+    s->coalesced_pio = s->coalesced_mmio &&
+                       kvm_check_extension(s, KVM_CAP_COALESCED_PIO);
 
     s->broken_set_mem_region = 1;
     ret = kvm_check_extension(s, KVM_CAP_JOIN_MEMORY_REGIONS_WORKS);
@@ -1420,6 +1625,69 @@ static void kvm_handle_io(uint16_t port, void *data, int direction, int size,
     }
 }
 
+/* Try to handle an I/O exit on a lockless region without the global
+ * mutex.  Accesses queued in the coalesced MMIO ring must be done first,
+ * which needs the global mutex.
+ */
+static bool kvm_handle_io_lockless(KVMState *s, struct kvm_run *run)
+{
+    struct kvm_coalesced_mmio_ring *ring = s->coalesced_mmio_ring;
+    MemoryRegion *as;
+    target_phys_addr_t addr;
+    unsigned size;
+    uint8_t *ptr;
+    bool is_write;
+    uint64_t val;
+
+    if (ring && ring->first != ring->last) {
+        return false;
+    }
+    switch (run->exit_reason) {
+    case KVM_EXIT_IO:
+        if (run->io.count != 1) {
+            return false;
+        }
+        as = get_system_io();
+        addr = run->io.port;
+        size = run->io.size;
+        ptr = (uint8_t *)run + run->io.data_offset;
+        is_write = run->io.direction == KVM_EXIT_IO_OUT;
+        break;
+    case KVM_EXIT_MMIO:
+        as = get_system_memory();
+        addr = run->mmio.phys_addr;
+        size = run->mmio.len;
+        ptr = run->mmio.data;
+        is_write = run->mmio.is_write;
+        break;
+    default:
+        return false;
+    }
+    if ((size != 1 && size != 2 && size != 4) || (addr & (size - 1))) {
+        return false;
+    }
+
+    if (is_write) {
+        val = size == 1 ? ldub_p(ptr) : size == 2 ? lduw_p(ptr) : ldl_p(ptr);
+        return io_mem_access_lockless(as, addr, &val, size, true);
+    }
+    if (!io_mem_access_lockless(as, addr, &val, size, false)) {
+        return false;
+    }
+    switch (size) {
+    case 1:
+        stb_p(ptr, val);
+        break;
+    case 2:
+        stw_p(ptr, val);
+        break;
+    case 4:
+        stl_p(ptr, val);
+        break;
+    }
+    return true;
+}
+
 static int kvm_handle_internal_error(CPUArchState *env, struct kvm_run *run)
 {
     fprintf(stderr, "KVM internal error.");
@@ -1459,15 +1727,23 @@ void kvm_flush_coalesced_mmio_buffer(void)
 
     if (s->coalesced_mmio_ring) {
         struct kvm_coalesced_mmio_ring *ring = s->coalesced_mmio_ring;
+
+        memory_set_coalesced_replay(true);
         while (ring->first != ring->last) {
             struct kvm_coalesced_mmio *ent;
 
             ent = &ring->coalesced_mmio[ring->first];
 
-            cpu_physical_memory_write(ent->phys_addr, ent->data, ent->len);
+            if (ent->pio == 1) {
+                kvm_handle_io(ent->phys_addr, ent->data, KVM_EXIT_IO_OUT,
+                              ent->len, 1);
+            } else {
+                cpu_physical_memory_write(ent->phys_addr, ent->data, ent->len);
+            }
             smp_wmb();
             ring->first = (ring->first + 1) % KVM_COALESCED_MMIO_MAX;
         }
+        memory_set_coalesced_replay(false);
     }
 
     s->coalesced_flush_in_progress = false;
@@ -1492,20 +1768,192 @@ void kvm_cpu_synchronize_state(CPUArchState *env)
 
 void kvm_cpu_synchronize_post_reset(CPUArchState *env)
 {
+    if (!env->kvm_state) {
+        /* parked, loaded when the vCPU is created */
+        return;
+    }
     kvm_arch_put_registers(env, KVM_PUT_RESET_STATE);
     env->kvm_vcpu_dirty = 0;
 }
 
 void kvm_cpu_synchronize_post_init(CPUArchState *env)
 {
+    if (!env->kvm_state) {
+        return;
+    }
     kvm_arch_put_registers(env, KVM_PUT_FULL_STATE);
     env->kvm_vcpu_dirty = 0;
 }
 
+static const char *const kvm_exit_reason_names[KVM_EXIT_STATS_NR + 1] = {
+    [KVM_EXIT_UNKNOWN] = "unknown",
+    [KVM_EXIT_EXCEPTION] = "exception",
+    [KVM_EXIT_IO] = "io",
+    [KVM_EXIT_HYPERCALL] = "hypercall",
+    [KVM_EXIT_DEBUG] = "debug",
+    [KVM_EXIT_HLT] = "hlt",
+    [KVM_EXIT_MMIO] = "mmio",
+    [KVM_EXIT_IRQ_WINDOW_OPEN] = "irq-window-open",
+    [KVM_EXIT_SHUTDOWN] = "shutdown",
+    [KVM_EXIT_FAIL_ENTRY] = "fail-entry",
+    [KVM_EXIT_INTR] = "intr",
+    [KVM_EXIT_SET_TPR] = "set-tpr",
+    [KVM_EXIT_TPR_ACCESS] = "tpr-access",
+    [KVM_EXIT_S390_SIEIC] = "s390-sieic",
+    [KVM_EXIT_S390_RESET] = "s390-reset",
+    [KVM_EXIT_DCR] = "dcr",
+    [KVM_EXIT_NMI] = "nmi",
+    [KVM_EXIT_INTERNAL_ERROR] = "internal-error",
+    [KVM_EXIT_OSI] = "osi",
+    [KVM_EXIT_PAPR_HCALL] = "papr-hcall",
+    [KVM_EXIT_S390_UCONTROL] = "s390-ucontrol",
+    [KVM_EXIT_STATS_NR] = "other",
+};
+
+static void kvm_sample_hot_addr(KVMState *s, bool pio, uint64_t addr)
+{
+    unsigned i, h = (addr >> (pio ? 0 : 2)) * 2654435761u + pio;
+    KVMHotAddr *e;
+
+    qemu_mutex_lock(&s->hot_lock);
+    for (i = 0; i < KVM_HOT_ADDR_SLOTS; i++) {
+        e = &s->hot[(h + i) % KVM_HOT_ADDR_SLOTS];
+        if (!e->used) {
+            e->used = true;
+            e->pio = pio;
+            e->addr = addr;
+        }
+        if (e->pio == pio && e->addr == addr) {
+            e->samples++;
+            break;
+        }
+    }
+    if (i == KVM_HOT_ADDR_SLOTS) {
+        s->hot_dropped++;
+    }
+    qemu_mutex_unlock(&s->hot_lock);
+}
+
+/* Called without the global mutex right after KVM_RUN returns */
+static void kvm_account_exit(CPUArchState *env, struct kvm_run *run,
+                             int run_ret)
+{
+    KVMExitStats *stats = env->kvm_exit_stats;
+
+    if (run_ret < 0) {
+        stats->signals++;
+        return;
+    }
+    stats->reasons[MIN(run->exit_reason, KVM_EXIT_STATS_NR)]++;
+    if (run->exit_reason != KVM_EXIT_IO && run->exit_reason != KVM_EXIT_MMIO) {
+        return;
+    }
+    if (++stats->sample_tick < KVM_EXIT_SAMPLE_INTERVAL) {
+        return;
+    }
+    stats->sample_tick = 0;
+    if (run->exit_reason == KVM_EXIT_IO) {
+        kvm_sample_hot_addr(env->kvm_state, true, run->io.port);
+    } else {
+        kvm_sample_hot_addr(env->kvm_state, false, run->mmio.phys_addr);
+    }
+}
+
+static int kvm_hot_addr_compare(const void *a, const void *b)
+{
+    const KVMHotAddr *ea = a, *eb = b;
+
+    if (ea->samples != eb->samples) {
+        return ea->samples > eb->samples ? -1 : 1;
+    }
+    return 0;
+}
+
+KvmExitInfo *qmp_query_kvm_exits(bool has_limit, int64_t limit, Error **errp)
+{
+    KvmExitInfo *info = g_malloc0(sizeof(*info));
+    KvmVcpuExitsList *cpu_head = NULL, **cpu_tail = &cpu_head;
+    KvmHotAddressList *hot_head = NULL, **hot_tail = &hot_head;
+    KVMState *s = kvm_state;
+    KVMHotAddr *hot;
+    CPUArchState *env;
+    MemoryRegionSection section;
+    int i, n;
+
+    info->sample_interval = KVM_EXIT_SAMPLE_INTERVAL;
+    if (!kvm_enabled()) {
+        return info;
+    }
+
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        KVMExitStats *stats = env->kvm_exit_stats;
+        KvmVcpuExitsList *entry;
+        KvmExitCountList **tail;
+
+        if (!stats) {
+            /* parked, no vCPU yet */
+            continue;
+        }
+
+        entry = g_malloc0(sizeof(*entry));
+        entry->value = g_malloc0(sizeof(*entry->value));
+        tail = &entry->value->exits;
+        entry->value->cpu = env->cpu_index;
+        entry->value->signals = stats->signals;
+        for (i = 0; i <= KVM_EXIT_STATS_NR; i++) {
+            KvmExitCountList *count;
+
+            entry->value->total += stats->reasons[i];
+            if (!stats->reasons[i]) {
+                continue;
+            }
+            count = g_malloc0(sizeof(*count));
+            count->value = g_malloc0(sizeof(*count->value));
+            count->value->reason = g_strdup(kvm_exit_reason_names[i]);
+            count->value->count = stats->reasons[i];
+            *tail = count;
+            tail = &count->next;
+        }
+        *cpu_tail = entry;
+        cpu_tail = &entry->next;
+    }
+    info->vcpus = cpu_head;
+
+    hot = g_new(KVMHotAddr, KVM_HOT_ADDR_SLOTS);
+    qemu_mutex_lock(&s->hot_lock);
+    memcpy(hot, s->hot, sizeof(s->hot));
+    info->dropped = s->hot_dropped;
+    qemu_mutex_unlock(&s->hot_lock);
+    qsort(hot, KVM_HOT_ADDR_SLOTS, sizeof(*hot), kvm_hot_addr_compare);
+
+    n = has_limit ? MIN(MAX(limit, 0), KVM_HOT_ADDR_SLOTS) : 10;
+    for (i = 0; i < n && hot[i].samples; i++) {
+        KvmHotAddressList *entry = g_malloc0(sizeof(*entry));
+
+        entry->value = g_malloc0(sizeof(*entry->value));
+        entry->value->space = hot[i].pio ? KVM_IO_SPACE_PIO : KVM_IO_SPACE_MMIO;
+        entry->value->addr = hot[i].addr;
+        entry->value->samples = hot[i].samples;
+        section = memory_region_find(hot[i].pio ? get_system_io()
+                                                : get_system_memory(),
+                                     hot[i].addr, 1);
+        entry->value->region = g_strdup(section.mr ? section.mr->name
+                                                   : "unassigned");
+        *hot_tail = entry;
+        hot_tail = &entry->next;
+    }
+    g_free(hot);
+    info->hot = hot_head;
+
+    return info;
+}
+
 int kvm_cpu_exec(CPUArchState *env)
 {
     struct kvm_run *run = env->kvm_run;
     int ret, run_ret;
+    bool handled;
+    int64_t run_start, exit_start = 0;
 
     DPRINTF("kvm_cpu_exec()\n");
 
@@ -1532,7 +1980,15 @@ int kvm_cpu_exec(CPUArchState *env)
         }
         qemu_mutex_unlock_iothread();
 
+        run_start = get_clock();
+        if (exit_start) {
+            env->time_stats.kvm_exit_ns += run_start - exit_start;
+        }
         run_ret = kvm_vcpu_ioctl(env, KVM_RUN, 0);
+        exit_start = get_clock();
+        env->time_stats.kvm_run_ns += exit_start - run_start;
+        kvm_account_exit(env, run, run_ret);
+        handled = run_ret >= 0 && kvm_handle_io_lockless(kvm_state, run);
 
         qemu_mutex_lock_iothread();
         kvm_arch_post_run(env, run);
@@ -1550,6 +2006,11 @@ int kvm_cpu_exec(CPUArchState *env)
             abort();
         }
 
+        if (handled) {
+            ret = 0;
+            continue;
+        }
+
         switch (run->exit_reason) {
         case KVM_EXIT_IO:
             DPRINTF("handle_io\n");
@@ -1592,6 +2053,10 @@ int kvm_cpu_exec(CPUArchState *env)
         }
     } while (ret == 0);
 
+    if (exit_start) {
+        env->time_stats.kvm_exit_ns += get_clock() - exit_start;
+    }
+
     if (ret < 0) {
         cpu_dump_state(env, stderr, fprintf, CPU_DUMP_CODE);
         vm_stop(RUN_STATE_INTERNAL_ERROR);
@@ -1768,6 +2233,10 @@ int kvm_update_guest_debug(CPUArchState *env, unsigned long reinject_trap)
 {
     struct kvm_set_guest_debug_data data;
 
+    if (!env->kvm_state) {
+        return 0;
+    }
+
     data.dbg.control = reinject_trap;
 
     if (env->singlestep_enabled) {
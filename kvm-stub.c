@@ -16,6 +16,7 @@
 #include "cpu.h"
 #include "gdbstub.h"
 #include "kvm.h"
+#include "qmp-commands.h"
 
 KVMState *kvm_state;
 bool kvm_kernel_irqchip;
@@ -39,11 +40,26 @@ int kvm_uncoalesce_mmio_region(target_phys_addr_t start, ram_addr_t size)
     return -ENOSYS;
 }
 
+int kvm_coalesce_pio_region(uint32_t start, uint32_t size)
+{
+    return -ENOSYS;
+}
+
+int kvm_uncoalesce_pio_region(uint32_t start, uint32_t size)
+{
+    return -ENOSYS;
+}
+
 int kvm_init(void)
 {
     return -ENOSYS;
 }
 
+KvmExitInfo *qmp_query_kvm_exits(bool has_limit, int64_t limit, Error **errp)
+{
+    return g_malloc0(sizeof(KvmExitInfo));
+}
+
 void kvm_flush_coalesced_mmio_buffer(void)
 {
 }
@@ -132,6 +148,11 @@ int kvm_on_sigbus(int code, void *addr)
     return 1;
 }
 
+int kvm_irqchip_send_msi(KVMState *s, MSIMessage msg)
+{
+    return -ENOSYS;
+}
+
 int kvm_irqchip_add_msi_route(KVMState *s, MSIMessage msg)
 {
     return -ENOSYS;
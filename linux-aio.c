@@ -35,10 +35,18 @@ struct qemu_laiocb {
     QLIST_ENTRY(qemu_laiocb) node;
 };
 
+/* Requests submitted while plugged, for a single io_submit() */
+typedef struct LaioQueue {
+    struct iocb *iocbs[MAX_EVENTS];
+    int plugged;
+    unsigned int n;
+} LaioQueue;
+
 struct qemu_laio_state {
     io_context_t ctx;
     int efd;
     int count;
+    LaioQueue io_q;
 };
 
 static inline ssize_t io_event_ret(struct io_event *ev)
@@ -76,29 +84,30 @@ static void qemu_laio_process_completion(struct qemu_laio_state *s,
     qemu_aio_release(laiocb);
 }
 
+/*
+ * Reap everything that has completed, in batches of MAX_EVENTS.  This
+ * also picks up the requests that complete while the earlier ones are
+ * processed, which then do not need a trip through the event loop.
+ */
 static void qemu_laio_completion_cb(void *opaque)
 {
     struct qemu_laio_state *s = opaque;
+    struct io_event events[MAX_EVENTS];
+    struct timespec ts = { 0 };
+    uint64_t val;
+    ssize_t ret;
+    int nevents, i;
 
-    while (1) {
-        struct io_event events[MAX_EVENTS];
-        uint64_t val;
-        ssize_t ret;
-        struct timespec ts = { 0 };
-        int nevents, i;
-
-        do {
-            ret = read(s->efd, &val, sizeof(val));
-        } while (ret == -1 && errno == EINTR);
-
-        if (ret == -1 && errno == EAGAIN)
-            break;
+    do {
+        ret = read(s->efd, &val, sizeof(val));
+    } while (ret == -1 && errno == EINTR);
 
-        if (ret != 8)
-            break;
+    if (ret != 8)
+        return;
 
+    do {
         do {
-            nevents = io_getevents(s->ctx, val, MAX_EVENTS, events, &ts);
+            nevents = io_getevents(s->ctx, 0, MAX_EVENTS, events, &ts);
         } while (nevents == -EINTR);
 
         for (i = 0; i < nevents; i++) {
@@ -109,6 +118,50 @@ static void qemu_laio_completion_cb(void *opaque)
             laiocb->ret = io_event_ret(&events[i]);
             qemu_laio_process_completion(s, laiocb);
         }
+    } while (nevents == MAX_EVENTS);
+}
+
+/*
+ * Submit the queued requests.  Those that the kernel refuses complete
+ * right away with its error.
+ */
+static void ioq_submit(struct qemu_laio_state *s)
+{
+    unsigned int i = 0, n = s->io_q.n;
+    int ret = 0;
+
+    s->io_q.n = 0;
+    while (i < n) {
+        ret = io_submit(s->ctx, n - i, &s->io_q.iocbs[i]);
+        if (ret <= 0) {
+            break;
+        }
+        i += ret;
+    }
+
+    for (; i < n; i++) {
+        struct qemu_laiocb *laiocb =
+                container_of(s->io_q.iocbs[i], struct qemu_laiocb, iocb);
+
+        laiocb->ret = ret < 0 ? ret : -EIO;
+        qemu_laio_process_completion(s, laiocb);
+    }
+}
+
+void laio_io_plug(void *aio_ctx)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    s->io_q.plugged++;
+}
+
+void laio_io_unplug(void *aio_ctx)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    assert(s->io_q.plugged > 0);
+    if (--s->io_q.plugged == 0 && s->io_q.n) {
+        ioq_submit(s);
     }
 }
 
@@ -128,6 +181,14 @@ static void laio_cancel(BlockDriverAIOCB *blockacb)
     if (laiocb->ret != -EINPROGRESS)
         return;
 
+    /* a request that is still queued would never complete */
+    if (laiocb->ctx->io_q.n) {
+        ioq_submit(laiocb->ctx);
+        if (laiocb->ret != -EINPROGRESS) {
+            return;
+        }
+    }
+
     /*
      * Note that as of Linux 2.6.31 neither the block device code nor any
      * filesystem implements cancellation of AIO request.
@@ -189,6 +250,14 @@ BlockDriverAIOCB *laio_submit(BlockDriverState *bs, void *aio_ctx, int fd,
     io_set_eventfd(&laiocb->iocb, s->efd);
     s->count++;
 
+    if (s->io_q.plugged) {
+        if (s->io_q.n == MAX_EVENTS) {
+            ioq_submit(s);
+        }
+        s->io_q.iocbs[s->io_q.n++] = iocbs;
+        return &laiocb->common;
+    }
+
     if (io_submit(s->ctx, 1, &iocbs) < 0)
         goto out_dec_count;
     return &laiocb->common;
@@ -224,3 +293,18 @@ out_free_state:
     g_free(s);
     return NULL;
 }
+
+void laio_detach_aio_context(void *s_, AioContext *old_context)
+{
+    struct qemu_laio_state *s = s_;
+
+    aio_set_fd_handler(old_context, s->efd, NULL, NULL, NULL, NULL);
+}
+
+void laio_attach_aio_context(void *s_, AioContext *new_context)
+{
+    struct qemu_laio_state *s = s_;
+
+    aio_set_fd_handler(new_context, s->efd, qemu_laio_completion_cb, NULL,
+                       qemu_laio_flush_cb, s);
+}
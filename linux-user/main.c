@@ -32,6 +32,7 @@
 #include "cpu.h"
 #include "tcg.h"
 #include "qemu-timer.h"
+#include "qemu-barrier.h"
 #include "envlist.h"
 #include "elf.h"
 
@@ -43,6 +44,7 @@ int singlestep;
 const char *filename;
 const char *argv0;
 int gdbstub_port;
+static const char *tb_cache_dir;
 envlist_t *envlist;
 const char *cpu_model;
 unsigned long mmap_min_addr;
@@ -254,6 +256,49 @@ void cpu_list_unlock(void)
 }
 #endif
 
+/* Compare and swap @size bytes of guest memory with a host atomic
+   operation, so that the other threads need not be stopped.  Returns 1
+   if @val was stored, 0 if the memory did not hold @cmp, and -1 if the
+   access is unaligned or would fault, in which case the caller falls
+   back to an exclusive section.  Must only be called from outside
+   cpu_exec, like start_exclusive.  */
+static int __attribute__((unused))
+guest_cmpxchg(abi_ulong addr, int size, uint64_t cmp, uint64_t val)
+{
+    void *host = g2h(addr);
+    int ret = -1;
+
+    if (addr & (size - 1)) {
+        return -1;
+    }
+    /* the mmap lock keeps the page mapped until the operation is done */
+    mmap_lock();
+    if (access_ok(VERIFY_WRITE, addr, size)) {
+        switch (size) {
+        case 1:
+            ret = __sync_bool_compare_and_swap((uint8_t *)host, (uint8_t)cmp,
+                                               (uint8_t)val);
+            break;
+        case 2:
+            ret = __sync_bool_compare_and_swap((uint16_t *)host,
+                                               tswap16(cmp), tswap16(val));
+            break;
+        case 4:
+            ret = __sync_bool_compare_and_swap((uint32_t *)host,
+                                               tswap32(cmp), tswap32(val));
+            break;
+#if HOST_LONG_BITS >= 64
+        case 8:
+            ret = __sync_bool_compare_and_swap((uint64_t *)host,
+                                               tswap64(cmp), tswap64(val));
+            break;
+#endif
+        }
+    }
+    mmap_unlock();
+    return ret;
+}
+
 
 #ifdef TARGET_I386
 /***********************************************************/
@@ -510,14 +555,12 @@ static void arm_kernel_cmpxchg64_helper(CPUARMState *env)
     uint64_t oldval, newval, val;
     uint32_t addr, cpsr;
     target_siginfo_t info;
+    int ret;
 
     /* Based on the 32 bit code in do_kernel_trap */
 
-    /* XXX: This only works between threads, not between processes.
-       It's probably possible to implement this with native host
-       operations. However things like ldrex/strex are much harder so
-       there's not much point trying.  */
-    start_exclusive();
+    /* XXX: The fallback only works between threads, not between
+       processes.  */
     cpsr = cpsr_read(env);
     addr = env->regs[2];
 
@@ -531,19 +574,24 @@ static void arm_kernel_cmpxchg64_helper(CPUARMState *env)
         goto segv;
     };
 
-    if (get_user_u64(val, addr)) {
-        env->cp15.c6_data = addr;
-        goto segv;
-    }
-
-    if (val == oldval) {
-        val = newval;
-
-        if (put_user_u64(val, addr)) {
+    ret = guest_cmpxchg(addr, 8, oldval, newval);
+    if (ret < 0) {
+        start_exclusive();
+        if (get_user_u64(val, addr)) {
+            end_exclusive();
             env->cp15.c6_data = addr;
             goto segv;
-        };
+        }
+        ret = val == oldval;
+        if (ret && put_user_u64(newval, addr)) {
+            end_exclusive();
+            env->cp15.c6_data = addr;
+            goto segv;
+        }
+        end_exclusive();
+    }
 
+    if (ret) {
         env->regs[0] = 0;
         cpsr |= CPSR_C;
     } else {
@@ -551,11 +599,9 @@ static void arm_kernel_cmpxchg64_helper(CPUARMState *env)
         cpsr &= ~CPSR_C;
     }
     cpsr_write(env, cpsr, CPSR_C);
-    end_exclusive();
     return;
 
 segv:
-    end_exclusive();
     /* We get the PC of the entry address - which is as good as anything,
        on a real kernel what you get depends on which mode it uses. */
     info.si_signo = SIGSEGV;
@@ -564,8 +610,6 @@ segv:
     info.si_code = TARGET_SEGV_MAPERR;
     info._sifields._sigfault._addr = env->cp15.c6_data;
     queue_signal(env, info.si_signo, &info);
-
-    end_exclusive();
 }
 
 /* Handle a jump to the kernel code page.  */
@@ -575,26 +619,31 @@ do_kernel_trap(CPUARMState *env)
     uint32_t addr;
     uint32_t cpsr;
     uint32_t val;
+    int ret;
 
     switch (env->regs[15]) {
     case 0xffff0fa0: /* __kernel_memory_barrier */
-        /* ??? No-op. Will need to do better for SMP.  */
+        smp_mb();
         break;
     case 0xffff0fc0: /* __kernel_cmpxchg */
-         /* XXX: This only works between threads, not between processes.
-            It's probably possible to implement this with native host
-            operations. However things like ldrex/strex are much harder so
-            there's not much point trying.  */
-        start_exclusive();
+        /* XXX: The fallback only works between threads, not between
+           processes.  */
         cpsr = cpsr_read(env);
         addr = env->regs[2];
-        /* FIXME: This should SEGV if the access fails.  */
-        if (get_user_u32(val, addr))
-            val = ~env->regs[0];
-        if (val == env->regs[0]) {
-            val = env->regs[1];
-            /* FIXME: Check for segfaults.  */
-            put_user_u32(val, addr);
+        ret = guest_cmpxchg(addr, 4, env->regs[0], env->regs[1]);
+        if (ret < 0) {
+            start_exclusive();
+            /* FIXME: This should SEGV if the access fails.  */
+            if (get_user_u32(val, addr))
+                val = ~env->regs[0];
+            ret = val == env->regs[0];
+            if (ret) {
+                /* FIXME: Check for segfaults.  */
+                put_user_u32(env->regs[1], addr);
+            }
+            end_exclusive();
+        }
+        if (ret) {
             env->regs[0] = 0;
             cpsr |= CPSR_C;
         } else {
@@ -602,7 +651,6 @@ do_kernel_trap(CPUARMState *env)
             cpsr &= ~CPSR_C;
         }
         cpsr_write(env, cpsr, CPSR_C);
-        end_exclusive();
         break;
     case 0xffff0fe0: /* __kernel_get_tls */
         env->regs[0] = env->cp15.c13_tls2;
@@ -1320,6 +1368,19 @@ static int do_store_exclusive(CPUPPCState *env)
     int segv = 0;
 
     addr = env->reserve_ea;
+    if (addr == env->reserve_addr) {
+        int size = (env->reserve_info >> 5) & 0xf;
+        int stored = guest_cmpxchg(addr, size, env->reserve_val,
+                                   env->gpr[env->reserve_info & 0x1f]);
+
+        if (stored >= 0) {
+            env->crf[0] = (stored << 1) | xer_so;
+            env->reserve_addr = (target_ulong)-1;
+            env->nip += 4;
+            return 0;
+        }
+    }
+
     page_addr = addr & TARGET_PAGE_MASK;
     start_exclusive();
     mmap_lock();
@@ -2145,8 +2206,19 @@ static int do_store_exclusive(CPUMIPSState *env)
     int segv = 0;
     int reg;
     int d;
+    int stored;
 
     addr = env->lladdr;
+    reg = env->llreg & 0x1f;
+    d = (env->llreg & 0x20) != 0;
+    stored = guest_cmpxchg(addr, d ? 8 : 4, env->llval, env->llnewval);
+    if (stored >= 0) {
+        env->active_tc.gpr[reg] = stored;
+        env->lladdr = -1;
+        env->active_tc.PC += 4;
+        return 0;
+    }
+
     page_addr = addr & TARGET_PAGE_MASK;
     start_exclusive();
     mmap_lock();
@@ -2154,8 +2226,6 @@ static int do_store_exclusive(CPUMIPSState *env)
     if ((flags & PAGE_READ) == 0) {
         segv = 1;
     } else {
-        reg = env->llreg & 0x1f;
-        d = (env->llreg & 0x20) != 0;
         if (d) {
             segv = get_user_s64(val, addr);
         } else {
@@ -2714,6 +2784,16 @@ static void do_store_exclusive(CPUAlphaState *env, int reg, int quad)
     env->lock_addr = -1;
     env->lock_st_addr = 0;
 
+    if (addr == tmp) {
+        ret = guest_cmpxchg(addr, quad ? 8 : 4, env->lock_value, env->ir[reg]);
+        if (ret >= 0) {
+            env->ir[reg] = ret;
+            env->pc += 4;
+            return;
+        }
+        ret = 0;
+    }
+
     start_exclusive();
     mmap_lock();
 
@@ -3196,6 +3276,11 @@ static void handle_arg_reserved_va(const char *arg)
 }
 #endif
 
+static void handle_arg_perfmap(const char *arg)
+{
+    tb_perf_map_open();
+}
+
 static void handle_arg_singlestep(const char *arg)
 {
     singlestep = 1;
@@ -3206,6 +3291,11 @@ static void handle_arg_strace(const char *arg)
     do_strace = 1;
 }
 
+static void handle_arg_tb_cache(const char *arg)
+{
+    tb_cache_dir = arg;
+}
+
 static void handle_arg_version(const char *arg)
 {
     printf("qemu-" TARGET_ARCH " version " QEMU_VERSION QEMU_PKGVERSION
@@ -3253,10 +3343,14 @@ struct qemu_argument arg_table[] = {
      "logfile",     "override default logfile location"},
     {"p",          "QEMU_PAGESIZE",    true,  handle_arg_pagesize,
      "pagesize",   "set the host page size to 'pagesize'"},
+    {"perfmap",    "QEMU_PERFMAP",     false, handle_arg_perfmap,
+     "",           "write /tmp/perf-<pid>.map for perf"},
     {"singlestep", "QEMU_SINGLESTEP",  false, handle_arg_singlestep,
      "",           "run in singlestep mode"},
     {"strace",     "QEMU_STRACE",      false, handle_arg_strace,
      "",           "log system calls"},
+    {"tb-cache",   "QEMU_TB_CACHE",    true,  handle_arg_tb_cache,
+     "dir",        "keep translated code in 'dir' across runs"},
     {"version",    "QEMU_VERSION",     false, handle_arg_version,
      "",           "display version information and exit"},
     {NULL, NULL, false, NULL, NULL, NULL}
@@ -3621,6 +3715,11 @@ int main(int argc, char **argv, char **envp)
     tcg_prologue_init(&tcg_ctx);
 #endif
 
+    /* the cache depends on the prologue and on GUEST_BASE */
+    if (tb_cache_dir && !gdbstub_port) {
+        tb_cache_init(tb_cache_dir, filename, cpu_model, info);
+    }
+
 #if defined(TARGET_I386)
     cpu_x86_set_cpl(env, 3);
 
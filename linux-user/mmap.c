@@ -80,7 +80,7 @@ void mmap_unlock(void)
 /* NOTE: all the constants are the HOST ones, but addresses are target. */
 int target_mprotect(abi_ulong start, abi_ulong len, int prot)
 {
-    abi_ulong end, host_start, host_end, addr;
+    abi_ulong end, host_start, host_end;
     int prot1, ret;
 
 #ifdef DEBUG_MMAP
@@ -106,14 +106,9 @@ int target_mprotect(abi_ulong start, abi_ulong len, int prot)
     host_end = HOST_PAGE_ALIGN(end);
     if (start > host_start) {
         /* handle host page containing start */
-        prot1 = prot;
-        for(addr = host_start; addr < start; addr += TARGET_PAGE_SIZE) {
-            prot1 |= page_get_flags(addr);
-        }
+        prot1 = prot | page_get_flags_range(host_start, start);
         if (host_end == host_start + qemu_host_page_size) {
-            for(addr = end; addr < host_end; addr += TARGET_PAGE_SIZE) {
-                prot1 |= page_get_flags(addr);
-            }
+            prot1 |= page_get_flags_range(end, host_end);
             end = host_end;
         }
         ret = mprotect(g2h(host_start), qemu_host_page_size, prot1 & PAGE_BITS);
@@ -122,10 +117,7 @@ int target_mprotect(abi_ulong start, abi_ulong len, int prot)
         host_start += qemu_host_page_size;
     }
     if (end < host_end) {
-        prot1 = prot;
-        for(addr = end; addr < host_end; addr += TARGET_PAGE_SIZE) {
-            prot1 |= page_get_flags(addr);
-        }
+        prot1 = prot | page_get_flags_range(end, host_end);
         ret = mprotect(g2h(host_end - qemu_host_page_size), qemu_host_page_size,
                        prot1 & PAGE_BITS);
         if (ret != 0)
@@ -152,7 +144,7 @@ static int mmap_frag(abi_ulong real_start,
                      abi_ulong start, abi_ulong end,
                      int prot, int flags, int fd, abi_ulong offset)
 {
-    abi_ulong real_end, addr;
+    abi_ulong real_end;
     void *host_start;
     int prot1, prot_new;
 
@@ -160,11 +152,8 @@ static int mmap_frag(abi_ulong real_start,
     host_start = g2h(real_start);
 
     /* get the protection of the target pages outside the mapping */
-    prot1 = 0;
-    for(addr = real_start; addr < real_end; addr++) {
-        if (addr < start || addr >= end)
-            prot1 |= page_get_flags(addr);
-    }
+    prot1 = page_get_flags_range(real_start, start) |
+        page_get_flags_range(end, real_end);
 
     if (prot1 == 0) {
         /* no page was there, so we allocate one */
@@ -218,13 +207,12 @@ unsigned long last_brk;
 
 #ifdef CONFIG_USE_GUEST_BASE
 /* Subroutine of mmap_find_vma, used when we have pre-allocated a chunk
-   of guest address space.  */
+   of guest address space.  All of it belongs to the guest, so the page
+   flags tell where the free space is without asking the host.  */
 static abi_ulong mmap_find_vma_reserved(abi_ulong start, abi_ulong size)
 {
     abi_ulong addr;
     abi_ulong end_addr;
-    int prot;
-    int looped = 0;
 
     if (size > RESERVED_VA) {
         return (abi_ulong)-1;
@@ -232,29 +220,17 @@ static abi_ulong mmap_find_vma_reserved(abi_ulong start, abi_ulong size)
 
     size = HOST_PAGE_ALIGN(size);
     end_addr = start + size;
-    if (end_addr > RESERVED_VA) {
+    if (end_addr > RESERVED_VA || end_addr < start) {
         end_addr = RESERVED_VA;
     }
-    addr = end_addr - qemu_host_page_size;
 
-    while (1) {
-        if (addr > end_addr) {
-            if (looped) {
-                return (abi_ulong)-1;
-            }
-            end_addr = RESERVED_VA;
-            addr = end_addr - qemu_host_page_size;
-            looped = 1;
-            continue;
-        }
-        prot = page_get_flags(addr);
-        if (prot) {
-            end_addr = addr;
-        }
-        if (addr + size == end_addr) {
-            break;
+    /* the highest hole below start, else the highest one at all */
+    addr = page_find_gap(end_addr, size, qemu_host_page_mask);
+    if (addr == (abi_ulong)-1) {
+        addr = page_find_gap(RESERVED_VA, size, qemu_host_page_mask);
+        if (addr == (abi_ulong)-1) {
+            return (abi_ulong)-1;
         }
-        addr -= qemu_host_page_size;
     }
 
     if (start == mmap_next_start) {
@@ -593,7 +569,6 @@ static void mmap_reserve(abi_ulong start, abi_ulong size)
 {
     abi_ulong real_start;
     abi_ulong real_end;
-    abi_ulong addr;
     abi_ulong end;
     int prot;
 
@@ -602,24 +577,16 @@ static void mmap_reserve(abi_ulong start, abi_ulong size)
     end = start + size;
     if (start > real_start) {
         /* handle host page containing start */
-        prot = 0;
-        for (addr = real_start; addr < start; addr += TARGET_PAGE_SIZE) {
-            prot |= page_get_flags(addr);
-        }
+        prot = page_get_flags_range(real_start, start);
         if (real_end == real_start + qemu_host_page_size) {
-            for (addr = end; addr < real_end; addr += TARGET_PAGE_SIZE) {
-                prot |= page_get_flags(addr);
-            }
+            prot |= page_get_flags_range(end, real_end);
             end = real_end;
         }
         if (prot != 0)
             real_start += qemu_host_page_size;
     }
     if (end < real_end) {
-        prot = 0;
-        for (addr = end; addr < real_end; addr += TARGET_PAGE_SIZE) {
-            prot |= page_get_flags(addr);
-        }
+        prot = page_get_flags_range(end, real_end);
         if (prot != 0)
             real_end -= qemu_host_page_size;
     }
@@ -632,7 +599,7 @@ static void mmap_reserve(abi_ulong start, abi_ulong size)
 
 int target_munmap(abi_ulong start, abi_ulong len)
 {
-    abi_ulong end, real_start, real_end, addr;
+    abi_ulong end, real_start, real_end;
     int prot, ret;
 
 #ifdef DEBUG_MMAP
@@ -652,24 +619,16 @@ int target_munmap(abi_ulong start, abi_ulong len)
 
     if (start > real_start) {
         /* handle host page containing start */
-        prot = 0;
-        for(addr = real_start; addr < start; addr += TARGET_PAGE_SIZE) {
-            prot |= page_get_flags(addr);
-        }
+        prot = page_get_flags_range(real_start, start);
         if (real_end == real_start + qemu_host_page_size) {
-            for(addr = end; addr < real_end; addr += TARGET_PAGE_SIZE) {
-                prot |= page_get_flags(addr);
-            }
+            prot |= page_get_flags_range(end, real_end);
             end = real_end;
         }
         if (prot != 0)
             real_start += qemu_host_page_size;
     }
     if (end < real_end) {
-        prot = 0;
-        for(addr = end; addr < real_end; addr += TARGET_PAGE_SIZE) {
-            prot |= page_get_flags(addr);
-        }
+        prot = page_get_flags_range(end, real_end);
         if (prot != 0)
             real_end -= qemu_host_page_size;
     }
@@ -732,12 +691,8 @@ abi_long target_mremap(abi_ulong old_addr, abi_ulong old_size,
     } else {
         int prot = 0;
         if (RESERVED_VA && old_size < new_size) {
-            abi_ulong addr;
-            for (addr = old_addr + old_size;
-                 addr < old_addr + new_size;
-                 addr++) {
-                prot |= page_get_flags(addr);
-            }
+            prot = page_get_flags_range(old_addr + old_size,
+                                        old_addr + new_size);
         }
         if (prot == 0) {
             host_addr = mremap(g2h(old_addr), old_size, new_size, flags);
@@ -197,6 +197,12 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
                     abi_long arg5, abi_long arg6, abi_long arg7,
                     abi_long arg8);
 void gemu_log(const char *fmt, ...) GCC_FMT_ATTR(1, 2);
+
+/* tbcache.c */
+void tb_cache_init(const char *dir, const char *filename,
+                   const char *cpu_model, struct image_info *info);
+void tb_cache_write(void);
+
 extern THREAD CPUArchState *thread_env;
 void cpu_loop(CPUArchState *env);
 char *target_strerror(int err);
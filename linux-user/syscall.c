@@ -202,7 +202,7 @@ static type name (type1 arg1,type2 arg2,type3 arg3,type4 arg4,type5 arg5,	\
 #define __NR_sys_inotify_rm_watch __NR_inotify_rm_watch
 
 #if defined(__alpha__) || defined (__ia64__) || defined(__x86_64__) || \
-    defined(__s390x__)
+    defined(__s390x__) || defined(__aarch64__)
 #define __NR__llseek __NR_lseek
 #endif
 
@@ -1744,6 +1744,16 @@ static abi_long do_getsockopt(int sockfd, int level, int optname,
     return ret;
 }
 
+/* Arrays of guest structures that match the host ones in size and byte
+   order are handed to the host kernel where they are, instead of being
+   converted to and from a copy on the stack.  */
+#if defined(HOST_WORDS_BIGENDIAN) == defined(TARGET_WORDS_BIGENDIAN)
+#define TARGET_LAYOUT_MATCHES(target_type, host_type) \
+    (sizeof(target_type) == sizeof(host_type))
+#else
+#define TARGET_LAYOUT_MATCHES(target_type, host_type) 0
+#endif
+
 /* FIXME
  * lock_iovec()/unlock_iovec() have a return code of 0 for success where
  * other lock functions have a return code of 0 for failure.
@@ -1777,6 +1787,7 @@ static abi_long lock_iovec(int type, struct iovec *vec, abi_ulong target_addr,
 static abi_long unlock_iovec(struct iovec *vec, abi_ulong target_addr,
                              int count, int copy)
 {
+#ifdef DEBUG_REMAP
     struct target_iovec *target_vec;
     abi_ulong base;
     int i;
@@ -1791,7 +1802,8 @@ static abi_long unlock_iovec(struct iovec *vec, abi_ulong target_addr,
         }
     }
     unlock_user (target_vec, target_addr, 0);
-
+#endif
+    /* otherwise the buffers are guest memory itself, nothing to undo */
     return 0;
 }
 
@@ -5149,6 +5161,7 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
         _mcleanup();
 #endif
         gdb_exit(cpu_env, arg1);
+        tb_cache_write();
         _exit(arg1);
         ret = 0; /* avoid warning */
         break;
@@ -5339,6 +5352,7 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
             }
             if (!(p = lock_user_string(arg1)))
                 goto execve_efault;
+            tb_cache_write();
             ret = get_errno(execve(p, argp, envp));
             unlock_user(p, arg1, 0);
 
@@ -6903,6 +6917,7 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
         _mcleanup();
 #endif
         gdb_exit(cpu_env, arg1);
+        tb_cache_write();
         ret = get_errno(exit_group(arg1));
         break;
 #endif
@@ -7127,10 +7142,14 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
             if (!target_pfd)
                 goto efault;
 
-            pfd = alloca(sizeof(struct pollfd) * nfds);
-            for(i = 0; i < nfds; i++) {
-                pfd[i].fd = tswap32(target_pfd[i].fd);
-                pfd[i].events = tswap16(target_pfd[i].events);
+            if (TARGET_LAYOUT_MATCHES(struct target_pollfd, struct pollfd)) {
+                pfd = (struct pollfd *)target_pfd;
+            } else {
+                pfd = alloca(sizeof(struct pollfd) * nfds);
+                for(i = 0; i < nfds; i++) {
+                    pfd[i].fd = tswap32(target_pfd[i].fd);
+                    pfd[i].events = tswap16(target_pfd[i].events);
+                }
             }
 
 # ifdef TARGET_NR_ppoll
@@ -7171,7 +7190,7 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
 # endif
                 ret = get_errno(poll(pfd, nfds, timeout));
 
-            if (!is_error(ret)) {
+            if (!is_error(ret) && pfd != (struct pollfd *)target_pfd) {
                 for(i = 0; i < nfds; i++) {
                     target_pfd[i].revents = tswap16(pfd[i].revents);
                 }
@@ -8751,7 +8770,12 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
             goto efault;
         }
 
-        ep = alloca(maxevents * sizeof(struct epoll_event));
+        if (TARGET_LAYOUT_MATCHES(struct target_epoll_event,
+                                  struct epoll_event)) {
+            ep = (struct epoll_event *)target_ep;
+        } else {
+            ep = alloca(maxevents * sizeof(struct epoll_event));
+        }
 
         switch (num) {
 #if defined(IMPLEMENT_EPOLL_PWAIT)
@@ -8785,7 +8809,7 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
         default:
             ret = -TARGET_ENOSYS;
         }
-        if (!is_error(ret)) {
+        if (!is_error(ret) && ep != (struct epoll_event *)target_ep) {
             int i;
             for (i = 0; i < ret; i++) {
                 target_ep[i].events = tswap32(ep[i].events);
@@ -0,0 +1,449 @@
+/*
+ * Translated code cache kept on disk across runs
+ *
+ * Copyright Red Hat, Inc. 2012
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+/* Short lived processes spend most of their time translating code that
+ * the previous run of the same binary translated already.  With -tb-cache,
+ * the host code of each TB is kept in memory together with the guest code
+ * it was translated from, and written to a file when the process exits or
+ * execs.  The next run reloads the file, and tb_gen_code() copies a TB
+ * back instead of translating it if the guest code is unchanged.
+ *
+ * The host code may only depend on its own address through the relocations
+ * that the TCG backend records (TCG_TARGET_HAS_CODE_RELOCS).  Everything
+ * else it refers to, helpers, the prologue and guest_base, must be at the
+ * same address as in the run that wrote the file, which is checked by the
+ * header.  This holds for a statically linked qemu, as used with binfmt,
+ * but not for a PIE one.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "qemu.h"
+#include "qemu-common.h"
+#include "cache-utils.h"
+#include "tcg.h"
+
+#if defined(TARGET_HAS_TB_CACHE) && defined(TCG_TARGET_HAS_CODE_RELOCS) && \
+    defined(USE_DIRECT_JUMP)
+
+#define TB_CACHE_MAGIC "QEMUTBC1"
+
+/* beyond that, records from previous runs are dropped when writing */
+#define TB_CACHE_MAX_SIZE (64 * 1024 * 1024)
+
+typedef struct TBCacheHeader {
+    char magic[8];
+    uint64_t key;           /* guest binary, CPU model, qemu binary */
+    uint64_t text;          /* host addresses the code depends on */
+    uint64_t prologue;
+    uint64_t guest_base;
+    uint32_t nb_records;
+    uint32_t pad;
+} TBCacheHeader;
+
+typedef struct TBCacheReloc {
+    uint32_t offset;
+    uint32_t type;
+    uint64_t value;         /* branch target, or offset from the TB */
+} TBCacheReloc;
+
+/* followed by the relocations, the guest code and the host code, padded
+   to a multiple of 8 bytes */
+typedef struct TBCacheRecord {
+    uint64_t pc;
+    uint64_t cs_base;
+    uint64_t flags;
+    uint32_t cflags;
+    uint32_t icount;
+    uint32_t size;          /* guest code */
+    uint32_t code_size;     /* host code */
+    uint16_t tb_next_offset[2];
+    uint16_t tb_jmp_offset[2];
+    uint32_t nb_relocs;
+    uint32_t rec_size;
+} TBCacheRecord;
+
+static bool tb_cache_enabled;
+static bool tb_cache_dirty;
+static char *tb_cache_path;
+static TBCacheHeader tb_cache_header;
+
+/* the file read at startup, and the size of the records added since */
+static uint8_t *tb_cache_file;
+static size_t tb_cache_file_size;
+static size_t tb_cache_new_size;
+
+/* open addressing on pc and flags */
+static TBCacheRecord **tb_cache_index;
+static unsigned int tb_cache_index_size;
+static unsigned int tb_cache_nb_records;
+
+static inline TBCacheReloc *rec_relocs(TBCacheRecord *rec)
+{
+    return (TBCacheReloc *)(rec + 1);
+}
+
+static inline uint8_t *rec_guest_code(TBCacheRecord *rec)
+{
+    return (uint8_t *)(rec_relocs(rec) + rec->nb_relocs);
+}
+
+static inline uint8_t *rec_host_code(TBCacheRecord *rec)
+{
+    return rec_guest_code(rec) + rec->size;
+}
+
+static inline uint32_t rec_size(uint32_t nb_relocs, uint32_t size,
+                                uint32_t code_size)
+{
+    return (sizeof(TBCacheRecord) + nb_relocs * sizeof(TBCacheReloc) +
+            size + code_size + 7) & ~7;
+}
+
+static inline bool rec_from_file(TBCacheRecord *rec)
+{
+    return (uint8_t *)rec >= tb_cache_file &&
+           (uint8_t *)rec < tb_cache_file + tb_cache_file_size;
+}
+
+static inline unsigned int tb_cache_hash(uint64_t pc, uint64_t flags)
+{
+    return ((pc ^ (flags << 17)) * 0x9e3779b97f4a7c15ull) >> 32;
+}
+
+static uint64_t fnv_hash(uint64_t h, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+
+    while (len--) {
+        h = (h ^ *p++) * 0x100000001b3ull;
+    }
+    return h;
+}
+
+static void tb_cache_insert(TBCacheRecord *rec)
+{
+    TBCacheRecord **old_index = tb_cache_index;
+    unsigned int old_size = tb_cache_index_size;
+    unsigned int i, mask;
+
+    if (2 * (tb_cache_nb_records + 1) > tb_cache_index_size) {
+        tb_cache_index_size = MAX(old_size * 2, 1024);
+        tb_cache_index = g_malloc0(tb_cache_index_size * sizeof(*old_index));
+        tb_cache_nb_records = 0;
+        for (i = 0; i < old_size; i++) {
+            if (old_index[i]) {
+                tb_cache_insert(old_index[i]);
+            }
+        }
+        g_free(old_index);
+    }
+    mask = tb_cache_index_size - 1;
+    i = tb_cache_hash(rec->pc, rec->flags) & mask;
+    while (tb_cache_index[i]) {
+        i = (i + 1) & mask;
+    }
+    tb_cache_index[i] = rec;
+    tb_cache_nb_records++;
+}
+
+/* Find a record for TB whose guest code is still the same in memory.  */
+static TBCacheRecord *tb_cache_find(TranslationBlock *tb)
+{
+    TBCacheRecord *rec;
+    unsigned int i, mask;
+
+    if (!tb_cache_index) {
+        return NULL;
+    }
+    mask = tb_cache_index_size - 1;
+    for (i = tb_cache_hash(tb->pc, tb->flags) & mask;
+         (rec = tb_cache_index[i]) != NULL; i = (i + 1) & mask) {
+        if (rec->pc == tb->pc && rec->cs_base == tb->cs_base &&
+            rec->flags == tb->flags && rec->cflags == tb->cflags &&
+            page_check_range(tb->pc, rec->size, PAGE_READ) == 0 &&
+            memcmp(g2h(tb->pc), rec_guest_code(rec), rec->size) == 0) {
+            return rec;
+        }
+    }
+    return NULL;
+}
+
+/* Breakpoints and single stepping are compiled into the code.  Other
+   compile flags are not used in user mode.  */
+static bool tb_cache_usable(CPUArchState *env, TranslationBlock *tb)
+{
+    return tb_cache_enabled && !singlestep && !env->singlestep_enabled &&
+           QTAILQ_EMPTY(&env->breakpoints) &&
+           !(tb->cflags & ~CF_SUPERBLOCK);
+}
+
+bool tb_cache_load(CPUArchState *env, TranslationBlock *tb, int *code_size)
+{
+    TBCacheRecord *rec;
+    TBCacheReloc *r;
+    uint8_t *code = tb->tc_ptr;
+    int64_t disp;
+    uint32_t i;
+
+    if (!tb_cache_usable(env, tb)) {
+        return false;
+    }
+    rec = tb_cache_find(tb);
+    if (!rec) {
+        return false;
+    }
+    memcpy(code, rec_host_code(rec), rec->code_size);
+    for (i = 0, r = rec_relocs(rec); i < rec->nb_relocs; i++, r++) {
+        switch (r->type) {
+        case TCG_CODE_RELOC_PCREL32:
+            disp = r->value - (uintptr_t)(code + r->offset + 4);
+            if (TCG_TARGET_REG_BITS == 64 && disp != (int32_t)disp) {
+                return false;
+            }
+            *(uint32_t *)(code + r->offset) = disp;
+            break;
+        case TCG_CODE_RELOC_TB_PTR:
+            *(tcg_target_ulong *)(code + r->offset) =
+                (tcg_target_ulong)(uintptr_t)tb + r->value;
+            break;
+        default:
+            return false;
+        }
+    }
+    flush_icache_range((uintptr_t)code, (uintptr_t)code + rec->code_size);
+
+    tb->size = rec->size;
+    tb->icount = rec->icount;
+    tb->tb_next_offset[0] = rec->tb_next_offset[0];
+    tb->tb_next_offset[1] = rec->tb_next_offset[1];
+    tb->tb_jmp_offset[0] = rec->tb_jmp_offset[0];
+    tb->tb_jmp_offset[1] = rec->tb_jmp_offset[1];
+    *code_size = rec->code_size;
+    return true;
+}
+
+/* Called right after TB was translated, before it is chained.  */
+void tb_cache_save(CPUArchState *env, TranslationBlock *tb, int code_size)
+{
+    TCGContext *s = &tcg_ctx;
+    TBCacheRecord *rec;
+    TBCacheReloc *r;
+    uint32_t size;
+    int i;
+
+    if (!tb_cache_usable(env, tb) || s->nb_code_relocs < 0 ||
+        tb_cache_new_size > TB_CACHE_MAX_SIZE || tb_cache_find(tb)) {
+        return;
+    }
+    size = rec_size(s->nb_code_relocs, tb->size, code_size);
+    rec = g_malloc0(size);
+    rec->pc = tb->pc;
+    rec->cs_base = tb->cs_base;
+    rec->flags = tb->flags;
+    rec->cflags = tb->cflags;
+    rec->icount = tb->icount;
+    rec->size = tb->size;
+    rec->code_size = code_size;
+    rec->tb_next_offset[0] = tb->tb_next_offset[0];
+    rec->tb_next_offset[1] = tb->tb_next_offset[1];
+    rec->tb_jmp_offset[0] = tb->tb_jmp_offset[0];
+    rec->tb_jmp_offset[1] = tb->tb_jmp_offset[1];
+    rec->nb_relocs = s->nb_code_relocs;
+    rec->rec_size = size;
+    for (i = 0, r = rec_relocs(rec); i < s->nb_code_relocs; i++, r++) {
+        r->offset = s->code_relocs[i].offset;
+        r->type = s->code_relocs[i].type;
+        r->value = (tcg_target_ulong)s->code_relocs[i].value;
+        if (r->type == TCG_CODE_RELOC_TB_PTR) {
+            /* exit_tb(tb + n); anything else is a host pointer that
+               would not survive */
+            r->value -= (uintptr_t)tb;
+            if (r->value > 3) {
+                g_free(rec);
+                return;
+            }
+        }
+    }
+    memcpy(rec_guest_code(rec), g2h(tb->pc), tb->size);
+    memcpy(rec_host_code(rec), tb->tc_ptr, code_size);
+
+    tb_cache_insert(rec);
+    tb_cache_new_size += size;
+    tb_cache_dirty = true;
+}
+
+/* Check the records of the file read at startup.  */
+static bool tb_cache_parse(void)
+{
+    TBCacheHeader *h = (TBCacheHeader *)tb_cache_file;
+    TBCacheRecord *rec;
+    size_t pos = sizeof(*h);
+    uint32_t i;
+
+    if (tb_cache_file_size < sizeof(*h) ||
+        memcmp(h, &tb_cache_header, offsetof(TBCacheHeader, nb_records))) {
+        return false;
+    }
+    for (i = 0; i < h->nb_records; i++) {
+        rec = (TBCacheRecord *)(tb_cache_file + pos);
+        if (tb_cache_file_size - pos < sizeof(*rec) ||
+            rec->nb_relocs > TCG_MAX_CODE_RELOCS ||
+            rec->size > 2 * TARGET_PAGE_SIZE ||
+            rec->code_size > TCG_MAX_OP_SIZE * OPC_BUF_SIZE ||
+            rec->rec_size != rec_size(rec->nb_relocs, rec->size,
+                                      rec->code_size) ||
+            tb_cache_file_size - pos < rec->rec_size) {
+            return false;
+        }
+        tb_cache_insert(rec);
+        pos += rec->rec_size;
+    }
+    return true;
+}
+
+static void tb_cache_read(void)
+{
+    struct stat st;
+    int fd;
+
+    fd = open(tb_cache_path, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    if (fstat(fd, &st) == 0 && st.st_size <= 2 * TB_CACHE_MAX_SIZE) {
+        tb_cache_file = g_malloc(st.st_size);
+        tb_cache_file_size = st.st_size;
+        if (read(fd, tb_cache_file, st.st_size) != st.st_size ||
+            !tb_cache_parse()) {
+            /* stale or damaged, rewrite it on exit */
+            g_free(tb_cache_index);
+            tb_cache_index = NULL;
+            tb_cache_index_size = 0;
+            tb_cache_nb_records = 0;
+            g_free(tb_cache_file);
+            tb_cache_file = NULL;
+            tb_cache_file_size = 0;
+        }
+    }
+    close(fd);
+}
+
+void tb_cache_init(const char *dir, const char *filename,
+                   const char *cpu_model, struct image_info *info)
+{
+    struct stat st;
+    uint64_t key = 0xcbf29ce484222325ull;
+
+    key = fnv_hash(key, TARGET_ARCH, strlen(TARGET_ARCH));
+    key = fnv_hash(key, cpu_model, strlen(cpu_model));
+    if (stat("/proc/self/exe", &st) < 0) {
+        return;
+    }
+    key = fnv_hash(key, &st.st_ino, sizeof(st.st_ino));
+    key = fnv_hash(key, &st.st_size, sizeof(st.st_size));
+    key = fnv_hash(key, &st.st_mtime, sizeof(st.st_mtime));
+    if (stat(filename, &st) < 0) {
+        return;
+    }
+    key = fnv_hash(key, &st.st_ino, sizeof(st.st_ino));
+    key = fnv_hash(key, &st.st_size, sizeof(st.st_size));
+    key = fnv_hash(key, &st.st_mtime, sizeof(st.st_mtime));
+    if (info->end_code > info->start_code &&
+        page_check_range(info->start_code, info->end_code - info->start_code,
+                         PAGE_READ) == 0) {
+        key = fnv_hash(key, g2h(info->start_code),
+                       info->end_code - info->start_code);
+    }
+
+    memcpy(tb_cache_header.magic, TB_CACHE_MAGIC, 8);
+    tb_cache_header.key = key;
+    tb_cache_header.text = (uintptr_t)tb_cache_init;
+    tb_cache_header.prologue = (uintptr_t)code_gen_prologue;
+    tb_cache_header.guest_base = GUEST_BASE;
+    tb_cache_path = g_strdup_printf("%s/%016" PRIx64 ".tbc", dir, key);
+
+    tb_cache_read();
+    tcg_ctx.code_relocs = g_malloc(TCG_MAX_CODE_RELOCS *
+                                   sizeof(TCGCodeReloc));
+    tb_cache_enabled = true;
+}
+
+void tb_cache_write(void)
+{
+    TBCacheHeader h = tb_cache_header;
+    TBCacheRecord *rec;
+    bool old = tb_cache_file_size + tb_cache_new_size <= TB_CACHE_MAX_SIZE;
+    char *tmp;
+    FILE *f;
+    unsigned int i;
+
+    if (!tb_cache_dirty) {
+        return;
+    }
+    tmp = g_strdup_printf("%s.%d", tb_cache_path, getpid());
+    f = fopen(tmp, "wb");
+    if (!f) {
+        g_free(tmp);
+        return;
+    }
+    spin_lock(&tb_lock);
+    h.nb_records = 0;
+    for (i = 0; i < tb_cache_index_size; i++) {
+        rec = tb_cache_index[i];
+        if (rec && (old || !rec_from_file(rec))) {
+            h.nb_records++;
+        }
+    }
+    fwrite(&h, sizeof(h), 1, f);
+    for (i = 0; i < tb_cache_index_size; i++) {
+        rec = tb_cache_index[i];
+        if (rec && (old || !rec_from_file(rec))) {
+            fwrite(rec, rec->rec_size, 1, f);
+        }
+    }
+    tb_cache_dirty = false;
+    spin_unlock(&tb_lock);
+    /* concurrent runs each replace the whole file */
+    if (fclose(f) == 0 && rename(tmp, tb_cache_path) == 0) {
+        g_free(tmp);
+        return;
+    }
+    unlink(tmp);
+    g_free(tmp);
+}
+
+#else
+
+bool tb_cache_load(CPUArchState *env, TranslationBlock *tb, int *code_size)
+{
+    return false;
+}
+
+void tb_cache_save(CPUArchState *env, TranslationBlock *tb, int code_size)
+{
+}
+
+void tb_cache_init(const char *dir, const char *filename,
+                   const char *cpu_model, struct image_info *info)
+{
+    fprintf(stderr, "qemu: -tb-cache is not supported on this host or target\n");
+}
+
+void tb_cache_write(void)
+{
+}
+
+#endif
@@ -26,6 +26,7 @@
 #include "qemu-timer.h"
 #include "slirp/slirp.h"
 #include "main-loop.h"
+#include "qemu-aio.h"
 
 #ifndef _WIN32
 
@@ -199,6 +200,12 @@ static int qemu_signal_init(void)
 }
 #endif
 
+/*
+ * Descriptors to wait for, rebuilt in every iteration: those of slirp,
+ * I/O handlers (see qemu_iohandler_fill) and glib, in that order.
+ */
+static GArray *gpollfds;
+
 int main_loop_init(void)
 {
     int ret;
@@ -215,103 +222,70 @@ int main_loop_init(void)
         return ret;
     }
 
+    gpollfds = g_array_new(FALSE, FALSE, sizeof(GPollFD));
     return 0;
 }
 
-static fd_set rfds, wfds, xfds;
-static int nfds;
-static GPollFD poll_fds[1024 * 2]; /* this is probably overkill */
-static int n_poll_fds;
 static int max_priority;
 
 #ifndef _WIN32
-static void glib_select_fill(int *max_fd, fd_set *rfds, fd_set *wfds,
-                             fd_set *xfds, uint32_t *cur_timeout)
+static int glib_pollfds_idx;
+static int glib_n_poll_fds;
+
+static void glib_pollfds_fill(int64_t *cur_timeout)
 {
     GMainContext *context = g_main_context_default();
-    int i;
     int timeout = 0;
+    int n;
 
     g_main_context_prepare(context, &max_priority);
 
-    n_poll_fds = g_main_context_query(context, max_priority, &timeout,
-                                      poll_fds, ARRAY_SIZE(poll_fds));
-    g_assert(n_poll_fds <= ARRAY_SIZE(poll_fds));
-
-    for (i = 0; i < n_poll_fds; i++) {
-        GPollFD *p = &poll_fds[i];
-
-        if ((p->events & G_IO_IN)) {
-            FD_SET(p->fd, rfds);
-            *max_fd = MAX(*max_fd, p->fd);
-        }
-        if ((p->events & G_IO_OUT)) {
-            FD_SET(p->fd, wfds);
-            *max_fd = MAX(*max_fd, p->fd);
-        }
-        if ((p->events & G_IO_ERR)) {
-            FD_SET(p->fd, xfds);
-            *max_fd = MAX(*max_fd, p->fd);
-        }
-    }
-
-    if (timeout >= 0 && timeout < *cur_timeout) {
-        *cur_timeout = timeout;
+    /* query with the size of the last iteration, retry if it grew */
+    glib_pollfds_idx = gpollfds->len;
+    n = glib_n_poll_fds;
+    do {
+        GPollFD *pfds;
+
+        glib_n_poll_fds = n;
+        g_array_set_size(gpollfds, glib_pollfds_idx + glib_n_poll_fds);
+        pfds = &g_array_index(gpollfds, GPollFD, glib_pollfds_idx);
+        n = g_main_context_query(context, max_priority, &timeout, pfds,
+                                 glib_n_poll_fds);
+    } while (n != glib_n_poll_fds);
+
+    if (timeout >= 0 &&
+        (*cur_timeout < 0 || (int64_t)timeout * SCALE_MS < *cur_timeout)) {
+        *cur_timeout = (int64_t)timeout * SCALE_MS;
     }
 }
 
-static void glib_select_poll(fd_set *rfds, fd_set *wfds, fd_set *xfds,
-                             bool err)
+static void glib_pollfds_poll(void)
 {
     GMainContext *context = g_main_context_default();
+    GPollFD *pfds = &g_array_index(gpollfds, GPollFD, glib_pollfds_idx);
 
-    if (!err) {
-        int i;
-
-        for (i = 0; i < n_poll_fds; i++) {
-            GPollFD *p = &poll_fds[i];
-
-            if ((p->events & G_IO_IN) && FD_ISSET(p->fd, rfds)) {
-                p->revents |= G_IO_IN;
-            }
-            if ((p->events & G_IO_OUT) && FD_ISSET(p->fd, wfds)) {
-                p->revents |= G_IO_OUT;
-            }
-            if ((p->events & G_IO_ERR) && FD_ISSET(p->fd, xfds)) {
-                p->revents |= G_IO_ERR;
-            }
-        }
-    }
-
-    if (g_main_context_check(context, max_priority, poll_fds, n_poll_fds)) {
+    if (g_main_context_check(context, max_priority, pfds, glib_n_poll_fds)) {
         g_main_context_dispatch(context);
     }
 }
 
-static int os_host_main_loop_wait(uint32_t timeout)
+static int os_host_main_loop_wait(int64_t timeout)
 {
-    struct timeval tv, *tvarg = NULL;
     int ret;
 
-    glib_select_fill(&nfds, &rfds, &wfds, &xfds, &timeout);
+    glib_pollfds_fill(&timeout);
 
-    if (timeout < UINT32_MAX) {
-        tvarg = &tv;
-        tv.tv_sec = timeout / 1000;
-        tv.tv_usec = (timeout % 1000) * 1000;
-    }
-
-    if (timeout > 0) {
+    if (timeout) {
         qemu_mutex_unlock_iothread();
     }
 
-    ret = select(nfds + 1, &rfds, &wfds, &xfds, tvarg);
+    ret = qemu_poll_ns((GPollFD *)gpollfds->data, gpollfds->len, timeout);
 
-    if (timeout > 0) {
+    if (timeout) {
         qemu_mutex_lock_iothread();
     }
 
-    glib_select_poll(&rfds, &wfds, &xfds, (ret < 0));
+    glib_pollfds_poll();
     return ret;
 }
 #else
@@ -404,13 +378,68 @@ void qemu_fd_register(int fd)
                    FD_CONNECT | FD_WRITE | FD_OOB);
 }
 
-static int os_host_main_loop_wait(uint32_t timeout)
+static GPollFD poll_fds[1024 * 2]; /* this is probably overkill */
+static int n_poll_fds;
+
+/* winsock only has select(), which does not care about FD_SETSIZE */
+static int pollfds_fill(GArray *pollfds, fd_set *rfds, fd_set *wfds,
+                        fd_set *xfds)
+{
+    int nfds = -1;
+    int i;
+
+    for (i = 0; i < pollfds->len; i++) {
+        GPollFD *pfd = &g_array_index(pollfds, GPollFD, i);
+        int fd = pfd->fd;
+
+        if (pfd->events & G_IO_IN) {
+            FD_SET(fd, rfds);
+            nfds = MAX(nfds, fd);
+        }
+        if (pfd->events & G_IO_OUT) {
+            FD_SET(fd, wfds);
+            nfds = MAX(nfds, fd);
+        }
+        if (pfd->events & G_IO_PRI) {
+            FD_SET(fd, xfds);
+            nfds = MAX(nfds, fd);
+        }
+    }
+    return nfds;
+}
+
+static void pollfds_poll(GArray *pollfds, fd_set *rfds, fd_set *wfds,
+                         fd_set *xfds)
+{
+    int i;
+
+    for (i = 0; i < pollfds->len; i++) {
+        GPollFD *pfd = &g_array_index(pollfds, GPollFD, i);
+        int fd = pfd->fd;
+        int revents = 0;
+
+        if (FD_ISSET(fd, rfds)) {
+            revents |= G_IO_IN;
+        }
+        if (FD_ISSET(fd, wfds)) {
+            revents |= G_IO_OUT;
+        }
+        if (FD_ISSET(fd, xfds)) {
+            revents |= G_IO_PRI;
+        }
+        pfd->revents = revents & pfd->events;
+    }
+}
+
+static int os_host_main_loop_wait(int64_t timeout)
 {
     GMainContext *context = g_main_context_default();
-    int ret, i;
+    int ret, i, nfds;
     PollingEntry *pe;
     WaitObjects *w = &wait_objects;
     gint poll_timeout;
+    int timeout_ms;
+    fd_set rfds, wfds, xfds;
     static struct timeval tv0;
 
     /* XXX: need to suppress polling by better using win32 events */
@@ -422,11 +451,18 @@ static int os_host_main_loop_wait(uint32_t timeout)
         return ret;
     }
 
+    FD_ZERO(&rfds);
+    FD_ZERO(&wfds);
+    FD_ZERO(&xfds);
+    nfds = pollfds_fill(gpollfds, &rfds, &wfds, &xfds);
     if (nfds >= 0) {
         ret = select(nfds + 1, &rfds, &wfds, &xfds, &tv0);
         if (ret != 0) {
             timeout = 0;
         }
+        if (ret > 0) {
+            pollfds_poll(gpollfds, &rfds, &wfds, &xfds);
+        }
     }
 
     g_main_context_prepare(context, &max_priority);
@@ -439,8 +475,9 @@ static int os_host_main_loop_wait(uint32_t timeout)
         poll_fds[n_poll_fds + i].events = G_IO_IN;
     }
 
-    if (poll_timeout < 0 || timeout < poll_timeout) {
-        poll_timeout = timeout;
+    timeout_ms = qemu_timeout_ns_to_ms(timeout);
+    if (poll_timeout < 0 || (timeout_ms >= 0 && timeout_ms < poll_timeout)) {
+        poll_timeout = timeout_ms;
     }
 
     qemu_mutex_unlock_iothread();
@@ -470,10 +507,95 @@ static int os_host_main_loop_wait(uint32_t timeout)
 }
 #endif
 
+#ifdef CONFIG_SLIRP
+/*
+ * slirp still works with fd_sets.  Where epoll is available they only
+ * hold the descriptor of its epoll set, so converting is cheap.
+ */
+static fd_set slirp_rfds, slirp_wfds, slirp_xfds;
+static int slirp_pollfds_idx;
+static int slirp_n_pollfds;
+
+static void slirp_pollfds_fill(GArray *pollfds)
+{
+    int nfds = -1;
+
+    FD_ZERO(&slirp_rfds);
+    FD_ZERO(&slirp_wfds);
+    FD_ZERO(&slirp_xfds);
+    slirp_select_fill(&nfds, &slirp_rfds, &slirp_wfds, &slirp_xfds);
+
+    slirp_pollfds_idx = pollfds->len;
+#ifdef _WIN32
+    {
+        /* socket handles are not small integers here */
+        u_int i;
+
+        for (i = 0; i < slirp_rfds.fd_count; i++) {
+            GPollFD pfd = { .fd = slirp_rfds.fd_array[i], .events = G_IO_IN };
+            g_array_append_val(pollfds, pfd);
+        }
+        for (i = 0; i < slirp_wfds.fd_count; i++) {
+            GPollFD pfd = { .fd = slirp_wfds.fd_array[i], .events = G_IO_OUT };
+            g_array_append_val(pollfds, pfd);
+        }
+        for (i = 0; i < slirp_xfds.fd_count; i++) {
+            GPollFD pfd = { .fd = slirp_xfds.fd_array[i], .events = G_IO_PRI };
+            g_array_append_val(pollfds, pfd);
+        }
+    }
+#else
+    {
+        int fd;
+
+        for (fd = 0; fd <= nfds; fd++) {
+            int events = (FD_ISSET(fd, &slirp_rfds) ? G_IO_IN : 0) |
+                         (FD_ISSET(fd, &slirp_wfds) ? G_IO_OUT : 0) |
+                         (FD_ISSET(fd, &slirp_xfds) ? G_IO_PRI : 0);
+
+            if (events) {
+                GPollFD pfd = { .fd = fd, .events = events };
+                g_array_append_val(pollfds, pfd);
+            }
+        }
+    }
+#endif
+    slirp_n_pollfds = pollfds->len - slirp_pollfds_idx;
+}
+
+static void slirp_pollfds_poll(GArray *pollfds, int select_error)
+{
+    int i;
+
+    FD_ZERO(&slirp_rfds);
+    FD_ZERO(&slirp_wfds);
+    FD_ZERO(&slirp_xfds);
+    for (i = 0; !select_error && i < slirp_n_pollfds; i++) {
+        GPollFD *pfd = &g_array_index(pollfds, GPollFD,
+                                      slirp_pollfds_idx + i);
+
+        /* as with select(), errors make a socket readable and writable */
+        if ((pfd->events & G_IO_IN) &&
+            (pfd->revents & (G_IO_IN | G_IO_HUP | G_IO_ERR))) {
+            FD_SET(pfd->fd, &slirp_rfds);
+        }
+        if ((pfd->events & G_IO_OUT) &&
+            (pfd->revents & (G_IO_OUT | G_IO_ERR))) {
+            FD_SET(pfd->fd, &slirp_wfds);
+        }
+        if ((pfd->events & G_IO_PRI) && (pfd->revents & G_IO_PRI)) {
+            FD_SET(pfd->fd, &slirp_xfds);
+        }
+    }
+    slirp_select_poll(&slirp_rfds, &slirp_wfds, &slirp_xfds, select_error);
+}
+#endif
+
 int main_loop_wait(int nonblocking)
 {
     int ret;
     uint32_t timeout = UINT32_MAX;
+    int64_t timeout_ns, deadline_ns;
 
     if (nonblocking) {
         timeout = 0;
@@ -482,24 +604,27 @@ int main_loop_wait(int nonblocking)
     }
 
     /* poll any events */
+    g_array_set_size(gpollfds, 0);
     /* XXX: separate device handlers from system ones */
-    nfds = -1;
-    FD_ZERO(&rfds);
-    FD_ZERO(&wfds);
-    FD_ZERO(&xfds);
-
 #ifdef CONFIG_SLIRP
     slirp_update_timeout(&timeout);
-    slirp_select_fill(&nfds, &rfds, &wfds, &xfds);
+    slirp_pollfds_fill(gpollfds);
 #endif
-    qemu_iohandler_fill(&nfds, &rfds, &wfds, &xfds);
-    ret = os_host_main_loop_wait(timeout);
-    qemu_iohandler_poll(&rfds, &wfds, &xfds, ret);
+    qemu_iohandler_fill(gpollfds);
+
+    timeout_ns = timeout == UINT32_MAX ? -1 : (int64_t)timeout * SCALE_MS;
+    deadline_ns = qemu_timer_poll_timeout_ns();
+    if (deadline_ns >= 0 && (timeout_ns < 0 || deadline_ns < timeout_ns)) {
+        timeout_ns = deadline_ns;
+    }
+    ret = os_host_main_loop_wait(timeout_ns);
+    qemu_iohandler_poll(gpollfds, ret);
 #ifdef CONFIG_SLIRP
-    slirp_select_poll(&rfds, &wfds, &xfds, (ret < 0));
+    slirp_pollfds_poll(gpollfds, (ret < 0));
 #endif
 
     qemu_run_all_timers();
+    aio_timers_run(qemu_get_aio_context());
 
     /* Check bottom-halves last in case any of the earlier events triggered
        them.  */
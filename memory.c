@@ -18,13 +18,15 @@
 #include "ioport.h"
 #include "bitops.h"
 #include "kvm.h"
+#include "qemu-thread.h"
+#include "qemu-rcu.h"
+#include "qemu-tls.h"
 #include <assert.h>
 
 #define WANT_EXEC_OBSOLETE
 #include "exec-obsolete.h"
 
 unsigned memory_region_transaction_depth = 0;
-static bool memory_region_update_pending = false;
 static bool global_dirty_log = false;
 
 static QTAILQ_HEAD(memory_listeners, MemoryListener) memory_listeners
@@ -216,6 +218,7 @@ struct FlatView {
     FlatRange *ranges;
     unsigned nr;
     unsigned nr_allocated;
+    struct rcu_head rcu;
 };
 
 typedef struct AddressSpace AddressSpace;
@@ -224,7 +227,10 @@ typedef struct AddressSpaceOps AddressSpaceOps;
 /* A system address space - I/O, memory, etc. */
 struct AddressSpace {
     MemoryRegion *root;
-    FlatView current_map;
+    FlatView *current_map;      /* RCU-protected, NULL until the first update */
+    /* Part of the address space to render again on the next update */
+    AddrRange invalid;
+    bool invalid_all;
     int ioeventfd_nb;
     MemoryRegionIoeventfd *ioeventfds;
 };
@@ -267,6 +273,12 @@ static void flatview_insert(FlatView *view, unsigned pos, FlatRange *range)
 static void flatview_destroy(FlatView *view)
 {
     g_free(view->ranges);
+    g_free(view);
+}
+
+static void flatview_reclaim(struct rcu_head *rcu)
+{
+    flatview_destroy(container_of(rcu, FlatView, rcu));
 }
 
 static bool can_merge(FlatRange *r1, FlatRange *r2)
@@ -362,6 +374,14 @@ static void access_with_adjusted_size(target_phys_addr_t addr,
 
 static AddressSpace address_space_memory;
 
+/* Protects the flat views and the lockless flags against the vCPU threads
+ * that dispatch lockless accesses; everything else runs under the global
+ * mutex.  memory_lockless_cond is signalled when the last access on a
+ * region finishes.
+ */
+static QemuMutex memory_lockless_lock;
+static QemuCond memory_lockless_cond;
+
 static const MemoryRegionPortio *find_portio(MemoryRegion *mr, uint64_t offset,
                                              unsigned width, bool write)
 {
@@ -377,6 +397,24 @@ static const MemoryRegionPortio *find_portio(MemoryRegion *mr, uint64_t offset,
     return NULL;
 }
 
+/* Set while KVM replays the accesses it queued in the coalesced ring */
+static DEFINE_TLS(bool, memory_coalesced_replay);
+
+void memory_set_coalesced_replay(bool replay)
+{
+    tls_var(memory_coalesced_replay) = replay;
+}
+
+/* Account an access that reached the device model behind @mr */
+static void memory_region_count_access(MemoryRegion *mr)
+{
+    if (tls_var(memory_coalesced_replay)) {
+        __sync_fetch_and_add(&mr->coalesced_count, 1);
+    } else {
+        __sync_fetch_and_add(&mr->exit_count, 1);
+    }
+}
+
 static void memory_region_iorange_read(IORange *iorange,
                                        uint64_t offset,
                                        unsigned width,
@@ -386,6 +424,7 @@ static void memory_region_iorange_read(IORange *iorange,
         = container_of(iorange, MemoryRegionIORange, iorange);
     MemoryRegion *mr = mrio->mr;
 
+    memory_region_count_access(mr);
     offset += mrio->offset;
     if (mr->ops->old_portio) {
         const MemoryRegionPortio *mrp = find_portio(mr, offset - mrio->offset,
@@ -418,6 +457,7 @@ static void memory_region_iorange_write(IORange *iorange,
         = container_of(iorange, MemoryRegionIORange, iorange);
     MemoryRegion *mr = mrio->mr;
 
+    memory_region_count_access(mr);
     offset += mrio->offset;
     if (mr->ops->old_portio) {
         const MemoryRegionPortio *mrp = find_portio(mr, offset - mrio->offset,
@@ -557,15 +597,54 @@ static void render_memory_region(FlatView *view,
 }
 
 /* Render a memory topology into a list of disjoint absolute ranges. */
-static FlatView generate_memory_topology(MemoryRegion *mr)
+static FlatView *generate_memory_topology(MemoryRegion *mr)
 {
-    FlatView view;
+    FlatView *view = g_new(FlatView, 1);
 
-    flatview_init(&view);
+    flatview_init(view);
 
-    render_memory_region(&view, mr, int128_zero(),
+    render_memory_region(view, mr, int128_zero(),
                          addrrange_make(int128_zero(), int128_2_64()), false);
-    flatview_simplify(&view);
+    flatview_simplify(view);
+
+    return view;
+}
+
+/* Render only the part of mr inside window, and take the rest from old.  */
+static FlatView *generate_memory_topology_window(MemoryRegion *mr,
+                                                 FlatView *old,
+                                                 AddrRange window)
+{
+    FlatView *view = g_new(FlatView, 1);
+    Int128 end = addrrange_end(window);
+    FlatRange *fr, piece;
+
+    flatview_init(view);
+
+    FOR_EACH_FLAT_RANGE(fr, old) {
+        if (!addrrange_intersects(fr->addr, window)) {
+            flatview_insert(view, view->nr, fr);
+            continue;
+        }
+        if (int128_lt(fr->addr.start, window.start)) {
+            piece = *fr;
+            piece.addr = addrrange_make(fr->addr.start,
+                                        int128_sub(window.start,
+                                                   fr->addr.start));
+            flatview_insert(view, view->nr, &piece);
+        }
+        if (int128_gt(addrrange_end(fr->addr), end)) {
+            piece = *fr;
+            piece.offset_in_region += int128_get64(int128_sub(end,
+                                                              fr->addr.start));
+            piece.addr = addrrange_make(end, int128_sub(addrrange_end(fr->addr),
+                                                        end));
+            flatview_insert(view, view->nr, &piece);
+        }
+    }
+
+    render_memory_region(view, mr, int128_zero(), window, false);
+    flatview_simplify(view);
 
     return view;
 }
@@ -627,7 +706,7 @@ static void address_space_update_ioeventfds(AddressSpace *as)
     AddrRange tmp;
     unsigned i;
 
-    FOR_EACH_FLAT_RANGE(fr, &as->current_map) {
+    FOR_EACH_FLAT_RANGE(fr, as->current_map) {
         for (i = 0; i < fr->mr->ioeventfd_nb; ++i) {
             tmp = addrrange_shift(fr->mr->ioeventfds[i].addr,
                                   int128_sub(fr->addr.start,
@@ -650,9 +729,43 @@ static void address_space_update_ioeventfds(AddressSpace *as)
     as->ioeventfd_nb = ioeventfd_nb;
 }
 
+static void flat_range_coalesced_io_del(FlatRange *fr, AddressSpace *as)
+{
+    if (as == &address_space_io) {
+        qemu_unregister_coalesced_pio(int128_get64(fr->addr.start),
+                                      int128_get64(fr->addr.size));
+    } else {
+        qemu_unregister_coalesced_mmio(int128_get64(fr->addr.start),
+                                       int128_get64(fr->addr.size));
+    }
+}
+
+static void flat_range_coalesced_io_add(FlatRange *fr, AddressSpace *as)
+{
+    CoalescedMemoryRange *cmr;
+    AddrRange tmp;
+
+    QTAILQ_FOREACH(cmr, &fr->mr->coalesced, link) {
+        tmp = addrrange_shift(cmr->addr,
+                              int128_sub(fr->addr.start,
+                                         int128_make64(fr->offset_in_region)));
+        if (!addrrange_intersects(tmp, fr->addr)) {
+            continue;
+        }
+        tmp = addrrange_intersection(tmp, fr->addr);
+        if (as == &address_space_io) {
+            qemu_register_coalesced_pio(int128_get64(tmp.start),
+                                        int128_get64(tmp.size));
+        } else {
+            qemu_register_coalesced_mmio(int128_get64(tmp.start),
+                                         int128_get64(tmp.size));
+        }
+    }
+}
+
 static void address_space_update_topology_pass(AddressSpace *as,
-                                               FlatView old_view,
-                                               FlatView new_view,
+                                               FlatView *old_view,
+                                               FlatView *new_view,
                                                bool adding)
 {
     unsigned iold, inew;
@@ -662,14 +775,14 @@ static void address_space_update_topology_pass(AddressSpace *as,
      * Kill ranges in the old map, and instantiate ranges in the new map.
      */
     iold = inew = 0;
-    while (iold < old_view.nr || inew < new_view.nr) {
-        if (iold < old_view.nr) {
-            frold = &old_view.ranges[iold];
+    while (iold < old_view->nr || inew < new_view->nr) {
+        if (iold < old_view->nr) {
+            frold = &old_view->ranges[iold];
         } else {
             frold = NULL;
         }
-        if (inew < new_view.nr) {
-            frnew = &new_view.ranges[inew];
+        if (inew < new_view->nr) {
+            frnew = &new_view->ranges[inew];
         } else {
             frnew = NULL;
         }
@@ -682,6 +795,9 @@ static void address_space_update_topology_pass(AddressSpace *as,
             /* In old, but (not in new, or in new but attributes changed). */
 
             if (!adding) {
+                if (!QTAILQ_EMPTY(&frold->mr->coalesced)) {
+                    flat_range_coalesced_io_del(frold, as);
+                }
                 MEMORY_LISTENER_UPDATE_REGION(frold, as, Reverse, region_del);
             }
 
@@ -705,6 +821,7 @@ static void address_space_update_topology_pass(AddressSpace *as,
 
             if (adding) {
                 MEMORY_LISTENER_UPDATE_REGION(frnew, as, Forward, region_add);
+                flat_range_coalesced_io_add(frnew, as);
             }
 
             ++inew;
@@ -713,27 +830,121 @@ static void address_space_update_topology_pass(AddressSpace *as,
 }
 
 
+static bool address_space_needs_update(AddressSpace *as)
+{
+    return as->root && (as->invalid_all || int128_nz(as->invalid.size));
+}
+
 static void address_space_update_topology(AddressSpace *as)
 {
-    FlatView old_view = as->current_map;
-    FlatView new_view = generate_memory_topology(as->root);
+    FlatView *old_view = as->current_map;
+    FlatView *new_view;
+    FlatView empty_view;
+
+    if (!old_view) {
+        flatview_init(&empty_view);
+        old_view = &empty_view;
+    }
+
+    if (as->invalid_all) {
+        new_view = generate_memory_topology(as->root);
+    } else if (int128_nz(as->invalid.size)) {
+        new_view = generate_memory_topology_window(as->root, old_view,
+                                                   as->invalid);
+    } else {
+        /* listeners still expect region_nop for every range */
+        new_view = old_view;
+    }
+    as->invalid_all = false;
+    as->invalid = addrrange_make(int128_zero(), int128_zero());
 
     address_space_update_topology_pass(as, old_view, new_view, false);
     address_space_update_topology_pass(as, old_view, new_view, true);
+    if (new_view == old_view) {
+        return;
+    }
 
-    as->current_map = new_view;
-    flatview_destroy(&old_view);
+    /* Readers may still be walking the old view; free it after they are
+       done.  */
+    qemu_mutex_lock(&memory_lockless_lock);
+    atomic_rcu_set(&as->current_map, new_view);
+    qemu_mutex_unlock(&memory_lockless_lock);
+    if (old_view != &empty_view) {
+        call_rcu(&old_view->rcu, flatview_reclaim);
+    }
     address_space_update_ioeventfds(as);
 }
 
-static void memory_region_update_topology(MemoryRegion *mr)
+static void address_space_invalidate(AddressSpace *as, AddrRange range)
+{
+    Int128 start, end;
+
+    if (!int128_nz(as->invalid.size)) {
+        as->invalid = range;
+        return;
+    }
+    start = int128_min(as->invalid.start, range.start);
+    end = int128_max(addrrange_end(as->invalid), addrrange_end(range));
+    as->invalid = addrrange_make(start, int128_sub(end, start));
+}
+
+/* Mark range (relative to mr) for rendering again, wherever mr is visible:
+ * through its parents and through any alias of mr or of its parents.
+ * Regions that are not part of an address space cost nothing.
+ */
+static void memory_region_invalidate_range(MemoryRegion *mr, AddrRange range,
+                                           bool changed)
+{
+    MemoryRegion *alias;
+    AddrRange window;
+
+    /* the region whose enable bit changed is rendered in either state */
+    if (!changed && !mr->enabled) {
+        return;
+    }
+
+    QTAILQ_FOREACH(alias, &mr->aliases, aliases_link) {
+        window = addrrange_make(int128_make64(alias->alias_offset),
+                                alias->size);
+        if (addrrange_intersects(range, window)) {
+            memory_region_invalidate_range(alias,
+                addrrange_shift(addrrange_intersection(range, window),
+                                int128_neg(window.start)),
+                false);
+        }
+    }
+
+    if (mr->parent) {
+        memory_region_invalidate_range(mr->parent,
+            addrrange_shift(range, int128_make64(mr->addr)), false);
+    } else if (mr == address_space_memory.root) {
+        address_space_invalidate(&address_space_memory, range);
+    } else if (mr == address_space_io.root) {
+        address_space_invalidate(&address_space_io, range);
+    }
+}
+
+static void memory_region_invalidate(MemoryRegion *mr)
+{
+    if (int128_nz(mr->size)) {
+        memory_region_invalidate_range(mr,
+                                       addrrange_make(int128_zero(), mr->size),
+                                       true);
+    }
+}
+
+/* Apply the invalidations recorded since the last update.  Only the
+ * invalid part of each address space is rendered again, and listeners
+ * are not called at all if nothing changed.
+ */
+static void memory_region_update_topology(void)
 {
     if (memory_region_transaction_depth) {
-        memory_region_update_pending |= !mr || mr->enabled;
         return;
     }
 
-    if (mr && !mr->enabled) {
+    if (!address_space_needs_update(&address_space_memory)
+        && !address_space_needs_update(&address_space_io)) {
         return;
     }
 
@@ -747,8 +958,6 @@ static void memory_region_update_topology(MemoryRegion *mr)
     }
 
     MEMORY_LISTENER_CALL_GLOBAL(commit, Forward);
-
-    memory_region_update_pending = false;
 }
 
 void memory_region_transaction_begin(void)
@@ -760,9 +969,7 @@ void memory_region_transaction_commit(void)
 {
     assert(memory_region_transaction_depth);
     --memory_region_transaction_depth;
-    if (!memory_region_transaction_depth && memory_region_update_pending) {
-        memory_region_update_topology(NULL);
-    }
+    memory_region_update_topology();
 }
 
 static void memory_region_destructor_none(MemoryRegion *mr)
@@ -819,6 +1026,7 @@ void memory_region_init(MemoryRegion *mr,
     mr->priority = 0;
     mr->may_overlap = false;
     mr->alias = NULL;
+    QTAILQ_INIT(&mr->aliases);
     QTAILQ_INIT(&mr->subregions);
     memset(&mr->subregions_link, 0, sizeof mr->subregions_link);
     QTAILQ_INIT(&mr->coalesced);
@@ -826,6 +1034,11 @@ void memory_region_init(MemoryRegion *mr,
     mr->dirty_log_mask = 0;
     mr->ioeventfd_nb = 0;
     mr->ioeventfds = NULL;
+    mr->lockless_read = false;
+    mr->lockless_write = false;
+    mr->lockless_refs = 0;
+    mr->exit_count = 0;
+    mr->coalesced_count = 0;
 }
 
 static bool memory_region_access_valid(MemoryRegion *mr,
@@ -901,6 +1114,7 @@ static uint64_t memory_region_dispatch_read(MemoryRegion *mr,
 {
     uint64_t ret;
 
+    memory_region_count_access(mr);
     ret = memory_region_dispatch_read1(mr, addr, size);
     adjust_endianness(mr, &ret, size);
     return ret;
@@ -911,6 +1125,7 @@ static void memory_region_dispatch_write(MemoryRegion *mr,
                                          uint64_t data,
                                          unsigned size)
 {
+    memory_region_count_access(mr);
     if (!memory_region_access_valid(mr, addr, size, true)) {
         return; /* FIXME: better signalling */
     }
@@ -954,6 +1169,17 @@ void memory_region_init_ram(MemoryRegion *mr,
     mr->ram_addr = qemu_ram_alloc(size, mr);
 }
 
+void memory_region_init_system_ram(MemoryRegion *mr,
+                                   const char *name,
+                                   uint64_t size)
+{
+    memory_region_init(mr, name, size);
+    mr->ram = true;
+    mr->terminates = true;
+    mr->destructor = memory_region_destructor_ram;
+    mr->ram_addr = qemu_ram_alloc_system(size, mr);
+}
+
 void memory_region_init_ram_ptr(MemoryRegion *mr,
                                 const char *name,
                                 uint64_t size,
@@ -975,6 +1201,7 @@ void memory_region_init_alias(MemoryRegion *mr,
     memory_region_init(mr, name, size);
     mr->alias = orig;
     mr->alias_offset = offset;
+    QTAILQ_INSERT_TAIL(&orig->aliases, mr, aliases_link);
 }
 
 void memory_region_init_rom_device(MemoryRegion *mr,
@@ -1030,7 +1257,19 @@ void memory_region_init_reservation(MemoryRegion *mr,
 
 void memory_region_destroy(MemoryRegion *mr)
 {
+    MemoryRegion *alias;
+
     assert(QTAILQ_EMPTY(&mr->subregions));
+    if (mr->alias) {
+        QTAILQ_REMOVE(&mr->alias->aliases, mr, aliases_link);
+    }
+    while ((alias = QTAILQ_FIRST(&mr->aliases)) != NULL) {
+        QTAILQ_REMOVE(&mr->aliases, alias, aliases_link);
+        alias->alias = NULL;
+    }
+    if (mr->lockless_read || mr->lockless_write) {
+        memory_region_set_lockless(mr, false, false);
+    }
     mr->destructor(mr);
     memory_region_clear_coalescing(mr);
     g_free((char *)mr->name);
@@ -1070,29 +1309,48 @@ void memory_region_set_log(MemoryRegion *mr, bool log, unsigned client)
     uint8_t mask = 1 << client;
 
     mr->dirty_log_mask = (mr->dirty_log_mask & ~mask) | (log * mask);
-    memory_region_update_topology(mr);
+    memory_region_invalidate(mr);
+    memory_region_update_topology();
 }
 
 bool memory_region_get_dirty(MemoryRegion *mr, target_phys_addr_t addr,
                              target_phys_addr_t size, unsigned client)
 {
     assert(mr->terminates);
-    return cpu_physical_memory_get_dirty(mr->ram_addr + addr, size,
-                                         1 << client);
+    return cpu_physical_memory_get_dirty(mr->ram_addr + addr, size, client);
+}
+
+target_phys_addr_t memory_region_find_next_dirty(MemoryRegion *mr,
+                                                 target_phys_addr_t addr,
+                                                 target_phys_addr_t size,
+                                                 unsigned client)
+{
+    assert(mr->terminates);
+    return cpu_physical_memory_find_next_dirty(mr->ram_addr + addr,
+                                               mr->ram_addr + size,
+                                               client) - mr->ram_addr;
 }
 
 void memory_region_set_dirty(MemoryRegion *mr, target_phys_addr_t addr,
                              target_phys_addr_t size)
 {
     assert(mr->terminates);
-    return cpu_physical_memory_set_dirty_range(mr->ram_addr + addr, size, -1);
+    cpu_physical_memory_set_dirty_range(mr->ram_addr + addr, size);
+}
+
+void memory_region_set_dirty_lebitmap(MemoryRegion *mr,
+                                      target_phys_addr_t addr,
+                                      unsigned long *bitmap, uint64_t pages)
+{
+    assert(mr->terminates);
+    cpu_physical_memory_set_dirty_lebitmap(bitmap, mr->ram_addr + addr, pages);
 }
 
 void memory_region_sync_dirty_bitmap(MemoryRegion *mr)
 {
     FlatRange *fr;
 
-    FOR_EACH_FLAT_RANGE(fr, &address_space_memory.current_map) {
+    FOR_EACH_FLAT_RANGE(fr, address_space_memory.current_map) {
         if (fr->mr == mr) {
             MEMORY_LISTENER_UPDATE_REGION(fr, &address_space_memory,
                                           Forward, log_sync);
@@ -1104,15 +1362,33 @@ void memory_region_set_readonly(MemoryRegion *mr, bool readonly)
 {
     if (mr->readonly != readonly) {
         mr->readonly = readonly;
-        memory_region_update_topology(mr);
+        memory_region_invalidate(mr);
+        memory_region_update_topology();
     }
 }
 
+void memory_region_set_lockless(MemoryRegion *mr, bool read, bool write)
+{
+    assert(!(read || write) ||
+           (mr->ops && !mr->ops->old_portio && !mr->ram && !mr->rom_device));
+
+    qemu_mutex_lock(&memory_lockless_lock);
+    mr->lockless_read = read;
+    mr->lockless_write = write;
+    if (!read && !write) {
+        while (mr->lockless_refs) {
+            qemu_cond_wait(&memory_lockless_cond, &memory_lockless_lock);
+        }
+    }
+    qemu_mutex_unlock(&memory_lockless_lock);
+}
+
 void memory_region_rom_device_set_readable(MemoryRegion *mr, bool readable)
 {
     if (mr->readable != readable) {
         mr->readable = readable;
-        memory_region_update_topology(mr);
+        memory_region_invalidate(mr);
+        memory_region_update_topology();
     }
 }
 
@@ -1122,7 +1398,7 @@ void memory_region_reset_dirty(MemoryRegion *mr, target_phys_addr_t addr,
     assert(mr->terminates);
     cpu_physical_memory_reset_dirty(mr->ram_addr + addr,
                                     mr->ram_addr + addr + size,
-                                    1 << client);
+                                    client);
 }
 
 void *memory_region_get_ram_ptr(MemoryRegion *mr)
@@ -1136,31 +1412,28 @@ void *memory_region_get_ram_ptr(MemoryRegion *mr)
     return qemu_get_ram_ptr(mr->ram_addr & TARGET_PAGE_MASK);
 }
 
-static void memory_region_update_coalesced_range(MemoryRegion *mr)
+static void memory_region_update_coalesced_range_as(MemoryRegion *mr,
+                                                    AddressSpace *as)
 {
     FlatRange *fr;
-    CoalescedMemoryRange *cmr;
-    AddrRange tmp;
 
-    FOR_EACH_FLAT_RANGE(fr, &address_space_memory.current_map) {
+    if (!as->current_map) {
+        return;
+    }
+    FOR_EACH_FLAT_RANGE(fr, as->current_map) {
         if (fr->mr == mr) {
-            qemu_unregister_coalesced_mmio(int128_get64(fr->addr.start),
-                                           int128_get64(fr->addr.size));
-            QTAILQ_FOREACH(cmr, &mr->coalesced, link) {
-                tmp = addrrange_shift(cmr->addr,
-                                      int128_sub(fr->addr.start,
-                                                 int128_make64(fr->offset_in_region)));
-                if (!addrrange_intersects(tmp, fr->addr)) {
-                    continue;
-                }
-                tmp = addrrange_intersection(tmp, fr->addr);
-                qemu_register_coalesced_mmio(int128_get64(tmp.start),
-                                             int128_get64(tmp.size));
-            }
+            flat_range_coalesced_io_del(fr, as);
+            flat_range_coalesced_io_add(fr, as);
         }
     }
 }
 
+static void memory_region_update_coalesced_range(MemoryRegion *mr)
+{
+    memory_region_update_coalesced_range_as(mr, &address_space_memory);
+    memory_region_update_coalesced_range_as(mr, &address_space_io);
+}
+
 void memory_region_set_coalescing(MemoryRegion *mr)
 {
     memory_region_clear_coalescing(mr);
@@ -1217,7 +1490,8 @@ void memory_region_add_eventfd(MemoryRegion *mr,
     memmove(&mr->ioeventfds[i+1], &mr->ioeventfds[i],
             sizeof(*mr->ioeventfds) * (mr->ioeventfd_nb-1 - i));
     mr->ioeventfds[i] = mrfd;
-    memory_region_update_topology(mr);
+    memory_region_invalidate(mr);
+    memory_region_update_topology();
 }
 
 void memory_region_del_eventfd(MemoryRegion *mr,
@@ -1247,7 +1521,8 @@ void memory_region_del_eventfd(MemoryRegion *mr,
     --mr->ioeventfd_nb;
     mr->ioeventfds = g_realloc(mr->ioeventfds,
                                   sizeof(*mr->ioeventfds)*mr->ioeventfd_nb + 1);
-    memory_region_update_topology(mr);
+    memory_region_invalidate(mr);
+    memory_region_update_topology();
 }
 
 static void memory_region_add_subregion_common(MemoryRegion *mr,
@@ -1288,7 +1563,8 @@ static void memory_region_add_subregion_common(MemoryRegion *mr,
     }
     QTAILQ_INSERT_TAIL(&mr->subregions, subregion, subregions_link);
 done:
-    memory_region_update_topology(mr);
+    memory_region_invalidate(subregion);
+    memory_region_update_topology();
 }
 
 
@@ -1315,9 +1591,10 @@ void memory_region_del_subregion(MemoryRegion *mr,
                                  MemoryRegion *subregion)
 {
     assert(subregion->parent == mr);
+    memory_region_invalidate(subregion);
     subregion->parent = NULL;
     QTAILQ_REMOVE(&mr->subregions, subregion, subregions_link);
-    memory_region_update_topology(mr);
+    memory_region_update_topology();
 }
 
 void memory_region_set_enabled(MemoryRegion *mr, bool enabled)
@@ -1326,7 +1603,8 @@ void memory_region_set_enabled(MemoryRegion *mr, bool enabled)
         return;
     }
     mr->enabled = enabled;
-    memory_region_update_topology(NULL);
+    memory_region_invalidate(mr);
+    memory_region_update_topology();
 }
 
 void memory_region_set_address(MemoryRegion *mr, target_phys_addr_t addr)
@@ -1357,11 +1635,12 @@ void memory_region_set_alias_offset(MemoryRegion *mr, target_phys_addr_t offset)
     assert(mr->alias);
     mr->alias_offset = offset;
 
-    if (offset == old_offset || !mr->parent) {
+    if (offset == old_offset) {
         return;
     }
 
-    memory_region_update_topology(mr);
+    memory_region_invalidate(mr);
+    memory_region_update_topology();
 }
 
 ram_addr_t memory_region_get_ram_addr(MemoryRegion *mr)
@@ -1382,9 +1661,9 @@ static int cmp_flatrange_addr(const void *addr_, const void *fr_)
     return 0;
 }
 
-static FlatRange *address_space_lookup(AddressSpace *as, AddrRange addr)
+static FlatRange *flatview_lookup(FlatView *view, AddrRange addr)
 {
-    return bsearch(&addr, as->current_map.ranges, as->current_map.nr,
+    return bsearch(&addr, view->ranges, view->nr,
                    sizeof(FlatRange), cmp_flatrange_addr);
 }
 
@@ -1394,14 +1673,19 @@ MemoryRegionSection memory_region_find(MemoryRegion *address_space,
     AddressSpace *as = memory_region_to_address_space(address_space);
     AddrRange range = addrrange_make(int128_make64(addr),
                                      int128_make64(size));
-    FlatRange *fr = address_space_lookup(as, range);
+    FlatView *view;
+    FlatRange *fr;
     MemoryRegionSection ret = { .mr = NULL, .size = 0 };
 
+    rcu_read_lock();
+    view = atomic_rcu_read(&as->current_map);
+    fr = flatview_lookup(view, range);
     if (!fr) {
+        rcu_read_unlock();
         return ret;
     }
 
-    while (fr > as->current_map.ranges
+    while (fr > view->ranges
            && addrrange_intersects(fr[-1].addr, range)) {
         --fr;
     }
@@ -1414,15 +1698,56 @@ MemoryRegionSection memory_region_find(MemoryRegion *address_space,
     ret.size = int128_get64(range.size);
     ret.offset_within_address_space = int128_get64(range.start);
     ret.readonly = fr->readonly;
+    rcu_read_unlock();
     return ret;
 }
 
+bool io_mem_access_lockless(MemoryRegion *address_space,
+                            target_phys_addr_t addr, uint64_t *data,
+                            unsigned size, bool is_write)
+{
+    AddressSpace *as = memory_region_to_address_space(address_space);
+    AddrRange range = addrrange_make(int128_make64(addr),
+                                     int128_make64(size));
+    MemoryRegion *mr = NULL;
+    target_phys_addr_t offset = 0;
+    FlatRange *fr;
+
+    qemu_mutex_lock(&memory_lockless_lock);
+    fr = flatview_lookup(as->current_map, range);
+    if (fr && (is_write ? fr->mr->lockless_write : fr->mr->lockless_read)
+        && int128_ge(range.start, fr->addr.start)
+        && int128_le(addrrange_end(range), addrrange_end(fr->addr))) {
+        mr = fr->mr;
+        offset = fr->offset_in_region +
+                 int128_get64(int128_sub(range.start, fr->addr.start));
+        mr->lockless_refs++;
+    }
+    qemu_mutex_unlock(&memory_lockless_lock);
+    if (!mr) {
+        return false;
+    }
+
+    if (is_write) {
+        memory_region_dispatch_write(mr, offset, *data, size);
+    } else {
+        *data = memory_region_dispatch_read(mr, offset, size);
+    }
+
+    qemu_mutex_lock(&memory_lockless_lock);
+    if (--mr->lockless_refs == 0) {
+        qemu_cond_broadcast(&memory_lockless_cond);
+    }
+    qemu_mutex_unlock(&memory_lockless_lock);
+    return true;
+}
+
 void memory_global_sync_dirty_bitmap(MemoryRegion *address_space)
 {
     AddressSpace *as = memory_region_to_address_space(address_space);
     FlatRange *fr;
 
-    FOR_EACH_FLAT_RANGE(fr, &as->current_map) {
+    FOR_EACH_FLAT_RANGE(fr, as->current_map) {
         MEMORY_LISTENER_UPDATE_REGION(fr, as, Forward, log_sync);
     }
 }
@@ -1452,7 +1777,7 @@ static void listener_add_address_space(MemoryListener *listener,
     if (global_dirty_log) {
         listener->log_global_start(listener);
     }
-    FOR_EACH_FLAT_RANGE(fr, &as->current_map) {
+    FOR_EACH_FLAT_RANGE(fr, as->current_map) {
         MemoryRegionSection section = {
             .mr = fr->mr,
             .address_space = as->root,
@@ -1493,25 +1818,38 @@ void memory_listener_unregister(MemoryListener *listener)
 
 void set_system_memory_map(MemoryRegion *mr)
 {
+    /* called once, before any topology update */
+    qemu_mutex_init(&memory_lockless_lock);
+    qemu_cond_init(&memory_lockless_cond);
     address_space_memory.root = mr;
-    memory_region_update_topology(NULL);
+    address_space_memory.invalid_all = true;
+    memory_region_update_topology();
 }
 
 void set_system_io_map(MemoryRegion *mr)
 {
     address_space_io.root = mr;
-    memory_region_update_topology(NULL);
+    address_space_io.invalid_all = true;
+    memory_region_update_topology();
 }
 
 uint64_t io_mem_read(MemoryRegion *mr, target_phys_addr_t addr, unsigned size)
 {
-    return memory_region_dispatch_read(mr, addr, size);
+    bool locked = qemu_tcg_io_lock();
+    uint64_t val;
+
+    val = memory_region_dispatch_read(mr, addr, size);
+    qemu_tcg_io_unlock(locked);
+    return val;
 }
 
 void io_mem_write(MemoryRegion *mr, target_phys_addr_t addr,
                   uint64_t val, unsigned size)
 {
+    bool locked = qemu_tcg_io_lock();
+
     memory_region_dispatch_write(mr, addr, val, size);
+    qemu_tcg_io_unlock(locked);
 }
 
 typedef struct MemoryRegionList MemoryRegionList;
@@ -1616,6 +1954,37 @@ static void mtree_print_mr(fprintf_function mon_printf, void *f,
     }
 }
 
+static void io_exits_print_as(fprintf_function mon_printf, void *f,
+                              const char *name, AddressSpace *as)
+{
+    GHashTable *seen;
+    FlatRange *fr;
+
+    if (!as->current_map) {
+        return;
+    }
+    mon_printf(f, "%s\n", name);
+    seen = g_hash_table_new(NULL, NULL);
+    FOR_EACH_FLAT_RANGE(fr, as->current_map) {
+        if (fr->mr->ram || g_hash_table_lookup(seen, fr->mr)) {
+            continue;
+        }
+        g_hash_table_insert(seen, fr->mr, fr->mr);
+        if (fr->mr->exit_count || fr->mr->coalesced_count) {
+            mon_printf(f, "  %s: %" PRIu64 " exits, %" PRIu64 " coalesced\n",
+                       fr->mr->name, fr->mr->exit_count,
+                       fr->mr->coalesced_count);
+        }
+    }
+    g_hash_table_destroy(seen);
+}
+
+void io_exits_info(fprintf_function mon_printf, void *f)
+{
+    io_exits_print_as(mon_printf, f, "memory", &address_space_memory);
+    io_exits_print_as(mon_printf, f, "I/O", &address_space_io);
+}
+
 void mtree_info(fprintf_function mon_printf, void *f)
 {
     MemoryRegionListHead ml_head;
@@ -31,13 +31,6 @@ typedef struct MemoryRegion MemoryRegion;
 typedef struct MemoryRegionPortio MemoryRegionPortio;
 typedef struct MemoryRegionMmio MemoryRegionMmio;
 
-/* Must match *_DIRTY_FLAGS in cpu-all.h.  To be replaced with dynamic
- * registration.
- */
-#define DIRTY_MEMORY_VGA       0
-#define DIRTY_MEMORY_CODE      1
-#define DIRTY_MEMORY_MIGRATION 3
-
 struct MemoryRegionMmio {
     CPUReadMemoryFunc *read[3];
     CPUWriteMemoryFunc *write[3];
@@ -135,6 +128,8 @@ struct MemoryRegion {
     bool warning_printed; /* For reservations */
     MemoryRegion *alias;
     target_phys_addr_t alias_offset;
+    QTAILQ_HEAD(aliases, MemoryRegion) aliases;
+    QTAILQ_ENTRY(MemoryRegion) aliases_link;
     unsigned priority;
     bool may_overlap;
     QTAILQ_HEAD(subregions, MemoryRegion) subregions;
@@ -144,6 +139,13 @@ struct MemoryRegion {
     uint8_t dirty_log_mask;
     unsigned ioeventfd_nb;
     MemoryRegionIoeventfd *ioeventfds;
+    bool lockless_read;
+    bool lockless_write;
+    unsigned lockless_refs; /* accesses in progress without the global mutex */
+    /* Accesses dispatched to the callbacks.  Under KVM every access that
+       was not queued in the coalesced ring was a vmexit.  */
+    uint64_t exit_count;
+    uint64_t coalesced_count;
 };
 
 struct MemoryRegionPortio {
@@ -251,6 +253,22 @@ void memory_region_init_ram(MemoryRegion *mr,
                             const char *name,
                             uint64_t size);
 
+/**
+ * memory_region_init_system_ram:  Initialize the RAM region that holds the
+ *                                 guest's main memory.
+ *
+ * Like memory_region_init_ram(), but the region is also laid out over the
+ * host NUMA nodes given with -numa hostnodes=, in the order of the guest
+ * nodes, and preallocated with -mem-prealloc.
+ *
+ * @mr: the #MemoryRegion to be initialized.
+ * @name: the name of the region.
+ * @size: size of the region.
+ */
+void memory_region_init_system_ram(MemoryRegion *mr,
+                                   const char *name,
+                                   uint64_t size);
+
 /**
  * memory_region_init_ram:  Initialize RAM memory region from a user-provided.
  *                          pointer.  Accesses into the region will modify
@@ -419,6 +437,28 @@ void memory_region_set_log(MemoryRegion *mr, bool log, unsigned client);
 bool memory_region_get_dirty(MemoryRegion *mr, target_phys_addr_t addr,
                              target_phys_addr_t size, unsigned client);
 
+/**
+ * memory_region_find_next_dirty: Find the next page that is dirty for a
+ *                                specified client.
+ *
+ * Scans the dirty bitmap a word at a time, which is much cheaper than
+ * calling memory_region_get_dirty() on every page of a mostly clean region.
+ *
+ * @mr: the memory region being queried.
+ * @addr: the address (relative to the start of the region) to start from.
+ * @size: the end of the range being scanned, relative to the start of the
+ *        region; must be page aligned.
+ * @client: the user of the logging information; %DIRTY_MEMORY_MIGRATION or
+ *          %DIRTY_MEMORY_VGA.
+ *
+ * Returns the page-aligned address of the first dirty page at or after
+ * @addr, or @size if there is none.
+ */
+target_phys_addr_t memory_region_find_next_dirty(MemoryRegion *mr,
+                                                 target_phys_addr_t addr,
+                                                 target_phys_addr_t size,
+                                                 unsigned client);
+
 /**
  * memory_region_set_dirty: Mark a range of bytes as dirty in a memory region.
  *
@@ -432,6 +472,22 @@ bool memory_region_get_dirty(MemoryRegion *mr, target_phys_addr_t addr,
 void memory_region_set_dirty(MemoryRegion *mr, target_phys_addr_t addr,
                              target_phys_addr_t size);
 
+/**
+ * memory_region_set_dirty_lebitmap: Mark pages dirty from a bitmap.
+ *
+ * Marks as dirty the pages whose bits are set in a little-endian bitmap
+ * with one bit per target page, as returned by KVM_GET_DIRTY_LOG.
+ *
+ * @mr: the memory region being dirtied.
+ * @addr: the address (relative to the start of the region) of the page
+ *        described by bit 0 of @bitmap.
+ * @bitmap: the dirty bitmap.
+ * @pages: number of pages described by @bitmap.
+ */
+void memory_region_set_dirty_lebitmap(MemoryRegion *mr,
+                                      target_phys_addr_t addr,
+                                      unsigned long *bitmap, uint64_t pages);
+
 /**
  * memory_region_sync_dirty_bitmap: Synchronize a region's dirty bitmap with
  *                                  any external TLBs (e.g. kvm)
@@ -469,6 +525,21 @@ void memory_region_reset_dirty(MemoryRegion *mr, target_phys_addr_t addr,
  */
 void memory_region_set_readonly(MemoryRegion *mr, bool readonly);
 
+/**
+ * memory_region_set_lockless: dispatch accesses without the global mutex
+ *
+ * Allows KVM vCPU threads to call the callbacks of an I/O region directly,
+ * instead of taking the global mutex for every access.  The callbacks must
+ * do their own synchronization and must not take the global mutex.  A
+ * reference keeps @mr from being destroyed while they run; clearing the
+ * flags waits for the accesses in progress.
+ *
+ * @mr: the region being updated; an I/O region without old_portio.
+ * @read: whether reads may be done without the global mutex.
+ * @write: whether writes may be done without the global mutex.
+ */
+void memory_region_set_lockless(MemoryRegion *mr, bool read, bool write);
+
 /**
  * memory_region_rom_device_set_readable: enable/disable ROM readability
  *
@@ -489,6 +560,12 @@ void memory_region_rom_device_set_readable(MemoryRegion *mr, bool readable);
  * Enabled writes to a region to be queued for later processing. MMIO ->write
  * callbacks may be delayed until a non-coalesced MMIO is issued.
  * Only useful for IO regions.  Roughly similar to write-combining hardware.
+ * Regions in the I/O address space use coalesced PIO where KVM supports it.
+ *
+ * Only opt in registers whose writes have no side effect that the guest
+ * can observe before it accesses a non-coalesced register of the device,
+ * e.g. index registers or values latched until a command is issued.
+ * Reads are never coalesced.
  *
  * @mr: the memory region to be write coalesced
  */
@@ -680,6 +757,23 @@ void memory_region_set_alias_offset(MemoryRegion *mr,
 MemoryRegionSection memory_region_find(MemoryRegion *address_space,
                                        target_phys_addr_t addr, uint64_t size);
 
+/**
+ * io_mem_access_lockless: access a lockless region without the global mutex
+ *
+ * Performs the access if @addr falls in a region that was made lockless
+ * with memory_region_set_lockless().  Returns false, without doing anything,
+ * if the access has to be done with the global mutex held.
+ *
+ * @address_space: get_system_memory() or get_system_io()
+ * @addr: address of the access within @address_space
+ * @data: the value read or to be written
+ * @size: size of the access: 1, 2 or 4 bytes
+ * @is_write: whether the access is a write
+ */
+bool io_mem_access_lockless(MemoryRegion *address_space,
+                            target_phys_addr_t addr, uint64_t *data,
+                            unsigned size, bool is_write);
+
 /**
  * memory_region_section_addr: get offset within MemoryRegionSection
  *
@@ -749,6 +843,18 @@ void memory_global_dirty_log_stop(void);
 
 void mtree_info(fprintf_function mon_printf, void *f);
 
+/**
+ * io_exits_info: print, for every mapped I/O region, how many accesses
+ * reached it directly and how many were replayed from the coalesced ring.
+ */
+void io_exits_info(fprintf_function mon_printf, void *f);
+
+/**
+ * memory_set_coalesced_replay: mark the accesses the calling thread issues
+ * from now on as replayed from the KVM coalesced ring (for io_exits_info()).
+ */
+void memory_set_coalesced_replay(bool replay);
+
 #endif
 
 #endif
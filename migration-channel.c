@@ -0,0 +1,232 @@
+/*
+ * QEMU live migration: additional RAM channels
+ *
+ * Copyright 2012 Red Hat, Inc. and/or its affiliates
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "hw/hw.h"
+#include "qemu_socket.h"
+#include "qemu-timer.h"
+#include "qemu-thread.h"
+#include "migration.h"
+
+//#define DEBUG_MIGRATION_CHANNEL
+
+#ifdef DEBUG_MIGRATION_CHANNEL
+#define DPRINTF(fmt, ...) \
+    do { printf("migration-channel: " fmt, ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...) \
+    do { } while (0)
+#endif
+
+/* length of a rate limiting slice, in milliseconds */
+#define CHANNEL_DELAY 100
+
+/*
+ * A channel is a write-only QEMUFile with a sender thread of its own.
+ * The migration thread fills the QEMUFile buffer as usual; on flush the
+ * buffer is handed to the sender thread, which puts it on the socket
+ * while the migration thread goes on producing the next one.  At most one
+ * buffer is in flight, so a slow channel stalls the migration thread
+ * instead of piling up memory.
+ */
+typedef struct QEMUFileChannel {
+    MigrationState *s;
+    QEMUFile *file;
+    int fd;
+    QemuThread thread;
+    QemuMutex lock;
+    QemuCond cond;
+    /* protected by lock */
+    uint8_t *buf;
+    int buf_size;
+    int len;            /* bytes waiting in buf, 0 when the sender is idle */
+    bool quit;
+    int error;
+    size_t xfer_limit;
+} QEMUFileChannel;
+
+/* Returns 0 or a negative errno */
+static int channel_send(QEMUFileChannel *c, const uint8_t *buf, int size)
+{
+    int offset = 0;
+
+    while (offset < size) {
+        ssize_t ret = send(c->fd, buf + offset, size - offset, 0);
+
+        if (ret > 0) {
+            offset += ret;
+            continue;
+        }
+        if (ret == 0) {
+            return -EIO;
+        }
+        if (socket_error() == EINTR) {
+            continue;
+        }
+        if (socket_error() == EAGAIN || socket_error() == EWOULDBLOCK) {
+            /* wake up now and then so that cancellation is noticed even
+             * if the other side stopped reading */
+            struct timeval tv = { .tv_sec = 0, .tv_usec = 100000 };
+            fd_set wfds;
+
+            if (!migration_is_active(c->s)) {
+                return -EIO;
+            }
+            FD_ZERO(&wfds);
+            FD_SET(c->fd, &wfds);
+            select(c->fd + 1, NULL, &wfds, NULL, &tv);
+            continue;
+        }
+        return -socket_error();
+    }
+
+    return 0;
+}
+
+static void *channel_thread(void *opaque)
+{
+    QEMUFileChannel *c = opaque;
+    int64_t slice_start = qemu_get_clock_ms(rt_clock);
+    size_t bytes_xfer = 0;
+
+    qemu_mutex_lock(&c->lock);
+    while (true) {
+        int64_t now;
+        int ret;
+
+        while (!c->len && !c->quit) {
+            qemu_cond_wait(&c->cond, &c->lock);
+        }
+        if (!c->len) {
+            break;
+        }
+
+        now = qemu_get_clock_ms(rt_clock);
+        if (now >= slice_start + CHANNEL_DELAY) {
+            bytes_xfer = 0;
+            slice_start = now;
+        }
+        if (bytes_xfer >= c->xfer_limit) {
+            /* out of budget for this slice, sleep until the next one */
+            qemu_mutex_unlock(&c->lock);
+            g_usleep((slice_start + CHANNEL_DELAY - now) * 1000);
+            qemu_mutex_lock(&c->lock);
+            continue;
+        }
+
+        qemu_mutex_unlock(&c->lock);
+        ret = channel_send(c, c->buf, c->len);
+        qemu_mutex_lock(&c->lock);
+
+        DPRINTF("sent %d bytes on fd %d: %d\n", c->len, c->fd, ret);
+        bytes_xfer += c->len;
+        c->len = 0;
+        if (ret < 0) {
+            c->error = ret;
+        }
+        qemu_cond_broadcast(&c->cond);
+    }
+    qemu_mutex_unlock(&c->lock);
+
+    return NULL;
+}
+
+static int channel_put_buffer(void *opaque, const uint8_t *buf,
+                              int64_t pos, int size)
+{
+    QEMUFileChannel *c = opaque;
+    int ret = size;
+
+    qemu_mutex_lock(&c->lock);
+    while (c->len && !c->error) {
+        qemu_cond_wait(&c->cond, &c->lock);
+    }
+    if (c->error) {
+        ret = c->error;
+    } else {
+        if (size > c->buf_size) {
+            c->buf = g_realloc(c->buf, size);
+            c->buf_size = size;
+        }
+        memcpy(c->buf, buf, size);
+        c->len = size;
+        qemu_cond_broadcast(&c->cond);
+    }
+    qemu_mutex_unlock(&c->lock);
+
+    return ret;
+}
+
+static int channel_close(void *opaque)
+{
+    QEMUFileChannel *c = opaque;
+    int ret;
+
+    DPRINTF("closing fd %d\n", c->fd);
+
+    /* the last buffer is sent before the thread goes away */
+    qemu_mutex_lock(&c->lock);
+    c->quit = true;
+    qemu_cond_broadcast(&c->cond);
+    qemu_mutex_unlock(&c->lock);
+    qemu_thread_join(&c->thread);
+
+    ret = c->error;
+    closesocket(c->fd);
+    qemu_cond_destroy(&c->cond);
+    qemu_mutex_destroy(&c->lock);
+    g_free(c->buf);
+    g_free(c);
+
+    return ret;
+}
+
+static int64_t channel_set_rate_limit(void *opaque, int64_t new_rate)
+{
+    QEMUFileChannel *c = opaque;
+
+    if (new_rate > SIZE_MAX) {
+        new_rate = SIZE_MAX;
+    }
+
+    qemu_mutex_lock(&c->lock);
+    c->xfer_limit = new_rate / (1000 / CHANNEL_DELAY);
+    qemu_mutex_unlock(&c->lock);
+
+    return new_rate;
+}
+
+static int64_t channel_get_rate_limit(void *opaque)
+{
+    QEMUFileChannel *c = opaque;
+
+    return c->xfer_limit * (1000 / CHANNEL_DELAY);
+}
+
+QEMUFile *qemu_fopen_migration_channel(MigrationState *s, int fd,
+                                       int64_t bytes_per_sec)
+{
+    QEMUFileChannel *c = g_malloc0(sizeof(*c));
+
+    c->s = s;
+    c->fd = fd;
+    c->xfer_limit = bytes_per_sec / (1000 / CHANNEL_DELAY);
+    qemu_mutex_init(&c->lock);
+    qemu_cond_init(&c->cond);
+    socket_set_nonblock(fd);
+
+    c->file = qemu_fopen_ops(c, channel_put_buffer, NULL, channel_close,
+                             NULL, channel_set_rate_limit,
+                             channel_get_rate_limit);
+
+    qemu_thread_create(&c->thread, channel_thread, c, QEMU_THREAD_JOINABLE);
+
+    return c->file;
+}
@@ -0,0 +1,1006 @@
+/*
+ * QEMU live migration over RDMA
+ *
+ * Copyright 2012 Red Hat, Inc. and/or its affiliates
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include <rdma/rdma_cma.h>
+#include <poll.h>
+#include <netdb.h>
+
+#include "qemu-common.h"
+#include "hw/hw.h"
+#include "cpu-common.h"
+#include "balloon.h"
+#include "qerror.h"
+#include "migration.h"
+
+//#define DEBUG_MIGRATION_RDMA
+
+#ifdef DEBUG_MIGRATION_RDMA
+#define DPRINTF(fmt, ...) \
+    do { printf("migration-rdma: " fmt, ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...) \
+    do { } while (0)
+#endif
+
+/*
+ * Guest RAM is registered with the adapter on both sides for the whole
+ * migration.  The destination tells the source where its RAM blocks are,
+ * and from then on the source writes dirty pages straight from its guest
+ * memory into the destination's with RDMA writes, without either CPU
+ * copying them.
+ *
+ * The migration stream itself (device state, zero pages, page headers of
+ * the pages that cannot be written directly) goes over send/receive
+ * messages on the same queue pair.  The destination keeps RDMA_RECV_COUNT
+ * buffers posted and hands them back to the source in batches with
+ * credit messages; the source never sends without a credit.
+ *
+ * A reliable connection delivers a message only after the writes posted
+ * before it, so once the destination reads the stream past some point,
+ * the pages written before that point are in place.
+ */
+
+/* size of a message buffer, header included */
+#define RDMA_BUF_SIZE           (64 * 1024)
+/* message buffers posted for receiving on each side */
+#define RDMA_RECV_COUNT         16
+#define RDMA_CREDIT_BATCH       (RDMA_RECV_COUNT / 2)
+/* sends and writes in flight */
+#define RDMA_SEND_DEPTH         128
+/* contiguous pages are merged into writes of up to this size */
+#define RDMA_WRITE_MAX          (1024 * 1024)
+
+#define RDMA_RESOLVE_TIMEOUT_MS 10000
+#define RDMA_POLL_TIMEOUT_MS    100
+
+enum {
+    RDMA_MSG_DATA = 1,          /* migration stream bytes */
+    RDMA_MSG_CREDIT,            /* be32: buffers posted again */
+    RDMA_MSG_BLOCKS,            /* RDMABlockDesc array */
+};
+
+typedef struct RDMAMsgHeader {
+    uint32_t type;
+    uint32_t len;               /* payload, not counting the header */
+} RDMAMsgHeader;
+
+#define RDMA_MSG_MAX (RDMA_BUF_SIZE - sizeof(RDMAMsgHeader))
+
+/* A destination RAM block, as sent to the source; big endian */
+typedef struct RDMABlockDesc {
+    uint64_t addr;
+    uint64_t length;
+    uint32_t rkey;
+    uint32_t padding;
+    char idstr[256];
+} RDMABlockDesc;
+
+/* work request ids: kind in the upper half, buffer index in the lower */
+#define RDMA_WRID_SEND          (1ULL << 32)
+#define RDMA_WRID_RECV          (2ULL << 32)
+#define RDMA_WRID_WRITE         (3ULL << 32)
+#define RDMA_WRID_KIND(id)      ((id) & ~0xffffffffULL)
+#define RDMA_WRID_INDEX(id)     ((int)((id) & 0xffffffffULL))
+
+typedef struct RDMABlock {
+    char idstr[256];
+    uint8_t *host;
+    uint64_t length;
+    struct ibv_mr *mr;
+    /* source only: the block of the same name on the destination */
+    bool has_remote;
+    uint64_t remote_addr;
+    uint32_t rkey;
+} RDMABlock;
+
+typedef struct RDMAContext {
+    /* outgoing only, to notice cancellation while waiting */
+    MigrationState *s;
+    bool incoming;
+
+    struct rdma_event_channel *cm_channel;
+    struct rdma_cm_id *listen_id;
+    struct rdma_cm_id *cm_id;
+    struct ibv_pd *pd;
+    struct ibv_comp_channel *comp_channel;
+    struct ibv_cq *cq;
+    bool connected;
+    /* sticky, once set the connection is unusable */
+    int error;
+
+    bool pinned;
+    RDMABlock *blocks;
+    int nb_blocks;
+    RDMABlock *last_block;
+    bool got_blocks;
+
+    uint8_t *send_bufs;
+    struct ibv_mr *send_mr;
+    bool send_busy[RDMA_RECV_COUNT];
+    int next_send;
+    /* sends and writes posted but not completed */
+    int outstanding;
+    /* DATA messages the peer has room for */
+    int credits;
+
+    uint8_t *recv_bufs;
+    struct ibv_mr *recv_mr;
+    /* payload length of the DATA message in each buffer, -1 if none */
+    int recv_len[RDMA_RECV_COUNT];
+    int recv_head;
+    int recv_offset;
+    int recv_consumed;
+
+    /* pages queued for the next write */
+    RDMABlock *pending_block;
+    uint8_t *pending_host;
+    size_t pending_len;
+} RDMAContext;
+
+static struct addrinfo *rdma_resolve_host(const char *host_port, bool passive)
+{
+    char *host = g_strdup(host_port);
+    char *port = strrchr(host, ':');
+    char *name = host;
+    struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+        .ai_flags = passive ? AI_PASSIVE : 0,
+    };
+    struct addrinfo *res = NULL;
+    int ret;
+
+    if (!port) {
+        fprintf(stderr, "rdma: '%s' is not host:port\n", host_port);
+        g_free(host);
+        return NULL;
+    }
+    *port++ = '\0';
+    if (name[0] == '[' && name[strlen(name) - 1] == ']') {
+        name[strlen(name) - 1] = '\0';
+        name++;
+    }
+
+    ret = getaddrinfo(name[0] ? name : NULL, port, &hints, &res);
+    if (ret != 0) {
+        fprintf(stderr, "rdma: address resolution failed for %s: %s\n",
+                host_port, gai_strerror(ret));
+        res = NULL;
+    }
+    g_free(host);
+    return res;
+}
+
+static void rdma_register_block(const char *idstr, void *host_addr,
+                                ram_addr_t length, void *opaque)
+{
+    RDMAContext *r = opaque;
+    RDMABlock *b;
+    /* even the source pins its pages writable: a read-only registration
+     * of memory the guest has not touched yet would pin the shared zero
+     * page, and keep sending it after the guest writes there */
+    int access = IBV_ACCESS_LOCAL_WRITE;
+
+    if (r->error || !host_addr || !length) {
+        return;
+    }
+    if (r->incoming) {
+        access |= IBV_ACCESS_REMOTE_WRITE;
+    }
+
+    r->blocks = g_renew(RDMABlock, r->blocks, r->nb_blocks + 1);
+    b = &r->blocks[r->nb_blocks];
+    memset(b, 0, sizeof(*b));
+    pstrcpy(b->idstr, sizeof(b->idstr), idstr);
+    b->host = host_addr;
+    b->length = length;
+    b->mr = ibv_reg_mr(r->pd, host_addr, length, access);
+    if (!b->mr) {
+        fprintf(stderr, "rdma: failed to register RAM block %s: %s\n",
+                idstr, strerror(errno));
+        r->error = -errno;
+        return;
+    }
+    r->nb_blocks++;
+}
+
+static int rdma_post_recv(RDMAContext *r, int idx)
+{
+    struct ibv_sge sge = {
+        .addr = (uintptr_t)(r->recv_bufs + idx * RDMA_BUF_SIZE),
+        .length = RDMA_BUF_SIZE,
+        .lkey = r->recv_mr->lkey,
+    };
+    struct ibv_recv_wr wr = {
+        .wr_id = RDMA_WRID_RECV | idx,
+        .sg_list = &sge,
+        .num_sge = 1,
+    };
+    struct ibv_recv_wr *bad_wr;
+    int ret;
+
+    r->recv_len[idx] = -1;
+    ret = ibv_post_recv(r->cm_id->qp, &wr, &bad_wr);
+    return ret ? -ret : 0;
+}
+
+/* Sets up the queue pair and registers guest RAM, before connecting */
+static int rdma_init_context(RDMAContext *r)
+{
+    struct ibv_context *verbs = r->cm_id->verbs;
+    struct ibv_qp_init_attr attr = {
+        .cap = {
+            .max_send_wr = RDMA_SEND_DEPTH,
+            .max_recv_wr = RDMA_RECV_COUNT,
+            .max_send_sge = 1,
+            .max_recv_sge = 1,
+        },
+        .qp_type = IBV_QPT_RC,
+    };
+    size_t bufs_size = RDMA_RECV_COUNT * RDMA_BUF_SIZE;
+    int i, ret;
+
+    r->pd = ibv_alloc_pd(verbs);
+    r->comp_channel = ibv_create_comp_channel(verbs);
+    if (!r->pd || !r->comp_channel) {
+        return -ENOMEM;
+    }
+    r->cq = ibv_create_cq(verbs, RDMA_SEND_DEPTH + RDMA_RECV_COUNT, NULL,
+                          r->comp_channel, 0);
+    if (!r->cq) {
+        return -ENOMEM;
+    }
+    attr.send_cq = r->cq;
+    attr.recv_cq = r->cq;
+    if (rdma_create_qp(r->cm_id, r->pd, &attr) < 0) {
+        return -errno;
+    }
+
+    r->send_bufs = g_malloc(bufs_size);
+    r->recv_bufs = g_malloc(bufs_size);
+    r->send_mr = ibv_reg_mr(r->pd, r->send_bufs, bufs_size, 0);
+    r->recv_mr = ibv_reg_mr(r->pd, r->recv_bufs, bufs_size,
+                            IBV_ACCESS_LOCAL_WRITE);
+    if (!r->send_mr || !r->recv_mr) {
+        return -ENOMEM;
+    }
+    for (i = 0; i < RDMA_RECV_COUNT; i++) {
+        ret = rdma_post_recv(r, i);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    r->credits = RDMA_RECV_COUNT;
+
+    /* registered pages must not be discarded under the adapter's feet */
+    r->pinned = true;
+    qemu_balloon_inhibit(true);
+    qemu_ram_foreach_block(rdma_register_block, r);
+
+    return r->error;
+}
+
+static void rdma_cleanup(RDMAContext *r)
+{
+    int i;
+
+    if (r->connected) {
+        rdma_disconnect(r->cm_id);
+    }
+    if (r->cm_id && r->cm_id->qp) {
+        rdma_destroy_qp(r->cm_id);
+    }
+    for (i = 0; i < r->nb_blocks; i++) {
+        ibv_dereg_mr(r->blocks[i].mr);
+    }
+    if (r->pinned) {
+        qemu_balloon_inhibit(false);
+    }
+    g_free(r->blocks);
+    if (r->send_mr) {
+        ibv_dereg_mr(r->send_mr);
+    }
+    if (r->recv_mr) {
+        ibv_dereg_mr(r->recv_mr);
+    }
+    g_free(r->send_bufs);
+    g_free(r->recv_bufs);
+    if (r->cq) {
+        ibv_destroy_cq(r->cq);
+    }
+    if (r->comp_channel) {
+        ibv_destroy_comp_channel(r->comp_channel);
+    }
+    if (r->pd) {
+        ibv_dealloc_pd(r->pd);
+    }
+    if (r->cm_id) {
+        rdma_destroy_id(r->cm_id);
+    }
+    if (r->listen_id) {
+        rdma_destroy_id(r->listen_id);
+    }
+    if (r->cm_channel) {
+        rdma_destroy_event_channel(r->cm_channel);
+    }
+    g_free(r);
+}
+
+/* Waits for the next connection manager event, which must be @type */
+static int rdma_wait_cm_event(RDMAContext *r, enum rdma_cm_event_type type)
+{
+    struct rdma_cm_event *ev;
+    int ret = 0;
+
+    if (rdma_get_cm_event(r->cm_channel, &ev) < 0) {
+        return -errno;
+    }
+    if (ev->event != type) {
+        fprintf(stderr, "rdma: expected %s, got %s\n",
+                rdma_event_str(type), rdma_event_str(ev->event));
+        ret = -ECONNREFUSED;
+    }
+    rdma_ack_cm_event(ev);
+    return ret;
+}
+
+static void rdma_handle_cm_event(RDMAContext *r)
+{
+    struct rdma_cm_event *ev;
+    struct rdma_cm_id *id;
+
+    if (rdma_get_cm_event(r->cm_channel, &ev) < 0) {
+        return;
+    }
+    DPRINTF("%s\n", rdma_event_str(ev->event));
+
+    id = ev->id;
+    switch (ev->event) {
+    case RDMA_CM_EVENT_CONNECT_REQUEST:
+        /* one migration at a time */
+        rdma_reject(id, NULL, 0);
+        rdma_ack_cm_event(ev);
+        rdma_destroy_id(id);
+        return;
+    case RDMA_CM_EVENT_DISCONNECTED:
+    case RDMA_CM_EVENT_DEVICE_REMOVAL:
+        r->connected = false;
+        break;
+    default:
+        break;
+    }
+    rdma_ack_cm_event(ev);
+}
+
+static int rdma_parse_blocks(RDMAContext *r, const uint8_t *buf, uint32_t len)
+{
+    int i, j;
+
+    if (len % sizeof(RDMABlockDesc)) {
+        return -EINVAL;
+    }
+
+    for (i = 0; i < len / sizeof(RDMABlockDesc); i++) {
+        RDMABlockDesc desc;
+
+        memcpy(&desc, buf + i * sizeof(desc), sizeof(desc));
+        desc.idstr[sizeof(desc.idstr) - 1] = '\0';
+        for (j = 0; j < r->nb_blocks; j++) {
+            RDMABlock *b = &r->blocks[j];
+
+            if (!strcmp(b->idstr, desc.idstr) &&
+                b->length == be64_to_cpu(desc.length)) {
+                b->has_remote = true;
+                b->remote_addr = be64_to_cpu(desc.addr);
+                b->rkey = be32_to_cpu(desc.rkey);
+                break;
+            }
+        }
+        if (j == r->nb_blocks) {
+            /* its pages just go through the stream */
+            DPRINTF("no local block for %s\n", desc.idstr);
+        }
+    }
+    r->got_blocks = true;
+
+    return 0;
+}
+
+static int rdma_handle_recv(RDMAContext *r, int idx, uint32_t byte_len)
+{
+    RDMAMsgHeader *hdr = (RDMAMsgHeader *)(r->recv_bufs + idx * RDMA_BUF_SIZE);
+    uint8_t *payload = (uint8_t *)(hdr + 1);
+    uint32_t len;
+    int ret;
+
+    if (byte_len < sizeof(*hdr) ||
+        be32_to_cpu(hdr->len) != byte_len - sizeof(*hdr)) {
+        return -EINVAL;
+    }
+    len = be32_to_cpu(hdr->len);
+
+    switch (be32_to_cpu(hdr->type)) {
+    case RDMA_MSG_DATA:
+        /* consumed, and posted again, by rdma_get_buffer */
+        r->recv_len[idx] = len;
+        return 0;
+    case RDMA_MSG_CREDIT:
+        if (len != sizeof(uint32_t)) {
+            return -EINVAL;
+        }
+        r->credits += be32_to_cpu(*(uint32_t *)payload);
+        break;
+    case RDMA_MSG_BLOCKS:
+        ret = rdma_parse_blocks(r, payload, len);
+        if (ret < 0) {
+            return ret;
+        }
+        break;
+    default:
+        return -EINVAL;
+    }
+
+    return rdma_post_recv(r, idx);
+}
+
+static int rdma_complete(RDMAContext *r, struct ibv_wc *wc)
+{
+    int idx = RDMA_WRID_INDEX(wc->wr_id);
+
+    if (wc->status != IBV_WC_SUCCESS) {
+        DPRINTF("work request %" PRIx64 " failed: %s\n", wc->wr_id,
+                ibv_wc_status_str(wc->status));
+        return -EIO;
+    }
+
+    switch (RDMA_WRID_KIND(wc->wr_id)) {
+    case RDMA_WRID_SEND:
+        r->send_busy[idx] = false;
+        r->outstanding--;
+        return 0;
+    case RDMA_WRID_WRITE:
+        r->outstanding--;
+        return 0;
+    case RDMA_WRID_RECV:
+        return rdma_handle_recv(r, idx, wc->byte_len);
+    default:
+        return -EINVAL;
+    }
+}
+
+/* Sleeps until the completion queue has something, for at most
+ * RDMA_POLL_TIMEOUT_MS; connection events are handled meanwhile.
+ * Returns true if there is a completion to look at.
+ */
+static bool rdma_wait_event(RDMAContext *r)
+{
+    struct pollfd pfd[2] = {
+        { .fd = r->comp_channel->fd, .events = POLLIN },
+        { .fd = r->cm_channel->fd, .events = POLLIN },
+    };
+    struct ibv_cq *cq;
+    void *cq_context;
+
+    if (poll(pfd, 2, RDMA_POLL_TIMEOUT_MS) < 0 && errno != EINTR) {
+        r->error = -errno;
+        return false;
+    }
+    if (r->s && !migration_is_active(r->s)) {
+        r->error = -EIO;
+        return false;
+    }
+    if (pfd[1].revents & POLLIN) {
+        rdma_handle_cm_event(r);
+    }
+    if (!(pfd[0].revents & POLLIN)) {
+        return false;
+    }
+
+    if (ibv_get_cq_event(r->comp_channel, &cq, &cq_context)) {
+        r->error = -EIO;
+        return false;
+    }
+    ibv_ack_cq_events(cq, 1);
+    return true;
+}
+
+/* Reaps one completion.  If there is none and @wait is set, waits a bit for
+ * one.  Returns 1 if a completion was reaped, 0 if none, -errno once the
+ * connection is unusable.
+ */
+static int rdma_poll(RDMAContext *r, bool wait)
+{
+    struct ibv_wc wc;
+    int ret;
+
+    if (r->error) {
+        return r->error;
+    }
+
+    ret = ibv_poll_cq(r->cq, 1, &wc);
+    if (ret == 0 && wait) {
+        /* arm the notification and look again: a completion that comes in
+         * between the two would not wake us up */
+        if (ibv_req_notify_cq(r->cq, 0)) {
+            ret = -1;
+        } else {
+            ret = ibv_poll_cq(r->cq, 1, &wc);
+            if (ret == 0 && rdma_wait_event(r)) {
+                ret = ibv_poll_cq(r->cq, 1, &wc);
+            }
+        }
+    }
+
+    if (r->error) {
+        return r->error;
+    }
+    if (ret < 0 || (ret == 0 && !r->connected)) {
+        r->error = -EIO;
+        return r->error;
+    }
+    if (ret == 0) {
+        return 0;
+    }
+
+    ret = rdma_complete(r, &wc);
+    if (ret < 0) {
+        r->error = ret;
+        return ret;
+    }
+    return 1;
+}
+
+static int rdma_send_msg(RDMAContext *r, uint32_t type, const void *data,
+                         uint32_t len)
+{
+    int idx = r->next_send;
+    RDMAMsgHeader *hdr = (RDMAMsgHeader *)(r->send_bufs + idx * RDMA_BUF_SIZE);
+    struct ibv_sge sge = {
+        .addr = (uintptr_t)hdr,
+        .length = sizeof(*hdr) + len,
+        .lkey = r->send_mr->lkey,
+    };
+    struct ibv_send_wr wr = {
+        .wr_id = RDMA_WRID_SEND | idx,
+        .sg_list = &sge,
+        .num_sge = 1,
+        .opcode = IBV_WR_SEND,
+        .send_flags = IBV_SEND_SIGNALED,
+    };
+    struct ibv_send_wr *bad_wr;
+    int ret;
+
+    assert(len <= RDMA_MSG_MAX);
+
+    while ((type == RDMA_MSG_DATA && r->credits == 0) ||
+           r->send_busy[idx] || r->outstanding >= RDMA_SEND_DEPTH) {
+        ret = rdma_poll(r, true);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    hdr->type = cpu_to_be32(type);
+    hdr->len = cpu_to_be32(len);
+    memcpy(hdr + 1, data, len);
+
+    ret = ibv_post_send(r->cm_id->qp, &wr, &bad_wr);
+    if (ret) {
+        r->error = -ret;
+        return r->error;
+    }
+    r->send_busy[idx] = true;
+    r->outstanding++;
+    r->next_send = (idx + 1) % RDMA_RECV_COUNT;
+    if (type == RDMA_MSG_DATA) {
+        r->credits--;
+    }
+
+    return 0;
+}
+
+/* Posts the write of the queued pages, if any */
+static int rdma_post_write(RDMAContext *r)
+{
+    RDMABlock *b = r->pending_block;
+    struct ibv_sge sge;
+    struct ibv_send_wr wr = {
+        .wr_id = RDMA_WRID_WRITE,
+        .sg_list = &sge,
+        .num_sge = 1,
+        .opcode = IBV_WR_RDMA_WRITE,
+        .send_flags = IBV_SEND_SIGNALED,
+    };
+    struct ibv_send_wr *bad_wr;
+    int ret;
+
+    if (!b) {
+        return r->error;
+    }
+    r->pending_block = NULL;
+
+    while (r->outstanding >= RDMA_SEND_DEPTH) {
+        ret = rdma_poll(r, true);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    sge.addr = (uintptr_t)r->pending_host;
+    sge.length = r->pending_len;
+    sge.lkey = b->mr->lkey;
+    wr.wr.rdma.remote_addr = b->remote_addr + (r->pending_host - b->host);
+    wr.wr.rdma.rkey = b->rkey;
+
+    ret = ibv_post_send(r->cm_id->qp, &wr, &bad_wr);
+    if (ret) {
+        r->error = -ret;
+        return r->error;
+    }
+    r->outstanding++;
+
+    /* reap what is done without waiting, to keep the queue short */
+    do {
+        ret = rdma_poll(r, false);
+    } while (ret > 0);
+
+    return ret;
+}
+
+static RDMABlock *rdma_find_block(RDMAContext *r, uint8_t *host, size_t len)
+{
+    RDMABlock *b = r->last_block;
+    int i;
+
+    if (b && host >= b->host && host + len <= b->host + b->length) {
+        return b;
+    }
+    for (i = 0; i < r->nb_blocks; i++) {
+        b = &r->blocks[i];
+        if (host >= b->host && host + len <= b->host + b->length) {
+            r->last_block = b;
+            return b;
+        }
+    }
+    return NULL;
+}
+
+static int rdma_write_ram(MigrationState *s, void *host, size_t len)
+{
+    RDMAContext *r = s->opaque;
+    uint8_t *p = host;
+    RDMABlock *b;
+    int ret;
+
+    if (r->error) {
+        return r->error;
+    }
+
+    b = r->pending_block;
+    if (b && p == r->pending_host + r->pending_len &&
+        p + len <= b->host + b->length &&
+        r->pending_len + len <= RDMA_WRITE_MAX) {
+        r->pending_len += len;
+        return 0;
+    }
+
+    b = rdma_find_block(r, p, len);
+    if (!b || !b->has_remote) {
+        return -ENOENT;
+    }
+
+    ret = rdma_post_write(r);
+    if (ret < 0) {
+        return ret;
+    }
+    r->pending_block = b;
+    r->pending_host = p;
+    r->pending_len = len;
+
+    return 0;
+}
+
+static int rdma_errno(MigrationState *s)
+{
+    RDMAContext *r = s->opaque;
+
+    return -r->error;
+}
+
+static int rdma_write(MigrationState *s, const void *buf, size_t size)
+{
+    RDMAContext *r = s->opaque;
+    size_t offset = 0;
+    int ret;
+
+    /* the pages written so far must land before what follows them */
+    ret = rdma_post_write(r);
+    while (ret == 0 && offset < size) {
+        size_t len = MIN(size - offset, RDMA_MSG_MAX);
+
+        ret = rdma_send_msg(r, RDMA_MSG_DATA, (const uint8_t *)buf + offset,
+                            len);
+        offset += len;
+    }
+
+    if (ret < 0) {
+        r->error = ret;
+        return -1;
+    }
+    return size;
+}
+
+static int rdma_close(MigrationState *s)
+{
+    RDMAContext *r = s->opaque;
+    int ret;
+
+    DPRINTF("rdma_close\n");
+
+    s->write_ram = NULL;
+    s->opaque = NULL;
+
+    /* when done, the last messages must be through before disconnecting;
+     * otherwise there is nothing left to wait for */
+    r->s = NULL;
+    if (migration_has_finished(s)) {
+        rdma_post_write(r);
+        while (!r->error && r->outstanding) {
+            rdma_poll(r, true);
+        }
+    }
+    ret = r->error;
+    rdma_cleanup(r);
+
+    return ret;
+}
+
+int rdma_start_outgoing_migration(MigrationState *s, const char *host_port,
+                                  Error **errp)
+{
+    RDMAContext *r = g_malloc0(sizeof(*r));
+    struct rdma_conn_param param = {
+        .initiator_depth = 1,
+        .responder_resources = 1,
+        .retry_count = 7,
+        .rnr_retry_count = 7,
+    };
+    struct addrinfo *res;
+    int i, ret;
+
+    s->fd = -1;
+
+    res = rdma_resolve_host(host_port, false);
+    if (!res) {
+        error_set(errp, QERR_SOCKET_CONNECT_FAILED);
+        goto fail;
+    }
+
+    r->cm_channel = rdma_create_event_channel();
+    if (!r->cm_channel ||
+        rdma_create_id(r->cm_channel, &r->cm_id, NULL, RDMA_PS_TCP) < 0) {
+        freeaddrinfo(res);
+        error_set(errp, QERR_SOCKET_CREATE_FAILED);
+        goto fail;
+    }
+
+    ret = rdma_resolve_addr(r->cm_id, NULL, res->ai_addr,
+                            RDMA_RESOLVE_TIMEOUT_MS);
+    freeaddrinfo(res);
+    if (ret < 0 ||
+        rdma_wait_cm_event(r, RDMA_CM_EVENT_ADDR_RESOLVED) < 0 ||
+        rdma_resolve_route(r->cm_id, RDMA_RESOLVE_TIMEOUT_MS) < 0 ||
+        rdma_wait_cm_event(r, RDMA_CM_EVENT_ROUTE_RESOLVED) < 0) {
+        fprintf(stderr, "rdma: could not resolve %s\n", host_port);
+        error_set(errp, QERR_SOCKET_CONNECT_FAILED);
+        goto fail;
+    }
+
+    ret = rdma_init_context(r);
+    if (ret < 0) {
+        fprintf(stderr, "rdma: could not set up the connection: %s\n",
+                strerror(-ret));
+        error_set(errp, QERR_SOCKET_CREATE_FAILED);
+        goto fail;
+    }
+
+    if (rdma_connect(r->cm_id, &param) < 0 ||
+        rdma_wait_cm_event(r, RDMA_CM_EVENT_ESTABLISHED) < 0) {
+        error_set(errp, QERR_SOCKET_CONNECT_FAILED);
+        goto fail;
+    }
+    r->connected = true;
+
+    /* the destination sends its RAM layout first thing */
+    for (i = 0; !r->got_blocks &&
+                i < RDMA_RESOLVE_TIMEOUT_MS / RDMA_POLL_TIMEOUT_MS; i++) {
+        if (rdma_poll(r, true) < 0) {
+            break;
+        }
+    }
+    if (!r->got_blocks) {
+        fprintf(stderr, "rdma: destination did not describe its RAM\n");
+        error_set(errp, QERR_SOCKET_CONNECT_FAILED);
+        goto fail;
+    }
+
+    DPRINTF("connected to %s\n", host_port);
+    r->s = s;
+    s->opaque = r;
+    s->get_error = rdma_errno;
+    s->write = rdma_write;
+    s->close = rdma_close;
+    s->write_ram = rdma_write_ram;
+    migrate_fd_connect(s);
+    return 0;
+
+fail:
+    rdma_cleanup(r);
+    migrate_fd_error(s);
+    return -1;
+}
+
+static int rdma_send_blocks(RDMAContext *r)
+{
+    RDMABlockDesc *descs;
+    int i, ret;
+
+    if (r->nb_blocks * sizeof(RDMABlockDesc) > RDMA_MSG_MAX) {
+        return -E2BIG;
+    }
+
+    descs = g_new0(RDMABlockDesc, r->nb_blocks);
+    for (i = 0; i < r->nb_blocks; i++) {
+        RDMABlock *b = &r->blocks[i];
+
+        descs[i].addr = cpu_to_be64((uintptr_t)b->host);
+        descs[i].length = cpu_to_be64(b->length);
+        descs[i].rkey = cpu_to_be32(b->mr->rkey);
+        pstrcpy(descs[i].idstr, sizeof(descs[i].idstr), b->idstr);
+    }
+    ret = rdma_send_msg(r, RDMA_MSG_BLOCKS, descs,
+                        r->nb_blocks * sizeof(RDMABlockDesc));
+    g_free(descs);
+
+    return ret;
+}
+
+static int rdma_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
+{
+    RDMAContext *r = opaque;
+    int idx = r->recv_head;
+    int len, ret;
+
+    while (r->recv_len[idx] < 0) {
+        ret = rdma_poll(r, true);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    len = MIN(size, r->recv_len[idx] - r->recv_offset);
+    memcpy(buf, r->recv_bufs + idx * RDMA_BUF_SIZE + sizeof(RDMAMsgHeader) +
+           r->recv_offset, len);
+    r->recv_offset += len;
+
+    if (r->recv_offset == r->recv_len[idx]) {
+        /* done with this buffer, give it back to the source */
+        r->recv_offset = 0;
+        r->recv_head = (idx + 1) % RDMA_RECV_COUNT;
+        ret = rdma_post_recv(r, idx);
+        if (ret == 0 && ++r->recv_consumed == RDMA_CREDIT_BATCH) {
+            uint32_t credits = cpu_to_be32(r->recv_consumed);
+
+            r->recv_consumed = 0;
+            ret = rdma_send_msg(r, RDMA_MSG_CREDIT, &credits,
+                                sizeof(credits));
+        }
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return len;
+}
+
+static void rdma_accept_incoming_migration(void *opaque)
+{
+    RDMAContext *r = opaque;
+    struct rdma_conn_param param = {
+        .initiator_depth = 1,
+        .responder_resources = 1,
+        .rnr_retry_count = 7,
+    };
+    struct rdma_cm_event *ev;
+    QEMUFile *f;
+    int ret;
+
+    if (rdma_get_cm_event(r->cm_channel, &ev) < 0) {
+        return;
+    }
+    if (ev->event != RDMA_CM_EVENT_CONNECT_REQUEST) {
+        rdma_ack_cm_event(ev);
+        return;
+    }
+    r->cm_id = ev->id;
+    rdma_ack_cm_event(ev);
+
+    qemu_set_fd_handler2(r->cm_channel->fd, NULL, NULL, NULL, NULL);
+    DPRINTF("connection request\n");
+
+    ret = rdma_init_context(r);
+    if (ret < 0) {
+        fprintf(stderr, "rdma: could not set up the connection: %s\n",
+                strerror(-ret));
+        rdma_reject(r->cm_id, NULL, 0);
+        goto out;
+    }
+    if (rdma_accept(r->cm_id, &param) < 0 ||
+        rdma_wait_cm_event(r, RDMA_CM_EVENT_ESTABLISHED) < 0) {
+        fprintf(stderr, "could not accept migration connection\n");
+        goto out;
+    }
+    r->connected = true;
+
+    ret = rdma_send_blocks(r);
+    if (ret < 0) {
+        fprintf(stderr, "rdma: could not describe RAM to the source: %s\n",
+                strerror(-ret));
+        goto out;
+    }
+
+    f = qemu_fopen_ops(r, NULL, rdma_get_buffer, NULL, NULL, NULL, NULL);
+    process_incoming_migration(f);
+    qemu_fclose(f);
+out:
+    rdma_cleanup(r);
+}
+
+int rdma_start_incoming_migration(const char *host_port, Error **errp)
+{
+    RDMAContext *r = g_malloc0(sizeof(*r));
+    struct addrinfo *res;
+    int ret;
+
+    r->incoming = true;
+
+    res = rdma_resolve_host(host_port, true);
+    if (!res) {
+        error_set(errp, QERR_SOCKET_CREATE_FAILED);
+        goto fail;
+    }
+
+    r->cm_channel = rdma_create_event_channel();
+    if (!r->cm_channel ||
+        rdma_create_id(r->cm_channel, &r->listen_id, NULL, RDMA_PS_TCP) < 0) {
+        freeaddrinfo(res);
+        error_set(errp, QERR_SOCKET_CREATE_FAILED);
+        goto fail;
+    }
+
+    ret = rdma_bind_addr(r->listen_id, res->ai_addr);
+    freeaddrinfo(res);
+    if (ret < 0) {
+        error_set(errp, QERR_SOCKET_BIND_FAILED);
+        goto fail;
+    }
+    if (rdma_listen(r->listen_id, 1) < 0) {
+        error_set(errp, QERR_SOCKET_LISTEN_FAILED);
+        goto fail;
+    }
+
+    qemu_set_fd_handler2(r->cm_channel->fd, NULL,
+                         rdma_accept_incoming_migration, NULL, r);
+    return 0;
+
+fail:
+    rdma_cleanup(r);
+    return -1;
+}
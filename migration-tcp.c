@@ -19,6 +19,7 @@
 #include "qemu-char.h"
 #include "buffered_file.h"
 #include "block.h"
+#include "iov.h"
 
 //#define DEBUG_MIGRATION_TCP
 
@@ -40,6 +41,17 @@ static int socket_write(MigrationState *s, const void * buf, size_t size)
     return send(s->fd, buf, size, 0);
 }
 
+static ssize_t socket_writev(MigrationState *s, struct iovec *iov, int iovcnt,
+                             size_t offset, size_t bytes)
+{
+    return iov_send(s->fd, iov, iovcnt, offset, bytes);
+}
+
+static int socket_read(MigrationState *s, void *buf, size_t size)
+{
+    return qemu_recv(s->fd, buf, size, 0);
+}
+
 static int tcp_close(MigrationState *s)
 {
     int r = 0;
@@ -79,6 +91,22 @@ static void tcp_wait_for_connect(void *opaque)
     }
 }
 
+static int tcp_open_channel(MigrationState *s)
+{
+    Error *local_err = NULL;
+    int fd;
+
+    fd = inet_connect(s->host_port, true, NULL, &local_err);
+    if (error_is_set(&local_err)) {
+        fprintf(stderr, "migration: could not connect channel: %s\n",
+                error_get_pretty(local_err));
+        error_free(local_err);
+        return -ECONNREFUSED;
+    }
+
+    return fd;
+}
+
 int tcp_start_outgoing_migration(MigrationState *s, const char *host_port,
                                  Error **errp)
 {
@@ -86,7 +114,11 @@ int tcp_start_outgoing_migration(MigrationState *s, const char *host_port,
 
     s->get_error = socket_errno;
     s->write = socket_write;
+    s->writev = socket_writev;
+    s->read = socket_read;
     s->close = tcp_close;
+    s->open_channel = tcp_open_channel;
+    s->host_port = g_strdup(host_port);
 
     s->fd = inet_connect(host_port, false, &in_progress, errp);
     if (error_is_set(errp)) {
@@ -104,6 +136,42 @@ int tcp_start_outgoing_migration(MigrationState *s, const char *host_port,
     return 0;
 }
 
+/* How long the source gets to connect the channels it announced */
+#define TCP_CHANNEL_ACCEPT_TIMEOUT 10
+
+static int tcp_accept_channel(void *opaque)
+{
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    int s = (intptr_t)opaque;
+    int c, ret;
+
+    do {
+        struct timeval tv = { .tv_sec = TCP_CHANNEL_ACCEPT_TIMEOUT };
+        fd_set rfds;
+
+        FD_ZERO(&rfds);
+        FD_SET(s, &rfds);
+        ret = select(s + 1, &rfds, NULL, NULL, &tv);
+    } while (ret == -1 && socket_error() == EINTR);
+
+    if (ret <= 0) {
+        return ret == 0 ? -ETIMEDOUT : -socket_error();
+    }
+
+    do {
+        c = qemu_accept(s, (struct sockaddr *)&addr, &addrlen);
+    } while (c == -1 && socket_error() == EINTR);
+
+    if (c == -1) {
+        return -socket_error();
+    }
+
+    DPRINTF("accepted migration channel\n");
+    socket_set_block(c);
+    return c;
+}
+
 static void tcp_accept_incoming_migration(void *opaque)
 {
     struct sockaddr_in addr;
@@ -129,7 +197,11 @@ static void tcp_accept_incoming_migration(void *opaque)
         goto out;
     }
 
+    migrate_incoming_set_accept_channel(tcp_accept_channel, opaque);
+    migrate_incoming_set_return_path(c);
     process_incoming_migration(f);
+    migrate_incoming_set_return_path(-1);
+    migrate_incoming_set_accept_channel(NULL, NULL);
     qemu_fclose(f);
 out:
     close(c);
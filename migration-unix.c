@@ -19,6 +19,7 @@
 #include "qemu-char.h"
 #include "buffered_file.h"
 #include "block.h"
+#include "iov.h"
 
 //#define DEBUG_MIGRATION_UNIX
 
@@ -40,6 +41,17 @@ static int unix_write(MigrationState *s, const void * buf, size_t size)
     return write(s->fd, buf, size);
 }
 
+static ssize_t unix_writev(MigrationState *s, struct iovec *iov, int iovcnt,
+                           size_t offset, size_t bytes)
+{
+    return iov_send(s->fd, iov, iovcnt, offset, bytes);
+}
+
+static int unix_read(MigrationState *s, void *buf, size_t size)
+{
+    return read(s->fd, buf, size);
+}
+
 static int unix_close(MigrationState *s)
 {
     int r = 0;
@@ -88,6 +100,8 @@ int unix_start_outgoing_migration(MigrationState *s, const char *path)
     snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
     s->get_error = unix_errno;
     s->write = unix_write;
+    s->writev = unix_writev;
+    s->read = unix_read;
     s->close = unix_close;
 
     s->fd = qemu_socket(PF_UNIX, SOCK_STREAM, 0);
@@ -143,7 +157,9 @@ static void unix_accept_incoming_migration(void *opaque)
         goto out;
     }
 
+    migrate_incoming_set_return_path(c);
     process_incoming_migration(f);
+    migrate_incoming_set_return_path(-1);
     qemu_fclose(f);
 out:
     close(c);
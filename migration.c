@@ -22,6 +22,7 @@
 #include "qemu_socket.h"
 #include "block-migration.h"
 #include "qmp-commands.h"
+#include "cpus.h"
 
 //#define DEBUG_MIGRATION
 
@@ -46,6 +47,22 @@ enum {
 /* Migration XBZRLE default cache size */
 #define DEFAULT_MIGRATE_CACHE_SIZE (64 * 1024 * 1024)
 
+/* Default compression parameters for the compress capability */
+#define DEFAULT_MIGRATE_COMPRESS_LEVEL 1
+#define DEFAULT_MIGRATE_COMPRESS_THREAD_COUNT 8
+#define DEFAULT_MIGRATE_DECOMPRESS_THREAD_COUNT 2
+#define MAX_MIGRATE_COMPRESS_THREAD_COUNT 255
+
+/* No bound on the number of pre-copy passes by default */
+#define DEFAULT_MIGRATE_MAX_PRECOPY_PASSES 0
+
+/* Everything goes over the main stream by default */
+#define DEFAULT_MIGRATE_CHANNEL_COUNT 1
+
+/* Reads block migration keeps in flight while copying the disks */
+#define DEFAULT_MIGRATE_BLOCK_INFLIGHT 16
+#define MAX_MIGRATE_BLOCK_INFLIGHT 1024
+
 static NotifierList migration_state_notifiers =
     NOTIFIER_LIST_INITIALIZER(migration_state_notifiers);
 
@@ -59,6 +76,12 @@ static MigrationState *migrate_get_current(void)
         .state = MIG_STATE_SETUP,
         .bandwidth_limit = MAX_THROTTLE,
         .xbzrle_cache_size = DEFAULT_MIGRATE_CACHE_SIZE,
+        .compress_level = DEFAULT_MIGRATE_COMPRESS_LEVEL,
+        .compress_thread_count = DEFAULT_MIGRATE_COMPRESS_THREAD_COUNT,
+        .decompress_thread_count = DEFAULT_MIGRATE_DECOMPRESS_THREAD_COUNT,
+        .max_precopy_passes = DEFAULT_MIGRATE_MAX_PRECOPY_PASSES,
+        .channel_count = DEFAULT_MIGRATE_CHANNEL_COUNT,
+        .block_inflight = DEFAULT_MIGRATE_BLOCK_INFLIGHT,
     };
 
     return &current_migration;
@@ -71,6 +94,10 @@ int qemu_start_incoming_migration(const char *uri, Error **errp)
 
     if (strstart(uri, "tcp:", &p))
         ret = tcp_start_incoming_migration(p, errp);
+#ifdef CONFIG_RDMA
+    else if (strstart(uri, "rdma:", &p))
+        ret = rdma_start_incoming_migration(p, errp);
+#endif
 #if !defined(WIN32)
     else if (strstart(uri, "exec:", &p))
         ret =  exec_start_incoming_migration(p);
@@ -78,6 +105,8 @@ int qemu_start_incoming_migration(const char *uri, Error **errp)
         ret = unix_start_incoming_migration(p);
     else if (strstart(uri, "fd:", &p))
         ret = fd_start_incoming_migration(p);
+    else if (strstart(uri, "template:", &p))
+        ret = template_start_incoming_migration(p, errp);
 #endif
     else {
         fprintf(stderr, "unknown migration protocol: %s\n", uri);
@@ -86,6 +115,41 @@ int qemu_start_incoming_migration(const char *uri, Error **errp)
     return ret;
 }
 
+static MigrationAcceptChannelFunc *incoming_accept_channel;
+static void *incoming_accept_channel_opaque;
+
+/* Set by transports that can take additional channels for the duration
+ * of an incoming migration */
+void migrate_incoming_set_accept_channel(MigrationAcceptChannelFunc *func,
+                                         void *opaque)
+{
+    incoming_accept_channel = func;
+    incoming_accept_channel_opaque = opaque;
+}
+
+int migrate_incoming_accept_channel(void)
+{
+    if (!incoming_accept_channel) {
+        return -ENOTSUP;
+    }
+    return incoming_accept_channel(incoming_accept_channel_opaque);
+}
+
+static int incoming_return_path = -1;
+
+/* Set by transports for the duration of an incoming migration, -1 for none */
+void migrate_incoming_set_return_path(int fd)
+{
+    incoming_return_path = fd;
+}
+
+int migrate_incoming_return_path(void)
+{
+    return incoming_return_path;
+}
+
+const char *migration_page_store;
+
 void process_incoming_migration(QEMUFile *f)
 {
     if (qemu_loadvm_state(f) < 0) {
@@ -141,6 +205,22 @@ MigrationCapabilityStatusList *qmp_query_migrate_capabilities(Error **errp)
     return head;
 }
 
+MigrationParameters *qmp_query_migrate_parameters(Error **errp)
+{
+    MigrationParameters *params;
+    MigrationState *s = migrate_get_current();
+
+    params = g_malloc0(sizeof(*params));
+    params->compress_level = s->compress_level;
+    params->compress_threads = s->compress_thread_count;
+    params->decompress_threads = s->decompress_thread_count;
+    params->max_precopy_passes = s->max_precopy_passes;
+    params->channels = s->channel_count;
+    params->block_inflight = s->block_inflight;
+
+    return params;
+}
+
 static void get_xbzrle_cache_stats(MigrationInfo *info)
 {
     if (migrate_use_xbzrle()) {
@@ -149,11 +229,32 @@ static void get_xbzrle_cache_stats(MigrationInfo *info)
         info->xbzrle_cache->cache_size = migrate_xbzrle_cache_size();
         info->xbzrle_cache->bytes = xbzrle_mig_bytes_transferred();
         info->xbzrle_cache->pages = xbzrle_mig_pages_transferred();
+        info->xbzrle_cache->cache_hit = xbzrle_mig_pages_cache_hit();
         info->xbzrle_cache->cache_miss = xbzrle_mig_pages_cache_miss();
         info->xbzrle_cache->overflow = xbzrle_mig_pages_overflow();
     }
 }
 
+static void get_dedup_stats(MigrationInfo *info)
+{
+    if (migrate_use_dedup()) {
+        info->has_dedup = true;
+        info->dedup = g_malloc0(sizeof(*info->dedup));
+        info->dedup->pages = dedup_mig_pages_transferred();
+        info->dedup->resent = dedup_mig_pages_resent();
+    }
+}
+
+static void get_compression_stats(MigrationInfo *info)
+{
+    if (migrate_use_compression()) {
+        info->has_compression = true;
+        info->compression = g_malloc0(sizeof(*info->compression));
+        info->compression->pages = compress_mig_pages_transferred();
+        info->compression->compressed_size = compress_mig_bytes_transferred();
+    }
+}
+
 MigrationInfo *qmp_query_migrate(Error **errp)
 {
     MigrationInfo *info = g_malloc0(sizeof(*info));
@@ -161,7 +262,9 @@ MigrationInfo *qmp_query_migrate(Error **errp)
 
     switch (s->state) {
     case MIG_STATE_SETUP:
-        /* no migration has happened ever */
+        /* no outgoing migration ever, but this may be the destination */
+        info->devices = qemu_savevm_device_stats();
+        info->has_devices = info->devices != NULL;
         break;
     case MIG_STATE_ACTIVE:
         info->has_status = true;
@@ -178,6 +281,7 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         info->ram->duplicate = dup_mig_pages_transferred();
         info->ram->normal = norm_mig_pages_transferred();
         info->ram->normal_bytes = norm_mig_bytes_transferred();
+        info->ram->dirty_sync_count = ram_dirty_sync_count();
 
         if (blk_mig_active()) {
             info->has_disk = true;
@@ -188,13 +292,25 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         }
 
         get_xbzrle_cache_stats(info);
+        get_compression_stats(info);
+        get_dedup_stats(info);
+
+        if (migrate_auto_converge()) {
+            info->has_cpu_throttle_percentage = true;
+            info->cpu_throttle_percentage = cpu_throttle_get_percentage();
+        }
         break;
     case MIG_STATE_COMPLETED:
         get_xbzrle_cache_stats(info);
+        get_compression_stats(info);
+        get_dedup_stats(info);
 
         info->has_status = true;
         info->status = g_strdup("completed");
+        info->has_total_time = true;
         info->total_time = s->total_time;
+        info->has_downtime = true;
+        info->downtime = s->downtime;
 
         info->has_ram = true;
         info->ram = g_malloc0(sizeof(*info->ram));
@@ -204,6 +320,10 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         info->ram->duplicate = dup_mig_pages_transferred();
         info->ram->normal = norm_mig_pages_transferred();
         info->ram->normal_bytes = norm_mig_bytes_transferred();
+        info->ram->dirty_sync_count = ram_dirty_sync_count();
+
+        info->devices = qemu_savevm_device_stats();
+        info->has_devices = info->devices != NULL;
         break;
     case MIG_STATE_ERROR:
         info->has_status = true;
@@ -234,8 +354,121 @@ void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
     }
 }
 
+void qmp_migrate_set_parameters(bool has_compress_level,
+                                int64_t compress_level,
+                                bool has_compress_threads,
+                                int64_t compress_threads,
+                                bool has_decompress_threads,
+                                int64_t decompress_threads,
+                                bool has_max_precopy_passes,
+                                int64_t max_precopy_passes,
+                                bool has_channels, int64_t channels,
+                                bool has_block_inflight,
+                                int64_t block_inflight,
+                                Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (s->state == MIG_STATE_ACTIVE) {
+        error_set(errp, QERR_MIGRATION_ACTIVE);
+        return;
+    }
+
+    if (has_compress_level && (compress_level < 0 || compress_level > 9)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "compress-level",
+                  "is invalid, it should be in the range of 0 to 9");
+        return;
+    }
+    if (has_compress_threads &&
+        (compress_threads < 1 ||
+         compress_threads > MAX_MIGRATE_COMPRESS_THREAD_COUNT)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "compress-threads",
+                  "is invalid, it should be in the range of 1 to 255");
+        return;
+    }
+    if (has_decompress_threads &&
+        (decompress_threads < 1 ||
+         decompress_threads > MAX_MIGRATE_COMPRESS_THREAD_COUNT)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "decompress-threads",
+                  "is invalid, it should be in the range of 1 to 255");
+        return;
+    }
+    if (has_max_precopy_passes &&
+        (max_precopy_passes < 0 || max_precopy_passes > INT_MAX)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "max-precopy-passes",
+                  "is invalid, it should be a positive number or 0");
+        return;
+    }
+    if (has_channels && (channels < 1 || channels > MAX_MIGRATE_CHANNELS)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "channels",
+                  "is invalid, it should be in the range of 1 to 16");
+        return;
+    }
+    if (has_block_inflight &&
+        (block_inflight < 1 || block_inflight > MAX_MIGRATE_BLOCK_INFLIGHT)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "block-inflight",
+                  "is invalid, it should be in the range of 1 to 1024");
+        return;
+    }
+
+    if (has_compress_level) {
+        s->compress_level = compress_level;
+    }
+    if (has_compress_threads) {
+        s->compress_thread_count = compress_threads;
+    }
+    if (has_decompress_threads) {
+        s->decompress_thread_count = decompress_threads;
+    }
+    if (has_max_precopy_passes) {
+        s->max_precopy_passes = max_precopy_passes;
+    }
+    if (has_channels) {
+        s->channel_count = channels;
+    }
+    if (has_block_inflight) {
+        s->block_inflight = block_inflight;
+    }
+}
+
 /* shared migration helpers */
 
+/* Connects the additional RAM channels; each one gets an even share of
+ * the bandwidth.  Called from the main loop, once the main stream is up. */
+static int migrate_fd_open_channels(MigrationState *s)
+{
+    while (s->nr_channel_files < s->channel_count - 1) {
+        int fd = s->open_channel(s);
+
+        if (fd < 0) {
+            DPRINTF("failed to open channel: %s\n", strerror(-fd));
+            return fd;
+        }
+        s->channel_files[s->nr_channel_files++] =
+            qemu_fopen_migration_channel(s, fd,
+                                         s->bandwidth_limit / s->channel_count);
+    }
+
+    return 0;
+}
+
+/* Sends what is left on the channels and closes them.  Called with the
+ * iothread lock held, so that migrate_set_speed does not race with it. */
+static int migrate_fd_close_channels(MigrationState *s)
+{
+    int ret = 0;
+
+    while (s->nr_channel_files) {
+        int r = qemu_fclose(s->channel_files[--s->nr_channel_files]);
+
+        if (r < 0) {
+            ret = r;
+        }
+    }
+
+    return ret;
+}
+
 static int migrate_fd_cleanup(MigrationState *s)
 {
     int ret = 0;
@@ -248,6 +481,12 @@ static int migrate_fd_cleanup(MigrationState *s)
         s->file = NULL;
     }
 
+    if (migrate_fd_close_channels(s) < 0) {
+        ret = -EIO;
+    }
+    g_free(s->host_port);
+    s->host_port = NULL;
+
     if (s->fd != -1) {
         close(s->fd);
         s->fd = -1;
@@ -264,27 +503,44 @@ void migrate_fd_error(MigrationState *s)
     migrate_fd_cleanup(s);
 }
 
-static void migrate_fd_completed(MigrationState *s)
+/* Runs in the main loop once the migration thread has finished */
+static void migrate_fd_cleanup_bh(void *opaque)
 {
-    DPRINTF("setting completed state\n");
-    if (migrate_fd_cleanup(s) < 0) {
+    MigrationState *s = opaque;
+
+    qemu_bh_delete(s->cleanup_bh);
+    s->cleanup_bh = NULL;
+
+    DPRINTF("cleaning up after the migration thread\n");
+    if (migrate_fd_cleanup(s) < 0 && s->state == MIG_STATE_COMPLETED) {
         s->state = MIG_STATE_ERROR;
-    } else {
-        s->state = MIG_STATE_COMPLETED;
+    }
+
+    if (s->state == MIG_STATE_COMPLETED) {
         runstate_set(RUN_STATE_POSTMIGRATE);
+    } else {
+        if (s->block_inactive) {
+            /* the destination never started, take the images back */
+            bdrv_invalidate_cache_all();
+            s->block_inactive = false;
+        }
+        if (s->old_vm_running) {
+            vm_start();
+        }
     }
     notifier_list_notify(&migration_state_notifiers, s);
 }
 
-static void migrate_fd_put_notify(void *opaque)
+/* Called from the migration thread, with the iothread lock held, as the
+ * last thing it does.  A cancelled migration keeps its state.
+ */
+static void migrate_fd_finish(MigrationState *s, int state)
 {
-    MigrationState *s = opaque;
-
-    qemu_set_fd_handler2(s->fd, NULL, NULL, NULL, NULL);
-    qemu_file_put_notify(s->file);
-    if (s->file && qemu_file_get_error(s->file)) {
-        migrate_fd_error(s);
+    if (s->state == MIG_STATE_ACTIVE) {
+        s->state = state;
     }
+    s->cleanup_bh = qemu_bh_new(migrate_fd_cleanup_bh, s);
+    qemu_bh_schedule(s->cleanup_bh);
 }
 
 static ssize_t migrate_fd_put_buffer(void *opaque, const void *data,
@@ -304,46 +560,104 @@ static ssize_t migrate_fd_put_buffer(void *opaque, const void *data,
     if (ret == -1)
         ret = -(s->get_error(s));
 
-    if (ret == -EAGAIN) {
-        qemu_set_fd_handler2(s->fd, NULL, NULL, migrate_fd_put_notify, s);
+    return ret;
+}
+
+static ssize_t migrate_fd_writev_buffer(void *opaque, struct iovec *iov,
+                                        int iovcnt, size_t offset,
+                                        size_t bytes)
+{
+    MigrationState *s = opaque;
+    ssize_t ret;
+
+    if (s->state != MIG_STATE_ACTIVE) {
+        return -EIO;
     }
 
+    do {
+        ret = s->writev(s, iov, iovcnt, offset, bytes);
+    } while (ret == -1 && ((s->get_error(s)) == EINTR));
+
+    if (ret == -1)
+        ret = -(s->get_error(s));
+
     return ret;
 }
 
-static void migrate_fd_put_ready(void *opaque)
+static int migrate_fd_setup(void *opaque)
 {
     MigrationState *s = opaque;
     int ret;
 
-    if (s->state != MIG_STATE_ACTIVE) {
-        DPRINTF("put_ready returning because of non-active state\n");
-        return;
+    qemu_mutex_lock_iothread();
+    DPRINTF("beginning savevm\n");
+    ret = qemu_savevm_state_begin(s->file, &s->params);
+    if (ret < 0) {
+        DPRINTF("failed, %d\n", ret);
+        migrate_fd_finish(s, MIG_STATE_ERROR);
     }
+    qemu_mutex_unlock_iothread();
 
-    DPRINTF("iterate\n");
-    ret = qemu_savevm_state_iterate(s->file);
-    if (ret < 0) {
-        migrate_fd_error(s);
-    } else if (ret == 1) {
-        int old_vm_running = runstate_is_running();
+    return ret;
+}
+
+/* Called from the migration thread.  RAM is sent without the iothread
+ * lock; it is only taken for the final stop-and-copy phase and on the
+ * way out.  Returns false once the thread should stop.
+ */
+static bool migrate_fd_put_ready(void *opaque)
+{
+    MigrationState *s = opaque;
+    int ret = 0;
+
+    if (s->state == MIG_STATE_ACTIVE) {
+        DPRINTF("iterate\n");
+        ret = qemu_savevm_state_iterate(s->file);
+        if (ret == 0) {
+            return true;
+        }
+    }
+
+    qemu_mutex_lock_iothread();
+    if (s->state != MIG_STATE_ACTIVE) {
+        DPRINTF("put_ready stopping because of non-active state\n");
+        qemu_savevm_state_cancel(s->file);
+        migrate_fd_finish(s, s->state);
+        migrate_fd_close_channels(s);
+    } else if (ret < 0) {
+        qemu_savevm_state_cancel(s->file);
+        /* leave the active state first, so that stuck channels give up */
+        migrate_fd_finish(s, MIG_STATE_ERROR);
+        migrate_fd_close_channels(s);
+    } else {
+        int64_t stop_time = qemu_get_clock_ms(rt_clock);
 
         DPRINTF("done iterating\n");
+        s->old_vm_running = runstate_is_running();
         qemu_system_wakeup_request(QEMU_WAKEUP_REASON_OTHER);
         vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
+        assert(!runstate_is_running());
 
-        if (qemu_savevm_state_complete(s->file) < 0) {
-            migrate_fd_error(s);
-        } else {
-            migrate_fd_completed(s);
+        /* the destination reads what the images keep in memory */
+        ret = bdrv_inactivate_all();
+        s->block_inactive = true;
+        if (ret >= 0) {
+            ret = qemu_savevm_state_complete(s->file);
         }
-        s->total_time = qemu_get_clock_ms(rt_clock) - s->total_time;
-        if (s->state != MIG_STATE_COMPLETED) {
-            if (old_vm_running) {
-                vm_start();
-            }
+        if (ret >= 0) {
+            qemu_fflush(s->file);
+            ret = qemu_file_get_error(s->file);
+        }
+        if (migrate_fd_close_channels(s) < 0 && ret >= 0) {
+            ret = -EIO;
         }
+        s->downtime = qemu_get_clock_ms(rt_clock) - stop_time;
+        s->total_time = qemu_get_clock_ms(rt_clock) - s->total_time;
+        migrate_fd_finish(s, ret < 0 ? MIG_STATE_ERROR : MIG_STATE_COMPLETED);
     }
+    qemu_mutex_unlock_iothread();
+
+    return false;
 }
 
 static void migrate_fd_cancel(MigrationState *s)
@@ -353,11 +667,8 @@ static void migrate_fd_cancel(MigrationState *s)
 
     DPRINTF("cancelling migration\n");
 
+    /* The migration thread notices and cleans up after itself */
     s->state = MIG_STATE_CANCELLED;
-    notifier_list_notify(&migration_state_notifiers, s);
-    qemu_savevm_state_cancel(s->file);
-
-    migrate_fd_cleanup(s);
 }
 
 static void migrate_fd_wait_for_unfreeze(void *opaque)
@@ -371,12 +682,16 @@ static void migrate_fd_wait_for_unfreeze(void *opaque)
 
     do {
         fd_set wfds;
+        /* wake up now and then so that cancellation is noticed even if
+         * the other side stopped reading */
+        struct timeval tv = { .tv_sec = 0, .tv_usec = 100000 };
 
         FD_ZERO(&wfds);
         FD_SET(s->fd, &wfds);
 
-        ret = select(s->fd + 1, NULL, &wfds, NULL, NULL);
-    } while (ret == -1 && (s->get_error(s)) == EINTR);
+        ret = select(s->fd + 1, NULL, &wfds, NULL, &tv);
+    } while ((ret == 0 && s->state == MIG_STATE_ACTIVE) ||
+             (ret == -1 && (s->get_error(s)) == EINTR));
 
     if (ret == -1) {
         qemu_file_set_error(s->file, -s->get_error(s));
@@ -406,6 +721,14 @@ bool migration_is_active(MigrationState *s)
     return s->state == MIG_STATE_ACTIVE;
 }
 
+/* True from the start of an outgoing migration until its thread is gone */
+bool migration_in_progress(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->state == MIG_STATE_ACTIVE || s->file;
+}
+
 bool migration_has_finished(MigrationState *s)
 {
     return s->state == MIG_STATE_COMPLETED;
@@ -419,24 +742,20 @@ bool migration_has_failed(MigrationState *s)
 
 void migrate_fd_connect(MigrationState *s)
 {
-    int ret;
-
     s->state = MIG_STATE_ACTIVE;
+    if (migrate_fd_open_channels(s) < 0) {
+        migrate_fd_error(s);
+        return;
+    }
     s->file = qemu_fopen_ops_buffered(s,
                                       s->bandwidth_limit,
                                       migrate_fd_put_buffer,
+                                      s->writev ? migrate_fd_writev_buffer
+                                                : NULL,
+                                      migrate_fd_setup,
                                       migrate_fd_put_ready,
                                       migrate_fd_wait_for_unfreeze,
                                       migrate_fd_close);
-
-    DPRINTF("beginning savevm\n");
-    ret = qemu_savevm_state_begin(s->file, &s->params);
-    if (ret < 0) {
-        DPRINTF("failed, %d\n", ret);
-        migrate_fd_error(s);
-        return;
-    }
-    migrate_fd_put_ready(s);
 }
 
 static MigrationState *migrate_init(const MigrationParams *params)
@@ -445,6 +764,11 @@ static MigrationState *migrate_init(const MigrationParams *params)
     int64_t bandwidth_limit = s->bandwidth_limit;
     bool enabled_capabilities[MIGRATION_CAPABILITY_MAX];
     int64_t xbzrle_cache_size = s->xbzrle_cache_size;
+    int compress_level = s->compress_level;
+    int compress_thread_count = s->compress_thread_count;
+    int decompress_thread_count = s->decompress_thread_count;
+    int max_precopy_passes = s->max_precopy_passes;
+    int channel_count = s->channel_count;
 
     memcpy(enabled_capabilities, s->enabled_capabilities,
            sizeof(enabled_capabilities));
@@ -455,6 +779,11 @@ static MigrationState *migrate_init(const MigrationParams *params)
     memcpy(s->enabled_capabilities, enabled_capabilities,
            sizeof(enabled_capabilities));
     s->xbzrle_cache_size = xbzrle_cache_size;
+    s->compress_level = compress_level;
+    s->compress_thread_count = compress_thread_count;
+    s->decompress_thread_count = decompress_thread_count;
+    s->max_precopy_passes = max_precopy_passes;
+    s->channel_count = channel_count;
 
     s->bandwidth_limit = bandwidth_limit;
     s->state = MIG_STATE_SETUP;
@@ -487,7 +816,8 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
     params.blk = blk;
     params.shared = inc;
 
-    if (s->state == MIG_STATE_ACTIVE) {
+    /* a cancelled migration thread may still be on its way out */
+    if (s->state == MIG_STATE_ACTIVE || s->file) {
         error_set(errp, QERR_MIGRATION_ACTIVE);
         return;
     }
@@ -501,10 +831,33 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         return;
     }
 
+    if (s->channel_count > 1) {
+        if (!strstart(uri, "tcp:", NULL)) {
+            error_set(errp, QERR_INVALID_PARAMETER_VALUE, "channels",
+                      "1 for migration protocols other than tcp");
+            return;
+        }
+        if (migrate_use_compression()) {
+            error_set(errp, QERR_INVALID_PARAMETER_COMBINATION);
+            return;
+        }
+    }
+
+    /* pages written with RDMA are neither cached nor compressed */
+    if (strstart(uri, "rdma:", NULL) &&
+        (migrate_use_xbzrle() || migrate_use_compression())) {
+        error_set(errp, QERR_INVALID_PARAMETER_COMBINATION);
+        return;
+    }
+
     s = migrate_init(&params);
 
     if (strstart(uri, "tcp:", &p)) {
         ret = tcp_start_outgoing_migration(s, p, errp);
+#ifdef CONFIG_RDMA
+    } else if (strstart(uri, "rdma:", &p)) {
+        ret = rdma_start_outgoing_migration(s, p, errp);
+#endif
 #if !defined(WIN32)
     } else if (strstart(uri, "exec:", &p)) {
         ret = exec_start_outgoing_migration(s, p);
@@ -557,6 +910,7 @@ int64_t qmp_query_migrate_cache_size(Error **errp)
 void qmp_migrate_set_speed(int64_t value, Error **errp)
 {
     MigrationState *s;
+    int i;
 
     if (value < 0) {
         value = 0;
@@ -565,6 +919,10 @@ void qmp_migrate_set_speed(int64_t value, Error **errp)
     s = migrate_get_current();
     s->bandwidth_limit = value;
     qemu_file_set_rate_limit(s->file, s->bandwidth_limit);
+    for (i = 0; i < s->nr_channel_files; i++) {
+        qemu_file_set_rate_limit(s->channel_files[i],
+                                 s->bandwidth_limit / s->channel_count);
+    }
 }
 
 void qmp_migrate_set_downtime(double value, Error **errp)
@@ -591,3 +949,159 @@ int64_t migrate_xbzrle_cache_size(void)
 
     return s->xbzrle_cache_size;
 }
+
+bool migrate_auto_converge(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_AUTO_CONVERGE];
+}
+
+bool migrate_use_zero_range(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_ZERO_RANGE];
+}
+
+bool migrate_use_compression(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_COMPRESS];
+}
+
+int migrate_compress_level(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->compress_level;
+}
+
+int migrate_compress_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->compress_thread_count;
+}
+
+int migrate_decompress_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->decompress_thread_count;
+}
+
+/* Number of additional RAM channels of the outgoing migration */
+int migrate_channel_file_count(void)
+{
+    return migrate_get_current()->nr_channel_files;
+}
+
+QEMUFile *migrate_channel_file(int i)
+{
+    MigrationState *s = migrate_get_current();
+
+    assert(i < s->nr_channel_files);
+    return s->channel_files[i];
+}
+
+/* Whether the transport can take RAM pages out of band, see write_ram */
+bool migrate_use_ram_writes(void)
+{
+    return migrate_get_current()->write_ram != NULL;
+}
+
+int migrate_write_ram(void *host, size_t len)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->write_ram(s, host, len);
+}
+
+bool migrate_use_dedup(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_DEDUP];
+}
+
+/* Whether the destination can answer on the connection, see read.  Only
+ * while an outgoing migration runs: read stays set after it finished, and
+ * savevm must not mistake its file for the migration stream. */
+bool migrate_has_return_path(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->read != NULL && s->fd != -1 && migration_is_active(s);
+}
+
+/* Reads what the destination sent back.  Returns the number of bytes
+ * read, 0 if nothing is pending and @wait is false, or -errno. */
+int migrate_read_return_path(void *buf, size_t len, bool wait)
+{
+    MigrationState *s = migrate_get_current();
+
+    while (true) {
+        struct timeval tv = { .tv_sec = 0, .tv_usec = 100000 };
+        fd_set rfds;
+        int ret, err;
+
+        ret = s->read(s, buf, len);
+        if (ret > 0) {
+            return ret;
+        }
+        if (ret == 0) {
+            return -EIO;
+        }
+        err = s->get_error(s);
+        if (err == EINTR) {
+            continue;
+        }
+        if (err != EAGAIN && err != EWOULDBLOCK) {
+            return -err;
+        }
+        if (!wait) {
+            return 0;
+        }
+        /* wake up now and then to notice cancellation */
+        if (!migration_is_active(s)) {
+            return -EIO;
+        }
+        FD_ZERO(&rfds);
+        FD_SET(s->fd, &rfds);
+        select(s->fd + 1, &rfds, NULL, NULL, &tv);
+    }
+}
+
+int migrate_max_precopy_passes(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->max_precopy_passes;
+}
+
+int migrate_block_inflight(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->block_inflight;
+}
@@ -19,6 +19,7 @@
 #include "notify.h"
 #include "error.h"
 #include "vmstate.h"
+#include "main-loop.h"
 #include "qapi-types.h"
 
 struct MigrationParams {
@@ -28,6 +29,9 @@ struct MigrationParams {
 
 typedef struct MigrationState MigrationState;
 
+/* Upper bound on the number of streams RAM is sent over */
+#define MAX_MIGRATE_CHANNELS 16
+
 struct MigrationState
 {
     int64_t bandwidth_limit;
@@ -37,15 +41,54 @@ struct MigrationState
     int (*get_error)(MigrationState *s);
     int (*close)(MigrationState *s);
     int (*write)(MigrationState *s, const void *buff, size_t size);
+    /* like write, for @bytes of @iov from @offset on; NULL if the
+     * transport has no gathering write */
+    ssize_t (*writev)(MigrationState *s, struct iovec *iov, int iovcnt,
+                      size_t offset, size_t bytes);
+    /* reads what the destination sends back on the connection; NULL if
+     * the transport only goes one way */
+    int (*read)(MigrationState *s, void *buf, size_t size);
+    /* connects an additional channel, returns its fd or -errno */
+    int (*open_channel)(MigrationState *s);
+    /* places RAM straight in the destination's memory, bypassing the
+     * stream; returns 0 or -errno.  NULL if the transport cannot. */
+    int (*write_ram)(MigrationState *s, void *host, size_t len);
     void *opaque;
     MigrationParams params;
     int64_t total_time;
+    int64_t downtime;
+    bool old_vm_running;
+    bool block_inactive;        /* images written back for the destination */
+    QEMUBH *cleanup_bh;
     bool enabled_capabilities[MIGRATION_CAPABILITY_MAX];
     int64_t xbzrle_cache_size;
+    int compress_level;
+    int compress_thread_count;
+    int decompress_thread_count;
+    int max_precopy_passes;
+    int channel_count;
+    int block_inflight;
+    char *host_port;
+    QEMUFile *channel_files[MAX_MIGRATE_CHANNELS - 1];
+    int nr_channel_files;
 };
 
 void process_incoming_migration(QEMUFile *f);
 
+/* Accepts an additional incoming channel, returns its fd or -errno */
+typedef int MigrationAcceptChannelFunc(void *opaque);
+
+void migrate_incoming_set_accept_channel(MigrationAcceptChannelFunc *func,
+                                         void *opaque);
+int migrate_incoming_accept_channel(void);
+
+/* Set by transports whose connection can carry data back to the source */
+void migrate_incoming_set_return_path(int fd);
+int migrate_incoming_return_path(void);
+
+/* Page store of the dedup capability on the destination, see -migration-page-store */
+extern const char *migration_page_store;
+
 int qemu_start_incoming_migration(const char *uri, Error **errp);
 
 uint64_t migrate_max_downtime(void);
@@ -69,8 +112,15 @@ int unix_start_outgoing_migration(MigrationState *s, const char *path);
 
 int fd_start_incoming_migration(const char *path);
 
+int template_start_incoming_migration(const char *filename, Error **errp);
+
 int fd_start_outgoing_migration(MigrationState *s, const char *fdname);
 
+int rdma_start_incoming_migration(const char *host_port, Error **errp);
+
+int rdma_start_outgoing_migration(MigrationState *s, const char *host_port,
+                                  Error **errp);
+
 void migrate_fd_error(MigrationState *s);
 
 void migrate_fd_connect(MigrationState *s);
@@ -78,12 +128,14 @@ void migrate_fd_connect(MigrationState *s);
 void add_migration_state_change_notifier(Notifier *notify);
 void remove_migration_state_change_notifier(Notifier *notify);
 bool migration_is_active(MigrationState *);
+bool migration_in_progress(void);
 bool migration_has_finished(MigrationState *);
 bool migration_has_failed(MigrationState *);
 
 uint64_t ram_bytes_remaining(void);
 uint64_t ram_bytes_transferred(void);
 uint64_t ram_bytes_total(void);
+uint64_t ram_dirty_sync_count(void);
 
 extern SaveVMHandlers savevm_ram_handlers;
 
@@ -94,7 +146,12 @@ uint64_t norm_mig_pages_transferred(void);
 uint64_t xbzrle_mig_bytes_transferred(void);
 uint64_t xbzrle_mig_pages_transferred(void);
 uint64_t xbzrle_mig_pages_overflow(void);
+uint64_t xbzrle_mig_pages_cache_hit(void);
 uint64_t xbzrle_mig_pages_cache_miss(void);
+uint64_t compress_mig_pages_transferred(void);
+uint64_t compress_mig_bytes_transferred(void);
+uint64_t dedup_mig_pages_transferred(void);
+uint64_t dedup_mig_pages_resent(void);
 
 /**
  * @migrate_add_blocker - prevent migration from proceeding
@@ -112,6 +169,9 @@ void migrate_del_blocker(Error *reason);
 
 int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen);
+/* Same output as xbzrle_encode_buffer, without vector instructions */
+int xbzrle_encode_buffer_scalar(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                                uint8_t *dst, int dlen);
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen);
 
 int migrate_use_xbzrle(void);
@@ -119,4 +179,23 @@ int64_t migrate_xbzrle_cache_size(void);
 
 int64_t xbzrle_cache_resize(int64_t new_size);
 
+bool migrate_auto_converge(void);
+bool migrate_use_zero_range(void);
+bool migrate_use_compression(void);
+int migrate_compress_level(void);
+int migrate_compress_threads(void);
+int migrate_decompress_threads(void);
+int migrate_max_precopy_passes(void);
+int migrate_channel_file_count(void);
+int migrate_block_inflight(void);
+bool migrate_use_ram_writes(void);
+int migrate_write_ram(void *host, size_t len);
+bool migrate_use_dedup(void);
+bool migrate_has_return_path(void);
+int migrate_read_return_path(void *buf, size_t len, bool wait);
+QEMUFile *migrate_channel_file(int i);
+
+QEMUFile *qemu_fopen_migration_channel(MigrationState *s, int fd,
+                                       int64_t bytes_per_sec);
+
 #endif
@@ -67,6 +67,7 @@
 #include "qmp-commands.h"
 #include "hmp.h"
 #include "qemu-thread.h"
+#include "qemu-config.h"
 
 /* for pic/irq_info */
 #if defined(TARGET_SPARC)
@@ -160,6 +161,7 @@ struct MonFdset {
 
 typedef struct MonitorControl {
     QObject *id;
+    QString *json_return;
     JSONMessageParser parser;
     int command_mode;
 } MonitorControl;
@@ -174,7 +176,8 @@ typedef struct MonitorEventState {
     int64_t rate;       /* Period over which to throttle. 0 to disable */
     int64_t last;       /* Time at which event was last emitted */
     QEMUTimer *timer;   /* Timer for handling delayed events */
-    QObject *data;      /* Event pending delayed dispatch */
+    const char *key;    /* Member of 'data' naming the instance, or NULL */
+    GHashTable *pending; /* Instance -> latest event pending dispatch */
 } MonitorEventState;
 
 struct Monitor {
@@ -384,12 +387,49 @@ static QDict *build_qmp_error_dict(const QError *err)
     return qobject_to_qdict(obj);
 }
 
+void monitor_set_json_return(Monitor *mon, QString *json)
+{
+    QDECREF(mon->mc->json_return);
+    mon->mc->json_return = json;
+}
+
+/*
+ * Send a reply whose return value is already JSON text.  It is written
+ * piecewise, so that a large return value is not copied once more; it
+ * is not pretty-printed.
+ */
+static void monitor_json_return_emitter(Monitor *mon, QString *json)
+{
+    QString *id;
+
+    monitor_puts(mon, "{\"return\": ");
+    monitor_puts(mon, qstring_get_str(json));
+    if (mon->mc->id) {
+        id = qobject_to_json(mon->mc->id);
+        monitor_puts(mon, ", \"id\": ");
+        monitor_puts(mon, qstring_get_str(id));
+        QDECREF(id);
+        qobject_decref(mon->mc->id);
+        mon->mc->id = NULL;
+    }
+    monitor_puts(mon, "}\n");
+}
+
 static void monitor_protocol_emitter(Monitor *mon, QObject *data)
 {
     QDict *qmp;
+    QString *json = mon->mc->json_return;
 
     trace_monitor_protocol_emitter(mon);
 
+    mon->mc->json_return = NULL;
+    if (json && !monitor_has_error(mon)) {
+        monitor_json_return_emitter(mon, json);
+        QDECREF(json);
+        return;
+    }
+    QDECREF(json);
+
     if (!monitor_has_error(mon)) {
         /* success response */
         qmp = qdict_new();
@@ -455,6 +495,10 @@ static const char *monitor_event_names[] = {
     [QEVENT_SUSPEND_DISK] = "SUSPEND_DISK",
     [QEVENT_WAKEUP] = "WAKEUP",
     [QEVENT_BALLOON_CHANGE] = "BALLOON_CHANGE",
+    [QEVENT_BLOCK_JOB_READY] = "BLOCK_JOB_READY",
+    [QEVENT_VCPU_TIMES] = "VCPU_TIMES",
+    [QEVENT_DUMP_COMPLETED] = "DUMP_COMPLETED",
+    [QEVENT_FROZEN_TRANSACTION_COMPLETED] = "FROZEN_TRANSACTION_COMPLETED",
 };
 QEMU_BUILD_BUG_ON(ARRAY_SIZE(monitor_event_names) != QEVENT_MAX)
 
@@ -479,6 +523,27 @@ monitor_protocol_event_emit(MonitorEvent event,
 }
 
 
+/*
+ * Value of the instance member of the event's data, or "" if the event
+ * is not tracked per instance
+ */
+static const char *
+monitor_protocol_event_key(MonitorEventState *evstate,
+                           QObject *data)
+{
+    QDict *qdict;
+    const char *key = NULL;
+
+    if (evstate->key) {
+        qdict = qobject_to_qdict(qdict_get(qobject_to_qdict(data), "data"));
+        if (qdict) {
+            key = qdict_get_try_str(qdict, evstate->key);
+        }
+    }
+    return key ? key : "";
+}
+
+
 /*
  * Queue a new event for emission to Monitor instances,
  * applying any rate limiting if required.
@@ -505,20 +570,23 @@ monitor_protocol_event_queue(MonitorEvent event,
         evstate->last = now;
     } else {
         int64_t delta = now - evstate->last;
-        if (evstate->data ||
+        bool pending = g_hash_table_size(evstate->pending) != 0;
+        if (pending ||
             delta < evstate->rate) {
-            /* If there's an existing event pending, replace
-             * it with the new event, otherwise schedule a
-             * timer for delayed emission
+            /* Replace any event pending for the same instance with
+             * the new one, so only the latest state is delivered.
+             * If nothing was pending, schedule a timer for delayed
+             * emission
              */
-            if (evstate->data) {
-                qobject_decref(evstate->data);
-            } else {
+            if (!pending) {
                 int64_t then = evstate->last + evstate->rate;
                 qemu_mod_timer_ns(evstate->timer, then);
             }
-            evstate->data = data;
-            qobject_incref(evstate->data);
+            qobject_incref(data);
+            g_hash_table_replace(evstate->pending,
+                                 g_strdup(monitor_protocol_event_key(evstate,
+                                                                     data)),
+                                 data);
         } else {
             monitor_protocol_event_emit(event, data);
             evstate->last = now;
@@ -529,25 +597,27 @@ monitor_protocol_event_queue(MonitorEvent event,
 
 
 /*
- * The callback invoked by QemuTimer when a delayed
- * event is ready to be emitted
+ * The callback invoked by QemuTimer when delayed
+ * events are ready to be emitted
  */
 static void monitor_protocol_event_handler(void *opaque)
 {
     MonitorEventState *evstate = opaque;
     int64_t now = qemu_get_clock_ns(rt_clock);
+    GHashTableIter iter;
+    gpointer data;
 
     qemu_mutex_lock(&monitor_event_state_lock);
 
-    trace_monitor_protocol_event_handler(evstate->event,
-                                         evstate->data,
-                                         evstate->last,
-                                         now);
-    if (evstate->data) {
-        monitor_protocol_event_emit(evstate->event, evstate->data);
-        qobject_decref(evstate->data);
-        evstate->data = NULL;
+    g_hash_table_iter_init(&iter, evstate->pending);
+    while (g_hash_table_iter_next(&iter, NULL, &data)) {
+        trace_monitor_protocol_event_handler(evstate->event,
+                                             data,
+                                             evstate->last,
+                                             now);
+        monitor_protocol_event_emit(evstate->event, data);
     }
+    g_hash_table_remove_all(evstate->pending);
     evstate->last = now;
     qemu_mutex_unlock(&monitor_event_state_lock);
 }
@@ -556,14 +626,18 @@ static void monitor_protocol_event_handler(void *opaque)
 /*
  * @event: the event ID to be limited
  * @rate: the rate limit in milliseconds
+ * @key: the member of the event data that tells instances apart, or NULL
  *
  * Sets a rate limit on a particular event, so no
  * more than 1 event will be emitted within @rate
- * milliseconds
+ * milliseconds.  With @key, events for different
+ * instances (e.g. block devices) are coalesced
+ * separately, so the latest state of each is kept.
  */
 static void
 monitor_protocol_event_throttle(MonitorEvent event,
-                                int64_t rate)
+                                int64_t rate,
+                                const char *key)
 {
     MonitorEventState *evstate;
     assert(event < QEVENT_MAX);
@@ -573,12 +647,50 @@ monitor_protocol_event_throttle(MonitorEvent event,
     trace_monitor_protocol_event_throttle(event, rate);
     evstate->event = event;
     evstate->rate = rate * SCALE_MS;
-    evstate->timer = qemu_new_timer(rt_clock,
-                                    SCALE_MS,
-                                    monitor_protocol_event_handler,
-                                    evstate);
-    evstate->last = 0;
-    evstate->data = NULL;
+    if (key) {
+        evstate->key = key;
+    }
+    if (!evstate->timer) {
+        evstate->timer = qemu_new_timer(rt_clock,
+                                        SCALE_MS,
+                                        monitor_protocol_event_handler,
+                                        evstate);
+        evstate->pending = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                 g_free,
+                                                 (GDestroyNotify)
+                                                 qobject_decref);
+        evstate->last = 0;
+    }
+}
+
+
+/*
+ * Applies one -event-throttle option, overriding the
+ * default rate limit of an event
+ */
+static int monitor_protocol_event_throttle_opts(QemuOpts *opts,
+                                                void *opaque)
+{
+    const char *name = qemu_opt_get(opts, "event");
+    MonitorEvent event;
+
+    if (!name) {
+        error_report("event-throttle: event name is required");
+        return -1;
+    }
+    for (event = 0; event < QEVENT_MAX; event++) {
+        if (!strcmp(monitor_event_names[event], name)) {
+            break;
+        }
+    }
+    if (event == QEVENT_MAX) {
+        error_report("event-throttle: unknown event '%s'", name);
+        return -1;
+    }
+    monitor_protocol_event_throttle(event,
+                                    qemu_opt_get_number(opts, "rate", 0),
+                                    NULL);
+    return 0;
 }
 
 
@@ -588,9 +700,16 @@ static void monitor_protocol_event_init(void)
 {
     qemu_mutex_init(&monitor_event_state_lock);
     /* Limit RTC & BALLOON events to 1 per second */
-    monitor_protocol_event_throttle(QEVENT_RTC_CHANGE, 1000);
-    monitor_protocol_event_throttle(QEVENT_BALLOON_CHANGE, 1000);
-    monitor_protocol_event_throttle(QEVENT_WATCHDOG, 1000);
+    monitor_protocol_event_throttle(QEVENT_RTC_CHANGE, 1000, NULL);
+    monitor_protocol_event_throttle(QEVENT_BALLOON_CHANGE, 1000, NULL);
+    monitor_protocol_event_throttle(QEVENT_WATCHDOG, 1000, NULL);
+    /* A failing disk can report an error for every request */
+    monitor_protocol_event_throttle(QEVENT_BLOCK_IO_ERROR, 1000, "device");
+
+    if (qemu_opts_foreach(qemu_find_opts("event-throttle"),
+                          monitor_protocol_event_throttle_opts, NULL, 1)) {
+        exit(1);
+    }
 }
 
 /**
@@ -764,6 +883,21 @@ static void do_trace_file(Monitor *mon, const QDict *qdict)
 }
 #endif
 
+void qmp_trace_dump(const char *filename, Error **errp)
+{
+#ifdef CONFIG_TRACE_SIMPLE
+    int ret = st_dump_flight_recorder(filename);
+
+    if (ret == -ENOTSUP) {
+        error_set(errp, QERR_UNSUPPORTED);
+    } else if (ret < 0) {
+        error_set(errp, QERR_OPEN_FILE_FAILED, filename);
+    }
+#else
+    error_set(errp, QERR_UNSUPPORTED);
+#endif
+}
+
 static void user_monitor_complete(void *opaque, QObject *ret_data)
 {
     MonitorCompletionData *data = (MonitorCompletionData *)opaque; 
@@ -910,6 +1044,11 @@ static void do_info_jit(Monitor *mon)
     dump_exec_info((FILE *)mon, monitor_fprintf);
 }
 
+static void do_info_dma_bounce(Monitor *mon)
+{
+    dma_bounce_info((FILE *)mon, monitor_fprintf);
+}
+
 static void do_info_history(Monitor *mon)
 {
     int i;
@@ -2065,6 +2204,11 @@ static void do_info_mtree(Monitor *mon)
     mtree_info((fprintf_function)monitor_printf, mon);
 }
 
+static void do_info_io_exits(Monitor *mon)
+{
+    io_exits_info((fprintf_function)monitor_printf, mon);
+}
+
 static void do_info_numa(Monitor *mon)
 {
     int i;
@@ -2784,6 +2928,13 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show memory tree",
         .mhandler.info = do_info_mtree,
     },
+    {
+        .name       = "io-exits",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the number of accesses to each I/O region",
+        .mhandler.info = do_info_io_exits,
+    },
     {
         .name       = "jit",
         .args_type  = "",
@@ -2791,6 +2942,13 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show dynamic compiler info",
         .mhandler.info = do_info_jit,
     },
+    {
+        .name       = "dma-bounce",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show how often DMA mappings needed a bounce buffer",
+        .mhandler.info = do_info_dma_bounce,
+    },
     {
         .name       = "kvm",
         .args_type  = "",
@@ -2798,6 +2956,55 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show KVM information",
         .mhandler.info = hmp_info_kvm,
     },
+    {
+        .name       = "kvm-exits",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show KVM exit statistics and hot I/O addresses",
+        .mhandler.info = hmp_info_kvm_exits,
+    },
+    {
+        .name       = "guest-samples",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the guest PCs most often sampled under TCG",
+        .mhandler.info = hmp_info_guest_samples,
+    },
+    {
+        .name       = "tcg-stats",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show TCG translation and execution statistics",
+        .mhandler.info = hmp_info_tcg_stats,
+    },
+    {
+        .name       = "lock-stats",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show lock contention statistics",
+        .mhandler.info = hmp_info_lock_stats,
+    },
+    {
+        .name       = "xen-mapcache",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show Xen map cache statistics",
+        .mhandler.info = hmp_info_xen_mapcache,
+    },
+    {
+        .name       = "memory-usage",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show memory allocated by QEMU outside of guest RAM",
+        .mhandler.info = hmp_info_memory_usage,
+    },
+    {
+        .name       = "dump",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the progress of the guest memory dump",
+        .mhandler.info = hmp_info_dump,
+    },
     {
         .name       = "numa",
         .args_type  = "",
@@ -2930,6 +3137,13 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show current migration xbzrle cache size",
         .mhandler.info = hmp_info_migrate_cache_size,
     },
+    {
+        .name       = "migrate_parameters",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show current migration parameters",
+        .mhandler.info = hmp_info_migrate_parameters,
+    },
     {
         .name       = "balloon",
         .args_type  = "",
@@ -2937,6 +3151,20 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show balloon information",
         .mhandler.info = hmp_info_balloon,
     },
+    {
+        .name       = "mem-prealloc",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show guest RAM preallocation progress",
+        .mhandler.info = hmp_info_mem_prealloc,
+    },
+    {
+        .name       = "memory_sharing",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show how guest RAM is shared and backed on the host",
+        .mhandler.info = hmp_info_memory_sharing,
+    },
     {
         .name       = "qtree",
         .args_type  = "",
@@ -4684,7 +4912,7 @@ static void qmp_call_cmd(Monitor *mon, const mon_cmd_t *cmd,
     qobject_decref(data);
 }
 
-static void handle_qmp_command(JSONMessageParser *parser, QList *tokens)
+static void handle_qmp_command(JSONMessageParser *parser, GPtrArray *tokens)
 {
     int err;
     QObject *obj;
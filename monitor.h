@@ -43,6 +43,10 @@ typedef enum MonitorEvent {
     QEVENT_SUSPEND_DISK,
     QEVENT_WAKEUP,
     QEVENT_BALLOON_CHANGE,
+    QEVENT_BLOCK_JOB_READY,
+    QEVENT_VCPU_TIMES,
+    QEVENT_DUMP_COMPLETED,
+    QEVENT_FROZEN_TRANSACTION_COMPLETED,
 
     /* Add to 'monitor_event_names' array in monitor.c when
      * defining new events here */
@@ -78,6 +82,8 @@ int monitor_get_cpu_index(void);
 typedef void (MonitorCompletion)(void *opaque, QObject *ret_data);
 
 void monitor_set_error(Monitor *mon, QError *qerror);
+/* Reply to the QMP command being run with @json, which the monitor owns */
+void monitor_set_json_return(Monitor *mon, QString *json);
 void monitor_read_command(Monitor *mon, int show_prompt);
 ReadLineState *monitor_get_rs(Monitor *mon);
 int monitor_read_password(Monitor *mon, ReadLineFunc *readline_func,
@@ -73,7 +73,33 @@
 #define NBD_SET_TIMEOUT         _IO(0xab, 9)
 #define NBD_SET_FLAGS           _IO(0xab, 10)
 
+#define NBD_OPTS_MAGIC          0x49484156454F5054LL
+#define NBD_REP_MAGIC           0x3e889045565a9LL
+
+#define NBD_FLAG_FIXED_NEWSTYLE (1 << 0)        /* Handshake: fixed newstyle */
+#define NBD_FLAG_C_FIXED_NEWSTYLE (1 << 0)      /* Client: fixed newstyle */
+
 #define NBD_OPT_EXPORT_NAME     (1 << 0)
+#define NBD_OPT_ABORT           2
+#define NBD_OPT_LIST            3
+#define NBD_OPT_STRUCTURED_REPLY 8
+
+#define NBD_REP_ACK             1
+#define NBD_REP_SERVER          2
+#define NBD_REP_ERR_UNSUP       ((1U << 31) | 1)
+#define NBD_REP_ERR_INVALID     ((1U << 31) | 3)
+
+#define NBD_STRUCTURED_REPLY_MAGIC 0x668e33ef
+#define NBD_STRUCTURED_REPLY_SIZE  (4 + 2 + 2 + 8 + 4)
+
+#define NBD_REPLY_FLAG_DONE     (1 << 0)
+
+#define NBD_REPLY_TYPE_NONE        0
+#define NBD_REPLY_TYPE_OFFSET_DATA 1
+#define NBD_REPLY_TYPE_OFFSET_HOLE 2
+#define NBD_REPLY_TYPE_ERROR       ((1 << 15) + 1)
+
+#define NBD_MAX_NAME_SIZE       4096
 
 /* That's all folks */
 
@@ -206,34 +232,230 @@ int unix_socket_outgoing(const char *path)
                   Request (type == 2)
 */
 
-static int nbd_send_negotiate(int csock, off_t size, uint32_t flags)
+static int nbd_negotiate_send_rep(int csock, uint32_t type, uint32_t opt,
+                                  const void *data, uint32_t len)
+{
+    uint8_t buf[8 + 4 + 4 + 4];
+
+    /* Option reply
+       [ 0 ..   7]   magic    (NBD_REP_MAGIC)
+       [ 8 ..  11]   option   (the option being replied to)
+       [12 ..  15]   type     (NBD_REP_*)
+       [16 ..  19]   length
+       [20 ..    ]   data
+     */
+    cpu_to_be64w((uint64_t*)buf, NBD_REP_MAGIC);
+    cpu_to_be32w((uint32_t*)(buf + 8), opt);
+    cpu_to_be32w((uint32_t*)(buf + 12), type);
+    cpu_to_be32w((uint32_t*)(buf + 16), len);
+    if (write_sync(csock, buf, sizeof(buf)) != sizeof(buf)) {
+        LOG("write failed (rep)");
+        return -EINVAL;
+    }
+    if (len && write_sync(csock, (void *)data, len) != len) {
+        LOG("write failed (rep data)");
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static int nbd_negotiate_drop(int csock, uint32_t len)
+{
+    char buf[256];
+    uint32_t n;
+
+    while (len > 0) {
+        n = MIN(len, sizeof(buf));
+        if (read_sync(csock, buf, n) != n) {
+            LOG("read failed");
+            return -EINVAL;
+        }
+        len -= n;
+    }
+    return 0;
+}
+
+static int nbd_negotiate_list(int csock, const char *name, uint32_t len)
+{
+    uint8_t buf[4 + NBD_MAX_NAME_SIZE];
+    uint32_t namelen = strlen(name);
+
+    if (len) {
+        if (nbd_negotiate_drop(csock, len) < 0) {
+            return -EINVAL;
+        }
+        return nbd_negotiate_send_rep(csock, NBD_REP_ERR_INVALID,
+                                      NBD_OPT_LIST, NULL, 0);
+    }
+    cpu_to_be32w((uint32_t*)buf, namelen);
+    memcpy(buf + 4, name, namelen);
+    if (nbd_negotiate_send_rep(csock, NBD_REP_SERVER, NBD_OPT_LIST,
+                               buf, 4 + namelen) < 0) {
+        return -EINVAL;
+    }
+    return nbd_negotiate_send_rep(csock, NBD_REP_ACK, NBD_OPT_LIST, NULL, 0);
+}
+
+/* Process options until the client picks an export with
+ * NBD_OPT_EXPORT_NAME.  Returns 0 if that export is @name.
+ */
+static int nbd_negotiate_options(int csock, const char *name,
+                                 bool *structured_reply)
+{
+    char buf[NBD_MAX_NAME_SIZE + 1];
+    uint64_t magic;
+    uint32_t opt, len;
+
+    for (;;) {
+        /* Option
+           [ 0 ..   7]   magic    (NBD_OPTS_MAGIC)
+           [ 8 ..  11]   option
+           [12 ..  15]   length
+           [16 ..    ]   data
+         */
+        if (read_sync(csock, &magic, sizeof(magic)) != sizeof(magic) ||
+            read_sync(csock, &opt, sizeof(opt)) != sizeof(opt) ||
+            read_sync(csock, &len, sizeof(len)) != sizeof(len)) {
+            LOG("read failed (option)");
+            return -EINVAL;
+        }
+        magic = be64_to_cpu(magic);
+        opt = be32_to_cpu(opt);
+        len = be32_to_cpu(len);
+        if (magic != NBD_OPTS_MAGIC) {
+            LOG("Bad magic received");
+            return -EINVAL;
+        }
+        TRACE("Got option %u, length %u", opt, len);
+
+        switch (opt) {
+        case NBD_OPT_EXPORT_NAME:
+            if (len > NBD_MAX_NAME_SIZE) {
+                LOG("export name too long");
+                return -EINVAL;
+            }
+            if (read_sync(csock, buf, len) != len) {
+                LOG("read failed (name)");
+                return -EINVAL;
+            }
+            buf[len] = '\0';
+            if (strcmp(buf, name)) {
+                LOG("unknown export '%s' requested", buf);
+                return -EINVAL;
+            }
+            return 0;
+
+        case NBD_OPT_ABORT:
+            nbd_negotiate_drop(csock, len);
+            nbd_negotiate_send_rep(csock, NBD_REP_ACK, opt, NULL, 0);
+            return -EINVAL;
+
+        case NBD_OPT_LIST:
+            if (nbd_negotiate_list(csock, name, len) < 0) {
+                return -EINVAL;
+            }
+            break;
+
+        case NBD_OPT_STRUCTURED_REPLY:
+            if (len) {
+                if (nbd_negotiate_drop(csock, len) < 0 ||
+                    nbd_negotiate_send_rep(csock, NBD_REP_ERR_INVALID, opt,
+                                           NULL, 0) < 0) {
+                    return -EINVAL;
+                }
+                break;
+            }
+            *structured_reply = true;
+            if (nbd_negotiate_send_rep(csock, NBD_REP_ACK, opt, NULL, 0) < 0) {
+                return -EINVAL;
+            }
+            break;
+
+        default:
+            if (nbd_negotiate_drop(csock, len) < 0 ||
+                nbd_negotiate_send_rep(csock, NBD_REP_ERR_UNSUP, opt,
+                                       NULL, 0) < 0) {
+                return -EINVAL;
+            }
+            break;
+        }
+    }
+}
+
+/* Without an export name the old-style handshake is used, which clients
+ * that predate export names understand.  With one, the server speaks
+ * fixed new-style and lets the client negotiate options such as
+ * structured replies before selecting the export.
+ */
+static int nbd_send_negotiate(int csock, const char *name, off_t size,
+                              uint32_t flags, bool *structured_reply)
 {
     char buf[8 + 8 + 8 + 128];
+    uint32_t client_flags;
     int rc;
 
-    /* Negotiate
+    /* Negotiate (old style)
         [ 0 ..   7]   passwd   ("NBDMAGIC")
         [ 8 ..  15]   magic    (0x00420281861253)
         [16 ..  23]   size
         [24 ..  27]   flags
         [28 .. 151]   reserved (0)
+
+       Negotiate (new style)
+        [ 0 ..   7]   passwd   ("NBDMAGIC")
+        [ 8 ..  15]   magic    (NBD_OPTS_MAGIC)
+        [16 ..  17]   handshake flags
+        ...options, see nbd_negotiate_options...
+        [ 0 ..   7]   size
+        [ 8 ..   9]   flags
+        [10 .. 133]   reserved (0)
      */
 
     socket_set_block(csock);
     rc = -EINVAL;
+    flags |= NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_TRIM |
+             NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA;
 
     TRACE("Beginning negotiation.");
     memcpy(buf, "NBDMAGIC", 8);
-    cpu_to_be64w((uint64_t*)(buf + 8), 0x00420281861253LL);
-    cpu_to_be64w((uint64_t*)(buf + 16), size);
-    cpu_to_be32w((uint32_t*)(buf + 24),
-                 flags | NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_TRIM |
-                 NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA);
-    memset(buf + 28, 0, 124);
+    if (!name) {
+        cpu_to_be64w((uint64_t*)(buf + 8), 0x00420281861253LL);
+        cpu_to_be64w((uint64_t*)(buf + 16), size);
+        cpu_to_be32w((uint32_t*)(buf + 24), flags);
+        memset(buf + 28, 0, 124);
 
-    if (write_sync(csock, buf, sizeof(buf)) != sizeof(buf)) {
-        LOG("write failed");
-        goto fail;
+        if (write_sync(csock, buf, sizeof(buf)) != sizeof(buf)) {
+            LOG("write failed");
+            goto fail;
+        }
+    } else {
+        cpu_to_be64w((uint64_t*)(buf + 8), NBD_OPTS_MAGIC);
+        cpu_to_be16w((uint16_t*)(buf + 16), NBD_FLAG_FIXED_NEWSTYLE);
+        if (write_sync(csock, buf, 18) != 18) {
+            LOG("write failed");
+            goto fail;
+        }
+        if (read_sync(csock, &client_flags, sizeof(client_flags)) !=
+            sizeof(client_flags)) {
+            LOG("read failed (client flags)");
+            goto fail;
+        }
+        client_flags = be32_to_cpu(client_flags);
+        if (client_flags & ~NBD_FLAG_C_FIXED_NEWSTYLE) {
+            LOG("unsupported client flags 0x%x", client_flags);
+            goto fail;
+        }
+        if (nbd_negotiate_options(csock, name, structured_reply) < 0) {
+            goto fail;
+        }
+
+        cpu_to_be64w((uint64_t*)buf, size);
+        cpu_to_be16w((uint16_t*)(buf + 8), flags);
+        memset(buf + 10, 0, 124);
+        if (write_sync(csock, buf, 10 + 124) != 10 + 124) {
+            LOG("write failed");
+            goto fail;
+        }
     }
 
     TRACE("Negotiation succeeded.");
@@ -295,7 +517,7 @@ int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
         uint32_t namesize;
 
         TRACE("Checking magic (opts_magic)");
-        if (magic != 0x49484156454F5054LL) {
+        if (magic != NBD_OPTS_MAGIC) {
             LOG("Bad magic received");
             goto fail;
         }
@@ -359,7 +581,7 @@ int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
             LOG("read failed (tmp)");
             goto fail;
         }
-        *flags |= be32_to_cpu(tmp);
+        *flags |= be16_to_cpu(tmp);
     }
     if (read_sync(csock, &buf, 124) != 124) {
         LOG("read failed (buf)");
@@ -620,6 +842,7 @@ struct NBDRequest {
 
 struct NBDExport {
     BlockDriverState *bs;
+    char *name;
     off_t dev_offset;
     off_t size;
     uint32_t nbdflags;
@@ -638,6 +861,7 @@ struct NBDClient {
     CoMutex send_lock;
     Coroutine *send_coroutine;
 
+    bool structured_reply;
     int nb_requests;
 };
 
@@ -706,6 +930,12 @@ NBDExport *nbd_export_new(BlockDriverState *bs, off_t dev_offset,
     return exp;
 }
 
+void nbd_export_set_name(NBDExport *exp, const char *name)
+{
+    g_free(exp->name);
+    exp->name = g_strdup(name);
+}
+
 void nbd_export_close(NBDExport *exp)
 {
     while (!QSIMPLEQ_EMPTY(&exp->requests)) {
@@ -716,6 +946,7 @@ void nbd_export_close(NBDExport *exp)
     }
 
     bdrv_close(exp->bs);
+    g_free(exp->name);
     g_free(exp);
 }
 
@@ -723,6 +954,24 @@ static int nbd_can_read(void *opaque);
 static void nbd_read(void *opaque);
 static void nbd_restart_write(void *opaque);
 
+/* Replies of different requests may go out in any order, but each one
+ * (or each chunk of a structured reply) must hit the socket in one piece.
+ */
+static void nbd_co_send_lock(NBDClient *client)
+{
+    qemu_co_mutex_lock(&client->send_lock);
+    qemu_set_fd_handler2(client->sock, nbd_can_read, nbd_read,
+                         nbd_restart_write, client);
+    client->send_coroutine = qemu_coroutine_self();
+}
+
+static void nbd_co_send_unlock(NBDClient *client)
+{
+    client->send_coroutine = NULL;
+    qemu_set_fd_handler2(client->sock, nbd_can_read, nbd_read, NULL, client);
+    qemu_co_mutex_unlock(&client->send_lock);
+}
+
 static ssize_t nbd_co_send_reply(NBDRequest *req, struct nbd_reply *reply,
                                  int len)
 {
@@ -730,10 +979,7 @@ static ssize_t nbd_co_send_reply(NBDRequest *req, struct nbd_reply *reply,
     int csock = client->sock;
     ssize_t rc, ret;
 
-    qemu_co_mutex_lock(&client->send_lock);
-    qemu_set_fd_handler2(csock, nbd_can_read, nbd_read,
-                         nbd_restart_write, client);
-    client->send_coroutine = qemu_coroutine_self();
+    nbd_co_send_lock(client);
 
     if (!len) {
         rc = nbd_send_reply(csock, reply);
@@ -749,12 +995,131 @@ static ssize_t nbd_co_send_reply(NBDRequest *req, struct nbd_reply *reply,
         socket_set_cork(csock, 0);
     }
 
-    client->send_coroutine = NULL;
-    qemu_set_fd_handler2(csock, nbd_can_read, nbd_read, NULL, client);
-    qemu_co_mutex_unlock(&client->send_lock);
+    nbd_co_send_unlock(client);
     return rc;
 }
 
+/* Send one chunk of a structured reply: the header, @hdr_len bytes of
+ * type-specific fields from @hdr, then @len bytes of @data.
+ */
+static ssize_t nbd_co_send_chunk(NBDClient *client, uint64_t handle,
+                                 uint16_t flags, uint16_t type,
+                                 const void *hdr, size_t hdr_len,
+                                 void *data, size_t len)
+{
+    uint8_t buf[NBD_STRUCTURED_REPLY_SIZE + 16];
+    size_t buf_len = NBD_STRUCTURED_REPLY_SIZE + hdr_len;
+    int csock = client->sock;
+    ssize_t rc = 0;
+
+    /* Structured reply chunk
+       [ 0 ..  3]    magic   (NBD_STRUCTURED_REPLY_MAGIC)
+       [ 4 ..  5]    flags   (NBD_REPLY_FLAG_DONE on the last chunk)
+       [ 6 ..  7]    type    (NBD_REPLY_TYPE_*)
+       [ 8 .. 15]    handle
+       [16 .. 19]    length of the payload
+       [20 ..   ]    payload
+     */
+    assert(hdr_len <= 16);
+    cpu_to_be32w((uint32_t*)buf, NBD_STRUCTURED_REPLY_MAGIC);
+    cpu_to_be16w((uint16_t*)(buf + 4), flags);
+    cpu_to_be16w((uint16_t*)(buf + 6), type);
+    cpu_to_be64w((uint64_t*)(buf + 8), handle);
+    cpu_to_be32w((uint32_t*)(buf + 16), hdr_len + len);
+    if (hdr_len) {
+        memcpy(buf + NBD_STRUCTURED_REPLY_SIZE, hdr, hdr_len);
+    }
+
+    TRACE("Sending chunk { .type = %u, .flags = %u, .length = %zu }",
+          type, flags, hdr_len + len);
+
+    nbd_co_send_lock(client);
+    if (len) {
+        socket_set_cork(csock, 1);
+    }
+    if (write_sync(csock, buf, buf_len) != buf_len) {
+        LOG("writing to socket failed");
+        rc = -EIO;
+    } else if (len && qemu_co_send(csock, data, len) != len) {
+        rc = -EIO;
+    }
+    if (len) {
+        socket_set_cork(csock, 0);
+    }
+    nbd_co_send_unlock(client);
+    return rc;
+}
+
+static ssize_t nbd_co_send_error_chunk(NBDClient *client, uint64_t handle,
+                                       uint32_t error)
+{
+    uint8_t hdr[4 + 2];
+
+    /* error, then the length of an (empty) message */
+    cpu_to_be32w((uint32_t*)hdr, error);
+    cpu_to_be16w((uint16_t*)(hdr + 4), 0);
+    return nbd_co_send_chunk(client, handle, NBD_REPLY_FLAG_DONE,
+                             NBD_REPLY_TYPE_ERROR, hdr, sizeof(hdr), NULL, 0);
+}
+
+/* Answer a read with a structured reply.  Ranges that are not allocated
+ * anywhere in the backing chain read as zeroes and are sent as hole
+ * chunks, without reading or transferring them.  Returns -EIO if the
+ * connection must be dropped; read errors go to the client.
+ */
+static ssize_t nbd_co_read_structured(NBDRequest *req,
+                                      struct nbd_request *request)
+{
+    NBDClient *client = req->client;
+    NBDExport *exp = client->exp;
+    int64_t sector_num = (request->from + exp->dev_offset) / 512;
+    int nb_sectors = request->len / 512;
+    uint8_t hdr[8 + 4];
+    uint16_t flags;
+    int done = 0, n, ret;
+
+    if (nb_sectors == 0) {
+        return nbd_co_send_chunk(client, request->handle,
+                                 NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_NONE,
+                                 NULL, 0, NULL, 0);
+    }
+
+    while (done < nb_sectors) {
+        ret = bdrv_co_is_allocated_above(exp->bs, NULL, sector_num + done,
+                                         nb_sectors - done, &n);
+        if (ret < 0 || n == 0) {
+            /* cannot tell, send the data */
+            ret = 1;
+            n = nb_sectors - done;
+        }
+        flags = done + n == nb_sectors ? NBD_REPLY_FLAG_DONE : 0;
+        cpu_to_be64w((uint64_t*)hdr, request->from + done * 512);
+
+        if (ret) {
+            ret = bdrv_read(exp->bs, sector_num + done, req->data, n);
+            if (ret < 0) {
+                LOG("reading from file failed");
+                return nbd_co_send_error_chunk(client, request->handle, -ret);
+            }
+            ret = nbd_co_send_chunk(client, request->handle, flags,
+                                    NBD_REPLY_TYPE_OFFSET_DATA, hdr, 8,
+                                    req->data, n * 512);
+        } else {
+            cpu_to_be32w((uint32_t*)(hdr + 8), n * 512);
+            ret = nbd_co_send_chunk(client, request->handle, flags,
+                                    NBD_REPLY_TYPE_OFFSET_HOLE, hdr, 12,
+                                    NULL, 0);
+        }
+        if (ret < 0) {
+            return ret;
+        }
+        done += n;
+    }
+
+    TRACE("Read %u byte(s)", request->len);
+    return 0;
+}
+
 static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *request)
 {
     NBDClient *client = req->client;
@@ -851,6 +1216,13 @@ static void nbd_trip(void *opaque)
             }
         }
 
+        if (client->structured_reply) {
+            if (nbd_co_read_structured(req, &request) < 0) {
+                goto out;
+            }
+            break;
+        }
+
         ret = bdrv_read(exp->bs, (request.from + exp->dev_offset) / 512,
                         req->data, request.len / 512);
         if (ret < 0) {
@@ -928,7 +1300,14 @@ static void nbd_trip(void *opaque)
     invalid_request:
         reply.error = -EINVAL;
     error_reply:
-        if (nbd_co_send_reply(req, &reply, 0) < 0) {
+        /* reads always get a structured reply once it is negotiated */
+        if (client->structured_reply &&
+            (request.type & NBD_CMD_MASK_COMMAND) == NBD_CMD_READ) {
+            ret = nbd_co_send_error_chunk(client, reply.handle, reply.error);
+        } else {
+            ret = nbd_co_send_reply(req, &reply, 0);
+        }
+        if (ret < 0) {
             goto out;
         }
         break;
@@ -974,11 +1353,15 @@ NBDClient *nbd_client_new(NBDExport *exp, int csock,
                           void (*close)(NBDClient *))
 {
     NBDClient *client;
-    if (nbd_send_negotiate(csock, exp->size, exp->nbdflags) < 0) {
+    bool structured_reply = false;
+
+    if (nbd_send_negotiate(csock, exp->name, exp->size, exp->nbdflags,
+                           &structured_reply) < 0) {
         return NULL;
     }
     client = g_malloc0(sizeof(NBDClient));
     client->refcount = 1;
+    client->structured_reply = structured_reply;
     client->exp = exp;
     client->sock = csock;
     client->close = close;
@@ -31,6 +31,7 @@
 #include "net/slirp.h"
 #include "net/vde.h"
 #include "net/hub.h"
+#include "net/vhost-user.h"
 #include "net/util.h"
 #include "monitor.h"
 #include "qemu-common.h"
@@ -221,21 +222,52 @@ NICState *qemu_new_nic(NetClientInfo *info,
                        const char *name,
                        void *opaque)
 {
+    NetClientState *peers[MAX_QUEUE_NUM];
     NetClientState *nc;
     NICState *nic;
+    int i, queues = 1;
 
     assert(info->type == NET_CLIENT_OPTIONS_KIND_NIC);
     assert(info->size >= sizeof(NICState));
 
+    /* A multiqueue netdev has one client per queue, all with its name */
+    if (conf->peer && conf->peer->name) {
+        queues = qemu_find_net_clients_except(conf->peer->name, peers,
+                                              NET_CLIENT_OPTIONS_KIND_NIC,
+                                              MAX_QUEUE_NUM);
+        assert(queues >= 1 && peers[0] == conf->peer);
+    }
+
     nc = qemu_new_net_client(info, conf->peer, model, name);
 
     nic = DO_UPCAST(NICState, nc, nc);
     nic->conf = conf;
     nic->opaque = opaque;
+    nic->queues = queues;
+
+    if (queues > 1) {
+        nic->subqueues = g_new0(NICState *, queues - 1);
+        for (i = 1; i < queues; i++) {
+            NICState *sub;
+
+            nc = qemu_new_net_client(info, peers[i], model, nic->nc.name);
+            nc->queue_index = i;
+            sub = DO_UPCAST(NICState, nc, nc);
+            sub->conf = conf;
+            sub->opaque = opaque;
+            nic->subqueues[i - 1] = sub;
+        }
+    }
 
     return nic;
 }
 
+NetClientState *qemu_get_subqueue(NICState *nic, int queue_index)
+{
+    assert(queue_index < MAX(nic->queues, 1));
+    return queue_index == 0 ? &nic->nc : &nic->subqueues[queue_index - 1]->nc;
+}
+
 static void qemu_cleanup_net_client(NetClientState *nc)
 {
     QTAILQ_REMOVE(&net_clients, nc, next);
@@ -258,34 +290,81 @@ static void qemu_free_net_client(NetClientState *nc)
     g_free(nc);
 }
 
+static void qemu_del_nic(NICState *nic)
+{
+    int i;
+
+    /* If the peers have already been deleted, free them now. */
+    for (i = 0; i < MAX(nic->queues, 1); i++) {
+        NetClientState *nc = qemu_get_subqueue(nic, i);
+        NICState *queue = DO_UPCAST(NICState, nc, nc);
+
+        if (nc->peer && queue->peer_deleted) {
+            qemu_free_net_client(nc->peer);
+        }
+    }
+
+    for (i = MAX(nic->queues, 1) - 1; i >= 0; i--) {
+        NetClientState *nc = qemu_get_subqueue(nic, i);
+
+        qemu_cleanup_net_client(nc);
+        if (i > 0) {
+            qemu_free_net_client(nc);
+        }
+    }
+    g_free(nic->subqueues);
+    qemu_free_net_client(&nic->nc);
+}
+
 void qemu_del_net_client(NetClientState *nc)
 {
+    NetClientState *ncs[MAX_QUEUE_NUM];
+    int queues, i;
+
+    if (nc->info->type == NET_CLIENT_OPTIONS_KIND_NIC) {
+        /* the NIC goes away together with all of its queues */
+        assert(nc->queue_index == 0);
+        qemu_del_nic(DO_UPCAST(NICState, nc, nc));
+        return;
+    }
+
+    /* A multiqueue netdev is deleted with all of its queues */
+    queues = qemu_find_net_clients_except(nc->name, ncs,
+                                          NET_CLIENT_OPTIONS_KIND_NIC,
+                                          MAX_QUEUE_NUM);
+    if (queues == 0) {
+        ncs[0] = nc;
+        queues = 1;
+    }
+
     /* If there is a peer NIC, delete and cleanup client, but do not free. */
     if (nc->peer && nc->peer->info->type == NET_CLIENT_OPTIONS_KIND_NIC) {
         NICState *nic = DO_UPCAST(NICState, nc, nc->peer);
         if (nic->peer_deleted) {
             return;
         }
-        nic->peer_deleted = true;
-        /* Let NIC know peer is gone. */
-        nc->peer->link_down = true;
+        for (i = 0; i < queues; i++) {
+            if (!ncs[i]->peer) {
+                continue;
+            }
+            nic = DO_UPCAST(NICState, nc, ncs[i]->peer);
+            nic->peer_deleted = true;
+            /* Let NIC know peer is gone. */
+            ncs[i]->peer->link_down = true;
+        }
         if (nc->peer->info->link_status_changed) {
             nc->peer->info->link_status_changed(nc->peer);
         }
-        qemu_cleanup_net_client(nc);
+        for (i = 0; i < queues; i++) {
+            qemu_cleanup_net_client(ncs[i]);
+        }
         return;
     }
 
-    /* If this is a peer NIC and peer has already been deleted, free it now. */
-    if (nc->peer && nc->info->type == NET_CLIENT_OPTIONS_KIND_NIC) {
-        NICState *nic = DO_UPCAST(NICState, nc, nc);
-        if (nic->peer_deleted) {
-            qemu_free_net_client(nc->peer);
-        }
+    for (i = 0; i < queues; i++) {
+        qemu_cleanup_net_client(ncs[i]);
+        qemu_free_net_client(ncs[i]);
     }
-
-    qemu_cleanup_net_client(nc);
-    qemu_free_net_client(nc);
 }
 
 void qemu_foreach_nic(qemu_nic_foreach func, void *opaque)
@@ -293,7 +372,8 @@ void qemu_foreach_nic(qemu_nic_foreach func, void *opaque)
     NetClientState *nc;
 
     QTAILQ_FOREACH(nc, &net_clients, next) {
-        if (nc->info->type == NET_CLIENT_OPTIONS_KIND_NIC) {
+        if (nc->info->type == NET_CLIENT_OPTIONS_KIND_NIC &&
+            nc->queue_index == 0) {
             func(DO_UPCAST(NICState, nc, nc), opaque);
         }
     }
@@ -430,6 +510,34 @@ ssize_t qemu_deliver_packet_iov(NetClientState *sender,
     }
 }
 
+int qemu_deliver_packet_batch(NetClientState *sender,
+                              unsigned flags,
+                              const NetPacketIOV *packets,
+                              int count,
+                              void *opaque)
+{
+    NetClientState *nc = opaque;
+    int i;
+
+    if (nc->link_down) {
+        return count;
+    }
+
+    /* The receivers take one packet at a time; stop at the first one
+     * that does not fit, the caller queues the rest.
+     */
+    for (i = 0; i < count; i++) {
+        if (i > 0 && !qemu_can_send_packet(sender)) {
+            break;
+        }
+        if (qemu_deliver_packet_iov(sender, flags, packets[i].iov,
+                                    packets[i].iovcnt, opaque) == 0) {
+            break;
+        }
+    }
+    return i;
+}
+
 ssize_t qemu_sendv_packet_async(NetClientState *sender,
                                 const struct iovec *iov, int iovcnt,
                                 NetPacketSent *sent_cb)
@@ -447,6 +555,25 @@ ssize_t qemu_sendv_packet_async(NetClientState *sender,
                                    iov, iovcnt, sent_cb);
 }
 
+/* Send a batch of packets, see qemu_net_queue_send_batch() for the return
+ * value.  flags may be QEMU_NET_PACKET_FLAG_ZEROCOPY.
+ */
+int qemu_sendv_packet_batch_async(NetClientState *sender, unsigned flags,
+                                  const NetPacketIOV *packets, int count,
+                                  NetPacketSent *sent_cb)
+{
+    NetQueue *queue;
+
+    if (sender->link_down || !sender->peer) {
+        return count;
+    }
+
+    queue = sender->peer->send_queue;
+
+    return qemu_net_queue_send_batch(queue, sender, flags,
+                                     packets, count, sent_cb);
+}
+
 ssize_t
 qemu_sendv_packet(NetClientState *nc, const struct iovec *iov, int iovcnt)
 {
@@ -468,6 +595,31 @@ NetClientState *qemu_find_netdev(const char *id)
     return NULL;
 }
 
+/*
+ * Store in @ncs the clients named @id that are not of type @type, in the
+ * order they were created, and return how many were found.
+ */
+int qemu_find_net_clients_except(const char *id, NetClientState **ncs,
+                                 NetClientOptionsKind type, int max)
+{
+    NetClientState *nc;
+    int ret = 0;
+
+    QTAILQ_FOREACH(nc, &net_clients, next) {
+        if (nc->info->type == type) {
+            continue;
+        }
+        if (!strcmp(nc->name, id)) {
+            if (ret < max) {
+                ncs[ret] = nc;
+            }
+            ret++;
+        }
+    }
+
+    return MIN(ret, max);
+}
+
 static int nic_get_free_idx(void)
 {
     int index;
@@ -622,6 +774,9 @@ static int (* const net_client_init_fun[NET_CLIENT_OPTIONS_KIND_MAX])(
         [NET_CLIENT_OPTIONS_KIND_BRIDGE]    = net_init_bridge,
 #endif
         [NET_CLIENT_OPTIONS_KIND_HUBPORT]   = net_init_hubport,
+#ifdef CONFIG_POSIX
+        [NET_CLIENT_OPTIONS_KIND_VHOST_USER] = net_init_vhost_user,
+#endif
 };
 
 
@@ -652,6 +807,9 @@ static int net_client_init1(const void *object, int is_netdev, Error **errp)
         case NET_CLIENT_OPTIONS_KIND_BRIDGE:
 #endif
         case NET_CLIENT_OPTIONS_KIND_HUBPORT:
+#ifdef CONFIG_POSIX
+        case NET_CLIENT_OPTIONS_KIND_VHOST_USER:
+#endif
             break;
 
         default:
@@ -865,6 +1023,11 @@ void do_info_network(Monitor *mon)
             continue;
         }
 
+        /* Queues of a multiqueue NIC are shown with the first one */
+        if (nc->queue_index != 0) {
+            continue;
+        }
+
         if (!peer || type == NET_CLIENT_OPTIONS_KIND_NIC) {
             print_net_client(mon, nc);
         } /* else it's a netdev connected to a NIC, printed with the NIC */
@@ -877,20 +1040,25 @@ void do_info_network(Monitor *mon)
 
 void qmp_set_link(const char *name, bool up, Error **errp)
 {
-    NetClientState *nc = NULL;
+    NetClientState *ncs[MAX_QUEUE_NUM];
+    NetClientState *nc;
+    int queues, i;
 
-    QTAILQ_FOREACH(nc, &net_clients, next) {
-        if (!strcmp(nc->name, name)) {
-            goto done;
-        }
-    }
-done:
-    if (!nc) {
+    queues = qemu_find_net_clients_except(name, ncs,
+                                          NET_CLIENT_OPTIONS_KIND_MAX,
+                                          MAX_QUEUE_NUM);
+    if (queues == 0) {
         error_set(errp, QERR_DEVICE_NOT_FOUND, name);
         return;
     }
+    nc = ncs[0];
 
-    nc->link_down = !up;
+    /* all the queues of a multiqueue client share its link status */
+    for (i = 0; i < queues; i++) {
+        if (ncs[i]->info->type == nc->info->type) {
+            ncs[i]->link_down = !up;
+        }
+    }
 
     if (nc->info->link_status_changed) {
         nc->info->link_status_changed(nc);
@@ -910,10 +1078,11 @@ done:
 
 void net_cleanup(void)
 {
-    NetClientState *nc, *next_vc;
-
-    QTAILQ_FOREACH_SAFE(nc, &net_clients, next, next_vc) {
-        qemu_del_net_client(nc);
+    /* Deleting a client can take other queues of the same device away,
+     * so always start again from the head of the list.
+     */
+    while (!QTAILQ_EMPTY(&net_clients)) {
+        qemu_del_net_client(QTAILQ_FIRST(&net_clients));
     }
 }
 
@@ -15,25 +15,58 @@
  *  along with this program; if not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "qemu-common.h"
 #include "net/checksum.h"
 
 #define PROTO_TCP  6
 #define PROTO_UDP 17
 
-uint32_t net_checksum_add(int len, uint8_t *buf)
+/*
+ * The ones' complement sum does not depend on byte order (RFC 1071), so
+ * add the buffer in host order 32 bits at a time into a 64-bit accumulator,
+ * which cannot overflow for any packet size, then fold it and swap it to
+ * network order.  The result is a partial sum, as wide as 17 bits, that
+ * can be added to other partial sums before net_checksum_finish().
+ */
+uint32_t net_checksum_add_cont(int len, uint8_t *buf, int seq)
 {
-    uint32_t sum = 0;
+    uint64_t sum64 = 0;
+    uint32_t sum, w;
     int i;
 
-    for (i = 0; i < len; i++) {
-	if (i & 1)
-	    sum += (uint32_t)buf[i];
-	else
-	    sum += (uint32_t)buf[i] << 8;
+    for (i = 0; i + 4 <= len; i += 4) {
+        memcpy(&w, buf + i, 4);
+        sum64 += w;
+    }
+    sum64 = (sum64 & 0xffffffff) + (sum64 >> 32);
+    sum64 = (sum64 & 0xffffffff) + (sum64 >> 32);
+    sum = (sum64 & 0xffff) + (sum64 >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = be16_to_cpu(sum);
+
+    for (; i < len; i++) {
+        if (i & 1) {
+            sum += (uint32_t)buf[i];
+        } else {
+            sum += (uint32_t)buf[i] << 8;
+        }
+    }
+
+    /* the buffer starts at an odd offset of the summed data */
+    if (seq & 1) {
+        sum = (sum & 0xffff) + (sum >> 16);
+        sum = (sum & 0xffff) + (sum >> 16);
+        sum = bswap16(sum);
     }
     return sum;
 }
 
+uint32_t net_checksum_add(int len, uint8_t *buf)
+{
+    return net_checksum_add_cont(len, buf, 0);
+}
+
 uint16_t net_checksum_finish(uint32_t sum)
 {
     while (sum>>16)
@@ -27,13 +27,41 @@
 #include "qemu-error.h"
 #include "qemu-log.h"
 #include "qemu-timer.h"
+#include "qemu-thread.h"
+#include "qemu-barrier.h"
 #include "hub.h"
+#include "packet-filter.h"
+
+/*
+ * With a ring, the network path only copies the records into a single
+ * producer, single consumer ring buffer; a writer thread drains it to the
+ * file in large contiguous writes.  The thread is woken when the ring is a
+ * quarter full, and once a second by a timer so that a quiet link still
+ * gets its packets flushed.  If the ring is full the packet is dropped.
+ */
+#define DUMP_RING_MIN           (64 * 1024)
+#define DUMP_FLUSH_INTERVAL_MS  1000
 
 typedef struct DumpState {
     NetClientState nc;
     int64_t start_ts;
     int fd;
     int pcap_caplen;
+    DumpFormat format;
+    PacketFilter *filter;
+
+    /* ring mode only */
+    uint8_t *ring;
+    size_t ring_size;           /* power of two */
+    size_t head;                /* bytes produced, written by the net path */
+    size_t tail;                /* bytes consumed, written by the thread */
+    uint64_t dropped;
+    bool write_error;
+    QemuThread thread;
+    QemuMutex lock;
+    QemuCond cond;
+    bool stop, flush;           /* protected by lock */
+    QEMUTimer *flush_timer;
 } DumpState;
 
 #define PCAP_MAGIC 0xa1b2c3d4
@@ -57,39 +85,251 @@ struct pcap_sf_pkthdr {
     uint32_t len;
 };
 
+#define PCAPNG_SHB_TYPE         0x0a0d0d0a
+#define PCAPNG_IDB_TYPE         0x00000001
+#define PCAPNG_EPB_TYPE         0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1a2b3c4d
+
+struct pcapng_shb {
+    uint32_t type;
+    uint32_t total_len;
+    uint32_t byte_order_magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int64_t section_len;
+    uint32_t total_len2;
+} QEMU_PACKED;
+
+struct pcapng_idb {
+    uint32_t type;
+    uint32_t total_len;
+    uint16_t linktype;
+    uint16_t reserved;
+    uint32_t snaplen;
+    uint32_t total_len2;
+} QEMU_PACKED;
+
+/* followed by the padded packet data and total_len again */
+struct pcapng_epb {
+    uint32_t type;
+    uint32_t total_len;
+    uint32_t interface_id;
+    uint32_t ts_high;
+    uint32_t ts_low;
+    uint32_t caplen;
+    uint32_t len;
+} QEMU_PACKED;
+
+/* The largest record header, and padding plus trailer */
+#define DUMP_HDR_MAX     sizeof(struct pcapng_epb)
+#define DUMP_TRAILER_MAX 8
+
+/*
+ * Fill in the header and trailer of the record for a packet of size bytes
+ * with caplen bytes captured.  Returns the length of the header.
+ */
+static size_t dump_record_header(DumpState *s, uint8_t *hdr,
+                                 uint8_t *trailer, size_t *trailer_len,
+                                 size_t caplen, size_t size)
+{
+    int64_t ts;
+
+    ts = muldiv64(qemu_get_clock_ns(vm_clock), 1000000, get_ticks_per_sec());
+
+    if (s->format == DUMP_FORMAT_PCAPNG) {
+        struct pcapng_epb epb;
+        size_t pad = -caplen & 3;
+        uint32_t total_len = sizeof(epb) + caplen + pad + 4;
+
+        ts += s->start_ts * 1000000;
+        epb.type = PCAPNG_EPB_TYPE;
+        epb.total_len = total_len;
+        epb.interface_id = 0;
+        epb.ts_high = ts >> 32;
+        epb.ts_low = ts;
+        epb.caplen = caplen;
+        epb.len = size;
+        memcpy(hdr, &epb, sizeof(epb));
+
+        memset(trailer, 0, pad);
+        memcpy(trailer + pad, &total_len, 4);
+        *trailer_len = pad + 4;
+        return sizeof(epb);
+    } else {
+        struct pcap_sf_pkthdr pkthdr;
+
+        pkthdr.ts.tv_sec = ts / 1000000 + s->start_ts;
+        pkthdr.ts.tv_usec = ts % 1000000;
+        pkthdr.caplen = caplen;
+        pkthdr.len = size;
+        memcpy(hdr, &pkthdr, sizeof(pkthdr));
+
+        *trailer_len = 0;
+        return sizeof(pkthdr);
+    }
+}
+
+static void dump_ring_put(DumpState *s, size_t pos, const uint8_t *buf,
+                          size_t len)
+{
+    size_t offset = pos & (s->ring_size - 1);
+    size_t chunk = MIN(len, s->ring_size - offset);
+
+    memcpy(s->ring + offset, buf, chunk);
+    memcpy(s->ring, buf + chunk, len - chunk);
+}
+
+static void dump_ring_kick(DumpState *s, bool flush)
+{
+    qemu_mutex_lock(&s->lock);
+    s->flush |= flush;
+    qemu_cond_signal(&s->cond);
+    qemu_mutex_unlock(&s->lock);
+}
+
 static ssize_t dump_receive(NetClientState *nc, const uint8_t *buf, size_t size)
 {
     DumpState *s = DO_UPCAST(DumpState, nc, nc);
-    struct pcap_sf_pkthdr hdr;
-    int64_t ts;
-    int caplen;
+    uint8_t hdr[DUMP_HDR_MAX], trailer[DUMP_TRAILER_MAX];
+    size_t hdr_len, trailer_len, caplen, total, used, head, threshold;
 
     /* Early return in case of previous error. */
     if (s->fd < 0) {
         return size;
     }
 
-    ts = muldiv64(qemu_get_clock_ns(vm_clock), 1000000, get_ticks_per_sec());
+    if (s->filter && !packet_filter_match(s->filter, buf, size)) {
+        return size;
+    }
+
     caplen = size > s->pcap_caplen ? s->pcap_caplen : size;
+    hdr_len = dump_record_header(s, hdr, trailer, &trailer_len, caplen, size);
 
-    hdr.ts.tv_sec = ts / 1000000 + s->start_ts;
-    hdr.ts.tv_usec = ts % 1000000;
-    hdr.caplen = caplen;
-    hdr.len = size;
-    if (write(s->fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
-        write(s->fd, buf, caplen) != caplen) {
-        qemu_log("-net dump write error - stop dump\n");
-        close(s->fd);
-        s->fd = -1;
+    if (!s->ring) {
+        if (write(s->fd, hdr, hdr_len) != hdr_len ||
+            write(s->fd, buf, caplen) != caplen ||
+            (trailer_len &&
+             write(s->fd, trailer, trailer_len) != trailer_len)) {
+            qemu_log("-net dump write error - stop dump\n");
+            close(s->fd);
+            s->fd = -1;
+        }
+        return size;
     }
 
+    head = s->head;
+    used = head - s->tail;
+    total = hdr_len + caplen + trailer_len;
+    if (total > s->ring_size - used) {
+        s->dropped++;
+        return size;
+    }
+
+    dump_ring_put(s, head, hdr, hdr_len);
+    dump_ring_put(s, head + hdr_len, buf, caplen);
+    dump_ring_put(s, head + hdr_len + caplen, trailer, trailer_len);
+
+    /* the record must be visible before the thread sees the new head */
+    smp_wmb();
+    s->head = head + total;
+
+    threshold = s->ring_size / 4;
+    if (used < threshold && used + total >= threshold) {
+        dump_ring_kick(s, false);
+    }
     return size;
 }
 
+static void dump_ring_drain(DumpState *s)
+{
+    size_t head, tail, offset, chunk;
+    ssize_t ret;
+
+    head = s->head;
+    smp_rmb();
+
+    tail = s->tail;
+    while (tail != head) {
+        offset = tail & (s->ring_size - 1);
+        chunk = MIN(head - tail, s->ring_size - offset);
+
+        if (!s->write_error) {
+            ret = write(s->fd, s->ring + offset, chunk);
+            if (ret < 0 && errno == EINTR) {
+                continue;
+            }
+            if (ret <= 0) {
+                qemu_log("-net dump write error - stop dump\n");
+                s->write_error = true;
+            } else {
+                chunk = ret;
+            }
+        }
+        tail += chunk;
+
+        /* finish reading the data before the net path may overwrite it */
+        smp_mb();
+        s->tail = tail;
+    }
+}
+
+static void *dump_writer_thread(void *opaque)
+{
+    DumpState *s = opaque;
+    size_t threshold = s->ring_size / 4;
+    bool stop;
+
+    do {
+        qemu_mutex_lock(&s->lock);
+        while (!s->stop && !s->flush && s->head - s->tail < threshold) {
+            qemu_cond_wait(&s->cond, &s->lock);
+        }
+        stop = s->stop;
+        s->flush = false;
+        qemu_mutex_unlock(&s->lock);
+
+        dump_ring_drain(s);
+    } while (!stop);
+
+    return NULL;
+}
+
+static void dump_flush_timer(void *opaque)
+{
+    DumpState *s = opaque;
+
+    if (s->head != s->tail) {
+        dump_ring_kick(s, true);
+    }
+    qemu_mod_timer(s->flush_timer,
+                   qemu_get_clock_ms(rt_clock) + DUMP_FLUSH_INTERVAL_MS);
+}
+
 static void dump_cleanup(NetClientState *nc)
 {
     DumpState *s = DO_UPCAST(DumpState, nc, nc);
 
+    if (s->ring) {
+        qemu_del_timer(s->flush_timer);
+        qemu_free_timer(s->flush_timer);
+
+        qemu_mutex_lock(&s->lock);
+        s->stop = true;
+        qemu_cond_signal(&s->cond);
+        qemu_mutex_unlock(&s->lock);
+        qemu_thread_join(&s->thread);
+
+        qemu_cond_destroy(&s->cond);
+        qemu_mutex_destroy(&s->lock);
+        g_free(s->ring);
+
+        if (s->dropped) {
+            error_report("-net dump: %" PRIu64 " packets dropped, "
+                         "ring buffer full", s->dropped);
+        }
+    }
+
+    packet_filter_free(s->filter);
     close(s->fd);
 }
 
@@ -100,10 +340,54 @@ static NetClientInfo net_dump_info = {
     .cleanup = dump_cleanup,
 };
 
+static int dump_write_file_header(int fd, DumpFormat format, int len)
+{
+    if (format == DUMP_FORMAT_PCAPNG) {
+        struct pcapng_shb shb;
+        struct pcapng_idb idb;
+
+        shb.type = PCAPNG_SHB_TYPE;
+        shb.total_len = sizeof(shb);
+        shb.byte_order_magic = PCAPNG_BYTE_ORDER_MAGIC;
+        shb.version_major = 1;
+        shb.version_minor = 0;
+        shb.section_len = -1;
+        shb.total_len2 = sizeof(shb);
+
+        idb.type = PCAPNG_IDB_TYPE;
+        idb.total_len = sizeof(idb);
+        idb.linktype = 1;
+        idb.reserved = 0;
+        idb.snaplen = len;
+        idb.total_len2 = sizeof(idb);
+
+        if (write(fd, &shb, sizeof(shb)) < sizeof(shb) ||
+            write(fd, &idb, sizeof(idb)) < sizeof(idb)) {
+            return -1;
+        }
+    } else {
+        struct pcap_file_hdr hdr;
+
+        hdr.magic = PCAP_MAGIC;
+        hdr.version_major = 2;
+        hdr.version_minor = 4;
+        hdr.thiszone = 0;
+        hdr.sigfigs = 0;
+        hdr.snaplen = len;
+        hdr.linktype = 1;
+
+        if (write(fd, &hdr, sizeof(hdr)) < sizeof(hdr)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
 static int net_dump_init(NetClientState *peer, const char *device,
-                         const char *name, const char *filename, int len)
+                         const char *name, const char *filename, int len,
+                         DumpFormat format, PacketFilter *filter,
+                         size_t ring_size)
 {
-    struct pcap_file_hdr hdr;
     NetClientState *nc;
     DumpState *s;
     struct tm tm;
@@ -112,19 +396,13 @@ static int net_dump_init(NetClientState *peer, const char *device,
     fd = open(filename, O_CREAT | O_TRUNC | O_WRONLY | O_BINARY, 0644);
     if (fd < 0) {
         error_report("-net dump: can't open %s", filename);
+        packet_filter_free(filter);
         return -1;
     }
 
-    hdr.magic = PCAP_MAGIC;
-    hdr.version_major = 2;
-    hdr.version_minor = 4;
-    hdr.thiszone = 0;
-    hdr.sigfigs = 0;
-    hdr.snaplen = len;
-    hdr.linktype = 1;
-
-    if (write(fd, &hdr, sizeof(hdr)) < sizeof(hdr)) {
+    if (dump_write_file_header(fd, format, len) < 0) {
         error_report("-net dump write error: %s", strerror(errno));
+        packet_filter_free(filter);
         close(fd);
         return -1;
     }
@@ -132,16 +410,33 @@ static int net_dump_init(NetClientState *peer, const char *device,
     nc = qemu_new_net_client(&net_dump_info, peer, device, name);
 
     snprintf(nc->info_str, sizeof(nc->info_str),
-             "dump to %s (len=%d)", filename, len);
+             "dump to %s (len=%d%s%s)", filename, len,
+             format == DUMP_FORMAT_PCAPNG ? ",pcapng" : "",
+             ring_size ? ",ring" : "");
 
     s = DO_UPCAST(DumpState, nc, nc);
 
     s->fd = fd;
     s->pcap_caplen = len;
+    s->format = format;
+    s->filter = filter;
 
     qemu_get_timedate(&tm, 0);
     s->start_ts = mktime(&tm);
 
+    if (ring_size) {
+        s->ring_size = ring_size;
+        s->ring = g_malloc(ring_size);
+        qemu_mutex_init(&s->lock);
+        qemu_cond_init(&s->cond);
+        qemu_thread_create(&s->thread, dump_writer_thread, s,
+                           QEMU_THREAD_JOINABLE);
+
+        s->flush_timer = qemu_new_timer_ms(rt_clock, dump_flush_timer, s);
+        qemu_mod_timer(s->flush_timer,
+                       qemu_get_clock_ms(rt_clock) + DUMP_FLUSH_INTERVAL_MS);
+    }
+
     return 0;
 }
 
@@ -152,6 +447,8 @@ int net_init_dump(const NetClientOptions *opts, const char *name,
     const char *file;
     char def_file[128];
     const NetdevDumpOptions *dump;
+    PacketFilter *filter = NULL;
+    size_t ring_size = 0;
 
     assert(opts->kind == NET_CLIENT_OPTIONS_KIND_DUMP);
     dump = opts->dump;
@@ -167,7 +464,9 @@ int net_init_dump(const NetClientOptions *opts, const char *name,
         ret = net_hub_id_for_client(peer, &id);
         assert(ret == 0); /* peer must be on a hub */
 
-        snprintf(def_file, sizeof(def_file), "qemu-vlan%d.pcap", id);
+        snprintf(def_file, sizeof(def_file), "qemu-vlan%d.%s", id,
+                 dump->has_format && dump->format == DUMP_FORMAT_PCAPNG ?
+                 "pcapng" : "pcap");
         file = def_file;
     }
 
@@ -181,5 +480,30 @@ int net_init_dump(const NetClientOptions *opts, const char *name,
         len = 65536;
     }
 
-    return net_dump_init(peer, "dump", name, file, len);
+    if (dump->has_ring) {
+        if (dump->ring > SIZE_MAX / 2) {
+            error_report("invalid ring size: %"PRIu64, dump->ring);
+            return -1;
+        }
+        ring_size = DUMP_RING_MIN;
+        while (ring_size < dump->ring) {
+            ring_size <<= 1;
+        }
+        /* a record plus headers must fit */
+        while (ring_size < 2 * (len + DUMP_HDR_MAX + DUMP_TRAILER_MAX)) {
+            ring_size <<= 1;
+        }
+    }
+
+    if (dump->has_filter) {
+        filter = packet_filter_new(dump->filter);
+        if (!filter) {
+            error_report("invalid filter expression: %s", dump->filter);
+            return -1;
+        }
+    }
+
+    return net_dump_init(peer, "dump", name, file, len,
+                         dump->has_format ? dump->format : DUMP_FORMAT_PCAP,
+                         filter, ring_size);
 }
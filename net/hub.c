@@ -16,13 +16,26 @@
 #include "net.h"
 #include "hub.h"
 #include "iov.h"
+#include "qemu-timer.h"
 
 /*
  * A hub broadcasts incoming packets to all its ports except the source port.
  * Hubs can be used to provide independent network segments, also confusingly
  * named the QEMU 'vlan' feature.
+ *
+ * A learning hub instead works like a switch: it remembers behind which
+ * port each source MAC address was seen, and sends unicast frames for a
+ * known address to that port only.  Broadcast, multicast and frames for
+ * unknown addresses are still flooded.  Ports connected to -net dump see
+ * all the traffic.
  */
 
+/* Addresses that were not seen for this long are forgotten (ms) */
+#define HUB_FDB_AGEING_TIME     (300 * 1000)
+#define HUB_FDB_MAX_ENTRIES     1024
+
+#define HUB_MAC_LEN     6
+
 typedef struct NetHub NetHub;
 
 typedef struct NetHubPort {
@@ -32,24 +45,134 @@ typedef struct NetHubPort {
     int id;
 } NetHubPort;
 
+/* forwarding database entry, keyed by mac */
+typedef struct NetHubFdbEntry {
+    uint8_t mac[HUB_MAC_LEN];
+    NetHubPort *port;
+    int64_t last_seen;
+} NetHubFdbEntry;
+
 struct NetHub {
     int id;
     QLIST_ENTRY(NetHub) next;
     int num_ports;
     QLIST_HEAD(, NetHubPort) ports;
+    bool learning;
+    GHashTable *fdb;
 };
 
 static QLIST_HEAD(, NetHub) hubs = QLIST_HEAD_INITIALIZER(&hubs);
 
+static guint net_hub_mac_hash(gconstpointer key)
+{
+    const uint8_t *mac = key;
+
+    /* the vendor part is mostly the same, mix in the device part first */
+    return (mac[5] | mac[4] << 8 | mac[3] << 16 | mac[2] << 24) ^
+           (mac[1] | mac[0] << 8);
+}
+
+static gboolean net_hub_mac_equal(gconstpointer a, gconstpointer b)
+{
+    return !memcmp(a, b, HUB_MAC_LEN);
+}
+
+static gboolean net_hub_fdb_expired(gpointer key, gpointer value,
+                                    gpointer opaque)
+{
+    NetHubFdbEntry *entry = value;
+    int64_t now = *(int64_t *)opaque;
+
+    return now - entry->last_seen >= HUB_FDB_AGEING_TIME;
+}
+
+static gboolean net_hub_fdb_entry_on_port(gpointer key, gpointer value,
+                                          gpointer opaque)
+{
+    NetHubFdbEntry *entry = value;
+
+    return entry->port == opaque;
+}
+
+/* Learn where the source address of a frame is, and return the only port
+ * that the frame has to go to, or NULL to flood it.  *drop is set if the
+ * destination is on the segment the frame came from.
+ */
+static NetHubPort *net_hub_fdb_update(NetHub *hub, NetHubPort *source_port,
+                                      const uint8_t *hdr, size_t len,
+                                      bool *drop)
+{
+    const uint8_t *dst = hdr, *src = hdr + HUB_MAC_LEN;
+    NetHubFdbEntry *entry;
+    int64_t now;
+
+    *drop = false;
+    if (len < 2 * HUB_MAC_LEN) {
+        return NULL;
+    }
+
+    now = qemu_get_clock_ms(rt_clock);
+
+    /* multicast source addresses are bogus, don't learn them */
+    if (!(src[0] & 1)) {
+        entry = g_hash_table_lookup(hub->fdb, src);
+        if (!entry) {
+            if (g_hash_table_size(hub->fdb) >= HUB_FDB_MAX_ENTRIES) {
+                g_hash_table_foreach_remove(hub->fdb, net_hub_fdb_expired,
+                                            &now);
+            }
+            if (g_hash_table_size(hub->fdb) < HUB_FDB_MAX_ENTRIES) {
+                entry = g_new(NetHubFdbEntry, 1);
+                memcpy(entry->mac, src, HUB_MAC_LEN);
+                g_hash_table_insert(hub->fdb, entry->mac, entry);
+            }
+        }
+        if (entry) {
+            entry->port = source_port;
+            entry->last_seen = now;
+        }
+    }
+
+    if (dst[0] & 1) {
+        return NULL;
+    }
+
+    entry = g_hash_table_lookup(hub->fdb, dst);
+    if (!entry || now - entry->last_seen >= HUB_FDB_AGEING_TIME) {
+        return NULL;
+    }
+    if (entry->port == source_port) {
+        *drop = true;
+        return NULL;
+    }
+    return entry->port;
+}
+
+/* Ports that see every frame, even on a learning hub */
+static bool net_hub_port_is_monitor(NetHubPort *port)
+{
+    return port->nc.peer &&
+           port->nc.peer->info->type == NET_CLIENT_OPTIONS_KIND_DUMP;
+}
+
 static ssize_t net_hub_receive(NetHub *hub, NetHubPort *source_port,
                                const uint8_t *buf, size_t len)
 {
-    NetHubPort *port;
+    NetHubPort *port, *dest_port = NULL;
+    bool drop = false;
+
+    if (hub->learning) {
+        dest_port = net_hub_fdb_update(hub, source_port, buf, len, &drop);
+    }
 
     QLIST_FOREACH(port, &hub->ports, next) {
         if (port == source_port) {
             continue;
         }
+        if ((dest_port || drop) && port != dest_port &&
+            !net_hub_port_is_monitor(port)) {
+            continue;
+        }
 
         qemu_send_packet(&port->nc, buf, len);
     }
@@ -59,13 +182,25 @@ static ssize_t net_hub_receive(NetHub *hub, NetHubPort *source_port,
 static ssize_t net_hub_receive_iov(NetHub *hub, NetHubPort *source_port,
                                    const struct iovec *iov, int iovcnt)
 {
-    NetHubPort *port;
+    NetHubPort *port, *dest_port = NULL;
     ssize_t len = iov_size(iov, iovcnt);
+    bool drop = false;
+
+    if (hub->learning) {
+        uint8_t hdr[2 * HUB_MAC_LEN];
+        size_t hdr_len = iov_to_buf(iov, iovcnt, 0, hdr, sizeof(hdr));
+
+        dest_port = net_hub_fdb_update(hub, source_port, hdr, hdr_len, &drop);
+    }
 
     QLIST_FOREACH(port, &hub->ports, next) {
         if (port == source_port) {
             continue;
         }
+        if ((dest_port || drop) && port != dest_port &&
+            !net_hub_port_is_monitor(port)) {
+            continue;
+        }
 
         qemu_sendv_packet(&port->nc, iov, iovcnt);
     }
@@ -80,6 +215,9 @@ static NetHub *net_hub_new(int id)
     hub->id = id;
     hub->num_ports = 0;
     QLIST_INIT(&hub->ports);
+    hub->learning = false;
+    hub->fdb = g_hash_table_new_full(net_hub_mac_hash, net_hub_mac_equal,
+                                     NULL, g_free);
 
     QLIST_INSERT_HEAD(&hubs, hub, next);
 
@@ -126,6 +264,8 @@ static void net_hub_port_cleanup(NetClientState *nc)
     NetHubPort *port = DO_UPCAST(NetHubPort, nc, nc);
 
     QLIST_REMOVE(port, next);
+    g_hash_table_foreach_remove(port->hub->fdb, net_hub_fdb_entry_on_port,
+                                port);
 }
 
 static NetClientInfo net_hub_port_info = {
@@ -242,7 +382,8 @@ void net_hub_info(Monitor *mon)
     NetHubPort *port;
 
     QLIST_FOREACH(hub, &hubs, next) {
-        monitor_printf(mon, "hub %d\n", hub->id);
+        monitor_printf(mon, "hub %d%s\n", hub->id,
+                       hub->learning ? " (learning)" : "");
         QLIST_FOREACH(port, &hub->ports, next) {
             if (port->nc.peer) {
                 monitor_printf(mon, " \\ ");
@@ -280,6 +421,7 @@ int net_init_hubport(const NetClientOptions *opts, const char *name,
                      NetClientState *peer)
 {
     const NetdevHubPortOptions *hubport;
+    NetClientState *nc;
 
     assert(opts->kind == NET_CLIENT_OPTIONS_KIND_HUBPORT);
     hubport = opts->hubport;
@@ -289,7 +431,10 @@ int net_init_hubport(const NetClientOptions *opts, const char *name,
         return -EINVAL;
     }
 
-    net_hub_add_port(hubport->hubid, name);
+    nc = net_hub_add_port(hubport->hubid, name);
+    if (hubport->has_learning && hubport->learning) {
+        DO_UPCAST(NetHubPort, nc, nc)->hub->learning = true;
+    }
     return 0;
 }
 
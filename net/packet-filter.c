@@ -0,0 +1,507 @@
+/*
+ * Packet filter expressions
+ *
+ * Copyright Red Hat, Inc. 2012
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "net/packet-filter.h"
+
+#define ETH_P_IP    0x0800
+#define ETH_P_ARP   0x0806
+#define ETH_P_VLAN  0x8100
+#define ETH_P_IPV6  0x86dd
+
+#define PROTO_ICMP  1
+#define PROTO_TCP   6
+#define PROTO_UDP   17
+
+typedef enum {
+    PF_AND,
+    PF_OR,
+    PF_NOT,
+    PF_ETHER_HOST,      /* mac */
+    PF_ETHER_PROTO,     /* value */
+    PF_VLAN,
+    PF_BROADCAST,
+    PF_MULTICAST,
+    PF_IP_PROTO,        /* value, IPv4 or IPv6 */
+    PF_HOST,            /* addr */
+    PF_PORT,            /* value */
+    PF_LESS,            /* value */
+    PF_GREATER,         /* value */
+} PacketFilterOp;
+
+/* which address or port a primitive looks at */
+enum {
+    PF_DIR_SRC = 1,
+    PF_DIR_DST = 2,
+    PF_DIR_ANY = PF_DIR_SRC | PF_DIR_DST,
+};
+
+typedef struct PacketFilterNode PacketFilterNode;
+
+struct PacketFilterNode {
+    PacketFilterOp op;
+    int dir;
+    uint32_t value;
+    uint8_t mac[6];
+    PacketFilterNode *left, *right;
+};
+
+struct PacketFilter {
+    PacketFilterNode *root;
+};
+
+/* The headers of a frame that primitives look at */
+typedef struct PacketInfo {
+    const uint8_t *buf;
+    size_t size;
+    uint16_t ethertype;
+    bool vlan;
+    int ip_version;     /* 0 if not IP */
+    uint32_t saddr, daddr;
+    int proto;          /* -1 if unknown */
+    int sport, dport;   /* -1 if no ports */
+} PacketInfo;
+
+/* Parser */
+
+typedef struct PacketFilterParser {
+    gchar **tokens;
+    int pos;
+} PacketFilterParser;
+
+static PacketFilterNode *pf_parse_or(PacketFilterParser *p);
+
+static const char *pf_peek(PacketFilterParser *p)
+{
+    return p->tokens[p->pos];
+}
+
+static bool pf_accept(PacketFilterParser *p, const char *tok1,
+                      const char *tok2)
+{
+    const char *tok = pf_peek(p);
+
+    if (tok && (!strcmp(tok, tok1) || (tok2 && !strcmp(tok, tok2)))) {
+        p->pos++;
+        return true;
+    }
+    return false;
+}
+
+static PacketFilterNode *pf_node(PacketFilterOp op)
+{
+    PacketFilterNode *n = g_new0(PacketFilterNode, 1);
+
+    n->op = op;
+    n->dir = PF_DIR_ANY;
+    return n;
+}
+
+static void pf_node_free(PacketFilterNode *n)
+{
+    if (n) {
+        pf_node_free(n->left);
+        pf_node_free(n->right);
+        g_free(n);
+    }
+}
+
+static bool pf_parse_number(PacketFilterParser *p, uint32_t *value)
+{
+    const char *tok = pf_peek(p);
+    char *end;
+    unsigned long v;
+
+    if (!tok || !qemu_isdigit(tok[0])) {
+        return false;
+    }
+    errno = 0;
+    v = strtoul(tok, &end, 0);
+    if (*end || errno || v > UINT32_MAX) {
+        return false;
+    }
+    *value = v;
+    p->pos++;
+    return true;
+}
+
+static bool pf_parse_ipv4(PacketFilterParser *p, uint32_t *addr)
+{
+    const char *tok = pf_peek(p);
+    unsigned int a, b, c, d;
+    char dummy;
+
+    if (!tok || sscanf(tok, "%u.%u.%u.%u%c", &a, &b, &c, &d, &dummy) != 4 ||
+        a > 255 || b > 255 || c > 255 || d > 255) {
+        return false;
+    }
+    *addr = (a << 24) | (b << 16) | (c << 8) | d;
+    p->pos++;
+    return true;
+}
+
+static bool pf_parse_mac(PacketFilterParser *p, uint8_t *mac)
+{
+    const char *tok = pf_peek(p);
+    unsigned int m[6];
+    char dummy;
+    int i;
+
+    if (!tok || sscanf(tok, "%x:%x:%x:%x:%x:%x%c", &m[0], &m[1], &m[2],
+                       &m[3], &m[4], &m[5], &dummy) != 6) {
+        return false;
+    }
+    for (i = 0; i < 6; i++) {
+        if (m[i] > 255) {
+            return false;
+        }
+        mac[i] = m[i];
+    }
+    p->pos++;
+    return true;
+}
+
+static PacketFilterNode *pf_parse_primitive(PacketFilterParser *p)
+{
+    PacketFilterNode *n;
+    int dir = PF_DIR_ANY;
+
+    if (pf_accept(p, "(", NULL)) {
+        n = pf_parse_or(p);
+        if (n && !pf_accept(p, ")", NULL)) {
+            pf_node_free(n);
+            return NULL;
+        }
+        return n;
+    }
+
+    if (pf_accept(p, "ether", NULL)) {
+        if (pf_accept(p, "proto", NULL)) {
+            n = pf_node(PF_ETHER_PROTO);
+            if (!pf_parse_number(p, &n->value) || n->value > 0xffff) {
+                goto fail;
+            }
+            return n;
+        }
+        if (pf_accept(p, "src", NULL)) {
+            dir = PF_DIR_SRC;
+        } else if (pf_accept(p, "dst", NULL)) {
+            dir = PF_DIR_DST;
+        }
+        n = pf_node(PF_ETHER_HOST);
+        n->dir = dir;
+        if (!pf_accept(p, "host", NULL) || !pf_parse_mac(p, n->mac)) {
+            goto fail;
+        }
+        return n;
+    }
+
+    if (pf_accept(p, "vlan", NULL)) {
+        return pf_node(PF_VLAN);
+    }
+    if (pf_accept(p, "broadcast", NULL)) {
+        return pf_node(PF_BROADCAST);
+    }
+    if (pf_accept(p, "multicast", NULL)) {
+        return pf_node(PF_MULTICAST);
+    }
+    if (pf_accept(p, "arp", NULL)) {
+        n = pf_node(PF_ETHER_PROTO);
+        n->value = ETH_P_ARP;
+        return n;
+    }
+    if (pf_accept(p, "ip", NULL)) {
+        n = pf_node(PF_ETHER_PROTO);
+        n->value = ETH_P_IP;
+        return n;
+    }
+    if (pf_accept(p, "ip6", NULL)) {
+        n = pf_node(PF_ETHER_PROTO);
+        n->value = ETH_P_IPV6;
+        return n;
+    }
+    if (pf_accept(p, "icmp", NULL)) {
+        n = pf_node(PF_IP_PROTO);
+        n->value = PROTO_ICMP;
+        return n;
+    }
+    if (pf_accept(p, "tcp", NULL)) {
+        n = pf_node(PF_IP_PROTO);
+        n->value = PROTO_TCP;
+        return n;
+    }
+    if (pf_accept(p, "udp", NULL)) {
+        n = pf_node(PF_IP_PROTO);
+        n->value = PROTO_UDP;
+        return n;
+    }
+    if (pf_accept(p, "less", NULL)) {
+        n = pf_node(PF_LESS);
+        if (!pf_parse_number(p, &n->value)) {
+            goto fail;
+        }
+        return n;
+    }
+    if (pf_accept(p, "greater", NULL)) {
+        n = pf_node(PF_GREATER);
+        if (!pf_parse_number(p, &n->value)) {
+            goto fail;
+        }
+        return n;
+    }
+
+    if (pf_accept(p, "src", NULL)) {
+        dir = PF_DIR_SRC;
+    } else if (pf_accept(p, "dst", NULL)) {
+        dir = PF_DIR_DST;
+    }
+    if (pf_accept(p, "host", NULL)) {
+        n = pf_node(PF_HOST);
+        n->dir = dir;
+        if (!pf_parse_ipv4(p, &n->value)) {
+            goto fail;
+        }
+        return n;
+    }
+    if (pf_accept(p, "port", NULL)) {
+        n = pf_node(PF_PORT);
+        n->dir = dir;
+        if (!pf_parse_number(p, &n->value) || n->value > 0xffff) {
+            goto fail;
+        }
+        return n;
+    }
+    return NULL;
+
+fail:
+    g_free(n);
+    return NULL;
+}
+
+static PacketFilterNode *pf_parse_not(PacketFilterParser *p)
+{
+    PacketFilterNode *n, *child;
+
+    if (pf_accept(p, "not", "!")) {
+        child = pf_parse_not(p);
+        if (!child) {
+            return NULL;
+        }
+        n = pf_node(PF_NOT);
+        n->left = child;
+        return n;
+    }
+    return pf_parse_primitive(p);
+}
+
+static PacketFilterNode *pf_parse_binary(PacketFilterParser *p,
+                                         PacketFilterOp op)
+{
+    PacketFilterNode *n, *left, *right;
+    const char *word = op == PF_AND ? "and" : "or";
+    const char *sym = op == PF_AND ? "&&" : "||";
+
+    left = op == PF_AND ? pf_parse_not(p) : pf_parse_binary(p, PF_AND);
+    while (left && pf_accept(p, word, sym)) {
+        right = op == PF_AND ? pf_parse_not(p) : pf_parse_binary(p, PF_AND);
+        if (!right) {
+            pf_node_free(left);
+            return NULL;
+        }
+        n = pf_node(op);
+        n->left = left;
+        n->right = right;
+        left = n;
+    }
+    return left;
+}
+
+static PacketFilterNode *pf_parse_or(PacketFilterParser *p)
+{
+    return pf_parse_binary(p, PF_OR);
+}
+
+/* Split the expression into words, with operators and parentheses apart */
+static gchar **pf_tokenize(const char *expr)
+{
+    GString *spaced = g_string_new(NULL);
+    gchar **words, **tokens;
+    int i, n;
+
+    for (; *expr; expr++) {
+        if (*expr == '(' || *expr == ')' || *expr == '!') {
+            g_string_append_c(spaced, ' ');
+            g_string_append_c(spaced, *expr);
+            g_string_append_c(spaced, ' ');
+        } else if ((*expr == '&' || *expr == '|') && expr[1] == *expr) {
+            g_string_append_c(spaced, ' ');
+            g_string_append_c(spaced, *expr);
+            g_string_append_c(spaced, *expr);
+            g_string_append_c(spaced, ' ');
+            expr++;
+        } else if (*expr == '\t' || *expr == '\n') {
+            g_string_append_c(spaced, ' ');
+        } else {
+            g_string_append_c(spaced, *expr);
+        }
+    }
+
+    /* drop the empty strings between consecutive spaces */
+    words = g_strsplit(spaced->str, " ", -1);
+    g_string_free(spaced, true);
+    tokens = g_new0(gchar *, g_strv_length(words) + 1);
+    for (i = n = 0; words[i]; i++) {
+        if (words[i][0]) {
+            tokens[n++] = g_strdup(words[i]);
+        }
+    }
+    g_strfreev(words);
+    return tokens;
+}
+
+PacketFilter *packet_filter_new(const char *expr)
+{
+    PacketFilterParser p;
+    PacketFilterNode *root;
+    PacketFilter *f;
+
+    p.tokens = pf_tokenize(expr);
+    p.pos = 0;
+    root = pf_parse_or(&p);
+    if (root && pf_peek(&p)) {
+        /* trailing garbage */
+        pf_node_free(root);
+        root = NULL;
+    }
+    g_strfreev(p.tokens);
+    if (!root) {
+        return NULL;
+    }
+
+    f = g_new0(PacketFilter, 1);
+    f->root = root;
+    return f;
+}
+
+void packet_filter_free(PacketFilter *f)
+{
+    if (f) {
+        pf_node_free(f->root);
+        g_free(f);
+    }
+}
+
+/* Matching */
+
+static uint16_t pf_get16(const uint8_t *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static uint32_t pf_get32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void pf_parse_packet(PacketInfo *info, const uint8_t *buf, size_t size)
+{
+    size_t l3, l4 = 0;
+
+    memset(info, 0, sizeof(*info));
+    info->buf = buf;
+    info->size = size;
+    info->proto = -1;
+    info->sport = info->dport = -1;
+    if (size < 14) {
+        return;
+    }
+
+    l3 = 14;
+    info->ethertype = pf_get16(buf + 12);
+    if (info->ethertype == ETH_P_VLAN && size >= 18) {
+        info->vlan = true;
+        info->ethertype = pf_get16(buf + 16);
+        l3 = 18;
+    }
+
+    if (info->ethertype == ETH_P_IP && size >= l3 + 20 &&
+        (buf[l3] >> 4) == 4) {
+        info->ip_version = 4;
+        info->proto = buf[l3 + 9];
+        info->saddr = pf_get32(buf + l3 + 12);
+        info->daddr = pf_get32(buf + l3 + 16);
+        /* only the first fragment has the ports */
+        if (!(pf_get16(buf + l3 + 6) & 0x1fff)) {
+            l4 = l3 + (buf[l3] & 0xf) * 4;
+        }
+    } else if (info->ethertype == ETH_P_IPV6 && size >= l3 + 40 &&
+               (buf[l3] >> 4) == 6) {
+        /* extension headers are not followed */
+        info->ip_version = 6;
+        info->proto = buf[l3 + 6];
+        l4 = l3 + 40;
+    }
+
+    if (l4 && (info->proto == PROTO_TCP || info->proto == PROTO_UDP) &&
+        size >= l4 + 4) {
+        info->sport = pf_get16(buf + l4);
+        info->dport = pf_get16(buf + l4 + 2);
+    }
+}
+
+static bool pf_eval(const PacketFilterNode *n, const PacketInfo *info)
+{
+    switch (n->op) {
+    case PF_AND:
+        return pf_eval(n->left, info) && pf_eval(n->right, info);
+    case PF_OR:
+        return pf_eval(n->left, info) || pf_eval(n->right, info);
+    case PF_NOT:
+        return !pf_eval(n->left, info);
+    case PF_ETHER_HOST:
+        if (info->size < 14) {
+            return false;
+        }
+        return ((n->dir & PF_DIR_DST) && !memcmp(info->buf, n->mac, 6)) ||
+               ((n->dir & PF_DIR_SRC) && !memcmp(info->buf + 6, n->mac, 6));
+    case PF_ETHER_PROTO:
+        return info->size >= 14 && info->ethertype == n->value;
+    case PF_VLAN:
+        return info->vlan;
+    case PF_BROADCAST:
+        return info->size >= 6 &&
+               !memcmp(info->buf, "\xff\xff\xff\xff\xff\xff", 6);
+    case PF_MULTICAST:
+        return info->size >= 6 && (info->buf[0] & 1);
+    case PF_IP_PROTO:
+        return info->ip_version && info->proto == n->value;
+    case PF_HOST:
+        return info->ip_version == 4 &&
+               (((n->dir & PF_DIR_SRC) && info->saddr == n->value) ||
+                ((n->dir & PF_DIR_DST) && info->daddr == n->value));
+    case PF_PORT:
+        return ((n->dir & PF_DIR_SRC) && info->sport == n->value) ||
+               ((n->dir & PF_DIR_DST) && info->dport == n->value);
+    case PF_LESS:
+        return info->size <= n->value;
+    case PF_GREATER:
+        return info->size >= n->value;
+    }
+    abort();
+}
+
+bool packet_filter_match(const PacketFilter *f, const uint8_t *buf,
+                         size_t size)
+{
+    PacketInfo info;
+
+    pf_parse_packet(&info, buf, size);
+    return pf_eval(f->root, &info);
+}
@@ -0,0 +1,39 @@
+/*
+ * Packet filter expressions
+ *
+ * Copyright Red Hat, Inc. 2012
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_NET_PACKET_FILTER_H
+#define QEMU_NET_PACKET_FILTER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct PacketFilter PacketFilter;
+
+/*
+ * Compile a filter expression in a subset of the pcap-filter(7) syntax:
+ * primitives combined with "and", "or", "not" (or "&&", "||", "!") and
+ * parentheses.  The primitives are
+ *
+ *   ether [src|dst] host MAC     ether proto N     vlan
+ *   arp  ip  ip6  icmp  tcp  udp broadcast  multicast
+ *   [src|dst] host A.B.C.D       [src|dst] port N
+ *   less N  greater N
+ *
+ * Returns NULL if the expression is invalid.
+ */
+PacketFilter *packet_filter_new(const char *expr);
+void packet_filter_free(PacketFilter *f);
+
+/* Does the Ethernet frame in buf match the filter? */
+bool packet_filter_match(const PacketFilter *f, const uint8_t *buf,
+                         size_t size);
+
+#endif /* QEMU_NET_PACKET_FILTER_H */
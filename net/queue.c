@@ -24,6 +24,7 @@
 #include "net/queue.h"
 #include "qemu-queue.h"
 #include "net.h"
+#include "iov.h"
 
 /* The delivery handler may only return zero if it will call
  * qemu_net_queue_flush() when it determines that it is once again able
@@ -45,6 +46,10 @@ struct NetPacket {
     unsigned flags;
     int size;
     NetPacketSent *sent_cb;
+    /* with QEMU_NET_PACKET_FLAG_ZEROCOPY, data holds iovcnt struct iovec
+     * pointing to the sender's buffers instead of the packet itself
+     */
+    int iovcnt;
     uint8_t data[0];
 };
 
@@ -97,6 +102,7 @@ static ssize_t qemu_net_queue_append(NetQueue *queue,
     packet->flags = flags;
     packet->size = size;
     packet->sent_cb = sent_cb;
+    packet->iovcnt = 0;
     memcpy(packet->data, buf, size);
 
     QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
@@ -124,6 +130,7 @@ static ssize_t qemu_net_queue_append_iov(NetQueue *queue,
     packet->sent_cb = sent_cb;
     packet->flags = flags;
     packet->size = 0;
+    packet->iovcnt = 0;
 
     for (i = 0; i < iovcnt; i++) {
         size_t len = iov[i].iov_len;
@@ -137,6 +144,28 @@ static ssize_t qemu_net_queue_append_iov(NetQueue *queue,
     return packet->size;
 }
 
+static ssize_t qemu_net_queue_append_zerocopy(NetQueue *queue,
+                                              NetClientState *sender,
+                                              unsigned flags,
+                                              const struct iovec *iov,
+                                              int iovcnt,
+                                              NetPacketSent *sent_cb)
+{
+    NetPacket *packet;
+
+    packet = g_malloc(sizeof(NetPacket) + iovcnt * sizeof(struct iovec));
+    packet->sender = sender;
+    packet->sent_cb = sent_cb;
+    packet->flags = flags;
+    packet->size = iov_size(iov, iovcnt);
+    packet->iovcnt = iovcnt;
+    memcpy(packet->data, iov, iovcnt * sizeof(struct iovec));
+
+    QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+
+    return packet->size;
+}
+
 static ssize_t qemu_net_queue_deliver(NetQueue *queue,
                                       NetClientState *sender,
                                       unsigned flags,
@@ -167,6 +196,22 @@ static ssize_t qemu_net_queue_deliver_iov(NetQueue *queue,
     return ret;
 }
 
+static int qemu_net_queue_deliver_batch(NetQueue *queue,
+                                        NetClientState *sender,
+                                        unsigned flags,
+                                        const NetPacketIOV *packets,
+                                        int count)
+{
+    int ret;
+
+    queue->delivering = 1;
+    ret = qemu_deliver_packet_batch(sender, flags, packets, count,
+                                    queue->opaque);
+    queue->delivering = 0;
+
+    return ret;
+}
+
 ssize_t qemu_net_queue_send(NetQueue *queue,
                             NetClientState *sender,
                             unsigned flags,
@@ -216,16 +261,74 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
     return ret;
 }
 
+/* Deliver several packets with one call into the receiver.
+ *
+ * Returns the number of packets that were delivered right away.  If that
+ * is less than @count, the remaining packets have been queued and
+ * @sent_cb is invoked once the last of them is delivered; as for a zero
+ * return from send(), the caller must not send any more packets until
+ * then.
+ */
+int qemu_net_queue_send_batch(NetQueue *queue,
+                              NetClientState *sender,
+                              unsigned flags,
+                              const NetPacketIOV *packets,
+                              int count,
+                              NetPacketSent *sent_cb)
+{
+    int ret = 0, i;
+
+    if (!queue->delivering && qemu_can_send_packet(sender)) {
+        ret = qemu_net_queue_deliver_batch(queue, sender, flags,
+                                           packets, count);
+        if (ret == count) {
+            qemu_net_queue_flush(queue);
+            return ret;
+        }
+    }
+
+    for (i = ret; i < count; i++) {
+        NetPacketSent *cb = i == count - 1 ? sent_cb : NULL;
+
+        if (flags & QEMU_NET_PACKET_FLAG_ZEROCOPY) {
+            qemu_net_queue_append_zerocopy(queue, sender, flags,
+                                           packets[i].iov, packets[i].iovcnt,
+                                           cb);
+        } else {
+            qemu_net_queue_append_iov(queue, sender, flags,
+                                      packets[i].iov, packets[i].iovcnt, cb);
+        }
+    }
+
+    return ret;
+}
+
 void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
 {
     NetPacket *packet, *next;
+    QTAILQ_HEAD(, NetPacket) zerocopy = QTAILQ_HEAD_INITIALIZER(zerocopy);
 
     QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
         if (packet->sender == from) {
             QTAILQ_REMOVE(&queue->packets, packet, entry);
-            g_free(packet);
+            if (packet->flags & QEMU_NET_PACKET_FLAG_ZEROCOPY) {
+                QTAILQ_INSERT_TAIL(&zerocopy, packet, entry);
+            } else {
+                g_free(packet);
+            }
         }
     }
+
+    /* The sender is waiting to get its buffers back.  Tell it once the
+     * queue is consistent again, it may well send more packets.
+     */
+    QTAILQ_FOREACH_SAFE(packet, &zerocopy, entry, next) {
+        QTAILQ_REMOVE(&zerocopy, packet, entry);
+        if (packet->sent_cb) {
+            packet->sent_cb(packet->sender, 0);
+        }
+        g_free(packet);
+    }
 }
 
 void qemu_net_queue_flush(NetQueue *queue)
@@ -237,11 +340,19 @@ void qemu_net_queue_flush(NetQueue *queue)
         packet = QTAILQ_FIRST(&queue->packets);
         QTAILQ_REMOVE(&queue->packets, packet, entry);
 
-        ret = qemu_net_queue_deliver(queue,
-                                     packet->sender,
-                                     packet->flags,
-                                     packet->data,
-                                     packet->size);
+        if (packet->flags & QEMU_NET_PACKET_FLAG_ZEROCOPY) {
+            ret = qemu_net_queue_deliver_iov(queue,
+                                             packet->sender,
+                                             packet->flags,
+                                             (struct iovec *)packet->data,
+                                             packet->iovcnt);
+        } else {
+            ret = qemu_net_queue_deliver(queue,
+                                         packet->sender,
+                                         packet->flags,
+                                         packet->data,
+                                         packet->size);
+        }
         if (ret == 0) {
             QTAILQ_INSERT_HEAD(&queue->packets, packet, entry);
             break;
@@ -0,0 +1,110 @@
+/*
+ * vhost-user.c
+ *
+ * Copyright Red Hat, Inc. 2012
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "vhost-user.h"
+#include "net.h"
+#include "qemu-common.h"
+#include "qemu-error.h"
+#include "qemu_socket.h"
+#include "qerror.h"
+#include "migration.h"
+#include "hw/vhost_net.h"
+
+/* The virtqueues are run by another process, see docs/specs/vhost-user.txt.
+ * Packets only go through QEMU before the guest driver is up, and
+ * are dropped.
+ */
+typedef struct VhostUserState {
+    NetClientState nc;
+    VHostNetState *vhost_net;
+    Error *migration_blocker;
+} VhostUserState;
+
+VHostNetState *vhost_user_get_vhost_net(NetClientState *nc)
+{
+    VhostUserState *s = DO_UPCAST(VhostUserState, nc, nc);
+    assert(nc->info->type == NET_CLIENT_OPTIONS_KIND_VHOST_USER);
+    return s->vhost_net;
+}
+
+static ssize_t vhost_user_receive(NetClientState *nc, const uint8_t *buf,
+                                  size_t size)
+{
+    return size;
+}
+
+static void vhost_user_cleanup(NetClientState *nc)
+{
+    VhostUserState *s = DO_UPCAST(VhostUserState, nc, nc);
+
+    if (s->vhost_net) {
+        vhost_net_cleanup(s->vhost_net);
+        s->vhost_net = NULL;
+    }
+    if (s->migration_blocker) {
+        migrate_del_blocker(s->migration_blocker);
+        error_free(s->migration_blocker);
+        s->migration_blocker = NULL;
+    }
+}
+
+static NetClientInfo net_vhost_user_info = {
+    .type = NET_CLIENT_OPTIONS_KIND_VHOST_USER,
+    .size = sizeof(VhostUserState),
+    .receive = vhost_user_receive,
+    .cleanup = vhost_user_cleanup,
+};
+
+int net_init_vhost_user(const NetClientOptions *opts, const char *name,
+                        NetClientState *peer)
+{
+    const NetdevVhostUserOptions *vhost_user;
+    NetClientState *nc;
+    VhostUserState *s;
+    int fd;
+
+    assert(opts->kind == NET_CLIENT_OPTIONS_KIND_VHOST_USER);
+    vhost_user = opts->vhost_user;
+
+    /* the vhost device must be right behind the virtio-net NIC */
+    if (peer) {
+        error_report("vhost-user: use -netdev, it can not be on a vlan");
+        return -1;
+    }
+
+    fd = unix_connect(vhost_user->path);
+    if (fd < 0) {
+        error_report("vhost-user: could not connect to %s", vhost_user->path);
+        return -1;
+    }
+
+    nc = qemu_new_net_client(&net_vhost_user_info, peer, "vhost_user", name);
+    snprintf(nc->info_str, sizeof(nc->info_str), "vhost-user to %s",
+             vhost_user->path);
+    s = DO_UPCAST(VhostUserState, nc, nc);
+
+    /* The other process has no other way to reach the guest: always use
+     * vhost, even without MSI-X.  The socket now belongs to the vhost device.
+     */
+    s->vhost_net = vhost_net_init(nc, fd, true);
+    if (!s->vhost_net) {
+        error_report("vhost-user: could not set up the vhost device for %s",
+                     vhost_user->path);
+        qemu_del_net_client(nc);
+        return -1;
+    }
+
+    /* The dirty log is not shared with the other process */
+    error_set(&s->migration_blocker, QERR_DEVICE_FEATURE_BLOCKS_MIGRATION,
+              "vhost-user", name ? name : "vhost-user");
+    migrate_add_blocker(s->migration_blocker);
+
+    return 0;
+}
@@ -1,6 +1,6 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is set associative, sets are selected by the page address
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -25,6 +25,7 @@
 
 #include "qemu-common.h"
 #include "qemu/page_cache.h"
+#include "qemu-memacct.h"
 
 #ifdef DEBUG_CACHE
 #define DPRINTF(fmt, ...) \
@@ -42,14 +43,32 @@ struct CacheItem {
     uint8_t *it_data;
 };
 
+/*
+ * The cache is split in sets of num_ways items; a page can only live in
+ * the set selected by its address, in any of its ways.  When the set is
+ * full the least recently used item of the set is evicted.
+ */
 struct PageCache {
     CacheItem *page_cache;
     unsigned int page_size;
     int64_t max_num_items;
     uint64_t max_item_age;
     int64_t num_items;
+    unsigned int num_ways;
+    int64_t num_sets;
+    MemAccount mem_account;
 };
 
+/* The cache owns the pages inserted into it, so count them too */
+static void cache_update_account(PageCache *cache)
+{
+    int64_t bytes = sizeof(*cache) +
+                    cache->max_num_items * sizeof(*cache->page_cache) +
+                    cache->num_items * cache->page_size;
+
+    mem_account_resize(&cache->mem_account, bytes - cache->mem_account.bytes);
+}
+
 PageCache *cache_init(int64_t num_pages, unsigned int page_size)
 {
     int64_t i;
@@ -61,7 +80,7 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
         return NULL;
     }
 
-    cache = g_malloc(sizeof(*cache));
+    cache = g_malloc0(sizeof(*cache));
 
     /* round down to the nearest power of 2 */
     if (!is_power_of_2(num_pages)) {
@@ -72,8 +91,11 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
     cache->num_items = 0;
     cache->max_item_age = 0;
     cache->max_num_items = num_pages;
+    cache->num_ways = MIN(num_pages, PAGE_CACHE_WAYS);
+    cache->num_sets = num_pages / cache->num_ways;
 
-    DPRINTF("Setting cache buckets to %" PRId64 "\n", cache->max_num_items);
+    DPRINTF("Setting cache buckets to %" PRId64 " sets of %u ways\n",
+            cache->num_sets, cache->num_ways);
 
     cache->page_cache = g_malloc((cache->max_num_items) *
                                  sizeof(*cache->page_cache));
@@ -84,6 +106,8 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
         cache->page_cache[i].it_addr = -1;
     }
 
+    mem_account_register(&cache->mem_account, "page-cache", NULL);
+    cache_update_account(cache);
     return cache;
 }
 
@@ -100,45 +124,74 @@ void cache_fini(PageCache *cache)
 
     g_free(cache->page_cache);
     cache->page_cache = NULL;
+    mem_account_unregister(&cache->mem_account);
 }
 
-static size_t cache_get_cache_pos(const PageCache *cache,
-                                  uint64_t address)
+/* First item of the set @address maps to */
+static CacheItem *cache_get_set(const PageCache *cache, uint64_t address)
 {
-    size_t pos;
+    size_t set;
 
     g_assert(cache->max_num_items);
-    pos = (address / cache->page_size) & (cache->max_num_items - 1);
-    return pos;
+    set = (address / cache->page_size) & (cache->num_sets - 1);
+    return &cache->page_cache[set * cache->num_ways];
 }
 
-bool cache_is_cached(const PageCache *cache, uint64_t addr)
+static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
+    CacheItem *set;
+    unsigned int i;
 
     g_assert(cache);
     g_assert(cache->page_cache);
 
-    pos = cache_get_cache_pos(cache, addr);
+    set = cache_get_set(cache, addr);
+    for (i = 0; i < cache->num_ways; i++) {
+        if (set[i].it_addr == addr) {
+            return &set[i];
+        }
+    }
 
-    return (cache->page_cache[pos].it_addr == addr);
+    return NULL;
 }
 
-static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
+/* Item to store a page that is not cached yet in: a free way of the set,
+ * or else its least recently used one.
+ */
+static CacheItem *cache_get_victim(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
-
-    g_assert(cache);
-    g_assert(cache->page_cache);
+    CacheItem *set, *victim;
+    unsigned int i;
+
+    set = cache_get_set(cache, addr);
+    victim = &set[0];
+    for (i = 0; i < cache->num_ways; i++) {
+        if (!set[i].it_data) {
+            return &set[i];
+        }
+        if (set[i].it_age < victim->it_age) {
+            victim = &set[i];
+        }
+    }
 
-    pos = cache_get_cache_pos(cache, addr);
+    return victim;
+}
 
-    return &cache->page_cache[pos];
+bool cache_is_cached(const PageCache *cache, uint64_t addr)
+{
+    return cache_get_by_addr(cache, addr) != NULL;
 }
 
-uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
+uint8_t *get_cached_data(PageCache *cache, uint64_t addr)
 {
-    return cache_get_by_addr(cache, addr)->it_data;
+    CacheItem *it = cache_get_by_addr(cache, addr);
+
+    if (!it) {
+        return NULL;
+    }
+
+    it->it_age = ++cache->max_item_age;
+    return it->it_data;
 }
 
 void cache_insert(PageCache *cache, uint64_t addr, uint8_t *pdata)
@@ -151,9 +204,15 @@ void cache_insert(PageCache *cache, uint64_t addr, uint8_t *pdata)
 
     /* actual update of entry */
     it = cache_get_by_addr(cache, addr);
+    if (!it) {
+        it = cache_get_victim(cache, addr);
+    }
 
     if (!it->it_data) {
         cache->num_items++;
+        cache_update_account(cache);
+    } else if (it->it_data != pdata) {
+        g_free(it->it_data);
     }
 
     it->it_data = pdata;
@@ -189,29 +248,31 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
     /* move all data from old cache */
     for (i = 0; i < cache->max_num_items; i++) {
         old_it = &cache->page_cache[i];
-        if (old_it->it_addr != -1) {
-            /* check for collision, if there is, keep MRU page */
-            new_it = cache_get_by_addr(new_cache, old_it->it_addr);
-            if (new_it->it_data) {
-                /* keep the MRU page */
-                if (new_it->it_age >= old_it->it_age) {
-                    g_free(old_it->it_data);
-                } else {
-                    g_free(new_it->it_data);
-                    new_it->it_data = old_it->it_data;
-                    new_it->it_age = old_it->it_age;
-                    new_it->it_addr = old_it->it_addr;
-                }
-            } else {
-                cache_insert(new_cache, old_it->it_addr, old_it->it_data);
-            }
+        if (old_it->it_addr == -1) {
+            continue;
+        }
+        /* if the set is full, keep its MRU pages */
+        new_it = cache_get_victim(new_cache, old_it->it_addr);
+        if (!new_it->it_data) {
+            new_cache->num_items++;
+        } else if (new_it->it_age >= old_it->it_age) {
+            g_free(old_it->it_data);
+            continue;
+        } else {
+            g_free(new_it->it_data);
         }
+        *new_it = *old_it;
     }
 
+    g_free(cache->page_cache);
     cache->page_cache = new_cache->page_cache;
     cache->max_num_items = new_cache->max_num_items;
     cache->num_items = new_cache->num_items;
+    cache->num_ways = new_cache->num_ways;
+    cache->num_sets = new_cache->num_sets;
+    cache_update_account(cache);
 
+    mem_account_unregister(&new_cache->mem_account);
     g_free(new_cache);
 
     return cache->max_num_items;
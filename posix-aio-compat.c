@@ -22,8 +22,16 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+#ifdef CONFIG_FALLOCATE
+#include <fcntl.h>
+#include <linux/falloc.h>
+#endif
 
 #include "qemu-queue.h"
+#include "qemu-barrier.h"
 #include "osdep.h"
 #include "sysemu.h"
 #include "qemu-common.h"
@@ -35,6 +43,17 @@
 
 static void do_spawn_thread(void);
 
+/* Maximum number of adjacent requests that a worker submits as one
+ * preadv/pwritev */
+#define MAX_MERGE 32
+
+enum {
+    PAIO_QUEUED,        /* waiting for a worker */
+    PAIO_ACTIVE,        /* taken by a worker */
+    PAIO_DONE,          /* ret is valid */
+    PAIO_CANCELLED,     /* released on completion, without callback */
+};
+
 struct qemu_paiocb {
     BlockDriverAIOCB common;
     int aio_fildes;
@@ -47,21 +66,23 @@ struct qemu_paiocb {
 #define aio_ioctl_cmd   aio_nbytes /* for QEMU_AIO_IOCTL */
     off_t aio_offset;
 
-    QTAILQ_ENTRY(qemu_paiocb) node;
+    QTAILQ_ENTRY(qemu_paiocb) node;     /* in request_list */
+    struct qemu_paiocb *next;           /* in submit_stack or complete_stack */
     int aio_type;
     ssize_t ret;
-    int active;
-    struct qemu_paiocb *next;
+    int state;
 };
 
 typedef struct PosixAioState {
     int rfd, wfd;
-    struct qemu_paiocb *first_aio;
+    int inflight;       /* submitted and not completed yet */
 } PosixAioState;
 
 
 static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+/* serializes read-modify-write cycles of partially written blocks */
+static pthread_mutex_t rmw_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_t thread_id;
 static pthread_attr_t attr;
 static int max_threads = 64;
@@ -70,7 +91,18 @@ static int idle_threads = 0;
 static int new_threads = 0;     /* backlog of threads we need to create */
 static int pending_threads = 0; /* threads created but not running yet */
 static QEMUBH *new_thread_bh;
-static QTAILQ_HEAD(, qemu_paiocb) request_list;
+
+/*
+ * Requests reach the workers through submit_stack, which is lock-free so
+ * that submission does not contend with busy workers.  The workers move
+ * them, under lock, to request_list to restore submission order.  Finished
+ * requests go back to the main loop through complete_stack; only the push
+ * that finds it empty signals the completion fd, so a burst of completions
+ * costs one wakeup.
+ */
+static QTAILQ_HEAD(, qemu_paiocb) request_list;     /* protected by lock */
+static struct qemu_paiocb *submit_stack;
+static struct qemu_paiocb *complete_stack;
 
 #ifdef CONFIG_PREADV
 static int preadv_present = 1;
@@ -122,6 +154,45 @@ static void thread_create(pthread_t *thread, pthread_attr_t *attr,
     if (ret) die2(ret, "pthread_create");
 }
 
+/*
+ * Push a request on one of the lock-free stacks.  Returns true if the stack
+ * was empty.  This is a full memory barrier.
+ */
+static bool paio_push(struct qemu_paiocb **head, struct qemu_paiocb *acb)
+{
+    struct qemu_paiocb *old;
+
+    do {
+        old = *head;
+        acb->next = old;
+    } while (!__sync_bool_compare_and_swap(head, old, acb));
+
+    return old == NULL;
+}
+
+/*
+ * Empty one of the lock-free stacks and return its contents, oldest
+ * request first.  There is only one consumer for each stack at a time
+ * (workers hold lock, completions run in the main loop), so there is no
+ * ABA problem.
+ */
+static struct qemu_paiocb *paio_pop_all(struct qemu_paiocb **head)
+{
+    struct qemu_paiocb *acb, *next, *list = NULL;
+
+    do {
+        acb = *head;
+    } while (acb && !__sync_bool_compare_and_swap(head, acb, NULL));
+
+    while (acb) {
+        next = acb->next;
+        acb->next = list;
+        list = acb;
+        acb = next;
+    }
+    return list;
+}
+
 static ssize_t handle_aiocb_ioctl(struct qemu_paiocb *aiocb)
 {
     int ret;
@@ -151,6 +222,84 @@ static ssize_t handle_aiocb_flush(struct qemu_paiocb *aiocb)
     return 0;
 }
 
+/* Errors that only say the file or the kernel cannot do it */
+static ssize_t paio_unsupported_errno(void)
+{
+    switch (errno) {
+    case ENOTTY:
+    case ENOSYS:
+    case EOPNOTSUPP:
+        return -ENOTSUP;
+    default:
+        return -errno;
+    }
+}
+
+#ifdef CONFIG_FALLOCATE
+static ssize_t do_fallocate(struct qemu_paiocb *aiocb, int mode)
+{
+    if (fallocate(aiocb->aio_fildes, mode, aiocb->aio_offset,
+                  aiocb->aio_nbytes) < 0) {
+        return paio_unsupported_errno();
+    }
+    return aiocb->aio_nbytes;
+}
+#endif
+
+#ifdef __linux__
+static ssize_t do_blkdev_range_ioctl(struct qemu_paiocb *aiocb,
+                                     unsigned long req)
+{
+    uint64_t range[2] = { aiocb->aio_offset, aiocb->aio_nbytes };
+
+    if (ioctl(aiocb->aio_fildes, req, range) < 0) {
+        return paio_unsupported_errno();
+    }
+    return aiocb->aio_nbytes;
+}
+#endif
+
+/* Returns -ENOTSUP if neither the host nor the file support the request */
+static ssize_t handle_aiocb_discard(struct qemu_paiocb *aiocb)
+{
+    if (aiocb->aio_type & QEMU_AIO_BLKDEV) {
+#ifdef BLKDISCARD
+        return do_blkdev_range_ioctl(aiocb, BLKDISCARD);
+#endif
+    } else {
+#if defined(CONFIG_FALLOCATE) && defined(FALLOC_FL_PUNCH_HOLE)
+        return do_fallocate(aiocb, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE);
+#endif
+    }
+    return -ENOTSUP;
+}
+
+/*
+ * Unlike BLKDISCARD, a hole punched in a file reads back as zeroes, so
+ * files fall back to punching when they cannot zero a range in place.
+ */
+static ssize_t handle_aiocb_write_zeroes(struct qemu_paiocb *aiocb)
+{
+    ssize_t ret = -ENOTSUP;
+
+    if (aiocb->aio_type & QEMU_AIO_BLKDEV) {
+#ifdef BLKZEROOUT
+        ret = do_blkdev_range_ioctl(aiocb, BLKZEROOUT);
+#endif
+    } else {
+#if defined(CONFIG_FALLOCATE) && defined(FALLOC_FL_ZERO_RANGE)
+        ret = do_fallocate(aiocb, FALLOC_FL_ZERO_RANGE);
+        if (ret != -ENOTSUP) {
+            return ret;
+        }
+#endif
+#if defined(CONFIG_FALLOCATE) && defined(FALLOC_FL_PUNCH_HOLE)
+        ret = do_fallocate(aiocb, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE);
+#endif
+    }
+    return ret;
+}
+
 #ifdef CONFIG_PREADV
 
 static ssize_t
@@ -170,37 +319,75 @@ qemu_pwritev(int fd, const struct iovec *iov, int nr_iov, off_t offset)
 static ssize_t
 qemu_preadv(int fd, const struct iovec *iov, int nr_iov, off_t offset)
 {
-    return -ENOSYS;
+    errno = ENOSYS;
+    return -1;
 }
 
 static ssize_t
 qemu_pwritev(int fd, const struct iovec *iov, int nr_iov, off_t offset)
 {
-    return -ENOSYS;
+    errno = ENOSYS;
+    return -1;
 }
 
 #endif
 
-static ssize_t handle_aiocb_rw_vector(struct qemu_paiocb *aiocb)
+/*
+ * Read/writes nbytes from/to the given vector, which is modified.  Without
+ * preadv/pwritev the segments are transferred one at a time, and short
+ * transfers are continued where they stopped; no copy is ever made.
+ *
+ * Returns the number of bytes handled or -errno in case of an error. Short
+ * reads are only returned if the end of the file is reached.
+ */
+static ssize_t handle_aiocb_rw_vector(int fd, int type, struct iovec *iov,
+                                      int niov, off_t offset, size_t nbytes)
 {
-    ssize_t len;
+    size_t done = 0;
+    ssize_t len = 0;
 
-    do {
-        if (aiocb->aio_type & QEMU_AIO_WRITE)
-            len = qemu_pwritev(aiocb->aio_fildes,
-                               aiocb->aio_iov,
-                               aiocb->aio_niov,
-                               aiocb->aio_offset);
-         else
-            len = qemu_preadv(aiocb->aio_fildes,
-                              aiocb->aio_iov,
-                              aiocb->aio_niov,
-                              aiocb->aio_offset);
-    } while (len == -1 && errno == EINTR);
+    while (1) {
+        /* skip what the last call transferred, and empty segments */
+        while (niov && len >= iov->iov_len) {
+            len -= iov->iov_len;
+            iov++;
+            niov--;
+        }
+        if (!niov || done >= nbytes) {
+            break;
+        }
+        iov->iov_base = (char *)iov->iov_base + len;
+        iov->iov_len -= len;
 
-    if (len == -1)
-        return -errno;
-    return len;
+        if (preadv_present) {
+            if (type & QEMU_AIO_WRITE) {
+                len = qemu_pwritev(fd, iov, niov, offset + done);
+            } else {
+                len = qemu_preadv(fd, iov, niov, offset + done);
+            }
+            if (len == -1 && errno == ENOSYS) {
+                preadv_present = 0;
+                len = 0;
+                continue;
+            }
+        } else if (type & QEMU_AIO_WRITE) {
+            len = pwrite(fd, iov->iov_base, iov->iov_len, offset + done);
+        } else {
+            len = pread(fd, iov->iov_base, iov->iov_len, offset + done);
+        }
+
+        if (len == -1 && errno == EINTR) {
+            len = 0;
+            continue;
+        } else if (len == -1) {
+            return -errno;
+        } else if (len == 0) {
+            break;
+        }
+        done += len;
+    }
+
+    return done;
 }
 
 /*
@@ -209,22 +396,19 @@ static ssize_t handle_aiocb_rw_vector(struct qemu_paiocb *aiocb)
  * Returns the number of bytes handles or -errno in case of an error. Short
  * reads are only returned if the end of the file is reached.
  */
-static ssize_t handle_aiocb_rw_linear(struct qemu_paiocb *aiocb, char *buf)
+static ssize_t handle_aiocb_rw_linear(int fd, int type, char *buf,
+                                      size_t nbytes, off_t aio_offset)
 {
     ssize_t offset = 0;
     ssize_t len;
 
-    while (offset < aiocb->aio_nbytes) {
-         if (aiocb->aio_type & QEMU_AIO_WRITE)
-             len = pwrite(aiocb->aio_fildes,
-                          (const char *)buf + offset,
-                          aiocb->aio_nbytes - offset,
-                          aiocb->aio_offset + offset);
+    while (offset < nbytes) {
+         if (type & QEMU_AIO_WRITE)
+             len = pwrite(fd, (const char *)buf + offset, nbytes - offset,
+                          aio_offset + offset);
          else
-             len = pread(aiocb->aio_fildes,
-                         buf + offset,
-                         aiocb->aio_nbytes - offset,
-                         aiocb->aio_offset + offset);
+             len = pread(fd, buf + offset, nbytes - offset,
+                         aio_offset + offset);
 
          if (len == -1 && errno == EINTR)
              continue;
@@ -240,70 +424,72 @@ static ssize_t handle_aiocb_rw_linear(struct qemu_paiocb *aiocb, char *buf)
     return offset;
 }
 
-static ssize_t handle_aiocb_rw(struct qemu_paiocb *aiocb)
+/* Read one block for a read-modify-write cycle, as zeroes past EOF */
+static ssize_t paio_read_block(int fd, char *buf, size_t align, off_t offset)
 {
-    ssize_t nbytes;
+    ssize_t ret;
+
+    ret = handle_aiocb_rw_linear(fd, QEMU_AIO_READ, buf, align, offset);
+    if (ret >= 0) {
+        memset(buf + ret, 0, align - ret);
+    }
+    return ret;
+}
+
+/*
+ * The file is opened with O_DIRECT and the request does not meet its
+ * alignment requirements (QEMU_AIO_MISALIGNED), so go through a single
+ * aligned buffer that covers the request rounded out to the alignment
+ * of the file.  A write that covers only part of its first or last block
+ * reads that block first; rmw_lock keeps two such writes from updating
+ * the same block at once.
+ */
+static ssize_t handle_aiocb_rw_bounce(struct qemu_paiocb *aiocb)
+{
+    size_t align = aiocb->common.bs->buffer_alignment;
+    off_t start = QEMU_ALIGN_DOWN(aiocb->aio_offset, align);
+    off_t end = QEMU_ALIGN_UP(aiocb->aio_offset + aiocb->aio_nbytes, align);
+    size_t head = aiocb->aio_offset - start;
+    size_t len = end - start;
+    int fd = aiocb->aio_fildes;
+    bool rmw = (aiocb->aio_type & QEMU_AIO_WRITE) && len != aiocb->aio_nbytes;
+    ssize_t nbytes = 0;
     char *buf;
 
-    if (!(aiocb->aio_type & QEMU_AIO_MISALIGNED)) {
-        /*
-         * If there is just a single buffer, and it is properly aligned
-         * we can just use plain pread/pwrite without any problems.
-         */
-        if (aiocb->aio_niov == 1)
-             return handle_aiocb_rw_linear(aiocb, aiocb->aio_iov->iov_base);
-
-        /*
-         * We have more than one iovec, and all are properly aligned.
-         *
-         * Try preadv/pwritev first and fall back to linearizing the
-         * buffer if it's not supported.
-         */
-        if (preadv_present) {
-            nbytes = handle_aiocb_rw_vector(aiocb);
-            if (nbytes == aiocb->aio_nbytes)
-                return nbytes;
-            if (nbytes < 0 && nbytes != -ENOSYS)
-                return nbytes;
-            preadv_present = 0;
+    buf = qemu_blockalign(aiocb->common.bs, len);
+    if (rmw) {
+        mutex_lock(&rmw_lock);
+        if (head) {
+            nbytes = paio_read_block(fd, buf, align, start);
+        }
+        if (nbytes >= 0 && end != aiocb->aio_offset + aiocb->aio_nbytes &&
+            (len > align || !head)) {
+            nbytes = paio_read_block(fd, buf + len - align, align,
+                                     end - align);
+        }
+        if (nbytes < 0) {
+            mutex_unlock(&rmw_lock);
+            qemu_vfree(buf);
+            return nbytes;
         }
-
-        /*
-         * XXX(hch): short read/write.  no easy way to handle the reminder
-         * using these interfaces.  For now retry using plain
-         * pread/pwrite?
-         */
     }
 
-    /*
-     * Ok, we have to do it the hard way, copy all segments into
-     * a single aligned buffer.
-     */
-    buf = qemu_blockalign(aiocb->common.bs, aiocb->aio_nbytes);
     if (aiocb->aio_type & QEMU_AIO_WRITE) {
-        char *p = buf;
-        int i;
-
-        for (i = 0; i < aiocb->aio_niov; ++i) {
-            memcpy(p, aiocb->aio_iov[i].iov_base, aiocb->aio_iov[i].iov_len);
-            p += aiocb->aio_iov[i].iov_len;
-        }
+        iov_to_buf(aiocb->aio_iov, aiocb->aio_niov, 0, buf + head,
+                   aiocb->aio_nbytes);
     }
 
-    nbytes = handle_aiocb_rw_linear(aiocb, buf);
-    if (!(aiocb->aio_type & QEMU_AIO_WRITE)) {
-        char *p = buf;
-        size_t count = aiocb->aio_nbytes, copy;
-        int i;
+    nbytes = handle_aiocb_rw_linear(fd, aiocb->aio_type, buf, len, start);
+    if (rmw) {
+        mutex_unlock(&rmw_lock);
+    }
 
-        for (i = 0; i < aiocb->aio_niov && count; ++i) {
-            copy = count;
-            if (copy > aiocb->aio_iov[i].iov_len)
-                copy = aiocb->aio_iov[i].iov_len;
-            memcpy(aiocb->aio_iov[i].iov_base, p, copy);
-            p     += copy;
-            count -= copy;
-        }
+    /* count only the bytes of the request itself */
+    if (nbytes >= 0) {
+        nbytes = MIN(MAX(nbytes - (ssize_t)head, 0), aiocb->aio_nbytes);
+    }
+    if (!(aiocb->aio_type & QEMU_AIO_WRITE) && nbytes > 0) {
+        iov_from_buf(aiocb->aio_iov, aiocb->aio_niov, 0, buf + head, nbytes);
     }
     qemu_vfree(buf);
 
@@ -312,8 +498,137 @@ static ssize_t handle_aiocb_rw(struct qemu_paiocb *aiocb)
 
 static void posix_aio_notify_event(void);
 
+static void paio_complete(struct qemu_paiocb *aiocb)
+{
+    if (paio_push(&complete_stack, aiocb)) {
+        posix_aio_notify_event();
+    }
+}
+
+static void paio_done(struct qemu_paiocb *aiocb, ssize_t ret)
+{
+    if ((aiocb->aio_type & QEMU_AIO_TYPE_MASK) == QEMU_AIO_READ &&
+        ret >= 0 && ret < aiocb->aio_nbytes && aiocb->common.bs->growable) {
+        /* A short read means that we have reached EOF. Pad the buffer
+         * with zeros for bytes after EOF. */
+        iov_memset(aiocb->aio_iov, aiocb->aio_niov, ret,
+                   0, aiocb->aio_nbytes - ret);
+
+        ret = aiocb->aio_nbytes;
+    }
+
+    aiocb->ret = ret;
+    smp_wmb();
+    aiocb->state = PAIO_DONE;
+    paio_complete(aiocb);
+}
+
+static bool paio_can_merge(struct qemu_paiocb *prev, struct qemu_paiocb *aiocb,
+                           int niov)
+{
+    return (aiocb->aio_type == QEMU_AIO_READ ||
+            aiocb->aio_type == QEMU_AIO_WRITE) &&
+           aiocb->aio_type == prev->aio_type &&
+           aiocb->aio_fildes == prev->aio_fildes &&
+           aiocb->aio_offset == prev->aio_offset + prev->aio_nbytes &&
+           niov + aiocb->aio_niov <= IOV_MAX;
+}
+
+/*
+ * Take the oldest request, together with the queued requests that
+ * continue it on the same file, and mark them active.  Requests that were
+ * cancelled while queued are completed without being run.
+ *
+ * Returns the number of requests stored in batch.  Called with lock held.
+ */
+static int paio_dequeue(struct qemu_paiocb **batch)
+{
+    struct qemu_paiocb *aiocb, *next;
+    int n = 0, niov = 0;
+
+    /* order the caller's update of idle_threads or cur_threads against
+     * reading submit_stack; pairs with paio_push() in qemu_paio_submit() */
+    smp_mb();
+    for (aiocb = paio_pop_all(&submit_stack); aiocb; aiocb = next) {
+        next = aiocb->next;
+        QTAILQ_INSERT_TAIL(&request_list, aiocb, node);
+    }
+
+    while (n < MAX_MERGE && (aiocb = QTAILQ_FIRST(&request_list))) {
+        if (n && !paio_can_merge(batch[n - 1], aiocb, niov)) {
+            break;
+        }
+        QTAILQ_REMOVE(&request_list, aiocb, node);
+        if (!__sync_bool_compare_and_swap(&aiocb->state, PAIO_QUEUED,
+                                          PAIO_ACTIVE)) {
+            paio_complete(aiocb);
+            continue;
+        }
+        batch[n++] = aiocb;
+        niov += aiocb->aio_niov;
+    }
+
+    return n;
+}
+
+/*
+ * Read or write a batch of adjacent requests with a single system call,
+ * directly from/to the guest buffers.  iov is a scratch vector owned by
+ * the worker thread.
+ */
+static void handle_aiocb_rw_batch(struct qemu_paiocb **batch, int n,
+                                  struct iovec **iov, int *iov_size)
+{
+    struct qemu_paiocb *first = batch[0];
+    size_t nbytes = 0;
+    ssize_t ret;
+    int i, niov = 0;
+
+    for (i = 0; i < n; i++) {
+        niov += batch[i]->aio_niov;
+    }
+    if (niov > *iov_size) {
+        *iov = g_realloc(*iov, niov * sizeof(struct iovec));
+        *iov_size = niov;
+    }
+
+    niov = 0;
+    for (i = 0; i < n; i++) {
+        memcpy(*iov + niov, batch[i]->aio_iov,
+               batch[i]->aio_niov * sizeof(struct iovec));
+        niov += batch[i]->aio_niov;
+        nbytes += batch[i]->aio_nbytes;
+    }
+
+    ret = handle_aiocb_rw_vector(first->aio_fildes, first->aio_type, *iov,
+                                 niov, first->aio_offset, nbytes);
+
+    if (ret < 0 && n > 1) {
+        /* only fail the request that the error belongs to */
+        for (i = 0; i < n; i++) {
+            handle_aiocb_rw_batch(&batch[i], 1, iov, iov_size);
+        }
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (ret < 0) {
+            paio_done(batch[i], ret);
+        } else {
+            size_t len = MIN(ret, batch[i]->aio_nbytes);
+
+            ret -= len;
+            paio_done(batch[i], len);
+        }
+    }
+}
+
 static void *aio_thread(void *unused)
 {
+    struct qemu_paiocb *batch[MAX_MERGE];
+    struct iovec *iov = NULL;
+    int iov_size = 0;
+
     mutex_lock(&lock);
     pending_threads--;
     mutex_unlock(&lock);
@@ -324,6 +639,7 @@ static void *aio_thread(void *unused)
         ssize_t ret = 0;
         qemu_timeval tv;
         struct timespec ts;
+        int n;
 
         qemu_gettimeofday(&tv);
         ts.tv_sec = tv.tv_sec + 10;
@@ -331,57 +647,57 @@ static void *aio_thread(void *unused)
 
         mutex_lock(&lock);
 
-        while (QTAILQ_EMPTY(&request_list) &&
-               !(ret == ETIMEDOUT)) {
-            idle_threads++;
+        idle_threads++;
+        while (!(n = paio_dequeue(batch)) && !(ret == ETIMEDOUT)) {
             ret = cond_timedwait(&cond, &lock, &ts);
-            idle_threads--;
         }
-
-        if (QTAILQ_EMPTY(&request_list))
-            break;
-
-        aiocb = QTAILQ_FIRST(&request_list);
-        QTAILQ_REMOVE(&request_list, aiocb, node);
-        aiocb->active = 1;
+        idle_threads--;
+
+        if (!n) {
+            /* A submitter that still sees the old cur_threads does not
+             * spawn a replacement, but then its request is found here. */
+            cur_threads--;
+            n = paio_dequeue(batch);
+            if (!n) {
+                break;
+            }
+            cur_threads++;
+        }
         mutex_unlock(&lock);
 
+        aiocb = batch[0];
         switch (aiocb->aio_type & QEMU_AIO_TYPE_MASK) {
         case QEMU_AIO_READ:
-            ret = handle_aiocb_rw(aiocb);
-            if (ret >= 0 && ret < aiocb->aio_nbytes && aiocb->common.bs->growable) {
-                /* A short read means that we have reached EOF. Pad the buffer
-                 * with zeros for bytes after EOF. */
-                iov_memset(aiocb->aio_iov, aiocb->aio_niov, ret,
-                           0, aiocb->aio_nbytes - ret);
-
-                ret = aiocb->aio_nbytes;
-            }
-            break;
         case QEMU_AIO_WRITE:
-            ret = handle_aiocb_rw(aiocb);
-            break;
+            if (aiocb->aio_type & QEMU_AIO_MISALIGNED) {
+                ret = handle_aiocb_rw_bounce(aiocb);
+                break;
+            }
+            handle_aiocb_rw_batch(batch, n, &iov, &iov_size);
+            continue;
         case QEMU_AIO_FLUSH:
             ret = handle_aiocb_flush(aiocb);
             break;
         case QEMU_AIO_IOCTL:
             ret = handle_aiocb_ioctl(aiocb);
             break;
+        case QEMU_AIO_DISCARD:
+            ret = handle_aiocb_discard(aiocb);
+            break;
+        case QEMU_AIO_WRITE_ZEROES:
+            ret = handle_aiocb_write_zeroes(aiocb);
+            break;
         default:
             fprintf(stderr, "invalid aio request (0x%x)\n", aiocb->aio_type);
             ret = -EINVAL;
             break;
         }
 
-        mutex_lock(&lock);
-        aiocb->ret = ret;
-        mutex_unlock(&lock);
-
-        posix_aio_notify_event();
+        paio_done(aiocb, ret);
     }
 
-    cur_threads--;
     mutex_unlock(&lock);
+    g_free(iov);
 
     return NULL;
 }
@@ -431,49 +747,40 @@ static void spawn_thread(void)
     }
 }
 
+static PosixAioState *posix_aio_state;
+
 static void qemu_paio_submit(struct qemu_paiocb *aiocb)
 {
     aiocb->ret = -EINPROGRESS;
-    aiocb->active = 0;
-    mutex_lock(&lock);
-    if (idle_threads == 0 && cur_threads < max_threads)
-        spawn_thread();
-    QTAILQ_INSERT_TAIL(&request_list, aiocb, node);
-    mutex_unlock(&lock);
-    cond_signal(&cond);
-}
-
-static ssize_t qemu_paio_return(struct qemu_paiocb *aiocb)
-{
-    ssize_t ret;
-
-    mutex_lock(&lock);
-    ret = aiocb->ret;
-    mutex_unlock(&lock);
+    aiocb->state = PAIO_QUEUED;
+    posix_aio_state->inflight++;
+    paio_push(&submit_stack, aiocb);
 
-    return ret;
-}
-
-static int qemu_paio_error(struct qemu_paiocb *aiocb)
-{
-    ssize_t ret = qemu_paio_return(aiocb);
-
-    if (ret < 0)
-        ret = -ret;
-    else
-        ret = 0;
-
-    return ret;
+    /*
+     * Workers that are busy pick the request up when they are done, so lock
+     * is only needed to wake up an idle worker or to create one.  A worker
+     * going idle increments idle_threads before it looks at submit_stack,
+     * so at least one of the two sides sees the other.
+     */
+    if (idle_threads || cur_threads < max_threads) {
+        mutex_lock(&lock);
+        if (idle_threads) {
+            cond_signal(&cond);
+        } else if (cur_threads < max_threads) {
+            spawn_thread();
+        }
+        mutex_unlock(&lock);
+    }
 }
 
 static void posix_aio_read(void *opaque)
 {
     PosixAioState *s = opaque;
-    struct qemu_paiocb *acb, **pacb;
+    struct qemu_paiocb *acb, *next;
     int ret;
     ssize_t len;
 
-    /* read all bytes from signal pipe */
+    /* read all bytes from the eventfd or signal pipe */
     for (;;) {
         char bytes[16];
 
@@ -485,106 +792,65 @@ static void posix_aio_read(void *opaque)
         break;
     }
 
-    for(;;) {
-        pacb = &s->first_aio;
-        for(;;) {
-            acb = *pacb;
-            if (!acb)
-                return;
-
-            ret = qemu_paio_error(acb);
-            if (ret == ECANCELED) {
-                /* remove the request */
-                *pacb = acb->next;
-                qemu_aio_release(acb);
-            } else if (ret != EINPROGRESS) {
-                /* end of aio */
-                if (ret == 0) {
-                    ret = qemu_paio_return(acb);
-                    if (ret == acb->aio_nbytes)
-                        ret = 0;
-                    else
-                        ret = -EINVAL;
-                } else {
-                    ret = -ret;
-                }
-
-                trace_paio_complete(acb, acb->common.opaque, ret);
-
-                /* remove the request */
-                *pacb = acb->next;
-                /* call the callback */
-                acb->common.cb(acb->common.opaque, ret);
-                qemu_aio_release(acb);
-                break;
-            } else {
-                pacb = &acb->next;
-            }
+    for (acb = paio_pop_all(&complete_stack); acb; acb = next) {
+        next = acb->next;
+        s->inflight--;
+
+        /* the callback may cancel requests that are later in the list */
+        if (acb->state == PAIO_CANCELLED) {
+            qemu_aio_release(acb);
+            continue;
+        }
+
+        ret = acb->ret;
+        if (ret == acb->aio_nbytes) {
+            ret = 0;
+        } else if (ret >= 0) {
+            ret = -EINVAL;
         }
+
+        trace_paio_complete(acb, acb->common.opaque, ret);
+
+        acb->common.cb(acb->common.opaque, ret);
+        qemu_aio_release(acb);
     }
 }
 
 static int posix_aio_flush(void *opaque)
 {
     PosixAioState *s = opaque;
-    return !!s->first_aio;
+    return s->inflight > 0;
 }
 
-static PosixAioState *posix_aio_state;
-
 static void posix_aio_notify_event(void)
 {
-    char byte = 0;
+    uint64_t value = 1;
     ssize_t ret;
 
-    ret = write(posix_aio_state->wfd, &byte, sizeof(byte));
+    /* an eventfd wants a 64-bit counter increment, a pipe does not care */
+    ret = write(posix_aio_state->wfd, &value, sizeof(value));
     if (ret < 0 && errno != EAGAIN)
         die("write()");
 }
 
-static void paio_remove(struct qemu_paiocb *acb)
-{
-    struct qemu_paiocb **pacb;
-
-    /* remove the callback from the queue */
-    pacb = &posix_aio_state->first_aio;
-    for(;;) {
-        if (*pacb == NULL) {
-            fprintf(stderr, "paio_remove: aio request not found!\n");
-            break;
-        } else if (*pacb == acb) {
-            *pacb = acb->next;
-            qemu_aio_release(acb);
-            break;
-        }
-        pacb = &(*pacb)->next;
-    }
-}
-
 static void paio_cancel(BlockDriverAIOCB *blockacb)
 {
     struct qemu_paiocb *acb = (struct qemu_paiocb *)blockacb;
-    int active = 0;
 
     trace_paio_cancel(acb, acb->common.opaque);
 
-    mutex_lock(&lock);
-    if (!acb->active) {
-        QTAILQ_REMOVE(&request_list, acb, node);
-        acb->ret = -ECANCELED;
-    } else if (acb->ret == -EINPROGRESS) {
-        active = 1;
+    /* not started yet: the worker that finds it completes it right away */
+    if (__sync_bool_compare_and_swap(&acb->state, PAIO_QUEUED,
+                                     PAIO_CANCELLED)) {
+        return;
     }
-    mutex_unlock(&lock);
 
-    if (active) {
-        /* fail safe: if the aio could not be canceled, we wait for
-           it */
-        while (qemu_paio_error(acb) == EINPROGRESS)
-            ;
+    /* fail safe: if the aio could not be canceled, we wait for
+       it */
+    while (acb->state != PAIO_DONE) {
+        barrier();
     }
-
-    paio_remove(acb);
+    acb->state = PAIO_CANCELLED;
 }
 
 static AIOPool raw_aio_pool = {
@@ -609,9 +875,6 @@ BlockDriverAIOCB *paio_submit(BlockDriverState *bs, int fd,
     acb->aio_nbytes = nb_sectors * 512;
     acb->aio_offset = sector_num * 512;
 
-    acb->next = posix_aio_state->first_aio;
-    posix_aio_state->first_aio = acb;
-
     trace_paio_submit(acb, opaque, sector_num, nb_sectors, type);
     qemu_paio_submit(acb);
     return &acb->common;
@@ -630,9 +893,6 @@ BlockDriverAIOCB *paio_ioctl(BlockDriverState *bs, int fd,
     acb->aio_ioctl_buf = buf;
     acb->aio_ioctl_cmd = req;
 
-    acb->next = posix_aio_state->first_aio;
-    posix_aio_state->first_aio = acb;
-
     qemu_paio_submit(acb);
     return &acb->common;
 }
@@ -648,9 +908,9 @@ int paio_init(void)
 
     s = g_malloc(sizeof(PosixAioState));
 
-    s->first_aio = NULL;
-    if (qemu_pipe(fds) == -1) {
-        fprintf(stderr, "failed to create pipe\n");
+    s->inflight = 0;
+    if (qemu_eventfd(fds) == -1) {
+        fprintf(stderr, "failed to create eventfd\n");
         g_free(s);
         return -1;
     }
@@ -0,0 +1,188 @@
+/*
+ * JSON Output Visitor
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2.1 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "json-output-visitor.h"
+#include "qapi/qapi-visit-impl.h"
+#include "qjson.h"
+
+struct JsonOutputVisitor
+{
+    Visitor visitor;
+    QString *str;
+    /* For each open struct or list, whether it is a struct */
+    GArray *in_struct;
+    bool need_comma;
+    bool list_head;
+};
+
+static JsonOutputVisitor *to_jov(Visitor *v)
+{
+    return container_of(v, JsonOutputVisitor, visitor);
+}
+
+/* Start a value: separator, and the key if the value is a member */
+static void json_output_name(JsonOutputVisitor *jov, const char *name)
+{
+    GArray *in_struct = jov->in_struct;
+
+    if (jov->need_comma) {
+        qstring_append(jov->str, ", ");
+    }
+    if (in_struct->len &&
+        g_array_index(in_struct, bool, in_struct->len - 1)) {
+        qjson_append_str(jov->str, name);
+        qstring_append(jov->str, ": ");
+    }
+    jov->need_comma = true;
+}
+
+static void json_output_push(JsonOutputVisitor *jov, bool is_struct)
+{
+    g_array_append_val(jov->in_struct, is_struct);
+    jov->need_comma = false;
+}
+
+static void json_output_pop(JsonOutputVisitor *jov)
+{
+    assert(jov->in_struct->len);
+    g_array_set_size(jov->in_struct, jov->in_struct->len - 1);
+    jov->need_comma = true;
+}
+
+static void json_output_start_struct(Visitor *v, void **obj, const char *kind,
+                                     const char *name, size_t unused,
+                                     Error **errp)
+{
+    JsonOutputVisitor *jov = to_jov(v);
+
+    json_output_name(jov, name);
+    qstring_append(jov->str, "{");
+    json_output_push(jov, true);
+}
+
+static void json_output_end_struct(Visitor *v, Error **errp)
+{
+    JsonOutputVisitor *jov = to_jov(v);
+
+    qstring_append(jov->str, "}");
+    json_output_pop(jov);
+}
+
+static void json_output_start_list(Visitor *v, const char *name,
+                                   Error **errp)
+{
+    JsonOutputVisitor *jov = to_jov(v);
+
+    json_output_name(jov, name);
+    qstring_append(jov->str, "[");
+    json_output_push(jov, false);
+    jov->list_head = true;
+}
+
+static GenericList *json_output_next_list(Visitor *v, GenericList **listp,
+                                          Error **errp)
+{
+    GenericList *list = *listp;
+    JsonOutputVisitor *jov = to_jov(v);
+
+    /* nothing is visited between start_list and the first next_list */
+    if (jov->list_head) {
+        jov->list_head = false;
+        return list;
+    }
+
+    return list ? list->next : NULL;
+}
+
+static void json_output_end_list(Visitor *v, Error **errp)
+{
+    JsonOutputVisitor *jov = to_jov(v);
+
+    qstring_append(jov->str, "]");
+    json_output_pop(jov);
+}
+
+static void json_output_type_int(Visitor *v, int64_t *obj, const char *name,
+                                 Error **errp)
+{
+    JsonOutputVisitor *jov = to_jov(v);
+    char buffer[32];
+
+    json_output_name(jov, name);
+    snprintf(buffer, sizeof(buffer), "%" PRId64, *obj);
+    qstring_append(jov->str, buffer);
+}
+
+static void json_output_type_bool(Visitor *v, bool *obj, const char *name,
+                                  Error **errp)
+{
+    JsonOutputVisitor *jov = to_jov(v);
+
+    json_output_name(jov, name);
+    qstring_append(jov->str, *obj ? "true" : "false");
+}
+
+static void json_output_type_str(Visitor *v, char **obj, const char *name,
+                                 Error **errp)
+{
+    JsonOutputVisitor *jov = to_jov(v);
+
+    json_output_name(jov, name);
+    qjson_append_str(jov->str, *obj ? *obj : "");
+}
+
+static void json_output_type_number(Visitor *v, double *obj, const char *name,
+                                    Error **errp)
+{
+    JsonOutputVisitor *jov = to_jov(v);
+
+    json_output_name(jov, name);
+    qjson_append_number(jov->str, *obj);
+}
+
+QString *json_output_get_string(JsonOutputVisitor *jov)
+{
+    QINCREF(jov->str);
+    return jov->str;
+}
+
+Visitor *json_output_get_visitor(JsonOutputVisitor *v)
+{
+    return &v->visitor;
+}
+
+void json_output_visitor_cleanup(JsonOutputVisitor *v)
+{
+    g_array_free(v->in_struct, true);
+    QDECREF(v->str);
+    g_free(v);
+}
+
+JsonOutputVisitor *json_output_visitor_new(void)
+{
+    JsonOutputVisitor *v;
+
+    v = g_malloc0(sizeof(*v));
+
+    v->visitor.start_struct = json_output_start_struct;
+    v->visitor.end_struct = json_output_end_struct;
+    v->visitor.start_list = json_output_start_list;
+    v->visitor.next_list = json_output_next_list;
+    v->visitor.end_list = json_output_end_list;
+    v->visitor.type_enum = output_type_enum;
+    v->visitor.type_int = json_output_type_int;
+    v->visitor.type_bool = json_output_type_bool;
+    v->visitor.type_str = json_output_type_str;
+    v->visitor.type_number = json_output_type_number;
+
+    v->str = qstring_new();
+    v->in_struct = g_array_new(false, false, sizeof(bool));
+
+    return v;
+}
@@ -15,7 +15,9 @@
 #define QEMU_AIO_H
 
 #include "qemu-common.h"
+#include "qemu-queue.h"
 #include "qemu-char.h"
+#include "main-loop.h"
 
 typedef struct BlockDriverAIOCB BlockDriverAIOCB;
 typedef void BlockDriverCompletionFunc(void *opaque, int ret);
@@ -23,7 +25,6 @@ typedef void BlockDriverCompletionFunc(void *opaque, int ret);
 typedef struct AIOPool {
     void (*cancel)(BlockDriverAIOCB *acb);
     int aiocb_size;
-    BlockDriverAIOCB *free_aiocb;
 } AIOPool;
 
 struct BlockDriverAIOCB {
@@ -38,9 +39,191 @@ void *qemu_aio_get(AIOPool *pool, BlockDriverState *bs,
                    BlockDriverCompletionFunc *cb, void *opaque);
 void qemu_aio_release(void *p);
 
+typedef struct AioHandler AioHandler;
+typedef struct AioTimer AioTimer;
+typedef struct AioTimerList AioTimerList;
+typedef void AioTimerFunc(void *opaque);
+
+/* An event loop for AIO: file descriptor handlers, bottom halves and timers.
+ *
+ * The main loop has its own context, returned by qemu_get_aio_context(), and
+ * the qemu_aio_*() and qemu_bh_*() functions operate on it.  Other contexts
+ * are run by a thread of their own calling aio_poll(); only that thread may
+ * use the context, except for aio_notify() and aio_bh_schedule() which can be
+ * called from anywhere.
+ */
+typedef struct AioContext {
+    /* The list of registered AIO handlers */
+    QLIST_HEAD(, AioHandler) aio_handlers;
+
+    /* This is a simple lock used to protect the aio_handlers list.
+     * Specifically, it's used to ensure that no callbacks are removed while
+     * we're walking and dispatching callbacks.
+     */
+    int walking_handlers;
+
+    /* Anchor of the list of Bottom Halves belonging to the context */
+    struct QEMUBH *first_bh;
+
+    /* A simple lock used to protect the first_bh list, and ensure that
+     * no callbacks are removed while we're walking and dispatching callbacks.
+     */
+    int walking_bh;
+
+    /* Deleted BHs still on the first_bh list */
+    int deleted_bh;
+
+    /* Stack of scheduled BHs, pushed without locks from any thread and
+     * taken all at once by aio_bh_poll()
+     */
+    struct QEMUBH *pending_bh;
+
+    /* BHs taken from pending_bh that aio_bh_poll() has yet to run */
+    struct QEMUBH *ready_bh;
+
+    /* Active timers, one list for each clock in use */
+    QLIST_HEAD(, AioTimerList) timer_lists;
+
+    /* Eventfd (or pipe, without eventfd) used by aio_notify() to wake up
+     * a thread blocked in aio_poll(),
+     * -1 for the main loop's context, which uses qemu_notify_event().
+     */
+    int notify_fds[2];
+} AioContext;
+
 /* Returns 1 if there are still outstanding AIO requests; 0 otherwise */
 typedef int (AioFlushHandler)(void *opaque);
 
+/**
+ * aio_context_new: Allocate a new AioContext.
+ *
+ * The context starts out empty; a thread runs it by calling aio_poll().
+ */
+AioContext *aio_context_new(void);
+
+/**
+ * aio_context_free: Free an AioContext.
+ *
+ * All handlers, bottom halves and timers must have been removed.
+ */
+void aio_context_free(AioContext *ctx);
+
+/**
+ * qemu_get_aio_context: Return the main loop's AioContext.
+ */
+AioContext *qemu_get_aio_context(void);
+
+/**
+ * aio_notify: Force processing of pending events.
+ *
+ * Wakes up the thread blocked in aio_poll() on @ctx, if any, so that it
+ * notices new bottom halves, timers or handlers.  The wakeup itself does
+ * not count as progress for aio_poll()'s return value.
+ */
+void aio_notify(AioContext *ctx);
+
+/**
+ * aio_bh_new: Allocate a new bottom half structure that runs in @ctx.
+ *
+ * Like qemu_bh_new(), which is the same as aio_bh_new() on the main loop's
+ * context.  Must be called from the thread that runs @ctx.
+ */
+QEMUBH *aio_bh_new(AioContext *ctx, QEMUBHFunc *cb, void *opaque);
+
+/**
+ * aio_bh_poll: Run the bottom halves that are scheduled in @ctx.
+ *
+ * Returns 1 if a bottom half that was not idle ran.
+ */
+int aio_bh_poll(AioContext *ctx);
+
+/* Returns whether a bottom half is scheduled in @ctx */
+bool aio_bh_pending(AioContext *ctx);
+
+/**
+ * aio_bh_update_timeout: Reduce *@timeout, in milliseconds, so that the
+ * scheduled bottom halves and the timers of @ctx run in time.
+ */
+void aio_bh_update_timeout(AioContext *ctx, uint32_t *timeout);
+
+/**
+ * aio_timer_new: Allocate a timer that fires from aio_poll() on @ctx.
+ *
+ * Expiry times are in nanoseconds of the host's monotonic clock, as returned
+ * by get_clock().  Timers are run by aio_poll(); on the main loop's context
+ * the main loop runs them too.
+ */
+AioTimer *aio_timer_new(AioContext *ctx, AioTimerFunc *cb, void *opaque);
+
+/**
+ * aio_timer_new_clock: Like aio_timer_new(), with expiry times in
+ * nanoseconds of @clock, e.g. vm_clock.
+ *
+ * The timer does not fire while @clock is disabled.  This lets a thread
+ * running @ctx use guest time without going through the main loop and
+ * the global mutex; vm_clock cannot be read outside the vCPU thread with
+ * -icount, though.  The first timer of @ctx on @clock must be created
+ * with the global mutex held.
+ */
+AioTimer *aio_timer_new_clock(AioContext *ctx, QEMUClock *clock,
+                              AioTimerFunc *cb, void *opaque);
+void aio_timer_free(AioTimer *ts);
+void aio_timer_mod(AioTimer *ts, int64_t expire_time);
+void aio_timer_del(AioTimer *ts);
+bool aio_timer_pending(AioTimer *ts);
+
+/**
+ * aio_timers_run: Run the timers of @ctx that have expired.
+ *
+ * Returns true if any timer ran.
+ */
+bool aio_timers_run(AioContext *ctx);
+
+/* Returns the nanoseconds until the first timer of @ctx expires, 0 if one
+ * already has, or -1 if no timer is active on an enabled clock.
+ */
+int64_t aio_timers_deadline(AioContext *ctx);
+
+/**
+ * aio_pending: Return whether there is work for aio_poll() on @ctx:
+ * scheduled bottom halves or outstanding AIO requests.
+ */
+bool aio_pending(AioContext *ctx);
+
+/**
+ * aio_poll: Progress in completing AIO work on @ctx.
+ *
+ * Runs the scheduled bottom halves and expired timers, then the handlers
+ * of ready file descriptors.  This can issue new pending aio as result of
+ * executing I/O completion or bh callbacks.
+ *
+ * If @blocking is true, waits for something to happen first.  It does not
+ * wait on the main loop's context if no AIO request is outstanding and no
+ * timer is active; other contexts always wait, until aio_notify() at the
+ * latest.
+ *
+ * Returns whether any progress was made or AIO requests are outstanding.
+ */
+bool aio_poll(AioContext *ctx, bool blocking);
+
+/**
+ * aio_flush: Wait until all outstanding AIO requests of @ctx have completed
+ * and there are no scheduled bottom halves left.
+ */
+void aio_flush(AioContext *ctx);
+
+/**
+ * aio_set_fd_handler: Register a file descriptor and its callbacks in @ctx.
+ *
+ * See qemu_aio_set_fd_handler().  Passing NULL for both @io_read and
+ * @io_write removes the handler.
+ */
+void aio_set_fd_handler(AioContext *ctx, int fd,
+                        IOHandler *io_read,
+                        IOHandler *io_write,
+                        AioFlushHandler *io_flush,
+                        void *opaque);
+
 /* Flush any pending AIO operation. This function will block until all
  * outstanding AIO operations have been completed or cancelled. */
 void qemu_aio_flush(void);
@@ -54,6 +54,7 @@
 #include <dirent.h>
 #include <netdb.h>
 #include <sys/select.h>
+#include <poll.h>
 #ifdef CONFIG_BSD
 #include <sys/stat.h>
 #if defined(__GLIBC__)
@@ -99,6 +100,8 @@
 #include "ui/qemu-spice.h"
 
 #define READ_BUF_LEN 4096
+/* fd and socket backends read that much at once if the front end takes it */
+#define READ_BATCH_LEN 65536
 
 /***********************************************************/
 /* character device */
@@ -144,6 +147,61 @@ int qemu_chr_fe_write(CharDriverState *s, const uint8_t *buf, int len)
     return s->chr_write(s, buf, len);
 }
 
+int qemu_chr_fe_write_nonblock(CharDriverState *s, const uint8_t *buf,
+                               int len)
+{
+    if (!s->chr_write_nonblock) {
+        return s->chr_write(s, buf, len);
+    }
+    return s->chr_write_nonblock(s, buf, len);
+}
+
+int qemu_chr_fe_writev_nonblock(CharDriverState *s, const struct iovec *iov,
+                                int iovcnt)
+{
+    int i, ret, done = 0;
+
+    if (s->chr_writev_nonblock) {
+        return s->chr_writev_nonblock(s, iov, iovcnt);
+    }
+    for (i = 0; i < iovcnt; i++) {
+        ret = qemu_chr_fe_write_nonblock(s, iov[i].iov_base, iov[i].iov_len);
+        if (ret < 0) {
+            return done ? done : ret;
+        }
+        done += ret;
+        if (ret < iov[i].iov_len) {
+            break;
+        }
+    }
+    return done;
+}
+
+int qemu_chr_fe_notify_writable(CharDriverState *s, IOHandler *cb,
+                                void *opaque)
+{
+    if (!s->chr_update_write_handler) {
+        return -ENOTSUP;
+    }
+    s->chr_writable = cb;
+    s->writable_opaque = opaque;
+    s->chr_update_write_handler(s);
+    return 0;
+}
+
+/* Called by backends when the front end may write again */
+static void qemu_chr_be_writable(void *opaque)
+{
+    CharDriverState *s = opaque;
+    IOHandler *cb = s->chr_writable;
+
+    s->chr_writable = NULL;
+    s->chr_update_write_handler(s);
+    if (cb) {
+        cb(s->writable_opaque);
+    }
+}
+
 int qemu_chr_fe_ioctl(CharDriverState *s, int cmd, void *arg)
 {
     if (!s->chr_ioctl)
@@ -537,6 +595,57 @@ int send_all(int fd, const void *_buf, int len1)
     }
     return len1 - len;
 }
+
+/*
+ * Write what @fd takes without blocking, even if it is in blocking mode:
+ * a pipe that polls writable has room for PIPE_BUF bytes.  Returns 0 if
+ * @fd is full.
+ */
+static int write_nonblock(int fd, const uint8_t *buf, int len)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+    int ret;
+
+    ret = poll(&pfd, 1, 0);
+    if (ret <= 0) {
+        return ret < 0 && errno != EINTR ? -1 : 0;
+    }
+    if (pfd.revents & (POLLERR | POLLNVAL)) {
+        return -1;
+    }
+    ret = write(fd, buf, MIN(len, PIPE_BUF));
+    if (ret < 0 && (errno == EINTR || errno == EAGAIN)) {
+        return 0;
+    }
+    return ret;
+}
+
+/* Like write_nonblock(), gathering up to PIPE_BUF bytes from @iov */
+static int writev_nonblock(int fd, const struct iovec *iov, int iovcnt)
+{
+    struct iovec v[IOV_MAX];
+    struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+    size_t room = PIPE_BUF;
+    int i, ret;
+
+    ret = poll(&pfd, 1, 0);
+    if (ret <= 0) {
+        return ret < 0 && errno != EINTR ? -1 : 0;
+    }
+    if (pfd.revents & (POLLERR | POLLNVAL)) {
+        return -1;
+    }
+    for (i = 0; i < iovcnt && i < IOV_MAX && room; i++) {
+        v[i].iov_base = iov[i].iov_base;
+        v[i].iov_len = MIN(iov[i].iov_len, room);
+        room -= v[i].iov_len;
+    }
+    ret = writev(fd, v, i);
+    if (ret < 0 && (errno == EINTR || errno == EAGAIN)) {
+        return 0;
+    }
+    return ret;
+}
 #endif /* !_WIN32 */
 
 #define STDIO_MAX_CLIENTS 1
@@ -556,6 +665,20 @@ static int fd_chr_write(CharDriverState *chr, const uint8_t *buf, int len)
     return send_all(s->fd_out, buf, len);
 }
 
+static int fd_chr_write_nonblock(CharDriverState *chr, const uint8_t *buf,
+                                 int len)
+{
+    FDCharDriver *s = chr->opaque;
+    return write_nonblock(s->fd_out, buf, len);
+}
+
+static int fd_chr_writev_nonblock(CharDriverState *chr,
+                                  const struct iovec *iov, int iovcnt)
+{
+    FDCharDriver *s = chr->opaque;
+    return writev_nonblock(s->fd_out, iov, iovcnt);
+}
+
 static int fd_chr_read_poll(void *opaque)
 {
     CharDriverState *chr = opaque;
@@ -570,7 +693,7 @@ static void fd_chr_read(void *opaque)
     CharDriverState *chr = opaque;
     FDCharDriver *s = chr->opaque;
     int size, len;
-    uint8_t buf[READ_BUF_LEN];
+    uint8_t buf[READ_BATCH_LEN];
 
     len = sizeof(buf);
     if (len > s->max_size)
@@ -592,16 +715,34 @@ static void fd_chr_read(void *opaque)
 static void fd_chr_update_read_handler(CharDriverState *chr)
 {
     FDCharDriver *s = chr->opaque;
+    IOHandler *fd_write = NULL;
 
+    /* one descriptor both ways, e.g. a tty, has a single handler */
+    if (s->fd_in == s->fd_out && chr->chr_writable) {
+        fd_write = qemu_chr_be_writable;
+    }
     if (s->fd_in >= 0) {
         if (display_type == DT_NOGRAPHIC && s->fd_in == 0) {
         } else {
             qemu_set_fd_handler2(s->fd_in, fd_chr_read_poll,
-                                 fd_chr_read, NULL, chr);
+                                 fd_chr_read, fd_write, chr);
         }
     }
 }
 
+static void fd_chr_update_write_handler(CharDriverState *chr)
+{
+    FDCharDriver *s = chr->opaque;
+
+    if (s->fd_in == s->fd_out) {
+        fd_chr_update_read_handler(chr);
+    } else {
+        qemu_set_fd_handler2(s->fd_out, NULL, NULL,
+                             chr->chr_writable ? qemu_chr_be_writable : NULL,
+                             chr);
+    }
+}
+
 static void fd_chr_close(struct CharDriverState *chr)
 {
     FDCharDriver *s = chr->opaque;
@@ -612,6 +753,9 @@ static void fd_chr_close(struct CharDriverState *chr)
             qemu_set_fd_handler2(s->fd_in, NULL, NULL, NULL, NULL);
         }
     }
+    if (chr->chr_writable && s->fd_out != s->fd_in) {
+        qemu_set_fd_handler2(s->fd_out, NULL, NULL, NULL, NULL);
+    }
 
     g_free(s);
     qemu_chr_be_event(chr, CHR_EVENT_CLOSED);
@@ -629,7 +773,10 @@ static CharDriverState *qemu_chr_open_fd(int fd_in, int fd_out)
     s->fd_out = fd_out;
     chr->opaque = s;
     chr->chr_write = fd_chr_write;
+    chr->chr_write_nonblock = fd_chr_write_nonblock;
+    chr->chr_writev_nonblock = fd_chr_writev_nonblock;
     chr->chr_update_read_handler = fd_chr_update_read_handler;
+    chr->chr_update_write_handler = fd_chr_update_write_handler;
     chr->chr_close = fd_chr_close;
 
     qemu_chr_generic_open(chr);
@@ -2142,6 +2289,7 @@ typedef struct {
 static void tcp_chr_accept(void *opaque);
 
 static void tcp_chr_connect(void *opaque);
+static void tcp_chr_read(void *opaque);
 
 static int tcp_chr_write(CharDriverState *chr, const uint8_t *buf, int len)
 {
@@ -2155,6 +2303,52 @@ static int tcp_chr_write(CharDriverState *chr, const uint8_t *buf, int len)
     }
 }
 
+static int tcp_chr_write_nonblock(CharDriverState *chr, const uint8_t *buf,
+                                  int len)
+{
+    TCPCharDriver *s = chr->opaque;
+    int ret;
+
+    if (!s->connected) {
+        tcp_chr_connect(chr);
+        return 0;
+    }
+    /* the socket is non-blocking */
+    ret = send(s->fd, (const void *)buf, len, 0);
+    if (ret < 0) {
+        int err = socket_error();
+#ifdef _WIN32
+        if (err == WSAEWOULDBLOCK) {
+            return 0;
+        }
+#else
+        if (err == EINTR || err == EAGAIN) {
+            return 0;
+        }
+#endif
+    }
+    return ret;
+}
+
+#ifndef _WIN32
+static int tcp_chr_writev_nonblock(CharDriverState *chr,
+                                   const struct iovec *iov, int iovcnt)
+{
+    TCPCharDriver *s = chr->opaque;
+    int ret;
+
+    if (!s->connected) {
+        tcp_chr_connect(chr);
+        return 0;
+    }
+    ret = writev(s->fd, iov, MIN(iovcnt, IOV_MAX));
+    if (ret < 0 && (errno == EINTR || errno == EAGAIN)) {
+        return 0;
+    }
+    return ret;
+}
+#endif
+
 static int tcp_chr_read_poll(void *opaque)
 {
     CharDriverState *chr = opaque;
@@ -2165,6 +2359,18 @@ static int tcp_chr_read_poll(void *opaque)
     return s->max_size;
 }
 
+static void tcp_chr_update_write_handler(CharDriverState *chr)
+{
+    TCPCharDriver *s = chr->opaque;
+
+    /* until a client connects, tcp_chr_connect() does this */
+    if (!s->connected) {
+        return;
+    }
+    qemu_set_fd_handler2(s->fd, tcp_chr_read_poll, tcp_chr_read,
+                         chr->chr_writable ? qemu_chr_be_writable : NULL, chr);
+}
+
 #define IAC 255
 #define IAC_BREAK 243
 static void tcp_chr_process_IAC_bytes(CharDriverState *chr,
@@ -2292,7 +2498,7 @@ static void tcp_chr_read(void *opaque)
 {
     CharDriverState *chr = opaque;
     TCPCharDriver *s = chr->opaque;
-    uint8_t buf[READ_BUF_LEN];
+    uint8_t buf[READ_BATCH_LEN];
     int len, size;
 
     if (!s->connected || s->max_size <= 0)
@@ -2332,8 +2538,7 @@ static void tcp_chr_connect(void *opaque)
     TCPCharDriver *s = chr->opaque;
 
     s->connected = 1;
-    qemu_set_fd_handler2(s->fd, tcp_chr_read_poll,
-                         tcp_chr_read, NULL, chr);
+    tcp_chr_update_write_handler(chr);
     qemu_chr_generic_open(chr);
 }
 
@@ -2352,12 +2557,6 @@ static void tcp_chr_telnet_init(int fd)
     send(fd, (char *)buf, 3, 0);
 }
 
-static void socket_set_nodelay(int fd)
-{
-    int val = 1;
-    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char *)&val, sizeof(val));
-}
-
 static int tcp_chr_add_client(CharDriverState *chr, int fd)
 {
     TCPCharDriver *s = chr->opaque;
@@ -2476,6 +2675,11 @@ static CharDriverState *qemu_chr_open_socket(QemuOpts *opts)
 
     chr->opaque = s;
     chr->chr_write = tcp_chr_write;
+    chr->chr_write_nonblock = tcp_chr_write_nonblock;
+#ifndef _WIN32
+    chr->chr_writev_nonblock = tcp_chr_writev_nonblock;
+#endif
+    chr->chr_update_write_handler = tcp_chr_update_write_handler;
     chr->chr_close = tcp_chr_close;
     chr->get_msgfd = tcp_get_msgfd;
     chr->chr_add_client = tcp_chr_add_client;
@@ -55,7 +55,12 @@ typedef void IOEventHandler(void *opaque, int event);
 struct CharDriverState {
     void (*init)(struct CharDriverState *s);
     int (*chr_write)(struct CharDriverState *s, const uint8_t *buf, int len);
+    int (*chr_write_nonblock)(struct CharDriverState *s, const uint8_t *buf,
+                              int len);
+    int (*chr_writev_nonblock)(struct CharDriverState *s,
+                               const struct iovec *iov, int iovcnt);
     void (*chr_update_read_handler)(struct CharDriverState *s);
+    void (*chr_update_write_handler)(struct CharDriverState *s);
     int (*chr_ioctl)(struct CharDriverState *s, int cmd, void *arg);
     int (*get_msgfd)(struct CharDriverState *s);
     int (*chr_add_client)(struct CharDriverState *chr, int fd);
@@ -63,6 +68,8 @@ struct CharDriverState {
     IOCanReadHandler *chr_can_read;
     IOReadHandler *chr_read;
     void *handler_opaque;
+    IOHandler *chr_writable;
+    void *writable_opaque;
     void (*chr_close)(struct CharDriverState *chr);
     void (*chr_accept_input)(struct CharDriverState *chr);
     void (*chr_set_echo)(struct CharDriverState *chr, bool echo);
@@ -162,6 +169,44 @@ void qemu_chr_fe_printf(CharDriverState *s, const char *fmt, ...)
  */
 int qemu_chr_fe_write(CharDriverState *s, const uint8_t *buf, int len);
 
+/**
+ * @qemu_chr_fe_write_nonblock:
+ *
+ * Write data to a character backend without waiting for it to drain.
+ * Backends that cannot do this write like qemu_chr_fe_write().
+ *
+ * @buf the data
+ * @len the number of bytes to send
+ *
+ * Returns: the number of bytes consumed, which can be less than @len and
+ *          0 if the backend is full, or -1 on error
+ */
+int qemu_chr_fe_write_nonblock(CharDriverState *s, const uint8_t *buf,
+                               int len);
+
+/**
+ * @qemu_chr_fe_writev_nonblock:
+ *
+ * Like qemu_chr_fe_write_nonblock(), for the data of @iovcnt buffers.
+ * Backends that support it send them with a single system call.
+ *
+ * Returns: the number of bytes consumed, or -1 on error
+ */
+int qemu_chr_fe_writev_nonblock(CharDriverState *s, const struct iovec *iov,
+                                int iovcnt);
+
+/**
+ * @qemu_chr_fe_notify_writable:
+ *
+ * Ask the backend to call @cb once it can take more data, after a short
+ * qemu_chr_fe_write_nonblock().  @cb is called only once; passing NULL
+ * cancels the notification.
+ *
+ * Returns: 0, or -ENOTSUP if the backend cannot tell
+ */
+int qemu_chr_fe_notify_writable(CharDriverState *s, IOHandler *cb,
+                                void *opaque);
+
 /**
  * @qemu_chr_fe_ioctl:
  *
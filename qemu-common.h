@@ -13,6 +13,7 @@
 #define TFR(expr) do { if ((expr) != -1) break; } while (errno == EINTR)
 
 typedef struct QEMUTimer QEMUTimer;
+typedef struct QEMUClock QEMUClock;
 typedef struct QEMUFile QEMUFile;
 typedef struct DeviceState DeviceState;
 
@@ -117,6 +118,9 @@ static inline char *realpath(const char *path, char *resolved_path)
 void configure_icount(const char *option);
 extern int use_icount;
 
+/* multi-threaded TCG */
+extern int mttcg_enabled;
+
 /* FIXME: Remove NEED_CPU_H.  */
 #ifndef NEED_CPU_H
 
@@ -303,6 +307,9 @@ typedef struct PCIHostDeviceAddress {
 
 void tcg_exec_init(unsigned long tb_size);
 bool tcg_enabled(void);
+void tb_perf_map_open(void);
+void tcg_sample_start(int rate);
+void tcg_stats_enable(void);
 
 void cpu_exec_init_all(void);
 
@@ -315,12 +322,30 @@ void qemu_cpu_kick(void *env);
 void qemu_cpu_kick_self(void);
 int qemu_cpu_is_self(void *env);
 
+/* With multi-threaded TCG, vCPU threads run guest code without the
+   iothread lock.  qemu_tcg_io_lock() takes it if the calling thread is
+   such a vCPU thread, and returns whether qemu_tcg_io_unlock() has to
+   drop it again.  */
+bool qemu_tcg_io_lock(void);
+void qemu_tcg_io_unlock(bool locked);
+void qemu_tcg_io_lock_reset(void);
+/* stop the vCPU threads that run guest code without the iothread lock;
+   they may still be in the middle of a TB */
+void qemu_tcg_start_exclusive(void);
+void qemu_tcg_end_exclusive(void);
+/* let exclusive sections run while the calling vCPU thread blocks */
+void qemu_tcg_exec_pause(void);
+void qemu_tcg_exec_resume(void);
+/* tb_flush() once no vCPU thread is inside cpu_exec() */
+void qemu_tcg_flush_request(void);
+
 /* work queue */
 struct qemu_work_item {
     struct qemu_work_item *next;
     void (*func)(void *data);
     void *data;
     int done;
+    bool free;
 };
 
 #ifdef CONFIG_USER_ONLY
@@ -110,10 +110,59 @@ static QemuOptsList qemu_drive_opts = {
             .name = "bps_wr",
             .type = QEMU_OPT_NUMBER,
             .help = "limit write bytes per second",
+        },{
+            .name = "bps_max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "total bytes burst",
+        },{
+            .name = "bps_rd_max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "read bytes burst",
+        },{
+            .name = "bps_wr_max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "write bytes burst",
+        },{
+            .name = "iops_max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "total operations burst",
+        },{
+            .name = "iops_rd_max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "read operations burst",
+        },{
+            .name = "iops_wr_max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "write operations burst",
+        },{
+            .name = "iops_size",
+            .type = QEMU_OPT_NUMBER,
+            .help = "when limiting by iops max size of an I/O in bytes",
+        },{
+            .name = "group",
+            .type = QEMU_OPT_STRING,
+            .help = "name of the throttle group sharing the limits",
         },{
             .name = "copy-on-read",
             .type = QEMU_OPT_BOOL,
             .help = "copy read data from backing file into image file",
+        },{
+            .name = "lazy-refcounts",
+            .type = QEMU_OPT_BOOL,
+            .help = "postpone refcount updates of the image format",
+        },{
+            .name = "l2-cache-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "size of the L2 table cache of the image format",
+        },{
+            .name = "refcount-cache-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "size of the refcount block cache of the image format",
+        },{
+            .name = "backing-cache",
+            .type = QEMU_OPT_SIZE,
+            .help = "size of the read cache of the backing files shared "
+                    "with other processes",
         },
         { /* end of list */ }
     },
@@ -235,6 +284,9 @@ QemuOptsList qemu_fsdev_opts = {
         }, {
             .name = "writeout",
             .type = QEMU_OPT_STRING,
+        }, {
+            .name = "cache",
+            .type = QEMU_OPT_STRING,
         }, {
             .name = "readonly",
             .type = QEMU_OPT_BOOL,
@@ -271,6 +323,9 @@ QemuOptsList qemu_virtfs_opts = {
         }, {
             .name = "writeout",
             .type = QEMU_OPT_STRING,
+        }, {
+            .name = "cache",
+            .type = QEMU_OPT_STRING,
         }, {
             .name = "readonly",
             .type = QEMU_OPT_BOOL,
@@ -397,6 +452,22 @@ static QemuOptsList qemu_mon_opts = {
     },
 };
 
+static QemuOptsList qemu_event_throttle_opts = {
+    .name = "event-throttle",
+    .implied_opt_name = "event",
+    .head = QTAILQ_HEAD_INITIALIZER(qemu_event_throttle_opts.head),
+    .desc = {
+        {
+            .name = "event",
+            .type = QEMU_OPT_STRING,
+        },{
+            .name = "rate",
+            .type = QEMU_OPT_NUMBER,
+        },
+        { /* end of list */ }
+    },
+};
+
 static QemuOptsList qemu_trace_opts = {
     .name = "trace",
     .implied_opt_name = "trace",
@@ -408,6 +479,9 @@ static QemuOptsList qemu_trace_opts = {
         },{
             .name = "file",
             .type = QEMU_OPT_STRING,
+        },{
+            .name = "flight-recorder",
+            .type = QEMU_OPT_NUMBER,
         },
         { /* end of list */ }
     },
@@ -612,6 +686,26 @@ static QemuOptsList qemu_machine_opts = {
             .name = "dump-guest-core",
             .type = QEMU_OPT_BOOL,
             .help = "Include guest memory in  a core dump",
+        }, {
+            .name = "mem-merge",
+            .type = QEMU_OPT_BOOL,
+            .help = "enable/disable memory merge support",
+        }, {
+            .name = "tcg-threads",
+            .type = QEMU_OPT_STRING,
+            .help = "TCG vCPU threads (single or multi)",
+        }, {
+            .name = "prealloc-threads",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of threads used by -mem-prealloc",
+        }, {
+            .name = "xen-mapcache-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "Xen map cache size",
+        }, {
+            .name = "map-images",
+            .type = QEMU_OPT_BOOL,
+            .help = "Map kernel and firmware images into guest RAM",
         },
         { /* End of list */ }
     },
@@ -652,6 +746,7 @@ static QemuOptsList *vm_config_groups[32] = {
     &qemu_rtc_opts,
     &qemu_global_opts,
     &qemu_mon_opts,
+    &qemu_event_throttle_opts,
     &qemu_cpudef_opts,
     &qemu_trace_opts,
     &qemu_option_rom_opts,
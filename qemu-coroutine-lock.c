@@ -102,9 +102,27 @@ void qemu_co_mutex_init(CoMutex *mutex)
     qemu_co_queue_init(&mutex->queue);
 }
 
+void qemu_co_mutex_set_name(CoMutex *mutex, const char *name)
+{
+    qemu_co_mutex_destroy(mutex);
+    mutex->stats = g_malloc0(sizeof(*mutex->stats));
+    lock_stats_register(mutex->stats, name);
+}
+
+void qemu_co_mutex_destroy(CoMutex *mutex)
+{
+    if (mutex->stats) {
+        lock_stats_unregister(mutex->stats);
+        g_free(mutex->stats);
+        mutex->stats = NULL;
+    }
+}
+
 void coroutine_fn qemu_co_mutex_lock(CoMutex *mutex)
 {
     Coroutine *self = qemu_coroutine_self();
+    int64_t start = mutex->stats ? lock_stats_start() : 0;
+    bool contended = mutex->locked;
 
     trace_qemu_co_mutex_lock_entry(mutex, self);
 
@@ -113,6 +131,10 @@ void coroutine_fn qemu_co_mutex_lock(CoMutex *mutex)
     }
 
     mutex->locked = true;
+    if (unlikely(start)) {
+        mutex->locked_at = lock_stats_acquired(mutex->stats, start, contended,
+                                               __builtin_return_address(0));
+    }
 
     trace_qemu_co_mutex_lock_return(mutex, self);
 }
@@ -126,6 +148,10 @@ void coroutine_fn qemu_co_mutex_unlock(CoMutex *mutex)
     assert(mutex->locked == true);
     assert(qemu_in_coroutine());
 
+    if (unlikely(mutex->locked_at)) {
+        lock_stats_released(mutex->stats, mutex->locked_at);
+        mutex->locked_at = 0;
+    }
     mutex->locked = false;
     qemu_co_queue_next(&mutex->queue);
 
@@ -18,6 +18,7 @@
 #include <stdbool.h>
 #include "qemu-queue.h"
 #include "qemu-timer.h"
+#include "qemu-lockstat.h"
 
 /**
  * Coroutines are a mechanism for stack switching and can be used for
@@ -95,6 +96,23 @@ Coroutine *coroutine_fn qemu_coroutine_self(void);
  */
 bool qemu_in_coroutine(void);
 
+/**
+ * Statistics of the pool of terminated coroutines
+ *
+ * qemu_coroutine_create() takes a coroutine from the pool if there is one,
+ * which counts as a hit, and creates a new one otherwise, which counts as a
+ * miss.  Terminated coroutines go back to the pool until it holds max_size
+ * of them; max_size is 0 if the coroutine backend does not support reuse.
+ */
+typedef struct CoroutinePoolStats {
+    unsigned int size;
+    unsigned int max_size;
+    uint64_t hits;
+    uint64_t misses;
+} CoroutinePoolStats;
+
+void qemu_coroutine_get_pool_stats(CoroutinePoolStats *stats);
+
 
 
 /**
@@ -148,6 +166,8 @@ bool qemu_co_queue_empty(CoQueue *queue);
 typedef struct CoMutex {
     bool locked;
     CoQueue queue;
+    QemuLockStats *stats;       /* NULL unless named */
+    int64_t locked_at;          /* for hold times, 0 if not recorded */
 } CoMutex;
 
 /**
@@ -156,6 +176,18 @@ typedef struct CoMutex {
  */
 void qemu_co_mutex_init(CoMutex *mutex);
 
+/**
+ * Gives the mutex a name under which its contention is reported by
+ * query-lock-stats.  Unnamed mutexes are not counted.
+ */
+void qemu_co_mutex_set_name(CoMutex *mutex, const char *name);
+
+/**
+ * Unregisters the statistics of a named mutex.  This must be called before
+ * a named mutex is freed.
+ */
+void qemu_co_mutex_destroy(CoMutex *mutex);
+
 /**
  * Locks the mutex. If the lock cannot be taken immediately, control is
  * transferred to the caller of the current coroutine.
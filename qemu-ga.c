@@ -496,7 +496,7 @@ static void process_command(GAState *s, QDict *req)
 }
 
 /* handle requests/control events coming in over the channel */
-static void process_event(JSONMessageParser *parser, QList *tokens)
+static void process_event(JSONMessageParser *parser, GPtrArray *tokens)
 {
     GAState *s = container_of(parser, GAState, parser);
     QObject *obj;
@@ -28,9 +28,9 @@ STEXI
 ETEXI
 
 DEF("convert", img_convert,
-    "convert [-c] [-p] [-f fmt] [-t cache] [-O output_fmt] [-o options] [-s snapshot_name] [-S sparse_size] filename [filename2 [...]] output_filename")
+    "convert [-c] [-p] [-f fmt] [-t cache] [-O output_fmt] [-o options] [-s snapshot_name] [-S sparse_size] [-m num_coroutines] [-W] filename [filename2 [...]] output_filename")
 STEXI
-@item convert [-c] [-p] [-f @var{fmt}] [-t @var{cache}] [-O @var{output_fmt}] [-o @var{options}] [-s @var{snapshot_name}] [-S @var{sparse_size}] @var{filename} [@var{filename2} [...]] @var{output_filename}
+@item convert [-c] [-p] [-f @var{fmt}] [-t @var{cache}] [-O @var{output_fmt}] [-o @var{options}] [-s @var{snapshot_name}] [-S @var{sparse_size}] [-m @var{num_coroutines}] [-W] @var{filename} [@var{filename2} [...]] @var{output_filename}
 ETEXI
 
 DEF("info", img_info,
@@ -39,6 +39,12 @@ STEXI
 @item info [-f @var{fmt}] @var{filename}
 ETEXI
 
+DEF("map", img_map,
+    "map [-f fmt] filename")
+STEXI
+@item map [-f @var{fmt}] @var{filename}
+ETEXI
+
 DEF("snapshot", img_snapshot,
     "snapshot [-l | -a snapshot | -c snapshot | -d snapshot] filename")
 STEXI
@@ -55,5 +61,11 @@ DEF("resize", img_resize,
     "resize filename [+ | -]size")
 STEXI
 @item resize @var{filename} [+ | -]@var{size}
+ETEXI
+
+DEF("bench", img_bench,
+    "bench [-f fmt] [-t cache] [-P pattern] [-s buf_size] [-d depth] [-w write_percent] [-T seconds] [-F flush_interval] filename")
+STEXI
+@item bench [-f @var{fmt}] [-t @var{cache}] [-P @var{pattern}] [-s @var{buf_size}] [-d @var{depth}] [-w @var{write_percent}] [-T @var{seconds}] [-F @var{flush_interval}] @var{filename}
 @end table
 ETEXI
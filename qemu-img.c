@@ -27,6 +27,8 @@
 #include "osdep.h"
 #include "sysemu.h"
 #include "block_int.h"
+#include "qemu-timer.h"
+#include "host-utils.h"
 #include <stdio.h>
 
 #ifdef _WIN32
@@ -84,6 +86,8 @@ static void help(void)
            "  '-p' show progress of command (only certain commands)\n"
            "  '-S' indicates the consecutive number of bytes that must contain only zeros\n"
            "       for qemu-img to create a sparse image during conversion\n"
+           "  '-m' number of parallel coroutines for the conversion (1 to 16, default 1)\n"
+           "  '-W' allow to write to the output image out of order rather than sequentially\n"
            "\n"
            "Parameters to check subcommand:\n"
            "  '-r' tries to repair any inconsistencies that are found during the check.\n"
@@ -96,7 +100,15 @@ static void help(void)
            "  '-a' applies a snapshot (revert disk to saved state)\n"
            "  '-c' creates a snapshot\n"
            "  '-d' deletes a snapshot\n"
-           "  '-l' lists all snapshots in the given image\n";
+           "  '-l' lists all snapshots in the given image\n"
+           "\n"
+           "Parameters to bench subcommand:\n"
+           "  '-P' is the access pattern, 'seq' (default) or 'rand'\n"
+           "  '-s' is the size of each request in bytes (default 4k)\n"
+           "  '-d' is the number of requests kept in flight (default 1)\n"
+           "  '-w' is the percentage of requests that are writes (default 0)\n"
+           "  '-T' is the duration of the run in seconds (default 10)\n"
+           "  '-F' issues a flush after every 'flush_interval' writes\n";
 
     printf("%s\nSupported formats:", help_msg);
     bdrv_iterate_format(format_print, NULL);
@@ -652,9 +664,252 @@ static int compare_sectors(const uint8_t *buf1, const uint8_t *buf2, int n,
 
 #define IO_BUF_SIZE (2 * 1024 * 1024)
 
+#define MAX_COROUTINES 16
+
+/* State shared by the coroutines of an uncompressed img_convert */
+typedef struct ImgConvertState {
+    BlockDriverState **src;
+    int64_t *src_sectors;
+    int src_num;
+    int64_t total_sectors;
+    BlockDriverState *target;
+    bool has_zero_init;
+    bool target_has_backing;
+    int min_sparse;
+    /* next sector to be claimed by a coroutine */
+    int64_t sector_num;
+    /* with in-order writes, the next sector that may be written */
+    int64_t wr_offs;
+    bool wr_in_order;
+    /* serializes claiming chunks, which may query block status */
+    CoMutex lock;
+    int ret;
+    int num_coroutines;
+    int running_coroutines;
+    Coroutine *co[MAX_COROUTINES];
+    int64_t wait_sector_num[MAX_COROUTINES];
+} ImgConvertState;
+
+enum ImgConvertChunk {
+    CHUNK_DATA,         /* read from the source and write */
+    CHUNK_ZERO,         /* unallocated in the whole source chain */
+    CHUNK_BACKING,      /* left to the target's backing file */
+};
+
+/*
+ * Size the chunk starting at s->sector_num: it never spans two source
+ * images and has the same allocation status throughout.  Returns the
+ * number of sectors and sets *status to how they are copied.
+ */
+static int coroutine_fn convert_co_chunk(ImgConvertState *s,
+                                         int *src_i, int64_t *src_sector,
+                                         enum ImgConvertChunk *status)
+{
+    int64_t sector_num = s->sector_num;
+    int n, n1, ret;
+    int i;
+
+    for (i = 0; sector_num >= s->src_sectors[i]; i++) {
+        sector_num -= s->src_sectors[i];
+        assert(i + 1 < s->src_num);
+    }
+    n = MIN(s->src_sectors[i] - sector_num, IO_BUF_SIZE / BDRV_SECTOR_SIZE);
+    *src_i = i;
+    *src_sector = sector_num;
+
+    if (s->has_zero_init && s->target_has_backing) {
+        /* If the output image is being created as a copy on write image,
+           assume that sectors which are unallocated in the input image
+           are present in both the output's and input's base images (no
+           need to copy them). */
+        ret = bdrv_co_is_allocated(s->src[i], sector_num, n, &n1);
+        *status = ret ? CHUNK_DATA : CHUNK_BACKING;
+    } else {
+        /* Sectors that nothing in the source chain allocates read as
+           zeroes, there is no point in reading them. */
+        ret = bdrv_co_is_allocated_above(s->src[i], NULL, sector_num, n, &n1);
+        *status = ret ? CHUNK_DATA : CHUNK_ZERO;
+    }
+    if (ret < 0) {
+        return ret;
+    }
+    if (n1 == 0) {
+        /* the driver could not tell, copy the data to be safe */
+        *status = CHUNK_DATA;
+        return n;
+    }
+    return n1;
+}
+
+static int coroutine_fn convert_co_write(ImgConvertState *s,
+                                         int64_t sector_num, int n,
+                                         uint8_t *buf)
+{
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int n1, ret;
+
+    while (n > 0) {
+        /* If the output image is being created as a copy on write image,
+           copy all sectors even the ones containing only NUL bytes,
+           because they may differ from the sectors in the base image.
+
+           If the output is to a host device, we also write out
+           sectors that are entirely 0, since whatever data was
+           already there is garbage, not 0s. */
+        n1 = n;
+        if (!s->has_zero_init || s->target_has_backing ||
+            is_allocated_sectors_min(buf, n, &n1, s->min_sparse)) {
+            iov.iov_base = buf;
+            iov.iov_len = n1 * BDRV_SECTOR_SIZE;
+            qemu_iovec_init_external(&qiov, &iov, 1);
+            ret = bdrv_co_writev(s->target, sector_num, n1, &qiov);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+        sector_num += n1;
+        n -= n1;
+        buf += n1 * BDRV_SECTOR_SIZE;
+    }
+    return 0;
+}
+
+/* Re-enter the coroutine waiting to write @sector_num, or all of them */
+static void convert_wake(ImgConvertState *s, int64_t sector_num)
+{
+    int i;
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] && s->wait_sector_num[i] != -1 &&
+            (sector_num == -1 || s->wait_sector_num[i] == sector_num)) {
+            qemu_coroutine_enter(s->co[i], NULL);
+        }
+    }
+}
+
+static void coroutine_fn convert_co_do_copy(void *opaque)
+{
+    ImgConvertState *s = opaque;
+    uint8_t *buf;
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int64_t sector_num, src_sector;
+    int index = -1;
+    int i, n, src_i, ret;
+    enum ImgConvertChunk status;
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] == qemu_coroutine_self()) {
+            index = i;
+            break;
+        }
+    }
+    assert(index >= 0);
+    buf = qemu_blockalign(s->target, IO_BUF_SIZE);
+
+    while (s->ret == -EINPROGRESS) {
+        qemu_co_mutex_lock(&s->lock);
+        if (s->ret != -EINPROGRESS || s->sector_num >= s->total_sectors) {
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+        n = convert_co_chunk(s, &src_i, &src_sector, &status);
+        if (n < 0) {
+            qemu_co_mutex_unlock(&s->lock);
+            error_report("error while reading block status of sector %"
+                         PRId64 ": %s", s->sector_num, strerror(-n));
+            ret = n;
+            goto fail;
+        }
+        sector_num = s->sector_num;
+        s->sector_num += n;
+        qemu_co_mutex_unlock(&s->lock);
+
+        if (status == CHUNK_DATA) {
+            iov.iov_base = buf;
+            iov.iov_len = n * BDRV_SECTOR_SIZE;
+            qemu_iovec_init_external(&qiov, &iov, 1);
+            ret = bdrv_co_readv(s->src[src_i], src_sector, n, &qiov);
+            if (ret < 0) {
+                error_report("error while reading sector %" PRId64 ": %s",
+                             src_sector, strerror(-ret));
+                goto fail;
+            }
+        }
+
+        if (s->wr_in_order) {
+            /* keep the target's allocation in the order of the source */
+            while (s->wr_offs != sector_num && s->ret == -EINPROGRESS) {
+                s->wait_sector_num[index] = sector_num;
+                qemu_coroutine_yield();
+            }
+            s->wait_sector_num[index] = -1;
+            if (s->ret != -EINPROGRESS) {
+                break;
+            }
+        }
+
+        if (status == CHUNK_DATA) {
+            ret = convert_co_write(s, sector_num, n, buf);
+        } else if (status == CHUNK_ZERO && !s->has_zero_init) {
+            /* whatever is on a host device is garbage, not zeroes */
+            ret = bdrv_co_write_zeroes(s->target, sector_num, n);
+        } else {
+            ret = 0;
+        }
+        if (ret < 0) {
+            error_report("error while writing sector %" PRId64 ": %s",
+                         sector_num, strerror(-ret));
+            goto fail;
+        }
+
+        if (s->wr_in_order) {
+            s->wr_offs = sector_num + n;
+            convert_wake(s, s->wr_offs);
+        }
+        qemu_progress_print(100.0f * n / s->total_sectors, 100);
+    }
+    goto out;
+
+fail:
+    s->ret = ret;
+    convert_wake(s, -1);
+out:
+    qemu_vfree(buf);
+    s->co[index] = NULL;
+    s->running_coroutines--;
+    if (!s->running_coroutines && s->ret == -EINPROGRESS) {
+        s->ret = 0;
+    }
+}
+
+static int convert_do_copy(ImgConvertState *s)
+{
+    int i;
+
+    qemu_co_mutex_init(&s->lock);
+    s->sector_num = 0;
+    s->wr_offs = 0;
+    s->ret = -EINPROGRESS;
+    s->running_coroutines = s->num_coroutines;
+    for (i = 0; i < s->num_coroutines; i++) {
+        s->co[i] = qemu_coroutine_create(convert_co_do_copy);
+        s->wait_sector_num[i] = -1;
+    }
+    for (i = 0; i < s->num_coroutines; i++) {
+        qemu_coroutine_enter(s->co[i], s);
+    }
+
+    while (s->running_coroutines) {
+        qemu_aio_wait();
+    }
+    return s->ret;
+}
+
 static int img_convert(int argc, char **argv)
 {
-    int c, ret = 0, n, n1, bs_n, bs_i, compress, cluster_size, cluster_sectors;
+    int c, ret = 0, n, bs_n, bs_i, compress, cluster_size, cluster_sectors;
     int progress = 0, flags;
     const char *fmt, *out_fmt, *cache, *out_baseimg, *out_filename;
     BlockDriver *drv, *proto_drv;
@@ -662,7 +917,6 @@ static int img_convert(int argc, char **argv)
     int64_t total_sectors, nb_sectors, sector_num, bs_offset;
     uint64_t bs_sectors;
     uint8_t * buf = NULL;
-    const uint8_t *buf1;
     BlockDriverInfo bdi;
     QEMUOptionParameter *param = NULL, *create_options = NULL;
     QEMUOptionParameter *out_baseimg_param;
@@ -670,6 +924,9 @@ static int img_convert(int argc, char **argv)
     const char *snapshot_name = NULL;
     float local_progress;
     int min_sparse = 8; /* Need at least 4k of zeros for sparse detection */
+    int num_coroutines = 1;
+    bool wr_in_order = true;
+    ImgConvertState state;
 
     fmt = NULL;
     out_fmt = "raw";
@@ -677,7 +934,7 @@ static int img_convert(int argc, char **argv)
     out_baseimg = NULL;
     compress = 0;
     for(;;) {
-        c = getopt(argc, argv, "f:O:B:s:hce6o:pS:t:");
+        c = getopt(argc, argv, "f:O:B:s:hce6o:pS:t:m:W");
         if (c == -1) {
             break;
         }
@@ -731,6 +988,20 @@ static int img_convert(int argc, char **argv)
         case 't':
             cache = optarg;
             break;
+        case 'm':
+        {
+            char *end;
+            num_coroutines = strtol(optarg, &end, 10);
+            if (*end || num_coroutines < 1 || num_coroutines > MAX_COROUTINES) {
+                error_report("Invalid number of coroutines. Allowed number of"
+                             " coroutines is between 1 and %d", MAX_COROUTINES);
+                return 1;
+            }
+            break;
+        }
+        case 'W':
+            wr_in_order = false;
+            break;
         }
     }
 
@@ -749,6 +1020,13 @@ static int img_convert(int argc, char **argv)
         goto out;
     }
 
+    if (compress && !wr_in_order) {
+        error_report("Out of order writes and compression are mutually "
+                     "exclusive");
+        ret = -1;
+        goto out;
+    }
+
     if (bs_n > 1 && out_baseimg) {
         error_report("-B makes no sense when concatenating multiple input "
                      "images");
@@ -973,92 +1251,35 @@ static int img_convert(int argc, char **argv)
             sector_num += n;
             qemu_progress_print(local_progress, 100);
         }
-        /* signal EOF to align */
-        bdrv_write_compressed(out_bs, 0, NULL, 0);
+        /* signal EOF to align, this also waits for queued clusters */
+        ret = bdrv_write_compressed(out_bs, 0, NULL, 0);
+        if (ret < 0) {
+            error_report("error while compressing: %s", strerror(-ret));
+            goto out;
+        }
     } else {
-        int has_zero_init = bdrv_has_zero_init(out_bs);
-
-        sector_num = 0; // total number of sectors converted so far
-        nb_sectors = total_sectors - sector_num;
-        local_progress = (float)100 /
-            (nb_sectors / MIN(nb_sectors, IO_BUF_SIZE / 512));
-
-        for(;;) {
-            nb_sectors = total_sectors - sector_num;
-            if (nb_sectors <= 0) {
-                break;
-            }
-            if (nb_sectors >= (IO_BUF_SIZE / 512)) {
-                n = (IO_BUF_SIZE / 512);
-            } else {
-                n = nb_sectors;
-            }
-
-            while (sector_num - bs_offset >= bs_sectors) {
-                bs_i ++;
-                assert (bs_i < bs_n);
-                bs_offset += bs_sectors;
-                bdrv_get_geometry(bs[bs_i], &bs_sectors);
-                /* printf("changing part: sector_num=%" PRId64 ", bs_i=%d, "
-                  "bs_offset=%" PRId64 ", bs_sectors=%" PRId64 "\n",
-                   sector_num, bs_i, bs_offset, bs_sectors); */
-            }
-
-            if (n > bs_offset + bs_sectors - sector_num) {
-                n = bs_offset + bs_sectors - sector_num;
-            }
-
-            if (has_zero_init) {
-                /* If the output image is being created as a copy on write image,
-                   assume that sectors which are unallocated in the input image
-                   are present in both the output's and input's base images (no
-                   need to copy them). */
-                if (out_baseimg) {
-                    if (!bdrv_is_allocated(bs[bs_i], sector_num - bs_offset,
-                                           n, &n1)) {
-                        sector_num += n1;
-                        continue;
-                    }
-                    /* The next 'n1' sectors are allocated in the input image. Copy
-                       only those as they may be followed by unallocated sectors. */
-                    n = n1;
-                }
-            } else {
-                n1 = n;
-            }
-
-            ret = bdrv_read(bs[bs_i], sector_num - bs_offset, buf, n);
-            if (ret < 0) {
-                error_report("error while reading sector %" PRId64 ": %s",
-                             sector_num - bs_offset, strerror(-ret));
-                goto out;
-            }
-            /* NOTE: at the same time we convert, we do not write zero
-               sectors to have a chance to compress the image. Ideally, we
-               should add a specific call to have the info to go faster */
-            buf1 = buf;
-            while (n > 0) {
-                /* If the output image is being created as a copy on write image,
-                   copy all sectors even the ones containing only NUL bytes,
-                   because they may differ from the sectors in the base image.
-
-                   If the output is to a host device, we also write out
-                   sectors that are entirely 0, since whatever data was
-                   already there is garbage, not 0s. */
-                if (!has_zero_init || out_baseimg ||
-                    is_allocated_sectors_min(buf1, n, &n1, min_sparse)) {
-                    ret = bdrv_write(out_bs, sector_num, buf1, n1);
-                    if (ret < 0) {
-                        error_report("error while writing sector %" PRId64
-                                     ": %s", sector_num, strerror(-ret));
-                        goto out;
-                    }
-                }
-                sector_num += n1;
-                n -= n1;
-                buf1 += n1 * 512;
-            }
-            qemu_progress_print(local_progress, 100);
+        memset(&state, 0, sizeof(state));
+        state.src = bs;
+        state.src_num = bs_n;
+        state.src_sectors = g_new(int64_t, bs_n);
+        for (bs_i = 0; bs_i < bs_n; bs_i++) {
+            bdrv_get_geometry(bs[bs_i], &bs_sectors);
+            state.src_sectors[bs_i] = bs_sectors;
+        }
+        state.total_sectors = total_sectors;
+        state.target = out_bs;
+        state.has_zero_init = bdrv_has_zero_init(out_bs);
+        state.target_has_backing = !!out_baseimg;
+        state.min_sparse = min_sparse;
+        state.wr_in_order = wr_in_order;
+        state.num_coroutines = num_coroutines;
+
+        if (total_sectors) {
+            ret = convert_do_copy(&state);
+        }
+        g_free(state.src_sectors);
+        if (ret < 0) {
+            goto out;
         }
     }
 out:
@@ -1181,6 +1402,120 @@ static int img_info(int argc, char **argv)
     return 0;
 }
 
+/*
+ * Find how deep in the backing chain of @bs the sectors starting at
+ * @sector_num are allocated.  Returns 1 and sets *depth (0 for @bs
+ * itself) if some layer allocates them, 0 if they read as zeroes, or
+ * -errno.  *pnum is set to the number of sectors with the same answer.
+ */
+static int get_block_status(BlockDriverState *bs, int64_t sector_num,
+                            int nb_sectors, int *pnum, int *depth)
+{
+    BlockDriverState *top = bs;
+    int n = nb_sectors, n1, ret;
+
+    for (*depth = 0; bs; (*depth)++, bs = bs->backing_hd) {
+        ret = bdrv_is_allocated(bs, sector_num, nb_sectors, &n1);
+        if (ret < 0) {
+            return ret;
+        }
+        if (bs == top && n1 == 0) {
+            /* the driver could not tell, assume data */
+            *pnum = nb_sectors;
+            return 1;
+        }
+        if (ret) {
+            *pnum = MIN(n, n1);
+            return 1;
+        }
+        /* a backing file shorter than the image reports nothing */
+        if (sector_num < bs->total_sectors) {
+            n = MIN(n, n1);
+        }
+    }
+    *pnum = n;
+    return 0;
+}
+
+static void dump_map_entry(int64_t start, int64_t length, bool data,
+                           int depth)
+{
+    char depth_buf[16];
+
+    if (data) {
+        snprintf(depth_buf, sizeof(depth_buf), "%d", depth);
+    } else {
+        pstrcpy(depth_buf, sizeof(depth_buf), "-");
+    }
+    printf("0x%-14" PRIx64 "0x%-14" PRIx64 "%-8s%s\n",
+           start * BDRV_SECTOR_SIZE, length * BDRV_SECTOR_SIZE,
+           depth_buf, data ? "data" : "zero");
+}
+
+static int img_map(int argc, char **argv)
+{
+    int c, ret = 0;
+    const char *filename, *fmt;
+    BlockDriverState *bs;
+    uint64_t total_sectors;
+    int64_t sector_num, start = 0;
+    int n, depth, last_depth = 0;
+    bool data, last_data = false;
+
+    fmt = NULL;
+    for(;;) {
+        c = getopt(argc, argv, "f:h");
+        if (c == -1) {
+            break;
+        }
+        switch(c) {
+        case '?':
+        case 'h':
+            help();
+            break;
+        case 'f':
+            fmt = optarg;
+            break;
+        }
+    }
+    if (optind >= argc) {
+        help();
+    }
+    filename = argv[optind++];
+
+    bs = bdrv_new_open(filename, fmt, BDRV_O_FLAGS);
+    if (!bs) {
+        return 1;
+    }
+    bdrv_get_geometry(bs, &total_sectors);
+
+    printf("%-16s%-16s%-8s%s\n", "Offset", "Length", "Depth", "Type");
+    for (sector_num = 0; sector_num < total_sectors; sector_num += n) {
+        n = MIN(total_sectors - sector_num, INT_MAX / BDRV_SECTOR_SIZE);
+        ret = get_block_status(bs, sector_num, n, &n, &depth);
+        if (ret < 0) {
+            error_report("error while reading block status of sector %"
+                         PRId64 ": %s", sector_num, strerror(-ret));
+            goto out;
+        }
+        data = ret;
+        if (sector_num &&
+            (data != last_data || (data && depth != last_depth))) {
+            dump_map_entry(start, sector_num - start, last_data, last_depth);
+            start = sector_num;
+        }
+        last_data = data;
+        last_depth = depth;
+    }
+    if (total_sectors) {
+        dump_map_entry(start, total_sectors - start, last_data, last_depth);
+    }
+    ret = 0;
+out:
+    bdrv_delete(bs);
+    return ret < 0 ? 1 : 0;
+}
+
 #define SNAPSHOT_LIST   1
 #define SNAPSHOT_CREATE 2
 #define SNAPSHOT_APPLY  3
@@ -1681,6 +2016,353 @@ out:
     return 0;
 }
 
+#define BENCH_MAX_DEPTH     1024
+/* Latency histogram: 16 linear buckets per power of two, in ns */
+#define BENCH_HIST_SUB_BITS 4
+#define BENCH_HIST_SIZE     ((64 - BENCH_HIST_SUB_BITS + 1) << BENCH_HIST_SUB_BITS)
+
+typedef struct BenchState BenchState;
+
+typedef struct BenchRequest {
+    BenchState *s;
+    int64_t start;
+    bool is_write;
+    bool is_flush;
+    uint8_t *buf;
+    struct iovec iov;
+    QEMUIOVector qiov;
+} BenchRequest;
+
+struct BenchState {
+    BlockDriverState *bs;
+    int bufsize;
+    int64_t nr_blocks;
+    bool random;
+    int write_percent;
+    int flush_interval;
+    int64_t end_time;
+    uint64_t rng;
+
+    int64_t offset;
+    int in_flight;
+    int writes_since_flush;
+    int ret;
+
+    uint64_t reads, writes, flushes;
+    uint64_t lat_min, lat_max, lat_sum;
+    uint64_t hist[BENCH_HIST_SIZE];
+};
+
+/* xorshift64*, seeded the same on every run so that runs are repeatable */
+static uint64_t bench_rand(BenchState *s)
+{
+    s->rng ^= s->rng >> 12;
+    s->rng ^= s->rng << 25;
+    s->rng ^= s->rng >> 27;
+    return s->rng * 2685821657736338717ULL;
+}
+
+static int bench_hist_index(uint64_t ns)
+{
+    int msb;
+
+    if (ns < (1 << BENCH_HIST_SUB_BITS)) {
+        return ns;
+    }
+    msb = 63 - clz64(ns);
+    return ((msb - BENCH_HIST_SUB_BITS + 1) << BENCH_HIST_SUB_BITS) |
+           ((ns >> (msb - BENCH_HIST_SUB_BITS)) &
+            ((1 << BENCH_HIST_SUB_BITS) - 1));
+}
+
+static uint64_t bench_hist_value(int index)
+{
+    int shift = (index >> BENCH_HIST_SUB_BITS) - 1;
+
+    if (shift < 0) {
+        return index;
+    }
+    return (uint64_t)((1 << BENCH_HIST_SUB_BITS) |
+                      (index & ((1 << BENCH_HIST_SUB_BITS) - 1))) << shift;
+}
+
+/* Lower bound of the bucket that holds the @pct percentile, in ns */
+static uint64_t bench_percentile(BenchState *s, double pct)
+{
+    uint64_t total = s->reads + s->writes;
+    uint64_t want = (uint64_t)(total * pct / 100.0), seen = 0;
+    int i;
+
+    for (i = 0; i < BENCH_HIST_SIZE; i++) {
+        seen += s->hist[i];
+        if (seen > want) {
+            return bench_hist_value(i);
+        }
+    }
+    return s->lat_max;
+}
+
+static void bench_cb(void *opaque, int ret);
+
+static void bench_submit(BenchRequest *req)
+{
+    BenchState *s = req->s;
+    BlockDriverAIOCB *acb;
+    int64_t sector_num = 0;
+    int nb_sectors = s->bufsize >> BDRV_SECTOR_BITS;
+
+    req->is_flush = s->flush_interval &&
+                    s->writes_since_flush >= s->flush_interval;
+    if (req->is_flush) {
+        s->writes_since_flush = 0;
+    } else {
+        if (s->random) {
+            sector_num = (bench_rand(s) % s->nr_blocks) * nb_sectors;
+        } else {
+            sector_num = s->offset * nb_sectors;
+            s->offset = (s->offset + 1) % s->nr_blocks;
+        }
+        req->is_write = s->write_percent &&
+                        bench_rand(s) % 100 < s->write_percent;
+        if (req->is_write) {
+            s->writes_since_flush++;
+        }
+    }
+
+    s->in_flight++;
+    req->start = get_clock();
+    if (req->is_flush) {
+        acb = bdrv_aio_flush(s->bs, bench_cb, req);
+    } else if (req->is_write) {
+        acb = bdrv_aio_writev(s->bs, sector_num, &req->qiov, nb_sectors,
+                              bench_cb, req);
+    } else {
+        acb = bdrv_aio_readv(s->bs, sector_num, &req->qiov, nb_sectors,
+                             bench_cb, req);
+    }
+    if (!acb) {
+        s->in_flight--;
+        s->ret = -EIO;
+    }
+}
+
+static void bench_cb(void *opaque, int ret)
+{
+    BenchRequest *req = opaque;
+    BenchState *s = req->s;
+    int64_t now = get_clock();
+    uint64_t lat = now - req->start;
+
+    s->in_flight--;
+    if (ret < 0) {
+        error_report("%s failed: %s", req->is_flush ? "Flush" :
+                     req->is_write ? "Write" : "Read", strerror(-ret));
+        s->ret = ret;
+        return;
+    }
+
+    if (req->is_flush) {
+        s->flushes++;
+    } else {
+        if (req->is_write) {
+            s->writes++;
+        } else {
+            s->reads++;
+        }
+        s->lat_min = MIN(s->lat_min, lat);
+        s->lat_max = MAX(s->lat_max, lat);
+        s->lat_sum += lat;
+        s->hist[bench_hist_index(lat)]++;
+    }
+
+    if (s->ret == 0 && now < s->end_time) {
+        bench_submit(req);
+    }
+}
+
+static int img_bench(int argc, char **argv)
+{
+    int c, ret = 0, flags, i;
+    const char *filename, *fmt, *cache, *pattern;
+    BlockDriverState *bs = NULL;
+    BenchState *s = NULL;
+    BenchRequest *reqs = NULL;
+    int depth = 1, duration = 10;
+    char *end;
+    int64_t sval, size, start, elapsed;
+    uint64_t count;
+    double secs;
+
+    fmt = NULL;
+    cache = BDRV_DEFAULT_CACHE;
+    pattern = "seq";
+    s = g_malloc0(sizeof(*s));
+    s->bufsize = 4096;
+    for(;;) {
+        c = getopt(argc, argv, "d:f:F:hP:s:t:T:w:");
+        if (c == -1) {
+            break;
+        }
+        switch(c) {
+        case '?':
+        case 'h':
+            help();
+            break;
+        case 'd':
+            depth = strtol(optarg, &end, 0);
+            if (*end || depth < 1 || depth > BENCH_MAX_DEPTH) {
+                error_report("Invalid queue depth specified");
+                ret = -1;
+                goto out;
+            }
+            break;
+        case 'f':
+            fmt = optarg;
+            break;
+        case 'F':
+            s->flush_interval = strtol(optarg, &end, 0);
+            if (*end || s->flush_interval < 0) {
+                error_report("Invalid flush interval specified");
+                ret = -1;
+                goto out;
+            }
+            break;
+        case 'P':
+            pattern = optarg;
+            break;
+        case 's':
+            sval = strtosz_suffix(optarg, &end, STRTOSZ_DEFSUFFIX_B);
+            if (sval <= 0 || *end || sval > INT_MAX ||
+                sval % BDRV_SECTOR_SIZE) {
+                error_report("Invalid buffer size specified");
+                ret = -1;
+                goto out;
+            }
+            s->bufsize = sval;
+            break;
+        case 't':
+            cache = optarg;
+            break;
+        case 'T':
+            duration = strtol(optarg, &end, 0);
+            if (*end || duration < 1) {
+                error_report("Invalid duration specified");
+                ret = -1;
+                goto out;
+            }
+            break;
+        case 'w':
+            s->write_percent = strtol(optarg, &end, 0);
+            if (*end || s->write_percent < 0 || s->write_percent > 100) {
+                error_report("Write percentage must be between 0 and 100");
+                ret = -1;
+                goto out;
+            }
+            break;
+        }
+    }
+    if (optind >= argc) {
+        help();
+    }
+    filename = argv[optind++];
+
+    if (!strcmp(pattern, "rand")) {
+        s->random = true;
+    } else if (strcmp(pattern, "seq")) {
+        error_report("Invalid access pattern '%s', use 'seq' or 'rand'",
+                     pattern);
+        ret = -1;
+        goto out;
+    }
+
+    flags = s->write_percent ? BDRV_O_RDWR : 0;
+    ret = bdrv_parse_cache_flags(cache, &flags);
+    if (ret < 0) {
+        error_report("Invalid cache option: %s", cache);
+        goto out;
+    }
+
+    bs = bdrv_new_open(filename, fmt, flags);
+    if (!bs) {
+        ret = -1;
+        goto out;
+    }
+    size = bdrv_getlength(bs);
+    if (size < 0) {
+        error_report("Could not get the image size: %s", strerror(-size));
+        ret = -1;
+        goto out;
+    }
+    s->bs = bs;
+    s->nr_blocks = size / s->bufsize;
+    if (s->nr_blocks == 0) {
+        error_report("The image is smaller than the buffer size");
+        ret = -1;
+        goto out;
+    }
+    s->rng = 0x2545f4914f6cdd1dULL;
+    s->lat_min = UINT64_MAX;
+
+    reqs = g_malloc0(depth * sizeof(*reqs));
+    for (i = 0; i < depth; i++) {
+        reqs[i].s = s;
+        reqs[i].buf = qemu_blockalign(bs, s->bufsize);
+        memset(reqs[i].buf, 0xa5, s->bufsize);
+        reqs[i].iov.iov_base = reqs[i].buf;
+        reqs[i].iov.iov_len = s->bufsize;
+        qemu_iovec_init_external(&reqs[i].qiov, &reqs[i].iov, 1);
+    }
+
+    printf("Running %s benchmark for %d seconds: %d bytes per request, "
+           "%d in parallel, %d%% writes, cache=%s\n",
+           s->random ? "random" : "sequential", duration,
+           s->bufsize, depth, s->write_percent, cache);
+
+    start = get_clock();
+    s->end_time = start + duration * 1000000000LL;
+    for (i = 0; i < depth && s->ret == 0; i++) {
+        bench_submit(&reqs[i]);
+    }
+    while (s->in_flight > 0) {
+        qemu_aio_wait();
+    }
+    elapsed = get_clock() - start;
+    ret = s->ret;
+    if (ret < 0) {
+        goto out;
+    }
+
+    count = s->reads + s->writes;
+    secs = elapsed / 1e9;
+    printf("Completed %" PRIu64 " requests (%" PRIu64 " reads, %" PRIu64
+           " writes, %" PRIu64 " flushes) in %.3f seconds\n",
+           count, s->reads, s->writes, s->flushes, secs);
+    if (count) {
+        printf("IOPS: %.0f, bandwidth: %.2f MB/s\n", count / secs,
+               count * s->bufsize / secs / (1024 * 1024));
+        printf("Latency (us): min %.1f, avg %.1f, max %.1f\n",
+               s->lat_min / 1e3, (double)s->lat_sum / count / 1e3,
+               s->lat_max / 1e3);
+        printf("Percentiles (us): 50th %.1f, 90th %.1f, 99th %.1f, "
+               "99.9th %.1f\n",
+               bench_percentile(s, 50) / 1e3, bench_percentile(s, 90) / 1e3,
+               bench_percentile(s, 99) / 1e3, bench_percentile(s, 99.9) / 1e3);
+    }
+
+out:
+    if (reqs) {
+        for (i = 0; i < depth; i++) {
+            qemu_vfree(reqs[i].buf);
+        }
+        g_free(reqs);
+    }
+    g_free(s);
+    if (bs) {
+        bdrv_delete(bs);
+    }
+    return ret < 0 ? 1 : 0;
+}
+
 static const img_cmd_t img_cmds[] = {
 #define DEF(option, callback, arg_string)        \
     { option, callback },
@@ -0,0 +1,227 @@
+/*
+ * Lock contention statistics
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "qemu-thread.h"
+#include "qemu-timer.h"
+#include "host-utils.h"
+#include "qemu-lockstat.h"
+#include "qmp-commands.h"
+
+bool lock_stats_enabled;
+
+/* lock_stats_list_lock protects the list, not the statistics */
+static QemuMutex lock_stats_list_lock;
+static QTAILQ_HEAD(, QemuLockStats) lock_stats_list =
+    QTAILQ_HEAD_INITIALIZER(lock_stats_list);
+
+static void __attribute__((constructor)) lock_stats_init(void)
+{
+    qemu_mutex_init(&lock_stats_list_lock);
+}
+
+static void lock_stats_reset(QemuLockStats *ls)
+{
+    ls->acquisitions = 0;
+    ls->contended = 0;
+    ls->wait_ns = 0;
+    ls->hold_ns = 0;
+    memset(ls->wait_bins, 0, sizeof(ls->wait_bins));
+    memset(ls->hold_bins, 0, sizeof(ls->hold_bins));
+    memset(ls->callers, 0, sizeof(ls->callers));
+}
+
+void lock_stats_register(QemuLockStats *ls, const char *name)
+{
+    ls->name = g_strdup(name);
+    lock_stats_reset(ls);
+    qemu_mutex_lock(&lock_stats_list_lock);
+    QTAILQ_INSERT_TAIL(&lock_stats_list, ls, next);
+    qemu_mutex_unlock(&lock_stats_list_lock);
+}
+
+void lock_stats_unregister(QemuLockStats *ls)
+{
+    qemu_mutex_lock(&lock_stats_list_lock);
+    QTAILQ_REMOVE(&lock_stats_list, ls, next);
+    qemu_mutex_unlock(&lock_stats_list_lock);
+    g_free(ls->name);
+    ls->name = NULL;
+}
+
+/*
+ * Resetting races with the holders of the locks, which may lose or keep
+ * an update or two; that is fine for statistics.
+ */
+void lock_stats_set_enabled(bool enabled)
+{
+    QemuLockStats *ls;
+
+    if (enabled && !lock_stats_enabled) {
+        qemu_mutex_lock(&lock_stats_list_lock);
+        QTAILQ_FOREACH(ls, &lock_stats_list, next) {
+            lock_stats_reset(ls);
+        }
+        qemu_mutex_unlock(&lock_stats_list_lock);
+    }
+    lock_stats_enabled = enabled;
+}
+
+int64_t lock_stats_clock(void)
+{
+    return get_clock();
+}
+
+static int lock_stats_bin(uint64_t ns)
+{
+    int bin = 63 - clz64(ns | 1) - LOCK_STATS_BIN_SHIFT;
+
+    if (bin < 0) {
+        return 0;
+    }
+    return bin < LOCK_STATS_BINS ? bin : LOCK_STATS_BINS - 1;
+}
+
+int64_t lock_stats_acquired(QemuLockStats *ls, int64_t start, bool contended,
+                            void *caller)
+{
+    int64_t now;
+    uint64_t wait;
+    int i;
+
+    if (!start) {
+        return 0;
+    }
+    now = get_clock();
+    wait = now - start;
+
+    ls->acquisitions++;
+    ls->wait_ns += wait;
+    ls->wait_bins[lock_stats_bin(wait)]++;
+    if (contended) {
+        ls->contended++;
+    }
+
+    for (i = 0; i < LOCK_STATS_CALLERS; i++) {
+        LockStatsCaller *c = &ls->callers[i];
+
+        if (c->caller != caller) {
+            if (c->caller) {
+                continue;
+            }
+            c->caller = caller;
+        }
+        c->acquisitions++;
+        c->wait_ns += wait;
+        if (contended) {
+            c->contended++;
+        }
+        break;
+    }
+    return now;
+}
+
+void lock_stats_released(QemuLockStats *ls, int64_t locked)
+{
+    uint64_t hold;
+
+    if (!locked) {
+        return;
+    }
+    hold = get_clock() - locked;
+    ls->hold_ns += hold;
+    ls->hold_bins[lock_stats_bin(hold)]++;
+}
+
+void qmp_lock_stats_set(bool enable, Error **errp)
+{
+    lock_stats_set_enabled(enable);
+}
+
+static LockStatsBinList *lock_stats_bins_info(const uint64_t *bins)
+{
+    LockStatsBinList *head = NULL, **prev = &head;
+    int i;
+
+    for (i = 0; i < LOCK_STATS_BINS; i++) {
+        LockStatsBinList *entry;
+
+        if (!bins[i]) {
+            continue;
+        }
+        entry = g_malloc0(sizeof(*entry));
+        entry->value = g_malloc0(sizeof(*entry->value));
+        entry->value->low = i ? 1LL << (i + LOCK_STATS_BIN_SHIFT) : 0;
+        if (i < LOCK_STATS_BINS - 1) {
+            entry->value->has_high = true;
+            entry->value->high = 1LL << (i + LOCK_STATS_BIN_SHIFT + 1);
+        }
+        entry->value->count = bins[i];
+
+        *prev = entry;
+        prev = &entry->next;
+    }
+
+    return head;
+}
+
+/* Return the callers that waited longest first */
+static LockCallerInfoList *lock_stats_callers_info(QemuLockStats *ls)
+{
+    LockCallerInfoList *head = NULL, **prev;
+    int i;
+
+    for (i = 0; i < LOCK_STATS_CALLERS && ls->callers[i].caller; i++) {
+        LockStatsCaller *c = &ls->callers[i];
+        LockCallerInfoList *entry = g_malloc0(sizeof(*entry));
+
+        entry->value = g_malloc0(sizeof(*entry->value));
+        entry->value->caller = (uintptr_t)c->caller;
+        entry->value->acquisitions = c->acquisitions;
+        entry->value->contended = c->contended;
+        entry->value->wait_ns = c->wait_ns;
+
+        for (prev = &head; *prev; prev = &(*prev)->next) {
+            if ((*prev)->value->wait_ns < entry->value->wait_ns) {
+                break;
+            }
+        }
+        entry->next = *prev;
+        *prev = entry;
+    }
+
+    return head;
+}
+
+LockStatsInfo *qmp_query_lock_stats(Error **errp)
+{
+    LockStatsInfo *info = g_malloc0(sizeof(*info));
+    LockStatsList **tail = &info->locks;
+    QemuLockStats *ls;
+
+    info->enabled = lock_stats_enabled;
+    qemu_mutex_lock(&lock_stats_list_lock);
+    QTAILQ_FOREACH(ls, &lock_stats_list, next) {
+        LockStatsList *entry = g_malloc0(sizeof(*entry));
+
+        entry->value = g_malloc0(sizeof(*entry->value));
+        entry->value->name = g_strdup(ls->name);
+        entry->value->acquisitions = ls->acquisitions;
+        entry->value->contended = ls->contended;
+        entry->value->wait_ns = ls->wait_ns;
+        entry->value->hold_ns = ls->hold_ns;
+        entry->value->wait_histogram = lock_stats_bins_info(ls->wait_bins);
+        entry->value->hold_histogram = lock_stats_bins_info(ls->hold_bins);
+        entry->value->callers = lock_stats_callers_info(ls);
+        *tail = entry;
+        tail = &entry->next;
+    }
+    qemu_mutex_unlock(&lock_stats_list_lock);
+
+    return info;
+}
@@ -0,0 +1,73 @@
+/*
+ * Lock contention statistics
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_LOCKSTAT_H
+#define QEMU_LOCKSTAT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "osdep.h"
+#include "qemu-queue.h"
+
+/* Bin 0 counts waits and hold times below 1 us, bin i those in
+   [2^(i+9), 2^(i+10)) ns and the last bin everything from 2^28 ns on */
+#define LOCK_STATS_BINS         20
+#define LOCK_STATS_BIN_SHIFT    9
+
+/* Callers are told apart by their return address; the first ones seen
+   get a slot, the others are only counted in the totals */
+#define LOCK_STATS_CALLERS      8
+
+typedef struct LockStatsCaller {
+    void *caller;
+    uint64_t acquisitions;
+    uint64_t contended;
+    uint64_t wait_ns;
+} LockStatsCaller;
+
+/*
+ * Statistics of one lock.  They are only updated while the lock is held,
+ * so the lock itself serializes them.
+ */
+typedef struct QemuLockStats {
+    char *name;
+    uint64_t acquisitions;
+    uint64_t contended;
+    uint64_t wait_ns;
+    uint64_t hold_ns;
+    uint64_t wait_bins[LOCK_STATS_BINS];
+    uint64_t hold_bins[LOCK_STATS_BINS];
+    LockStatsCaller callers[LOCK_STATS_CALLERS];
+    QTAILQ_ENTRY(QemuLockStats) next;
+} QemuLockStats;
+
+extern bool lock_stats_enabled;
+
+void lock_stats_register(QemuLockStats *ls, const char *name);
+void lock_stats_unregister(QemuLockStats *ls);
+void lock_stats_set_enabled(bool enabled);
+int64_t lock_stats_clock(void);
+
+/* Time an acquisition starts, or 0 if it is not going to be recorded */
+static inline int64_t lock_stats_start(void)
+{
+    return unlikely(lock_stats_enabled) ? lock_stats_clock() : 0;
+}
+
+/*
+ * Record an acquisition that started at @start, unless @start is 0.
+ * Returns the time the lock was taken, to be passed to
+ * lock_stats_released(), or 0 if nothing was recorded.
+ */
+int64_t lock_stats_acquired(QemuLockStats *ls, int64_t start, bool contended,
+                            void *caller);
+
+/* Record the hold time of a lock taken at @locked, unless @locked is 0 */
+void lock_stats_released(QemuLockStats *ls, int64_t locked);
+
+#endif
@@ -0,0 +1,87 @@
+/*
+ * Accounting of QEMU's own memory use
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "qemu-thread.h"
+#include "qemu-memacct.h"
+#include "qmp-commands.h"
+
+/* mem_accounts_lock protects the list, not the counters */
+static QemuMutex mem_accounts_lock;
+static QTAILQ_HEAD(, MemAccount) mem_accounts =
+    QTAILQ_HEAD_INITIALIZER(mem_accounts);
+
+static void __attribute__((constructor)) mem_account_init(void)
+{
+    qemu_mutex_init(&mem_accounts_lock);
+}
+
+void mem_account_register(MemAccount *acct, const char *subsystem,
+                          const char *owner)
+{
+    acct->subsystem = subsystem;
+    acct->owner = g_strdup(owner);
+    qemu_mutex_lock(&mem_accounts_lock);
+    QTAILQ_INSERT_TAIL(&mem_accounts, acct, next);
+    qemu_mutex_unlock(&mem_accounts_lock);
+}
+
+void mem_account_unregister(MemAccount *acct)
+{
+    if (!acct->subsystem) {
+        return;
+    }
+    qemu_mutex_lock(&mem_accounts_lock);
+    QTAILQ_REMOVE(&mem_accounts, acct, next);
+    qemu_mutex_unlock(&mem_accounts_lock);
+    acct->subsystem = NULL;
+    g_free(acct->owner);
+    acct->owner = NULL;
+}
+
+MemoryUsageInfo *qmp_query_memory_usage(Error **errp)
+{
+    MemoryUsageInfo *info = g_malloc0(sizeof(*info));
+    MemorySubsystemUsageList **sub_tail = &info->subsystems;
+    MemoryAccountUsageList **acct_tail = &info->accounts;
+    MemorySubsystemUsageList *sub;
+    MemAccount *acct;
+
+    qemu_mutex_lock(&mem_accounts_lock);
+    QTAILQ_FOREACH(acct, &mem_accounts, next) {
+        MemoryAccountUsageList *entry = g_malloc0(sizeof(*entry));
+
+        entry->value = g_malloc0(sizeof(*entry->value));
+        entry->value->subsystem = g_strdup(acct->subsystem);
+        entry->value->has_owner = acct->owner != NULL;
+        entry->value->owner = g_strdup(acct->owner);
+        entry->value->bytes = acct->bytes;
+        entry->value->peak = acct->peak;
+        entry->value->allocations = acct->allocations;
+        *acct_tail = entry;
+        acct_tail = &entry->next;
+
+        for (sub = info->subsystems; sub; sub = sub->next) {
+            if (!strcmp(sub->value->subsystem, acct->subsystem)) {
+                break;
+            }
+        }
+        if (!sub) {
+            sub = g_malloc0(sizeof(*sub));
+            sub->value = g_malloc0(sizeof(*sub->value));
+            sub->value->subsystem = g_strdup(acct->subsystem);
+            *sub_tail = sub;
+            sub_tail = &sub->next;
+        }
+        sub->value->bytes += acct->bytes;
+        info->total += acct->bytes;
+    }
+    qemu_mutex_unlock(&mem_accounts_lock);
+
+    return info;
+}
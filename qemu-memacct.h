@@ -0,0 +1,64 @@
+/*
+ * Accounting of QEMU's own memory use
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_MEMACCT_H
+#define QEMU_MEMACCT_H
+
+#include <stdint.h>
+#include "qemu-queue.h"
+
+/*
+ * A MemAccount counts the bytes that a subsystem, or one device or image
+ * of a subsystem, currently has allocated outside of guest RAM.  Callers
+ * report allocations and frees with their size next to the g_malloc() and
+ * g_free() themselves; the counters are updated atomically, so accounts
+ * may be shared between threads.
+ */
+typedef struct MemAccount {
+    const char *subsystem;
+    char *owner;                /* NULL for a whole subsystem */
+    int64_t bytes;
+    int64_t peak;               /* best effort under concurrent updates */
+    int64_t allocations;        /* blocks currently allocated */
+    QTAILQ_ENTRY(MemAccount) next;
+} MemAccount;
+
+/* Counting may start before registration, which only makes the account
+   visible to query-memory-usage.  Unregistering one that was never
+   registered does nothing.  */
+void mem_account_register(MemAccount *acct, const char *subsystem,
+                          const char *owner);
+void mem_account_unregister(MemAccount *acct);
+
+static inline void mem_account_alloc(MemAccount *acct, int64_t size)
+{
+    int64_t bytes = __sync_add_and_fetch(&acct->bytes, size);
+
+    __sync_fetch_and_add(&acct->allocations, 1);
+    if (bytes > acct->peak) {
+        acct->peak = bytes;
+    }
+}
+
+static inline void mem_account_free(MemAccount *acct, int64_t size)
+{
+    __sync_fetch_and_sub(&acct->bytes, size);
+    __sync_fetch_and_sub(&acct->allocations, 1);
+}
+
+/* For a block that grows or shrinks in place, such as a realloc'ed buffer */
+static inline void mem_account_resize(MemAccount *acct, int64_t delta)
+{
+    int64_t bytes = __sync_add_and_fetch(&acct->bytes, delta);
+
+    if (bytes > acct->peak) {
+        acct->peak = bytes;
+    }
+}
+
+#endif
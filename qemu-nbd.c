@@ -44,6 +44,7 @@ static char *sockpath;
 static bool sigterm_reported;
 static bool nbd_started;
 static int shared = 1;
+static char *export_name;
 static int nb_fds;
 
 static void usage(const char *name)
@@ -61,6 +62,8 @@ static void usage(const char *name)
 "  -k, --socket=PATH    path to the unix socket\n"
 "                       (default '"SOCKET_PATH"')\n"
 "  -e, --shared=NUM     device can be shared by NUM clients (default '1')\n"
+"  -x, --export-name=NAME  use the new-style protocol and export the image\n"
+"                       as NAME; clients may then ask for structured replies\n"
 "  -t, --persistent     don't exit on the last connection\n"
 "  -v, --verbose        display extra debugging information\n"
 "\n"
@@ -222,7 +225,7 @@ static void *nbd_client_thread(void *arg)
         goto out;
     }
 
-    ret = nbd_receive_negotiate(sock, NULL, &nbdflags,
+    ret = nbd_receive_negotiate(sock, export_name, &nbdflags,
                                 &size, &blocksize);
     if (ret < 0) {
         goto out;
@@ -298,7 +301,7 @@ int main(int argc, char **argv)
     char *device = NULL;
     int port = NBD_DEFAULT_PORT;
     off_t fd_size;
-    const char *sopt = "hVb:o:p:rsnP:c:dvk:e:t";
+    const char *sopt = "hVb:o:p:rsnP:c:dvk:e:x:t";
     struct option lopt[] = {
         { "help", 0, NULL, 'h' },
         { "version", 0, NULL, 'V' },
@@ -317,6 +320,7 @@ int main(int argc, char **argv)
         { "aio", 1, NULL, QEMU_NBD_OPT_AIO },
 #endif
         { "shared", 1, NULL, 'e' },
+        { "export-name", 1, NULL, 'x' },
         { "persistent", 0, NULL, 't' },
         { "verbose", 0, NULL, 'v' },
         { NULL, 0, NULL, 0 }
@@ -429,6 +433,9 @@ int main(int argc, char **argv)
                 errx(EXIT_FAILURE, "Shared device number must be greater than 0\n");
             }
             break;
+        case 'x':
+            export_name = optarg;
+            break;
 	case 't':
 	    persistent = 1;
 	    break;
@@ -547,6 +554,9 @@ int main(int argc, char **argv)
     }
 
     exp = nbd_export_new(bs, dev_offset, fd_size, nbdflags);
+    if (export_name) {
+        nbd_export_set_name(exp, export_name);
+    }
 
     if (sockpath) {
         fd = unix_socket_incoming(sockpath);
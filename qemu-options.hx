@@ -38,7 +38,11 @@ DEF("machine", HAS_ARG, QEMU_OPTION_machine, \
     "                supported accelerators are kvm, xen, tcg (default: tcg)\n"
     "                kernel_irqchip=on|off controls accelerated irqchip support\n"
     "                kvm_shadow_mem=size of KVM shadow MMU\n"
-    "                dump-guest-core=on|off include guest memory in a core dump (default=on)\n",
+    "                dump-guest-core=on|off include guest memory in a core dump (default=on)\n"
+    "                tcg-threads=single|multi run TCG vCPUs in a single thread or one each (default=single)\n"
+    "                prealloc-threads=n threads used by -mem-prealloc (default: one per host CPU, up to 16)\n"
+    "                xen-mapcache-size=size of the Xen map cache\n"
+    "                map-images=on|off map kernel and firmware files into guest RAM (default=off)\n",
     QEMU_ARCH_ALL)
 STEXI
 @item -machine [type=]@var{name}[,prop=@var{value}[,...]]
@@ -57,6 +61,34 @@ Enables in-kernel irqchip support for the chosen accelerator when available.
 Defines the size of the KVM shadow MMU.
 @item dump-guest-core=on|off
 Include guest memory in a core dump. The default is on.
+@item prealloc-threads=@var{n}
+Number of threads that fault in guest memory for @option{-mem-prealloc}.
+By default one thread per host CPU is used, up to 16.
+@item tcg-threads=single|multi
+Run all the TCG vCPUs in a single thread (the default), or each in its own
+thread.  @code{multi} is experimental: it is only available for x86 and ARM
+guests on x86 Linux hosts, does not work with @option{-icount}, and blocks
+migration.  Guest atomic instructions on MMIO, across pages and x86
+@code{cmpxchg16b} are only atomic with respect to each other, not against
+plain stores to the same location by other vCPUs.
+@item xen-mapcache-size=@var{size}
+Map at most @var{size} bytes of guest memory in QEMU at a time with Xen.  The
+least recently used mappings are dropped beyond that.  The default is 2 GB on
+32-bit hosts and 32 GB on 64-bit hosts, less if QEMU's address space is
+limited.
+@item map-images=on|off
+At reset, map the kernel, initrd and firmware images that are loaded at a
+fixed guest address into guest RAM instead of copying them there.  The
+pages are shared with the host page cache, and so with other guests using
+the same files, until the guest writes to them.  This needs page aligned
+images in RAM that is not backed by @option{-mem-path}, otherwise the
+images are copied as usual; so are images that the board patches, such as
+a kernel that gets the location of the initrd or the command line written
+into it.  A mapped file must not be
+rewritten or truncated in place while QEMU runs: the guest sees the new
+contents in the pages it did not write yet, and accessing pages beyond the
+new end of the file kills QEMU with SIGBUS.  Replace such files with a new
+one, e.g. by renaming, instead.  The default is off.
 @end table
 ETEXI
 
@@ -94,12 +126,18 @@ specifies the maximum number of hotpluggable CPUs.
 ETEXI
 
 DEF("numa", HAS_ARG, QEMU_OPTION_numa,
-    "-numa node[,mem=size][,cpus=cpu[-cpu]][,nodeid=node]\n", QEMU_ARCH_ALL)
+    "-numa node[,mem=size][,cpus=cpu[-cpu]][,nodeid=node]\n"
+    "          [,hostnodes=node[-node][,policy=bind|preferred|interleave]]\n",
+    QEMU_ARCH_ALL)
 STEXI
 @item -numa @var{opts}
 @findex -numa
 Simulate a multi node NUMA system. If mem and cpus are omitted, resources
 are split equally.
+
+@option{hostnodes} places the memory of the guest node on the given host
+nodes, with the host memory @option{policy} (default @code{bind}).  Guest
+nodes cover the guest RAM in order.
 ETEXI
 
 DEF("fda", HAS_ARG, QEMU_OPTION_fda,
@@ -150,6 +188,10 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "       [,serial=s][,addr=A][,id=name][,aio=threads|native]\n"
     "       [,readonly=on|off][,copy-on-read=on|off]\n"
     "       [[,bps=b]|[[,bps_rd=r][,bps_wr=w]]][[,iops=i]|[[,iops_rd=r][,iops_wr=w]]\n"
+    "       [,lazy-refcounts=on|off][,l2-cache-size=size][,refcount-cache-size=size]\n"
+    "       [[,bps_max=bm]|[[,bps_rd_max=rm][,bps_wr_max=wm]]]\n"
+    "       [[,iops_max=im]|[[,iops_rd_max=irm][,iops_wr_max=iwm]]]\n"
+    "       [,iops_size=is][,group=g][,backing-cache=size]\n"
     "                use 'file' as a drive image\n", QEMU_ARCH_ALL)
 STEXI
 @item -drive @var{option}[,@var{option}[,@var{option}[,...]]]
@@ -184,6 +226,7 @@ These options have the same definition as they have in @option{-hdachs}.
 @var{cache} is "none", "writeback", "unsafe", "directsync" or "writethrough" and controls how the host cache is used to access block data.
 @item aio=@var{aio}
 @var{aio} is "threads", or "native" and selects between pthread based disk I/O and native Linux AIO.
+Native AIO is the default for host block devices opened with cache=none or cache=directsync.
 @item format=@var{format}
 Specify which disk @var{format} will be used rather than detecting
 the format.  Can be used to specifiy format=raw to avoid interpreting
@@ -203,6 +246,43 @@ Open drive @option{file} as read-only. Guest write attempts will fail.
 @item copy-on-read=@var{copy-on-read}
 @var{copy-on-read} is "on" or "off" and enables whether to copy read backing
 file sectors into the image file.
+@item lazy-refcounts=@var{lazy-refcounts}
+@var{lazy-refcounts} is "on" or "off".  If it is on, qcow2 images keep
+refcount updates in memory instead of ordering them before every L2 table
+update, which makes allocating writes nearly as fast as on raw images.  The
+image is marked dirty while this is in effect, and its refcounts are rebuilt
+the next time it is opened if QEMU does not get to close it cleanly.  It
+has no effect on images with the qemu 0.10 compatibility level
+(compat=0.10), and is always on for images created with
+@code{lazy_refcounts=on}.
+@item l2-cache-size=@var{size},refcount-cache-size=@var{size}
+Set the size of the caches of L2 tables and refcount blocks that formats like
+qcow2 keep in memory.  Each table takes one cluster, the default is 16 L2
+tables and 4 refcount blocks.  One L2 table maps cluster size / 8 clusters,
+so a 64k cluster qcow2 image needs 1M of L2 cache to cover 8G of its data
+without reading tables back from the image.  For VMDK, l2-cache-size is
+the size of the grain table cache of each extent, 16 tables by default.
+The sizes take suffixes like @code{k} and @code{M}.
+@item backing-cache=@var{size}
+Keep the data read from the backing files of the image in a cache of
+@var{size} bytes in @file{/dev/shm}, which every QEMU process of the same
+user that reads the same backing file with this option shares.  Clones of a
+base image then read each block of it from the storage once, instead of
+once per guest, even with @option{cache=none}.  The first process to use a
+backing file sets the size of its cache; a cache whose backing file has
+changed size or modification time since is discarded.  The cache files are
+left behind for the next guests to use.
+@item bps_max=@var{b},bps_rd_max=@var{r},bps_wr_max=@var{w}
+@itemx iops_max=@var{i},iops_rd_max=@var{r},iops_wr_max=@var{w}
+Let I/O go above the matching @option{bps}/@option{iops} limit at full speed
+until that many bytes or operations in excess of it have been done.  The
+default is a tenth of a second worth of the limit.
+@item iops_size=@var{size}
+Count requests larger than @var{size} bytes as several operations for the
+@option{iops} limits.
+@item group=@var{name}
+Put the drive in the throttle group @var{name}.  All the drives in a group
+share one set of limits, the last ones set on any of them.
 @end table
 
 By default, writethrough caching is used for all block device.  This means that
@@ -408,11 +488,17 @@ ETEXI
 
 #ifdef MAP_POPULATE
 DEF("mem-prealloc", 0, QEMU_OPTION_mem_prealloc,
-    "-mem-prealloc   preallocate guest memory (use with -mem-path)\n",
+    "-mem-prealloc   preallocate guest memory\n",
     QEMU_ARCH_ALL)
 STEXI
 @item -mem-prealloc
-Preallocate memory when using -mem-path.
+Preallocate guest memory at startup, using several threads.  With
+@option{-mem-path} this covers every RAM block, otherwise only the main
+guest RAM.  The threads for a NUMA node bound to host nodes with
+@option{-numa node,hostnodes=...} run on the CPUs of those host nodes.
+The monitor is available while memory is being allocated; the guest
+starts running when allocation completes, and @code{query-mem-prealloc}
+reports the progress.
 ETEXI
 #endif
 
@@ -573,12 +659,13 @@ DEFHEADING(File system options:)
 
 DEF("fsdev", HAS_ARG, QEMU_OPTION_fsdev,
     "-fsdev fsdriver,id=id[,path=path,][security_model={mapped-xattr|mapped-file|passthrough|none}]\n"
-    " [,writeout=immediate][,readonly][,socket=socket|sock_fd=sock_fd]\n",
+    " [,writeout=immediate][,cache=none|loose|fscache][,readonly]\n"
+    " [,socket=socket|sock_fd=sock_fd]\n",
     QEMU_ARCH_ALL)
 
 STEXI
 
-@item -fsdev @var{fsdriver},id=@var{id},path=@var{path},[security_model=@var{security_model}][,writeout=@var{writeout}][,readonly][,socket=@var{socket}|sock_fd=@var{sock_fd}]
+@item -fsdev @var{fsdriver},id=@var{id},path=@var{path},[security_model=@var{security_model}][,writeout=@var{writeout}][,cache=@var{cache}][,readonly][,socket=@var{socket}|sock_fd=@var{sock_fd}]
 @findex -fsdev
 Define a new file system device. Valid options are:
 @table @option
@@ -609,6 +696,13 @@ This is an optional argument. The only supported value is "immediate".
 This means that host page cache will be used to read and write data but
 write notification will be sent to the guest only when the data has been
 reported as written by the storage subsystem.
+@item cache=@var{cache}
+This is an optional argument. "none", the default, looks up file
+attributes on the host filesystem for every request. "loose" caches
+attributes and failed lookups for one second, so changes made on the
+host may be seen late by the guest. "fscache" keeps them until the guest
+itself modifies the file and must only be used when nothing but the
+guest changes the exported directory.
 @item readonly
 Enables exporting 9p share as a readonly mount for guests. By default
 read-write access is given.
@@ -639,12 +733,13 @@ DEFHEADING(Virtual File system pass-through options:)
 
 DEF("virtfs", HAS_ARG, QEMU_OPTION_virtfs,
     "-virtfs local,path=path,mount_tag=tag,security_model=[mapped-xattr|mapped-file|passthrough|none]\n"
-    "        [,writeout=immediate][,readonly][,socket=socket|sock_fd=sock_fd]\n",
+    "        [,writeout=immediate][,cache=none|loose|fscache][,readonly]\n"
+    "        [,socket=socket|sock_fd=sock_fd]\n",
     QEMU_ARCH_ALL)
 
 STEXI
 
-@item -virtfs @var{fsdriver}[,path=@var{path}],mount_tag=@var{mount_tag}[,security_model=@var{security_model}][,writeout=@var{writeout}][,readonly][,socket=@var{socket}|sock_fd=@var{sock_fd}]
+@item -virtfs @var{fsdriver}[,path=@var{path}],mount_tag=@var{mount_tag}[,security_model=@var{security_model}][,writeout=@var{writeout}][,cache=@var{cache}][,readonly][,socket=@var{socket}|sock_fd=@var{sock_fd}]
 @findex -virtfs
 
 The general form of a Virtual File system pass-through options are:
@@ -676,6 +771,13 @@ This is an optional argument. The only supported value is "immediate".
 This means that host page cache will be used to read and write data but
 write notification will be sent to the guest only when the data has been
 reported as written by the storage subsystem.
+@item cache=@var{cache}
+This is an optional argument. "none", the default, looks up file
+attributes on the host filesystem for every request. "loose" caches
+attributes and failed lookups for one second, so changes made on the
+host may be seen late by the guest. "fscache" keeps them until the guest
+itself modifies the file and must only be used when nothing but the
+guest changes the exported directory.
 @item readonly
 Enables exporting 9p share as a readonly mount for guests. By default
 read-write access is given.
@@ -738,7 +840,7 @@ ETEXI
 DEF("display", HAS_ARG, QEMU_OPTION_display,
     "-display sdl[,frame=on|off][,alt_grab=on|off][,ctrl_grab=on|off]\n"
     "            [,window_close=on|off]|curses|none|\n"
-    "            vnc=<display>[,<optargs>]\n"
+    "            vnc=<display>[,<optargs>]|shm=<path>\n"
     "                select display type\n", QEMU_ARCH_ALL)
 STEXI
 @item -display @var{type}
@@ -763,6 +865,12 @@ only affects what is done with video output; -nographic also changes
 the destination of the serial and parallel port data.
 @item vnc
 Start a VNC server on display <arg>
+@item shm=@var{path}
+Export the guest display to local viewers that connect to the UNIX
+socket @var{path}.  Viewers receive a shared memory file descriptor
+holding the screen and are then told which rectangles changed, so the
+framebuffer is never copied or converted for them.  The protocol is
+described in @file{docs/specs/shm-display.txt}.
 @end table
 ETEXI
 
@@ -1122,9 +1230,11 @@ a lot of bandwidth at the expense of quality.
 Disable adaptive encodings. Adaptive encodings are enabled by default.
 An adaptive encoding will try to detect frequently updated screen regions,
 and send updates in these regions using a lossy encoding (like JPEG).
-This can be really helpful to save bandwidth when playing videos. Disabling
-adaptive encodings allows to restore the original static behavior of encodings
-like Tight.
+This can be really helpful to save bandwidth when playing videos. It also
+measures how fast each client takes data, and on links fast enough that
+compression does not pay off sends raw or hextile rectangles instead of
+the client's preferred encoding. Disabling adaptive encodings allows to
+restore the original static behavior of encodings like Tight.
 
 @item share=[allow-exclusive|force-shared|ignore]
 
@@ -1139,6 +1249,14 @@ everybody else.  'ignore' completely ignores the shared flag and
 allows everybody connect unconditionally.  Doesn't conform to the rfb
 spec but is traditional QEMU behavior.
 
+@item websocket=@var{port}
+
+Also listen on TCP port @var{port}, on the host of the display, for
+clients that speak the WebSocket protocol, such as browser based
+viewers.  Only binary frames are used.  This option cannot be used
+with @option{tls}, @option{sasl}, @option{reverse} or a UNIX domain
+socket display, and needs glib 2.16 or newer.
+
 @end table
 ETEXI
 
@@ -1257,7 +1375,7 @@ DEF("net", HAS_ARG, QEMU_OPTION_net,
 #ifdef CONFIG_SLIRP
     "-net user[,vlan=n][,name=str][,net=addr[/mask]][,host=addr][,restrict=on|off]\n"
     "         [,hostname=host][,dhcpstart=addr][,dns=addr][,tftp=dir][,bootfile=f]\n"
-    "         [,hostfwd=rule][,guestfwd=rule]"
+    "         [,hostfwd=rule][,guestfwd=rule][,sockbuf=size]"
 #ifndef _WIN32
                                              "[,smb=dir[,smbserver=addr]]\n"
 #endif
@@ -1268,7 +1386,7 @@ DEF("net", HAS_ARG, QEMU_OPTION_net,
     "-net tap[,vlan=n][,name=str],ifname=name\n"
     "                connect the host TAP network interface to VLAN 'n'\n"
 #else
-    "-net tap[,vlan=n][,name=str][,fd=h][,ifname=name][,script=file][,downscript=dfile][,helper=helper][,sndbuf=nbytes][,vnet_hdr=on|off][,vhost=on|off][,vhostfd=h][,vhostforce=on|off]\n"
+    "-net tap[,vlan=n][,name=str][,fd=h][,ifname=name][,script=file][,downscript=dfile][,helper=helper][,sndbuf=nbytes][,vnet_hdr=on|off][,vhost=on|off][,vhostfd=h][,vhostforce=on|off][,queues=n][,fds=x:y:...:z][,vhostfds=x:y:...:z]\n"
     "                connect the host TAP network interface to VLAN 'n' \n"
     "                use network scripts 'file' (default=" DEFAULT_NETWORK_SCRIPT ")\n"
     "                to configure it and 'dfile' (default=" DEFAULT_NETWORK_DOWN_SCRIPT ")\n"
@@ -1285,6 +1403,10 @@ DEF("net", HAS_ARG, QEMU_OPTION_net,
     "                    (only has effect for virtio guests which use MSIX)\n"
     "                use vhostforce=on to force vhost on for non-MSIX virtio guests\n"
     "                use 'vhostfd=h' to connect to an already opened vhost net device\n"
+    "                use 'queues=n' to open a multiqueue capable TAP interface with 'n' queues\n"
+    "                use 'fds=x:y:...:z' to connect to the queues of an already opened\n"
+    "                multiqueue TAP interface, and 'vhostfds=x:y:...:z' to connect\n"
+    "                them to already opened vhost net devices\n"
     "-net bridge[,vlan=n][,name=str][,br=bridge][,helper=helper]\n"
     "                connects a host TAP network interface to a host bridge device 'br'\n"
     "                (default=" DEFAULT_BRIDGE_INTERFACE ") using the program 'helper'\n"
@@ -1304,8 +1426,15 @@ DEF("net", HAS_ARG, QEMU_OPTION_net,
     "                Use group 'groupname' and mode 'octalmode' to change default\n"
     "                ownership and permissions for communication port.\n"
 #endif
-    "-net dump[,vlan=n][,file=f][,len=n]\n"
+#ifdef CONFIG_POSIX
+    "-netdev vhost-user,id=str,path=socketpath\n"
+    "                run the virtqueues of the virtio-net device in another\n"
+    "                process that listens for vhost-user connections on 'socketpath'\n"
+#endif
+    "-net dump[,vlan=n][,file=f][,len=n][,format=pcap|pcapng][,filter=expr][,ring=n]\n"
     "                dump traffic on vlan 'n' to file 'f' (max n bytes per packet)\n"
+    "                only packets matching 'expr' are dumped; with 'ring', a\n"
+    "                thread writes the file from an 'n' bytes ring buffer\n"
     "-net none       use it alone to have zero network devices. If no -net option\n"
     "                is provided, the default is '-net nic -net user'\n", QEMU_ARCH_ALL)
 DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
@@ -1317,6 +1446,9 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "bridge|"
 #ifdef CONFIG_VDE
     "vde|"
+#endif
+#ifdef CONFIG_POSIX
+    "vhost-user|"
 #endif
     "socket],id=str[,option][,option][,...]\n", QEMU_ARCH_ALL)
 STEXI
@@ -1391,6 +1523,13 @@ Example (using pxelinux):
 qemu-system-i386 -hda linux.img -boot n -net user,tftp=/path/to/tftp/files,bootfile=/pxelinux.0
 @end example
 
+@item sockbuf=@var{size}
+Size in bytes of the send and receive buffers of each TCP connection of the
+user mode network stack, between 4096 and 65535.  The default of 8192 bytes
+limits the TCP window and with it the throughput of bulk transfers; larger
+buffers keep more data in flight and let each read from a host socket fetch
+more, at the cost of more memory per connection.
+
 @item smb=@var{dir}[,smbserver=@var{addr}]
 When using the user mode network stack, activate a built-in SMB
 server so that Windows OSes can access to the host files in @file{@var{dir}}
@@ -1488,6 +1627,13 @@ helper executable is @file{/usr/local/libexec/qemu-bridge-helper}.
 @option{fd}=@var{h} can be used to specify the handle of an already
 opened host TAP interface.
 
+@option{queues}=@var{n} opens the TAP interface @var{n} times with the
+IFF_MULTI_QUEUE flag, giving a @option{-netdev} backend one queue per
+guest queue pair of a multiqueue virtio-net device.  The scripts only run
+once, for the first queue.  @option{fds} and @option{vhostfds} pass the
+handles of the queues of an already opened multiqueue TAP interface and of
+their vhost net devices instead.  Multiqueue can not be used on a QEMU vlan.
+
 Examples:
 
 @example
@@ -1510,6 +1656,14 @@ qemu-system-i386 linux.img \
                  -net nic -net tap,"helper=/usr/local/libexec/qemu-bridge-helper"
 @end example
 
+@example
+#launch a QEMU instance with a four queue virtio-net device, the guest
+#turns the extra queues on with "ethtool -L eth0 combined 4"
+qemu-system-i386 linux.img \
+                 -netdev tap,id=hn0,queues=4,vhost=on \
+                 -device virtio-net-pci,netdev=hn0,vectors=10
+@end example
+
 @item -net bridge[,vlan=@var{n}][,name=@var{name}][,br=@var{bridge}][,helper=@var{helper}]
 Connect a host TAP network interface to a host bridge device.
 
@@ -1620,10 +1774,42 @@ vde_switch -F -sock /tmp/myswitch
 qemu-system-i386 linux.img -net nic -net vde,sock=/tmp/myswitch
 @end example
 
-@item -net dump[,vlan=@var{n}][,file=@var{file}][,len=@var{len}]
+@item -net dump[,vlan=@var{n}][,file=@var{file}][,len=@var{len}][,format=pcap|pcapng][,filter=@var{expr}][,ring=@var{size}]
 Dump network traffic on VLAN @var{n} to file @var{file} (@file{qemu-vlan0.pcap} by default).
 At most @var{len} bytes (64k by default) per packet are stored. The file format is
-libpcap, so it can be analyzed with tools such as tcpdump or Wireshark.
+libpcap, or pcapng with @option{format=pcapng}, so it can be analyzed with tools
+such as tcpdump or Wireshark.
+
+@option{filter} only stores the packets that match @var{expr}, which uses a
+subset of the tcpdump syntax: @code{ether [src|dst] host @var{mac}},
+@code{ether proto @var{n}}, @code{vlan}, @code{arp}, @code{ip}, @code{ip6},
+@code{icmp}, @code{tcp}, @code{udp}, @code{broadcast}, @code{multicast},
+@code{[src|dst] host @var{a.b.c.d}}, @code{[src|dst] port @var{n}},
+@code{less @var{n}} and @code{greater @var{n}}, combined with @code{and},
+@code{or}, @code{not} and parentheses.
+
+By default each packet is written to the file as it goes through the VLAN.
+With @option{ring}, packets are instead copied into a ring buffer of
+@var{size} bytes and a separate thread writes them to the file, so capturing
+does not slow down the guest; packets that do not fit in the ring are dropped.
+
+@example
+qemu-system-i386 linux.img -net nic -net user \
+                 -net dump,format=pcapng,ring=4M,filter="tcp and port 80"
+@end example
+
+@item -netdev vhost-user,id=@var{id},path=@var{socketpath}
+Connect to the process listening on the UNIX socket @var{socketpath} and let
+it run the virtqueues of the virtio-net device using this backend, with the
+protocol described in @file{docs/specs/vhost-user.txt}.  The process maps
+guest RAM, which must be a shared file mapping: use @option{-mem-path} together
+with @option{-mem-prealloc}.  Migration is not supported.
+
+@example
+qemu-system-x86_64 -mem-path /dev/hugepages -mem-prealloc [...] \
+        -netdev vhost-user,id=net0,path=/var/run/vswitch.sock \
+        -device virtio-net-pci,netdev=net0
+@end example
 
 @item -net none
 Indicate that no network devices should be configured. It is used to
@@ -2297,6 +2483,23 @@ STEXI
 Setup monitor on chardev @var{name}.
 ETEXI
 
+DEF("event-throttle", HAS_ARG, QEMU_OPTION_event_throttle, \
+    "-event-throttle [event=]name,rate=ms\n"
+    "                deliver at most one QMP event 'name' every 'ms'\n"
+    "                milliseconds, 0 to disable throttling\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -event-throttle [event=]@var{name},rate=@var{ms}
+@findex -event-throttle
+Deliver QMP event @var{name} to the monitors at most once every @var{ms}
+milliseconds.  Further events within that window are coalesced, and only
+the latest one (the latest one for each device in the case of
+@code{BLOCK_IO_ERROR}) is sent when the window expires.  By default
+@code{RTC_CHANGE}, @code{BALLOON_CHANGE}, @code{WATCHDOG} and
+@code{BLOCK_IO_ERROR} are limited to one per second; a rate of 0
+disables throttling.
+ETEXI
+
 DEF("debugcon", HAS_ARG, QEMU_OPTION_debugcon, \
     "-debugcon dev   redirect the debug console to char device 'dev'\n",
     QEMU_ARCH_ALL)
@@ -2652,7 +2855,10 @@ DEF("tb-size", HAS_ARG, QEMU_OPTION_tb_size, \
 STEXI
 @item -tb-size @var{n}
 @findex -tb-size
-Set TB size.
+Set the size of the translated code buffer to @var{n} MB.  By default it
+starts at 32 MB and grows, when the translated code turns over quickly, up
+to a quarter of the guest RAM or an eighth of the host RAM.  Once full, the
+oldest part of it is flushed at a time.
 ETEXI
 
 DEF("incoming", HAS_ARG, QEMU_OPTION_incoming, \
@@ -2662,6 +2868,29 @@ STEXI
 @item -incoming @var{port}
 @findex -incoming
 Prepare for incoming migration, listen on @var{port}.
+
+@item -incoming template:@var{file}
+Restore the guest from a template written by the @code{vm-template-save}
+QMP command.  The RAM is mapped copy-on-write from @var{file} rather than
+read, so the guest starts as soon as the device state is loaded, and
+guests restored from the same template share the pages they never
+write.  The machine options must match those the template was saved
+with, and @option{-mem-path} cannot be used.
+ETEXI
+
+DEF("migration-page-store", HAS_ARG, QEMU_OPTION_migration_page_store, \
+    "-migration-page-store file\n"
+    "                look up pages of incoming migrations in file\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -migration-page-store @var{file}
+@findex -migration-page-store
+When the source migrates with the @code{dedup} capability, look the
+fingerprints it sends up in the page store @var{file}, and add the pages
+that were not there.  Any number of incoming migrations on the host may
+share @var{file}, so guests cloned from the same image only send their
+common pages once.  The fingerprints are kept in @var{file}.idx.  The
+store only grows; remove both files to reclaim the space.
 ETEXI
 
 DEF("nodefaults", 0, QEMU_OPTION_nodefaults, \
@@ -2723,6 +2952,54 @@ STEXI
 Old param mode (ARM only).
 ETEXI
 
+DEF("startup-profile", 0, QEMU_OPTION_startup_profile, \
+    "-startup-profile\n"
+    "                report the time spent in each phase of startup\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -startup-profile
+@findex -startup-profile
+Print to stderr how long each phase of startup took, from option parsing
+to starting the guest, and how long each device took to initialize.
+ETEXI
+
+DEF("perfmap", 0, QEMU_OPTION_perfmap, \
+    "-perfmap        write the guest code of translated blocks to /tmp/perf-<pid>.map\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -perfmap
+@findex -perfmap
+Write the host address range of each block of translated code to
+@file{/tmp/perf-<pid>.map}, labelled with the guest symbol it came from,
+or with its guest PC if the loaded ELF image has no symbol for it.  perf
+then attributes samples in the TCG code buffer to guest code.
+ETEXI
+
+DEF("tcg-sample", HAS_ARG, QEMU_OPTION_tcg_sample, \
+    "-tcg-sample rate\n"
+    "                sample the guest PC of each vCPU rate times per second\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -tcg-sample @var{rate}
+@findex -tcg-sample
+Record the guest PC of each TCG vCPU @var{rate} times per second (1 to
+10000).  Use @code{info guest-samples} or @code{query-guest-samples} to see
+the hottest guest code.  Halted vCPUs are not sampled.
+ETEXI
+
+DEF("tcg-stats", 0, QEMU_OPTION_tcg_stats, \
+    "-tcg-stats      count TCG translations, TB lookups, TLB misses and helper calls\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -tcg-stats
+@findex -tcg-stats
+Keep counters of the TCG translator and of translated code: translation
+time and code expansion, how TBs are entered, softmmu TLB misses and how
+often each helper is called.  Retrieve them with @code{info tcg-stats} or
+@code{query-tcg-stats}.  Translated code runs somewhat slower, since it
+counts its own executions and helper calls.
+ETEXI
+
 DEF("sandbox", HAS_ARG, QEMU_OPTION_sandbox, \
     "-sandbox <arg>  Enable seccomp mode 2 system call filter (default 'off').\n",
     QEMU_ARCH_ALL)
@@ -2774,13 +3051,13 @@ config files on @var{sysconfdir}, but won't make it skip the QEMU-provided confi
 files from @var{datadir}.
 ETEXI
 DEF("trace", HAS_ARG, QEMU_OPTION_trace,
-    "-trace [events=<file>][,file=<file>]\n"
+    "-trace [events=<file>][,file=<file>][,flight-recorder=<MB>]\n"
     "                specify tracing options\n",
     QEMU_ARCH_ALL)
 STEXI
 HXCOMM This line is not accurate, as some sub-options are backend-specific but
 HXCOMM HX does not support conditional compilation of text.
-@item -trace [events=@var{file}][,file=@var{file}]
+@item -trace [events=@var{file}][,file=@var{file}][,flight-recorder=@var{mb}]
 @findex -trace
 
 Specify tracing options.
@@ -2795,6 +3072,13 @@ either @var{simple} or @var{stderr} tracing backend.
 @item file=@var{file}
 Log output traces to @var{file}.
 
+This option is only available if QEMU has been compiled with
+the @var{simple} tracing backend.
+@item flight-recorder=@var{mb}
+Do not log traces to a file.  Instead, keep the last @var{mb} megabytes of
+traces of each thread in memory, to be saved with the @code{trace-dump}
+QMP command.
+
 This option is only available if QEMU has been compiled with
 the @var{simple} tracing backend.
 @end table
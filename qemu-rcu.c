@@ -0,0 +1,226 @@
+/*
+ * Read-copy-update
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#include <glib.h>
+#include "qemu-thread.h"
+#include "qemu-rcu.h"
+
+/* Readers copy rcu_gp_ctr when entering a critical section; a grace
+ * period starts by advancing it and ends when no registered reader
+ * still holds an older value.
+ */
+#define RCU_GP_CTR 2
+
+volatile unsigned long rcu_gp_ctr = 1;
+
+#ifdef __linux__
+DEFINE_TLS(struct rcu_reader_data, rcu_reader);
+
+static void rcu_reader_init(void)
+{
+}
+
+static void rcu_reader_put(struct rcu_reader_data *p)
+{
+}
+#elif defined(_WIN32)
+static DWORD rcu_reader_key;
+
+static void rcu_reader_init(void)
+{
+    rcu_reader_key = TlsAlloc();
+    if (rcu_reader_key == TLS_OUT_OF_INDEXES) {
+        abort();
+    }
+}
+
+struct rcu_reader_data *rcu_reader_get(void)
+{
+    struct rcu_reader_data *p = TlsGetValue(rcu_reader_key);
+
+    if (!p) {
+        p = g_new0(struct rcu_reader_data, 1);
+        TlsSetValue(rcu_reader_key, p);
+    }
+    return p;
+}
+
+/* Win32 TLS slots have no destructor, so free the state when the
+   thread unregisters.  */
+static void rcu_reader_put(struct rcu_reader_data *p)
+{
+    TlsSetValue(rcu_reader_key, NULL);
+    g_free(p);
+}
+#else
+static pthread_key_t rcu_reader_key;
+
+static void rcu_reader_destroy(void *opaque)
+{
+    struct rcu_reader_data *p = opaque;
+
+    /* a thread that exits while registered is a bug, as on Linux; keep
+       the registry valid rather than freeing an entry that is on it */
+    if (!p->registered) {
+        g_free(p);
+    }
+}
+
+static void rcu_reader_init(void)
+{
+    if (pthread_key_create(&rcu_reader_key, rcu_reader_destroy)) {
+        abort();
+    }
+}
+
+struct rcu_reader_data *rcu_reader_get(void)
+{
+    struct rcu_reader_data *p = pthread_getspecific(rcu_reader_key);
+
+    if (!p) {
+        p = g_new0(struct rcu_reader_data, 1);
+        pthread_setspecific(rcu_reader_key, p);
+    }
+    return p;
+}
+
+static void rcu_reader_put(struct rcu_reader_data *p)
+{
+}
+#endif
+
+/* rcu_gp_lock serializes grace periods, rcu_registry_lock protects
+   the list of readers */
+static QemuMutex rcu_gp_lock;
+static QemuMutex rcu_registry_lock;
+static QLIST_HEAD(, rcu_reader_data) rcu_registry =
+    QLIST_HEAD_INITIALIZER(rcu_registry);
+
+/* Callbacks queued by call_rcu(), oldest first */
+static QemuMutex rcu_call_lock;
+static QemuCond rcu_call_cond;
+static struct rcu_head *rcu_call_head;
+static struct rcu_head **rcu_call_tail = &rcu_call_head;
+static bool rcu_call_started;
+static QemuThread rcu_call_thread;
+
+void rcu_register_thread(void)
+{
+    struct rcu_reader_data *p = rcu_reader_get();
+
+    qemu_mutex_lock(&rcu_registry_lock);
+    if (p->registered++ == 0) {
+        QLIST_INSERT_HEAD(&rcu_registry, p, node);
+    }
+    qemu_mutex_unlock(&rcu_registry_lock);
+}
+
+void rcu_unregister_thread(void)
+{
+    struct rcu_reader_data *p = rcu_reader_get();
+    bool last;
+
+    assert(p->depth == 0);
+    qemu_mutex_lock(&rcu_registry_lock);
+    last = --p->registered == 0;
+    if (last) {
+        QLIST_REMOVE(p, node);
+    }
+    qemu_mutex_unlock(&rcu_registry_lock);
+    if (last) {
+        rcu_reader_put(p);
+    }
+}
+
+static bool rcu_gp_ongoing(struct rcu_reader_data *p)
+{
+    unsigned long ctr = p->ctr;
+
+    return ctr && ctr != rcu_gp_ctr;
+}
+
+void synchronize_rcu(void)
+{
+    struct rcu_reader_data *p;
+    int spins;
+
+    assert(rcu_reader_get()->depth == 0);
+    qemu_mutex_lock(&rcu_gp_lock);
+
+    /* Order the removal of the old version before the new grace period,
+       and the counter update before looking at the readers.  */
+    smp_mb();
+    rcu_gp_ctr += RCU_GP_CTR;
+    smp_mb();
+
+    qemu_mutex_lock(&rcu_registry_lock);
+    QLIST_FOREACH(p, &rcu_registry, node) {
+        for (spins = 0; rcu_gp_ongoing(p); spins++) {
+            if (spins < 100) {
+                barrier();
+            } else {
+                g_usleep(100);
+            }
+        }
+    }
+    qemu_mutex_unlock(&rcu_registry_lock);
+
+    /* Readers are done with the old version before it is reclaimed.  */
+    smp_mb();
+    qemu_mutex_unlock(&rcu_gp_lock);
+}
+
+static void *call_rcu_thread_fn(void *opaque)
+{
+    struct rcu_head *head, *next;
+
+    for (;;) {
+        qemu_mutex_lock(&rcu_call_lock);
+        while (!rcu_call_head) {
+            qemu_cond_wait(&rcu_call_cond, &rcu_call_lock);
+        }
+        head = rcu_call_head;
+        rcu_call_head = NULL;
+        rcu_call_tail = &rcu_call_head;
+        qemu_mutex_unlock(&rcu_call_lock);
+
+        synchronize_rcu();
+        for (; head; head = next) {
+            next = head->next;
+            head->func(head);
+        }
+    }
+    return NULL;
+}
+
+void call_rcu(struct rcu_head *head, RCUCBFunc *func)
+{
+    head->next = NULL;
+    head->func = func;
+
+    qemu_mutex_lock(&rcu_call_lock);
+    /* started lazily so that it is not lost across -daemonize */
+    if (!rcu_call_started) {
+        rcu_call_started = true;
+        qemu_thread_create(&rcu_call_thread, call_rcu_thread_fn, NULL,
+                           QEMU_THREAD_DETACHED);
+    }
+    *rcu_call_tail = head;
+    rcu_call_tail = &head->next;
+    qemu_cond_signal(&rcu_call_cond);
+    qemu_mutex_unlock(&rcu_call_lock);
+}
+
+static void __attribute__((constructor)) rcu_init(void)
+{
+    rcu_reader_init();
+    qemu_mutex_init(&rcu_gp_lock);
+    qemu_mutex_init(&rcu_registry_lock);
+    qemu_mutex_init(&rcu_call_lock);
+    qemu_cond_init(&rcu_call_cond);
+    rcu_register_thread();
+}
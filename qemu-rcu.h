@@ -0,0 +1,110 @@
+/*
+ * Read-copy-update
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#ifndef QEMU_RCU_H
+#define QEMU_RCU_H 1
+
+#include <assert.h>
+#include "qemu-barrier.h"
+#include "qemu-queue.h"
+#include "qemu-tls.h"
+
+/* Readers bracket their accesses with rcu_read_lock() and
+ * rcu_read_unlock(), which never block and may nest.  Writers publish a
+ * new version of a structure with atomic_rcu_set() and hand the old one
+ * to call_rcu(), which frees it once every reader that might still be
+ * using it has left its critical section.
+ *
+ * A thread must call rcu_register_thread() before its first
+ * rcu_read_lock(); the main thread is registered automatically.
+ * synchronize_rcu() waits for a grace period and must never be called
+ * from a read-side critical section.  Since readers may block on the
+ * global mutex, writers holding it must use call_rcu() instead.
+ */
+
+struct rcu_reader_data {
+    /* snapshot of rcu_gp_ctr taken by the outermost rcu_read_lock(),
+       or 0 outside of read-side critical sections */
+    volatile unsigned long ctr;
+    unsigned depth;
+    unsigned registered;
+    QLIST_ENTRY(rcu_reader_data) node;
+};
+
+extern volatile unsigned long rcu_gp_ctr;
+
+/* qemu-tls.h only has real per-thread variables on Linux; elsewhere the
+ * reader state is allocated on first use and found through a
+ * pthread_getspecific() or Win32 TLS slot.
+ */
+#ifdef __linux__
+DECLARE_TLS(struct rcu_reader_data, rcu_reader);
+
+static inline struct rcu_reader_data *rcu_reader_get(void)
+{
+    return &tls_var(rcu_reader);
+}
+#else
+struct rcu_reader_data *rcu_reader_get(void);
+#endif
+
+static inline void rcu_read_lock(void)
+{
+    struct rcu_reader_data *p = rcu_reader_get();
+
+    if (p->depth++ > 0) {
+        return;
+    }
+    p->ctr = rcu_gp_ctr;
+    smp_mb();
+}
+
+static inline void rcu_read_unlock(void)
+{
+    struct rcu_reader_data *p = rcu_reader_get();
+
+    assert(p->depth > 0);
+    if (--p->depth > 0) {
+        return;
+    }
+    smp_mb();
+    p->ctr = 0;
+}
+
+/* Load a pointer published with atomic_rcu_set(); the result may only
+ * be dereferenced inside the read-side critical section.
+ */
+#define atomic_rcu_read(ptr) ({                                 \
+    typeof(*(ptr)) _val = *(volatile typeof(*(ptr)) *)(ptr);   \
+    smp_rmb();                                                  \
+    _val;                                                       \
+})
+
+/* Publish a pointer to a fully initialized structure. */
+#define atomic_rcu_set(ptr, val) do {                           \
+    smp_wmb();                                                  \
+    *(volatile typeof(*(ptr)) *)(ptr) = (val);                  \
+} while (0)
+
+void rcu_register_thread(void);
+void rcu_unregister_thread(void);
+void synchronize_rcu(void);
+
+struct rcu_head;
+typedef void RCUCBFunc(struct rcu_head *head);
+
+struct rcu_head {
+    struct rcu_head *next;
+    RCUCBFunc *func;
+};
+
+/* Run func(head) in the reclamation thread after a grace period.  Use
+ * container_of() in func to get at the enclosing structure.
+ */
+void call_rcu(struct rcu_head *head, RCUCBFunc *func);
+
+#endif
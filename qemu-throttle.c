@@ -0,0 +1,127 @@
+/*
+ * QEMU I/O throttling
+ *
+ * Copyright Red Hat, Inc. 2012
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#include "qemu-throttle.h"
+
+#define NANOSECONDS_PER_SECOND  1000000000.0
+
+/* Without an explicit burst size, allow one tenth of a second of I/O */
+#define THROTTLE_DEFAULT_BURST_DIVISOR 10
+
+void throttle_init(ThrottleState *ts, int64_t now)
+{
+    *ts = (ThrottleState) {
+        .previous_leak = now,
+    };
+}
+
+void throttle_config_bucket(LeakyBucket *bkt, double avg, double max)
+{
+    bkt->avg = avg;
+    bkt->max = max ? max : avg / THROTTLE_DEFAULT_BURST_DIVISOR;
+    if (bkt->level > bkt->max) {
+        bkt->level = bkt->max;
+    }
+}
+
+bool throttle_enabled(ThrottleState *ts)
+{
+    int i;
+
+    for (i = 0; i < THROTTLE_MAX; i++) {
+        if (ts->bps[i].avg || ts->ops[i].avg) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void throttle_leak_bucket(LeakyBucket *bkt, int64_t delta_ns)
+{
+    double leak = bkt->avg * delta_ns / NANOSECONDS_PER_SECOND;
+
+    bkt->level = bkt->level > leak ? bkt->level - leak : 0;
+}
+
+void throttle_leak(ThrottleState *ts, int64_t now)
+{
+    int64_t delta_ns = now - ts->previous_leak;
+    int i;
+
+    if (delta_ns <= 0) {
+        return;
+    }
+
+    ts->previous_leak = now;
+    for (i = 0; i < THROTTLE_MAX; i++) {
+        throttle_leak_bucket(&ts->bps[i], delta_ns);
+        throttle_leak_bucket(&ts->ops[i], delta_ns);
+    }
+}
+
+/* Returns the time in ns until the bucket is no longer full */
+static int64_t throttle_bucket_wait(LeakyBucket *bkt)
+{
+    double extra;
+
+    if (!bkt->avg) {
+        return 0;
+    }
+
+    extra = bkt->level - bkt->max;
+    if (extra <= 0) {
+        return 0;
+    }
+    return extra * NANOSECONDS_PER_SECOND / bkt->avg + 1;
+}
+
+/*
+ * Returns how many ns a request has to wait before it can be submitted,
+ * 0 if it can go now.  Only the buckets for its direction and the total
+ * ones are considered.
+ */
+int64_t throttle_compute_wait(ThrottleState *ts, bool is_write, int64_t now)
+{
+    int dir = is_write ? THROTTLE_WRITE : THROTTLE_READ;
+    int64_t wait, max_wait = 0;
+
+    throttle_leak(ts, now);
+
+    wait = throttle_bucket_wait(&ts->bps[dir]);
+    max_wait = wait > max_wait ? wait : max_wait;
+    wait = throttle_bucket_wait(&ts->bps[THROTTLE_TOTAL]);
+    max_wait = wait > max_wait ? wait : max_wait;
+    wait = throttle_bucket_wait(&ts->ops[dir]);
+    max_wait = wait > max_wait ? wait : max_wait;
+    wait = throttle_bucket_wait(&ts->ops[THROTTLE_TOTAL]);
+    max_wait = wait > max_wait ? wait : max_wait;
+
+    return max_wait;
+}
+
+/*
+ * Charge a request of @size bytes to the buckets.  With an operation size
+ * set, large requests count as several operations, so that splitting I/O
+ * in small requests does not change the IOPS accounting.
+ */
+void throttle_account(ThrottleState *ts, bool is_write, uint64_t size)
+{
+    int dir = is_write ? THROTTLE_WRITE : THROTTLE_READ;
+    double units = 1.0;
+
+    if (ts->op_size && size > ts->op_size) {
+        units = (double) size / ts->op_size;
+    }
+
+    ts->bps[dir].level += size;
+    ts->bps[THROTTLE_TOTAL].level += size;
+    ts->ops[dir].level += units;
+    ts->ops[THROTTLE_TOTAL].level += units;
+}
@@ -0,0 +1,50 @@
+/*
+ * QEMU I/O throttling
+ *
+ * Copyright Red Hat, Inc. 2012
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_THROTTLE_H
+#define QEMU_THROTTLE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Bucket indices; they match BLOCK_IO_LIMIT_* */
+enum {
+    THROTTLE_READ,
+    THROTTLE_WRITE,
+    THROTTLE_TOTAL,
+    THROTTLE_MAX,
+};
+
+/*
+ * A leaky bucket is filled by I/O and leaks at the average rate.  I/O
+ * can go on as long as the bucket is not full, so bursts of up to @max
+ * units are served at full speed before the average rate kicks in.
+ */
+typedef struct LeakyBucket {
+    double avg;             /* average goal in units per second, 0 if unset */
+    double max;             /* burst size in units */
+    double level;           /* current level in units */
+} LeakyBucket;
+
+typedef struct ThrottleState {
+    LeakyBucket bps[THROTTLE_MAX];
+    LeakyBucket ops[THROTTLE_MAX];
+    uint64_t op_size;       /* a request of op_size bytes counts as one op */
+    int64_t previous_leak;  /* time of the last leak, in ns */
+} ThrottleState;
+
+void throttle_init(ThrottleState *ts, int64_t now);
+void throttle_config_bucket(LeakyBucket *bkt, double avg, double max);
+bool throttle_enabled(ThrottleState *ts);
+void throttle_leak(ThrottleState *ts, int64_t now);
+int64_t throttle_compute_wait(ThrottleState *ts, bool is_write, int64_t now);
+void throttle_account(ThrottleState *ts, bool is_write, uint64_t size);
+
+#endif
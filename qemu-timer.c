@@ -33,6 +33,8 @@
 
 #ifdef _WIN32
 #include <mmsystem.h>
+#else
+#include <poll.h>
 #endif
 
 /***********************************************************/
@@ -42,10 +44,20 @@
 #define QEMU_CLOCK_VIRTUAL  1
 #define QEMU_CLOCK_HOST     2
 
+/*
+ * The active timers of a clock are a binary min-heap ordered by
+ * expiration time, then by the order they were armed in, so that
+ * arming, removing and finding the next timer do not depend on how
+ * many timers there are.
+ */
 struct QEMUClock {
-    QEMUTimer *active_timers;
+    QEMUTimer **active_timers;
+    int nb_active_timers;
+    int max_active_timers;
+    uint64_t armed;             /* sequence for timers with equal times */
 
     NotifierList reset_notifiers;
+    NotifierList enable_notifiers;
     int64_t last;
 
     int type;
@@ -57,7 +69,8 @@ struct QEMUTimer {
     QEMUClock *clock;
     QEMUTimerCB *cb;
     void *opaque;
-    QEMUTimer *next;
+    uint64_t seq;
+    int heap_index;             /* in active_timers, -1 if not pending */
     int scale;
 };
 
@@ -78,30 +91,91 @@ struct qemu_alarm_timer {
 
 static struct qemu_alarm_timer *alarm_timer;
 
+/* qemu_run_all_timers is running, the main loop looks at deadlines next */
+static bool timers_running;
+
 static bool qemu_timer_expired_ns(QEMUTimer *timer_head, int64_t current_time)
 {
     return timer_head && (timer_head->expire_time <= current_time);
 }
 
+/* The timer that expires first, or NULL */
+static inline QEMUTimer *qemu_clock_head(QEMUClock *clock)
+{
+    return clock->nb_active_timers ? clock->active_timers[0] : NULL;
+}
+
+static bool qemu_timer_before(QEMUTimer *a, QEMUTimer *b)
+{
+    return a->expire_time < b->expire_time ||
+           (a->expire_time == b->expire_time && a->seq < b->seq);
+}
+
+static void qemu_timer_heap_set(QEMUClock *clock, int i, QEMUTimer *ts)
+{
+    clock->active_timers[i] = ts;
+    ts->heap_index = i;
+}
+
+static void qemu_timer_heap_up(QEMUClock *clock, int i)
+{
+    QEMUTimer *ts = clock->active_timers[i];
+
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+
+        if (!qemu_timer_before(ts, clock->active_timers[parent])) {
+            break;
+        }
+        qemu_timer_heap_set(clock, i, clock->active_timers[parent]);
+        i = parent;
+    }
+    qemu_timer_heap_set(clock, i, ts);
+}
+
+static void qemu_timer_heap_down(QEMUClock *clock, int i)
+{
+    QEMUTimer *ts = clock->active_timers[i];
+    int n = clock->nb_active_timers;
+
+    for (;;) {
+        int child = 2 * i + 1;
+
+        if (child >= n) {
+            break;
+        }
+        if (child + 1 < n &&
+            qemu_timer_before(clock->active_timers[child + 1],
+                              clock->active_timers[child])) {
+            child++;
+        }
+        if (!qemu_timer_before(clock->active_timers[child], ts)) {
+            break;
+        }
+        qemu_timer_heap_set(clock, i, clock->active_timers[child]);
+        i = child;
+    }
+    qemu_timer_heap_set(clock, i, ts);
+}
+
 static int64_t qemu_next_alarm_deadline(void)
 {
     int64_t delta = INT64_MAX;
     int64_t rtdelta;
+    QEMUTimer *head;
 
-    if (!use_icount && vm_clock->enabled && vm_clock->active_timers) {
-        delta = vm_clock->active_timers->expire_time -
-                     qemu_get_clock_ns(vm_clock);
+    if (!use_icount && vm_clock->enabled &&
+        (head = qemu_clock_head(vm_clock))) {
+        delta = head->expire_time - qemu_get_clock_ns(vm_clock);
     }
-    if (host_clock->enabled && host_clock->active_timers) {
-        int64_t hdelta = host_clock->active_timers->expire_time -
-                 qemu_get_clock_ns(host_clock);
+    if (host_clock->enabled && (head = qemu_clock_head(host_clock))) {
+        int64_t hdelta = head->expire_time - qemu_get_clock_ns(host_clock);
         if (hdelta < delta) {
             delta = hdelta;
         }
     }
-    if (rt_clock->enabled && rt_clock->active_timers) {
-        rtdelta = (rt_clock->active_timers->expire_time -
-                 qemu_get_clock_ns(rt_clock));
+    if (rt_clock->enabled && (head = qemu_clock_head(rt_clock))) {
+        rtdelta = head->expire_time - qemu_get_clock_ns(rt_clock);
         if (rtdelta < delta) {
             delta = rtdelta;
         }
@@ -133,6 +207,10 @@ static void win32_rearm_timer(struct qemu_alarm_timer *t, int64_t delta);
 
 #else
 
+static int poll_start_timer(struct qemu_alarm_timer *t);
+static void poll_stop_timer(struct qemu_alarm_timer *t);
+static void poll_rearm_timer(struct qemu_alarm_timer *t, int64_t delta);
+
 static int unix_start_timer(struct qemu_alarm_timer *t);
 static void unix_stop_timer(struct qemu_alarm_timer *t);
 static void unix_rearm_timer(struct qemu_alarm_timer *t, int64_t delta);
@@ -149,6 +227,7 @@ static void dynticks_rearm_timer(struct qemu_alarm_timer *t, int64_t delta);
 
 static struct qemu_alarm_timer alarm_timers[] = {
 #ifndef _WIN32
+    {"poll", poll_start_timer, poll_stop_timer, poll_rearm_timer},
 #ifdef __linux__
     {"dynticks", dynticks_start_timer,
      dynticks_stop_timer, dynticks_rearm_timer},
@@ -238,6 +317,7 @@ static QEMUClock *qemu_new_clock(int type)
     clock->enabled = true;
     clock->last = INT64_MIN;
     notifier_list_init(&clock->reset_notifiers);
+    notifier_list_init(&clock->enable_notifiers);
     return clock;
 }
 
@@ -247,27 +327,35 @@ void qemu_clock_enable(QEMUClock *clock, bool enabled)
     clock->enabled = enabled;
     if (enabled && !old) {
         qemu_rearm_alarm_timer(alarm_timer);
+        notifier_list_notify(&clock->enable_notifiers, NULL);
     }
 }
 
+bool qemu_clock_enabled(QEMUClock *clock)
+{
+    return clock->enabled;
+}
+
 int64_t qemu_clock_has_timers(QEMUClock *clock)
 {
-    return !!clock->active_timers;
+    return !!clock->nb_active_timers;
 }
 
 int64_t qemu_clock_expired(QEMUClock *clock)
 {
-    return (clock->active_timers &&
-            clock->active_timers->expire_time < qemu_get_clock_ns(clock));
+    QEMUTimer *head = qemu_clock_head(clock);
+
+    return head && head->expire_time < qemu_get_clock_ns(clock);
 }
 
 int64_t qemu_clock_deadline(QEMUClock *clock)
 {
     /* To avoid problems with overflow limit this to 2^32.  */
     int64_t delta = INT32_MAX;
+    QEMUTimer *head = qemu_clock_head(clock);
 
-    if (clock->active_timers) {
-        delta = clock->active_timers->expire_time - qemu_get_clock_ns(clock);
+    if (head) {
+        delta = head->expire_time - qemu_get_clock_ns(clock);
     }
     if (delta < 0) {
         delta = 0;
@@ -285,6 +373,7 @@ QEMUTimer *qemu_new_timer(QEMUClock *clock, int scale,
     ts->cb = cb;
     ts->opaque = opaque;
     ts->scale = scale;
+    ts->heap_index = -1;
     return ts;
 }
 
@@ -296,20 +385,25 @@ void qemu_free_timer(QEMUTimer *ts)
 /* stop a timer, but do not dealloc it */
 void qemu_del_timer(QEMUTimer *ts)
 {
-    QEMUTimer **pt, *t;
+    QEMUClock *clock = ts->clock;
+    int i = ts->heap_index;
+    QEMUTimer *last;
 
-    /* NOTE: this code must be signal safe because
-       qemu_timer_expired() can be called from a signal. */
-    pt = &ts->clock->active_timers;
-    for(;;) {
-        t = *pt;
-        if (!t)
-            break;
-        if (t == ts) {
-            *pt = t->next;
-            break;
-        }
-        pt = &t->next;
+    if (i < 0) {
+        return;
+    }
+    ts->heap_index = -1;
+
+    last = clock->active_timers[--clock->nb_active_timers];
+    if (last == ts) {
+        return;
+    }
+    /* the last timer takes the hole and moves to where it belongs */
+    qemu_timer_heap_set(clock, i, last);
+    if (i > 0 && qemu_timer_before(last, clock->active_timers[(i - 1) / 2])) {
+        qemu_timer_heap_up(clock, i);
+    } else {
+        qemu_timer_heap_down(clock, i);
     }
 }
 
@@ -317,27 +411,22 @@ void qemu_del_timer(QEMUTimer *ts)
    >= expire_time. The corresponding callback will be called. */
 void qemu_mod_timer_ns(QEMUTimer *ts, int64_t expire_time)
 {
-    QEMUTimer **pt, *t;
+    QEMUClock *clock = ts->clock;
 
     qemu_del_timer(ts);
 
-    /* add the timer in the sorted list */
-    /* NOTE: this code must be signal safe because
-       qemu_timer_expired() can be called from a signal. */
-    pt = &ts->clock->active_timers;
-    for(;;) {
-        t = *pt;
-        if (!qemu_timer_expired_ns(t, expire_time)) {
-            break;
-        }
-        pt = &t->next;
+    if (clock->nb_active_timers == clock->max_active_timers) {
+        clock->max_active_timers = MAX(16, clock->max_active_timers * 2);
+        clock->active_timers = g_renew(QEMUTimer *, clock->active_timers,
+                                       clock->max_active_timers);
     }
     ts->expire_time = expire_time;
-    ts->next = *pt;
-    *pt = ts;
+    ts->seq = clock->armed++;
+    qemu_timer_heap_set(clock, clock->nb_active_timers++, ts);
+    qemu_timer_heap_up(clock, ts->heap_index);
 
     /* Rearm if necessary  */
-    if (pt == &ts->clock->active_timers) {
+    if (ts->heap_index == 0) {
         if (!alarm_timer->pending) {
             qemu_rearm_alarm_timer(alarm_timer);
         }
@@ -356,13 +445,7 @@ void qemu_mod_timer(QEMUTimer *ts, int64_t expire_time)
 
 bool qemu_timer_pending(QEMUTimer *ts)
 {
-    QEMUTimer *t;
-    for (t = ts->clock->active_timers; t != NULL; t = t->next) {
-        if (t == ts) {
-            return true;
-        }
-    }
-    return false;
+    return ts->heap_index >= 0;
 }
 
 bool qemu_timer_expired(QEMUTimer *timer_head, int64_t current_time)
@@ -372,24 +455,22 @@ bool qemu_timer_expired(QEMUTimer *timer_head, int64_t current_time)
 
 void qemu_run_timers(QEMUClock *clock)
 {
-    QEMUTimer **ptimer_head, *ts;
+    QEMUTimer *ts;
     int64_t current_time;
    
     if (!clock->enabled)
         return;
 
     current_time = qemu_get_clock_ns(clock);
-    ptimer_head = &clock->active_timers;
     for(;;) {
-        ts = *ptimer_head;
+        ts = qemu_clock_head(clock);
         if (!qemu_timer_expired_ns(ts, current_time)) {
             break;
         }
-        /* remove timer from the list before calling the callback */
-        *ptimer_head = ts->next;
-        ts->next = NULL;
+        /* remove timer from the heap before calling the callback */
+        qemu_del_timer(ts);
 
-        /* run the callback (the timer list can be modified) */
+        /* run the callback (the timers can be modified) */
         ts->cb(ts->opaque);
     }
 }
@@ -429,6 +510,17 @@ void qemu_unregister_clock_reset_notifier(QEMUClock *clock, Notifier *notifier)
     notifier_remove(notifier);
 }
 
+void qemu_register_clock_enable_notifier(QEMUClock *clock, Notifier *notifier)
+{
+    notifier_list_add(&clock->enable_notifiers, notifier);
+}
+
+void qemu_unregister_clock_enable_notifier(QEMUClock *clock,
+                                           Notifier *notifier)
+{
+    notifier_remove(notifier);
+}
+
 void init_clocks(void)
 {
     rt_clock = qemu_new_clock(QEMU_CLOCK_REALTIME);
@@ -436,6 +528,53 @@ void init_clocks(void)
     host_clock = qemu_new_clock(QEMU_CLOCK_HOST);
 }
 
+/* Round up, so that a wait does not end before the deadline */
+int qemu_timeout_ns_to_ms(int64_t ns)
+{
+    int64_t ms;
+
+    if (ns < 0) {
+        return -1;
+    }
+    ms = (ns + SCALE_MS - 1) / SCALE_MS;
+    return MIN(ms, INT32_MAX);
+}
+
+int qemu_poll_ns(GPollFD *fds, guint nfds, int64_t timeout)
+{
+#ifdef CONFIG_PPOLL
+    /* GPollFD and struct pollfd are the same on POSIX hosts */
+    if (timeout < 0) {
+        return ppoll((struct pollfd *)fds, nfds, NULL, NULL);
+    } else {
+        struct timespec ts;
+
+        ts.tv_sec = timeout / 1000000000LL;
+        ts.tv_nsec = timeout % 1000000000LL;
+        return ppoll((struct pollfd *)fds, nfds, &ts, NULL);
+    }
+#elif !defined(_WIN32)
+    return poll((struct pollfd *)fds, nfds, qemu_timeout_ns_to_ms(timeout));
+#else
+    return g_poll(fds, nfds, qemu_timeout_ns_to_ms(timeout));
+#endif
+}
+
+int64_t qemu_timer_poll_timeout_ns(void)
+{
+#ifndef _WIN32
+    int64_t delta;
+
+    if (alarm_timer && alarm_timer->start == poll_start_timer) {
+        delta = qemu_next_alarm_deadline();
+        if (delta < INT64_MAX) {
+            return MAX(delta, 0);
+        }
+    }
+#endif
+    return -1;
+}
+
 uint64_t qemu_timer_expire_time_ns(QEMUTimer *ts)
 {
     return qemu_timer_pending(ts) ? ts->expire_time : -1;
@@ -446,9 +585,11 @@ void qemu_run_all_timers(void)
     alarm_timer->pending = false;
 
     /* vm time timers */
+    timers_running = true;
     qemu_run_timers(vm_clock);
     qemu_run_timers(rt_clock);
     qemu_run_timers(host_clock);
+    timers_running = false;
 
     /* rearm timer, if not periodic */
     if (alarm_timer->expired) {
@@ -555,6 +696,29 @@ static void dynticks_rearm_timer(struct qemu_alarm_timer *t,
 
 #if !defined(_WIN32)
 
+/*
+ * No host timer and no signals: the main loop does not sleep past the
+ * next deadline (see qemu_timer_poll_timeout_ns).  Only a timer that
+ * became the first one while the main loop sleeps needs a wakeup, so
+ * that it picks up the new deadline.
+ */
+static int poll_start_timer(struct qemu_alarm_timer *t)
+{
+    return 0;
+}
+
+static void poll_stop_timer(struct qemu_alarm_timer *t)
+{
+}
+
+static void poll_rearm_timer(struct qemu_alarm_timer *t,
+                             int64_t nearest_delta_ns)
+{
+    if (!timers_running) {
+        qemu_notify_event();
+    }
+}
+
 static int unix_start_timer(struct qemu_alarm_timer *t)
 {
     struct sigaction act;
@@ -15,7 +15,6 @@
 #define SCALE_US 1000
 #define SCALE_NS 1
 
-typedef struct QEMUClock QEMUClock;
 typedef void QEMUTimerCB(void *opaque);
 
 /* The real time clock should be used only for stuff which does not
@@ -41,12 +40,18 @@ int64_t qemu_clock_has_timers(QEMUClock *clock);
 int64_t qemu_clock_expired(QEMUClock *clock);
 int64_t qemu_clock_deadline(QEMUClock *clock);
 void qemu_clock_enable(QEMUClock *clock, bool enabled);
+bool qemu_clock_enabled(QEMUClock *clock);
 void qemu_clock_warp(QEMUClock *clock);
 
 void qemu_register_clock_reset_notifier(QEMUClock *clock, Notifier *notifier);
 void qemu_unregister_clock_reset_notifier(QEMUClock *clock,
                                           Notifier *notifier);
 
+/* Called when a disabled clock is enabled again */
+void qemu_register_clock_enable_notifier(QEMUClock *clock, Notifier *notifier);
+void qemu_unregister_clock_enable_notifier(QEMUClock *clock,
+                                           Notifier *notifier);
+
 QEMUTimer *qemu_new_timer(QEMUClock *clock, int scale,
                           QEMUTimerCB *cb, void *opaque);
 void qemu_free_timer(QEMUTimer *ts);
@@ -63,6 +68,16 @@ void configure_alarms(char const *opt);
 void init_clocks(void);
 int init_timer_alarm(void);
 
+/* Timeouts are in nanoseconds, -1 waits forever */
+int qemu_timeout_ns_to_ms(int64_t ns);
+int qemu_poll_ns(GPollFD *fds, guint nfds, int64_t timeout);
+
+/*
+ * How long the main loop may wait before timers are due, if it is what
+ * wakes them up (the "poll" alarm timer), else -1
+ */
+int64_t qemu_timer_poll_timeout_ns(void);
+
 int64_t cpu_get_ticks(void);
 void cpu_enable_ticks(void);
 void cpu_disable_ticks(void);
@@ -283,6 +298,16 @@ static inline int64_t cpu_get_real_ticks(void)
     return cur - ofs;
 }
 
+#elif defined(__aarch64__)
+
+static inline int64_t cpu_get_real_ticks(void)
+{
+    int64_t val;
+
+    asm volatile("mrs %0, cntvct_el0" : "=r"(val));
+    return val;
+}
+
 #else
 /* The host CPU doesn't have an easily accessible cycle counter.
    Just return a monotonically increasing value.  This will be
@@ -51,6 +51,9 @@ void assert_no_error(Error *err);
 #define QERR_BLOCK_FORMAT_FEATURE_NOT_SUPPORTED \
     ERROR_CLASS_GENERIC_ERROR, "Block format '%s' used by device '%s' does not support feature '%s'"
 
+#define QERR_BLOCK_JOB_NOT_READY \
+    ERROR_CLASS_GENERIC_ERROR, "The active block job for device '%s' cannot be completed"
+
 #define QERR_BUFFER_OVERRUN \
     ERROR_CLASS_GENERIC_ERROR, "An internal buffer overran"
 
@@ -125,6 +125,8 @@ static GuestFileHandle *guest_file_handle_find(int64_t id)
     return NULL;
 }
 
+static void guest_transfer_cancel(GuestFileHandle *gfh);
+
 int64_t qmp_guest_file_open(const char *path, bool has_mode, const char *mode, Error **err)
 {
     FILE *fh;
@@ -175,6 +177,7 @@ void qmp_guest_file_close(int64_t handle, Error **err)
         return;
     }
 
+    guest_transfer_cancel(gfh);
     QTAILQ_REMOVE(&guest_file_state.filehandles, gfh, next);
     g_free(gfh);
 }
@@ -312,6 +315,389 @@ static void guest_file_init(void)
     QTAILQ_INIT(&guest_file_state.filehandles);
 }
 
+/*
+ * Bulk file transfers.  The data of guest-file-transfer goes over a second
+ * virtio-serial port as raw frames, see qapi-schema-guest.json, instead of
+ * base64 inside JSON; frames are up to 1MB so that a transfer takes few
+ * system calls, and the frames of all read transfers are sent round robin.
+ */
+
+#define QGA_TRANSFER_PATH_DEFAULT "/dev/virtio-ports/org.qemu.guest_agent.1"
+#define QGA_TRANSFER_FRAME_MAX (1 << 20)
+
+typedef struct GuestTransferHeader {
+    uint32_t id;
+    uint32_t len;
+} QEMU_PACKED GuestTransferHeader;
+
+#define QGA_TRANSFER_BUF_SIZE \
+    (sizeof(GuestTransferHeader) + QGA_TRANSFER_FRAME_MAX)
+
+typedef struct GuestTransfer {
+    uint32_t id;
+    GuestFileHandle *gfh;
+    bool write;
+    int64_t remaining;          /* bytes left to read, -1 for up to EOF */
+    int64_t count;
+    bool done;
+    bool failed;
+    QTAILQ_ENTRY(GuestTransfer) next;
+} GuestTransfer;
+
+static struct {
+    int fd;
+    GIOChannel *channel;
+    guint in_watch;
+    guint out_watch;
+    uint32_t next_id;
+    QTAILQ_HEAD(, GuestTransfer) transfers;
+    /* frame being received, in_xfer is NULL if its payload is discarded */
+    uint8_t *in_buf;
+    GuestTransferHeader in_hdr;
+    size_t in_hdr_len;
+    size_t in_left;
+    GuestTransfer *in_xfer;
+    /* frame being sent */
+    uint8_t *out_buf;
+    size_t out_len;
+    size_t out_pos;
+} guest_transfer_state;
+
+static GuestTransfer *guest_transfer_find(int64_t id)
+{
+    GuestTransfer *xfer;
+
+    QTAILQ_FOREACH(xfer, &guest_transfer_state.transfers, next) {
+        if (xfer->id == id) {
+            return xfer;
+        }
+    }
+
+    return NULL;
+}
+
+static void guest_transfer_free(GuestTransfer *xfer)
+{
+    if (guest_transfer_state.in_xfer == xfer) {
+        guest_transfer_state.in_xfer = NULL;
+    }
+    QTAILQ_REMOVE(&guest_transfer_state.transfers, xfer, next);
+    g_free(xfer);
+}
+
+/* transfers in progress fail, they may be restarted on a new channel */
+static void guest_transfer_channel_close(void)
+{
+    GuestTransfer *xfer;
+
+    if (guest_transfer_state.fd == -1) {
+        return;
+    }
+    if (guest_transfer_state.in_watch) {
+        g_source_remove(guest_transfer_state.in_watch);
+        guest_transfer_state.in_watch = 0;
+    }
+    if (guest_transfer_state.out_watch) {
+        g_source_remove(guest_transfer_state.out_watch);
+        guest_transfer_state.out_watch = 0;
+    }
+    g_io_channel_unref(guest_transfer_state.channel);
+    guest_transfer_state.channel = NULL;
+    close(guest_transfer_state.fd);
+    guest_transfer_state.fd = -1;
+
+    QTAILQ_FOREACH(xfer, &guest_transfer_state.transfers, next) {
+        if (!xfer->done) {
+            xfer->done = xfer->failed = true;
+        }
+    }
+    guest_transfer_state.in_hdr_len = 0;
+    guest_transfer_state.in_left = 0;
+    guest_transfer_state.in_xfer = NULL;
+    guest_transfer_state.out_len = guest_transfer_state.out_pos = 0;
+    g_free(guest_transfer_state.in_buf);
+    g_free(guest_transfer_state.out_buf);
+    guest_transfer_state.in_buf = guest_transfer_state.out_buf = NULL;
+}
+
+static void guest_transfer_frame_start(void)
+{
+    GuestTransfer *xfer;
+    uint32_t id = be32_to_cpu(guest_transfer_state.in_hdr.id);
+
+    guest_transfer_state.in_left = be32_to_cpu(guest_transfer_state.in_hdr.len);
+    xfer = guest_transfer_find(id);
+    if (xfer && (!xfer->write || xfer->done)) {
+        xfer = NULL;
+    }
+    if (!xfer) {
+        g_debug("discarding bulk frame for transfer %u", id);
+    }
+    guest_transfer_state.in_xfer = xfer;
+
+    if (!guest_transfer_state.in_left) {
+        /* end of transfer */
+        if (xfer) {
+            if (fflush(xfer->gfh->fh) == EOF) {
+                xfer->failed = true;
+            }
+            clearerr(xfer->gfh->fh);
+            xfer->done = true;
+        }
+        guest_transfer_state.in_hdr_len = 0;
+    }
+}
+
+static gboolean guest_transfer_in(GIOChannel *channel, GIOCondition condition,
+                                  gpointer opaque)
+{
+    GuestTransfer *xfer;
+    uint8_t *p = guest_transfer_state.in_buf;
+    ssize_t len;
+    size_t n;
+
+    len = read(guest_transfer_state.fd, p, QGA_TRANSFER_BUF_SIZE);
+    if (len == -1 && (errno == EAGAIN || errno == EINTR)) {
+        return true;
+    }
+    if (len <= 0) {
+        /* the host closed the port, or the channel broke */
+        g_debug("closing bulk transfer channel");
+        guest_transfer_state.in_watch = 0;
+        guest_transfer_channel_close();
+        return false;
+    }
+
+    while (len) {
+        if (guest_transfer_state.in_hdr_len < sizeof(GuestTransferHeader)) {
+            n = MIN(len, sizeof(GuestTransferHeader) -
+                         guest_transfer_state.in_hdr_len);
+            memcpy((uint8_t *)&guest_transfer_state.in_hdr +
+                   guest_transfer_state.in_hdr_len, p, n);
+            guest_transfer_state.in_hdr_len += n;
+            if (guest_transfer_state.in_hdr_len ==
+                sizeof(GuestTransferHeader)) {
+                guest_transfer_frame_start();
+            }
+        } else {
+            n = MIN(len, guest_transfer_state.in_left);
+            xfer = guest_transfer_state.in_xfer;
+            if (xfer && !xfer->failed) {
+                if (fwrite(p, 1, n, xfer->gfh->fh) != n) {
+                    slog("guest-file-transfer write failed, handle: %ld",
+                         (long)xfer->gfh->id);
+                    xfer->failed = true;
+                    clearerr(xfer->gfh->fh);
+                } else {
+                    xfer->count += n;
+                }
+            }
+            guest_transfer_state.in_left -= n;
+            if (!guest_transfer_state.in_left) {
+                guest_transfer_state.in_hdr_len = 0;
+            }
+        }
+        p += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+/* read the next frame to send, false if no read transfer is pending */
+static bool guest_transfer_fill(void)
+{
+    GuestTransferHeader *hdr = (GuestTransferHeader *)guest_transfer_state.out_buf;
+    GuestTransfer *xfer;
+    FILE *fh;
+    size_t size, n = 0;
+
+    QTAILQ_FOREACH(xfer, &guest_transfer_state.transfers, next) {
+        if (!xfer->write && !xfer->done) {
+            break;
+        }
+    }
+    if (!xfer) {
+        return false;
+    }
+
+    fh = xfer->gfh->fh;
+    size = QGA_TRANSFER_FRAME_MAX;
+    if (xfer->remaining >= 0) {
+        size = MIN(size, xfer->remaining);
+    }
+    if (size && !feof(fh)) {
+        n = fread(hdr + 1, 1, size, fh);
+        if (ferror(fh)) {
+            slog("guest-file-transfer read failed, handle: %ld",
+                 (long)xfer->gfh->id);
+            xfer->failed = true;
+            n = 0;
+        }
+    }
+
+    hdr->id = cpu_to_be32(xfer->id);
+    hdr->len = cpu_to_be32(n);
+    guest_transfer_state.out_len = sizeof(GuestTransferHeader) + n;
+    guest_transfer_state.out_pos = 0;
+    if (n) {
+        xfer->count += n;
+        if (xfer->remaining >= 0) {
+            xfer->remaining -= n;
+        }
+        /* let the other read transfers have a turn */
+        QTAILQ_REMOVE(&guest_transfer_state.transfers, xfer, next);
+        QTAILQ_INSERT_TAIL(&guest_transfer_state.transfers, xfer, next);
+    } else {
+        clearerr(fh);
+        xfer->done = true;
+    }
+
+    return true;
+}
+
+static gboolean guest_transfer_out(GIOChannel *channel, GIOCondition condition,
+                                   gpointer opaque)
+{
+    ssize_t len;
+
+    for (;;) {
+        if (guest_transfer_state.out_pos == guest_transfer_state.out_len &&
+            !guest_transfer_fill()) {
+            guest_transfer_state.out_watch = 0;
+            return false;
+        }
+        len = write(guest_transfer_state.fd,
+                    guest_transfer_state.out_buf + guest_transfer_state.out_pos,
+                    guest_transfer_state.out_len - guest_transfer_state.out_pos);
+        if (len == -1) {
+            if (errno == EAGAIN || errno == EINTR) {
+                return true;
+            }
+            g_warning("error writing bulk transfer channel: %s",
+                      strerror(errno));
+            guest_transfer_state.out_watch = 0;
+            guest_transfer_channel_close();
+            return false;
+        }
+        guest_transfer_state.out_pos += len;
+    }
+}
+
+static bool guest_transfer_channel_open(const char *path, Error **err)
+{
+    int fd;
+
+    fd = qemu_open(path, O_RDWR | O_NONBLOCK);
+    if (fd == -1) {
+        error_set(err, QERR_OPEN_FILE_FAILED, path);
+        return false;
+    }
+
+    guest_transfer_state.fd = fd;
+    guest_transfer_state.channel = g_io_channel_unix_new(fd);
+    guest_transfer_state.in_buf = g_malloc(QGA_TRANSFER_BUF_SIZE);
+    guest_transfer_state.out_buf = g_malloc(QGA_TRANSFER_BUF_SIZE);
+    guest_transfer_state.in_watch =
+        g_io_add_watch(guest_transfer_state.channel, G_IO_IN | G_IO_HUP,
+                       guest_transfer_in, NULL);
+    return true;
+}
+
+int64_t qmp_guest_file_transfer(int64_t handle, GuestFileTransferMode mode,
+                                bool has_count, int64_t count,
+                                bool has_path, const char *path, Error **err)
+{
+    GuestFileHandle *gfh = guest_file_handle_find(handle);
+    GuestTransfer *xfer;
+
+    if (!gfh) {
+        error_set(err, QERR_FD_NOT_FOUND, "handle");
+        return -1;
+    }
+    if (has_count && count < 0) {
+        error_set(err, QERR_INVALID_PARAMETER, "count");
+        return -1;
+    }
+
+    if (!has_path) {
+        path = QGA_TRANSFER_PATH_DEFAULT;
+    }
+    if (guest_transfer_state.fd == -1 &&
+        !guest_transfer_channel_open(path, err)) {
+        return -1;
+    }
+
+    xfer = g_malloc0(sizeof(GuestTransfer));
+    do {
+        xfer->id = guest_transfer_state.next_id++;
+    } while (guest_transfer_find(xfer->id));
+    xfer->gfh = gfh;
+    xfer->write = mode == GUEST_FILE_TRANSFER_MODE_WRITE;
+    xfer->remaining = has_count ? count : -1;
+    QTAILQ_INSERT_TAIL(&guest_transfer_state.transfers, xfer, next);
+
+    if (!xfer->write && !guest_transfer_state.out_watch) {
+        guest_transfer_state.out_watch =
+            g_io_add_watch(guest_transfer_state.channel, G_IO_OUT,
+                           guest_transfer_out, NULL);
+    }
+
+    slog("guest-file-transfer called, handle: %ld, id: %u",
+         (long)handle, xfer->id);
+    return xfer->id;
+}
+
+GuestFileTransferStatus *qmp_guest_file_transfer_status(int64_t id,
+                                                        Error **err)
+{
+    GuestTransfer *xfer = guest_transfer_find(id);
+    GuestFileTransferStatus *status;
+
+    if (!xfer) {
+        error_set(err, QERR_INVALID_PARAMETER, "id");
+        return NULL;
+    }
+
+    status = g_malloc0(sizeof(GuestFileTransferStatus));
+    status->count = xfer->count;
+    status->done = xfer->done;
+    status->failed = xfer->failed;
+    if (xfer->done) {
+        guest_transfer_free(xfer);
+    }
+
+    return status;
+}
+
+/* transfers of a file end when it is closed */
+static void guest_transfer_cancel(GuestFileHandle *gfh)
+{
+    GuestTransfer *xfer, *tmp;
+
+    QTAILQ_FOREACH_SAFE(xfer, &guest_transfer_state.transfers, next, tmp) {
+        if (xfer->gfh == gfh) {
+            guest_transfer_free(xfer);
+        }
+    }
+}
+
+static void guest_transfer_init(void)
+{
+    guest_transfer_state.fd = -1;
+    QTAILQ_INIT(&guest_transfer_state.transfers);
+}
+
+static void guest_transfer_cleanup(void)
+{
+    GuestTransfer *xfer;
+
+    guest_transfer_channel_close();
+    while ((xfer = QTAILQ_FIRST(&guest_transfer_state.transfers)) != NULL) {
+        guest_transfer_free(xfer);
+    }
+}
+
 /* linux-specific implementations. avoid this if at all possible. */
 #if defined(__linux__)
 
@@ -1000,4 +1386,5 @@ void ga_command_state_init(GAState *s, GACommandState *cs)
     ga_command_state_add(cs, NULL, guest_fsfreeze_cleanup);
 #endif
     ga_command_state_add(cs, guest_file_init, NULL);
+    ga_command_state_add(cs, guest_transfer_init, guest_transfer_cleanup);
 }
@@ -145,6 +145,21 @@ void qmp_guest_file_flush(int64_t handle, Error **err)
     error_set(err, QERR_UNSUPPORTED);
 }
 
+int64_t qmp_guest_file_transfer(int64_t handle, GuestFileTransferMode mode,
+                                bool has_count, int64_t count,
+                                bool has_path, const char *path, Error **err)
+{
+    error_set(err, QERR_UNSUPPORTED);
+    return 0;
+}
+
+GuestFileTransferStatus *qmp_guest_file_transfer_status(int64_t id,
+                                                        Error **err)
+{
+    error_set(err, QERR_UNSUPPORTED);
+    return 0;
+}
+
 /*
  * Return status of freeze/thaw
  */
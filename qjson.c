@@ -28,7 +28,7 @@ typedef struct JSONParsingState
     QObject *result;
 } JSONParsingState;
 
-static void parse_json(JSONMessageParser *parser, QList *tokens)
+static void parse_json(JSONMessageParser *parser, GPtrArray *tokens)
 {
     JSONParsingState *s = container_of(parser, JSONParsingState, parser);
     s->result = json_parser_parse(tokens, s->ap);
@@ -78,12 +78,95 @@ typedef struct ToJsonIterState
     QString *str;
 } ToJsonIterState;
 
+void qjson_append_str(QString *str, const char *ptr)
+{
+    qstring_append(str, "\"");
+    while (*ptr) {
+        if ((ptr[0] & 0xE0) == 0xE0 &&
+            (ptr[1] & 0x80) && (ptr[2] & 0x80)) {
+            uint16_t wchar;
+            char escape[7];
+
+            wchar  = (ptr[0] & 0x0F) << 12;
+            wchar |= (ptr[1] & 0x3F) << 6;
+            wchar |= (ptr[2] & 0x3F);
+            ptr += 2;
+
+            snprintf(escape, sizeof(escape), "\\u%04X", wchar);
+            qstring_append(str, escape);
+        } else if ((ptr[0] & 0xE0) == 0xC0 && (ptr[1] & 0x80)) {
+            uint16_t wchar;
+            char escape[7];
+
+            wchar  = (ptr[0] & 0x1F) << 6;
+            wchar |= (ptr[1] & 0x3F);
+            ptr++;
+
+            snprintf(escape, sizeof(escape), "\\u%04X", wchar);
+            qstring_append(str, escape);
+        } else switch (ptr[0]) {
+            case '\"':
+                qstring_append(str, "\\\"");
+                break;
+            case '\\':
+                qstring_append(str, "\\\\");
+                break;
+            case '\b':
+                qstring_append(str, "\\b");
+                break;
+            case '\f':
+                qstring_append(str, "\\f");
+                break;
+            case '\n':
+                qstring_append(str, "\\n");
+                break;
+            case '\r':
+                qstring_append(str, "\\r");
+                break;
+            case '\t':
+                qstring_append(str, "\\t");
+                break;
+            default: {
+                if (ptr[0] <= 0x1F) {
+                    char escape[7];
+                    snprintf(escape, sizeof(escape), "\\u%04X", ptr[0]);
+                    qstring_append(str, escape);
+                } else {
+                    char buf[2] = { ptr[0], 0 };
+                    qstring_append(str, buf);
+                }
+                break;
+            }
+            }
+        ptr++;
+    }
+    qstring_append(str, "\"");
+}
+
+void qjson_append_number(QString *str, double number)
+{
+    char buffer[1024];
+    int len;
+
+    len = snprintf(buffer, sizeof(buffer), "%f", number);
+    while (len > 0 && buffer[len - 1] == '0') {
+        len--;
+    }
+
+    if (len && buffer[len - 1] == '.') {
+        buffer[len - 1] = 0;
+    } else {
+        buffer[len] = 0;
+    }
+
+    qstring_append(str, buffer);
+}
+
 static void to_json(const QObject *obj, QString *str, int pretty, int indent);
 
 static void to_json_dict_iter(const char *key, QObject *obj, void *opaque)
 {
     ToJsonIterState *s = opaque;
-    QString *qkey;
     int j;
 
     if (s->count)
@@ -95,9 +178,7 @@ static void to_json_dict_iter(const char *key, QObject *obj, void *opaque)
             qstring_append(s->str, "    ");
     }
 
-    qkey = qstring_from_str(key);
-    to_json(QOBJECT(qkey), s->str, s->pretty, s->indent);
-    QDECREF(qkey);
+    qjson_append_str(s->str, key);
 
     qstring_append(s->str, ": ");
     to_json(obj, s->str, s->pretty, s->indent);
@@ -135,70 +216,8 @@ static void to_json(const QObject *obj, QString *str, int pretty, int indent)
     }
     case QTYPE_QSTRING: {
         QString *val = qobject_to_qstring(obj);
-        const char *ptr;
-
-        ptr = qstring_get_str(val);
-        qstring_append(str, "\"");
-        while (*ptr) {
-            if ((ptr[0] & 0xE0) == 0xE0 &&
-                (ptr[1] & 0x80) && (ptr[2] & 0x80)) {
-                uint16_t wchar;
-                char escape[7];
-
-                wchar  = (ptr[0] & 0x0F) << 12;
-                wchar |= (ptr[1] & 0x3F) << 6;
-                wchar |= (ptr[2] & 0x3F);
-                ptr += 2;
-
-                snprintf(escape, sizeof(escape), "\\u%04X", wchar);
-                qstring_append(str, escape);
-            } else if ((ptr[0] & 0xE0) == 0xC0 && (ptr[1] & 0x80)) {
-                uint16_t wchar;
-                char escape[7];
-
-                wchar  = (ptr[0] & 0x1F) << 6;
-                wchar |= (ptr[1] & 0x3F);
-                ptr++;
-
-                snprintf(escape, sizeof(escape), "\\u%04X", wchar);
-                qstring_append(str, escape);
-            } else switch (ptr[0]) {
-                case '\"':
-                    qstring_append(str, "\\\"");
-                    break;
-                case '\\':
-                    qstring_append(str, "\\\\");
-                    break;
-                case '\b':
-                    qstring_append(str, "\\b");
-                    break;
-                case '\f':
-                    qstring_append(str, "\\f");
-                    break;
-                case '\n':
-                    qstring_append(str, "\\n");
-                    break;
-                case '\r':
-                    qstring_append(str, "\\r");
-                    break;
-                case '\t':
-                    qstring_append(str, "\\t");
-                    break;
-                default: {
-                    if (ptr[0] <= 0x1F) {
-                        char escape[7];
-                        snprintf(escape, sizeof(escape), "\\u%04X", ptr[0]);
-                        qstring_append(str, escape);
-                    } else {
-                        char buf[2] = { ptr[0], 0 };
-                        qstring_append(str, buf);
-                    }
-                    break;
-                }
-                }
-            ptr++;
-        }
-        qstring_append(str, "\"");
+
+        qjson_append_str(str, qstring_get_str(val));
         break;
     }
     case QTYPE_QDICT: {
@@ -241,21 +260,8 @@ static void to_json(const QObject *obj, QString *str, int pretty, int indent)
     }
     case QTYPE_QFLOAT: {
         QFloat *val = qobject_to_qfloat(obj);
-        char buffer[1024];
-        int len;
-
-        len = snprintf(buffer, sizeof(buffer), "%f", qfloat_get_double(val));
-        while (len > 0 && buffer[len - 1] == '0') {
-            len--;
-        }
 
-        if (len && buffer[len - 1] == '.') {
-            buffer[len - 1] = 0;
-        } else {
-            buffer[len] = 0;
-        }
-        
-        qstring_append(str, buffer);
+        qjson_append_number(str, qfloat_get_double(val));
         break;
     }
     case QTYPE_QBOOL: {
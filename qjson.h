@@ -26,4 +26,8 @@ QObject *qobject_from_jsonv(const char *string, va_list *ap) GCC_FMT_ATTR(1, 0);
 QString *qobject_to_json(const QObject *obj);
 QString *qobject_to_json_pretty(const QObject *obj);
 
+/* Append the JSON representation of a string or a number to @str */
+void qjson_append_str(QString *str, const char *ptr);
+void qjson_append_number(QString *str, double number);
+
 #endif /* QJSON_H */
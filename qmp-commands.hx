@@ -357,6 +357,53 @@ Example:
 
 Note: CPUs' indexes are obtained with the 'query-cpus' command.
 
+EQMP
+
+    {
+        .name       = "cpu-add",
+        .args_type  = "id:i",
+        .mhandler.cmd_new = qmp_marshal_input_cpu_add,
+    },
+
+SQMP
+cpu-add
+-------
+
+Plug a CPU reserved with -smp maxcpus.
+
+Arguments:
+
+- "id": the CPU's index, below maxcpus (json-int)
+
+Example:
+
+-> { "execute": "cpu-add", "arguments": { "id": 2 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "cpu-del",
+        .args_type  = "id:i",
+        .mhandler.cmd_new = qmp_marshal_input_cpu_del,
+    },
+
+SQMP
+cpu-del
+-------
+
+Ask the guest to give up a CPU.  The CPU is parked, and can be plugged
+again with cpu-add, once the guest has taken it offline.
+
+Arguments:
+
+- "id": the CPU's index, other than 0 (json-int)
+
+Example:
+
+-> { "execute": "cpu-del", "arguments": { "id": 2 } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -465,6 +512,63 @@ Example:
      "arguments": { "filename": "/tmp/save" } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "query-xen-mapcache",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_xen_mapcache,
+    },
+
+SQMP
+query-xen-mapcache
+------------------
+
+Show the statistics of the cache of guest memory mappings of Xen.
+
+Return a json-object with the following information:
+
+- "hits": lookups served by an existing mapping (json-int)
+- "misses": lookups that mapped guest memory (json-int)
+- "evictions": mappings dropped to stay within max-size (json-int)
+- "size": bytes of guest memory mapped (json-int)
+- "max-size": bytes of guest memory that may be mapped at a time (json-int)
+- "locked": mappings in use that cannot be evicted (json-int)
+
+Example:
+
+-> { "execute": "query-xen-mapcache" }
+<- { "return": { "hits": 183402, "misses": 1024, "evictions": 0,
+                 "size": 1073741824, "max-size": 34359738368,
+                 "locked": 3 } }
+
+EQMP
+
+    {
+        .name       = "vm-template-save",
+        .args_type  = "filename:F",
+    .mhandler.cmd_new = qmp_marshal_input_vm_template_save,
+    },
+
+SQMP
+vm-template-save
+----------------
+
+Save the RAM and the state of all devices to a template file, for use with
+"-incoming template:FILE".  The RAM is mapped from the file on restore, so
+the guest starts without reading it.  The block devices of the VM are not
+saved by this command.
+
+Arguments:
+
+- "filename": the file to write the template to (json-string)
+
+Example:
+
+-> { "execute": "vm-template-save",
+     "arguments": { "filename": "/var/lib/templates/web.tmpl" } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -649,7 +753,8 @@ EQMP
 
     {
         .name       = "dump-guest-memory",
-        .args_type  = "paging:b,protocol:s,begin:i?,end:i?",
+        .args_type  = "paging:b,protocol:s,begin:i?,end:i?,detach:b?,"
+                      "format:s?",
         .params     = "-p protocol [begin] [length]",
         .help       = "dump guest memory to file",
         .user_print = monitor_user_noop,
@@ -671,6 +776,11 @@ Arguments:
            with length together (json-int)
 - "length": the memory size, in bytes. It's optional, and should be specified
             with begin together (json-int)
+- "detach": return at once and write the dump in the background; the guest
+            stays stopped until the DUMP_COMPLETED event (json-bool, optional)
+- "format": "elf" or "kdump-zlib"; kdump-zlib needs a seekable file and
+            cannot be combined with paging, begin or length (json-string,
+            optional, default "elf")
 
 Example:
 
@@ -681,6 +791,32 @@ Notes:
 
 (1) All boolean arguments default to false
 
+EQMP
+
+    {
+        .name       = "query-dump",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_dump,
+    },
+
+SQMP
+query-dump
+----------
+
+Show the progress of the running or last guest memory dump.
+
+Return a json-object with the following information:
+
+- "status": "none", "active", "completed" or "failed" (json-string)
+- "completed": bytes of guest memory written so far (json-int)
+- "total": bytes of guest memory to write (json-int)
+
+Example:
+
+-> { "execute": "query-dump" }
+<- { "return": { "status": "active", "completed": 1073741824,
+                 "total": 4294967296 } }
+
 EQMP
 
     {
@@ -777,6 +913,82 @@ EQMP
         .args_type  = "device:B",
         .mhandler.cmd_new = qmp_marshal_input_block_job_cancel,
     },
+    {
+        .name       = "block-job-complete",
+        .args_type  = "device:B",
+        .mhandler.cmd_new = qmp_marshal_input_block_job_complete,
+    },
+
+    {
+        .name       = "block-dirty-bitmap-add",
+        .args_type  = "device:B,name:s,granularity:i?,persistent:b?",
+        .mhandler.cmd_new = qmp_marshal_input_block_dirty_bitmap_add,
+    },
+
+SQMP
+block-dirty-bitmap-add
+----------------------
+
+Start tracking the writes to a block device in a new, clean dirty bitmap.
+
+Arguments:
+
+- "device": the device's ID (json-string)
+- "name": name of the bitmap, unique for the device (json-string)
+- "granularity": bytes covered by each bit, a power of two of at least 512,
+                 defaults to 65536 (json-int, optional)
+- "persistent": keep the bitmap in the image across restarts, qcow2
+                version 3 only, defaults to false (json-bool, optional)
+
+Example:
+
+-> { "execute": "block-dirty-bitmap-add",
+     "arguments": { "device": "ide0-hd0", "name": "backup",
+                    "persistent": true } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block-dirty-bitmap-remove",
+        .args_type  = "device:B,name:s",
+        .mhandler.cmd_new = qmp_marshal_input_block_dirty_bitmap_remove,
+    },
+
+    {
+        .name       = "block-dirty-bitmap-clear",
+        .args_type  = "device:B,name:s",
+        .mhandler.cmd_new = qmp_marshal_input_block_dirty_bitmap_clear,
+    },
+
+    {
+        .name       = "query-block-dirty-bitmap",
+        .args_type  = "device:B,name:s,clear:b?",
+        .mhandler.cmd_new = qmp_marshal_input_query_block_dirty_bitmap,
+    },
+
+SQMP
+query-block-dirty-bitmap
+------------------------
+
+Return the ranges of a block device that were written since its dirty
+bitmap was last cleared.
+
+Arguments:
+
+- "device": the device's ID (json-string)
+- "name": name of the bitmap (json-string)
+- "clear": mark the device clean in the same step, defaults to false
+           (json-bool, optional)
+
+Example:
+
+-> { "execute": "query-block-dirty-bitmap",
+     "arguments": { "device": "ide0-hd0", "name": "backup", "clear": true } }
+<- { "return": [ { "offset": 0, "length": 65536 },
+                 { "offset": 1048576, "length": 196608 } ] }
+
+EQMP
     {
         .name       = "transaction",
         .args_type  = "actions:q",
@@ -829,6 +1041,41 @@ Example:
                                          "format": "qcow2" } } ] } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "frozen-transaction",
+        .args_type  = "agent:s,actions:q,timeout:i?",
+        .mhandler.cmd_new = qmp_marshal_input_frozen_transaction,
+    },
+
+SQMP
+frozen-transaction
+------------------
+
+Freeze the guest filesystems through the guest agent, perform a
+transaction and thaw the filesystems again, without a round trip to the
+management application while the guest is frozen.  The command returns
+once the freeze request is sent to the agent; the
+FROZEN_TRANSACTION_COMPLETED event reports the outcome.  Nothing else
+should talk to the agent until then.
+
+Arguments:
+
+- "agent": id of the virtserialport device of the guest agent (json-string)
+- "actions": the actions, as for transaction (json-array)
+- "timeout": how long to wait for each agent reply, in milliseconds
+             (json-int, optional, default 10000)
+
+Example:
+
+-> { "execute": "frozen-transaction",
+     "arguments": { "agent": "qga0", "actions": [
+         { 'type': 'blockdev-snapshot-sync', 'data' : { "device": "ide-hd0",
+                                         "snapshot-file": "/some/place/my-image",
+                                         "format": "qcow2" } } ] } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -863,6 +1110,48 @@ Example:
                                                         "format": "qcow2" } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "drive-mirror",
+        .args_type  = "sync:s,device:B,target:s,speed:i?,"
+                      "mode:s?,format:s?",
+        .mhandler.cmd_new = qmp_marshal_input_drive_mirror,
+    },
+
+SQMP
+drive-mirror
+------------
+
+Start mirroring a block device's writes to a new destination. target
+specifies the target of the new image. If the file exists, or if it is
+a device, it will be used as the new destination for writes. If it does
+not exist, a new file will be created. format specifies the format of the
+mirror image, default is to probe if mode='existing', else the format
+of the source.
+
+Arguments:
+
+- "device": device name to operate on (json-string)
+- "target": name of new image file (json-string)
+- "format": format of new image (json-string, optional)
+- "mode": how an image file should be created into the target
+  file/device (NewImageMode, optional, default 'absolute-paths')
+- "speed": maximum speed of the streaming job, in bytes per second
+  (json-int)
+- "sync": what parts of the disk image should be copied to the destination;
+  possibilities include "full" for all the disk, "top" for only the sectors
+  allocated in the topmost image, or "none" to only replicate new I/O
+  (MirrorSyncMode).
+
+Example:
+
+-> { "execute": "drive-mirror", "arguments": { "device": "ide-hd0",
+                                               "target": "/some/place/my-image",
+                                               "sync": "full",
+                                               "format": "qcow2" } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -1119,7 +1408,10 @@ EQMP
 
     {
         .name       = "block_set_io_throttle",
-        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l",
+        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l,"
+                      "bps_max:l?,bps_rd_max:l?,bps_wr_max:l?,"
+                      "iops_max:l?,iops_rd_max:l?,iops_wr_max:l?,"
+                      "iops_size:l?,group:s?",
         .mhandler.cmd_new = qmp_marshal_input_block_set_io_throttle,
     },
 
@@ -1138,6 +1430,21 @@ Arguments:
 - "iops":  total I/O operations per second(json-int)
 - "iops_rd":  read I/O operations per second(json-int)
 - "iops_wr":  write I/O operations per second(json-int)
+- "bps_max":  total throughput burst in bytes (json-int, optional)
+- "bps_rd_max":  read throughput burst in bytes (json-int, optional)
+- "bps_wr_max":  write throughput burst in bytes (json-int, optional)
+- "iops_max":  total I/O operations burst (json-int, optional)
+- "iops_rd_max":  read I/O operations burst (json-int, optional)
+- "iops_wr_max":  write I/O operations burst (json-int, optional)
+- "iops_size":  an I/O size in bytes; larger requests count as several
+                operations (json-int, optional)
+- "group":  throttle group to put the drive in; drives in the same group
+            share their limits.  An empty string takes the drive out of
+            its group (json-string, optional)
+
+A burst lets the drive go above its limit, at full speed, until it has
+transferred that many bytes or operations in excess of it.  Bursts
+default to a tenth of a second worth of the limit.
 
 Example:
 
@@ -1150,6 +1457,41 @@ Example:
                                                "iops_wr": "0" } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "block-latency-histogram-set",
+        .args_type  = "device:B,boundaries:s?,boundaries-read:s?,"
+                      "boundaries-write:s?,boundaries-flush:s?",
+        .mhandler.cmd_new = qmp_marshal_input_block_latency_histogram_set,
+    },
+
+SQMP
+block-latency-histogram-set
+---------------------------
+
+Enable, change or disable the latency histograms of a block device and of
+the layers below it.  A list of boundaries is a comma-separated list of
+strictly increasing latencies in nanoseconds; an empty list disables the
+histogram.  Setting a histogram resets its counters.
+
+Arguments:
+
+- "device": device name (json-string)
+- "boundaries": boundaries for the histograms not set by the options below
+                (json-string, optional)
+- "boundaries-read": boundaries of the read histogram (json-string, optional)
+- "boundaries-write": boundaries of the write histogram (json-string, optional)
+- "boundaries-flush": boundaries of the flush histogram (json-string, optional)
+
+Example:
+
+-> { "execute": "block-latency-histogram-set",
+     "arguments": { "device": "virtio0",
+                    "boundaries": "100000,1000000,10000000",
+                    "boundaries-flush": "" } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -1491,6 +1833,15 @@ Each json-object contain the following:
          - "iops": limit total I/O operations per second (json-int)
          - "iops_rd": limit read operations per second (json-int)
          - "iops_wr": limit write operations per second (json-int)
+         - "bps_max": total bytes burst (json-int, optional)
+         - "bps_rd_max": read bytes burst (json-int, optional)
+         - "bps_wr_max": write bytes burst (json-int, optional)
+         - "iops_max": total I/O operations burst (json-int, optional)
+         - "iops_rd_max": read operations burst (json-int, optional)
+         - "iops_wr_max": write operations burst (json-int, optional)
+         - "iops_size": I/O size in bytes counted as one operation
+                        (json-int, optional)
+         - "group": throttle group of the drive (json-string, optional)
 
 - "io-status": I/O operation status, only present if the device supports it
                and the VM is configured to stop on errors. It's always reset
@@ -1575,10 +1926,35 @@ Each json-object contain the following:
     - "flush_total_time_ns": total time spend on cache flushes in nano-seconds (json-int)
     - "wr_highest_offset": Highest offset of a sector written since the
                            BlockDriverState has been opened (json-int)
+    - "l2_cache": L2 table cache of the image format, if it has one
+                  (json-object, optional), with:
+        - "size": size of the cache in bytes (json-int)
+        - "hits": lookups that found the table in the cache (json-int)
+        - "misses": lookups that did not (json-int)
+    - "refcount_cache": refcount block cache of the image format, if it has
+                        one (json-object, optional), same fields as
+                        "l2_cache"
+    - "in_flight": requests being processed (json-int)
+    - "rd_latency_histogram": read latency histogram, if enabled with
+                              block-latency-histogram-set (json-array,
+                              optional), each bin a json-object with:
+        - "low": lowest latency of the bin in nano-seconds (json-int)
+        - "high": latency below which the bin ends in nano-seconds, omitted
+                  for the last bin (json-int, optional)
+        - "count": requests of the bin (json-int)
+    - "wr_latency_histogram": write latency histogram (json-array, optional),
+                              like "rd_latency_histogram"
+    - "flush_latency_histogram": cache flush latency histogram (json-array,
+                                 optional), like "rd_latency_histogram"
 - "parent": Contains recursively the statistics of the underlying
             protocol (e.g. the host file for a qcow2 image). If there is
             no underlying protocol, this field is omitted
             (json-object, optional)
+- "backing": Contains recursively the statistics of the backing file, if
+             there is one (json-object, optional)
+
+For a device the statistics cover the guest's requests; for the layers below
+it ("parent" and "backing"), the requests that the layer above issued.
 
 Example:
 
@@ -1609,7 +1985,23 @@ Example:
                "flush_operations":51,
                "wr_total_times_ns":313253456
                "rd_total_times_ns":3465673657
-               "flush_total_times_ns":49653
+               "flush_total_times_ns":49653,
+               "l2_cache":{
+                  "size":1048576,
+                  "hits":153852,
+                  "misses":2164
+               },
+               "refcount_cache":{
+                  "size":262144,
+                  "hits":1377,
+                  "misses":12
+               },
+               "in_flight":2,
+               "rd_latency_histogram":[
+                  { "low":0, "high":1000000, "count":35902 },
+                  { "low":1000000, "high":10000000, "count":689 },
+                  { "low":10000000, "count":13 }
+               ]
             }
          },
          {
@@ -1682,6 +2074,14 @@ Return a json-array. Each CPU is represented by a json-object, which contains:
      "pc" and "npc": sparc (json-int)
      "PC": mips (json-int)
 - "thread_id": ID of the underlying host thread (json-int)
+- "run-delay-ns": time the host thread was runnable but not running, from
+                  the host's schedstats (json-int, optional)
+- "lock-wait-ns": time the thread waited for the global mutex (json-int)
+- "kvm-run-ns": time spent in KVM_RUN, KVM only (json-int, optional)
+- "kvm-exit-ns": time spent handling KVM exits in QEMU, including the waits
+                 for the global mutex, KVM only (json-int, optional)
+
+The times are totals since the vCPU was created.
 
 Example:
 
@@ -1693,14 +2093,22 @@ Example:
             "current":true,
             "halted":false,
             "pc":3227107138
-            "thread_id":3134
+            "thread_id":3134,
+            "run-delay-ns":41103822,
+            "lock-wait-ns":2251037,
+            "kvm-run-ns":9120337411,
+            "kvm-exit-ns":310284731
          },
          {
             "CPU":1,
             "current":false,
             "halted":true,
             "pc":7108165
-            "thread_id":3135
+            "thread_id":3135,
+            "run-delay-ns":82774102,
+            "lock-wait-ns":1934411,
+            "kvm-run-ns":8801920330,
+            "kvm-exit-ns":290149082
          }
       ]
    }
@@ -1954,6 +2362,299 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_input_query_kvm,
     },
 
+SQMP
+query-kvm-exits
+---------------
+
+Show KVM exit statistics.
+
+Arguments:
+
+- "limit": how many hot addresses to return, default 10 (json-int, optional)
+
+Return a json-object with the following information:
+
+- "vcpus": a json-array with one json-object per vCPU:
+  - "cpu": CPU index (json-int)
+  - "total": number of exits to QEMU (json-int)
+  - "signals": number of KVM_RUN calls interrupted by a signal (json-int)
+  - "exits": json-array of json-objects with "reason" (json-string) and
+             "count" (json-int), for the reasons seen so far
+- "sample-interval": one I/O exit out of this many is sampled (json-int)
+- "hot": json-array of the most frequently sampled I/O addresses:
+  - "space": "mmio" or "pio" (json-string)
+  - "addr": address or port (json-int)
+  - "region": name of the memory region at that address (json-string)
+  - "samples": number of samples (json-int)
+- "dropped": samples lost because the address table was full (json-int)
+
+Example:
+
+-> { "execute": "query-kvm-exits", "arguments": { "limit": 1 } }
+<- { "return": {
+       "vcpus": [
+          { "cpu": 0, "total": 81520, "signals": 312,
+            "exits": [ { "reason": "io", "count": 60233 },
+                       { "reason": "mmio", "count": 21287 } ] } ],
+       "sample-interval": 64,
+       "hot": [ { "space": "pio", "addr": 496, "region": "ide",
+                  "samples": 802 } ],
+       "dropped": 0 } }
+
+EQMP
+
+    {
+        .name       = "query-kvm-exits",
+        .args_type  = "limit:i?",
+        .mhandler.cmd_new = qmp_marshal_input_query_kvm_exits,
+    },
+
+SQMP
+query-guest-samples
+-------------------
+
+Show the guest PCs sampled under TCG (see -tcg-sample).
+
+Arguments:
+
+- "limit": how many PCs to return per vCPU, default 10 (json-int, optional)
+
+Return a json-object with the following information:
+
+- "rate": samples per second and vCPU, 0 if the sampler is off (json-int)
+- "vcpus": a json-array with one json-object per vCPU:
+  - "cpu": CPU index (json-int)
+  - "total": number of samples (json-int)
+  - "dropped": samples lost because the PC table was full (json-int)
+  - "hot": json-array of the most frequently sampled PCs:
+    - "pc": guest virtual address (json-int)
+    - "symbol": guest symbol, or "" if unknown (json-string)
+    - "samples": number of samples (json-int)
+
+Example:
+
+-> { "execute": "query-guest-samples", "arguments": { "limit": 1 } }
+<- { "return": {
+       "rate": 1000,
+       "vcpus": [
+          { "cpu": 0, "total": 52110, "dropped": 0,
+            "hot": [ { "pc": 3222302720, "symbol": "memcpy",
+                       "samples": 8095 } ] } ] } }
+
+EQMP
+
+    {
+        .name       = "query-guest-samples",
+        .args_type  = "limit:i?",
+        .mhandler.cmd_new = qmp_marshal_input_query_guest_samples,
+    },
+
+SQMP
+query-tcg-stats
+---------------
+
+Show statistics of the TCG translator and of translated code.  Except for
+the translation buffer and "tlb-victim-hits", the counters stay zero
+unless QEMU was started with -tcg-stats.
+
+Arguments:
+
+- "limit": how many helpers to return, default 10 (json-int, optional)
+
+Return a json-object with the following information:
+
+- "enabled": whether -tcg-stats was given (json-bool)
+- "code-size": bytes of host code in the translation buffer (json-int)
+- "code-capacity": size of the translation buffer in use (json-int)
+- "tb-count": TBs in the translation buffer (json-int)
+- "flushes": full flushes of the translation buffer (json-int)
+- "translated-tbs": TBs translated (json-int)
+- "translation-ns": time spent translating (json-int)
+- "guest-insns": guest instructions translated (json-int)
+- "guest-bytes": guest code bytes translated (json-int)
+- "host-bytes": host code bytes generated (json-int)
+- "tb-execs": TBs entered (json-int)
+- "tb-lookups": TBs looked up by the execution loop (json-int)
+- "jmp-cache-misses": lookups that missed the virtual PC cache (json-int)
+- "hash-misses": lookups that had to translate (json-int)
+- "indirect-lookups": lookups done by translated code at indirect
+  branches (json-int)
+- "chained-jumps": direct jumps patched between TBs (json-int)
+- "tlb-slow-path": accesses that called the softmmu helpers (json-int)
+- "tlb-misses": accesses to pages not in the TLB (json-int)
+- "tlb-victim-hits": misses found in the victim TLB (json-int)
+- "tlb-io": MMIO accesses (json-int)
+- "helpers": json-array of the most called helpers, most called first:
+  - "name": helper name (json-string)
+  - "calls": number of calls (json-int)
+
+Example:
+
+-> { "execute": "query-tcg-stats", "arguments": { "limit": 1 } }
+<- { "return": {
+       "enabled": true, "code-size": 10983424, "code-capacity": 33554432,
+       "tb-count": 48213, "flushes": 0,
+       "translated-tbs": 48213, "translation-ns": 1730216412,
+       "guest-insns": 251870, "guest-bytes": 790230, "host-bytes": 10983424,
+       "tb-execs": 981520311, "tb-lookups": 52193342,
+       "jmp-cache-misses": 1203410, "hash-misses": 48213,
+       "indirect-lookups": 130255821, "chained-jumps": 91290,
+       "tlb-slow-path": 8922103, "tlb-misses": 2339105,
+       "tlb-victim-hits": 1720433, "tlb-io": 4102982,
+       "helpers": [ { "name": "cc_compute_all", "calls": 31022311 } ] } }
+
+EQMP
+
+    {
+        .name       = "query-tcg-stats",
+        .args_type  = "limit:i?",
+        .mhandler.cmd_new = qmp_marshal_input_query_tcg_stats,
+    },
+
+SQMP
+lock-stats-set
+--------------
+
+Start or stop collecting contention statistics for the global mutex and
+the coroutine locks of image formats.  Starting resets the statistics.
+
+Arguments:
+
+- "enable": whether to collect statistics (json-bool)
+
+Example:
+
+-> { "execute": "lock-stats-set", "arguments": { "enable": true } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "lock-stats-set",
+        .args_type  = "enable:b",
+        .mhandler.cmd_new = qmp_marshal_input_lock_stats_set,
+    },
+
+SQMP
+query-lock-stats
+----------------
+
+Show the lock contention statistics collected since the last lock-stats-set.
+
+Return a json-object with the following information:
+
+- "enabled": whether statistics are being collected (json-bool)
+- "locks": json-array with one entry per lock:
+  - "name": name of the lock (json-string)
+  - "acquisitions": how often the lock was taken (json-int)
+  - "contended": how often it was already taken (json-int)
+  - "wait-ns": total time spent waiting for it (json-int)
+  - "hold-ns": total time it was held (json-int)
+  - "wait-histogram": json-array of the non-empty bins of the wait times:
+    - "low": lowest time in the bin, in ns (json-int)
+    - "high": time the entries stayed below, in ns; omitted for the last
+      bin (json-int, optional)
+    - "count": number of entries (json-int)
+  - "hold-histogram": the same for the hold times (json-array)
+  - "callers": json-array of the first callers seen, longest waits first:
+    - "caller": return address of the call that took the lock (json-int)
+    - "acquisitions": how often it took the lock (json-int)
+    - "contended": how often it found the lock taken (json-int)
+    - "wait-ns": total time it waited (json-int)
+
+Example:
+
+-> { "execute": "query-lock-stats" }
+<- { "return": {
+       "enabled": true,
+       "locks": [
+         { "name": "qemu_global_mutex", "acquisitions": 120342,
+           "contended": 2231, "wait-ns": 87234110, "hold-ns": 901236087,
+           "wait-histogram": [ { "low": 0, "high": 1024, "count": 117902 },
+                               { "low": 1024, "high": 2048, "count": 2440 } ],
+           "hold-histogram": [ { "low": 0, "high": 1024, "count": 120342 } ],
+           "callers": [ { "caller": 93824994391082, "acquisitions": 60171,
+                          "contended": 2231, "wait-ns": 87021933 } ] } ] } }
+
+EQMP
+
+    {
+        .name       = "query-lock-stats",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_lock_stats,
+    },
+
+SQMP
+query-memory-usage
+------------------
+
+Show the memory QEMU allocated for its own use, outside of guest RAM, in the
+subsystems that account for it: virtio devices (device state and in-flight
+virtqueue elements), qcow2 metadata caches, the VNC server, the XBZRLE page
+cache and the part of the TCG translation buffer in use.
+
+Return a json-object with the following information:
+
+- "total": bytes allocated in all accounts (json-int)
+- "subsystems": json-array of the sums per subsystem:
+  - "subsystem": "virtio", "qcow2", "vnc", "page-cache" or "tcg"
+    (json-string)
+  - "bytes": bytes allocated (json-int)
+- "accounts": json-array of the individual accounts:
+  - "subsystem": the subsystem (json-string)
+  - "owner": device id or type, or image file name (json-string, optional)
+  - "bytes": bytes allocated (json-int)
+  - "peak": largest value of "bytes" (json-int)
+  - "allocations": blocks allocated, where counted (json-int)
+
+Example:
+
+-> { "execute": "query-memory-usage" }
+<- { "return": {
+       "total": 38109184,
+       "subsystems": [ { "subsystem": "tcg", "bytes": 33554432 },
+                       { "subsystem": "virtio", "bytes": 160768 },
+                       { "subsystem": "qcow2", "bytes": 4393984 } ],
+       "accounts": [
+         { "subsystem": "tcg", "bytes": 33554432, "peak": 33554432,
+           "allocations": 1 },
+         { "subsystem": "virtio", "owner": "virtio-disk0", "bytes": 160768,
+           "peak": 1213440, "allocations": 5 },
+         { "subsystem": "qcow2", "owner": "/var/lib/images/guest.qcow2",
+           "bytes": 4393984, "peak": 4393984, "allocations": 2 } ] } }
+
+EQMP
+
+    {
+        .name       = "query-memory-usage",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_memory_usage,
+    },
+
+SQMP
+vcpu-times-event-set
+--------------------
+
+Emit a VCPU_TIMES event every "interval" milliseconds, or stop the events if
+"interval" is 0.
+
+Arguments:
+
+- "interval": period in milliseconds (json-int)
+
+Example:
+
+-> { "execute": "vcpu-times-event-set", "arguments": { "interval": 1000 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "vcpu-times-event-set",
+        .args_type  = "interval:i",
+        .mhandler.cmd_new = qmp_marshal_input_vcpu_times_event_set,
+    },
+
 SQMP
 query-status
 ------------
@@ -2242,6 +2943,8 @@ The main json-object contains the following:
 - "total-time": total amount of ms since migration started.  If
                 migration has ended, it returns the total migration
 		 time (json-int)
+- "downtime": only present if "status" is "completed", ms the guest was
+              stopped on the source for the final stage (json-int)
 - "ram": only present if "status" is "active", it is a json-object with the
   following RAM information (in bytes):
          - "transferred": amount transferred (json-int)
@@ -2250,6 +2953,7 @@ The main json-object contains the following:
          - "duplicate": number of duplicated pages (json-int)
          - "normal" : number of normal pages transferred (json-int)
          - "normal-bytes" : number of normal bytes transferred (json-int)
+         - "dirty-sync-count": number of pre-copy passes (json-int)
 - "disk": only present if "status" is "active" and it is a block migration,
   it is a json-object with the following disk information (in bytes):
          - "transferred": amount transferred (json-int)
@@ -2260,8 +2964,27 @@ The main json-object contains the following:
          - "cache-size": XBZRLE cache size
          - "bytes": total XBZRLE bytes transferred
          - "pages": number of XBZRLE compressed pages
+         - "cache-hit": number of pages found in the cache
          - "cache-miss": number of cache misses
          - "overflow": number of XBZRLE overflows
+- "compression": only present if the compress capability is on.
+  It is a json-object with the following compression information:
+         - "pages": number of compressed pages transferred
+         - "compressed-size": total bytes of compressed pages transferred
+- "dedup": only present if the dedup capability is on.
+  It is a json-object with the following information:
+         - "pages": number of pages sent as a fingerprint
+         - "resent": number of those sent again in full
+- "cpu-throttle-percentage": percentage of time guest cpus are being
+  throttled, only present if the auto-converge capability is on (json-int)
+- "devices": only present if "status" is "completed", or on the destination
+  once an incoming migration has been loaded.  It is a json-array of
+  json-objects, one per device state, with the following information:
+         - "id": state section name (json-string)
+         - "instance-id": instance of the section (json-int)
+         - "save-time": us spent saving it, on the source (json-int, optional)
+         - "load-time": us spent loading it, on the destination (json-int,
+           optional)
 Examples:
 
 1. Before the first migration
@@ -2373,6 +3096,10 @@ migrate-set-capabilities
 Enable/Disable migration capabilities
 
 - "xbzrle": xbzrle support
+- "compress": multi-threaded page compression support
+- "auto-converge": throttle down the guest when RAM migration does not converge
+- "zero-range": send runs of zero pages, and unallocated block ranges, as a single record
+- "dedup": send page fingerprints, and only the pages the destination lacks
 
 Arguments:
 
@@ -2397,6 +3124,10 @@ Query current migration capabilities
 
 - "capabilities": migration capabilities state
          - "xbzrle" : XBZRLE state (json-bool)
+         - "compress" : multi-threaded compression state (json-bool)
+         - "auto-converge" : auto-converge state (json-bool)
+         - "zero-range" : zero page run encoding state (json-bool)
+         - "dedup" : page fingerprint state (json-bool)
 
 Arguments:
 
@@ -2415,6 +3146,75 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_input_query_migrate_capabilities,
     },
 
+SQMP
+migrate-set-parameters
+----------------------
+
+Set migration parameters
+
+- "compress-level": set compression level during migration (json-int)
+- "compress-threads": set compression thread count for migration (json-int)
+- "decompress-threads": set decompression thread count for migration (json-int)
+- "max-precopy-passes": bound the number of pre-copy passes, 0 for no limit
+                        (json-int)
+- "channels": number of tcp connections to send RAM over (json-int)
+- "block-inflight": number of reads in flight during the bulk phase of
+                    block migration (json-int)
+
+Arguments:
+
+Example:
+
+-> { "execute": "migrate-set-parameters" , "arguments":
+      { "compress-level": 1 } }
+
+EQMP
+
+    {
+        .name       = "migrate-set-parameters",
+        .args_type  = "compress-level:i?,compress-threads:i?,"
+                      "decompress-threads:i?,max-precopy-passes:i?,"
+                      "channels:i?,block-inflight:i?",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_set_parameters,
+    },
+SQMP
+query-migrate-parameters
+------------------------
+
+Query current migration parameters
+
+- "parameters": migration parameters value
+         - "compress-level" : compression level value (json-int)
+         - "compress-threads" : compression thread count value (json-int)
+         - "decompress-threads" : decompression thread count value (json-int)
+         - "max-precopy-passes" : pre-copy pass limit (json-int)
+         - "channels" : number of migration channels (json-int)
+         - "block-inflight" : block migration bulk phase reads (json-int)
+
+Arguments:
+
+Example:
+
+-> { "execute": "query-migrate-parameters" }
+<- {
+      "return": {
+         "decompress-threads": 2,
+         "compress-threads": 8,
+         "compress-level": 1,
+         "max-precopy-passes": 0,
+         "channels": 1,
+         "block-inflight": 16
+      }
+   }
+
+EQMP
+
+    {
+        .name       = "query-migrate-parameters",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_migrate_parameters,
+    },
+
 SQMP
 query-balloon
 -------------
@@ -2456,6 +3256,74 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_input_query_balloon,
     },
 
+SQMP
+query-mem-prealloc
+------------------
+
+Show the progress of guest RAM preallocation (-mem-prealloc).
+
+Return a json-object with the following data:
+
+- "active": true while preallocation is running (json-bool)
+- "total": bytes to preallocate (json-int)
+- "done": bytes preallocated so far (json-int)
+
+Example:
+
+-> { "execute": "query-mem-prealloc" }
+<- {
+      "return":{
+         "active":true,
+         "total":17179869184,
+         "done":6442450944
+      }
+   }
+
+EQMP
+
+    {
+        .name       = "query-mem-prealloc",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_mem_prealloc,
+    },
+
+SQMP
+query-memory-sharing
+--------------------
+
+Show how guest RAM is backed on the host: how much of it is resident,
+shared (for example merged by KSM) and backed by transparent huge pages.
+
+Return a json-object with the following data:
+
+- "merge": true if guest RAM is offered to KSM (json-bool)
+- "rss": bytes of guest RAM resident in host memory (json-int)
+- "shared": resident bytes also mapped elsewhere or merged (json-int)
+- "anon-huge": bytes backed by transparent huge pages (json-int)
+- "swap": bytes swapped out (json-int)
+- "ksm": bytes merged by KSM, optional (json-int)
+
+Example:
+
+-> { "execute": "query-memory-sharing" }
+<- {
+      "return":{
+         "merge":true,
+         "rss":1073741824,
+         "shared":268435456,
+         "anon-huge":536870912,
+         "swap":0
+      }
+   }
+
+EQMP
+
+    {
+        .name       = "query-memory-sharing",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_memory_sharing,
+    },
+
     {
         .name       = "query-block-jobs",
         .args_type  = "",
@@ -2514,3 +3382,26 @@ EQMP
         .args_type  = "",
         .mhandler.cmd_new = qmp_marshal_input_query_target,
     },
+
+    {
+        .name       = "trace-dump",
+        .args_type  = "filename:F",
+        .mhandler.cmd_new = qmp_marshal_input_trace_dump,
+    },
+
+SQMP
+trace-dump
+----------
+
+Save the traces kept by the flight recorder of the simple trace backend.
+
+Arguments:
+
+- "filename": the file to write (json-string)
+
+Example:
+
+-> { "execute": "trace-dump", "arguments": { "filename": "/tmp/trace" } }
+<- { "return": {} }
+
+EQMP
@@ -19,8 +19,10 @@
 #include "ui/qemu-spice.h"
 #include "ui/vnc.h"
 #include "kvm.h"
+#include "cpu-common.h"
 #include "arch_init.h"
 #include "hw/qdev.h"
+#include "hw/boards.h"
 #include "blockdev.h"
 #include "qemu/qom-qobject.h"
 
@@ -62,6 +64,18 @@ KvmInfo *qmp_query_kvm(Error **errp)
     return info;
 }
 
+MemPreallocInfo *qmp_query_mem_prealloc(Error **errp)
+{
+    MemPreallocInfo *info = g_malloc0(sizeof(*info));
+    uint64_t total, done;
+
+    qemu_ram_prealloc_status(&info->active, &total, &done);
+    info->total = total;
+    info->done = done;
+
+    return info;
+}
+
 UuidInfo *qmp_query_uuid(Error **errp)
 {
     UuidInfo *info = g_malloc0(sizeof(*info));
@@ -103,6 +117,24 @@ void qmp_cpu(int64_t index, Error **errp)
     /* Just do nothing */
 }
 
+void qmp_cpu_add(int64_t id, Error **errp)
+{
+    if (current_machine->hot_add_cpu) {
+        current_machine->hot_add_cpu(id, errp);
+    } else {
+        error_set(errp, QERR_UNSUPPORTED);
+    }
+}
+
+void qmp_cpu_del(int64_t id, Error **errp)
+{
+    if (current_machine->hot_remove_cpu) {
+        current_machine->hot_remove_cpu(id, errp);
+    } else {
+        error_set(errp, QERR_UNSUPPORTED);
+    }
+}
+
 #ifndef CONFIG_VNC
 /* If VNC support is enabled, the "true" query-vnc command is
    defined in the VNC subsystem */
@@ -153,6 +185,11 @@ void qmp_cont(Error **errp)
         return;
     } else if (runstate_check(RUN_STATE_SUSPENDED)) {
         return;
+    } else if (dump_in_progress()) {
+        /* a detached dump reads guest memory until DUMP_COMPLETED */
+        error_set(errp, ERROR_CLASS_GENERIC_ERROR,
+                  "Cannot resume while dumping guest memory");
+        return;
     }
 
     bdrv_iterate(iostatus_bdrv_it, NULL);
@@ -26,6 +26,9 @@
 
 #define MAX_INTERFACES 32
 
+/* Objects with more properties than this also index them by name */
+#define OBJECT_PROPERTY_TABLE_MIN 16
+
 typedef struct InterfaceImpl InterfaceImpl;
 typedef struct TypeImpl TypeImpl;
 
@@ -56,6 +59,11 @@ struct TypeImpl
     const char *parent;
     TypeImpl *parent_type;
 
+    /* Filled in by type_initialize: ancestors[i] is the ancestor at
+     * depth i, so ancestors[depth] is the type itself */
+    int depth;
+    TypeImpl **ancestors;
+
     ObjectClass *class;
 
     int num_interfaces;
@@ -188,6 +196,13 @@ static bool type_is_ancestor(TypeImpl *type, TypeImpl *target_type)
 {
     assert(target_type);
 
+    /* The ancestors of an initialized type are initialized too */
+    if (type && type->ancestors) {
+        return target_type->ancestors &&
+               target_type->depth <= type->depth &&
+               type->ancestors[target_type->depth] == target_type;
+    }
+
     /* Check if typename is a direct ancestor of type */
     while (type) {
         if (type == target_type) {
@@ -239,6 +254,16 @@ static void type_initialize(TypeImpl *ti)
     parent = type_get_parent(ti);
     if (parent) {
         type_initialize(parent);
+        ti->depth = parent->depth + 1;
+    }
+    ti->ancestors = g_new(TypeImpl *, ti->depth + 1);
+    if (parent) {
+        memcpy(ti->ancestors, parent->ancestors,
+               ti->depth * sizeof(*ti->ancestors));
+    }
+    ti->ancestors[ti->depth] = ti;
+
+    if (parent) {
         GSList *e;
         int i;
 
@@ -330,6 +355,12 @@ static inline bool object_property_is_link(ObjectProperty *prop)
 
 static void object_property_del_all(Object *obj)
 {
+    if (obj->property_table) {
+        g_hash_table_destroy(obj->property_table);
+        obj->property_table = NULL;
+    }
+    obj->num_properties = 0;
+
     while (!QTAILQ_EMPTY(&obj->properties)) {
         ObjectProperty *prop = QTAILQ_FIRST(&obj->properties);
 
@@ -442,9 +473,26 @@ Object *object_dynamic_cast_assert(Object *obj, const char *typename)
 ObjectClass *object_class_dynamic_cast(ObjectClass *class,
                                        const char *typename)
 {
-    TypeImpl *target_type = type_get_by_name(typename);
+    TypeImpl *target_type;
     TypeImpl *type = class->type;
     ObjectClass *ret = NULL;
+    int i;
+
+    /* Casts in device code name the type with the same string constant
+     * every time, so a hit here avoids hashing it.  The entries are only
+     * ever set to names the class can be cast to, so a racing update
+     * from another thread cannot make this return a wrong answer.
+     */
+    for (i = 0; i < OBJECT_CLASS_CAST_CACHE; i++) {
+        if (class->cast_cache[i] == typename) {
+            return class;
+        }
+    }
+
+    target_type = type_get_by_name(typename);
+    if (!target_type) {
+        return NULL;
+    }
 
     if (type->num_interfaces && type_is_ancestor(target_type, type_interface)) {
         int found = 0;
@@ -465,6 +513,10 @@ ObjectClass *object_class_dynamic_cast(ObjectClass *class,
         }
     } else if (type_is_ancestor(type, target_type)) {
         ret = class;
+        for (i = 1; i < OBJECT_CLASS_CAST_CACHE; i++) {
+            class->cast_cache[i - 1] = class->cast_cache[i];
+        }
+        class->cast_cache[i - 1] = typename;
     }
 
     return ret;
@@ -614,6 +666,14 @@ void object_unref(Object *obj)
     }
 }
 
+/* Like the list walk, the table finds the first property with a name */
+static void object_property_table_add(Object *obj, ObjectProperty *prop)
+{
+    if (!g_hash_table_lookup(obj->property_table, prop->name)) {
+        g_hash_table_insert(obj->property_table, prop->name, prop);
+    }
+}
+
 void object_property_add(Object *obj, const char *name, const char *type,
                          ObjectPropertyAccessor *get,
                          ObjectPropertyAccessor *set,
@@ -631,6 +691,16 @@ void object_property_add(Object *obj, const char *name, const char *type,
     prop->opaque = opaque;
 
     QTAILQ_INSERT_TAIL(&obj->properties, prop, node);
+    obj->num_properties++;
+
+    if (obj->property_table) {
+        object_property_table_add(obj, prop);
+    } else if (obj->num_properties > OBJECT_PROPERTY_TABLE_MIN) {
+        obj->property_table = g_hash_table_new(g_str_hash, g_str_equal);
+        QTAILQ_FOREACH(prop, &obj->properties, node) {
+            object_property_table_add(obj, prop);
+        }
+    }
 }
 
 ObjectProperty *object_property_find(Object *obj, const char *name,
@@ -638,6 +708,15 @@ ObjectProperty *object_property_find(Object *obj, const char *name,
 {
     ObjectProperty *prop;
 
+    if (obj->property_table) {
+        prop = g_hash_table_lookup(obj->property_table, name);
+        if (prop) {
+            return prop;
+        }
+        error_set(errp, QERR_PROPERTY_NOT_FOUND, "", name);
+        return NULL;
+    }
+
     QTAILQ_FOREACH(prop, &obj->properties, node) {
         if (strcmp(prop->name, name) == 0) {
             return prop;
@@ -660,6 +739,20 @@ void object_property_del(Object *obj, const char *name, Error **errp)
     }
 
     QTAILQ_REMOVE(&obj->properties, prop, node);
+    obj->num_properties--;
+
+    if (obj->property_table &&
+        g_hash_table_lookup(obj->property_table, prop->name) == prop) {
+        ObjectProperty *next;
+
+        g_hash_table_remove(obj->property_table, prop->name);
+        QTAILQ_FOREACH(next, &obj->properties, node) {
+            if (strcmp(next->name, prop->name) == 0) {
+                g_hash_table_insert(obj->property_table, next->name, next);
+                break;
+            }
+        }
+    }
 
     g_free(prop->name);
     g_free(prop->type);
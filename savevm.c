@@ -81,11 +81,13 @@
 #include "migration.h"
 #include "qemu_socket.h"
 #include "qemu-queue.h"
+#include "iov.h"
 #include "qemu-timer.h"
 #include "cpus.h"
 #include "memory.h"
 #include "qmp-commands.h"
 #include "trace.h"
+#include "buffered_file.h"
 
 #define SELF_ANNOUNCE_ROUNDS 5
 
@@ -160,6 +162,7 @@ void qemu_announce_self(void)
 /* savevm/loadvm support */
 
 #define IO_BUF_SIZE 32768
+#define MAX_IOV_SIZE MIN(IOV_MAX, 64)
 
 struct QEMUFile {
     QEMUFilePutBufferFunc *put_buffer;
@@ -168,6 +171,7 @@ struct QEMUFile {
     QEMUFileRateLimit *rate_limit;
     QEMUFileSetRateLimit *set_rate_limit;
     QEMUFileGetRateLimit *get_rate_limit;
+    QEMUFileWritevBufferFunc *writev_buffer;
     void *opaque;
     int is_write;
 
@@ -177,6 +181,14 @@ struct QEMUFile {
     int buf_size; /* 0 when writing */
     uint8_t buf[IO_BUF_SIZE];
 
+    /* With writev_buffer, the data to write on flush: pieces of buf
+     * interleaved with data queued by qemu_put_buffer_async().  The
+     * bytes of buf from buf_queued on are not in iov yet.
+     */
+    struct iovec iov[MAX_IOV_SIZE];
+    unsigned int iovcnt;
+    int buf_queued;
+
     int last_error;
 };
 
@@ -435,6 +447,12 @@ QEMUFile *qemu_fopen_ops(void *opaque, QEMUFilePutBufferFunc *put_buffer,
     return f;
 }
 
+void qemu_file_set_writev_buffer(QEMUFile *f,
+                                 QEMUFileWritevBufferFunc *writev_buffer)
+{
+    f->writev_buffer = writev_buffer;
+}
+
 int qemu_file_get_error(QEMUFile *f)
 {
     return f->last_error;
@@ -461,11 +479,56 @@ static void qemu_file_set_if_error(QEMUFile *f, int ret)
  *
  * In case of error, last_error is set.
  */
+static void qemu_queue_iov(QEMUFile *f, const uint8_t *buf, int size)
+{
+    struct iovec *last = f->iovcnt ? &f->iov[f->iovcnt - 1] : NULL;
+
+    if (last && (uint8_t *)last->iov_base + last->iov_len == buf) {
+        last->iov_len += size;
+    } else {
+        f->iov[f->iovcnt].iov_base = (uint8_t *)buf;
+        f->iov[f->iovcnt].iov_len = size;
+        f->iovcnt++;
+    }
+}
+
+/* Moves the bytes put in buf since the last queued piece to iov */
+static void qemu_queue_buf(QEMUFile *f)
+{
+    if (f->buf_index > f->buf_queued) {
+        qemu_queue_iov(f, f->buf + f->buf_queued,
+                       f->buf_index - f->buf_queued);
+        f->buf_queued = f->buf_index;
+    }
+}
+
+static void qemu_fflush_iov(QEMUFile *f)
+{
+    int len, size;
+
+    qemu_queue_buf(f);
+    size = iov_size(f->iov, f->iovcnt);
+    len = f->writev_buffer(f->opaque, f->iov, f->iovcnt, f->buf_offset);
+    if (len > 0) {
+        f->buf_offset += size;
+    } else {
+        qemu_file_set_error(f, -EINVAL);
+    }
+    f->iovcnt = 0;
+    f->buf_index = 0;
+    f->buf_queued = 0;
+}
+
 void qemu_fflush(QEMUFile *f)
 {
     if (!f->put_buffer)
         return;
 
+    if (f->is_write && f->iovcnt) {
+        qemu_fflush_iov(f);
+        return;
+    }
+
     if (f->is_write && f->buf_index > 0) {
         int len;
 
@@ -546,11 +609,6 @@ int qemu_fclose(QEMUFile *f)
     return ret;
 }
 
-void qemu_file_put_notify(QEMUFile *f)
-{
-    f->put_buffer(f->opaque, NULL, 0, 0);
-}
-
 void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, int size)
 {
     int l;
@@ -575,6 +633,32 @@ void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, int size)
     }
 }
 
+void qemu_put_buffer_async(QEMUFile *f, const uint8_t *buf, int size)
+{
+    if (!f->writev_buffer || size < IO_BUF_SIZE / 8) {
+        /* copying a small piece is cheaper than a separate iovec */
+        qemu_put_buffer(f, buf, size);
+        return;
+    }
+
+    if (!f->last_error && f->is_write == 0 && f->buf_index > 0) {
+        fprintf(stderr,
+                "Attempted to write to buffer while read buffer is not empty\n");
+        abort();
+    }
+    if (f->last_error) {
+        return;
+    }
+
+    f->is_write = 1;
+    qemu_queue_buf(f);
+    qemu_queue_iov(f, buf, size);
+    /* room for the next piece of buf and the next async buffer */
+    if (f->iovcnt >= MAX_IOV_SIZE - 1) {
+        qemu_fflush(f);
+    }
+}
+
 void qemu_put_byte(QEMUFile *f, int v)
 {
     if (!f->last_error && f->is_write == 0 && f->buf_index > 0) {
@@ -673,6 +757,11 @@ int qemu_get_byte(QEMUFile *f)
 
 int64_t qemu_ftell(QEMUFile *f)
 {
+    if (f->iovcnt) {
+        /* iov holds buf up to buf_queued */
+        return f->buf_offset + iov_size(f->iov, f->iovcnt) +
+               f->buf_index - f->buf_queued;
+    }
     return f->buf_offset - f->buf_size + f->buf_index;
 }
 
@@ -1164,6 +1253,29 @@ typedef struct CompatEntry {
     int instance_id;
 } CompatEntry;
 
+/*
+ * A VMStateDescription flattened into a list of plain copies, for the
+ * common case of a device whose state is just integers, fixed arrays and
+ * nested structs of the same.  Such descriptions are compiled when they
+ * are registered; saving and loading them at the current version then
+ * runs through the list without the per-field callbacks and size lookups
+ * of vmstate_save_state() and vmstate_load_state().  Anything else, and
+ * loading an older version, goes through the interpreter.
+ */
+typedef struct VMStateOp {
+    size_t offset;
+    uint32_t size;              /* 2, 4 or 8; 1 means a buffer of num bytes */
+    uint32_t num;
+} VMStateOp;
+
+typedef struct VMStateProgram {
+    int nops;
+    VMStateOp ops[];
+} VMStateProgram;
+
+#define VMSTATE_COMPILE_MAX_DEPTH 4
+#define VMSTATE_COMPILE_MAX_OPS 256
+
 typedef struct SaveStateEntry {
     QTAILQ_ENTRY(SaveStateEntry) entry;
     char idstr[256];
@@ -1177,6 +1289,10 @@ typedef struct SaveStateEntry {
     CompatEntry *compat;
     int no_migrate;
     int is_ram;
+    VMStateProgram *prog;
+    /* of the last migration, in nanoseconds */
+    int64_t save_time;
+    int64_t load_time;
 } SaveStateEntry;
 
 
@@ -1309,6 +1425,100 @@ void unregister_savevm(DeviceState *dev, const char *idstr, void *opaque)
     }
 }
 
+static void vmstate_compile_op(VMStateOp *ops, int *nops, size_t offset,
+                               uint32_t size, uint32_t num)
+{
+    VMStateOp *last = *nops ? &ops[*nops - 1] : NULL;
+
+    /* neighbouring elements of the same size go together */
+    if (last && last->size == size &&
+        last->offset + (size_t)last->size * last->num == offset) {
+        last->num += num;
+        return;
+    }
+    ops[(*nops)++] = (VMStateOp) {
+        .offset = offset,
+        .size = size,
+        .num = num,
+    };
+}
+
+static bool vmstate_compile_fields(const VMStateDescription *vmsd,
+                                   size_t base, VMStateOp *ops, int *nops,
+                                   int depth)
+{
+    VMStateField *field;
+
+    for (field = vmsd->fields; field->name; field++) {
+        int flags = field->flags & ~(VMS_SINGLE | VMS_ARRAY | VMS_STRUCT |
+                                     VMS_BUFFER);
+        size_t offset = base + field->offset;
+        int i, n = field->flags & VMS_ARRAY ? field->num : 1;
+        uint32_t size;
+
+        if (flags || field->field_exists || *nops >= VMSTATE_COMPILE_MAX_OPS) {
+            return false;
+        }
+        if (field->flags & VMS_STRUCT) {
+            const VMStateDescription *sub = field->vmsd;
+
+            if (depth >= VMSTATE_COMPILE_MAX_DEPTH || sub->pre_load ||
+                sub->post_load || sub->pre_save ||
+                (sub->subsections && sub->subsections->vmsd)) {
+                return false;
+            }
+            for (i = 0; i < n; i++) {
+                if (!vmstate_compile_fields(sub, offset + field->size * i,
+                                            ops, nops, depth + 1)) {
+                    return false;
+                }
+            }
+            continue;
+        }
+
+        if (field->info == &vmstate_info_buffer) {
+            vmstate_compile_op(ops, nops, offset, 1, field->size * n);
+            continue;
+        }
+        if (field->info == &vmstate_info_int8 ||
+            field->info == &vmstate_info_uint8) {
+            size = 1;
+        } else if (field->info == &vmstate_info_int16 ||
+                   field->info == &vmstate_info_uint16) {
+            size = 2;
+        } else if (field->info == &vmstate_info_int32 ||
+                   field->info == &vmstate_info_uint32) {
+            size = 4;
+        } else if (field->info == &vmstate_info_int64 ||
+                   field->info == &vmstate_info_uint64) {
+            size = 8;
+        } else {
+            return false;
+        }
+        if (field->size != size) {
+            return false;
+        }
+        vmstate_compile_op(ops, nops, offset, size, n);
+    }
+    return true;
+}
+
+/* Returns NULL if @vmsd must be interpreted */
+static VMStateProgram *vmstate_compile(const VMStateDescription *vmsd)
+{
+    VMStateOp ops[VMSTATE_COMPILE_MAX_OPS];
+    VMStateProgram *prog;
+    int nops = 0;
+
+    if (!vmstate_compile_fields(vmsd, 0, ops, &nops, 0)) {
+        return NULL;
+    }
+    prog = g_malloc(sizeof(*prog) + nops * sizeof(VMStateOp));
+    prog->nops = nops;
+    memcpy(prog->ops, ops, nops * sizeof(VMStateOp));
+    return prog;
+}
+
 int vmstate_register_with_alias_id(DeviceState *dev, int instance_id,
                                    const VMStateDescription *vmsd,
                                    void *opaque, int alias_id,
@@ -1349,6 +1559,7 @@ int vmstate_register_with_alias_id(DeviceState *dev, int instance_id,
         se->instance_id = instance_id;
     }
     assert(!se->compat || se->instance_id == 0);
+    se->prog = vmstate_compile(vmsd);
     /* add at the end of list */
     QTAILQ_INSERT_TAIL(&savevm_handlers, se, entry);
     return 0;
@@ -1372,6 +1583,7 @@ void vmstate_unregister(DeviceState *dev, const VMStateDescription *vmsd,
             if (se->compat) {
                 g_free(se->compat);
             }
+            g_free(se->prog);
             g_free(se);
         }
     }
@@ -1513,21 +1725,147 @@ void vmstate_save_state(QEMUFile *f, const VMStateDescription *vmsd,
     vmstate_subsection_save(f, vmsd, opaque);
 }
 
+static void vmstate_save_program(QEMUFile *f, const VMStateProgram *prog,
+                                 void *opaque)
+{
+    const VMStateOp *op;
+    uint32_t i;
+
+    for (op = prog->ops; op < prog->ops + prog->nops; op++) {
+        uint8_t *p = opaque + op->offset;
+
+        switch (op->size) {
+        case 1:
+            qemu_put_buffer(f, p, op->num);
+            break;
+        case 2:
+            for (i = 0; i < op->num; i++) {
+                qemu_put_be16(f, ((uint16_t *)p)[i]);
+            }
+            break;
+        case 4:
+            for (i = 0; i < op->num; i++) {
+                qemu_put_be32(f, ((uint32_t *)p)[i]);
+            }
+            break;
+        case 8:
+            for (i = 0; i < op->num; i++) {
+                qemu_put_be64(f, ((uint64_t *)p)[i]);
+            }
+            break;
+        }
+    }
+}
+
+static void vmstate_load_program(QEMUFile *f, const VMStateProgram *prog,
+                                 void *opaque)
+{
+    const VMStateOp *op;
+    uint32_t i;
+
+    for (op = prog->ops; op < prog->ops + prog->nops; op++) {
+        uint8_t *p = opaque + op->offset;
+
+        switch (op->size) {
+        case 1:
+            qemu_get_buffer(f, p, op->num);
+            break;
+        case 2:
+            for (i = 0; i < op->num; i++) {
+                ((uint16_t *)p)[i] = qemu_get_be16(f);
+            }
+            break;
+        case 4:
+            for (i = 0; i < op->num; i++) {
+                ((uint32_t *)p)[i] = qemu_get_be32(f);
+            }
+            break;
+        case 8:
+            for (i = 0; i < op->num; i++) {
+                ((uint64_t *)p)[i] = qemu_get_be64(f);
+            }
+            break;
+        }
+    }
+}
+
 static int vmstate_load(QEMUFile *f, SaveStateEntry *se, int version_id)
 {
-    if (!se->vmsd) {         /* Old style */
+    const VMStateDescription *vmsd = se->vmsd;
+    int ret;
+
+    if (!vmsd) {             /* Old style */
         return se->ops->load_state(f, se->opaque, version_id);
     }
-    return vmstate_load_state(f, se->vmsd, se->opaque, version_id);
+    if (!se->prog || version_id != vmsd->version_id) {
+        return vmstate_load_state(f, vmsd, se->opaque, version_id);
+    }
+
+    if (vmsd->pre_load) {
+        ret = vmsd->pre_load(se->opaque);
+        if (ret) {
+            return ret;
+        }
+    }
+    vmstate_load_program(f, se->prog, se->opaque);
+    ret = vmstate_subsection_load(f, vmsd, se->opaque);
+    if (ret != 0) {
+        return ret;
+    }
+    if (vmsd->post_load) {
+        return vmsd->post_load(se->opaque, version_id);
+    }
+    return 0;
 }
 
 static void vmstate_save(QEMUFile *f, SaveStateEntry *se)
 {
-    if (!se->vmsd) {         /* Old style */
+    const VMStateDescription *vmsd = se->vmsd;
+
+    if (!vmsd) {             /* Old style */
         se->ops->save_state(f, se->opaque);
         return;
     }
-    vmstate_save_state(f,se->vmsd, se->opaque);
+    if (!se->prog) {
+        vmstate_save_state(f, vmsd, se->opaque);
+        return;
+    }
+
+    if (vmsd->pre_save) {
+        vmsd->pre_save(se->opaque);
+    }
+    vmstate_save_program(f, se->prog, se->opaque);
+    vmstate_subsection_save(f, vmsd, se->opaque);
+}
+
+/* Time spent on the device states in the last migration, NULL if none */
+MigrationDeviceStatsList *qemu_savevm_device_stats(void)
+{
+    MigrationDeviceStatsList *head = NULL, **tail = &head;
+    SaveStateEntry *se;
+
+    QTAILQ_FOREACH(se, &savevm_handlers, entry) {
+        MigrationDeviceStatsList *entry;
+
+        if (!se->save_time && !se->load_time) {
+            continue;
+        }
+        entry = g_malloc0(sizeof(*entry));
+        entry->value = g_malloc0(sizeof(*entry->value));
+        entry->value->id = g_strdup(se->idstr);
+        entry->value->instance_id = se->instance_id;
+        if (se->save_time) {
+            entry->value->has_save_time = true;
+            entry->value->save_time = se->save_time / 1000;
+        }
+        if (se->load_time) {
+            entry->value->has_load_time = true;
+            entry->value->load_time = se->load_time / 1000;
+        }
+        *tail = entry;
+        tail = &entry->next;
+    }
+    return head;
 }
 
 #define QEMU_VM_FILE_MAGIC           0x5145564d
@@ -1613,6 +1951,11 @@ int qemu_savevm_state_begin(QEMUFile *f,
  *   negative: there was one error, and we have -errno.
  *   0 : We haven't finished, caller have to go again
  *   1 : We have finished, we can go to complete phase
+ *
+ * It runs in the migration thread without the iothread lock; handlers
+ * take it themselves for the parts that need it.  On error the caller
+ * is responsible for calling qemu_savevm_state_cancel() with the lock
+ * held.
  */
 int qemu_savevm_state_iterate(QEMUFile *f)
 {
@@ -1650,16 +1993,13 @@ int qemu_savevm_state_iterate(QEMUFile *f)
     if (ret != 0) {
         return ret;
     }
-    ret = qemu_file_get_error(f);
-    if (ret != 0) {
-        qemu_savevm_state_cancel(f);
-    }
-    return ret;
+    return qemu_file_get_error(f);
 }
 
 int qemu_savevm_state_complete(QEMUFile *f)
 {
     SaveStateEntry *se;
+    int64_t start;
     int ret;
 
     cpu_synchronize_all_states();
@@ -1704,7 +2044,9 @@ int qemu_savevm_state_complete(QEMUFile *f)
         qemu_put_be32(f, se->instance_id);
         qemu_put_be32(f, se->version_id);
 
+        start = qemu_get_clock_ns(rt_clock);
         vmstate_save(f, se);
+        se->save_time = qemu_get_clock_ns(rt_clock) - start;
         trace_savevm_section_end(se->section_id);
     }
 
@@ -1741,12 +2083,9 @@ static int qemu_savevm_state(QEMUFile *f)
     if (ret < 0)
         goto out;
 
-    do {
-        ret = qemu_savevm_state_iterate(f);
-        if (ret < 0)
-            goto out;
-    } while (ret == 0);
-
+    /* The guest is stopped, so iterating would not make the final pass
+     * any shorter; qemu_savevm_state_iterate() also expects to run
+     * without the iothread lock, which we hold here.  */
     ret = qemu_savevm_state_complete(f);
 
 out:
@@ -1757,7 +2096,7 @@ out:
     return ret;
 }
 
-static int qemu_save_device_state(QEMUFile *f)
+int qemu_save_device_state(QEMUFile *f)
 {
     SaveStateEntry *se;
 
@@ -1902,6 +2241,7 @@ int qemu_loadvm_state(QEMUFile *f)
         QLIST_HEAD_INITIALIZER(loadvm_handlers);
     LoadStateEntry *le, *new_le;
     uint8_t section_type;
+    int64_t start;
     unsigned int v;
     int ret;
 
@@ -1962,7 +2302,9 @@ int qemu_loadvm_state(QEMUFile *f)
             le->version_id = version_id;
             QLIST_INSERT_HEAD(&loadvm_handlers, le, entry);
 
+            start = qemu_get_clock_ns(rt_clock);
             ret = vmstate_load(f, le->se, le->version_id);
+            se->load_time = qemu_get_clock_ns(rt_clock) - start;
             if (ret < 0) {
                 fprintf(stderr, "qemu: warning: error while loading state for instance 0x%x of device '%s'\n",
                         instance_id, idstr);
@@ -2004,6 +2346,9 @@ int qemu_loadvm_state(QEMUFile *f)
 
 out:
     QLIST_FOREACH_SAFE(le, &loadvm_handlers, entry, new_le) {
+        if (le->se->ops && le->se->ops->load_cleanup) {
+            le->se->ops->load_cleanup(le->se->opaque);
+        }
         QLIST_REMOVE(le, entry);
         g_free(le);
     }
@@ -2064,9 +2409,270 @@ static int del_existing_snapshots(Monitor *mon, const char *name)
     return 0;
 }
 
+static void savevm_create_snapshots(BlockDriverState *bs,
+                                    QEMUSnapshotInfo *sn,
+                                    uint64_t vm_state_size)
+{
+    BlockDriverState *bs1 = NULL;
+    int ret;
+
+    while ((bs1 = bdrv_next(bs1))) {
+        if (bdrv_can_snapshot(bs1)) {
+            /* Write VM state size only to the image that contains the state */
+            sn->vm_state_size = (bs == bs1 ? vm_state_size : 0);
+            ret = bdrv_snapshot_create(bs1, sn);
+            if (ret < 0) {
+                error_report("Error while creating snapshot on '%s'",
+                             bdrv_get_device_name(bs1));
+            }
+        }
+    }
+}
+
+/*
+ * Live snapshots
+ *
+ * The VM state is saved like an outgoing migration: RAM is copied by a
+ * thread of its own while the guest keeps running, and only the last
+ * pass over the pages dirtied in the meantime, the device state and the
+ * creation of the disk snapshots happen with the guest stopped.  The
+ * snapshot is thus taken at the end of the copy, not at its start.
+ *
+ * The state goes to the VM state area of the image through a buffer, so
+ * that the block layer sees large writes; they are issued with the
+ * iothread lock held, as the block layer requires.
+ */
+
+#define LIVE_SNAPSHOT_BUF_SIZE  (1 << 20)
+
+typedef struct LiveSnapshotState {
+    QEMUFile *file;
+    BlockDriverState *bs;
+    QEMUSnapshotInfo sn;
+    uint8_t *buf;
+    size_t buf_len;
+    int64_t pos;
+    bool locked;                /* the writer holds the iothread lock */
+    bool cancelled;
+    int ret;
+    int saved_vm_running;
+    int64_t start_time;
+    int64_t stop_time;
+    QEMUBH *cleanup_bh;
+    Error *blocker;
+} LiveSnapshotState;
+
+static LiveSnapshotState *live_snapshot;
+
+static int live_snapshot_flush(LiveSnapshotState *s)
+{
+    int ret;
+
+    if (!s->buf_len) {
+        return 0;
+    }
+    if (!s->locked) {
+        qemu_mutex_lock_iothread();
+    }
+    ret = bdrv_save_vmstate(s->bs, s->buf, s->pos, s->buf_len);
+    if (!s->locked) {
+        qemu_mutex_unlock_iothread();
+    }
+    if (ret < 0) {
+        return ret;
+    }
+    s->pos += s->buf_len;
+    s->buf_len = 0;
+    return 0;
+}
+
+static ssize_t live_snapshot_put_buffer(void *opaque, const void *data,
+                                        size_t size)
+{
+    LiveSnapshotState *s = opaque;
+    size_t len = MIN(size, LIVE_SNAPSHOT_BUF_SIZE - s->buf_len);
+    int ret;
+
+    memcpy(s->buf + s->buf_len, data, len);
+    s->buf_len += len;
+    if (s->buf_len == LIVE_SNAPSHOT_BUF_SIZE) {
+        ret = live_snapshot_flush(s);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return len;
+}
+
+/* Runs in the main loop once the snapshot thread has finished */
+static void live_snapshot_cleanup_bh(void *opaque)
+{
+    LiveSnapshotState *s = opaque;
+    int ret;
+
+    qemu_bh_delete(s->cleanup_bh);
+    ret = qemu_fclose(s->file);
+    if (s->ret == 0 && ret < 0) {
+        s->ret = ret;
+    }
+
+    if (s->ret == 0) {
+        savevm_create_snapshots(s->bs, &s->sn, s->pos);
+    } else if (s->ret != -ECANCELED) {
+        error_report("Error %d while writing VM", s->ret);
+    }
+    if (s->stop_time) {
+        trace_savevm_live_done(qemu_get_clock_ms(rt_clock) - s->start_time,
+                               qemu_get_clock_ms(rt_clock) - s->stop_time);
+        if (s->saved_vm_running) {
+            vm_start();
+        }
+    }
+
+    migrate_del_blocker(s->blocker);
+    error_free(s->blocker);
+    g_free(s->buf);
+    g_free(s);
+    live_snapshot = NULL;
+}
+
+/* Called from the snapshot thread with the iothread lock held, as the
+   last thing it does */
+static void live_snapshot_finish(LiveSnapshotState *s, int ret)
+{
+    s->ret = ret;
+    s->locked = true;
+    s->cleanup_bh = qemu_bh_new(live_snapshot_cleanup_bh, s);
+    qemu_bh_schedule(s->cleanup_bh);
+}
+
+static int live_snapshot_setup(void *opaque)
+{
+    LiveSnapshotState *s = opaque;
+    MigrationParams params = {
+        .blk = 0,
+        .shared = 0
+    };
+    int ret;
+
+    qemu_mutex_lock_iothread();
+    s->locked = true;
+    ret = qemu_savevm_state_begin(s->file, &params);
+    s->locked = false;
+    if (ret < 0) {
+        live_snapshot_finish(s, ret);
+    }
+    qemu_mutex_unlock_iothread();
+
+    return ret;
+}
+
+static bool live_snapshot_put_ready(void *opaque)
+{
+    LiveSnapshotState *s = opaque;
+    int ret = 0;
+
+    if (!s->cancelled) {
+        ret = qemu_savevm_state_iterate(s->file);
+        if (ret == 0) {
+            return true;
+        }
+    }
+
+    qemu_mutex_lock_iothread();
+    s->locked = true;
+    if (s->cancelled || ret < 0) {
+        qemu_savevm_state_cancel(s->file);
+        ret = ret < 0 ? ret : -ECANCELED;
+    } else {
+        s->stop_time = qemu_get_clock_ms(rt_clock);
+        s->saved_vm_running = runstate_is_running();
+        vm_stop(RUN_STATE_SAVE_VM);
+        assert(!runstate_is_running());
+
+        s->sn.vm_clock_nsec = qemu_get_clock_ns(vm_clock);
+        ret = qemu_savevm_state_complete(s->file);
+        if (ret >= 0) {
+            qemu_fflush(s->file);
+            ret = qemu_file_get_error(s->file);
+        }
+        if (ret >= 0) {
+            ret = live_snapshot_flush(s);
+        }
+    }
+    live_snapshot_finish(s, ret);
+    qemu_mutex_unlock_iothread();
+
+    return false;
+}
+
+/* Nothing is ever queued, the writes block instead */
+static void live_snapshot_wait_for_unfreeze(void *opaque)
+{
+}
+
+static int live_snapshot_close(void *opaque)
+{
+    LiveSnapshotState *s = opaque;
+    int ret = live_snapshot_flush(s);
+
+    return ret < 0 ? ret : bdrv_flush(s->bs);
+}
+
+static bool live_snapshot_check(Monitor *mon)
+{
+    if (migration_in_progress()) {
+        monitor_printf(mon, "Cannot save a live snapshot during migration\n");
+        return false;
+    }
+    /* the VM state is loaded without the matching migration settings */
+    if (migrate_use_xbzrle() || migrate_use_compression() ||
+        migrate_use_dedup()) {
+        monitor_printf(mon, "Live snapshots do not support the xbzrle, "
+                       "compress and dedup migration capabilities\n");
+        return false;
+    }
+    if (qemu_savevm_state_blocked(NULL)) {
+        monitor_printf(mon, "The VM state cannot be saved\n");
+        return false;
+    }
+    return true;
+}
+
+static void live_snapshot_start(BlockDriverState *bs, QEMUSnapshotInfo *sn)
+{
+    LiveSnapshotState *s = g_malloc0(sizeof(*s));
+
+    s->bs = bs;
+    s->sn = *sn;
+    s->buf = g_malloc(LIVE_SNAPSHOT_BUF_SIZE);
+    s->start_time = qemu_get_clock_ms(rt_clock);
+
+    error_set(&s->blocker, ERROR_CLASS_GENERIC_ERROR,
+              "A live snapshot is being saved");
+    migrate_add_blocker(s->blocker);
+
+    live_snapshot = s;
+    /* the thread waits for the iothread lock, so s->file is set in time */
+    s->file = qemu_fopen_ops_buffered(s, SIZE_MAX,
+                                      live_snapshot_put_buffer, NULL,
+                                      live_snapshot_setup,
+                                      live_snapshot_put_ready,
+                                      live_snapshot_wait_for_unfreeze,
+                                      live_snapshot_close);
+}
+
+void do_savevm_cancel(Monitor *mon, const QDict *qdict)
+{
+    if (live_snapshot) {
+        /* The snapshot thread notices and cleans up after itself */
+        live_snapshot->cancelled = true;
+    }
+}
+
 void do_savevm(Monitor *mon, const QDict *qdict)
 {
-    BlockDriverState *bs, *bs1;
+    BlockDriverState *bs;
     QEMUSnapshotInfo sn1, *sn = &sn1, old_sn1, *old_sn = &old_sn1;
     int ret;
     QEMUFile *f;
@@ -2080,6 +2686,12 @@ void do_savevm(Monitor *mon, const QDict *qdict)
     struct tm tm;
 #endif
     const char *name = qdict_get_try_str(qdict, "name");
+    bool live = qdict_get_try_bool(qdict, "live", 0);
+
+    if (live_snapshot) {
+        monitor_printf(mon, "A live snapshot is being saved\n");
+        return;
+    }
 
     /* Verify if there is a device that doesn't support snapshots and is writable */
     bs = NULL;
@@ -2102,8 +2714,15 @@ void do_savevm(Monitor *mon, const QDict *qdict)
         return;
     }
 
-    saved_vm_running = runstate_is_running();
-    vm_stop(RUN_STATE_SAVE_VM);
+    if (live) {
+        if (!live_snapshot_check(mon)) {
+            return;
+        }
+        saved_vm_running = 0;
+    } else {
+        saved_vm_running = runstate_is_running();
+        vm_stop(RUN_STATE_SAVE_VM);
+    }
 
     memset(sn, 0, sizeof(*sn));
 
@@ -2144,6 +2763,11 @@ void do_savevm(Monitor *mon, const QDict *qdict)
         goto the_end;
     }
 
+    if (live) {
+        live_snapshot_start(bs, sn);
+        return;
+    }
+
     /* save the VM state */
     f = qemu_fopen_bdrv(bs, 1);
     if (!f) {
@@ -2158,20 +2782,7 @@ void do_savevm(Monitor *mon, const QDict *qdict)
         goto the_end;
     }
 
-    /* create the snapshots */
-
-    bs1 = NULL;
-    while ((bs1 = bdrv_next(bs1))) {
-        if (bdrv_can_snapshot(bs1)) {
-            /* Write VM state size only to the image that contains the state */
-            sn->vm_state_size = (bs == bs1 ? vm_state_size : 0);
-            ret = bdrv_snapshot_create(bs1, sn);
-            if (ret < 0) {
-                monitor_printf(mon, "Error while creating snapshot on '%s'\n",
-                               bdrv_get_device_name(bs1));
-            }
-        }
-    }
+    savevm_create_snapshots(bs, sn, vm_state_size);
 
  the_end:
     if (saved_vm_running)
@@ -2211,6 +2822,11 @@ int load_vmstate(const char *name)
     QEMUFile *f;
     int ret;
 
+    if (live_snapshot) {
+        error_report("A live snapshot is being saved");
+        return -EBUSY;
+    }
+
     bs_vm_state = bdrv_snapshots();
     if (!bs_vm_state) {
         error_report("No block device supports snapshots");
@@ -2290,6 +2906,11 @@ void do_delvm(Monitor *mon, const QDict *qdict)
     int ret;
     const char *name = qdict_get_str(qdict, "name");
 
+    if (live_snapshot) {
+        monitor_printf(mon, "A live snapshot is being saved\n");
+        return;
+    }
+
     bs = bdrv_snapshots();
     if (!bs) {
         monitor_printf(mon, "No block device supports snapshots\n");
@@ -2392,162 +3013,3 @@ void vmstate_register_ram_global(MemoryRegion *mr)
 {
     vmstate_register_ram(mr, NULL);
 }
-
-/*
-  page = zrun nzrun
-       | zrun nzrun page
-
-  zrun = length
-
-  nzrun = length byte...
-
-  length = uleb128 encoded integer
- */
-int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
-                         uint8_t *dst, int dlen)
-{
-    uint32_t zrun_len = 0, nzrun_len = 0;
-    int d = 0, i = 0;
-    long res, xor;
-    uint8_t *nzrun_start = NULL;
-
-    g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
-               sizeof(long)));
-
-    while (i < slen) {
-        /* overflow */
-        if (d + 2 > dlen) {
-            return -1;
-        }
-
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] == new_buf[i]) {
-            zrun_len++;
-            i++;
-            res--;
-        }
-
-        /* word at a time for speed */
-        if (!res) {
-            while (i < slen &&
-                   (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
-                i += sizeof(long);
-                zrun_len += sizeof(long);
-            }
-
-            /* go over the rest */
-            while (i < slen && old_buf[i] == new_buf[i]) {
-                zrun_len++;
-                i++;
-            }
-        }
-
-        /* buffer unchanged */
-        if (zrun_len == slen) {
-            return 0;
-        }
-
-        /* skip last zero run */
-        if (i == slen) {
-            return d;
-        }
-
-        d += uleb128_encode_small(dst + d, zrun_len);
-
-        zrun_len = 0;
-        nzrun_start = new_buf + i;
-
-        /* overflow */
-        if (d + 2 > dlen) {
-            return -1;
-        }
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] != new_buf[i]) {
-            i++;
-            nzrun_len++;
-            res--;
-        }
-
-        /* word at a time for speed, use of 32-bit long okay */
-        if (!res) {
-            /* truncation to 32-bit long okay */
-            long mask = (long)0x0101010101010101ULL;
-            while (i < slen) {
-                xor = *(long *)(old_buf + i) ^ *(long *)(new_buf + i);
-                if ((xor - mask) & ~xor & (mask << 7)) {
-                    /* found the end of an nzrun within the current long */
-                    while (old_buf[i] != new_buf[i]) {
-                        nzrun_len++;
-                        i++;
-                    }
-                    break;
-                } else {
-                    i += sizeof(long);
-                    nzrun_len += sizeof(long);
-                }
-            }
-        }
-
-        d += uleb128_encode_small(dst + d, nzrun_len);
-        /* overflow */
-        if (d + nzrun_len > dlen) {
-            return -1;
-        }
-        memcpy(dst + d, nzrun_start, nzrun_len);
-        d += nzrun_len;
-        nzrun_len = 0;
-    }
-
-    return d;
-}
-
-int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
-{
-    int i = 0, d = 0;
-    int ret;
-    uint32_t count = 0;
-
-    while (i < slen) {
-
-        /* zrun */
-        if ((slen - i) < 2) {
-            return -1;
-        }
-
-        ret = uleb128_decode_small(src + i, &count);
-        if (ret < 0 || (i && !count)) {
-            return -1;
-        }
-        i += ret;
-        d += count;
-
-        /* overflow */
-        if (d > dlen) {
-            return -1;
-        }
-
-        /* nzrun */
-        if ((slen - i) < 2) {
-            return -1;
-        }
-
-        ret = uleb128_decode_small(src + i, &count);
-        if (ret < 0 || !count) {
-            return -1;
-        }
-        i += ret;
-
-        /* overflow */
-        if (d + count > dlen || i + count > slen) {
-            return -1;
-        }
-
-        memcpy(dst + d, src + i, count);
-        d += count;
-        i += count;
-    }
-
-    return d;
-}
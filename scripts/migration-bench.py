@@ -0,0 +1,243 @@
+#!/usr/bin/env python
+#
+# Live migration benchmark
+#
+# Copyright Red Hat, Inc. 2012
+#
+# This work is licensed under the terms of the GNU GPL, version 2.  See
+# the COPYING file in the top-level directory.
+#
+# Usage: migration-bench.py [--qemu BINARY] [options]
+#
+# Runs a source and a destination QEMU on this host and migrates between
+# them once for each combination of --bandwidth, --max-downtime and
+# --dirty-rate.  There is no guest: both sides use the qtest accelerator,
+# and the script dirties guest RAM on the source through the qtest socket
+# at the requested rate, one byte per page, so that the pages neither stay
+# duplicates nor compress to nothing with XBZRLE.
+#
+# Each run prints one JSON object per line with the parameters and the
+# results: total time, bytes transferred, pre-copy passes, the XBZRLE
+# statistics if enabled, the downtime measured by the source, and the
+# guest-visible downtime from the STOP event on the source to the RESUME
+# event on the destination.  Compare the output of two builds with the
+# same options.
+
+from __future__ import print_function
+import json
+import optparse
+import os
+import shutil
+import socket
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+sys.path.append(os.path.join(os.path.dirname(__file__), '..', 'QMP'))
+import qmp
+
+PAGE_SIZE = 4096
+# leave the first megabyte alone, as the PC machine puts its BIOS there
+DIRTY_BASE = 1 << 20
+
+class QTestDirtier(threading.Thread):
+    """Write one byte to each page of a working set, @rate pages/s"""
+
+    def __init__(self, path, rate, size):
+        threading.Thread.__init__(self)
+        self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.sock.connect(path)
+        self.sockfile = self.sock.makefile()
+        self.rate = rate
+        self.pages = size // PAGE_SIZE
+        self.written = 0
+        self.stopped = threading.Event()
+        self.daemon = True
+
+    def write(self, addr, value):
+        self.sock.sendall('write 0x%x 1 0x%02x\n' % (addr, value))
+        while not self.sockfile.readline().startswith('OK'):
+            pass
+
+    def run(self):
+        start = time.time()
+        page = 0
+        while not self.stopped.is_set():
+            # catch up with the rate in slices of 10 ms
+            due = int((time.time() - start) * self.rate)
+            while self.written < due and not self.stopped.is_set():
+                self.write(DIRTY_BASE + page * PAGE_SIZE, self.written & 0xff)
+                self.written += 1
+                page = (page + 1) % self.pages
+            time.sleep(0.01)
+
+    def stop(self):
+        self.stopped.set()
+        self.join()
+        self.sock.close()
+
+class VM(object):
+    def __init__(self, opts, tmpdir, name, extra_args):
+        self.qmp_path = os.path.join(tmpdir, name + '.qmp')
+        self.qtest_path = os.path.join(tmpdir, name + '.qtest')
+        args = [opts.qemu,
+                '-machine', 'accel=qtest',
+                '-qtest', 'unix:%s,server,nowait' % self.qtest_path,
+                '-qtest-log', '/dev/null',
+                '-qmp', 'unix:%s,server,nowait' % self.qmp_path,
+                '-m', str(opts.mem),
+                '-display', 'none', '-vga', 'none', '-net', 'none']
+        self.proc = subprocess.Popen(args + extra_args)
+        for i in range(100):
+            if os.path.exists(self.qmp_path):
+                break
+            time.sleep(0.05)
+        self.mon = qmp.QEMUMonitorProtocol(self.qmp_path)
+        self.mon.connect()
+
+    def command(self, cmd, **kwds):
+        return self.mon.command(cmd, **kwds)
+
+    def wait_event(self, name, timeout=30):
+        deadline = time.time() + timeout
+        while time.time() < deadline:
+            for event in self.mon.get_events():
+                if event['event'] == name:
+                    return event
+            time.sleep(0.01)
+        return None
+
+    def shutdown(self):
+        try:
+            self.command('quit')
+        except Exception:
+            pass
+        self.mon.close()
+        self.proc.wait()
+
+def event_time(event):
+    ts = event['timestamp']
+    return ts['seconds'] + ts['microseconds'] / 1e6
+
+def run_once(opts, bandwidth, max_downtime, dirty_rate):
+    tmpdir = tempfile.mkdtemp(prefix='migration-bench-')
+    if opts.transport == 'unix':
+        uri = 'unix:' + os.path.join(tmpdir, 'migrate.sock')
+    else:
+        uri = 'tcp:127.0.0.1:%d' % opts.port
+    result = dict(transport=opts.transport, mem=opts.mem,
+                  bandwidth=bandwidth, max_downtime=max_downtime,
+                  dirty_rate=dirty_rate, xbzrle=opts.xbzrle)
+    src = dst = dirtier = None
+    try:
+        src = VM(opts, tmpdir, 'src', [])
+        dst = VM(opts, tmpdir, 'dst', ['-incoming', uri])
+
+        if opts.xbzrle:
+            src.command('migrate-set-capabilities', capabilities=[
+                {'capability': 'xbzrle', 'state': True}])
+            src.command('migrate-set-cache-size',
+                        value=opts.cache_size << 20)
+        src.command('migrate_set_speed', value=bandwidth << 20)
+        src.command('migrate_set_downtime', value=max_downtime / 1000.0)
+
+        if dirty_rate:
+            dirtier = QTestDirtier(src.qtest_path, dirty_rate,
+                                   opts.dirty_size << 20)
+            dirtier.start()
+            # let the workload settle before migrating
+            time.sleep(0.5)
+
+        src.command('migrate', uri=uri)
+        deadline = time.time() + opts.timeout
+        while True:
+            info = src.command('query-migrate')
+            if info.get('status') != 'active':
+                break
+            if time.time() > deadline:
+                src.command('migrate_cancel')
+                info = dict(status='timeout')
+                break
+            time.sleep(0.05)
+        if dirtier:
+            dirtier.stop()
+            result['dirtied_pages'] = dirtier.written
+            dirtier = None
+
+        result['status'] = info.get('status')
+        if info.get('status') == 'completed':
+            ram = info['ram']
+            result['total_time'] = info.get('total-time')
+            result['downtime'] = info.get('downtime')
+            result['transferred'] = ram['transferred']
+            result['iterations'] = ram['dirty-sync-count']
+            result['duplicate'] = ram['duplicate']
+            result['normal'] = ram['normal']
+            if 'xbzrle-cache' in info:
+                result['xbzrle'] = info['xbzrle-cache']
+            stop = src.wait_event('STOP')
+            resume = dst.wait_event('RESUME')
+            if stop and resume:
+                result['guest_downtime'] = int(round(
+                    (event_time(resume) - event_time(stop)) * 1000))
+    finally:
+        if dirtier:
+            dirtier.stop()
+        if src:
+            src.shutdown()
+        if dst:
+            dst.shutdown()
+        shutil.rmtree(tmpdir)
+    return result
+
+def int_list(value):
+    return [int(v) for v in value.split(',')]
+
+def main():
+    parser = optparse.OptionParser(usage='%prog [options]')
+    parser.add_option('--qemu', default=os.environ.get(
+                          'QTEST_QEMU_BINARY',
+                          'x86_64-softmmu/qemu-system-x86_64'),
+                      help='QEMU binary [default: $QTEST_QEMU_BINARY]')
+    parser.add_option('--transport', choices=['unix', 'tcp'],
+                      default='unix', help='unix or tcp [default: %default]')
+    parser.add_option('--port', type='int', default=4444,
+                      help='TCP port [default: %default]')
+    parser.add_option('--mem', type='int', default=512,
+                      help='guest RAM in MB [default: %default]')
+    parser.add_option('--bandwidth', default='32,1024',
+                      help='comma separated bandwidth limits in MB/s '
+                           '[default: %default]')
+    parser.add_option('--max-downtime', default='30,300',
+                      help='comma separated downtime limits in ms '
+                           '[default: %default]')
+    parser.add_option('--dirty-rate', default='0,10000',
+                      help='comma separated rates of dirtied pages/s '
+                           '[default: %default]')
+    parser.add_option('--dirty-size', type='int', default=64,
+                      help='working set of the dirtier in MB '
+                           '[default: %default]')
+    parser.add_option('--xbzrle', action='store_true', default=False,
+                      help='enable the xbzrle capability')
+    parser.add_option('--cache-size', type='int', default=64,
+                      help='XBZRLE cache size in MB [default: %default]')
+    parser.add_option('--timeout', type='int', default=120,
+                      help='cancel a migration after this many seconds '
+                           '[default: %default]')
+    opts, args = parser.parse_args()
+    if args:
+        parser.error('unexpected arguments')
+    if opts.dirty_size + DIRTY_BASE // (1 << 20) > opts.mem:
+        parser.error('--dirty-size does not fit in --mem')
+
+    for bandwidth in int_list(opts.bandwidth):
+        for max_downtime in int_list(opts.max_downtime):
+            for dirty_rate in int_list(opts.dirty_rate):
+                result = run_once(opts, bandwidth, max_downtime, dirty_rate)
+                print(json.dumps(result, sort_keys=True))
+                sys.stdout.flush()
+
+if __name__ == '__main__':
+    main()
@@ -44,7 +44,7 @@ def generate_command_decl(name, args, ret_type):
 ''',
                  ret_type=c_type(ret_type), name=c_fun(name), args=arglist).strip()
 
-def gen_sync_call(name, args, ret_type, indent=0):
+def gen_sync_call(name, args, ret_type, json_output=False, indent=0):
     ret = ""
     arglist=""
     retval=""
@@ -66,14 +66,16 @@ if (!error_is_set(errp)) {
     %(marshal_output_call)s
 }
 ''',
-                            marshal_output_call=gen_marshal_output_call(name, ret_type)).rstrip()
+                            marshal_output_call=gen_marshal_output_call(name, ret_type, json_output)).rstrip()
     pop_indent(indent)
     return ret.rstrip()
 
 
-def gen_marshal_output_call(name, ret_type):
+def gen_marshal_output_call(name, ret_type, json_output=False):
     if not ret_type:
         return ""
+    if json_output:
+        return "qmp_marshal_output_%s(retval, mon, errp);" % c_fun(name)
     return "qmp_marshal_output_%s(retval, ret, errp);" % c_fun(name)
 
 def gen_visitor_output_containers_decl(ret_type):
@@ -176,9 +178,36 @@ qmp_input_visitor_cleanup(mi);
     pop_indent()
     return ret.rstrip()
 
-def gen_marshal_output(name, args, ret_type, middle_mode):
+# The reply goes to the monitor as JSON text, without building a QObject
+def gen_marshal_output_json(name, args, ret_type):
+    ret = mcgen('''
+static void qmp_marshal_output_%(c_name)s(%(c_ret_type)s ret_in, Monitor *mon, Error **errp)
+{
+    QapiDeallocVisitor *md = qapi_dealloc_visitor_new();
+    JsonOutputVisitor *jo = json_output_visitor_new();
+    Visitor *v;
+
+    v = json_output_get_visitor(jo);
+    %(visitor)s(v, &ret_in, "unused", errp);
+    if (!error_is_set(errp)) {
+        monitor_set_json_return(mon, json_output_get_string(jo));
+    }
+    json_output_visitor_cleanup(jo);
+    v = qapi_dealloc_get_visitor(md);
+    %(visitor)s(v, &ret_in, "unused", errp);
+    qapi_dealloc_visitor_cleanup(md);
+}
+''',
+                c_ret_type=c_type(ret_type), c_name=c_fun(name),
+                visitor=type_visitor(ret_type))
+
+    return ret
+
+def gen_marshal_output(name, args, ret_type, middle_mode, json_output=False):
     if not ret_type:
         return ""
+    if json_output:
+        return gen_marshal_output_json(name, args, ret_type)
 
     ret = mcgen('''
 static void qmp_marshal_output_%(c_name)s(%(c_ret_type)s ret_in, QObject **ret_out, Error **errp)
@@ -211,7 +240,7 @@ def gen_marshal_input_decl(name, args, ret_type, middle_mode):
 
 
 
-def gen_marshal_input(name, args, ret_type, middle_mode):
+def gen_marshal_input(name, args, ret_type, middle_mode, json_output=False):
     hdr = gen_marshal_input_decl(name, args, ret_type, middle_mode)
 
     ret = mcgen('''
@@ -259,7 +288,8 @@ def gen_marshal_input(name, args, ret_type, middle_mode):
     }
 %(sync_call)s
 ''',
-                 sync_call=gen_sync_call(name, args, ret_type, indent=4))
+                 sync_call=gen_sync_call(name, args, ret_type, json_output,
+                                         indent=4))
     ret += mcgen('''
 
 out:
@@ -377,6 +407,11 @@ def gen_command_def_prologue(prefix="", proxy=False):
 
 ''',
                 prefix=prefix)
+    if middle_mode:
+        ret += mcgen('''
+#include "qapi/json-output-visitor.h"
+#include "monitor.h"
+''')
     if not proxy:
         ret += '#include "%sqmp-commands.h"' % prefix
     return ret + "\n\n"
@@ -453,16 +488,18 @@ if dispatch_type == "sync":
             arglist = cmd['data']
         if cmd.has_key('returns'):
             ret_type = cmd['returns']
+        # only the monitor can take the reply as text
+        json_output = middle_mode and option_value_matches('json-output', 'yes', cmd)
         ret = generate_command_decl(cmd['command'], arglist, ret_type) + "\n"
         fdecl.write(ret)
         if ret_type:
-            ret = gen_marshal_output(cmd['command'], arglist, ret_type, middle_mode) + "\n"
+            ret = gen_marshal_output(cmd['command'], arglist, ret_type, middle_mode, json_output) + "\n"
             fdef.write(ret)
 
         if middle_mode:
             fdecl.write('%s;\n' % gen_marshal_input_decl(cmd['command'], arglist, ret_type, middle_mode))
 
-        ret = gen_marshal_input(cmd['command'], arglist, ret_type, middle_mode) + "\n"
+        ret = gen_marshal_input(cmd['command'], arglist, ret_type, middle_mode, json_output) + "\n"
         fdef.write(ret)
 
     fdecl.write("\n#endif\n");
@@ -0,0 +1,103 @@
+#!/usr/bin/env python
+#
+# Summarize the quality of the code generated by TCG
+#
+# Copyright Red Hat, Inc. 2012
+#
+# This work is licensed under the terms of the GNU GPL, version 2.  See
+# the COPYING file in the top-level directory.
+#
+# Usage: run the workload with "-d op_opt,out_asm", then
+#
+#   tcg-codesize.py [--env-reg REG] qemu.log [qemu-other.log]
+#
+# For each log, print the number of TBs, guest instructions and TCG ops,
+# the size of the host code, and how many host instructions load from or
+# store to the CPU state.  With two logs, also print the change from the
+# first to the second, for example before and after a register allocator
+# change.  Time the workload separately to compare speed.
+
+from __future__ import print_function
+import re
+import sys
+
+def parse_log(fobj, env_reg):
+    stats = dict(tbs=0, guest_insns=0, ops=0, host_bytes=0,
+                 host_insns=0, env_accesses=0)
+    env_re = re.compile(r'\(%' + env_reg + r'\)')
+    section = None
+    for line in fobj:
+        line = line.rstrip('\n')
+        if line.startswith('OP after liveness analysis:'):
+            section = 'op'
+            stats['tbs'] += 1
+            continue
+        m = re.match(r'OUT: \[size=(\d+)\]', line)
+        if m:
+            section = 'out'
+            stats['host_bytes'] += int(m.group(1))
+            continue
+        if not line:
+            section = None
+            continue
+        if section == 'op':
+            if line.startswith(' ---- '):
+                stats['guest_insns'] += 1
+            elif not line.startswith(' nop'):
+                stats['ops'] += 1
+        elif section == 'out' and line.startswith('0x'):
+            stats['host_insns'] += 1
+            if env_re.search(line):
+                stats['env_accesses'] += 1
+    return stats
+
+def ratio(a, b):
+    return float(a) / b if b else 0.0
+
+def print_stats(name, stats):
+    print(name)
+    print('  TBs                  %d' % stats['tbs'])
+    print('  guest instructions   %d' % stats['guest_insns'])
+    print('  TCG ops              %d (%.2f/guest insn)' %
+          (stats['ops'], ratio(stats['ops'], stats['guest_insns'])))
+    print('  host code bytes      %d (%.2f/guest insn)' %
+          (stats['host_bytes'],
+           ratio(stats['host_bytes'], stats['guest_insns'])))
+    print('  host instructions    %d (%.2f/guest insn)' %
+          (stats['host_insns'],
+           ratio(stats['host_insns'], stats['guest_insns'])))
+    print('  CPU state accesses   %d (%.1f%% of host insns)' %
+          (stats['env_accesses'],
+           100 * ratio(stats['env_accesses'], stats['host_insns'])))
+
+def main(args):
+    env_reg = 'r14'
+    if len(args) > 1 and args[0] == '--env-reg':
+        env_reg = args[1]
+        args = args[2:]
+    if len(args) not in (1, 2):
+        sys.stderr.write('usage: %s [--env-reg REG] LOG [LOG2]\n' %
+                         sys.argv[0])
+        return 1
+
+    results = []
+    for name in args:
+        with open(name) as fobj:
+            results.append(parse_log(fobj, env_reg))
+        print_stats(name, results[-1])
+
+    if len(results) == 2:
+        a, b = results
+        print('change per guest instruction')
+        for key, label in (('ops', 'TCG ops'),
+                           ('host_bytes', 'host code bytes'),
+                           ('host_insns', 'host instructions'),
+                           ('env_accesses', 'CPU state accesses')):
+            before = ratio(a[key], a['guest_insns'])
+            after = ratio(b[key], b['guest_insns'])
+            print('  %-20s %+.1f%%' %
+                  (label, 100 * (ratio(after, before) - 1) if before else 0))
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv[1:]))
@@ -40,10 +40,17 @@ def h(events):
     out('#include "trace-dtrace.h"',
         '')
 
+    # the is-enabled probe keeps the arguments from being evaluated when
+    # no tracer is attached
     for e in events:
-        out('static inline void trace_%(name)s(%(args)s) {',
+        out('static inline void _dtrace_trace_%(name)s(%(args)s) {',
             '    QEMU_%(uppername)s(%(argnames)s);',
             '}',
+            '#define trace_%(name)s(...) do { \\',
+            '    if (unlikely(QEMU_%(uppername)s_ENABLED())) { \\',
+            '        _dtrace_trace_%(name)s(__VA_ARGS__); \\',
+            '    } \\',
+            '} while (0)',
             name = e.name,
             args = e.args,
             uppername = e.name.upper(),
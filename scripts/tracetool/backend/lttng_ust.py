@@ -0,0 +1,73 @@
+#!/usr/bin/env python
+# -*- coding: utf-8 -*-
+
+"""
+LTTng-UST 2.x tracepoint backend.
+"""
+
+__author__     = "Lluís Vilanova <vilanova@ac.upc.edu>"
+__copyright__  = "Copyright 2012, Lluís Vilanova <vilanova@ac.upc.edu>"
+__license__    = "GPL version 2 or (at your option) any later version"
+
+__maintainer__ = "Stefan Hajnoczi"
+__email__      = "stefanha@linux.vnet.ibm.com"
+
+
+from tracetool import out
+
+
+def c(events):
+    # trace.h pulls in trace-ust.h, which must see these first
+    out('#define TRACEPOINT_DEFINE',
+        '#define TRACEPOINT_CREATE_PROBES',
+        '#include "trace.h"')
+
+
+def h(events):
+    out('#include "trace-ust.h"',
+        '')
+
+    # tracepoint() tests a per-event enable flag before it evaluates the
+    # arguments, so disabled events cost a single branch
+    for e in events:
+        if len(e.args) > 0:
+            out('#define trace_%(name)s(...) tracepoint(qemu, %(name)s, __VA_ARGS__)',
+                name = e.name,
+                )
+        else:
+            out('#define trace_%(name)s() tracepoint(qemu, %(name)s)',
+                name = e.name,
+                )
+
+    out('')
+
+
+def ust_events_h(events):
+    for e in events:
+        if len(e.args) > 0:
+            args = ", ".join(["%s, %s" % (t, n) for t, n in e.args])
+        else:
+            args = "void"
+
+        fields = []
+        for t, n in e.args:
+            if t.replace(" ", "") in ("char*", "constchar*"):
+                fields.append('ctf_string(%s, %s)' % (n, n))
+            elif '*' in t:
+                fields.append('ctf_integer_hex(intptr_t, %s, (intptr_t)%s)' % (n, n))
+            else:
+                fields.append('ctf_integer(%s, %s, %s)' % (t, n, n))
+
+        out('TRACEPOINT_EVENT(',
+            '    qemu,',
+            '    %(name)s,',
+            '    TP_ARGS(%(args)s),',
+            '    TP_FIELDS(',
+            name = e.name,
+            args = args,
+            )
+        for f in fields:
+            out('        ' + f)
+        out('    )',
+            ')',
+            '')
@@ -37,7 +37,7 @@ def c(events):
         '')
 
     for num, event in enumerate(events):
-        out('void trace_%(name)s(%(args)s)',
+        out('void _simple_trace_%(name)s(%(args)s)',
             '{',
             '    TraceBufferRecord rec;',
             name = event.name,
@@ -58,11 +58,8 @@ def c(events):
             sizestr = '0'
 
 
+        # the event state is checked by the trace_* macro in trace.h
         out('',
-            '    if (!trace_list[%(event_id)s].state) {',
-            '        return;',
-            '    }',
-            '',
             '    if (trace_record_start(&rec, %(event_id)s, %(size_str)s)) {',
             '        return; /* Trace Buffer Full, Event Dropped ! */',
             '    }',
@@ -95,13 +92,22 @@ def c(events):
 
 def h(events):
     out('#include "trace/simple.h"',
-        '')
+        '',
+        '#define NR_TRACE_EVENTS %d' % len(events),
+        'extern TraceEvent trace_list[NR_TRACE_EVENTS];')
 
-    for event in events:
-        out('void trace_%(name)s(%(args)s);',
+    # A disabled event costs one load and a predictable branch at the call
+    # site; its arguments are not evaluated and no call is made.
+    for num, event in enumerate(events):
+        out('',
+            'void _simple_trace_%(name)s(%(args)s);',
+            '#define trace_%(name)s(...) do { \\',
+            '    if (unlikely(trace_list[%(event_id)s].state)) { \\',
+            '        _simple_trace_%(name)s(__VA_ARGS__); \\',
+            '    } \\',
+            '} while (0)',
             name = event.name,
             args = event.args,
+            event_id = num,
             )
     out('')
-    out('#define NR_TRACE_EVENTS %d' % len(events))
-    out('extern TraceEvent trace_list[NR_TRACE_EVENTS];')
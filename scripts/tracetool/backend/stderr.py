@@ -39,12 +39,16 @@ def h(events):
         if len(e.args) > 0:
             argnames = ", " + argnames
 
-        out('static inline void trace_%(name)s(%(args)s)',
+        # check the state before the arguments are evaluated
+        out('static inline void _stderr_trace_%(name)s(%(args)s)',
             '{',
-            '    if (trace_list[%(event_num)s].state != 0) {',
-            '        fprintf(stderr, "%(name)s " %(fmt)s "\\n" %(argnames)s);',
-            '    }',
+            '    fprintf(stderr, "%(name)s " %(fmt)s "\\n" %(argnames)s);',
             '}',
+            '#define trace_%(name)s(...) do { \\',
+            '    if (unlikely(trace_list[%(event_num)s].state)) { \\',
+            '        _stderr_trace_%(name)s(__VA_ARGS__); \\',
+            '    } \\',
+            '} while (0)',
             name = e.name,
             args = e.args,
             event_num = num,
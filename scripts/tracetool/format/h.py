@@ -35,11 +35,17 @@ def end(events):
         '#endif /* TRACE_H */')
 
 def nop(events):
+    # the arguments are still type-checked, but never evaluated
     for e in events:
         out('',
-            'static inline void trace_%(name)s(%(args)s)',
+            'static inline void _nop_trace_%(name)s(%(args)s)',
             '{',
             '}',
+            '#define trace_%(name)s(...) do { \\',
+            '    if (0) { \\',
+            '        _nop_trace_%(name)s(__VA_ARGS__); \\',
+            '    } \\',
+            '} while (0)',
             name = e.name,
             args = e.args,
             )
@@ -26,6 +26,9 @@
 #include "qemu-char.h"
 #include "slirp.h"
 #include "hw/hw.h"
+#ifdef CONFIG_EPOLL
+#include <sys/epoll.h>
+#endif
 
 /* host loopback address */
 struct in_addr loopback_addr;
@@ -39,9 +42,6 @@ static const uint8_t special_ethaddr[ETH_ALEN] = {
 
 static const uint8_t zero_ethaddr[ETH_ALEN] = { 0, 0, 0, 0, 0, 0 };
 
-/* XXX: suppress those select globals */
-fd_set *global_readfds, *global_writefds, *global_xfds;
-
 u_int curtime;
 static u_int time_fasttimo, last_slowtimo;
 static int do_slowtimo;
@@ -203,13 +203,21 @@ Slirp *slirp_init(int restricted, struct in_addr vnetwork,
                   struct in_addr vnetmask, struct in_addr vhost,
                   const char *vhostname, const char *tftp_path,
                   const char *bootfile, struct in_addr vdhcp_start,
-                  struct in_addr vnameserver, void *opaque)
+                  struct in_addr vnameserver, int tcp_bufsize, void *opaque)
 {
     Slirp *slirp = g_malloc0(sizeof(Slirp));
 
     slirp_init_once();
 
     slirp->restricted = restricted;
+    slirp->tcp_bufsize = tcp_bufsize ? tcp_bufsize : TCP_SNDSPACE;
+#ifdef CONFIG_EPOLL
+    /* without it, fall back to select() */
+    slirp->epoll_fd = epoll_create(64);
+    if (slirp->epoll_fd >= 0) {
+        qemu_set_cloexec(slirp->epoll_fd);
+    }
+#endif
 
     if_init(slirp);
     ip_init(slirp);
@@ -252,6 +260,12 @@ void slirp_cleanup(Slirp *slirp)
     ip_cleanup(slirp);
     m_cleanup(slirp);
 
+#ifdef CONFIG_EPOLL
+    if (slirp->epoll_fd >= 0) {
+        close(slirp->epoll_fd);
+    }
+    g_free(slirp->epoll_sockets);
+#endif
     g_free(slirp->tftp_prefix);
     g_free(slirp->bootp_filename);
     g_free(slirp);
@@ -261,6 +275,156 @@ void slirp_cleanup(Slirp *slirp)
 #define CONN_CANFRCV(so) (((so)->so_state & (SS_FCANTRCVMORE|SS_ISFCONNECTED)) == SS_ISFCONNECTED)
 #define UPD_NFDS(x) if (nfds < (x)) nfds = (x)
 
+/*
+ * Host sockets are polled either with the fd_sets of the main loop, or,
+ * where available, with an epoll set whose descriptor is the only one
+ * slirp adds to the main loop.  A set that is only updated when the
+ * events of a socket change avoids passing thousands of descriptors to
+ * select() in every iteration, and is not limited to FD_SETSIZE.
+ *
+ * The events that are ready go to so_revents, which is only valid for
+ * the poll round so_revents_gen.
+ */
+static u_int poll_gen;
+
+#ifdef CONFIG_EPOLL
+static void slirp_epoll_update(Slirp *slirp, struct socket *so, int events)
+{
+    struct epoll_event ev;
+    int op;
+
+    if (so->so_pollfd != so->s) {
+        /* the registration went away with the old descriptor */
+        if (so->so_events && so->so_pollfd < slirp->epoll_nsockets &&
+            slirp->epoll_sockets[so->so_pollfd] == so) {
+            slirp->epoll_sockets[so->so_pollfd] = NULL;
+        }
+        so->so_events = 0;
+        so->so_pollfd = so->s;
+    }
+    if (so->s < 0 || events == so->so_events) {
+        return;
+    }
+
+    if (so->s >= slirp->epoll_nsockets) {
+        int n = MAX(so->s + 1, slirp->epoll_nsockets * 2);
+
+        slirp->epoll_sockets = g_renew(struct socket *,
+                                       slirp->epoll_sockets, n);
+        memset(slirp->epoll_sockets + slirp->epoll_nsockets, 0,
+               (n - slirp->epoll_nsockets) * sizeof(struct socket *));
+        slirp->epoll_nsockets = n;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = (events & SLIRP_POLL_IN ? EPOLLIN : 0) |
+                (events & SLIRP_POLL_OUT ? EPOLLOUT : 0) |
+                (events & SLIRP_POLL_PRI ? EPOLLPRI : 0);
+    ev.data.fd = so->s;
+
+    /* no events: remove it, or epoll keeps reporting errors and hangups */
+    op = !events ? EPOLL_CTL_DEL :
+         so->so_events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    if (epoll_ctl(slirp->epoll_fd, op, so->s, &ev) < 0) {
+        if (op == EPOLL_CTL_MOD && errno == ENOENT) {
+            epoll_ctl(slirp->epoll_fd, EPOLL_CTL_ADD, so->s, &ev);
+        } else if (op == EPOLL_CTL_ADD && errno == EEXIST) {
+            epoll_ctl(slirp->epoll_fd, EPOLL_CTL_MOD, so->s, &ev);
+        }
+    }
+    so->so_events = events;
+    slirp->epoll_sockets[so->s] = events ? so : NULL;
+}
+
+static void slirp_epoll_wait(Slirp *slirp)
+{
+    struct epoll_event events[256];
+    struct socket *so;
+    int i, n;
+
+    n = epoll_wait(slirp->epoll_fd, events, ARRAY_SIZE(events), 0);
+    for (i = 0; i < n; i++) {
+        int fd = events[i].data.fd;
+        uint32_t ev = events[i].events;
+
+        /* a late event for a socket that was closed in the meantime */
+        so = fd < slirp->epoll_nsockets ? slirp->epoll_sockets[fd] : NULL;
+        if (!so || so->s != fd) {
+            continue;
+        }
+        so->so_revents = (ev & EPOLLIN ? SLIRP_POLL_IN : 0) |
+                         (ev & EPOLLOUT ? SLIRP_POLL_OUT : 0) |
+                         (ev & EPOLLPRI ? SLIRP_POLL_PRI : 0);
+        /* like select(), errors make the socket readable and writable */
+        if (ev & (EPOLLERR | EPOLLHUP)) {
+            so->so_revents |= so->so_events & (SLIRP_POLL_IN | SLIRP_POLL_OUT);
+        }
+        so->so_revents_gen = poll_gen;
+    }
+}
+#endif
+
+/* Called when a socket is freed, its descriptor is already closed */
+void slirp_poll_forget(struct socket *so)
+{
+#ifdef CONFIG_EPOLL
+    Slirp *slirp = so->slirp;
+
+    if (so->so_events && so->so_pollfd >= 0 &&
+        so->so_pollfd < slirp->epoll_nsockets &&
+        slirp->epoll_sockets[so->so_pollfd] == so) {
+        slirp->epoll_sockets[so->so_pollfd] = NULL;
+    }
+#endif
+    so->so_events = 0;
+}
+
+static void slirp_poll_add(Slirp *slirp, struct socket *so, int events,
+                           fd_set *readfds, fd_set *writefds, fd_set *xfds,
+                           int *pnfds)
+{
+#ifdef CONFIG_EPOLL
+    if (slirp->epoll_fd >= 0) {
+        slirp_epoll_update(slirp, so, events);
+        return;
+    }
+#endif
+    if (!events) {
+        return;
+    }
+    if (events & SLIRP_POLL_IN) {
+        FD_SET(so->s, readfds);
+    }
+    if (events & SLIRP_POLL_OUT) {
+        FD_SET(so->s, writefds);
+    }
+    if (events & SLIRP_POLL_PRI) {
+        FD_SET(so->s, xfds);
+    }
+    if (*pnfds < so->s) {
+        *pnfds = so->s;
+    }
+}
+
+/* Update so_revents for the current poll round */
+static void slirp_poll_revents(Slirp *slirp, struct socket *so,
+                               fd_set *readfds, fd_set *writefds,
+                               fd_set *xfds)
+{
+#ifdef CONFIG_EPOLL
+    if (slirp->epoll_fd >= 0) {
+        if (so->so_revents_gen != poll_gen) {
+            so->so_revents = 0;
+        }
+        return;
+    }
+#endif
+    so->so_revents = (FD_ISSET(so->s, readfds) ? SLIRP_POLL_IN : 0) |
+                     (FD_ISSET(so->s, writefds) ? SLIRP_POLL_OUT : 0) |
+                     (FD_ISSET(so->s, xfds) ? SLIRP_POLL_PRI : 0);
+    so->so_revents_gen = poll_gen;
+}
+
 void slirp_update_timeout(uint32_t *timeout)
 {
     if (!QTAILQ_EMPTY(&slirp_instances)) {
@@ -273,17 +437,12 @@ void slirp_select_fill(int *pnfds,
 {
     Slirp *slirp;
     struct socket *so, *so_next;
-    int nfds;
+    int nfds, events;
 
     if (QTAILQ_EMPTY(&slirp_instances)) {
         return;
     }
 
-    /* fail safe */
-    global_readfds = NULL;
-    global_writefds = NULL;
-    global_xfds = NULL;
-
     nfds = *pnfds;
 	/*
 	 * First, TCP sockets
@@ -298,6 +457,13 @@ void slirp_select_fill(int *pnfds,
 		do_slowtimo |= ((slirp->tcb.so_next != &slirp->tcb) ||
 		    (&slirp->ipq.ip_link != slirp->ipq.ip_link.next));
 
+#ifdef CONFIG_EPOLL
+		if (slirp->epoll_fd >= 0) {
+			FD_SET(slirp->epoll_fd, readfds);
+			UPD_NFDS(slirp->epoll_fd);
+		}
+#endif
+
 		for (so = slirp->tcb.so_next; so != &slirp->tcb;
 		     so = so_next) {
 			so_next = so->so_next;
@@ -312,45 +478,43 @@ void slirp_select_fill(int *pnfds,
 			 * NOFDREF can include still connecting to local-host,
 			 * newly socreated() sockets etc. Don't want to select these.
 	 		 */
-			if (so->so_state & SS_NOFDREF || so->s == -1)
+			events = 0;
+			if (so->so_state & SS_NOFDREF || so->s == -1) {
+			   slirp_poll_add(slirp, so, 0, readfds, writefds, xfds,
+					  &nfds);
 			   continue;
-
-			/*
-			 * Set for reading sockets which are accepting
-			 */
-			if (so->so_state & SS_FACCEPTCONN) {
-                                FD_SET(so->s, readfds);
-				UPD_NFDS(so->s);
-				continue;
-			}
-
-			/*
-			 * Set for writing sockets which are connecting
-			 */
-			if (so->so_state & SS_ISFCONNECTING) {
-				FD_SET(so->s, writefds);
-				UPD_NFDS(so->s);
-				continue;
 			}
 
-			/*
-			 * Set for writing if we are connected, can send more, and
-			 * we have something to send
-			 */
-			if (CONN_CANFSEND(so) && so->so_rcv.sb_cc) {
-				FD_SET(so->s, writefds);
-				UPD_NFDS(so->s);
-			}
+			if (so->so_state & SS_FACCEPTCONN) {
+				/*
+				 * Set for reading sockets which are accepting
+				 */
+				events = SLIRP_POLL_IN;
+			} else if (so->so_state & SS_ISFCONNECTING) {
+				/*
+				 * Set for writing sockets which are connecting
+				 */
+				events = SLIRP_POLL_OUT;
+			} else {
+				/*
+				 * Set for writing if we are connected, can send
+				 * more, and we have something to send
+				 */
+				if (CONN_CANFSEND(so) && so->so_rcv.sb_cc) {
+					events |= SLIRP_POLL_OUT;
+				}
 
-			/*
-			 * Set for reading (and urgent data) if we are connected, can
-			 * receive more, and we have room for it XXX /2 ?
-			 */
-			if (CONN_CANFRCV(so) && (so->so_snd.sb_cc < (so->so_snd.sb_datalen/2))) {
-				FD_SET(so->s, readfds);
-				FD_SET(so->s, xfds);
-				UPD_NFDS(so->s);
+				/*
+				 * Set for reading (and urgent data) if we are
+				 * connected, can receive more, and we have room
+				 * for it XXX /2 ?
+				 */
+				if (CONN_CANFRCV(so) && (so->so_snd.sb_cc < (so->so_snd.sb_datalen/2))) {
+					events |= SLIRP_POLL_IN | SLIRP_POLL_PRI;
+				}
 			}
+			slirp_poll_add(slirp, so, events, readfds, writefds, xfds,
+				       &nfds);
 		}
 
 		/*
@@ -381,10 +545,12 @@ void slirp_select_fill(int *pnfds,
 			 * if the packets needed to be fragmented
 			 * (XXX <= 4 ?)
 			 */
+			events = 0;
 			if ((so->so_state & SS_ISFCONNECTED) && so->so_queued <= 4) {
-				FD_SET(so->s, readfds);
-				UPD_NFDS(so->s);
+				events = SLIRP_POLL_IN;
 			}
+			slirp_poll_add(slirp, so, events, readfds, writefds, xfds,
+				       &nfds);
 		}
 
                 /*
@@ -406,10 +572,12 @@ void slirp_select_fill(int *pnfds,
                         }
                     }
 
+                    events = 0;
                     if (so->so_state & SS_ISFCONNECTED) {
-                        FD_SET(so->s, readfds);
-                        UPD_NFDS(so->s);
+                        events = SLIRP_POLL_IN;
                     }
+                    slirp_poll_add(slirp, so, events, readfds, writefds, xfds,
+                                   &nfds);
                 }
 	}
 
@@ -427,11 +595,8 @@ void slirp_select_poll(fd_set *readfds, fd_set *writefds, fd_set *xfds,
         return;
     }
 
-    global_readfds = readfds;
-    global_writefds = writefds;
-    global_xfds = xfds;
-
     curtime = qemu_get_clock_ms(rt_clock);
+    poll_gen++;
 
     QTAILQ_FOREACH(slirp, &slirp_instances, entry) {
 	/*
@@ -451,6 +616,13 @@ void slirp_select_poll(fd_set *readfds, fd_set *writefds, fd_set *xfds,
 	 * Check sockets
 	 */
 	if (!select_error) {
+#ifdef CONFIG_EPOLL
+		if (slirp->epoll_fd >= 0 &&
+		    FD_ISSET(slirp->epoll_fd, readfds)) {
+			slirp_epoll_wait(slirp);
+		}
+#endif
+
 		/*
 		 * Check TCP sockets
 		 */
@@ -465,17 +637,19 @@ void slirp_select_poll(fd_set *readfds, fd_set *writefds, fd_set *xfds,
 			if (so->so_state & SS_NOFDREF || so->s == -1)
 			   continue;
 
+			slirp_poll_revents(slirp, so, readfds, writefds, xfds);
+
 			/*
 			 * Check for URG data
 			 * This will soread as well, so no need to
 			 * test for readfds below if this succeeds
 			 */
-			if (FD_ISSET(so->s, xfds))
+			if (so->so_revents & SLIRP_POLL_PRI)
 			   sorecvoob(so);
 			/*
 			 * Check sockets for reading
 			 */
-			else if (FD_ISSET(so->s, readfds)) {
+			else if (so->so_revents & SLIRP_POLL_IN) {
 				/*
 				 * Check for incoming connections
 				 */
@@ -493,7 +667,7 @@ void slirp_select_poll(fd_set *readfds, fd_set *writefds, fd_set *xfds,
 			/*
 			 * Check sockets for writing
 			 */
-			if (FD_ISSET(so->s, writefds)) {
+			if (so->so_revents & SLIRP_POLL_OUT) {
 			  /*
 			   * Check for non-blocking, still-connecting sockets
 			   */
@@ -576,7 +750,11 @@ void slirp_select_poll(fd_set *readfds, fd_set *writefds, fd_set *xfds,
 		     so = so_next) {
 			so_next = so->so_next;
 
-			if (so->s != -1 && FD_ISSET(so->s, readfds)) {
+			if (so->s == -1) {
+			    continue;
+			}
+			slirp_poll_revents(slirp, so, readfds, writefds, xfds);
+			if (so->so_revents & SLIRP_POLL_IN) {
                             sorecvfrom(so);
                         }
 		}
@@ -588,7 +766,11 @@ void slirp_select_poll(fd_set *readfds, fd_set *writefds, fd_set *xfds,
                      so = so_next) {
                      so_next = so->so_next;
 
-                    if (so->s != -1 && FD_ISSET(so->s, readfds)) {
+                    if (so->s == -1) {
+                        continue;
+                    }
+                    slirp_poll_revents(slirp, so, readfds, writefds, xfds);
+                    if (so->so_revents & SLIRP_POLL_IN) {
                         icmp_receive(so);
                     }
                 }
@@ -596,15 +778,6 @@ void slirp_select_poll(fd_set *readfds, fd_set *writefds, fd_set *xfds,
 
         if_start(slirp);
     }
-
-	/* clear global file descriptor sets.
-	 * these reside on the stack in vl.c
-	 * so they're unusable if we're not in
-	 * slirp_select_fill or slirp_select_poll.
-	 */
-	 global_readfds = NULL;
-	 global_writefds = NULL;
-	 global_xfds = NULL;
 }
 
 static void arp_input(Slirp *slirp, const uint8_t *pkt, int pkt_len)
@@ -256,6 +256,16 @@ struct Slirp {
 
     ArpTable arp_table;
 
+    /* send and receive buffer size of TCP sockets */
+    int tcp_bufsize;
+
+#ifdef CONFIG_EPOLL
+    /* host sockets are polled with this epoll set if it is >= 0 */
+    int epoll_fd;
+    struct socket **epoll_sockets;  /* indexed by descriptor */
+    int epoll_nsockets;
+#endif
+
     void *opaque;
 };
 
@@ -297,6 +307,9 @@ void lprint(const char *, ...) GCC_FMT_ATTR(1, 2);
 /* cksum.c */
 int cksum(struct mbuf *m, int len);
 
+/* slirp.c */
+void slirp_poll_forget(struct socket *so);
+
 /* if.c */
 void if_init(Slirp *);
 void if_output(struct socket *, struct mbuf *);
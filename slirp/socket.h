@@ -51,8 +51,18 @@ struct socket {
   struct sbuf so_rcv;		/* Receive buffer */
   struct sbuf so_snd;		/* Send buffer */
   void * extra;			/* Extra pointer */
+
+  int	so_events;		/* SLIRP_POLL_* events waited for */
+  int	so_pollfd;		/* descriptor so_events was registered for */
+  int	so_revents;		/* SLIRP_POLL_* events ready */
+  u_int	so_revents_gen;		/* poll round so_revents belongs to */
 };
 
+/* Events of a host socket, see slirp_select_fill() */
+#define SLIRP_POLL_IN		0x1	/* readable, or a connection to accept */
+#define SLIRP_POLL_OUT		0x2	/* writable, or connected */
+#define SLIRP_POLL_PRI		0x4	/* out-of-band data */
+
 
 /*
  * Socket state bits. (peer means the host on the Internet,
@@ -365,8 +365,8 @@ findso:
 	    goto dropwithreset;
 	  }
 
-	  sbreserve(&so->so_snd, TCP_SNDSPACE);
-	  sbreserve(&so->so_rcv, TCP_RCVSPACE);
+	  sbreserve(&so->so_snd, slirp->tcp_bufsize);
+	  sbreserve(&so->so_rcv, slirp->tcp_bufsize);
 
 	  so->so_laddr = ti->ti_src;
 	  so->so_lport = ti->ti_sport;
@@ -1458,7 +1458,7 @@ int
 tcp_mss(struct tcpcb *tp, u_int offer)
 {
 	struct socket *so = tp->t_socket;
-	int mss;
+	int mss, bufsize;
 
 	DEBUG_CALL("tcp_mss");
 	DEBUG_ARG("tp = %lx", (long)tp);
@@ -1473,12 +1473,11 @@ tcp_mss(struct tcpcb *tp, u_int offer)
 
 	tp->snd_cwnd = mss;
 
-	sbreserve(&so->so_snd, TCP_SNDSPACE + ((TCP_SNDSPACE % mss) ?
-                                               (mss - (TCP_SNDSPACE % mss)) :
-                                               0));
-	sbreserve(&so->so_rcv, TCP_RCVSPACE + ((TCP_RCVSPACE % mss) ?
-                                               (mss - (TCP_RCVSPACE % mss)) :
-                                               0));
+	/* a multiple of the segment size */
+	bufsize = so->slirp->tcp_bufsize;
+	bufsize += (bufsize % mss) ? (mss - (bufsize % mss)) : 0;
+	sbreserve(&so->so_snd, bufsize);
+	sbreserve(&so->so_rcv, bufsize);
 
 	DEBUG_MISC((dfd, " returning mss = %d\n", mss));
 
@@ -50,6 +50,15 @@ void qemu_register_suspend_notifier(Notifier *notifier);
 void qemu_system_wakeup_request(WakeupReason reason);
 void qemu_system_wakeup_enable(WakeupReason reason, bool enabled);
 void qemu_register_wakeup_notifier(Notifier *notifier);
+
+/* A CPU was plugged or asked to leave, @id is its APIC id on x86 */
+typedef struct CPUHotplugEvent {
+    int id;
+    bool plugged;
+} CPUHotplugEvent;
+
+void qemu_system_cpu_hotplug(int id, bool plugged);
+void qemu_register_cpu_hotplug_notifier(Notifier *notifier);
 void qemu_system_shutdown_request(void);
 void qemu_system_powerdown_request(void);
 void qemu_system_debug_request(void);
@@ -71,19 +80,24 @@ void qemu_remove_exit_notifier(Notifier *notify);
 void qemu_add_machine_init_done_notifier(Notifier *notify);
 
 void do_savevm(Monitor *mon, const QDict *qdict);
+void do_savevm_cancel(Monitor *mon, const QDict *qdict);
 int load_vmstate(const char *name);
 void do_delvm(Monitor *mon, const QDict *qdict);
 void do_info_snapshots(Monitor *mon);
 
 void qemu_announce_self(void);
 
+bool dump_in_progress(void);
+
 bool qemu_savevm_state_blocked(Error **errp);
+int qemu_save_device_state(QEMUFile *f);
 int qemu_savevm_state_begin(QEMUFile *f,
                             const MigrationParams *params);
 int qemu_savevm_state_iterate(QEMUFile *f);
 int qemu_savevm_state_complete(QEMUFile *f);
 void qemu_savevm_state_cancel(QEMUFile *f);
 int qemu_loadvm_state(QEMUFile *f);
+MigrationDeviceStatsList *qemu_savevm_device_stats(void);
 
 /* SLIRP */
 void do_info_slirp(Monitor *mon);
@@ -95,10 +109,14 @@ typedef enum DisplayType
     DT_SDL,
     DT_NOGRAPHIC,
     DT_NONE,
+    DT_SHM,
 } DisplayType;
 
 extern int autostart;
 extern int bios_size;
+extern bool startup_profile;
+
+void startup_profile_step(const char *what, int64_t start);
 
 typedef enum {
     VGA_NONE, VGA_STD, VGA_CIRRUS, VGA_VMWARE, VGA_XENFB, VGA_QXL,
@@ -140,6 +158,17 @@ extern int nb_numa_nodes;
 extern uint64_t node_mem[MAX_NODES];
 extern unsigned long *node_cpumask[MAX_NODES];
 
+/* host memory policy for the guest RAM of each node, from -numa hostnodes= */
+#define MAX_HOST_NODES 128
+enum {
+    NUMA_POLICY_DEFAULT,
+    NUMA_POLICY_PREFERRED,
+    NUMA_POLICY_BIND,
+    NUMA_POLICY_INTERLEAVE,
+};
+extern int node_host_policy[MAX_NODES];
+extern unsigned long *node_host_mask[MAX_NODES];
+
 #define MAX_OPTION_ROMS 16
 typedef struct QEMUOptionRom {
     const char *name;
@@ -52,6 +52,10 @@ DEF_HELPER_1(logicq_cc, i32, i64)
 DEF_HELPER_3(sel_flags, i32, i32, i32, i32)
 DEF_HELPER_1(exception, void, i32)
 DEF_HELPER_0(wfi, void)
+DEF_HELPER_2(strex, i32, i32, i32)
+#ifndef CONFIG_USER_ONLY
+DEF_HELPER_3(swp, i32, i32, i32, i32)
+#endif
 
 DEF_HELPER_2(cpsr_write, void, i32, i32)
 DEF_HELPER_0(cpsr_read, i32)
@@ -142,9 +146,7 @@ DEF_HELPER_2(recpe_u32, i32, i32, env)
 DEF_HELPER_2(rsqrte_u32, i32, i32, env)
 DEF_HELPER_4(neon_tbl, i32, i32, i32, i32, i32)
 
-DEF_HELPER_2(add_cc, i32, i32, i32)
 DEF_HELPER_2(adc_cc, i32, i32, i32)
-DEF_HELPER_2(sub_cc, i32, i32, i32)
 DEF_HELPER_2(sbc_cc, i32, i32, i32)
 
 DEF_HELPER_2(shl, i32, i32, i32)
@@ -237,6 +237,186 @@ void HELPER(wfi)(void)
     cpu_loop_exit(env);
 }
 
+/* Whether a store exclusive of that size can be a host compare-and-swap */
+static bool strex_host_ok(uint32_t addr, int size)
+{
+#if HOST_LONG_BITS < 64
+    if (size == 3) {
+        return false;
+    }
+#endif
+    return !(addr & ((1 << size) - 1));
+}
+
+/* Compare-and-swap {Rt} or {Rt2, Rt} at host against the value seen by
+   the load exclusive.  Returns true if the store happened.  */
+static bool strex_cas(void *host, uint32_t info)
+{
+    int size = info & 0xf;
+    uint32_t val = env->regs[(info >> 8) & 0xf];
+    bool stored;
+
+    switch (size) {
+    case 0:
+        stored = __sync_bool_compare_and_swap((uint8_t *)host,
+                                              (uint8_t)env->exclusive_val,
+                                              (uint8_t)val);
+        break;
+    case 1:
+        stored = __sync_bool_compare_and_swap((uint16_t *)host,
+                                              tswap16(env->exclusive_val),
+                                              tswap16(val));
+        break;
+    case 2:
+        stored = __sync_bool_compare_and_swap((uint32_t *)host,
+                                              tswap32(env->exclusive_val),
+                                              tswap32(val));
+        break;
+#if HOST_LONG_BITS >= 64
+    case 3: {
+        /* the two words as they are laid out in guest memory */
+        union {
+            uint32_t w[2];
+            uint64_t d;
+        } cmp, new;
+
+        cmp.w[0] = tswap32(env->exclusive_val);
+        cmp.w[1] = tswap32(env->exclusive_high);
+        new.w[0] = tswap32(val);
+        new.w[1] = tswap32(env->regs[(info >> 12) & 0xf]);
+        stored = __sync_bool_compare_and_swap((uint64_t *)host, cmp.d, new.d);
+        break;
+    }
+#endif
+    default:
+        abort();
+    }
+    return stored;
+}
+
+#if defined(CONFIG_USER_ONLY)
+/* Store exclusive as a host compare-and-swap against the value seen by
+   the load exclusive, so that the other guest threads keep running.
+   Unaligned and faulting accesses, and doubleword ones on 32-bit hosts,
+   go to the CPU loop, which does them in an exclusive section.  The PC
+   points to the instruction.  Returns 0 if the store happened.  */
+uint32_t HELPER(strex)(uint32_t addr, uint32_t info)
+{
+    if (addr != env->exclusive_addr) {
+        return 1;
+    }
+    if (!strex_host_ok(addr, info & 0xf) ||
+        page_check_range(addr, 1 << (info & 0xf),
+                         PAGE_READ | PAGE_WRITE) < 0) {
+        env->exclusive_test = addr;
+        env->exclusive_info = info;
+        raise_exception(EXCP_STREX);
+    }
+    return !strex_cas(g2h(addr), info);
+}
+#else
+/* With multi-threaded TCG, store exclusive is a host compare-and-swap on
+   the RAM that the TLB maps the address to, as in user emulation mode.
+   MMIO, unaligned and page-crossing accesses go through the softmmu under
+   the atomic lock, which only makes them atomic with respect to each
+   other.  Bits 16 and up of info are the MMU index.  The PC points to the
+   instruction.  Returns 0 if the store happened.  */
+uint32_t HELPER(strex)(uint32_t addr, uint32_t info)
+{
+    int size = info & 0xf;
+    int mmu_idx = info >> 16;
+    void *host;
+    bool stored;
+
+    if (addr != env->exclusive_addr) {
+        return 1;
+    }
+    host = tlb_vaddr_to_host_write(env, addr, 1 << size, mmu_idx, GETPC());
+    if (host && strex_host_ok(addr, size)) {
+        return !strex_cas(host, info);
+    }
+
+    cpu_atomic_lock();
+    switch (size) {
+    case 0:
+        stored = __ldb_mmu(addr, mmu_idx) == (uint8_t)env->exclusive_val;
+        break;
+    case 1:
+        stored = __ldw_mmu(addr, mmu_idx) == (uint16_t)env->exclusive_val;
+        break;
+    case 2:
+        stored = __ldl_mmu(addr, mmu_idx) == env->exclusive_val;
+        break;
+    case 3:
+        stored = __ldl_mmu(addr, mmu_idx) == env->exclusive_val &&
+                 __ldl_mmu(addr + 4, mmu_idx) == env->exclusive_high;
+        break;
+    default:
+        abort();
+    }
+    if (stored) {
+        uint32_t val = env->regs[(info >> 8) & 0xf];
+
+        switch (size) {
+        case 0:
+            __stb_mmu(addr, val, mmu_idx);
+            break;
+        case 1:
+            __stw_mmu(addr, val, mmu_idx);
+            break;
+        default:
+            __stl_mmu(addr, val, mmu_idx);
+            break;
+        }
+        if (size == 3) {
+            __stl_mmu(addr + 4, env->regs[(info >> 12) & 0xf], mmu_idx);
+        }
+    }
+    cpu_atomic_unlock();
+    return !stored;
+}
+
+/* SWP and SWPB for multi-threaded TCG, with the same fallback as
+   HELPER(strex).  info is the size (0 or 2) plus the MMU index in bits
+   16 and up.  Returns the old value.  */
+uint32_t HELPER(swp)(uint32_t addr, uint32_t val, uint32_t info)
+{
+    int size = info & 0xf;
+    int mmu_idx = info >> 16;
+    uint32_t old;
+    void *host;
+
+    host = tlb_vaddr_to_host_write(env, addr, 1 << size, mmu_idx, GETPC());
+    if (host && !(addr & ((1 << size) - 1))) {
+        if (size == 0) {
+            do {
+                old = *(volatile uint8_t *)host;
+            } while (!__sync_bool_compare_and_swap((uint8_t *)host,
+                                                   (uint8_t)old,
+                                                   (uint8_t)val));
+        } else {
+            do {
+                old = *(volatile uint32_t *)host;
+            } while (!__sync_bool_compare_and_swap((uint32_t *)host,
+                                                   old, tswap32(val)));
+            old = tswap32(old);
+        }
+        return old;
+    }
+
+    cpu_atomic_lock();
+    if (size == 0) {
+        old = __ldb_mmu(addr, mmu_idx);
+        __stb_mmu(addr, val, mmu_idx);
+    } else {
+        old = __ldl_mmu(addr, mmu_idx);
+        __stl_mmu(addr, val, mmu_idx);
+    }
+    cpu_atomic_unlock();
+    return old;
+}
+#endif
+
 void HELPER(exception)(uint32_t excp)
 {
     env->exception_index = excp;
@@ -325,19 +505,9 @@ uint64_t HELPER(get_cp_reg64)(CPUARMState *env, void *rip)
     return value;
 }
 
-/* ??? Flag setting arithmetic is awkward because we need to do comparisons.
-   The only way to do that in TCG is a conditional branch, which clobbers
-   all our temporaries.  For now implement these as helper functions.  */
-
-uint32_t HELPER (add_cc)(uint32_t a, uint32_t b)
-{
-    uint32_t result;
-    result = a + b;
-    env->NF = env->ZF = result;
-    env->CF = result < a;
-    env->VF = (a ^ b ^ -1) & (a ^ result);
-    return result;
-}
+/* ??? Flag setting arithmetic with carry in is awkward because the carry
+   out depends on it.  Plain add and sub are done inline with setcond;
+   for now implement these as helper functions.  */
 
 uint32_t HELPER(adc_cc)(uint32_t a, uint32_t b)
 {
@@ -354,16 +524,6 @@ uint32_t HELPER(adc_cc)(uint32_t a, uint32_t b)
     return result;
 }
 
-uint32_t HELPER(sub_cc)(uint32_t a, uint32_t b)
-{
-    uint32_t result;
-    result = a - b;
-    env->NF = env->ZF = result;
-    env->CF = a >= b;
-    env->VF = (a ^ b) & (a ^ result);
-    return result;
-}
-
 uint32_t HELPER(sbc_cc)(uint32_t a, uint32_t b)
 {
     uint32_t result;
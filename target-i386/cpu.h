@@ -36,6 +36,12 @@
 
 #define TARGET_HAS_ICE 1
 
+/* the translator follows direct jumps in CF_SUPERBLOCK TBs */
+#define TARGET_HAS_SUPERBLOCK
+
+/* translated code refers to no host pointers besides helpers and TBs */
+#define TARGET_HAS_TB_CACHE
+
 #ifdef TARGET_X86_64
 #define ELF_MACHINE	EM_X86_64
 #else
@@ -671,6 +677,7 @@ typedef struct CPUX86State {
     XMMReg xmm_t0;
     MMXReg mmx_t0;
     target_ulong cc_tmp; /* temporary for rcr/rcl */
+    target_ulong lock_val; /* value loaded by a locked instruction */
 
     /* sysenter registers */
     uint32_t sysenter_cs;
@@ -699,6 +706,7 @@ typedef struct CPUX86State {
     uint64_t system_time_msr;
     uint64_t wall_clock_msr;
     uint64_t async_pf_en_msr;
+    uint64_t pv_eoi_en_msr;
 
     uint64_t tsc;
     uint64_t tsc_deadline;
@@ -763,6 +771,7 @@ typedef struct CPUX86State {
     bool tsc_valid;
     int tsc_khz;
     void *kvm_xsave_buf;
+    void *kvm_sync_cache;
 
     /* in order to simplify APIC support, we leave this pointer to the
        user */
@@ -5,6 +5,9 @@ DEF_HELPER_FLAGS_2(cc_compute_c, TCG_CALL_PURE, i32, env, int)
 
 DEF_HELPER_0(lock, void)
 DEF_HELPER_0(unlock, void)
+#ifndef CONFIG_USER_ONLY
+DEF_HELPER_4(locked_st, void, env, tl, tl, int)
+#endif
 DEF_HELPER_3(write_eflags, void, env, tl, i32)
 DEF_HELPER_1(read_eflags, tl, env)
 DEF_HELPER_2(divb_AL, void, env, tl)
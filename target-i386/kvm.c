@@ -63,9 +63,82 @@ static bool has_msr_star;
 static bool has_msr_hsave_pa;
 static bool has_msr_tsc_deadline;
 static bool has_msr_async_pf_en;
+static bool has_msr_pv_eoi_en;
 static bool has_msr_misc_enable;
 static int lm_capable_kernel;
 
+/* Register sets the kernel is known to hold, kept as the image that the
+ * put functions would write for them.  The images are refreshed whenever
+ * a set is transferred and forgotten before the vcpu runs again.  While
+ * one is valid, a runtime writeback of an unchanged set is dropped and
+ * reading a set that cannot change without the vcpu running is skipped,
+ * so back-to-back synchronizations of a stopped vcpu are nearly free.
+ */
+#define KVM_SYNC_REGS       (1u << 0)
+#define KVM_SYNC_FPU        (1u << 1)
+#define KVM_SYNC_XCRS       (1u << 2)
+#define KVM_SYNC_SREGS      (1u << 3)
+#define KVM_SYNC_MSRS       (1u << 4)
+#define KVM_SYNC_EVENTS     (1u << 5)
+#define KVM_SYNC_DEBUGREGS  (1u << 6)
+#define KVM_SYNC_ALL        (~0u)
+
+typedef struct KVMMSRData {
+    struct kvm_msrs info;
+    struct kvm_msr_entry entries[100];
+} KVMMSRData;
+
+typedef struct KVMSyncCache {
+    unsigned valid;
+    struct kvm_regs regs;
+    struct kvm_fpu fpu;
+    struct kvm_xsave xsave;
+    struct kvm_xcrs xcrs;
+    struct kvm_sregs sregs;
+    KVMMSRData msrs;        /* runtime state MSRs only */
+    struct kvm_vcpu_events events;
+    struct kvm_debugregs dbgregs;
+} KVMSyncCache;
+
+static void kvm_sync_invalidate(CPUX86State *env, unsigned sets)
+{
+    KVMSyncCache *cache = env->kvm_sync_cache;
+
+    if (cache) {
+        cache->valid &= ~sets;
+    }
+}
+
+static bool kvm_sync_cached(CPUX86State *env, unsigned set)
+{
+    KVMSyncCache *cache = env->kvm_sync_cache;
+
+    return cache->valid & set;
+}
+
+/* Write @data, the image of @set, with ioctl @type.  Runtime writebacks
+ * are dropped if the kernel already holds the same image.
+ */
+static int kvm_put_cached(CPUX86State *env, int level, unsigned set, int type,
+                          void *cached, void *data, size_t size)
+{
+    KVMSyncCache *cache = env->kvm_sync_cache;
+    int ret;
+
+    if (level == KVM_PUT_RUNTIME_STATE && (cache->valid & set) &&
+        !memcmp(cached, data, size)) {
+        return 0;
+    }
+    cache->valid &= ~set;
+    ret = kvm_vcpu_ioctl(env, type, data);
+    if (ret < 0) {
+        return ret;
+    }
+    memcpy(cached, data, size);
+    cache->valid |= set;
+    return 0;
+}
+
 bool kvm_allows_irq0_override(void)
 {
     return !kvm_irqchip_in_kernel() || kvm_has_gsi_routing();
@@ -337,6 +410,7 @@ static int kvm_inject_mce_oldstyle(CPUX86State *env)
         mce.addr = env->mce_banks[bank * 4 + 2];
         mce.misc = env->mce_banks[bank * 4 + 3];
 
+        kvm_sync_invalidate(env, KVM_SYNC_MSRS);
         return kvm_vcpu_ioctl(env, KVM_X86_SET_MCE, &mce);
     }
     return 0;
@@ -454,6 +528,7 @@ int kvm_arch_init_vcpu(CPUX86State *env)
     }
 
     has_msr_async_pf_en = c->eax & (1 << KVM_FEATURE_ASYNC_PF);
+    has_msr_pv_eoi_en = c->eax & (1 << KVM_FEATURE_PV_EOI);
 
     cpu_x86_cpuid(env, 0, 0, &limit, &unused, &unused, &unused);
 
@@ -584,6 +659,7 @@ int kvm_arch_init_vcpu(CPUX86State *env)
     if (kvm_has_xsave()) {
         env->kvm_xsave_buf = qemu_memalign(4096, sizeof(struct kvm_xsave));
     }
+    env->kvm_sync_cache = g_malloc0(sizeof(KVMSyncCache));
 
     return 0;
 }
@@ -592,6 +668,7 @@ void kvm_arch_reset_vcpu(CPUX86State *env)
 {
     X86CPU *cpu = x86_env_get_cpu(env);
 
+    kvm_sync_invalidate(env, KVM_SYNC_ALL);
     env->exception_injected = -1;
     env->interrupt_injected = -1;
     env->xcr0 = 1;
@@ -781,67 +858,95 @@ static void kvm_getput_reg(__u64 *kvm_reg, target_ulong *qemu_reg, int set)
     }
 }
 
-static int kvm_getput_regs(CPUX86State *env, int set)
+static void kvm_getput_regs(CPUX86State *env, struct kvm_regs *regs, int set)
 {
+    kvm_getput_reg(&regs->rax, &env->regs[R_EAX], set);
+    kvm_getput_reg(&regs->rbx, &env->regs[R_EBX], set);
+    kvm_getput_reg(&regs->rcx, &env->regs[R_ECX], set);
+    kvm_getput_reg(&regs->rdx, &env->regs[R_EDX], set);
+    kvm_getput_reg(&regs->rsi, &env->regs[R_ESI], set);
+    kvm_getput_reg(&regs->rdi, &env->regs[R_EDI], set);
+    kvm_getput_reg(&regs->rsp, &env->regs[R_ESP], set);
+    kvm_getput_reg(&regs->rbp, &env->regs[R_EBP], set);
+#ifdef TARGET_X86_64
+    kvm_getput_reg(&regs->r8, &env->regs[8], set);
+    kvm_getput_reg(&regs->r9, &env->regs[9], set);
+    kvm_getput_reg(&regs->r10, &env->regs[10], set);
+    kvm_getput_reg(&regs->r11, &env->regs[11], set);
+    kvm_getput_reg(&regs->r12, &env->regs[12], set);
+    kvm_getput_reg(&regs->r13, &env->regs[13], set);
+    kvm_getput_reg(&regs->r14, &env->regs[14], set);
+    kvm_getput_reg(&regs->r15, &env->regs[15], set);
+#endif
+
+    kvm_getput_reg(&regs->rflags, &env->eflags, set);
+    kvm_getput_reg(&regs->rip, &env->eip, set);
+}
+
+static void kvm_regs_image(CPUX86State *env, struct kvm_regs *regs)
+{
+    memset(regs, 0, sizeof(*regs));
+    kvm_getput_regs(env, regs, 1);
+}
+
+static int kvm_put_regs(CPUX86State *env, int level)
+{
+    KVMSyncCache *cache = env->kvm_sync_cache;
     struct kvm_regs regs;
-    int ret = 0;
 
-    if (!set) {
-        ret = kvm_vcpu_ioctl(env, KVM_GET_REGS, &regs);
-        if (ret < 0) {
-            return ret;
-        }
-    }
+    kvm_regs_image(env, &regs);
+    return kvm_put_cached(env, level, KVM_SYNC_REGS, KVM_SET_REGS,
+                          &cache->regs, &regs, sizeof(regs));
+}
 
-    kvm_getput_reg(&regs.rax, &env->regs[R_EAX], set);
-    kvm_getput_reg(&regs.rbx, &env->regs[R_EBX], set);
-    kvm_getput_reg(&regs.rcx, &env->regs[R_ECX], set);
-    kvm_getput_reg(&regs.rdx, &env->regs[R_EDX], set);
-    kvm_getput_reg(&regs.rsi, &env->regs[R_ESI], set);
-    kvm_getput_reg(&regs.rdi, &env->regs[R_EDI], set);
-    kvm_getput_reg(&regs.rsp, &env->regs[R_ESP], set);
-    kvm_getput_reg(&regs.rbp, &env->regs[R_EBP], set);
-#ifdef TARGET_X86_64
-    kvm_getput_reg(&regs.r8, &env->regs[8], set);
-    kvm_getput_reg(&regs.r9, &env->regs[9], set);
-    kvm_getput_reg(&regs.r10, &env->regs[10], set);
-    kvm_getput_reg(&regs.r11, &env->regs[11], set);
-    kvm_getput_reg(&regs.r12, &env->regs[12], set);
-    kvm_getput_reg(&regs.r13, &env->regs[13], set);
-    kvm_getput_reg(&regs.r14, &env->regs[14], set);
-    kvm_getput_reg(&regs.r15, &env->regs[15], set);
-#endif
+static int kvm_get_regs(CPUX86State *env)
+{
+    KVMSyncCache *cache = env->kvm_sync_cache;
+    struct kvm_regs regs;
+    int ret;
 
-    kvm_getput_reg(&regs.rflags, &env->eflags, set);
-    kvm_getput_reg(&regs.rip, &env->eip, set);
+    if (kvm_sync_cached(env, KVM_SYNC_REGS)) {
+        return 0;
+    }
 
-    if (set) {
-        ret = kvm_vcpu_ioctl(env, KVM_SET_REGS, &regs);
+    ret = kvm_vcpu_ioctl(env, KVM_GET_REGS, &regs);
+    if (ret < 0) {
+        return ret;
     }
+    kvm_getput_regs(env, &regs, 0);
 
-    return ret;
+    kvm_regs_image(env, &cache->regs);
+    cache->valid |= KVM_SYNC_REGS;
+    return 0;
 }
 
-static int kvm_put_fpu(CPUX86State *env)
+static void kvm_fpu_image(CPUX86State *env, struct kvm_fpu *fpu)
 {
-    struct kvm_fpu fpu;
     int i;
 
-    memset(&fpu, 0, sizeof fpu);
-    fpu.fsw = env->fpus & ~(7 << 11);
-    fpu.fsw |= (env->fpstt & 7) << 11;
-    fpu.fcw = env->fpuc;
-    fpu.last_opcode = env->fpop;
-    fpu.last_ip = env->fpip;
-    fpu.last_dp = env->fpdp;
+    memset(fpu, 0, sizeof(*fpu));
+    fpu->fsw = env->fpus & ~(7 << 11);
+    fpu->fsw |= (env->fpstt & 7) << 11;
+    fpu->fcw = env->fpuc;
+    fpu->last_opcode = env->fpop;
+    fpu->last_ip = env->fpip;
+    fpu->last_dp = env->fpdp;
     for (i = 0; i < 8; ++i) {
-        fpu.ftwx |= (!env->fptags[i]) << i;
+        fpu->ftwx |= (!env->fptags[i]) << i;
     }
-    memcpy(fpu.fpr, env->fpregs, sizeof env->fpregs);
-    memcpy(fpu.xmm, env->xmm_regs, sizeof env->xmm_regs);
-    fpu.mxcsr = env->mxcsr;
+    memcpy(fpu->fpr, env->fpregs, sizeof env->fpregs);
+    memcpy(fpu->xmm, env->xmm_regs, sizeof env->xmm_regs);
+    fpu->mxcsr = env->mxcsr;
+}
 
-    return kvm_vcpu_ioctl(env, KVM_SET_FPU, &fpu);
+static int kvm_put_fpu(CPUX86State *env, int level)
+{
+    KVMSyncCache *cache = env->kvm_sync_cache;
+    struct kvm_fpu fpu;
+
+    kvm_fpu_image(env, &fpu);
+    return kvm_put_cached(env, level, KVM_SYNC_FPU, KVM_SET_FPU,
+                          &cache->fpu, &fpu, sizeof(fpu));
 }
 
 #define XSAVE_FCW_FSW     0
@@ -854,15 +959,10 @@ static int kvm_put_fpu(CPUX86State *env)
 #define XSAVE_XSTATE_BV   128
 #define XSAVE_YMMH_SPACE  144
 
-static int kvm_put_xsave(CPUX86State *env)
+static void kvm_xsave_image(CPUX86State *env, struct kvm_xsave *xsave)
 {
-    struct kvm_xsave* xsave = env->kvm_xsave_buf;
     uint16_t cwd, swd, twd;
-    int i, r;
-
-    if (!kvm_has_xsave()) {
-        return kvm_put_fpu(env);
-    }
+    int i;
 
     memset(xsave, 0, sizeof(struct kvm_xsave));
     twd = 0;
@@ -884,88 +984,111 @@ static int kvm_put_xsave(CPUX86State *env)
     *(uint64_t *)&xsave->region[XSAVE_XSTATE_BV] = env->xstate_bv;
     memcpy(&xsave->region[XSAVE_YMMH_SPACE], env->ymmh_regs,
             sizeof env->ymmh_regs);
-    r = kvm_vcpu_ioctl(env, KVM_SET_XSAVE, xsave);
-    return r;
 }
 
-static int kvm_put_xcrs(CPUX86State *env)
+static int kvm_put_xsave(CPUX86State *env, int level)
 {
+    KVMSyncCache *cache = env->kvm_sync_cache;
+    struct kvm_xsave* xsave = env->kvm_xsave_buf;
+
+    if (!kvm_has_xsave()) {
+        return kvm_put_fpu(env, level);
+    }
+
+    kvm_xsave_image(env, xsave);
+    return kvm_put_cached(env, level, KVM_SYNC_FPU, KVM_SET_XSAVE,
+                          &cache->xsave, xsave, sizeof(*xsave));
+}
+
+static void kvm_xcrs_image(CPUX86State *env, struct kvm_xcrs *xcrs)
+{
+    memset(xcrs, 0, sizeof(*xcrs));
+    xcrs->nr_xcrs = 1;
+    xcrs->flags = 0;
+    xcrs->xcrs[0].xcr = 0;
+    xcrs->xcrs[0].value = env->xcr0;
+}
+
+static int kvm_put_xcrs(CPUX86State *env, int level)
+{
+    KVMSyncCache *cache = env->kvm_sync_cache;
     struct kvm_xcrs xcrs;
 
     if (!kvm_has_xcrs()) {
         return 0;
     }
 
-    xcrs.nr_xcrs = 1;
-    xcrs.flags = 0;
-    xcrs.xcrs[0].xcr = 0;
-    xcrs.xcrs[0].value = env->xcr0;
-    return kvm_vcpu_ioctl(env, KVM_SET_XCRS, &xcrs);
+    kvm_xcrs_image(env, &xcrs);
+    return kvm_put_cached(env, level, KVM_SYNC_XCRS, KVM_SET_XCRS,
+                          &cache->xcrs, &xcrs, sizeof(xcrs));
 }
 
-static int kvm_put_sregs(CPUX86State *env)
+static void kvm_sregs_image(CPUX86State *env, struct kvm_sregs *sregs)
 {
-    struct kvm_sregs sregs;
-
-    memset(sregs.interrupt_bitmap, 0, sizeof(sregs.interrupt_bitmap));
+    memset(sregs, 0, sizeof(*sregs));
     if (env->interrupt_injected >= 0) {
-        sregs.interrupt_bitmap[env->interrupt_injected / 64] |=
+        sregs->interrupt_bitmap[env->interrupt_injected / 64] |=
                 (uint64_t)1 << (env->interrupt_injected % 64);
     }
 
     if ((env->eflags & VM_MASK)) {
-        set_v8086_seg(&sregs.cs, &env->segs[R_CS]);
-        set_v8086_seg(&sregs.ds, &env->segs[R_DS]);
-        set_v8086_seg(&sregs.es, &env->segs[R_ES]);
-        set_v8086_seg(&sregs.fs, &env->segs[R_FS]);
-        set_v8086_seg(&sregs.gs, &env->segs[R_GS]);
-        set_v8086_seg(&sregs.ss, &env->segs[R_SS]);
+        set_v8086_seg(&sregs->cs, &env->segs[R_CS]);
+        set_v8086_seg(&sregs->ds, &env->segs[R_DS]);
+        set_v8086_seg(&sregs->es, &env->segs[R_ES]);
+        set_v8086_seg(&sregs->fs, &env->segs[R_FS]);
+        set_v8086_seg(&sregs->gs, &env->segs[R_GS]);
+        set_v8086_seg(&sregs->ss, &env->segs[R_SS]);
     } else {
-        set_seg(&sregs.cs, &env->segs[R_CS]);
-        set_seg(&sregs.ds, &env->segs[R_DS]);
-        set_seg(&sregs.es, &env->segs[R_ES]);
-        set_seg(&sregs.fs, &env->segs[R_FS]);
-        set_seg(&sregs.gs, &env->segs[R_GS]);
-        set_seg(&sregs.ss, &env->segs[R_SS]);
+        set_seg(&sregs->cs, &env->segs[R_CS]);
+        set_seg(&sregs->ds, &env->segs[R_DS]);
+        set_seg(&sregs->es, &env->segs[R_ES]);
+        set_seg(&sregs->fs, &env->segs[R_FS]);
+        set_seg(&sregs->gs, &env->segs[R_GS]);
+        set_seg(&sregs->ss, &env->segs[R_SS]);
     }
 
-    set_seg(&sregs.tr, &env->tr);
-    set_seg(&sregs.ldt, &env->ldt);
+    set_seg(&sregs->tr, &env->tr);
+    set_seg(&sregs->ldt, &env->ldt);
+
+    sregs->idt.limit = env->idt.limit;
+    sregs->idt.base = env->idt.base;
+    memset(sregs->idt.padding, 0, sizeof sregs->idt.padding);
+    sregs->gdt.limit = env->gdt.limit;
+    sregs->gdt.base = env->gdt.base;
+    memset(sregs->gdt.padding, 0, sizeof sregs->gdt.padding);
 
-    sregs.idt.limit = env->idt.limit;
-    sregs.idt.base = env->idt.base;
-    memset(sregs.idt.padding, 0, sizeof sregs.idt.padding);
-    sregs.gdt.limit = env->gdt.limit;
-    sregs.gdt.base = env->gdt.base;
-    memset(sregs.gdt.padding, 0, sizeof sregs.gdt.padding);
+    sregs->cr0 = env->cr[0];
+    sregs->cr2 = env->cr[2];
+    sregs->cr3 = env->cr[3];
+    sregs->cr4 = env->cr[4];
 
-    sregs.cr0 = env->cr[0];
-    sregs.cr2 = env->cr[2];
-    sregs.cr3 = env->cr[3];
-    sregs.cr4 = env->cr[4];
+    sregs->cr8 = cpu_get_apic_tpr(env->apic_state);
+    sregs->apic_base = cpu_get_apic_base(env->apic_state);
 
-    sregs.cr8 = cpu_get_apic_tpr(env->apic_state);
-    sregs.apic_base = cpu_get_apic_base(env->apic_state);
+    sregs->efer = env->efer;
+}
 
-    sregs.efer = env->efer;
+static int kvm_put_sregs(CPUX86State *env, int level)
+{
+    KVMSyncCache *cache = env->kvm_sync_cache;
+    struct kvm_sregs sregs;
 
-    return kvm_vcpu_ioctl(env, KVM_SET_SREGS, &sregs);
+    kvm_sregs_image(env, &sregs);
+    return kvm_put_cached(env, level, KVM_SYNC_SREGS, KVM_SET_SREGS,
+                          &cache->sregs, &sregs, sizeof(sregs));
 }
 
 static void kvm_msr_entry_set(struct kvm_msr_entry *entry,
                               uint32_t index, uint64_t value)
 {
     entry->index = index;
+    entry->reserved = 0;
     entry->data = value;
 }
 
-static int kvm_put_msrs(CPUX86State *env, int level)
+static void kvm_msrs_image(CPUX86State *env, int level, KVMMSRData *msr_data)
 {
-    struct {
-        struct kvm_msrs info;
-        struct kvm_msr_entry entries[100];
-    } msr_data;
-    struct kvm_msr_entry *msrs = msr_data.entries;
+    struct kvm_msr_entry *msrs = msr_data->entries;
     int n = 0;
 
     kvm_msr_entry_set(&msrs[n++], MSR_IA32_SYSENTER_CS, env->sysenter_cs);
@@ -1017,6 +1140,10 @@ static int kvm_put_msrs(CPUX86State *env, int level)
             kvm_msr_entry_set(&msrs[n++], MSR_KVM_ASYNC_PF_EN,
                               env->async_pf_en_msr);
         }
+        if (has_msr_pv_eoi_en) {
+            kvm_msr_entry_set(&msrs[n++], MSR_KVM_PV_EOI_EN,
+                              env->pv_eoi_en_msr);
+        }
         if (hyperv_hypercall_available()) {
             kvm_msr_entry_set(&msrs[n++], HV_X64_MSR_GUEST_OS_ID, 0);
             kvm_msr_entry_set(&msrs[n++], HV_X64_MSR_HYPERCALL, 0);
@@ -1035,15 +1162,55 @@ static int kvm_put_msrs(CPUX86State *env, int level)
         }
     }
 
-    msr_data.info.nmsrs = n;
+    memset(&msr_data->info, 0, sizeof(msr_data->info));
+    msr_data->info.nmsrs = n;
+}
 
-    return kvm_vcpu_ioctl(env, KVM_SET_MSRS, &msr_data);
+static int kvm_put_msrs(CPUX86State *env, int level)
+{
+    KVMSyncCache *cache = env->kvm_sync_cache;
+    KVMMSRData msr_data;
+    struct kvm_msr_entry *msrs = msr_data.entries;
+    struct kvm_msr_entry *cached = cache->msrs.entries;
+    bool partial;
+    int i, n, ret;
+
+    kvm_msrs_image(env, level, &msr_data);
+    partial = level == KVM_PUT_RUNTIME_STATE &&
+              kvm_sync_cached(env, KVM_SYNC_MSRS) &&
+              cache->msrs.info.nmsrs == msr_data.info.nmsrs;
+    if (partial) {
+        /* write back only the MSRs that differ from the kernel's */
+        for (i = n = 0; i < msr_data.info.nmsrs; i++) {
+            if (msrs[i].index == cached[i].index &&
+                msrs[i].data == cached[i].data) {
+                continue;
+            }
+            cached[i] = msrs[i];
+            msrs[n++] = msrs[i];
+        }
+        if (n == 0) {
+            return 0;
+        }
+        msr_data.info.nmsrs = n;
+    }
 
+    kvm_sync_invalidate(env, KVM_SYNC_MSRS);
+    ret = kvm_vcpu_ioctl(env, KVM_SET_MSRS, &msr_data);
+    if (ret < 0) {
+        return ret;
+    }
+    if (!partial) {
+        kvm_msrs_image(env, KVM_PUT_RUNTIME_STATE, &cache->msrs);
+    }
+    cache->valid |= KVM_SYNC_MSRS;
+    return ret;
 }
 
 
 static int kvm_get_fpu(CPUX86State *env)
 {
+    KVMSyncCache *cache = env->kvm_sync_cache;
     struct kvm_fpu fpu;
     int i, ret;
 
@@ -1065,15 +1232,21 @@ static int kvm_get_fpu(CPUX86State *env)
     memcpy(env->xmm_regs, fpu.xmm, sizeof env->xmm_regs);
     env->mxcsr = fpu.mxcsr;
 
+    kvm_fpu_image(env, &cache->fpu);
+    cache->valid |= KVM_SYNC_FPU;
     return 0;
 }
 
 static int kvm_get_xsave(CPUX86State *env)
 {
+    KVMSyncCache *cache = env->kvm_sync_cache;
     struct kvm_xsave* xsave = env->kvm_xsave_buf;
     int ret, i;
     uint16_t cwd, swd, twd;
 
+    if (kvm_sync_cached(env, KVM_SYNC_FPU)) {
+        return 0;
+    }
     if (!kvm_has_xsave()) {
         return kvm_get_fpu(env);
     }
@@ -1103,15 +1276,19 @@ static int kvm_get_xsave(CPUX86State *env)
     env->xstate_bv = *(uint64_t *)&xsave->region[XSAVE_XSTATE_BV];
     memcpy(env->ymmh_regs, &xsave->region[XSAVE_YMMH_SPACE],
             sizeof env->ymmh_regs);
+
+    kvm_xsave_image(env, &cache->xsave);
+    cache->valid |= KVM_SYNC_FPU;
     return 0;
 }
 
 static int kvm_get_xcrs(CPUX86State *env)
 {
+    KVMSyncCache *cache = env->kvm_sync_cache;
     int i, ret;
     struct kvm_xcrs xcrs;
 
-    if (!kvm_has_xcrs()) {
+    if (!kvm_has_xcrs() || kvm_sync_cached(env, KVM_SYNC_XCRS)) {
         return 0;
     }
 
@@ -1127,15 +1304,23 @@ static int kvm_get_xcrs(CPUX86State *env)
             break;
         }
     }
+
+    kvm_xcrs_image(env, &cache->xcrs);
+    cache->valid |= KVM_SYNC_XCRS;
     return 0;
 }
 
 static int kvm_get_sregs(CPUX86State *env)
 {
+    KVMSyncCache *cache = env->kvm_sync_cache;
     struct kvm_sregs sregs;
     uint32_t hflags;
     int bit, i, ret;
 
+    if (kvm_sync_cached(env, KVM_SYNC_SREGS)) {
+        return 0;
+    }
+
     ret = kvm_vcpu_ioctl(env, KVM_GET_SREGS, &sregs);
     if (ret < 0) {
         return ret;
@@ -1211,15 +1396,15 @@ static int kvm_get_sregs(CPUX86State *env)
     }
     env->hflags = (env->hflags & HFLAG_COPY_MASK) | hflags;
 
+    kvm_sregs_image(env, &cache->sregs);
+    cache->valid |= KVM_SYNC_SREGS;
     return 0;
 }
 
 static int kvm_get_msrs(CPUX86State *env)
 {
-    struct {
-        struct kvm_msrs info;
-        struct kvm_msr_entry entries[100];
-    } msr_data;
+    KVMSyncCache *cache = env->kvm_sync_cache;
+    KVMMSRData msr_data;
     struct kvm_msr_entry *msrs = msr_data.entries;
     int ret, i, n;
 
@@ -1259,6 +1444,9 @@ static int kvm_get_msrs(CPUX86State *env)
     if (has_msr_async_pf_en) {
         msrs[n++].index = MSR_KVM_ASYNC_PF_EN;
     }
+    if (has_msr_pv_eoi_en) {
+        msrs[n++].index = MSR_KVM_PV_EOI_EN;
+    }
 
     if (env->mcg_cap) {
         msrs[n++].index = MSR_MCG_STATUS;
@@ -1338,9 +1526,14 @@ static int kvm_get_msrs(CPUX86State *env)
         case MSR_KVM_ASYNC_PF_EN:
             env->async_pf_en_msr = msrs[i].data;
             break;
+        case MSR_KVM_PV_EOI_EN:
+            env->pv_eoi_en_msr = msrs[i].data;
+            break;
         }
     }
 
+    kvm_msrs_image(env, KVM_PUT_RUNTIME_STATE, &cache->msrs);
+    cache->valid |= KVM_SYNC_MSRS;
     return 0;
 }
 
@@ -1397,42 +1590,55 @@ static int kvm_put_apic(CPUX86State *env)
     return 0;
 }
 
-static int kvm_put_vcpu_events(CPUX86State *env, int level)
+static void kvm_vcpu_events_image(CPUX86State *env, int level,
+                                  struct kvm_vcpu_events *events)
 {
-    struct kvm_vcpu_events events;
-
-    if (!kvm_has_vcpu_events()) {
-        return 0;
-    }
-
-    events.exception.injected = (env->exception_injected >= 0);
-    events.exception.nr = env->exception_injected;
-    events.exception.has_error_code = env->has_error_code;
-    events.exception.error_code = env->error_code;
-    events.exception.pad = 0;
+    memset(events, 0, sizeof(*events));
+    events->exception.injected = (env->exception_injected >= 0);
+    events->exception.nr = env->exception_injected;
+    events->exception.has_error_code = env->has_error_code;
+    events->exception.error_code = env->error_code;
+    events->exception.pad = 0;
 
-    events.interrupt.injected = (env->interrupt_injected >= 0);
-    events.interrupt.nr = env->interrupt_injected;
-    events.interrupt.soft = env->soft_interrupt;
+    events->interrupt.injected = (env->interrupt_injected >= 0);
+    events->interrupt.nr = env->interrupt_injected;
+    events->interrupt.soft = env->soft_interrupt;
 
-    events.nmi.injected = env->nmi_injected;
-    events.nmi.pending = env->nmi_pending;
-    events.nmi.masked = !!(env->hflags2 & HF2_NMI_MASK);
-    events.nmi.pad = 0;
+    events->nmi.injected = env->nmi_injected;
+    events->nmi.pending = env->nmi_pending;
+    events->nmi.masked = !!(env->hflags2 & HF2_NMI_MASK);
+    events->nmi.pad = 0;
 
-    events.sipi_vector = env->sipi_vector;
+    events->sipi_vector = env->sipi_vector;
 
-    events.flags = 0;
+    events->flags = 0;
     if (level >= KVM_PUT_RESET_STATE) {
-        events.flags |=
+        events->flags |=
             KVM_VCPUEVENT_VALID_NMI_PENDING | KVM_VCPUEVENT_VALID_SIPI_VECTOR;
     }
+}
+
+static int kvm_put_vcpu_events(CPUX86State *env, int level)
+{
+    KVMSyncCache *cache = env->kvm_sync_cache;
+    struct kvm_vcpu_events events;
+    int ret;
+
+    if (!kvm_has_vcpu_events()) {
+        return 0;
+    }
 
-    return kvm_vcpu_ioctl(env, KVM_SET_VCPU_EVENTS, &events);
+    kvm_vcpu_events_image(env, level, &events);
+    ret = kvm_put_cached(env, level, KVM_SYNC_EVENTS, KVM_SET_VCPU_EVENTS,
+                         &cache->events, &events, sizeof(events));
+    /* keep the runtime image, which has no VALID flags */
+    cache->events.flags = 0;
+    return ret;
 }
 
 static int kvm_get_vcpu_events(CPUX86State *env)
 {
+    KVMSyncCache *cache = env->kvm_sync_cache;
     struct kvm_vcpu_events events;
     int ret;
 
@@ -1463,6 +1669,8 @@ static int kvm_get_vcpu_events(CPUX86State *env)
 
     env->sipi_vector = events.sipi_vector;
 
+    kvm_vcpu_events_image(env, KVM_PUT_RUNTIME_STATE, &cache->events);
+    cache->valid |= KVM_SYNC_EVENTS;
     return 0;
 }
 
@@ -1495,31 +1703,41 @@ static int kvm_guest_debug_workarounds(CPUX86State *env)
     return ret;
 }
 
-static int kvm_put_debugregs(CPUX86State *env)
+static void kvm_debugregs_image(CPUX86State *env,
+                                struct kvm_debugregs *dbgregs)
 {
-    struct kvm_debugregs dbgregs;
     int i;
 
-    if (!kvm_has_debugregs()) {
-        return 0;
+    memset(dbgregs, 0, sizeof(*dbgregs));
+    for (i = 0; i < 4; i++) {
+        dbgregs->db[i] = env->dr[i];
     }
+    dbgregs->dr6 = env->dr[6];
+    dbgregs->dr7 = env->dr[7];
+    dbgregs->flags = 0;
+}
 
-    for (i = 0; i < 4; i++) {
-        dbgregs.db[i] = env->dr[i];
+static int kvm_put_debugregs(CPUX86State *env, int level)
+{
+    KVMSyncCache *cache = env->kvm_sync_cache;
+    struct kvm_debugregs dbgregs;
+
+    if (!kvm_has_debugregs()) {
+        return 0;
     }
-    dbgregs.dr6 = env->dr[6];
-    dbgregs.dr7 = env->dr[7];
-    dbgregs.flags = 0;
 
-    return kvm_vcpu_ioctl(env, KVM_SET_DEBUGREGS, &dbgregs);
+    kvm_debugregs_image(env, &dbgregs);
+    return kvm_put_cached(env, level, KVM_SYNC_DEBUGREGS, KVM_SET_DEBUGREGS,
+                          &cache->dbgregs, &dbgregs, sizeof(dbgregs));
 }
 
 static int kvm_get_debugregs(CPUX86State *env)
 {
+    KVMSyncCache *cache = env->kvm_sync_cache;
     struct kvm_debugregs dbgregs;
     int i, ret;
 
-    if (!kvm_has_debugregs()) {
+    if (!kvm_has_debugregs() || kvm_sync_cached(env, KVM_SYNC_DEBUGREGS)) {
         return 0;
     }
 
@@ -1533,6 +1751,8 @@ static int kvm_get_debugregs(CPUX86State *env)
     env->dr[4] = env->dr[6] = dbgregs.dr6;
     env->dr[5] = env->dr[7] = dbgregs.dr7;
 
+    kvm_debugregs_image(env, &cache->dbgregs);
+    cache->valid |= KVM_SYNC_DEBUGREGS;
     return 0;
 }
 
@@ -1542,19 +1762,19 @@ int kvm_arch_put_registers(CPUX86State *env, int level)
 
     assert(cpu_is_stopped(env) || qemu_cpu_is_self(env));
 
-    ret = kvm_getput_regs(env, 1);
+    ret = kvm_put_regs(env, level);
     if (ret < 0) {
         return ret;
     }
-    ret = kvm_put_xsave(env);
+    ret = kvm_put_xsave(env, level);
     if (ret < 0) {
         return ret;
     }
-    ret = kvm_put_xcrs(env);
+    ret = kvm_put_xcrs(env, level);
     if (ret < 0) {
         return ret;
     }
-    ret = kvm_put_sregs(env);
+    ret = kvm_put_sregs(env, level);
     if (ret < 0) {
         return ret;
     }
@@ -1581,7 +1801,7 @@ int kvm_arch_put_registers(CPUX86State *env, int level)
     if (ret < 0) {
         return ret;
     }
-    ret = kvm_put_debugregs(env);
+    ret = kvm_put_debugregs(env, level);
     if (ret < 0) {
         return ret;
     }
@@ -1599,7 +1819,7 @@ int kvm_arch_get_registers(CPUX86State *env)
 
     assert(cpu_is_stopped(env) || qemu_cpu_is_self(env));
 
-    ret = kvm_getput_regs(env, 0);
+    ret = kvm_get_regs(env);
     if (ret < 0) {
         return ret;
     }
@@ -1642,6 +1862,9 @@ void kvm_arch_pre_run(CPUX86State *env, struct kvm_run *run)
 {
     int ret;
 
+    /* whatever the kernel holds is about to change */
+    kvm_sync_invalidate(env, KVM_SYNC_ALL);
+
     /* Inject NMI */
     if (env->interrupt_request & CPU_INTERRUPT_NMI) {
         env->interrupt_request &= ~CPU_INTERRUPT_NMI;
@@ -1955,6 +2178,9 @@ void kvm_arch_update_guest_debug(CPUX86State *env, struct kvm_guest_debug *dbg)
     };
     int n;
 
+    /* changing the debug state may rewrite rflags and the debug registers */
+    kvm_sync_invalidate(env, KVM_SYNC_REGS | KVM_SYNC_DEBUGREGS);
+
     if (kvm_sw_breakpoints_active(env)) {
         dbg->control |= KVM_GUESTDBG_ENABLE | KVM_GUESTDBG_USE_SW_BP;
     }
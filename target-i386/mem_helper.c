@@ -26,6 +26,7 @@
 
 /* broken thread support */
 
+#if defined(CONFIG_USER_ONLY)
 static spinlock_t global_cpu_lock = SPIN_LOCK_UNLOCKED;
 
 void helper_lock(void)
@@ -37,20 +38,156 @@ void helper_unlock(void)
 {
     spin_unlock(&global_cpu_lock);
 }
+#else
+void helper_lock(void)
+{
+    cpu_atomic_lock();
+}
+
+void helper_unlock(void)
+{
+    cpu_atomic_unlock();
+}
+
+/* Start the current instruction over */
+static void QEMU_NORETURN restart_insn(CPUX86State *env, uintptr_t retaddr)
+{
+    TranslationBlock *tb = tb_find_pc(retaddr);
+
+    if (tb) {
+        cpu_restore_state(tb, env, retaddr);
+    }
+    env->exception_index = -1;
+    cpu_loop_exit(env);
+}
+
+/* With multi-threaded TCG, the store of a locked read-modify-write is a
+   host compare-and-swap against the value that the instruction loaded,
+   in env->lock_val.  If another vCPU wrote the location in between, with
+   any kind of store, the instruction starts over.  Stores that do not go
+   straight to RAM in one page are done through the softmmu under the
+   atomic lock, which only makes them atomic with respect to each other.
+   idx is the operand size plus the memory index, as in translate.c.  */
+void helper_locked_st(CPUX86State *env, target_ulong addr, target_ulong val,
+                      int idx)
+{
+    int size = idx & 3;
+    int mmu_idx = (idx >> 2) - 1;
+    uintptr_t retaddr = GETPC();
+    target_ulong old = env->lock_val;
+    void *host;
+    bool stored;
+
+    host = tlb_vaddr_to_host_write(env, addr, 1 << size, mmu_idx, retaddr);
+#if HOST_LONG_BITS < 64
+    if (size == 3) {
+        host = NULL;
+    }
+#endif
+    if (host) {
+        switch (size) {
+        case 0:
+            stored = __sync_bool_compare_and_swap((uint8_t *)host,
+                                                  (uint8_t)old, (uint8_t)val);
+            break;
+        case 1:
+            stored = __sync_bool_compare_and_swap((uint16_t *)host,
+                                                  cpu_to_le16(old),
+                                                  cpu_to_le16(val));
+            break;
+        case 2:
+            stored = __sync_bool_compare_and_swap((uint32_t *)host,
+                                                  cpu_to_le32(old),
+                                                  cpu_to_le32(val));
+            break;
+        default:
+#if HOST_LONG_BITS >= 64
+            stored = __sync_bool_compare_and_swap((uint64_t *)host,
+                                                  cpu_to_le64(old),
+                                                  cpu_to_le64(val));
+#else
+            abort();
+#endif
+            break;
+        }
+    } else {
+        cpu_atomic_lock();
+        switch (size) {
+        case 0:
+            stored = helper_ldb_mmu(env, addr, mmu_idx) == (uint8_t)old;
+            if (stored) {
+                helper_stb_mmu(env, addr, val, mmu_idx);
+            }
+            break;
+        case 1:
+            stored = helper_ldw_mmu(env, addr, mmu_idx) == (uint16_t)old;
+            if (stored) {
+                helper_stw_mmu(env, addr, val, mmu_idx);
+            }
+            break;
+        case 2:
+            stored = helper_ldl_mmu(env, addr, mmu_idx) == (uint32_t)old;
+            if (stored) {
+                helper_stl_mmu(env, addr, val, mmu_idx);
+            }
+            break;
+        default:
+            stored = helper_ldq_mmu(env, addr, mmu_idx) == (uint64_t)old;
+            if (stored) {
+                helper_stq_mmu(env, addr, val, mmu_idx);
+            }
+            break;
+        }
+        cpu_atomic_unlock();
+    }
+    if (!stored) {
+        restart_insn(env, retaddr);
+    }
+}
+#endif
 
+/* Multi-threaded TCG does cmpxchg8b as a host compare-and-swap when it
+   can, and takes the atomic lock otherwise, see helper_locked_st().  */
 void helper_cmpxchg8b(CPUX86State *env, target_ulong a0)
 {
+    uint64_t cmp = ((uint64_t)EDX << 32) | (uint32_t)EAX;
     uint64_t d;
     int eflags;
 
     eflags = cpu_cc_compute_all(env, CC_OP);
+#if !defined(CONFIG_USER_ONLY) && HOST_LONG_BITS >= 64
+    if (mttcg_enabled) {
+        void *host = tlb_vaddr_to_host_write(env, a0, 8, cpu_mmu_index(env),
+                                             GETPC());
+        if (host) {
+            uint64_t new = ((uint64_t)ECX << 32) | (uint32_t)EBX;
+
+            d = le64_to_cpu(__sync_val_compare_and_swap((uint64_t *)host,
+                                                        cpu_to_le64(cmp),
+                                                        cpu_to_le64(new)));
+            goto done;
+        }
+    }
+#endif
+#if !defined(CONFIG_USER_ONLY)
+    cpu_atomic_lock();
+#endif
     d = cpu_ldq_data(env, a0);
-    if (d == (((uint64_t)EDX << 32) | (uint32_t)EAX)) {
+    if (d == cmp) {
         cpu_stq_data(env, a0, ((uint64_t)ECX << 32) | (uint32_t)EBX);
-        eflags |= CC_Z;
     } else {
         /* always do the store */
         cpu_stq_data(env, a0, d);
+    }
+#if !defined(CONFIG_USER_ONLY)
+    cpu_atomic_unlock();
+#endif
+#if !defined(CONFIG_USER_ONLY) && HOST_LONG_BITS >= 64
+ done:
+#endif
+    if (d == cmp) {
+        eflags |= CC_Z;
+    } else {
         EDX = (uint32_t)(d >> 32);
         EAX = (uint32_t)d;
         eflags &= ~CC_Z;
@@ -68,6 +205,10 @@ void helper_cmpxchg16b(CPUX86State *env, target_ulong a0)
         raise_exception(env, EXCP0D_GPF);
     }
     eflags = cpu_cc_compute_all(env, CC_OP);
+#if !defined(CONFIG_USER_ONLY)
+    /* there is no 16-byte host compare-and-swap to rely on */
+    cpu_atomic_lock();
+#endif
     d0 = cpu_ldq_data(env, a0);
     d1 = cpu_ldq_data(env, a0 + 8);
     if (d0 == EAX && d1 == EDX) {
@@ -82,6 +223,9 @@ void helper_cmpxchg16b(CPUX86State *env, target_ulong a0)
         EAX = d0;
         eflags &= ~CC_Z;
     }
+#if !defined(CONFIG_USER_ONLY)
+    cpu_atomic_unlock();
+#endif
     CC_SRC = eflags;
 }
 #endif
@@ -154,7 +154,10 @@ target_ulong helper_read_crN(CPUX86State *env, int reg)
         break;
     case 8:
         if (!(env->hflags2 & HF2_VINTR_MASK)) {
+            bool locked = qemu_tcg_io_lock();
+
             val = cpu_get_apic_tpr(env->apic_state);
+            qemu_tcg_io_unlock(locked);
         } else {
             val = env->v_tpr;
         }
@@ -178,7 +181,10 @@ void helper_write_crN(CPUX86State *env, int reg, target_ulong t0)
         break;
     case 8:
         if (!(env->hflags2 & HF2_VINTR_MASK)) {
+            bool locked = qemu_tcg_io_lock();
+
             cpu_set_apic_tpr(env->apic_state, t0);
+            qemu_tcg_io_unlock(locked);
         }
         env->v_tpr = t0 & 0x0f;
         break;
@@ -284,7 +290,12 @@ void helper_wrmsr(CPUX86State *env)
         env->sysenter_eip = val;
         break;
     case MSR_IA32_APICBASE:
-        cpu_set_apic_base(env->apic_state, val);
+        {
+            bool locked = qemu_tcg_io_lock();
+
+            cpu_set_apic_base(env->apic_state, val);
+            qemu_tcg_io_unlock(locked);
+        }
         break;
     case MSR_EFER:
         {
@@ -429,7 +440,12 @@ void helper_rdmsr(CPUX86State *env)
         val = env->sysenter_eip;
         break;
     case MSR_IA32_APICBASE:
-        val = cpu_get_apic_base(env->apic_state);
+        {
+            bool locked = qemu_tcg_io_lock();
+
+            val = cpu_get_apic_base(env->apic_state);
+            qemu_tcg_io_unlock(locked);
+        }
         break;
     case MSR_EFER:
         val = env->efer;
@@ -71,6 +71,9 @@ static uint8_t gen_opc_cc_op[OPC_BUF_SIZE];
 static int x86_64_hregs;
 #endif
 
+/* inside a locked instruction made atomic by helper_locked_st() */
+static int locked_rmw;
+
 typedef struct DisasContext {
     /* current insn context */
     int override; /* -1 if no override */
@@ -107,6 +110,7 @@ typedef struct DisasContext {
     int cpuid_ext_features;
     int cpuid_ext2_features;
     int cpuid_ext3_features;
+    int nb_follows; /* direct jumps followed in a superblock */
 } DisasContext;
 
 static void gen_eob(DisasContext *s);
@@ -539,6 +543,10 @@ static inline void gen_op_ld_v(int idx, TCGv t0, TCGv a0)
 #endif
         break;
     }
+    if (locked_rmw) {
+        /* what the store of the instruction expects to replace */
+        tcg_gen_st_tl(t0, cpu_env, offsetof(CPUX86State, lock_val));
+    }
 }
 
 /* XXX: always use ldu or lds */
@@ -560,6 +568,15 @@ static inline void gen_op_ld_T1_A0(int idx)
 static inline void gen_op_st_v(int idx, TCGv t0, TCGv a0)
 {
     int mem_index = (idx >> 2) - 1;
+#if !defined(CONFIG_USER_ONLY)
+    if (locked_rmw) {
+        TCGv_i32 tmp = tcg_const_i32(idx);
+
+        gen_helper_locked_st(cpu_env, a0, t0, tmp);
+        tcg_temp_free_i32(tmp);
+        return;
+    }
+#endif
     switch(idx & 3) {
     case 0:
         tcg_gen_qemu_st8(t0, a0, mem_index);
@@ -590,6 +607,29 @@ static inline void gen_op_st_T1_A0(int idx)
     gen_op_st_v(idx, cpu_T[1], cpu_A0);
 }
 
+/* Locked instructions run under the atomic lock, except with
+   multi-threaded TCG where their load and store go through
+   helper_locked_st() instead.  */
+static void gen_lock(void)
+{
+#if !defined(CONFIG_USER_ONLY)
+    if (mttcg_enabled) {
+        locked_rmw = 1;
+        return;
+    }
+#endif
+    gen_helper_lock();
+}
+
+static void gen_unlock(void)
+{
+    if (locked_rmw) {
+        locked_rmw = 0;
+        return;
+    }
+    gen_helper_unlock();
+}
+
 static inline void gen_jmp_im(target_ulong pc)
 {
     tcg_gen_movi_tl(cpu_tmp0, pc);
@@ -2747,8 +2787,8 @@ static void gen_debug(DisasContext *s, target_ulong cur_eip)
 }
 
 /* generate a generic end of block. Trace exception is also generated
-   if needed */
-static void gen_eob(DisasContext *s)
+   if needed.  If JR, the next TB is looked up from generated code.  */
+static void gen_eob_worker(DisasContext *s, bool jr)
 {
     if (s->cc_op != CC_OP_DYNAMIC)
         gen_op_set_cc_op(s->cc_op);
@@ -2762,12 +2802,25 @@ static void gen_eob(DisasContext *s)
         gen_helper_debug(cpu_env);
     } else if (s->tf) {
         gen_helper_single_step(cpu_env);
+    } else if (jr && !(s->tb->flags & HF_INHIBIT_IRQ_MASK)) {
+        gen_lookup_and_goto_ptr();
     } else {
         tcg_gen_exit_tb(0);
     }
     s->is_jmp = DISAS_TB_JUMP;
 }
 
+static void gen_eob(DisasContext *s)
+{
+    gen_eob_worker(s, false);
+}
+
+/* end of block after an indirect jump, whose target is already in EIP */
+static void gen_jr(DisasContext *s)
+{
+    gen_eob_worker(s, true);
+}
+
 /* generate a jump to eip. No segment change must happen before as a
    direct call to the next block may occur */
 static void gen_jmp_tb(DisasContext *s, target_ulong eip, int tb_num)
@@ -2787,6 +2840,25 @@ static void gen_jmp(DisasContext *s, target_ulong eip)
     gen_jmp_tb(s, eip, 0);
 }
 
+#define MAX_SUPERBLOCK_FOLLOWS 8
+
+/* jump or call to a constant eip.  A superblock goes on translating at
+   the target instead, if it is ahead of the current insn and close
+   enough that the TB still covers at most two pages.  */
+static void gen_jmp_follow(DisasContext *s, target_ulong eip)
+{
+    target_ulong pc = s->cs_base + eip;
+
+    if ((s->tb->cflags & CF_SUPERBLOCK) && s->jmp_opt &&
+        s->nb_follows < MAX_SUPERBLOCK_FOLLOWS &&
+        pc > s->pc && pc - s->tb->pc < TARGET_PAGE_SIZE - 32) {
+        s->nb_follows++;
+        s->pc = pc;
+        return;
+    }
+    gen_jmp(s, eip);
+}
+
 static inline void gen_ldq_env_A0(int idx, int offset)
 {
     int mem_index = (idx >> 2) - 1;
@@ -3166,6 +3238,57 @@ static const struct SSEOpHelper_eppi sse_op_table7[256] = {
     [0x63] = SSE42_OP(pcmpistri),
 };
 
+/* Packed integer and logical operations that TCG has vector ops for,
+   so that they do not go through a helper.  */
+static bool gen_sse_vec(int b, int oprsz, int op1_offset, int op2_offset)
+{
+    switch (b) {
+    case 0x54: /* andps, andpd */
+    case 0xdb: /* pand */
+        tcg_gen_and_vec(cpu_env, oprsz, op1_offset, op1_offset, op2_offset);
+        break;
+    case 0x55: /* andnps, andnpd */
+    case 0xdf: /* pandn */
+        tcg_gen_andc_vec(cpu_env, oprsz, op1_offset, op2_offset, op1_offset);
+        break;
+    case 0x56: /* orps, orpd */
+    case 0xeb: /* por */
+        tcg_gen_or_vec(cpu_env, oprsz, op1_offset, op1_offset, op2_offset);
+        break;
+    case 0x57: /* xorps, xorpd */
+    case 0xef: /* pxor */
+        tcg_gen_xor_vec(cpu_env, oprsz, op1_offset, op1_offset, op2_offset);
+        break;
+    case 0xfc: /* paddb */
+        tcg_gen_add8_vec(cpu_env, oprsz, op1_offset, op1_offset, op2_offset);
+        break;
+    case 0xfd: /* paddw */
+        tcg_gen_add16_vec(cpu_env, oprsz, op1_offset, op1_offset, op2_offset);
+        break;
+    case 0xfe: /* paddl */
+        tcg_gen_add32_vec(cpu_env, oprsz, op1_offset, op1_offset, op2_offset);
+        break;
+    case 0xd4: /* paddq */
+        tcg_gen_add64_vec(cpu_env, oprsz, op1_offset, op1_offset, op2_offset);
+        break;
+    case 0xf8: /* psubb */
+        tcg_gen_sub8_vec(cpu_env, oprsz, op1_offset, op1_offset, op2_offset);
+        break;
+    case 0xf9: /* psubw */
+        tcg_gen_sub16_vec(cpu_env, oprsz, op1_offset, op1_offset, op2_offset);
+        break;
+    case 0xfa: /* psubl */
+        tcg_gen_sub32_vec(cpu_env, oprsz, op1_offset, op1_offset, op2_offset);
+        break;
+    case 0xfb: /* psubq */
+        tcg_gen_sub64_vec(cpu_env, oprsz, op1_offset, op1_offset, op2_offset);
+        break;
+    default:
+        return false;
+    }
+    return true;
+}
+
 static void gen_sse(DisasContext *s, int b, target_ulong pc_start, int rex_r)
 {
     int b1, op1_offset, op2_offset, is_xmm, val, ot;
@@ -4181,6 +4304,9 @@ static void gen_sse(DisasContext *s, int b, target_ulong pc_start, int rex_r)
             sse_fn_eppt(cpu_env, cpu_ptr0, cpu_ptr1, cpu_A0);
             break;
         default:
+            if (gen_sse_vec(b, is_xmm ? 16 : 8, op1_offset, op2_offset)) {
+                break;
+            }
             tcg_gen_addi_ptr(cpu_ptr0, cpu_env, op1_offset);
             tcg_gen_addi_ptr(cpu_ptr1, cpu_env, op2_offset);
             sse_fn_epp(cpu_env, cpu_ptr0, cpu_ptr1);
@@ -4206,6 +4332,7 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
         tcg_gen_debug_insn_start(pc_start);
     s->pc = pc_start;
     prefixes = 0;
+    locked_rmw = 0;
     aflag = s->code32;
     dflag = s->code32;
     s->override = -1;
@@ -4325,7 +4452,7 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
 
     /* lock generation */
     if (prefixes & PREFIX_LOCK)
-        gen_helper_lock();
+        gen_lock();
 
     /* now check op code */
  reswitch:
@@ -4747,7 +4874,7 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
             gen_movtl_T1_im(next_eip);
             gen_push_T1(s);
             gen_op_jmp_T0();
-            gen_eob(s);
+            gen_jr(s);
             break;
         case 3: /* lcall Ev */
             gen_op_ld_T1_A0(ot + s->mem_index);
@@ -4774,7 +4901,7 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
             if (s->dflag == 0)
                 gen_op_andl_T0_ffff();
             gen_op_jmp_T0();
-            gen_eob(s);
+            gen_jr(s);
             break;
         case 5: /* ljmp Ev */
             gen_op_ld_T1_A0(ot + s->mem_index);
@@ -5437,11 +5564,11 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
             gen_op_mov_TN_reg(ot, 0, reg);
             /* for xchg, lock is implicit */
             if (!(prefixes & PREFIX_LOCK))
-                gen_helper_lock();
+                gen_lock();
             gen_op_ld_T1_A0(ot + s->mem_index);
             gen_op_st_T0_A0(ot + s->mem_index);
             if (!(prefixes & PREFIX_LOCK))
-                gen_helper_unlock();
+                gen_unlock();
             gen_op_mov_reg_T1(ot, reg);
         }
         break;
@@ -6302,7 +6429,7 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
         if (s->dflag == 0)
             gen_op_andl_T0_ffff();
         gen_op_jmp_T0();
-        gen_eob(s);
+        gen_jr(s);
         break;
     case 0xc3: /* ret */
         gen_pop_T0(s);
@@ -6310,7 +6437,7 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
         if (s->dflag == 0)
             gen_op_andl_T0_ffff();
         gen_op_jmp_T0();
-        gen_eob(s);
+        gen_jr(s);
         break;
     case 0xca: /* lret im */
         val = cpu_ldsw_code(cpu_single_env, s->pc);
@@ -6380,7 +6507,7 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
                 tval &= 0xffffffff;
             gen_movtl_T0_im(next_eip);
             gen_push_T0(s);
-            gen_jmp(s, tval);
+            gen_jmp_follow(s, tval);
         }
         break;
     case 0x9a: /* lcall im */
@@ -6407,7 +6534,7 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
             tval &= 0xffff;
         else if(!CODE64(s))
             tval &= 0xffffffff;
-        gen_jmp(s, tval);
+        gen_jmp_follow(s, tval);
         break;
     case 0xea: /* ljmp im */
         {
@@ -6428,7 +6555,7 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
         tval += s->pc - s->cs_base;
         if (s->dflag == 0)
             tval &= 0xffff;
-        gen_jmp(s, tval);
+        gen_jmp_follow(s, tval);
         break;
     case 0x70 ... 0x7f: /* jcc Jb */
         tval = (int8_t)insn_get(s, OT_BYTE);
@@ -7781,11 +7908,11 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
     }
     /* lock generation */
     if (s->prefix & PREFIX_LOCK)
-        gen_helper_unlock();
+        gen_unlock();
     return s->pc;
  illegal_op:
     if (s->prefix & PREFIX_LOCK)
-        gen_helper_unlock();
+        gen_unlock();
     /* XXX: ensure that no lock was generated */
     gen_exception(s, EXCP06_ILLOP, pc_start - s->cs_base);
     return s->pc;
@@ -7943,6 +8070,7 @@ static inline void gen_intermediate_code_internal(CPUX86State *env,
     gen_opc_end = gen_opc_buf + OPC_MAX_SIZE;
 
     dc->is_jmp = DISAS_NEXT;
+    dc->nb_follows = 0;
     pc_ptr = pc_start;
     lj = -1;
     num_insns = 0;
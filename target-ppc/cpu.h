@@ -902,6 +902,8 @@ struct ppc_segment_page_sizes {
 /* The whole PowerPC CPU context */
 #define NB_MMU_MODES 3
 
+#define PPC_HTAB_HINT_SIZE 4096
+
 struct ppc_def_t {
     const char *name;
     uint32_t pvr;
@@ -988,6 +990,9 @@ struct CPUPPCState {
     target_ulong sr[32];
     /* externally stored hash table */
     uint8_t *external_htab;
+    /* Slot of the PTE last found in a PTEG, indexed by the low bits of the
+       hash; find_pte2() starts its search there.  Only a hint. */
+    uint8_t htab_hint[PPC_HTAB_HINT_SIZE];
     /* BATs */
     int nb_BATs;
     target_ulong DBAT[2][8];
@@ -569,13 +569,18 @@ static inline int find_pte2(CPUPPCState *env, mmu_ctx_t *ctx, int is_64b, int h,
 {
     target_phys_addr_t pteg_off;
     target_ulong pte0, pte1;
-    int i, good = -1;
+    uint8_t *hint;
+    int i, n, good = -1;
     int ret, r;
 
     ret = -1; /* No entry found */
     pteg_off = get_pteg_offset(env, ctx->hash[h],
                                is_64b ? HASH_PTE_SIZE_64 : HASH_PTE_SIZE_32);
-    for (i = 0; i < 8; i++) {
+    /* Start with the slot that matched last time in this PTEG: repeated
+       translations of the same pages then usually check one PTE only.  */
+    hint = &env->htab_hint[ctx->hash[h] & (PPC_HTAB_HINT_SIZE - 1)];
+    for (n = 0; n < 8; n++) {
+        i = (*hint + n) & 7;
 #if defined(TARGET_PPC64)
         if (is_64b) {
             if (env->external_htab) {
@@ -635,6 +640,7 @@ static inline int find_pte2(CPUPPCState *env, mmu_ctx_t *ctx, int is_64b, int h,
     done:
         LOG_MMU("found PTE at addr " TARGET_FMT_lx " prot=%01x ret=%d\n",
                 ctx->raddr, ctx->prot, ret);
+        *hint = good;
         /* Update page flags */
         pte1 = ctx->raddr;
         if (pte_update_flags(ctx, &pte1, ret, rw) == 1) {
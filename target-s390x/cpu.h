@@ -972,6 +972,19 @@ static inline uint64_t time2tod(uint64_t ns) {
 static inline void cpu_inject_ext(CPUS390XState *env, uint32_t code, uint32_t param,
                                   uint64_t param64)
 {
+    int i;
+
+    /* An identical interrupt that is still queued covers this one: for a
+       virtio queue the guest looks at the whole used ring when it takes
+       the interrupt. */
+    for (i = 0; i <= env->ext_index; i++) {
+        if (env->ext_queue[i].code == code &&
+            env->ext_queue[i].param == param &&
+            env->ext_queue[i].param64 == param64) {
+            return;
+        }
+    }
+
     if (env->ext_index == MAX_EXT_QUEUE - 1) {
         /* ugh - can't queue anymore. Let's drop. */
         return;
@@ -21,6 +21,7 @@
 #include "cpu.h"
 #include "memory.h"
 #include "cputlb.h"
+#include "qemu-rcu.h"
 #include "dyngen-exec.h"
 #include "host-utils.h"
 #include "helper.h"
@@ -2369,13 +2370,17 @@ int sclp_service_call(CPUS390XState *env, uint32_t sccb, uint64_t code)
 {
     int r = 0;
     int shift = 0;
+    bool is_ram;
 
 #ifdef DEBUG_HELPER
     printf("sclp(0x%x, 0x%" PRIx64 ")\n", sccb, code);
 #endif
 
     /* basic checks */
-    if (!memory_region_is_ram(phys_page_find(sccb >> TARGET_PAGE_BITS)->mr)) {
+    rcu_read_lock();
+    is_ram = memory_region_is_ram(phys_page_find(sccb >> TARGET_PAGE_BITS)->mr);
+    rcu_read_unlock();
+    if (!is_ram) {
         return -PGM_ADDRESSING;
     }
     if (sccb & ~0x7ffffff8ul) {
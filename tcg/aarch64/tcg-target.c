@@ -0,0 +1,1479 @@
+/*
+ * Tiny Code Generator for QEMU
+ *
+ * Copyright (c) 2008 Fabrice Bellard
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* Register 31 is the stack pointer as the base of loads and stores and in
+ * the add/sub immediate instructions, and the zero register elsewhere.
+ * 32-bit values live in the low half of the registers and are operated on
+ * with the W forms of the instructions, which ignore the high half.
+ */
+#define TCG_REG_XZR TCG_REG_SP
+
+/* scratch register, reserved */
+#define TCG_REG_TMP TCG_REG_X17
+
+#ifndef GUEST_BASE
+#define GUEST_BASE 0
+#endif
+
+#ifndef CONFIG_SOFTMMU
+/* Loads and stores of a 32-bit guest address zero-extend it as the index of
+ * a register offset access, so they need a base even without GUEST_BASE */
+#define TCG_GUEST_BASE_REG TCG_REG_X28
+#define USE_GUEST_BASE_REG (GUEST_BASE != 0 || TARGET_LONG_BITS == 32)
+#endif
+
+#ifndef NDEBUG
+static const char * const tcg_target_reg_names[TCG_TARGET_NB_REGS] = {
+    "%x0", "%x1", "%x2", "%x3", "%x4", "%x5", "%x6", "%x7",
+    "%x8", "%x9", "%x10", "%x11", "%x12", "%x13", "%x14", "%x15",
+    "%x16", "%x17", "%x18", "%x19", "%x20", "%x21", "%x22", "%x23",
+    "%x24", "%x25", "%x26", "%x27", "%x28", "%fp", "%lr", "%sp",
+};
+#endif
+
+static const int tcg_target_reg_alloc_order[] = {
+    /* callee saved */
+    TCG_REG_X20,
+    TCG_REG_X21,
+    TCG_REG_X22,
+    TCG_REG_X23,
+    TCG_REG_X24,
+    TCG_REG_X25,
+    TCG_REG_X26,
+    TCG_REG_X27,
+    TCG_REG_X28,
+    /* call clobbered */
+    TCG_REG_X8,
+    TCG_REG_X9,
+    TCG_REG_X10,
+    TCG_REG_X11,
+    TCG_REG_X12,
+    TCG_REG_X13,
+    TCG_REG_X14,
+    TCG_REG_X15,
+    TCG_REG_X16,
+    TCG_REG_X7,
+    TCG_REG_X6,
+    TCG_REG_X5,
+    TCG_REG_X4,
+    TCG_REG_X3,
+    TCG_REG_X2,
+    TCG_REG_X1,
+    TCG_REG_X0,
+};
+
+static const int tcg_target_call_iarg_regs[8] = {
+    TCG_REG_X0, TCG_REG_X1, TCG_REG_X2, TCG_REG_X3,
+    TCG_REG_X4, TCG_REG_X5, TCG_REG_X6, TCG_REG_X7
+};
+static const int tcg_target_call_oarg_regs[1] = {
+    TCG_REG_X0
+};
+
+static inline void reloc_pc26(void *code_ptr, tcg_target_long target)
+{
+    tcg_target_long offset = (target - (tcg_target_long) code_ptr) >> 2;
+
+    *(uint32_t *) code_ptr = (*(uint32_t *) code_ptr & ~0x03ffffff)
+                             | (offset & 0x03ffffff);
+}
+
+static inline void reloc_pc19(void *code_ptr, tcg_target_long target)
+{
+    tcg_target_long offset = (target - (tcg_target_long) code_ptr) >> 2;
+
+    *(uint32_t *) code_ptr = (*(uint32_t *) code_ptr & ~(0x7ffff << 5))
+                             | ((offset & 0x7ffff) << 5);
+}
+
+static void patch_reloc(uint8_t *code_ptr, int type,
+                        tcg_target_long value, tcg_target_long addend)
+{
+    value += addend;
+
+    switch (type) {
+    case R_AARCH64_JUMP26:
+    case R_AARCH64_CALL26:
+        reloc_pc26(code_ptr, value);
+        break;
+    case R_AARCH64_CONDBR19:
+        reloc_pc19(code_ptr, value);
+        break;
+    default:
+        tcg_abort();
+    }
+}
+
+/* maximum number of register used for input function arguments */
+static inline int tcg_target_get_call_iarg_regs_count(int flags)
+{
+    return ARRAY_SIZE(tcg_target_call_iarg_regs);
+}
+
+#define TCG_CT_CONST_AIMM 0x100
+
+/* parse target specific constraints */
+static int target_parse_constraint(TCGArgConstraint *ct, const char **pct_str)
+{
+    const char *ct_str;
+
+    ct_str = *pct_str;
+    switch (ct_str[0]) {
+    case 'r':
+        ct->ct |= TCG_CT_REG;
+        tcg_regset_set32(ct->u.regs, 0, 0xffffffff);
+        break;
+
+    /* qemu_ld/st address and qemu_st data */
+    case 'l':
+        ct->ct |= TCG_CT_REG;
+        tcg_regset_set32(ct->u.regs, 0, 0xffffffff);
+#ifdef CONFIG_SOFTMMU
+        /* x0-x3 are used for the TLB lookup and the helper arguments */
+        tcg_regset_reset_reg(ct->u.regs, TCG_REG_X0);
+        tcg_regset_reset_reg(ct->u.regs, TCG_REG_X1);
+        tcg_regset_reset_reg(ct->u.regs, TCG_REG_X2);
+        tcg_regset_reset_reg(ct->u.regs, TCG_REG_X3);
+#endif
+        break;
+
+    /* add, sub and compare immediate */
+    case 'A':
+        ct->ct |= TCG_CT_CONST_AIMM;
+        break;
+
+    default:
+        return -1;
+    }
+    ct_str++;
+    *pct_str = ct_str;
+
+    return 0;
+}
+
+/* Add/sub immediates are 12 bits, optionally shifted left by 12; a negative
+ * value uses the opposite instruction.
+ */
+static inline int is_aimm(tcg_target_long val)
+{
+    uint64_t uval = val < 0 ? -(uint64_t) val : val;
+
+    return (uval & ~0xfffull) == 0 || (uval & ~0xfff000ull) == 0;
+}
+
+/* test if a constant matches the constraint */
+static inline int tcg_target_const_match(tcg_target_long val,
+                                         const TCGArgConstraint *arg_ct)
+{
+    int ct;
+
+    ct = arg_ct->ct;
+    if (ct & TCG_CT_CONST)
+        return 1;
+    else if ((ct & TCG_CT_CONST_AIMM) && is_aimm(val))
+        return 1;
+    else
+        return 0;
+}
+
+enum aarch64_cond_code {
+    COND_EQ = 0x0,
+    COND_NE = 0x1,
+    COND_HS = 0x2,      /* unsigned greater or equal */
+    COND_LO = 0x3,      /* unsigned less than */
+    COND_MI = 0x4,
+    COND_PL = 0x5,
+    COND_VS = 0x6,
+    COND_VC = 0x7,
+    COND_HI = 0x8,      /* unsigned greater than */
+    COND_LS = 0x9,      /* unsigned less or equal */
+    COND_GE = 0xa,
+    COND_LT = 0xb,
+    COND_GT = 0xc,
+    COND_LE = 0xd,
+    COND_AL = 0xe,
+};
+
+static const uint8_t tcg_cond_to_aarch64_cond[10] = {
+    [TCG_COND_EQ] = COND_EQ,
+    [TCG_COND_NE] = COND_NE,
+    [TCG_COND_LT] = COND_LT,
+    [TCG_COND_GE] = COND_GE,
+    [TCG_COND_LE] = COND_LE,
+    [TCG_COND_GT] = COND_GT,
+    /* unsigned */
+    [TCG_COND_LTU] = COND_LO,
+    [TCG_COND_GEU] = COND_HS,
+    [TCG_COND_LEU] = COND_LS,
+    [TCG_COND_GTU] = COND_HI,
+};
+
+/* Base opcodes; the ext argument of the emitters below sets bit 31 for the
+ * 64-bit form.
+ */
+enum aarch64_insn {
+    /* data processing, shifted register */
+    INSN_ADD    = 0x0b000000,
+    INSN_ADDS   = 0x2b000000,
+    INSN_SUB    = 0x4b000000,
+    INSN_SUBS   = 0x6b000000,
+    INSN_AND    = 0x0a000000,
+    INSN_BIC    = 0x0a200000,
+    INSN_ORR    = 0x2a000000,
+    INSN_ORN    = 0x2a200000,
+    INSN_EOR    = 0x4a000000,
+    INSN_EON    = 0x4a200000,
+
+    /* data processing, register */
+    INSN_UDIV   = 0x1ac00800,
+    INSN_SDIV   = 0x1ac00c00,
+    INSN_LSLV   = 0x1ac02000,
+    INSN_LSRV   = 0x1ac02400,
+    INSN_ASRV   = 0x1ac02800,
+    INSN_RORV   = 0x1ac02c00,
+    INSN_MADD   = 0x1b000000,
+    INSN_MSUB   = 0x1b008000,
+    INSN_CSINC  = 0x1a800400,
+    INSN_REV16  = 0x5ac00400,  /* 32-bit form only */
+    INSN_REV32  = 0x5ac00800,  /* 32-bit form only */
+    INSN_REV64  = 0xdac00c00,
+
+    /* data processing, immediate */
+    INSN_ADDI   = 0x11000000,
+    INSN_ADDSI  = 0x31000000,
+    INSN_SUBI   = 0x51000000,
+    INSN_SUBSI  = 0x71000000,
+    INSN_ANDI   = 0x12000000,
+    INSN_MOVN   = 0x12800000,
+    INSN_MOVZ   = 0x52800000,
+    INSN_MOVK   = 0x72800000,
+    INSN_SBFM   = 0x13000000,
+    INSN_UBFM   = 0x53000000,
+    INSN_EXTR   = 0x13800000,
+
+    /* branches */
+    INSN_B      = 0x14000000,
+    INSN_BL     = 0x94000000,
+    INSN_BCOND  = 0x54000000,
+    INSN_BR     = 0xd61f0000,
+    INSN_BLR    = 0xd63f0000,
+    INSN_RET    = 0xd65f0000,
+
+    /* load/store pair of 64-bit registers */
+    INSN_STP    = 0xa9000000,
+    INSN_LDP    = 0xa9400000,
+    INSN_STP_PRE  = 0xa9800000,
+    INSN_LDP_POST = 0xa8c00000,
+};
+
+/* Loads and stores, in their unsigned scaled 12-bit offset form.  The access
+ * size is log2 in bits 31:30.
+ */
+enum aarch64_ldst_op {
+    LDST_STRB   = 0x39000000,
+    LDST_LDRB   = 0x39400000,
+    LDST_LDRSBX = 0x39800000,
+    LDST_STRH   = 0x79000000,
+    LDST_LDRH   = 0x79400000,
+    LDST_LDRSHX = 0x79800000,
+    LDST_STRW   = 0xb9000000,
+    LDST_LDRW   = 0xb9400000,
+    LDST_LDRSWX = 0xb9800000,
+    LDST_STRX   = 0xf9000000,
+    LDST_LDRX   = 0xf9400000,
+};
+
+/* extension of the index register of a register offset access */
+enum aarch64_ldst_ext {
+    LDST_EXT_UXTW = 2,
+    LDST_EXT_LSL  = 3,
+};
+
+#if TARGET_LONG_BITS == 32
+#define LDST_EXT_ADDR LDST_EXT_UXTW
+#else
+#define LDST_EXT_ADDR LDST_EXT_LSL
+#endif
+
+static inline void tcg_out_insn_3reg(TCGContext *s, int insn, int ext,
+                                     int rd, int rn, int rm)
+{
+    tcg_out32(s, insn | (ext << 31) | (rm << 16) | (rn << 5) | rd);
+}
+
+/* rd = rn op (rm << shift), for add, sub and the logical operations */
+static inline void tcg_out_insn_shift(TCGContext *s, int insn, int ext,
+                                      int rd, int rn, int rm, int shift)
+{
+    tcg_out32(s, insn | (ext << 31) | (rm << 16) | (shift << 10) |
+              (rn << 5) | rd);
+}
+
+/* rd = ra +/- rn * rm */
+static inline void tcg_out_insn_4reg(TCGContext *s, int insn, int ext,
+                                     int rd, int rn, int rm, int ra)
+{
+    tcg_out32(s, insn | (ext << 31) | (rm << 16) | (ra << 10) |
+              (rn << 5) | rd);
+}
+
+static inline void tcg_out_rev(TCGContext *s, int insn, int rd, int rn)
+{
+    tcg_out32(s, insn | (rn << 5) | rd);
+}
+
+/* aimm must satisfy is_aimm() and be positive */
+static inline void tcg_out_aimm(TCGContext *s, int insn, int ext,
+                                int rd, int rn, tcg_target_long aimm)
+{
+    if (aimm & ~0xfff) {
+        insn |= 1 << 22;
+        aimm >>= 12;
+    }
+    tcg_out32(s, insn | (ext << 31) | (aimm << 10) | (rn << 5) | rd);
+}
+
+static inline void tcg_out_addi(TCGContext *s, int ext,
+                                int rd, int rn, tcg_target_long aimm)
+{
+    if (aimm < 0) {
+        tcg_out_aimm(s, INSN_SUBI, ext, rd, rn, -aimm);
+    } else {
+        tcg_out_aimm(s, INSN_ADDI, ext, rd, rn, aimm);
+    }
+}
+
+/* Bitfield move; the 64-bit form also needs the N bit */
+static inline void tcg_out_bfm(TCGContext *s, int insn, int ext,
+                               int rd, int rn, int immr, int imms)
+{
+    tcg_out32(s, insn | (ext << 31) | (ext << 22) | (immr << 16) |
+              (imms << 10) | (rn << 5) | rd);
+}
+
+static inline void tcg_out_extr(TCGContext *s, int ext,
+                                int rd, int rn, int rm, int lsb)
+{
+    tcg_out32(s, INSN_EXTR | (ext << 31) | (ext << 22) | (rm << 16) |
+              (lsb << 10) | (rn << 5) | rd);
+}
+
+static inline void tcg_out_shli(TCGContext *s, int ext,
+                                int rd, int rn, int n)
+{
+    int bits = ext ? 64 : 32;
+
+    tcg_out_bfm(s, INSN_UBFM, ext, rd, rn, (bits - n) & (bits - 1),
+                bits - 1 - n);
+}
+
+static inline void tcg_out_shri(TCGContext *s, int ext,
+                                int rd, int rn, int n)
+{
+    tcg_out_bfm(s, INSN_UBFM, ext, rd, rn, n, ext ? 63 : 31);
+}
+
+static inline void tcg_out_sari(TCGContext *s, int ext,
+                                int rd, int rn, int n)
+{
+    tcg_out_bfm(s, INSN_SBFM, ext, rd, rn, n, ext ? 63 : 31);
+}
+
+static inline void tcg_out_ext8s(TCGContext *s, int ext, int rd, int rn)
+{
+    tcg_out_bfm(s, INSN_SBFM, ext, rd, rn, 0, 7);
+}
+
+static inline void tcg_out_ext16s(TCGContext *s, int ext, int rd, int rn)
+{
+    tcg_out_bfm(s, INSN_SBFM, ext, rd, rn, 0, 15);
+}
+
+static inline void tcg_out_ext32s(TCGContext *s, int rd, int rn)
+{
+    tcg_out_bfm(s, INSN_SBFM, 1, rd, rn, 0, 31);
+}
+
+/* The 32-bit forms clear the high half, which does for both types */
+static inline void tcg_out_ext8u(TCGContext *s, int rd, int rn)
+{
+    tcg_out_bfm(s, INSN_UBFM, 0, rd, rn, 0, 7);
+}
+
+static inline void tcg_out_ext16u(TCGContext *s, int rd, int rn)
+{
+    tcg_out_bfm(s, INSN_UBFM, 0, rd, rn, 0, 15);
+}
+
+static inline void tcg_out_mov(TCGContext *s, TCGType type,
+                               TCGReg ret, TCGReg arg)
+{
+    if (ret != arg) {
+        tcg_out_insn_3reg(s, INSN_ORR, type == TCG_TYPE_I64,
+                          ret, TCG_REG_XZR, arg);
+    }
+}
+
+static inline void tcg_out_movw(TCGContext *s, int insn, int ext,
+                                int rd, int imm16, int hw)
+{
+    tcg_out32(s, insn | (ext << 31) | (hw << 21) | (imm16 << 5) | rd);
+}
+
+static void tcg_out_movi(TCGContext *s, TCGType type,
+                         TCGReg rd, tcg_target_long arg)
+{
+    int ext = type == TCG_TYPE_I64;
+    int bits = ext ? 64 : 32;
+    uint64_t val = ext ? arg : (uint32_t) arg;
+    int i, zeros = 0, ones = 0, first = 1;
+    unsigned int half, fill;
+
+    /* Start from all ones with MOVN when that leaves fewer halfwords to
+       fill in with MOVK than starting from zero with MOVZ.  */
+    for (i = 0; i < bits; i += 16) {
+        half = (val >> i) & 0xffff;
+        zeros += half == 0;
+        ones += half == 0xffff;
+    }
+    fill = ones > zeros ? 0xffff : 0;
+
+    for (i = 0; i < bits; i += 16) {
+        half = (val >> i) & 0xffff;
+        if (half == fill) {
+            continue;
+        }
+        if (first) {
+            if (fill) {
+                tcg_out_movw(s, INSN_MOVN, ext, rd, ~half & 0xffff, i >> 4);
+            } else {
+                tcg_out_movw(s, INSN_MOVZ, ext, rd, half, i >> 4);
+            }
+            first = 0;
+        } else {
+            tcg_out_movw(s, INSN_MOVK, ext, rd, half, i >> 4);
+        }
+    }
+    if (first) {
+        tcg_out_movw(s, fill ? INSN_MOVN : INSN_MOVZ, ext, rd, 0, 0);
+    }
+}
+
+/* [rn + (rm, extended)] */
+static inline void tcg_out_ldst_r(TCGContext *s, int op, int rd,
+                                  int rn, int rm, int ext_opt)
+{
+    tcg_out32(s, (op & ~0x01000000) | 0x00200800 | (rm << 16) |
+              (ext_opt << 13) | (rn << 5) | rd);
+}
+
+static void tcg_out_ldst(TCGContext *s, int op, int rd, int rn,
+                         tcg_target_long offset)
+{
+    int size = (uint32_t) op >> 30;
+
+    if (offset >= 0 && !(offset & ((1 << size) - 1))
+        && (offset >> size) < 0x1000) {
+        tcg_out32(s, op | ((offset >> size) << 10) | (rn << 5) | rd);
+    } else if (offset >= -0x100 && offset < 0x100) {
+        /* unscaled signed 9-bit offset */
+        tcg_out32(s, (op & ~0x01000000) | ((offset & 0x1ff) << 12) |
+                  (rn << 5) | rd);
+    } else {
+        tcg_out_movi(s, TCG_TYPE_I64, TCG_REG_TMP, offset);
+        tcg_out_ldst_r(s, op, rd, rn, TCG_REG_TMP, LDST_EXT_LSL);
+    }
+}
+
+/* Pair of 64-bit registers, offset a multiple of 8 in [-512, 504] */
+static inline void tcg_out_ldstp(TCGContext *s, int insn, int rt, int rt2,
+                                 int rn, int offset)
+{
+    tcg_out32(s, insn | (((offset >> 3) & 0x7f) << 15) | (rt2 << 10) |
+              (rn << 5) | rt);
+}
+
+static inline void tcg_out_ld(TCGContext *s, TCGType type, TCGReg arg,
+                              TCGReg arg1, tcg_target_long arg2)
+{
+    tcg_out_ldst(s, type == TCG_TYPE_I32 ? LDST_LDRW : LDST_LDRX,
+                 arg, arg1, arg2);
+}
+
+static inline void tcg_out_st(TCGContext *s, TCGType type, TCGReg arg,
+                              TCGReg arg1, tcg_target_long arg2)
+{
+    tcg_out_ldst(s, type == TCG_TYPE_I32 ? LDST_STRW : LDST_STRX,
+                 arg, arg1, arg2);
+}
+
+static void tcg_out_cmp(TCGContext *s, int ext, TCGReg a,
+                        tcg_target_long b, int const_b)
+{
+    if (!const_b) {
+        tcg_out_insn_3reg(s, INSN_SUBS, ext, TCG_REG_XZR, a, b);
+    } else if (b >= 0) {
+        tcg_out_aimm(s, INSN_SUBSI, ext, TCG_REG_XZR, a, b);
+    } else {
+        tcg_out_aimm(s, INSN_ADDSI, ext, TCG_REG_XZR, a, -b);
+    }
+}
+
+static inline int in_range_b26(tcg_target_long target, uint8_t *code_ptr)
+{
+    tcg_target_long disp = (target - (tcg_target_long) code_ptr) >> 2;
+
+    return disp >= -0x2000000 && disp < 0x2000000;
+}
+
+/* Between TBs the code buffer is small enough for a direct branch, but the
+ * prologue and the helpers may be further away.
+ */
+static void tcg_out_goto(TCGContext *s, tcg_target_long target)
+{
+    if (in_range_b26(target, s->code_ptr)) {
+        tcg_out32(s, INSN_B |
+                  (((target - (tcg_target_long) s->code_ptr) >> 2)
+                   & 0x03ffffff));
+    } else {
+        tcg_out_movi(s, TCG_TYPE_I64, TCG_REG_TMP, target);
+        tcg_out32(s, INSN_BR | (TCG_REG_TMP << 5));
+    }
+}
+
+static inline void tcg_out_callr(TCGContext *s, int reg)
+{
+    tcg_out32(s, INSN_BLR | (reg << 5));
+}
+
+static void tcg_out_call(TCGContext *s, tcg_target_long target)
+{
+    if (in_range_b26(target, s->code_ptr)) {
+        tcg_out32(s, INSN_BL |
+                  (((target - (tcg_target_long) s->code_ptr) >> 2)
+                   & 0x03ffffff));
+    } else {
+        tcg_out_movi(s, TCG_TYPE_I64, TCG_REG_TMP, target);
+        tcg_out_callr(s, TCG_REG_TMP);
+    }
+}
+
+/* We pay attention here to not modify the branch target by keeping the
+ * offset bits of the instruction being overwritten.  This ensures that
+ * caches and memory are kept coherent during retranslation.
+ */
+static inline void tcg_out_b_noaddr(TCGContext *s)
+{
+    tcg_out32(s, INSN_B | (*(uint32_t *) s->code_ptr & 0x03ffffff));
+}
+
+static inline void tcg_out_bcond_noaddr(TCGContext *s, int cond)
+{
+    tcg_out32(s, INSN_BCOND | cond |
+              (*(uint32_t *) s->code_ptr & (0x7ffff << 5)));
+}
+
+static void tcg_out_goto_label(TCGContext *s, int cond, int label_index)
+{
+    TCGLabel *l = &s->labels[label_index];
+
+    if (cond == COND_AL) {
+        if (!l->has_value) {
+            tcg_out_reloc(s, s->code_ptr, R_AARCH64_JUMP26, label_index, 0);
+        }
+        tcg_out_b_noaddr(s);
+        if (l->has_value) {
+            reloc_pc26(s->code_ptr - 4, l->u.value);
+        }
+    } else {
+        if (!l->has_value) {
+            tcg_out_reloc(s, s->code_ptr, R_AARCH64_CONDBR19, label_index, 0);
+        }
+        tcg_out_bcond_noaddr(s, cond);
+        if (l->has_value) {
+            reloc_pc19(s->code_ptr - 4, l->u.value);
+        }
+    }
+}
+
+#ifdef CONFIG_SOFTMMU
+
+#include "../../softmmu_defs.h"
+
+#ifdef CONFIG_TCG_PASS_AREG0
+/* helper signature: helper_ld_mmu(CPUState *env, target_ulong addr,
+   int mmu_idx) */
+static const void * const qemu_ld_helpers[4] = {
+    helper_ldb_mmu,
+    helper_ldw_mmu,
+    helper_ldl_mmu,
+    helper_ldq_mmu,
+};
+
+/* helper signature: helper_st_mmu(CPUState *env, target_ulong addr,
+   uintxx_t val, int mmu_idx) */
+static const void * const qemu_st_helpers[4] = {
+    helper_stb_mmu,
+    helper_stw_mmu,
+    helper_stl_mmu,
+    helper_stq_mmu,
+};
+#else
+/* legacy helper signature: __ld_mmu(target_ulong addr, int
+   mmu_idx) */
+static void *qemu_ld_helpers[4] = {
+    __ldb_mmu,
+    __ldw_mmu,
+    __ldl_mmu,
+    __ldq_mmu,
+};
+
+/* legacy helper signature: __st_mmu(target_ulong addr, uintxx_t val,
+   int mmu_idx) */
+static void *qemu_st_helpers[4] = {
+    __stb_mmu,
+    __stw_mmu,
+    __stl_mmu,
+    __stq_mmu,
+};
+#endif
+
+/* Look up the TLB entry for addr_reg; cmp_off and add_off are the offsets
+ * of addr_read or addr_write and of addend in the tlb_table entries of
+ * mem_index.  Generates
+ *  ubfx x0, addr_reg, #TARGET_PAGE_BITS, #CPU_TLB_BITS
+ *  add  x0, env, x0, lsl #CPU_TLB_ENTRY_BITS
+ *  ldr  x1, [x0, #cmp_off]
+ *  ldr  x2, [x0, #add_off]
+ *  and  x3, addr_reg, #(TARGET_PAGE_MASK | ((1 << s_bits) - 1))
+ *  cmp  x3, x1
+ * using W registers for the address of a 32-bit guest, and leaves NE set
+ * on a miss or an unaligned access, and the addend in x2.
+ */
+static void tcg_out_tlb_read(TCGContext *s, int addr_reg, int s_bits,
+                             int cmp_off, int add_off)
+{
+    int ext = TARGET_LONG_BITS == 64;
+    int bits = TARGET_LONG_BITS;
+    int base_off;
+
+    tcg_out_bfm(s, INSN_UBFM, 1, TCG_REG_X0, addr_reg, TARGET_PAGE_BITS,
+                TARGET_PAGE_BITS + CPU_TLB_BITS - 1);
+    tcg_out_insn_shift(s, INSN_ADD, 1, TCG_REG_X0, TCG_AREG0, TCG_REG_X0,
+                       CPU_TLB_ENTRY_BITS);
+
+    /* Move the base up if the offsets of mem_index don't fit the scaled
+       12-bit offset of the loads.  */
+    if ((cmp_off >> (ext ? 3 : 2)) >= 0x1000 || (add_off >> 3) >= 0x1000) {
+        base_off = cmp_off & ~0xfff;
+        tcg_out_aimm(s, INSN_ADDI, 1, TCG_REG_X0, TCG_REG_X0, base_off);
+        cmp_off -= base_off;
+        add_off -= base_off;
+    }
+    tcg_out_ldst(s, ext ? LDST_LDRX : LDST_LDRW, TCG_REG_X1, TCG_REG_X0,
+                 cmp_off);
+    tcg_out_ldst(s, LDST_LDRX, TCG_REG_X2, TCG_REG_X0, add_off);
+
+    /* The mask is a run of ones from TARGET_PAGE_BITS up to the top bit
+       and around to bit s_bits - 1, as a logical immediate.  */
+    tcg_out32(s, INSN_ANDI | (ext << 31) | (ext << 22) |
+              (((bits - TARGET_PAGE_BITS) & (bits - 1)) << 16) |
+              ((bits - TARGET_PAGE_BITS + s_bits - 1) << 10) |
+              (addr_reg << 5) | TCG_REG_X3);
+    tcg_out_insn_3reg(s, INSN_SUBS, ext, TCG_REG_XZR, TCG_REG_X3, TCG_REG_X1);
+}
+#endif /* CONFIG_SOFTMMU */
+
+static void tcg_out_qemu_ld_direct(TCGContext *s, int opc, int data_reg,
+                                   int base, int index)
+{
+    int bswap;
+
+#ifdef TARGET_WORDS_BIGENDIAN
+    bswap = 1;
+#else
+    bswap = 0;
+#endif
+    switch (opc) {
+    case 0:
+        tcg_out_ldst_r(s, LDST_LDRB, data_reg, base, index, LDST_EXT_ADDR);
+        break;
+    case 0 | 4:
+        tcg_out_ldst_r(s, LDST_LDRSBX, data_reg, base, index, LDST_EXT_ADDR);
+        break;
+    case 1:
+        tcg_out_ldst_r(s, LDST_LDRH, data_reg, base, index, LDST_EXT_ADDR);
+        if (bswap) {
+            tcg_out_rev(s, INSN_REV16, data_reg, data_reg);
+        }
+        break;
+    case 1 | 4:
+        if (bswap) {
+            tcg_out_ldst_r(s, LDST_LDRH, data_reg, base, index,
+                           LDST_EXT_ADDR);
+            tcg_out_rev(s, INSN_REV16, data_reg, data_reg);
+            tcg_out_ext16s(s, 1, data_reg, data_reg);
+        } else {
+            tcg_out_ldst_r(s, LDST_LDRSHX, data_reg, base, index,
+                           LDST_EXT_ADDR);
+        }
+        break;
+    case 2:
+        tcg_out_ldst_r(s, LDST_LDRW, data_reg, base, index, LDST_EXT_ADDR);
+        if (bswap) {
+            tcg_out_rev(s, INSN_REV32, data_reg, data_reg);
+        }
+        break;
+    case 2 | 4:
+        if (bswap) {
+            tcg_out_ldst_r(s, LDST_LDRW, data_reg, base, index,
+                           LDST_EXT_ADDR);
+            tcg_out_rev(s, INSN_REV32, data_reg, data_reg);
+            tcg_out_ext32s(s, data_reg, data_reg);
+        } else {
+            tcg_out_ldst_r(s, LDST_LDRSWX, data_reg, base, index,
+                           LDST_EXT_ADDR);
+        }
+        break;
+    case 3:
+    default:
+        tcg_out_ldst_r(s, LDST_LDRX, data_reg, base, index, LDST_EXT_ADDR);
+        if (bswap) {
+            tcg_out_rev(s, INSN_REV64, data_reg, data_reg);
+        }
+        break;
+    }
+}
+
+static void tcg_out_qemu_st_direct(TCGContext *s, int opc, int data_reg,
+                                   int base, int index)
+{
+    int bswap;
+
+#ifdef TARGET_WORDS_BIGENDIAN
+    bswap = 1;
+#else
+    bswap = 0;
+#endif
+    switch (opc) {
+    case 0:
+        tcg_out_ldst_r(s, LDST_STRB, data_reg, base, index, LDST_EXT_ADDR);
+        break;
+    case 1:
+        if (bswap) {
+            tcg_out_rev(s, INSN_REV16, TCG_REG_TMP, data_reg);
+            data_reg = TCG_REG_TMP;
+        }
+        tcg_out_ldst_r(s, LDST_STRH, data_reg, base, index, LDST_EXT_ADDR);
+        break;
+    case 2:
+        if (bswap) {
+            tcg_out_rev(s, INSN_REV32, TCG_REG_TMP, data_reg);
+            data_reg = TCG_REG_TMP;
+        }
+        tcg_out_ldst_r(s, LDST_STRW, data_reg, base, index, LDST_EXT_ADDR);
+        break;
+    case 3:
+    default:
+        if (bswap) {
+            tcg_out_rev(s, INSN_REV64, TCG_REG_TMP, data_reg);
+            data_reg = TCG_REG_TMP;
+        }
+        tcg_out_ldst_r(s, LDST_STRX, data_reg, base, index, LDST_EXT_ADDR);
+        break;
+    }
+}
+
+static void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args, int opc)
+{
+    int addr_reg, data_reg;
+#ifdef CONFIG_SOFTMMU
+    int mem_index, s_bits;
+    uint8_t *label1_ptr, *label2_ptr;
+#endif
+
+    data_reg = *args++;
+    addr_reg = *args++;
+
+#ifdef CONFIG_SOFTMMU
+    mem_index = *args;
+    s_bits = opc & 3;
+
+    tcg_out_tlb_read(s, addr_reg, s_bits,
+                     offsetof(CPUArchState, tlb_table[mem_index][0].addr_read),
+                     offsetof(CPUArchState, tlb_table[mem_index][0].addend));
+
+    label1_ptr = s->code_ptr;
+    tcg_out_bcond_noaddr(s, COND_NE);
+
+    /* fast path: x2 = env->tlb_table[mem_index][index].addend */
+    tcg_out_qemu_ld_direct(s, opc, data_reg, TCG_REG_X2, addr_reg);
+
+    label2_ptr = s->code_ptr;
+    tcg_out_b_noaddr(s);
+
+    /* slow path */
+    reloc_pc19(label1_ptr, (tcg_target_long) s->code_ptr);
+#ifdef CONFIG_TCG_PASS_AREG0
+    tcg_out_mov(s, TCG_TYPE_I64, TCG_REG_X0, TCG_AREG0);
+    tcg_out_mov(s, TCG_TYPE_I64, TCG_REG_X1, addr_reg);
+    tcg_out_movi(s, TCG_TYPE_I32, TCG_REG_X2, mem_index);
+#else
+    tcg_out_mov(s, TCG_TYPE_I64, TCG_REG_X0, addr_reg);
+    tcg_out_movi(s, TCG_TYPE_I32, TCG_REG_X1, mem_index);
+#endif
+    tcg_out_call(s, (tcg_target_long) qemu_ld_helpers[s_bits]);
+
+    /* The high bits of a narrow return value are unspecified */
+    switch (opc) {
+    case 0:
+        tcg_out_ext8u(s, data_reg, TCG_REG_X0);
+        break;
+    case 0 | 4:
+        tcg_out_ext8s(s, 1, data_reg, TCG_REG_X0);
+        break;
+    case 1:
+        tcg_out_ext16u(s, data_reg, TCG_REG_X0);
+        break;
+    case 1 | 4:
+        tcg_out_ext16s(s, 1, data_reg, TCG_REG_X0);
+        break;
+    case 2:
+        tcg_out_insn_3reg(s, INSN_ORR, 0, data_reg, TCG_REG_XZR, TCG_REG_X0);
+        break;
+    case 2 | 4:
+        tcg_out_ext32s(s, data_reg, TCG_REG_X0);
+        break;
+    case 3:
+    default:
+        tcg_out_mov(s, TCG_TYPE_I64, data_reg, TCG_REG_X0);
+        break;
+    }
+
+    reloc_pc26(label2_ptr, (tcg_target_long) s->code_ptr);
+#else /* !CONFIG_SOFTMMU */
+    if (USE_GUEST_BASE_REG) {
+        tcg_out_qemu_ld_direct(s, opc, data_reg, TCG_GUEST_BASE_REG, addr_reg);
+    } else {
+        tcg_out_qemu_ld_direct(s, opc, data_reg, addr_reg, TCG_REG_XZR);
+    }
+#endif
+}
+
+static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args, int opc)
+{
+    int addr_reg, data_reg;
+#ifdef CONFIG_SOFTMMU
+    int mem_index, s_bits, argreg;
+    uint8_t *label1_ptr, *label2_ptr;
+#endif
+
+    data_reg = *args++;
+    addr_reg = *args++;
+
+#ifdef CONFIG_SOFTMMU
+    mem_index = *args;
+    s_bits = opc;
+
+    tcg_out_tlb_read(s, addr_reg, s_bits,
+                     offsetof(CPUArchState, tlb_table[mem_index][0].addr_write),
+                     offsetof(CPUArchState, tlb_table[mem_index][0].addend));
+
+    label1_ptr = s->code_ptr;
+    tcg_out_bcond_noaddr(s, COND_NE);
+
+    /* fast path: x2 = env->tlb_table[mem_index][index].addend */
+    tcg_out_qemu_st_direct(s, opc, data_reg, TCG_REG_X2, addr_reg);
+
+    label2_ptr = s->code_ptr;
+    tcg_out_b_noaddr(s);
+
+    /* slow path */
+    reloc_pc19(label1_ptr, (tcg_target_long) s->code_ptr);
+    argreg = TCG_REG_X0;
+#ifdef CONFIG_TCG_PASS_AREG0
+    tcg_out_mov(s, TCG_TYPE_I64, argreg++, TCG_AREG0);
+#endif
+    tcg_out_mov(s, TCG_TYPE_I64, argreg++, addr_reg);
+    tcg_out_mov(s, TCG_TYPE_I64, argreg++, data_reg);
+    tcg_out_movi(s, TCG_TYPE_I32, argreg, mem_index);
+    tcg_out_call(s, (tcg_target_long) qemu_st_helpers[s_bits]);
+
+    reloc_pc26(label2_ptr, (tcg_target_long) s->code_ptr);
+#else /* !CONFIG_SOFTMMU */
+    if (USE_GUEST_BASE_REG) {
+        tcg_out_qemu_st_direct(s, opc, data_reg, TCG_GUEST_BASE_REG, addr_reg);
+    } else {
+        tcg_out_qemu_st_direct(s, opc, data_reg, addr_reg, TCG_REG_XZR);
+    }
+#endif
+}
+
+static uint8_t *tb_ret_addr;
+
+static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
+                const TCGArg *args, const int *const_args)
+{
+    /* 64-bit operation */
+    int ext = 0;
+
+    switch (opc) {
+    case INDEX_op_exit_tb:
+        tcg_out_movi(s, TCG_TYPE_I64, TCG_REG_X0, args[0]);
+        tcg_out_goto(s, (tcg_target_long) tb_ret_addr);
+        break;
+    case INDEX_op_goto_tb:
+        if (s->tb_jmp_offset) {
+            /* direct jump method, patched by tb_set_jmp_target1 */
+            s->tb_jmp_offset[args[0]] = s->code_ptr - s->code_buf;
+            tcg_out_b_noaddr(s);
+        } else {
+            /* indirect jump method */
+            tcg_out_movi(s, TCG_TYPE_I64, TCG_REG_TMP,
+                         (tcg_target_long) (s->tb_next + args[0]));
+            tcg_out_ld(s, TCG_TYPE_I64, TCG_REG_TMP, TCG_REG_TMP, 0);
+            tcg_out32(s, INSN_BR | (TCG_REG_TMP << 5));
+        }
+        s->tb_next_offset[args[0]] = s->code_ptr - s->code_buf;
+        break;
+    case INDEX_op_call:
+        if (const_args[0])
+            tcg_out_call(s, args[0]);
+        else
+            tcg_out_callr(s, args[0]);
+        break;
+    case INDEX_op_jmp:
+        if (const_args[0])
+            tcg_out_goto(s, args[0]);
+        else
+            tcg_out32(s, INSN_BR | (args[0] << 5));
+        break;
+    case INDEX_op_br:
+        tcg_out_goto_label(s, COND_AL, args[0]);
+        break;
+
+    case INDEX_op_ld8u_i32:
+    case INDEX_op_ld8u_i64:
+        tcg_out_ldst(s, LDST_LDRB, args[0], args[1], args[2]);
+        break;
+    case INDEX_op_ld8s_i32:
+    case INDEX_op_ld8s_i64:
+        tcg_out_ldst(s, LDST_LDRSBX, args[0], args[1], args[2]);
+        break;
+    case INDEX_op_ld16u_i32:
+    case INDEX_op_ld16u_i64:
+        tcg_out_ldst(s, LDST_LDRH, args[0], args[1], args[2]);
+        break;
+    case INDEX_op_ld16s_i32:
+    case INDEX_op_ld16s_i64:
+        tcg_out_ldst(s, LDST_LDRSHX, args[0], args[1], args[2]);
+        break;
+    case INDEX_op_ld_i32:
+    case INDEX_op_ld32u_i64:
+        tcg_out_ldst(s, LDST_LDRW, args[0], args[1], args[2]);
+        break;
+    case INDEX_op_ld32s_i64:
+        tcg_out_ldst(s, LDST_LDRSWX, args[0], args[1], args[2]);
+        break;
+    case INDEX_op_ld_i64:
+        tcg_out_ldst(s, LDST_LDRX, args[0], args[1], args[2]);
+        break;
+    case INDEX_op_st8_i32:
+    case INDEX_op_st8_i64:
+        tcg_out_ldst(s, LDST_STRB, args[0], args[1], args[2]);
+        break;
+    case INDEX_op_st16_i32:
+    case INDEX_op_st16_i64:
+        tcg_out_ldst(s, LDST_STRH, args[0], args[1], args[2]);
+        break;
+    case INDEX_op_st_i32:
+    case INDEX_op_st32_i64:
+        tcg_out_ldst(s, LDST_STRW, args[0], args[1], args[2]);
+        break;
+    case INDEX_op_st_i64:
+        tcg_out_ldst(s, LDST_STRX, args[0], args[1], args[2]);
+        break;
+
+    case INDEX_op_mov_i64:
+        ext = 1;
+        /* fall through */
+    case INDEX_op_mov_i32:
+        tcg_out_mov(s, ext ? TCG_TYPE_I64 : TCG_TYPE_I32, args[0], args[1]);
+        break;
+    case INDEX_op_movi_i64:
+        tcg_out_movi(s, TCG_TYPE_I64, args[0], args[1]);
+        break;
+    case INDEX_op_movi_i32:
+        tcg_out_movi(s, TCG_TYPE_I32, args[0], args[1]);
+        break;
+
+    case INDEX_op_add_i64:
+        ext = 1;
+        /* fall through */
+    case INDEX_op_add_i32:
+        if (const_args[2]) {
+            tcg_out_addi(s, ext, args[0], args[1], args[2]);
+        } else {
+            tcg_out_insn_3reg(s, INSN_ADD, ext, args[0], args[1], args[2]);
+        }
+        break;
+    case INDEX_op_sub_i64:
+        ext = 1;
+        /* fall through */
+    case INDEX_op_sub_i32:
+        if (const_args[2]) {
+            tcg_out_addi(s, ext, args[0], args[1], -args[2]);
+        } else {
+            tcg_out_insn_3reg(s, INSN_SUB, ext, args[0], args[1], args[2]);
+        }
+        break;
+    case INDEX_op_neg_i64:
+        ext = 1;
+        /* fall through */
+    case INDEX_op_neg_i32:
+        tcg_out_insn_3reg(s, INSN_SUB, ext, args[0], TCG_REG_XZR, args[1]);
+        break;
+    case INDEX_op_not_i64:
+        ext = 1;
+        /* fall through */
+    case INDEX_op_not_i32:
+        tcg_out_insn_3reg(s, INSN_ORN, ext, args[0], TCG_REG_XZR, args[1]);
+        break;
+
+    case INDEX_op_and_i64:
+        ext = 1;
+        /* fall through */
+    case INDEX_op_and_i32:
+        tcg_out_insn_3reg(s, INSN_AND, ext, args[0], args[1], args[2]);
+        break;
+    case INDEX_op_or_i64:
+        ext = 1;
+        /* fall through */
+    case INDEX_op_or_i32:
+        tcg_out_insn_3reg(s, INSN_ORR, ext, args[0], args[1], args[2]);
+        break;
+    case INDEX_op_xor_i64:
+        ext = 1;
+        /* fall through */
+    case INDEX_op_xor_i32:
+        tcg_out_insn_3reg(s, INSN_EOR, ext, args[0], args[1], args[2]);
+        break;
+    case INDEX_op_andc_i64:
+        ext = 1;
+        /* fall through */
+    case INDEX_op_andc_i32:
+        tcg_out_insn_3reg(s, INSN_BIC, ext, args[0], args[1], args[2]);
+        break;
+    case INDEX_op_orc_i64:
+        ext = 1;
+        /* fall through */
+    case INDEX_op_orc_i32:
+        tcg_out_insn_3reg(s, INSN_ORN, ext, args[0], args[1], args[2]);
+        break;
+    case INDEX_op_eqv_i64:
+        ext = 1;
+        /* fall through */
+    case INDEX_op_eqv_i32:
+        tcg_out_insn_3reg(s, INSN_EON, ext, args[0], args[1], args[2]);
+        break;
+
+    case INDEX_op_mul_i64:
+        ext = 1;
+        /* fall through */
+    case INDEX_op_mul_i32:
+        tcg_out_insn_4reg(s, INSN_MADD, ext, args[0], args[1], args[2],
+                          TCG_REG_XZR);
+        break;
+    case INDEX_op_div_i64:
+        ext = 1;
+        /* fall through */
+    case INDEX_op_div_i32:
+        tcg_out_insn_3reg(s, INSN_SDIV, ext, args[0], args[1], args[2]);
+        break;
+    case INDEX_op_divu_i64:
+        ext = 1;
+        /* fall through */
+    case INDEX_op_divu_i32:
+        tcg_out_insn_3reg(s, INSN_UDIV, ext, args[0], args[1], args[2]);
+        break;
+    case INDEX_op_rem_i64:
+        ext = 1;
+        /* fall through */
+    case INDEX_op_rem_i32:
+        tcg_out_insn_3reg(s, INSN_SDIV, ext, TCG_REG_TMP, args[1], args[2]);
+        tcg_out_insn_4reg(s, INSN_MSUB, ext, args[0], TCG_REG_TMP, args[2],
+                          args[1]);
+        break;
+    case INDEX_op_remu_i64:
+        ext = 1;
+        /* fall through */
+    case INDEX_op_remu_i32:
+        tcg_out_insn_3reg(s, INSN_UDIV, ext, TCG_REG_TMP, args[1], args[2]);
+        tcg_out_insn_4reg(s, INSN_MSUB, ext, args[0], TCG_REG_TMP, args[2],
+                          args[1]);
+        break;
+
+    case INDEX_op_shl_i64:
+        ext = 1;
+        /* fall through */
+    case INDEX_op_shl_i32:
+        if (const_args[2]) {
+            tcg_out_shli(s, ext, args[0], args[1],
+                         args[2] & (ext ? 63 : 31));
+        } else {
+            tcg_out_insn_3reg(s, INSN_LSLV, ext, args[0], args[1], args[2]);
+        }
+        break;
+    case INDEX_op_shr_i64:
+        ext = 1;
+        /* fall through */
+    case INDEX_op_shr_i32:
+        if (const_args[2]) {
+            tcg_out_shri(s, ext, args[0], args[1],
+                         args[2] & (ext ? 63 : 31));
+        } else {
+            tcg_out_insn_3reg(s, INSN_LSRV, ext, args[0], args[1], args[2]);
+        }
+        break;
+    case INDEX_op_sar_i64:
+        ext = 1;
+        /* fall through */
+    case INDEX_op_sar_i32:
+        if (const_args[2]) {
+            tcg_out_sari(s, ext, args[0], args[1],
+                         args[2] & (ext ? 63 : 31));
+        } else {
+            tcg_out_insn_3reg(s, INSN_ASRV, ext, args[0], args[1], args[2]);
+        }
+        break;
+    case INDEX_op_rotr_i64:
+        ext = 1;
+        /* fall through */
+    case INDEX_op_rotr_i32:
+        if (const_args[2]) {
+            tcg_out_extr(s, ext, args[0], args[1], args[1],
+                         args[2] & (ext ? 63 : 31));
+        } else {
+            tcg_out_insn_3reg(s, INSN_RORV, ext, args[0], args[1], args[2]);
+        }
+        break;
+    case INDEX_op_rotl_i64:
+        ext = 1;
+        /* fall through */
+    case INDEX_op_rotl_i32:
+        if (const_args[2]) {
+            tcg_out_extr(s, ext, args[0], args[1], args[1],
+                         -args[2] & (ext ? 63 : 31));
+        } else {
+            tcg_out_insn_3reg(s, INSN_SUB, ext, TCG_REG_TMP,
+                              TCG_REG_XZR, args[2]);
+            tcg_out_insn_3reg(s, INSN_RORV, ext, args[0], args[1],
+                              TCG_REG_TMP);
+        }
+        break;
+
+    case INDEX_op_brcond_i64:
+        ext = 1;
+        /* fall through */
+    case INDEX_op_brcond_i32:
+        tcg_out_cmp(s, ext, args[0], args[1], const_args[1]);
+        tcg_out_goto_label(s, tcg_cond_to_aarch64_cond[args[2]], args[3]);
+        break;
+    case INDEX_op_setcond_i64:
+        ext = 1;
+        /* fall through */
+    case INDEX_op_setcond_i32:
+        tcg_out_cmp(s, ext, args[1], args[2], const_args[2]);
+        /* cset: csinc rd, wzr, wzr, invert(cond) */
+        tcg_out32(s, INSN_CSINC | (TCG_REG_XZR << 16) |
+                  ((tcg_cond_to_aarch64_cond[args[3]] ^ 1) << 12) |
+                  (TCG_REG_XZR << 5) | args[0]);
+        break;
+
+    case INDEX_op_ext8s_i64:
+        ext = 1;
+        /* fall through */
+    case INDEX_op_ext8s_i32:
+        tcg_out_ext8s(s, ext, args[0], args[1]);
+        break;
+    case INDEX_op_ext16s_i64:
+        ext = 1;
+        /* fall through */
+    case INDEX_op_ext16s_i32:
+        tcg_out_ext16s(s, ext, args[0], args[1]);
+        break;
+    case INDEX_op_ext32s_i64:
+        tcg_out_ext32s(s, args[0], args[1]);
+        break;
+    case INDEX_op_ext8u_i64:
+    case INDEX_op_ext8u_i32:
+        tcg_out_ext8u(s, args[0], args[1]);
+        break;
+    case INDEX_op_ext16u_i64:
+    case INDEX_op_ext16u_i32:
+        tcg_out_ext16u(s, args[0], args[1]);
+        break;
+    case INDEX_op_ext32u_i64:
+        tcg_out_insn_3reg(s, INSN_ORR, 0, args[0], TCG_REG_XZR, args[1]);
+        break;
+
+    /* the high bits of the input are zero, and stay so */
+    case INDEX_op_bswap16_i64:
+    case INDEX_op_bswap16_i32:
+        tcg_out_rev(s, INSN_REV16, args[0], args[1]);
+        break;
+    case INDEX_op_bswap32_i64:
+    case INDEX_op_bswap32_i32:
+        tcg_out_rev(s, INSN_REV32, args[0], args[1]);
+        break;
+    case INDEX_op_bswap64_i64:
+        tcg_out_rev(s, INSN_REV64, args[0], args[1]);
+        break;
+
+    case INDEX_op_qemu_ld8u:
+        tcg_out_qemu_ld(s, args, 0);
+        break;
+    case INDEX_op_qemu_ld8s:
+        tcg_out_qemu_ld(s, args, 0 | 4);
+        break;
+    case INDEX_op_qemu_ld16u:
+        tcg_out_qemu_ld(s, args, 1);
+        break;
+    case INDEX_op_qemu_ld16s:
+        tcg_out_qemu_ld(s, args, 1 | 4);
+        break;
+    case INDEX_op_qemu_ld32:
+    case INDEX_op_qemu_ld32u:
+        tcg_out_qemu_ld(s, args, 2);
+        break;
+    case INDEX_op_qemu_ld32s:
+        tcg_out_qemu_ld(s, args, 2 | 4);
+        break;
+    case INDEX_op_qemu_ld64:
+        tcg_out_qemu_ld(s, args, 3);
+        break;
+
+    case INDEX_op_qemu_st8:
+        tcg_out_qemu_st(s, args, 0);
+        break;
+    case INDEX_op_qemu_st16:
+        tcg_out_qemu_st(s, args, 1);
+        break;
+    case INDEX_op_qemu_st32:
+        tcg_out_qemu_st(s, args, 2);
+        break;
+    case INDEX_op_qemu_st64:
+        tcg_out_qemu_st(s, args, 3);
+        break;
+
+    default:
+        tcg_abort();
+    }
+}
+
+static const TCGTargetOpDef aarch64_op_defs[] = {
+    { INDEX_op_exit_tb, { } },
+    { INDEX_op_goto_tb, { } },
+    { INDEX_op_call, { "ri" } },
+    { INDEX_op_jmp, { "ri" } },
+    { INDEX_op_br, { } },
+
+    { INDEX_op_mov_i32, { "r", "r" } },
+    { INDEX_op_movi_i32, { "r" } },
+
+    { INDEX_op_ld8u_i32, { "r", "r" } },
+    { INDEX_op_ld8s_i32, { "r", "r" } },
+    { INDEX_op_ld16u_i32, { "r", "r" } },
+    { INDEX_op_ld16s_i32, { "r", "r" } },
+    { INDEX_op_ld_i32, { "r", "r" } },
+    { INDEX_op_st8_i32, { "r", "r" } },
+    { INDEX_op_st16_i32, { "r", "r" } },
+    { INDEX_op_st_i32, { "r", "r" } },
+
+    { INDEX_op_add_i32, { "r", "r", "rA" } },
+    { INDEX_op_sub_i32, { "r", "r", "rA" } },
+    { INDEX_op_mul_i32, { "r", "r", "r" } },
+    { INDEX_op_div_i32, { "r", "r", "r" } },
+    { INDEX_op_divu_i32, { "r", "r", "r" } },
+    { INDEX_op_rem_i32, { "r", "r", "r" } },
+    { INDEX_op_remu_i32, { "r", "r", "r" } },
+    { INDEX_op_and_i32, { "r", "r", "r" } },
+    { INDEX_op_or_i32, { "r", "r", "r" } },
+    { INDEX_op_xor_i32, { "r", "r", "r" } },
+    { INDEX_op_andc_i32, { "r", "r", "r" } },
+    { INDEX_op_orc_i32, { "r", "r", "r" } },
+    { INDEX_op_eqv_i32, { "r", "r", "r" } },
+    { INDEX_op_neg_i32, { "r", "r" } },
+    { INDEX_op_not_i32, { "r", "r" } },
+
+    { INDEX_op_shl_i32, { "r", "r", "ri" } },
+    { INDEX_op_shr_i32, { "r", "r", "ri" } },
+    { INDEX_op_sar_i32, { "r", "r", "ri" } },
+    { INDEX_op_rotl_i32, { "r", "r", "ri" } },
+    { INDEX_op_rotr_i32, { "r", "r", "ri" } },
+
+    { INDEX_op_brcond_i32, { "r", "rA" } },
+    { INDEX_op_setcond_i32, { "r", "r", "rA" } },
+
+    { INDEX_op_ext8s_i32, { "r", "r" } },
+    { INDEX_op_ext16s_i32, { "r", "r" } },
+    { INDEX_op_ext8u_i32, { "r", "r" } },
+    { INDEX_op_ext16u_i32, { "r", "r" } },
+    { INDEX_op_bswap16_i32, { "r", "r" } },
+    { INDEX_op_bswap32_i32, { "r", "r" } },
+
+    { INDEX_op_mov_i64, { "r", "r" } },
+    { INDEX_op_movi_i64, { "r" } },
+
+    { INDEX_op_ld8u_i64, { "r", "r" } },
+    { INDEX_op_ld8s_i64, { "r", "r" } },
+    { INDEX_op_ld16u_i64, { "r", "r" } },
+    { INDEX_op_ld16s_i64, { "r", "r" } },
+    { INDEX_op_ld32u_i64, { "r", "r" } },
+    { INDEX_op_ld32s_i64, { "r", "r" } },
+    { INDEX_op_ld_i64, { "r", "r" } },
+    { INDEX_op_st8_i64, { "r", "r" } },
+    { INDEX_op_st16_i64, { "r", "r" } },
+    { INDEX_op_st32_i64, { "r", "r" } },
+    { INDEX_op_st_i64, { "r", "r" } },
+
+    { INDEX_op_add_i64, { "r", "r", "rA" } },
+    { INDEX_op_sub_i64, { "r", "r", "rA" } },
+    { INDEX_op_mul_i64, { "r", "r", "r" } },
+    { INDEX_op_div_i64, { "r", "r", "r" } },
+    { INDEX_op_divu_i64, { "r", "r", "r" } },
+    { INDEX_op_rem_i64, { "r", "r", "r" } },
+    { INDEX_op_remu_i64, { "r", "r", "r" } },
+    { INDEX_op_and_i64, { "r", "r", "r" } },
+    { INDEX_op_or_i64, { "r", "r", "r" } },
+    { INDEX_op_xor_i64, { "r", "r", "r" } },
+    { INDEX_op_andc_i64, { "r", "r", "r" } },
+    { INDEX_op_orc_i64, { "r", "r", "r" } },
+    { INDEX_op_eqv_i64, { "r", "r", "r" } },
+    { INDEX_op_neg_i64, { "r", "r" } },
+    { INDEX_op_not_i64, { "r", "r" } },
+
+    { INDEX_op_shl_i64, { "r", "r", "ri" } },
+    { INDEX_op_shr_i64, { "r", "r", "ri" } },
+    { INDEX_op_sar_i64, { "r", "r", "ri" } },
+    { INDEX_op_rotl_i64, { "r", "r", "ri" } },
+    { INDEX_op_rotr_i64, { "r", "r", "ri" } },
+
+    { INDEX_op_brcond_i64, { "r", "rA" } },
+    { INDEX_op_setcond_i64, { "r", "r", "rA" } },
+
+    { INDEX_op_ext8s_i64, { "r", "r" } },
+    { INDEX_op_ext16s_i64, { "r", "r" } },
+    { INDEX_op_ext32s_i64, { "r", "r" } },
+    { INDEX_op_ext8u_i64, { "r", "r" } },
+    { INDEX_op_ext16u_i64, { "r", "r" } },
+    { INDEX_op_ext32u_i64, { "r", "r" } },
+    { INDEX_op_bswap16_i64, { "r", "r" } },
+    { INDEX_op_bswap32_i64, { "r", "r" } },
+    { INDEX_op_bswap64_i64, { "r", "r" } },
+
+    { INDEX_op_qemu_ld8u, { "r", "l" } },
+    { INDEX_op_qemu_ld8s, { "r", "l" } },
+    { INDEX_op_qemu_ld16u, { "r", "l" } },
+    { INDEX_op_qemu_ld16s, { "r", "l" } },
+    { INDEX_op_qemu_ld32, { "r", "l" } },
+    { INDEX_op_qemu_ld32u, { "r", "l" } },
+    { INDEX_op_qemu_ld32s, { "r", "l" } },
+    { INDEX_op_qemu_ld64, { "r", "l" } },
+
+    { INDEX_op_qemu_st8, { "l", "l" } },
+    { INDEX_op_qemu_st16, { "l", "l" } },
+    { INDEX_op_qemu_st32, { "l", "l" } },
+    { INDEX_op_qemu_st64, { "l", "l" } },
+    { -1 },
+};
+
+static void tcg_target_init(TCGContext *s)
+{
+#if !defined(CONFIG_USER_ONLY)
+    /* fail safe */
+    if ((1 << CPU_TLB_ENTRY_BITS) != sizeof(CPUTLBEntry))
+        tcg_abort();
+#endif
+
+    tcg_regset_set32(tcg_target_available_regs[TCG_TYPE_I32], 0, 0xffffffff);
+    tcg_regset_set32(tcg_target_available_regs[TCG_TYPE_I64], 0, 0xffffffff);
+    /* x0-x18 and lr */
+    tcg_regset_set32(tcg_target_call_clobber_regs, 0,
+                     0x7ffff | (1 << TCG_REG_LR));
+
+    tcg_regset_clear(s->reserved_regs);
+    tcg_regset_set_reg(s->reserved_regs, TCG_REG_SP);
+    tcg_regset_set_reg(s->reserved_regs, TCG_REG_FP);
+    tcg_regset_set_reg(s->reserved_regs, TCG_REG_LR);
+    tcg_regset_set_reg(s->reserved_regs, TCG_REG_X18); /* platform register */
+    tcg_regset_set_reg(s->reserved_regs, TCG_REG_TMP);
+
+    tcg_add_target_add_op_defs(aarch64_op_defs);
+    tcg_set_frame(s, TCG_AREG0, offsetof(CPUArchState, temp_buf),
+                  CPU_TEMP_BUF_NLONGS * sizeof(long));
+}
+
+/* fp, lr and the callee saved x19-x28 */
+#define PUSH_SIZE (12 * 8)
+
+static void tcg_target_qemu_prologue(TCGContext *s)
+{
+    int i;
+
+    /* stp fp, lr, [sp, #-PUSH_SIZE]!; mov fp, sp */
+    tcg_out_ldstp(s, INSN_STP_PRE, TCG_REG_FP, TCG_REG_LR, TCG_REG_SP,
+                  -PUSH_SIZE);
+    tcg_out_aimm(s, INSN_ADDI, 1, TCG_REG_FP, TCG_REG_SP, 0);
+    for (i = 0; i < 10; i += 2) {
+        tcg_out_ldstp(s, INSN_STP, TCG_REG_X19 + i, TCG_REG_X20 + i,
+                      TCG_REG_SP, 16 + i * 8);
+    }
+    /* outgoing arguments of the helpers */
+    tcg_out_aimm(s, INSN_SUBI, 1, TCG_REG_SP, TCG_REG_SP,
+                 TCG_STATIC_CALL_ARGS_SIZE);
+
+#ifndef CONFIG_SOFTMMU
+    if (USE_GUEST_BASE_REG) {
+        tcg_out_movi(s, TCG_TYPE_I64, TCG_GUEST_BASE_REG, GUEST_BASE);
+        tcg_regset_set_reg(s->reserved_regs, TCG_GUEST_BASE_REG);
+    }
+#endif
+
+    tcg_out_mov(s, TCG_TYPE_PTR, TCG_AREG0, tcg_target_call_iarg_regs[0]);
+    tcg_out32(s, INSN_BR | (tcg_target_call_iarg_regs[1] << 5));
+
+    tb_ret_addr = s->code_ptr;
+
+    tcg_out_aimm(s, INSN_ADDI, 1, TCG_REG_SP, TCG_REG_SP,
+                 TCG_STATIC_CALL_ARGS_SIZE);
+    for (i = 0; i < 10; i += 2) {
+        tcg_out_ldstp(s, INSN_LDP, TCG_REG_X19 + i, TCG_REG_X20 + i,
+                      TCG_REG_SP, 16 + i * 8);
+    }
+    /* ldp fp, lr, [sp], #PUSH_SIZE; ret */
+    tcg_out_ldstp(s, INSN_LDP_POST, TCG_REG_FP, TCG_REG_LR, TCG_REG_SP,
+                  PUSH_SIZE);
+    tcg_out32(s, INSN_RET | (TCG_REG_LR << 5));
+}
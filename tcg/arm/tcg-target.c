@@ -442,11 +442,26 @@ static inline void tcg_out_dat_imm(TCGContext *s,
 static inline void tcg_out_movi32(TCGContext *s,
                 int cond, int rd, uint32_t arg)
 {
-    /* TODO: This is very suboptimal, we can easily have a constant
-     * pool somewhere after all the instructions.  */
-    if ((int)arg < 0 && (int)arg >= -0x100) {
-        tcg_out_dat_imm(s, cond, ARITH_MVN, rd, 0, (~arg) & 0xff);
-    } else if (use_armv7_instructions) {
+    int rot;
+
+    /* A single MOV or MVN of a rotated immediate beats movw/movt, but
+     * movw alone covers everything below 0x10000.  */
+    if (!use_armv7_instructions || (arg & 0xffff0000)) {
+        rot = encode_imm(arg);
+        if (rot >= 0) {
+            tcg_out_dat_imm(s, cond, ARITH_MOV, rd, 0,
+                            rotl(arg, rot) | (rot << 7));
+            return;
+        }
+        rot = encode_imm(~arg);
+        if (rot >= 0) {
+            tcg_out_dat_imm(s, cond, ARITH_MVN, rd, 0,
+                            rotl(~arg, rot) | (rot << 7));
+            return;
+        }
+    }
+
+    if (use_armv7_instructions) {
         /* use movw/movt */
         /* movw */
         tcg_out32(s, (cond << 28) | 0x03000000 | (rd << 12)
@@ -457,6 +472,8 @@ static inline void tcg_out_movi32(TCGContext *s,
                       | ((arg >> 12) & 0x000f0000) | ((arg >> 16) & 0xfff));
         }
     } else {
+        /* TODO: This is very suboptimal, we can easily have a constant
+         * pool somewhere after all the instructions.  */
         int opc = ARITH_MOV;
         int rn = 0;
 
@@ -491,6 +508,26 @@ static inline void tcg_out_mul32(TCGContext *s,
     }
 }
 
+static inline void tcg_out_sdiv(TCGContext *s, int cond,
+                                int rd, int rn, int rm)
+{
+    tcg_out32(s, (cond << 28) | 0x0710f010 | (rd << 16) | (rm << 8) | rn);
+}
+
+static inline void tcg_out_udiv(TCGContext *s, int cond,
+                                int rd, int rn, int rm)
+{
+    tcg_out32(s, (cond << 28) | 0x0730f010 | (rd << 16) | (rm << 8) | rn);
+}
+
+/* rd = ra - rn * rm */
+static inline void tcg_out_mls(TCGContext *s, int cond,
+                               int rd, int rn, int rm, int ra)
+{
+    tcg_out32(s, (cond << 28) | 0x00600090 |
+                    (rd << 16) | (ra << 12) | (rm << 8) | rn);
+}
+
 static inline void tcg_out_umull32(TCGContext *s,
                 int cond, int rd0, int rd1, int rs, int rm)
 {
@@ -671,6 +708,29 @@ static inline void tcg_out_st32_rwb(TCGContext *s, int cond,
                     (rn << 16) | (rd << 12) | rm);
 }
 
+/* Doubleword accesses, rd must be even and rd + 1 is the second register.
+ * The address must be doubleword aligned, which the TLB check guarantees.  */
+static inline void tcg_out_ldrd_r(TCGContext *s, int cond,
+                int rd, int rn, int rm)
+{
+    tcg_out32(s, (cond << 28) | 0x018000d0 |
+                    (rn << 16) | (rd << 12) | rm);
+}
+
+static inline void tcg_out_strd_r(TCGContext *s, int cond,
+                int rd, int rn, int rm)
+{
+    tcg_out32(s, (cond << 28) | 0x018000f0 |
+                    (rn << 16) | (rd << 12) | rm);
+}
+
+/* Whether a 64-bit value in data_reg:data_reg2 can use ldrd/strd.  */
+static inline int use_ldrd_pair(int data_reg, int data_reg2)
+{
+    return use_armv6_instructions
+        && (data_reg & 1) == 0 && data_reg2 == data_reg + 1;
+}
+
 static inline void tcg_out_ld16u_8(TCGContext *s, int cond,
                 int rd, int rn, tcg_target_long im)
 {
@@ -915,6 +975,10 @@ static inline void tcg_out_call(TCGContext *s, uint32_t addr)
         } else {
             tcg_out_bl(s, COND_AL, val);
         }
+    } else if (use_armv7_instructions) {
+        /* movw/movt and blx predict better than a load into pc */
+        tcg_out_movi32(s, COND_AL, TCG_REG_R8, addr);
+        tcg_out_blx(s, COND_AL, TCG_REG_R8);
     } else {
         tcg_out_dat_imm(s, COND_AL, ARITH_ADD, TCG_REG_R14, TCG_REG_PC, 4);
         tcg_out_ld32_12(s, COND_AL, TCG_REG_PC, TCG_REG_PC, -4);
@@ -1079,41 +1143,25 @@ static inline void tcg_out_arg_stacktidy(TCGContext *s, TCGReg argreg)
 
 #define TLB_SHIFT	(CPU_TLB_ENTRY_BITS + CPU_TLB_BITS)
 
-static inline void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args, int opc)
-{
-    int addr_reg, data_reg, data_reg2, bswap;
 #ifdef CONFIG_SOFTMMU
-    int mem_index, s_bits;
-    TCGReg argreg;
-# if TARGET_LONG_BITS == 64
-    int addr_reg2;
-# endif
-    uint32_t *label_ptr;
-#endif
-
-#ifdef TARGET_WORDS_BIGENDIAN
-    bswap = 1;
-#else
-    bswap = 0;
-#endif
-    data_reg = *args++;
-    if (opc == 3)
-        data_reg2 = *args++;
-    else
-        data_reg2 = 0; /* suppress warning */
-    addr_reg = *args++;
-#ifdef CONFIG_SOFTMMU
-# if TARGET_LONG_BITS == 64
-    addr_reg2 = *args++;
-# endif
-    mem_index = *args;
-    s_bits = opc & 3;
+/* Look up the TLB entry for addr_reg (addr_reg2 is the high half of a 64-bit
+ * guest address), cmp_off being the offset of addr_read or addr_write in
+ * CPUArchState.tlb_table[0][0].  Should generate something like:
+ *  shr r8, addr_reg, #TARGET_PAGE_BITS
+ *  and r0, r8, #(CPU_TLB_SIZE - 1)   @ Assumption: CPU_TLB_BITS <= 8
+ *  add r0, env, r0 lsl #CPU_TLB_ENTRY_BITS
+ *  ldr r1, [r0, #cmp_off]
+ *  cmp r1, r8 lsl #TARGET_PAGE_BITS
+ *  tsteq addr_reg, #((1 << s_bits) - 1)
+ *  ldreq r1, [r0, #addend]
+ * leaving EQ set and the addend in r1 on a hit.
+ */
+static void tcg_out_tlb_read(TCGContext *s, int addr_reg, int addr_reg2,
+                             int s_bits, int mem_index, int cmp_off)
+{
+    int add_off = offsetof(CPUArchState, tlb_table[0][0].addend);
+    int tlb_off = mem_index << TLB_SHIFT;
 
-    /* Should generate something like the following:
-     *  shr r8, addr_reg, #TARGET_PAGE_BITS
-     *  and r0, r8, #(CPU_TLB_SIZE - 1)   @ Assumption: CPU_TLB_BITS <= 8
-     *  add r0, env, r0 lsl #CPU_TLB_ENTRY_BITS
-     */
 #  if CPU_TLB_BITS > 8
 #   error
 #  endif
@@ -1123,19 +1171,20 @@ static inline void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args, int opc)
                     TCG_REG_R0, TCG_REG_R8, CPU_TLB_SIZE - 1);
     tcg_out_dat_reg(s, COND_AL, ARITH_ADD, TCG_REG_R0, TCG_AREG0,
                     TCG_REG_R0, SHIFT_IMM_LSL(CPU_TLB_ENTRY_BITS));
-    /* In the
-     *  ldr r1 [r0, #(offsetof(CPUArchState, tlb_table[mem_index][0].addr_read))]
-     * below, the offset is likely to exceed 12 bits if mem_index != 0 and
-     * not exceed otherwise, so use an
+    /* The offsets into tlb_table[mem_index] are likely to exceed 12 bits
+     * if mem_index != 0, in which case use an
      *  add r0, r0, #(mem_index * sizeof *CPUArchState.tlb_table)
-     * before.
+     * before the loads; a small CPUArchState doesn't need it.
      */
-    if (mem_index)
+    if (tlb_off && add_off + tlb_off > 0xfff) {
         tcg_out_dat_imm(s, COND_AL, ARITH_ADD, TCG_REG_R0, TCG_REG_R0,
                         (mem_index << (TLB_SHIFT & 1)) |
                         ((16 - (TLB_SHIFT >> 1)) << 8));
-    tcg_out_ld32_12(s, COND_AL, TCG_REG_R1, TCG_REG_R0,
-                    offsetof(CPUArchState, tlb_table[0][0].addr_read));
+    } else {
+        cmp_off += tlb_off;
+        add_off += tlb_off;
+    }
+    tcg_out_ld32_12(s, COND_AL, TCG_REG_R1, TCG_REG_R0, cmp_off);
     tcg_out_dat_reg(s, COND_AL, ARITH_CMP, 0, TCG_REG_R1,
                     TCG_REG_R8, SHIFT_IMM_LSL(TARGET_PAGE_BITS));
     /* Check alignment.  */
@@ -1143,15 +1192,87 @@ static inline void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args, int opc)
         tcg_out_dat_imm(s, COND_EQ, ARITH_TST,
                         0, addr_reg, (1 << s_bits) - 1);
 #  if TARGET_LONG_BITS == 64
-    /* XXX: possibly we could use a block data load or writeback in
-     * the first access.  */
-    tcg_out_ld32_12(s, COND_EQ, TCG_REG_R1, TCG_REG_R0,
-                    offsetof(CPUArchState, tlb_table[0][0].addr_read) + 4);
+    tcg_out_ld32_12(s, COND_EQ, TCG_REG_R1, TCG_REG_R0, cmp_off + 4);
     tcg_out_dat_reg(s, COND_EQ, ARITH_CMP, 0,
                     TCG_REG_R1, addr_reg2, SHIFT_IMM_LSL(0));
 #  endif
-    tcg_out_ld32_12(s, COND_EQ, TCG_REG_R1, TCG_REG_R0,
-                    offsetof(CPUArchState, tlb_table[0][0].addend));
+    tcg_out_ld32_12(s, COND_EQ, TCG_REG_R1, TCG_REG_R0, add_off);
+}
+#else
+/* Add GUEST_BASE to addr_reg, using rd as the destination when there is
+ * one; returns the register holding the host address.
+ */
+static int tcg_out_guest_base(TCGContext *s, int rd, int addr_reg)
+{
+    uint32_t offset = GUEST_BASE, rest;
+    int i, rot, n;
+
+    if (!offset) {
+        return addr_reg;
+    }
+
+    rot = encode_imm(offset);
+    if (rot >= 0) {
+        tcg_out_dat_imm(s, COND_AL, ARITH_ADD, rd, addr_reg,
+                        rotl(offset, rot) | (rot << 7));
+        return rd;
+    }
+
+    /* Prefer movw/movt and a register add to more than two immediate adds */
+    for (n = 0, rest = offset; rest; n++) {
+        rest &= ~(0xff << (ctz32(rest) & ~1));
+    }
+    if (use_armv7_instructions && n > 2) {
+        tcg_out_movi32(s, COND_AL, rd, offset);
+        tcg_out_dat_reg(s, COND_AL, ARITH_ADD, rd, addr_reg, rd,
+                        SHIFT_IMM_LSL(0));
+        return rd;
+    }
+
+    while (offset) {
+        i = ctz32(offset) & ~1;
+        rot = ((32 - i) << 7) & 0xf00;
+
+        tcg_out_dat_imm(s, COND_AL, ARITH_ADD, rd, addr_reg,
+                        ((offset >> i) & 0xff) | rot);
+        addr_reg = rd;
+        offset &= ~(0xff << i);
+    }
+    return rd;
+}
+#endif
+
+static inline void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args, int opc)
+{
+    int addr_reg, data_reg, data_reg2, bswap;
+#ifdef CONFIG_SOFTMMU
+    int mem_index, s_bits, addr_reg2;
+    TCGReg argreg;
+    uint32_t *label_ptr;
+#endif
+
+#ifdef TARGET_WORDS_BIGENDIAN
+    bswap = 1;
+#else
+    bswap = 0;
+#endif
+    data_reg = *args++;
+    if (opc == 3)
+        data_reg2 = *args++;
+    else
+        data_reg2 = 0; /* suppress warning */
+    addr_reg = *args++;
+#ifdef CONFIG_SOFTMMU
+# if TARGET_LONG_BITS == 64
+    addr_reg2 = *args++;
+# else
+    addr_reg2 = 0;
+# endif
+    mem_index = *args;
+    s_bits = opc & 3;
+
+    tcg_out_tlb_read(s, addr_reg, addr_reg2, s_bits, mem_index,
+                     offsetof(CPUArchState, tlb_table[0][0].addr_read));
 
     switch (opc) {
     case 0:
@@ -1187,6 +1308,8 @@ static inline void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args, int opc)
             tcg_out_ld32_12(s, COND_EQ, data_reg, TCG_REG_R1, 4);
             tcg_out_bswap32(s, COND_EQ, data_reg2, data_reg2);
             tcg_out_bswap32(s, COND_EQ, data_reg, data_reg);
+        } else if (use_ldrd_pair(data_reg, data_reg2)) {
+            tcg_out_ldrd_r(s, COND_EQ, data_reg, addr_reg, TCG_REG_R1);
         } else {
             tcg_out_ld32_rwb(s, COND_EQ, data_reg, TCG_REG_R1, addr_reg);
             tcg_out_ld32_12(s, COND_EQ, data_reg2, TCG_REG_R1, 4);
@@ -1245,21 +1368,7 @@ static inline void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args, int opc)
 
     reloc_pc24(label_ptr, (tcg_target_long)s->code_ptr);
 #else /* !CONFIG_SOFTMMU */
-    if (GUEST_BASE) {
-        uint32_t offset = GUEST_BASE;
-        int i;
-        int rot;
-
-        while (offset) {
-            i = ctz32(offset) & ~1;
-            rot = ((32 - i) << 7) & 0xf00;
-
-            tcg_out_dat_imm(s, COND_AL, ARITH_ADD, TCG_REG_R8, addr_reg,
-                            ((offset >> i) & 0xff) | rot);
-            addr_reg = TCG_REG_R8;
-            offset &= ~(0xff << i);
-        }
-    }
+    addr_reg = tcg_out_guest_base(s, TCG_REG_R8, addr_reg);
     switch (opc) {
     case 0:
         tcg_out_ld8_12(s, COND_AL, data_reg, addr_reg, 0);
@@ -1289,8 +1398,7 @@ static inline void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args, int opc)
         }
         break;
     case 3:
-        /* TODO: use block load -
-         * check that data_reg2 > data_reg or the other way */
+        /* No ldrd here; it faults on addresses that are not word aligned */
         if (data_reg == addr_reg) {
             tcg_out_ld32_12(s, COND_AL, data_reg2, addr_reg, bswap ? 0 : 4);
             tcg_out_ld32_12(s, COND_AL, data_reg, addr_reg, bswap ? 4 : 0);
@@ -1311,11 +1419,8 @@ static inline void tcg_out_qemu_st(TCGContext *s, const TCGArg *args, int opc)
 {
     int addr_reg, data_reg, data_reg2, bswap;
 #ifdef CONFIG_SOFTMMU
-    int mem_index, s_bits;
+    int mem_index, s_bits, addr_reg2;
     TCGReg argreg;
-# if TARGET_LONG_BITS == 64
-    int addr_reg2;
-# endif
     uint32_t *label_ptr;
 #endif
 
@@ -1333,50 +1438,14 @@ static inline void tcg_out_qemu_st(TCGContext *s, const TCGArg *args, int opc)
 #ifdef CONFIG_SOFTMMU
 # if TARGET_LONG_BITS == 64
     addr_reg2 = *args++;
+# else
+    addr_reg2 = 0;
 # endif
     mem_index = *args;
     s_bits = opc & 3;
 
-    /* Should generate something like the following:
-     *  shr r8, addr_reg, #TARGET_PAGE_BITS
-     *  and r0, r8, #(CPU_TLB_SIZE - 1)   @ Assumption: CPU_TLB_BITS <= 8
-     *  add r0, env, r0 lsl #CPU_TLB_ENTRY_BITS
-     */
-    tcg_out_dat_reg(s, COND_AL, ARITH_MOV,
-                    TCG_REG_R8, 0, addr_reg, SHIFT_IMM_LSR(TARGET_PAGE_BITS));
-    tcg_out_dat_imm(s, COND_AL, ARITH_AND,
-                    TCG_REG_R0, TCG_REG_R8, CPU_TLB_SIZE - 1);
-    tcg_out_dat_reg(s, COND_AL, ARITH_ADD, TCG_REG_R0,
-                    TCG_AREG0, TCG_REG_R0, SHIFT_IMM_LSL(CPU_TLB_ENTRY_BITS));
-    /* In the
-     *  ldr r1 [r0, #(offsetof(CPUArchState, tlb_table[mem_index][0].addr_write))]
-     * below, the offset is likely to exceed 12 bits if mem_index != 0 and
-     * not exceed otherwise, so use an
-     *  add r0, r0, #(mem_index * sizeof *CPUArchState.tlb_table)
-     * before.
-     */
-    if (mem_index)
-        tcg_out_dat_imm(s, COND_AL, ARITH_ADD, TCG_REG_R0, TCG_REG_R0,
-                        (mem_index << (TLB_SHIFT & 1)) |
-                        ((16 - (TLB_SHIFT >> 1)) << 8));
-    tcg_out_ld32_12(s, COND_AL, TCG_REG_R1, TCG_REG_R0,
-                    offsetof(CPUArchState, tlb_table[0][0].addr_write));
-    tcg_out_dat_reg(s, COND_AL, ARITH_CMP, 0, TCG_REG_R1,
-                    TCG_REG_R8, SHIFT_IMM_LSL(TARGET_PAGE_BITS));
-    /* Check alignment.  */
-    if (s_bits)
-        tcg_out_dat_imm(s, COND_EQ, ARITH_TST,
-                        0, addr_reg, (1 << s_bits) - 1);
-#  if TARGET_LONG_BITS == 64
-    /* XXX: possibly we could use a block data load or writeback in
-     * the first access.  */
-    tcg_out_ld32_12(s, COND_EQ, TCG_REG_R1, TCG_REG_R0,
-                    offsetof(CPUArchState, tlb_table[0][0].addr_write) + 4);
-    tcg_out_dat_reg(s, COND_EQ, ARITH_CMP, 0,
-                    TCG_REG_R1, addr_reg2, SHIFT_IMM_LSL(0));
-#  endif
-    tcg_out_ld32_12(s, COND_EQ, TCG_REG_R1, TCG_REG_R0,
-                    offsetof(CPUArchState, tlb_table[0][0].addend));
+    tcg_out_tlb_read(s, addr_reg, addr_reg2, s_bits, mem_index,
+                     offsetof(CPUArchState, tlb_table[0][0].addr_write));
 
     switch (opc) {
     case 0:
@@ -1405,6 +1474,8 @@ static inline void tcg_out_qemu_st(TCGContext *s, const TCGArg *args, int opc)
             tcg_out_st32_rwb(s, COND_EQ, TCG_REG_R0, TCG_REG_R1, addr_reg);
             tcg_out_bswap32(s, COND_EQ, TCG_REG_R0, data_reg);
             tcg_out_st32_12(s, COND_EQ, TCG_REG_R0, TCG_REG_R1, 4);
+        } else if (use_ldrd_pair(data_reg, data_reg2)) {
+            tcg_out_strd_r(s, COND_EQ, data_reg, addr_reg, TCG_REG_R1);
         } else {
             tcg_out_st32_rwb(s, COND_EQ, data_reg, TCG_REG_R1, addr_reg);
             tcg_out_st32_12(s, COND_EQ, data_reg2, TCG_REG_R1, 4);
@@ -1451,21 +1522,7 @@ static inline void tcg_out_qemu_st(TCGContext *s, const TCGArg *args, int opc)
 
     reloc_pc24(label_ptr, (tcg_target_long)s->code_ptr);
 #else /* !CONFIG_SOFTMMU */
-    if (GUEST_BASE) {
-        uint32_t offset = GUEST_BASE;
-        int i;
-        int rot;
-
-        while (offset) {
-            i = ctz32(offset) & ~1;
-            rot = ((32 - i) << 7) & 0xf00;
-
-            tcg_out_dat_imm(s, COND_AL, ARITH_ADD, TCG_REG_R1, addr_reg,
-                            ((offset >> i) & 0xff) | rot);
-            addr_reg = TCG_REG_R1;
-            offset &= ~(0xff << i);
-        }
-    }
+    addr_reg = tcg_out_guest_base(s, TCG_REG_R1, addr_reg);
     switch (opc) {
     case 0:
         tcg_out_st8_12(s, COND_AL, data_reg, addr_reg, 0);
@@ -1488,8 +1545,6 @@ static inline void tcg_out_qemu_st(TCGContext *s, const TCGArg *args, int opc)
         }
         break;
     case 3:
-        /* TODO: use block store -
-         * check that data_reg2 > data_reg or the other way */
         if (bswap) {
             tcg_out_bswap32(s, COND_AL, TCG_REG_R0, data_reg2);
             tcg_out_st32_12(s, COND_AL, TCG_REG_R0, addr_reg, 0);
@@ -1654,6 +1709,22 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
     case INDEX_op_mulu2_i32:
         tcg_out_umull32(s, COND_AL, args[0], args[1], args[2], args[3]);
         break;
+#if TCG_TARGET_HAS_div_i32
+    case INDEX_op_div_i32:
+        tcg_out_sdiv(s, COND_AL, args[0], args[1], args[2]);
+        break;
+    case INDEX_op_divu_i32:
+        tcg_out_udiv(s, COND_AL, args[0], args[1], args[2]);
+        break;
+    case INDEX_op_rem_i32:
+        tcg_out_sdiv(s, COND_AL, TCG_REG_R8, args[1], args[2]);
+        tcg_out_mls(s, COND_AL, args[0], TCG_REG_R8, args[2], args[1]);
+        break;
+    case INDEX_op_remu_i32:
+        tcg_out_udiv(s, COND_AL, TCG_REG_R8, args[1], args[2]);
+        tcg_out_mls(s, COND_AL, args[0], TCG_REG_R8, args[2], args[1]);
+        break;
+#endif
     /* XXX: Perhaps args[2] & 0x1f is wrong */
     case INDEX_op_shl_i32:
         c = const_args[2] ?
@@ -1820,6 +1891,12 @@ static const TCGTargetOpDef arm_op_defs[] = {
     { INDEX_op_sub_i32, { "r", "r", "rI" } },
     { INDEX_op_mul_i32, { "r", "r", "r" } },
     { INDEX_op_mulu2_i32, { "r", "r", "r", "r" } },
+#if TCG_TARGET_HAS_div_i32
+    { INDEX_op_div_i32, { "r", "r", "r" } },
+    { INDEX_op_divu_i32, { "r", "r", "r" } },
+    { INDEX_op_rem_i32, { "r", "r", "r" } },
+    { INDEX_op_remu_i32, { "r", "r", "r" } },
+#endif
     { INDEX_op_and_i32, { "r", "r", "rI" } },
     { INDEX_op_andc_i32, { "r", "r", "rI" } },
     { INDEX_op_or_i32, { "r", "r", "rI" } },
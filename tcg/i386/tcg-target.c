@@ -284,6 +284,23 @@ static inline int tcg_target_const_match(tcg_target_long val,
 #define OPC_TESTL	(0x85)
 #define OPC_XCHG_ax_r32	(0x90)
 
+#define OPC_MOVUPS_VxWx	(0x10 | P_EXT)
+#define OPC_MOVUPS_WxVx	(0x11 | P_EXT)
+#define OPC_MOVLPS_VqMq	(0x12 | P_EXT)
+#define OPC_MOVLPS_MqVq	(0x13 | P_EXT)
+#define OPC_PADDB	(0xfc | P_EXT | P_DATA16)
+#define OPC_PADDW	(0xfd | P_EXT | P_DATA16)
+#define OPC_PADDD	(0xfe | P_EXT | P_DATA16)
+#define OPC_PADDQ	(0xd4 | P_EXT | P_DATA16)
+#define OPC_PSUBB	(0xf8 | P_EXT | P_DATA16)
+#define OPC_PSUBW	(0xf9 | P_EXT | P_DATA16)
+#define OPC_PSUBD	(0xfa | P_EXT | P_DATA16)
+#define OPC_PSUBQ	(0xfb | P_EXT | P_DATA16)
+#define OPC_PAND	(0xdb | P_EXT | P_DATA16)
+#define OPC_PANDN	(0xdf | P_EXT | P_DATA16)
+#define OPC_POR		(0xeb | P_EXT | P_DATA16)
+#define OPC_PXOR	(0xef | P_EXT | P_DATA16)
+
 #define OPC_GRP3_Ev	(0xf7)
 #define OPC_GRP5	(0xff)
 
@@ -429,6 +446,7 @@ static void tcg_out_modrm_sib_offset(TCGContext *s, int opc, int r, int rm,
             tcg_target_long pc = (tcg_target_long)s->code_ptr + 5 + ~rm;
             tcg_target_long disp = offset - pc;
             if (disp == (int32_t)disp) {
+                tcg_out_code_fixed(s);
                 tcg_out_opc(s, opc, r, 0, 0);
                 tcg_out8(s, (LOWREGMASK(r) << 3) | 5);
                 tcg_out32(s, disp);
@@ -943,8 +961,14 @@ static void tcg_out_branch(TCGContext *s, int call, tcg_target_long dest)
 
     if (disp == (int32_t)disp) {
         tcg_out_opc(s, call ? OPC_CALL_Jz : OPC_JMP_long, 0, 0, 0);
+        if (dest < (tcg_target_long)s->code_buf ||
+            dest >= (tcg_target_long)s->code_ptr) {
+            tcg_out_code_reloc(s, s->code_ptr, TCG_CODE_RELOC_PCREL32, dest);
+        }
         tcg_out32(s, disp);
     } else {
+        /* would become a rel32 branch if the code moved closer */
+        tcg_out_code_fixed(s);
         tcg_out_movi(s, TCG_TYPE_PTR, TCG_REG_R10, dest);
         tcg_out_modrm(s, OPC_GRP5,
                       call ? EXT5_CALLN_Ev : EXT5_JMPN_Ev, TCG_REG_R10);
@@ -1025,6 +1049,26 @@ static void *qemu_st_helpers[4] = {
 
    Second argument register is clobbered.  */
 
+/* Emit the jne to the TLB miss case and return the position of its
+   displacement.  The miss case is after the code of the TB when
+   CONFIG_QEMU_LDST_OPTIMIZATION is set, further away than a short jump
+   can reach.  */
+static inline uint8_t *tcg_out_tlb_miss_jump(TCGContext *s)
+{
+    uint8_t *label_ptr;
+
+#ifdef CONFIG_QEMU_LDST_OPTIMIZATION
+    tcg_out_opc(s, OPC_JCC_long + JCC_JNE, 0, 0, 0);
+    label_ptr = s->code_ptr;
+    s->code_ptr += 4;
+#else
+    tcg_out8(s, OPC_JCC_short + JCC_JNE);
+    label_ptr = s->code_ptr;
+    s->code_ptr++;
+#endif
+    return label_ptr;
+}
+
 static inline void tcg_out_tlb_load(TCGContext *s, int addrlo_idx,
                                     int mem_index, int s_bits,
                                     const TCGArg *args,
@@ -1049,8 +1093,9 @@ static inline void tcg_out_tlb_load(TCGContext *s, int addrlo_idx,
 
     tgen_arithi(s, ARITH_AND + rexw, r0,
                 TARGET_PAGE_MASK | ((1 << s_bits) - 1), 0);
-    tgen_arithi(s, ARITH_AND + rexw, r1,
-                (CPU_TLB_SIZE - 1) << CPU_TLB_ENTRY_BITS, 0);
+    /* and env->tlb_mask, r1: the size of the TLB changes at run time */
+    tcg_out_modrm_offset(s, OPC_ARITH_GvEv + (ARITH_AND << 3) + rexw, r1,
+                         TCG_AREG0, offsetof(CPUArchState, tlb_mask));
 
     tcg_out_modrm_sib_offset(s, OPC_LEA + P_REXW, r1, TCG_AREG0, r1, 0,
                              offsetof(CPUArchState, tlb_table[mem_index][0])
@@ -1062,18 +1107,14 @@ static inline void tcg_out_tlb_load(TCGContext *s, int addrlo_idx,
     tcg_out_mov(s, type, r0, addrlo);
 
     /* jne label1 */
-    tcg_out8(s, OPC_JCC_short + JCC_JNE);
-    label_ptr[0] = s->code_ptr;
-    s->code_ptr++;
+    label_ptr[0] = tcg_out_tlb_miss_jump(s);
 
     if (TARGET_LONG_BITS > TCG_TARGET_REG_BITS) {
         /* cmp 4(r1), addrhi */
         tcg_out_modrm_offset(s, OPC_CMP_GvEv, args[addrlo_idx+1], r1, 4);
 
         /* jne label1 */
-        tcg_out8(s, OPC_JCC_short + JCC_JNE);
-        label_ptr[1] = s->code_ptr;
-        s->code_ptr++;
+        label_ptr[1] = tcg_out_tlb_miss_jump(s);
     }
 
     /* TLB Hit.  */
@@ -1161,64 +1202,45 @@ static void tcg_out_qemu_ld_direct(TCGContext *s, int datalo, int datahi,
     }
 }
 
-/* XXX: qemu_ld and qemu_st could be modified to clobber only EDX and
-   EAX. It will be useful once fixed registers globals are less
-   common. */
-static void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args,
-                            int opc)
-{
-    int data_reg, data_reg2 = 0;
-    int addrlo_idx;
 #if defined(CONFIG_SOFTMMU)
-    int mem_index, s_bits;
+#if defined(CONFIG_QEMU_LDST_OPTIMIZATION)
+/* A helper called from a TLB miss case after the code of the TB finds
+   where the access is in the fast path from a jmp that follows its return
+   address and is skipped over; see GETPC_LDST() in exec-all.h.  */
+static void tcg_out_ldst_raddr(TCGContext *s, uint8_t *raddr)
+{
+    /* jmp over the following jmp */
+    tcg_out8(s, OPC_JMP_short);
+    tcg_out8(s, 5);
+    /* jmp raddr, never executed */
+    tcg_out8(s, OPC_JMP_long);
+    tcg_out32(s, raddr - s->code_ptr - 4);
+}
+#endif
+
+/* Call the load helper of a TLB miss and move its result to DATA_REG
+   and DATA_REG2.  The first argument register holds the low part of the
+   guest address, ADDRLO and ADDRHI its registers.  RADDR is where the
+   code goes on in the fast path if the call is out of line, else NULL.  */
+static void tcg_out_qemu_ld_helper(TCGContext *s, int opc, int data_reg,
+                                   int data_reg2, int addrlo, int addrhi,
+                                   int mem_index, uint8_t *raddr)
+{
+    int s_bits = opc & 3;
 #if TCG_TARGET_REG_BITS == 64
     int arg_idx;
 #else
     int stack_adjust;
 #endif
-    uint8_t *label_ptr[3];
-#endif
 
-    data_reg = args[0];
-    addrlo_idx = 1;
-    if (TCG_TARGET_REG_BITS == 32 && opc == 3) {
-        data_reg2 = args[1];
-        addrlo_idx = 2;
-    }
-
-#if defined(CONFIG_SOFTMMU)
-    mem_index = args[addrlo_idx + 1 + (TARGET_LONG_BITS > TCG_TARGET_REG_BITS)];
-    s_bits = opc & 3;
-
-    tcg_out_tlb_load(s, addrlo_idx, mem_index, s_bits, args,
-                     label_ptr, offsetof(CPUTLBEntry, addr_read));
-
-    /* TLB Hit.  */
-    tcg_out_qemu_ld_direct(s, data_reg, data_reg2,
-                           tcg_target_call_iarg_regs[0], 0, opc);
-
-    /* jmp label2 */
-    tcg_out8(s, OPC_JMP_short);
-    label_ptr[2] = s->code_ptr;
-    s->code_ptr++;
-
-    /* TLB Miss.  */
-
-    /* label1: */
-    *label_ptr[0] = s->code_ptr - label_ptr[0] - 1;
-    if (TARGET_LONG_BITS > TCG_TARGET_REG_BITS) {
-        *label_ptr[1] = s->code_ptr - label_ptr[1] - 1;
-    }
-
-    /* XXX: move that code at the end of the TB */
 #if TCG_TARGET_REG_BITS == 32
     tcg_out_pushi(s, mem_index);
     stack_adjust = 4;
     if (TARGET_LONG_BITS == 64) {
-        tcg_out_push(s, args[addrlo_idx + 1]);
+        tcg_out_push(s, addrhi);
         stack_adjust += 4;
     }
-    tcg_out_push(s, args[addrlo_idx]);
+    tcg_out_push(s, addrlo);
     stack_adjust += 4;
 #ifdef CONFIG_TCG_PASS_AREG0
     tcg_out_push(s, TCG_AREG0);
@@ -1243,6 +1265,11 @@ static void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args,
 #endif
 
     tcg_out_calli(s, (tcg_target_long)qemu_ld_helpers[s_bits]);
+#if defined(CONFIG_QEMU_LDST_OPTIMIZATION)
+    if (raddr) {
+        tcg_out_ldst_raddr(s, raddr);
+    }
+#endif
 
 #if TCG_TARGET_REG_BITS == 32
     if (stack_adjust == (TCG_TARGET_REG_BITS / 8)) {
@@ -1289,9 +1316,94 @@ static void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args,
     default:
         tcg_abort();
     }
+}
+
+#if defined(CONFIG_QEMU_LDST_OPTIMIZATION)
+/* Record the TLB miss case of a qemu_ld/st, to be generated by
+   tcg_out_tb_finalize().  */
+static void add_qemu_ldst_label(TCGContext *s, int is_ld, int opc,
+                                int data_reg, int data_reg2,
+                                int addrlo, int addrhi, int mem_index,
+                                uint8_t *raddr, uint8_t **label_ptr)
+{
+    TCGLabelQemuLdst *l;
+
+    if (s->nb_qemu_ldst_labels >= TCG_MAX_QEMU_LDST) {
+        tcg_abort();
+    }
+    l = &s->qemu_ldst_labels[s->nb_qemu_ldst_labels++];
+    l->is_ld = is_ld;
+    l->opc = opc;
+    l->datalo_reg = data_reg;
+    l->datahi_reg = data_reg2;
+    l->addrlo_reg = addrlo;
+    l->addrhi_reg = addrhi;
+    l->mem_index = mem_index;
+    l->raddr = raddr;
+    l->label_ptr[0] = label_ptr[0];
+    if (TARGET_LONG_BITS > TCG_TARGET_REG_BITS) {
+        l->label_ptr[1] = label_ptr[1];
+    }
+}
+#endif
+#endif /* CONFIG_SOFTMMU */
+
+/* XXX: qemu_ld and qemu_st could be modified to clobber only EDX and
+   EAX. It will be useful once fixed registers globals are less
+   common. */
+static void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args,
+                            int opc)
+{
+    int data_reg, data_reg2 = 0;
+    int addrlo_idx;
+#if defined(CONFIG_SOFTMMU)
+    int mem_index, s_bits;
+    uint8_t *label_ptr[3];
+#endif
+
+    data_reg = args[0];
+    addrlo_idx = 1;
+    if (TCG_TARGET_REG_BITS == 32 && opc == 3) {
+        data_reg2 = args[1];
+        addrlo_idx = 2;
+    }
+
+#if defined(CONFIG_SOFTMMU)
+    mem_index = args[addrlo_idx + 1 + (TARGET_LONG_BITS > TCG_TARGET_REG_BITS)];
+    s_bits = opc & 3;
+
+    tcg_out_tlb_load(s, addrlo_idx, mem_index, s_bits, args,
+                     label_ptr, offsetof(CPUTLBEntry, addr_read));
+
+    /* TLB Hit.  */
+    tcg_out_qemu_ld_direct(s, data_reg, data_reg2,
+                           tcg_target_call_iarg_regs[0], 0, opc);
+
+#if defined(CONFIG_QEMU_LDST_OPTIMIZATION)
+    /* TLB Miss, after the code of the TB.  */
+    add_qemu_ldst_label(s, 1, opc, data_reg, data_reg2, args[addrlo_idx],
+                        args[addrlo_idx + 1], mem_index, s->code_ptr,
+                        label_ptr);
+#else
+    /* jmp label2 */
+    tcg_out8(s, OPC_JMP_short);
+    label_ptr[2] = s->code_ptr;
+    s->code_ptr++;
+
+    /* TLB Miss.  */
+
+    /* label1: */
+    *label_ptr[0] = s->code_ptr - label_ptr[0] - 1;
+    if (TARGET_LONG_BITS > TCG_TARGET_REG_BITS) {
+        *label_ptr[1] = s->code_ptr - label_ptr[1] - 1;
+    }
+
+    tcg_out_qemu_ld_helper(s, opc, data_reg, data_reg2, args[addrlo_idx],
+                           args[addrlo_idx + 1], mem_index, NULL);
 
     /* label2: */
     *label_ptr[2] = s->code_ptr - label_ptr[2] - 1;
+#endif
 #else
     {
         int32_t offset = GUEST_BASE;
@@ -1378,49 +1490,15 @@ static void tcg_out_qemu_st_direct(TCGContext *s, int datalo, int datahi,
     }
 }
 
-static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args,
-                            int opc)
-{
-    int data_reg, data_reg2 = 0;
-    int addrlo_idx;
 #if defined(CONFIG_SOFTMMU)
-    int mem_index, s_bits;
+/* Call the store helper of a TLB miss, as tcg_out_qemu_ld_helper.  */
+static void tcg_out_qemu_st_helper(TCGContext *s, int opc, int data_reg,
+                                   int data_reg2, int addrlo, int addrhi,
+                                   int mem_index, uint8_t *raddr)
+{
+    int s_bits = opc;
     int stack_adjust;
-    uint8_t *label_ptr[3];
-#endif
-
-    data_reg = args[0];
-    addrlo_idx = 1;
-    if (TCG_TARGET_REG_BITS == 32 && opc == 3) {
-        data_reg2 = args[1];
-        addrlo_idx = 2;
-    }
-
-#if defined(CONFIG_SOFTMMU)
-    mem_index = args[addrlo_idx + 1 + (TARGET_LONG_BITS > TCG_TARGET_REG_BITS)];
-    s_bits = opc;
-
-    tcg_out_tlb_load(s, addrlo_idx, mem_index, s_bits, args,
-                     label_ptr, offsetof(CPUTLBEntry, addr_write));
-
-    /* TLB Hit.  */
-    tcg_out_qemu_st_direct(s, data_reg, data_reg2,
-                           tcg_target_call_iarg_regs[0], 0, opc);
-
-    /* jmp label2 */
-    tcg_out8(s, OPC_JMP_short);
-    label_ptr[2] = s->code_ptr;
-    s->code_ptr++;
 
-    /* TLB Miss.  */
-
-    /* label1: */
-    *label_ptr[0] = s->code_ptr - label_ptr[0] - 1;
-    if (TARGET_LONG_BITS > TCG_TARGET_REG_BITS) {
-        *label_ptr[1] = s->code_ptr - label_ptr[1] - 1;
-    }
-
-    /* XXX: move that code at the end of the TB */
 #if TCG_TARGET_REG_BITS == 32
     tcg_out_pushi(s, mem_index);
     stack_adjust = 4;
@@ -1431,10 +1509,10 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args,
     tcg_out_push(s, data_reg);
     stack_adjust += 4;
     if (TARGET_LONG_BITS == 64) {
-        tcg_out_push(s, args[addrlo_idx + 1]);
+        tcg_out_push(s, addrhi);
         stack_adjust += 4;
     }
-    tcg_out_push(s, args[addrlo_idx]);
+    tcg_out_push(s, addrlo);
     stack_adjust += 4;
 #ifdef CONFIG_TCG_PASS_AREG0
     tcg_out_push(s, TCG_AREG0);
@@ -1459,6 +1537,11 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args,
 #endif
 
     tcg_out_calli(s, (tcg_target_long)qemu_st_helpers[s_bits]);
+#if defined(CONFIG_QEMU_LDST_OPTIMIZATION)
+    if (raddr) {
+        tcg_out_ldst_raddr(s, raddr);
+    }
+#endif
 
     if (stack_adjust == (TCG_TARGET_REG_BITS / 8)) {
         /* Pop and discard.  This is 2 bytes smaller than the add.  */
@@ -1466,9 +1549,62 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args,
     } else if (stack_adjust != 0) {
         tcg_out_addi(s, TCG_REG_CALL_STACK, stack_adjust);
     }
+}
+#endif /* CONFIG_SOFTMMU */
+
+static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args,
+                            int opc)
+{
+    int data_reg, data_reg2 = 0;
+    int addrlo_idx;
+#if defined(CONFIG_SOFTMMU)
+    int mem_index, s_bits;
+    uint8_t *label_ptr[3];
+#endif
+
+    data_reg = args[0];
+    addrlo_idx = 1;
+    if (TCG_TARGET_REG_BITS == 32 && opc == 3) {
+        data_reg2 = args[1];
+        addrlo_idx = 2;
+    }
+
+#if defined(CONFIG_SOFTMMU)
+    mem_index = args[addrlo_idx + 1 + (TARGET_LONG_BITS > TCG_TARGET_REG_BITS)];
+    s_bits = opc;
+
+    tcg_out_tlb_load(s, addrlo_idx, mem_index, s_bits, args,
+                     label_ptr, offsetof(CPUTLBEntry, addr_write));
+
+    /* TLB Hit.  */
+    tcg_out_qemu_st_direct(s, data_reg, data_reg2,
+                           tcg_target_call_iarg_regs[0], 0, opc);
+
+#if defined(CONFIG_QEMU_LDST_OPTIMIZATION)
+    /* TLB Miss, after the code of the TB.  */
+    add_qemu_ldst_label(s, 0, opc, data_reg, data_reg2, args[addrlo_idx],
+                        args[addrlo_idx + 1], mem_index, s->code_ptr,
+                        label_ptr);
+#else
+    /* jmp label2 */
+    tcg_out8(s, OPC_JMP_short);
+    label_ptr[2] = s->code_ptr;
+    s->code_ptr++;
+
+    /* TLB Miss.  */
+
+    /* label1: */
+    *label_ptr[0] = s->code_ptr - label_ptr[0] - 1;
+    if (TARGET_LONG_BITS > TCG_TARGET_REG_BITS) {
+        *label_ptr[1] = s->code_ptr - label_ptr[1] - 1;
+    }
+
+    tcg_out_qemu_st_helper(s, opc, data_reg, data_reg2, args[addrlo_idx],
+                           args[addrlo_idx + 1], mem_index, NULL);
 
     /* label2: */
     *label_ptr[2] = s->code_ptr - label_ptr[2] - 1;
+#endif
 #else
     {
         int32_t offset = GUEST_BASE;
@@ -1496,6 +1632,55 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args,
 #endif
 }
 
+#if defined(CONFIG_SOFTMMU) && defined(CONFIG_QEMU_LDST_OPTIMIZATION)
+/* Generate the TLB miss cases of the qemu_ld/st of the TB, each of which
+   goes back to the fast path when done.  */
+static void tcg_out_tb_finalize(TCGContext *s)
+{
+    TCGLabelQemuLdst *l;
+    int i;
+
+    for (i = 0; i < s->nb_qemu_ldst_labels; i++) {
+        l = &s->qemu_ldst_labels[i];
+
+        /* label1: */
+        *(uint32_t *)l->label_ptr[0] = s->code_ptr - l->label_ptr[0] - 4;
+        if (TARGET_LONG_BITS > TCG_TARGET_REG_BITS) {
+            *(uint32_t *)l->label_ptr[1] = s->code_ptr - l->label_ptr[1] - 4;
+        }
+
+        if (l->is_ld) {
+            tcg_out_qemu_ld_helper(s, l->opc, l->datalo_reg, l->datahi_reg,
+                                   l->addrlo_reg, l->addrhi_reg,
+                                   l->mem_index, l->raddr);
+        } else {
+            tcg_out_qemu_st_helper(s, l->opc, l->datalo_reg, l->datahi_reg,
+                                   l->addrlo_reg, l->addrhi_reg,
+                                   l->mem_index, l->raddr);
+        }
+        tcg_out_jmp(s, (tcg_target_long)l->raddr);
+    }
+}
+#endif
+
+#if TCG_TARGET_REG_BITS == 64
+/* The vector ops go through xmm0 and xmm1, which TCG does not otherwise
+   use and which are call clobbered.  ARGS are the base register, the
+   size and the destination and source offsets; pandn complements its
+   first operand, so the sources are swapped for andc.  */
+static void tcg_out_vec_op(TCGContext *s, int opc, const TCGArg *args)
+{
+    int ld = args[1] == 16 ? OPC_MOVUPS_VxWx : OPC_MOVLPS_VqMq;
+    int st = args[1] == 16 ? OPC_MOVUPS_WxVx : OPC_MOVLPS_MqVq;
+    int swap = opc == OPC_PANDN;
+
+    tcg_out_modrm_offset(s, ld, swap, args[0], args[3]);
+    tcg_out_modrm_offset(s, ld, !swap, args[0], args[4]);
+    tcg_out_modrm(s, opc, 0, 1);
+    tcg_out_modrm_offset(s, st, 0, args[0], args[2]);
+}
+#endif
+
 static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
                               const TCGArg *args, const int *const_args)
 {
@@ -1513,7 +1698,20 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
 
     switch(opc) {
     case INDEX_op_exit_tb:
-        tcg_out_movi(s, TCG_TYPE_PTR, TCG_REG_EAX, args[0]);
+        if (s->code_relocs && args[0]) {
+            /* TB pointer: always use the full width immediate so that
+               it can be patched in place */
+            tcg_out_opc(s, OPC_MOVL_Iv + P_REXW + LOWREGMASK(TCG_REG_EAX),
+                        0, TCG_REG_EAX, 0);
+            tcg_out_code_reloc(s, s->code_ptr, TCG_CODE_RELOC_TB_PTR,
+                               args[0]);
+            tcg_out32(s, args[0]);
+            if (TCG_TARGET_REG_BITS == 64) {
+                tcg_out32(s, args[0] >> 31 >> 1);
+            }
+        } else {
+            tcg_out_movi(s, TCG_TYPE_PTR, TCG_REG_EAX, args[0]);
+        }
         tcg_out_jmp(s, (tcg_target_long) tb_ret_addr);
         break;
     case INDEX_op_goto_tb:
@@ -1529,6 +1727,10 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
         }
         s->tb_next_offset[args[0]] = s->code_ptr - s->code_buf;
         break;
+    case INDEX_op_goto_ptr:
+        /* jmp *reg */
+        tcg_out_modrm(s, OPC_GRP5, EXT5_JMPN_Ev, args[0]);
+        break;
     case INDEX_op_call:
         if (const_args[0]) {
             tcg_out_calli(s, args[0]);
@@ -1812,6 +2014,43 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
     case INDEX_op_ext32s_i64:
         tcg_out_ext32s(s, args[0], args[1]);
         break;
+
+    case INDEX_op_add8_vec:
+        tcg_out_vec_op(s, OPC_PADDB, args);
+        break;
+    case INDEX_op_add16_vec:
+        tcg_out_vec_op(s, OPC_PADDW, args);
+        break;
+    case INDEX_op_add32_vec:
+        tcg_out_vec_op(s, OPC_PADDD, args);
+        break;
+    case INDEX_op_add64_vec:
+        tcg_out_vec_op(s, OPC_PADDQ, args);
+        break;
+    case INDEX_op_sub8_vec:
+        tcg_out_vec_op(s, OPC_PSUBB, args);
+        break;
+    case INDEX_op_sub16_vec:
+        tcg_out_vec_op(s, OPC_PSUBW, args);
+        break;
+    case INDEX_op_sub32_vec:
+        tcg_out_vec_op(s, OPC_PSUBD, args);
+        break;
+    case INDEX_op_sub64_vec:
+        tcg_out_vec_op(s, OPC_PSUBQ, args);
+        break;
+    case INDEX_op_and_vec:
+        tcg_out_vec_op(s, OPC_PAND, args);
+        break;
+    case INDEX_op_or_vec:
+        tcg_out_vec_op(s, OPC_POR, args);
+        break;
+    case INDEX_op_xor_vec:
+        tcg_out_vec_op(s, OPC_PXOR, args);
+        break;
+    case INDEX_op_andc_vec:
+        tcg_out_vec_op(s, OPC_PANDN, args);
+        break;
 #endif
 
     OP_32_64(deposit):
@@ -1840,6 +2079,7 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
 static const TCGTargetOpDef x86_op_defs[] = {
     { INDEX_op_exit_tb, { } },
     { INDEX_op_goto_tb, { } },
+    { INDEX_op_goto_ptr, { "r" } },
     { INDEX_op_call, { "ri" } },
     { INDEX_op_jmp, { "ri" } },
     { INDEX_op_br, { } },
@@ -1940,6 +2180,19 @@ static const TCGTargetOpDef x86_op_defs[] = {
     { INDEX_op_ext32u_i64, { "r", "r" } },
 
     { INDEX_op_deposit_i64, { "Q", "0", "Q" } },
+
+    { INDEX_op_add8_vec, { "r" } },
+    { INDEX_op_add16_vec, { "r" } },
+    { INDEX_op_add32_vec, { "r" } },
+    { INDEX_op_add64_vec, { "r" } },
+    { INDEX_op_sub8_vec, { "r" } },
+    { INDEX_op_sub16_vec, { "r" } },
+    { INDEX_op_sub32_vec, { "r" } },
+    { INDEX_op_sub64_vec, { "r" } },
+    { INDEX_op_and_vec, { "r" } },
+    { INDEX_op_or_vec, { "r" } },
+    { INDEX_op_xor_vec, { "r" } },
+    { INDEX_op_andc_vec, { "r" } },
 #endif
 
 #if TCG_TARGET_REG_BITS == 64
@@ -2048,6 +2301,10 @@ static void tcg_target_qemu_prologue(TCGContext *s)
     /* jmp *tb.  */
     tcg_out_modrm(s, OPC_GRP5, EXT5_JMPN_Ev, tcg_target_call_iarg_regs[1]);
 
+    /* Return path for goto_ptr: exit_tb(0), with nothing to chain.  */
+    s->code_gen_epilogue = s->code_ptr;
+    tcg_out_movi(s, TCG_TYPE_PTR, TCG_REG_EAX, 0);
+
     /* TB epilogue */
     tb_ret_addr = s->code_ptr;
 
@@ -86,6 +86,9 @@ typedef enum {
 #define TCG_TARGET_HAS_nand_i32         0
 #define TCG_TARGET_HAS_nor_i32          0
 #define TCG_TARGET_HAS_deposit_i32      1
+#define TCG_TARGET_HAS_goto_ptr         1
+/* SSE2 is part of x86-64 */
+#define TCG_TARGET_HAS_vec              (TCG_TARGET_REG_BITS == 64)
 
 #if TCG_TARGET_REG_BITS == 64
 #define TCG_TARGET_HAS_div2_i64         1
@@ -115,6 +118,7 @@ typedef enum {
 #define TCG_TARGET_deposit_i64_valid    TCG_TARGET_deposit_i32_valid
 
 #define TCG_TARGET_HAS_GUEST_BASE
+#define TCG_TARGET_HAS_CODE_RELOCS
 
 /* Note: must be synced with dyngen-exec.h */
 #if TCG_TARGET_REG_BITS == 64
@@ -48,6 +48,8 @@ struct tcg_temp_info {
     uint16_t prev_copy;
     uint16_t next_copy;
     tcg_target_ulong val;
+    tcg_target_ulong mask;      /* bits that may be set in the value */
+    tcg_target_ulong ones;      /* bits known to be set in the value */
 };
 
 static struct tcg_temp_info temps[TCG_MAX_TEMPS];
@@ -82,11 +84,25 @@ static void reset_temp(TCGArg temp, int nb_temps, int nb_globals)
         new_base = temps[temp].val;
     }
     temps[temp].state = TCG_TEMP_ANY;
+    temps[temp].mask = -1;
+    temps[temp].ones = 0;
     if (new_base != (TCGArg)-1 && temps[new_base].next_copy == new_base) {
         temps[new_base].state = TCG_TEMP_ANY;
     }
 }
 
+/* Forget everything about all the temps, e.g. at the start of a basic
+   block. */
+static void reset_all_temps(int nb_temps)
+{
+    int i;
+
+    memset(temps, 0, nb_temps * sizeof(struct tcg_temp_info));
+    for (i = 0; i < nb_temps; i++) {
+        temps[i].mask = -1;
+    }
+}
+
 static int op_bits(TCGOpcode op)
 {
     const TCGOpDef *def = &tcg_op_defs[op];
@@ -111,6 +127,8 @@ static void tcg_opt_gen_mov(TCGContext *s, TCGArg *gen_args, TCGArg dst,
                             TCGArg src, int nb_temps, int nb_globals)
 {
         reset_temp(dst, nb_temps, nb_globals);
+        temps[dst].mask = temps[src].mask;
+        temps[dst].ones = temps[src].ones;
         assert(temps[src].state != TCG_TEMP_COPY);
         /* Don't try to copy if one of temps is a global or either one
            is local and another is register */
@@ -139,6 +157,8 @@ static void tcg_opt_gen_movi(TCGArg *gen_args, TCGArg dst, TCGArg val,
         reset_temp(dst, nb_temps, nb_globals);
         temps[dst].state = TCG_TEMP_CONST;
         temps[dst].val = val;
+        temps[dst].mask = val;
+        temps[dst].ones = val;
         gen_args[0] = dst;
         gen_args[1] = val;
 }
@@ -267,6 +287,230 @@ static TCGArg do_constant_folding(TCGOpcode op, TCGArg x, TCGArg y)
     return res;
 }
 
+static tcg_target_ulong deposit_mask(int pos, int len)
+{
+    if (len >= sizeof(tcg_target_ulong) * 8) {
+        return -1;
+    }
+    return (((tcg_target_ulong)1 << len) - 1) << pos;
+}
+
+static TCGArg do_constant_folding_deposit(TCGOpcode op, TCGArg x, TCGArg y,
+                                          int pos, int len)
+{
+    tcg_target_ulong mask = deposit_mask(pos, len);
+    TCGArg res = (x & ~mask) | ((y << pos) & mask);
+
+    if (op_bits(op) == 32) {
+        res &= 0xffffffff;
+    }
+    return res;
+}
+
+static bool do_constant_folding_cond_32(uint32_t x, uint32_t y, TCGCond c)
+{
+    switch (c) {
+    case TCG_COND_EQ:
+        return x == y;
+    case TCG_COND_NE:
+        return x != y;
+    case TCG_COND_LT:
+        return (int32_t)x < (int32_t)y;
+    case TCG_COND_GE:
+        return (int32_t)x >= (int32_t)y;
+    case TCG_COND_LE:
+        return (int32_t)x <= (int32_t)y;
+    case TCG_COND_GT:
+        return (int32_t)x > (int32_t)y;
+    case TCG_COND_LTU:
+        return x < y;
+    case TCG_COND_GEU:
+        return x >= y;
+    case TCG_COND_LEU:
+        return x <= y;
+    case TCG_COND_GTU:
+        return x > y;
+    default:
+        tcg_abort();
+    }
+}
+
+static bool do_constant_folding_cond_64(uint64_t x, uint64_t y, TCGCond c)
+{
+    switch (c) {
+    case TCG_COND_EQ:
+        return x == y;
+    case TCG_COND_NE:
+        return x != y;
+    case TCG_COND_LT:
+        return (int64_t)x < (int64_t)y;
+    case TCG_COND_GE:
+        return (int64_t)x >= (int64_t)y;
+    case TCG_COND_LE:
+        return (int64_t)x <= (int64_t)y;
+    case TCG_COND_GT:
+        return (int64_t)x > (int64_t)y;
+    case TCG_COND_LTU:
+        return x < y;
+    case TCG_COND_GEU:
+        return x >= y;
+    case TCG_COND_LEU:
+        return x <= y;
+    case TCG_COND_GTU:
+        return x > y;
+    default:
+        tcg_abort();
+    }
+}
+
+/* Return 1 if the condition c on temps x and y is known to be true, 0 if
+   it is known to be false, and 2 if it is not known.  */
+static TCGArg do_constant_folding_cond(TCGOpcode op, TCGArg x, TCGArg y,
+                                       TCGCond c)
+{
+    if (temps[x].state == TCG_TEMP_CONST && temps[y].state == TCG_TEMP_CONST) {
+        if (op_bits(op) == 32) {
+            return do_constant_folding_cond_32(temps[x].val, temps[y].val, c);
+        } else {
+            return do_constant_folding_cond_64(temps[x].val, temps[y].val, c);
+        }
+    }
+    if (x == y) {
+        switch (c) {
+        case TCG_COND_EQ:
+        case TCG_COND_GE:
+        case TCG_COND_LE:
+        case TCG_COND_GEU:
+        case TCG_COND_LEU:
+            return 1;
+        default:
+            return 0;
+        }
+    }
+    if (temps[y].state == TCG_TEMP_CONST && temps[y].val == 0) {
+        switch (c) {
+        case TCG_COND_LTU:
+            return 0;
+        case TCG_COND_GEU:
+            return 1;
+        default:
+            break;
+        }
+    }
+    return 2;
+}
+
+/* The bits that may be set and that are known to be set in temp.  Only
+   the low 32 bits of an I32 temp are known, the others are whatever the
+   host left in the register.  */
+static tcg_target_ulong temp_mask(TCGContext *s, TCGArg temp)
+{
+    tcg_target_ulong mask = temps[temp].mask;
+
+    if (s->temps[temp].type == TCG_TYPE_I32) {
+        mask |= ~(tcg_target_ulong)0xffffffffu;
+    }
+    return mask;
+}
+
+static tcg_target_ulong temp_ones(TCGContext *s, TCGArg temp)
+{
+    tcg_target_ulong ones = temps[temp].ones;
+
+    if (s->temps[temp].type == TCG_TYPE_I32) {
+        ones &= 0xffffffffu;
+    }
+    return ones;
+}
+
+/* Compute which bits may be set (*pmask) and which are known to be set
+   (*pones) in the output of op.  Return false if nothing is known.  */
+static bool known_bits(TCGContext *s, TCGOpcode op, const TCGArg *args,
+                       tcg_target_ulong *pmask, tcg_target_ulong *pones)
+{
+    tcg_target_ulong mask = -1, ones = 0, m;
+    int sh, bits = op_bits(op);
+
+    switch (op) {
+    CASE_OP_32_64(and):
+        mask = temp_mask(s, args[1]) & temp_mask(s, args[2]);
+        ones = temp_ones(s, args[1]) & temp_ones(s, args[2]);
+        break;
+    CASE_OP_32_64(or):
+        mask = temp_mask(s, args[1]) | temp_mask(s, args[2]);
+        ones = temp_ones(s, args[1]) | temp_ones(s, args[2]);
+        break;
+    CASE_OP_32_64(xor):
+        mask = temp_mask(s, args[1]) | temp_mask(s, args[2]);
+        ones = (temp_ones(s, args[1]) & ~temp_mask(s, args[2])) |
+               (temp_ones(s, args[2]) & ~temp_mask(s, args[1]));
+        break;
+    CASE_OP_32_64(andc):
+        mask = temp_mask(s, args[1]) & ~temp_ones(s, args[2]);
+        ones = temp_ones(s, args[1]) & ~temp_mask(s, args[2]);
+        break;
+    CASE_OP_32_64(not):
+        mask = ~temp_ones(s, args[1]);
+        ones = ~temp_mask(s, args[1]);
+        break;
+    CASE_OP_32_64(ext8u):
+        mask = temp_mask(s, args[1]) & 0xff;
+        ones = temp_ones(s, args[1]) & 0xff;
+        break;
+    CASE_OP_32_64(ext16u):
+        mask = temp_mask(s, args[1]) & 0xffff;
+        ones = temp_ones(s, args[1]) & 0xffff;
+        break;
+    case INDEX_op_ext32u_i64:
+        mask = temp_mask(s, args[1]) & 0xffffffffu;
+        ones = temp_ones(s, args[1]) & 0xffffffffu;
+        break;
+    CASE_OP_32_64(shl):
+    CASE_OP_32_64(shr):
+        if (temps[args[2]].state != TCG_TEMP_CONST ||
+            temps[args[2]].val >= bits) {
+            return false;
+        }
+        sh = temps[args[2]].val;
+        m = bits == 32 ? 0xffffffffu : -1;
+        if (op == INDEX_op_shl_i32 || op == INDEX_op_shl_i64) {
+            mask = temp_mask(s, args[1]) << sh;
+            ones = temp_ones(s, args[1]) << sh;
+        } else {
+            mask = (temp_mask(s, args[1]) & m) >> sh;
+            ones = (temp_ones(s, args[1]) & m) >> sh;
+        }
+        break;
+    CASE_OP_32_64(deposit):
+        sh = args[3];
+        m = deposit_mask(sh, args[4]);
+        mask = (temp_mask(s, args[1]) & ~m) |
+               ((temp_mask(s, args[2]) << sh) & m);
+        ones = (temp_ones(s, args[1]) & ~m) |
+               ((temp_ones(s, args[2]) << sh) & m);
+        break;
+    CASE_OP_32_64(setcond):
+        mask = 1;
+        break;
+    CASE_OP_32_64(ld8u):
+    case INDEX_op_qemu_ld8u:
+        mask = 0xff;
+        break;
+    CASE_OP_32_64(ld16u):
+    case INDEX_op_qemu_ld16u:
+        mask = 0xffff;
+        break;
+    case INDEX_op_ld32u_i64:
+        mask = 0xffffffffu;
+        break;
+    default:
+        return false;
+    }
+    *pmask = mask;
+    *pones = ones;
+    return true;
+}
+
 /* Propagate constants and copies, fold constant expressions. */
 static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
                                     TCGArg *args, TCGOpDef *tcg_op_defs)
@@ -276,6 +520,8 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
     const TCGOpDef *def;
     TCGArg *gen_args;
     TCGArg tmp;
+    tcg_target_ulong mask, ones, width;
+    bool have_bits, dead_code;
     /* Array VALS has an element for each temp.
        If this temp holds a constant then its value is kept in VALS' element.
        If this temp is a copy of other ones then this equivalence class'
@@ -285,15 +531,35 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
 
     nb_temps = s->nb_temps;
     nb_globals = s->nb_globals;
-    memset(temps, 0, nb_temps * sizeof(struct tcg_temp_info));
+    reset_all_temps(nb_temps);
+    dead_code = false;
 
     nb_ops = tcg_opc_ptr - gen_opc_buf;
     gen_args = args;
     for (op_index = 0; op_index < nb_ops; op_index++) {
         op = gen_opc_buf[op_index];
         def = &tcg_op_defs[op];
+
+        /* Remove the unreachable ops between an unconditional jump and the
+           next label.  The instruction boundaries are kept for
+           tcg_gen_code_search_pc.  */
+        if (dead_code) {
+            if (op == INDEX_op_set_label) {
+                dead_code = false;
+            } else if (op != INDEX_op_debug_insn_start) {
+                if (op == INDEX_op_call) {
+                    args += (args[0] >> 16) + (args[0] & 0xffff) + 3;
+                } else {
+                    args += def->nb_args;
+                }
+                gen_opc_buf[op_index] = INDEX_op_nop;
+                continue;
+            }
+        }
+
         /* Do copy propagation */
-        if (!(def->flags & (TCG_OPF_CALL_CLOBBER | TCG_OPF_SIDE_EFFECTS))) {
+        if (!(def->flags & (TCG_OPF_CALL_CLOBBER | TCG_OPF_SIDE_EFFECTS)) ||
+            op == INDEX_op_brcond_i32 || op == INDEX_op_brcond_i64) {
             assert(op != INDEX_op_call);
             for (i = def->nb_oargs; i < def->nb_oargs + def->nb_iargs; i++) {
                 if (temps[args[i]].state == TCG_TEMP_COPY) {
@@ -318,6 +584,24 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
                 args[2] = tmp;
             }
             break;
+        CASE_OP_32_64(brcond):
+            if (temps[args[0]].state == TCG_TEMP_CONST
+                && temps[args[1]].state != TCG_TEMP_CONST) {
+                tmp = args[0];
+                args[0] = args[1];
+                args[1] = tmp;
+                args[2] = tcg_swap_cond(args[2]);
+            }
+            break;
+        CASE_OP_32_64(setcond):
+            if (temps[args[1]].state == TCG_TEMP_CONST
+                && temps[args[2]].state != TCG_TEMP_CONST) {
+                tmp = args[1];
+                args[1] = args[2];
+                args[2] = tmp;
+                args[3] = tcg_swap_cond(args[3]);
+            }
+            break;
         default:
             break;
         }
@@ -331,6 +615,9 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
         CASE_OP_32_64(sar):
         CASE_OP_32_64(rotl):
         CASE_OP_32_64(rotr):
+        CASE_OP_32_64(or):
+        CASE_OP_32_64(xor):
+        CASE_OP_32_64(andc):
             if (temps[args[1]].state == TCG_TEMP_CONST) {
                 /* Proceed with possible constant folding. */
                 break;
@@ -352,6 +639,13 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
                 continue;
             }
             break;
+        default:
+            break;
+        }
+
+        /* Simplify using 0 or 1 as the second argument, or operations
+           whose two arguments are the same temp. */
+        switch (op) {
         CASE_OP_32_64(mul):
             if ((temps[args[2]].state == TCG_TEMP_CONST
                 && temps[args[2]].val == 0)) {
@@ -378,6 +672,67 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
                 continue;
             }
             break;
+        CASE_OP_32_64(sub):
+        CASE_OP_32_64(xor):
+        CASE_OP_32_64(andc):
+            if (args[1] == args[2]) {
+                gen_opc_buf[op_index] = op_to_movi(op);
+                tcg_opt_gen_movi(gen_args, args[0], 0, nb_temps, nb_globals);
+                args += 3;
+                gen_args += 2;
+                continue;
+            }
+            break;
+        default:
+            break;
+        }
+
+        /* Use the known bits of the arguments: the result may be fully
+           known, or an and or zero extension may leave its argument
+           unchanged.  */
+        mask = -1;
+        ones = 0;
+        width = op_bits(op) == 32 ? 0xffffffffu : -1;
+        have_bits = known_bits(s, op, args, &mask, &ones);
+        if (have_bits && ((mask ^ ones) & width) == 0
+            && !(def->flags & TCG_OPF_SIDE_EFFECTS)) {
+            gen_opc_buf[op_index] = op_to_movi(op);
+            tcg_opt_gen_movi(gen_args, args[0], ones & width,
+                             nb_temps, nb_globals);
+            args += def->nb_args;
+            gen_args += 2;
+            continue;
+        }
+        switch (op) {
+        CASE_OP_32_64(and):
+            if (temps[args[2]].state != TCG_TEMP_CONST) {
+                break;
+            }
+            tmp = temps[args[2]].val;
+            goto do_redundant;
+        CASE_OP_32_64(ext8u):
+            tmp = 0xff;
+            goto do_redundant;
+        CASE_OP_32_64(ext16u):
+            tmp = 0xffff;
+            goto do_redundant;
+        case INDEX_op_ext32u_i64:
+            tmp = 0xffffffffu;
+        do_redundant:
+            if ((temp_mask(s, args[1]) & ~tmp & width) != 0) {
+                break;
+            }
+            if (args[0] == args[1]) {
+                args += def->nb_args;
+                gen_opc_buf[op_index] = INDEX_op_nop;
+            } else {
+                gen_opc_buf[op_index] = op_to_mov(op);
+                tcg_opt_gen_mov(s, gen_args, args[0], args[1],
+                                nb_temps, nb_globals);
+                gen_args += 2;
+                args += def->nb_args;
+            }
+            continue;
         default:
             break;
         }
@@ -429,6 +784,8 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
                 break;
             } else {
                 reset_temp(args[0], nb_temps, nb_globals);
+                temps[args[0]].mask = mask;
+                temps[args[0]].ones = ones;
                 gen_args[0] = args[0];
                 gen_args[1] = args[1];
                 gen_args += 2;
@@ -462,6 +819,8 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
                 break;
             } else {
                 reset_temp(args[0], nb_temps, nb_globals);
+                temps[args[0]].mask = mask;
+                temps[args[0]].ones = ones;
                 gen_args[0] = args[0];
                 gen_args[1] = args[1];
                 gen_args[2] = args[2];
@@ -469,6 +828,71 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
                 args += 3;
                 break;
             }
+        CASE_OP_32_64(deposit):
+            if (temps[args[1]].state == TCG_TEMP_CONST
+                && temps[args[2]].state == TCG_TEMP_CONST) {
+                gen_opc_buf[op_index] = op_to_movi(op);
+                tmp = do_constant_folding_deposit(op, temps[args[1]].val,
+                                                  temps[args[2]].val,
+                                                  args[3], args[4]);
+                tcg_opt_gen_movi(gen_args, args[0], tmp, nb_temps, nb_globals);
+                gen_args += 2;
+                args += 5;
+                break;
+            } else {
+                reset_temp(args[0], nb_temps, nb_globals);
+                temps[args[0]].mask = mask;
+                temps[args[0]].ones = ones;
+                for (i = 0; i < 5; i++) {
+                    gen_args[i] = args[i];
+                }
+                gen_args += 5;
+                args += 5;
+                break;
+            }
+        CASE_OP_32_64(setcond):
+            tmp = do_constant_folding_cond(op, args[1], args[2], args[3]);
+            if (tmp != 2) {
+                gen_opc_buf[op_index] = op_to_movi(op);
+                tcg_opt_gen_movi(gen_args, args[0], tmp, nb_temps, nb_globals);
+                gen_args += 2;
+                args += 4;
+                break;
+            } else {
+                reset_temp(args[0], nb_temps, nb_globals);
+                temps[args[0]].mask = mask;
+                temps[args[0]].ones = ones;
+                for (i = 0; i < 4; i++) {
+                    gen_args[i] = args[i];
+                }
+                gen_args += 4;
+                args += 4;
+                break;
+            }
+        CASE_OP_32_64(brcond):
+            tmp = do_constant_folding_cond(op, args[0], args[1], args[2]);
+            if (tmp == 0) {
+                /* never taken: the code that follows is not a new basic
+                   block, so what is known about the temps still holds */
+                gen_opc_buf[op_index] = INDEX_op_nop;
+                args += 4;
+                break;
+            }
+            if (tmp == 1) {
+                gen_opc_buf[op_index] = INDEX_op_br;
+                gen_args[0] = args[3];
+                gen_args += 1;
+                args += 4;
+                dead_code = true;
+            } else {
+                for (i = 0; i < 4; i++) {
+                    gen_args[i] = args[i];
+                }
+                gen_args += 4;
+                args += 4;
+            }
+            reset_all_temps(nb_temps);
+            break;
         case INDEX_op_call:
             nb_call_args = (args[0] >> 16) + (args[0] & 0xffff);
             if (!(args[nb_call_args + 1] & (TCG_CALL_CONST | TCG_CALL_PURE))) {
@@ -487,11 +911,12 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
                 i--;
             }
             break;
-        case INDEX_op_set_label:
         case INDEX_op_jmp:
         case INDEX_op_br:
-        CASE_OP_32_64(brcond):
-            memset(temps, 0, nb_temps * sizeof(struct tcg_temp_info));
+            dead_code = true;
+            /* fallthrough */
+        case INDEX_op_set_label:
+            reset_all_temps(nb_temps);
             for (i = 0; i < def->nb_args; i++) {
                 *gen_args = *args;
                 args++;
@@ -500,13 +925,21 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
             break;
         default:
             /* Default case: we do know nothing about operation so no
-               propagation is done.  We only trash output args.  */
+               propagation is done.  We only trash output args, and keep
+               the known bits of loads.  */
             for (i = 0; i < def->nb_oargs; i++) {
                 reset_temp(args[i], nb_temps, nb_globals);
             }
+            if (have_bits) {
+                temps[args[0]].mask = mask;
+                temps[args[0]].ones = ones;
+            }
             for (i = 0; i < def->nb_args; i++) {
                 gen_args[i] = args[i];
             }
+            if (op == INDEX_op_exit_tb || op == INDEX_op_goto_ptr) {
+                dead_code = true;
+            }
             args += def->nb_args;
             gen_args += def->nb_args;
             break;
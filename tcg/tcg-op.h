@@ -389,6 +389,7 @@ static inline void tcg_gen_helperN(void *func, int flags, int sizemask,
                                    TCGArg ret, int nargs, TCGArg *args)
 {
     TCGv_ptr fn;
+    tcg_gen_helper_count(func);
     fn = tcg_const_ptr(func);
     tcg_gen_callN(&tcg_ctx, fn, flags, sizemask, ret,
                   nargs, args);
@@ -2171,6 +2172,153 @@ static inline void tcg_gen_goto_tb(int idx)
     tcg_gen_op1i(INDEX_op_goto_tb, idx);
 }
 
+/* Jump to host code at ADDR, normally the result of
+   helper_lookup_tb_ptr().  Backends without goto_ptr return to the main
+   loop instead.  */
+static inline void tcg_gen_goto_ptr(TCGv_ptr addr)
+{
+    if (TCG_TARGET_HAS_goto_ptr) {
+        *gen_opc_ptr++ = INDEX_op_goto_ptr;
+        *gen_opparam_ptr++ = GET_TCGV_PTR(addr);
+    } else {
+        tcg_gen_exit_tb(0);
+    }
+}
+
+/* Vector operations on OPRSZ (8 or 16) bytes of memory at constant
+   offsets from BASE, normally registers in the CPU state.  Each lane of
+   the destination at DOFS is computed from the same lane at AOFS and
+   BOFS; the operands are either identical or disjoint.  Without host
+   support they are done 64 bits at a time.  */
+
+static inline void tcg_gen_vec_op(TCGOpcode opc, TCGv_ptr base, int oprsz,
+                                  tcg_target_long dofs, tcg_target_long aofs,
+                                  tcg_target_long bofs)
+{
+    *gen_opc_ptr++ = opc;
+    *gen_opparam_ptr++ = GET_TCGV_PTR(base);
+    *gen_opparam_ptr++ = oprsz;
+    *gen_opparam_ptr++ = dofs;
+    *gen_opparam_ptr++ = aofs;
+    *gen_opparam_ptr++ = bofs;
+}
+
+static inline void tcg_gen_vec_i64(void (*fn)(TCGv_i64, TCGv_i64, TCGv_i64),
+                                   TCGv_ptr base, int oprsz,
+                                   tcg_target_long dofs, tcg_target_long aofs,
+                                   tcg_target_long bofs)
+{
+    TCGv_i64 a = tcg_temp_new_i64();
+    TCGv_i64 b = tcg_temp_new_i64();
+    int i;
+
+    for (i = 0; i < oprsz; i += 8) {
+        tcg_gen_ld_i64(a, base, aofs + i);
+        tcg_gen_ld_i64(b, base, bofs + i);
+        fn(a, a, b);
+        tcg_gen_st_i64(a, base, dofs + i);
+    }
+    tcg_temp_free_i64(a);
+    tcg_temp_free_i64(b);
+}
+
+/* Add or subtract the lanes of a 64 bit value whose most significant
+   bits are set in M, keeping the carries from crossing lanes.  */
+static inline void tcg_gen_vec_add_mask_i64(TCGv_i64 d, TCGv_i64 a,
+                                            TCGv_i64 b, uint64_t m)
+{
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    TCGv_i64 t2 = tcg_temp_new_i64();
+    TCGv_i64 t3 = tcg_temp_new_i64();
+
+    tcg_gen_andi_i64(t1, a, ~m);
+    tcg_gen_andi_i64(t2, b, ~m);
+    tcg_gen_xor_i64(t3, a, b);
+    tcg_gen_add_i64(d, t1, t2);
+    tcg_gen_andi_i64(t3, t3, m);
+    tcg_gen_xor_i64(d, d, t3);
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t2);
+    tcg_temp_free_i64(t3);
+}
+
+static inline void tcg_gen_vec_sub_mask_i64(TCGv_i64 d, TCGv_i64 a,
+                                            TCGv_i64 b, uint64_t m)
+{
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    TCGv_i64 t2 = tcg_temp_new_i64();
+    TCGv_i64 t3 = tcg_temp_new_i64();
+
+    tcg_gen_ori_i64(t1, a, m);
+    tcg_gen_andi_i64(t2, b, ~m);
+    tcg_gen_eqv_i64(t3, a, b);
+    tcg_gen_sub_i64(d, t1, t2);
+    tcg_gen_andi_i64(t3, t3, m);
+    tcg_gen_xor_i64(d, d, t3);
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t2);
+    tcg_temp_free_i64(t3);
+}
+
+static inline void tcg_gen_vec_add8_i64(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_vec_add_mask_i64(d, a, b, 0x8080808080808080ull);
+}
+
+static inline void tcg_gen_vec_add16_i64(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_vec_add_mask_i64(d, a, b, 0x8000800080008000ull);
+}
+
+static inline void tcg_gen_vec_add32_i64(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_vec_add_mask_i64(d, a, b, 0x8000000080000000ull);
+}
+
+static inline void tcg_gen_vec_sub8_i64(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_vec_sub_mask_i64(d, a, b, 0x8080808080808080ull);
+}
+
+static inline void tcg_gen_vec_sub16_i64(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_vec_sub_mask_i64(d, a, b, 0x8000800080008000ull);
+}
+
+static inline void tcg_gen_vec_sub32_i64(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_vec_sub_mask_i64(d, a, b, 0x8000000080000000ull);
+}
+
+#define TCG_GEN_VEC(name, fallback)                                         \
+static inline void tcg_gen_ ## name ## _vec(TCGv_ptr base, int oprsz,       \
+                                            tcg_target_long dofs,           \
+                                            tcg_target_long aofs,           \
+                                            tcg_target_long bofs)           \
+{                                                                           \
+    if (TCG_TARGET_HAS_vec) {                                               \
+        tcg_gen_vec_op(INDEX_op_ ## name ## _vec, base, oprsz,              \
+                       dofs, aofs, bofs);                                   \
+    } else {                                                                \
+        tcg_gen_vec_i64(fallback, base, oprsz, dofs, aofs, bofs);           \
+    }                                                                       \
+}
+
+TCG_GEN_VEC(add8, tcg_gen_vec_add8_i64)
+TCG_GEN_VEC(add16, tcg_gen_vec_add16_i64)
+TCG_GEN_VEC(add32, tcg_gen_vec_add32_i64)
+TCG_GEN_VEC(add64, tcg_gen_add_i64)
+TCG_GEN_VEC(sub8, tcg_gen_vec_sub8_i64)
+TCG_GEN_VEC(sub16, tcg_gen_vec_sub16_i64)
+TCG_GEN_VEC(sub32, tcg_gen_vec_sub32_i64)
+TCG_GEN_VEC(sub64, tcg_gen_sub_i64)
+TCG_GEN_VEC(and, tcg_gen_and_i64)
+TCG_GEN_VEC(or, tcg_gen_or_i64)
+TCG_GEN_VEC(xor, tcg_gen_xor_i64)
+TCG_GEN_VEC(andc, tcg_gen_andc_i64)
+
+#undef TCG_GEN_VEC
+
 #if TCG_TARGET_REG_BITS == 32
 static inline void tcg_gen_qemu_ld8u(TCGv ret, TCGv addr, int mem_index)
 {
@@ -158,6 +158,22 @@ DEF(eqv_i64, 1, 2, 0, IMPL64 | IMPL(TCG_TARGET_HAS_eqv_i64))
 DEF(nand_i64, 1, 2, 0, IMPL64 | IMPL(TCG_TARGET_HAS_nand_i64))
 DEF(nor_i64, 1, 2, 0, IMPL64 | IMPL(TCG_TARGET_HAS_nor_i64))
 
+/* vector ops on memory: base, size, dest offset, source offsets */
+#define IMPLVEC TCG_OPF_SIDE_EFFECTS | IMPL(TCG_TARGET_HAS_vec)
+
+DEF(add8_vec, 0, 1, 4, IMPLVEC)
+DEF(add16_vec, 0, 1, 4, IMPLVEC)
+DEF(add32_vec, 0, 1, 4, IMPLVEC)
+DEF(add64_vec, 0, 1, 4, IMPLVEC)
+DEF(sub8_vec, 0, 1, 4, IMPLVEC)
+DEF(sub16_vec, 0, 1, 4, IMPLVEC)
+DEF(sub32_vec, 0, 1, 4, IMPLVEC)
+DEF(sub64_vec, 0, 1, 4, IMPLVEC)
+DEF(and_vec, 0, 1, 4, IMPLVEC)
+DEF(or_vec, 0, 1, 4, IMPLVEC)
+DEF(xor_vec, 0, 1, 4, IMPLVEC)
+DEF(andc_vec, 0, 1, 4, IMPLVEC)
+
 /* QEMU specific */
 #if TARGET_LONG_BITS > TCG_TARGET_REG_BITS
 DEF(debug_insn_start, 0, 0, 2, 0)
@@ -166,6 +182,8 @@ DEF(debug_insn_start, 0, 0, 1, 0)
 #endif
 DEF(exit_tb, 0, 0, 1, TCG_OPF_BB_END | TCG_OPF_SIDE_EFFECTS)
 DEF(goto_tb, 0, 0, 1, TCG_OPF_BB_END | TCG_OPF_SIDE_EFFECTS)
+DEF(goto_ptr, 0, 1, 0, TCG_OPF_BB_END | TCG_OPF_SIDE_EFFECTS
+    | IMPL(TCG_TARGET_HAS_goto_ptr))
 /* Note: even if TARGET_LONG_BITS is not defined, the INDEX_op
    constants must be defined */
 #if TCG_TARGET_REG_BITS == 32
@@ -241,4 +259,5 @@ DEF(qemu_st64, 0, 2, 1, TCG_OPF_CALL_CLOBBER | TCG_OPF_SIDE_EFFECTS)
 
 #undef IMPL
 #undef IMPL64
+#undef IMPLVEC
 #undef DEF
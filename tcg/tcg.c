@@ -90,6 +90,9 @@ static void tcg_out_st(TCGContext *s, TCGType type, TCGReg arg, TCGReg arg1,
 static int tcg_target_const_match(tcg_target_long val,
                                   const TCGArgConstraint *arg_ct);
 static int tcg_target_get_call_iarg_regs_count(int flags);
+#if defined(CONFIG_QEMU_LDST_OPTIMIZATION) && defined(CONFIG_SOFTMMU)
+static void tcg_out_tb_finalize(TCGContext *s);
+#endif
 
 TCGOpDef tcg_op_defs[] = {
 #define DEF(s, oargs, iargs, cargs, flags) { #s, oargs, iargs, cargs, iargs + oargs + cargs, flags },
@@ -147,6 +150,32 @@ static void tcg_out_reloc(TCGContext *s, uint8_t *code_ptr, int type,
     }
 }
 
+/* Record a position dependent value about to be emitted at CODE_PTR.  */
+static inline void tcg_out_code_reloc(TCGContext *s, uint8_t *code_ptr,
+                                      int type, tcg_target_long value)
+{
+    TCGCodeReloc *r;
+
+    if (!s->code_relocs || s->nb_code_relocs < 0) {
+        return;
+    }
+    if (s->nb_code_relocs == TCG_MAX_CODE_RELOCS) {
+        s->nb_code_relocs = -1;
+        return;
+    }
+    r = &s->code_relocs[s->nb_code_relocs++];
+    r->offset = code_ptr - s->code_buf;
+    r->type = type;
+    r->value = value;
+}
+
+/* The code being emitted depends on its own address in a way that
+   tcg_out_code_reloc cannot describe.  */
+static inline void tcg_out_code_fixed(TCGContext *s)
+{
+    s->nb_code_relocs = -1;
+}
+
 static void tcg_out_label(TCGContext *s, int label_index, void *ptr)
 {
     TCGLabel *l;
@@ -298,6 +327,10 @@ void tcg_func_start(TCGContext *s)
     s->labels = tcg_malloc(sizeof(TCGLabel) * TCG_MAX_LABELS);
     s->nb_labels = 0;
     s->current_frame_offset = s->frame_start;
+#if defined(CONFIG_QEMU_LDST_OPTIMIZATION) && defined(CONFIG_SOFTMMU)
+    s->qemu_ldst_labels = tcg_malloc(sizeof(TCGLabelQemuLdst) *
+                                     TCG_MAX_QEMU_LDST);
+#endif
 
     gen_opc_ptr = gen_opc_buf;
     gen_opparam_ptr = gen_opparam_buf;
@@ -604,6 +637,7 @@ void tcg_register_helper(void *func, const char *name)
     }
     s->helpers[s->nb_helpers].func = (tcg_target_ulong)func;
     s->helpers[s->nb_helpers].name = name;
+    s->helpers[s->nb_helpers].exec_count = NULL;
     s->nb_helpers++;
 }
 
@@ -859,6 +893,34 @@ static TCGHelperInfo *tcg_find_helper(TCGContext *s, tcg_target_ulong val)
     return NULL;
 }
 
+/* With -tcg-stats, emit an increment of the call counter of helper
+   @func.  The counter is allocated separately since sorting moves the
+   TCGHelperInfo.  */
+void tcg_gen_helper_count(void *func)
+{
+    TCGHelperInfo *th;
+    TCGv_ptr ptr;
+    TCGv_i64 n;
+
+    if (likely(!tcg_stats_enabled)) {
+        return;
+    }
+    th = tcg_find_helper(&tcg_ctx, (tcg_target_ulong)func);
+    if (!th) {
+        return;
+    }
+    if (!th->exec_count) {
+        th->exec_count = g_malloc0(sizeof(*th->exec_count));
+    }
+    ptr = tcg_const_ptr(th->exec_count);
+    n = tcg_temp_new_i64();
+    tcg_gen_ld_i64(n, ptr, 0);
+    tcg_gen_addi_i64(n, n, 1);
+    tcg_gen_st_i64(n, ptr, 0);
+    tcg_temp_free_i64(n);
+    tcg_temp_free_ptr(ptr);
+}
+
 static const char * const cond_name[] =
 {
     [TCG_COND_EQ] = "eq",
@@ -1513,7 +1575,17 @@ static int tcg_reg_alloc(TCGContext *s, TCGRegSet reg1, TCGRegSet reg2)
             return reg;
     }
 
-    /* XXX: do better spill choice */
+    /* then prefer a register whose temporary is unchanged since it was
+       loaded or synced: it can be reused without a store */
+    for(i = 0; i < ARRAY_SIZE(tcg_target_reg_alloc_order); i++) {
+        reg = tcg_target_reg_alloc_order[i];
+        if (tcg_regset_test_reg(reg_ct, reg) &&
+            s->temps[s->reg_to_temp[reg]].mem_coherent) {
+            tcg_reg_free(s, reg);
+            return reg;
+        }
+    }
+
     for(i = 0; i < ARRAY_SIZE(tcg_target_reg_alloc_order); i++) {
         reg = tcg_target_reg_alloc_order[i];
         if (tcg_regset_test_reg(reg_ct, reg)) {
@@ -1558,6 +1630,28 @@ static void temp_save(TCGContext *s, int temp, TCGRegSet allocated_regs)
     }
 }
 
+/* store a temporary to memory if needed, but keep it in its register
+   so that the following code can still use it there. */
+static void temp_sync(TCGContext *s, int temp, TCGRegSet allocated_regs)
+{
+    TCGTemp *ts;
+
+    ts = &s->temps[temp];
+    if (ts->fixed_reg) {
+        return;
+    }
+    if (ts->val_type == TEMP_VAL_REG) {
+        if (!ts->mem_coherent) {
+            if (!ts->mem_allocated)
+                temp_allocate_frame(s, temp);
+            tcg_out_st(s, ts->type, ts->reg, ts->mem_reg, ts->mem_offset);
+            ts->mem_coherent = 1;
+        }
+    } else {
+        temp_save(s, temp, allocated_regs);
+    }
+}
+
 /* save globals to their canonical location and assume they can be
    modified be the following code. 'allocated_regs' is used in case a
    temporary registers needs to be allocated to store a constant. */
@@ -1570,6 +1664,17 @@ static void save_globals(TCGContext *s, TCGRegSet allocated_regs)
     }
 }
 
+/* store globals to their canonical location for code that may read
+   but not modify them. */
+static void sync_globals(TCGContext *s, TCGRegSet allocated_regs)
+{
+    int i;
+
+    for(i = 0; i < s->nb_globals; i++) {
+        temp_sync(s, i, allocated_regs);
+    }
+}
+
 /* at the end of a basic block, we assume all temporaries are dead and
    all globals are stored at their canonical location. */
 static void tcg_reg_alloc_bb_end(TCGContext *s, TCGRegSet allocated_regs)
@@ -1592,6 +1697,30 @@ static void tcg_reg_alloc_bb_end(TCGContext *s, TCGRegSet allocated_regs)
     save_globals(s, allocated_regs);
 }
 
+/* at a branch, the temporaries are dead and the globals and local
+   temporaries must be at their canonical location for the branch
+   target.  The registers keep their values, so the code following a
+   conditional branch does not need to reload them. */
+static void tcg_reg_alloc_branch(TCGContext *s, TCGRegSet allocated_regs)
+{
+    TCGTemp *ts;
+    int i;
+
+    for(i = s->nb_globals; i < s->nb_temps; i++) {
+        ts = &s->temps[i];
+        if (ts->temp_local) {
+            temp_sync(s, i, allocated_regs);
+        } else {
+            if (ts->val_type == TEMP_VAL_REG) {
+                s->reg_to_temp[ts->reg] = -1;
+            }
+            ts->val_type = TEMP_VAL_DEAD;
+        }
+    }
+
+    sync_globals(s, allocated_regs);
+}
+
 #define IS_DEAD_ARG(n) ((dead_args >> (n)) & 1)
 
 static void tcg_reg_alloc_movi(TCGContext *s, const TCGArg *args)
@@ -1758,7 +1887,7 @@ static void tcg_reg_alloc_op(TCGContext *s,
     }
     
     if (def->flags & TCG_OPF_BB_END) {
-        tcg_reg_alloc_bb_end(s, allocated_regs);
+        tcg_reg_alloc_branch(s, allocated_regs);
     } else {
         /* mark dead temporaries and free the associated registers */
         for(i = nb_oargs; i < nb_oargs + nb_iargs; i++) {
@@ -1782,10 +1911,10 @@ static void tcg_reg_alloc_op(TCGContext *s,
             }
             /* XXX: for load/store we could do that only for the slow path
                (i.e. when a memory callback is called) */
-            
-            /* store globals and free associated registers (we assume the insn
-               can modify any global. */
-            save_globals(s, allocated_regs);
+
+            /* the slow path may raise an exception, so the globals must be
+               in memory, but it does not modify them */
+            sync_globals(s, allocated_regs);
         }
         
         /* satisfy the output constraints */
@@ -1991,9 +2120,13 @@ static int tcg_reg_alloc_call(TCGContext *s, const TCGOpDef *def,
     }
     
     /* store globals and free associated registers (we assume the call
-       can modify any global. */
+       can modify any global).  A pure function only reads them. */
     if (!(flags & TCG_CALL_CONST)) {
-        save_globals(s, allocated_regs);
+        if (flags & TCG_CALL_PURE) {
+            sync_globals(s, allocated_regs);
+        } else {
+            save_globals(s, allocated_regs);
+        }
     }
 
     tcg_out_op(s, opc, &func_arg, &const_func_arg);
@@ -2042,6 +2175,30 @@ static void dump_op_count(void)
 #endif
 
 
+#ifdef DEBUG_DISAS
+/* number of ops that generate code */
+static int tcg_count_ops(void)
+{
+    int i, n = 0;
+
+    for (i = 0; gen_opc_buf[i] != INDEX_op_end; i++) {
+        switch (gen_opc_buf[i]) {
+        case INDEX_op_nop:
+        case INDEX_op_nop1:
+        case INDEX_op_nop2:
+        case INDEX_op_nop3:
+        case INDEX_op_nopn:
+        case INDEX_op_debug_insn_start:
+            break;
+        default:
+            n++;
+            break;
+        }
+    }
+    return n;
+}
+#endif
+
 static inline int tcg_gen_code_common(TCGContext *s, uint8_t *gen_code_buf,
                                       long search_pc)
 {
@@ -2050,13 +2207,17 @@ static inline int tcg_gen_code_common(TCGContext *s, uint8_t *gen_code_buf,
     const TCGOpDef *def;
     unsigned int dead_args;
     const TCGArg *args;
-
 #ifdef DEBUG_DISAS
+    int nb_ops = 0;
+
     if (unlikely(qemu_loglevel_mask(CPU_LOG_TB_OP))) {
         qemu_log("OP:\n");
         tcg_dump_ops(s);
         qemu_log("\n");
     }
+    if (unlikely(qemu_loglevel_mask(CPU_LOG_TB_OP_OPT))) {
+        nb_ops = tcg_count_ops();
+    }
 #endif
 
 #ifdef USE_TCG_OPTIMIZATIONS
@@ -2074,7 +2235,8 @@ static inline int tcg_gen_code_common(TCGContext *s, uint8_t *gen_code_buf,
 
 #ifdef DEBUG_DISAS
     if (unlikely(qemu_loglevel_mask(CPU_LOG_TB_OP_OPT))) {
-        qemu_log("OP after liveness analysis:\n");
+        qemu_log("OP after liveness analysis: %d ops, %d before "
+                 "optimization\n", tcg_count_ops(), nb_ops);
         tcg_dump_ops(s);
         qemu_log("\n");
     }
@@ -2084,6 +2246,10 @@ static inline int tcg_gen_code_common(TCGContext *s, uint8_t *gen_code_buf,
 
     s->code_buf = gen_code_buf;
     s->code_ptr = gen_code_buf;
+    s->nb_code_relocs = 0;
+#if defined(CONFIG_QEMU_LDST_OPTIMIZATION) && defined(CONFIG_SOFTMMU)
+    s->nb_qemu_ldst_labels = 0;
+#endif
 
     args = gen_opparam_buf;
     op_index = 0;
@@ -2169,6 +2335,10 @@ static inline int tcg_gen_code_common(TCGContext *s, uint8_t *gen_code_buf,
 #endif
     }
  the_end:
+#if defined(CONFIG_QEMU_LDST_OPTIMIZATION) && defined(CONFIG_SOFTMMU)
+    /* the TLB miss cases go after the code of the ops */
+    tcg_out_tb_finalize(s);
+#endif
     return -1;
 }
 
@@ -125,6 +125,22 @@ typedef struct TCGRelocation {
     tcg_target_long addend;
 } TCGRelocation; 
 
+/* Position dependent values in the host code of a TB, recorded by
+   backends defining TCG_TARGET_HAS_CODE_RELOCS so that the code can be
+   copied elsewhere (linux-user/tbcache.c).  */
+enum {
+    TCG_CODE_RELOC_PCREL32, /* 32 bit displacement to absolute 'value' */
+    TCG_CODE_RELOC_TB_PTR,  /* pointer sized immediate 'value' */
+};
+
+typedef struct TCGCodeReloc {
+    uint32_t offset; /* from the start of the TB's code */
+    uint32_t type;
+    tcg_target_long value;
+} TCGCodeReloc;
+
+#define TCG_MAX_CODE_RELOCS 128
+
 typedef struct TCGLabel {
     int has_value;
     union {
@@ -143,6 +159,23 @@ typedef struct TCGPool {
 
 #define TCG_MAX_LABELS 512
 
+#if defined(CONFIG_QEMU_LDST_OPTIMIZATION) && defined(CONFIG_SOFTMMU)
+/* TLB miss case of a qemu_ld/st, generated after the code of the TB */
+typedef struct TCGLabelQemuLdst {
+    int is_ld;                  /* qemu_ld: 1, qemu_st: 0 */
+    int opc;
+    int addrlo_reg;
+    int addrhi_reg;
+    int datalo_reg;
+    int datahi_reg;
+    int mem_index;
+    uint8_t *raddr;             /* return address in the fast path */
+    uint8_t *label_ptr[2];      /* displacements of the jumps to the miss case */
+} TCGLabelQemuLdst;
+
+#define TCG_MAX_QEMU_LDST 640
+#endif
+
 #define TCG_MAX_TEMPS 512
 
 /* when the size of the arguments of a called function is smaller than
@@ -326,6 +359,7 @@ typedef struct TCGTemp {
 typedef struct TCGHelperInfo {
     tcg_target_ulong func;
     const char *name;
+    uint64_t *exec_count;       /* with -tcg-stats, once it was translated */
 } TCGHelperInfo;
 
 typedef struct TCGContext TCGContext;
@@ -346,6 +380,19 @@ struct TCGContext {
     unsigned long *tb_next;
     uint16_t *tb_next_offset;
     uint16_t *tb_jmp_offset; /* != NULL if USE_DIRECT_JUMP */
+    /* goto_ptr support: returns to cpu_exec() without chaining */
+    uint8_t *code_gen_epilogue;
+
+    /* relocations of the last TB if code_relocs is not NULL.
+       nb_code_relocs is -1 if its code cannot be moved.  */
+    TCGCodeReloc *code_relocs;
+    int nb_code_relocs;
+
+#if defined(CONFIG_QEMU_LDST_OPTIMIZATION) && defined(CONFIG_SOFTMMU)
+    /* TLB miss cases of the TB being generated */
+    TCGLabelQemuLdst *qemu_ldst_labels;
+    int nb_qemu_ldst_labels;
+#endif
 
     /* liveness analysis */
     uint16_t *op_dead_args; /* for each operation, each bit tells if the
@@ -559,6 +606,7 @@ void tcg_add_target_add_op_defs(const TCGTargetOpDef *tdefs);
 #define tcg_temp_free_ptr(T) tcg_temp_free_i64(TCGV_PTR_TO_NAT(T))
 #endif
 
+void tcg_gen_helper_count(void *func);
 void tcg_gen_callN(TCGContext *s, TCGv_ptr func, unsigned int flags,
                    int sizemask, TCGArg ret, int nargs, TCGArg *args);
 
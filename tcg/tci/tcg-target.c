@@ -48,6 +48,26 @@
 /* TODO: documentation. */
 static uint8_t *tb_ret_addr;
 
+/* Start of the last op written, which the next one may be merged into. */
+static uint8_t *tci_last_op;
+
+/* Pairs of ops written as one superinstruction, see tcg-target.h. */
+static const struct {
+    uint8_t first;
+    uint8_t second;
+    uint8_t fused;
+} tci_superinsns[] = {
+    { INDEX_op_ld_i32, INDEX_op_add_i32, TCI_OP_ld_add_i32 },
+    { TCI_OP_ld_add_i32, INDEX_op_st_i32, TCI_OP_ld_add_st_i32 },
+    { INDEX_op_ld_i32, INDEX_op_brcond_i32, TCI_OP_ld_brcond_i32 },
+    { INDEX_op_setcond_i32, INDEX_op_brcond_i32, TCI_OP_setcond_brcond_i32 },
+#if TCG_TARGET_REG_BITS == 64
+    { INDEX_op_ld_i64, INDEX_op_add_i64, TCI_OP_ld_add_i64 },
+    { TCI_OP_ld_add_i64, INDEX_op_st_i64, TCI_OP_ld_add_st_i64 },
+    { INDEX_op_setcond_i64, INDEX_op_brcond_i64, TCI_OP_setcond_brcond_i64 },
+#endif
+};
+
 /* Macros used in tcg_target_op_defs. */
 #define R       "r"
 #define RI      "ri"
@@ -406,7 +426,13 @@ static int target_parse_constraint(TCGArgConstraint *ct, const char **pct_str)
 /* Show current bytecode. Used by tcg interpreter. */
 void tci_disas(uint8_t opc)
 {
-    const TCGOpDef *def = &tcg_op_defs[opc];
+    const TCGOpDef *def;
+
+    if (opc >= TCI_OP_FIRST) {
+        fprintf(stderr, "TCI superinstruction %u\n", opc);
+        return;
+    }
+    def = &tcg_op_defs[opc];
     fprintf(stderr, "TCG %s %u, %u, %u\n",
             def->name, def->nb_oargs, def->nb_iargs, def->nb_cargs);
 }
@@ -426,11 +452,57 @@ static void tcg_out64(TCGContext *s, uint64_t v)
     s->code_ptr += sizeof(v);
 }
 
-/* Write opcode. */
-static void tcg_out_op_t(TCGContext *s, TCGOpcode op)
+/*
+ * Merge op into the previous op if the pair makes a superinstruction.
+ * This needs the previous op to end right here, in the same TB, and no
+ * label to point between them.  Returns the op to continue, or NULL.
+ */
+static uint8_t *tci_out_fused(TCGContext *s, TCGOpcode op)
+{
+    uint8_t *prev = tci_last_op;
+    unsigned i;
+    int j;
+
+    if (prev < s->code_buf || prev + prev[1] != s->code_ptr) {
+        return NULL;
+    }
+    for (i = 0; i < ARRAY_SIZE(tci_superinsns); i++) {
+        if (tci_superinsns[i].first == prev[0] &&
+            tci_superinsns[i].second == op) {
+            break;
+        }
+    }
+    if (i == ARRAY_SIZE(tci_superinsns)) {
+        return NULL;
+    }
+    for (j = 0; j < s->nb_labels; j++) {
+        if (s->labels[j].has_value &&
+            s->labels[j].u.value == (tcg_target_long)s->code_ptr) {
+            return NULL;
+        }
+    }
+    prev[0] = tci_superinsns[i].fused;
+    return prev;
+}
+
+/* Write opcode.  The size is filled in by tcg_out_op_size. */
+static uint8_t *tcg_out_op_t(TCGContext *s, TCGOpcode op)
 {
-    tcg_out8(s, op);
-    tcg_out8(s, 0);
+    uint8_t *op_ptr = tci_out_fused(s, op);
+
+    if (op_ptr == NULL) {
+        op_ptr = s->code_ptr;
+        tcg_out8(s, op);
+        tcg_out8(s, 0);
+    }
+    return op_ptr;
+}
+
+/* Write the size of the op starting at op_ptr, which ends here. */
+static void tcg_out_op_size(TCGContext *s, uint8_t *op_ptr)
+{
+    op_ptr[1] = s->code_ptr - op_ptr;
+    tci_last_op = op_ptr;
 }
 
 /* Write register. */
@@ -494,16 +566,16 @@ static void tci_out_label(TCGContext *s, TCGArg arg)
 static void tcg_out_ld(TCGContext *s, TCGType type, TCGReg ret, TCGReg arg1,
                        tcg_target_long arg2)
 {
-    uint8_t *old_code_ptr = s->code_ptr;
+    uint8_t *old_code_ptr;
     if (type == TCG_TYPE_I32) {
-        tcg_out_op_t(s, INDEX_op_ld_i32);
+        old_code_ptr = tcg_out_op_t(s, INDEX_op_ld_i32);
         tcg_out_r(s, ret);
         tcg_out_r(s, arg1);
         tcg_out32(s, arg2);
     } else {
         assert(type == TCG_TYPE_I64);
 #if TCG_TARGET_REG_BITS == 64
-        tcg_out_op_t(s, INDEX_op_ld_i64);
+        old_code_ptr = tcg_out_op_t(s, INDEX_op_ld_i64);
         tcg_out_r(s, ret);
         tcg_out_r(s, arg1);
         assert(arg2 == (uint32_t)arg2);
@@ -512,51 +584,49 @@ static void tcg_out_ld(TCGContext *s, TCGType type, TCGReg ret, TCGReg arg1,
         TODO();
 #endif
     }
-    old_code_ptr[1] = s->code_ptr - old_code_ptr;
+    tcg_out_op_size(s, old_code_ptr);
 }
 
 static void tcg_out_mov(TCGContext *s, TCGType type, TCGReg ret, TCGReg arg)
 {
-    uint8_t *old_code_ptr = s->code_ptr;
+    uint8_t *old_code_ptr;
     assert(ret != arg);
 #if TCG_TARGET_REG_BITS == 32
-    tcg_out_op_t(s, INDEX_op_mov_i32);
+    old_code_ptr = tcg_out_op_t(s, INDEX_op_mov_i32);
 #else
-    tcg_out_op_t(s, INDEX_op_mov_i64);
+    old_code_ptr = tcg_out_op_t(s, INDEX_op_mov_i64);
 #endif
     tcg_out_r(s, ret);
     tcg_out_r(s, arg);
-    old_code_ptr[1] = s->code_ptr - old_code_ptr;
+    tcg_out_op_size(s, old_code_ptr);
 }
 
 static void tcg_out_movi(TCGContext *s, TCGType type,
                          TCGReg t0, tcg_target_long arg)
 {
-    uint8_t *old_code_ptr = s->code_ptr;
+    uint8_t *old_code_ptr;
     uint32_t arg32 = arg;
     if (type == TCG_TYPE_I32 || arg == arg32) {
-        tcg_out_op_t(s, INDEX_op_movi_i32);
+        old_code_ptr = tcg_out_op_t(s, INDEX_op_movi_i32);
         tcg_out_r(s, t0);
         tcg_out32(s, arg32);
     } else {
         assert(type == TCG_TYPE_I64);
 #if TCG_TARGET_REG_BITS == 64
-        tcg_out_op_t(s, INDEX_op_movi_i64);
+        old_code_ptr = tcg_out_op_t(s, INDEX_op_movi_i64);
         tcg_out_r(s, t0);
         tcg_out64(s, arg);
 #else
         TODO();
 #endif
     }
-    old_code_ptr[1] = s->code_ptr - old_code_ptr;
+    tcg_out_op_size(s, old_code_ptr);
 }
 
 static void tcg_out_op(TCGContext *s, TCGOpcode opc, const TCGArg *args,
                        const int *const_args)
 {
-    uint8_t *old_code_ptr = s->code_ptr;
-
-    tcg_out_op_t(s, opc);
+    uint8_t *old_code_ptr = tcg_out_op_t(s, opc);
 
     switch (opc) {
     case INDEX_op_exit_tb:
@@ -833,22 +903,22 @@ static void tcg_out_op(TCGContext *s, TCGOpcode opc, const TCGArg *args,
         fprintf(stderr, "Missing: %s\n", tcg_op_defs[opc].name);
         tcg_abort();
     }
-    old_code_ptr[1] = s->code_ptr - old_code_ptr;
+    tcg_out_op_size(s, old_code_ptr);
 }
 
 static void tcg_out_st(TCGContext *s, TCGType type, TCGReg arg, TCGReg arg1,
                        tcg_target_long arg2)
 {
-    uint8_t *old_code_ptr = s->code_ptr;
+    uint8_t *old_code_ptr;
     if (type == TCG_TYPE_I32) {
-        tcg_out_op_t(s, INDEX_op_st_i32);
+        old_code_ptr = tcg_out_op_t(s, INDEX_op_st_i32);
         tcg_out_r(s, arg);
         tcg_out_r(s, arg1);
         tcg_out32(s, arg2);
     } else {
         assert(type == TCG_TYPE_I64);
 #if TCG_TARGET_REG_BITS == 64
-        tcg_out_op_t(s, INDEX_op_st_i64);
+        old_code_ptr = tcg_out_op_t(s, INDEX_op_st_i64);
         tcg_out_r(s, arg);
         tcg_out_r(s, arg1);
         tcg_out32(s, arg2);
@@ -856,7 +926,7 @@ static void tcg_out_st(TCGContext *s, TCGType type, TCGReg arg, TCGReg arg1,
         TODO();
 #endif
     }
-    old_code_ptr[1] = s->code_ptr - old_code_ptr;
+    tcg_out_op_size(s, old_code_ptr);
 }
 
 /* Test if a constant matches the constraint. */
@@ -884,6 +954,7 @@ static void tcg_target_init(TCGContext *s)
 
     /* The current code uses uint8_t for tcg operations. */
     assert(ARRAY_SIZE(tcg_op_defs) <= UINT8_MAX);
+    assert(ARRAY_SIZE(tcg_op_defs) <= TCI_OP_FIRST);
 
     /* Registers available for 32 bit operations. */
     tcg_regset_set32(tcg_target_available_regs[TCG_TYPE_I32], 0,
@@ -68,6 +68,8 @@
 #define TCG_TARGET_HAS_ext16u_i32       1
 #define TCG_TARGET_HAS_andc_i32         0
 #define TCG_TARGET_HAS_deposit_i32      0
+#define TCG_TARGET_HAS_goto_ptr         0
+#define TCG_TARGET_HAS_vec              0
 #define TCG_TARGET_HAS_eqv_i32          0
 #define TCG_TARGET_HAS_nand_i32         0
 #define TCG_TARGET_HAS_nor_i32          0
@@ -152,6 +154,22 @@ typedef enum {
     TCG_CONST = UINT8_MAX
 } TCGReg;
 
+/*
+ * Superinstructions.  The backend merges some frequent pairs of ops into a
+ * single bytecode op which keeps the operands of both, saving a dispatch
+ * in the interpreter.  Their opcodes follow those of TCG.
+ */
+#define TCI_OP_FIRST                (UINT8_MAX - 7)
+#define TCI_OP_ld_add_i32           (TCI_OP_FIRST + 0)
+#define TCI_OP_ld_add_st_i32        (TCI_OP_FIRST + 1)
+#define TCI_OP_ld_brcond_i32        (TCI_OP_FIRST + 2)
+#define TCI_OP_setcond_brcond_i32   (TCI_OP_FIRST + 3)
+#if TCG_TARGET_REG_BITS == 64
+#define TCI_OP_ld_add_i64           (TCI_OP_FIRST + 4)
+#define TCI_OP_ld_add_st_i64        (TCI_OP_FIRST + 5)
+#define TCI_OP_setcond_brcond_i64   (TCI_OP_FIRST + 6)
+#endif
+
 void tci_disas(uint8_t opc);
 
 tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr);
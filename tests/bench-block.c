@@ -0,0 +1,287 @@
+/*
+ * Block layer microbenchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * Measures the cost of a read request in the block layer itself, on top
+ * of the null-co and null-aio protocols which complete without doing
+ * any I/O.  qcow2 and QED need their metadata to survive, so they run on
+ * an empty image in the temporary directory instead: reads of unallocated
+ * clusters never reach the file, and only the format driver is measured.
+ *
+ * Usage: bench-block [-t seconds] [-s bytes] [-d depth[,depth...]]
+ */
+
+#include <glib.h>
+#include <getopt.h>
+#include <sys/resource.h>
+#include "qemu-common.h"
+#include "block.h"
+#include "block_int.h"
+#include "qemu-aio.h"
+#include "qemu-timer.h"
+#include "qemu-coroutine.h"
+
+typedef struct BenchConfig {
+    const char *name;
+    const char *format;
+    const char *filename;       /* NULL for an image in the temp dir */
+} BenchConfig;
+
+static const BenchConfig configs[] = {
+    { "raw/null-co",  "raw",   "null-co://" },
+    { "raw/null-aio", "raw",   "null-aio://" },
+    { "qcow2",        "qcow2", NULL },
+    { "qed",          "qed",   NULL },
+};
+
+#define BENCH_IMAGE_SIZE    (1LL << 30)
+
+typedef struct BenchState {
+    BlockDriverState *bs;
+    QEMUIOVector qiov;
+    int nb_sectors;
+    int64_t total_sectors;
+    int64_t next_sector;
+    int64_t deadline;
+    uint64_t done;
+    int in_flight;
+    int errors;
+} BenchState;
+
+typedef struct BenchRequest {
+    BenchState *s;
+    QEMUIOVector qiov;
+    void *buf;
+} BenchRequest;
+
+static int64_t bench_next_sector(BenchState *s)
+{
+    int64_t sector = s->next_sector;
+
+    s->next_sector += s->nb_sectors;
+    if (s->next_sector + s->nb_sectors > s->total_sectors) {
+        s->next_sector = 0;
+    }
+    return sector;
+}
+
+static void bench_aio_submit(BenchRequest *req);
+
+static void bench_aio_cb(void *opaque, int ret)
+{
+    BenchRequest *req = opaque;
+    BenchState *s = req->s;
+
+    if (ret < 0) {
+        s->errors++;
+    }
+    s->done++;
+    s->in_flight--;
+    if (get_clock() < s->deadline && !s->errors) {
+        bench_aio_submit(req);
+    }
+}
+
+static void bench_aio_submit(BenchRequest *req)
+{
+    BenchState *s = req->s;
+
+    s->in_flight++;
+    if (!bdrv_aio_readv(s->bs, bench_next_sector(s), &req->qiov,
+                        s->nb_sectors, bench_aio_cb, req)) {
+        s->in_flight--;
+        s->errors++;
+    }
+}
+
+static void coroutine_fn bench_co_entry(void *opaque)
+{
+    BenchRequest *req = opaque;
+    BenchState *s = req->s;
+
+    while (get_clock() < s->deadline && !s->errors) {
+        if (bdrv_co_readv(s->bs, bench_next_sector(s), s->nb_sectors,
+                          &req->qiov) < 0) {
+            s->errors++;
+        }
+        s->done++;
+    }
+    s->in_flight--;
+}
+
+static double cpu_seconds(void)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+           (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+static int bench_run(BlockDriverState *bs, bool co, int depth,
+                     int buf_size, int64_t duration_ns,
+                     double *iops, double *iops_per_core)
+{
+    BenchState s = {
+        .bs = bs,
+        .nb_sectors = buf_size / BDRV_SECTOR_SIZE,
+        .total_sectors = bdrv_getlength(bs) / BDRV_SECTOR_SIZE,
+    };
+    BenchRequest *reqs = g_new0(BenchRequest, depth);
+    int64_t start;
+    double cpu_start, cpu;
+    int i;
+
+    for (i = 0; i < depth; i++) {
+        reqs[i].s = &s;
+        reqs[i].buf = qemu_blockalign(bs, buf_size);
+        qemu_iovec_init(&reqs[i].qiov, 1);
+        qemu_iovec_add(&reqs[i].qiov, reqs[i].buf, buf_size);
+    }
+
+    cpu_start = cpu_seconds();
+    start = get_clock();
+    s.deadline = start + duration_ns;
+    for (i = 0; i < depth; i++) {
+        if (co) {
+            s.in_flight++;
+            qemu_coroutine_enter(qemu_coroutine_create(bench_co_entry),
+                                 &reqs[i]);
+        } else {
+            bench_aio_submit(&reqs[i]);
+        }
+    }
+    while (s.in_flight) {
+        qemu_aio_wait();
+    }
+    bdrv_drain_all();
+
+    cpu = cpu_seconds() - cpu_start;
+    *iops = s.done * (double)get_ticks_per_sec() / (get_clock() - start);
+    *iops_per_core = cpu > 0 ? s.done / cpu : 0;
+
+    for (i = 0; i < depth; i++) {
+        qemu_iovec_destroy(&reqs[i].qiov);
+        qemu_vfree(reqs[i].buf);
+    }
+    g_free(reqs);
+    return s.errors ? -EIO : 0;
+}
+
+static int create_image(const char *format, const char *filename)
+{
+    BlockDriver *drv = bdrv_find_format(format);
+    QEMUOptionParameter *param;
+    int ret;
+
+    if (!drv) {
+        return -ENOENT;
+    }
+    param = parse_option_parameters("", drv->create_options, NULL);
+    set_option_parameter_int(param, BLOCK_OPT_SIZE, BENCH_IMAGE_SIZE);
+    ret = bdrv_create(drv, filename, param);
+    free_option_parameters(param);
+    return ret;
+}
+
+static void usage(const char *progname)
+{
+    fprintf(stderr, "usage: %s [-t seconds] [-s bytes] [-d depth[,depth...]]\n",
+            progname);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    static const char *const apis[] = { "aio", "co" };
+    int64_t duration_ns = get_ticks_per_sec();
+    int buf_size = 4096;
+    char *depth_list = g_strdup("1,4,16,64");
+    char **depths, *tmp_image;
+    unsigned c, i;
+    int api, c_opt, fd, ret;
+
+    while ((c_opt = getopt(argc, argv, "t:s:d:h")) != -1) {
+        switch (c_opt) {
+        case 't':
+            duration_ns = atof(optarg) * get_ticks_per_sec();
+            break;
+        case 's':
+            buf_size = atoi(optarg);
+            if (buf_size <= 0 || buf_size % BDRV_SECTOR_SIZE) {
+                usage(argv[0]);
+            }
+            break;
+        case 'd':
+            g_free(depth_list);
+            depth_list = g_strdup(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    depths = g_strsplit(depth_list, ",", 0);
+
+    init_clocks();
+    bdrv_init();
+    qemu_init_main_loop();
+
+    tmp_image = g_strdup_printf("%s/bench-block-XXXXXX", g_get_tmp_dir());
+    fd = mkstemp(tmp_image);
+    if (fd < 0) {
+        perror("mkstemp");
+        return 1;
+    }
+    close(fd);
+
+    printf("%-14s %-4s %6s %12s %12s\n",
+           "driver", "api", "depth", "IOPS", "IOPS/core");
+    for (c = 0; c < ARRAY_SIZE(configs); c++) {
+        const BenchConfig *cfg = &configs[c];
+        const char *filename = cfg->filename ? cfg->filename : tmp_image;
+        BlockDriverState *bs;
+
+        if (!cfg->filename && create_image(cfg->format, tmp_image) < 0) {
+            fprintf(stderr, "%s: could not create image\n", cfg->name);
+            continue;
+        }
+        bs = bdrv_new("");
+        ret = bdrv_open(bs, filename, BDRV_O_RDWR,
+                        bdrv_find_format(cfg->format));
+        if (ret < 0) {
+            fprintf(stderr, "%s: could not open %s: %s\n",
+                    cfg->name, filename, strerror(-ret));
+            bdrv_delete(bs);
+            continue;
+        }
+        for (api = 0; api < ARRAY_SIZE(apis); api++) {
+            for (i = 0; depths[i]; i++) {
+                int depth = atoi(depths[i]);
+                double iops, per_core;
+
+                if (depth <= 0) {
+                    continue;
+                }
+                ret = bench_run(bs, api == 1, depth, buf_size, duration_ns,
+                                &iops, &per_core);
+                if (ret < 0) {
+                    printf("%-14s %-4s %6d %12s\n",
+                           cfg->name, apis[api], depth, "error");
+                    continue;
+                }
+                printf("%-14s %-4s %6d %12.0f %12.0f\n",
+                       cfg->name, apis[api], depth, iops, per_core);
+                fflush(stdout);
+            }
+        }
+        bdrv_delete(bs);
+    }
+
+    unlink(tmp_image);
+    g_free(tmp_image);
+    g_strfreev(depths);
+    g_free(depth_list);
+    return 0;
+}
@@ -17,6 +17,8 @@
 #include "qfloat.h"
 #include "qbool.h"
 #include "qjson.h"
+#include "json-parser.h"
+#include "json-streamer.h"
 
 #include "qemu-common.h"
 
@@ -518,6 +520,114 @@ static void large_dict(void)
     g_string_free(gstr, true);
 }
 
+/* Something like query-block on @count devices */
+static void gen_large_document(GString *gstr, int count)
+{
+    int i;
+
+    g_string_append(gstr, "{'return': [");
+    for (i = 0; i < count; i++) {
+        g_string_append_printf(gstr,
+            "%s{'device': 'drive-virtio-disk%d', 'locked': false, "
+            "'removable': false, 'type': 'unknown', "
+            "'inserted': {'ro': false, 'drv': 'qcow2', 'encrypted': false, "
+            "'file': '/var/lib/images/guest%d.qcow2', 'bps': 0, "
+            "'iops': 0, 'bps_rd': 0, 'bps_wr': 0}}",
+            i ? ", " : "", i, i);
+    }
+    g_string_append(gstr, "]}");
+}
+
+typedef struct {
+    JSONMessageParser parser;
+    QObject *result;
+    int messages;
+} LargeDocumentState;
+
+static void large_document_emit(JSONMessageParser *parser, GPtrArray *tokens)
+{
+    LargeDocumentState *s = container_of(parser, LargeDocumentState, parser);
+
+    qobject_decref(s->result);
+    s->result = json_parser_parse(tokens, NULL);
+    s->messages++;
+}
+
+/* Feed @str in @chunk byte pieces, as the monitor does */
+static QObject *parse_in_chunks(const char *str, size_t len, size_t chunk)
+{
+    LargeDocumentState s = {};
+    size_t i;
+
+    json_message_parser_init(&s.parser, large_document_emit);
+    for (i = 0; i < len; i += chunk) {
+        json_message_parser_feed(&s.parser, str + i, MIN(chunk, len - i));
+    }
+    json_message_parser_flush(&s.parser);
+    json_message_parser_destroy(&s.parser);
+    g_assert_cmpint(s.messages, ==, 1);
+    return s.result;
+}
+
+static void large_document(void)
+{
+    GString *gstr = g_string_new("");
+    GString *big = g_string_new("");
+    QObject *obj;
+    QDict *dict;
+    QList *list;
+    QString *str;
+    int i;
+
+    gen_large_document(gstr, 500);
+    obj = parse_in_chunks(gstr->str, gstr->len, 7);
+    g_assert(obj != NULL);
+    dict = qobject_to_qdict(obj);
+    list = qobject_to_qlist(qdict_get(dict, "return"));
+    g_assert_cmpint(qlist_size(list), ==, 500);
+    dict = qobject_to_qdict(qlist_peek(list));
+    g_assert_cmpstr(qdict_get_str(dict, "device"), ==, "drive-virtio-disk0");
+    qobject_decref(obj);
+
+    /* a string token larger than the token storage chunks */
+    g_string_append(big, "['");
+    for (i = 0; i < 10000; i++) {
+        g_string_append_c(big, 'a' + i % 26);
+    }
+    g_string_append(big, "', 1]");
+    obj = parse_in_chunks(big->str, big->len, 4096);
+    g_assert(obj != NULL);
+    list = qobject_to_qlist(obj);
+    str = qobject_to_qstring(qlist_peek(list));
+    g_assert_cmpint(strlen(qstring_get_str(str)), ==, 10000);
+    qobject_decref(obj);
+
+    g_string_free(big, true);
+    g_string_free(gstr, true);
+}
+
+static void perf_large_document(void)
+{
+    GString *gstr = g_string_new("");
+    QObject *obj;
+    double elapsed, rate;
+    int r, rounds = 20;
+
+    gen_large_document(gstr, 2000);
+    g_test_timer_start();
+    for (r = 0; r < rounds; r++) {
+        obj = parse_in_chunks(gstr->str, gstr->len, 4096);
+        g_assert(obj != NULL);
+        qobject_decref(obj);
+    }
+    elapsed = g_test_timer_elapsed();
+
+    /* MB of JSON parsed per second */
+    rate = (double)rounds * gstr->len / elapsed / (1024 * 1024);
+    g_test_maximized_result(rate, "%.1f MB/s", rate);
+    g_string_free(gstr, true);
+}
+
 static void simple_list(void)
 {
     int i;
@@ -759,6 +869,7 @@ int main(int argc, char **argv)
 
     g_test_add_func("/dicts/simple_dict", simple_dict);
     g_test_add_func("/dicts/large_dict", large_dict);
+    g_test_add_func("/dicts/large_document", large_document);
     g_test_add_func("/lists/simple_list", simple_list);
 
     g_test_add_func("/whitespace/simple_whitespace", simple_whitespace);
@@ -777,5 +888,9 @@ int main(int argc, char **argv)
     g_test_add_func("/errors/invalid_dict_comma", invalid_dict_comma);
     g_test_add_func("/errors/unterminated/literal", unterminated_literal);
 
+    if (g_test_perf()) {
+        g_test_add_func("/perf/large_document", perf_large_document);
+    }
+
     return g_test_run();
 }
@@ -0,0 +1,243 @@
+/*
+ * Shared memory ring benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * Two processes play ping-pong over a pair of single-producer rings in a
+ * shared memory object, laid out as a guest application would lay them
+ * out in the BAR of an ivshmem device.  The doorbell is either busy
+ * polling of the ring or an eventfd per direction, which is what the
+ * guests ring through ivshmem with ioeventfd=on and irqfds.  This gives
+ * the floor the device path can be compared against, and shows what
+ * backing the object with huge pages (-p on a hugetlbfs mount) buys.
+ * Polling needs a host CPU for each side to mean anything.
+ *
+ * Usage: ivshmem-bench [-t seconds] [-m poll|eventfd] [-b bytes]
+ *                      [-p path] [-s size in MB]
+ */
+
+#include <glib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "qemu-barrier.h"
+
+#define RING_SLOTS      256
+#define CACHELINE       64
+
+typedef struct Ring {
+    volatile uint32_t head;     /* written by the producer */
+    uint8_t pad1[CACHELINE - sizeof(uint32_t)];
+    volatile uint32_t tail;     /* written by the consumer */
+    uint8_t pad2[CACHELINE - sizeof(uint32_t)];
+} Ring;
+
+typedef struct BenchState {
+    Ring *tx, *rx;
+    uint8_t *tx_slots, *rx_slots;
+    int tx_fd, rx_fd;           /* doorbells, -1 when polling */
+    size_t msg_size;
+} BenchState;
+
+static void ring_wait(BenchState *b)
+{
+    uint64_t val;
+
+    if (b->rx_fd < 0) {
+        return;
+    }
+    while (read(b->rx_fd, &val, sizeof(val)) < 0 && errno == EINTR) {
+        /* retry */
+    }
+}
+
+static void ring_kick(BenchState *b)
+{
+    uint64_t val = 1;
+
+    if (b->tx_fd >= 0 && write(b->tx_fd, &val, sizeof(val)) < 0) {
+        perror("write");
+        exit(1);
+    }
+}
+
+static void ring_send(BenchState *b, uint32_t seq)
+{
+    uint32_t head = b->tx->head;
+
+    while (head - b->tx->tail >= RING_SLOTS) {
+        /* the peer answers every message, so this never waits long */
+    }
+    memcpy(b->tx_slots + (head % RING_SLOTS) * b->msg_size, &seq,
+           sizeof(seq));
+    smp_wmb();
+    b->tx->head = head + 1;
+    smp_mb();
+    ring_kick(b);
+}
+
+static uint32_t ring_receive(BenchState *b)
+{
+    uint32_t tail = b->rx->tail;
+    uint32_t seq;
+
+    while (b->rx->head == tail) {
+        ring_wait(b);
+    }
+    smp_rmb();
+    memcpy(&seq, b->rx_slots + (tail % RING_SLOTS) * b->msg_size,
+           sizeof(seq));
+    b->rx->tail = tail + 1;
+    return seq;
+}
+
+/* Echo messages back until the sequence number 0 comes in */
+static void bench_peer(BenchState *b)
+{
+    uint32_t seq;
+
+    do {
+        seq = ring_receive(b);
+        ring_send(b, seq);
+    } while (seq);
+    exit(0);
+}
+
+int main(int argc, char **argv)
+{
+    const char *path = NULL, *mode = "eventfd";
+    double duration = 1;
+    size_t msg_size = 64, size = 2;
+    BenchState ping, pong;
+    int fds[2] = { -1, -1 };
+    GTimer *timer;
+    double elapsed;
+    uint32_t seq = 0;
+    uint8_t *mem;
+    pid_t pid;
+    int c, fd;
+
+    while ((c = getopt(argc, argv, "t:m:b:p:s:h")) != -1) {
+        switch (c) {
+        case 't':
+            duration = atof(optarg);
+            break;
+        case 'm':
+            mode = optarg;
+            break;
+        case 'b':
+            msg_size = atoi(optarg);
+            break;
+        case 'p':
+            path = optarg;
+            break;
+        case 's':
+            size = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-t seconds] [-m poll|eventfd] "
+                    "[-b bytes] [-p path] [-s size in MB]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (strcmp(mode, "poll") && strcmp(mode, "eventfd")) {
+        fprintf(stderr, "%s: unknown mode %s\n", argv[0], mode);
+        return 1;
+    }
+    size <<= 20;
+    msg_size = MAX(msg_size, sizeof(uint32_t));
+    if (2 * (sizeof(Ring) + RING_SLOTS * msg_size) > size) {
+        fprintf(stderr, "%s: the rings do not fit in %zu bytes\n", argv[0],
+                size);
+        return 1;
+    }
+
+    if (path) {
+        fd = open(path, O_RDWR | O_CREAT, 0600);
+    } else {
+        char *name = g_strdup_printf("/ivshmem-bench-%d", (int)getpid());
+
+        fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        shm_unlink(name);
+        g_free(name);
+    }
+    if (fd < 0 || ftruncate(fd, size) < 0) {
+        perror("ivshmem-bench: shared memory");
+        return 1;
+    }
+    mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mem == MAP_FAILED) {
+        perror("ivshmem-bench: mmap");
+        return 1;
+    }
+    if (path) {
+        unlink(path);
+    }
+    memset(mem, 0, 2 * sizeof(Ring));
+
+    if (!strcmp(mode, "eventfd")) {
+        fds[0] = eventfd(0, 0);
+        fds[1] = eventfd(0, 0);
+        if (fds[0] < 0 || fds[1] < 0) {
+            perror("ivshmem-bench: eventfd");
+            return 1;
+        }
+    }
+
+    ping.tx = (Ring *)mem;
+    ping.rx = (Ring *)(mem + sizeof(Ring));
+    ping.tx_slots = mem + 2 * sizeof(Ring);
+    ping.rx_slots = ping.tx_slots + RING_SLOTS * msg_size;
+    ping.tx_fd = fds[0];
+    ping.rx_fd = fds[1];
+    ping.msg_size = msg_size;
+
+    pong.tx = ping.rx;
+    pong.rx = ping.tx;
+    pong.tx_slots = ping.rx_slots;
+    pong.rx_slots = ping.tx_slots;
+    pong.tx_fd = fds[1];
+    pong.rx_fd = fds[0];
+    pong.msg_size = msg_size;
+
+    pid = fork();
+    if (pid < 0) {
+        perror("ivshmem-bench: fork");
+        return 1;
+    }
+    if (pid == 0) {
+        bench_peer(&pong);
+    }
+
+    timer = g_timer_new();
+    do {
+        ring_send(&ping, ++seq);
+        if (ring_receive(&ping) != seq) {
+            fprintf(stderr, "ivshmem-bench: lost message %u\n", seq);
+            return 1;
+        }
+    } while ((seq & 1023) || g_timer_elapsed(timer, NULL) < duration);
+    elapsed = g_timer_elapsed(timer, NULL);
+
+    ring_send(&ping, 0);
+    ring_receive(&ping);
+    waitpid(pid, NULL, 0);
+
+    printf("%-8s %8s %12s %12s\n", "mode", "bytes", "msg/s", "rtt us");
+    printf("%-8s %8zu %12.0f %12.2f\n", mode, msg_size, seq / elapsed,
+           elapsed * 1e6 / seq);
+
+    g_timer_destroy(timer);
+    return 0;
+}
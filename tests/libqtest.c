@@ -139,23 +139,32 @@ QTestState *qtest_init(const char *extra_args)
     return s;
 }
 
-void qtest_quit(QTestState *s)
+pid_t qtest_get_pid(QTestState *s)
 {
     FILE *f;
     char buffer[1024];
+    pid_t pid = -1;
 
     f = fopen(s->pid_file, "r");
     if (f) {
         if (fgets(buffer, sizeof(buffer), f)) {
-            pid_t pid = atoi(buffer);
-            int status = 0;
-
-            kill(pid, SIGTERM);
-            waitpid(pid, &status, 0);
+            pid = atoi(buffer);
         }
-
         fclose(f);
     }
+    return pid;
+}
+
+void qtest_quit(QTestState *s)
+{
+    pid_t pid = qtest_get_pid(s);
+
+    if (pid != -1) {
+        int status = 0;
+
+        kill(pid, SIGTERM);
+        waitpid(pid, &status, 0);
+    }
 
     unlink(s->pid_file);
     unlink(s->socket_path);
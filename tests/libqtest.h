@@ -37,6 +37,14 @@ QTestState *qtest_init(const char *extra_args);
  */
 void qtest_quit(QTestState *s);
 
+/**
+ * qtest_get_pid:
+ * @s: QTestState instance to operate on.
+ *
+ * Returns the process ID of the QEMU process associated to @s, or -1.
+ */
+pid_t qtest_get_pid(QTestState *s);
+
 /**
  * qtest_qmp:
  * @s: QTestState instance to operate on.
@@ -0,0 +1,220 @@
+/*
+ * Minimal virtio-pci driver for qtest
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "libqvirtio.h"
+#include <glib.h>
+#include <string.h>
+
+#define PCI_CONFIG_ADDR             0xcf8
+#define PCI_CONFIG_DATA             0xcfc
+#define PCI_VENDOR_ID               0x00
+#define PCI_COMMAND                 0x04
+#define PCI_BASE_ADDRESS_0          0x10
+#define PCI_COMMAND_IO              0x1
+#define PCI_COMMAND_MASTER          0x4
+
+/* legacy virtio-pci I/O BAR layout, see hw/virtio-pci.c */
+#define VIRTIO_PCI_HOST_FEATURES    0
+#define VIRTIO_PCI_GUEST_FEATURES   4
+#define VIRTIO_PCI_QUEUE_PFN        8
+#define VIRTIO_PCI_QUEUE_NUM        12
+#define VIRTIO_PCI_QUEUE_SEL        14
+#define VIRTIO_PCI_QUEUE_NOTIFY     16
+#define VIRTIO_PCI_STATUS           18
+
+#define VIRTIO_PCI_QUEUE_ADDR_SHIFT 12
+#define VIRTIO_PCI_VRING_ALIGN      4096
+
+#define VRING_DESC_F_NEXT           1
+#define VRING_DESC_F_WRITE          2
+
+#define QVIRTIO_ALLOC_START         (1 << 20)
+
+static uint32_t pci_config_readl(QTestState *s, int devfn, uint8_t offset)
+{
+    qtest_outl(s, PCI_CONFIG_ADDR, 0x80000000 | (devfn << 8) | offset);
+    return qtest_inl(s, PCI_CONFIG_DATA);
+}
+
+static void pci_config_writel(QTestState *s, int devfn, uint8_t offset,
+                              uint32_t value)
+{
+    qtest_outl(s, PCI_CONFIG_ADDR, 0x80000000 | (devfn << 8) | offset);
+    qtest_outl(s, PCI_CONFIG_DATA, value);
+}
+
+/* The guest is little endian, the host need not be */
+static void stw_le(uint8_t *p, uint16_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void stl_le(uint8_t *p, uint32_t v)
+{
+    stw_le(p, v);
+    stw_le(p + 2, v >> 16);
+}
+
+static void stq_le(uint8_t *p, uint64_t v)
+{
+    stl_le(p, v);
+    stl_le(p + 4, v >> 32);
+}
+
+bool qvirtio_pci_init(QVirtioDevice *dev, QTestState *s,
+                      uint16_t device_id, uint16_t iobase)
+{
+    int devfn;
+
+    for (devfn = 0; devfn < 256; devfn += 8) {
+        uint32_t id = pci_config_readl(s, devfn, PCI_VENDOR_ID);
+
+        if ((id & 0xffff) == QVIRTIO_VENDOR_ID && (id >> 16) == device_id) {
+            break;
+        }
+    }
+    if (devfn == 256) {
+        return false;
+    }
+
+    pci_config_writel(s, devfn, PCI_BASE_ADDRESS_0, iobase | 1);
+    pci_config_writel(s, devfn, PCI_COMMAND,
+                      PCI_COMMAND_IO | PCI_COMMAND_MASTER);
+
+    dev->qts = s;
+    dev->iobase = iobase;
+    dev->alloc_next = QVIRTIO_ALLOC_START;
+    qvirtio_set_status(dev, 0);
+    qvirtio_set_status(dev, QVIRTIO_STATUS_ACKNOWLEDGE |
+                            QVIRTIO_STATUS_DRIVER);
+    return true;
+}
+
+uint64_t qvirtio_guest_alloc(QVirtioDevice *dev, size_t size, size_t align)
+{
+    uint64_t addr = (dev->alloc_next + align - 1) & ~(uint64_t)(align - 1);
+
+    dev->alloc_next = addr + size;
+    return addr;
+}
+
+uint32_t qvirtio_get_features(QVirtioDevice *dev)
+{
+    return qtest_inl(dev->qts, dev->iobase + VIRTIO_PCI_HOST_FEATURES);
+}
+
+void qvirtio_set_features(QVirtioDevice *dev, uint32_t features)
+{
+    qtest_outl(dev->qts, dev->iobase + VIRTIO_PCI_GUEST_FEATURES, features);
+}
+
+void qvirtio_set_status(QVirtioDevice *dev, uint8_t status)
+{
+    qtest_outb(dev->qts, dev->iobase + VIRTIO_PCI_STATUS, status);
+}
+
+void qvirtqueue_init(QVirtioDevice *dev, QVirtQueue *vq, int index)
+{
+    size_t ring_size;
+    uint8_t *zero;
+
+    qtest_outw(dev->qts, dev->iobase + VIRTIO_PCI_QUEUE_SEL, index);
+    vq->index = index;
+    vq->size = qtest_inw(dev->qts, dev->iobase + VIRTIO_PCI_QUEUE_NUM);
+    g_assert(vq->size);
+
+    /* descriptors, avail ring + used_event, aligned used ring + avail_event */
+    vq->desc = qvirtio_guest_alloc(dev, 0, VIRTIO_PCI_VRING_ALIGN);
+    vq->avail = vq->desc + 16 * vq->size;
+    vq->used = (vq->avail + 4 + 2 * vq->size + 2 + VIRTIO_PCI_VRING_ALIGN - 1)
+               & ~(uint64_t)(VIRTIO_PCI_VRING_ALIGN - 1);
+    ring_size = vq->used + 4 + 8 * vq->size + 2 - vq->desc;
+    qvirtio_guest_alloc(dev, ring_size, 1);
+
+    zero = g_malloc0(ring_size);
+    qtest_memwrite(dev->qts, vq->desc, zero, ring_size);
+    g_free(zero);
+
+    vq->free_head = 0;
+    vq->avail_idx = 0;
+    vq->last_used_idx = 0;
+    qtest_outl(dev->qts, dev->iobase + VIRTIO_PCI_QUEUE_PFN,
+               vq->desc >> VIRTIO_PCI_QUEUE_ADDR_SHIFT);
+}
+
+uint16_t qvirtqueue_add(QVirtioDevice *dev, QVirtQueue *vq,
+                        const QVirtioBuf *bufs, int n)
+{
+    uint16_t head = vq->free_head;
+    uint8_t *desc;
+    int i;
+
+    g_assert(n > 0 && vq->free_head + n <= vq->size);
+    desc = g_malloc0(16 * n);
+    for (i = 0; i < n; i++) {
+        uint8_t *d = desc + 16 * i;
+        uint16_t flags = bufs[i].write ? VRING_DESC_F_WRITE : 0;
+
+        if (i + 1 < n) {
+            flags |= VRING_DESC_F_NEXT;
+        }
+        stq_le(d, bufs[i].addr);
+        stl_le(d + 8, bufs[i].len);
+        stw_le(d + 12, flags);
+        stw_le(d + 14, head + i + 1);
+    }
+    qtest_memwrite(dev->qts, vq->desc + 16 * head, desc, 16 * n);
+    g_free(desc);
+
+    vq->free_head += n;
+    return head;
+}
+
+void qvirtqueue_submit(QVirtioDevice *dev, QVirtQueue *vq,
+                       const uint16_t *heads, int n)
+{
+    uint8_t *ring = g_malloc(2 * n);
+    uint8_t idx[2];
+    int start = vq->avail_idx % vq->size;
+    int first = n < vq->size - start ? n : vq->size - start;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        stw_le(ring + 2 * i, heads[i]);
+    }
+    /* at most two writes, in case the batch wraps around the ring */
+    qtest_memwrite(dev->qts, vq->avail + 4 + 2 * start, ring, 2 * first);
+    if (first < n) {
+        qtest_memwrite(dev->qts, vq->avail + 4, ring + 2 * first,
+                       2 * (n - first));
+    }
+    g_free(ring);
+
+    vq->avail_idx += n;
+    stw_le(idx, vq->avail_idx);
+    qtest_memwrite(dev->qts, vq->avail + 2, idx, sizeof(idx));
+}
+
+void qvirtqueue_kick(QVirtioDevice *dev, QVirtQueue *vq)
+{
+    qtest_outw(dev->qts, dev->iobase + VIRTIO_PCI_QUEUE_NOTIFY, vq->index);
+}
+
+void qvirtqueue_wait_used(QVirtioDevice *dev, QVirtQueue *vq, uint16_t n)
+{
+    uint16_t target = vq->last_used_idx + n;
+    uint8_t idx[2];
+
+    for (;;) {
+        qtest_memread(dev->qts, vq->used + 2, idx, sizeof(idx));
+        if ((uint16_t)(idx[0] | (idx[1] << 8)) == target) {
+            break;
+        }
+    }
+    vq->last_used_idx = target;
+}
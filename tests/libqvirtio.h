@@ -0,0 +1,106 @@
+/*
+ * Minimal virtio-pci driver for qtest
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * Drives legacy virtio-pci devices on bus 0 of a PC machine through the
+ * I/O port BAR, without MSI-X.  Guest memory is handed out by a bump
+ * allocator starting at 1 MB and is never freed.
+ */
+#ifndef LIBQVIRTIO_H
+#define LIBQVIRTIO_H
+
+#include "libqtest.h"
+
+#define QVIRTIO_VENDOR_ID           0x1af4
+#define QVIRTIO_NET_DEVICE_ID       0x1000
+#define QVIRTIO_BLK_DEVICE_ID       0x1001
+
+#define QVIRTIO_STATUS_ACKNOWLEDGE  1
+#define QVIRTIO_STATUS_DRIVER       2
+#define QVIRTIO_STATUS_DRIVER_OK    4
+
+typedef struct QVirtioDevice {
+    QTestState *qts;
+    uint16_t iobase;
+    uint64_t alloc_next;
+} QVirtioDevice;
+
+typedef struct QVirtQueue {
+    int index;
+    uint16_t size;
+    uint64_t desc;
+    uint64_t avail;
+    uint64_t used;
+    uint16_t free_head;         /* next unused descriptor */
+    uint16_t avail_idx;
+    uint16_t last_used_idx;
+} QVirtQueue;
+
+typedef struct QVirtioBuf {
+    uint64_t addr;
+    uint32_t len;
+    bool write;                 /* written by the device */
+} QVirtioBuf;
+
+/**
+ * qvirtio_pci_init:
+ * @dev: device to initialize.
+ * @s: QTestState instance to operate on.
+ * @device_id: PCI device ID to look for.
+ * @iobase: I/O port address assigned to BAR 0.
+ *
+ * Find the first virtio device with @device_id on bus 0, map its BAR 0
+ * at @iobase, enable it and reset it.  Returns false if there is none.
+ */
+bool qvirtio_pci_init(QVirtioDevice *dev, QTestState *s,
+                      uint16_t device_id, uint16_t iobase);
+
+/**
+ * qvirtio_guest_alloc:
+ *
+ * Return the guest physical address of @size bytes, aligned to @align.
+ */
+uint64_t qvirtio_guest_alloc(QVirtioDevice *dev, size_t size, size_t align);
+
+uint32_t qvirtio_get_features(QVirtioDevice *dev);
+void qvirtio_set_features(QVirtioDevice *dev, uint32_t features);
+void qvirtio_set_status(QVirtioDevice *dev, uint8_t status);
+
+/**
+ * qvirtqueue_init:
+ *
+ * Allocate the rings of queue @index at the size the device offers and
+ * tell the device about them.
+ */
+void qvirtqueue_init(QVirtioDevice *dev, QVirtQueue *vq, int index);
+
+/**
+ * qvirtqueue_add:
+ *
+ * Write a chain of @n descriptors for @bufs and return its head.  Chains
+ * are meant to be set up once and made available again for every
+ * request; descriptors are never reclaimed.
+ */
+uint16_t qvirtqueue_add(QVirtioDevice *dev, QVirtQueue *vq,
+                        const QVirtioBuf *bufs, int n);
+
+/**
+ * qvirtqueue_submit:
+ *
+ * Make the chains at @heads available to the device, without notifying it.
+ */
+void qvirtqueue_submit(QVirtioDevice *dev, QVirtQueue *vq,
+                       const uint16_t *heads, int n);
+
+void qvirtqueue_kick(QVirtioDevice *dev, QVirtQueue *vq);
+
+/**
+ * qvirtqueue_wait_used:
+ *
+ * Poll the used ring until the device completed @n more chains.
+ */
+void qvirtqueue_wait_used(QVirtioDevice *dev, QVirtQueue *vq, uint16_t n);
+
+#endif
@@ -0,0 +1,86 @@
+/*
+ * Floating point micro-benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * Times the basic single and double precision operations, one dependent
+ * chain per operation so that the emulator cannot overlap them.  The
+ * operands stay normal and the results are mostly inexact, which is the
+ * common case of guest FP code; run it natively and under the emulator and
+ * compare the columns.
+ *
+ * Usage: fpu-bench [iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <sys/time.h>
+
+static double now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+/* volatile operands keep the compiler from folding the loops */
+static volatile float fa = 1.000001f, fb = 0.999999f;
+static volatile double da = 1.0000000001, db = 0.9999999999;
+
+#define BENCH(name, type, a, b, expr)                                   \
+    static double bench_##name(long n)                                  \
+    {                                                                   \
+        type x = a, y = b;                                              \
+        double start = now();                                           \
+        long i;                                                         \
+                                                                        \
+        for (i = 0; i < n; i++) {                                       \
+            x = expr;                                                   \
+        }                                                               \
+        a = x + (y - y);                                                \
+        return (now() - start) * 1e9 / n;                               \
+    }
+
+/* each step leaves x close to where it was, or close to 2 for sqrt */
+BENCH(fadd, float, fa, fb, (x + y) - y)
+BENCH(fmul, float, fa, fb, x * y * (1.0f / 0.999999f))
+BENCH(fdiv, float, fa, fb, (x / y) * y)
+BENCH(fsqrt, float, fa, fb, sqrtf(x) * 1.4142135f)
+BENCH(dadd, double, da, db, (x + y) - y)
+BENCH(dmul, double, da, db, x * y * (1.0 / 0.9999999999))
+BENCH(ddiv, double, da, db, (x / y) * y)
+BENCH(dsqrt, double, da, db, sqrt(x) * 1.4142135623730951)
+
+static const struct {
+    const char *name;
+    double (*fn)(long n);
+} benches[] = {
+    { "float add/sub", bench_fadd },
+    { "float mul", bench_fmul },
+    { "float div/mul", bench_fdiv },
+    { "float sqrt/mul", bench_fsqrt },
+    { "double add/sub", bench_dadd },
+    { "double mul", bench_dmul },
+    { "double div/mul", bench_ddiv },
+    { "double sqrt/mul", bench_dsqrt },
+};
+
+int main(int argc, char **argv)
+{
+    long n = argc > 1 ? atol(argv[1]) : 10000000;
+    unsigned int i;
+
+    if (n <= 0) {
+        fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    printf("%-20s %12s\n", "operation", "ns/loop");
+    for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+        printf("%-20s %12.2f\n", benches[i].name, benches[i].fn(n));
+    }
+    return 0;
+}
@@ -0,0 +1,410 @@
+/*
+ * AioContext tests
+ *
+ * Copyright Red Hat, Inc. 2012
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "qemu-aio.h"
+#include "qemu-timer.h"
+#include "qemu-thread.h"
+
+static AioContext *ctx;
+
+/* Simple callbacks for testing.  */
+
+typedef struct {
+    QEMUBH *bh;
+    int n;
+    int max;
+} BHTestData;
+
+typedef struct {
+    int fds[2];
+    int n;
+    int active;
+} PipeTestData;
+
+static void bh_test_cb(void *opaque)
+{
+    BHTestData *data = opaque;
+    if (++data->n < data->max) {
+        qemu_bh_schedule(data->bh);
+    }
+}
+
+static void bh_delete_cb(void *opaque)
+{
+    BHTestData *data = opaque;
+    if (++data->n < data->max) {
+        qemu_bh_schedule(data->bh);
+    } else {
+        qemu_bh_delete(data->bh);
+        data->bh = NULL;
+    }
+}
+
+static void timer_test_cb(void *opaque)
+{
+    int *n = opaque;
+    (*n)++;
+}
+
+static int pipe_flush_cb(void *opaque)
+{
+    PipeTestData *data = opaque;
+    return data->active > 0;
+}
+
+static void pipe_read_cb(void *opaque)
+{
+    PipeTestData *data = opaque;
+    char buf[16];
+
+    g_assert(read(data->fds[0], buf, sizeof(buf)) > 0);
+    data->n++;
+    data->active--;
+}
+
+static void pipe_write(PipeTestData *data)
+{
+    g_assert_cmpint(write(data->fds[1], "x", 1), ==, 1);
+}
+
+static void pipe_init(PipeTestData *data)
+{
+    memset(data, 0, sizeof(*data));
+    g_assert(!qemu_pipe(data->fds));
+    aio_set_fd_handler(ctx, data->fds[0], pipe_read_cb, NULL,
+                       pipe_flush_cb, data);
+}
+
+static void pipe_cleanup(PipeTestData *data)
+{
+    aio_set_fd_handler(ctx, data->fds[0], NULL, NULL, NULL, NULL);
+    close(data->fds[0]);
+    close(data->fds[1]);
+}
+
+/* Tests using aio_*.  */
+
+static void test_notify(void)
+{
+    g_assert(!aio_poll(ctx, false));
+    aio_notify(ctx);
+    g_assert(!aio_poll(ctx, true));
+    g_assert(!aio_poll(ctx, false));
+}
+
+static void test_bh_schedule(void)
+{
+    BHTestData data = { .n = 0 };
+    data.bh = aio_bh_new(ctx, bh_test_cb, &data);
+
+    qemu_bh_schedule(data.bh);
+    g_assert_cmpint(data.n, ==, 0);
+
+    g_assert(aio_pending(ctx));
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data.n, ==, 1);
+
+    g_assert(!aio_poll(ctx, false));
+    g_assert_cmpint(data.n, ==, 1);
+    qemu_bh_delete(data.bh);
+}
+
+static void test_bh_schedule10(void)
+{
+    BHTestData data = { .n = 0, .max = 10 };
+    data.bh = aio_bh_new(ctx, bh_test_cb, &data);
+
+    qemu_bh_schedule(data.bh);
+    g_assert_cmpint(data.n, ==, 0);
+
+    g_assert(aio_poll(ctx, false));
+    g_assert_cmpint(data.n, ==, 1);
+
+    while (data.n < 10) {
+        aio_poll(ctx, true);
+    }
+    g_assert_cmpint(data.n, ==, 10);
+
+    g_assert(!aio_poll(ctx, false));
+    g_assert_cmpint(data.n, ==, 10);
+    qemu_bh_delete(data.bh);
+}
+
+static void test_bh_cancel(void)
+{
+    BHTestData data = { .n = 0 };
+    data.bh = aio_bh_new(ctx, bh_test_cb, &data);
+
+    qemu_bh_schedule(data.bh);
+    g_assert_cmpint(data.n, ==, 0);
+
+    qemu_bh_cancel(data.bh);
+    g_assert_cmpint(data.n, ==, 0);
+
+    g_assert(!aio_poll(ctx, false));
+    g_assert_cmpint(data.n, ==, 0);
+    qemu_bh_delete(data.bh);
+}
+
+static void test_bh_cancel_reschedule(void)
+{
+    BHTestData data = { .n = 0 };
+    data.bh = aio_bh_new(ctx, bh_test_cb, &data);
+
+    /* the BH is still queued after the cancel, but runs only once */
+    qemu_bh_schedule(data.bh);
+    qemu_bh_cancel(data.bh);
+    qemu_bh_schedule(data.bh);
+
+    g_assert(aio_poll(ctx, false));
+    g_assert_cmpint(data.n, ==, 1);
+
+    g_assert(!aio_poll(ctx, false));
+    g_assert_cmpint(data.n, ==, 1);
+    qemu_bh_delete(data.bh);
+}
+
+typedef struct {
+    QEMUBH *bh;
+    int id;
+    int *order;
+    int *n;
+} BHOrderData;
+
+static void bh_order_cb(void *opaque)
+{
+    BHOrderData *data = opaque;
+    data->order[(*data->n)++] = data->id;
+}
+
+static void test_bh_order(void)
+{
+    BHOrderData data[3];
+    int order[3], n = 0;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        data[i].id = i;
+        data[i].order = order;
+        data[i].n = &n;
+        data[i].bh = aio_bh_new(ctx, bh_order_cb, &data[i]);
+    }
+
+    /* BHs run in the order they were scheduled */
+    qemu_bh_schedule(data[1].bh);
+    qemu_bh_schedule(data[2].bh);
+    qemu_bh_schedule(data[0].bh);
+
+    g_assert(aio_poll(ctx, false));
+    g_assert_cmpint(n, ==, 3);
+    g_assert_cmpint(order[0], ==, 1);
+    g_assert_cmpint(order[1], ==, 2);
+    g_assert_cmpint(order[2], ==, 0);
+
+    for (i = 0; i < 3; i++) {
+        qemu_bh_delete(data[i].bh);
+    }
+}
+
+static void test_bh_delete_from_cb(void)
+{
+    BHTestData data1 = { .n = 0, .max = 1 };
+
+    data1.bh = aio_bh_new(ctx, bh_delete_cb, &data1);
+
+    qemu_bh_schedule(data1.bh);
+    g_assert_cmpint(data1.n, ==, 0);
+
+    aio_flush(ctx);
+    g_assert_cmpint(data1.n, ==, data1.max);
+    g_assert(data1.bh == NULL);
+
+    g_assert(!aio_poll(ctx, false));
+}
+
+static void test_flush(void)
+{
+    BHTestData data = { .n = 0, .max = 10 };
+    data.bh = aio_bh_new(ctx, bh_test_cb, &data);
+
+    qemu_bh_schedule(data.bh);
+    g_assert_cmpint(data.n, ==, 0);
+
+    aio_flush(ctx);
+    g_assert_cmpint(data.n, ==, 10);
+
+    g_assert(!aio_poll(ctx, false));
+    g_assert_cmpint(data.n, ==, 10);
+    qemu_bh_delete(data.bh);
+}
+
+static void test_fd_handler(void)
+{
+    PipeTestData data;
+
+    pipe_init(&data);
+    g_assert(!aio_poll(ctx, false));
+    g_assert_cmpint(data.n, ==, 0);
+
+    data.active = 1;
+    pipe_write(&data);
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data.n, ==, 1);
+    g_assert_cmpint(data.active, ==, 0);
+
+    g_assert(!aio_poll(ctx, false));
+    g_assert_cmpint(data.n, ==, 1);
+
+    pipe_cleanup(&data);
+    g_assert(!aio_poll(ctx, false));
+}
+
+static void test_fd_handler_flush(void)
+{
+    PipeTestData data;
+
+    pipe_init(&data);
+    data.active = 2;
+    pipe_write(&data);
+    g_assert(aio_poll(ctx, false));
+    g_assert_cmpint(data.n, ==, 1);
+
+    /* still busy: aio_flush() has to wait for the second write */
+    pipe_write(&data);
+    aio_flush(ctx);
+    g_assert_cmpint(data.n, ==, 2);
+    g_assert_cmpint(data.active, ==, 0);
+
+    pipe_cleanup(&data);
+}
+
+static void test_timer_schedule(void)
+{
+    int n = 0;
+    int64_t start;
+    AioTimer *ts = aio_timer_new(ctx, timer_test_cb, &n);
+
+    start = get_clock();
+    aio_timer_mod(ts, start + 10 * SCALE_MS);
+    g_assert(aio_timer_pending(ts));
+    g_assert_cmpint(aio_timers_deadline(ctx), >, 0);
+
+    /* the timer alone is enough for aio_poll() to block */
+    while (!n) {
+        aio_poll(ctx, true);
+    }
+    g_assert_cmpint(n, ==, 1);
+    g_assert_cmpint(get_clock() - start, >=, 10 * SCALE_MS);
+    g_assert(!aio_timer_pending(ts));
+    g_assert_cmpint(aio_timers_deadline(ctx), ==, -1);
+
+    aio_timer_mod(ts, get_clock() + 10 * SCALE_MS);
+    aio_timer_del(ts);
+    g_assert(!aio_timer_pending(ts));
+    g_assert(!aio_poll(ctx, false));
+    g_assert_cmpint(n, ==, 1);
+
+    aio_timer_free(ts);
+}
+
+static void test_timer_order(void)
+{
+    int n1 = 0, n2 = 0;
+    int64_t now = get_clock();
+    AioTimer *ts1 = aio_timer_new(ctx, timer_test_cb, &n1);
+    AioTimer *ts2 = aio_timer_new(ctx, timer_test_cb, &n2);
+
+    aio_timer_mod(ts1, now + 1000 * SCALE_MS);
+    aio_timer_mod(ts2, now);
+    g_assert_cmpint(aio_timers_deadline(ctx), ==, 0);
+
+    g_assert(aio_timers_run(ctx));
+    g_assert_cmpint(n1, ==, 0);
+    g_assert_cmpint(n2, ==, 1);
+    g_assert(aio_timer_pending(ts1));
+
+    aio_timer_free(ts1);
+    aio_timer_free(ts2);
+    g_assert_cmpint(aio_timers_deadline(ctx), ==, -1);
+}
+
+static void test_timer_clock(void)
+{
+    int n = 0;
+    AioTimer *ts = aio_timer_new_clock(ctx, vm_clock, timer_test_cb, &n);
+
+    /* a stopped clock keeps its timers from firing */
+    qemu_clock_enable(vm_clock, false);
+    aio_timer_mod(ts, qemu_get_clock_ns(vm_clock));
+    g_assert(aio_timer_pending(ts));
+    g_assert_cmpint(aio_timers_deadline(ctx), ==, -1);
+    g_assert(!aio_timers_run(ctx));
+    g_assert_cmpint(n, ==, 0);
+
+    /* restarting it wakes up aio_poll() */
+    qemu_clock_enable(vm_clock, true);
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(n, ==, 1);
+    g_assert(!aio_timer_pending(ts));
+
+    aio_timer_free(ts);
+}
+
+static void *bh_schedule_thread(void *opaque)
+{
+    BHTestData *data = opaque;
+
+    g_usleep(10 * 1000);
+    qemu_bh_schedule(data->bh);
+    return NULL;
+}
+
+static void test_bh_from_thread(void)
+{
+    BHTestData data = { .n = 0 };
+    QemuThread thread;
+
+    data.bh = aio_bh_new(ctx, bh_test_cb, &data);
+    qemu_thread_create(&thread, bh_schedule_thread, &data,
+                       QEMU_THREAD_JOINABLE);
+
+    /* woken up by aio_notify() from the other thread */
+    while (!data.n) {
+        aio_poll(ctx, true);
+    }
+    qemu_thread_join(&thread);
+    g_assert_cmpint(data.n, ==, 1);
+    qemu_bh_delete(data.bh);
+}
+
+int main(int argc, char **argv)
+{
+    init_clocks();
+    ctx = aio_context_new();
+
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/aio/notify",                  test_notify);
+    g_test_add_func("/aio/flush",                   test_flush);
+    g_test_add_func("/aio/bh/schedule",             test_bh_schedule);
+    g_test_add_func("/aio/bh/schedule10",           test_bh_schedule10);
+    g_test_add_func("/aio/bh/cancel",               test_bh_cancel);
+    g_test_add_func("/aio/bh/cancel-reschedule",    test_bh_cancel_reschedule);
+    g_test_add_func("/aio/bh/order",                test_bh_order);
+    g_test_add_func("/aio/bh/delete-from-cb",       test_bh_delete_from_cb);
+    g_test_add_func("/aio/bh/from-thread",          test_bh_from_thread);
+    g_test_add_func("/aio/fd-handler/basic",        test_fd_handler);
+    g_test_add_func("/aio/fd-handler/flush",        test_fd_handler_flush);
+    g_test_add_func("/aio/timer/schedule",          test_timer_schedule);
+    g_test_add_func("/aio/timer/order",             test_timer_order);
+    g_test_add_func("/aio/timer/clock",             test_timer_clock);
+    return g_test_run();
+}
@@ -0,0 +1,91 @@
+/*
+ * Internet checksum unit tests
+ *
+ * Copyright Red Hat, Inc. 2012
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "net/checksum.h"
+
+/* one byte at a time, the way the checksum is defined */
+static uint16_t ref_checksum(int len, const uint8_t *buf)
+{
+    uint32_t sum = 0;
+    int i;
+
+    for (i = 0; i < len; i++) {
+        sum += (i & 1) ? buf[i] : buf[i] << 8;
+    }
+    return net_checksum_finish(sum);
+}
+
+static void fill(uint8_t *buf, int len)
+{
+    int i;
+
+    for (i = 0; i < len; i++) {
+        buf[i] = g_test_rand_int();
+    }
+}
+
+static void test_add(void)
+{
+    uint8_t buf[1600];
+    int len;
+
+    fill(buf, sizeof(buf));
+    for (len = 0; len <= sizeof(buf); len++) {
+        g_assert_cmpint(net_checksum_finish(net_checksum_add(len, buf)), ==,
+                        ref_checksum(len, buf));
+        /* unaligned buffers */
+        if (len) {
+            g_assert_cmpint(
+                net_checksum_finish(net_checksum_add(len - 1, buf + 1)), ==,
+                ref_checksum(len - 1, buf + 1));
+        }
+    }
+}
+
+static void test_add_ones(void)
+{
+    static uint8_t buf[0x10000];
+
+    /* the largest sums must not overflow the accumulator */
+    memset(buf, 0xff, sizeof(buf));
+    g_assert_cmpint(net_checksum_finish(net_checksum_add(sizeof(buf), buf)),
+                    ==, ref_checksum(sizeof(buf), buf));
+    g_assert_cmpint(net_checksum_finish(net_checksum_add(7, buf)), ==,
+                    ref_checksum(7, buf));
+}
+
+static void test_add_cont(void)
+{
+    uint8_t buf[1500];
+    uint16_t expected;
+    uint32_t sum;
+    int split;
+
+    fill(buf, sizeof(buf));
+    expected = ref_checksum(sizeof(buf), buf);
+
+    /* summing in two pieces gives the same result at any split point */
+    for (split = 0; split <= sizeof(buf); split++) {
+        sum = net_checksum_add(split, buf) +
+              net_checksum_add_cont(sizeof(buf) - split, buf + split, split);
+        g_assert_cmpint(net_checksum_finish(sum), ==, expected);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/checksum/add",                test_add);
+    g_test_add_func("/checksum/add-ones",           test_add_ones);
+    g_test_add_func("/checksum/add-cont",           test_add_cont);
+    return g_test_run();
+}
@@ -122,6 +122,49 @@ static void test_yield(void)
     g_assert_cmpint(i, ==, 5); /* coroutine must yield 5 times */
 }
 
+/*
+ * Check that named mutexes count their acquisitions when enabled
+ */
+
+static void coroutine_fn lock_twice(void *opaque)
+{
+    CoMutex *mutex = opaque;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        qemu_co_mutex_lock(mutex);
+        qemu_co_mutex_unlock(mutex);
+    }
+}
+
+static void test_mutex_stats(void)
+{
+    CoMutex mutex;
+    uint64_t holds = 0;
+    int i;
+
+    qemu_co_mutex_init(&mutex);
+    qemu_co_mutex_set_name(&mutex, "test");
+
+    qemu_coroutine_enter(qemu_coroutine_create(lock_twice), &mutex);
+    g_assert_cmpint(mutex.stats->acquisitions, ==, 0);
+
+    lock_stats_set_enabled(true);
+    qemu_coroutine_enter(qemu_coroutine_create(lock_twice), &mutex);
+    lock_stats_set_enabled(false);
+    g_assert_cmpint(mutex.stats->acquisitions, ==, 2);
+    g_assert_cmpint(mutex.stats->contended, ==, 0);
+    g_assert(mutex.stats->callers[0].caller != NULL);
+    g_assert_cmpint(mutex.stats->callers[0].acquisitions, ==, 2);
+    for (i = 0; i < LOCK_STATS_BINS; i++) {
+        holds += mutex.stats->hold_bins[i];
+    }
+    g_assert_cmpint(holds, ==, 2);
+
+    qemu_co_mutex_destroy(&mutex);
+    g_assert(mutex.stats == NULL);
+}
+
 /*
  * Check that creation, enter, and return work
  */
@@ -150,6 +193,42 @@ static void test_lifecycle(void)
     g_assert(done); /* expect done to be true (second time) */
 }
 
+/*
+ * Check that terminated coroutines are reused
+ */
+
+static void test_pool(void)
+{
+    CoroutinePoolStats before, after;
+    Coroutine *first, *second;
+    bool done = false;
+
+    qemu_coroutine_get_pool_stats(&before);
+
+    first = qemu_coroutine_create(set_and_exit);
+    qemu_coroutine_enter(first, &done);
+    g_assert(done);
+
+    done = false;
+    second = qemu_coroutine_create(set_and_exit);
+    qemu_coroutine_enter(second, &done);
+    g_assert(done);
+
+    qemu_coroutine_get_pool_stats(&after);
+    g_assert_cmpint(after.hits + after.misses, ==,
+                    before.hits + before.misses + 2);
+    g_assert_cmpint(after.size, <=, after.max_size);
+
+    if (after.max_size) {
+        /* the most recently terminated coroutine is reused first */
+        g_assert(second == first);
+        g_assert_cmpint(after.hits, >=, before.hits + 1);
+        g_assert_cmpint(after.size, >=, 1);
+    } else {
+        g_assert_cmpint(after.hits, ==, before.hits);
+    }
+}
+
 /*
  * Lifecycle benchmark
  */
@@ -159,14 +238,34 @@ static void coroutine_fn empty_coroutine(void *opaque)
     /* Do nothing */
 }
 
+static void perf_message_pool(const char *name, unsigned int n,
+                              double duration,
+                              const CoroutinePoolStats *before)
+{
+    CoroutinePoolStats after;
+    uint64_t hits, misses;
+
+    qemu_coroutine_get_pool_stats(&after);
+    hits = after.hits - before->hits;
+    misses = after.misses - before->misses;
+
+    g_test_message("%s %u coroutines: %f s, %.0f coroutines/s, "
+                   "pool hit rate %.1f%% (size %u of %u)\n",
+                   name, n, duration, n / duration,
+                   hits + misses ? 100.0 * hits / (hits + misses) : 0.0,
+                   after.size, after.max_size);
+}
+
 static void perf_lifecycle(void)
 {
     Coroutine *coroutine;
+    CoroutinePoolStats stats;
     unsigned int i, max;
     double duration;
 
     max = 1000000;
 
+    qemu_coroutine_get_pool_stats(&stats);
     g_test_timer_start();
     for (i = 0; i < max; i++) {
         coroutine = qemu_coroutine_create(empty_coroutine);
@@ -174,7 +273,45 @@ static void perf_lifecycle(void)
     }
     duration = g_test_timer_elapsed();
 
-    g_test_message("Lifecycle %u iterations: %f s\n", max, duration);
+    perf_message_pool("Lifecycle", max, duration, &stats);
+}
+
+/*
+ * Like perf_lifecycle, but with many coroutines alive at the same time,
+ * the way requests are in flight during parallel I/O
+ */
+
+static void coroutine_fn yield_once(void *opaque)
+{
+    qemu_coroutine_yield();
+}
+
+static void perf_lifecycle_batch(void)
+{
+    Coroutine *coroutines[128];
+    CoroutinePoolStats stats;
+    unsigned int i, j, batch, max;
+    double duration;
+
+    max = 10000;
+
+    for (batch = 16; batch <= G_N_ELEMENTS(coroutines); batch *= 2) {
+        qemu_coroutine_get_pool_stats(&stats);
+        g_test_timer_start();
+        for (i = 0; i < max; i++) {
+            for (j = 0; j < batch; j++) {
+                coroutines[j] = qemu_coroutine_create(yield_once);
+                qemu_coroutine_enter(coroutines[j], NULL);
+            }
+            for (j = 0; j < batch; j++) {
+                qemu_coroutine_enter(coroutines[j], NULL);
+            }
+        }
+        duration = g_test_timer_elapsed();
+
+        g_test_message("Batches of %u:\n", batch);
+        perf_message_pool("Lifecycle", max * batch, duration, &stats);
+    }
 }
 
 static void perf_nesting(void)
@@ -207,12 +344,15 @@ int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
     g_test_add_func("/basic/lifecycle", test_lifecycle);
+    g_test_add_func("/basic/pool", test_pool);
     g_test_add_func("/basic/yield", test_yield);
     g_test_add_func("/basic/nesting", test_nesting);
     g_test_add_func("/basic/self", test_self);
     g_test_add_func("/basic/in_coroutine", test_in_coroutine);
+    g_test_add_func("/basic/mutex_stats", test_mutex_stats);
     if (g_test_perf()) {
         g_test_add_func("/perf/lifecycle", perf_lifecycle);
+        g_test_add_func("/perf/lifecycle-batch", perf_lifecycle_batch);
         g_test_add_func("/perf/nesting", perf_nesting);
     }
     return g_test_run();
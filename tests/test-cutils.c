@@ -0,0 +1,48 @@
+/*
+ * cutils.c unit-tests
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+
+#define BUF_SIZE 8192
+
+/* buffer_is_zero() picks a vector implementation depending on the
+ * alignment and length; exercise both the vector and the fallback paths.
+ */
+static void test_buffer_is_zero(void)
+{
+    uint8_t *mem = qemu_memalign(64, BUF_SIZE + 64);
+    size_t off, len, i;
+
+    for (off = 0; off < 64; off += sizeof(long)) {
+        for (len = 4 * sizeof(long); len <= BUF_SIZE; len *= 2) {
+            uint8_t *buf = mem + off;
+
+            memset(mem, 0, BUF_SIZE + 64);
+            g_assert(buffer_is_zero(buf, len));
+
+            for (i = 0; i < len; i++) {
+                buf[i] = 1;
+                g_assert(!buffer_is_zero(buf, len));
+                buf[i] = 0;
+            }
+
+            /* bytes past the end do not count */
+            buf[len] = 1;
+            g_assert(buffer_is_zero(buf, len));
+        }
+    }
+
+    qemu_vfree(mem);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/cutils/buffer_is_zero", test_buffer_is_zero);
+    return g_test_run();
+}
@@ -145,6 +145,132 @@ static void test_to_from_buf(void)
     }
 }
 
+static void test_to_iov_1(void)
+{
+    unsigned dniov, sniov;
+    struct iovec *diov, *siov;
+    size_t dsz, ssz, i, j, n, o;
+    unsigned char *buf;
+
+    iov_random(&diov, &dniov);
+    iov_random(&siov, &sniov);
+    dsz = iov_size(diov, dniov);
+    ssz = iov_size(siov, sniov);
+
+    buf = g_malloc(ssz);
+    for (i = 0; i < ssz; ++i) {
+        buf[i] = i & 255;
+    }
+    iov_from_buf(siov, sniov, 0, buf, ssz);
+
+    for (i = 0; i <= ssz; ++i) {
+        for (j = 0; j <= dsz; ++j) {
+            /* copy source bytes [i..) to destination bytes [j..) */
+            iov_memset(diov, dniov, 0, 0xff, -1);
+            n = iov_to_iov(diov, dniov, j, siov, sniov, i, -1);
+            g_assert(n == MIN(ssz - i, dsz - j));
+
+            /* bytes [j..j+n) of the destination hold i, i+1, ... */
+            for (o = 0; o < dsz; ++o) {
+                unsigned char c;
+                iov_to_buf(diov, dniov, o, &c, 1);
+                if (o >= j && o < j + n) {
+                    g_assert(c == ((o - j + i) & 255));
+                } else {
+                    g_assert(c == 0xff);
+                }
+            }
+
+            /* a limited count stops early */
+            n = iov_to_iov(diov, dniov, j, siov, sniov, i, 1);
+            g_assert(n == (i < ssz && j < dsz));
+        }
+    }
+    g_free(buf);
+    iov_free(diov, dniov);
+    iov_free(siov, sniov);
+}
+
+static void test_to_iov(void)
+{
+    int x;
+    for (x = 0; x < 4; ++x) {
+        test_to_iov_1();
+    }
+}
+
+static void test_cursor(void)
+{
+    unsigned niov;
+    struct iovec *iov;
+    IOVCursor cur;
+    size_t sz, i, n, step;
+    unsigned char *buf, c[20];
+
+    iov_random(&iov, &niov);
+    sz = iov_size(iov, niov);
+    buf = g_malloc(sz);
+    for (i = 0; i < sz; ++i) {
+        buf[i] = i & 255;
+    }
+    iov_from_buf(iov, niov, 0, buf, sz);
+
+    /* reading in steps of every size gives the same bytes as iov_to_buf */
+    for (step = 1; step < sizeof(c); ++step) {
+        iov_cursor_init(&cur, iov, niov, 0);
+        for (i = 0; i < sz; i += n) {
+            n = iov_cursor_to_buf(&cur, c, step);
+            g_assert(n == MIN(step, sz - i));
+            g_assert(memcmp(c, buf + i, n) == 0);
+        }
+        g_assert(cur.cnt == 0);
+        g_assert(iov_cursor_to_buf(&cur, c, step) == 0);
+    }
+
+    /* skip, then write through the cursor */
+    iov_memset(iov, niov, 0, 0xff, -1);
+    iov_cursor_init(&cur, iov, niov, 0);
+    g_assert(iov_cursor_skip(&cur, 3) == MIN(3, sz));
+    n = iov_cursor_from_buf(&cur, buf + 3, sz - 3);
+    g_assert(n == sz - 3);
+    test_iov_bytes(iov, niov, 3, sz - 3);
+
+    g_free(buf);
+    iov_free(iov, niov);
+}
+
+/* large enough for the non-temporal copy, with unaligned pieces */
+static void test_to_iov_large(void)
+{
+    const size_t sz = 1024 * 1024;
+    unsigned char *sbuf = g_malloc(sz + 1), *dbuf = g_malloc(sz + 1);
+    struct iovec siov[3], diov[2];
+    size_t i, n;
+
+    for (i = 0; i <= sz; ++i) {
+        sbuf[i] = (i * 7) & 255;
+    }
+    memset(dbuf, 0, sz + 1);
+    siov[0].iov_base = sbuf + 1;
+    siov[0].iov_len = 5;
+    siov[1].iov_base = sbuf + 6;
+    siov[1].iov_len = sz / 2;
+    siov[2].iov_base = sbuf + 6 + sz / 2;
+    siov[2].iov_len = sz - 5 - sz / 2;
+    diov[0].iov_base = dbuf + 1;
+    diov[0].iov_len = sz / 3;
+    diov[1].iov_base = dbuf + 1 + sz / 3;
+    diov[1].iov_len = sz - sz / 3;
+
+    n = iov_to_iov(diov, 2, 0, siov, 3, 0, -1);
+    g_assert(n == sz);
+    g_assert(memcmp(dbuf + 1, sbuf + 1, sz) == 0);
+    g_assert(dbuf[0] == 0);
+
+    g_free(sbuf);
+    g_free(dbuf);
+}
+
 static void test_io(void)
 {
 #ifndef _WIN32
@@ -255,6 +381,9 @@ int main(int argc, char **argv)
     g_test_init(&argc, &argv, NULL);
     g_test_rand_int();
     g_test_add_func("/basic/iov/from-to-buf", test_to_from_buf);
+    g_test_add_func("/basic/iov/to-iov", test_to_iov);
+    g_test_add_func("/basic/iov/to-iov-large", test_to_iov_large);
+    g_test_add_func("/basic/iov/cursor", test_cursor);
     g_test_add_func("/basic/iov/io", test_io);
     return g_test_run();
 }
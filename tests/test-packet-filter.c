@@ -0,0 +1,145 @@
+/*
+ * Packet filter unit tests
+ *
+ * Copyright Red Hat, Inc. 2012
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#include <glib.h>
+#include <string.h>
+#include "net/packet-filter.h"
+
+/* 52:54:00:12:34:56 -> ff:ff:ff:ff:ff:ff, ARP */
+static const uint8_t arp_frame[42] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x52, 0x54, 0x00, 0x12, 0x34, 0x56,
+    0x08, 0x06,
+};
+
+/* 52:54:00:12:34:56 -> 52:54:00:12:34:57, 10.0.2.15:1234 -> 10.0.2.2:80 */
+static uint8_t tcp_frame[54] = {
+    0x52, 0x54, 0x00, 0x12, 0x34, 0x57, 0x52, 0x54, 0x00, 0x12, 0x34, 0x56,
+    0x08, 0x00,
+    0x45, 0x00, 0x00, 0x28, 0x00, 0x00, 0x00, 0x00, 0x40, 0x06, 0x00, 0x00,
+    10, 0, 2, 15, 10, 0, 2, 2,
+    0x04, 0xd2, 0x00, 0x50,
+};
+
+static bool match(const char *expr, const uint8_t *buf, size_t size)
+{
+    PacketFilter *f = packet_filter_new(expr);
+    bool ret;
+
+    g_assert(f);
+    ret = packet_filter_match(f, buf, size);
+    packet_filter_free(f);
+    return ret;
+}
+
+static void test_parse(void)
+{
+    static const char *valid[] = {
+        "tcp", "not arp", "!arp", "tcp and port 80", "tcp&&port 80",
+        "(udp or tcp) and not (host 10.0.2.2)", "!(ip)",
+        "ether src host 52:54:00:12:34:56", "ether proto 0x0800",
+        "src port 1234 || dst port 53", "less 100 and greater 60",
+    };
+    static const char *invalid[] = {
+        "", "foo", "tcp and", "(tcp", "tcp)", "port", "port 70000",
+        "host 10.0.2", "host 10.0.2.256", "ether host 52:54", "not",
+        "tcp udp", "ether proto 0x10000",
+    };
+    int i;
+
+    for (i = 0; i < G_N_ELEMENTS(valid); i++) {
+        PacketFilter *f = packet_filter_new(valid[i]);
+        g_assert(f);
+        packet_filter_free(f);
+    }
+    for (i = 0; i < G_N_ELEMENTS(invalid); i++) {
+        g_assert(!packet_filter_new(invalid[i]));
+    }
+}
+
+static void test_ether(void)
+{
+    g_assert(match("arp", arp_frame, sizeof(arp_frame)));
+    g_assert(!match("ip", arp_frame, sizeof(arp_frame)));
+    g_assert(match("broadcast and multicast", arp_frame, sizeof(arp_frame)));
+    g_assert(!match("broadcast", tcp_frame, sizeof(tcp_frame)));
+    g_assert(match("ether src host 52:54:00:12:34:56",
+                   tcp_frame, sizeof(tcp_frame)));
+    g_assert(!match("ether dst host 52:54:00:12:34:56",
+                    tcp_frame, sizeof(tcp_frame)));
+    g_assert(match("ether host 52:54:00:12:34:57",
+                   tcp_frame, sizeof(tcp_frame)));
+    g_assert(match("ether proto 0x806", arp_frame, sizeof(arp_frame)));
+    g_assert(!match("vlan", tcp_frame, sizeof(tcp_frame)));
+
+    /* runt frames match nothing but their length */
+    g_assert(!match("arp", arp_frame, 10));
+    g_assert(match("not ip and less 10", arp_frame, 10));
+}
+
+static void test_ip(void)
+{
+    g_assert(match("ip and tcp", tcp_frame, sizeof(tcp_frame)));
+    g_assert(!match("udp or icmp or ip6", tcp_frame, sizeof(tcp_frame)));
+    g_assert(match("host 10.0.2.15", tcp_frame, sizeof(tcp_frame)));
+    g_assert(match("src host 10.0.2.15 and dst host 10.0.2.2",
+                   tcp_frame, sizeof(tcp_frame)));
+    g_assert(!match("dst host 10.0.2.15", tcp_frame, sizeof(tcp_frame)));
+    g_assert(match("tcp and port 80", tcp_frame, sizeof(tcp_frame)));
+    g_assert(match("src port 1234", tcp_frame, sizeof(tcp_frame)));
+    g_assert(!match("src port 80", tcp_frame, sizeof(tcp_frame)));
+    g_assert(match("greater 54 and less 54", tcp_frame, sizeof(tcp_frame)));
+    g_assert(!match("greater 55", tcp_frame, sizeof(tcp_frame)));
+
+    /* non-first fragments have no ports */
+    tcp_frame[20] = 0x00;
+    tcp_frame[21] = 0x10;
+    g_assert(match("tcp", tcp_frame, sizeof(tcp_frame)));
+    g_assert(!match("port 80", tcp_frame, sizeof(tcp_frame)));
+    tcp_frame[21] = 0x00;
+}
+
+static void test_vlan(void)
+{
+    uint8_t frame[58];
+
+    /* insert an 802.1Q tag into the TCP frame */
+    memcpy(frame, tcp_frame, 12);
+    frame[12] = 0x81;
+    frame[13] = 0x00;
+    frame[14] = 0x00;
+    frame[15] = 0x05;
+    memcpy(frame + 16, tcp_frame + 12, sizeof(tcp_frame) - 12);
+
+    g_assert(match("vlan and tcp and port 80", frame, sizeof(frame)));
+    g_assert(match("ip", frame, sizeof(frame)));
+}
+
+static void test_precedence(void)
+{
+    /* "and" binds tighter than "or", "not" tighter than both */
+    g_assert(match("arp or tcp and port 80", tcp_frame, sizeof(tcp_frame)));
+    g_assert(match("arp or udp and port 80", arp_frame, sizeof(arp_frame)));
+    g_assert(!match("(arp or udp) and port 80",
+                    arp_frame, sizeof(arp_frame)));
+    g_assert(match("not arp and tcp", tcp_frame, sizeof(tcp_frame)));
+    g_assert(!match("not (arp or tcp)", tcp_frame, sizeof(tcp_frame)));
+    g_assert(match("!!tcp", tcp_frame, sizeof(tcp_frame)));
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/net/packet-filter/parse",      test_parse);
+    g_test_add_func("/net/packet-filter/ether",      test_ether);
+    g_test_add_func("/net/packet-filter/ip",         test_ip);
+    g_test_add_func("/net/packet-filter/vlan",       test_vlan);
+    g_test_add_func("/net/packet-filter/precedence", test_precedence);
+    return g_test_run();
+}
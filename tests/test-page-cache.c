@@ -0,0 +1,127 @@
+/*
+ * Page cache unit tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "qemu/page_cache.h"
+
+#define PAGE_SIZE 4096
+#define NUM_PAGES 64
+
+static uint8_t *page(uint8_t val)
+{
+    uint8_t *p = g_malloc(PAGE_SIZE);
+
+    memset(p, val, PAGE_SIZE);
+    return p;
+}
+
+/* Addresses that map to the same set */
+static uint64_t colliding(int n)
+{
+    return (uint64_t)n * (NUM_PAGES / PAGE_CACHE_WAYS) * PAGE_SIZE;
+}
+
+static void test_insert(void)
+{
+    PageCache *cache = cache_init(NUM_PAGES, PAGE_SIZE);
+
+    g_assert(!cache_is_cached(cache, 0));
+    g_assert(get_cached_data(cache, 0) == NULL);
+
+    cache_insert(cache, 0, page(1));
+    g_assert(cache_is_cached(cache, 0));
+    g_assert_cmpint(get_cached_data(cache, 0)[0], ==, 1);
+
+    /* replacing the data of a cached page */
+    cache_insert(cache, 0, page(2));
+    g_assert_cmpint(get_cached_data(cache, 0)[0], ==, 2);
+
+    cache_fini(cache);
+    g_free(cache);
+}
+
+/* Pages that map to the same set do not evict each other until it is full */
+static void test_associative(void)
+{
+    PageCache *cache = cache_init(NUM_PAGES, PAGE_SIZE);
+    int i;
+
+    for (i = 0; i < PAGE_CACHE_WAYS; i++) {
+        cache_insert(cache, colliding(i), page(i));
+    }
+    for (i = 0; i < PAGE_CACHE_WAYS; i++) {
+        g_assert(cache_is_cached(cache, colliding(i)));
+        g_assert_cmpint(get_cached_data(cache, colliding(i))[0], ==, i);
+    }
+
+    cache_fini(cache);
+    g_free(cache);
+}
+
+static void test_lru(void)
+{
+    PageCache *cache = cache_init(NUM_PAGES, PAGE_SIZE);
+    int i;
+
+    for (i = 0; i < PAGE_CACHE_WAYS; i++) {
+        cache_insert(cache, colliding(i), page(i));
+    }
+
+    /* page 0 was used last, so page 1 is the one to go */
+    get_cached_data(cache, colliding(0));
+    cache_insert(cache, colliding(PAGE_CACHE_WAYS), page(0xff));
+
+    g_assert(cache_is_cached(cache, colliding(0)));
+    g_assert(!cache_is_cached(cache, colliding(1)));
+    for (i = 2; i <= PAGE_CACHE_WAYS; i++) {
+        g_assert(cache_is_cached(cache, colliding(i)));
+    }
+
+    cache_fini(cache);
+    g_free(cache);
+}
+
+/* Shrinking the cache keeps the most recently used pages of each set */
+static void test_resize(void)
+{
+    PageCache *cache = cache_init(NUM_PAGES, PAGE_SIZE);
+    int i;
+
+    for (i = 0; i < NUM_PAGES; i++) {
+        cache_insert(cache, (uint64_t)i * PAGE_SIZE, page(i));
+    }
+    for (i = 0; i < NUM_PAGES; i++) {
+        g_assert(cache_is_cached(cache, (uint64_t)i * PAGE_SIZE));
+    }
+
+    g_assert_cmpint(cache_resize(cache, NUM_PAGES / 2), ==, NUM_PAGES / 2);
+    for (i = 0; i < NUM_PAGES; i++) {
+        g_assert(cache_is_cached(cache, (uint64_t)i * PAGE_SIZE) ==
+                 (i >= NUM_PAGES / 2));
+    }
+    g_assert_cmpint(get_cached_data(cache, (NUM_PAGES - 1) * PAGE_SIZE)[0],
+                    ==, NUM_PAGES - 1);
+
+    g_assert_cmpint(cache_resize(cache, NUM_PAGES), ==, NUM_PAGES);
+    for (i = NUM_PAGES / 2; i < NUM_PAGES; i++) {
+        g_assert(cache_is_cached(cache, (uint64_t)i * PAGE_SIZE));
+    }
+
+    cache_fini(cache);
+    g_free(cache);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/page_cache/insert", test_insert);
+    g_test_add_func("/page_cache/associative", test_associative);
+    g_test_add_func("/page_cache/lru", test_lru);
+    g_test_add_func("/page_cache/resize", test_resize);
+    return g_test_run();
+}
@@ -0,0 +1,150 @@
+/*
+ * Leaky bucket throttling unit tests
+ *
+ * Copyright Red Hat, Inc. 2012
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#include <glib.h>
+#include "qemu-throttle.h"
+
+#define NS_PER_SEC 1000000000LL
+
+static void test_init(void)
+{
+    ThrottleState ts;
+
+    throttle_init(&ts, 42);
+    g_assert(!throttle_enabled(&ts));
+    g_assert_cmpint(ts.previous_leak, ==, 42);
+
+    /* nothing configured: requests never wait */
+    throttle_account(&ts, false, 1 << 20);
+    g_assert_cmpint(throttle_compute_wait(&ts, false, 42), ==, 0);
+}
+
+static void test_config(void)
+{
+    ThrottleState ts;
+
+    throttle_init(&ts, 0);
+    throttle_config_bucket(&ts.bps[THROTTLE_TOTAL], 1000, 0);
+    g_assert(throttle_enabled(&ts));
+    /* default burst is a tenth of a second */
+    g_assert_cmpfloat(ts.bps[THROTTLE_TOTAL].max, ==, 100);
+
+    throttle_config_bucket(&ts.bps[THROTTLE_TOTAL], 1000, 5000);
+    g_assert_cmpfloat(ts.bps[THROTTLE_TOTAL].max, ==, 5000);
+
+    /* lowering the burst drops what was above it */
+    ts.bps[THROTTLE_TOTAL].level = 4000;
+    throttle_config_bucket(&ts.bps[THROTTLE_TOTAL], 1000, 2000);
+    g_assert_cmpfloat(ts.bps[THROTTLE_TOTAL].level, ==, 2000);
+
+    throttle_config_bucket(&ts.bps[THROTTLE_TOTAL], 0, 0);
+    g_assert(!throttle_enabled(&ts));
+}
+
+static void test_leak(void)
+{
+    ThrottleState ts;
+
+    throttle_init(&ts, 0);
+    throttle_config_bucket(&ts.bps[THROTTLE_READ], 1000, 0);
+    ts.bps[THROTTLE_READ].level = 1000;
+
+    throttle_leak(&ts, NS_PER_SEC / 2);
+    g_assert_cmpfloat(ts.bps[THROTTLE_READ].level, ==, 500);
+
+    /* time going backwards leaks nothing */
+    throttle_leak(&ts, 0);
+    g_assert_cmpfloat(ts.bps[THROTTLE_READ].level, ==, 500);
+
+    /* the bucket does not go below empty */
+    throttle_leak(&ts, 10 * NS_PER_SEC);
+    g_assert_cmpfloat(ts.bps[THROTTLE_READ].level, ==, 0);
+}
+
+static void test_wait(void)
+{
+    ThrottleState ts;
+    int64_t wait;
+
+    throttle_init(&ts, 0);
+    throttle_config_bucket(&ts.bps[THROTTLE_WRITE], 1000, 100);
+
+    /* a request goes as long as the bucket is not full... */
+    throttle_account(&ts, true, 600);
+    g_assert_cmpfloat(ts.bps[THROTTLE_WRITE].level, ==, 600);
+    g_assert_cmpfloat(ts.bps[THROTTLE_TOTAL].level, ==, 600);
+
+    /* ...and then has to wait for the excess to leak */
+    wait = throttle_compute_wait(&ts, true, 0);
+    g_assert_cmpint(wait, >, NS_PER_SEC / 2 - 1000);
+    g_assert_cmpint(wait, <=, NS_PER_SEC / 2 + 1000);
+    g_assert_cmpint(throttle_compute_wait(&ts, true, wait), ==, 0);
+
+    /* reads are not affected by the write limit */
+    throttle_account(&ts, true, 600);
+    g_assert_cmpint(throttle_compute_wait(&ts, false, wait), ==, 0);
+    g_assert_cmpint(throttle_compute_wait(&ts, true, wait), >, 0);
+}
+
+static void test_burst(void)
+{
+    ThrottleState ts;
+    int i;
+
+    throttle_init(&ts, 0);
+    throttle_config_bucket(&ts.ops[THROTTLE_TOTAL], 10, 50);
+
+    /* 50 operations at once fit the burst, the next one waits */
+    for (i = 0; i < 50; i++) {
+        g_assert_cmpint(throttle_compute_wait(&ts, i & 1, 0), ==, 0);
+        throttle_account(&ts, i & 1, 4096);
+    }
+    g_assert_cmpint(throttle_compute_wait(&ts, false, 0), ==, 0);
+    throttle_account(&ts, false, 4096);
+    g_assert_cmpint(throttle_compute_wait(&ts, false, 0), >, 0);
+
+    /* a tenth of a second later one operation has leaked */
+    g_assert_cmpint(throttle_compute_wait(&ts, false, NS_PER_SEC / 10), ==, 0);
+}
+
+static void test_op_size(void)
+{
+    ThrottleState ts;
+
+    throttle_init(&ts, 0);
+    throttle_config_bucket(&ts.ops[THROTTLE_TOTAL], 100, 0);
+
+    /* without an operation size, any request is one operation */
+    throttle_account(&ts, false, 64 * 1024);
+    g_assert_cmpfloat(ts.ops[THROTTLE_TOTAL].level, ==, 1);
+
+    ts.ops[THROTTLE_TOTAL].level = 0;
+    ts.op_size = 4096;
+    throttle_account(&ts, false, 64 * 1024);
+    g_assert_cmpfloat(ts.ops[THROTTLE_TOTAL].level, ==, 16);
+    g_assert_cmpfloat(ts.ops[THROTTLE_READ].level, ==, 17);
+
+    /* small requests still count as one */
+    throttle_account(&ts, true, 512);
+    g_assert_cmpfloat(ts.ops[THROTTLE_TOTAL].level, ==, 17);
+    g_assert_cmpfloat(ts.ops[THROTTLE_WRITE].level, ==, 1);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/throttle/init",               test_init);
+    g_test_add_func("/throttle/config",             test_config);
+    g_test_add_func("/throttle/leak",               test_leak);
+    g_test_add_func("/throttle/wait",               test_wait);
+    g_test_add_func("/throttle/burst",              test_burst);
+    g_test_add_func("/throttle/op-size",            test_op_size);
+    return g_test_run();
+}
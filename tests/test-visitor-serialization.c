@@ -19,6 +19,7 @@
 #include "qemu-objects.h"
 #include "qapi/qmp-input-visitor.h"
 #include "qapi/qmp-output-visitor.h"
+#include "qapi/json-output-visitor.h"
 #include "qapi/string-input-visitor.h"
 #include "qapi/string-output-visitor.h"
 
@@ -668,6 +669,40 @@ static void qmp_cleanup(void *datap)
     qmp_input_visitor_cleanup(d->qiv);
 }
 
+typedef struct JsonSerializeData {
+    JsonOutputVisitor *jov;
+    QmpInputVisitor *qiv;
+} JsonSerializeData;
+
+static void json_serialize(void *native_in, void **datap,
+                           VisitorFunc visit, Error **errp)
+{
+    JsonSerializeData *d = g_malloc0(sizeof(*d));
+
+    d->jov = json_output_visitor_new();
+    visit(json_output_get_visitor(d->jov), &native_in, errp);
+    *datap = d;
+}
+
+static void json_deserialize(void **native_out, void *datap,
+                             VisitorFunc visit, Error **errp)
+{
+    JsonSerializeData *d = datap;
+    QString *output_json = json_output_get_string(d->jov);
+    QObject *obj = qobject_from_json(qstring_get_str(output_json));
+
+    QDECREF(output_json);
+    d->qiv = qmp_input_visitor_new(obj);
+    visit(qmp_input_get_visitor(d->qiv), native_out, errp);
+}
+
+static void json_cleanup(void *datap)
+{
+    JsonSerializeData *d = datap;
+    json_output_visitor_cleanup(d->jov);
+    qmp_input_visitor_cleanup(d->qiv);
+}
+
 typedef struct StringSerializeData {
     StringOutputVisitor *sov;
     StringInputVisitor *siv;
@@ -713,6 +748,13 @@ static const SerializeOps visitors[] = {
         .cleanup = qmp_cleanup,
         .caps = VCAP_PRIMITIVES | VCAP_STRUCTURES | VCAP_LISTS
     },
+    {
+        .type = "JSON",
+        .serialize = json_serialize,
+        .deserialize = json_deserialize,
+        .cleanup = json_cleanup,
+        .caps = VCAP_PRIMITIVES | VCAP_STRUCTURES | VCAP_LISTS
+    },
     {
         .type = "String",
         .serialize = string_serialize,
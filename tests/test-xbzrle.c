@@ -0,0 +1,171 @@
+/*
+ * Xor Based Zero Run Length Encoding unit tests and micro-benchmark.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * Run with "-m perf" to compare the vector encoder with the scalar one.
+ */
+#include <glib.h>
+#include "qemu-common.h"
+#include "migration.h"
+
+#define PAGE_SIZE 4096
+
+typedef int XBZRLEEncodeFunc(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                             uint8_t *dst, int dlen);
+
+/* Dirty @nruns random runs of at most @maxlen bytes each */
+static void scribble(uint8_t *buf, int nruns, int maxlen)
+{
+    int i, j;
+
+    for (i = 0; i < nruns; i++) {
+        int len = g_test_rand_int_range(1, maxlen + 1);
+        int start = g_test_rand_int_range(0, PAGE_SIZE - len + 1);
+
+        for (j = start; j < start + len; j++) {
+            buf[j] ^= g_test_rand_int_range(1, 256);
+        }
+    }
+}
+
+static void test_unchanged(void)
+{
+    uint8_t *old = g_malloc0(PAGE_SIZE);
+    uint8_t *dst = g_malloc0(PAGE_SIZE);
+
+    g_assert_cmpint(xbzrle_encode_buffer(old, old, PAGE_SIZE, dst,
+                                         PAGE_SIZE), ==, 0);
+    g_assert_cmpint(xbzrle_encode_buffer_scalar(old, old, PAGE_SIZE, dst,
+                                                PAGE_SIZE), ==, 0);
+    g_free(old);
+    g_free(dst);
+}
+
+static void test_overflow(void)
+{
+    uint8_t *old = g_malloc0(PAGE_SIZE);
+    uint8_t *new = g_malloc0(PAGE_SIZE);
+    uint8_t *dst = g_malloc0(PAGE_SIZE);
+    int i;
+
+    /* every other byte changed does not fit in a page */
+    for (i = 0; i < PAGE_SIZE; i += 2) {
+        new[i] = 1;
+    }
+    g_assert_cmpint(xbzrle_encode_buffer(old, new, PAGE_SIZE, dst,
+                                         PAGE_SIZE), ==, -1);
+    g_assert_cmpint(xbzrle_encode_buffer_scalar(old, new, PAGE_SIZE, dst,
+                                                PAGE_SIZE), ==, -1);
+    g_free(old);
+    g_free(new);
+    g_free(dst);
+}
+
+/* Both encoders must emit the same bytes, and decode back to the page */
+static void test_encode_decode(void)
+{
+    uint8_t *old = g_malloc(PAGE_SIZE);
+    uint8_t *new = g_malloc(PAGE_SIZE);
+    uint8_t *dst = g_malloc(PAGE_SIZE);
+    uint8_t *dst_scalar = g_malloc(PAGE_SIZE);
+    int iter, i;
+
+    for (iter = 0; iter < 1000; iter++) {
+        int len, len_scalar, dlen;
+
+        for (i = 0; i < PAGE_SIZE; i++) {
+            old[i] = g_test_rand_int_range(0, 256);
+        }
+        memcpy(new, old, PAGE_SIZE);
+        scribble(new, g_test_rand_int_range(1, 64),
+                 g_test_rand_int_range(1, 64));
+
+        len = xbzrle_encode_buffer(old, new, PAGE_SIZE, dst, PAGE_SIZE);
+        len_scalar = xbzrle_encode_buffer_scalar(old, new, PAGE_SIZE,
+                                                 dst_scalar, PAGE_SIZE);
+        g_assert_cmpint(len, ==, len_scalar);
+        if (len <= 0) {
+            continue;
+        }
+        g_assert(memcmp(dst, dst_scalar, len) == 0);
+
+        dlen = xbzrle_decode_buffer(dst, len, old, PAGE_SIZE);
+        g_assert_cmpint(dlen, <=, PAGE_SIZE);
+        g_assert(memcmp(old, new, PAGE_SIZE) == 0);
+    }
+
+    g_free(old);
+    g_free(new);
+    g_free(dst);
+    g_free(dst_scalar);
+}
+
+/*
+ * A busy guest page typically changes in a few places: counters, list
+ * pointers, a partially rewritten buffer.  Time both encoders on that.
+ */
+static double bench_encode(XBZRLEEncodeFunc *encode, int nruns, int maxlen)
+{
+    const int npages = 256, rounds = 64;
+    uint8_t *old = g_malloc(npages * PAGE_SIZE);
+    uint8_t *new = g_malloc(npages * PAGE_SIZE);
+    uint8_t *dst = g_malloc(PAGE_SIZE);
+    double elapsed;
+    int i, r;
+
+    for (i = 0; i < npages * PAGE_SIZE; i++) {
+        old[i] = g_test_rand_int_range(0, 256);
+    }
+    memcpy(new, old, npages * PAGE_SIZE);
+    for (i = 0; i < npages; i++) {
+        scribble(new + i * PAGE_SIZE, nruns, maxlen);
+    }
+
+    g_test_timer_start();
+    for (r = 0; r < rounds; r++) {
+        for (i = 0; i < npages; i++) {
+            encode(old + i * PAGE_SIZE, new + i * PAGE_SIZE, PAGE_SIZE,
+                   dst, PAGE_SIZE);
+        }
+    }
+    elapsed = g_test_timer_elapsed();
+
+    g_free(old);
+    g_free(new);
+    g_free(dst);
+
+    /* MB of pages encoded per second */
+    return (double)rounds * npages * PAGE_SIZE / elapsed / (1024 * 1024);
+}
+
+static void perf_encode(gconstpointer opaque)
+{
+    const int *delta = opaque;
+    double scalar, vector;
+
+    scalar = bench_encode(xbzrle_encode_buffer_scalar, delta[0], delta[1]);
+    vector = bench_encode(xbzrle_encode_buffer, delta[0], delta[1]);
+    g_test_message("%d runs of up to %d bytes: scalar %.0f MB/s, "
+                   "vector %.0f MB/s", delta[0], delta[1], scalar, vector);
+    g_test_maximized_result(vector, "%.0f MB/s", vector);
+}
+
+int main(int argc, char **argv)
+{
+    static const int sparse[] = { 4, 8 };
+    static const int medium[] = { 16, 32 };
+    static const int dense[] = { 64, 16 };
+
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/xbzrle/unchanged", test_unchanged);
+    g_test_add_func("/xbzrle/overflow", test_overflow);
+    g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    if (g_test_perf()) {
+        g_test_add_data_func("/xbzrle/perf/sparse", sparse, perf_encode);
+        g_test_add_data_func("/xbzrle/perf/medium", medium, perf_encode);
+        g_test_add_data_func("/xbzrle/perf/dense", dense, perf_encode);
+    }
+    return g_test_run();
+}
@@ -0,0 +1,105 @@
+/*
+ * QTest testcase for drives with I/O throttling
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "qemu-common.h"
+#include "libqtest.h"
+
+static char *img_file_name;
+
+static char *create_test_img(int secs)
+{
+    char *template = strdup("/tmp/qtest.XXXXXX");
+    int fd, ret;
+
+    fd = mkstemp(template);
+    g_assert(fd >= 0);
+    ret = ftruncate(fd, (off_t)secs * 512);
+    g_assert(ret == 0);
+    close(fd);
+    return template;
+}
+
+/* QEMU is still there if it answers a command */
+static void check_alive(void)
+{
+    qmp("{ 'execute': 'query-block' }");
+    inb(0x70);
+}
+
+static void test_drive_iops(void)
+{
+    char *args;
+
+    args = g_strdup_printf("-drive if=ide,file=%s,iops=100", img_file_name);
+    qtest_start(args);
+    check_alive();
+    qtest_quit(global_qtest);
+    g_free(args);
+}
+
+static void test_drive_bps_group(void)
+{
+    char *args;
+
+    args = g_strdup_printf("-drive if=ide,index=0,file=%s,bps=1048576,group=g0 "
+                           "-drive if=ide,index=1,file=%s,iops=100,group=g0",
+                           img_file_name, img_file_name);
+    qtest_start(args);
+    check_alive();
+    qtest_quit(global_qtest);
+    g_free(args);
+}
+
+/* Changing the limits and the group of an open, throttled drive */
+static void test_set_io_throttle(void)
+{
+    char *args;
+
+    args = g_strdup_printf("-drive if=ide,file=%s,iops=100", img_file_name);
+    qtest_start(args);
+    qmp("{ 'execute': 'block_set_io_throttle', 'arguments': {"
+        " 'device': 'ide0-hd0', 'bps': 0, 'bps_rd': 0, 'bps_wr': 0,"
+        " 'iops': 200, 'iops_rd': 0, 'iops_wr': 0, 'group': 'g1' } }");
+    check_alive();
+    qmp("{ 'execute': 'block_set_io_throttle', 'arguments': {"
+        " 'device': 'ide0-hd0', 'bps': 0, 'bps_rd': 0, 'bps_wr': 0,"
+        " 'iops': 0, 'iops_rd': 0, 'iops_wr': 0 } }");
+    check_alive();
+    qtest_quit(global_qtest);
+    g_free(args);
+}
+
+int main(int argc, char **argv)
+{
+    const char *arch = qtest_get_arch();
+    int ret;
+
+    /* Check architecture */
+    if (strcmp(arch, "i386") && strcmp(arch, "x86_64")) {
+        g_test_message("Skipping test for non-x86\n");
+        return 0;
+    }
+
+    g_test_init(&argc, &argv, NULL);
+
+    img_file_name = create_test_img(2048);
+
+    qtest_add_func("throttle/drive/iops", test_drive_iops);
+    qtest_add_func("throttle/drive/group", test_drive_bps_group);
+    qtest_add_func("throttle/set_io_throttle", test_set_io_throttle);
+
+    ret = g_test_run();
+
+    unlink(img_file_name);
+    free(img_file_name);
+
+    return ret;
+}
@@ -0,0 +1,191 @@
+/*
+ * virtio request path benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * Drives virtio-blk on the null-co protocol and virtio-net without a
+ * backend from a qtest "guest", and reports requests per second together
+ * with the CPU time QEMU spent per request.  The null backends complete
+ * at once, so what is left is the device emulation and the virtqueue
+ * handling.  Each notify makes a whole ring's worth of requests available
+ * to amortize the round trips of the qtest protocol, but those are still
+ * included in the numbers; compare runs against each other, not against
+ * a real guest.
+ *
+ * Usage: QTEST_QEMU_BINARY=x86_64-softmmu/qemu-system-x86_64 \
+ *            tests/virtio-bench [-t seconds]
+ */
+
+#include <glib.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libqvirtio.h"
+
+#define BENCH_IOBASE            0xc000
+
+#define VIRTIO_BLK_T_IN         0
+#define VIRTIO_BLK_HDR_SIZE     16
+#define VIRTIO_NET_HDR_SIZE     10
+#define VIRTIO_NET_TX_QUEUE     1
+
+typedef struct BenchDevice {
+    const char *name;
+    const char *args;
+    uint16_t device_id;
+    int queue;
+    size_t payload;
+} BenchDevice;
+
+static const BenchDevice devices[] = {
+    { "virtio-blk", "-net none "
+                    "-drive if=none,id=drive0,file=null-co://,format=raw "
+                    "-device virtio-blk-pci,drive=drive0",
+      QVIRTIO_BLK_DEVICE_ID, 0, 4096 },
+    { "virtio-net", "-net none -device virtio-net-pci",
+      QVIRTIO_NET_DEVICE_ID, VIRTIO_NET_TX_QUEUE, 1514 },
+};
+
+/* User and system time of @pid in seconds, from /proc */
+static double process_cpu_seconds(pid_t pid)
+{
+    char *path = g_strdup_printf("/proc/%d/stat", (int)pid);
+    char *contents = NULL, *p;
+    unsigned long utime, stime;
+    double ret = 0;
+
+    if (g_file_get_contents(path, &contents, NULL, NULL)) {
+        /* skip past the command name, which may contain spaces */
+        p = strrchr(contents, ')');
+        if (p && sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+                        "%lu %lu", &utime, &stime) == 2) {
+            ret = (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+        }
+    }
+    g_free(contents);
+    g_free(path);
+    return ret;
+}
+
+/* Lay out one request per chain; returns the number of chains */
+static int bench_setup_chains(QVirtioDevice *dev, QVirtQueue *vq,
+                              const BenchDevice *bd, uint16_t *heads)
+{
+    int nb_bufs = bd->device_id == QVIRTIO_BLK_DEVICE_ID ? 3 : 2;
+    int n = vq->size / nb_bufs;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        QVirtioBuf bufs[3];
+
+        if (bd->device_id == QVIRTIO_BLK_DEVICE_ID) {
+            uint8_t hdr[VIRTIO_BLK_HDR_SIZE] = { VIRTIO_BLK_T_IN };
+
+            bufs[0].addr = qvirtio_guest_alloc(dev, sizeof(hdr), 16);
+            bufs[0].len = sizeof(hdr);
+            bufs[0].write = false;
+            qtest_memwrite(dev->qts, bufs[0].addr, hdr, sizeof(hdr));
+            bufs[1].addr = qvirtio_guest_alloc(dev, bd->payload, 4096);
+            bufs[1].len = bd->payload;
+            bufs[1].write = true;
+            bufs[2].addr = qvirtio_guest_alloc(dev, 1, 1);
+            bufs[2].len = 1;
+            bufs[2].write = true;
+        } else {
+            /* an all-zero virtio_net_hdr asks for no offloads */
+            bufs[0].addr = qvirtio_guest_alloc(dev, VIRTIO_NET_HDR_SIZE, 16);
+            bufs[0].len = VIRTIO_NET_HDR_SIZE;
+            bufs[0].write = false;
+            bufs[1].addr = qvirtio_guest_alloc(dev, bd->payload, 16);
+            bufs[1].len = bd->payload;
+            bufs[1].write = false;
+        }
+        heads[i] = qvirtqueue_add(dev, vq, bufs, nb_bufs);
+    }
+    return n;
+}
+
+static void bench_device(const BenchDevice *bd, double duration)
+{
+    QTestState *s;
+    QVirtioDevice dev;
+    QVirtQueue vq;
+    uint16_t *heads;
+    GTimer *timer;
+    double cpu_start, cpu, elapsed;
+    uint64_t done = 0;
+    pid_t pid;
+    int n;
+
+    s = qtest_init(bd->args);
+    pid = qtest_get_pid(s);
+    if (!qvirtio_pci_init(&dev, s, bd->device_id, BENCH_IOBASE)) {
+        fprintf(stderr, "%s: device not found\n", bd->name);
+        qtest_quit(s);
+        return;
+    }
+    qvirtio_set_features(&dev, 0);
+    qvirtqueue_init(&dev, &vq, bd->queue);
+    qvirtio_set_status(&dev, QVIRTIO_STATUS_ACKNOWLEDGE |
+                             QVIRTIO_STATUS_DRIVER |
+                             QVIRTIO_STATUS_DRIVER_OK);
+
+    heads = g_new(uint16_t, vq.size);
+    n = bench_setup_chains(&dev, &vq, bd, heads);
+
+    timer = g_timer_new();
+    cpu_start = process_cpu_seconds(pid);
+    do {
+        qvirtqueue_submit(&dev, &vq, heads, n);
+        qvirtqueue_kick(&dev, &vq);
+        qvirtqueue_wait_used(&dev, &vq, n);
+        done += n;
+    } while (g_timer_elapsed(timer, NULL) < duration);
+    elapsed = g_timer_elapsed(timer, NULL);
+    cpu = process_cpu_seconds(pid) - cpu_start;
+
+    printf("%-12s %6d %12.0f %12.2f\n", bd->name, n, done / elapsed,
+           cpu * 1e6 / done);
+    fflush(stdout);
+
+    g_timer_destroy(timer);
+    g_free(heads);
+    qtest_quit(s);
+}
+
+static void usage(const char *progname)
+{
+    fprintf(stderr, "usage: %s [-t seconds]\n", progname);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    double duration = 1;
+    unsigned i;
+    int c;
+
+    while ((c = getopt(argc, argv, "t:h")) != -1) {
+        switch (c) {
+        case 't':
+            duration = atof(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (!getenv("QTEST_QEMU_BINARY")) {
+        fprintf(stderr, "%s: QTEST_QEMU_BINARY must be set\n", argv[0]);
+        return 1;
+    }
+
+    printf("%-12s %6s %12s %12s\n", "device", "batch", "req/s", "cpu us/req");
+    for (i = 0; i < sizeof(devices) / sizeof(devices[0]); i++) {
+        bench_device(&devices[i], duration);
+    }
+    return 0;
+}
@@ -17,6 +17,7 @@
 #include <pthread.h>
 #endif
 #include "qemu-timer.h"
+#include "host-utils.h"
 #include "trace.h"
 #include "trace/control.h"
 
@@ -32,9 +33,6 @@
 /** Records were dropped event ID */
 #define DROPPED_EVENT_ID (~(uint64_t)0 - 1)
 
-/** Trace record is valid */
-#define TRACE_RECORD_VALID ((uint64_t)1 << 63)
-
 /*
  * Trace records are written out by a dedicated thread.  The thread waits for
  * records to become available, writes them out, and then waits again.
@@ -47,16 +45,44 @@ static bool trace_writeout_enabled;
 
 enum {
     TRACE_BUF_LEN = 4096 * 64,
-    TRACE_BUF_FLUSH_THRESHOLD = TRACE_BUF_LEN / 4,
 };
 
-uint8_t trace_buf[TRACE_BUF_LEN];
-static unsigned int trace_idx;
-static unsigned int writeout_idx;
-static uint64_t dropped_events;
+/*
+ * Each thread that traces gets its own ring buffer, so that threads do not
+ * contend on a shared index.  The owner thread is the only producer and the
+ * writeout thread the only consumer, so the indices need no atomic updates.
+ *
+ * In flight recorder mode nothing is written out: the owner overwrites the
+ * oldest records when the ring is full, and st_dump_flight_recorder() copies
+ * the rings to a file while producers stay away from them.
+ */
+typedef struct TraceThreadBuf TraceThreadBuf;
+struct TraceThreadBuf {
+    TraceThreadBuf *next;        /* in trace_bufs; buffers are never freed */
+    int in_use;                  /* owned by a live thread */
+    int busy;                    /* owner is writing a record */
+    unsigned int write_idx;      /* end of the last finished record */
+    unsigned int read_idx;       /* start of the oldest record */
+    unsigned int dump_idx;       /* cursor of st_dump_flight_recorder() */
+    uint64_t dropped;            /* records the owner could not store */
+    uint64_t dropped_written;    /* ... of which were already reported */
+    unsigned int size;           /* power of two */
+    uint8_t data[];
+};
+
+static TraceThreadBuf *trace_bufs;
+static unsigned int trace_buf_size = TRACE_BUF_LEN;
+static bool trace_flight_recorder;
+static int trace_dumping;
 static FILE *trace_fp;
 static char *trace_file_name;
 
+#ifdef _WIN32
+static DWORD trace_buf_key;
+#else
+static pthread_key_t trace_buf_key;
+#endif
+
 /* * Trace buffer entry */
 typedef struct {
     uint64_t event; /*   TraceEventID */
@@ -72,54 +98,174 @@ typedef struct {
     uint64_t header_version;  /* HEADER_VERSION  */
 } TraceLogHeader;
 
+static const TraceLogHeader trace_log_header = {
+    .header_event_id = HEADER_EVENT_ID,
+    .header_magic = HEADER_MAGIC,
+    /* Older log readers will check for version at next location */
+    .header_version = HEADER_VERSION,
+};
 
-static void read_from_buffer(unsigned int idx, void *dataptr, size_t size);
-static unsigned int write_to_buffer(unsigned int idx, void *dataptr, size_t size);
 
-static void clear_buffer_range(unsigned int idx, size_t len)
+static void read_from_buffer(TraceThreadBuf *buf, unsigned int idx,
+                             void *dataptr, size_t size)
 {
-    uint32_t num = 0;
-    while (num < len) {
-        if (idx >= TRACE_BUF_LEN) {
-            idx = idx % TRACE_BUF_LEN;
-        }
-        trace_buf[idx++] = 0;
-        num++;
+    uint8_t *data_ptr = dataptr;
+    uint32_t x = 0;
+    while (x < size) {
+        data_ptr[x++] = buf->data[idx++ & (buf->size - 1)];
     }
 }
+
+static unsigned int write_to_buffer(TraceThreadBuf *buf, unsigned int idx,
+                                    void *dataptr, size_t size)
+{
+    uint8_t *data_ptr = dataptr;
+    uint32_t x = 0;
+    while (x < size) {
+        buf->data[idx++ & (buf->size - 1)] = data_ptr[x++];
+    }
+    return idx; /* most callers wants to know where to write next */
+}
+
+#ifndef _WIN32
+static void trace_thread_exit(void *opaque)
+{
+    TraceThreadBuf *buf = opaque;
+
+    /* let another thread take over the buffer, records and all */
+    smp_wmb();
+    buf->in_use = 0;
+}
+#endif
+
 /**
- * Read a trace record from the trace buffer
+ * Return the trace buffer of the calling thread, allocating one if needed
  *
- * @idx         Trace buffer index
- * @record      Trace record to fill
+ * Uses malloc rather than g_malloc, which can deadlock when traced.
+ */
+static TraceThreadBuf *trace_thread_buf(void)
+{
+    TraceThreadBuf *buf;
+
+#ifdef _WIN32
+    buf = TlsGetValue(trace_buf_key);
+#else
+    buf = pthread_getspecific(trace_buf_key);
+#endif
+    if (buf) {
+        return buf;
+    }
+
+    for (buf = trace_bufs; buf; buf = buf->next) {
+        if (g_atomic_int_compare_and_exchange(&buf->in_use, 0, 1)) {
+            break;
+        }
+    }
+    if (!buf) {
+        buf = calloc(1, sizeof(*buf) + trace_buf_size);
+        if (!buf) {
+            return NULL;
+        }
+        buf->size = trace_buf_size;
+        buf->in_use = 1;
+        do {
+            buf->next = trace_bufs;
+        } while (!g_atomic_pointer_compare_and_exchange((gpointer *)&trace_bufs,
+                                                        buf->next, buf));
+    }
+
+#ifdef _WIN32
+    TlsSetValue(trace_buf_key, buf);
+#else
+    pthread_setspecific(trace_buf_key, buf);
+#endif
+    return buf;
+}
+
+static unsigned int *buf_cursor(TraceThreadBuf *buf, bool dump)
+{
+    return dump ? &buf->dump_idx : &buf->read_idx;
+}
+
+/**
+ * Find the buffer whose next record is the oldest
  *
- * Returns false if the record is not valid.
+ * @dump        Whether to use the cursor of st_dump_flight_recorder()
  */
-static bool get_trace_record(unsigned int idx, TraceRecord **recordptr)
+static TraceThreadBuf *earliest_record(bool dump)
 {
-    uint64_t event_flag = 0;
+    TraceThreadBuf *buf, *best = NULL;
+    uint64_t best_ts = 0;
     TraceRecord record;
-    /* read the event flag to see if its a valid record */
-    read_from_buffer(idx, &record, sizeof(event_flag));
 
-    if (!(record.event & TRACE_RECORD_VALID)) {
-        return false;
+    for (buf = trace_bufs; buf; buf = buf->next) {
+        unsigned int idx = *buf_cursor(buf, dump);
+
+        if (idx == buf->write_idx) {
+            continue;
+        }
+        smp_rmb(); /* read memory barrier before accessing record */
+        read_from_buffer(buf, idx, &record, sizeof(record));
+        if (!best || record.timestamp_ns < best_ts) {
+            best = buf;
+            best_ts = record.timestamp_ns;
+        }
     }
+    return best;
+}
 
-    smp_rmb(); /* read memory barrier before accessing record */
-    /* read the record header to know record length */
-    read_from_buffer(idx, &record, sizeof(TraceRecord));
-    *recordptr = malloc(record.length); /* dont use g_malloc, can deadlock when traced */
-    /* make a copy of record to avoid being overwritten */
-    read_from_buffer(idx, *recordptr, record.length);
-    smp_rmb(); /* memory barrier before clearing valid flag */
-    (*recordptr)->event &= ~TRACE_RECORD_VALID;
-    /* clear the trace buffer range for consumed record otherwise any byte
-     * with its MSB set may be considered as a valid event id when the writer
-     * thread crosses this range of buffer again.
-     */
-    clear_buffer_range(idx, record.length);
-    return true;
+static void write_dropped_record(FILE *fp)
+{
+    union {
+        TraceRecord rec;
+        uint8_t bytes[sizeof(TraceRecord) + sizeof(uint64_t)];
+    } dropped;
+    TraceThreadBuf *buf;
+    uint64_t dropped_count = 0;
+    size_t unused __attribute__ ((unused));
+
+    for (buf = trace_bufs; buf; buf = buf->next) {
+        uint64_t n = buf->dropped;
+        dropped_count += n - buf->dropped_written;
+        buf->dropped_written = n;
+    }
+    if (!dropped_count) {
+        return;
+    }
+
+    dropped.rec.event = DROPPED_EVENT_ID,
+    dropped.rec.timestamp_ns = get_clock();
+    dropped.rec.length = sizeof(TraceRecord) + sizeof(dropped_count),
+    dropped.rec.reserved = 0;
+    memcpy(dropped.rec.arguments, &dropped_count, sizeof(uint64_t));
+    unused = fwrite(&dropped.rec, dropped.rec.length, 1, fp);
+}
+
+/**
+ * Write the records of all threads in timestamp order
+ *
+ * @dump        Whether to copy the records for st_dump_flight_recorder()
+ *              rather than consume them
+ */
+static void write_records(FILE *fp, bool dump)
+{
+    TraceThreadBuf *buf;
+    TraceRecord record, *recordptr;
+    size_t unused __attribute__ ((unused));
+
+    while ((buf = earliest_record(dump))) {
+        unsigned int *cursor = buf_cursor(buf, dump);
+
+        read_from_buffer(buf, *cursor, &record, sizeof(record));
+        recordptr = malloc(record.length); /* dont use g_malloc, can deadlock when traced */
+        /* make a copy of record, it may wrap around the end of the ring */
+        read_from_buffer(buf, *cursor, recordptr, record.length);
+        unused = fwrite(recordptr, recordptr->length, 1, fp);
+        free(recordptr); /* dont use g_free, can deadlock when traced */
+
+        smp_mb(); /* finish reading before the space can be reused */
+        *cursor += record.length;
+    }
 }
 
 /**
@@ -154,41 +300,11 @@ static void wait_for_trace_records_available(void)
 
 static gpointer writeout_thread(gpointer opaque)
 {
-    TraceRecord *recordptr;
-    union {
-        TraceRecord rec;
-        uint8_t bytes[sizeof(TraceRecord) + sizeof(uint64_t)];
-    } dropped;
-    unsigned int idx = 0;
-    uint64_t dropped_count;
-    size_t unused __attribute__ ((unused));
-
     for (;;) {
         wait_for_trace_records_available();
 
-        if (dropped_events) {
-            dropped.rec.event = DROPPED_EVENT_ID,
-            dropped.rec.timestamp_ns = get_clock();
-            dropped.rec.length = sizeof(TraceRecord) + sizeof(dropped_events),
-            dropped.rec.reserved = 0;
-            while (1) {
-                dropped_count = dropped_events;
-                if (g_atomic_int_compare_and_exchange((gint *)&dropped_events,
-                                                      dropped_count, 0)) {
-                    break;
-                }
-            }
-            memcpy(dropped.rec.arguments, &dropped_count, sizeof(uint64_t));
-            unused = fwrite(&dropped.rec, dropped.rec.length, 1, trace_fp);
-        }
-
-        while (get_trace_record(idx, &recordptr)) {
-            unused = fwrite(recordptr, recordptr->length, 1, trace_fp);
-            writeout_idx += recordptr->length;
-            free(recordptr); /* dont use g_free, can deadlock when traced */
-            idx = writeout_idx % TRACE_BUF_LEN;
-        }
-
+        write_dropped_record(trace_fp);
+        write_records(trace_fp, false);
         fflush(trace_fp);
     }
     return NULL;
@@ -196,88 +312,145 @@ static gpointer writeout_thread(gpointer opaque)
 
 void trace_record_write_u64(TraceBufferRecord *rec, uint64_t val)
 {
-    rec->rec_off = write_to_buffer(rec->rec_off, &val, sizeof(uint64_t));
+    rec->rec_off = write_to_buffer(rec->buf, rec->rec_off,
+                                   &val, sizeof(uint64_t));
 }
 
 void trace_record_write_str(TraceBufferRecord *rec, const char *s, uint32_t slen)
 {
     /* Write string length first */
-    rec->rec_off = write_to_buffer(rec->rec_off, &slen, sizeof(slen));
+    rec->rec_off = write_to_buffer(rec->buf, rec->rec_off,
+                                   &slen, sizeof(slen));
     /* Write actual string now */
-    rec->rec_off = write_to_buffer(rec->rec_off, (void*)s, slen);
+    rec->rec_off = write_to_buffer(rec->buf, rec->rec_off, (void*)s, slen);
 }
 
 int trace_record_start(TraceBufferRecord *rec, TraceEventID event, size_t datasize)
 {
-    unsigned int idx, rec_off, old_idx, new_idx;
+    TraceThreadBuf *buf = trace_thread_buf();
+    TraceRecord oldest;
+    unsigned int rec_off;
     uint32_t rec_len = sizeof(TraceRecord) + datasize;
+    uint32_t reserved = 0;
     uint64_t timestamp_ns = get_clock();
 
-    while (1) {
-        old_idx = trace_idx;
-        smp_rmb();
-        new_idx = old_idx + rec_len;
+    if (!buf) {
+        return -ENOMEM;
+    }
 
-        if (new_idx - writeout_idx > TRACE_BUF_LEN) {
-            /* Trace Buffer Full, Event dropped ! */
-            g_atomic_int_inc((gint *)&dropped_events);
-            return -ENOSPC;
+    if (trace_flight_recorder) {
+        /* pairs with the barrier in st_dump_flight_recorder() */
+        buf->busy = 1;
+        smp_mb();
+        if (trace_dumping || rec_len > buf->size) {
+            buf->busy = 0;
+            buf->dropped++;
+            return -EBUSY;
         }
-
-        if (g_atomic_int_compare_and_exchange((gint *)&trace_idx,
-                                              old_idx, new_idx)) {
-            break;
+        /* make room by forgetting the oldest records */
+        while (buf->write_idx + rec_len - buf->read_idx > buf->size) {
+            read_from_buffer(buf, buf->read_idx, &oldest, sizeof(oldest));
+            buf->read_idx += oldest.length;
         }
+    } else if (buf->write_idx + rec_len - buf->read_idx > buf->size) {
+        /* Trace Buffer Full, Event dropped ! */
+        buf->dropped++;
+        return -ENOSPC;
     }
 
-    idx = old_idx % TRACE_BUF_LEN;
+    rec_off = buf->write_idx;
+    rec_off = write_to_buffer(buf, rec_off, &event, sizeof(event));
+    rec_off = write_to_buffer(buf, rec_off, &timestamp_ns, sizeof(timestamp_ns));
+    rec_off = write_to_buffer(buf, rec_off, &rec_len, sizeof(rec_len));
+    rec_off = write_to_buffer(buf, rec_off, &reserved, sizeof(reserved));
 
-    rec_off = idx;
-    rec_off = write_to_buffer(rec_off, &event, sizeof(event));
-    rec_off = write_to_buffer(rec_off, &timestamp_ns, sizeof(timestamp_ns));
-    rec_off = write_to_buffer(rec_off, &rec_len, sizeof(rec_len));
-
-    rec->tbuf_idx = idx;
-    rec->rec_off  = (idx + sizeof(TraceRecord)) % TRACE_BUF_LEN;
+    rec->buf = buf;
+    rec->tbuf_idx = buf->write_idx;
+    rec->rec_off  = rec_off;
     return 0;
 }
 
-static void read_from_buffer(unsigned int idx, void *dataptr, size_t size)
+void trace_record_finish(TraceBufferRecord *rec)
 {
-    uint8_t *data_ptr = dataptr;
-    uint32_t x = 0;
-    while (x < size) {
-        if (idx >= TRACE_BUF_LEN) {
-            idx = idx % TRACE_BUF_LEN;
-        }
-        data_ptr[x++] = trace_buf[idx++];
+    TraceThreadBuf *buf = rec->buf;
+    TraceRecord record;
+
+    read_from_buffer(buf, rec->tbuf_idx, &record, sizeof(TraceRecord));
+    smp_wmb(); /* write barrier before publishing the record */
+    buf->write_idx = rec->tbuf_idx + record.length;
+
+    if (trace_flight_recorder) {
+        smp_mb();
+        buf->busy = 0;
+    } else if ((buf->write_idx - buf->read_idx) > buf->size / 4) {
+        flush_trace_file(false);
     }
 }
 
-static unsigned int write_to_buffer(unsigned int idx, void *dataptr, size_t size)
+/**
+ * Keep records in memory instead of writing them out
+ *
+ * @size_mb     Size of the buffer of each thread, rounded up to a power of two
+ *
+ * Must be called before trace_backend_init().
+ */
+void st_set_flight_recorder(unsigned int size_mb)
 {
-    uint8_t *data_ptr = dataptr;
-    uint32_t x = 0;
-    while (x < size) {
-        if (idx >= TRACE_BUF_LEN) {
-            idx = idx % TRACE_BUF_LEN;
-        }
-        trace_buf[idx++] = data_ptr[x++];
-    }
-    return idx; /* most callers wants to know where to write next */
+    size_mb = MIN(MAX(size_mb, 1), 2048);
+    trace_buf_size = 1U << (32 - clz32(size_mb * 1024 * 1024 - 1));
+    trace_flight_recorder = true;
 }
 
-void trace_record_finish(TraceBufferRecord *rec)
+/**
+ * Write the records kept by the flight recorder to a trace file
+ *
+ * Threads drop their records while the dump is in progress, so that the
+ * rings do not change under it.
+ *
+ * Returns 0, -ENOTSUP if the flight recorder is off, or -errno if @file
+ * cannot be written.
+ */
+int st_dump_flight_recorder(const char *file)
 {
-    TraceRecord record;
-    read_from_buffer(rec->tbuf_idx, &record, sizeof(TraceRecord));
-    smp_wmb(); /* write barrier before marking as valid */
-    record.event |= TRACE_RECORD_VALID;
-    write_to_buffer(rec->tbuf_idx, &record, sizeof(TraceRecord));
+    TraceThreadBuf *buf;
+    FILE *fp;
+    int ret = 0;
 
-    if ((trace_idx - writeout_idx) > TRACE_BUF_FLUSH_THRESHOLD) {
-        flush_trace_file(false);
+    if (!trace_flight_recorder) {
+        return -ENOTSUP;
+    }
+
+    fp = fopen(file, "wb");
+    if (!fp) {
+        return -errno;
     }
+
+    g_static_mutex_lock(&trace_lock);
+    trace_dumping = 1;
+    smp_mb();
+    for (buf = trace_bufs; buf; buf = buf->next) {
+        while (buf->busy) {
+            g_thread_yield();
+        }
+        smp_rmb();
+        buf->dump_idx = buf->read_idx;
+    }
+
+    if (fwrite(&trace_log_header, sizeof trace_log_header, 1, fp) != 1) {
+        ret = -EIO;
+    } else {
+        write_dropped_record(fp);
+        write_records(fp, true);
+    }
+
+    smp_mb();
+    trace_dumping = 0;
+    g_static_mutex_unlock(&trace_lock);
+
+    if (fclose(fp) != 0 && !ret) {
+        ret = -errno;
+    }
+    return ret;
 }
 
 void st_set_trace_file_enabled(bool enable)
@@ -285,6 +458,9 @@ void st_set_trace_file_enabled(bool enable)
     if (enable == !!trace_fp) {
         return; /* no change */
     }
+    if (trace_flight_recorder) {
+        return; /* records are only written by st_dump_flight_recorder() */
+    }
 
     /* Halt trace writeout */
     flush_trace_file(true);
@@ -292,19 +468,13 @@ void st_set_trace_file_enabled(bool enable)
     flush_trace_file(true);
 
     if (enable) {
-        static const TraceLogHeader header = {
-            .header_event_id = HEADER_EVENT_ID,
-            .header_magic = HEADER_MAGIC,
-            /* Older log readers will check for version at next location */
-            .header_version = HEADER_VERSION,
-        };
-
         trace_fp = fopen(trace_file_name, "wb");
         if (!trace_fp) {
             return;
         }
 
-        if (fwrite(&header, sizeof header, 1, trace_fp) != 1) {
+        if (fwrite(&trace_log_header, sizeof trace_log_header, 1,
+                   trace_fp) != 1) {
             fclose(trace_fp);
             trace_fp = NULL;
             return;
@@ -425,6 +595,13 @@ bool trace_backend_init(const char *events, const char *file)
 #endif
     }
 
+#ifdef _WIN32
+    /* no destructor: the buffers of exited threads are not reused */
+    trace_buf_key = TlsAlloc();
+#else
+    pthread_key_create(&trace_buf_key, trace_thread_exit);
+#endif
+
     trace_available_cond = g_cond_new();
     trace_empty_cond = g_cond_new();
 
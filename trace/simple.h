@@ -26,8 +26,11 @@ void st_print_trace_file_status(FILE *stream, fprintf_function stream_printf);
 void st_set_trace_file_enabled(bool enable);
 bool st_set_trace_file(const char *file);
 void st_flush_trace_buffer(void);
+void st_set_flight_recorder(unsigned int size_mb);
+int st_dump_flight_recorder(const char *file);
 
 typedef struct {
+    struct TraceThreadBuf *buf;
     unsigned int tbuf_idx;
     unsigned int rec_off;
 } TraceBufferRecord;
@@ -21,6 +21,8 @@
 #include <stdio.h>
 #include <string.h>
 #include <inttypes.h>
+#include <errno.h>
+#include <unistd.h>
 
 #include "config.h"
 
@@ -40,6 +42,16 @@ target_ulong gen_opc_pc[OPC_BUF_SIZE];
 uint16_t gen_opc_icount[OPC_BUF_SIZE];
 uint8_t gen_opc_instr_start[OPC_BUF_SIZE];
 
+/* Set before the first translation: the counters are partly generated
+   into the code, so TBs translated without them never count.  */
+bool tcg_stats_enabled;
+TCGTranslationStats tcg_translation_stats;
+
+void tcg_stats_enable(void)
+{
+    tcg_stats_enabled = true;
+}
+
 void cpu_gen_init(void)
 {
     tcg_context_init(&tcg_ctx); 
@@ -56,10 +68,14 @@ int cpu_gen_code(CPUArchState *env, TranslationBlock *tb, int *gen_code_size_ptr
     TCGContext *s = &tcg_ctx;
     uint8_t *gen_code_buf;
     int gen_code_size;
+    int64_t start_ns = 0;
 #ifdef CONFIG_PROFILER
     int64_t ti;
 #endif
 
+    if (unlikely(tcg_stats_enabled)) {
+        start_ns = get_clock();
+    }
 #ifdef CONFIG_PROFILER
     s->tb_count1++; /* includes aborted translations because of
                        exceptions */
@@ -94,6 +110,14 @@ int cpu_gen_code(CPUArchState *env, TranslationBlock *tb, int *gen_code_size_ptr
     s->code_in_len += tb->size;
     s->code_out_len += gen_code_size;
 #endif
+    if (unlikely(tcg_stats_enabled)) {
+        /* tcg_ctx is shared, so this runs under tb_mutex too */
+        tcg_translation_stats.tbs++;
+        tcg_translation_stats.guest_insns += tb->icount;
+        tcg_translation_stats.guest_bytes += tb->size;
+        tcg_translation_stats.host_bytes += gen_code_size;
+        tcg_translation_stats.time_ns += get_clock() - start_ns;
+    }
 
 #ifdef DEBUG_DISAS
     if (qemu_loglevel_mask(CPU_LOG_TB_OUT_ASM)) {
@@ -121,6 +145,8 @@ int cpu_restore_state(TranslationBlock *tb,
 #ifdef CONFIG_PROFILER
     ti = profile_getclock();
 #endif
+    /* tcg_ctx and the gen_opc arrays are shared by the vCPU threads */
+    tb_mutex_lock();
     tcg_func_start(s);
 
     gen_intermediate_code_pc(env, tb);
@@ -134,8 +160,10 @@ int cpu_restore_state(TranslationBlock *tb,
 
     /* find opc index corresponding to search_pc */
     tc_ptr = (uintptr_t)tb->tc_ptr;
-    if (searched_pc < tc_ptr)
+    if (searched_pc < tc_ptr) {
+        tb_mutex_unlock();
         return -1;
+    }
 
     s->tb_next_offset = tb->tb_next_offset;
 #ifdef USE_DIRECT_JUMP
@@ -146,14 +174,17 @@ int cpu_restore_state(TranslationBlock *tb,
     s->tb_next = tb->tb_next;
 #endif
     j = tcg_gen_code_search_pc(s, (uint8_t *)tc_ptr, searched_pc - tc_ptr);
-    if (j < 0)
+    if (j < 0) {
+        tb_mutex_unlock();
         return -1;
+    }
     /* now find start of instruction before */
     while (gen_opc_instr_start[j] == 0)
         j--;
     env->icount_decr.u16.low -= gen_opc_icount[j];
 
     restore_state_to_opc(env, tb, j);
+    tb_mutex_unlock();
 
 #ifdef CONFIG_PROFILER
     s->restore_time += profile_getclock() - ti;
@@ -161,3 +192,42 @@ int cpu_restore_state(TranslationBlock *tb,
 #endif
     return 0;
 }
+
+/* perf(1) looks up the symbols of JIT code in /tmp/perf-<pid>.map */
+static FILE *tb_perf_map;
+
+void tb_perf_map_open(void)
+{
+    char path[64];
+
+    snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+    tb_perf_map = fopen(path, "w");
+    if (!tb_perf_map) {
+        fprintf(stderr, "qemu: could not open %s: %s\n",
+                path, strerror(errno));
+        exit(1);
+    }
+    /* keep the file usable by "perf top" and after a crash */
+    setvbuf(tb_perf_map, NULL, _IOLBF, 0);
+}
+
+/* Called with tb_mutex held once the host code of @tb is in place.
+   Entries are grouped by guest symbol when the loaded ELF file has one.
+   The addresses are reused after tb_flush(), so later entries may
+   overlap earlier ones.  */
+void tb_perf_map_add(TranslationBlock *tb, int code_size)
+{
+    const char *symbol;
+
+    if (!tb_perf_map) {
+        return;
+    }
+    symbol = lookup_symbol(tb->pc);
+    if (symbol[0] != '\0') {
+        fprintf(tb_perf_map, "%" PRIxPTR " %x guest:%s\n",
+                (uintptr_t)tb->tc_ptr, code_size, symbol);
+    } else {
+        fprintf(tb_perf_map, "%" PRIxPTR " %x guest:0x" TARGET_FMT_lx "\n",
+                (uintptr_t)tb->tc_ptr, code_size, tb->pc);
+    }
+}
@@ -0,0 +1,356 @@
+/*
+ * QEMU pixel format conversion
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * One row converter per pair of formats, picked at startup: SSE2
+ * kernels on x86 hosts, SSSE3 for packed 24 bpp where the CPU has it
+ * and plain C everywhere else and for the tail of each row.
+ */
+
+#include "pixel-conv.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+PixelConvFunc *pixel_conv_table[PIXEL_CONV_NB_FORMATS][PIXEL_CONV_NB_FORMATS];
+
+/* @from and @to are constants in every caller, so the switches fold away */
+static inline __attribute__((always_inline))
+void pixel_conv_generic(uint8_t *d, const uint8_t *s, int width,
+                        PixelConvFormat from, PixelConvFormat to)
+{
+    unsigned int v, r, g, b;
+    int i;
+
+    for (i = 0; i < width; i++) {
+        switch (from) {
+        case PIXEL_CONV_RGB555:
+            v = s[0] | (s[1] << 8);
+            r = (v >> 7) & 0xf8;
+            g = (v >> 2) & 0xf8;
+            b = (v << 3) & 0xf8;
+            s += 2;
+            break;
+        case PIXEL_CONV_RGB565:
+            v = s[0] | (s[1] << 8);
+            r = (v >> 8) & 0xf8;
+            g = (v >> 3) & 0xfc;
+            b = (v << 3) & 0xf8;
+            s += 2;
+            break;
+        case PIXEL_CONV_RGB888:
+            b = s[0];
+            g = s[1];
+            r = s[2];
+            s += 3;
+            break;
+        case PIXEL_CONV_XRGB8888:
+            b = s[0];
+            g = s[1];
+            r = s[2];
+            s += 4;
+            break;
+        case PIXEL_CONV_XBGR8888:
+            r = s[0];
+            g = s[1];
+            b = s[2];
+            s += 4;
+            break;
+        default:
+            abort();
+        }
+
+        switch (to) {
+        case PIXEL_CONV_RGB555:
+            v = ((r >> 3) << 10) | ((g >> 3) << 5) | (b >> 3);
+            d[0] = v;
+            d[1] = v >> 8;
+            d += 2;
+            break;
+        case PIXEL_CONV_RGB565:
+            v = ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
+            d[0] = v;
+            d[1] = v >> 8;
+            d += 2;
+            break;
+        case PIXEL_CONV_RGB888:
+            d[0] = b;
+            d[1] = g;
+            d[2] = r;
+            d += 3;
+            break;
+        case PIXEL_CONV_XRGB8888:
+            d[0] = b;
+            d[1] = g;
+            d[2] = r;
+            d[3] = 0;
+            d += 4;
+            break;
+        case PIXEL_CONV_XBGR8888:
+            d[0] = r;
+            d[1] = g;
+            d[2] = b;
+            d[3] = 0;
+            d += 4;
+            break;
+        default:
+            abort();
+        }
+    }
+}
+
+#define PIXEL_CONV_C(from, to)                                          \
+static void pixel_conv_##from##_##to##_c(uint8_t *d, const uint8_t *s, \
+                                         int width)                     \
+{                                                                       \
+    pixel_conv_generic(d, s, width, PIXEL_CONV_##from, PIXEL_CONV_##to); \
+}
+
+PIXEL_CONV_C(RGB555, XRGB8888)
+PIXEL_CONV_C(RGB555, XBGR8888)
+PIXEL_CONV_C(RGB565, XRGB8888)
+PIXEL_CONV_C(RGB565, XBGR8888)
+PIXEL_CONV_C(RGB888, XRGB8888)
+PIXEL_CONV_C(RGB888, XBGR8888)
+PIXEL_CONV_C(XRGB8888, XRGB8888)
+PIXEL_CONV_C(XRGB8888, XBGR8888)
+PIXEL_CONV_C(XBGR8888, XRGB8888)
+PIXEL_CONV_C(XBGR8888, XBGR8888)
+PIXEL_CONV_C(XRGB8888, RGB565)
+PIXEL_CONV_C(XRGB8888, RGB555)
+
+#ifdef __SSE2__
+/* 8 pixels of 15 or 16 bpp become 8 pixels of 32 bpp */
+static inline __attribute__((always_inline))
+void pixel_conv_16_32_sse2(uint8_t *d, const uint8_t *s, int width,
+                           PixelConvFormat from, PixelConvFormat to)
+{
+    const __m128i f8 = _mm_set1_epi16(0xf8);
+    const __m128i fc = _mm_set1_epi16(0xfc);
+    int i;
+
+    for (i = 0; i + 8 <= width; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i * 2));
+        __m128i r, g, b, lo, hi;
+
+        if (from == PIXEL_CONV_RGB565) {
+            r = _mm_and_si128(_mm_srli_epi16(v, 8), f8);
+            g = _mm_and_si128(_mm_srli_epi16(v, 3), fc);
+        } else {
+            r = _mm_and_si128(_mm_srli_epi16(v, 7), f8);
+            g = _mm_and_si128(_mm_srli_epi16(v, 2), f8);
+        }
+        b = _mm_and_si128(_mm_slli_epi16(v, 3), f8);
+
+        /* low and high halves of each 32 bpp pixel */
+        if (to == PIXEL_CONV_XBGR8888) {
+            lo = _mm_or_si128(_mm_slli_epi16(g, 8), r);
+            hi = b;
+        } else {
+            lo = _mm_or_si128(_mm_slli_epi16(g, 8), b);
+            hi = r;
+        }
+        _mm_storeu_si128((__m128i *)(d + i * 4), _mm_unpacklo_epi16(lo, hi));
+        _mm_storeu_si128((__m128i *)(d + i * 4 + 16),
+                         _mm_unpackhi_epi16(lo, hi));
+    }
+    pixel_conv_generic(d + i * 4, s + i * 2, width - i, from, to);
+}
+
+/* 32 bpp to 32 bpp: clear the padding byte, swap red and blue if asked */
+static inline __attribute__((always_inline))
+void pixel_conv_32_32_sse2(uint8_t *d, const uint8_t *s, int width,
+                           PixelConvFormat from, PixelConvFormat to)
+{
+    const __m128i gmask = _mm_set1_epi32(0x0000ff00);
+    const __m128i lmask = _mm_set1_epi32(0x000000ff);
+    const __m128i rbmask = _mm_set1_epi32(0x00ff00ff);
+    int i;
+
+    for (i = 0; i + 4 <= width; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i * 4));
+        __m128i rb;
+
+        if (from != to) {
+            rb = _mm_or_si128(_mm_and_si128(_mm_srli_epi32(v, 16), lmask),
+                              _mm_slli_epi32(_mm_and_si128(v, lmask), 16));
+        } else {
+            rb = _mm_and_si128(v, rbmask);
+        }
+        _mm_storeu_si128((__m128i *)(d + i * 4),
+                         _mm_or_si128(_mm_and_si128(v, gmask), rb));
+    }
+    pixel_conv_generic(d + i * 4, s + i * 4, width - i, from, to);
+}
+
+/* 4 pixels of 32 bpp to 15 or 16 bpp, still one per 32 bit lane */
+static inline __attribute__((always_inline))
+__m128i pixel_conv_pack16_sse2(__m128i v, PixelConvFormat to)
+{
+    __m128i r, g, b;
+
+    if (to == PIXEL_CONV_RGB565) {
+        r = _mm_and_si128(_mm_srli_epi32(v, 8), _mm_set1_epi32(0xf800));
+        g = _mm_and_si128(_mm_srli_epi32(v, 5), _mm_set1_epi32(0x07e0));
+    } else {
+        r = _mm_and_si128(_mm_srli_epi32(v, 9), _mm_set1_epi32(0x7c00));
+        g = _mm_and_si128(_mm_srli_epi32(v, 6), _mm_set1_epi32(0x03e0));
+    }
+    b = _mm_and_si128(_mm_srli_epi32(v, 3), _mm_set1_epi32(0x001f));
+
+    /* sign extend so that the saturating pack keeps all 16 bits */
+    v = _mm_or_si128(_mm_or_si128(r, g), b);
+    return _mm_srai_epi32(_mm_slli_epi32(v, 16), 16);
+}
+
+/* 8 pixels of 32 bpp become 8 pixels of 15 or 16 bpp */
+static inline __attribute__((always_inline))
+void pixel_conv_32_16_sse2(uint8_t *d, const uint8_t *s, int width,
+                           PixelConvFormat from, PixelConvFormat to)
+{
+    int i;
+
+    for (i = 0; i + 8 <= width; i += 8) {
+        __m128i v0 = _mm_loadu_si128((const __m128i *)(s + i * 4));
+        __m128i v1 = _mm_loadu_si128((const __m128i *)(s + i * 4 + 16));
+
+        _mm_storeu_si128((__m128i *)(d + i * 2),
+                         _mm_packs_epi32(pixel_conv_pack16_sse2(v0, to),
+                                         pixel_conv_pack16_sse2(v1, to)));
+    }
+    pixel_conv_generic(d + i * 2, s + i * 4, width - i, from, to);
+}
+
+#define PIXEL_CONV_SSE2(kernel, from, to)                                  \
+static void pixel_conv_##from##_##to##_sse2(uint8_t *d, const uint8_t *s, \
+                                            int width)                     \
+{                                                                          \
+    kernel(d, s, width, PIXEL_CONV_##from, PIXEL_CONV_##to);               \
+}
+
+PIXEL_CONV_SSE2(pixel_conv_16_32_sse2, RGB555, XRGB8888)
+PIXEL_CONV_SSE2(pixel_conv_16_32_sse2, RGB555, XBGR8888)
+PIXEL_CONV_SSE2(pixel_conv_16_32_sse2, RGB565, XRGB8888)
+PIXEL_CONV_SSE2(pixel_conv_16_32_sse2, RGB565, XBGR8888)
+PIXEL_CONV_SSE2(pixel_conv_32_32_sse2, XRGB8888, XRGB8888)
+PIXEL_CONV_SSE2(pixel_conv_32_32_sse2, XRGB8888, XBGR8888)
+PIXEL_CONV_SSE2(pixel_conv_32_32_sse2, XBGR8888, XRGB8888)
+PIXEL_CONV_SSE2(pixel_conv_32_32_sse2, XBGR8888, XBGR8888)
+PIXEL_CONV_SSE2(pixel_conv_32_16_sse2, XRGB8888, RGB565)
+PIXEL_CONV_SSE2(pixel_conv_32_16_sse2, XRGB8888, RGB555)
+#endif
+
+/* the configure test for AVX2 also vouches for target pragmas */
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("ssse3")
+#include <cpuid.h>
+#include <tmmintrin.h>
+
+/* 4 packed 24 bpp pixels per shuffle; a load reads 16 of their 12 bytes */
+static inline __attribute__((always_inline))
+void pixel_conv_24_32_ssse3(uint8_t *d, const uint8_t *s, int width,
+                            PixelConvFormat to)
+{
+    __m128i shuf;
+    int i;
+
+    if (to == PIXEL_CONV_XBGR8888) {
+        shuf = _mm_setr_epi8(2, 1, 0, 0x80, 5, 4, 3, 0x80,
+                             8, 7, 6, 0x80, 11, 10, 9, 0x80);
+    } else {
+        shuf = _mm_setr_epi8(0, 1, 2, 0x80, 3, 4, 5, 0x80,
+                             6, 7, 8, 0x80, 9, 10, 11, 0x80);
+    }
+    for (i = 0; i + 6 <= width; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i * 3));
+
+        _mm_storeu_si128((__m128i *)(d + i * 4), _mm_shuffle_epi8(v, shuf));
+    }
+    pixel_conv_generic(d + i * 4, s + i * 3, width - i,
+                       PIXEL_CONV_RGB888, to);
+}
+
+static void pixel_conv_RGB888_XRGB8888_ssse3(uint8_t *d, const uint8_t *s,
+                                             int width)
+{
+    pixel_conv_24_32_ssse3(d, s, width, PIXEL_CONV_XRGB8888);
+}
+
+static void pixel_conv_RGB888_XBGR8888_ssse3(uint8_t *d, const uint8_t *s,
+                                             int width)
+{
+    pixel_conv_24_32_ssse3(d, s, width, PIXEL_CONV_XBGR8888);
+}
+#pragma GCC pop_options
+
+static bool cpu_has_ssse3(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return false;
+    }
+    return (ecx & bit_SSSE3) != 0;
+}
+#endif
+
+void pixel_conv_palette8(uint8_t *dst, const uint8_t *src,
+                         const uint32_t *palette, int width)
+{
+    uint32_t *d = (uint32_t *)dst;
+    int i;
+
+    /* no SIMD here: SSE2 has no gather and AVX2's is slower than this */
+    for (i = 0; i + 4 <= width; i += 4) {
+        d[i] = palette[src[i]];
+        d[i + 1] = palette[src[i + 1]];
+        d[i + 2] = palette[src[i + 2]];
+        d[i + 3] = palette[src[i + 3]];
+    }
+    for (; i < width; i++) {
+        d[i] = palette[src[i]];
+    }
+}
+
+#define PIXEL_CONV_SET(from, to, impl)                                  \
+    pixel_conv_table[PIXEL_CONV_##from][PIXEL_CONV_##to] =              \
+        pixel_conv_##from##_##to##_##impl
+
+static void __attribute__((constructor)) pixel_conv_init(void)
+{
+    PIXEL_CONV_SET(RGB555, XRGB8888, c);
+    PIXEL_CONV_SET(RGB555, XBGR8888, c);
+    PIXEL_CONV_SET(RGB565, XRGB8888, c);
+    PIXEL_CONV_SET(RGB565, XBGR8888, c);
+    PIXEL_CONV_SET(RGB888, XRGB8888, c);
+    PIXEL_CONV_SET(RGB888, XBGR8888, c);
+    PIXEL_CONV_SET(XRGB8888, XRGB8888, c);
+    PIXEL_CONV_SET(XRGB8888, XBGR8888, c);
+    PIXEL_CONV_SET(XBGR8888, XRGB8888, c);
+    PIXEL_CONV_SET(XBGR8888, XBGR8888, c);
+    PIXEL_CONV_SET(XRGB8888, RGB565, c);
+    PIXEL_CONV_SET(XRGB8888, RGB555, c);
+
+#ifdef __SSE2__
+    PIXEL_CONV_SET(RGB555, XRGB8888, sse2);
+    PIXEL_CONV_SET(RGB555, XBGR8888, sse2);
+    PIXEL_CONV_SET(RGB565, XRGB8888, sse2);
+    PIXEL_CONV_SET(RGB565, XBGR8888, sse2);
+    PIXEL_CONV_SET(XRGB8888, XRGB8888, sse2);
+    PIXEL_CONV_SET(XRGB8888, XBGR8888, sse2);
+    PIXEL_CONV_SET(XBGR8888, XRGB8888, sse2);
+    PIXEL_CONV_SET(XBGR8888, XBGR8888, sse2);
+    PIXEL_CONV_SET(XRGB8888, RGB565, sse2);
+    PIXEL_CONV_SET(XRGB8888, RGB555, sse2);
+#endif
+#ifdef CONFIG_AVX2_OPT
+    if (cpu_has_ssse3()) {
+        PIXEL_CONV_SET(RGB888, XRGB8888, ssse3);
+        PIXEL_CONV_SET(RGB888, XBGR8888, ssse3);
+    }
+#endif
+}
@@ -0,0 +1,58 @@
+/*
+ * QEMU pixel format conversion
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_PIXEL_CONV_H
+#define QEMU_PIXEL_CONV_H
+
+#include "qemu-common.h"
+
+/*
+ * Formats are named by their channels from the most significant bit
+ * down and are always stored little endian: PIXEL_CONV_XRGB8888 is the
+ * 32 bpp console surface of a little endian host, PIXEL_CONV_RGB888 the
+ * packed 24 bpp b, g, r byte triplets of VGA and VBE modes.
+ */
+typedef enum PixelConvFormat {
+    PIXEL_CONV_RGB555,
+    PIXEL_CONV_RGB565,
+    PIXEL_CONV_RGB888,
+    PIXEL_CONV_XRGB8888,
+    PIXEL_CONV_XBGR8888,
+    PIXEL_CONV_NB_FORMATS
+} PixelConvFormat;
+
+typedef void PixelConvFunc(uint8_t *dst, const uint8_t *src, int width);
+
+extern PixelConvFunc *pixel_conv_table[PIXEL_CONV_NB_FORMATS]
+                                      [PIXEL_CONV_NB_FORMATS];
+
+/*
+ * Conversions from every format to PIXEL_CONV_XRGB8888 and
+ * PIXEL_CONV_XBGR8888 (guest framebuffers to the console surface) and
+ * from PIXEL_CONV_XRGB8888 to the 15, 16 and BGR 32 bpp formats that
+ * remote clients ask for are available.  Channels that get narrower
+ * are truncated, those that get wider are shifted up, as the VGA and
+ * VNC code always did.
+ */
+static inline bool pixel_conv_supported(PixelConvFormat from,
+                                        PixelConvFormat to)
+{
+    return pixel_conv_table[from][to] != NULL;
+}
+
+/* Convert @width pixels; only valid if pixel_conv_supported() */
+static inline void pixel_conv(PixelConvFormat from, PixelConvFormat to,
+                              uint8_t *dst, const uint8_t *src, int width)
+{
+    pixel_conv_table[from][to](dst, src, width);
+}
+
+/* Expand @width 8 bpp pixels through a 256 entry 32 bpp palette */
+void pixel_conv_palette8(uint8_t *dst, const uint8_t *src,
+                         const uint32_t *palette, int width);
+
+#endif
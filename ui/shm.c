@@ -0,0 +1,468 @@
+/*
+ * QEMU shared memory display
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * The guest screen lives in a POSIX shared memory object whose file
+ * descriptor is handed to viewers connecting to a UNIX socket; after
+ * that only the rectangles that changed are sent, so QEMU never
+ * converts or copies pixels on behalf of a local viewer.  The protocol
+ * is described in docs/specs/shm-display.txt.
+ */
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "qemu-common.h"
+#include "console.h"
+#include "main-loop.h"
+#include "qemu_socket.h"
+
+#define SHM_DISPLAY_SURFACE     1
+#define SHM_DISPLAY_UPDATE      2
+
+/* Refresh interval while nobody is looking, in milliseconds */
+#define SHM_IDLE_INTERVAL       500
+
+/* Layout is host endian: both ends run on the same machine */
+typedef struct ShmDisplayMsg {
+    uint32_t type;
+    uint32_t x;
+    uint32_t y;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    uint32_t size;
+    uint8_t bits_per_pixel;
+    uint8_t depth;
+    uint8_t big_endian;
+    uint8_t pad;
+    uint32_t rmask;
+    uint32_t gmask;
+    uint32_t bmask;
+} ShmDisplayMsg;
+
+typedef struct ShmBuffer {
+    int fd;
+    uint8_t *data;
+    size_t size;
+} ShmBuffer;
+
+typedef struct ShmClient {
+    int fd;
+    bool need_surface;
+    bool need_full;
+    QTAILQ_ENTRY(ShmClient) next;
+} ShmClient;
+
+static DisplayChangeListener *dcl;
+static int listen_fd = -1;
+static QTAILQ_HEAD(, ShmClient) clients = QTAILQ_HEAD_INITIALIZER(clients);
+
+/* Backs the surface handed out by shm_create_displaysurface */
+static ShmBuffer surface_buf = { .fd = -1 };
+/* Copy of a surface that lives in device memory (shared vram) */
+static ShmBuffer mirror_buf = { .fd = -1 };
+/* The buffer clients have mapped, one of the above */
+static ShmBuffer *cur_buf;
+
+/* Union of the dpy_update rectangles since the last refresh */
+static int damage_x1, damage_y1, damage_x2, damage_y2;
+
+static void shm_buffer_alloc(ShmBuffer *buf, size_t size)
+{
+    static unsigned int count;
+    char name[64];
+
+    snprintf(name, sizeof(name), "/qemu-shm-display-%d-%u",
+             (int)getpid(), count++);
+    buf->fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (buf->fd < 0) {
+        fprintf(stderr, "shm display: cannot create %s: %s\n",
+                name, strerror(errno));
+        exit(1);
+    }
+    /* only reachable through the descriptors from now on */
+    shm_unlink(name);
+    qemu_set_cloexec(buf->fd);
+
+    size = MAX(size, 1);
+    if (ftruncate(buf->fd, size) < 0) {
+        fprintf(stderr, "shm display: cannot size buffer: %s\n",
+                strerror(errno));
+        exit(1);
+    }
+    buf->data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     buf->fd, 0);
+    if (buf->data == MAP_FAILED) {
+        fprintf(stderr, "shm display: cannot map buffer: %s\n",
+                strerror(errno));
+        exit(1);
+    }
+    buf->size = size;
+}
+
+/* Viewers keep their own mapping alive, so this never pulls the rug */
+static void shm_buffer_free(ShmBuffer *buf)
+{
+    if (buf->fd < 0) {
+        return;
+    }
+    munmap(buf->data, buf->size);
+    close(buf->fd);
+    buf->fd = -1;
+    buf->data = NULL;
+    buf->size = 0;
+}
+
+static DisplaySurface *shm_resize_displaysurface(DisplaySurface *surface,
+                                                 int width, int height)
+{
+    if (surface->data == surface_buf.data) {
+        shm_buffer_free(&surface_buf);
+    } else if (surface->flags & QEMU_ALLOCATED_FLAG) {
+        g_free(surface->data);
+    }
+
+    surface->width = width;
+    surface->height = height;
+    surface->linesize = width * 4;
+    surface->pf = qemu_default_pixelformat(32);
+    shm_buffer_alloc(&surface_buf, surface->linesize * height);
+    surface->data = surface_buf.data;
+#ifdef HOST_WORDS_BIGENDIAN
+    surface->flags = QEMU_REALPIXELS_FLAG | QEMU_BIG_ENDIAN_FLAG;
+#else
+    surface->flags = QEMU_REALPIXELS_FLAG;
+#endif
+    return surface;
+}
+
+static DisplaySurface *shm_create_displaysurface(int width, int height)
+{
+    DisplaySurface *surface = g_malloc0(sizeof(DisplaySurface));
+
+    return shm_resize_displaysurface(surface, width, height);
+}
+
+static void shm_free_displaysurface(DisplaySurface *surface)
+{
+    if (surface == NULL) {
+        return;
+    }
+    if (surface->data == surface_buf.data) {
+        shm_buffer_free(&surface_buf);
+    } else if (surface->flags & QEMU_ALLOCATED_FLAG) {
+        g_free(surface->data);
+    }
+    g_free(surface);
+}
+
+static void shm_damage_reset(void)
+{
+    damage_x1 = damage_y1 = INT_MAX;
+    damage_x2 = damage_y2 = 0;
+}
+
+static void shm_copy_rect(DisplayState *ds, int x, int y, int w, int h)
+{
+    DisplaySurface *surface = ds->surface;
+    int bpp = surface->pf.bytes_per_pixel;
+    size_t offset = y * surface->linesize + x * bpp;
+    int i;
+
+    for (i = 0; i < h; i++, offset += surface->linesize) {
+        memcpy(mirror_buf.data + offset, surface->data + offset, w * bpp);
+    }
+}
+
+static void shm_client_close(ShmClient *client)
+{
+    qemu_set_fd_handler2(client->fd, NULL, NULL, NULL, NULL);
+    close(client->fd);
+    QTAILQ_REMOVE(&clients, client, next);
+    g_free(client);
+
+    if (QTAILQ_EMPTY(&clients)) {
+        dcl->idle = 1;
+        dcl->gui_timer_interval = SHM_IDLE_INTERVAL;
+    }
+}
+
+/*
+ * Send one message, with @fd attached unless it is negative.  Returns 1
+ * if it was sent, 0 if the client has to be retried later and -1 if the
+ * client went away and was freed.
+ */
+static int shm_client_send(ShmClient *client, ShmDisplayMsg *msg, int fd)
+{
+    struct msghdr msgh;
+    struct iovec iov;
+    union {
+        struct cmsghdr cmsg;
+        char control[CMSG_SPACE(sizeof(int))];
+    } u;
+    ssize_t ret;
+
+    memset(&msgh, 0, sizeof(msgh));
+    iov.iov_base = msg;
+    iov.iov_len = sizeof(*msg);
+    msgh.msg_iov = &iov;
+    msgh.msg_iovlen = 1;
+    if (fd >= 0) {
+        struct cmsghdr *cmsg;
+
+        memset(&u, 0, sizeof(u));
+        msgh.msg_control = u.control;
+        msgh.msg_controllen = sizeof(u.control);
+        cmsg = CMSG_FIRSTHDR(&msgh);
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    do {
+        ret = sendmsg(client->fd, &msgh, MSG_DONTWAIT | MSG_NOSIGNAL);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            shm_client_close(client);
+            return -1;
+        }
+        return 0;
+    }
+    return 1;
+}
+
+static int shm_client_send_surface(DisplayState *ds, ShmClient *client)
+{
+    DisplaySurface *surface = ds->surface;
+    ShmDisplayMsg msg = {
+        .type = SHM_DISPLAY_SURFACE,
+        .width = surface->width,
+        .height = surface->height,
+        .stride = surface->linesize,
+        .size = cur_buf->size,
+        .bits_per_pixel = surface->pf.bits_per_pixel,
+        .depth = surface->pf.depth,
+        .big_endian = !!(surface->flags & QEMU_BIG_ENDIAN_FLAG),
+        .rmask = surface->pf.rmask,
+        .gmask = surface->pf.gmask,
+        .bmask = surface->pf.bmask,
+    };
+
+    return shm_client_send(client, &msg, cur_buf->fd);
+}
+
+static int shm_client_send_update(ShmClient *client, int x, int y,
+                                  int w, int h)
+{
+    ShmDisplayMsg msg = {
+        .type = SHM_DISPLAY_UPDATE,
+        .x = x,
+        .y = y,
+        .width = w,
+        .height = h,
+    };
+
+    return shm_client_send(client, &msg, -1);
+}
+
+static void shm_update(DisplayState *ds, int x, int y, int w, int h)
+{
+    if (QTAILQ_EMPTY(&clients)) {
+        return;
+    }
+    if (cur_buf == &mirror_buf) {
+        shm_copy_rect(ds, x, y, w, h);
+    }
+    damage_x1 = MIN(damage_x1, x);
+    damage_y1 = MIN(damage_y1, y);
+    damage_x2 = MAX(damage_x2, x + w);
+    damage_y2 = MAX(damage_y2, y + h);
+}
+
+/*
+ * Called whenever ds->surface changed: export it directly if it is one
+ * of ours, otherwise mirror it into a buffer of the same layout.
+ */
+static void shm_surface_changed(DisplayState *ds)
+{
+    DisplaySurface *surface = ds->surface;
+    ShmClient *client;
+
+    if (surface->data == surface_buf.data) {
+        shm_buffer_free(&mirror_buf);
+        cur_buf = &surface_buf;
+    } else {
+        size_t size = MAX(surface->linesize * surface->height, 1);
+
+        /* page flipping in vram keeps the layout, so keep the buffer */
+        if (mirror_buf.size != size) {
+            shm_buffer_free(&mirror_buf);
+            shm_buffer_alloc(&mirror_buf, size);
+        }
+        memcpy(mirror_buf.data, surface->data,
+               surface->linesize * surface->height);
+        cur_buf = &mirror_buf;
+    }
+
+    shm_damage_reset();
+    QTAILQ_FOREACH(client, &clients, next) {
+        client->need_surface = true;
+    }
+}
+
+static void shm_resize(DisplayState *ds)
+{
+    shm_surface_changed(ds);
+}
+
+static void shm_setdata(DisplayState *ds)
+{
+    shm_surface_changed(ds);
+}
+
+static void shm_refresh(DisplayState *ds)
+{
+    ShmClient *client, *next;
+    int w = ds_get_width(ds), h = ds_get_height(ds);
+    int ret;
+
+    if (QTAILQ_EMPTY(&clients)) {
+        return;
+    }
+
+    vga_hw_update();
+
+    QTAILQ_FOREACH_SAFE(client, &clients, next, next) {
+        if (client->need_surface) {
+            if (shm_client_send_surface(ds, client) <= 0) {
+                continue;
+            }
+            client->need_surface = false;
+            client->need_full = true;
+        }
+        if (client->need_full) {
+            /* a dropped update is made up for by repainting everything */
+            ret = shm_client_send_update(client, 0, 0, w, h);
+        } else if (damage_x1 < damage_x2 && damage_y1 < damage_y2) {
+            ret = shm_client_send_update(client, damage_x1, damage_y1,
+                                         damage_x2 - damage_x1,
+                                         damage_y2 - damage_y1);
+        } else {
+            continue;
+        }
+        if (ret >= 0) {
+            client->need_full = !ret;
+        }
+    }
+    shm_damage_reset();
+}
+
+/* Viewers have nothing to say yet; this only notices them leaving */
+static void shm_client_read(void *opaque)
+{
+    ShmClient *client = opaque;
+    char buf[256];
+    ssize_t ret;
+
+    ret = recv(client->fd, buf, sizeof(buf), MSG_DONTWAIT);
+    if (ret == 0 || (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+                     errno != EINTR)) {
+        shm_client_close(client);
+    }
+}
+
+static void shm_accept(void *opaque)
+{
+    DisplayState *ds = opaque;
+    ShmClient *client;
+    int fd;
+
+    fd = qemu_accept(listen_fd, NULL, NULL);
+    if (fd < 0) {
+        return;
+    }
+    socket_set_nonblock(fd);
+
+    if (QTAILQ_EMPTY(&clients)) {
+        dcl->idle = 0;
+        dcl->gui_timer_interval = 0;
+        /* nothing was tracked while nobody was connected */
+        if (cur_buf == &mirror_buf) {
+            memcpy(mirror_buf.data, ds->surface->data,
+                   ds->surface->linesize * ds->surface->height);
+        }
+        vga_hw_invalidate();
+    }
+
+    client = g_malloc0(sizeof(*client));
+    client->fd = fd;
+    client->need_surface = true;
+    QTAILQ_INSERT_TAIL(&clients, client, next);
+    qemu_set_fd_handler2(fd, NULL, shm_client_read, NULL, client);
+}
+
+static int shm_listen(const char *path)
+{
+    struct sockaddr_un un;
+    int fd;
+
+    if (strlen(path) >= sizeof(un.sun_path)) {
+        fprintf(stderr, "shm display: socket path too long: %s\n", path);
+        return -1;
+    }
+
+    /* message boundaries keep every send all-or-nothing */
+    fd = qemu_socket(PF_UNIX, SOCK_SEQPACKET, 0);
+    if (fd < 0) {
+        perror("shm display: socket");
+        return -1;
+    }
+
+    memset(&un, 0, sizeof(un));
+    un.sun_family = AF_UNIX;
+    pstrcpy(un.sun_path, sizeof(un.sun_path), path);
+    unlink(un.sun_path);
+    if (bind(fd, (struct sockaddr *)&un, sizeof(un)) < 0 ||
+        listen(fd, 1) < 0) {
+        fprintf(stderr, "shm display: cannot listen on %s: %s\n",
+                path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void shm_display_init(DisplayState *ds, const char *path)
+{
+    DisplayAllocator *da;
+
+    listen_fd = shm_listen(path);
+    if (listen_fd < 0) {
+        exit(1);
+    }
+    qemu_set_fd_handler2(listen_fd, NULL, shm_accept, NULL, ds);
+
+    dcl = g_malloc0(sizeof(DisplayChangeListener));
+    dcl->idle = 1;
+    dcl->gui_timer_interval = SHM_IDLE_INTERVAL;
+    dcl->dpy_update = shm_update;
+    dcl->dpy_resize = shm_resize;
+    dcl->dpy_setdata = shm_setdata;
+    dcl->dpy_refresh = shm_refresh;
+    register_displaychangelistener(ds, dcl);
+
+    da = g_malloc0(sizeof(DisplayAllocator));
+    da->create_displaysurface = shm_create_displaysurface;
+    da->resize_displaysurface = shm_resize_displaysurface;
+    da->free_displaysurface = shm_free_displaysurface;
+    register_displayallocator(ds, da);
+    shm_damage_reset();
+    shm_surface_changed(ds);
+}
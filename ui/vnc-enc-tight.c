@@ -1260,11 +1260,59 @@ static void jpeg_term_destination(j_compress_ptr cinfo)
     buffer->offset = buffer->capacity - cinfo->dest->free_in_buffer;
 }
 
-static int send_jpeg_rect(VncState *vs, int x, int y, int w, int h, int quality)
+#ifdef JCS_EXTENSIONS
+/*
+ * libjpeg-turbo can take 32-bit pixels straight from the server surface and
+ * convert them to YCbCr with its SIMD code.  Return the input colorspace that
+ * matches the surface, or JCS_UNKNOWN if rows have to go through
+ * rgb_prepare_row().
+ */
+static J_COLOR_SPACE jpeg_surface_color_space(VncState *vs)
+{
+    PixelFormat *pf = &vs->ds->surface->pf;
+    int r, g, b;
+
+    if (ds_get_bytes_per_pixel(vs->ds) != 4 ||
+        pf->rmax != 0xFF || pf->gmax != 0xFF || pf->bmax != 0xFF ||
+        (pf->rshift | pf->gshift | pf->bshift) & 7) {
+        return JCS_UNKNOWN;
+    }
+
+    /* byte offset of each component in memory */
+#ifdef HOST_WORDS_BIGENDIAN
+    r = 3 - pf->rshift / 8;
+    g = 3 - pf->gshift / 8;
+    b = 3 - pf->bshift / 8;
+#else
+    r = pf->rshift / 8;
+    g = pf->gshift / 8;
+    b = pf->bshift / 8;
+#endif
+
+    if (g == 1 && r == 2 && b == 0) {
+        return JCS_EXT_BGRX;
+    } else if (g == 1 && r == 0 && b == 2) {
+        return JCS_EXT_RGBX;
+    } else if (g == 2 && r == 3 && b == 1) {
+        return JCS_EXT_XBGR;
+    } else if (g == 2 && r == 1 && b == 3) {
+        return JCS_EXT_XRGB;
+    }
+    return JCS_UNKNOWN;
+}
+#endif
+
+/*
+ * Rectangles that are updated all the time, like video, are compressed with
+ * the faster but less accurate integer DCT.
+ */
+static int send_jpeg_rect(VncState *vs, int x, int y, int w, int h, int quality,
+                          bool fast)
 {
     struct jpeg_compress_struct cinfo;
     struct jpeg_error_mgr jerr;
     struct jpeg_destination_mgr manager;
+    J_COLOR_SPACE color_space = JCS_UNKNOWN;
     JSAMPROW row[1];
     uint8_t *buf;
     int dy;
@@ -1277,14 +1325,26 @@ static int send_jpeg_rect(VncState *vs, int x, int y, int w, int h, int quality)
     cinfo.err = jpeg_std_error(&jerr);
     jpeg_create_compress(&cinfo);
 
+#ifdef JCS_EXTENSIONS
+    color_space = jpeg_surface_color_space(vs);
+#endif
+
     cinfo.client_data = vs;
     cinfo.image_width = w;
     cinfo.image_height = h;
-    cinfo.input_components = 3;
-    cinfo.in_color_space = JCS_RGB;
+    if (color_space != JCS_UNKNOWN) {
+        cinfo.input_components = 4;
+        cinfo.in_color_space = color_space;
+    } else {
+        cinfo.input_components = 3;
+        cinfo.in_color_space = JCS_RGB;
+    }
 
     jpeg_set_defaults(&cinfo);
     jpeg_set_quality(&cinfo, quality, true);
+    if (fast) {
+        cinfo.dct_method = JDCT_IFAST;
+    }
 
     manager.init_destination = jpeg_init_destination;
     manager.empty_output_buffer = jpeg_empty_output_buffer;
@@ -1293,13 +1353,22 @@ static int send_jpeg_rect(VncState *vs, int x, int y, int w, int h, int quality)
 
     jpeg_start_compress(&cinfo, true);
 
-    buf = g_malloc(w * 3);
-    row[0] = buf;
-    for (dy = 0; dy < h; dy++) {
-        rgb_prepare_row(vs, buf, x, y + dy, w);
-        jpeg_write_scanlines(&cinfo, row, 1);
+    if (color_space != JCS_UNKNOWN) {
+        /* feed rows straight from the server surface */
+        buf = vs->vd->server->data + y * ds_get_linesize(vs->ds) + x * 4;
+        for (dy = 0; dy < h; dy++) {
+            row[0] = buf + dy * ds_get_linesize(vs->ds);
+            jpeg_write_scanlines(&cinfo, row, 1);
+        }
+    } else {
+        buf = g_malloc(w * 3);
+        row[0] = buf;
+        for (dy = 0; dy < h; dy++) {
+            rgb_prepare_row(vs, buf, x, y + dy, w);
+            jpeg_write_scanlines(&cinfo, row, 1);
+        }
+        g_free(buf);
     }
-    g_free(buf);
 
     jpeg_finish_compress(&cinfo);
     jpeg_destroy_compress(&cinfo);
@@ -1512,7 +1581,7 @@ static int send_sub_rect_jpeg(VncState *vs, int x, int y, int w, int h,
                       tight_detect_smooth_image(vs, w, h))) {
             int quality = tight_conf[vs->tight.quality].jpeg_quality;
 
-            ret = send_jpeg_rect(vs, x, y, w, h, quality);
+            ret = send_jpeg_rect(vs, x, y, w, h, quality, force);
         } else {
             ret = send_full_color_rect(vs, x, y, w, h);
         }
@@ -1526,7 +1595,7 @@ static int send_sub_rect_jpeg(VncState *vs, int x, int y, int w, int h,
                       tight_detect_smooth_image(vs, w, h))) {
             int quality = tight_conf[vs->tight.quality].jpeg_quality;
 
-            ret = send_jpeg_rect(vs, x, y, w, h, quality);
+            ret = send_jpeg_rect(vs, x, y, w, h, quality, force);
         } else {
             ret = send_palette_rect(vs, x, y, w, h, palette);
         }
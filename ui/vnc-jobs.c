@@ -41,19 +41,27 @@
  * - VncState::output lock: used to make sure the output buffer is not corrupted
  * 		   	 if two threads try to write on it at the same time
  *
- * While the VNC worker thread is working, the VncDisplay global lock is hold
- * to avoid screen corruptions (this does not block vnc_refresh() because it
- * uses trylock()) but the output lock is not hold because the thread work on
- * its own output buffer.
+ * While a VNC worker thread is working, it holds the VncDisplay lock in
+ * shared mode to avoid screen corruptions (this does not block vnc_refresh()
+ * because it uses trylock()) but the output lock is not hold because the
+ * thread work on its own output buffer.
  * When the encoding job is done, the worker thread will hold the output lock
  * and copy its output buffer in vs->output.
+ *
+ * Several worker threads share the queue.  The zlib based encodings keep
+ * stream state that the client decodes in order, so a client's jobs are
+ * never encoded concurrently: a worker only takes the oldest job of a client,
+ * and only once no other worker is running a job for the same client.
+ * Clients are encoded in parallel and their output stays in order.
 */
 
+#define VNC_WORKER_THREADS 4
+
 struct VncJobQueue {
     QemuCond cond;
     QemuMutex mutex;
-    QemuThread thread;
-    Buffer buffer;
+    QemuThread threads[VNC_WORKER_THREADS];
+    int nthreads;
     bool exit;
     QTAILQ_HEAD(, VncJob) jobs;
 };
@@ -61,8 +69,7 @@ struct VncJobQueue {
 typedef struct VncJobQueue VncJobQueue;
 
 /*
- * We use a single global queue, but most of the functions are
- * already reetrant, so we can easilly add more than one encoding thread
+ * We use a single global queue, served by a pool of encoding threads
  */
 static VncJobQueue *queue;
 
@@ -142,7 +149,8 @@ void vnc_jobs_clear(VncState *vs)
 
     vnc_lock_queue(queue);
     QTAILQ_FOREACH_SAFE(job, &queue->jobs, next, tmp) {
-        if (job->vs == vs || !vs) {
+        /* running jobs are removed by their worker */
+        if ((job->vs == vs || !vs) && !job->running) {
             QTAILQ_REMOVE(&queue->jobs, job, next);
         }
     }
@@ -176,29 +184,58 @@ void vnc_jobs_consume_buffer(VncState *vs)
     }
 }
 
+/*
+ * Return the next job that can be encoded, that is the oldest job of a
+ * client no other worker is busy with
+ */
+static VncJob *vnc_job_next_locked(VncJobQueue *queue)
+{
+    VncJob *job, *prev;
+
+    QTAILQ_FOREACH(job, &queue->jobs, next) {
+        bool blocked = false;
+
+        for (prev = QTAILQ_FIRST(&queue->jobs); prev != job;
+             prev = QTAILQ_NEXT(prev, next)) {
+            if (prev->vs == job->vs) {
+                blocked = true;
+                break;
+            }
+        }
+        if (!blocked && !job->running) {
+            return job;
+        }
+    }
+    return NULL;
+}
+
 /*
  * Copy data for local use
  */
-static void vnc_async_encoding_start(VncState *orig, VncState *local)
+static void vnc_async_encoding_start(VncState *orig, VncState *local,
+                                     Buffer *buffer)
 {
     local->vnc_encoding = orig->vnc_encoding;
     local->features = orig->features;
+    local->drain_fast = orig->drain_fast;
     local->ds = orig->ds;
     local->vd = orig->vd;
     local->lossy_rect = orig->lossy_rect;
     local->write_pixels = orig->write_pixels;
+    local->pixel_conv_to = orig->pixel_conv_to;
     local->clientds = orig->clientds;
     local->tight = orig->tight;
     local->zlib = orig->zlib;
     local->hextile = orig->hextile;
     local->zrle = orig->zrle;
-    local->output =  queue->buffer;
+    local->output = *buffer;
     local->csock = -1; /* Don't do any network work on this thread */
 
     buffer_reset(&local->output);
 }
 
-static void vnc_async_encoding_end(VncState *orig, VncState *local)
+static void vnc_async_encoding_end(VncState *orig, VncState *local,
+                                   Buffer *buffer)
 {
     orig->tight = local->tight;
     orig->zlib = local->zlib;
@@ -206,10 +243,10 @@ static void vnc_async_encoding_end(VncState *orig, VncState *local)
     orig->zrle = local->zrle;
     orig->lossy_rect = local->lossy_rect;
 
-    queue->buffer = local->output;
+    *buffer = local->output;
 }
 
-static int vnc_worker_thread_loop(VncJobQueue *queue)
+static int vnc_worker_thread_loop(VncJobQueue *queue, Buffer *buffer)
 {
     VncJob *job;
     VncRectEntry *entry, *tmp;
@@ -218,16 +255,15 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
     int saved_offset;
 
     vnc_lock_queue(queue);
-    while (QTAILQ_EMPTY(&queue->jobs) && !queue->exit) {
+    while (!queue->exit && !(job = vnc_job_next_locked(queue))) {
         qemu_cond_wait(&queue->cond, &queue->mutex);
     }
-    /* Here job can only be NULL if queue->exit is true */
-    job = QTAILQ_FIRST(&queue->jobs);
-    vnc_unlock_queue(queue);
-
     if (queue->exit) {
+        vnc_unlock_queue(queue);
         return -1;
     }
+    job->running = true;
+    vnc_unlock_queue(queue);
 
     vnc_lock_output(job->vs);
     if (job->vs->csock == -1 || job->vs->abort == true) {
@@ -237,7 +273,7 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
     vnc_unlock_output(job->vs);
 
     /* Make a local copy of vs and switch output buffers */
-    vnc_async_encoding_start(job->vs, &vs);
+    vnc_async_encoding_start(job->vs, &vs, buffer);
 
     /* Start sending rectangles */
     n_rectangles = 0;
@@ -246,12 +282,13 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
     saved_offset = vs.output.offset;
     vnc_write_u16(&vs, 0);
 
-    vnc_lock_display(job->vs->vd);
+    vnc_lock_display_shared(job->vs->vd);
     QLIST_FOREACH_SAFE(entry, &job->rectangles, next, tmp) {
         int n;
 
         if (job->vs->csock == -1) {
-            vnc_unlock_display(job->vs->vd);
+            vnc_unlock_display_shared(job->vs->vd);
+            *buffer = vs.output;
             goto disconnected;
         }
 
@@ -263,7 +300,7 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
         }
         g_free(entry);
     }
-    vnc_unlock_display(job->vs->vd);
+    vnc_unlock_display_shared(job->vs->vd);
 
     /* Put n_rectangles at the beginning of the message */
     vs.output.buffer[saved_offset] = (n_rectangles >> 8) & 0xFF;
@@ -275,9 +312,11 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
         buffer_append(&job->vs->jobs_buffer, vs.output.buffer,
                       vs.output.offset);
         /* Copy persistent encoding data */
-        vnc_async_encoding_end(job->vs, &vs);
+        vnc_async_encoding_end(job->vs, &vs, buffer);
 
 	qemu_bh_schedule(job->vs->bh);
+    } else {
+        *buffer = vs.output;
     }
     vnc_unlock_output(job->vs);
 
@@ -304,7 +343,6 @@ static void vnc_queue_clear(VncJobQueue *q)
 {
     qemu_cond_destroy(&queue->cond);
     qemu_mutex_destroy(&queue->mutex);
-    buffer_free(&queue->buffer);
     g_free(q);
     queue = NULL; /* Unset global queue */
 }
@@ -312,24 +350,37 @@ static void vnc_queue_clear(VncJobQueue *q)
 static void *vnc_worker_thread(void *arg)
 {
     VncJobQueue *queue = arg;
+    Buffer buffer = { 0 };
+    bool last;
 
-    qemu_thread_get_self(&queue->thread);
+    while (!vnc_worker_thread_loop(queue, &buffer)) ;
+    buffer_free(&buffer);
 
-    while (!vnc_worker_thread_loop(queue)) ;
-    vnc_queue_clear(queue);
+    /* The last thread out frees the queue */
+    vnc_lock_queue(queue);
+    last = --queue->nthreads == 0;
+    vnc_unlock_queue(queue);
+    if (last) {
+        vnc_queue_clear(queue);
+    }
     return NULL;
 }
 
 void vnc_start_worker_thread(void)
 {
     VncJobQueue *q;
+    int i;
 
     if (vnc_worker_thread_running())
         return ;
 
     q = vnc_queue_init();
-    qemu_thread_create(&q->thread, vnc_worker_thread, q, QEMU_THREAD_DETACHED);
+    q->nthreads = VNC_WORKER_THREADS;
     queue = q; /* Set global queue */
+    for (i = 0; i < VNC_WORKER_THREADS; i++) {
+        qemu_thread_create(&q->threads[i], vnc_worker_thread, q,
+                           QEMU_THREAD_DETACHED);
+    }
 }
 
 bool vnc_worker_thread_running(void)
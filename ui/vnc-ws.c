@@ -0,0 +1,333 @@
+/*
+ * QEMU VNC display driver: WebSocket transport
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * Lets browser clients such as noVNC connect without a proxy.  The
+ * RFB stream is carried in binary frames (RFC 6455).  The frames sent
+ * to the client are not assembled anywhere: the header of each frame
+ * is sent together with the pending bytes in the output Buffer.
+ */
+
+#include "vnc.h"
+#include "iov.h"
+#include "qemu_socket.h"
+
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+#define WS_OPCODE_CONTINUATION  0x0
+#define WS_OPCODE_TEXT          0x1
+#define WS_OPCODE_BINARY        0x2
+#define WS_OPCODE_CLOSE         0x8
+
+#define WS_HEAD_FIN             0x80
+#define WS_HEAD_MASK            0x80
+#define WS_HEAD_OPCODE          0x0f
+#define WS_HEAD_LEN             0x7f
+
+/* Largest HTTP request accepted for the handshake */
+#define WS_MAX_HANDSHAKE        4096
+
+void vncws_connect(VncState *vs)
+{
+    vs->ws.enabled = true;
+}
+
+/*
+ * Return the value of header @name in the request @req, which ends
+ * with an empty line, or NULL.  The result must be g_free()d.
+ */
+static char *vncws_get_header(const char *req, const char *name)
+{
+    size_t len = strlen(name);
+    const char *line, *end;
+
+    for (line = strstr(req, "\r\n"); line; line = strstr(line, "\r\n")) {
+        line += 2;
+        if (!g_ascii_strncasecmp(line, name, len) && line[len] == ':') {
+            line += len + 1;
+            while (*line == ' ' || *line == '\t') {
+                line++;
+            }
+            end = strstr(line, "\r\n");
+            while (end > line && (end[-1] == ' ' || end[-1] == '\t')) {
+                end--;
+            }
+            return g_strndup(line, end - line);
+        }
+    }
+    return NULL;
+}
+
+/* Does the comma separated header value @list contain @token? */
+static bool vncws_has_token(const char *list, const char *token)
+{
+    char **tokens = g_strsplit(list, ",", 0);
+    bool found = false;
+    int i;
+
+    for (i = 0; tokens[i]; i++) {
+        if (!g_ascii_strcasecmp(g_strstrip(tokens[i]), token)) {
+            found = true;
+            break;
+        }
+    }
+    g_strfreev(tokens);
+    return found;
+}
+
+static bool vncws_handshake(VncState *vs, const char *req)
+{
+#if VNC_WS_SUPPORTED
+    char *key, *upgrade, *protocols, *accept, *reply;
+    GChecksum *sha1;
+    guint8 digest[20];
+    gsize digest_len = sizeof(digest);
+    bool binary = false;
+
+    upgrade = vncws_get_header(req, "Upgrade");
+    key = vncws_get_header(req, "Sec-WebSocket-Key");
+    if (strncmp(req, "GET ", 4) != 0 || !upgrade ||
+        g_ascii_strcasecmp(upgrade, "websocket") != 0 || !key) {
+        VNC_DEBUG("Not a WebSocket handshake\n");
+        g_free(upgrade);
+        g_free(key);
+        return false;
+    }
+    protocols = vncws_get_header(req, "Sec-WebSocket-Protocol");
+    if (protocols) {
+        /* the old base64 subprotocol is not supported */
+        binary = vncws_has_token(protocols, "binary");
+        g_free(protocols);
+        if (!binary) {
+            VNC_DEBUG("WebSocket client does not offer binary\n");
+            g_free(upgrade);
+            g_free(key);
+            return false;
+        }
+    }
+
+    sha1 = g_checksum_new(G_CHECKSUM_SHA1);
+    g_checksum_update(sha1, (guchar *)key, strlen(key));
+    g_checksum_update(sha1, (guchar *)WS_GUID, strlen(WS_GUID));
+    g_checksum_get_digest(sha1, digest, &digest_len);
+    g_checksum_free(sha1);
+    accept = g_base64_encode(digest, digest_len);
+
+    reply = g_strdup_printf("HTTP/1.1 101 Switching Protocols\r\n"
+                            "Upgrade: websocket\r\n"
+                            "Connection: Upgrade\r\n"
+                            "Sec-WebSocket-Accept: %s\r\n"
+                            "%s"
+                            "\r\n",
+                            accept,
+                            binary ? "Sec-WebSocket-Protocol: binary\r\n" : "");
+
+    /* nothing was queued before the handshake, so the reply is the head */
+    vnc_write(vs, reply, strlen(reply));
+    vs->ws.raw_left = strlen(reply);
+
+    g_free(reply);
+    g_free(accept);
+    g_free(upgrade);
+    g_free(key);
+    return true;
+#else
+    return false;
+#endif
+}
+
+/*
+ * Move the payload of complete frames from ws.input to input.  Returns
+ * false if the client has to be disconnected.
+ */
+static bool vncws_decode_frames(VncState *vs)
+{
+    Buffer *in = &vs->ws.input;
+
+    for (;;) {
+        uint8_t *p = in->buffer;
+        size_t head = 2, len, i;
+        uint8_t *mask;
+        int opcode;
+
+        if (in->offset < head) {
+            return true;
+        }
+        opcode = p[0] & WS_HEAD_OPCODE;
+        if (!(p[1] & WS_HEAD_MASK)) {
+            /* clients must mask what they send */
+            return false;
+        }
+        len = p[1] & WS_HEAD_LEN;
+        if (len == 126) {
+            head += 2;
+            if (in->offset < head) {
+                return true;
+            }
+            len = (p[2] << 8) | p[3];
+        } else if (len == 127) {
+            head += 8;
+            if (in->offset < head) {
+                return true;
+            }
+            if (p[2] | p[3] | p[4] | p[5]) {
+                return false;
+            }
+            len = ((size_t)p[6] << 24) | (p[7] << 16) | (p[8] << 8) | p[9];
+        }
+        if (len > VNC_WS_MAX_FRAME) {
+            return false;
+        }
+        mask = p + head;
+        head += 4;
+        if (in->offset < head + len) {
+            return true;
+        }
+
+        switch (opcode) {
+        case WS_OPCODE_CONTINUATION:
+        case WS_OPCODE_BINARY:
+            buffer_reserve(&vs->input, len);
+            for (i = 0; i < len; i++) {
+                vs->input.buffer[vs->input.offset + i] = p[head + i] ^ mask[i & 3];
+            }
+            vs->input.offset += len;
+            break;
+        case WS_OPCODE_CLOSE:
+        case WS_OPCODE_TEXT:
+            return false;
+        default:
+            /* ping and pong: browsers do not send pings on their own */
+            break;
+        }
+
+        memmove(in->buffer, in->buffer + head + len, in->offset - head - len);
+        in->offset -= head + len;
+    }
+}
+
+/*
+ * Read from the socket and append whatever RFB data it carried to
+ * vs->input.  Returns 0 if nothing was read or the client went away,
+ * like vnc_client_read_plain.
+ */
+long vncws_client_read(VncState *vs)
+{
+    Buffer *in = &vs->ws.input;
+    long ret;
+
+    buffer_reserve(in, 4096);
+    ret = vnc_client_read_buf(vs, buffer_end(in), 4096);
+    if (!ret) {
+        return 0;
+    }
+    in->offset += ret;
+
+    if (!vs->ws.handshake_done) {
+        uint8_t *end;
+
+        buffer_reserve(in, 1);
+        in->buffer[in->offset] = 0;
+        end = (uint8_t *)strstr((char *)in->buffer, "\r\n\r\n");
+        if (!end) {
+            if (in->offset > WS_MAX_HANDSHAKE ||
+                strlen((char *)in->buffer) != in->offset) {
+                vnc_client_error(vs);
+                return 0;
+            }
+            return ret;
+        }
+        end += 4;
+        end[-2] = 0;
+        if (!vncws_handshake(vs, (char *)in->buffer)) {
+            vnc_client_error(vs);
+            return 0;
+        }
+        memmove(in->buffer, end, in->buffer + in->offset - end);
+        in->offset -= end - in->buffer;
+        vs->ws.handshake_done = true;
+        vnc_start_protocol(vs);
+        if (vs->csock == -1) {
+            return 0;
+        }
+    }
+
+    if (!vncws_decode_frames(vs)) {
+        vnc_client_error(vs);
+        return 0;
+    }
+    return ret;
+}
+
+static void vncws_start_frame(VncState *vs, size_t len)
+{
+    uint8_t *h = vs->ws.header;
+
+    h[0] = WS_HEAD_FIN | WS_OPCODE_BINARY;
+    if (len < 126) {
+        h[1] = len;
+        vs->ws.header_len = 2;
+    } else if (len < 65536) {
+        h[1] = 126;
+        h[2] = len >> 8;
+        h[3] = len;
+        vs->ws.header_len = 4;
+    } else {
+        h[1] = 127;
+        h[2] = h[3] = h[4] = h[5] = 0;
+        h[6] = (uint64_t)len >> 24;
+        h[7] = len >> 16;
+        h[8] = len >> 8;
+        h[9] = len;
+        vs->ws.header_len = 10;
+    }
+    vs->ws.header_sent = 0;
+    vs->ws.payload_left = len;
+}
+
+/*
+ * Counterpart of vnc_client_write_buf for vs->output.  Returns how many
+ * bytes at the head of vs->output were sent, which may be 0 even when
+ * only part of a frame header went out.
+ */
+long vncws_client_write_buf(VncState *vs)
+{
+    struct iovec iov[2];
+    size_t header_left;
+    long ret;
+
+    if (vs->ws.raw_left) {
+        ret = vnc_client_write_buf(vs, vs->output.buffer,
+                                   MIN(vs->ws.raw_left, vs->output.offset));
+        vs->ws.raw_left -= ret;
+        return ret;
+    }
+
+    if (!vs->ws.payload_left) {
+        vncws_start_frame(vs, vs->output.offset);
+    }
+    header_left = vs->ws.header_len - vs->ws.header_sent;
+    iov[0].iov_base = vs->ws.header + vs->ws.header_sent;
+    iov[0].iov_len = header_left;
+    iov[1].iov_base = vs->output.buffer;
+    iov[1].iov_len = vs->ws.payload_left;
+
+    ret = iov_send(vs->csock, iov, 2, 0, header_left + vs->ws.payload_left);
+    VNC_DEBUG("Wrote ws frame %zd+%zd -> %ld\n",
+              header_left, vs->ws.payload_left, ret);
+    ret = vnc_client_io_error(vs, ret, socket_error());
+    if (ret <= 0) {
+        return 0;
+    }
+
+    if (ret <= header_left) {
+        vs->ws.header_sent += ret;
+        return 0;
+    }
+    vs->ws.header_sent = vs->ws.header_len;
+    ret -= header_left;
+    vs->ws.payload_left -= ret;
+    return ret;
+}
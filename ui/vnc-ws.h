@@ -0,0 +1,32 @@
+/*
+ * QEMU VNC display driver: WebSocket transport
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef __QEMU_VNC_WS_H__
+#define __QEMU_VNC_WS_H__
+
+/* SHA-1 for the handshake comes from GChecksum */
+#define VNC_WS_SUPPORTED GLIB_CHECK_VERSION(2, 16, 0)
+
+/* Largest frame accepted from a client; they only send small messages */
+#define VNC_WS_MAX_FRAME (1024 * 1024)
+
+typedef struct VncStateWS {
+    bool enabled;
+    bool handshake_done;
+    Buffer input;               /* received bytes, still framed */
+    size_t raw_left;            /* unframed handshake reply at head of output */
+    uint8_t header[10];         /* header of the frame being sent */
+    size_t header_len;
+    size_t header_sent;
+    size_t payload_left;        /* output bytes that belong to that frame */
+} VncStateWS;
+
+void vncws_connect(VncState *vs);
+long vncws_client_read(VncState *vs);
+long vncws_client_write_buf(VncState *vs);
+
+#endif /* __QEMU_VNC_WS_H__ */
@@ -32,8 +32,13 @@
 #include "acl.h"
 #include "qemu-objects.h"
 #include "qmp-commands.h"
+#include "qemu-memacct.h"
 #include "osdep.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #define VNC_REFRESH_INTERVAL_BASE 30
 #define VNC_REFRESH_INTERVAL_INC  50
 #define VNC_REFRESH_INTERVAL_MAX  2000
@@ -45,6 +50,8 @@ static const struct timeval VNC_REFRESH_LOSSY = { 2, 0 };
 
 static VncDisplay *vnc_display; /* needed for info vnc */
 static DisplayChangeListener *dcl;
+/* the server surface and the buffers of all clients and encoders */
+static MemAccount vnc_mem_account;
 
 static int vnc_cursor_define(VncState *vs);
 static void vnc_release_modifiers(VncState *vs);
@@ -466,6 +473,11 @@ void vnc_framebuffer_update(VncState *vs, int x, int y, int w, int h,
 void buffer_reserve(Buffer *buffer, size_t len)
 {
     if ((buffer->capacity - buffer->offset) < len) {
+        if (buffer->buffer) {
+            mem_account_resize(&vnc_mem_account, len + 1024);
+        } else {
+            mem_account_alloc(&vnc_mem_account, len + 1024);
+        }
         buffer->capacity += (len + 1024);
         buffer->buffer = g_realloc(buffer->buffer, buffer->capacity);
         if (buffer->buffer == NULL) {
@@ -492,6 +504,9 @@ void buffer_reset(Buffer *buffer)
 
 void buffer_free(Buffer *buffer)
 {
+    if (buffer->buffer) {
+        mem_account_free(&vnc_mem_account, buffer->capacity);
+    }
     g_free(buffer->buffer);
     buffer->offset = 0;
     buffer->capacity = 0;
@@ -556,11 +571,16 @@ static void vnc_dpy_resize(DisplayState *ds)
     /* server surface */
     if (!vd->server)
         vd->server = g_malloc0(sizeof(*vd->server));
-    if (vd->server->data)
+    if (vd->server->data) {
+        mem_account_free(&vnc_mem_account,
+                         vd->server->linesize * vd->server->height);
         g_free(vd->server->data);
+    }
     *(vd->server) = *(ds->surface);
     vd->server->data = g_malloc0(vd->server->linesize *
                                     vd->server->height);
+    mem_account_alloc(&vnc_mem_account,
+                      vd->server->linesize * vd->server->height);
 
     /* guest surface */
     if (!vd->guest.ds)
@@ -666,6 +686,49 @@ static void vnc_write_pixels_generic(VncState *vs, struct PixelFormat *pf,
     }
 }
 
+/* server pixels in the one format pixel_conv() handles, see below */
+static void vnc_write_pixels_conv(VncState *vs, struct PixelFormat *pf,
+                                  void *pixels, int size)
+{
+    int n = size / 4;
+    size_t len = n * vs->clientds.pf.bytes_per_pixel;
+
+    buffer_reserve(&vs->output, len);
+    if (vs->csock != -1 && buffer_empty(&vs->output)) {
+        qemu_set_fd_handler2(vs->csock, NULL, vnc_client_read, vnc_client_write, vs);
+    }
+    pixel_conv(PIXEL_CONV_XRGB8888, vs->pixel_conv_to,
+               buffer_end(&vs->output), pixels, n);
+    vs->output.offset += len;
+}
+
+/* The PixelConvFormat @pf and @flags describe, or -1 */
+static int vnc_pixel_conv_format(PixelFormat *pf, int flags)
+{
+    if (flags & QEMU_BIG_ENDIAN_FLAG) {
+        return -1;
+    }
+    if (pf->bits_per_pixel == 32 && pf->rmax == 255 && pf->gmax == 255 &&
+        pf->bmax == 255 && pf->gshift == 8) {
+        if (pf->rshift == 16 && pf->bshift == 0) {
+            return PIXEL_CONV_XRGB8888;
+        }
+        if (pf->rshift == 0 && pf->bshift == 16) {
+            return PIXEL_CONV_XBGR8888;
+        }
+    }
+    if (pf->bits_per_pixel == 16 && pf->rmax == 31 && pf->bmax == 31 &&
+        pf->gshift == 5 && pf->bshift == 0) {
+        if (pf->gmax == 63 && pf->rshift == 11) {
+            return PIXEL_CONV_RGB565;
+        }
+        if (pf->gmax == 31 && pf->rshift == 10) {
+            return PIXEL_CONV_RGB555;
+        }
+    }
+    return -1;
+}
+
 int vnc_raw_send_framebuffer_update(VncState *vs, int x, int y, int w, int h)
 {
     int i;
@@ -680,11 +743,69 @@ int vnc_raw_send_framebuffer_update(VncState *vs, int x, int y, int w, int h)
     return 1;
 }
 
+/*
+ * Cheap content estimate for vnc_select_encoding: the number of
+ * distinct colors in a sparse grid of samples, up to @max + 1.
+ */
+static int vnc_sample_colors(VncState *vs, int x, int y, int w, int h,
+                             int max)
+{
+    DisplaySurface *server = vs->vd->server;
+    int bpp = server->pf.bytes_per_pixel;
+    VncPalette palette;
+    int i, j, n = 0;
+
+    palette_init(&palette, max + 1, server->pf.bits_per_pixel);
+    for (j = y; j < y + h; j += 8) {
+        uint8_t *row = server->data + j * server->linesize;
+
+        for (i = x; i < x + w; i += 8) {
+            uint32_t color;
+
+            switch (bpp) {
+            case 4:
+                color = ((uint32_t *)row)[i];
+                break;
+            case 2:
+                color = ((uint16_t *)row)[i];
+                break;
+            default:
+                color = row[i];
+                break;
+            }
+            n = palette_put(&palette, color);
+            if (n == 0) {
+                return max + 1;
+            }
+        }
+    }
+    return n;
+}
+
+/*
+ * Pick the encoding of one rectangle.  When the client drains its
+ * output faster than compression could help, zlib based encodings only
+ * burn CPU: send raw pixels, or hextile for flat content, which costs
+ * little to produce and still shrinks it.  Otherwise, or with
+ * adaptive encodings disabled, use what the client prefers.
+ */
+static int vnc_select_encoding(VncState *vs, int x, int y, int w, int h)
+{
+    if (vs->vd->non_adaptive || !vs->drain_fast) {
+        return vs->vnc_encoding;
+    }
+    if ((vs->features & VNC_FEATURE_HEXTILE_MASK) &&
+        vnc_sample_colors(vs, x, y, w, h, 16) <= 16) {
+        return VNC_ENCODING_HEXTILE;
+    }
+    return VNC_ENCODING_RAW;
+}
+
 int vnc_send_framebuffer_update(VncState *vs, int x, int y, int w, int h)
 {
     int n = 0;
 
-    switch(vs->vnc_encoding) {
+    switch(vnc_select_encoding(vs, x, y, w, h)) {
         case VNC_ENCODING_ZLIB:
             n = vnc_zlib_send_framebuffer_update(vs, x, y, w, h);
             break;
@@ -1026,6 +1147,7 @@ static void vnc_disconnect_finish(VncState *vs)
 
     buffer_free(&vs->input);
     buffer_free(&vs->output);
+    buffer_free(&vs->ws.input);
 
     qobject_decref(vs->info);
 
@@ -1144,6 +1266,51 @@ long vnc_client_write_buf(VncState *vs, const uint8_t *data, size_t datalen)
  * the buffered output data if the socket would block. Returns
  * -1 on error, and disconnects the client socket.
  */
+/*
+ * Estimate how fast the client takes data.  A burst runs from the
+ * first write of pending output to the write that empties it; bursts
+ * that had to wait for the socket measure the link, the others only
+ * show that it is at least that fast.
+ */
+static void vnc_update_drain_rate(VncState *vs, long written)
+{
+    int64_t now = qemu_get_clock_ns(rt_clock);
+    uint64_t sample;
+
+    if (!vs->drain_start) {
+        vs->drain_start = now;
+        vs->drain_bytes = 0;
+        vs->drain_congested = false;
+    }
+    vs->drain_bytes += written;
+    if (vs->output.offset) {
+        /* the socket took less than it was offered */
+        vs->drain_congested = true;
+        return;
+    }
+
+    /* at least a millisecond, for bursts that fit in the socket buffer */
+    sample = (uint64_t)vs->drain_bytes * 1000000000ULL /
+             MAX(now - vs->drain_start, 1000000);
+    vs->drain_start = 0;
+    if (vs->drain_congested) {
+        vs->drain_rate = vs->drain_rate ?
+                         (vs->drain_rate * 3 + sample) / 4 : sample;
+    } else if (vs->drain_bytes >= VNC_DRAIN_MIN_BYTES &&
+               sample > vs->drain_rate) {
+        vs->drain_rate = vs->drain_rate ?
+                         (vs->drain_rate * 3 + sample) / 4 : sample;
+    } else {
+        return;
+    }
+
+    if (vs->drain_rate >= VNC_DRAIN_FAST_RATE) {
+        vs->drain_fast = true;
+    } else if (vs->drain_rate < VNC_DRAIN_SLOW_RATE) {
+        vs->drain_fast = false;
+    }
+}
+
 static long vnc_client_write_plain(VncState *vs)
 {
     long ret;
@@ -1161,12 +1328,17 @@ static long vnc_client_write_plain(VncState *vs)
             vs->sasl.waitWriteSSF -= ret;
     } else
 #endif /* CONFIG_VNC_SASL */
+    if (vs->ws.enabled) {
+        ret = vncws_client_write_buf(vs);
+    } else {
         ret = vnc_client_write_buf(vs, vs->output.buffer, vs->output.offset);
+    }
     if (!ret)
         return 0;
 
     memmove(vs->output.buffer, vs->output.buffer + ret, (vs->output.offset - ret));
     vs->output.offset -= ret;
+    vnc_update_drain_rate(vs, ret);
 
     if (vs->output.offset == 0) {
         qemu_set_fd_handler2(vs->csock, NULL, vnc_client_read, NULL, vs);
@@ -1294,7 +1466,11 @@ void vnc_client_read(void *opaque)
         ret = vnc_client_read_sasl(vs);
     else
 #endif /* CONFIG_VNC_SASL */
+    if (vs->ws.enabled) {
+        ret = vncws_client_read(vs);
+    } else {
         ret = vnc_client_read_plain(vs);
+    }
     if (!ret) {
         if (vs->csock == -1)
             vnc_disconnect_finish(vs);
@@ -1861,7 +2037,18 @@ static void set_pixel_conversion(VncState *vs)
         vs->write_pixels = vnc_write_pixels_copy;
         vnc_hextile_set_pixel_conversion(vs, 0);
     } else {
-        vs->write_pixels = vnc_write_pixels_generic;
+        int from = vnc_pixel_conv_format(&vs->ds->surface->pf,
+                                         vs->ds->surface->flags);
+        int to = vnc_pixel_conv_format(&vs->clientds.pf,
+                                       vs->clientds.flags);
+
+        if (from == PIXEL_CONV_XRGB8888 && to >= 0 &&
+            pixel_conv_supported(from, to)) {
+            vs->pixel_conv_to = to;
+            vs->write_pixels = vnc_write_pixels_conv;
+        } else {
+            vs->write_pixels = vnc_write_pixels_generic;
+        }
         vnc_hextile_set_pixel_conversion(vs, 1);
     }
 }
@@ -2524,12 +2711,52 @@ static void vnc_rect_updated(VncDisplay *vd, int x, int y, struct timeval * tv)
     rect->updated = true;
 }
 
+/*
+ * Copy a chunk of the guest surface to the server surface if it changed.
+ * Returns true if it did.
+ */
+static inline bool vnc_sync_chunk(uint8_t *server_ptr,
+                                  const uint8_t *guest_ptr, int len)
+{
+#ifdef __SSE2__
+    if ((len & (sizeof(__m128i) - 1)) == 0) {
+        __m128i diff = _mm_setzero_si128();
+        int i;
+
+        /* Without an early exit the loop is branch-free; chunks are only
+         * one to four vectors long.
+         */
+        for (i = 0; i < len; i += sizeof(__m128i)) {
+            __m128i g = _mm_loadu_si128((const __m128i *)(guest_ptr + i));
+            __m128i s = _mm_loadu_si128((const __m128i *)(server_ptr + i));
+
+            diff = _mm_or_si128(diff, _mm_xor_si128(g, s));
+        }
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(diff, _mm_setzero_si128())) ==
+            0xFFFF) {
+            return false;
+        }
+        for (i = 0; i < len; i += sizeof(__m128i)) {
+            _mm_storeu_si128((__m128i *)(server_ptr + i),
+                _mm_loadu_si128((const __m128i *)(guest_ptr + i)));
+        }
+        return true;
+    }
+#endif
+    if (memcmp(server_ptr, guest_ptr, len) == 0) {
+        return false;
+    }
+    memcpy(server_ptr, guest_ptr, len);
+    return true;
+}
+
 static int vnc_refresh_server_surface(VncDisplay *vd)
 {
     int y;
     uint8_t *guest_row;
     uint8_t *server_row;
     int cmp_bytes;
+    int nchunks;
     VncState *vs;
     int has_dirty = 0;
 
@@ -2551,29 +2778,27 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
     }
     guest_row  = vd->guest.ds->data;
     server_row = vd->server->data;
+    nchunks = vd->guest.ds->width / 16;
+    vd->refresh_checked = 0;
     for (y = 0; y < vd->guest.ds->height; y++) {
-        if (!bitmap_empty(vd->guest.dirty[y], VNC_DIRTY_BITS)) {
-            int x;
-            uint8_t *guest_ptr;
-            uint8_t *server_ptr;
-
-            guest_ptr  = guest_row;
-            server_ptr = server_row;
-
-            for (x = 0; x + 15 < vd->guest.ds->width;
-                    x += 16, guest_ptr += cmp_bytes, server_ptr += cmp_bytes) {
-                if (!test_and_clear_bit((x / 16), vd->guest.dirty[y]))
-                    continue;
-                if (memcmp(server_ptr, guest_ptr, cmp_bytes) == 0)
-                    continue;
-                memcpy(server_ptr, guest_ptr, cmp_bytes);
-                if (!vd->non_adaptive)
-                    vnc_rect_updated(vd, x, y, &tv);
-                QTAILQ_FOREACH(vs, &vd->clients, next) {
-                    set_bit((x / 16), vs->dirty[y]);
-                }
-                has_dirty++;
+        unsigned long *dirty = vd->guest.dirty[y];
+        int i;
+
+        /* Skip clean parts of the row a word of the bitmap at a time */
+        for (i = find_first_bit(dirty, nchunks); i < nchunks;
+             i = find_next_bit(dirty, nchunks, i + 1)) {
+            clear_bit(i, dirty);
+            vd->refresh_checked++;
+            if (!vnc_sync_chunk(server_row + i * cmp_bytes,
+                                guest_row + i * cmp_bytes, cmp_bytes)) {
+                continue;
             }
+            if (!vd->non_adaptive)
+                vnc_rect_updated(vd, i * 16, y, &tv);
+            QTAILQ_FOREACH(vs, &vd->clients, next) {
+                set_bit(i, vs->dirty[y]);
+            }
+            has_dirty++;
         }
         guest_row  += ds_get_linesize(vd->ds);
         server_row += ds_get_linesize(vd->ds);
@@ -2610,7 +2835,15 @@ static void vnc_refresh(void *opaque)
         return;
 
     if (has_dirty && rects) {
-        vd->timer_interval /= 2;
+        /* Speed up quickly when much of what the guest touched really
+         * changed.  A guest that keeps rewriting the same pixels, or only
+         * animates a few of them, does not need the fastest refresh.
+         */
+        if (has_dirty * 4 >= vd->refresh_checked) {
+            vd->timer_interval /= 2;
+        } else {
+            vd->timer_interval -= VNC_REFRESH_INTERVAL_INC;
+        }
         if (vd->timer_interval < VNC_REFRESH_INTERVAL_BASE)
             vd->timer_interval = VNC_REFRESH_INTERVAL_BASE;
     } else {
@@ -2640,12 +2873,26 @@ static void vnc_remove_timer(VncDisplay *vd)
     }
 }
 
-static void vnc_connect(VncDisplay *vd, int csock, int skipauth)
+/*
+ * Send the RFB greeting.  WebSocket clients only get it once their
+ * handshake is done.
+ */
+void vnc_start_protocol(VncState *vs)
+{
+    vnc_write(vs, "RFB 003.008\n", 12);
+    vnc_flush(vs);
+    vnc_read_when(vs, protocol_version, 12);
+}
+
+static void vnc_connect(VncDisplay *vd, int csock, int skipauth, bool websocket)
 {
     VncState *vs = g_malloc0(sizeof(VncState));
     int i;
 
     vs->csock = csock;
+    if (websocket) {
+        vncws_connect(vs);
+    }
 
     if (skipauth) {
 	vs->auth = VNC_AUTH_NONE;
@@ -2690,9 +2937,9 @@ static void vnc_connect(VncDisplay *vd, int csock, int skipauth)
 
     vga_hw_update();
 
-    vnc_write(vs, "RFB 003.008\n", 12);
-    vnc_flush(vs);
-    vnc_read_when(vs, protocol_version, 12);
+    if (!websocket) {
+        vnc_start_protocol(vs);
+    }
     reset_keys(vs);
     if (vs->vd->lock_key_sync)
         vs->led = qemu_add_led_event_handler(kbd_leds, vs);
@@ -2716,7 +2963,22 @@ static void vnc_listen_read(void *opaque)
 
     int csock = qemu_accept(vs->lsock, (struct sockaddr *)&addr, &addrlen);
     if (csock != -1) {
-        vnc_connect(vs, csock, 0);
+        vnc_connect(vs, csock, 0, false);
+    }
+}
+
+static void vnc_listen_websocket_read(void *opaque)
+{
+    VncDisplay *vs = opaque;
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+
+    /* Catch-up */
+    vga_hw_update();
+
+    int csock = qemu_accept(vs->lwebsock, (struct sockaddr *)&addr, &addrlen);
+    if (csock != -1) {
+        vnc_connect(vs, csock, 0, true);
     }
 }
 
@@ -2731,10 +2993,12 @@ void vnc_display_init(DisplayState *ds)
     vnc_display = vs;
 
     vs->lsock = -1;
+    vs->lwebsock = -1;
 
     vs->ds = ds;
     QTAILQ_INIT(&vs->clients);
     vs->expires = TIME_MAX;
+    mem_account_register(&vnc_mem_account, "vnc", NULL);
 
     if (keyboard_layout)
         vs->kbd_layout = init_keyboard_layout(name2keysym, keyboard_layout);
@@ -2772,6 +3036,11 @@ void vnc_display_close(DisplayState *ds)
         close(vs->lsock);
         vs->lsock = -1;
     }
+    if (vs->lwebsock != -1) {
+        qemu_set_fd_handler2(vs->lwebsock, NULL, NULL, NULL, NULL);
+        close(vs->lwebsock);
+        vs->lwebsock = -1;
+    }
     vs->auth = VNC_AUTH_INVALID;
 #ifdef CONFIG_VNC_TLS
     vs->subauth = VNC_AUTH_INVALID;
@@ -2861,6 +3130,7 @@ int vnc_display_open(DisplayState *ds, const char *display)
     int acl = 0;
 #endif
     int lock_key_sync = 1;
+    char *websocket = NULL;
 
     if (!vnc_display)
         return -1;
@@ -2890,6 +3160,12 @@ int vnc_display_open(DisplayState *ds, const char *display)
             reverse = 1;
         } else if (strncmp(options, "no-lock-key-sync", 16) == 0) {
             lock_key_sync = 0;
+        } else if (strncmp(options, "websocket=", 10) == 0) {
+            const char *end = strchr(options, ',');
+            size_t len = end ? end - (options + 10) : strlen(options + 10);
+
+            g_free(websocket);
+            websocket = g_strndup(options + 10, len);
 #ifdef CONFIG_VNC_SASL
         } else if (strncmp(options, "sasl", 4) == 0) {
             sasl = 1; /* Require SASL auth */
@@ -2944,6 +3220,7 @@ int vnc_display_open(DisplayState *ds, const char *display)
                 vs->share_policy = VNC_SHARE_POLICY_FORCE_SHARED;
             } else {
                 fprintf(stderr, "unknown vnc share= option\n");
+                g_free(websocket);
                 g_free(vs->display);
                 vs->display = NULL;
                 return -1;
@@ -2951,6 +3228,33 @@ int vnc_display_open(DisplayState *ds, const char *display)
         }
     }
 
+    if (websocket) {
+        const char *reason = NULL;
+
+        if (!VNC_WS_SUPPORTED) {
+            reason = "needs glib 2.16 or newer";
+        } else if (reverse) {
+            reason = "cannot be used with reverse";
+        } else if (strncmp(display, "unix:", 5) == 0) {
+            reason = "needs a TCP display";
+#ifdef CONFIG_VNC_TLS
+        } else if (tls) {
+            reason = "cannot be used with tls";
+#endif
+#ifdef CONFIG_VNC_SASL
+        } else if (sasl) {
+            reason = "cannot be used with sasl";
+#endif
+        }
+        if (reason) {
+            fprintf(stderr, "vnc websocket= %s\n", reason);
+            g_free(websocket);
+            g_free(vs->display);
+            vs->display = NULL;
+            return -1;
+        }
+    }
+
 #ifdef CONFIG_VNC_TLS
     if (acl && x509 && vs->tls.x509verify) {
         if (!(vs->tls.acl = qemu_acl_init("vnc.x509dname"))) {
@@ -3069,7 +3373,7 @@ int vnc_display_open(DisplayState *ds, const char *display)
         } else {
             int csock = vs->lsock;
             vs->lsock = -1;
-            vnc_connect(vs, csock, 0);
+            vnc_connect(vs, csock, 0, false);
         }
         return 0;
 
@@ -3086,11 +3390,33 @@ int vnc_display_open(DisplayState *ds, const char *display)
         }
         if (-1 == vs->lsock) {
             g_free(dpy);
+            g_free(websocket);
             return -1;
         } else {
             g_free(vs->display);
             vs->display = dpy;
         }
+        if (websocket) {
+            /* same host as the display, port given as is */
+            size_t hostlen = strcspn(display, ",");
+            char *addr;
+
+            while (hostlen > 0 && display[hostlen - 1] != ':') {
+                hostlen--;
+            }
+            addr = g_strdup_printf("%.*s:%s", hostlen ? (int)hostlen - 1 : 0,
+                                   display, websocket);
+
+            vs->lwebsock = inet_listen(addr, NULL, 0, SOCK_STREAM, 0, NULL);
+            g_free(addr);
+            g_free(websocket);
+            if (-1 == vs->lwebsock) {
+                vnc_display_close(ds);
+                return -1;
+            }
+            qemu_set_fd_handler2(vs->lwebsock, NULL,
+                                 vnc_listen_websocket_read, NULL, vs);
+        }
     }
     return qemu_set_fd_handler2(vs->lsock, NULL, vnc_listen_read, NULL, vs);
 }
@@ -3099,5 +3425,5 @@ void vnc_display_add_client(DisplayState *ds, int csock, int skipauth)
 {
     VncDisplay *vs = ds ? (VncDisplay *)ds->opaque : vnc_display;
 
-    vnc_connect(vs, csock, skipauth);
+    vnc_connect(vs, csock, skipauth, false);
 }
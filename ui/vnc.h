@@ -38,6 +38,7 @@
 #include <stdbool.h>
 
 #include "keymaps.h"
+#include "pixel-conv.h"
 #include "vnc-palette.h"
 #include "vnc-enc-zrle.h"
 
@@ -63,6 +64,8 @@ typedef struct Buffer
 } Buffer;
 
 typedef struct VncState VncState;
+
+#include "vnc-ws.h"
 typedef struct VncJob VncJob;
 typedef struct VncRect VncRect;
 typedef struct VncRectEntry VncRectEntry;
@@ -88,6 +91,13 @@ typedef void VncSendHextileTile(VncState *vs,
 #define VNC_STAT_COLS (VNC_MAX_WIDTH / VNC_STAT_RECT)
 #define VNC_STAT_ROWS (VNC_MAX_HEIGHT / VNC_STAT_RECT)
 
+/* Drain rates (bytes per second) above which compression is skipped,
+ * and below which it is used again */
+#define VNC_DRAIN_FAST_RATE (40 * 1024 * 1024)
+#define VNC_DRAIN_SLOW_RATE (20 * 1024 * 1024)
+/* Bursts that never filled the socket must be this big to count */
+#define VNC_DRAIN_MIN_BYTES (64 * 1024)
+
 #define VNC_AUTH_CHALLENGE_SIZE 16
 
 typedef struct VncDisplay VncDisplay;
@@ -140,11 +150,14 @@ struct VncDisplay
     VncSharePolicy share_policy;
     QEMUTimer *timer;
     int timer_interval;
+    int refresh_checked;        /* dirty chunks compared by the last refresh */
     int lsock;
+    int lwebsock;               /* -1 unless websocket= was given */
     DisplayState *ds;
     kbd_layout_t *kbd_layout;
     int lock_key_sync;
     QemuMutex mutex;
+    int encoders;               /* workers using the server surface */
 
     QEMUCursor *cursor;
     int cursor_msize;
@@ -229,6 +242,7 @@ struct VncRectEntry
 struct VncJob
 {
     VncState *vs;
+    bool running;               /* taken by a worker thread */
 
     QLIST_HEAD(, VncRectEntry) rectangles;
     QTAILQ_ENTRY(VncJob) next;
@@ -256,6 +270,13 @@ struct VncState
 
     uint32_t vnc_encoding;
 
+    /* output drain rate, see vnc_update_drain_rate() */
+    int64_t drain_start;
+    size_t drain_bytes;
+    bool drain_congested;
+    uint64_t drain_rate;        /* bytes per second, 0 until measured */
+    bool drain_fast;            /* compression does not pay off */
+
     int major;
     int minor;
 
@@ -268,6 +289,7 @@ struct VncState
 #ifdef CONFIG_VNC_SASL
     VncStateSASL sasl;
 #endif
+    VncStateWS ws;
 
     QObject *info;
 
@@ -275,6 +297,7 @@ struct VncState
     Buffer input;
     /* current output mode information */
     VncWritePixels *write_pixels;
+    PixelConvFormat pixel_conv_to; /* for vnc_write_pixels_conv */
     DisplaySurface clientds;
 
     CaptureVoiceOut *audio_cap;
@@ -502,6 +525,7 @@ uint32_t read_u32(uint8_t *data, size_t offset);
 void vnc_client_error(VncState *vs);
 int vnc_client_io_error(VncState *vs, int ret, int last_errno);
 
+void vnc_start_protocol(VncState *vs);
 void start_client_init(VncState *vs);
 void start_auth_vnc(VncState *vs);
 
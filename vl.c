@@ -162,6 +162,9 @@ int main(int argc, char **argv)
 
 #include "trace.h"
 #include "trace/control.h"
+#ifdef CONFIG_TRACE_SIMPLE
+#include "trace/simple.h"
+#endif
 #include "qemu-queue.h"
 #include "cpus.h"
 #include "arch_init.h"
@@ -190,6 +193,8 @@ int mem_prealloc = 0; /* force preallocation of physical target memory */
 int nb_nics;
 NICInfo nd_table[MAX_NICS];
 int autostart;
+bool startup_profile;
+static int64_t startup_profile_start, startup_profile_last;
 static int rtc_utc = 1;
 static int rtc_date_offset = -1; /* -1 means no change */
 QEMUClock *rtc_clock;
@@ -211,6 +216,9 @@ int smp_cores = 1;
 int smp_threads = 1;
 #ifdef CONFIG_VNC
 const char *vnc_display;
+#ifdef CONFIG_POSIX
+static const char *shm_display;
+#endif
 #endif
 int acpi_enabled = 1;
 int no_hpet = 0;
@@ -248,6 +256,8 @@ QTAILQ_HEAD(, FWBootEntry) fw_boot_order = QTAILQ_HEAD_INITIALIZER(fw_boot_order
 int nb_numa_nodes;
 uint64_t node_mem[MAX_NODES];
 unsigned long *node_cpumask[MAX_NODES];
+int node_host_policy[MAX_NODES];
+unsigned long *node_host_mask[MAX_NODES];
 
 uint8_t qemu_uuid[16];
 
@@ -266,6 +276,7 @@ int xen_allowed = 0;
 uint32_t xen_domid;
 enum xen_mode xen_mode = XEN_EMULATE;
 static int tcg_tb_size;
+static int tcg_sample_rate;
 
 static int default_serial = 1;
 static int default_parallel = 1;
@@ -303,6 +314,33 @@ const char *qemu_get_vm_name(void)
     return qemu_name;
 }
 
+/*
+ * With -startup-profile, report the time spent in @phase, which
+ * started when the previous phase ended
+ */
+static void startup_profile_phase(const char *phase)
+{
+    int64_t now = get_clock();
+
+    if (startup_profile) {
+        fprintf(stderr, "startup: %-34s %8" PRId64 " us\n",
+                phase, (now - startup_profile_last) / SCALE_US);
+    }
+    startup_profile_last = now;
+}
+
+/*
+ * With -startup-profile, report the time spent in one step of a
+ * phase (e.g. initializing a device) which began at @start
+ */
+void startup_profile_step(const char *what, int64_t start)
+{
+    if (startup_profile) {
+        fprintf(stderr, "startup:   %-32s %8" PRId64 " us\n",
+                what, (get_clock() - start) / SCALE_US);
+    }
+}
+
 static void res_free(void)
 {
     if (boot_splash_filedata != NULL) {
@@ -1021,6 +1059,36 @@ static void numa_add(const char *optarg)
 
             bitmap_set(node_cpumask[nodenr], value, endvalue-value+1);
         }
+        if (get_param_value(option, 128, "hostnodes", optarg) != 0) {
+            value = strtoull(option, &endptr, 10);
+            if (*endptr == '-') {
+                endvalue = strtoull(endptr+1, &endptr, 10);
+            } else {
+                endvalue = value;
+            }
+            if (*endptr || endvalue < value || endvalue >= MAX_HOST_NODES) {
+                fprintf(stderr, "qemu: invalid numa hostnodes: %s\n", optarg);
+                exit(1);
+            }
+            bitmap_set(node_host_mask[nodenr], value, endvalue-value+1);
+            node_host_policy[nodenr] = NUMA_POLICY_BIND;
+        }
+        if (get_param_value(option, 128, "policy", optarg) != 0) {
+            if (node_host_policy[nodenr] == NUMA_POLICY_DEFAULT) {
+                fprintf(stderr, "qemu: numa policy requires hostnodes\n");
+                exit(1);
+            }
+            if (!strcmp(option, "bind")) {
+                node_host_policy[nodenr] = NUMA_POLICY_BIND;
+            } else if (!strcmp(option, "preferred")) {
+                node_host_policy[nodenr] = NUMA_POLICY_PREFERRED;
+            } else if (!strcmp(option, "interleave")) {
+                node_host_policy[nodenr] = NUMA_POLICY_INTERLEAVE;
+            } else {
+                fprintf(stderr, "qemu: invalid numa policy: %s\n", option);
+                exit(1);
+            }
+        }
         nb_numa_nodes++;
     }
     return;
@@ -1329,6 +1397,9 @@ void vm_state_notify(int running, RunState state)
 
 void vm_start(void)
 {
+    if (qemu_ram_prealloc_defer_start()) {
+        return;
+    }
     if (!runstate_is_running()) {
         cpu_enable_ticks();
         runstate_set(RUN_STATE_RUNNING);
@@ -1359,6 +1430,8 @@ static NotifierList suspend_notifiers =
     NOTIFIER_LIST_INITIALIZER(suspend_notifiers);
 static NotifierList wakeup_notifiers =
     NOTIFIER_LIST_INITIALIZER(wakeup_notifiers);
+static NotifierList cpu_hotplug_notifiers =
+    NOTIFIER_LIST_INITIALIZER(cpu_hotplug_notifiers);
 static uint32_t wakeup_reason_mask = ~0;
 static RunState vmstop_requested = RUN_STATE_MAX;
 
@@ -1549,6 +1622,21 @@ void qemu_register_wakeup_notifier(Notifier *notifier)
     notifier_list_add(&wakeup_notifiers, notifier);
 }
 
+void qemu_system_cpu_hotplug(int id, bool plugged)
+{
+    CPUHotplugEvent event = {
+        .id = id,
+        .plugged = plugged,
+    };
+
+    notifier_list_notify(&cpu_hotplug_notifiers, &event);
+}
+
+void qemu_register_cpu_hotplug_notifier(Notifier *notifier)
+{
+    notifier_list_add(&cpu_hotplug_notifiers, notifier);
+}
+
 void qemu_system_killed(int signal, pid_t pid)
 {
     shutdown_signal = signal;
@@ -1836,6 +1924,17 @@ static DisplayType select_display(const char *p)
 #else
         fprintf(stderr, "Curses support is disabled\n");
         exit(1);
+#endif
+    } else if (strstart(p, "shm", &opts)) {
+#ifdef CONFIG_POSIX
+        display = DT_SHM;
+        if (!strstart(opts, "=", &shm_display) || !*shm_display) {
+            fprintf(stderr, "shm display requires shm=<path>\n");
+            exit(1);
+        }
+#else
+        fprintf(stderr, "shm display is not supported on this host\n");
+        exit(1);
 #endif
     } else if (strstart(p, "none", &opts)) {
         display = DT_NONE;
@@ -2174,6 +2273,24 @@ static QEMUMachine *machine_parse(const char *name)
 
 static int tcg_init(void)
 {
+    const char *threads = NULL;
+    QemuOptsList *list = qemu_find_opts("machine");
+
+    if (!QTAILQ_EMPTY(&list->head)) {
+        threads = qemu_opt_get(QTAILQ_FIRST(&list->head), "tcg-threads");
+    }
+    if (threads && strcmp(threads, "multi") == 0) {
+        if (!mttcg_available()) {
+            fprintf(stderr, "tcg-threads=multi is not supported for this "
+                    "host and target\n");
+            exit(1);
+        }
+        mttcg_enabled = 1;
+    } else if (threads && strcmp(threads, "single") != 0) {
+        fprintf(stderr, "Invalid tcg-threads value: %s\n", threads);
+        exit(1);
+    }
+
     tcg_exec_init(tcg_tb_size * 1024 * 1024);
     return 0;
 }
@@ -2397,6 +2514,7 @@ int main(int argc, char **argv, char **envp)
 
     init_clocks();
     rtc_clock = host_clock;
+    startup_profile_start = startup_profile_last = get_clock();
 
     qemu_cache_utils_init(envp);
 
@@ -2414,6 +2532,8 @@ int main(int argc, char **argv, char **envp)
     for (i = 0; i < MAX_NODES; i++) {
         node_mem[i] = 0;
         node_cpumask[i] = bitmap_new(MAX_CPUMASK_BITS);
+        node_host_policy[i] = NUMA_POLICY_DEFAULT;
+        node_host_mask[i] = bitmap_new(MAX_HOST_NODES);
     }
 
     nb_numa_nodes = 0;
@@ -2850,6 +2970,13 @@ int main(int argc, char **argv, char **envp)
                 }
                 default_monitor = 0;
                 break;
+            case QEMU_OPTION_event_throttle:
+                opts = qemu_opts_parse(qemu_find_opts("event-throttle"),
+                                       optarg, 1);
+                if (!opts) {
+                    exit(1);
+                }
+                break;
             case QEMU_OPTION_chardev:
                 opts = qemu_opts_parse(qemu_find_opts("chardev"), optarg, 1);
                 if (!opts) {
@@ -2871,7 +2998,7 @@ int main(int argc, char **argv, char **envp)
             case QEMU_OPTION_virtfs: {
                 QemuOpts *fsdev;
                 QemuOpts *device;
-                const char *writeout, *sock_fd, *socket;
+                const char *writeout, *cache, *sock_fd, *socket;
 
                 olist = qemu_find_opts("virtfs");
                 if (!olist) {
@@ -2908,6 +3035,10 @@ int main(int argc, char **argv, char **envp)
                     exit(1);
 #endif
                 }
+                cache = qemu_opt_get(opts, "cache");
+                if (cache) {
+                    qemu_opt_set(fsdev, "cache", cache);
+                }
                 qemu_opt_set(fsdev, "fsdriver", qemu_opt_get(opts, "fsdriver"));
                 qemu_opt_set(fsdev, "path", qemu_opt_get(opts, "path"));
                 qemu_opt_set(fsdev, "security_model",
@@ -3196,6 +3327,9 @@ int main(int argc, char **argv, char **envp)
                 incoming = optarg;
                 runstate_set(RUN_STATE_INMIGRATE);
                 break;
+            case QEMU_OPTION_migration_page_store:
+                migration_page_store = optarg;
+                break;
             case QEMU_OPTION_nodefaults:
                 default_serial = 0;
                 default_parallel = 0;
@@ -3236,6 +3370,12 @@ int main(int argc, char **argv, char **envp)
                 }
                 trace_events = qemu_opt_get(opts, "events");
                 trace_file = qemu_opt_get(opts, "file");
+#ifdef CONFIG_TRACE_SIMPLE
+                if (qemu_opt_get(opts, "flight-recorder")) {
+                    st_set_flight_recorder(
+                        qemu_opt_get_number(opts, "flight-recorder", 0));
+                }
+#endif
                 break;
             }
             case QEMU_OPTION_readconfig:
@@ -3282,6 +3422,26 @@ int main(int argc, char **argv, char **envp)
             case QEMU_OPTION_qtest_log:
                 qtest_log = optarg;
                 break;
+            case QEMU_OPTION_startup_profile:
+                startup_profile = true;
+                break;
+            case QEMU_OPTION_perfmap:
+                tb_perf_map_open();
+                break;
+            case QEMU_OPTION_tcg_stats:
+                tcg_stats_enable();
+                break;
+            case QEMU_OPTION_tcg_sample: {
+                char *end;
+
+                tcg_sample_rate = strtol(optarg, &end, 10);
+                if (*end || tcg_sample_rate < 1 || tcg_sample_rate > 10000) {
+                    fprintf(stderr, "qemu: invalid -tcg-sample rate: %s\n",
+                            optarg);
+                    exit(1);
+                }
+                break;
+            }
             case QEMU_OPTION_sandbox:
                 opts = qemu_opts_parse(qemu_find_opts("sandbox"), optarg, 1);
                 if (!opts) {
@@ -3294,6 +3454,7 @@ int main(int argc, char **argv, char **envp)
         }
     }
     loc_set_none();
+    startup_profile_phase("options");
 
     if (qemu_opts_foreach(qemu_find_opts("sandbox"), parse_sandbox, NULL, 0)) {
         exit(1);
@@ -3446,6 +3607,7 @@ int main(int argc, char **argv, char **envp)
     }
 
     configure_accelerator();
+    startup_profile_phase("accelerator");
 
     qemu_init_cpu_loop();
     if (qemu_init_main_loop()) {
@@ -3501,6 +3663,19 @@ int main(int argc, char **argv, char **envp)
     }
     configure_icount(icount_option);
 
+    if (mttcg_enabled) {
+        Error *mttcg_blocker = NULL;
+
+        if (use_icount) {
+            fprintf(stderr, "-icount is not allowed with tcg-threads=multi\n");
+            exit(1);
+        }
+        /* the vCPU threads race with the dirty memory tracking */
+        error_set(&mttcg_blocker, ERROR_CLASS_GENERIC_ERROR,
+                  "Migration is not supported with tcg-threads=multi");
+        migrate_add_blocker(mttcg_blocker);
+    }
+
     if (net_init_clients() < 0) {
         exit(1);
     }
@@ -3535,6 +3710,7 @@ int main(int argc, char **argv, char **envp)
                   IF_FLOPPY, 0, FD_OPTS);
     default_drive(default_sdcard, snapshot, machine->use_scsi,
                   IF_SD, 0, SD_OPTS);
+    startup_profile_phase("backends");
 
     register_savevm_live(NULL, "ram", 0, 4, &savevm_ram_handlers, NULL);
 
@@ -3615,6 +3791,7 @@ int main(int argc, char **argv, char **envp)
 
     machine->init(ram_size, boot_devices,
                   kernel_filename, kernel_cmdline, initrd_filename, cpu_model);
+    startup_profile_phase("machine");
 
     cpu_synchronize_all_post_init();
 
@@ -3631,6 +3808,7 @@ int main(int argc, char **argv, char **envp)
     /* init generic devices */
     if (qemu_opts_foreach(qemu_find_opts("device"), device_init_func, NULL, 1) != 0)
         exit(1);
+    startup_profile_phase("devices");
 
     net_check_clients();
 
@@ -3668,6 +3846,11 @@ int main(int argc, char **argv, char **envp)
     case DT_SDL:
         cocoa_display_init(ds, full_screen);
         break;
+#endif
+#if defined(CONFIG_POSIX)
+    case DT_SHM:
+        shm_display_init(ds, shm_display);
+        break;
 #endif
     default:
         break;
@@ -3720,12 +3903,17 @@ int main(int argc, char **argv, char **envp)
         fprintf(stderr, "rom loading failed\n");
         exit(1);
     }
+    startup_profile_phase("displays and roms");
 
     /* TODO: once all bus devices are qdevified, this should be done
      * when bus is created by qdev.c */
     qemu_register_reset(qbus_reset_all_fn, sysbus_get_default());
     qemu_run_machine_init_done_notifiers();
 
+    if (tcg_sample_rate && tcg_enabled()) {
+        tcg_sample_start(tcg_sample_rate);
+    }
+
     qemu_system_reset(VMRESET_SILENT);
     if (loadvm) {
         if (load_vmstate(loadvm) < 0) {
@@ -3750,6 +3938,11 @@ int main(int argc, char **argv, char **envp)
     }
 
     os_setup_post();
+    startup_profile_phase("reset and start");
+    if (startup_profile) {
+        fprintf(stderr, "startup: %-34s %8" PRId64 " us\n", "total",
+                (startup_profile_last - startup_profile_start) / SCALE_US);
+    }
 
     resume_all_vcpus();
     main_loop();
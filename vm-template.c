@@ -0,0 +1,319 @@
+/*
+ * VM templates: guest RAM laid out for mmap, plus the device state
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * A template holds the RAM blocks of a stopped guest as raw images,
+ * followed by the device state in the migration format.  Restoring with
+ * "-incoming template:FILE" maps the RAM blocks MAP_PRIVATE from the file
+ * instead of reading them: the guest starts once the device state is
+ * loaded, pages are read from the file when first touched, and clones
+ * restored from the same template share the pages they do not write in
+ * the host page cache.
+ *
+ * Layout, all numbers big endian:
+ *
+ *   be32 magic, be32 version, be32 header size, be32 number of blocks,
+ *   be64 offset of the device state,
+ *   per block: u8 idstr length, idstr, be64 length, be64 offset,
+ *
+ * padded to VM_TEMPLATE_ALIGN, then the blocks, each aligned to
+ * VM_TEMPLATE_ALIGN so that any host page size can map them, then the
+ * device state.
+ */
+
+#include <sys/types.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+#include "qemu-common.h"
+#include "cpu.h"
+#include "hw/hw.h"
+#include "sysemu.h"
+#include "kvm.h"
+#include "migration.h"
+#include "qmp-commands.h"
+#include "qerror.h"
+
+#define VM_TEMPLATE_MAGIC       0x51564d54      /* "QVMT" */
+#define VM_TEMPLATE_VERSION     1
+#define VM_TEMPLATE_ALIGN       (64 * 1024)
+#define VM_TEMPLATE_FIXED_SIZE  24
+#define VM_TEMPLATE_MAX_HEADER  (1024 * 1024)   /* thousands of blocks */
+
+static uint64_t vm_template_align(uint64_t offset)
+{
+    return (offset + VM_TEMPLATE_ALIGN - 1) & ~(uint64_t)(VM_TEMPLATE_ALIGN - 1);
+}
+
+/* Called with the ramlist lock held; returns the header, or NULL if a
+   block cannot be saved */
+static uint8_t *vm_template_header(uint32_t *header_size, Error **errp)
+{
+    RAMBlock *block;
+    uint8_t *header, *p;
+    uint64_t offset;
+    uint32_t size = VM_TEMPLATE_FIXED_SIZE, nb_blocks = 0;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        if (!block->host) {
+            error_set(errp, QERR_UNSUPPORTED);
+            return NULL;
+        }
+        size += 1 + strlen(block->idstr) + 16;
+        nb_blocks++;
+    }
+
+    header = g_malloc0(size);
+    stl_be_p(header, VM_TEMPLATE_MAGIC);
+    stl_be_p(header + 4, VM_TEMPLATE_VERSION);
+    stl_be_p(header + 8, size);
+    stl_be_p(header + 12, nb_blocks);
+
+    p = header + VM_TEMPLATE_FIXED_SIZE;
+    offset = vm_template_align(size);
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        size_t len = strlen(block->idstr);
+
+        *p++ = len;
+        memcpy(p, block->idstr, len);
+        p += len;
+        stq_be_p(p, block->length);
+        stq_be_p(p + 8, offset);
+        p += 16;
+        offset = vm_template_align(offset + block->length);
+    }
+    stq_be_p(header + 16, offset);
+
+    *header_size = size;
+    return header;
+}
+
+static int vm_template_write(int fd, const void *buf, size_t len,
+                             uint64_t offset)
+{
+    if (lseek(fd, offset, SEEK_SET) < 0 ||
+        qemu_write_full(fd, buf, len) != len) {
+        return -errno;
+    }
+    return 0;
+}
+
+void qmp_vm_template_save(const char *filename, Error **errp)
+{
+    RAMBlock *block;
+    QEMUFile *f;
+    uint8_t *header;
+    uint32_t header_size;
+    uint64_t offset;
+    int saved_vm_running;
+    int fd, ret;
+
+    if (qemu_savevm_state_blocked(errp)) {
+        return;
+    }
+
+    saved_vm_running = runstate_is_running();
+    vm_stop(RUN_STATE_SAVE_VM);
+
+    fd = qemu_open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0600);
+    if (fd < 0) {
+        error_set(errp, QERR_OPEN_FILE_FAILED, filename);
+        goto the_end;
+    }
+
+    qemu_mutex_lock_ramlist();
+    header = vm_template_header(&header_size, errp);
+    if (!header) {
+        qemu_mutex_unlock_ramlist();
+        close(fd);
+        goto the_end;
+    }
+    ret = vm_template_write(fd, header, header_size, 0);
+
+    offset = vm_template_align(header_size);
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        if (ret < 0) {
+            break;
+        }
+        ret = vm_template_write(fd, block->host, block->length, offset);
+        offset = vm_template_align(offset + block->length);
+    }
+    qemu_mutex_unlock_ramlist();
+    g_free(header);
+
+    if (ret == 0 && lseek(fd, offset, SEEK_SET) < 0) {
+        ret = -errno;
+    }
+    if (ret < 0) {
+        close(fd);
+        error_set(errp, QERR_IO_ERROR);
+        goto the_end;
+    }
+
+    /* the device state follows the RAM, through a stream of its own */
+    f = qemu_fdopen(fd, "wb");
+    if (!f) {
+        close(fd);
+        error_set(errp, QERR_IO_ERROR);
+        goto the_end;
+    }
+    ret = qemu_save_device_state(f);
+    if (qemu_fclose(f) < 0 || ret < 0) {
+        error_set(errp, QERR_IO_ERROR);
+    }
+
+ the_end:
+    if (saved_vm_running) {
+        vm_start();
+    }
+}
+
+#ifndef _WIN32
+static RAMBlock *vm_template_find_block(const char *idstr)
+{
+    RAMBlock *block;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        if (!strcmp(block->idstr, idstr)) {
+            return block;
+        }
+    }
+    return NULL;
+}
+
+/* Replaces the RAM of each block by a private mapping of its image */
+static int vm_template_map_ram(int fd, const uint8_t *header,
+                               uint32_t header_size, Error **errp)
+{
+    const uint8_t *p = header + VM_TEMPLATE_FIXED_SIZE;
+    const uint8_t *end = header + header_size;
+    uint32_t nb_blocks = ldl_be_p(header + 12);
+    uint32_t i = 0;
+    RAMBlock *block;
+    char idstr[256];
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        i++;
+    }
+    if (i != nb_blocks) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "template",
+                  "a template of a guest with the same RAM blocks");
+        return -EINVAL;
+    }
+
+    for (i = 0; i < nb_blocks; i++) {
+        uint64_t length, offset;
+        size_t len;
+
+        if (p >= end || p + 1 + *p + 16 > end) {
+            error_set(errp, QERR_INVALID_PARAMETER_VALUE, "template",
+                      "a valid template");
+            return -EINVAL;
+        }
+        len = *p++;
+        memcpy(idstr, p, len);
+        idstr[len] = 0;
+        p += len;
+        length = ldq_be_p(p);
+        offset = ldq_be_p(p + 8);
+        p += 16;
+
+        block = vm_template_find_block(idstr);
+        if (!block || block->length != length ||
+            (offset & (VM_TEMPLATE_ALIGN - 1))) {
+            error_set(errp, QERR_INVALID_PARAMETER_VALUE, "template",
+                      "a template of a guest with the same RAM blocks");
+            return -EINVAL;
+        }
+        /* preallocated and shared RAM belong to someone else */
+        if (block->flags & (RAM_PREALLOC_MASK | RAM_SHARED_MASK)) {
+            error_set(errp, QERR_UNSUPPORTED);
+            return -ENOTSUP;
+        }
+        if (mmap(block->host, length, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_FIXED, fd, offset) != block->host) {
+            int ret = -errno;
+
+            error_set(errp, QERR_IO_ERROR);
+            return ret;
+        }
+        qemu_madvise(block->host, length, QEMU_MADV_MERGEABLE);
+    }
+    return 0;
+}
+
+int template_start_incoming_migration(const char *filename, Error **errp)
+{
+    uint8_t fixed[VM_TEMPLATE_FIXED_SIZE], *header;
+    uint32_t header_size;
+    struct stat st;
+    QEMUFile *f;
+    int fd, ret;
+
+    if (mem_path || (kvm_enabled() && !kvm_has_sync_mmu())) {
+        error_set(errp, QERR_UNSUPPORTED);
+        return -ENOTSUP;
+    }
+
+    fd = qemu_open(filename, O_RDONLY | O_BINARY);
+    if (fd < 0) {
+        ret = -errno;
+        error_set(errp, QERR_OPEN_FILE_FAILED, filename);
+        return ret;
+    }
+
+    if (fstat(fd, &st) < 0) {
+        ret = -errno;
+        error_set(errp, QERR_IO_ERROR);
+        close(fd);
+        return ret;
+    }
+    /* the header size comes from the file, check it before allocating */
+    if (pread(fd, fixed, sizeof(fixed), 0) != sizeof(fixed) ||
+        ldl_be_p(fixed) != VM_TEMPLATE_MAGIC ||
+        ldl_be_p(fixed + 4) != VM_TEMPLATE_VERSION ||
+        ldl_be_p(fixed + 8) < sizeof(fixed) ||
+        ldl_be_p(fixed + 8) > VM_TEMPLATE_MAX_HEADER ||
+        ldl_be_p(fixed + 8) > st.st_size) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "template",
+                  "a valid template");
+        close(fd);
+        return -EINVAL;
+    }
+    header_size = ldl_be_p(fixed + 8);
+    header = g_malloc(header_size);
+    if (pread(fd, header, header_size, 0) != header_size) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "template",
+                  "a valid template");
+        ret = -EINVAL;
+    } else {
+        qemu_mutex_lock_ramlist();
+        ret = vm_template_map_ram(fd, header, header_size, errp);
+        qemu_mutex_unlock_ramlist();
+    }
+    if (ret == 0 && lseek(fd, ldq_be_p(header + 16), SEEK_SET) < 0) {
+        ret = -errno;
+        error_set(errp, QERR_IO_ERROR);
+    }
+    g_free(header);
+    if (ret < 0) {
+        close(fd);
+        return ret;
+    }
+
+    /* the mappings keep their own reference to the file */
+    f = qemu_fdopen(fd, "rb");
+    if (!f) {
+        close(fd);
+        error_set(errp, QERR_IO_ERROR);
+        return -EIO;
+    }
+    process_incoming_migration(f);
+    qemu_fclose(f);
+
+    return 0;
+}
+#endif
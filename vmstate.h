@@ -37,6 +37,8 @@ typedef struct SaveVMHandlers {
     int (*save_live_complete)(QEMUFile *f, void *opaque);
     void (*cancel)(void *opaque);
     LoadStateHandler *load_state;
+    /* called at the end of qemu_loadvm_state() if a section was loaded */
+    void (*load_cleanup)(void *opaque);
     bool (*is_active)(void *opaque);
 } SaveVMHandlers;
 
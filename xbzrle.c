@@ -0,0 +1,266 @@
+/*
+ * Xor Based Zero Run Length Encoding
+ *
+ * Copyright 2012 Red Hat, Inc. and/or its affiliates
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#include "qemu-common.h"
+#include "host-utils.h"
+#include "migration.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+  page = zrun nzrun
+       | zrun nzrun page
+
+  zrun = length
+
+  nzrun = length byte...
+
+  length = uleb128 encoded integer
+ */
+
+/*
+ * Run finders.  Each returns the length of the run of equal (zrun) or
+ * different (nzrun) bytes at the start of @a and @b, at most @len.
+ * The long versions expect @a and @b to be equally aligned.
+ */
+static inline int xbzrle_zrun_long(const uint8_t *a, const uint8_t *b, int len)
+{
+    int i = 0;
+
+    /* not aligned to sizeof(long) */
+    while (i < len && ((uintptr_t)(a + i) % sizeof(long)) && a[i] == b[i]) {
+        i++;
+    }
+
+    /* word at a time for speed */
+    if (!((uintptr_t)(a + i) % sizeof(long))) {
+        while (i + sizeof(long) <= len &&
+               *(long *)(a + i) == *(long *)(b + i)) {
+            i += sizeof(long);
+        }
+    }
+
+    /* go over the rest */
+    while (i < len && a[i] == b[i]) {
+        i++;
+    }
+
+    return i;
+}
+
+static inline int xbzrle_nzrun_long(const uint8_t *a, const uint8_t *b,
+                                    int len)
+{
+    /* truncation to 32-bit long okay */
+    const long mask = (long)0x0101010101010101ULL;
+    int i = 0;
+
+    /* not aligned to sizeof(long) */
+    while (i < len && ((uintptr_t)(a + i) % sizeof(long)) && a[i] != b[i]) {
+        i++;
+    }
+
+    /* word at a time for speed, stop at the first long with a zero byte */
+    if (!((uintptr_t)(a + i) % sizeof(long))) {
+        while (i + sizeof(long) <= len) {
+            long xor = *(long *)(a + i) ^ *(long *)(b + i);
+
+            if ((xor - mask) & ~xor & (mask << 7)) {
+                break;
+            }
+            i += sizeof(long);
+        }
+    }
+
+    /* found the end of the nzrun within the current long, or the tail */
+    while (i < len && a[i] != b[i]) {
+        i++;
+    }
+
+    return i;
+}
+
+#ifdef __SSE2__
+/* 16 bytes at a time; a movemask bit is set for every equal byte */
+static inline int xbzrle_zrun_sse2(const uint8_t *a, const uint8_t *b, int len)
+{
+    int i = 0;
+
+    while (i + sizeof(__m128i) <= len) {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+        unsigned int eq = _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb));
+
+        if (eq != 0xffff) {
+            return i + ctz32(~eq);
+        }
+        i += sizeof(__m128i);
+    }
+
+    while (i < len && a[i] == b[i]) {
+        i++;
+    }
+
+    return i;
+}
+
+static inline int xbzrle_nzrun_sse2(const uint8_t *a, const uint8_t *b,
+                                    int len)
+{
+    int i = 0;
+
+    while (i + sizeof(__m128i) <= len) {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+        unsigned int eq = _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb));
+
+        if (eq) {
+            return i + ctz32(eq);
+        }
+        i += sizeof(__m128i);
+    }
+
+    while (i < len && a[i] != b[i]) {
+        i++;
+    }
+
+    return i;
+}
+#endif
+
+/*
+ * Both encoders produce exactly the same output; @simd is a constant in
+ * each caller, so the compiler generates a specialized copy for each.
+ */
+static inline int xbzrle_encode(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                                uint8_t *dst, int dlen, bool simd)
+{
+    uint32_t zrun_len, nzrun_len;
+    int d = 0, i = 0;
+
+    g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
+               sizeof(long)));
+
+    while (i < slen) {
+        /* overflow */
+        if (d + 2 > dlen) {
+            return -1;
+        }
+
+#ifdef __SSE2__
+        if (simd) {
+            zrun_len = xbzrle_zrun_sse2(old_buf + i, new_buf + i, slen - i);
+        } else
+#endif
+        {
+            zrun_len = xbzrle_zrun_long(old_buf + i, new_buf + i, slen - i);
+        }
+        i += zrun_len;
+
+        /* buffer unchanged */
+        if (zrun_len == slen) {
+            return 0;
+        }
+
+        /* skip last zero run */
+        if (i == slen) {
+            return d;
+        }
+
+        d += uleb128_encode_small(dst + d, zrun_len);
+
+        /* overflow */
+        if (d + 2 > dlen) {
+            return -1;
+        }
+
+#ifdef __SSE2__
+        if (simd) {
+            nzrun_len = xbzrle_nzrun_sse2(old_buf + i, new_buf + i, slen - i);
+        } else
+#endif
+        {
+            nzrun_len = xbzrle_nzrun_long(old_buf + i, new_buf + i, slen - i);
+        }
+
+        d += uleb128_encode_small(dst + d, nzrun_len);
+        /* overflow */
+        if (d + nzrun_len > dlen) {
+            return -1;
+        }
+        memcpy(dst + d, new_buf + i, nzrun_len);
+        d += nzrun_len;
+        i += nzrun_len;
+    }
+
+    return d;
+}
+
+int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen)
+{
+    return xbzrle_encode(old_buf, new_buf, slen, dst, dlen, true);
+}
+
+int xbzrle_encode_buffer_scalar(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                                uint8_t *dst, int dlen)
+{
+    return xbzrle_encode(old_buf, new_buf, slen, dst, dlen, false);
+}
+
+int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
+{
+    int i = 0, d = 0;
+    int ret;
+    uint32_t count = 0;
+
+    while (i < slen) {
+
+        /* zrun */
+        if ((slen - i) < 2) {
+            return -1;
+        }
+
+        ret = uleb128_decode_small(src + i, &count);
+        if (ret < 0 || (i && !count)) {
+            return -1;
+        }
+        i += ret;
+        d += count;
+
+        /* overflow */
+        if (d > dlen) {
+            return -1;
+        }
+
+        /* nzrun */
+        if ((slen - i) < 2) {
+            return -1;
+        }
+
+        ret = uleb128_decode_small(src + i, &count);
+        if (ret < 0 || !count) {
+            return -1;
+        }
+        i += ret;
+
+        /* overflow */
+        if (d + count > dlen || i + count > slen) {
+            return -1;
+        }
+
+        memcpy(dst + d, src + i, count);
+        d += count;
+        i += count;
+    }
+
+    return d;
+}
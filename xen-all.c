@@ -306,6 +306,10 @@ go_physmap:
         }
     }
 
+    /* the pages moved from one range to the other */
+    xen_invalidate_map_cache_range(phys_offset, size);
+    xen_invalidate_map_cache_range(start_addr, size);
+
     physmap = g_malloc(sizeof (XenPhysmap));
 
     physmap->start_addr = start_addr;
@@ -366,6 +370,9 @@ static int xen_remove_from_physmap(XenIOState *state,
     DPRINTF("unmapping vram to %llx - %llx, from %llx\n",
             phys_offset, phys_offset + size, start_addr);
 
+    xen_invalidate_map_cache_range(phys_offset, size);
+    xen_invalidate_map_cache_range(start_addr, size);
+
     size >>= TARGET_PAGE_BITS;
     start_addr >>= TARGET_PAGE_BITS;
     phys_offset >>= TARGET_PAGE_BITS;
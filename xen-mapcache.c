@@ -21,6 +21,9 @@
 
 #include "xen-mapcache.h"
 #include "trace.h"
+#include "qemu-config.h"
+#include "qmp-commands.h"
+#include "qerror.h"
 
 
 //#define MAPCACHE_DEBUG
@@ -59,6 +62,7 @@ typedef struct MapCacheEntry {
     uint8_t lock;
     target_phys_addr_t size;
     struct MapCacheEntry *next;
+    QTAILQ_ENTRY(MapCacheEntry) lru;
 } MapCacheEntry;
 
 typedef struct MapCacheRev {
@@ -72,6 +76,9 @@ typedef struct MapCache {
     MapCacheEntry *entry;
     unsigned long nr_buckets;
     QTAILQ_HEAD(map_cache_head, MapCacheRev) locked_entries;
+    /* mapped entries, the least recently used first */
+    QTAILQ_HEAD(, MapCacheEntry) lru;
+    target_phys_addr_t mapped_size;
 
     /* For most cases (>99.9%), the page address is the same. */
     target_phys_addr_t last_address_index;
@@ -81,6 +88,10 @@ typedef struct MapCache {
 
     phys_offset_to_gaddr_t phys_offset_to_gaddr;
     void *opaque;
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
 } MapCache;
 
 static MapCache *mapcache;
@@ -96,7 +107,8 @@ static inline int test_bits(int nr, int size, const unsigned long *addr)
 
 void xen_map_cache_init(phys_offset_to_gaddr_t f, void *opaque)
 {
-    unsigned long size;
+    QemuOptsList *list = qemu_find_opts("machine");
+    unsigned long size, max_size = MCACHE_MAX_SIZE;
     struct rlimit rlimit_as;
 
     mapcache = g_malloc0(sizeof (MapCache));
@@ -105,12 +117,19 @@ void xen_map_cache_init(phys_offset_to_gaddr_t f, void *opaque)
     mapcache->opaque = opaque;
 
     QTAILQ_INIT(&mapcache->locked_entries);
+    QTAILQ_INIT(&mapcache->lru);
     mapcache->last_address_index = -1;
 
+    if (!QTAILQ_EMPTY(&list->head)) {
+        max_size = qemu_opt_get_size(QTAILQ_FIRST(&list->head),
+                                     "xen-mapcache-size", max_size);
+        max_size = MAX(max_size, MCACHE_BUCKET_SIZE);
+    }
+
     if (geteuid() == 0) {
         rlimit_as.rlim_cur = RLIM_INFINITY;
         rlimit_as.rlim_max = RLIM_INFINITY;
-        mapcache->max_mcache_size = MCACHE_MAX_SIZE;
+        mapcache->max_mcache_size = max_size;
     } else {
         getrlimit(RLIMIT_AS, &rlimit_as);
         rlimit_as.rlim_cur = rlimit_as.rlim_max;
@@ -119,11 +138,11 @@ void xen_map_cache_init(phys_offset_to_gaddr_t f, void *opaque)
             fprintf(stderr, "Warning: QEMU's maximum size of virtual"
                     " memory is not infinity.\n");
         }
-        if (rlimit_as.rlim_max < MCACHE_MAX_SIZE + NON_MCACHE_MEMORY_SIZE) {
+        if (rlimit_as.rlim_max < max_size + NON_MCACHE_MEMORY_SIZE) {
             mapcache->max_mcache_size = rlimit_as.rlim_max -
                 NON_MCACHE_MEMORY_SIZE;
         } else {
-            mapcache->max_mcache_size = MCACHE_MAX_SIZE;
+            mapcache->max_mcache_size = max_size;
         }
     }
 
@@ -141,6 +160,62 @@ void xen_map_cache_init(phys_offset_to_gaddr_t f, void *opaque)
     mapcache->entry = g_malloc0(size);
 }
 
+/* Unmap @entry, which stays in its bucket as an unused entry */
+static void xen_unmap_entry(MapCacheEntry *entry)
+{
+    if (munmap(entry->vaddr_base, entry->size) != 0) {
+        perror("unmap fails");
+        exit(-1);
+    }
+    QTAILQ_REMOVE(&mapcache->lru, entry, lru);
+    mapcache->mapped_size -= entry->size;
+    if (mapcache->last_address_vaddr == entry->vaddr_base) {
+        mapcache->last_address_index = -1;
+        mapcache->last_address_vaddr = NULL;
+    }
+
+    entry->paddr_index = 0;
+    entry->vaddr_base = NULL;
+    entry->size = 0;
+    g_free(entry->valid_mapping);
+    entry->valid_mapping = NULL;
+}
+
+/* Unmap @entry, and free it unless it is the head of its bucket */
+static void xen_drop_entry(MapCacheEntry *entry)
+{
+    MapCacheEntry *pentry;
+
+    pentry = &mapcache->entry[entry->paddr_index % mapcache->nr_buckets];
+    xen_unmap_entry(entry);
+    if (pentry == entry) {
+        return;
+    }
+    while (pentry->next != entry) {
+        pentry = pentry->next;
+    }
+    pentry->next = entry->next;
+    g_free(entry);
+}
+
+/* Make room for @size bytes by unmapping the least recently used entries */
+static void xen_map_cache_evict(target_phys_addr_t size)
+{
+    MapCacheEntry *entry, *next;
+
+    QTAILQ_FOREACH_SAFE(entry, &mapcache->lru, lru, next) {
+        if (mapcache->mapped_size + size <= mapcache->max_mcache_size) {
+            break;
+        }
+        if (entry->lock) {
+            continue;
+        }
+        trace_xen_map_cache_evict(entry->paddr_index);
+        xen_drop_entry(entry);
+        mapcache->evictions++;
+    }
+}
+
 static void xen_remap_bucket(MapCacheEntry *entry,
                              target_phys_addr_t size,
                              target_phys_addr_t address_index)
@@ -157,15 +232,9 @@ static void xen_remap_bucket(MapCacheEntry *entry,
     err = g_malloc0(nb_pfn * sizeof (int));
 
     if (entry->vaddr_base != NULL) {
-        if (munmap(entry->vaddr_base, entry->size) != 0) {
-            perror("unmap fails");
-            exit(-1);
-        }
-    }
-    if (entry->valid_mapping != NULL) {
-        g_free(entry->valid_mapping);
-        entry->valid_mapping = NULL;
+        xen_unmap_entry(entry);
     }
+    xen_map_cache_evict(size);
 
     for (i = 0; i < nb_pfn; i++) {
         pfns[i] = (address_index << (MCACHE_BUCKET_SHIFT-XC_PAGE_SHIFT)) + i;
@@ -190,6 +259,8 @@ static void xen_remap_bucket(MapCacheEntry *entry,
             bitmap_set(entry->valid_mapping, i, 1);
         }
     }
+    QTAILQ_INSERT_TAIL(&mapcache->lru, entry, lru);
+    mapcache->mapped_size += size;
 
     g_free(pfns);
     g_free(err);
@@ -198,7 +269,7 @@ static void xen_remap_bucket(MapCacheEntry *entry,
 uint8_t *xen_map_cache(target_phys_addr_t phys_addr, target_phys_addr_t size,
                        uint8_t lock)
 {
-    MapCacheEntry *entry, *pentry = NULL;
+    MapCacheEntry *entry, *pentry = NULL, *free_entry, *stale_entry;
     target_phys_addr_t address_index;
     target_phys_addr_t address_offset;
     target_phys_addr_t __size = size;
@@ -211,6 +282,7 @@ tryagain:
     trace_xen_map_cache(phys_addr);
 
     if (address_index == mapcache->last_address_index && !lock && !__size) {
+        mapcache->hits++;
         trace_xen_map_cache_return(mapcache->last_address_vaddr + address_offset);
         return mapcache->last_address_vaddr + address_offset;
     }
@@ -225,26 +297,42 @@ tryagain:
         __size = MCACHE_BUCKET_SIZE;
     }
 
-    entry = &mapcache->entry[address_index % mapcache->nr_buckets];
-
-    while (entry && entry->lock && entry->vaddr_base &&
-            (entry->paddr_index != address_index || entry->size != __size ||
-             !test_bits(address_offset >> XC_PAGE_SHIFT, size >> XC_PAGE_SHIFT,
-                 entry->valid_mapping))) {
-        pentry = entry;
-        entry = entry->next;
+    /*
+     * Entries of other addresses stay in the bucket until they are evicted,
+     * so that addresses that share a bucket do not remap each other.  An
+     * unlocked entry with pages that failed to map is mapped again, in case
+     * they have been populated since.
+     */
+    free_entry = stale_entry = NULL;
+    for (entry = &mapcache->entry[address_index % mapcache->nr_buckets];
+         entry; pentry = entry, entry = entry->next) {
+        if (!entry->vaddr_base) {
+            free_entry = free_entry ? free_entry : entry;
+            continue;
+        }
+        if (entry->paddr_index != address_index || entry->size != __size) {
+            continue;
+        }
+        if (test_bits(address_offset >> XC_PAGE_SHIFT, size >> XC_PAGE_SHIFT,
+                      entry->valid_mapping)) {
+            break;
+        }
+        if (!entry->lock && !stale_entry) {
+            stale_entry = entry;
+        }
     }
-    if (!entry) {
-        entry = g_malloc0(sizeof (MapCacheEntry));
-        pentry->next = entry;
-        xen_remap_bucket(entry, __size, address_index);
-    } else if (!entry->lock) {
-        if (!entry->vaddr_base || entry->paddr_index != address_index ||
-                entry->size != __size ||
-                !test_bits(address_offset >> XC_PAGE_SHIFT, size >> XC_PAGE_SHIFT,
-                    entry->valid_mapping)) {
-            xen_remap_bucket(entry, __size, address_index);
+    if (entry) {
+        mapcache->hits++;
+        QTAILQ_REMOVE(&mapcache->lru, entry, lru);
+        QTAILQ_INSERT_TAIL(&mapcache->lru, entry, lru);
+    } else {
+        mapcache->misses++;
+        entry = stale_entry ? stale_entry : free_entry;
+        if (!entry) {
+            entry = g_malloc0(sizeof (MapCacheEntry));
+            pentry->next = entry;
         }
+        xen_remap_bucket(entry, __size, address_index);
     }
 
     if(!test_bits(address_offset >> XC_PAGE_SHIFT, size >> XC_PAGE_SHIFT,
@@ -301,7 +389,9 @@ ram_addr_t xen_ram_addr_from_mapcache(void *ptr)
     }
 
     entry = &mapcache->entry[paddr_index % mapcache->nr_buckets];
-    while (entry && (entry->paddr_index != paddr_index || entry->size != size)) {
+    while (entry && (entry->paddr_index != paddr_index || entry->size != size ||
+                     (uint8_t *)ptr < entry->vaddr_base ||
+                     (uint8_t *)ptr >= entry->vaddr_base + entry->size)) {
         entry = entry->next;
     }
     if (!entry) {
@@ -314,7 +404,7 @@ ram_addr_t xen_ram_addr_from_mapcache(void *ptr)
 
 void xen_invalidate_map_cache_entry(uint8_t *buffer)
 {
-    MapCacheEntry *entry = NULL, *pentry = NULL;
+    MapCacheEntry *entry = NULL;
     MapCacheRev *reventry;
     target_phys_addr_t paddr_index;
     target_phys_addr_t size;
@@ -338,37 +428,48 @@ void xen_invalidate_map_cache_entry(uint8_t *buffer)
     QTAILQ_REMOVE(&mapcache->locked_entries, reventry, next);
     g_free(reventry);
 
-    if (mapcache->last_address_index == paddr_index) {
-        mapcache->last_address_index = -1;
-        mapcache->last_address_vaddr = NULL;
-    }
-
     entry = &mapcache->entry[paddr_index % mapcache->nr_buckets];
-    while (entry && (entry->paddr_index != paddr_index || entry->size != size)) {
-        pentry = entry;
+    while (entry && (entry->paddr_index != paddr_index || entry->size != size ||
+                     buffer < entry->vaddr_base ||
+                     buffer >= entry->vaddr_base + entry->size)) {
         entry = entry->next;
     }
     if (!entry) {
         DPRINTF("Trying to unmap address %p that is not in the mapcache!\n", buffer);
         return;
     }
+    /* once unlocked, the mapping stays cached until it is evicted */
     entry->lock--;
-    if (entry->lock > 0 || pentry == NULL) {
-        return;
-    }
+}
 
-    pentry->next = entry->next;
-    if (munmap(entry->vaddr_base, entry->size) != 0) {
-        perror("unmap fails");
-        exit(-1);
+void xen_invalidate_map_cache_range(target_phys_addr_t start_addr,
+                                    target_phys_addr_t size)
+{
+    MapCacheEntry *entry, *next;
+
+    trace_xen_invalidate_map_cache_range(start_addr, size);
+
+    mapcache_lock();
+
+    QTAILQ_FOREACH_SAFE(entry, &mapcache->lru, lru, next) {
+        target_phys_addr_t base = entry->paddr_index << MCACHE_BUCKET_SHIFT;
+
+        if (base >= start_addr + size || base + entry->size <= start_addr) {
+            continue;
+        }
+        if (entry->lock > 0) {
+            DPRINTF("%s, "TARGET_FMT_plx" is locked\n", __func__, base);
+            continue;
+        }
+        xen_drop_entry(entry);
     }
-    g_free(entry->valid_mapping);
-    g_free(entry);
+
+    mapcache_unlock();
 }
 
 void xen_invalidate_map_cache(void)
 {
-    unsigned long i;
+    MapCacheEntry *entry, *next;
     MapCacheRev *reventry;
 
     /* Flush pending AIO before destroying the mapcache */
@@ -382,26 +483,11 @@ void xen_invalidate_map_cache(void)
 
     mapcache_lock();
 
-    for (i = 0; i < mapcache->nr_buckets; i++) {
-        MapCacheEntry *entry = &mapcache->entry[i];
-
-        if (entry->vaddr_base == NULL) {
-            continue;
-        }
+    QTAILQ_FOREACH_SAFE(entry, &mapcache->lru, lru, next) {
         if (entry->lock > 0) {
             continue;
         }
-
-        if (munmap(entry->vaddr_base, entry->size) != 0) {
-            perror("unmap fails");
-            exit(-1);
-        }
-
-        entry->paddr_index = 0;
-        entry->vaddr_base = NULL;
-        entry->size = 0;
-        g_free(entry->valid_mapping);
-        entry->valid_mapping = NULL;
+        xen_drop_entry(entry);
     }
 
     mapcache->last_address_index = -1;
@@ -409,3 +495,25 @@ void xen_invalidate_map_cache(void)
 
     mapcache_unlock();
 }
+
+XenMapCacheInfo *qmp_query_xen_mapcache(Error **errp)
+{
+    XenMapCacheInfo *info;
+    MapCacheRev *reventry;
+
+    if (!mapcache) {
+        error_set(errp, QERR_UNSUPPORTED);
+        return NULL;
+    }
+
+    info = g_malloc0(sizeof(*info));
+    info->hits = mapcache->hits;
+    info->misses = mapcache->misses;
+    info->evictions = mapcache->evictions;
+    info->size = mapcache->mapped_size;
+    info->max_size = mapcache->max_mcache_size;
+    QTAILQ_FOREACH(reventry, &mapcache->locked_entries, next) {
+        info->locked++;
+    }
+    return info;
+}
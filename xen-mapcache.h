@@ -22,6 +22,8 @@ uint8_t *xen_map_cache(target_phys_addr_t phys_addr, target_phys_addr_t size,
                        uint8_t lock);
 ram_addr_t xen_ram_addr_from_mapcache(void *ptr);
 void xen_invalidate_map_cache_entry(uint8_t *buffer);
+void xen_invalidate_map_cache_range(target_phys_addr_t start_addr,
+                                    target_phys_addr_t size);
 void xen_invalidate_map_cache(void);
 
 #else
@@ -47,6 +49,11 @@ static inline void xen_invalidate_map_cache_entry(uint8_t *buffer)
 {
 }
 
+static inline void xen_invalidate_map_cache_range(target_phys_addr_t start_addr,
+                                                  target_phys_addr_t size)
+{
+}
+
 static inline void xen_invalidate_map_cache(void)
 {
 }